@@ -46,6 +46,52 @@ static unsigned int bsc_count = 0;
 static unsigned int ppmd_count = 0;
 static unsigned int lz4_count = 0;
 
+/*
+ * Component algorithm states are set up by a thread the first time it uses
+ * the algorithm, see adapt_codec(). These count the threads that did.
+ */
+static unsigned int lzma_inits = 0;
+static unsigned int bsc_inits = 0;
+static unsigned int ppmd_inits = 0;
+static unsigned int lz4_inits = 0;
+static pthread_mutex_t codec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Trial compression samples ADAPT_TRIAL_SLICES evenly spaced slices of the
+ * chunk and only kicks in for chunks at least ADAPT_TRIAL_MIN bytes long.
+ */
+#define	ADAPT_TRIAL_SLICES	4
+#define	ADAPT_TRIAL_SLICE	(64 * 1024)
+#define	ADAPT_TRIAL_LEN		(ADAPT_TRIAL_SLICES * ADAPT_TRIAL_SLICE)
+#define	ADAPT_TRIAL_MIN		(ADAPT_TRIAL_LEN * 4)
+#define	ADAPT_TRIAL_MAX		4
+
+/*
+ * The throughput model keeps one entry per primary data type and algorithm.
+ * An entry is trusted once ADAPT_MODEL_MIN bytes were compressed with it.
+ */
+#define	ADAPT_NTYPES		(PC_TYPE_MASK + 1)
+#define	ADAPT_NALGOS		(ADAPT_COMPRESS_LZ4 + 1)
+#define	ADAPT_MODEL_MIN		(4 * 1024 * 1024)
+#define	ADAPT_MODEL_DECAY	0.25
+
+/*
+ * Bytes looked at to guess the algorithm of a chunk of unknown type.
+ */
+#define	ADAPT_HINT_SAMPLE	(16 * 1024)
+
+struct adapt_model {
+	double speed;		/* Bytes per millisecond, moving average. */
+	double ratio;		/* Compressed / original size, moving average. */
+	uint64_t seen;
+};
+
+static struct adapt_model model[ADAPT_NTYPES][ADAPT_NALGOS];
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+static double model_start = 0;
+static uint64_t model_bytes = 0;
+static int model_workers = 0;
+
 extern int lzma_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
 extern int bzip2_compress(void *src, uint64_t srclen, void *dst,
@@ -82,7 +128,6 @@ extern int lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 extern int lz4_deinit(void **data);
 
 extern int ppmd_alloc(void *data);
-extern void ppmd_free(void *data);
 extern int ppmd_state_init(void **data, int *level, int alloc);
 
 extern int lz4_buf_extra(uint64_t buflen);
@@ -93,10 +138,153 @@ struct adapt_data {
 	void *ppmd_data;
 	void *bsc_data;
 	void *lz4_data;
+	int ppmd_used;
+	int use_bsc;
+	int level, nthreads, file_version;
+	uint64_t chunksize;
+	compress_op_t op;
 	int adapt_mode;
+	int trial_rate;
+	int worker;
+	double target;
 	analyzer_ctx_t *actx;
 };
 
+/*
+ * PCOMPRESS_ADAPT_TRIAL=<n> enables trial compression. The value is the
+ * number of KB of compressed output that one second of CPU time is worth.
+ * Zero picks the smallest output regardless of speed.
+ */
+static int
+adapt_trial_rate(void)
+{
+	char *val;
+
+	if ((val = getenv("PCOMPRESS_ADAPT_TRIAL")) == NULL)
+		return (-1);
+	if (atoi(val) < 0)
+		return (-1);
+	return (atoi(val));
+}
+
+/*
+ * PCOMPRESS_ADAPT_TARGET=<MB/s> sets the overall throughput to sustain.
+ * Returned in bytes per millisecond, 0 if unset.
+ */
+static double
+adapt_target(void)
+{
+	char *val;
+
+	if ((val = getenv("PCOMPRESS_ADAPT_TARGET")) == NULL || atoi(val) <= 0)
+		return (0);
+	return ((double)atoi(val) * 1024 * 1024 / 1000);
+}
+
+static void
+adapt_model_join(struct adapt_data *adat, compress_op_t op)
+{
+	adat->target = adapt_target();
+	adat->worker = (op == COMPRESS && adat->target > 0);
+	if (adat->worker) {
+		pthread_mutex_lock(&model_lock);
+		model_workers++;
+		pthread_mutex_unlock(&model_lock);
+	}
+}
+
+static void
+adapt_model_leave(struct adapt_data *adat)
+{
+	if (!adat->worker)
+		return;
+	pthread_mutex_lock(&model_lock);
+	if (--model_workers == 0) {
+		memset(model, 0, sizeof (model));
+		model_start = 0;
+		model_bytes = 0;
+	}
+	pthread_mutex_unlock(&model_lock);
+}
+
+static int
+adapt_model_usable(struct adapt_data *adat, int algo)
+{
+	if (algo == ADAPT_COMPRESS_LZMA)
+		return (adat->adapt_mode == 2);
+	if (algo == ADAPT_COMPRESS_BSC)
+		return (adat->use_bsc);
+	return (algo != ADAPT_COMPRESS_NONE);
+}
+
+/*
+ * Decide whether the preferred algorithm keeps the overall throughput on
+ * target. Every worker gets an equal share of the target. The share is
+ * scaled by how far the observed throughput is off so far, so falling behind
+ * pushes chunks to cheaper algorithms and running ahead lets slower ones
+ * back in. If the preferred algorithm is known to be too slow for this data
+ * type, the best ratio among the fast enough ones is taken, LZ4 if none is.
+ * Algorithms without enough history are given a chance.
+ */
+static int
+adapt_model_pick(struct adapt_data *adat, int type, int algo)
+{
+	struct adapt_model *m;
+	double now, need, f;
+	int a, best;
+
+	now = get_wtime_millis();
+	pthread_mutex_lock(&model_lock);
+	if (model_start == 0)
+		model_start = now;
+	need = adat->target / (model_workers > 0 ? model_workers : 1);
+	if (now - model_start > 1000 && model_bytes > 0) {
+		f = adat->target / (model_bytes / (now - model_start));
+		if (f < 0.5) f = 0.5;
+		if (f > 4) f = 4;
+		need *= f;
+	}
+
+	m = model[type];
+	if (m[algo].seen >= ADAPT_MODEL_MIN && m[algo].speed < need) {
+		best = -1;
+		for (a = 1; a < ADAPT_NALGOS; a++) {
+			if (!adapt_model_usable(adat, a) || m[a].seen < ADAPT_MODEL_MIN ||
+			    m[a].speed < need)
+				continue;
+			if (best < 0 || m[a].ratio < m[best].ratio)
+				best = a;
+		}
+		algo = (best < 0 ? ADAPT_COMPRESS_LZ4 : best);
+	}
+	pthread_mutex_unlock(&model_lock);
+	return (algo);
+}
+
+static void
+adapt_model_update(int type, int algo, uint64_t srclen, uint64_t dstlen, double millis)
+{
+	struct adapt_model *m;
+	double spd, ratio;
+
+	if (millis < 0.01)
+		millis = 0.01;
+	spd = srclen / millis;
+	ratio = (double)dstlen / srclen;
+	pthread_mutex_lock(&model_lock);
+	m = &model[type][algo];
+	if (m->seen == 0) {
+		m->speed = spd;
+		m->ratio = ratio;
+	} else {
+		m->speed += (spd - m->speed) * ADAPT_MODEL_DECAY;
+		m->ratio += (ratio - m->ratio) * ADAPT_MODEL_DECAY;
+	}
+	m->seen += srclen;
+	model_bytes += srclen;
+	pthread_mutex_unlock(&model_lock);
+}
+
 void
 adapt_set_analyzer_ctx(void *data, analyzer_ctx_t *actx)
 {
@@ -115,6 +303,8 @@ adapt_stats(int show)
 			log_msg(LOG_INFO, 0, "	PPMd chunk count: %u", ppmd_count);
 			log_msg(LOG_INFO, 0, "	LZMA chunk count: %u", lzma_count);
 			log_msg(LOG_INFO, 0, "	LZ4 chunk count: %u", lz4_count);
+			log_msg(LOG_INFO, 0, "	Threads that set up LZMA: %u, LIBBSC: %u, "
+			    "PPMd: %u, LZ4: %u", lzma_inits, bsc_inits, ppmd_inits, lz4_inits);
 		} else {
 			log_msg(LOG_INFO, 0, "\n");
 		}
@@ -129,6 +319,7 @@ adapt_stats(int show)
 void
 adapt_props(algo_props_t *data, int level, uint64_t chunksize)
 {
+	algo_props_t sub;
 	int ext1, ext2;
 
 	data->delta2_span = 200;
@@ -141,6 +332,19 @@ adapt_props(algo_props_t *data, int level, uint64_t chunksize)
 #endif
 
 	data->buf_extra = ext1;
+
+	/*
+	 * Any of the component algorithms can be in use at the same time.
+	 */
+	init_algo_props(&sub);
+	ppmd_props(&sub, level, chunksize);
+	data->state_mem = sub.state_mem;
+	lzma_props(&sub, level, chunksize);
+	data->state_mem += sub.state_mem;
+#ifdef ENABLE_PC_LIBBSC
+	libbsc_props(&sub, level, chunksize);
+	data->state_mem += sub.state_mem;
+#endif
 }
 
 int
@@ -148,22 +352,21 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	   int file_version, compress_op_t op)
 {
 	struct adapt_data *adat = (struct adapt_data *)(*data);
-	int rv = 0, lv = 1;
+	int rv = 0;
 
 	if (!adat) {
-		adat = (struct adapt_data *)slab_alloc(NULL, sizeof (struct adapt_data));
+		adat = (struct adapt_data *)slab_calloc(NULL, 1, sizeof (struct adapt_data));
+		if (!adat)
+			return (-1);
 		adat->adapt_mode = 1;
+		adat->trial_rate = adapt_trial_rate();
+		adapt_model_join(adat, op);
 		rv = ppmd_state_init(&(adat->ppmd_data), level, 0);
-
-		/*
-		 * LZ4 is used to tackle some embedded archive headers and/or zero paddings in
-		 * otherwise incompressible data. So we always use it at the lowest and fastest
-		 * compression level.
-		 */
-		if (rv == 0)
-			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
-		adat->lzma_data = NULL;
-		adat->bsc_data = NULL;
+		adat->level = *level;
+		adat->nthreads = nthreads;
+		adat->chunksize = chunksize;
+		adat->file_version = file_version;
+		adat->op = op;
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
@@ -172,6 +375,10 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	lzma_inits = 0;
+	bsc_inits = 0;
+	ppmd_inits = 0;
+	lz4_inits = 0;
 	return (rv);
 }
 
@@ -180,32 +387,24 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	    int file_version, compress_op_t op)
 {
 	struct adapt_data *adat = (struct adapt_data *)(*data);
-	int rv = 0, lv;
+	int rv = 0;
 
 	if (!adat) {
-		adat = (struct adapt_data *)slab_alloc(NULL, sizeof (struct adapt_data));
+		adat = (struct adapt_data *)slab_calloc(NULL, 1, sizeof (struct adapt_data));
+		if (!adat)
+			return (-1);
 		adat->adapt_mode = 2;
-		adat->ppmd_data = NULL;
-		adat->bsc_data = NULL;
-		lv = *level;
-		if (lv > 10) lv = 10;
+		adat->trial_rate = adapt_trial_rate();
+		adapt_model_join(adat, op);
 		rv = ppmd_state_init(&(adat->ppmd_data), level, 0);
-		lv = *level;
-		if (rv == 0)
-			rv = lzma_init(&(adat->lzma_data), &lv, nthreads, chunksize, file_version, op);
-		lv = *level;
 #ifdef ENABLE_PC_LIBBSC
-		if (rv == 0)
-			rv = libbsc_init(&(adat->bsc_data), &lv, nthreads, chunksize, file_version, op);
+		adat->use_bsc = 1;
 #endif
-		/*
-		 * LZ4 is used to tackle some embedded archive headers and/or zero paddings in
-		 * otherwise incompressible data. So we always use it at the lowest and fastest
-		 * compression level.
-		 */
-		lv = 1;
-		if (rv == 0)
-			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
+		adat->level = *level;
+		adat->nthreads = nthreads;
+		adat->chunksize = chunksize;
+		adat->file_version = file_version;
+		adat->op = op;
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
@@ -214,6 +413,10 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	lzma_inits = 0;
+	bsc_inits = 0;
+	ppmd_inits = 0;
+	lz4_inits = 0;
 	return (rv);
 }
 
@@ -224,9 +427,16 @@ adapt_deinit(void **data)
 	int rv = 0;
 
 	if (adat) {
+		adapt_model_leave(adat);
 		rv = ppmd_deinit(&(adat->ppmd_data));
+		pthread_mutex_lock(&codec_lock);
 		if (adat->lzma_data)
 			rv += lzma_deinit(&(adat->lzma_data));
+		pthread_mutex_unlock(&codec_lock);
+#ifdef ENABLE_PC_LIBBSC
+		if (adat->bsc_data)
+			rv += libbsc_deinit(&(adat->bsc_data));
+#endif
 		if (adat->lz4_data)
 			rv += lz4_deinit(&(adat->lz4_data));
 		slab_free(NULL, adat);
@@ -251,14 +461,228 @@ is_bsc_type(int btype)
 	    (mtype & TYPE_BINARY && stype == TYPE_MARKUP));
 }
 
+/*
+ * Guess which component algorithm a chunk will end up with, without the full
+ * analysis done at compression time. Chunks of unknown type are judged from
+ * a sample at their start. The guess only steers which worker thread gets
+ * the chunk, a wrong one costs nothing but some cache warmth.
+ */
+int
+adapt_codec_hint(int adapt_mode, int btype, uchar_t *buf, uint64_t len)
+{
+	int bsc_type = 0;
+
+	if (btype == TYPE_UNKNOWN && buf != NULL && len > 0) {
+		if (len > ADAPT_HINT_SAMPLE)
+			len = ADAPT_HINT_SAMPLE;
+		if (analyze_buffer_entropy(buf, len) >= INCOMPRESSIBLE_ENTROPY)
+			return (ADAPT_COMPRESS_LZ4);
+		btype = analyze_buffer_simple(buf, len);
+	}
+#ifdef ENABLE_PC_LIBBSC
+	bsc_type = (adapt_mode == 2 && is_bsc_type(btype));
+#endif
+	if (is_incompressible(btype) && !bsc_type)
+		return (ADAPT_COMPRESS_LZ4);
+	if (PC_TYPE(btype) & TYPE_BINARY && !bsc_type)
+		return (adapt_mode == 2 ? ADAPT_COMPRESS_LZMA : ADAPT_COMPRESS_BZIP2);
+	if (bsc_type)
+		return (ADAPT_COMPRESS_BSC);
+	return (ADAPT_COMPRESS_PPMD);
+}
+
+/*
+ * Set up the state of a component algorithm the first time this thread uses
+ * it. Most runs only ever need some of them and the LZMA and PPMd states are
+ * large. The PPMd model memory is kept once allocated. Setup is serialized
+ * since the LZMA encoder properties are shared by all threads.
+ */
+static int
+adapt_codec(struct adapt_data *adat, int algo)
+{
+	int rv, lv;
+
+	rv = 0;
+	switch (algo) {
+	    case ADAPT_COMPRESS_LZ4:
+		if (adat->lz4_data)
+			return (0);
+
+		/*
+		 * LZ4 is used to tackle some embedded archive headers and/or zero
+		 * paddings in otherwise incompressible data. So we always use it
+		 * at the lowest and fastest compression level.
+		 */
+		lv = 1;
+		rv = lz4_init(&(adat->lz4_data), &lv, adat->nthreads, adat->chunksize,
+		    adat->file_version, adat->op);
+		if (rv == 0)
+			__sync_fetch_and_add(&lz4_inits, 1);
+		break;
+	    case ADAPT_COMPRESS_LZMA:
+		if (adat->lzma_data)
+			return (0);
+		lv = adat->level;
+		pthread_mutex_lock(&codec_lock);
+		rv = lzma_init(&(adat->lzma_data), &lv, adat->nthreads, adat->chunksize,
+		    adat->file_version, adat->op);
+		if (rv == 0)
+			lzma_inits++;
+		pthread_mutex_unlock(&codec_lock);
+		break;
+#ifdef ENABLE_PC_LIBBSC
+	    case ADAPT_COMPRESS_BSC:
+		if (adat->bsc_data)
+			return (0);
+		lv = adat->level;
+		pthread_mutex_lock(&codec_lock);
+		rv = libbsc_init(&(adat->bsc_data), &lv, adat->nthreads, adat->chunksize,
+		    adat->file_version, adat->op);
+		if (rv == 0)
+			bsc_inits++;
+		else if (adat->bsc_data)
+			libbsc_deinit(&(adat->bsc_data));
+		pthread_mutex_unlock(&codec_lock);
+		break;
+#endif
+	    case ADAPT_COMPRESS_PPMD:
+		rv = ppmd_alloc(adat->ppmd_data);
+		if (rv == 0 && !adat->ppmd_used) {
+			adat->ppmd_used = 1;
+			__sync_fetch_and_add(&ppmd_inits, 1);
+		}
+		break;
+	}
+	return (rv == 0 ? 0 : -1);
+}
+
+/*
+ * Compress with one of the component algorithms. Returns the ADAPT_COMPRESS_*
+ * id on success.
+ */
+static int
+adapt_run(struct adapt_data *adat, int algo, void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype)
+{
+	int rv;
+
+	if (adapt_codec(adat, algo) == -1)
+		return (-1);
+	switch (algo) {
+	    case ADAPT_COMPRESS_LZ4:
+		rv = lz4_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lz4_data);
+		break;
+	    case ADAPT_COMPRESS_LZMA:
+		rv = lzma_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lzma_data);
+		break;
+	    case ADAPT_COMPRESS_BZIP2:
+		rv = bzip2_compress(src, srclen, dst, dstlen, level, chdr, btype, NULL);
+		break;
+#ifdef ENABLE_PC_LIBBSC
+	    case ADAPT_COMPRESS_BSC:
+		rv = libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data);
+		break;
+#endif
+	    case ADAPT_COMPRESS_PPMD:
+		rv = ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
+		break;
+	    default:
+		return (-1);
+	}
+	if (rv < 0)
+		return (rv);
+	return (algo);
+}
+
+/*
+ * Compress a sample built from slices of the chunk with every candidate
+ * algorithm, in parallel, and return the one with the lowest cost. The cost
+ * is the compressed size plus the time taken, converted to bytes by the
+ * user supplied rate. Returns -1 if no trial succeeded.
+ */
+static int
+adapt_trial(struct adapt_data *adat, uchar_t *src, uint64_t srclen, int level,
+	uchar_t chdr, int btype)
+{
+	int cand[ADAPT_TRIAL_MAX];
+	double cost[ADAPT_TRIAL_MAX];
+	uchar_t *smp;
+	uint64_t step;
+	int i, n, best;
+
+	n = 0;
+	cand[n++] = ADAPT_COMPRESS_LZ4;
+	if (adat->adapt_mode == 2)
+		cand[n++] = ADAPT_COMPRESS_LZMA;
+	else
+		cand[n++] = ADAPT_COMPRESS_BZIP2;
+	cand[n++] = ADAPT_COMPRESS_PPMD;
+#ifdef ENABLE_PC_LIBBSC
+	if (adat->use_bsc)
+		cand[n++] = ADAPT_COMPRESS_BSC;
+#endif
+
+	/*
+	 * Set up the candidates here, the trials run in parallel.
+	 */
+	for (i = 0; i < n; i++) {
+		if (adapt_codec(adat, cand[i]) == 0)
+			continue;
+		if (cand[i] == ADAPT_COMPRESS_BSC)
+			adat->use_bsc = 0;
+		cand[i--] = cand[--n];
+	}
+
+	smp = (uchar_t *)slab_alloc(NULL, ADAPT_TRIAL_LEN);
+	if (!smp)
+		return (-1);
+	step = srclen / ADAPT_TRIAL_SLICES;
+	for (i = 0; i < ADAPT_TRIAL_SLICES; i++)
+		memcpy(smp + i * ADAPT_TRIAL_SLICE, src + i * step, ADAPT_TRIAL_SLICE);
+
+#	pragma omp parallel for schedule(dynamic, 1)
+	for (i = 0; i < n; i++) {
+		uchar_t *out;
+		uint64_t olen;
+		double strt;
+
+		cost[i] = -1;
+		olen = ADAPT_TRIAL_LEN + lz4_buf_extra(ADAPT_TRIAL_LEN);
+#ifdef ENABLE_PC_LIBBSC
+		if (libbsc_buf_extra(ADAPT_TRIAL_LEN) > lz4_buf_extra(ADAPT_TRIAL_LEN))
+			olen = ADAPT_TRIAL_LEN + libbsc_buf_extra(ADAPT_TRIAL_LEN);
+#endif
+		out = (uchar_t *)slab_alloc(NULL, olen);
+		if (!out)
+			continue;
+		strt = get_wtime_millis();
+		if (adapt_run(adat, cand[i], smp, ADAPT_TRIAL_LEN, out, &olen, level,
+		    chdr, btype) >= 0 && olen < ADAPT_TRIAL_LEN) {
+			cost[i] = olen + (get_wtime_millis() - strt) * adat->trial_rate * 1024 / 1000;
+		}
+		slab_free(NULL, out);
+	}
+	slab_free(NULL, smp);
+
+	best = -1;
+	for (i = 0; i < n; i++) {
+		if (cost[i] >= 0 && (best < 0 || cost[i] < cost[best]))
+			best = i;
+	}
+	if (best < 0)
+		return (-1);
+	return (cand[best]);
+}
+
 int
 adapt_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
 {
 	struct adapt_data *adat = (struct adapt_data *)(data);
-	int rv = 0, bsc_type = 0;
+	int rv = 0, bsc_type = 0, algo, high_ent = 0;
 	int stype = PC_SUBTYPE(btype);
 	analyzer_ctx_t actx;
+	double strt = 0;
 
 	if (btype == TYPE_UNKNOWN || PC_TYPE(btype) & TYPE_TEXT ||
 	    stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF) {
@@ -266,6 +690,7 @@ adapt_compress(void *src, uint64_t srclen, void *dst,
 			analyze_buffer(src, srclen, &actx);
 			adat->actx = &actx;
 		}
+		high_ent = (adat->actx->entropy >= INCOMPRESSIBLE_ENTROPY);
 		if (adat->adapt_mode == 2) {
 			btype = adat->actx->thirty_pct.btype;
 
@@ -283,55 +708,69 @@ adapt_compress(void *src, uint64_t srclen, void *dst,
 	 * use Bzip2 or LZMA. For totally incompressible data we always use LZ4. There
 	 * is no point trying to compress such data, like Jpegs. However some archive headers
 	 * and zero paddings can exist which LZ4 can easily take care of very fast.
+	 * Data of unknown type is treated the same when its byte entropy is close
+	 * to 8 bits. In trial mode anything that is not plainly incompressible is
+	 * decided by compressing samples instead.
 	 */
 #ifdef ENABLE_PC_LIBBSC
 	bsc_type = is_bsc_type(btype);
 #endif
-	if (is_incompressible(btype) && !bsc_type) {
-		rv = lz4_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lz4_data);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_LZ4;
-		lz4_count++;
+	algo = -1;
+	if ((is_incompressible(btype) || high_ent) && !bsc_type) {
+		algo = ADAPT_COMPRESS_LZ4;
 
-	} else if (adat->adapt_mode == 2 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
-		rv = lzma_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lzma_data);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_LZMA;
-		lzma_count++;
+	} else if (adat->trial_rate >= 0 && srclen >= ADAPT_TRIAL_MIN) {
+		algo = adapt_trial(adat, (uchar_t *)src, srclen, level, chdr, btype);
+	}
 
-	} else if (adat->adapt_mode == 1 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
-		rv = bzip2_compress(src, srclen, dst, dstlen, level, chdr, btype, NULL);
-		if (rv < 0)
-			return (rv);
-		rv = ADAPT_COMPRESS_BZIP2;
-		bzip2_count++;
+	if (algo < 0) {
+		if (adat->adapt_mode == 2 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type)
+			algo = ADAPT_COMPRESS_LZMA;
+		else if (adat->adapt_mode == 1 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type)
+			algo = ADAPT_COMPRESS_BZIP2;
+		else if (adat->use_bsc && bsc_type)
+			algo = ADAPT_COMPRESS_BSC;
+		else
+			algo = ADAPT_COMPRESS_PPMD;
+	}
 
-	} else {
-#ifdef ENABLE_PC_LIBBSC
-		if (adat->bsc_data && bsc_type) {
-			rv = libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_BSC;
-			bsc_count++;
-		} else {
-#endif
-			rv = ppmd_alloc(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
-			ppmd_free(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_PPMD;
-			ppmd_count++;
-#ifdef ENABLE_PC_LIBBSC
-		}
-#endif
+	if (adat->target > 0) {
+		if (algo != ADAPT_COMPRESS_LZ4)
+			algo = adapt_model_pick(adat, PC_TYPE(btype), algo);
+		strt = get_wtime_millis();
 	}
 
+	/*
+	 * Libbsc can refuse large chunks. PPMd takes over then.
+	 */
+	if (algo == ADAPT_COMPRESS_BSC && adapt_codec(adat, algo) == -1) {
+		adat->use_bsc = 0;
+		algo = ADAPT_COMPRESS_PPMD;
+	}
+	rv = adapt_run(adat, algo, src, srclen, dst, dstlen, level, chdr, btype);
+	if (rv < 0)
+		return (rv);
+	if (adat->target > 0 && srclen > 0) {
+		adapt_model_update(PC_TYPE(btype), algo, srclen, *dstlen,
+		    get_wtime_millis() - strt);
+	}
+	switch (algo) {
+	    case ADAPT_COMPRESS_LZ4:
+		lz4_count++;
+		break;
+	    case ADAPT_COMPRESS_LZMA:
+		lzma_count++;
+		break;
+	    case ADAPT_COMPRESS_BZIP2:
+		bzip2_count++;
+		break;
+	    case ADAPT_COMPRESS_BSC:
+		bsc_count++;
+		break;
+	    case ADAPT_COMPRESS_PPMD:
+		ppmd_count++;
+		break;
+	}
 	return (rv);
 }
 
@@ -343,6 +782,8 @@ adapt_decompress(void *src, uint64_t srclen, void *dst,
 	uchar_t cmp_flags;
 
 	cmp_flags = CHDR_ALGO(chdr);
+	if (cmp_flags != ADAPT_COMPRESS_BZIP2 && adapt_codec(adat, cmp_flags) == -1)
+		return (-1);
 
 	if (cmp_flags == ADAPT_COMPRESS_LZ4) {
 		return (lz4_decompress(src, srclen, dst, dstlen, 1, chdr, btype, adat->lz4_data));
@@ -354,13 +795,8 @@ adapt_decompress(void *src, uint64_t srclen, void *dst,
 		return (bzip2_decompress(src, srclen, dst, dstlen, level, chdr, btype, NULL));
 
 	} else if (cmp_flags == ADAPT_COMPRESS_PPMD) {
-		int rv;
-		rv = ppmd_alloc(adat->ppmd_data);
-		if (rv < 0)
-			return (rv);
-		rv = ppmd_decompress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
-		ppmd_free(adat->ppmd_data);
-		return (rv);
+		return (ppmd_decompress(src, srclen, dst, dstlen, level, chdr, btype,
+		    adat->ppmd_data));
 
 	} else if (cmp_flags == ADAPT_COMPRESS_BSC) {
 #ifdef ENABLE_PC_LIBBSC
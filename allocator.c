@@ -24,13 +24,18 @@
 
 /*
  * A basic slab allocator that uses power of 2 and fixed interval
- * slab sizes and uses integer hashing to track pointers. It uses
- * per-slab and per-hash-bucket locking for scalability. This
+ * slab sizes and keeps a small header in front of every buffer to
+ * find its slab on free. It uses per-slab locking for scalability. This
  * allocator is being used in Pcompress as repeated compression of
  * fixed-size chunks causes repeated and predictable memory allocation
  * and freeing patterns. Using pre-allocated buffer pools in this
  * case causes significant speedup.
  *
+ * Each thread keeps a magazine of free buffers for every small power
+ * of 2 slab. Allocations and frees of those sizes go to the magazine
+ * and only take the slab lock to move half a magazine of buffers at a
+ * time, so threads do not serialize on a popular slab.
+ *
  * There is no provision yet to reap buffers from high-usage slabs
  * and return them to the heap.
  */
@@ -46,6 +51,7 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <math.h>
+#include <sys/mman.h>
 #include "utils.h"
 #include "allocator.h"
 
@@ -67,9 +73,16 @@
 #define	SLAB_START_SZ	64 /* Starting slab size in Bytes. */
 #define	SLAB_START_POW2	6 /* 2 ^ SLAB_START_POW2 = SLAB_START. */
 
-#define	HTABLE_SZ	8192
 #define	ONEM		(1UL * 1024UL * 1024UL)
 
+/*
+ * Per-thread magazines cover the slabs of 64 bytes to 32K, holding at most
+ * 512K per slab and thread.
+ */
+#define	MAG_SLABS	10
+#define	MAG_ROUNDS	16
+#define	IS_MAG_SLAB(slab)	((slab) >= slabheads && (slab) < slabheads + MAG_SLABS)
+
 static const unsigned int bv[] = {
 	0xAAAAAAAA,
 	0xCCCCCCCC,
@@ -78,26 +91,92 @@ static const unsigned int bv[] = {
 	0xFFFF0000
 };
 
+/*
+ * The usage counters (inuse and below) are only kept when telemetry is
+ * enabled with PCOMPRESS_ALLOC_STATS, since they are updated on every
+ * allocation and free from all threads.
+ */
 struct slabentry {
-	struct bufentry *avail;
+	void *avail;
 	struct slabentry *next;
 	uint64_t sz;
 	uint64_t allocs, hits;
+	uint64_t inuse, peak, released;
+	uint64_t reqs, req_bytes;
 	pthread_mutex_t slab_lock;
 };
-struct bufentry {
-	void *ptr;
+
+/*
+ * Every buffer is preceded by a header naming its slab, NULL for oversize
+ * buffers, so a free finds the slab from the address alone. The magic tells
+ * buffers in use from free ones and from foreign pointers. Free buffers are
+ * linked through their first word.
+ */
+struct bufhdr {
 	struct slabentry *slab;
-	struct bufentry *next;
+	uint32_t magic;
+	uint32_t huge; // Number of huge pages mapped for the buffer, 0 if from malloc
+};
+#define	BUF_HDR_SZ	sizeof (struct bufhdr)
+#define	BUF_HDR(ptr)	((struct bufhdr *)((char *)(ptr) - BUF_HDR_SZ))
+#define	BUF_NEXT(ptr)	(*(void **)(ptr))
+#define	BUF_INUSE	0x50435355U
+#define	BUF_FREE	0x50434652U
+
+/*
+ * Buffers of at least HUGE_MIN bytes, like chunk buffers and large codec
+ * state, are mapped at huge page alignment and marked for transparent huge
+ * pages. The header then sits at the end of an ordinary page just before the
+ * huge page aligned buffer, so that it does not take up a huge page of its own.
+ * Setting the environment variable PCOMPRESS_HUGEPAGES to 0 disables this.
+ */
+#define	HUGE_PAGE_SZ	(2UL * 1024UL * 1024UL)
+#define	HUGE_MIN	HUGE_PAGE_SZ
+
+struct magazine {
+	int n[MAG_SLABS];
+	void *bufs[MAG_SLABS][MAG_ROUNDS];
+};
+
+/*
+ * Per-thread scratch arena for allocations that live no longer than the chunk
+ * being processed. Buffers are carved from large blocks with a bump pointer
+ * and carry an ordinary header naming the tmp_slab sentinel, so that they are
+ * released with slab_free like any other buffer. Each header records the size
+ * of the buffer before it, which lets freed buffers at the top be popped off
+ * again in LIFO order. Whatever is left is dropped by slab_tmp_reset at the
+ * start of the next chunk.
+ */
+#define	TMP_BLOCK_MIN	(2 * ONEM)
+
+struct tmpblk {
+	struct tmpblk *next;
+	size_t size;
+};
+#define	TMP_BLK_SZ	sizeof (struct tmpblk)
+
+struct tmparena {
+	struct tmpblk *blk;
+	size_t used;	// Bytes used in the current block
+	size_t last;	// Size of the topmost buffer in the current block
+	size_t bsize;	// Size of the next block to allocate
 };
 
 static struct slabentry slabheads[NUM_SLABS];
-static struct bufentry **htable;
-static pthread_mutex_t *hbucket_locks;
-static pthread_mutex_t htable_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 static int inited = 0, bypass = 0;
 
-static uint64_t total_allocs, oversize_allocs, hash_collisions, hash_entries;
+static uint64_t total_allocs, oversize_allocs, live_bufs;
+static uint64_t huge_bufs, huge_pages;
+static uint64_t oversize_live, oversize_peak, dynamic_slabs;
+static int huge_mode, track, stats_interval;
+static size_t pagesize;
+static pthread_key_t mag_key;
+static pthread_once_t mag_once = PTHREAD_ONCE_INIT;
+static __thread struct magazine *thr_mag;
+static pthread_key_t tmp_key;
+static __thread struct tmparena *thr_tmp;
+static struct slabentry tmp_slab;
 
 /*
  * Hash function for 64Bit pointers/numbers that generates
@@ -117,6 +196,259 @@ hash6432shift(uint64_t key)
 	return (uint32_t) key;
 }
 
+/*
+ * Map len bytes at huge page alignment with one ordinary page in front for
+ * the header. Returns NULL if that is not possible and the buffer should come
+ * from malloc.
+ */
+static char *
+huge_map(size_t len)
+{
+#ifdef MADV_HUGEPAGE
+	char *m, *a;
+
+	m = mmap(NULL, pagesize + len + HUGE_PAGE_SZ, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		return (NULL);
+	a = (char *)(((uintptr_t)m + pagesize + HUGE_PAGE_SZ - 1) &
+	    ~(uintptr_t)(HUGE_PAGE_SZ - 1));
+	if (a - pagesize > m)
+		munmap(m, a - pagesize - m);
+	if (m + pagesize + len + HUGE_PAGE_SZ > a + len)
+		munmap(a + len, m + pagesize + len + HUGE_PAGE_SZ - (a + len));
+	(void) madvise(a, len, MADV_HUGEPAGE);
+	return (a);
+#else
+	return (NULL);
+#endif
+}
+
+static void *
+buf_new(struct slabentry *slab, size_t size)
+{
+	struct bufhdr *hdr;
+	size_t len;
+	char *buf;
+
+	if (huge_mode && size >= HUGE_MIN) {
+		len = (size + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1);
+		if ((buf = huge_map(len)) != NULL) {
+			ATOMIC_ADD(huge_bufs, 1);
+			ATOMIC_ADD(huge_pages, len / HUGE_PAGE_SZ);
+			hdr = BUF_HDR(buf);
+			hdr->slab = slab;
+			hdr->huge = len / HUGE_PAGE_SZ;
+			return (buf);
+		}
+	}
+	hdr = (struct bufhdr *)malloc(BUF_HDR_SZ + size);
+	if (hdr == NULL)
+		return (NULL);
+	hdr->slab = slab;
+	hdr->huge = 0;
+	return ((char *)hdr + BUF_HDR_SZ);
+}
+
+static void
+buf_destroy(struct bufhdr *hdr)
+{
+	if (hdr->huge)
+		munmap((char *)hdr + BUF_HDR_SZ - pagesize,
+		    pagesize + (size_t)hdr->huge * HUGE_PAGE_SZ);
+	else
+		free(hdr);
+}
+
+/*
+ * Move buffers of slab si from a magazine back to the slab, leaving keep of them.
+ */
+static void
+mag_drain(struct magazine *m, int si, int keep)
+{
+	struct slabentry *slab = &slabheads[si];
+	void *buf;
+
+	pthread_mutex_lock(&(slab->slab_lock));
+	while (m->n[si] > keep) {
+		buf = m->bufs[si][--m->n[si]];
+		BUF_NEXT(buf) = slab->avail;
+		slab->avail = buf;
+	}
+	pthread_mutex_unlock(&(slab->slab_lock));
+}
+
+/*
+ * Return the buffers of an exiting thread's magazine to the slabs.
+ */
+static void
+mag_destroy(void *dat)
+{
+	struct magazine *m = (struct magazine *)dat;
+	int i;
+
+	for (i = 0; i < MAG_SLABS; i++) {
+		if (m->n[i] > 0)
+			mag_drain(m, i, 0);
+	}
+	free(m);
+}
+
+static void
+tmp_free_blocks(struct tmparena *ta)
+{
+	struct tmpblk *b;
+
+	while ((b = ta->blk) != NULL) {
+		ta->blk = b->next;
+		buf_destroy(BUF_HDR(b));
+	}
+	ta->used = 0;
+	ta->last = 0;
+}
+
+static void
+tmp_destroy(void *dat)
+{
+	struct tmparena *ta = (struct tmparena *)dat;
+
+	tmp_free_blocks(ta);
+	free(ta);
+}
+
+static void
+mag_key_init(void)
+{
+	pthread_key_create(&mag_key, mag_destroy);
+	pthread_key_create(&tmp_key, tmp_destroy);
+}
+
+static struct magazine *
+mag_self(void)
+{
+	struct magazine *m;
+
+	if (thr_mag != NULL)
+		return (thr_mag);
+	m = (struct magazine *)calloc(1, sizeof (struct magazine));
+	if (m == NULL)
+		return (NULL);
+	if (pthread_setspecific(mag_key, m) != 0) {
+		free(m);
+		return (NULL);
+	}
+	thr_mag = m;
+	return (m);
+}
+
+/*
+ * Take a free buffer of slab si from the thread's magazine, refilling it with
+ * up to half a magazine from the slab when empty.
+ */
+static void *
+mag_get(int si)
+{
+	struct slabentry *slab = &slabheads[si];
+	struct magazine *m;
+
+	if ((m = mag_self()) == NULL)
+		return (NULL);
+	if (m->n[si] == 0) {
+		pthread_mutex_lock(&(slab->slab_lock));
+		while (m->n[si] < MAG_ROUNDS / 2 && slab->avail) {
+			m->bufs[si][m->n[si]++] = slab->avail;
+			slab->avail = BUF_NEXT(slab->avail);
+			slab->hits++;
+		}
+		pthread_mutex_unlock(&(slab->slab_lock));
+		if (m->n[si] == 0)
+			return (NULL);
+	}
+	return (m->bufs[si][--m->n[si]]);
+}
+
+/*
+ * Put a freed buffer of slab si in the thread's magazine, moving half of a full
+ * magazine back to the slab first. Returns 0 if there is no magazine.
+ */
+static int
+mag_put(int si, void *buf)
+{
+	struct magazine *m;
+
+	if ((m = mag_self()) == NULL)
+		return (0);
+	if (m->n[si] == MAG_ROUNDS)
+		mag_drain(m, si, MAG_ROUNDS / 2);
+	m->bufs[si][m->n[si]++] = buf;
+	return (1);
+}
+
+/*
+ * Pop freed buffers off the top of the thread's current arena block.
+ */
+static void
+tmp_pop(struct tmparena *ta)
+{
+	struct bufhdr *top;
+	char *base;
+
+	if (ta == NULL || ta->blk == NULL)
+		return;
+	base = (char *)ta->blk + TMP_BLK_SZ;
+	while (ta->used > 0) {
+		top = (struct bufhdr *)(base + ta->used - ta->last);
+		if (top->magic != BUF_FREE)
+			break;
+		ta->used -= ta->last;
+		ta->last = top->huge;
+	}
+}
+
+static void *
+stats_thread(void *dat)
+{
+	for (;;) {
+		sleep(stats_interval);
+		if (stats_interval == 0)
+			break;
+		slab_dump_stats();
+	}
+	return (NULL);
+}
+
+/*
+ * Usage accounting for telemetry. The peak updates can race and undercount
+ * slightly, which is good enough here.
+ */
+static void
+track_alloc(struct slabentry *slab, size_t size)
+{
+	if (slab == NULL) {
+		ATOMIC_ADD(oversize_live, 1);
+		if (oversize_live > oversize_peak)
+			oversize_peak = oversize_live;
+		return;
+	}
+	ATOMIC_ADD(slab->inuse, 1);
+	ATOMIC_ADD(slab->reqs, 1);
+	ATOMIC_ADD(slab->req_bytes, size);
+	if (slab->inuse > slab->peak)
+		slab->peak = slab->inuse;
+}
+
+static void
+track_free(struct slabentry *slab, int do_free)
+{
+	if (slab == NULL) {
+		ATOMIC_SUB(oversize_live, 1);
+		return;
+	}
+	ATOMIC_SUB(slab->inuse, 1);
+	if (do_free)
+		ATOMIC_ADD(slab->released, 1);
+}
+
 void
 slab_init()
 {
@@ -128,6 +460,16 @@ slab_init()
 		bypass = 1;
 		return;
 	}
+	pthread_once(&mag_once, mag_key_init);
+	pagesize = sysconf(_SC_PAGE_SIZE);
+	huge_mode = 1;
+	if (getenv("PCOMPRESS_HUGEPAGES") != NULL)
+		huge_mode = atoi(getenv("PCOMPRESS_HUGEPAGES"));
+	track = 0;
+	if (getenv("PCOMPRESS_ALLOC_STATS") != NULL) {
+		track = 1;
+		stats_interval = atoi(getenv("PCOMPRESS_ALLOC_STATS"));
+	}
 
 	/* Initialize first NUM_POW2 power of 2 slots. */
 	slab_sz = SLAB_START_SZ;
@@ -137,7 +479,7 @@ slab_init()
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
 		/* Speed up: Copy from already inited but not yet used lock object. */
-		slabheads[i].slab_lock = htable_lock;
+		slabheads[i].slab_lock = init_lock;
 		slab_sz *= 2;
 	}
 
@@ -150,7 +492,7 @@ slab_init()
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
 		/* Speed up: Copy from already inited but not yet used lock object. */
-		slabheads[i].slab_lock = htable_lock;
+		slabheads[i].slab_lock = init_lock;
 		slab_sz += ONEM;
 	}
 
@@ -162,28 +504,48 @@ slab_init()
 		slabheads[i].hits = 0;
 		/* Do not init locks here. They will be inited on demand. */
 	}
-	htable = (struct bufentry **)calloc(HTABLE_SZ, sizeof (struct bufentry *));
-	hbucket_locks = (pthread_mutex_t *)malloc(HTABLE_SZ * sizeof (pthread_mutex_t));
-
-	for (i=0; i<HTABLE_SZ; i++)
-		hbucket_locks[i] = htable_lock;
 
 	total_allocs = 0;
 	oversize_allocs = 0;
-	hash_collisions = 0;
-	hash_entries = 0;
+	live_bufs = 0;
+	huge_bufs = 0;
+	huge_pages = 0;
+	oversize_live = 0;
+	oversize_peak = 0;
+	dynamic_slabs = 0;
 	inited = 1;
+
+	if (stats_interval > 0) {
+		pthread_t thr;
+
+		if (pthread_create(&thr, NULL, stats_thread, NULL) == 0)
+			pthread_detach(thr);
+	}
 }
 
 void
 slab_cleanup(int quiet)
 {
 	int i;
-	struct bufentry *buf, *buf1;
-	uint64_t nonfreed_oversize;
+	void *buf, *buf1;
 
 	if (!inited) return;
 	if (bypass) return;
+	stats_interval = 0;
+	if (track)
+		slab_dump_stats();
+
+	/*
+	 * Worker threads have exited and returned their magazines by now.
+	 */
+	if (thr_mag) {
+		for (i = 0; i < MAG_SLABS; i++) {
+			if (thr_mag->n[i] > 0)
+				mag_drain(thr_mag, i, 0);
+		}
+	}
+	if (thr_tmp)
+		tmp_free_blocks(thr_tmp);
 
 	if (!quiet) {
 		log_msg(LOG_INFO, 0, "Slab Allocation Stats\n");
@@ -206,9 +568,8 @@ slab_cleanup(int quiet)
 				slab->allocs = 0;
 				buf = slab->avail;
 				do {
-					buf1 = buf->next;
-					free(buf->ptr);
-					free(buf);
+					buf1 = BUF_NEXT(buf);
+					buf_destroy(BUF_HDR(buf));
 					buf = buf1;
 				} while (buf);
 			}
@@ -216,52 +577,18 @@ slab_cleanup(int quiet)
 		}
 	}
 
+	/*
+	 * Buffers still in use are not tracked, so leaked ones are only counted.
+	 */
 	if (!quiet) {
 		log_msg(LOG_INFO, 0, "==================================================================\n");
 		log_msg(LOG_INFO, 0, "Oversize Allocations  : %" PRIu64 "\n", oversize_allocs);
 		log_msg(LOG_INFO, 0, "Total Requests        : %" PRIu64 "\n", total_allocs);
-		log_msg(LOG_INFO, 0, "Hash collisions       : %" PRIu64 "\n", hash_collisions);
-		log_msg(LOG_INFO, 0, "Leaked allocations    : %" PRIu64 "\n", hash_entries);
+		log_msg(LOG_INFO, 0, "Leaked allocations    : %" PRIu64 "\n", live_bufs);
+		log_msg(LOG_INFO, 0, "Huge page buffers     : %" PRIu64 " (%" PRIu64 " 2M pages)\n",
+		    huge_bufs, huge_pages);
 	}
 
-	if (hash_entries > 0) {
-		nonfreed_oversize = 0;
-		for (i=0; i<HTABLE_SZ; i++) {
-			buf = htable[i];
-
-			while (buf) {
-				if (buf->slab == NULL) {
-					nonfreed_oversize++;
-				} else {
-					buf->slab->allocs++;
-				}
-				buf1 = buf->next;
-				free(buf->ptr);
-				free(buf);
-				buf = buf1;
-			}
-		}
-		free(htable);
-		free(hbucket_locks);
-
-		if (!quiet) {
-			log_msg(LOG_INFO, 0, "==================================================================\n");
-			log_msg(LOG_INFO, 0, " Slab Size           | Allocations: leaked |\n");
-			log_msg(LOG_INFO, 0, "==================================================================\n");
-			for (i=0; i<NUM_SLABS; i++)
-			{
-				struct slabentry *slab;
-
-				slab = &slabheads[i];
-				do {
-					if (slab->allocs > 0)
-						log_msg(LOG_INFO, 0, "%21" PRIu64 " %21" PRIu64 "\n", \
-						    slab->sz, slab->allocs);
-					slab = slab->next;
-				} while (slab);
-			}
-		}
-	}
 	for (i=0; i<NUM_SLABS; i++)
 	{
 		struct slabentry *slab, *pslab;
@@ -279,6 +606,93 @@ slab_cleanup(int quiet)
 	if (!quiet) log_msg(LOG_INFO, 0, "\n\n");
 }
 
+/*
+ * Start a new chunk on the calling thread. The first call sets up the thread's
+ * arena. Later calls rewind it, and if the last chunk overflowed into more
+ * blocks these are replaced by a single block large enough for all of them.
+ */
+void
+slab_tmp_reset(void)
+{
+	struct tmparena *ta;
+	struct tmpblk *b;
+	size_t total;
+
+	if (bypass || !inited) return;
+	ta = thr_tmp;
+	if (ta == NULL) {
+		ta = (struct tmparena *)calloc(1, sizeof (struct tmparena));
+		if (ta == NULL)
+			return;
+		if (pthread_setspecific(tmp_key, ta) != 0) {
+			free(ta);
+			return;
+		}
+		ta->bsize = TMP_BLOCK_MIN;
+		thr_tmp = ta;
+		return;
+	}
+	if (ta->blk != NULL && ta->blk->next != NULL) {
+		total = 0;
+		for (b = ta->blk; b != NULL; b = b->next)
+			total += b->size;
+		tmp_free_blocks(ta);
+		ta->bsize = total;
+	}
+	ta->used = 0;
+	ta->last = 0;
+}
+
+/*
+ * Allocate a buffer that is released no later than the end of the current
+ * chunk. Threads without an arena get an ordinary slab buffer.
+ */
+void *
+slab_tmp_alloc(void *p, size_t size)
+{
+	struct tmparena *ta;
+	struct tmpblk *b;
+	struct bufhdr *hdr;
+	size_t need, bsz;
+
+	ta = thr_tmp;
+	need = (BUF_HDR_SZ + size + 15) & ~(size_t)15;
+	if (bypass || ta == NULL || need > UINT32_MAX)
+		return (slab_alloc(p, size));
+
+	if (ta->blk == NULL || ta->used + need > ta->blk->size) {
+		bsz = ta->bsize;
+		if (bsz < need)
+			bsz = need;
+		b = (struct tmpblk *)buf_new(NULL, TMP_BLK_SZ + bsz);
+		if (b == NULL)
+			return (slab_alloc(p, size));
+		b->next = ta->blk;
+		b->size = bsz;
+		ta->blk = b;
+		ta->used = 0;
+		ta->last = 0;
+	}
+	hdr = (struct bufhdr *)((char *)ta->blk + TMP_BLK_SZ + ta->used);
+	hdr->slab = &tmp_slab;
+	hdr->magic = BUF_INUSE;
+	hdr->huge = ta->last;
+	ta->used += need;
+	ta->last = need;
+	return ((char *)hdr + BUF_HDR_SZ);
+}
+
+void *
+slab_tmp_calloc(void *p, size_t items, size_t size)
+{
+	void *ptr;
+
+	ptr = slab_tmp_alloc(p, items * size);
+	if (ptr)
+		memset(ptr, 0, items * size);
+	return (ptr);
+}
+
 void *
 slab_calloc(void *p, size_t items, size_t size) {
 	void *ptr;
@@ -359,7 +773,7 @@ slab_cache_add(uint64_t size)
 		slabheads[sindx].sz = size;
 		pthread_mutex_unlock(&(slabheads[sindx].slab_lock));
 	} else {
-		slab = (struct slabentry *)malloc(sizeof (struct slabentry));
+		slab = (struct slabentry *)calloc(1, sizeof (struct slabentry));
 		if (!slab) return (0);
 		slab->avail = NULL;
 		slab->sz = size;
@@ -372,14 +786,141 @@ slab_cache_add(uint64_t size)
 		slabheads[sindx].next = slab;
 		pthread_mutex_unlock(&(slabheads[sindx].slab_lock));
 	}
+	ATOMIC_ADD(dynamic_slabs, 1);
 	return (1);
 }
 
+static void
+slab_stat(struct slabentry *slab, slab_stats_t *st)
+{
+	void *buf;
+	uint64_t idle;
+
+	pthread_mutex_lock(&(slab->slab_lock));
+	st->size = slab->sz;
+	st->allocs = slab->allocs;
+	st->hits = slab->hits;
+	st->inuse = slab->inuse;
+	st->peak = slab->peak;
+	st->reqs = slab->reqs;
+	st->req_bytes = slab->req_bytes;
+	if (track) {
+		idle = slab->allocs - slab->released - slab->inuse;
+	} else {
+		idle = 0;
+		for (buf = slab->avail; buf != NULL; buf = BUF_NEXT(buf))
+			idle++;
+	}
+	st->idle = idle;
+	pthread_mutex_unlock(&(slab->slab_lock));
+	st->dynamic = (slab >= slabheads + SLAB_POS_HASH || slab < slabheads);
+}
+
+/*
+ * Fill in up to nst entries of st with the size classes that have been used.
+ * Returns the number of such size classes, which can exceed nst. The usage
+ * fields are zero unless telemetry is enabled with PCOMPRESS_ALLOC_STATS.
+ */
+int
+slab_get_stats(slab_stats_t *st, int nst)
+{
+	struct slabentry *slab;
+	slab_stats_t tmp;
+	int i, n;
+
+	if (!inited || bypass) return (0);
+	n = 0;
+	for (i = 0; i < NUM_SLABS; i++) {
+		slab = &slabheads[i];
+		if (slab->sz == 0)
+			continue;
+		while (slab) {
+			if (slab->allocs > 0) {
+				slab_stat(slab, n < nst ? &st[n] : &tmp);
+				n++;
+			}
+			slab = slab->next;
+		}
+	}
+	return (n);
+}
+
+void
+slab_get_totals(slab_totals_t *tot)
+{
+	memset(tot, 0, sizeof (slab_totals_t));
+	if (!inited || bypass) return;
+	tot->requests = total_allocs;
+	tot->oversize_allocs = oversize_allocs;
+	tot->oversize_live = oversize_live;
+	tot->oversize_peak = oversize_peak;
+	tot->dynamic_slabs = dynamic_slabs;
+	tot->huge_bufs = huge_bufs;
+	tot->huge_pages = huge_pages;
+}
+
+/*
+ * Log a table of the used size classes with the bytes held in and out of use,
+ * the share of requests served without a new heap allocation and the share of
+ * handed out bytes lost to rounding requests up to the class size.
+ */
+void
+slab_dump_stats(void)
+{
+	slab_stats_t *st;
+	slab_totals_t tot;
+	uint64_t inuse_b, idle_b, peak_b;
+	double hit, waste;
+	int i, n;
+
+	n = slab_get_stats(NULL, 0);
+	if (n == 0) return;
+	st = (slab_stats_t *)malloc(n * sizeof (slab_stats_t));
+	if (st == NULL) return;
+	n = slab_get_stats(st, n);
+	slab_get_totals(&tot);
+
+	log_msg(LOG_INFO, 0, "Allocator Telemetry\n");
+	log_msg(LOG_INFO, 0, "=================================================================================\n");
+	log_msg(LOG_INFO, 0, "   Slab Size   Allocs     Hit %%   In use   Peak    Idle     In use MB  Idle MB  Waste %%\n");
+	log_msg(LOG_INFO, 0, "=================================================================================\n");
+	inuse_b = 0;
+	idle_b = 0;
+	peak_b = 0;
+	for (i = 0; i < n; i++) {
+		hit = 0;
+		waste = 0;
+		if (st[i].reqs > 0) {
+			hit = st[i].allocs < st[i].reqs ?
+			    100.0 * (st[i].reqs - st[i].allocs) / st[i].reqs : 0;
+			waste = 100.0 - 100.0 * st[i].req_bytes / ((double)st[i].reqs * st[i].size);
+		}
+		log_msg(LOG_INFO, 0, "%12" PRIu64 "%c %8" PRIu64 " %7.2f %8" PRIu64 " %6" PRIu64
+		    " %7" PRIu64 " %10.2f %8.2f %7.2f\n", st[i].size, st[i].dynamic ? 'D' : ' ',
+		    st[i].allocs, hit, st[i].inuse, st[i].peak, st[i].idle,
+		    (double)(st[i].inuse * st[i].size) / ONEM,
+		    (double)(st[i].idle * st[i].size) / ONEM, waste);
+		inuse_b += st[i].inuse * st[i].size;
+		idle_b += st[i].idle * st[i].size;
+		peak_b += st[i].peak * st[i].size;
+	}
+	log_msg(LOG_INFO, 0, "=================================================================================\n");
+	log_msg(LOG_INFO, 0, "Requests              : %" PRIu64 "\n", tot.requests);
+	log_msg(LOG_INFO, 0, "Oversize allocations  : %" PRIu64 " (%" PRIu64 " live, %" PRIu64 " peak)\n",
+	    tot.oversize_allocs, tot.oversize_live, tot.oversize_peak);
+	log_msg(LOG_INFO, 0, "Dynamic slabs         : %" PRIu64 "\n", tot.dynamic_slabs);
+	log_msg(LOG_INFO, 0, "Slab memory in use    : %.2f MB (sum of class peaks %.2f MB)\n",
+	    (double)inuse_b / ONEM, (double)peak_b / ONEM);
+	log_msg(LOG_INFO, 0, "Slab memory idle      : %.2f MB\n\n", (double)idle_b / ONEM);
+	free(st);
+}
+
 void *
 slab_alloc(void *p, size_t size)
 {
 	uint64_t div;
 	struct slabentry *slab;
+	void *buf;
 
 	if (bypass) return (malloc(size));
 	ATOMIC_ADD(total_allocs, 1);
@@ -401,97 +942,68 @@ slab_alloc(void *p, size_t size)
 	}
 
 	if (!slab) {
-		struct bufentry *buf = (struct bufentry *)malloc(sizeof (struct bufentry));
-		uint32_t hindx;
-
-		buf->ptr = malloc(size);
-		buf->slab = NULL;
-		hindx = hash6432shift((unsigned long)(buf->ptr)) & (HTABLE_SZ - 1);
-
-		pthread_mutex_lock(&hbucket_locks[hindx]);
-		buf->next = htable[hindx];
-		htable[hindx] = buf;
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
+		if ((buf = buf_new(NULL, size)) == NULL)
+			return (NULL);
 		ATOMIC_ADD(oversize_allocs, 1);
-		ATOMIC_ADD(hash_entries, 1);
-		return (buf->ptr);
 	} else {
-		struct bufentry *buf;
-		uint32_t hindx;
-
-		pthread_mutex_lock(&(slab->slab_lock));
-		if (slab->avail == NULL) {
-			slab->allocs++;
-			pthread_mutex_unlock(&(slab->slab_lock));
-			buf = (struct bufentry *)malloc(sizeof (struct bufentry));
-			buf->ptr = malloc(slab->sz);
-			buf->slab = slab;
-		} else {
-			buf = slab->avail;
-			slab->avail = buf->next;
-			slab->hits++;
-			pthread_mutex_unlock(&(slab->slab_lock));
+		buf = NULL;
+		if (IS_MAG_SLAB(slab))
+			buf = mag_get(slab - slabheads);
+		if (buf == NULL) {
+			pthread_mutex_lock(&(slab->slab_lock));
+			if (slab->avail == NULL) {
+				slab->allocs++;
+				pthread_mutex_unlock(&(slab->slab_lock));
+				if ((buf = buf_new(slab, slab->sz)) == NULL)
+					return (NULL);
+			} else {
+				buf = slab->avail;
+				slab->avail = BUF_NEXT(buf);
+				slab->hits++;
+				pthread_mutex_unlock(&(slab->slab_lock));
+			}
 		}
-
-		hindx = hash6432shift((unsigned long)(buf->ptr)) & (HTABLE_SZ - 1);
-		if (htable[hindx]) ATOMIC_ADD(hash_collisions, 1);
-		pthread_mutex_lock(&hbucket_locks[hindx]);
-		buf->next = htable[hindx];
-		htable[hindx] = buf;
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
-		ATOMIC_ADD(hash_entries, 1);
-		return (buf->ptr);
 	}
+	BUF_HDR(buf)->magic = BUF_INUSE;
+	ATOMIC_ADD(live_bufs, 1);
+	if (track)
+		track_alloc(slab, size);
+	return (buf);
 }
 
 static void
 slab_free_real(void *p, void *address, int do_free)
 {
-	struct bufentry *buf, *pbuf;
-	int found = 0;
-	uint32_t hindx;
+	struct bufhdr *hdr;
+	struct slabentry *slab;
 
 	if (!address) return;
 	if (bypass) { free(address); return; }
-	hindx = hash6432shift((uint64_t)(address)) & (HTABLE_SZ - 1);
-
-	pthread_mutex_lock(&hbucket_locks[hindx]);
-	buf = htable[hindx];
-	pbuf = NULL;
-	while (buf) {
-		if (buf->ptr == address) {
-			if (hash_entries <=0) {
-				log_msg(LOG_ERR, 0, "Inconsistent allocation hash\n");
-				abort();
-			}
-			if (pbuf)
-				pbuf->next = buf->next;
-			else
-				htable[hindx] = buf->next;
-			pthread_mutex_unlock(&hbucket_locks[hindx]);
-			found = 1;
-			ATOMIC_SUB(hash_entries, 1);
-
-			if (buf->slab == NULL || do_free) {
-				free(buf->ptr);
-				free(buf);
-			} else {
-				pthread_mutex_lock(&(buf->slab->slab_lock));
-				buf->next = buf->slab->avail;
-				buf->slab->avail = buf;
-				pthread_mutex_unlock(&(buf->slab->slab_lock));
-			}
-			break;
-		}
-		pbuf = buf;
-		buf = buf->next;
-	}
-	if (!found) {
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
+
+	hdr = BUF_HDR(address);
+	if (hdr->magic != BUF_INUSE) {
 		log_msg(LOG_ERR, 0, "Freed buf(%p) not in slab allocations!\n", address);
-		free(address);
 		abort();
-		fflush(stderr);
+	}
+	hdr->magic = BUF_FREE;
+	slab = hdr->slab;
+	if (slab == &tmp_slab) {
+		tmp_pop(thr_tmp);
+		return;
+	}
+	ATOMIC_SUB(live_bufs, 1);
+	if (track)
+		track_free(slab, do_free);
+
+	if (slab == NULL || do_free) {
+		buf_destroy(hdr);
+	} else if (IS_MAG_SLAB(slab) && mag_put(slab - slabheads, address)) {
+		/* Kept in the thread's magazine. */
+	} else {
+		pthread_mutex_lock(&(slab->slab_lock));
+		BUF_NEXT(address) = slab->avail;
+		slab->avail = address;
+		pthread_mutex_unlock(&(slab->slab_lock));
 	}
 }
 
@@ -526,6 +1038,21 @@ void
 	return (calloc(items, size));
 }
 
+void
+slab_tmp_reset(void) {}
+
+void
+*slab_tmp_alloc(void *p, size_t size)
+{
+	return (malloc(size));
+}
+
+void
+*slab_tmp_calloc(void *p, size_t items, size_t size)
+{
+	return (calloc(items, size));
+}
+
 void
 slab_free(void *p, void *address)
 {
@@ -544,4 +1071,19 @@ slab_cache_add(uint64_t size)
 	return (0);
 }
 
+int
+slab_get_stats(slab_stats_t *st, int nst)
+{
+	return (0);
+}
+
+void
+slab_get_totals(slab_totals_t *tot)
+{
+	memset(tot, 0, sizeof (slab_totals_t));
+}
+
+void
+slab_dump_stats(void) {}
+
 #endif
@@ -29,13 +29,45 @@
 #include <sys/types.h>
 #include <inttypes.h>
 
+/*
+ * Telemetry of one slab size class. Usage fields are only kept when the
+ * PCOMPRESS_ALLOC_STATS environment variable is set.
+ */
+typedef struct {
+	uint64_t size;		/* Buffer size of the class. */
+	uint64_t allocs;	/* Buffers allocated from the heap. */
+	uint64_t hits;		/* Buffers taken from the free list. */
+	uint64_t inuse;		/* Buffers handed out now. */
+	uint64_t peak;		/* Highest inuse seen. */
+	uint64_t idle;		/* Buffers held but not in use. */
+	uint64_t reqs;		/* Requests served from the class. */
+	uint64_t req_bytes;	/* Bytes asked for by those requests. */
+	int dynamic;		/* Class added by slab_cache_add. */
+} slab_stats_t;
+
+typedef struct {
+	uint64_t requests;
+	uint64_t oversize_allocs;
+	uint64_t oversize_live;
+	uint64_t oversize_peak;
+	uint64_t dynamic_slabs;
+	uint64_t huge_bufs;
+	uint64_t huge_pages;
+} slab_totals_t;
+
 void slab_init();
 void slab_cleanup(int quiet);
 void *slab_alloc(void *p, size_t size);
 void *slab_calloc(void *p, size_t items, size_t size);
+void slab_tmp_reset(void);
+void *slab_tmp_alloc(void *p, size_t size);
+void *slab_tmp_calloc(void *p, size_t items, size_t size);
 void slab_free(void *p, void *address);
 void slab_release(void *p, void *address);
 int slab_cache_add(uint64_t size);
+int slab_get_stats(slab_stats_t *st, int nst);
+void slab_get_totals(slab_totals_t *tot);
+void slab_dump_stats(void);
 
 #endif
 
@@ -41,6 +41,20 @@ extern "C" {
 
 typedef unsigned char uchar_t;
 #define DISPACK_MAGIC	"DisPack "
+#define DISPACK_MAGIC_SECT	"DisPackS"
+
+/*
+ * Code sections smaller than this are left alone, the table entry costs
+ * more than Dispack can save on them.
+ */
+#define DISPACK_MIN_SECTION	4096
+#define DISPACK_MAX_SECTIONS	64
+
+#define ELF_EM_386		3
+#define ELF_SHT_PROGBITS	1
+#define ELF_SHF_EXECINSTR	4
+#define ELF32_EHDR_SIZE		52
+#define ELF32_SHDR_SIZE		40
 
 #pragma pack(1)
 struct FileHeader
@@ -52,87 +66,251 @@ struct FileHeader
 	sU32 SizeOriginal;    // size of untransformed code section
 	sU32 Origin;          // virtual address of first byte
 };
-#pragma pack()
 
-size_t
-dispack_filter_encode(uchar_t *inData, size_t len, uchar_t **out_buf)
+/*
+ * Header used when more than one code section is transformed. It is followed
+ * by one SectEntry per section in file order, the transformed sections and
+ * then all the bytes outside the sections in file order.
+ */
+struct SectHeader
 {
-	uchar_t *pos;
-	FileHeader hdr;
-	sU32 sizeNow;
+	char magic[8];
+	sU32 NumSections;
+	sU32 SizeFile;        // size of the original file
+};
 
-	*out_buf = (uchar_t *)malloc(len);
-	if (*out_buf == NULL)
-		return (0);
+struct SectEntry
+{
+	sU32 Offset;          // file offset of the section
+	sU32 SizeOriginal;
+	sU32 SizeTransformed;
+	sU32 Origin;          // virtual address of first byte
+};
+#pragma pack()
+
+struct code_section {
+	sU32 offset, size, origin;
+	sU8 *out;
+	sU32 out_size;
+};
 
-	// assume the input file is a PE executable.
+static int
+add_section(struct code_section *sec, int n, size_t len, sU32 offset, sU32 size,
+    sU32 origin)
+{
+	if (n >= DISPACK_MAX_SECTIONS || offset == 0 || offset >= len)
+		return (n);
+	if (size > len - offset)
+		size = len - offset;
+	if (size < DISPACK_MIN_SECTION)
+		return (n);
+	sec[n].offset = offset;
+	sec[n].size = size;
+	sec[n].origin = origin;
+	sec[n].out = NULL;
+	sec[n].out_size = 0;
+	return (n + 1);
+}
+
+/*
+ * Sections flagged as code or executable in a 32-bit x86 PE file.
+ */
+static int
+pe_code_sections(uchar_t *inData, size_t len, struct code_section *sec)
+{
 	IMAGE_DOS_HEADER *doshdr = (IMAGE_DOS_HEADER *) inData;
-	IMAGE_NT_HEADERS *nthdr = (IMAGE_NT_HEADERS *) (inData + doshdr->e_lfanew);
+	IMAGE_NT_HEADERS *nthdr;
+	IMAGE_SECTION_HEADER *shdr;
+	sU32 imageBase;
+	int i, n;
 
+	if (len < sizeof (IMAGE_DOS_HEADER) || doshdr->e_lfanew <= 0 ||
+	    (size_t)doshdr->e_lfanew + sizeof (IMAGE_NT_HEADERS) > len)
+		return (0);
+	nthdr = (IMAGE_NT_HEADERS *) (inData + doshdr->e_lfanew);
 	if (nthdr->FileHeader.Machine != IMAGE_FILE_MACHINE_I386 ||
 	    nthdr->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
 		// Only 32-bit PE files for x86 supported
 		return (0);
 	}
 
-	sU32 imageBase = nthdr->OptionalHeader.ImageBase;
-	sU32 codeStart = nthdr->OptionalHeader.BaseOfCode;
-	sU32 codeSize = nthdr->OptionalHeader.SizeOfCode;
-	sU32 fileOffs = 0; // find file offset of first section
-
-	// find section containing code
-	IMAGE_SECTION_HEADER *sec = IMAGE_FIRST_SECTION(nthdr);
-	for (sInt i=0;i<nthdr->FileHeader.NumberOfSections;i++) {
-		if (codeStart >= sec[i].VirtualAddress && codeStart <
-		    sec[i].VirtualAddress + sec[i].SizeOfRawData)
-			fileOffs = sec[i].PointerToRawData + (codeStart - sec[i].VirtualAddress);
+	imageBase = nthdr->OptionalHeader.ImageBase;
+	shdr = IMAGE_FIRST_SECTION(nthdr);
+	if ((uchar_t *)(shdr + nthdr->FileHeader.NumberOfSections) > inData + len)
+		return (0);
+	n = 0;
+	for (i = 0; i < nthdr->FileHeader.NumberOfSections; i++) {
+		if (!(shdr[i].Characteristics & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)))
+			continue;
+		n = add_section(sec, n, len, shdr[i].PointerToRawData, shdr[i].SizeOfRawData,
+		    imageBase + shdr[i].VirtualAddress);
 	}
+	return (n);
+}
 
-	if (fileOffs == 0) {
-		// Code section not found!
+/*
+ * Executable PROGBITS sections of a 32-bit little-endian x86 ELF file.
+ */
+static int
+elf_code_sections(uchar_t *inData, size_t len, struct code_section *sec)
+{
+	sU32 shoff, shentsize, shnum, i;
+	uchar_t *sh;
+	int n;
+
+	if (len < ELF32_EHDR_SIZE || memcmp(inData, "\177ELF", 4) != 0 ||
+	    inData[4] != 1 || inData[5] != 1 || LE16(U16_P(inData + 18)) != ELF_EM_386)
 		return (0);
+	shoff = LE32(U32_P(inData + 32));
+	shentsize = LE16(U16_P(inData + 46));
+	shnum = LE16(U16_P(inData + 48));
+	if (shentsize < ELF32_SHDR_SIZE || shoff >= len || shnum > (len - shoff) / shentsize)
+		return (0);
+
+	n = 0;
+	for (i = 0; i < shnum; i++) {
+		sh = inData + shoff + i * shentsize;
+		if (LE32(U32_P(sh + 4)) != ELF_SHT_PROGBITS ||
+		    !(LE32(U32_P(sh + 8)) & ELF_SHF_EXECINSTR))
+			continue;
+		n = add_section(sec, n, len, LE32(U32_P(sh + 16)), LE32(U32_P(sh + 20)),
+		    LE32(U32_P(sh + 12)));
 	}
+	return (n);
+}
 
-	// Keep space for header
-	pos = *out_buf + sizeof (hdr);
+/*
+ * Put the sections in file order and drop any that overlap the one before.
+ */
+static int
+sort_sections(struct code_section *sec, int n)
+{
+	struct code_section t;
+	int i, j, k;
+
+	for (i = 1; i < n; i++) {
+		t = sec[i];
+		for (j = i; j > 0 && sec[j - 1].offset > t.offset; j--)
+			sec[j] = sec[j - 1];
+		sec[j] = t;
+	}
+	k = 0;
+	for (i = 0; i < n; i++) {
+		if (k > 0 && sec[i].offset < sec[k - 1].offset + sec[k - 1].size)
+			continue;
+		sec[k++] = sec[i];
+	}
+	return (k);
+}
+
+/*
+ * Only the code sections found from the ELF or PE headers are run through
+ * Dispack, in parallel when there are several. Sections Dispack does not
+ * shrink are stored as they are along with the rest of the file. A single
+ * transformed section uses the original header layout.
+ */
+size_t
+dispack_filter_encode(uchar_t *inData, size_t len, uchar_t **out_buf)
+{
+	struct code_section sec[DISPACK_MAX_SECTIONS];
+	uchar_t *pos;
+	sU32 sizeNow, prev;
+	int i, n, k;
+
+	*out_buf = (uchar_t *)malloc(len);
+	if (*out_buf == NULL)
+		return (0);
+
+	n = pe_code_sections(inData, len, sec);
+	if (n == 0)
+		n = elf_code_sections(inData, len, sec);
+	if (n == 0) {
+		// Code section not found!
+		return (0);
+	}
+	n = sort_sections(sec, n);
 
 	// transform code
-	sU32 transSize = len - sizeof (hdr);
-	if (fileOffs + codeSize > len) {
-		codeSize = len - fileOffs;
+#if defined(_OPENMP)
+#	pragma omp parallel for schedule(dynamic, 1) if (n > 1)
+#endif
+	for (i = 0; i < n; i++) {
+		sec[i].out = (sU8 *)malloc(sec[i].size);
+		sec[i].out_size = sec[i].size;
+		if (sec[i].out == NULL || DisFilter(inData + sec[i].offset, sec[i].size,
+		    sec[i].origin, sec[i].out, sec[i].out_size) == NULL ||
+		    sec[i].out_size >= sec[i].size) {
+			free(sec[i].out);
+			sec[i].out = NULL;
+		}
 	}
-	if (DisFilter(inData + fileOffs, codeSize, imageBase + codeStart, pos, transSize) == NULL) {
-		goto cmp_E89;
+
+	k = 0;
+	sizeNow = 0;
+	for (i = 0; i < n; i++) {
+		if (sec[i].out == NULL)
+			continue;
+		sec[k++] = sec[i];
+		sizeNow += sec[i].size - sec[i].out_size;
 	}
-	pos += transSize;
+	if (k == 0)
+		goto cmp_E89;
 
 	// Give up if dispack savings is not enough for header space and we can overflow the buffer.
-	memcpy(hdr.magic, DISPACK_MAGIC, strlen(DISPACK_MAGIC));
-	hdr.SizeBefore = fileOffs;
-	hdr.SizeAfter = len - (fileOffs + codeSize);
-	hdr.SizeTransformed = transSize;
-	hdr.SizeOriginal = codeSize;
-	hdr.Origin = imageBase + codeStart;
-	sizeNow = pos - *out_buf;
-	if (sizeNow + hdr.SizeBefore + hdr.SizeAfter >= len) {
-		goto cmp_E89;
-	}
+	if (k == 1) {
+		FileHeader hdr;
 
-	// Now plonk the header
-	memcpy(*out_buf, &hdr, sizeof (hdr));
+		if (sizeNow <= sizeof (hdr))
+			goto cmp_E89;
+		memcpy(hdr.magic, DISPACK_MAGIC, strlen(DISPACK_MAGIC));
+		hdr.SizeBefore = sec[0].offset;
+		hdr.SizeAfter = len - (sec[0].offset + sec[0].size);
+		hdr.SizeTransformed = sec[0].out_size;
+		hdr.SizeOriginal = sec[0].size;
+		hdr.Origin = sec[0].origin;
+		memcpy(*out_buf, &hdr, sizeof (hdr));
+		pos = *out_buf + sizeof (hdr);
+	} else {
+		SectHeader hdr;
+		SectEntry ent;
 
-	if (hdr.SizeBefore > 0) {
-		// Copy rest of the data
-		memcpy(pos, inData, hdr.SizeBefore);
-		pos += hdr.SizeBefore;
+		if (sizeNow <= sizeof (hdr) + k * sizeof (ent))
+			goto cmp_E89;
+		memcpy(hdr.magic, DISPACK_MAGIC_SECT, strlen(DISPACK_MAGIC_SECT));
+		hdr.NumSections = k;
+		hdr.SizeFile = len;
+		memcpy(*out_buf, &hdr, sizeof (hdr));
+		pos = *out_buf + sizeof (hdr);
+		for (i = 0; i < k; i++) {
+			ent.Offset = sec[i].offset;
+			ent.SizeOriginal = sec[i].size;
+			ent.SizeTransformed = sec[i].out_size;
+			ent.Origin = sec[i].origin;
+			memcpy(pos, &ent, sizeof (ent));
+			pos += sizeof (ent);
+		}
 	}
-	if (hdr.SizeAfter > 0) {
-		memcpy(pos, inData + (fileOffs + codeSize), hdr.SizeAfter);
-		pos += hdr.SizeAfter;
+	for (i = 0; i < k; i++) {
+		memcpy(pos, sec[i].out, sec[i].out_size);
+		pos += sec[i].out_size;
+	}
+
+	// Copy rest of the data
+	prev = 0;
+	for (i = 0; i < k; i++) {
+		memcpy(pos, inData + prev, sec[i].offset - prev);
+		pos += sec[i].offset - prev;
+		prev = sec[i].offset + sec[i].size;
+		free(sec[i].out);
 	}
+	memcpy(pos, inData + prev, len - prev);
+	pos += len - prev;
 
 	return (pos -  *out_buf);
 cmp_E89:
+	for (i = 0; i < k; i++)
+		free(sec[i].out);
+
 	// Apply an E8E9 filter this does not put the DISPACK_MAGIC into the
 	// file header. So, when decoding, that is detected and E8E9 decode
 	// is applied.
@@ -142,6 +320,59 @@ cmp_E89:
 	return (len);
 }
 
+static size_t
+dispack_sect_decode(uchar_t *inData, size_t len, uchar_t *out)
+{
+	SectHeader *hdr = (SectHeader *)inData;
+	SectEntry *ent = (SectEntry *)(inData + sizeof (SectHeader));
+	sU8 *transformed[DISPACK_MAX_SECTIONS];
+	sU8 *rest;
+	sU32 n, i, prev;
+	int err;
+
+	n = hdr->NumSections;
+	if (n == 0 || n > DISPACK_MAX_SECTIONS || hdr->SizeFile > len ||
+	    sizeof (SectHeader) + n * sizeof (SectEntry) > len)
+		return (0);
+
+	rest = (sU8 *)(ent + n);
+	prev = 0;
+	for (i = 0; i < n; i++) {
+		if (ent[i].Offset < prev || ent[i].Offset > hdr->SizeFile ||
+		    ent[i].SizeOriginal > hdr->SizeFile - ent[i].Offset ||
+		    ent[i].SizeTransformed > len - (rest - inData))
+			return (0);
+		transformed[i] = rest;
+		rest += ent[i].SizeTransformed;
+		prev = ent[i].Offset + ent[i].SizeOriginal;
+	}
+
+	err = 0;
+#if defined(_OPENMP)
+#	pragma omp parallel for schedule(dynamic, 1)
+#endif
+	for (i = 0; i < n; i++) {
+		if (!DisUnFilter(transformed[i], ent[i].SizeTransformed, out + ent[i].Offset,
+		    ent[i].SizeOriginal, ent[i].Origin))
+			err = 1;
+	}
+	if (err)
+		return (0);
+
+	prev = 0;
+	for (i = 0; i <= n; i++) {
+		sU32 gap = (i < n ? ent[i].Offset : hdr->SizeFile) - prev;
+
+		if (gap > len - (rest - inData))
+			return (0);
+		memcpy(out + prev, rest, gap);
+		rest += gap;
+		if (i < n)
+			prev = ent[i].Offset + ent[i].SizeOriginal;
+	}
+	return (hdr->SizeFile);
+}
+
 size_t
 dispack_filter_decode(uchar_t *inData, size_t len, uchar_t **out_buf)
 {
@@ -157,6 +388,8 @@ dispack_filter_decode(uchar_t *inData, size_t len, uchar_t **out_buf)
 	if (*out_buf == NULL)
 		return (0);
 
+	if (memcmp(hdr->magic, DISPACK_MAGIC_SECT, strlen(DISPACK_MAGIC_SECT)) == 0)
+		return (dispack_sect_decode(inData, len, *out_buf));
 	if (memcmp(hdr->magic, DISPACK_MAGIC, strlen(DISPACK_MAGIC)) != 0)
 		goto dec_E89;
 
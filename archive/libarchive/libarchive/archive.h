@@ -811,6 +811,13 @@ __LA_DECL int archive_write_disk_set_user_lookup(struct archive *,
     void (* /* cleanup */)(void *));
 __LA_DECL __LA_INT64_T archive_write_disk_gid(struct archive *, const char *, __LA_INT64_T);
 __LA_DECL __LA_INT64_T archive_write_disk_uid(struct archive *, const char *, __LA_INT64_T);
+/*
+ * Copy up to the given number of bytes from the current position of a file
+ * descriptor into the entry being written. Returns the count copied or an
+ * ARCHIVE_ error code.
+ */
+__LA_DECL __LA_INT64_T archive_write_disk_copy_fd(struct archive *, int /* fd */,
+    __LA_INT64_T);
 
 /*
  * ARCHIVE_READ_DISK API
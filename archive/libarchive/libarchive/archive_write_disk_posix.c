@@ -74,6 +74,9 @@ __FBSDID("$FreeBSD$");
 #ifdef HAVE_LANGINFO_H
 #include <langinfo.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>	/* for copy_file_range */
+#endif
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>	/* for Linux file flags */
 #endif
@@ -1486,6 +1489,77 @@ _archive_write_disk_data(struct archive *_a, const void *buff, size_t size)
 	return (write_data_block(a, buff, size));
 }
 
+/*
+ * Copy file data from another descriptor into the current entry. On Linux
+ * copy_file_range() lets the kernel move the data, or share extents on file
+ * systems that support reflinks. Otherwise, or if it is refused, the data
+ * is read and written.
+ */
+int64_t
+archive_write_disk_copy_fd(struct archive *_a, int fd, int64_t len)
+{
+	struct archive_write_disk *a = (struct archive_write_disk *)_a;
+	int64_t done;
+	ssize_t r, w;
+	char *buff;
+
+	archive_check_magic(&a->archive, ARCHIVE_WRITE_DISK_MAGIC,
+	    ARCHIVE_STATE_DATA, "archive_write_disk_copy_fd");
+	if (a->filesize >= 0 && a->offset + len > a->filesize)
+		len = a->filesize - a->offset;
+	done = 0;
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+	if (a->fd >= 0 && !(a->todo & TODO_HFS_COMPRESSION) && len > 0) {
+		if (a->offset != a->fd_offset) {
+			if (lseek(a->fd, a->offset, SEEK_SET) < 0) {
+				archive_set_error(&a->archive, errno,
+				    "Seek failed");
+				return (ARCHIVE_FATAL);
+			}
+			a->fd_offset = a->offset;
+		}
+		while (done < len) {
+			r = syscall(SYS_copy_file_range, fd, NULL, a->fd, NULL,
+			    (size_t)(len - done), 0);
+			if (r <= 0)
+				break;
+			done += r;
+		}
+		a->offset += done;
+		a->fd_offset = a->offset;
+	}
+#endif
+	if (done == len)
+		return (done);
+
+	buff = malloc(65536);
+	if (buff == NULL) {
+		archive_set_error(&a->archive, ENOMEM, "No memory");
+		return (ARCHIVE_FATAL);
+	}
+	while (done < len) {
+		r = read(fd, buff, (len - done < 65536) ? (size_t)(len - done) : 65536);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			archive_set_error(&a->archive, errno, "Read failed");
+			free(buff);
+			return (ARCHIVE_FATAL);
+		}
+		if (r == 0)
+			break;
+		w = _archive_write_disk_data(_a, buff, r);
+		if (w < r) {
+			free(buff);
+			return (w < 0 ? w : ARCHIVE_WARN);
+		}
+		done += r;
+	}
+	free(buff);
+	return (done);
+}
+
 static int
 _archive_write_disk_finish_entry(struct archive *_a)
 {
@@ -37,14 +37,33 @@
 #include <utils.h>
 #include <sys/mman.h>
 #include <ctype.h>
+#include <zlib.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include "pc_arc_filter.h"
 #include "pc_archive.h"
+#include "pc_filter_plugin.h"
 
 struct scratch_buffer {
 	uchar_t *in_buff;
 	size_t in_bufflen;
 };
 
+/*
+ * A loaded external filter. Its type tag is the typetab slot shifted like
+ * the builtin sub-types.
+ */
+struct filter_plugin {
+	const pc_filter_plugin_t *p;
+	void *dlh;
+	int type;
+	pthread_mutex_t lock;
+	struct scratch_buffer sdat;
+};
+
+static struct filter_plugin plugins[FILTER_PLUGINS_MAX];
+static int nplugins = 0;
+
 #ifndef _MPLV2_LICENSE_
 extern size_t packjpg_filter_process(uchar_t *in_buf, size_t len, uchar_t **out_buf);
 ssize_t packjpg_filter(struct filter_info *fi, void *filter_private);
@@ -65,6 +84,96 @@ size_t dispack_filter_encode(uchar_t *inData, size_t len, uchar_t **out_buf);
 size_t dispack_filter_decode(uchar_t *inData, size_t len, uchar_t **out_buf);
 ssize_t dispack_filter(struct filter_info *fi, void *filter_private);
 
+size_t deflate_filter_encode(uchar_t *in, size_t len, uchar_t **out);
+size_t deflate_filter_decode(uchar_t *in, size_t len, uchar_t **out);
+ssize_t deflate_filter(struct filter_info *fi, void *filter_private);
+
+static ssize_t plugin_filter(struct filter_info *fi, void *filter_private);
+
+/*
+ * Load the shared objects listed in PCOMPRESS_FILTER_PLUGINS into the slots
+ * after the builtin sub-types. Plugins that cannot be used are skipped with
+ * a warning. Members filtered by a plugin that is not loaded at extraction
+ * are reported by the archive code.
+ */
+static void
+load_filter_plugins(struct type_data *typetab)
+{
+	const pc_filter_plugin_t *p;
+	pc_filter_plugin_init_fn init;
+	struct filter_plugin *fp;
+	char *env, *list, *path, *sp;
+	void *dlh;
+	int slot;
+
+	env = getenv("PCOMPRESS_FILTER_PLUGINS");
+	if (env == NULL || *env == '\0')
+		return;
+	list = strdup(env);
+	if (list == NULL)
+		return;
+
+	for (path = strtok_r(list, ":", &sp); path != NULL; path = strtok_r(NULL, ":", &sp)) {
+		if (nplugins == FILTER_PLUGINS_MAX) {
+			log_msg(LOG_WARN, 0, "At most %d filter plugins can be loaded, ignoring %s.",
+			    FILTER_PLUGINS_MAX, path);
+			break;
+		}
+		dlh = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		if (dlh == NULL) {
+			log_msg(LOG_WARN, 0, "Cannot load filter plugin: %s", dlerror());
+			continue;
+		}
+		*(void **)(&init) = dlsym(dlh, PC_FILTER_PLUGIN_INIT_SYM);
+		p = (init != NULL ? init() : NULL);
+		if (p == NULL || p->abi_version != PC_FILTER_PLUGIN_ABI || p->name == NULL ||
+		    *(p->name) == '\0' || p->detect == NULL || p->encode == NULL ||
+		    p->decode == NULL) {
+			log_msg(LOG_WARN, 0, "%s is not a compatible filter plugin.", path);
+			dlclose(dlh);
+			continue;
+		}
+		if (type_tag_from_filter_name(typetab, p->name, strlen(p->name)) != TYPE_UNKNOWN) {
+			log_msg(LOG_WARN, 0, "Filter name %s from %s is already in use.",
+			    p->name, path);
+			dlclose(dlh);
+			continue;
+		}
+
+		fp = &plugins[nplugins];
+		slot = NUM_SUB_TYPES + 1 + nplugins;
+		fp->p = p;
+		fp->dlh = dlh;
+		fp->type = slot << 3;
+		pthread_mutex_init(&fp->lock, NULL);
+		fp->sdat.in_buff = NULL;
+		fp->sdat.in_bufflen = 0;
+
+		typetab[slot].filter_private = fp;
+		typetab[slot].filter_func = plugin_filter;
+		typetab[slot].filter_name = (char *)p->name;
+		typetab[slot].result_type = (p->result_type > 0 ? p->result_type : TYPE_BINARY);
+		typetab[slot].cost = p->cost;
+		nplugins++;
+	}
+	free(list);
+}
+
+/*
+ * Return the type tag of the first loaded plugin that claims the member.
+ */
+int
+filter_plugin_detect(const char *name, const uchar_t *buf, size_t len)
+{
+	int i;
+
+	for (i = 0; i < nplugins; i++) {
+		if (plugins[i].p->detect(name, buf, len))
+			return (plugins[i].type);
+	}
+	return (TYPE_UNKNOWN);
+}
+
 void
 add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 {
@@ -108,6 +217,34 @@ add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 		typetab[slot].filter_func = dispack_filter;
 		typetab[slot].filter_name = "Dispack";
 		typetab[slot].result_type = 0;
+
+		/*
+		 * 32-bit ELF files have their code sections located the same way.
+		 */
+		slot = TYPE_EXE32 >> 3;
+		typetab[slot].filter_private = sdat;
+		typetab[slot].filter_func = dispack_filter;
+		typetab[slot].filter_name = "Dispack";
+		typetab[slot].result_type = 0;
+	}
+
+	if (ff->enable_deflate) {
+		if (!sdat) {
+			sdat = (struct scratch_buffer *)malloc(sizeof (struct scratch_buffer));
+			sdat->in_buff = NULL;
+			sdat->in_bufflen = 0;
+		}
+		slot = TYPE_COMPRESSED_GZ >> 3;
+		typetab[slot].filter_private = sdat;
+		typetab[slot].filter_func = deflate_filter;
+		typetab[slot].filter_name = "Deflate";
+		typetab[slot].result_type = TYPE_UNKNOWN;
+
+		slot = TYPE_COMPRESSED_ZIP >> 3;
+		typetab[slot].filter_private = sdat;
+		typetab[slot].filter_func = deflate_filter;
+		typetab[slot].filter_name = "Deflate";
+		typetab[slot].result_type = TYPE_UNKNOWN;
 	}
 
 #ifdef _ENABLE_WAVPACK_
@@ -125,6 +262,7 @@ add_filters_by_type(struct type_data *typetab, struct filter_flags *ff)
 		typetab[slot].result_type = -1;
 	}
 #endif
+	load_filter_plugins(typetab);
 }
 
 int
@@ -132,9 +270,9 @@ type_tag_from_filter_name(struct type_data *typetab, const char *fname, size_t l
 {
     size_t i;
 
-    for (i = 0; i <= NUM_SUB_TYPES; i++)
+    for (i = 0; i < FILTER_TYPETAB_SIZE; i++)
     {
-        if (typetab[i].filter_name &&
+        if (typetab[i].filter_name && strlen(typetab[i].filter_name) == len &&
             strncmp(fname, typetab[i].filter_name, len) == 0)
         {
             return (i << 3);
@@ -176,6 +314,29 @@ copy_archive_data(struct archive *ar, uchar_t *out_buf)
 	return (tot);
 }
 
+/*
+ * Get the stored data of the entry being extracted. The extractor's decode
+ * pool hands it in already read, otherwise it is read from the archive into
+ * the filter's scratch buffer.
+ */
+static uchar_t *
+filter_input(struct filter_info *fi, struct scratch_buffer *sdat, uint64_t len)
+{
+	if (fi->in_buff != NULL)
+		return (fi->in_buff);
+
+	ensure_buffer(sdat, len);
+	if (sdat->in_buff == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory.");
+		return (NULL);
+	}
+	if (copy_archive_data(fi->source_arc, sdat->in_buff) != len) {
+		log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		return (NULL);
+	}
+	return (sdat->in_buff);
+}
+
 #ifndef _MPLV2_LICENSE_
 int
 pjg_version_supported(char ver)
@@ -187,7 +348,7 @@ ssize_t
 packjpg_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *inbuf;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
@@ -215,29 +376,16 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 			return (FILTER_RETURN_SKIP);
 		}
 	} else {
-		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
-		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
+		if ((inbuf = filter_input(fi, sdat, len)) == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
-			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(inbuf));
+		mapbuf = inbuf + 8;
 
 		/*
 		 * We are trying to decompress and this is not a packJPG file.
@@ -247,7 +395,7 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 		if (mapbuf[0] != 'J' || mapbuf[1] != 'S' || !pjg_version_supported(mapbuf[2])) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, inbuf, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -286,7 +434,7 @@ packjpg_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, inbuf, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -304,12 +452,12 @@ ssize_t
 packpnm_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *inbuf;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
 	len1 = len;
-	if (len > PJG_FILE_SIZE_LIMIT) // Bork on massive JPEGs
+	if (len > PPNM_FILE_SIZE_LIMIT) // Bork on massive images
 		return (FILTER_RETURN_SKIP);
 
 	if (fi->compressing) {
@@ -327,29 +475,16 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 			return (FILTER_RETURN_SKIP);
 		}
 	} else {
-		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
-		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		if ((inbuf = filter_input(fi, sdat, len)) == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(inbuf));
+		mapbuf = inbuf + 8;
 
 		/*
 		 * We are trying to decompress and this is not a packPNM file.
@@ -358,7 +493,7 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 		if (identify_pnm_type(mapbuf, len - 8) != 2) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, inbuf, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -397,7 +532,7 @@ packpnm_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, inbuf, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -417,12 +552,17 @@ ssize_t
 wavpack_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *inbuf;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
 	len1 = len;
-	if (len > WVPK_FILE_SIZE_LIMIT)
+
+	/*
+	 * Long audio is split into segments that are coded in parallel, so
+	 * the limit is higher than for a single WavPack stream.
+	 */
+	if (len > WVPK_SEG_FILE_SIZE_LIMIT)
 		return (FILTER_RETURN_SKIP);
 
 	if (fi->compressing) {
@@ -442,39 +582,26 @@ wavpack_filter(struct filter_info *fi, void *filter_private)
 	} else {
 		char *wpkstr;
 
-		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
-		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		if ((inbuf = filter_input(fi, sdat, len)) == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
 
 		/*
 		 * First 8 bytes in the data is the compressed size of the entry.
 		 * LibArchive always zero-pads entries to their original size so
 		 * we need to separately store the compressed size.
 		 */
-		in_size = LE64(U64_P(sdat->in_buff));
-		mapbuf = sdat->in_buff + 8;
+		in_size = LE64(U64_P(inbuf));
+		mapbuf = inbuf + 8;
 
 		/*
 		 * We are trying to decompress and this is not a Wavpack file.
 		 * Write the raw data and skip.
 		 */
 		wpkstr = (char *)mapbuf;
-		if (strncmp(wpkstr, "wvpk", 4) != 0) {
+		if (strncmp(wpkstr, "wvpk", 4) != 0 && strncmp(wpkstr, "wvpm", 4) != 0) {
 			uint8_t *out = malloc(len);
 
-			memcpy(out, sdat->in_buff, len);
+			memcpy(out, inbuf, len);
 			fi->fout->output_type = FILTER_OUTPUT_MEM;
 			fi->fout->out = out;
 			fi->fout->out_size = len;
@@ -513,7 +640,7 @@ wavpack_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, inbuf, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -532,12 +659,12 @@ ssize_t
 dispack_filter(struct filter_info *fi, void *filter_private)
 {
 	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
-	uchar_t *mapbuf, *out;
+	uchar_t *mapbuf, *out, *inbuf;
 	uint64_t len, in_size = 0, len1;
 
 	len = archive_entry_size(fi->entry);
 	len1 = len;
-	if (len > WVPK_FILE_SIZE_LIMIT) // Bork on massive files
+	if (len > DISPACK_FILE_SIZE_LIMIT) // Bork on massive files
 		return (FILTER_RETURN_SKIP);
 
 	if (fi->compressing) {
@@ -548,26 +675,14 @@ dispack_filter(struct filter_info *fi, void *filter_private)
 		}
 
 		/*
-		 * No check for supported 32-bit exe here. EXE types are always
-		 * detected by file header analysis. So no need to duplicate here.
+		 * The encoder parses the PE or ELF headers itself and skips
+		 * files where it finds no 32-bit x86 code sections.
 		 */
 	} else {
-		/*
-		 * Allocate input buffer and read archive data stream for the entry
-		 * into this buffer.
-		 */
-		ensure_buffer(sdat, len);
-		if (sdat->in_buff == NULL) {
-			log_msg(LOG_ERR, 1, "Out of memory.");
-			return (FILTER_RETURN_ERROR);
-		}
-
-		in_size = copy_archive_data(fi->source_arc, sdat->in_buff);
-		if (in_size != len) {
-			log_msg(LOG_ERR, 0, "Failed to read archive data.");
+		if ((inbuf = filter_input(fi, sdat, len)) == NULL)
 			return (FILTER_RETURN_ERROR);
-		}
-		mapbuf = sdat->in_buff;
+		in_size = len;
+		mapbuf = inbuf;
 
 		/*
 		 * No check for supported EXE types needed here since supported
@@ -607,7 +722,7 @@ dispack_filter(struct filter_info *fi, void *filter_private)
 		 */
 		free(out);
 		out = malloc(len);
-		memcpy(out, sdat->in_buff, len);
+		memcpy(out, inbuf, len);
 
 		fi->fout->output_type = FILTER_OUTPUT_MEM;
 		fi->fout->out = out;
@@ -621,3 +736,749 @@ dispack_filter(struct filter_info *fi, void *filter_private)
 	return (ARCHIVE_OK);
 }
 
+
+/*
+ * Deflate filter. Deflate streams in ZIP based files (zip, jar, odt, docx),
+ * gzip files and the IDAT data of PNG images are stored inflated, so that
+ * the main codec sees the data and not its entropy coded form. They are
+ * deflated again on extraction. This only works if zlib reproduces the
+ * stream bit for bit, so a stream is taken only if deflating it again at one
+ * of the zlib levels, memLevels and strategies gives exactly the same bytes.
+ * Everything else is kept as it is.
+ *
+ * Filter output, integers are little endian unless noted:
+ *   "PCDF" version(1) file size(8)
+ *   Records, each a tag byte followed by:
+ *     DFL_REC_RAW     len(4) data
+ *     DFL_REC_STREAM  level(1) memlevel(1) wbits(1) strategy(1) crc(4)
+ *                     stream len(4) inflated len(4) inflated data
+ *     DFL_REC_IDAT    count(4) chunk len(4) * count, then the records of the
+ *                     concatenated IDAT data up to DFL_REC_IDAT_END. The PNG
+ *                     chunk length and CRC fields are rebuilt from these.
+ *     DFL_REC_END
+ *
+ * The CRC of each deflate stream is checked when it is rebuilt, so that a
+ * zlib which deflates differently is caught instead of writing a bad file.
+ */
+#define	DFL_MAGIC	"PCDF"
+#define	DFL_VERSION	1
+#define	DFL_HDR_SIZE	13
+#define	DFL_MIN_STREAM	64
+#define	DFL_MAX_MISSES	16
+#define	DFL_CMP_BUF	(64 * 1024)
+
+enum {
+	DFL_REC_END = 0,
+	DFL_REC_RAW,
+	DFL_REC_STREAM,
+	DFL_REC_IDAT,
+	DFL_REC_IDAT_END
+};
+
+struct dfl_buf {
+	uchar_t *buf;
+	size_t len, size;
+};
+
+struct dfl_params {
+	int level, memlevel, wbits, strategy;
+};
+
+struct dfl_state {
+	struct dfl_buf ubuf;
+	uchar_t *cbuf;
+	struct dfl_params last;
+	size_t total;
+	int hits, misses;
+};
+
+static const uchar_t png_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static int
+dfl_grow(struct dfl_buf *b, size_t need)
+{
+	uchar_t *nb;
+	size_t nsz;
+
+	if (b->len + need <= b->size)
+		return (0);
+	nsz = (b->size > 0 ? b->size : DFL_CMP_BUF);
+	while (nsz < b->len + need)
+		nsz *= 2;
+	nb = (uchar_t *)realloc(b->buf, nsz);
+	if (nb == NULL)
+		return (-1);
+	b->buf = nb;
+	b->size = nsz;
+	return (0);
+}
+
+static int
+dfl_put(struct dfl_buf *b, const void *src, size_t len)
+{
+	if (dfl_grow(b, len) == -1)
+		return (-1);
+	memcpy(b->buf + b->len, src, len);
+	b->len += len;
+	return (0);
+}
+
+static int
+dfl_put32(struct dfl_buf *b, uint32_t val)
+{
+	uint32_t le = LE32(val);
+
+	return (dfl_put(b, &le, sizeof (le)));
+}
+
+static int
+dfl_put_be32(struct dfl_buf *b, uint32_t val)
+{
+	uchar_t be[4];
+
+	be[0] = val >> 24;
+	be[1] = val >> 16;
+	be[2] = val >> 8;
+	be[3] = val;
+	return (dfl_put(b, be, sizeof (be)));
+}
+
+static uint32_t
+dfl_get_be32(const uchar_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static int
+dfl_put_raw(struct dfl_buf *b, const uchar_t *src, size_t len)
+{
+	uchar_t tag = DFL_REC_RAW;
+
+	if (len == 0)
+		return (0);
+	if (dfl_put(b, &tag, 1) == -1 || dfl_put32(b, len) == -1 ||
+	    dfl_put(b, src, len) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Inflate the raw deflate stream at src into ub. Returns the inflated size
+ * and the size of the stream in *clen, or 0 if there is no complete stream
+ * there or it inflates to more than limit.
+ */
+static size_t
+dfl_inflate(const uchar_t *src, size_t len, struct dfl_buf *ub, size_t limit,
+    size_t *clen)
+{
+	z_stream zs;
+	int rv;
+
+	memset(&zs, 0, sizeof (zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		return (0);
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	ub->len = 0;
+	do {
+		if (dfl_grow(ub, DFL_CMP_BUF) == -1) {
+			rv = Z_MEM_ERROR;
+			break;
+		}
+		zs.next_out = ub->buf + ub->len;
+		zs.avail_out = ub->size - ub->len;
+		rv = inflate(&zs, Z_NO_FLUSH);
+		ub->len = zs.total_out;
+		if (ub->len > limit) {
+			rv = Z_BUF_ERROR;
+			break;
+		}
+	} while (rv == Z_OK);
+	inflateEnd(&zs);
+	if (rv != Z_STREAM_END)
+		return (0);
+	*clen = zs.total_in;
+	return (ub->len);
+}
+
+/*
+ * Check if deflate with the given parameters reproduces the stream exactly.
+ * The output is compared as it is produced so that a mismatch stops early.
+ */
+static int
+dfl_match(const uchar_t *ubuf, size_t ulen, const uchar_t *src, size_t clen,
+    struct dfl_params *p, uchar_t *cbuf)
+{
+	z_stream zs;
+	size_t pos, n;
+	int rv;
+
+	memset(&zs, 0, sizeof (zs));
+	if (deflateInit2(&zs, p->level, Z_DEFLATED, -p->wbits, p->memlevel,
+	    p->strategy) != Z_OK)
+		return (0);
+	zs.next_in = (Bytef *)ubuf;
+	zs.avail_in = ulen;
+	pos = 0;
+	do {
+		zs.next_out = cbuf;
+		zs.avail_out = DFL_CMP_BUF;
+		rv = deflate(&zs, Z_FINISH);
+		n = DFL_CMP_BUF - zs.avail_out;
+		if (n > clen - pos || memcmp(cbuf, src + pos, n) != 0) {
+			rv = Z_DATA_ERROR;
+			break;
+		}
+		pos += n;
+	} while (rv == Z_OK);
+	deflateEnd(&zs);
+	return (rv == Z_STREAM_END && pos == clen);
+}
+
+/*
+ * Find the zlib parameters that reproduce a stream. The ones that matched
+ * the last stream of the file are tried first, then the zlib default level
+ * and the others. Z_FILTERED, which libpng uses, only matters from level 4.
+ */
+static int
+dfl_find_params(struct dfl_state *st, const uchar_t *src, size_t clen, int wbits)
+{
+	static const int levels[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8 };
+	struct dfl_params p;
+	int i, m, s;
+
+	if (st->last.level > 0 && st->last.wbits == wbits &&
+	    dfl_match(st->ubuf.buf, st->ubuf.len, src, clen, &st->last, st->cbuf))
+		return (1);
+	p.wbits = wbits;
+	for (i = 0; i < sizeof (levels) / sizeof (levels[0]); i++) {
+		p.level = levels[i];
+		for (m = 8; m <= 9; m++) {
+			p.memlevel = m;
+			for (s = 0; s < (p.level > 3 ? 2 : 1); s++) {
+				p.strategy = (s == 0 ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+				if (memcmp(&p, &st->last, sizeof (p)) == 0)
+					continue;
+				if (dfl_match(st->ubuf.buf, st->ubuf.len, src, clen,
+				    &p, st->cbuf)) {
+					st->last = p;
+					return (1);
+				}
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Try the deflate stream at src. Returns 1 if it can be reproduced, with the
+ * inflated data in st->ubuf and the stream size in *clen, 0 if not.
+ */
+static int
+dfl_try_stream(struct dfl_state *st, const uchar_t *src, size_t len, int wbits,
+    size_t *clen)
+{
+	size_t ulen;
+
+	ulen = dfl_inflate(src, len, &st->ubuf, DFL_INFLATE_MAX - st->total, clen);
+	if (ulen < DFL_MIN_STREAM)
+		return (0);
+	if (!dfl_find_params(st, src, *clen, wbits)) {
+		st->misses++;
+		return (0);
+	}
+	st->total += ulen;
+	st->hits++;
+	return (1);
+}
+
+static int
+dfl_put_stream(struct dfl_state *st, struct dfl_buf *b, const uchar_t *src,
+    size_t clen)
+{
+	uchar_t hdr[5];
+
+	hdr[0] = DFL_REC_STREAM;
+	hdr[1] = st->last.level;
+	hdr[2] = st->last.memlevel;
+	hdr[3] = st->last.wbits;
+	hdr[4] = st->last.strategy;
+	if (dfl_put(b, hdr, sizeof (hdr)) == -1 ||
+	    dfl_put32(b, crc32(0, src, clen)) == -1 ||
+	    dfl_put32(b, clen) == -1 || dfl_put32(b, st->ubuf.len) == -1 ||
+	    dfl_put(b, st->ubuf.buf, st->ubuf.len) == -1)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Offset of the deflate data after a ZIP local file header or a gzip header
+ * at buf[pos], or 0 if there is none.
+ */
+static size_t
+dfl_stream_start(const uchar_t *buf, size_t len, size_t pos)
+{
+	const uchar_t *p = buf + pos;
+	size_t rem = len - pos, off;
+	int flg;
+
+	if (rem > 30 && p[0] == 'P' && p[1] == 'K' && p[2] == 3 && p[3] == 4) {
+		/*
+		 * Deflated and not encrypted.
+		 */
+		if (LE16(U16_P(p + 8)) != 8 || (LE16(U16_P(p + 6)) & 1))
+			return (0);
+		off = 30 + LE16(U16_P(p + 26)) + LE16(U16_P(p + 28));
+		return (off < rem ? pos + off : 0);
+	}
+	if (rem > 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8) {
+		flg = p[3];
+		if (flg & 0xe0)
+			return (0);
+		off = 10;
+		if (flg & 4)
+			off += 2 + LE16(U16_P(p + off));
+		if (flg & 8) {
+			while (off < rem && p[off] != '\0') off++;
+			off++;
+		}
+		if (flg & 16) {
+			while (off < rem && p[off] != '\0') off++;
+			off++;
+		}
+		if (flg & 2)
+			off += 2;
+		return (off < rem ? pos + off : 0);
+	}
+	return (0);
+}
+
+/*
+ * Scan for ZIP members and gzip streams. If none of the first few streams
+ * can be reproduced the file was not made by zlib and the scan stops.
+ */
+static int
+dfl_encode_streams(struct dfl_state *st, struct dfl_buf *ob, const uchar_t *in,
+    size_t len)
+{
+	size_t pos, raw, start, clen;
+	int rv;
+
+	pos = 0;
+	raw = 0;
+	while (pos < len) {
+		if (st->hits == 0 && st->misses >= DFL_MAX_MISSES)
+			break;
+		if (in[pos] != 'P' && in[pos] != 0x1f) {
+			pos++;
+			continue;
+		}
+		start = dfl_stream_start(in, len, pos);
+		if (start == 0) {
+			pos++;
+			continue;
+		}
+		rv = dfl_try_stream(st, in + start, len - start, MAX_WBITS, &clen);
+		if (rv == 0) {
+			pos++;
+			continue;
+		}
+		if (dfl_put_raw(ob, in + raw, start - raw) == -1 ||
+		    dfl_put_stream(st, ob, in + start, clen) == -1)
+			return (-1);
+		pos = start + clen;
+		raw = pos;
+	}
+	return (dfl_put_raw(ob, in + raw, len - raw));
+}
+
+/*
+ * The zlib stream of a PNG is split over one or more consecutive IDAT chunks.
+ * It is put together and stored inflated with the chunk lengths. Returns 1
+ * if the PNG cannot be handled.
+ */
+static int
+dfl_encode_png(struct dfl_state *st, struct dfl_buf *ob, const uchar_t *in,
+    size_t len)
+{
+	struct dfl_buf z, sizes;
+	size_t pos, first, clen;
+	uint32_t csz, count;
+	uchar_t tag;
+	int rv;
+
+	pos = sizeof (png_sig);
+	first = 0;
+	count = 0;
+	memset(&z, 0, sizeof (z));
+	memset(&sizes, 0, sizeof (sizes));
+	rv = 1;
+	while (len - pos >= 12) {
+		csz = dfl_get_be32(in + pos);
+		if (csz > len - pos - 12)
+			goto out;
+		if (memcmp(in + pos + 4, "IDAT", 4) == 0) {
+			if (count == 0)
+				first = pos;
+			if (crc32(0, in + pos + 4, csz + 4) != dfl_get_be32(in + pos + 8 + csz))
+				goto out;
+			if (dfl_put(&z, in + pos + 8, csz) == -1 || dfl_put32(&sizes, csz) == -1) {
+				rv = -1;
+				goto out;
+			}
+			count++;
+		} else if (count > 0) {
+			break;
+		}
+		pos += 12 + csz;
+	}
+
+	/*
+	 * A zlib header without preset dictionary.
+	 */
+	if (count == 0 || z.len < 8 || (z.buf[0] & 0x0f) != Z_DEFLATED ||
+	    (z.buf[0] >> 4) > 7 || (z.buf[1] & 0x20) ||
+	    ((z.buf[0] << 8) | z.buf[1]) % 31 != 0)
+		goto out;
+	if (dfl_try_stream(st, z.buf + 2, z.len - 2, (z.buf[0] >> 4) + 8, &clen) == 0)
+		goto out;
+
+	tag = DFL_REC_IDAT;
+	rv = -1;
+	if (dfl_put_raw(ob, in, first) == -1 || dfl_put(ob, &tag, 1) == -1 ||
+	    dfl_put32(ob, count) == -1 || dfl_put(ob, sizes.buf, sizes.len) == -1 ||
+	    dfl_put_raw(ob, z.buf, 2) == -1 ||
+	    dfl_put_stream(st, ob, z.buf + 2, clen) == -1 ||
+	    dfl_put_raw(ob, z.buf + 2 + clen, z.len - 2 - clen) == -1)
+		goto out;
+	tag = DFL_REC_IDAT_END;
+	if (dfl_put(ob, &tag, 1) == -1 || dfl_put_raw(ob, in + pos, len - pos) == -1)
+		goto out;
+	rv = 0;
+out:
+	free(z.buf);
+	free(sizes.buf);
+	return (rv);
+}
+
+size_t
+deflate_filter_encode(uchar_t *in, size_t len, uchar_t **out)
+{
+	struct dfl_state st;
+	struct dfl_buf ob;
+	uint64_t osize;
+	uchar_t ver, tag;
+	int rv;
+
+	memset(&st, 0, sizeof (st));
+	memset(&ob, 0, sizeof (ob));
+	st.cbuf = (uchar_t *)malloc(DFL_CMP_BUF);
+	if (st.cbuf == NULL)
+		return (0);
+	ver = DFL_VERSION;
+	osize = LE64((uint64_t)len);
+	rv = -1;
+	if (dfl_put(&ob, DFL_MAGIC, 4) == -1 || dfl_put(&ob, &ver, 1) == -1 ||
+	    dfl_put(&ob, &osize, sizeof (osize)) == -1)
+		goto out;
+	if (len > sizeof (png_sig) && memcmp(in, png_sig, sizeof (png_sig)) == 0) {
+		rv = dfl_encode_png(&st, &ob, in, len);
+		if (rv == 1)
+			rv = dfl_put_raw(&ob, in, len);
+	} else {
+		rv = dfl_encode_streams(&st, &ob, in, len);
+	}
+	tag = DFL_REC_END;
+	if (rv == 0)
+		rv = dfl_put(&ob, &tag, 1);
+out:
+	free(st.cbuf);
+	free(st.ubuf.buf);
+	if (rv != 0 || st.hits == 0) {
+		free(ob.buf);
+		return (0);
+	}
+	*out = ob.buf;
+	return (ob.len);
+}
+
+/*
+ * Deflate an inflated stream again. It must come out at the recorded size
+ * and CRC.
+ */
+static int
+dfl_decode_stream(const uchar_t *in, struct dfl_buf *ob)
+{
+	z_stream zs;
+	uint32_t crc, clen, ulen;
+	int rv;
+
+	crc = LE32(U32_P(in + 4));
+	clen = LE32(U32_P(in + 8));
+	ulen = LE32(U32_P(in + 12));
+	if (dfl_grow(ob, (size_t)clen + 1) == -1)
+		return (-1);
+	memset(&zs, 0, sizeof (zs));
+	if (deflateInit2(&zs, in[0], Z_DEFLATED, -(int)in[2], in[1], in[3]) != Z_OK)
+		return (-1);
+	zs.next_in = (Bytef *)(in + 16);
+	zs.avail_in = ulen;
+	zs.next_out = ob->buf + ob->len;
+	/*
+	 * One byte more than needed, otherwise deflate cannot tell it is done.
+	 */
+	zs.avail_out = clen + 1;
+	rv = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (rv != Z_STREAM_END || zs.total_out != clen ||
+	    crc32(0, ob->buf + ob->len, clen) != crc) {
+		log_msg(LOG_ERR, 0, "Deflate filter: stream does not match.");
+		return (-1);
+	}
+	ob->len += clen;
+	return (0);
+}
+
+/*
+ * Decode records into ob up to DFL_REC_END, or up to DFL_REC_IDAT_END for
+ * the data of an IDAT group.
+ */
+static int
+dfl_decode_recs(const uchar_t *in, size_t len, size_t *pos, struct dfl_buf *ob,
+    int idat)
+{
+	struct dfl_buf z;
+	const uchar_t *sizes;
+	uint32_t n, count, i, csz;
+	size_t zpos;
+	uchar_t tag;
+
+	for (;;) {
+		if (*pos >= len)
+			return (-1);
+		tag = in[(*pos)++];
+		switch (tag) {
+		    case DFL_REC_END:
+			return (idat ? -1 : 0);
+
+		    case DFL_REC_IDAT_END:
+			return (idat ? 0 : -1);
+
+		    case DFL_REC_RAW:
+			if (len - *pos < 4)
+				return (-1);
+			n = LE32(U32_P(in + *pos));
+			*pos += 4;
+			if (len - *pos < n || dfl_put(ob, in + *pos, n) == -1)
+				return (-1);
+			*pos += n;
+			break;
+
+		    case DFL_REC_STREAM:
+			if (len - *pos < 16)
+				return (-1);
+			n = LE32(U32_P(in + *pos + 12));
+			if (len - *pos - 16 < n || dfl_decode_stream(in + *pos, ob) == -1)
+				return (-1);
+			*pos += 16 + n;
+			break;
+
+		    case DFL_REC_IDAT:
+			if (idat || len - *pos < 4)
+				return (-1);
+			count = LE32(U32_P(in + *pos));
+			*pos += 4;
+			if (count == 0 || (len - *pos) / 4 < count)
+				return (-1);
+			sizes = in + *pos;
+			*pos += (size_t)count * 4;
+			memset(&z, 0, sizeof (z));
+			if (dfl_decode_recs(in, len, pos, &z, 1) == -1) {
+				free(z.buf);
+				return (-1);
+			}
+			zpos = 0;
+			for (i = 0; i < count; i++) {
+				csz = LE32(U32_P(sizes + i * 4));
+				if (z.len - zpos < csz || dfl_put_be32(ob, csz) == -1 ||
+				    dfl_put(ob, "IDAT", 4) == -1 ||
+				    dfl_put(ob, z.buf + zpos, csz) == -1 ||
+				    dfl_put_be32(ob, crc32(0, ob->buf + ob->len - csz - 4,
+				    csz + 4)) == -1) {
+					free(z.buf);
+					return (-1);
+				}
+				zpos += csz;
+			}
+			free(z.buf);
+			if (zpos != z.len)
+				return (-1);
+			break;
+
+		    default:
+			return (-1);
+		}
+	}
+}
+
+size_t
+deflate_filter_decode(uchar_t *in, size_t len, uchar_t **out)
+{
+	struct dfl_buf ob;
+	uint64_t osize;
+	size_t pos;
+
+	if (len < DFL_HDR_SIZE || memcmp(in, DFL_MAGIC, 4) != 0 || in[4] != DFL_VERSION)
+		return (0);
+	osize = LE64(U64_P(in + 5));
+	if (osize == 0 || osize > DFL_FILE_SIZE_LIMIT)
+		return (0);
+	ob.buf = (uchar_t *)malloc(osize);
+	if (ob.buf == NULL)
+		return (0);
+	ob.len = 0;
+	ob.size = osize;
+	pos = DFL_HDR_SIZE;
+	if (dfl_decode_recs(in, len, &pos, &ob, 0) == -1 || ob.len != osize) {
+		free(ob.buf);
+		return (0);
+	}
+	*out = ob.buf;
+	return (ob.len);
+}
+
+ssize_t
+deflate_filter(struct filter_info *fi, void *filter_private)
+{
+	struct scratch_buffer *sdat = (struct scratch_buffer *)filter_private;
+	uchar_t *mapbuf, *out, *inbuf;
+	uint64_t len, len1;
+
+	len = archive_entry_size(fi->entry);
+	len1 = len;
+
+	/*
+	 * Compression case. The output is usually bigger than the file. It is
+	 * stored with the entry size grown to fit.
+	 */
+	if (fi->compressing) {
+		if (len > DFL_FILE_SIZE_LIMIT)
+			return (FILTER_RETURN_SKIP);
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fi->fd, 0);
+		if (mapbuf == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Mmap failed in Deflate filter.");
+			return (FILTER_RETURN_ERROR);
+		}
+		out = NULL;
+		len = deflate_filter_encode(mapbuf, len, &out);
+		munmap(mapbuf, len1);
+		if (len == 0)
+			return (FILTER_RETURN_SKIP);
+
+		fi->fout->output_type = FILTER_OUTPUT_MEM;
+		fi->fout->out = out;
+		fi->fout->out_size = len;
+		fi->fout->hdr_valid = 0;
+		return (ARCHIVE_OK);
+	}
+
+	/*
+	 * Decompression case.
+	 */
+	if ((inbuf = filter_input(fi, sdat, len)) == NULL)
+		return (FILTER_RETURN_ERROR);
+	out = NULL;
+	if ((len1 = deflate_filter_decode(inbuf, len, &out)) == 0) {
+		/*
+		 * If filter failed we indicate a soft error to continue the
+		 * archive extraction.
+		 */
+		out = malloc(len);
+		memcpy(out, inbuf, len);
+
+		fi->fout->output_type = FILTER_OUTPUT_MEM;
+		fi->fout->out = out;
+		fi->fout->out_size = len;
+		return (FILTER_RETURN_SOFT_ERROR);
+	}
+
+	fi->fout->output_type = FILTER_OUTPUT_MEM;
+	fi->fout->out = out;
+	fi->fout->out_size = len1;
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Run an external filter plugin on a whole member. Encoding failures store
+ * the member unfiltered. Decoding failures are soft errors like the other
+ * filters so that the rest of the archive can still be extracted.
+ */
+static ssize_t
+plugin_filter(struct filter_info *fi, void *filter_private)
+{
+	struct filter_plugin *fp = (struct filter_plugin *)filter_private;
+	const pc_filter_plugin_t *p = fp->p;
+	uchar_t *mapbuf, *inbuf, *out;
+	size_t len, outlen;
+	int rv, serial;
+
+	len = archive_entry_size(fi->entry);
+	serial = !(p->flags & PC_FILTER_PLUGIN_MT_SAFE);
+	out = NULL;
+	outlen = 0;
+
+	if (fi->compressing) {
+		if (len == 0 || (p->max_size > 0 && len > p->max_size))
+			return (FILTER_RETURN_SKIP);
+		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fi->fd, 0);
+		if (mapbuf == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Mmap failed in %s filter.", p->name);
+			return (FILTER_RETURN_ERROR);
+		}
+		if (serial)
+			pthread_mutex_lock(&fp->lock);
+		rv = p->encode(mapbuf, len, &out, &outlen, fi->cmp_level);
+		if (serial)
+			pthread_mutex_unlock(&fp->lock);
+		munmap(mapbuf, len);
+		if (rv != PC_FILTER_PLUGIN_OK || out == NULL || outlen == 0) {
+			if (rv == PC_FILTER_PLUGIN_ERROR)
+				log_msg(LOG_WARN, 0, "%s filter failed, storing %s unfiltered.",
+				    p->name, archive_entry_pathname(fi->entry));
+			if (out)
+				free(out);
+			return (FILTER_RETURN_SKIP);
+		}
+
+		fi->fout->output_type = FILTER_OUTPUT_MEM;
+		fi->fout->out = out;
+		fi->fout->out_size = outlen;
+		fi->fout->hdr_valid = 0;
+		return (ARCHIVE_OK);
+	}
+
+	if ((inbuf = filter_input(fi, &fp->sdat, len)) == NULL)
+		return (FILTER_RETURN_ERROR);
+	if (serial)
+		pthread_mutex_lock(&fp->lock);
+	rv = p->decode(inbuf, len, &out, &outlen);
+	if (serial)
+		pthread_mutex_unlock(&fp->lock);
+	if (rv != PC_FILTER_PLUGIN_OK || out == NULL) {
+		if (out)
+			free(out);
+		out = malloc(len);
+		memcpy(out, inbuf, len);
+
+		fi->fout->output_type = FILTER_OUTPUT_MEM;
+		fi->fout->out = out;
+		fi->fout->out_size = len;
+		return (FILTER_RETURN_SOFT_ERROR);
+	}
+
+	fi->fout->output_type = FILTER_OUTPUT_MEM;
+	fi->fout->out = out;
+	fi->fout->out_size = outlen;
+	return (ARCHIVE_OK);
+}
@@ -41,12 +41,18 @@ extern "C" {
 #define	FILTER_RETURN_ERROR	(-1)
 #define	FILTER_RETURN_SOFT_ERROR	(-2)
 #define FILTER_XATTR_ENTRY  "_._pc_filter_xattr"
+#define DUP_XATTR_ENTRY  "_._pc_dup_xattr"
+#define FILTER_SIZE_XATTR_ENTRY  "_._pc_filter_size"
 
 #define	FILTER_OUTPUT_MEM	1
 #define	FILTER_OUTPUT_FILE	2
 
 #define HELPER_DEF_BUFSIZ       (512 * 1024)
 #define WVPK_FILE_SIZE_LIMIT    (18 * 1024 * 1024)
+#define WVPK_SEG_FILE_SIZE_LIMIT (256 * 1024 * 1024)
+#define DFL_FILE_SIZE_LIMIT     (64 * 1024 * 1024)
+#define DISPACK_FILE_SIZE_LIMIT (256 * 1024 * 1024)
+#define DFL_INFLATE_MAX         (256 * 1024 * 1024)
 
 /*
  * The biggest scratch buffer reqd by filter routines.
@@ -54,10 +60,18 @@ extern "C" {
  */
 #define	FILTER_SCRATCH_SIZE_MAX	WVPK_FILE_SIZE_LIMIT
 
+/*
+ * External filter plugins take the type table slots after the builtin
+ * sub-types.
+ */
+#define	FILTER_PLUGINS_MAX	8
+#define	FILTER_TYPETAB_SIZE	(NUM_SUB_TYPES + 1 + FILTER_PLUGINS_MAX)
+
 #ifndef _MPLV2_LICENSE_
-#	define  PJG_FILE_SIZE_LIMIT     (8 * 1024 * 1024)
+#	define  PJG_FILE_SIZE_LIMIT     (256 * 1024 * 1024)
+#	define  PPNM_FILE_SIZE_LIMIT    (8 * 1024 * 1024)
 #	define  PJG_APPVERSION1         (25)
-#	define  PJG_APPVERSION2         (25)
+#	define  PJG_APPVERSION2         (26)
 #endif
 
 #pragma	pack(1)
@@ -79,6 +93,7 @@ struct filter_info {
 	struct archive *source_arc;
 	struct archive *target_arc;
 	struct archive_entry *entry;
+	uchar_t *in_buff;	/* Entry data already read, when extracting */
 	int fd;
 	int compressing, block_size;
 	int *type_ptr;
@@ -92,6 +107,7 @@ struct filter_flags {
 	int enable_packjpg;
 	int enable_wavpack;
 	int exe_preprocess;
+	int enable_deflate;
 };
 
 typedef ssize_t (*filter_func_ptr)(struct filter_info *fi, void *filter_private);
@@ -101,11 +117,13 @@ struct type_data {
 	filter_func_ptr filter_func;
 	char *filter_name;
 	int result_type;
+	unsigned int cost;	/* Encode ns per byte, 0 if not known */
 };
 
 void add_filters_by_type(struct type_data *typetab, struct filter_flags *ff);
 int  type_tag_from_filter_name(struct type_data *typetab, const char *fname,
     size_t len);
+int  filter_plugin_detect(const char *name, const uchar_t *buf, size_t len);
 
 #ifdef	__cplusplus
 }
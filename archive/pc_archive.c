@@ -43,6 +43,7 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <phash/phash.h>
@@ -50,6 +51,12 @@
 #include <phash/standard.h>
 #include "archive/pc_archive.h"
 #include "meta_stream.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #undef _FEATURES_H
 #define _XOPEN_SOURCE 700
@@ -63,7 +70,7 @@ static struct ext_hash_entry {
 	int type;
 } *exthtab = NULL;
 
-static struct type_data typetab[NUM_SUB_TYPES+1];
+static struct type_data typetab[FILTER_TYPETAB_SIZE];
 
 /*
 AE_IFREG   Regular file
@@ -77,14 +84,21 @@ AE_IFIFO   Named pipe (fifo)
 
 #define	ARC_ENTRY_OVRHEAD	1024
 #define	MMAP_SIZE		(1024 * 1024)
+#define	SPARSE_MIN_SIZE		(1024 * 1024)
 #define	SORT_BUF_SIZE		(65536)
 #define	NAMELEN			4
+#define	SKETCH_LEN		4096
 #define	TEMP_MMAP_SIZE		(128 * 1024)
 #define	AW_BLOCK_SIZE		(256 * 1024)
 
+#define	ARC_SLOT_FREE		0
+#define	ARC_SLOT_QUEUED		1
+#define	ARC_SLOT_DONE		2
+
 typedef struct member_entry {
 	uchar_t name[NAMELEN];
 	uint32_t file_pos; // 32-bit file position to limit memory usage.
+	uint32_t sketch; // Content sketch, 0 unless similarity ordering (-N).
 	uint64_t size;
 } member_entry_t;
 
@@ -94,6 +108,14 @@ struct sort_buf {
 	struct sort_buf *next;
 };
 
+/*
+ * Min-heap of the sorted buffers keyed on their current entry, for the merge.
+ */
+struct sort_heap {
+	int n;
+	struct sort_buf *b[1];
+};
+
 static struct arc_list_state {
 	uchar_t *pbuf;
 	uint64_t bufsiz, bufpos, arc_size, pathlist_size;
@@ -105,6 +127,41 @@ static struct arc_list_state {
 
 pthread_mutex_t nftw_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * A member read ahead by the archiver thread. ctype, rv and fout are the
+ * result of the media filter if the member was filtered by the pool. Small
+ * members are read whole into sbuf instead, sbuf_len is -1 if that failed.
+ * spare is a further entry handed back by the link resolver.
+ */
+#define	FILTER_POOL_MAX		16
+#define	FILTER_POOL_MIN_NS	(200 * 1000)
+#define	SMALL_FILE_SIZE		(16 * 1024)
+
+typedef struct filter_job {
+	char fpath[PATH_MAX];
+	struct archive_entry *entry, *spare;
+	int typ, ctype;
+	int filtered, done, small;
+	ssize_t rv;
+	filter_output_t fout;
+	uchar_t *sbuf;
+	ssize_t sbuf_len;
+} filter_job_t;
+
+/*
+ * Jobs head to tail are read ahead, next is the first one that a filter
+ * worker has not picked up yet. The counters only increase, the slot of a
+ * job is the counter modulo nslots.
+ */
+struct filter_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv, done_cv;
+	filter_job_t *jobs;
+	uint64_t head, tail, next;
+	int nslots, nthreads, quit, level;
+	pthread_t *threads;
+};
+
 static int detect_type_by_ext(const char *path, int pathlen);
 static int detect_type_from_ext(const char *ext, int len);
 static int detect_type_by_data(uchar_t *buf, size_t len);
@@ -125,25 +182,86 @@ arc_open_callback(struct archive *arc, void *ctx)
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Mark every queued chunk buffer filled so that the reader sees the end of
+ * the archive. Called with arc_lock held.
+ */
+static void
+arc_slots_flush(pc_ctx_t *pctx)
+{
+	struct arc_slot *slot;
+	int i;
+
+	for (i = 0; i < ARC_SLOTS; i++) {
+		slot = &(pctx->arc_slot[i]);
+		if (slot->state != ARC_SLOT_QUEUED)
+			continue;
+		if (pctx->arc_writing && slot == &(pctx->arc_slot[pctx->arc_cur % ARC_SLOTS])) {
+			slot->btype = pctx->btype;
+			slot->interesting = pctx->interesting;
+		}
+		slot->state = ARC_SLOT_DONE;
+	}
+	pthread_cond_broadcast(&(pctx->arc_cv));
+}
+
 static int
 creat_close_callback(struct archive *arc, void *ctx)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
+	pthread_mutex_lock(&(pctx->arc_lock));
 	pctx->arc_closed = 1;
-	if (pctx->arc_buf) {
-		Sem_Post(&(pctx->read_sem));
-	} else {
-		pctx->arc_buf_pos = 0;
-	}
+	arc_slots_flush(pctx);
+	pctx->arc_writing = 0;
+	pthread_mutex_unlock(&(pctx->arc_lock));
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Wait for the reader to queue the next chunk buffer. Returns NULL if the
+ * archiver was closed meanwhile.
+ */
+static struct arc_slot *
+arc_slot_get(pc_ctx_t *pctx)
+{
+	struct arc_slot *slot;
+
+	slot = &(pctx->arc_slot[pctx->arc_cur % ARC_SLOTS]);
+	pthread_mutex_lock(&(pctx->arc_lock));
+	while (slot->state != ARC_SLOT_QUEUED && !pctx->arc_closed)
+		pthread_cond_wait(&(pctx->arc_cv), &(pctx->arc_lock));
+	pthread_mutex_unlock(&(pctx->arc_lock));
+	if (pctx->arc_closed)
+		return (NULL);
+	pctx->arc_writing = 1;
+	pctx->btype = TYPE_UNKNOWN;
+	pctx->interesting = 0;
+	return (slot);
+}
+
+/*
+ * Hand the current chunk buffer back to the reader.
+ */
+static void
+arc_slot_put(pc_ctx_t *pctx, struct arc_slot *slot)
+{
+	pthread_mutex_lock(&(pctx->arc_lock));
+	slot->btype = pctx->btype;
+	slot->interesting = pctx->interesting;
+	slot->state = ARC_SLOT_DONE;
+	pctx->arc_cur++;
+	pctx->arc_writing = 0;
+	pthread_cond_broadcast(&(pctx->arc_cv));
+	pthread_mutex_unlock(&(pctx->arc_lock));
+}
+
 static ssize_t
 creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len)
 {
 	uchar_t *buff = (uchar_t *)buf;
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+	struct arc_slot *slot;
 	size_t remaining;
 
 	if (pctx->arc_closed) {
@@ -155,7 +273,7 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		int rv;
 
 		/*
-		 * Send the buf pointer over to the metadata thread.
+		 * Hand the buffer over to the metadata stream.
 		 */
 		rv = meta_ctx_send(pctx->meta_ctx, &buf, &len);
 		if (rv == 0) {
@@ -168,22 +286,27 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		}
 		return (len);
 	}
+	pctx->arc_stream_pos += len;
 
-	if (!pctx->arc_writing) {
-		Sem_Wait(&(pctx->write_sem));
-	}
-
-	if (pctx->arc_buf == NULL || pctx->arc_buf_size == 0) {
+	if (pctx->arc_writing)
+		slot = &(pctx->arc_slot[pctx->arc_cur % ARC_SLOTS]);
+	else
+		slot = arc_slot_get(pctx);
+	if (slot == NULL || slot->size == 0) {
 		archive_set_error(arc, ARCHIVE_EOF, "End of file when writing archive.");
 		return (-1);
 	}
-	pctx->arc_writing = 1;
 
+	/*
+	 * Archive data is copied straight into the queued chunk buffers. Once one
+	 * is full the next queued one is picked up, blocking only if the reader
+	 * has not queued it yet.
+	 */
 	remaining = len;
 	while (remaining && !pctx->arc_closed) {
 		uchar_t *tbuf;
 
-		tbuf = pctx->arc_buf + pctx->arc_buf_pos;
+		tbuf = slot->buf + slot->pos;
 
 		/*
 		 * Determine if we should return the accumulated data to the caller.
@@ -191,13 +314,13 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 		 * of data has accumulated in the buffer.
 		 */
 		if (pctx->btype != pctx->ctype) {
-			if (pctx->btype == TYPE_UNKNOWN || pctx->arc_buf_pos == 0) {
+			if (pctx->btype == TYPE_UNKNOWN || slot->pos == 0) {
 				pctx->btype = pctx->ctype;
-				if (pctx->arc_buf_pos != 0)
+				if (slot->pos != 0)
 					pctx->interesting = 1;
 			} else {
-				if (pctx->arc_buf_pos < pctx->min_chunk) {
-					int diff = pctx->min_chunk - (int)(pctx->arc_buf_pos);
+				if (slot->pos < pctx->min_chunk) {
+					int diff = pctx->min_chunk - (int)(slot->pos);
 					if (len >= diff) {
 						pctx->btype = pctx->ctype;
 					} else {
@@ -205,34 +328,30 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 					}
 					pctx->interesting = 1;
 				} else {
-					pctx->arc_writing = 0;
-					Sem_Post(&(pctx->read_sem));
-					Sem_Wait(&(pctx->write_sem));
-					pctx->arc_writing = 1;
-					tbuf = pctx->arc_buf;
+					arc_slot_put(pctx, slot);
+					if ((slot = arc_slot_get(pctx)) == NULL)
+						break;
+					tbuf = slot->buf;
 					pctx->btype = pctx->ctype;
 				}
 			}
 		}
 
-		if (remaining > pctx->arc_buf_size - pctx->arc_buf_pos) {
-			size_t nlen = pctx->arc_buf_size - pctx->arc_buf_pos;
+		if (remaining > slot->size - slot->pos) {
+			size_t nlen = slot->size - slot->pos;
 			memcpy(tbuf, buff, nlen);
 			remaining -= nlen;
-			pctx->arc_buf_pos += nlen;
+			slot->pos += nlen;
 			buff += nlen;
-			pctx->arc_writing = 0;
-			Sem_Post(&(pctx->read_sem));
-			Sem_Wait(&(pctx->write_sem));
-			pctx->arc_writing = 1;
+			arc_slot_put(pctx, slot);
+			if ((slot = arc_slot_get(pctx)) == NULL)
+				break;
 		} else {
 			memcpy(tbuf, buff, remaining);
-			pctx->arc_buf_pos += remaining;
+			slot->pos += remaining;
 			remaining = 0;
-			if (pctx->arc_buf_pos == pctx->arc_buf_size) {
-				pctx->arc_writing = 0;
-				Sem_Post(&(pctx->read_sem));
-			}
+			if (slot->pos == slot->size)
+				arc_slot_put(pctx, slot);
 			break;
 		}
 	}
@@ -240,28 +359,71 @@ creat_write_callback(struct archive *arc, void *ctx, const void *buf, size_t len
 	return (len - remaining);
 }
 
-int64_t
-archiver_read(void *ctx, void *buf, uint64_t count)
+/*
+ * Queue a chunk buffer for the archiver to fill. Up to ARC_SLOTS buffers can
+ * be outstanding and are filled in the order queued.
+ */
+void
+archiver_submit(void *ctx, void *buf, uint64_t count)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+	struct arc_slot *slot;
+
+	pthread_mutex_lock(&(pctx->arc_lock));
+	slot = &(pctx->arc_slot[pctx->arc_tail % ARC_SLOTS]);
+	slot->buf = (uchar_t *)buf;
+	slot->size = count;
+	slot->pos = 0;
+	slot->btype = TYPE_UNKNOWN;
+	slot->interesting = 0;
+	slot->state = (pctx->arc_closed ? ARC_SLOT_DONE : ARC_SLOT_QUEUED);
+	pctx->arc_tail++;
+	pthread_cond_broadcast(&(pctx->arc_cv));
+	pthread_mutex_unlock(&(pctx->arc_lock));
+}
 
-	if (pctx->arc_closed)
-		return (0);
+/*
+ * Wait for the oldest queued buffer to be filled. Returns the number of bytes
+ * in it, 0 at the end of the archive or -1 if no buffer was queued.
+ */
+int64_t
+archiver_wait(void *ctx, int *btype, int *interesting)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+	struct arc_slot *slot;
+	int64_t pos;
 
-	if (pctx->arc_buf != NULL) {
-		log_msg(LOG_ERR, 0, "Incorrect sequencing of archiver_read() call.");
+	if (pctx->arc_head == pctx->arc_tail) {
+		log_msg(LOG_ERR, 0, "Incorrect sequencing of archiver_wait() call.");
 		return (-1);
 	}
+	slot = &(pctx->arc_slot[pctx->arc_head % ARC_SLOTS]);
+	pthread_mutex_lock(&(pctx->arc_lock));
+	while (slot->state != ARC_SLOT_DONE)
+		pthread_cond_wait(&(pctx->arc_cv), &(pctx->arc_lock));
+	pos = slot->pos;
+	*btype = slot->btype;
+	*interesting = slot->interesting;
+	slot->state = ARC_SLOT_FREE;
+	pctx->arc_head++;
+	pthread_mutex_unlock(&(pctx->arc_lock));
+	return (pos);
+}
 
-	pctx->arc_buf = buf;
-	pctx->arc_buf_size = count;
-	pctx->arc_buf_pos = 0;
-	pctx->btype = TYPE_UNKNOWN;
-	Sem_Post(&(pctx->write_sem));
-	Sem_Wait(&(pctx->read_sem));
+/*
+ * Fill one buffer synchronously. The chunk's data type is left in pctx->btype
+ * and pctx->interesting.
+ */
+int64_t
+archiver_read(void *ctx, void *buf, uint64_t count)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
-	pctx->arc_buf = NULL;
-	return (pctx->arc_buf_pos);
+	if (pctx->arc_closed)
+		return (0);
+
+	archiver_submit(ctx, buf, count);
+	return (archiver_wait(ctx, &(pctx->btype), &(pctx->interesting)));
 }
 
 int
@@ -269,11 +431,10 @@ archiver_close(void *ctx)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
 
+	pthread_mutex_lock(&(pctx->arc_lock));
 	pctx->arc_closed = 1;
-	pctx->arc_buf = NULL;
-	pctx->arc_buf_size = 0;
-	Sem_Post(&(pctx->write_sem));
-	Sem_Post(&(pctx->read_sem));
+	arc_slots_flush(pctx);
+	pthread_mutex_unlock(&(pctx->arc_lock));
 	return (0);
 }
 
@@ -308,7 +469,7 @@ extract_read_callback(struct archive *arc, void *ctx, const void **buf)
 		size_t len;
 
 		/*
-		 * Send the buf pointer over to the metadata thread.
+		 * Hand the buffer over to the metadata stream.
 		 */
 		len = 0;
 		rv = meta_ctx_send(pctx->meta_ctx, buf, &len);
@@ -351,6 +512,21 @@ extract_read_callback(struct archive *arc, void *ctx, const void **buf)
 	return (pctx->arc_buf_size);
 }
 
+/*
+ * When listing an archive with a metadata stream the data is never read, so
+ * member data is skipped outright instead of being passed through in dummy
+ * buffers. Returning 0 makes libarchive fall back to reads.
+ */
+static int64_t
+extract_skip_callback(struct archive *arc, void *ctx, int64_t request)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+
+	if (pctx->list_mode && pctx->meta_stream && !archive_request_is_metadata(arc))
+		return (request);
+	return (0);
+}
+
 int64_t
 archiver_write(void *ctx, void *buf, uint64_t count)
 {
@@ -403,6 +579,14 @@ compare_members(const void *a, const void *b) {
 			return (rv);
 	}
 
+	/*
+	 * Files of the same type with the same content sketch are kept together.
+	 */
+	if (mem1->sketch > mem2->sketch)
+		return (1);
+	else if (mem1->sketch < mem2->sketch)
+		return (-1);
+
 	/*
 	 * Clear high bits of size. They are just flags.
 	 */
@@ -441,6 +625,8 @@ compare_members_lt(member_entry_t *mem1, member_entry_t *mem2) {
 		else if (rv > 0)
 			return (0);
 	}
+	if (mem1->sketch != mem2->sketch)
+		return (mem1->sketch < mem2->sketch);
 
 	/*
 	 * Clear high bits of size. They are just flags.
@@ -452,6 +638,103 @@ compare_members_lt(member_entry_t *mem1, member_entry_t *mem2) {
 	return (0);
 }
 
+/*
+ * Restore the heap order below slot i after the entry at the top of its buffer
+ * has changed.
+ */
+static void
+sort_heap_down(struct sort_heap *hp, int i)
+{
+	struct sort_buf *t;
+	int c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= hp->n)
+			break;
+		if (c + 1 < hp->n && compare_members_lt(&(hp->b[c + 1]->members[hp->b[c + 1]->pos]),
+		    &(hp->b[c]->members[hp->b[c]->pos])))
+			c++;
+		if (!compare_members_lt(&(hp->b[c]->members[hp->b[c]->pos]),
+		    &(hp->b[i]->members[hp->b[i]->pos])))
+			break;
+		t = hp->b[i];
+		hp->b[i] = hp->b[c];
+		hp->b[c] = t;
+		i = c;
+	}
+}
+
+/*
+ * Sort the filled buffers in parallel and put them in a heap for the merge, so
+ * that each pop costs O(log k) for k buffers. The list of buffers is consumed.
+ * Returns NULL if there is nothing to merge.
+ */
+static struct sort_heap *
+sort_bufs_merge_init(struct sort_buf *head)
+{
+	struct sort_heap *hp;
+	struct sort_buf *srt, *nxt;
+	int i, n;
+
+	n = 0;
+	for (srt = head; srt; srt = srt->next)
+		n++;
+	hp = (struct sort_heap *)malloc(sizeof (struct sort_heap) +
+	    n * sizeof (struct sort_buf *));
+	if (hp == NULL) {
+		log_msg(LOG_WARN, 0, "Out of memory for sort merge. Continuing without sorting.");
+		while (head) {
+			srt = head->next;
+			free(head);
+			head = srt;
+		}
+		return (NULL);
+	}
+	hp->n = 0;
+	for (srt = head; srt; srt = nxt) {
+		nxt = srt->next;
+		srt->next = NULL;
+		if (srt->max < 0)
+			free(srt);
+		else
+			hp->b[hp->n++] = srt;
+	}
+	if (hp->n == 0) {
+		free(hp);
+		return (NULL);
+	}
+
+	n = hp->n;
+#if defined(_OPENMP)
+#	pragma omp parallel for schedule(dynamic, 1) if (n > 1)
+#endif
+	for (i = 0; i < n; i++) {
+		qsort(hp->b[i]->members, hp->b[i]->max + 1, sizeof (member_entry_t),
+		    compare_members);
+	}
+
+	for (i = n / 2 - 1; i >= 0; i--)
+		sort_heap_down(hp, i);
+	return (hp);
+}
+
+/*
+ * Drop all sort buffers while scanning, after which archiving goes on unsorted.
+ */
+static void
+sort_bufs_free(void)
+{
+	struct sort_buf *srt;
+
+	while (a_state.head) {
+		srt = a_state.head->next;
+		free(a_state.head);
+		a_state.head = srt;
+	}
+	a_state.srt = NULL;
+}
+
 /*
  * Fetch the next entry from the pathlist file. If we are doing sorting then this
  * fetches the next entry in ascending order of the predetermined sort keys.
@@ -465,30 +748,18 @@ read_next_path(pc_ctx_t *pctx, char *fpath, char **namechars, int *fpathlen)
 	int n;
 
 	if (pctx->enable_archive_sort) {
-		member_entry_t *mem1, *mem2;
-		struct sort_buf *srt, *srt1, *psrt, *psrt1;
+		member_entry_t *mem1;
+		struct sort_heap *hp;
+		struct sort_buf *srt1;
 
 		/*
 		 * Here we have a set of sorted buffers and we do the external merge phase where
-		 * we pop the buffer entry that is smallest.
+		 * we pop the buffer entry that is smallest, from the top of the heap.
 		 */
-		srt = (struct sort_buf *)pctx->archive_sort_buf;
-		if (!srt) return (0);
-		srt1 = srt;
-		psrt = srt;
-		psrt1 = psrt;
-		mem1 = &(srt->members[srt->pos]);
-		srt = srt->next;
-		while (srt) {
-			mem2 = &(srt->members[srt->pos]);
-			if (compare_members_lt(mem2, mem1)) {
-				mem1 = mem2;
-				srt1 = srt;
-				psrt1 = psrt;
-			}
-			psrt =  srt;
-			srt = srt->next;
-		}
+		hp = (struct sort_heap *)pctx->archive_sort_buf;
+		if (!hp) return (0);
+		srt1 = hp->b[0];
+		mem1 = &(srt1->members[srt1->pos]);
 
 		/*
 		 * If we are not using mmap then seek to the position of the current entry, otherwise
@@ -505,18 +776,22 @@ read_next_path(pc_ctx_t *pctx, char *fpath, char **namechars, int *fpathlen)
 
 		/*
 		 * Increment popped position of the current buffer and check if it is empty.
-		 * The empty buffer is freed and is taken out of the linked list of buffers.
+		 * The empty buffer is freed and replaced by the last one in the heap.
 		 */
 		srt1->pos++;
 		if (srt1->pos > srt1->max) {
-			if (srt1 == pctx->archive_sort_buf) {
-				pctx->archive_sort_buf = srt1->next;
-				free(srt1);
+			free(srt1);
+			hp->n--;
+			if (hp->n == 0) {
+				free(hp);
+				pctx->archive_sort_buf = NULL;
+				hp = NULL;
 			} else {
-				psrt1->next = srt1->next;
-				free(srt1);
+				hp->b[0] = hp->b[hp->n];
 			}
 		}
+		if (hp)
+			sort_heap_down(hp, 0);
 	}
 
 	/*
@@ -606,12 +881,259 @@ do_mmap:
 	return (rbytes);
 }
 
+/*
+ * Member prefetch. The archiver takes member paths from a ring that is filled
+ * by read_next_path() up to depth members ahead. Helper threads look up each
+ * path in the ring before the archiver reaches it and, for regular files, ask
+ * the kernel to read in the first PREFETCH_LEN bytes with POSIX_FADV_WILLNEED.
+ * With a cold cache the directory, inode and data reads of upcoming members
+ * then overlap, instead of each member waiting on its own open and read.
+ * Jobs head to tail are in the ring, next is the first one no helper has
+ * taken. A helper skips members the archiver has already taken.
+ */
+#define	PREFETCH_DEPTH		64
+#define	PREFETCH_DEPTH_MAX	1024
+#define	PREFETCH_THREADS	4
+#define	PREFETCH_LEN		(1024 * 1024)
+
+struct prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv;
+	char *paths;
+	int *lens;
+	uint64_t head, tail, next;
+	int depth, nthreads, quit, eof;
+	pthread_t threads[PREFETCH_THREADS];
+};
+
+static void *
+prefetch_func(void *dat)
+{
+	struct prefetch *pf = (struct prefetch *)dat;
+	char fpath[PATH_MAX];
+	struct stat sb;
+	int fd;
+
+	pthread_mutex_lock(&pf->lock);
+	for (;;) {
+		if (pf->next < pf->head)
+			pf->next = pf->head;
+		if (pf->next == pf->tail) {
+			if (pf->quit)
+				break;
+			pthread_cond_wait(&pf->work_cv, &pf->lock);
+			continue;
+		}
+		strcpy(fpath, pf->paths + (pf->next % pf->depth) * PATH_MAX);
+		pf->next++;
+		pthread_mutex_unlock(&pf->lock);
+
+		/*
+		 * Only regular files are opened, opening a fifo or device can
+		 * block or have side effects.
+		 */
+		if (lstat(fpath, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+			fd = open(fpath, O_RDONLY | O_NONBLOCK);
+			if (fd != -1) {
+				(void) posix_fadvise(fd, 0, PREFETCH_LEN, POSIX_FADV_WILLNEED);
+				close(fd);
+			}
+		}
+		pthread_mutex_lock(&pf->lock);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return (NULL);
+}
+
+/*
+ * Start the prefetch helpers. The depth is taken from PCOMPRESS_PREFETCH,
+ * 0 turns prefetch off. Returns NULL if there is no prefetch.
+ */
+static struct prefetch *
+prefetch_create(pc_ctx_t *pctx)
+{
+	struct prefetch *pf;
+	char *val;
+	int i, depth;
+
+	depth = PREFETCH_DEPTH;
+	if ((val = getenv("PCOMPRESS_PREFETCH")) != NULL) {
+		depth = atoi(val);
+		if (depth < 0 || depth > PREFETCH_DEPTH_MAX) {
+			log_msg(LOG_WARN, 0, "PCOMPRESS_PREFETCH must be 0 - %d, using %d.",
+			    PREFETCH_DEPTH_MAX, PREFETCH_DEPTH);
+			depth = PREFETCH_DEPTH;
+		}
+	}
+	if (depth == 0 || pctx->archive_members_count < 2)
+		return (NULL);
+
+	pf = (struct prefetch *)calloc(1, sizeof (struct prefetch));
+	if (pf == NULL)
+		return (NULL);
+	pf->depth = depth;
+	pf->paths = (char *)malloc((size_t)depth * PATH_MAX);
+	pf->lens = (int *)malloc(depth * sizeof (int));
+	if (pf->paths == NULL || pf->lens == NULL) {
+		free(pf->paths);
+		free(pf->lens);
+		free(pf);
+		return (NULL);
+	}
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->work_cv, NULL);
+	for (i = 0; i < PREFETCH_THREADS && i < depth; i++) {
+		if (pthread_create(&pf->threads[i], NULL, prefetch_func, pf) != 0)
+			break;
+	}
+	pf->nthreads = i;
+	return (pf);
+}
+
+static void
+prefetch_destroy(struct prefetch *pf)
+{
+	int i;
+
+	if (pf == NULL)
+		return;
+	pthread_mutex_lock(&pf->lock);
+	pf->quit = 1;
+	pf->head = pf->tail;
+	pthread_cond_broadcast(&pf->work_cv);
+	pthread_mutex_unlock(&pf->lock);
+	for (i = 0; i < pf->nthreads; i++)
+		pthread_join(pf->threads[i], NULL);
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->work_cv);
+	free(pf->paths);
+	free(pf->lens);
+	free(pf);
+}
+
+/*
+ * Fetch the next member path like read_next_path(), keeping the prefetch
+ * ring topped up.
+ */
+static int
+prefetch_next_path(pc_ctx_t *pctx, struct prefetch *pf, char *fpath,
+    char **namechars, int *fpathlen)
+{
+	char *slot, *bn;
+	int rbytes, len, n;
+
+	if (pf == NULL || pf->nthreads == 0)
+		return (read_next_path(pctx, fpath, namechars, fpathlen));
+
+	/*
+	 * The slot at tail is behind head, no helper reads it while it is filled.
+	 */
+	while (!pf->eof && pf->tail - pf->head < pf->depth) {
+		slot = pf->paths + (pf->tail % pf->depth) * PATH_MAX;
+		rbytes = read_next_path(pctx, slot, &bn, &len);
+		if (rbytes == -1)
+			return (-1);
+		if (rbytes == 0) {
+			pf->eof = 1;
+			break;
+		}
+		pf->lens[pf->tail % pf->depth] = len;
+		pthread_mutex_lock(&pf->lock);
+		pf->tail++;
+		pthread_cond_signal(&pf->work_cv);
+		pthread_mutex_unlock(&pf->lock);
+	}
+	if (pf->head == pf->tail)
+		return (0);
+
+	len = pf->lens[pf->head % pf->depth];
+	memcpy(fpath, pf->paths + (pf->head % pf->depth) * PATH_MAX, len + 1);
+	pthread_mutex_lock(&pf->lock);
+	pf->head++;
+	pthread_mutex_unlock(&pf->lock);
+
+	*fpathlen = len;
+	n = len-1;
+	while (fpath[n] == '/' && n > 0) n--;
+	while (fpath[n] != '/' && fpath[n] != '\\' && n > 0) n--;
+	*namechars = &fpath[n+1];
+	return (len);
+}
+
+/*
+ * Compute a content sketch from the first SKETCH_LEN bytes of a file. This is
+ * the minimum hash over all 8-byte shingles, a one-value MinHash: two files
+ * get the same sketch with a probability close to the fraction of shingles
+ * they share. Sorting on it places similar files next to each other, so they
+ * tend to land in the same chunk. Returns 0 if the file cannot be read.
+ */
+static uint32_t
+member_sketch(int dfd, const char *name, const struct stat *sb)
+{
+	uchar_t buf[SKETCH_LEN];
+	uint64_t h, hmin;
+	ssize_t rbytes;
+	int fd, i;
+
+	if (!S_ISREG(sb->st_mode) || sb->st_size < 8)
+		return (0);
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd == -1)
+		return (0);
+	rbytes = Read(fd, buf, SKETCH_LEN);
+	close(fd);
+	if (rbytes < 8)
+		return (0);
+
+	hmin = UINT64_MAX;
+	for (i = 0; i <= rbytes - 8; i++) {
+		h = U64_P(buf + i) * 0x9E3779B97F4A7C15ULL;
+		if (h < hmin)
+			hmin = h;
+	}
+	return ((uint32_t)(hmin >> 32) | 1);
+}
+
+/*
+ * Give a small member to the training of per-type dictionaries (-y). The type
+ * is found as when archiving, by extension and else by content. Compressed
+ * data and types that go through a filter are not used.
+ */
+static void
+member_tdict_sample(int dfd, const char *name, const char *path, const struct stat *sb)
+{
+#ifdef ENABLE_PC_ZSTD
+	uchar_t buf[SMALL_FILE_SIZE];
+	ssize_t rbytes;
+	int fd, typ;
+
+	if (!S_ISREG(sb->st_mode) || sb->st_size < 8 || sb->st_size > SMALL_FILE_SIZE)
+		return;
+	typ = detect_type_by_ext(path, strlen(path));
+	if (!zstd_tdict_want(typ == TYPE_UNKNOWN ? -1 : typ))
+		return;
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd == -1)
+		return;
+	rbytes = Read(fd, buf, sb->st_size);
+	close(fd);
+	if (rbytes != sb->st_size)
+		return;
+	if (typ == TYPE_UNKNOWN)
+		typ = detect_type_by_data(buf, rbytes);
+	if (typ == TYPE_UNKNOWN || (PC_TYPE(typ) & TYPE_COMPRESSED) ||
+	    typetab[(typ >> 3)].filter_func != NULL)
+		return;
+	zstd_tdict_sample(typ, buf, rbytes);
+#endif
+}
+
 /*
  * Build list of pathnames in a temp file.
  */
 static int
 add_pathname(const char *fpath, const struct stat *sb,
-                    int tflag, struct FTW *ftwbuf)
+                    int tflag, struct FTW *ftwbuf, uint32_t sketch)
 {
 	short len;
 	uchar_t *buf;
@@ -660,24 +1182,17 @@ add_pathname(const char *fpath, const struct stat *sb,
 			struct sort_buf *srt;
 
 			/*
-			 * Sort Buffer is full so sort it. Sorting is done by file extension and size.
+			 * Sort Buffer is full so start another. The buffers are sorted once
+			 * the scan is done. Sorting is done by file extension and size.
 			 * If file has no extension then an algorithm is used, described below.
 			 */
 			srt = (struct sort_buf *)malloc(sizeof (struct sort_buf));
 			if (srt == NULL) {
 				log_msg(LOG_WARN, 0, "Out of memory for sort buffer. Continuing without sorting.");
-				a_state.srt = a_state.head;
-				while (a_state.srt) {
-					struct sort_buf *srt;
-					srt = a_state.srt->next;
-					free(a_state.srt);
-					a_state.srt = srt;
-					goto cont;
-				}
+				sort_bufs_free();
+				goto cont;
 			} else {
-				log_msg(LOG_INFO, 0, "Sorting ...");
 				a_state.srt->max = a_state.srt_pos - 1;
-				qsort(a_state.srt->members, SORT_BUF_SIZE, sizeof (member_entry_t), compare_members);
 				srt->next = NULL;
 				srt->pos = 0;
 				a_state.srt->next = srt;
@@ -694,17 +1209,12 @@ add_pathname(const char *fpath, const struct stat *sb,
 		 */
 		if (a_state.pathlist_size + a_state.bufpos >= UINT_MAX) {
 			log_msg(LOG_WARN, 0, "Too many pathnames. Continuing without sorting.");
-			a_state.srt = a_state.head;
-			while (a_state.srt) {
-				struct sort_buf *srt;
-				srt = a_state.srt->next;
-				free(a_state.srt);
-				a_state.srt = srt;
-				goto cont;
-			}
+			sort_bufs_free();
+			goto cont;
 		}
 		member = &(a_state.srt->members[a_state.srt_pos++]);
 		member->size = sb->st_size;
+		member->sketch = (tflag == FTW_F) ? sketch : 0;
 		member->file_pos = a_state.pathlist_size + a_state.bufpos;
 		dot = strrchr(basename, '.');
 
@@ -810,39 +1320,342 @@ cont:
 }
 
 /*
- * Archiving related functions.
- * This one creates a list of files to be included into the archive and
- * sets up the libarchive context.
+ * Parallel directory walker used in place of nftw(). Threads take directories
+ * from a bounded queue, read all names in a directory and then stat them
+ * relative to the open directory, so paths are not resolved again. The batch
+ * goes to add_pathname() under one lock. Subdirectories that do not fit in
+ * the queue are walked by the thread that found them. A directory is added
+ * only after all directories below it, as with nftw() and FTW_DEPTH, so that
+ * directory permissions can be restored on extraction.
  */
-int
-setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
+#define	WALK_QUEUE_MAX		4096
+#define	WALK_THREADS_MAX	16
+#define	WALK_BATCH		256
+
+struct walk_dir {
+	char *path;
+	int level, base;
+	int pending, unreadable;
+	struct stat sb;
+	struct walk_dir *parent;
+};
+
+struct walk_item {
+	char *path;
+	int base, level, tflag;
+	uint32_t sketch;
+	struct stat sb;
+};
+
+struct walk_state {
+	pthread_mutex_t lock, emit_lock;
+	pthread_cond_t cv;
+	struct walk_dir *queue[WALK_QUEUE_MAX];
+	int qhead, qcount;
+	int done, err, sketch, tdict;
+};
+
+static void
+walk_emit(struct walk_state *ws, struct walk_item *items, int n)
 {
-	char *tmpfile, *tmp;
-	int err, fd;
-	uchar_t *pbuf;
-	struct archive *arc;
-	struct fn_list *fn;
+	struct FTW ftwbuf;
+	int i;
 
-	/*
-	 * If sorting is enabled create the initial sort buffer.
-	 */
-	if (pctx->enable_archive_sort) {
-		struct sort_buf *srt;
-		srt = (struct sort_buf *)malloc(sizeof (struct sort_buf));
-		if (srt == NULL) {
+	pthread_mutex_lock(&ws->emit_lock);
+	for (i = 0; i < n && !ws->err; i++) {
+		ftwbuf.base = items[i].base;
+		ftwbuf.level = items[i].level;
+		if (add_pathname(items[i].path, &items[i].sb, items[i].tflag, &ftwbuf,
+		    items[i].sketch) == -1)
+			ws->err = 1;
+	}
+	pthread_mutex_unlock(&ws->emit_lock);
+	for (i = 0; i < n; i++)
+		free(items[i].path);
+}
+
+/*
+ * Drop one reference on a directory. The last one adds the directory itself
+ * and goes on to the parent. When the top directory is added the walk is done.
+ */
+static void
+walk_release(struct walk_state *ws, struct walk_dir *d)
+{
+	struct walk_dir *parent;
+	struct walk_item it;
+
+	while (d != NULL) {
+		if (__sync_sub_and_fetch(&d->pending, 1) > 0)
+			return;
+		if (!d->unreadable) {
+			it.path = d->path;
+			it.base = d->base;
+			it.level = d->level;
+			it.tflag = FTW_DP;
+			it.sketch = 0;
+			it.sb = d->sb;
+			walk_emit(ws, &it, 1);
+		} else {
+			free(d->path);
+		}
+		parent = d->parent;
+		free(d);
+		d = parent;
+	}
+	pthread_mutex_lock(&ws->lock);
+	ws->done = 1;
+	pthread_cond_broadcast(&ws->cv);
+	pthread_mutex_unlock(&ws->lock);
+}
+
+static void
+walk_dir(struct walk_state *ws, struct walk_dir *d)
+{
+	struct walk_item *items, it;
+	struct walk_dir *sub, **subs;
+	struct dirent *de;
+	int i, n, nsubs, maxsubs, plen;
+	DIR *dp;
+
+	dp = opendir(d->path);
+	items = (struct walk_item *)malloc(WALK_BATCH * sizeof (struct walk_item));
+	if (dp == NULL || items == NULL) {
+		/*
+		 * Unreadable directories are reported but not added, as nftw()
+		 * does with FTW_DNR.
+		 */
+		if (dp != NULL) {
 			log_msg(LOG_ERR, 0, "Out of memory.");
-			return (-1);
+			closedir(dp);
+			ws->err = 1;
+		} else if ((it.path = strdup(d->path)) != NULL) {
+			it.base = d->base;
+			it.level = d->level;
+			it.tflag = FTW_DNR;
+			it.sketch = 0;
+			it.sb = d->sb;
+			walk_emit(ws, &it, 1);
 		}
-		srt->next = NULL;
-		srt->pos = 0;
-		pctx->archive_sort_buf = srt;
+		free(items);
+		d->unreadable = 1;
+		walk_release(ws, d);
+		return;
 	}
 
-	/*
-	 * Create a temporary file to hold the generated list of pathnames to be archived.
-	 * Storing in a file saves memory usage and allows scalability.
-	 */
-	tmpfile = pctx->archive_members_file;
+	plen = strlen(d->path);
+	if (plen > 0 && d->path[plen - 1] == PATHSEP_CHAR)
+		plen--;
+	n = 0;
+	nsubs = 0;
+	maxsubs = 0;
+	subs = NULL;
+	while (!ws->err && (de = readdir(dp)) != NULL) {
+		struct walk_item *ip;
+		char *path;
+		int nlen;
+
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+		nlen = strlen(de->d_name);
+		path = (char *)malloc(plen + nlen + 2);
+		if (path == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			ws->err = 1;
+			break;
+		}
+		memcpy(path, d->path, plen);
+		path[plen] = PATHSEP_CHAR;
+		memcpy(path + plen + 1, de->d_name, nlen + 1);
+
+		ip = &items[n];
+		ip->path = path;
+		ip->base = plen + 1;
+		ip->level = d->level + 1;
+		ip->sketch = 0;
+		if (fstatat(dirfd(dp), de->d_name, &ip->sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			ip->tflag = FTW_NS;
+		} else if (S_ISDIR(ip->sb.st_mode)) {
+			sub = (struct walk_dir *)malloc(sizeof (struct walk_dir));
+			if (sub == NULL || (nsubs == maxsubs &&
+			    (subs = realloc(subs, (maxsubs + 64) * sizeof (sub))) == NULL)) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				free(sub);
+				free(path);
+				ws->err = 1;
+				break;
+			}
+			if (nsubs == maxsubs)
+				maxsubs += 64;
+			sub->path = path;
+			sub->base = ip->base;
+			sub->level = ip->level;
+			sub->sb = ip->sb;
+			sub->pending = 1;
+			sub->unreadable = 0;
+			sub->parent = d;
+			__sync_fetch_and_add(&d->pending, 1);
+			subs[nsubs++] = sub;
+			continue;
+		} else if (S_ISLNK(ip->sb.st_mode)) {
+			ip->tflag = FTW_SL;
+		} else {
+			ip->tflag = FTW_F;
+			if (ws->sketch)
+				ip->sketch = member_sketch(dirfd(dp), de->d_name, &ip->sb);
+			if (ws->tdict)
+				member_tdict_sample(dirfd(dp), de->d_name, path, &ip->sb);
+		}
+		if (++n == WALK_BATCH) {
+			walk_emit(ws, items, n);
+			n = 0;
+		}
+	}
+	closedir(dp);
+	walk_emit(ws, items, n);
+	free(items);
+
+	/*
+	 * Queue the subdirectories for other threads, walk the rest here.
+	 */
+	for (i = 0; i < nsubs; i++) {
+		sub = subs[i];
+		pthread_mutex_lock(&ws->lock);
+		if (ws->qcount < WALK_QUEUE_MAX && !ws->err) {
+			ws->queue[(ws->qhead + ws->qcount) % WALK_QUEUE_MAX] = sub;
+			ws->qcount++;
+			pthread_cond_signal(&ws->cv);
+			sub = NULL;
+		}
+		pthread_mutex_unlock(&ws->lock);
+		if (sub != NULL)
+			walk_dir(ws, sub);
+	}
+	free(subs);
+	walk_release(ws, d);
+}
+
+static void *
+walk_thread(void *dat)
+{
+	struct walk_state *ws = (struct walk_state *)dat;
+	struct walk_dir *d;
+
+	pthread_mutex_lock(&ws->lock);
+	for (;;) {
+		while (ws->qcount == 0 && !ws->done)
+			pthread_cond_wait(&ws->cv, &ws->lock);
+		if (ws->qcount == 0)
+			break;
+		d = ws->queue[ws->qhead];
+		ws->qhead = (ws->qhead + 1) % WALK_QUEUE_MAX;
+		ws->qcount--;
+		pthread_mutex_unlock(&ws->lock);
+		walk_dir(ws, d);
+		pthread_mutex_lock(&ws->lock);
+	}
+	pthread_mutex_unlock(&ws->lock);
+	return (NULL);
+}
+
+/*
+ * Walk the directory tree at path and add all pathnames below it and itself.
+ */
+static int
+walk_tree(pc_ctx_t *pctx, const char *path, struct stat *sb)
+{
+	struct walk_state *ws;
+	struct walk_dir *root;
+	pthread_t threads[WALK_THREADS_MAX];
+	int i, nthreads, err;
+	const char *pos;
+
+	/*
+	 * Metadata access is mostly waiting on the filesystem so use twice
+	 * the processors.
+	 */
+	nthreads = pctx->nthreads;
+	if (nthreads <= 0)
+		nthreads = get_avail_cpus();
+	nthreads *= 2;
+	if (nthreads > WALK_THREADS_MAX)
+		nthreads = WALK_THREADS_MAX;
+
+	ws = (struct walk_state *)calloc(1, sizeof (struct walk_state));
+	root = (struct walk_dir *)malloc(sizeof (struct walk_dir));
+	if (ws == NULL || root == NULL || (root->path = strdup(path)) == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		free(ws);
+		free(root);
+		return (-1);
+	}
+	pos = strrchr(path, PATHSEP_CHAR);
+	root->base = (pos && pos[1] != '\0') ? pos - path + 1 : 0;
+	root->level = 0;
+	root->sb = *sb;
+	root->pending = 1;
+	root->unreadable = 0;
+	root->parent = NULL;
+	pthread_mutex_init(&ws->lock, NULL);
+	pthread_mutex_init(&ws->emit_lock, NULL);
+	pthread_cond_init(&ws->cv, NULL);
+	ws->sketch = (pctx->archive_sim_sort && pctx->enable_archive_sort);
+	ws->tdict = pctx->archive_type_dicts;
+	ws->queue[0] = root;
+	ws->qcount = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, walk_thread, ws) != 0)
+			break;
+	}
+	nthreads = i;
+	if (nthreads == 0)
+		walk_thread(ws);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	err = ws->err ? -1 : 0;
+	pthread_mutex_destroy(&ws->lock);
+	pthread_mutex_destroy(&ws->emit_lock);
+	pthread_cond_destroy(&ws->cv);
+	free(ws);
+	return (err);
+}
+
+/*
+ * Archiving related functions.
+ * This one creates a list of files to be included into the archive and
+ * sets up the libarchive context.
+ */
+int
+setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
+{
+	char *tmpfile, *tmp;
+	int err, fd;
+	uchar_t *pbuf;
+	struct archive *arc;
+	struct fn_list *fn;
+
+	/*
+	 * If sorting is enabled create the initial sort buffer.
+	 */
+	if (pctx->enable_archive_sort) {
+		struct sort_buf *srt;
+		srt = (struct sort_buf *)malloc(sizeof (struct sort_buf));
+		if (srt == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			return (-1);
+		}
+		srt->next = NULL;
+		srt->pos = 0;
+		pctx->archive_sort_buf = srt;
+	}
+
+	/*
+	 * Create a temporary file to hold the generated list of pathnames to be archived.
+	 * Storing in a file saves memory usage and allows scalability.
+	 */
+	tmpfile = pctx->archive_members_file;
 	tmp = get_temp_dir();
 	strcpy(tmpfile, tmp);
 	free(tmp);
@@ -871,6 +1684,10 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 	sbuf->st_size = 0;
 	pctx->archive_size = 0;
 	pctx->archive_members_count = 0;
+	pctx->arc_stream_pos = 0;
+	pctx->midx_len = 0;
+	pctx->midx_count = 0;
+	pctx->midx_end = 0;
 
 	/*
 	 * nftw requires using global state variable. So we lock to be mt-safe.
@@ -900,10 +1717,15 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 		a_state.fcount = 0;
 		if (S_ISDIR(sb.st_mode)) {
 			/*
-			 * Depth-First scan, FTW_DEPTH, is needed to handle restoring
-			 * all directory permissions correctly.
+			 * Depth-First scan, as with nftw() and FTW_DEPTH, is needed to
+			 * handle restoring all directory permissions correctly.
 			 */
-			err = nftw(fn->filename, add_pathname, 1024, FTW_PHYS | FTW_DEPTH);
+			err = walk_tree(pctx, fn->filename, &sb);
+			if (err == -1) {
+				pthread_mutex_unlock(&nftw_mutex);
+				close(fd);  unlink(tmpfile);
+				return (-1);
+			}
 		} else {
 			int tflag;
 			struct FTW ftwbuf;
@@ -922,7 +1744,11 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 				ftwbuf.base = pos - fn->filename + 1;
 			else
 				ftwbuf.base = 0;
-			add_pathname(fn->filename, &sb, tflag, &ftwbuf);
+			add_pathname(fn->filename, &sb, tflag, &ftwbuf,
+			    (pctx->archive_sim_sort && pctx->enable_archive_sort) ?
+			    member_sketch(AT_FDCWD, fn->filename, &sb) : 0);
+			if (pctx->archive_type_dicts)
+				member_tdict_sample(AT_FDCWD, fn->filename, fn->filename, &sb);
 			a_state.arc_size = sb.st_size;
 		}
 		if (a_state.bufpos > 0) {
@@ -940,16 +1766,30 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 		fn = fn->next;
 	}
 
+	pctx->archive_sort_buf = NULL;
 	if (a_state.srt == NULL) {
 		pctx->enable_archive_sort = 0;
 	} else {
 		log_msg(LOG_INFO, 0, "Sorting ...");
 		a_state.srt->max = a_state.srt_pos - 1;
-		qsort(a_state.srt->members, a_state.srt_pos, sizeof (member_entry_t), compare_members);
+		pctx->archive_sort_buf = sort_bufs_merge_init(a_state.head);
+		a_state.srt = a_state.head = NULL;
+		if (pctx->archive_sort_buf == NULL)
+			pctx->enable_archive_sort = 0;
 		pctx->archive_temp_size = a_state.pathlist_size;
 	}
 	pthread_mutex_unlock(&nftw_mutex);
 
+	/*
+	 * Without any trained dictionary the file is written as without -y.
+	 */
+#ifdef ENABLE_PC_ZSTD
+	if (pctx->archive_type_dicts) {
+		pctx->archive_type_dicts = zstd_tdict_train();
+		log_msg(LOG_INFO, 0, "Trained %d type dictionaries.", pctx->archive_type_dicts);
+	}
+#endif
+
 	sbuf->st_size = pctx->archive_size;
 	lseek(fd, 0, SEEK_SET);
 	free(pbuf);
@@ -965,6 +1805,11 @@ setup_archiver(pc_ctx_t *pctx, struct stat *sbuf)
 		return (-1);
 	}
 
+	memset(pctx->arc_slot, 0, sizeof (pctx->arc_slot));
+	pctx->arc_head = pctx->arc_tail = pctx->arc_cur = 0;
+	pthread_mutex_init(&(pctx->arc_lock), NULL);
+	pthread_cond_init(&(pctx->arc_cv), NULL);
+
 	if (pctx->meta_stream)
 		archive_set_metadata_streaming(arc, 1);
 	archive_write_set_format_pax_restricted(arc);
@@ -1014,6 +1859,12 @@ setup_extractor(pc_ctx_t *pctx)
 	if (pctx->meta_stream)
 		archive_set_metadata_streaming(arc, 1);
 	archive_read_support_format_all(arc);
+
+	/*
+	 * Members appended with -U follow the end-of-archive mark of the
+	 * earlier archive stream.
+	 */
+	archive_read_set_format_option(arc, "tar", "read_concatenated_archives", "1");
 	pctx->archive_ctx = arc;
 	pctx->arc_writing = 0;
 
@@ -1023,22 +1874,26 @@ setup_extractor(pc_ctx_t *pctx)
 static ssize_t
 process_by_filter(int fd, int *typ, struct archive *target_arc,
     struct archive *source_arc, struct archive_entry *entry,
-    filter_output_t *fout, int cmp, int level)
+    filter_output_t *fout, int cmp, int level, uchar_t *in_buff)
 {
 	struct filter_info fi;
 	int64_t wrtn;
+	uint64_t t;
 
 	fout->hdr_valid = 1;
 	fi.source_arc = source_arc;
 	fi.target_arc = target_arc;
 	fi.entry = entry;
+	fi.in_buff = in_buff;
 	fi.fd = fd;
 	fi.compressing = cmp;
 	fi.block_size = AW_BLOCK_SIZE;
 	fi.type_ptr = typ;
 	fi.cmp_level = level;
 	fi.fout = fout;
+	t = pc_trace_start();
 	wrtn = (*(typetab[(*typ >> 3)].filter_func))(&fi, typetab[(*typ >> 3)].filter_private);
+	pc_trace_end("filter", t, archive_entry_size(entry));
 	if (wrtn == FILTER_RETURN_ERROR) {
 		log_msg(LOG_ERR, 0, "Warning: Error invoking filter: %s (skipping)",
 		    typetab[(*typ >> 3)].filter_name);
@@ -1069,24 +1924,62 @@ write_header(struct archive *arc, struct archive_entry *entry)
 	return (0);
 }
 
+/*
+ * Filter output bigger than the file, as from the Deflate filter, is stored
+ * with the entry size grown to fit. The file size is kept in an xattr.
+ */
+static void
+filter_entry_size(struct archive_entry *entry, filter_output_t *fout)
+{
+	int64_t sz, fsz;
+	uint64_t le;
+
+	fsz = archive_entry_size(entry);
+	sz = fout->out_size + (fout->hdr_valid ? sizeof (fout->hdr) : 0);
+	if (sz <= fsz)
+		return;
+	le = LE64((uint64_t)fsz);
+	archive_entry_xattr_add_entry(entry, FILTER_SIZE_XATTR_ENTRY, &le, sizeof (le));
+	archive_entry_set_size(entry, sz);
+}
+
 /*
  * Routines to archive members and write the file data to the callback. Portions of
  * the following code is adapted from some of the Libarchive bsdtar code.
  */
 static int
-copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ,
+    filter_job_t *job)
 {
-	size_t sz, offset, len;
+	size_t sz, offset, len, adj;
 	ssize_t bytes_to_write;
 	uchar_t *mapbuf;
-	int rv, fd, typ1;
+	int rv, fd, typ1, sparse;
+	int64_t dstart, dend, slen;
 	const char *fpath;
 	filter_output_t fout;
+	static uchar_t zero_buf[MMAP_SIZE];
+
+	/*
+	 * Small members were read ahead in one go. They skip the filters and are
+	 * written straight from the buffer.
+	 */
+	sz = archive_entry_size(entry);
+	if (job != NULL && job->small && job->sbuf_len == (ssize_t)sz) {
+		if (typ == TYPE_UNKNOWN)
+			pctx->ctype = detect_type_by_data(job->sbuf, sz);
+		if (write_header(arc, entry) == -1)
+			return (-1);
+		if (archive_write_data(arc, job->sbuf, sz) < (ssize_t)sz) {
+			log_msg(LOG_ERR, 0, "Data write error: %s", archive_error_string(arc));
+			return (-1);
+		}
+		return (0);
+	}
 
 	typ1 = typ;
 	offset = 0;
 	rv = 0;
-	sz = archive_entry_size(entry);
 	bytes_to_write = sz;
 	fpath = archive_entry_sourcepath(entry);
 	fd = open(fpath, O_RDONLY);
@@ -1094,20 +1987,36 @@ copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
 		log_msg(LOG_ERR, 1, "Failed to open %s.", fpath);
 		return (-1);
 	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (sz > MMAP_SIZE)
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
 	if (typ != TYPE_UNKNOWN) {
 		if (typetab[(typ >> 3)].filter_func != NULL) {
 			int64_t rv;
 			char *fname = typetab[(typ >> 3)].filter_name;
 
-			pctx->ctype = typ;
-			rv = process_by_filter(fd, &(pctx->ctype), arc, NULL, entry,
-			    &fout, 1, pctx->level);
+			/*
+			 * The filter may already have been run by the filter pool.
+			 */
+			if (job != NULL && job->filtered) {
+				pctx->ctype = job->ctype;
+				rv = job->rv;
+				fout = job->fout;
+				job->fout.out = NULL;
+			} else {
+				pctx->ctype = typ;
+				rv = process_by_filter(fd, &(pctx->ctype), arc, NULL, entry,
+				    &fout, 1, pctx->level, NULL);
+			}
 			if (rv != FILTER_RETURN_SKIP &&
 			    rv != FILTER_RETURN_ERROR) {
 				if (fout.output_type == FILTER_OUTPUT_MEM) {
 					archive_entry_xattr_add_entry(entry, FILTER_XATTR_ENTRY,
 								      fname, strlen(fname));
+					archive_entry_sparse_clear(entry);
+					filter_entry_size(entry, &fout);
 					if (write_header(arc, entry) == -1) {
 						close(fd);
 						return (-1);
@@ -1145,6 +2054,24 @@ copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
 		}
 	}
 
+	/*
+	 * Sparse files only have their data extents mapped. Holes are fed from a
+	 * zero buffer which the pax writer skips without reading. Type detection
+	 * is skipped since the file start may well be a hole.
+	 */
+	sparse = 0;
+	dstart = dend = 0;
+	if (archive_entry_sparse_reset(entry) > 0) {
+		sparse = 1;
+		if (typ == TYPE_UNKNOWN) {
+			if (write_header(arc, entry) == -1) {
+				close(fd);
+				return (-1);
+			}
+			typ = TYPE_COMPRESSED;
+		}
+	}
+
 	/*
 	 * Use mmap for copying file data. Not necessarily for performance, but it saves on
 	 * resident memory use.
@@ -1158,16 +2085,56 @@ copy_file_data(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry,
 			len = bytes_to_write;
 		else
 			len = MMAP_SIZE;
+		adj = 0;
+		if (sparse) {
+			while (sparse && offset >= dend) {
+				if (archive_entry_sparse_next(entry, &dstart, &slen) != ARCHIVE_OK) {
+					dstart = dend = sz;
+					sparse = 0;
+				} else {
+					dend = dstart + slen;
+				}
+			}
+			if (offset < dstart) {
+				if (len > dstart - offset)
+					len = dstart - offset;
+				wrtn = archive_write_data(arc, zero_buf, len);
+				if (wrtn < (ssize_t)len) {
+					log_msg(LOG_ERR, 0, "Data write error: %s",
+					    archive_error_string(arc));
+					rv = -1;
+					break;
+				}
+				offset += len;
+				bytes_to_write -= len;
+				continue;
+			}
+			if (len > dend - offset)
+				len = dend - offset;
+			adj = offset % pctx->pagesize;
+		}
 do_map:
-		mapbuf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
-		if (mapbuf == NULL) {
+		mapbuf = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, fd, offset - adj);
+		if (mapbuf == MAP_FAILED) {
 			/* Mmap failed; this is bad. */
 			log_msg(LOG_ERR, 1, "Mmap failed for %s.", fpath);
 			rv = -1;
 			break;
 		}
+
+		/*
+		 * The window is copied once, straight into the chunk buffer. Have
+		 * it paged in as a whole and the next one read ahead meanwhile.
+		 */
+#ifdef MADV_WILLNEED
+		(void) madvise(mapbuf, len + adj, MADV_WILLNEED);
+#endif
+#ifdef POSIX_FADV_WILLNEED
+		if (bytes_to_write > len)
+			(void) posix_fadvise(fd, offset + len, MMAP_SIZE, POSIX_FADV_WILLNEED);
+#endif
 		offset += len;
-		src = mapbuf;
+		src = mapbuf + adj;
 		wlen = len;
 
 		if (typ == TYPE_UNKNOWN) {
@@ -1180,13 +2147,15 @@ do_map:
 
 					munmap(mapbuf, len);
 					rv = process_by_filter(fd, &(pctx->ctype), arc, NULL, entry,
-					    &fout, 1, pctx->level);
+					    &fout, 1, pctx->level, NULL);
 					if (rv != FILTER_RETURN_SKIP &&
 					    rv != FILTER_RETURN_ERROR) {
 						if (fout.output_type == FILTER_OUTPUT_MEM) {
 							archive_entry_xattr_add_entry(entry,
 										      FILTER_XATTR_ENTRY,
 										      fname, strlen(fname));
+							archive_entry_sparse_clear(entry);
+							filter_entry_size(entry, &fout);
 							if (write_header(arc, entry) == -1) {
 								close(fd);
 								return (-1);
@@ -1247,7 +2216,7 @@ do_map:
 		}
 		bytes_to_write -= wrtn;
 		if (rv == -1) break;
-		munmap(mapbuf, len);
+		munmap(mapbuf, len + adj);
 	}
 	close(fd);
 
@@ -1255,14 +2224,15 @@ do_map:
 }
 
 static int
-write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ)
+write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, int typ,
+    filter_job_t *job)
 {
 	/*
 	 * If entry has data we postpone writing the header till we have
 	 * determined whether the entry type has an associated filter.
 	 */
 	if (archive_entry_size(entry) > 0) {
-		return (copy_file_data(pctx, arc, entry, typ));
+		return (copy_file_data(pctx, arc, entry, typ, job));
 	} else {
 		if (write_header(arc, entry) == -1)
 			return (-1);
@@ -1272,207 +2242,854 @@ write_entry(pc_ctx_t *pctx, struct archive *arc, struct archive_entry *entry, in
 }
 
 /*
- * Thread function. Archive members and write to pipe. The dispatcher thread
- * reads from the other end and compresses.
+ * Media filter worker pool. The archiver thread reads ahead up to 2 members per
+ * worker into a ring of jobs. Members with a filter for their extension type
+ * (packJPG, packPNM, WavPack, Dispack) are converted by the workers while the
+ * archiver writes out earlier members in order. The output of a job is held
+ * in memory till its member is written, the filters' size limits bound that.
  */
-static void *
-archiver_thread_func(void *dat) {
-	pc_ctx_t *pctx = (pc_ctx_t *)dat;
-	char fpath[PATH_MAX], *name, *bnchars = NULL; // Silence compiler
-	int warn, rbytes, fpathlen = 0; // Silence compiler
-	uint32_t ctr;
-	struct archive_entry *entry, *spare_entry, *ent;
-	struct archive *arc, *ard;
-	struct archive_entry_linkresolver *resolver;
-	int readdisk_flags;
+/*
+ * Small regular files are read whole during read-ahead rather than mapped
+ * when written. Links are resolved before this, so a further link to a file
+ * already seen has no data.
+ */
+static int
+small_member(struct archive_entry *entry)
+{
+	return (archive_entry_filetype(entry) == AE_IFREG &&
+	    archive_entry_size(entry) > 0 &&
+	    archive_entry_size(entry) <= SMALL_FILE_SIZE &&
+	    archive_entry_hardlink(entry) == NULL);
+}
 
-	warn = 1;
-	entry = archive_entry_new();
-	arc = (struct archive *)(pctx->archive_ctx);
+static void
+small_read(filter_job_t *job)
+{
+	int fd;
 
-	if ((resolver = archive_entry_linkresolver_new()) != NULL) {
-		archive_entry_linkresolver_set_strategy(resolver, archive_format(arc));
-	} else {
-		log_msg(LOG_WARN, 0, "Cannot create link resolver, hardlinks will be duplicated.");
+	job->sbuf_len = -1;
+	if (job->sbuf == NULL) {
+		job->sbuf = (uchar_t *)malloc(SMALL_FILE_SIZE);
+		if (job->sbuf == NULL)
+			return;
 	}
+	fd = open(job->fpath, O_RDONLY);
+	if (fd == -1)
+		return;
+	job->sbuf_len = Read(fd, job->sbuf, archive_entry_size(job->entry));
+	close(fd);
+}
 
-	ctr = 1;
-	readdisk_flags = ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS;
-	readdisk_flags |= ARCHIVE_READDISK_HONOR_NODUMP;
-
-	ard = archive_read_disk_new();
-	archive_read_disk_set_behavior(ard, readdisk_flags);
-	archive_read_disk_set_standard_lookup(ard);
-	archive_read_disk_set_symlink_physical(ard);
-
-	/*
-	 * Read next path entry from list file. read_next_path() also handles sorted reading.
-	 */
-	while ((rbytes = read_next_path(pctx, fpath, &bnchars, &fpathlen)) != 0) {
-		int typ;
+static void *
+filter_pool_func(void *dat)
+{
+	struct filter_pool *fp = (struct filter_pool *)dat;
+	filter_job_t *job;
+	int fd;
 
-		if (rbytes == -1) break;
-		archive_entry_copy_sourcepath(entry, fpath);
-		if (archive_read_disk_entry_from_file(ard, entry, -1, NULL) != ARCHIVE_OK) {
-			log_msg(LOG_WARN, 1, "archive_read_disk_entry_from_file:\n  %s",
-			    archive_error_string(ard));
-			archive_entry_clear(entry);
+	pthread_mutex_lock(&fp->lock);
+	for (;;) {
+		while (fp->next < fp->tail && fp->jobs[fp->next % fp->nslots].done)
+			fp->next++;
+		if (fp->next == fp->tail) {
+			if (fp->quit)
+				break;
+			pthread_cond_wait(&fp->work_cv, &fp->lock);
 			continue;
 		}
+		job = &fp->jobs[fp->next % fp->nslots];
+		fp->next++;
+		pthread_mutex_unlock(&fp->lock);
 
-		typ = TYPE_UNKNOWN;
-		if (archive_entry_filetype(entry) == AE_IFREG) {
-			if ((typ = detect_type_by_ext(fpath, fpathlen)) != TYPE_UNKNOWN)
-				pctx->ctype = typ;
-		}
-
-		/*
-		 * Strip leading '/' or '../' or '/../' from member name.
-		 */
-		name = fpath;
-		while (name[0] == '/' || name[0] == '\\') {
-			if (warn) {
-				log_msg(LOG_WARN, 0, "Converting absolute paths.");
-				warn = 0;
-			}
-			if (name[1] == '.' && name[2] == '.' && (name[3] == '/' || name[3] == '\\')) {
-				name += 3; /* /.. is removed here and / is removed next. */
-			} else {
-				name += 1;
+		if (job->small) {
+			small_read(job);
+		} else {
+			job->ctype = job->typ;
+			job->rv = FILTER_RETURN_SKIP;
+			fd = open(job->fpath, O_RDONLY);
+			if (fd != -1) {
+				job->rv = process_by_filter(fd, &job->ctype, NULL, NULL,
+				    job->entry, &job->fout, 1, fp->level, NULL);
+				close(fd);
 			}
 		}
 
-#ifndef	__APPLE__
-		/*
-		 * Workaround for libarchive weirdness on Non MAC OS X platforms. The files
-		 * with names matching pattern: ._* are MAC OS X resource forks which contain
-		 * extended attributes, ACLs etc. They should be handled accordingly on MAC
-		 * platforms and treated as normal files on others. For some reason beyond me
-		 * libarchive refuses to extract these files on Linux, no matter what I try.
-		 * Bug?
-		 * 
-		 * In this case the file basename is changed and a custom flag is set to
-		 * indicate extraction to change it back.
-		 */
-		if (bnchars[0] == '.' && bnchars[1] == '_' && archive_entry_filetype(entry) == AE_IFREG) {
-			char *pos = strstr(name, "._");
-			char name[] = "@.", value[] = "m";
-			if (pos) {
-				*pos = '|';
-				archive_entry_xattr_add_entry(entry, name, value, strlen(value));
-			}
-		}
-#endif
+		pthread_mutex_lock(&fp->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&fp->done_cv);
+	}
+	pthread_mutex_unlock(&fp->lock);
+	return (NULL);
+}
+
+/*
+ * Builtin filters are always worth a pool worker. Plugins give a per byte
+ * cost and small members of cheap filters are left to run inline, where
+ * they avoid the handoff.
+ */
+static int
+filter_pool_worth(int typ, int64_t size)
+{
+	unsigned int cost = typetab[(typ >> 3)].cost;
 
-		if (name != archive_entry_pathname(entry))
-			archive_entry_copy_pathname(entry, name);
+	return (cost == 0 || size * cost >= FILTER_POOL_MIN_NS);
+}
 
-		if (archive_entry_filetype(entry) != AE_IFREG) {
-			archive_entry_set_size(entry, 0);
-		} else {
-			archive_entry_set_size(entry, archive_entry_size(entry));
-		}
-		log_msg(LOG_VERBOSE, 0, "%5d/%d %8" PRIu64 " %s", ctr, pctx->archive_members_count,
-		    archive_entry_size(entry), name);
+static struct filter_pool *
+filter_pool_create(pc_ctx_t *pctx)
+{
+	struct filter_pool *fp;
+	int i, nthreads;
 
-		archive_entry_linkify(resolver, &entry, &spare_entry);
-		ent = entry;
-		while (ent != NULL) {
-			if (write_entry(pctx, arc, ent, typ) != 0) {
-				log_msg(LOG_WARN, 1, "Error archiving entry: %s\n%s",
-				    archive_entry_pathname(entry),
-				    archive_error_string(ard));
-				goto done;
-			}
-			ent = spare_entry;
-			spare_entry = NULL;
-		}
-		archive_write_finish_entry(arc);
-		archive_entry_clear(entry);
-		ctr++;
-	}
+	nthreads = pctx->nthreads;
+	if (nthreads <= 0)
+		nthreads = get_avail_cpus();
+	if (nthreads > FILTER_POOL_MAX)
+		nthreads = FILTER_POOL_MAX;
 
-done:
-	if (pctx->temp_mmap_len > 0)
-		munmap(pctx->temp_mmap_buf, pctx->temp_mmap_len);
-	archive_entry_free(entry);
-	archive_entry_linkresolver_free(resolver);
-	archive_read_free(ard);
-	archive_write_free(arc);
-	close(pctx->archive_members_fd);
-	unlink(pctx->archive_members_file);
-	return (NULL);
+	/*
+	 * With no media filters or a single processor the members are filtered
+	 * inline as they are written.
+	 */
+	for (i = 0; i < FILTER_TYPETAB_SIZE; i++) {
+		if (typetab[i].filter_func != NULL)
+			break;
+	}
+	if (i == FILTER_TYPETAB_SIZE || nthreads < 2)
+		nthreads = 0;
+
+	fp = (struct filter_pool *)calloc(1, sizeof (struct filter_pool));
+	if (fp == NULL)
+		return (NULL);
+	fp->nslots = nthreads ? nthreads * 2 : 1;
+	fp->jobs = (filter_job_t *)calloc(fp->nslots, sizeof (filter_job_t));
+	fp->threads = (pthread_t *)calloc(nthreads + 1, sizeof (pthread_t));
+	if (fp->jobs == NULL || fp->threads == NULL) {
+		free(fp->jobs);
+		free(fp->threads);
+		free(fp);
+		return (NULL);
+	}
+	fp->level = pctx->level;
+	pthread_mutex_init(&fp->lock, NULL);
+	pthread_cond_init(&fp->work_cv, NULL);
+	pthread_cond_init(&fp->done_cv, NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&fp->threads[i], NULL, filter_pool_func, fp) != 0)
+			break;
+	}
+	fp->nthreads = i;
+	if (i < nthreads)
+		log_msg(LOG_WARN, 0, "Only %d of %d filter threads started.", i, nthreads);
+	return (fp);
 }
 
-int
-start_archiver(pc_ctx_t *pctx) {
-	return (pthread_create(&(pctx->archive_thread), NULL, archiver_thread_func, (void *)pctx));
+static void
+filter_pool_destroy(struct filter_pool *fp)
+{
+	int i;
+
+	pthread_mutex_lock(&fp->lock);
+	fp->quit = 1;
+	pthread_cond_broadcast(&fp->work_cv);
+	pthread_mutex_unlock(&fp->lock);
+	for (i = 0; i < fp->nthreads; i++)
+		pthread_join(fp->threads[i], NULL);
+
+	for (i = 0; i < fp->nslots; i++) {
+		free(fp->jobs[i].fout.out);
+		free(fp->jobs[i].sbuf);
+		if (fp->jobs[i].entry != NULL)
+			archive_entry_free(fp->jobs[i].entry);
+	}
+	pthread_mutex_destroy(&fp->lock);
+	pthread_cond_destroy(&fp->work_cv);
+	pthread_cond_destroy(&fp->done_cv);
+	free(fp->jobs);
+	free(fp->threads);
+	free(fp);
 }
 
 /*
- * The next two functions are from libArchive source/example:
- * https://github.com/libarchive/libarchive/wiki/Examples#wiki-A_Complete_Extractor
- *
- * We have to use low-level APIs to extract entries to disk. Normally one would use
- * archive_read_extract2() but LibArchive has no option to set user-defined filter
- * routines, so we have to handle here.
+ * Note the archive stream offset where a member starts, for the member index
+ * written with the chunk index. A member ends where the next one starts.
  */
 static int
-copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
-    int typ, pc_ctx_t *pctx)
+member_index_add(pc_ctx_t *pctx, struct archive_entry *entry)
 {
-	int64_t offset;
-	const void *buff;
-	size_t size;
-	int r, ret;
-	filter_output_t fout;
+	const char *name;
+	size_t len;
+	uchar_t *pos;
+
+	name = archive_entry_pathname(entry);
+	len = strlen(name);
+	if (len > 65535)
+		len = 65535;
+	if (pctx->midx_len + len + 10 > pctx->midx_max) {
+		uint64_t nmax;
+
+		nmax = pctx->midx_max ? pctx->midx_max * 2 : 65536;
+		while (nmax < pctx->midx_len + len + 10)
+			nmax *= 2;
+		pos = (uchar_t *)realloc(pctx->midx, nmax);
+		if (pos == NULL)
+			return (-1);
+		pctx->midx = pos;
+		pctx->midx_max = nmax;
+	}
+	pos = pctx->midx + pctx->midx_len;
+	U64_P(pos) = htonll(pctx->arc_stream_pos);
+	U16_P(pos + 8) = htons(len);
+	memcpy(pos + 10, name, len);
+	pctx->midx_len += len + 10;
+	pctx->midx_count++;
+	return (0);
+}
 
-	ret = ARCHIVE_OK;
-	if (typ != TYPE_UNKNOWN) {
-		if (typetab[(typ >> 3)].filter_func != NULL) {
-			int64_t rv;
+/*
+ * Whole-file duplicate detection (-W). Regular files are grouped by size and
+ * a file is only hashed once another file of the same size turns up, so the
+ * first copy of a size is hashed lazily by re-reading it. A repeated file is
+ * archived with no data and an xattr naming the first copy, which extraction
+ * copies from. Files with several links are left to the link resolver.
+ *
+ * Reflinked copies (cp --reflink, clones on Btrfs and XFS) are found before
+ * hashing. Their extent maps from FIEMAP are the same and every extent is
+ * shared, so a hash of the map identifies the data without reading it.
+ */
+#define	DUP_MIN_SIZE		4096
+#define	DUP_HASH_SLOTS		65536
+#define	DUP_CKSUM		CKSUM_BLAKE256
+#define	DUP_CKSUM_BYTES		32
+#define	DUP_EXTENTS		64
 
-			rv = process_by_filter(-1, &typ, aw, ar, entry, &fout, 0, 0);
-			if (rv == FILTER_RETURN_ERROR) {
-				archive_set_error(ar, archive_errno(aw),
-				    "%s", archive_error_string(aw));
-				return (ARCHIVE_FATAL);
-
-			} else if (rv == FILTER_RETURN_SOFT_ERROR ||
-				   rv == FILTER_RETURN_SKIP) {
-				if (rv == FILTER_RETURN_SKIP) {
-					log_msg(LOG_WARN, 0, "Filter function skipped"
-						" for entry: %s.",
-						archive_entry_pathname(entry));
-				} else {
-					log_msg(LOG_WARN, 0, "Filter function failed"
-						" for entry: %s.",
-						archive_entry_pathname(entry));
-				}
-				pctx->errored_count++;
-				if (pctx->err_paths_fd) {
-					fprintf(pctx->err_paths_fd, "%s,%s\n",
-					    archive_entry_pathname(entry),
-					    typetab[(typ >> 3)].filter_name);
+struct dup_ent {
+	uint64_t size;
+	char *name, *src;
+	uchar_t cksum[DUP_CKSUM_BYTES];
+	uchar_t emap[DUP_CKSUM_BYTES];
+	int hashed, mapped;
+	struct dup_ent *next;
+};
+
+struct dup_tab {
+	struct dup_ent *slots[DUP_HASH_SLOTS];
+	uint64_t dups, saved, clones;
+};
+
+/*
+ * Hash the extent map of a file made only of shared extents. Returns 1 with
+ * the hash in emap, or -1 if the file has unshared, inline or not yet
+ * allocated extents, more than DUP_EXTENTS extents, or no FIEMAP support.
+ */
+static int
+dup_map_file(const char *path, uint64_t size, uchar_t *emap)
+{
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+	uint64_t mbuf[(sizeof (struct fiemap) + DUP_EXTENTS *
+	    sizeof (struct fiemap_extent) + 7) / 8];
+	uint64_t map[DUP_EXTENTS * 3 + 1];
+	uchar_t digest[CKSUM_MAX_BYTES];
+	struct fiemap *fm;
+	struct fiemap_extent *fe;
+	struct stat sb;
+	uint32_t i, n;
+	int fd, rv;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+
+	/*
+	 * The extent array follows the header, in a buffer aligned for both.
+	 */
+	memset(mbuf, 0, sizeof (mbuf));
+	fm = (struct fiemap *)mbuf;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_flags = FIEMAP_FLAG_SYNC;
+	fm->fm_extent_count = DUP_EXTENTS;
+	rv = ioctl(fd, FS_IOC_FIEMAP, fm);
+	if (rv != -1)
+		rv = fstat(fd, &sb);
+	close(fd);
+	n = fm->fm_mapped_extents;
+	if (rv == -1 || n == 0 || n > DUP_EXTENTS ||
+	    !(fm->fm_extents[n - 1].fe_flags & FIEMAP_EXTENT_LAST) ||
+	    fm->fm_extents[n - 1].fe_logical + fm->fm_extents[n - 1].fe_length < size)
+		return (-1);
+
+	/*
+	 * Physical offsets are per filesystem, so the device is hashed too.
+	 */
+	map[0] = sb.st_dev;
+	for (i = 0; i < n; i++) {
+		fe = &fm->fm_extents[i];
+		if (!(fe->fe_flags & FIEMAP_EXTENT_SHARED) ||
+		    (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+		    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED)))
+			return (-1);
+		map[i * 3 + 1] = fe->fe_logical;
+		map[i * 3 + 2] = fe->fe_physical;
+		map[i * 3 + 3] = fe->fe_length;
+	}
+	compute_checksum(digest, DUP_CKSUM, (uchar_t *)map, (n * 3 + 1) * sizeof (uint64_t), 0, 0);
+	memcpy(emap, digest, DUP_CKSUM_BYTES);
+	return (1);
+#else
+	return (-1);
+#endif
+}
+
+static int
+dup_hash_file(const char *path, uint64_t size, uchar_t *cksum)
+{
+	uchar_t *buf, digest[CKSUM_MAX_BYTES];
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return (-1);
+	compute_checksum(digest, DUP_CKSUM, buf, size, 0, 0);
+	munmap(buf, size);
+	memcpy(cksum, digest, DUP_CKSUM_BYTES);
+	return (0);
+}
+
+/*
+ * Return the member name of an earlier identical file, or NULL after noting
+ * this file as a possible source for later ones.
+ */
+static const char *
+dup_lookup(struct dup_tab *dt, struct archive_entry *entry)
+{
+	struct dup_ent *de, *ne;
+	const char *src;
+	const void *val;
+	uchar_t cksum[DUP_CKSUM_BYTES], emap[DUP_CKSUM_BYTES];
+	uint64_t size;
+	size_t vsize;
+	int slot, hashed, mapped;
+
+	size = archive_entry_size(entry);
+	if (archive_entry_filetype(entry) != AE_IFREG || size < DUP_MIN_SIZE ||
+	    archive_entry_nlink(entry) > 1 ||
+	    archive_entry_has_xattr(entry, "@.", &val, &vsize))
+		return (NULL);
+
+	src = archive_entry_sourcepath(entry);
+	slot = (size * 0x9E3779B97F4A7C15ULL) >> 48;
+	hashed = 0;
+	mapped = 0;
+	for (de = dt->slots[slot]; de != NULL; de = de->next) {
+		if (de->size != size)
+			continue;
+		if (mapped == 0)
+			mapped = dup_map_file(src, size, emap);
+		if (mapped == 1) {
+			if (de->mapped == 0)
+				de->mapped = dup_map_file(de->src, size, de->emap);
+			if (de->mapped == 1 &&
+			    memcmp(emap, de->emap, DUP_CKSUM_BYTES) == 0) {
+				dt->dups++;
+				dt->clones++;
+				dt->saved += size;
+				return (de->name);
+			}
+		}
+		if (!hashed) {
+			if (dup_hash_file(src, size, cksum) == -1)
+				return (NULL);
+			hashed = 1;
+		}
+		if (!de->hashed) {
+			if (dup_hash_file(de->src, size, de->cksum) == -1)
+				continue;
+			de->hashed = 1;
+		}
+		if (memcmp(cksum, de->cksum, DUP_CKSUM_BYTES) == 0) {
+			dt->dups++;
+			dt->saved += size;
+			return (de->name);
+		}
+	}
+
+	ne = (struct dup_ent *)malloc(sizeof (struct dup_ent));
+	if (ne == NULL)
+		return (NULL);
+	ne->name = strdup(archive_entry_pathname(entry));
+	ne->src = strdup(src);
+	if (ne->name == NULL || ne->src == NULL) {
+		free(ne->name);
+		free(ne->src);
+		free(ne);
+		return (NULL);
+	}
+	ne->size = size;
+	ne->hashed = hashed;
+	if (hashed)
+		memcpy(ne->cksum, cksum, DUP_CKSUM_BYTES);
+	ne->mapped = mapped;
+	if (mapped == 1)
+		memcpy(ne->emap, emap, DUP_CKSUM_BYTES);
+	ne->next = dt->slots[slot];
+	dt->slots[slot] = ne;
+	return (NULL);
+}
+
+static void
+dup_tab_destroy(struct dup_tab *dt)
+{
+	struct dup_ent *de, *next;
+	int i;
+
+	if (dt == NULL)
+		return;
+	if (dt->dups > 0) {
+		log_msg(LOG_INFO, 0, "%" PRIu64 " duplicate files, %" PRIu64
+		    " bytes stored as references, %" PRIu64 " reflinked copies"
+		    " found without reading.", dt->dups, dt->saved, dt->clones);
+	}
+	for (i = 0; i < DUP_HASH_SLOTS; i++) {
+		for (de = dt->slots[i]; de != NULL; de = next) {
+			next = de->next;
+			free(de->name);
+			free(de->src);
+			free(de);
+		}
+	}
+	free(dt);
+}
+
+/*
+ * Libarchive builds the sparse map of a file using FIEMAP which is not available
+ * on all filesystems (tmpfs, NFS etc.). If no map was built and the allocated
+ * blocks hint at holes, build the map by walking the data extents with
+ * SEEK_DATA/SEEK_HOLE.
+ */
+static void
+sparse_map(struct archive_entry *entry, const char *fpath)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	const struct stat *sb;
+	off_t off, data, hole, sz;
+	int fd, extents;
+
+	data = 0;
+
+	sb = archive_entry_stat(entry);
+	sz = archive_entry_size(entry);
+	if (sz < SPARSE_MIN_SIZE || archive_entry_sparse_count(entry) > 0 ||
+	    (off_t)sb->st_blocks * 512 >= sz)
+		return;
+
+	fd = open(fpath, O_RDONLY);
+	if (fd == -1)
+		return;
+	off = 0;
+	extents = 0;
+	while (off < sz) {
+		data = lseek(fd, off, SEEK_DATA);
+		if (data == -1) {
+			/*
+			 * ENXIO means the rest of the file is a hole. Anything else
+			 * means the filesystem does not support this.
+			 */
+			if (errno != ENXIO)
+				extents = -1;
+			break;
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1 || hole > sz) {
+			extents = -1;
+			break;
+		}
+		if (data == 0 && hole == sz)
+			break;
+		archive_entry_sparse_add_entry(entry, data, hole - data);
+		extents++;
+		off = hole;
+	}
+	close(fd);
+
+	if (extents == -1) {
+		archive_entry_sparse_clear(entry);
+	} else if (extents == 0 && off == 0 && data == -1) {
+		/*
+		 * Entirely a hole. A zero-length extent at the end is needed to
+		 * mark the entry sparse.
+		 */
+		archive_entry_sparse_add_entry(entry, sz, 0);
+	}
+#endif
+}
+
+/*
+ * Read the next member path and fill in its entry. Returns 1 if a member was
+ * read, 0 at the end of the list and -1 on error.
+ */
+static int
+prepare_member(pc_ctx_t *pctx, struct archive *ard, filter_job_t *job,
+    struct prefetch *pf, int *warn)
+{
+	char *name, *bnchars = NULL; // Silence compiler
+	int rbytes, fpathlen = 0; // Silence compiler
+	struct archive_entry *entry;
+
+	entry = job->entry;
+	for (;;) {
+		rbytes = prefetch_next_path(pctx, pf, job->fpath, &bnchars, &fpathlen);
+		if (rbytes == 0 || rbytes == -1)
+			return (rbytes);
+		archive_entry_copy_sourcepath(entry, job->fpath);
+		if (archive_read_disk_entry_from_file(ard, entry, -1, NULL) == ARCHIVE_OK)
+			break;
+		log_msg(LOG_WARN, 1, "archive_read_disk_entry_from_file:\n  %s",
+		    archive_error_string(ard));
+		archive_entry_clear(entry);
+	}
+
+	job->typ = TYPE_UNKNOWN;
+	if (archive_entry_filetype(entry) == AE_IFREG)
+		job->typ = detect_type_by_ext(job->fpath, fpathlen);
+
+	/*
+	 * Strip leading '/' or '../' or '/../' from member name.
+	 */
+	name = job->fpath;
+	while (name[0] == '/' || name[0] == '\\') {
+		if (*warn) {
+			log_msg(LOG_WARN, 0, "Converting absolute paths.");
+			*warn = 0;
+		}
+		if (name[1] == '.' && name[2] == '.' && (name[3] == '/' || name[3] == '\\')) {
+			name += 3; /* /.. is removed here and / is removed next. */
+		} else {
+			name += 1;
+		}
+	}
+
+#ifndef	__APPLE__
+	/*
+	 * Workaround for libarchive weirdness on Non MAC OS X platforms. The files
+	 * with names matching pattern: ._* are MAC OS X resource forks which contain
+	 * extended attributes, ACLs etc. They should be handled accordingly on MAC
+	 * platforms and treated as normal files on others. For some reason beyond me
+	 * libarchive refuses to extract these files on Linux, no matter what I try.
+	 * Bug?
+	 * 
+	 * In this case the file basename is changed and a custom flag is set to
+	 * indicate extraction to change it back.
+	 */
+	if (bnchars[0] == '.' && bnchars[1] == '_' && archive_entry_filetype(entry) == AE_IFREG) {
+		char *pos = strstr(name, "._");
+		char name[] = "@.", value[] = "m";
+		if (pos) {
+			*pos = '|';
+			archive_entry_xattr_add_entry(entry, name, value, strlen(value));
+		}
+	}
+#endif
+
+	if (name != archive_entry_pathname(entry))
+		archive_entry_copy_pathname(entry, name);
+
+	if (archive_entry_filetype(entry) != AE_IFREG) {
+		archive_entry_set_size(entry, 0);
+	} else {
+		archive_entry_set_size(entry, archive_entry_size(entry));
+		sparse_map(entry, job->fpath);
+	}
+	return (1);
+}
+
+/*
+ * Thread function. Archive members and write to pipe. The dispatcher thread
+ * reads from the other end and compresses.
+ */
+static void *
+archiver_thread_func(void *dat) {
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+	int warn, rbytes, eof;
+	uint32_t ctr;
+	struct archive_entry *spare_entry, *ent;
+	struct archive *arc, *ard;
+	struct archive_entry_linkresolver *resolver;
+	struct filter_pool *fp;
+	struct prefetch *pf;
+	struct dup_tab *dt;
+	filter_job_t *job;
+	int readdisk_flags;
+
+	warn = 1;
+	dt = NULL;
+	pf = NULL;
+	arc = (struct archive *)(pctx->archive_ctx);
+	pc_trace_thread("archiver");
+
+	if ((resolver = archive_entry_linkresolver_new()) != NULL) {
+		archive_entry_linkresolver_set_strategy(resolver, archive_format(arc));
+	} else {
+		log_msg(LOG_WARN, 0, "Cannot create link resolver, hardlinks will be duplicated.");
+	}
+
+	fp = filter_pool_create(pctx);
+	if (fp == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		goto done;
+	}
+	if (pctx->archive_dup_members) {
+		dt = (struct dup_tab *)calloc(1, sizeof (struct dup_tab));
+		if (dt == NULL)
+			log_msg(LOG_WARN, 0, "Out of memory, not checking for duplicate files.");
+	}
+	pf = prefetch_create(pctx);
+
+	ctr = 1;
+	eof = 0;
+	readdisk_flags = ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS;
+	readdisk_flags |= ARCHIVE_READDISK_HONOR_NODUMP;
+
+	ard = archive_read_disk_new();
+	archive_read_disk_set_behavior(ard, readdisk_flags);
+	archive_read_disk_set_standard_lookup(ard);
+	archive_read_disk_set_symlink_physical(ard);
+
+	for (;;) {
+		/*
+		 * Read ahead next path entries from list file. read_next_path()
+		 * also handles sorted reading. Members that have a filter are
+		 * handed to the filter pool. The members after these are being
+		 * prefetched.
+		 */
+		while (!eof && fp->tail - fp->head < fp->nslots) {
+			job = &fp->jobs[fp->tail % fp->nslots];
+			if (job->entry == NULL)
+				job->entry = archive_entry_new();
+			rbytes = prepare_member(pctx, ard, job, pf, &warn);
+			if (rbytes != 1) {
+				eof = 1;
+				break;
+			}
+
+			/*
+			 * Resolve links before the member is read ahead. A further
+			 * link to a file already archived is written as a hardlink
+			 * with no data, so the pool neither reads nor filters it.
+			 */
+			job->spare = NULL;
+			if (resolver != NULL)
+				archive_entry_linkify(resolver, &job->entry, &job->spare);
+			if (job->entry == NULL)
+				job->entry = job->spare;
+			if (job->entry == NULL) {
+				job->entry = archive_entry_new();
+				continue;
+			}
+			if (dt != NULL) {
+				const char *src = dup_lookup(dt, job->entry);
+
+				if (src != NULL) {
+					archive_entry_xattr_add_entry(job->entry, DUP_XATTR_ENTRY,
+					    src, strlen(src));
+					archive_entry_set_size(job->entry, 0);
+					archive_entry_sparse_clear(job->entry);
+					job->typ = TYPE_UNKNOWN;
 				}
-				ret = ARCHIVE_WARN;
 			}
-			if (fout.output_type == FILTER_OUTPUT_MEM) {
-				int rv;
-				rv = archive_write_data(aw, fout.out, fout.out_size);
-				free(fout.out);
-				if (rv < ret)
-					ret = rv;
-				return (ret);
-			} else {
-				log_msg(LOG_WARN, 0,
-					"Unsupported filter output for entry: %s.",
-					archive_entry_pathname(entry));
-				return (ARCHIVE_FATAL);
+			job->filtered = 0;
+			job->done = 1;
+			job->small = 0;
+			if (small_member(job->entry)) {
+				/*
+				 * Small members are read by the pool workers in
+				 * parallel, or here if there are none.
+				 */
+				job->small = 1;
+				if (fp->nthreads > 0)
+					job->done = 0;
+				else
+					small_read(job);
+			} else if (fp->nthreads > 0 && job->typ != TYPE_UNKNOWN &&
+			    archive_entry_size(job->entry) > 0 &&
+			    typetab[(job->typ >> 3)].filter_func != NULL &&
+			    filter_pool_worth(job->typ, archive_entry_size(job->entry))) {
+				job->filtered = 1;
+				job->done = 0;
+			}
+			pthread_mutex_lock(&fp->lock);
+			fp->tail++;
+			if (!job->done)
+				pthread_cond_signal(&fp->work_cv);
+			pthread_mutex_unlock(&fp->lock);
+		}
+		if (fp->head == fp->tail)
+			break;
+
+		job = &fp->jobs[fp->head % fp->nslots];
+		pthread_mutex_lock(&fp->lock);
+		while (!job->done)
+			pthread_cond_wait(&fp->done_cv, &fp->lock);
+		pthread_mutex_unlock(&fp->lock);
+
+		if (job->typ != TYPE_UNKNOWN)
+			pctx->ctype = job->typ;
+		log_msg(LOG_VERBOSE, 0, "%5d/%d %8" PRIu64 " %s", ctr, pctx->archive_members_count,
+		    archive_entry_size(job->entry), archive_entry_pathname(job->entry));
+
+		/*
+		 * The filter output is only used for the member it was made
+		 * for, a hardlink written in its place gets no data.
+		 */
+		spare_entry = (job->spare != job->entry) ? job->spare : NULL;
+		job->spare = NULL;
+		ent = job->entry;
+		while (ent != NULL) {
+			if (pctx->chunk_index && member_index_add(pctx, ent) != 0) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				archive_read_free(ard);
+				goto done;
 			}
+			if (write_entry(pctx, arc, ent, job->typ, job) != 0) {
+				log_msg(LOG_WARN, 1, "Error archiving entry: %s\n%s",
+				    archive_entry_pathname(ent),
+				    archive_error_string(ard));
+				archive_read_free(ard);
+				goto done;
+			}
+			ent = spare_entry;
+			spare_entry = NULL;
+			job->filtered = 0;
+			job->small = 0;
+		}
+		archive_write_finish_entry(arc);
+		pctx->midx_end = pctx->arc_stream_pos;
+		free(job->fout.out);
+		job->fout.out = NULL;
+		if (job->entry != NULL)
+			archive_entry_clear(job->entry);
+		fp->head++;
+		ctr++;
+	}
+	archive_read_free(ard);
+
+done:
+	if (fp != NULL)
+		filter_pool_destroy(fp);
+	prefetch_destroy(pf);
+	dup_tab_destroy(dt);
+	if (pctx->temp_mmap_len > 0)
+		munmap(pctx->temp_mmap_buf, pctx->temp_mmap_len);
+	archive_entry_linkresolver_free(resolver);
+	archive_write_free(arc);
+	close(pctx->archive_members_fd);
+	unlink(pctx->archive_members_file);
+	return (NULL);
+}
+
+int
+start_archiver(pc_ctx_t *pctx) {
+	return (pthread_create(&(pctx->archive_thread), NULL, archiver_thread_func, (void *)pctx));
+}
+
+/*
+ * Record an entry whose filter skipped or failed while extracting. Filtered
+ * entries are decoded by the extractor and by the writer threads.
+ */
+static pthread_mutex_t filter_err_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+decode_data_failed(struct archive_entry *entry, int typ, pc_ctx_t *pctx, int64_t rv)
+{
+	if (rv == FILTER_RETURN_SKIP) {
+		log_msg(LOG_WARN, 0, "Filter function skipped"
+			" for entry: %s.",
+			archive_entry_pathname(entry));
+	} else {
+		log_msg(LOG_WARN, 0, "Filter function failed"
+			" for entry: %s.",
+			archive_entry_pathname(entry));
+	}
+	pthread_mutex_lock(&filter_err_lock);
+	pctx->errored_count++;
+	if (pctx->err_paths_fd) {
+		fprintf(pctx->err_paths_fd, "%s,%s\n",
+		    archive_entry_pathname(entry),
+		    typetab[(typ >> 3)].filter_name);
+	}
+	pthread_mutex_unlock(&filter_err_lock);
+}
+
+/*
+ * Decode a filtered entry into memory. The output is returned in fout and
+ * must be freed by the caller unless ARCHIVE_FATAL is returned. The stored
+ * data is read from ar, or taken from in_buff if that is given.
+ */
+static int
+decode_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
+    int typ, pc_ctx_t *pctx, filter_output_t *fout, uchar_t *in_buff)
+{
+	int64_t rv;
+	int ret;
+
+	ret = ARCHIVE_OK;
+	rv = process_by_filter(-1, &typ, aw, ar, entry, fout, 0, 0, in_buff);
+	if (rv == FILTER_RETURN_ERROR) {
+		if (ar != NULL) {
+			archive_set_error(ar, archive_errno(aw),
+			    "%s", archive_error_string(aw));
+		}
+		return (ARCHIVE_FATAL);
+
+	} else if (rv == FILTER_RETURN_SOFT_ERROR ||
+		   rv == FILTER_RETURN_SKIP) {
+		decode_data_failed(entry, typ, pctx, rv);
+		ret = ARCHIVE_WARN;
+	}
+	if (fout->output_type != FILTER_OUTPUT_MEM) {
+		log_msg(LOG_WARN, 0,
+			"Unsupported filter output for entry: %s.",
+			archive_entry_pathname(entry));
+		return (ARCHIVE_FATAL);
+	}
+	return (ret);
+}
+
+/*
+ * The next two functions are from libArchive source/example:
+ * https://github.com/libarchive/libarchive/wiki/Examples#wiki-A_Complete_Extractor
+ *
+ * We have to use low-level APIs to extract entries to disk. Normally one would use
+ * archive_read_extract2() but LibArchive has no option to set user-defined filter
+ * routines, so we have to handle here.
+ */
+static int
+copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entry,
+    int typ, pc_ctx_t *pctx)
+{
+	int64_t offset;
+	const void *buff;
+	size_t size;
+	int r, ret;
+	filter_output_t fout;
+
+	if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_func != NULL) {
+		ret = decode_data_out(ar, aw, entry, typ, pctx, &fout, NULL);
+		if (ret != ARCHIVE_FATAL) {
+			int rv;
+			rv = archive_write_data(aw, fout.out, fout.out_size);
+			free(fout.out);
+			if (rv < ret)
+				ret = rv;
 		}
+		return (ret);
 	}
 
+	ret = ARCHIVE_OK;
+
 	for (;;) {
 		r = archive_read_data_block(ar, &buff, &size, &offset);
 		if (r == ARCHIVE_EOF)
@@ -1491,104 +3108,826 @@ copy_data_out(struct archive *ar, struct archive *aw, struct archive_entry *entr
 	return (ret);
 }
 
+/*
+ * If the entry is tagged with our custom xattr we get the filter which
+ * processed it and return the proper type tag.
+ */
 static int
-archive_extract_entry(struct archive *a, struct archive_entry *entry,
-    struct archive *ad, int typ, pc_ctx_t *pctx)
+extract_entry_type(struct archive_entry *entry, int typ)
 {
-	int r, r2;
 	char *filter_name;
 	size_t name_size;
 
-	/*
-	 * If the entry is tagged with our custom xattr we get the filter which
-	 * processed it and set the proper type tag.
-	 */
 	if (archive_entry_has_xattr(entry, FILTER_XATTR_ENTRY,
 	    (const void **)&filter_name, &name_size))
 	{
 		typ = type_tag_from_filter_name(typetab, filter_name, name_size);
+		if (typ == TYPE_UNKNOWN) {
+			log_msg(LOG_WARN, 0, "Filter %.*s for %s is not available, "
+			    "check PCOMPRESS_FILTER_PLUGINS.", (int)name_size, filter_name,
+			    archive_entry_pathname(entry));
+		}
 		archive_entry_xattr_delete_entry(entry, FILTER_XATTR_ENTRY);
 	}
-	r = archive_write_header(ad, entry);
-	if (r < ARCHIVE_WARN)
-		r = ARCHIVE_WARN;
-	if (r != ARCHIVE_OK) {
-		/* If _write_header failed, copy the error. */
-		archive_copy_error(a, ad);
-	} else if (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
-		/* Otherwise, pour data into the entry. */
-		r = copy_data_out(a, ad, entry, typ, pctx);
+	return (typ);
+}
+
+/*
+ * Get the file size of an entry stored bigger by its filter and drop the
+ * tag. Returns -1 for other entries.
+ */
+static int64_t
+extract_entry_file_size(struct archive_entry *entry)
+{
+	const void *val;
+	size_t size;
+	int64_t fsz;
+
+	if (!archive_entry_has_xattr(entry, FILTER_SIZE_XATTR_ENTRY, &val, &size))
+		return (-1);
+	fsz = -1;
+	if (size == sizeof (uint64_t))
+		fsz = LE64(U64_P(val));
+	archive_entry_xattr_delete_entry(entry, FILTER_SIZE_XATTR_ENTRY);
+	return (fsz);
+}
+
+/*
+ * Tell if the entry was processed by a filter, without consuming the tag.
+ */
+static int
+extract_entry_filtered(struct archive_entry *entry)
+{
+	const void *val;
+	size_t size;
+
+	return (archive_entry_has_xattr(entry, FILTER_XATTR_ENTRY, &val, &size));
+}
+
+/*
+ * Tell if the entry is a duplicate file stored as a reference (-W).
+ */
+static int
+extract_entry_is_dup(struct archive_entry *entry)
+{
+	const void *val;
+	size_t size;
+
+	return (archive_entry_has_xattr(entry, DUP_XATTR_ENTRY, &val, &size));
+}
+
+/*
+ * Fill in the data of a duplicate file from the copy extracted earlier. The
+ * disk writer copies file to file, in the kernel where possible.
+ */
+static int
+copy_dup_data(struct archive *ar, struct archive *aw, const char *src, int64_t size)
+{
+	int64_t cbytes;
+	int fd;
+
+	fd = open(src, O_RDONLY);
+	if (fd == -1) {
+		archive_set_error(ar, errno, "Cannot read duplicate source %s", src);
+		return (ARCHIVE_WARN);
+	}
+	cbytes = archive_write_disk_copy_fd(aw, fd, size);
+	close(fd);
+	if (cbytes < 0) {
+		archive_copy_error(ar, aw);
+		return (ARCHIVE_WARN);
+	}
+	if (cbytes < size) {
+		archive_set_error(ar, EIO, "Short read of duplicate source %s", src);
+		return (ARCHIVE_WARN);
+	}
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Deferred file metadata (PCOMPRESS_EXTRACT_BATCH). Regular files are written
+ * by disk writers that do not set owner, mode or times. These are queued once
+ * the file is written and set by a helper thread in batches, by path, while
+ * extraction goes on. On network filesystems each of those calls is a round
+ * trip that would otherwise be paid in turn for every file. Files with ACLs or
+ * file flags keep the normal path, since a later chmod would change the ACL
+ * mask and an immutable flag would block it. Directories are already fixed up
+ * at the end by libarchive. The filesystem is synced once when done.
+ */
+#define	META_DEFERRED	(ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME)
+
+typedef struct meta_job {
+	char *path;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	struct timespec ts[2];
+	struct meta_job *next;
+} meta_job_t;
+
+struct meta_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv;
+	meta_job_t *head, *tail;
+	int flags, quit;
+	uint64_t count, failed;
+	pthread_t thread;
+};
+
+static void
+meta_apply(struct meta_pool *mp, meta_job_t *mj)
+{
+	int err;
+
+	/*
+	 * Owner first, chown clears the set-id bits.
+	 */
+	err = 0;
+	if ((mp->flags & ARCHIVE_EXTRACT_OWNER) &&
+	    fchownat(AT_FDCWD, mj->path, mj->uid, mj->gid, AT_SYMLINK_NOFOLLOW) == -1)
+		err = 1;
+	if ((mp->flags & ARCHIVE_EXTRACT_PERM) &&
+	    fchmodat(AT_FDCWD, mj->path, mj->mode & 07777, 0) == -1)
+		err = 1;
+	if ((mp->flags & ARCHIVE_EXTRACT_TIME) &&
+	    utimensat(AT_FDCWD, mj->path, mj->ts, AT_SYMLINK_NOFOLLOW) == -1)
+		err = 1;
+	if (err) {
+		log_msg(LOG_WARN, 1, "%s: Cannot restore metadata.", mj->path);
+		mp->failed++;
+	}
+}
+
+static void *
+meta_pool_func(void *dat)
+{
+	struct meta_pool *mp = (struct meta_pool *)dat;
+	meta_job_t *mj, *next;
+
+	pthread_mutex_lock(&mp->lock);
+	for (;;) {
+		while (mp->head == NULL && !mp->quit)
+			pthread_cond_wait(&mp->work_cv, &mp->lock);
+		if (mp->head == NULL)
+			break;
+
+		/*
+		 * Take all queued files as one batch.
+		 */
+		mj = mp->head;
+		mp->head = mp->tail = NULL;
+		pthread_mutex_unlock(&mp->lock);
+		for (; mj != NULL; mj = next) {
+			next = mj->next;
+			meta_apply(mp, mj);
+			free(mj->path);
+			free(mj);
+		}
+		pthread_mutex_lock(&mp->lock);
+	}
+	pthread_mutex_unlock(&mp->lock);
+	return (NULL);
+}
+
+/*
+ * Start the metadata helper if PCOMPRESS_EXTRACT_BATCH is set. Flags are the
+ * disk writer flags, of which the deferred ones are applied by the helper.
+ */
+static struct meta_pool *
+meta_pool_create(int flags)
+{
+	struct meta_pool *mp;
+	char *val;
+
+	val = getenv("PCOMPRESS_EXTRACT_BATCH");
+	if (val == NULL || atoi(val) == 0)
+		return (NULL);
+	mp = (struct meta_pool *)calloc(1, sizeof (struct meta_pool));
+	if (mp == NULL)
+		return (NULL);
+	mp->flags = flags & META_DEFERRED;
+	pthread_mutex_init(&mp->lock, NULL);
+	pthread_cond_init(&mp->work_cv, NULL);
+	if (pthread_create(&mp->thread, NULL, meta_pool_func, mp) != 0) {
+		log_msg(LOG_WARN, 0, "Cannot start metadata thread, not batching.");
+		pthread_mutex_destroy(&mp->lock);
+		pthread_cond_destroy(&mp->work_cv);
+		free(mp);
+		return (NULL);
+	}
+	return (mp);
+}
+
+/*
+ * Apply all queued metadata, then sync the filesystem extracted to once.
+ */
+static void
+meta_pool_destroy(struct meta_pool *mp)
+{
+	int fd;
+
+	if (mp == NULL)
+		return;
+	pthread_mutex_lock(&mp->lock);
+	mp->quit = 1;
+	pthread_cond_signal(&mp->work_cv);
+	pthread_mutex_unlock(&mp->lock);
+	pthread_join(mp->thread, NULL);
+
+#if defined(__linux__) && defined(SYS_syncfs)
+	fd = open(".", O_RDONLY);
+	if (fd != -1) {
+		(void) syscall(SYS_syncfs, fd);
+		close(fd);
+	}
+#else
+	fd = -1;
+	sync();
+#endif
+	log_msg(LOG_VERBOSE, 0, "Metadata of %" PRIu64 " files set in batches, %"
+	    PRIu64 " failed.", mp->count, mp->failed);
+	pthread_mutex_destroy(&mp->lock);
+	pthread_cond_destroy(&mp->work_cv);
+	free(mp);
+}
+
+/*
+ * Tell if the metadata of an entry is set by the helper.
+ */
+static int
+meta_deferred(struct meta_pool *mp, struct archive_entry *entry)
+{
+	unsigned long set, clr;
+
+	if (mp == NULL || archive_entry_filetype(entry) != AE_IFREG ||
+	    archive_entry_hardlink(entry) != NULL)
+		return (0);
+	archive_entry_fflags(entry, &set, &clr);
+	return (set == 0 && archive_entry_acl_count(entry,
+	    ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT |
+	    ARCHIVE_ENTRY_ACL_TYPE_NFS4) == 0);
+}
+
+/*
+ * Queue the metadata of a file just written by the disk writer ad. Owner
+ * names are looked up the way the disk writer does.
+ */
+static void
+meta_add(struct meta_pool *mp, struct archive *ad, struct archive_entry *entry)
+{
+	meta_job_t *mj;
+
+	mj = (meta_job_t *)malloc(sizeof (meta_job_t));
+	if (mj == NULL || (mj->path = strdup(archive_entry_pathname(entry))) == NULL) {
+		free(mj);
+		log_msg(LOG_WARN, 0, "%s: Out of memory, metadata not restored.",
+		    archive_entry_pathname(entry));
+		return;
+	}
+	mj->uid = archive_write_disk_uid(ad, archive_entry_uname(entry),
+	    archive_entry_uid(entry));
+	mj->gid = archive_write_disk_gid(ad, archive_entry_gname(entry),
+	    archive_entry_gid(entry));
+	mj->mode = archive_entry_mode(entry);
+	if (archive_entry_atime_is_set(entry)) {
+		mj->ts[0].tv_sec = archive_entry_atime(entry);
+		mj->ts[0].tv_nsec = archive_entry_atime_nsec(entry);
+	} else {
+		mj->ts[0].tv_sec = 0;
+		mj->ts[0].tv_nsec = UTIME_NOW;
+	}
+	if (archive_entry_mtime_is_set(entry)) {
+		mj->ts[1].tv_sec = archive_entry_mtime(entry);
+		mj->ts[1].tv_nsec = archive_entry_mtime_nsec(entry);
+	} else {
+		mj->ts[1].tv_sec = 0;
+		mj->ts[1].tv_nsec = UTIME_NOW;
+	}
+	mj->next = NULL;
+
+	pthread_mutex_lock(&mp->lock);
+	if (mp->tail)
+		mp->tail->next = mj;
+	else
+		mp->head = mj;
+	mp->tail = mj;
+	mp->count++;
+	pthread_cond_signal(&mp->work_cv);
+	pthread_mutex_unlock(&mp->lock);
+}
+
+/*
+ * Extract one entry with the disk writer ad. If mp is given, ad does not set
+ * the deferred metadata and it is queued on mp instead.
+ */
+static int
+archive_extract_entry(struct archive *a, struct archive_entry *entry,
+    struct archive *ad, int typ, pc_ctx_t *pctx, struct meta_pool *mp)
+{
+	int r, r2, nosrc, hdr_ok, decoded;
+	char src[PATH_MAX];
+	const void *val;
+	size_t size;
+	filter_output_t fout;
+
+	typ = extract_entry_type(entry, typ);
+
+	/*
+	 * An entry stored bigger than the file is decoded first, so that the
+	 * header is written with the file size.
+	 */
+	decoded = 0;
+	if (extract_entry_file_size(entry) != -1 && typ != TYPE_UNKNOWN &&
+	    typetab[(typ >> 3)].filter_func != NULL) {
+		r = decode_data_out(a, ad, entry, typ, pctx, &fout, NULL);
+		if (r == ARCHIVE_FATAL)
+			return (r);
+		archive_entry_set_size(entry, fout.out_size);
+		decoded = 1;
+	}
+
+	/*
+	 * A duplicate gets the size of its source so that the disk writer
+	 * accepts the data copied in.
+	 */
+	src[0] = '\0';
+	nosrc = 0;
+	if (archive_entry_has_xattr(entry, DUP_XATTR_ENTRY, &val, &size)) {
+		struct stat sb;
+
+		if (size < PATH_MAX) {
+			memcpy(src, val, size);
+			src[size] = '\0';
+		}
+		archive_entry_xattr_delete_entry(entry, DUP_XATTR_ENTRY);
+		if (src[0] != '\0' && lstat(src, &sb) == 0 && S_ISREG(sb.st_mode)) {
+			archive_entry_set_size(entry, sb.st_size);
+		} else {
+			src[0] = '\0';
+			nosrc = 1;
+		}
+	}
+	r = archive_write_header(ad, entry);
+	if (r < ARCHIVE_WARN)
+		r = ARCHIVE_WARN;
+	hdr_ok = (r == ARCHIVE_OK);
+	if (r != ARCHIVE_OK) {
+		/* If _write_header failed, copy the error. */
+		archive_copy_error(a, ad);
+	} else if (decoded) {
+		if (archive_write_data(ad, fout.out, fout.out_size) < (ssize_t)fout.out_size)
+			r = ARCHIVE_WARN;
+	} else if (src[0] != '\0') {
+		r = copy_dup_data(a, ad, src, archive_entry_size(entry));
+	} else if (nosrc) {
+		archive_set_error(a, ENOENT, "Source of duplicate file not extracted");
+		r = ARCHIVE_WARN;
+	} else if (!archive_entry_size_is_set(entry) || archive_entry_size(entry) > 0) {
+		/* Otherwise, pour data into the entry. */
+		r = copy_data_out(a, ad, entry, typ, pctx);
+	}
+	r2 = archive_write_finish_entry(ad);
+	if (r2 < ARCHIVE_WARN)
+		r2 = ARCHIVE_WARN;
+	/* Use the first message. */
+	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
+		archive_copy_error(a, ad);
+	/* Use the worst error return. */
+	if (r2 < r)
+		r = r2;
+	if (mp != NULL && hdr_ok)
+		meta_add(mp, ad, entry);
+	if (decoded)
+		free(fout.out);
+	return (r);
+}
+
+static int
+copy_data_skip(struct archive *ar, struct archive_entry *entry, int typ)
+{
+	int64_t offset;
+	const void *buff;
+	size_t size;
+	int r;
+
+	for (;;) {
+		r = archive_read_data_block(ar, &buff, &size, &offset);
+		if (r == ARCHIVE_EOF)
+			return (ARCHIVE_OK);
+		if (r != ARCHIVE_OK)
+			return (r);
+	}
+	return (ARCHIVE_OK);
+}
+
+static int
+archive_list_entry(struct archive *a, struct archive_entry *entry, int typ)
+{
+	time_t tm;
+	int tm_is_set = 0;
+	char strtm[13];
+
+	if (archive_entry_mtime_is_set(entry)) {
+		tm = archive_entry_mtime(entry);
+		tm_is_set = 1;
+
+	} else if (archive_entry_atime_is_set(entry)) {
+		tm = archive_entry_atime(entry);
+		tm_is_set = 1;
+
+	} else if (archive_entry_ctime_is_set(entry)) {
+		tm = archive_entry_ctime(entry);
+		tm_is_set = 1;
+
+	} else if (archive_entry_birthtime_is_set(entry)) {
+		tm = archive_entry_birthtime(entry);
+		tm_is_set = 1;
+	}
+
+	if (!tm_is_set) {
+		strcpy(strtm, "N/A");
+	} else {
+		if (strftime(strtm, sizeof (strtm), "%b %e %G", localtime(&tm)) == 0)
+			strcpy(strtm, "N/A");
+	}
+
+	if (archive_entry_size_is_set(entry)) {
+		int64_t sz = archive_entry_size(entry);
+		int64_t fsz = extract_entry_file_size(entry);
+
+		printf("%12" PRId64 " %13s %s\n", fsz != -1 ? fsz : sz, strtm,
+		    archive_entry_pathname(entry));
+		if (sz > 0)
+			return (copy_data_skip(a, entry, typ));
+	} else {
+		printf("%12" PRId64 " %13s %s\n", 0LL, strtm, archive_entry_pathname(entry));
+	}
+	return (ARCHIVE_OK);
+}
+
+/*
+ * Extraction of small regular files is handed to a pool of writer threads,
+ * each with its own disk writer, so that the open/write/close/utimes latency
+ * of many files overlaps. The data is read by the extractor thread as before, so
+ * members are still read in archive order. Filtered files (packJPG, packPNM,
+ * WavPack, Dispack) are also decoded by the writer threads from the data read,
+ * since decoding is CPU heavy and would otherwise serialize extraction. These
+ * are queued up to the size limit of the filters. Larger files,
+ * directories, symlinks and other special files are written by the extractor
+ * thread itself. Directory permissions and times are set when the extractor's
+ * own writer is freed, after all writer threads finish. A hardlink waits until
+ * all queued files are written, since its target must exist.
+ */
+#define	EXTRACT_WRITERS_MAX	16
+#define	EXTRACT_ASYNC_MAX	(4 * 1024 * 1024)
+#define	EXTRACT_DECODE_MAX	(256 * 1024 * 1024)
+#define	EXTRACT_QUEUE_BYTES	(64 * 1024 * 1024)
+
+typedef struct extract_job {
+	struct archive_entry *entry;
+	uchar_t *data;
+	int64_t len, qlen;
+	uint32_t ctr;
+	int typ;
+	struct extract_job *next;
+} extract_job_t;
+
+struct extract_pool;
+
+struct extract_writer {
+	struct extract_pool *ep;
+	struct archive *awd;
+	pthread_t thread;
+};
+
+struct extract_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv, space_cv;
+	extract_job_t *head, *tail;
+	int64_t queued_bytes;
+	int busy, quit, fatal, nthreads;
+	pc_ctx_t *pctx;
+	struct meta_pool *mp;
+	struct extract_writer w[EXTRACT_WRITERS_MAX];
+};
+
+/*
+ * Decode the stored data of a filtered file in place of the job's data.
+ */
+static int
+extract_decode_job(pc_ctx_t *pctx, extract_job_t *job)
+{
+	filter_output_t fout;
+	int r;
+
+	r = decode_data_out(NULL, NULL, job->entry, job->typ, pctx, &fout, job->data);
+	if (r == ARCHIVE_FATAL) {
+		log_msg(LOG_ERR, 0, "%s: Filter decoding failed.",
+		    archive_entry_pathname(job->entry));
+		return (r);
+	}
+	free(job->data);
+	job->data = fout.out;
+	job->len = fout.out_size;
+	if (extract_entry_file_size(job->entry) != -1)
+		archive_entry_set_size(job->entry, fout.out_size);
+	return (r);
+}
+
+static int
+extract_write_job(struct archive *awd, extract_job_t *job, struct meta_pool *mp)
+{
+	int r, r2, hdr_ok;
+
+	r = archive_write_header(awd, job->entry);
+	if (r < ARCHIVE_WARN)
+		r = ARCHIVE_WARN;
+	hdr_ok = (r == ARCHIVE_OK);
+	if (r == ARCHIVE_OK && job->len > 0) {
+		if (archive_write_data(awd, job->data, job->len) < job->len)
+			r = ARCHIVE_WARN;
+	}
+	r2 = archive_write_finish_entry(awd);
+	if (mp != NULL && hdr_ok)
+		meta_add(mp, awd, job->entry);
+	if (r2 < ARCHIVE_WARN)
+		r2 = ARCHIVE_WARN;
+	if (r2 < r)
+		r = r2;
+	if (r != ARCHIVE_OK) {
+		log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(job->entry),
+		    archive_error_string(awd));
+	} else {
+		log_msg(LOG_VERBOSE, 0, "%5d %8" PRIu64 " %s", job->ctr,
+		    archive_entry_size(job->entry), archive_entry_pathname(job->entry));
+	}
+	return (r);
+}
+
+static void *
+extract_pool_func(void *dat)
+{
+	struct extract_writer *w = (struct extract_writer *)dat;
+	struct extract_pool *ep = w->ep;
+	extract_job_t *job;
+	int r, r2;
+
+	pthread_mutex_lock(&ep->lock);
+	for (;;) {
+		while (ep->head == NULL && !ep->quit)
+			pthread_cond_wait(&ep->work_cv, &ep->lock);
+		if (ep->head == NULL)
+			break;
+		job = ep->head;
+		ep->head = job->next;
+		if (ep->head == NULL)
+			ep->tail = NULL;
+		ep->busy++;
+		pthread_mutex_unlock(&ep->lock);
+
+		r = ARCHIVE_OK;
+		if (job->typ != TYPE_UNKNOWN)
+			r = extract_decode_job(ep->pctx, job);
+		if (r != ARCHIVE_FATAL) {
+			r2 = extract_write_job(w->awd, job, ep->mp);
+			if (r2 < r)
+				r = r2;
+		}
+
+		pthread_mutex_lock(&ep->lock);
+		if (r == ARCHIVE_FATAL)
+			ep->fatal = 1;
+		ep->queued_bytes -= job->qlen;
+		ep->busy--;
+		pthread_cond_broadcast(&ep->space_cv);
+		archive_entry_free(job->entry);
+		free(job->data);
+		free(job);
+	}
+	pthread_mutex_unlock(&ep->lock);
+	return (NULL);
+}
+
+static struct extract_pool *
+extract_pool_create(pc_ctx_t *pctx, int flags, struct meta_pool *mp)
+{
+	struct extract_pool *ep;
+	int i, nthreads;
+
+	/*
+	 * Writers mostly wait on the filesystem so use twice the processors.
+	 */
+	nthreads = pctx->nthreads;
+	if (nthreads <= 0)
+		nthreads = get_avail_cpus();
+	nthreads *= 2;
+	if (nthreads > EXTRACT_WRITERS_MAX)
+		nthreads = EXTRACT_WRITERS_MAX;
+
+	ep = (struct extract_pool *)calloc(1, sizeof (struct extract_pool));
+	if (ep == NULL)
+		return (NULL);
+	ep->pctx = pctx;
+	ep->mp = mp;
+	if (mp != NULL)
+		flags &= ~META_DEFERRED;
+	pthread_mutex_init(&ep->lock, NULL);
+	pthread_cond_init(&ep->work_cv, NULL);
+	pthread_cond_init(&ep->space_cv, NULL);
+	for (i = 0; i < nthreads; i++) {
+		ep->w[i].ep = ep;
+		ep->w[i].awd = archive_write_disk_new();
+		if (ep->w[i].awd == NULL)
+			break;
+		archive_write_disk_set_options(ep->w[i].awd, flags);
+		archive_write_disk_set_standard_lookup(ep->w[i].awd);
+		if (pthread_create(&ep->w[i].thread, NULL, extract_pool_func, &ep->w[i]) != 0) {
+			archive_write_free(ep->w[i].awd);
+			break;
+		}
+	}
+	ep->nthreads = i;
+	if (ep->nthreads == 0) {
+		pthread_mutex_destroy(&ep->lock);
+		pthread_cond_destroy(&ep->work_cv);
+		pthread_cond_destroy(&ep->space_cv);
+		free(ep);
+		return (NULL);
 	}
-	r2 = archive_write_finish_entry(ad);
-	if (r2 < ARCHIVE_WARN)
-		r2 = ARCHIVE_WARN;
-	/* Use the first message. */
-	if (r2 != ARCHIVE_OK && r == ARCHIVE_OK)
-		archive_copy_error(a, ad);
-	/* Use the worst error return. */
-	if (r2 < r)
-		r = r2;
-	return (r);
+	return (ep);
 }
 
+/*
+ * Queue a file for the writers. Waits while too much data is queued. The
+ * data is decoded first if typ names a filter.
+ */
 static int
-copy_data_skip(struct archive *ar, struct archive_entry *entry, int typ)
+extract_pool_add(struct extract_pool *ep, struct archive_entry *entry,
+    uchar_t *data, int64_t len, uint32_t ctr, int typ)
 {
-	int64_t offset;
-	const void *buff;
-	size_t size;
-	int r;
+	extract_job_t *job;
 
-	for (;;) {
-		r = archive_read_data_block(ar, &buff, &size, &offset);
-		if (r == ARCHIVE_EOF)
-			return (ARCHIVE_OK);
-		if (r != ARCHIVE_OK)
-			return (r);
+	job = (extract_job_t *)malloc(sizeof (extract_job_t));
+	if (job == NULL || (job->entry = archive_entry_clone(entry)) == NULL) {
+		free(job);
+		free(data);
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (ARCHIVE_FATAL);
 	}
+	job->data = data;
+	job->len = len;
+	job->qlen = len;
+	job->ctr = ctr;
+	job->typ = typ;
+	job->next = NULL;
+
+	pthread_mutex_lock(&ep->lock);
+	while (ep->queued_bytes > 0 && ep->queued_bytes + len > EXTRACT_QUEUE_BYTES)
+		pthread_cond_wait(&ep->space_cv, &ep->lock);
+	ep->queued_bytes += len;
+	if (ep->tail)
+		ep->tail->next = job;
+	else
+		ep->head = job;
+	ep->tail = job;
+	pthread_cond_signal(&ep->work_cv);
+	pthread_mutex_unlock(&ep->lock);
 	return (ARCHIVE_OK);
 }
 
+/*
+ * Wait till all queued files are written.
+ */
 static int
-archive_list_entry(struct archive *a, struct archive_entry *entry, int typ)
+extract_pool_drain(struct extract_pool *ep)
 {
-	time_t tm;
-	int tm_is_set = 0;
-	char strtm[13];
+	int fatal;
+
+	pthread_mutex_lock(&ep->lock);
+	while (ep->head != NULL || ep->busy > 0)
+		pthread_cond_wait(&ep->space_cv, &ep->lock);
+	fatal = ep->fatal;
+	pthread_mutex_unlock(&ep->lock);
+	return (fatal ? ARCHIVE_FATAL : ARCHIVE_OK);
+}
 
-	if (archive_entry_mtime_is_set(entry)) {
-		tm = archive_entry_mtime(entry);
-		tm_is_set = 1;
+static void
+extract_pool_destroy(struct extract_pool *ep)
+{
+	int i;
 
-	} else if (archive_entry_atime_is_set(entry)) {
-		tm = archive_entry_atime(entry);
-		tm_is_set = 1;
+	pthread_mutex_lock(&ep->lock);
+	ep->quit = 1;
+	pthread_cond_broadcast(&ep->work_cv);
+	pthread_mutex_unlock(&ep->lock);
+	for (i = 0; i < ep->nthreads; i++) {
+		pthread_join(ep->w[i].thread, NULL);
+		archive_write_free(ep->w[i].awd);
+	}
+	pthread_mutex_destroy(&ep->lock);
+	pthread_cond_destroy(&ep->work_cv);
+	pthread_cond_destroy(&ep->space_cv);
+	free(ep);
+}
 
-	} else if (archive_entry_ctime_is_set(entry)) {
-		tm = archive_entry_ctime(entry);
-		tm_is_set = 1;
+/*
+ * Read the data of a small or filtered regular file into memory and queue it
+ * for the writers. Returns 0 if the entry should be extracted inline instead.
+ */
+static int
+extract_entry_async(struct archive *a, struct archive_entry *entry,
+    struct archive *ad, int typ, pc_ctx_t *pctx, struct extract_pool *ep,
+    uint32_t ctr, int *rv)
+{
+	int64_t len, offset;
+	const void *buff;
+	uchar_t *data;
+	size_t size;
 
-	} else if (archive_entry_birthtime_is_set(entry)) {
-		tm = archive_entry_birthtime(entry);
-		tm_is_set = 1;
-	}
+	if (archive_entry_filetype(entry) != AE_IFREG ||
+	    archive_entry_hardlink(entry) != NULL ||
+	    extract_entry_is_dup(entry) ||
+	    !archive_entry_size_is_set(entry) ||
+	    (ep->mp != NULL && !meta_deferred(ep->mp, entry)))
+		return (0);
+	len = archive_entry_size(entry);
+	if (len > EXTRACT_ASYNC_MAX &&
+	    (len > EXTRACT_DECODE_MAX || !extract_entry_filtered(entry)))
+		return (0);
+
+	typ = extract_entry_type(entry, typ);
+	if (typ != TYPE_UNKNOWN && typetab[(typ >> 3)].filter_func == NULL)
+		typ = TYPE_UNKNOWN;
+	if (typ == TYPE_UNKNOWN)
+		(void) extract_entry_file_size(entry);
+	data = NULL;
+	if (len == 0) {
+		/*
+		 * Nothing to decode.
+		 */
+		typ = TYPE_UNKNOWN;
 
-	if (!tm_is_set) {
-		strcpy(strtm, "N/A");
 	} else {
-		if (strftime(strtm, sizeof (strtm), "%b %e %G", localtime(&tm)) == 0)
-			strcpy(strtm, "N/A");
+		/*
+		 * Holes in sparse files are left zeroed in the buffer.
+		 */
+		data = (uchar_t *)calloc(1, len);
+		if (data == NULL) {
+			archive_set_error(a, ENOMEM, "Out of memory");
+			*rv = ARCHIVE_FATAL;
+			return (1);
+		}
+		for (;;) {
+			int r1 = archive_read_data_block(a, &buff, &size, &offset);
+			if (r1 == ARCHIVE_EOF)
+				break;
+			if (r1 != ARCHIVE_OK) {
+				free(data);
+				*rv = r1;
+				return (1);
+			}
+			if (offset < 0 || offset + (int64_t)size > len) {
+				free(data);
+				archive_set_error(a, EINVAL, "Bad data offset");
+				*rv = ARCHIVE_FATAL;
+				return (1);
+			}
+			memcpy(data + offset, buff, size);
+		}
 	}
+	*rv = extract_pool_add(ep, entry, data, len, ctr, typ);
+	return (1);
+}
 
-	if (archive_entry_size_is_set(entry)) {
-		int64_t sz = archive_entry_size(entry);
-		printf("%12" PRId64 " %13s %s\n", sz, strtm, archive_entry_pathname(entry));
-		if (sz > 0)
-			return (copy_data_skip(a, entry, typ));
-	} else {
-		printf("%12" PRId64 " %13s %s\n", 0LL, strtm, archive_entry_pathname(entry));
+/*
+ * Options for the libarchive disk writer when extracting.
+ */
+static int
+extract_flags(pc_ctx_t *pctx)
+{
+	int flags;
+
+	flags = ARCHIVE_EXTRACT_TIME;
+	flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+	flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+	flags |= ARCHIVE_EXTRACT_SPARSE;
+
+	/*
+	 * Extract all security attributes if we are root.
+	 */
+	if (pctx->force_archive_perms || geteuid() == 0) {
+		if (geteuid() == 0)
+			flags |= ARCHIVE_EXTRACT_OWNER;
+		flags |= ARCHIVE_EXTRACT_PERM;
+		flags |= ARCHIVE_EXTRACT_ACL;
+		flags |= ARCHIVE_EXTRACT_XATTR;
+		flags |= ARCHIVE_EXTRACT_FFLAGS;
+		flags |= ARCHIVE_EXTRACT_MAC_METADATA;
 	}
-	return (ARCHIVE_OK);
+
+	if (pctx->no_overwrite_newer)
+		flags |= ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER;
+	return (flags);
 }
 
 /*
@@ -1599,37 +3938,22 @@ static void *
 extractor_thread_func(void *dat) {
 	pc_ctx_t *pctx = (pc_ctx_t *)dat;
 	char cwd[PATH_MAX], got_cwd;
-	int flags, rv;
+	int flags, rv, async;
 	uint32_t ctr;
 	struct archive_entry *entry;
-	struct archive *awd, *arc;
+	struct archive *awd, *awf, *arc;
+	struct extract_pool *ep;
+	struct meta_pool *mp;
 
 	/* Silence compiler. */
 	awd = NULL;
+	awf = NULL;
+	ep = NULL;
+	mp = NULL;
 	got_cwd = 0;
 
 	if (!pctx->list_mode) {
-		flags = ARCHIVE_EXTRACT_TIME;
-		flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
-		flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
-		flags |= ARCHIVE_EXTRACT_SPARSE;
-
-		/*
-		 * Extract all security attributes if we are root.
-		 */
-		if (pctx->force_archive_perms || geteuid() == 0) {
-			if (geteuid() == 0)
-				flags |= ARCHIVE_EXTRACT_OWNER;
-			flags |= ARCHIVE_EXTRACT_PERM;
-			flags |= ARCHIVE_EXTRACT_ACL;
-			flags |= ARCHIVE_EXTRACT_XATTR;
-			flags |= ARCHIVE_EXTRACT_FFLAGS;
-			flags |= ARCHIVE_EXTRACT_MAC_METADATA;
-		}
-
-		if (pctx->no_overwrite_newer)
-			flags |= ARCHIVE_EXTRACT_NO_OVERWRITE_NEWER;
-
+		flags = extract_flags(pctx);
 		got_cwd = 1;
 		if (getcwd(cwd, PATH_MAX) == NULL) {
 			log_msg(LOG_WARN, 1, "Cannot get current directory.");
@@ -1639,10 +3963,21 @@ extractor_thread_func(void *dat) {
 		awd = archive_write_disk_new();
 		archive_write_disk_set_options(awd, flags);
 		archive_write_disk_set_standard_lookup(awd);
+
+		/*
+		 * Regular files whose metadata is batched get a writer of their own.
+		 */
+		mp = meta_pool_create(flags);
+		if (mp != NULL) {
+			awf = archive_write_disk_new();
+			archive_write_disk_set_options(awf, flags & ~META_DEFERRED);
+			archive_write_disk_set_standard_lookup(awf);
+		}
 	}
 	ctr = 1;
 	arc = (struct archive *)(pctx->archive_ctx);
-	archive_read_open(arc, pctx, arc_open_callback, extract_read_callback, extract_close_callback);
+	archive_read_open2(arc, pctx, arc_open_callback, extract_read_callback,
+	    extract_skip_callback, extract_close_callback);
 
 	/*
 	 * Change directory after opening the archive, otherwise archive_read_open() can fail
@@ -1658,6 +3993,7 @@ extractor_thread_func(void *dat) {
 		 * Open list file for pathnames that had filter errors (if any).
 		 */
 		pctx->err_paths_fd = fopen("filter_failures.txt", "w");
+		ep = extract_pool_create(pctx, flags, mp);
 	}
 
 	/*
@@ -1708,8 +4044,22 @@ extractor_thread_func(void *dat) {
 		}
 #endif
 
+		async = 0;
 		if (!pctx->list_mode) {
-			rv = archive_extract_entry(arc, entry, awd, typ, pctx);
+			if (ep != NULL) {
+				async = extract_entry_async(arc, entry, awd, typ, pctx, ep, ctr, &rv);
+				if (!async && (archive_entry_hardlink(entry) != NULL ||
+				    extract_entry_is_dup(entry)))
+					rv = extract_pool_drain(ep);
+				if (ep->fatal)
+					rv = ARCHIVE_FATAL;
+			}
+			if (!async && rv != ARCHIVE_FATAL) {
+				if (meta_deferred(mp, entry))
+					rv = archive_extract_entry(arc, entry, awf, typ, pctx, mp);
+				else
+					rv = archive_extract_entry(arc, entry, awd, typ, pctx, NULL);
+			}
 		} else {
 			rv = archive_list_entry(arc, entry, typ);
 		}
@@ -1717,7 +4067,7 @@ extractor_thread_func(void *dat) {
 			log_msg(LOG_WARN, 0, "%s: %s", archive_entry_pathname(entry),
 			    archive_error_string(arc));
 
-		} else {
+		} else if (!async) {
 			log_msg(LOG_VERBOSE, 0, "%5d %8" PRIu64 " %s", ctr, archive_entry_size(entry),
 			    archive_entry_pathname(entry));
 		}
@@ -1730,6 +4080,11 @@ extractor_thread_func(void *dat) {
 	}
 
 	if (!pctx->list_mode) {
+		if (ep != NULL)
+			extract_pool_destroy(ep);
+		if (awf != NULL)
+			archive_write_free(awf);
+		meta_pool_destroy(mp);
 		if (pctx->errored_count > 0) {
 			log_msg(LOG_WARN, 0, "WARN: %d pathnames failed filter decoding.");
 			if (pctx->err_paths_fd) {
@@ -1759,6 +4114,317 @@ start_extractor(pc_ctx_t *pctx) {
 	return (pthread_create(&(pctx->archive_thread), NULL, extractor_thread_func, (void *)pctx));
 }
 
+/*
+ * Selective extraction using the member index. A name given with -X matches
+ * a member of the same name and everything below it if it is a directory.
+ * Members close to each other in the archive stream are decompressed as one
+ * byte range, the chunks in between are decoded anyway.
+ */
+#define	MEMBER_RANGE_GAP	(8 * 1024 * 1024)
+
+static int
+member_selected(pc_ctx_t *pctx, const char *name, size_t len)
+{
+	size_t xlen;
+	int i;
+
+	for (i = 0; i < pctx->xmembers_count; i++) {
+		const char *xm = pctx->xmembers[i];
+
+		xlen = strlen(xm);
+		while (xlen > 1 && xm[xlen - 1] == PATHSEP_CHAR)
+			xlen--;
+		if (len < xlen || strncmp(name, xm, xlen) != 0)
+			continue;
+		if (len == xlen || name[xlen] == PATHSEP_CHAR)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Extract the selected members found in one decompressed range of the
+ * archive stream.
+ */
+static int
+extract_member_range(pc_ctx_t *pctx, struct archive *awd, uchar_t *buf, uint64_t len,
+    uint32_t *ctr)
+{
+	struct archive_entry *entry;
+	struct archive *arc;
+	int rv, err;
+
+	arc = archive_read_new();
+	if (arc == NULL) {
+		log_msg(LOG_ERR, 0, "Unable to create libarchive context.");
+		return (-1);
+	}
+	archive_read_support_format_tar(arc);
+	archive_read_set_format_option(arc, "tar", "read_concatenated_archives", "1");
+	if (archive_read_open_memory(arc, buf, len) != ARCHIVE_OK) {
+		log_msg(LOG_ERR, 0, "%s", archive_error_string(arc));
+		archive_read_free(arc);
+		return (-1);
+	}
+
+	err = 0;
+	while ((rv = archive_read_next_header(arc, &entry)) != ARCHIVE_EOF) {
+		const char *name;
+
+		if (rv == ARCHIVE_FATAL) {
+			log_msg(LOG_ERR, 0, "%s", archive_error_string(arc));
+			err = -1;
+			break;
+		}
+		name = archive_entry_pathname(entry);
+		if (!member_selected(pctx, name, strlen(name)))
+			continue;
+
+		rv = archive_extract_entry(arc, entry, awd, TYPE_UNKNOWN, pctx, NULL);
+		if (rv != ARCHIVE_OK) {
+			log_msg(LOG_WARN, 0, "%s: %s", name, archive_error_string(arc));
+		} else {
+			log_msg(LOG_VERBOSE, 0, "%5d %8" PRIu64 " %s", *ctr,
+			    archive_entry_size(entry), name);
+		}
+		if (rv == ARCHIVE_FATAL) {
+			err = -1;
+			break;
+		}
+		(*ctr)++;
+	}
+	archive_read_free(arc);
+	return (err);
+}
+
+int
+extract_members(pc_ctx_t *pctx, const char *filename, const char *to_dir)
+{
+	char cwd[PATH_MAX];
+	uint64_t i, off, end, roff, rend, nsel;
+	uchar_t *pos, *buf;
+	struct archive *awd;
+	uint32_t ctr;
+	int err;
+
+	/*
+	 * An empty byte range only reads the header and the indexes.
+	 */
+	if (start_decompress_range(pctx, filename, 0, 0, NULL) == -1)
+		return (1);
+	if (pctx->encrypt_type) {
+		log_msg(LOG_ERR, 0, "Selective extraction of encrypted archives is not supported.");
+		return (1);
+	}
+	if (pctx->midx == NULL) {
+		log_msg(LOG_ERR, 0, "Selective extraction needs an archive with a member "
+		    "index, created with -a and -I.");
+		return (1);
+	}
+
+	if (to_dir == NULL)
+		to_dir = ".";
+	if (mkdir(to_dir, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1 && errno != EEXIST) {
+		log_msg(LOG_ERR, 1, "Unable to create target directory %s.", to_dir);
+		return (1);
+	}
+	if (getcwd(cwd, PATH_MAX) == NULL) {
+		log_msg(LOG_ERR, 1, "Cannot get current directory.");
+		return (1);
+	}
+
+	awd = archive_write_disk_new();
+	if (awd == NULL) {
+		log_msg(LOG_ERR, 0, "Unable to create libarchive context.");
+		return (1);
+	}
+	archive_write_disk_set_options(awd, extract_flags(pctx));
+	archive_write_disk_set_standard_lookup(awd);
+
+	/*
+	 * Walk the index in archive order and decompress covering ranges of
+	 * selected members. The file name is opened before changing directory
+	 * for each range, so go back to the original directory for that.
+	 */
+	err = 0;
+	ctr = 1;
+	nsel = 0;
+	roff = rend = 0;
+	buf = NULL;
+	pos = pctx->midx;
+	for (i = 0; i <= pctx->midx_count && !err; i++) {
+		uint16_t nlen = 0;
+
+		if (i < pctx->midx_count) {
+			off = ntohll(U64_P(pos));
+			nlen = ntohs(U16_P(pos + 8));
+			if (i + 1 < pctx->midx_count)
+				end = ntohll(U64_P(pos + 10 + nlen));
+			else
+				end = pctx->midx_end;
+			if (!member_selected(pctx, (char *)pos + 10, nlen)) {
+				pos += 10 + nlen;
+				continue;
+			}
+			pos += 10 + nlen;
+			nsel++;
+			if (rend > roff && off <= rend + MEMBER_RANGE_GAP) {
+				rend = end;
+				continue;
+			}
+		}
+
+		/*
+		 * Flush the pending range.
+		 */
+		if (rend > roff) {
+			int64_t got;
+
+			buf = (uchar_t *)malloc(rend - roff);
+			if (buf == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				err = 1;
+				break;
+			}
+			got = start_decompress_range(pctx, filename, roff, rend - roff, buf);
+			if (got != rend - roff) {
+				log_msg(LOG_ERR, 0, "Unable to decompress members at offset %"
+				    PRIu64 ".", roff);
+				err = 1;
+			} else if (chdir(to_dir) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot change to dir: %s", to_dir);
+				err = 1;
+			} else {
+				if (extract_member_range(pctx, awd, buf, got, &ctr) == -1)
+					err = 1;
+				if (chdir(cwd) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot change to dir: %s", cwd);
+					err = 1;
+				}
+			}
+			free(buf);
+		}
+		if (i < pctx->midx_count) {
+			roff = off;
+			rend = end;
+		}
+	}
+
+	/*
+	 * Directory permissions and times are set when the writer is freed.
+	 */
+	if (chdir(to_dir) == 0) {
+		archive_write_free(awd);
+		if (chdir(cwd) == -1)
+			log_msg(LOG_WARN, 1, "Cannot change to dir: %s", cwd);
+	} else {
+		archive_write_free(awd);
+	}
+	if (!err && nsel == 0) {
+		log_msg(LOG_ERR, 0, "No matching members in the archive.");
+		err = 1;
+	}
+	return (err);
+}
+
+static struct archive *
+member_read_open(uchar_t *buf, uint64_t len, struct archive_entry **entry)
+{
+	struct archive *arc;
+	int rv;
+
+	arc = archive_read_new();
+	if (arc == NULL) {
+		log_msg(LOG_ERR, 0, "Unable to create libarchive context.");
+		return (NULL);
+	}
+	archive_read_support_format_tar(arc);
+	if (archive_read_open_memory(arc, buf, len) != ARCHIVE_OK) {
+		log_msg(LOG_ERR, 0, "%s", archive_error_string(arc));
+		archive_read_free(arc);
+		return (NULL);
+	}
+	rv = archive_read_next_header(arc, entry);
+	if (rv != ARCHIVE_OK && rv != ARCHIVE_WARN) {
+		if (rv != ARCHIVE_EOF)
+			log_msg(LOG_ERR, 0, "%s", archive_error_string(arc));
+		archive_read_free(arc);
+		return (NULL);
+	}
+	return (arc);
+}
+
+/*
+ * Read the header of the member at the start of buf. Only the header needs
+ * to be present in buf, the data is not read.
+ */
+int
+archive_member_stat(uchar_t *buf, uint64_t len, struct member_stat *ms)
+{
+	struct archive_entry *entry;
+	struct archive *arc;
+	const void *val;
+	size_t size;
+
+	memset(ms, 0, sizeof (*ms));
+	arc = member_read_open(buf, len, &entry);
+	if (arc == NULL)
+		return (-1);
+	memcpy(&ms->st, archive_entry_stat(entry), sizeof (struct stat));
+	ms->stored = archive_entry_size(entry);
+	ms->filtered = extract_entry_filtered(entry);
+	if (archive_entry_hardlink(entry) != NULL) {
+		ms->link = strdup(archive_entry_hardlink(entry));
+		ms->hardlink = 1;
+	} else if (archive_entry_symlink(entry) != NULL) {
+		ms->link = strdup(archive_entry_symlink(entry));
+	}
+	if (archive_entry_has_xattr(entry, DUP_XATTR_ENTRY, &val, &size))
+		ms->dup = strndup((const char *)val, size);
+	archive_read_free(arc);
+	if ((ms->hardlink || S_ISLNK(ms->st.st_mode)) && ms->link == NULL)
+		return (-1);
+	return (0);
+}
+
+void
+archive_member_free(struct member_stat *ms)
+{
+	free(ms->link);
+	free(ms->dup);
+	ms->link = NULL;
+	ms->dup = NULL;
+}
+
+/*
+ * Decode the data of a filtered member, all of which must be in buf, into
+ * a new buffer returned in out.
+ */
+int
+archive_member_decode(pc_ctx_t *pctx, uchar_t *buf, uint64_t len, uchar_t **out,
+    uint64_t *outlen)
+{
+	struct archive_entry *entry;
+	struct archive *arc;
+	filter_output_t fout;
+	int typ;
+
+	arc = member_read_open(buf, len, &entry);
+	if (arc == NULL)
+		return (-1);
+	typ = extract_entry_type(entry, TYPE_UNKNOWN);
+	if (typ == TYPE_UNKNOWN || typetab[(typ >> 3)].filter_func == NULL ||
+	    decode_data_out(arc, arc, entry, typ, pctx, &fout, NULL) == ARCHIVE_FATAL) {
+		log_msg(LOG_ERR, 0, "Unable to decode %s.", archive_entry_pathname(entry));
+		archive_read_free(arc);
+		return (-1);
+	}
+	archive_read_free(arc);
+	*out = fout.out;
+	*outlen = fout.out_size;
+	return (0);
+}
+
 /*
  * Initialize the hash table of known extensions and types. Bob Jenkins Minimal Perfect Hash
  * is used to get a perfect hash function for the set of known extensions. See:
@@ -1820,6 +4486,8 @@ disable_all_filters()
 	if (!filters_inited) {
 		ff.enable_packjpg = 0;
 		ff.enable_wavpack = 0;
+		ff.exe_preprocess = 0;
+		ff.enable_deflate = 0;
 		add_filters_by_type(typetab, &ff);
 		filters_inited = 1;
 	} else {
@@ -1842,16 +4510,17 @@ detect_type_from_ext(const char *ext, int len)
 	uint64_t extnum;
 
 	if (len == 0 || len > 8) goto ret; // If extension is empty give up
-	for (i = 0; i < len; i++) extl[i] = tolower(ext[i]);
-	slot = phash(extl, len);
-	if (slot >= PHASHNKEYS) goto ret; // Extension maps outside hash table range, give up
-	extnum = 0;
 
 	/*
-	 * Pack given extension into 64-bit integer.
+	 * Lowercase and pack given extension into 64-bit integer in one pass.
 	 */
-	for (i = 0; i < len; i++)
-		extnum = (extnum << 8) | tolower(ext[i]);
+	extnum = 0;
+	for (i = 0; i < len; i++) {
+		extl[i] = tolower(ext[i]);
+		extnum = (extnum << 8) | (uchar_t)extl[i];
+	}
+	slot = phash(extl, len);
+	if (slot >= PHASHNKEYS) goto ret; // Extension maps outside hash table range, give up
 	if (exthtab[slot].extnum == extnum)
 		return (exthtab[slot].type);
 ret:
@@ -1864,6 +4533,8 @@ detect_type_by_ext(const char *path, int pathlen)
 	const char *ext = NULL;
 	int i, len;
 
+	if ((i = filter_plugin_detect(path, NULL, 0)) != TYPE_UNKNOWN)
+		return (i);
 	for (i = pathlen-1; i > 0 && path[i] != '.' && path[i] != PATHSEP_CHAR; i--);
 	if (i == 0 || path[i] != '.') goto out; // If extension not found give up
 	len = pathlen - i - 1;
@@ -1918,6 +4589,10 @@ static int
 detect_type_by_data(uchar_t *buf, size_t len)
 {
 	uint16_t leval;
+	int typ;
+
+	if ((typ = filter_plugin_detect(NULL, buf, len)) != TYPE_UNKNOWN)
+		return (typ);
 
 	// At least a few bytes.
 	if (len < 10) return (TYPE_UNKNOWN);
@@ -1936,23 +4611,37 @@ detect_type_by_data(uchar_t *buf, size_t len)
 
 	if (memcmp(buf, "!<arch>\n", 8) == 0)
 		return (TYPE_BINARY|TYPE_ARCHIVE_AR);
-	if (memcmp(&buf[257], "ustar\0", 6) == 0 || memcmp(&buf[257], "ustar\040\040\0", 8) == 0)
+	if (len > 264 && (memcmp(&buf[257], "ustar\0", 6) == 0 ||
+	    memcmp(&buf[257], "ustar\040\040\0", 8) == 0))
 		return (TYPE_BINARY|TYPE_ARCHIVE_TAR);
 	if (memcmp(buf, "%PDF-", 5) == 0)
 		return (TYPE_BINARY|TYPE_PDF);
 
+	// ZIP based files without a known extension, like docx, xlsx and epub,
+	// and PNGs. The Deflate filter handles these.
+	if (memcmp(buf, "PK\003\004", 4) == 0)
+		return (TYPE_BINARY|TYPE_COMPRESSED|TYPE_COMPRESSED_ZIP);
+	if (memcmp(buf, "\211PNG\r\n\032\n", 8) == 0)
+		return (TYPE_BINARY|TYPE_COMPRESSED|TYPE_COMPRESSED_GZ);
+
 	// Try to detect DICOM medical image file. BSC compresses these better.
 	if (len > 127) {
-		int i;
-
-		// DICOM files should have either DICM or ISO_IR within the first 128 bytes
-		for (i = 0; i < 128-4; i++) {
-			if (buf[i] == 'D')
-				if (memcmp(&buf[i], "DICM", 4) == 0)
-					return (TYPE_BINARY|TYPE_DICOM);
-			if (buf[i] == 'I')
-				if (memcmp(&buf[i], "ISO_IR ", 7) == 0)
-					return (TYPE_BINARY|TYPE_DICOM);
+		uchar_t *pos, *end;
+
+		// DICOM files should have either DICM or ISO_IR within the first 128 bytes.
+		// Candidate start bytes are located with memchr() which is vectorized.
+		end = buf + 128 - 4;
+		pos = buf;
+		while (pos < end && (pos = (uchar_t *)memchr(pos, 'D', end - pos)) != NULL) {
+			if (memcmp(pos, "DICM", 4) == 0)
+				return (TYPE_BINARY|TYPE_DICOM);
+			pos++;
+		}
+		pos = buf;
+		while (pos < end && (pos = (uchar_t *)memchr(pos, 'I', end - pos)) != NULL) {
+			if (memcmp(pos, "ISO_IR ", 7) == 0)
+				return (TYPE_BINARY|TYPE_DICOM);
+			pos++;
 		}
 	}
 
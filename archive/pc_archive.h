@@ -50,8 +50,28 @@ int start_archiver(pc_ctx_t *pctx);
 int setup_extractor(pc_ctx_t *pctx);
 int start_extractor(pc_ctx_t *pctx);
 int64_t archiver_read(void *ctx, void *buf, uint64_t count);
+void archiver_submit(void *ctx, void *buf, uint64_t count);
+int64_t archiver_wait(void *ctx, int *btype, int *interesting);
 int64_t archiver_write(void *ctx, void *buf, uint64_t count);
 int archiver_close(void *ctx);
+int extract_members(pc_ctx_t *pctx, const char *filename, const char *to_dir);
+
+/*
+ * A member header read from a decoded range of the archive stream, for the
+ * FUSE mount. stored is the size of the data in the stream, link the symlink
+ * or hardlink target and dup the source of a duplicate file (-W).
+ */
+struct member_stat {
+	struct stat st;
+	int64_t stored;
+	char *link, *dup;
+	int hardlink, filtered;
+};
+
+int archive_member_stat(uchar_t *buf, uint64_t len, struct member_stat *ms);
+void archive_member_free(struct member_stat *ms);
+int archive_member_decode(pc_ctx_t *pctx, uchar_t *buf, uint64_t len, uchar_t **out,
+    uint64_t *outlen);
 int init_archive_mod();
 int insert_filter_data(filter_func_ptr func, void *filter_private, const char *ext);
 void init_filters(struct filter_flags *ff);
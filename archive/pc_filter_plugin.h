@@ -0,0 +1,94 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Interface for external archive filters. A plugin is a shared object that
+ * exports PC_FILTER_PLUGIN_INIT_SYM returning a filled pc_filter_plugin_t.
+ * Plugins are listed, colon separated, in PCOMPRESS_FILTER_PLUGINS and get
+ * a type tag after the builtin ones. The filter name is stored with each
+ * filtered archive member, so the same plugin must be listed when
+ * extracting. This header is self contained so that plugins can be built
+ * outside the Pcompress tree.
+ */
+
+#ifndef	_PC_FILTER_PLUGIN_H
+#define	_PC_FILTER_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define	PC_FILTER_PLUGIN_ABI		1
+#define	PC_FILTER_PLUGIN_INIT_SYM	"pc_filter_plugin_init"
+
+/*
+ * The encode and decode callbacks may be called from several threads at
+ * once. Without this flag calls into the plugin are serialized.
+ */
+#define	PC_FILTER_PLUGIN_MT_SAFE	0x1
+
+/*
+ * Return values of encode and decode.
+ */
+#define	PC_FILTER_PLUGIN_OK		0
+#define	PC_FILTER_PLUGIN_SKIP		1
+#define	PC_FILTER_PLUGIN_ERROR		(-1)
+
+typedef struct _pc_filter_plugin {
+	int abi_version;	/* Must be PC_FILTER_PLUGIN_ABI */
+	const char *name;	/* Unique, stored in the archive */
+	unsigned int flags;
+	unsigned int cost;	/* Approximate encode nanoseconds per byte */
+	int result_type;	/* Pcompress type of the output, 0 for binary */
+	size_t max_size;	/* Largest member to encode, 0 for no limit */
+
+	/*
+	 * Return non-zero if the member should go through this filter. The
+	 * name is the member path, or NULL when only data is known. The
+	 * buffer holds the leading bytes of the member, or is NULL when
+	 * only the name is known.
+	 */
+	int (*detect)(const char *name, const unsigned char *buf, size_t len);
+
+	/*
+	 * Transform a whole member. The output is allocated with malloc()
+	 * and is freed by Pcompress. Encode may return PC_FILTER_PLUGIN_SKIP
+	 * to store the member unchanged.
+	 */
+	int (*encode)(const unsigned char *in, size_t inlen, unsigned char **out,
+	    size_t *outlen, int level);
+	int (*decode)(const unsigned char *in, size_t inlen, unsigned char **out,
+	    size_t *outlen);
+} pc_filter_plugin_t;
+
+typedef const pc_filter_plugin_t *(*pc_filter_plugin_init_fn)(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
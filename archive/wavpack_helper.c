@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <utils.h>
 #include "wavpack.h"
 
@@ -56,6 +57,17 @@ typedef struct read_data_s {
 #define	TRUE	1
 #define	FALSE	0
 
+/*
+ * WAV files with at least two segments of audio are coded as independent
+ * WavPack streams, one per segment, on up to WVPK_SEG_THREADS threads.
+ * The segment size only depends on the file, so the output does not
+ * depend on the host.
+ */
+#define	WVPK_SEG_MAGIC		"wvpm"
+#define	WVPK_SEG_SIZE		(4 * 1024 * 1024)
+#define	WVPK_SEG_THREADS	16
+#define	WVPK_SEG_HDR_SIZE	16
+
 /*
  * Utility functions to read and write to memory areas as if they are files.
  */
@@ -306,8 +318,8 @@ pack_audio(WavpackContext *wpc, read_data *rdat)
  * Helper routine for wavpack. Higher level encoding interface adapted from
  * pack_file() in cli/wavpack.c and unpack_file() in cli/wvunpack.c
  */
-size_t
-wavpack_filter_encode(uchar_t *in_buf, size_t len, uchar_t **out_buf, int cmp_level)
+static size_t
+wavpack_encode_one(uchar_t *in_buf, size_t len, uchar_t **out_buf, int cmp_level)
 {
 	uint32_t total_samples = 0, bcount;
 	WavpackConfig loc_config;
@@ -559,8 +571,8 @@ format_samples(int bps, unsigned char *dst, int32_t *src, uint32_t samcnt)
     return dst;
 }
 
-size_t
-wavpack_filter_decode(uchar_t *in_buf, size_t len, uchar_t **out_buf, ssize_t out_len)
+static size_t
+wavpack_decode_one(uchar_t *in_buf, size_t len, uchar_t **out_buf, ssize_t out_len)
 {
 	write_data wr_dat;
 	read_data  rd_dat;
@@ -672,6 +684,324 @@ wavpack_filter_decode(uchar_t *in_buf, size_t len, uchar_t **out_buf, ssize_t ou
 
 	return (wr_dat.bytes_written);
 }
+
+/*
+ * Segmented format. All values are little endian.
+ *
+ *   "wvpm", segment count, header length, trailer length
+ *   per segment: coded length, audio length
+ *   WAV header up to the audio data, as is
+ *   coded segments
+ *   trailing chunks, as is
+ *
+ * Each segment is coded as a WAV of its own: the original header with the
+ * sizes adjusted, followed by the segment audio.
+ */
+struct wvpk_seg {
+	uchar_t *in;
+	size_t in_len;
+	uchar_t *out;
+	size_t out_len;
+};
+
+struct wvpk_seg_job {
+	struct wvpk_seg *segs;
+	uint32_t nseg, next;
+	uchar_t *hdr;
+	uint32_t hdr_len, size_off;
+	int cmp_level, error;
+	uchar_t *dst;		/* Audio area of the output when decoding */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Find the audio data of a WAV. Returns the length of the header before
+ * the audio and sets the offset of the data chunk size field, the sample
+ * frame size and the audio length, a multiple of the frame size.
+ */
+static uint32_t
+wav_find_data(uchar_t *buf, size_t len, uint32_t *size_off, size_t *data_len,
+    uint32_t *frame)
+{
+	size_t off, csz;
+	uint32_t align = 0;
+
+	off = 12;
+	while (off + 8 <= len) {
+		csz = LE32(U32_P(buf + off + 4));
+		if (memcmp(buf + off, "fmt ", 4) == 0 && csz >= 16 && off + 8 + 16 <= len) {
+			align = buf[off + 8 + 12] | (buf[off + 8 + 13] << 8);
+		} else if (memcmp(buf + off, "data", 4) == 0) {
+			if (align == 0)
+				return (0);
+			if (csz > len - off - 8)
+				csz = len - off - 8;
+			*size_off = off + 4;
+			*frame = align;
+			*data_len = csz - csz % align;
+			return (off + 8);
+		}
+		off += 8 + ((csz + 1) & ~((size_t)1));
+	}
+	return (0);
+}
+
+static void *
+wvpk_seg_encode_func(void *arg)
+{
+	struct wvpk_seg_job *job = (struct wvpk_seg_job *)arg;
+	struct wvpk_seg *seg;
+	uchar_t *wav;
+	uint32_t i;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nseg || job->error)
+			break;
+
+		seg = &job->segs[i];
+		wav = malloc(job->hdr_len + seg->in_len);
+		if (wav == NULL) {
+			job->error = 1;
+			break;
+		}
+		memcpy(wav, job->hdr, job->hdr_len);
+		U32_P(wav + 4) = LE32((uint32_t)(job->hdr_len + seg->in_len - 8));
+		U32_P(wav + job->size_off) = LE32((uint32_t)seg->in_len);
+		memcpy(wav + job->hdr_len, seg->in, seg->in_len);
+		seg->out = NULL;
+		seg->out_len = wavpack_encode_one(wav, job->hdr_len + seg->in_len, &seg->out,
+		    job->cmp_level);
+		free(wav);
+		if (seg->out_len == 0)
+			job->error = 1;
+	}
+	return (NULL);
+}
+
+static void *
+wvpk_seg_decode_func(void *arg)
+{
+	struct wvpk_seg_job *job = (struct wvpk_seg_job *)arg;
+	struct wvpk_seg *seg;
+	uchar_t *wav;
+	size_t wlen;
+	uint32_t i;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->nseg || job->error)
+			break;
+
+		seg = &job->segs[i];
+		wav = NULL;
+		wlen = wavpack_decode_one(seg->in, seg->in_len, &wav,
+		    job->hdr_len + seg->out_len);
+		if (wlen != job->hdr_len + seg->out_len) {
+			job->error = 1;
+		} else {
+			memcpy(seg->out, wav + job->hdr_len, seg->out_len);
+		}
+		free(wav);
+	}
+	return (NULL);
+}
+
+/*
+ * Run the segment jobs on a few threads and the calling one.
+ */
+static int
+wvpk_seg_run(struct wvpk_seg_job *job, void *(*func)(void *))
+{
+	pthread_t tids[WVPK_SEG_THREADS];
+	int i, nthreads, started;
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (ncpu > 0 ? ncpu : 1);
+	if (nthreads > WVPK_SEG_THREADS)
+		nthreads = WVPK_SEG_THREADS;
+	if (nthreads > job->nseg)
+		nthreads = job->nseg;
+
+	job->next = 0;
+	job->error = 0;
+	pthread_mutex_init(&job->lock, NULL);
+	started = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&tids[started], NULL, func, job) != 0)
+			break;
+		started++;
+	}
+	func(job);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&job->lock);
+	return (job->error ? -1 : 0);
+}
+
+static size_t
+wavpack_encode_segments(uchar_t *in_buf, size_t len, uchar_t **out_buf, int cmp_level)
+{
+	struct wvpk_seg_job job;
+	struct wvpk_seg *segs;
+	uint32_t hdr_len, size_off, nseg, i, align;
+	size_t data_len, seg_len, trailer_len, pos, out_len;
+	uchar_t *out;
+
+	if (len < 12 || memcmp(in_buf, "RIFF", 4) != 0 || memcmp(in_buf + 8, "WAVE", 4) != 0)
+		return (0);
+	hdr_len = wav_find_data(in_buf, len, &size_off, &data_len, &align);
+	if (hdr_len == 0 || data_len < 2 * WVPK_SEG_SIZE)
+		return (0);
+
+	/*
+	 * Segments are a multiple of the sample frame size.
+	 */
+	seg_len = WVPK_SEG_SIZE - WVPK_SEG_SIZE % align;
+	nseg = (data_len + seg_len - 1) / seg_len;
+	trailer_len = len - hdr_len - data_len;
+
+	segs = (struct wvpk_seg *)calloc(nseg, sizeof (struct wvpk_seg));
+	if (segs == NULL)
+		return (0);
+	for (i = 0; i < nseg; i++) {
+		segs[i].in = in_buf + hdr_len + (size_t)i * seg_len;
+		segs[i].in_len = (i < nseg - 1 ? seg_len : data_len - (size_t)i * seg_len);
+	}
+	job.segs = segs;
+	job.nseg = nseg;
+	job.hdr = in_buf;
+	job.hdr_len = hdr_len;
+	job.size_off = size_off;
+	job.cmp_level = cmp_level;
+
+	out = NULL;
+	out_len = 0;
+	if (wvpk_seg_run(&job, wvpk_seg_encode_func) == 0) {
+		out_len = WVPK_SEG_HDR_SIZE + nseg * 8 + hdr_len + trailer_len;
+		for (i = 0; i < nseg; i++)
+			out_len += segs[i].out_len;
+
+		/*
+		 * Not worth it if the result does not fit in the member.
+		 */
+		if (out_len >= len || (out = malloc(out_len)) == NULL) {
+			out_len = 0;
+		} else {
+			memcpy(out, WVPK_SEG_MAGIC, 4);
+			U32_P(out + 4) = LE32(nseg);
+			U32_P(out + 8) = LE32(hdr_len);
+			U32_P(out + 12) = LE32((uint32_t)trailer_len);
+			pos = WVPK_SEG_HDR_SIZE;
+			for (i = 0; i < nseg; i++) {
+				U32_P(out + pos) = LE32((uint32_t)segs[i].out_len);
+				U32_P(out + pos + 4) = LE32((uint32_t)segs[i].in_len);
+				pos += 8;
+			}
+			memcpy(out + pos, in_buf, hdr_len);
+			pos += hdr_len;
+			for (i = 0; i < nseg; i++) {
+				memcpy(out + pos, segs[i].out, segs[i].out_len);
+				pos += segs[i].out_len;
+			}
+			memcpy(out + pos, in_buf + hdr_len + data_len, trailer_len);
+		}
+	}
+	for (i = 0; i < nseg; i++)
+		free(segs[i].out);
+	free(segs);
+	*out_buf = out;
+	return (out_len);
+}
+
+static size_t
+wavpack_decode_segments(uchar_t *in_buf, size_t len, uchar_t **out_buf, ssize_t out_len)
+{
+	struct wvpk_seg_job job;
+	struct wvpk_seg *segs;
+	uint32_t nseg, hdr_len, trailer_len, i;
+	size_t pos, opos, total;
+	uchar_t *out;
+
+	if (len < WVPK_SEG_HDR_SIZE)
+		return (0);
+	nseg = LE32(U32_P(in_buf + 4));
+	hdr_len = LE32(U32_P(in_buf + 8));
+	trailer_len = LE32(U32_P(in_buf + 12));
+	if (nseg == 0 || nseg > (len - WVPK_SEG_HDR_SIZE) / 8)
+		return (0);
+
+	segs = (struct wvpk_seg *)calloc(nseg, sizeof (struct wvpk_seg));
+	out = malloc(out_len);
+	if (segs == NULL || out == NULL) {
+		free(segs);
+		free(out);
+		log_msg(LOG_ERR, 1, "malloc failed.");
+		return (0);
+	}
+
+	/*
+	 * Check the table against both buffers before any decoding.
+	 */
+	pos = WVPK_SEG_HDR_SIZE + (size_t)nseg * 8 + hdr_len;
+	opos = hdr_len;
+	for (i = 0; i < nseg; i++) {
+		size_t p = WVPK_SEG_HDR_SIZE + (size_t)i * 8;
+
+		segs[i].in_len = LE32(U32_P(in_buf + p));
+		segs[i].out_len = LE32(U32_P(in_buf + p + 4));
+		segs[i].in = in_buf + pos;
+		segs[i].out = out + opos;
+		pos += segs[i].in_len;
+		opos += segs[i].out_len;
+	}
+	total = opos + trailer_len;
+	if (pos + trailer_len > len || total > (size_t)out_len) {
+		free(segs);
+		free(out);
+		log_msg(LOG_ERR, 0, "Wavpack: Bad segment table. File corrupt?");
+		return (0);
+	}
+	memcpy(out, in_buf + WVPK_SEG_HDR_SIZE + (size_t)nseg * 8, hdr_len);
+	memcpy(out + opos, in_buf + pos, trailer_len);
+
+	job.segs = segs;
+	job.nseg = nseg;
+	job.hdr_len = hdr_len;
+	if (wvpk_seg_run(&job, wvpk_seg_decode_func) != 0) {
+		free(segs);
+		free(out);
+		log_msg(LOG_ERR, 0, "Wavpack: Segment decoding failed.");
+		return (0);
+	}
+	free(segs);
+	*out_buf = out;
+	return (total);
+}
+
+size_t
+wavpack_filter_encode(uchar_t *in_buf, size_t len, uchar_t **out_buf, int cmp_level)
+{
+	size_t rv;
+
+	rv = wavpack_encode_segments(in_buf, len, out_buf, cmp_level);
+	if (rv > 0)
+		return (rv);
+	return (wavpack_encode_one(in_buf, len, out_buf, cmp_level));
+}
+
+size_t
+wavpack_filter_decode(uchar_t *in_buf, size_t len, uchar_t **out_buf, ssize_t out_len)
+{
+	if (len >= 4 && memcmp(in_buf, WVPK_SEG_MAGIC, 4) == 0)
+		return (wavpack_decode_segments(in_buf, len, out_buf, out_len));
+	return (wavpack_decode_one(in_buf, len, out_buf, out_len));
+}
 #ifdef	__cplusplus
 }
 #endif
@@ -41,6 +41,14 @@ See also the bsc and libbsc web site:
 #include "../platform/platform.h"
 #include "../libbsc.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define ADLER32_X86
+#elif defined(__GNUC__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+    #include <arm_neon.h>
+    #define ADLER32_NEON
+#endif
+
 #define BASE 65521UL
 #define NMAX 5552
 
@@ -51,11 +59,17 @@ See also the bsc and libbsc web site:
 #define DO16(buf)   DO8(buf, 0); DO8(buf, 8);
 #define MOD(a)      a %= BASE
 
-unsigned int bsc_adler32(const unsigned char * T, int n, int features)
-{
-    unsigned int sum1 = 1;
-    unsigned int sum2 = 0;
+/* The vector kernels take 32 bytes per step, NMAX / 32 steps between reductions. */
+#define BLOCK_SIZE  32
+#define BLOCK_NMAX  (NMAX / BLOCK_SIZE)
+
+/* Inputs shorter than this, like the block headers, are not worth the vector setup. */
+#define SIMD_MIN    64
 
+typedef unsigned int (*adler32_func)(const unsigned char * T, int n);
+
+static unsigned int bsc_adler32_update(unsigned int sum1, unsigned int sum2, const unsigned char * T, int n)
+{
     while (n >= NMAX)
     {
         for (int i = 0; i < NMAX / 16; ++i)
@@ -80,6 +94,214 @@ unsigned int bsc_adler32(const unsigned char * T, int n, int features)
     return sum1 | (sum2 << 16);
 }
 
+static unsigned int bsc_adler32_scalar(const unsigned char * T, int n)
+{
+    return bsc_adler32_update(1, 0, T, n);
+}
+
+/*
+* The vector kernels keep sum1 per lane and get sum2 as the block prefix sums
+* of sum1, times 32, plus the bytes of each block weighted 32 down to 1.
+*/
+
+#ifdef ADLER32_X86
+
+__attribute__((target("ssse3")))
+static unsigned int bsc_adler32_ssse3(const unsigned char * T, int n)
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    unsigned int sum1 = 1;
+    unsigned int sum2 = 0;
+    int blocks = n / BLOCK_SIZE;
+
+    n -= blocks * BLOCK_SIZE;
+    while (blocks > 0)
+    {
+        int k = blocks < BLOCK_NMAX ? blocks : BLOCK_NMAX; blocks -= k;
+
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, sum1 * k);
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, sum2);
+        __m128i v_s1 = _mm_setzero_si128();
+
+        do
+        {
+            __m128i bytes1 = _mm_loadu_si128((const __m128i *)T);
+            __m128i bytes2 = _mm_loadu_si128((const __m128i *)(T + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            T += BLOCK_SIZE;
+        } while (--k);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        sum1 += (unsigned int)_mm_cvtsi128_si32(v_s1);
+        sum2  = (unsigned int)_mm_cvtsi128_si32(v_s2);
+        MOD(sum1); MOD(sum2);
+    }
+
+    return bsc_adler32_update(sum1, sum2, T, n);
+}
+
+__attribute__((target("avx2")))
+static unsigned int bsc_adler32_avx2(const unsigned char * T, int n)
+{
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    unsigned int sum1 = 1;
+    unsigned int sum2 = 0;
+    int blocks = n / BLOCK_SIZE;
+
+    n -= blocks * BLOCK_SIZE;
+    while (blocks > 0)
+    {
+        int k = blocks < BLOCK_NMAX ? blocks : BLOCK_NMAX; blocks -= k;
+
+        __m256i v_ps = _mm256_setr_epi32(sum1 * k, 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s2 = _mm256_setr_epi32(sum2, 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s1 = _mm256_setzero_si256();
+
+        /* Two accumulators for sum2 break the dependency on the madd chain. */
+        __m256i v_s2b = _mm256_setzero_si256();
+
+        while (k >= 2)
+        {
+            __m256i bytes1 = _mm256_loadu_si256((const __m256i *)T);
+            __m256i bytes2 = _mm256_loadu_si256((const __m256i *)(T + BLOCK_SIZE));
+
+            v_ps  = _mm256_add_epi32(v_ps, v_s1);
+            v_s1  = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes1, zero));
+            v_s2  = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, tap), ones));
+            v_ps  = _mm256_add_epi32(v_ps, v_s1);
+            v_s1  = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes2, zero));
+            v_s2b = _mm256_add_epi32(v_s2b, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, tap), ones));
+            T += 2 * BLOCK_SIZE; k -= 2;
+        }
+        if (k > 0)
+        {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)T);
+
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+            T += BLOCK_SIZE;
+        }
+
+        v_s2 = _mm256_add_epi32(_mm256_add_epi32(v_s2, v_s2b), _mm256_slli_epi32(v_ps, 5));
+
+        __m128i s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+        __m128i s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+
+        s1 = _mm_add_epi32(s1, _mm_shuffle_epi32(s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        sum1 += (unsigned int)_mm_cvtsi128_si32(s1);
+        sum2  = (unsigned int)_mm_cvtsi128_si32(s2);
+        MOD(sum1); MOD(sum2);
+    }
+
+    return bsc_adler32_update(sum1, sum2, T, n);
+}
+
+#endif
+
+#ifdef ADLER32_NEON
+
+static unsigned int bsc_adler32_neon(const unsigned char * T, int n)
+{
+    static const uint16_t taps[32] = { 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+
+    unsigned int sum1 = 1;
+    unsigned int sum2 = 0;
+    int blocks = n / BLOCK_SIZE;
+
+    n -= blocks * BLOCK_SIZE;
+    while (blocks > 0)
+    {
+        int k = blocks < BLOCK_NMAX ? blocks : BLOCK_NMAX; blocks -= k;
+
+        uint32x4_t v_s2 = vsetq_lane_u32(sum1 * k, vdupq_n_u32(0), 0);
+        uint32x4_t v_s1 = vdupq_n_u32(0);
+
+        /* Per column byte totals, at most BLOCK_NMAX * 255 each. */
+        uint16x8_t c1 = vdupq_n_u16(0), c2 = vdupq_n_u16(0);
+        uint16x8_t c3 = vdupq_n_u16(0), c4 = vdupq_n_u16(0);
+
+        do
+        {
+            uint8x16_t bytes1 = vld1q_u8(T);
+            uint8x16_t bytes2 = vld1q_u8(T + 16);
+
+            v_s2 = vaddq_u32(v_s2, v_s1);
+            v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+            c1 = vaddw_u8(c1, vget_low_u8(bytes1));
+            c2 = vaddw_u8(c2, vget_high_u8(bytes1));
+            c3 = vaddw_u8(c3, vget_low_u8(bytes2));
+            c4 = vaddw_u8(c4, vget_high_u8(bytes2));
+            T += BLOCK_SIZE;
+        } while (--k);
+
+        v_s2 = vshlq_n_u32(v_s2, 5);
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(c1),  vld1_u16(taps + 0));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(c1), vld1_u16(taps + 4));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(c2),  vld1_u16(taps + 8));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(c2), vld1_u16(taps + 12));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(c3),  vld1_u16(taps + 16));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(c3), vld1_u16(taps + 20));
+        v_s2 = vmlal_u16(v_s2, vget_low_u16(c4),  vld1_u16(taps + 24));
+        v_s2 = vmlal_u16(v_s2, vget_high_u16(c4), vld1_u16(taps + 28));
+
+        uint32x2_t s1 = vadd_u32(vget_low_u32(v_s1), vget_high_u32(v_s1));
+        uint32x2_t s2 = vadd_u32(vget_low_u32(v_s2), vget_high_u32(v_s2));
+
+        sum1 += vget_lane_u32(vpadd_u32(s1, s1), 0);
+        sum2 += vget_lane_u32(vpadd_u32(s2, s2), 0);
+        MOD(sum1); MOD(sum2);
+    }
+
+    return bsc_adler32_update(sum1, sum2, T, n);
+}
+
+#endif
+
+static adler32_func bsc_adler32_select(void)
+{
+#ifdef ADLER32_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return bsc_adler32_avx2;
+    if (__builtin_cpu_supports("ssse3")) return bsc_adler32_ssse3;
+#endif
+#ifdef ADLER32_NEON
+    return bsc_adler32_neon;
+#endif
+    return bsc_adler32_scalar;
+}
+
+unsigned int bsc_adler32(const unsigned char * T, int n, int features)
+{
+    static const adler32_func kernel = bsc_adler32_select();
+
+    if (n < SIMD_MIN) return bsc_adler32_scalar(T, n);
+
+    return kernel(T, n);
+}
+
 /*-----------------------------------------------------------*/
 /* End                                           adler32.cpp */
 /*-----------------------------------------------------------*/
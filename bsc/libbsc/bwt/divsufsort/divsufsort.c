@@ -31,6 +31,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "divsufsort.h"
 
@@ -82,6 +83,13 @@
 #define SS_SMERGE_STACKSIZE (32)
 #define TR_INSERTIONSORT_THRESHOLD (8)
 #define TR_STACKSIZE (64)
+/* The induced sorting scans touch T at random. Prefetch that many entries ahead. */
+#define IS_PREFETCH_DISTANCE (32)
+#if defined(__GNUC__)
+# define IS_PREFETCH(_p) __builtin_prefetch((_p), 0, 0)
+#else
+# define IS_PREFETCH(_p)
+#endif
 
 
 /*- Macros -*/
@@ -1431,6 +1439,92 @@ trsort(int *ISA, int *SA, int n, int depth) {
 /*---------------------------------------------------------------------------*/
 
 /* Sorts suffixes of type B*. */
+#ifdef LIBBSC_OPENMP
+/* Below this size the parallel type scan does not pay for its extra buckets. */
+#define TYPE_SCAN_PARALLEL_MIN (1 << 20)
+
+/* Counts the type A, B and B* suffixes like the serial scan in sort_typeBstar
+   and stores the B* positions at the top of SA in ascending order. Every thread
+   scans its own segment with private buckets. A thread needs the type of the
+   suffix just after its segment, which is found by skipping the run of equal
+   characters that starts there. Each thread keeps its B* positions at the top
+   of its own segment, from where they are moved up into place afterwards.
+   Returns the number of B* suffixes or -1 if out of memory. */
+static
+int
+count_typeBstar_parallel(const unsigned char *T, int *SA,
+                         int *bucket_A, int *bucket_B,
+                         int n, int nthreads) {
+  int *bkt, *cnt;
+  int t, m;
+
+  bkt = (int *)bsc_zero_malloc((size_t)nthreads * (BUCKET_A_SIZE + BUCKET_B_SIZE) * sizeof(int));
+  cnt = (int *)bsc_malloc((size_t)nthreads * sizeof(int));
+  if((bkt == NULL) || (cnt == NULL)) {
+    bsc_free(cnt); bsc_free(bkt);
+    return -1;
+  }
+
+#pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+  for(t = 0; t < nthreads; ++t) {
+    int *tA = bkt + (size_t)t * (BUCKET_A_SIZE + BUCKET_B_SIZE);
+    int *tB = tA + BUCKET_A_SIZE;
+    int lo = (int)(((long long)n * t) / nthreads);
+    int hi = (int)(((long long)n * (t + 1)) / nthreads);
+    int i, j, c0, c1, next_a, cur_a, k;
+
+    if(hi == n) {
+      /* The last suffix is type A. */
+      c1 = T[n - 1];
+      ++tA[c1];
+      next_a = 1;
+      hi = n - 1;
+    } else {
+      for(j = hi; (j < n - 1) && (T[j] == T[j + 1]); ++j) { }
+      next_a = (j == n - 1) || (T[j] > T[j + 1]);
+      c1 = T[hi];
+    }
+    k = hi;
+    for(i = hi - 1; lo <= i; --i, c1 = c0, next_a = cur_a) {
+      c0 = T[i];
+      cur_a = (c0 > c1) || ((c0 == c1) && next_a);
+      if(cur_a) {
+        ++tA[c0];
+      } else if(next_a) {
+        ++tB[c0 * ALPHABET_SIZE + c1];
+        SA[--k] = i;
+      } else {
+        ++tB[c1 * ALPHABET_SIZE + c0];
+      }
+    }
+    cnt[t] = hi - k;
+  }
+
+  /* Move every segment's B* positions up into place, the topmost first. */
+  for(t = nthreads - 1, m = 0; 0 <= t; --t) {
+    int hi = (int)(((long long)n * (t + 1)) / nthreads);
+    if(hi == n) { hi = n - 1; }
+    m += cnt[t];
+    if(0 < cnt[t]) {
+      memmove(SA + n - m, SA + hi - cnt[t], (size_t)cnt[t] * sizeof(int));
+    }
+  }
+
+  for(t = 0; t < nthreads; ++t) {
+    int *tA = bkt + (size_t)t * (BUCKET_A_SIZE + BUCKET_B_SIZE);
+    int *tB = tA + BUCKET_A_SIZE;
+    int i;
+
+    for(i = 0; i < BUCKET_A_SIZE; ++i) { bucket_A[i] += tA[i]; }
+    for(i = 0; i < BUCKET_B_SIZE; ++i) { bucket_B[i] += tB[i]; }
+  }
+
+  bsc_free(cnt);
+  bsc_free(bkt);
+  return m;
+}
+#endif
+
 static
 int
 sort_typeBstar(const unsigned char *T, int *SA,
@@ -1454,6 +1548,15 @@ sort_typeBstar(const unsigned char *T, int *SA,
   /* Count the number of occurrences of the first one or two characters of each
      type A, B and B* suffix. Moreover, store the beginning position of all
      type B* suffixes into the array SA. */
+  m = -1;
+#ifdef LIBBSC_OPENMP
+  if (openMP && (TYPE_SCAN_PARALLEL_MIN <= n) && (1 < omp_get_max_threads()))
+  {
+      m = count_typeBstar_parallel(T, SA, bucket_A, bucket_B, n, omp_get_max_threads());
+  }
+#endif
+  if(m < 0)
+  {
   for(i = n - 1, m = n, c0 = T[n - 1]; 0 <= i;) {
     /* type A suffix. */
     do { ++BUCKET_A(c1 = c0); } while((0 <= --i) && ((c0 = T[i]) >= c1));
@@ -1468,6 +1571,7 @@ sort_typeBstar(const unsigned char *T, int *SA,
     }
   }
   m = n - m;
+  }
 /*
 note:
   A type B* suffix is lexicographically smaller than a type B suffix that
@@ -1620,6 +1724,9 @@ construct_SA(const unsigned char *T, int *SA,
           j = SA + BUCKET_A(c1 + 1) - 1, k = NULL, c2 = -1;
           i <= j;
           --j) {
+        if((i <= j - IS_PREFETCH_DISTANCE) && (1 < (s = j[-IS_PREFETCH_DISTANCE]))) {
+          IS_PREFETCH(T + s - 2);
+        }
         if(0 < (s = *j)) {
           assert(T[s] == c1);
           assert(((s + 1) < n) && (T[s] <= T[s + 1]));
@@ -1647,6 +1754,9 @@ construct_SA(const unsigned char *T, int *SA,
   *k++ = (T[n - 2] < c2) ? ~(n - 1) : (n - 1);
   /* Scan the suffix array from left to right. */
   for(i = SA, j = SA + n; i < j; ++i) {
+    if((i + IS_PREFETCH_DISTANCE < j) && (1 < (s = i[IS_PREFETCH_DISTANCE]))) {
+      IS_PREFETCH(T + s - 2);
+    }
     if(0 < (s = *i)) {
       assert(T[s - 1] >= T[s]);
       c0 = T[--s];
@@ -1684,6 +1794,9 @@ construct_BWT(const unsigned char *T, int *SA,
           j = SA + BUCKET_A(c1 + 1) - 1, k = NULL, c2 = -1;
           i <= j;
           --j) {
+        if((i <= j - IS_PREFETCH_DISTANCE) && (1 < (s = j[-IS_PREFETCH_DISTANCE]))) {
+          IS_PREFETCH(T + s - 2);
+        }
         if(0 < (s = *j)) {
           assert(T[s] == c1);
           assert(((s + 1) < n) && (T[s] <= T[s + 1]));
@@ -1714,6 +1827,9 @@ construct_BWT(const unsigned char *T, int *SA,
   *k++ = (T[n - 2] < c2) ? ~((int)T[n - 2]) : (n - 1);
   /* Scan the suffix array from left to right. */
   for(i = SA, j = SA + n, orig = SA; i < j; ++i) {
+    if((i + IS_PREFETCH_DISTANCE < j) && (1 < (s = i[IS_PREFETCH_DISTANCE]))) {
+      IS_PREFETCH(T + s - 2);
+    }
     if(0 < (s = *i)) {
       assert(T[s - 1] >= T[s]);
       c0 = T[--s];
@@ -1765,6 +1881,9 @@ construct_BWT_indexes(const unsigned char *T, int *SA,
           j = SA + BUCKET_A(c1 + 1) - 1, k = NULL, c2 = -1;
           i <= j;
           --j) {
+        if((i <= j - IS_PREFETCH_DISTANCE) && (1 < (s = j[-IS_PREFETCH_DISTANCE]))) {
+          IS_PREFETCH(T + s - 2);
+        }
         if(0 < (s = *j)) {
           assert(T[s] == c1);
           assert(((s + 1) < n) && (T[s] <= T[s + 1]));
@@ -1805,6 +1924,9 @@ construct_BWT_indexes(const unsigned char *T, int *SA,
 
   /* Scan the suffix array from left to right. */
   for(i = SA, j = SA + n, orig = SA; i < j; ++i) {
+    if((i + IS_PREFETCH_DISTANCE < j) && (1 < (s = i[IS_PREFETCH_DISTANCE]))) {
+      IS_PREFETCH(T + s - 2);
+    }
     if(0 < (s = *i)) {
       assert(T[s - 1] >= T[s]);
 
@@ -46,6 +46,57 @@ See also the bsc and libbsc web site:
 
 #include "qlfc_model.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+    #include <emmintrin.h>
+    #define QLFC_SSE2
+#endif
+
+#ifdef QLFC_SSE2
+
+static const unsigned char qlfc_lane_index[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+/* Returns the position of c in the MTF table, c must be present. */
+static INLINE int bsc_qlfc_mtf_find(const unsigned char * RESTRICT MTFTable, unsigned char c)
+{
+    __m128i v = _mm_set1_epi8((char)c);
+    for (int rank = 0; ; rank += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(MTFTable + rank)), v));
+        if (mask != 0) return rank + __builtin_ctz(mask);
+    }
+}
+
+/* Moves entries [0, rank) up by one. Entries above rank are left alone. */
+static INLINE void bsc_qlfc_mtf_shift_up(unsigned char * RESTRICT MTFTable, int rank)
+{
+    if (rank <= 16)
+    {
+        __m128i keep = _mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)qlfc_lane_index), _mm_set1_epi8((char)rank));
+        __m128i src  = _mm_loadu_si128((const __m128i *)(MTFTable + 0));
+        __m128i dst  = _mm_loadu_si128((const __m128i *)(MTFTable + 1));
+        _mm_storeu_si128((__m128i *)(MTFTable + 1), _mm_or_si128(_mm_and_si128(keep, src), _mm_andnot_si128(keep, dst)));
+    }
+    else
+    {
+        memmove(MTFTable + 1, MTFTable, rank);
+    }
+}
+
+/* Returns the position below the run of c that ends at i. */
+static INLINE int bsc_qlfc_run_start(const unsigned char * RESTRICT input, int i, unsigned char c)
+{
+    __m128i v = _mm_set1_epi8((char)c);
+    for (; i >= 15; i -= 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(input + i - 15)), v));
+        if (mask != 0xffff) return i - 15 + (31 - __builtin_clz(~mask & 0xffff));
+    }
+    for (; (i >= 0) && (input[i] == c); --i) ;
+    return i;
+}
+
+#endif
+
 int bsc_qlfc_init(int features)
 {
     return bsc_qlfc_init_static_model();
@@ -67,6 +118,12 @@ unsigned char * bsc_qlfc_transform(const unsigned char * RESTRICT input, unsigne
     for (int i = n - 1; i >= 0;)
     {
         unsigned char currentChar = input[i--];
+#ifdef QLFC_SSE2
+        i = bsc_qlfc_run_start(input, i, currentChar);
+
+        unsigned char rank = (unsigned char)bsc_qlfc_mtf_find(MTFTable, currentChar);
+        bsc_qlfc_mtf_shift_up(MTFTable, rank); MTFTable[0] = currentChar;
+#else
         for (; (i >= 0) && (input[i] == currentChar); --i) ;
 
         unsigned char previousChar = MTFTable[0], rank = 1; MTFTable[0] = currentChar;
@@ -86,6 +143,7 @@ unsigned char * bsc_qlfc_transform(const unsigned char * RESTRICT input, unsigne
 
             rank += 4; previousChar = temporaryChar3;
         }
+#endif
 
         if (Flag[currentChar] == 0)
         {
@@ -487,7 +487,8 @@ int bsc_decompress(unsigned char * input, int inputSize, unsigned char * output,
 
     int             index           = *(int *)(input + 12);
     int             features_stored = *(int *)(input + 16);
-    if (features_stored != features) return LIBBSC_DATA_CORRUPT;
+    /* The multithreading feature does not change the stream format. */
+    if ((features_stored ^ features) & ~LIBBSC_FEATURE_MULTITHREADING) return LIBBSC_DATA_CORRUPT;
 
     num_indexes = input[blockSize - 1];
     if (num_indexes > 0)
@@ -271,15 +271,15 @@ bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
 	bufio_t pf;
 
 	sz = sizeof (bsize_t);
-	I = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sz);
-	V = (bsize_t *)slab_alloc(NULL, (oldsize+1)*sz);
+	I = (bsize_t *)slab_tmp_alloc(NULL, (oldsize+1)*sz);
+	V = (bsize_t *)slab_tmp_alloc(NULL, (oldsize+1)*sz);
 	if(I == NULL || V == NULL) return (0);
 
 	qsufsort(I,V,oldbuf,oldsize);
 	slab_free(NULL, V);
 
-	if(((db=(u_char *)slab_alloc(NULL, newsize+1))==NULL) ||
-		((eb=(u_char *)slab_alloc(NULL, newsize+1))==NULL)) {
+	if(((db=(u_char *)slab_tmp_alloc(NULL, newsize+1))==NULL) ||
+		((eb=(u_char *)slab_tmp_alloc(NULL, newsize+1))==NULL)) {
 		log_msg(LOG_ERR, 0, "bsdiff: Memory allocation error.\n");
 		slab_free(NULL, I);
 		slab_free(NULL, V);
@@ -402,7 +402,7 @@ bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
 
 	/* If our data can fit in the scratch area use it otherwise alloc. */
 	if (ulen > scratchsize) {
-		cb = (u_char *)slab_alloc(NULL, ulen);
+		cb = (u_char *)slab_tmp_alloc(NULL, ulen);
 	} else {
 		cb = scratch;
 	}
@@ -144,8 +144,8 @@ bspatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t *
 	*_newsize = newsize;
 
 	/* Allocate buffers. */
-	diffdata = (u_char *)slab_alloc(NULL, datalen);
-	extradata = (u_char *)slab_alloc(NULL, extralen);
+	diffdata = (u_char *)slab_tmp_alloc(NULL, datalen);
+	extradata = (u_char *)slab_tmp_alloc(NULL, extralen);
 	if (diffdata == NULL || extradata == NULL) {
 		log_msg(LOG_ERR, 0, "bspatch: Out of memory.\n");
 		if (diffdata) slab_free(NULL, diffdata);
@@ -156,7 +156,7 @@ bspatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t *
 	/* Decompress ctrldata, diffdata and extradata. */
 	if (lzctrllen < ctrllen) {
 		/* Ctrl data will be RLE-d if RLE size is less. */
-		ctrldata = (u_char *)slab_alloc(NULL, ctrllen);
+		ctrldata = (u_char *)slab_tmp_alloc(NULL, ctrllen);
 		if (ctrldata == NULL) {
 			log_msg(LOG_ERR, 0, "bspatch: Out of memory.\n");
 			slab_free(NULL, diffdata);
@@ -0,0 +1,231 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ * A hash based delta encoder in the style of xdelta/VCDIFF. Every position
+ * of the old buffer is indexed by a hash of the 8 bytes starting there and
+ * the new buffer is encoded as a sequence of literal runs and copies from the
+ * old buffer. This is linear time and needs a small table instead of the
+ * suffix array bsdiff builds, at the cost of not encoding small differences
+ * inside matching regions.
+ *
+ * Patch format, all lengths are varints:
+ *	0	4	HDELTA_MAGIC | total length of patch
+ *	4	4	length of new buffer
+ *	8	??	(literal length, literals, copy length, copy offset)...
+ * The last copy length is 0 and has no offset. Since the first word of a
+ * bsdiff patch is a compressed length below 2GB the MSB tells them apart.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <allocator.h>
+#include <utils.h>
+
+#define	HDELTA_MAGIC	(0x80000000UL)
+#define	HDELTA_HDR	8
+#define	HDELTA_MINMATCH	12
+#define	HDELTA_PRIME	(0x9E3779B185EBCA87ULL)
+
+static inline uint32_t
+hdelta_hash(uchar_t *p, int bits)
+{
+	return ((uint32_t)((U64_P(p) * HDELTA_PRIME) >> (64 - bits)));
+}
+
+static inline uchar_t *
+put_varint(uchar_t *op, uint32_t val)
+{
+	while (val >= 0x80) {
+		*op++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*op++ = val;
+	return (op);
+}
+
+static inline uchar_t *
+get_varint(uchar_t *ip, uchar_t *iend, uint32_t *val)
+{
+	uint32_t v;
+	int shift;
+
+	v = 0;
+	shift = 0;
+	while (ip < iend && shift < 32) {
+		v |= (uint32_t)(*ip & 0x7f) << shift;
+		if (!(*ip++ & 0x80)) {
+			*val = v;
+			return (ip);
+		}
+		shift += 7;
+	}
+	return (NULL);
+}
+
+int
+is_hdelta(uchar_t *pbuf)
+{
+	return ((ntohl(U32_P(pbuf)) & HDELTA_MAGIC) != 0);
+}
+
+bsize_t
+get_hdelta_sz(uchar_t *pbuf)
+{
+	return (ntohl(U32_P(pbuf)) & ~HDELTA_MAGIC);
+}
+
+/*
+ * Encode newbuf against oldbuf into diff. Returns the patch length or 0 if the
+ * patch does not fit in maxsize bytes.
+ */
+bsize_t
+hdelta(uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf, bsize_t newsize,
+       uchar_t *diff, bsize_t maxsize)
+{
+	uint32_t *htab, cand;
+	uchar_t *op, *oend;
+	bsize_t pos, lit, len, back, end, i;
+	int bits;
+
+	if (oldsize < HDELTA_MINMATCH || newsize < HDELTA_MINMATCH || maxsize <= HDELTA_HDR + 10)
+		return (0);
+
+	bits = 10;
+	while ((1 << bits) < oldsize && bits < 20)
+		bits++;
+	htab = (uint32_t *)slab_tmp_calloc(NULL, 1 << bits, sizeof (uint32_t));
+	if (htab == NULL)
+		return (0);
+
+	/*
+	 * Index the old buffer. Walk backward so that the earliest position wins
+	 * and entries are 1-based to leave 0 as empty.
+	 */
+	for (i = oldsize - sizeof (uint64_t) + 1; i > 0; i--) {
+		htab[hdelta_hash(oldbuf + i - 1, bits)] = i;
+	}
+
+	op = diff + HDELTA_HDR;
+	oend = diff + maxsize - 10;
+	lit = 0;
+	pos = 0;
+	end = newsize - sizeof (uint64_t);
+	while (pos <= end) {
+		cand = htab[hdelta_hash(newbuf + pos, bits)];
+		if (cand == 0 || U64_P(oldbuf + cand - 1) != U64_P(newbuf + pos)) {
+			pos++;
+			continue;
+		}
+		cand--;
+		len = sizeof (uint64_t);
+		while (pos + len < newsize && cand + len < oldsize &&
+		    newbuf[pos + len] == oldbuf[cand + len])
+			len++;
+
+		/*
+		 * Extend backward into the pending literal run.
+		 */
+		back = 0;
+		while (back < pos - lit && back < cand &&
+		    newbuf[pos - back - 1] == oldbuf[cand - back - 1])
+			back++;
+		if (len + back < HDELTA_MINMATCH) {
+			pos++;
+			continue;
+		}
+		pos -= back;
+		cand -= back;
+		len += back;
+
+		if (op + (pos - lit) + 15 > oend)
+			goto fail;
+		op = put_varint(op, pos - lit);
+		memcpy(op, newbuf + lit, pos - lit);
+		op += pos - lit;
+		op = put_varint(op, len);
+		op = put_varint(op, cand);
+		pos += len;
+		lit = pos;
+	}
+
+	if (op + (newsize - lit) + 10 > oend)
+		goto fail;
+	op = put_varint(op, newsize - lit);
+	memcpy(op, newbuf + lit, newsize - lit);
+	op += newsize - lit;
+	op = put_varint(op, 0);
+	slab_free(NULL, htab);
+
+	U32_P(diff) = htonl((op - diff) | HDELTA_MAGIC);
+	U32_P(diff + 4) = htonl(newsize);
+	return (op - diff);
+fail:
+	slab_free(NULL, htab);
+	return (0);
+}
+
+/*
+ * Rebuild newbuf from oldbuf and the patch. *newsize holds the size of newbuf
+ * on entry and the decoded length on return. Returns 1 on success and 0 on a
+ * corrupt patch.
+ */
+int
+hpatch(uchar_t *pbuf, uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf, bsize_t *newsize)
+{
+	uchar_t *ip, *iend, *np;
+	uint32_t lit, len, off, nsz;
+
+	iend = pbuf + get_hdelta_sz(pbuf);
+	nsz = ntohl(U32_P(pbuf + 4));
+	if (nsz > *newsize) {
+		log_msg(LOG_ERR, 0, "Output buffer too small.\n");
+		return (0);
+	}
+	ip = pbuf + HDELTA_HDR;
+	np = newbuf;
+	for (;;) {
+		if ((ip = get_varint(ip, iend, &lit)) == NULL ||
+		    lit > iend - ip || lit > nsz - (np - newbuf))
+			goto corrupt;
+		memcpy(np, ip, lit);
+		np += lit;
+		ip += lit;
+		if ((ip = get_varint(ip, iend, &len)) == NULL)
+			goto corrupt;
+		if (len == 0)
+			break;
+		if ((ip = get_varint(ip, iend, &off)) == NULL || off > oldsize ||
+		    len > oldsize - off || len > nsz - (np - newbuf))
+			goto corrupt;
+		memcpy(np, oldbuf + off, len);
+		np += len;
+	}
+	if (np - newbuf != nsz)
+		goto corrupt;
+	*newsize = nsz;
+	return (1);
+corrupt:
+	log_msg(LOG_ERR, 0, "hpatch: Corrupt patch\n");
+	return (0);
+}
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <bzlib.h>
 #include <utils.h>
@@ -35,6 +36,21 @@
  */
 #define	SINGLE_CALL_MAX (2147483648UL)
 
+/*
+ * When a chunk gets spare processors it is split into up to BZIP2_SPLIT_MAX
+ * blocks that are encoded and decoded independently in parallel. Each block
+ * is a complete bzip2 stream and the blocks together form a standard
+ * concatenated bzip2 stream. Block boundaries are rounded to whole bzip2
+ * blocks of the compression level so that splitting costs little ratio.
+ * Such a chunk starts with a marker byte that can not begin a bzip2 stream,
+ * followed by the block count and the compressed and uncompressed length of
+ * every block as 64-bit big-endian values.
+ */
+#define	BZIP2_SPLIT_MARK	0xFF
+#define	BZIP2_SPLIT_MAX		16
+#define	BZIP2_BLOCK(level)	((uint64_t)(level) * 100000)
+#define	BZIP2_SPLIT_HDR(n)	(2 + (n) * 2 * sizeof (uint64_t))
+
 static void *
 slab_alloc_i(void *p, int items, int size) {
 	void *ptr;
@@ -51,8 +67,12 @@ bzip2_stats(int show)
 
 void
 bzip2_props(algo_props_t *data, int level, uint64_t chunksize) {
+	data->single_chunk_mt_capable = 1;
+	data->c_max_threads = BZIP2_SPLIT_MAX;
+	data->d_max_threads = BZIP2_SPLIT_MAX;
 	data->delta2_span = 200;
 	data->deltac_min_distance = FOURM;
+	data->state_mem = EIGHTM;
 }
 
 int
@@ -93,9 +113,8 @@ bzerr(int err)
 	}
 }
 
-int
-bzip2_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
-	       int level, uchar_t chdr, int btype, void *data)
+static int
+bzip2_enc_run(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int level)
 {
 	bz_stream bzs;
 	int ret, ending;
@@ -105,19 +124,6 @@ bzip2_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	char *dst1 = (char *)dst;
 	char *src1 = (char *)src;
 
-	/*
-	 * If the data is known to be compressed then certain types less compressed data
-	 * can be attempted to be compressed again for a possible gain. For others it is
-	 * a waste of time.
-	 */
-	if (PC_TYPE(btype) & TYPE_COMPRESSED && level < 7) {
-		int subtype = PC_SUBTYPE(btype);
-
-		if (subtype != TYPE_COMPRESSED_LZW && subtype != TYPE_COMPRESSED_GZ &&
-		    subtype != TYPE_COMPRESSED_LZ && subtype != TYPE_COMPRESSED_LZO) {
-			return (-1);
-		}
-	}
 	bzs.bzalloc = slab_alloc_i;
 	bzs.bzfree = slab_free;
 	bzs.opaque = NULL;
@@ -175,9 +181,8 @@ bzip2_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	return (0);
 }
 
-int
-bzip2_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
-		 int level, uchar_t chdr, int btype, void *data)
+static int
+bzip2_dec_run(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
 {
 	bz_stream bzs;
 	int ret;
@@ -220,6 +225,12 @@ bzip2_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 			bzerr(ret);
 			return (-1);
 		}
+		if (ret == BZ_OK && bzs.avail_in == slen && bzs.avail_out == dlen) {
+			/* No progress: output buffer full or truncated input. */
+			BZ2_bzDecompressEnd(&bzs);
+			bzerr(BZ_OUTBUFF_FULL);
+			return (-1);
+		}
 		dst1 += (dlen - bzs.avail_out);
 		_dstlen -= (dlen - bzs.avail_out);
 		src1 += (slen - bzs.avail_in);
@@ -231,3 +242,144 @@ bzip2_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	BZ2_bzDecompressEnd(&bzs);
 	return (0);
 }
+
+static int
+bzip2_compress_split(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
+	int level, int nblk, uint64_t bsz)
+{
+	uchar_t *bdst[BZIP2_SPLIT_MAX];
+	uint64_t blen[BZIP2_SPLIT_MAX], bclen[BZIP2_SPLIT_MAX], pos;
+	int i, err;
+
+	for (i = 0; i < nblk; i++) {
+		blen[i] = (i < nblk - 1 ? bsz : srclen - bsz * (nblk - 1));
+		bdst[i] = NULL;
+	}
+	err = 0;
+
+#	pragma omp parallel for num_threads(nblk) schedule(static, 1)
+	for (i = 0; i < nblk; i++) {
+		bdst[i] = (uchar_t *)slab_alloc(NULL, blen[i]);
+		if (bdst[i] == NULL) {
+			err = 1;
+			continue;
+		}
+		bclen[i] = blen[i];
+		if (bzip2_enc_run(src + bsz * i, blen[i], bdst[i], &(bclen[i]), level) != 0)
+			err = 1;
+	}
+
+	pos = BZIP2_SPLIT_HDR(nblk);
+	for (i = 0; i < nblk && !err; i++) {
+		if (pos + bclen[i] > *dstlen) {
+			err = 1;
+			break;
+		}
+		memcpy(dst + pos, bdst[i], bclen[i]);
+		U64_P(dst + 2 + i * 16) = htonll(bclen[i]);
+		U64_P(dst + 2 + i * 16 + 8) = htonll(blen[i]);
+		pos += bclen[i];
+	}
+	for (i = 0; i < nblk; i++) {
+		if (bdst[i])
+			slab_free(NULL, bdst[i]);
+	}
+	if (err)
+		return (-1);
+	dst[0] = BZIP2_SPLIT_MARK;
+	dst[1] = nblk;
+	*dstlen = pos;
+	return (0);
+}
+
+static int
+bzip2_decompress_split(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t coff[BZIP2_SPLIT_MAX], doff[BZIP2_SPLIT_MAX];
+	uint64_t clen[BZIP2_SPLIT_MAX], ulen[BZIP2_SPLIT_MAX];
+	uint64_t cpos, dpos;
+	int i, nblk, err;
+
+	nblk = src[1];
+	if (nblk < 2 || nblk > BZIP2_SPLIT_MAX || srclen < BZIP2_SPLIT_HDR(nblk)) {
+		bzerr(BZ_DATA_ERROR);
+		return (-1);
+	}
+	cpos = BZIP2_SPLIT_HDR(nblk);
+	dpos = 0;
+	for (i = 0; i < nblk; i++) {
+		clen[i] = ntohll(U64_P(src + 2 + i * 16));
+		ulen[i] = ntohll(U64_P(src + 2 + i * 16 + 8));
+		if (clen[i] > srclen - cpos || ulen[i] > *dstlen - dpos) {
+			bzerr(BZ_DATA_ERROR);
+			return (-1);
+		}
+		coff[i] = cpos;
+		doff[i] = dpos;
+		cpos += clen[i];
+		dpos += ulen[i];
+	}
+	err = 0;
+
+#	pragma omp parallel for schedule(static, 1)
+	for (i = 0; i < nblk; i++) {
+		uint64_t dlen = ulen[i];
+
+		if (bzip2_dec_run(src + coff[i], clen[i], dst + doff[i], &dlen) != 0 ||
+		    dlen != ulen[i]) {
+			err = 1;
+		}
+	}
+	if (err)
+		return (-1);
+	*dstlen = dpos;
+	return (0);
+}
+
+int
+bzip2_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+	       int level, uchar_t chdr, int btype, void *data)
+{
+	uint64_t blk, bsz;
+	int nblk;
+
+	/*
+	 * If the data is known to be compressed then certain types less compressed data
+	 * can be attempted to be compressed again for a possible gain. For others it is
+	 * a waste of time.
+	 */
+	if (PC_TYPE(btype) & TYPE_COMPRESSED && level < 7) {
+		int subtype = PC_SUBTYPE(btype);
+
+		if (subtype != TYPE_COMPRESSED_LZW && subtype != TYPE_COMPRESSED_GZ &&
+		    subtype != TYPE_COMPRESSED_LZ && subtype != TYPE_COMPRESSED_LZO) {
+			return (-1);
+		}
+	}
+
+	/*
+	 * Split into equal runs of whole bzip2 blocks, one per available thread.
+	 */
+	blk = BZIP2_BLOCK(level < 1 ? 1 : level);
+	nblk = get_chunk_threads();
+	if (nblk > BZIP2_SPLIT_MAX)
+		nblk = BZIP2_SPLIT_MAX;
+	if (nblk > 1 && srclen >= 2 * blk) {
+		bsz = srclen / nblk;
+		bsz = (bsz + blk - 1) / blk * blk;
+		nblk = (srclen + bsz - 1) / bsz;
+		if (nblk > 1)
+			return (bzip2_compress_split((uchar_t *)src, srclen, (uchar_t *)dst,
+			    dstlen, level, nblk, bsz));
+	}
+	return (bzip2_enc_run((uchar_t *)src, srclen, (uchar_t *)dst, dstlen, level));
+}
+
+int
+bzip2_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+		 int level, uchar_t chdr, int btype, void *data)
+{
+	if (srclen > 0 && *((uchar_t *)src) == BZIP2_SPLIT_MARK)
+		return (bzip2_decompress_split((uchar_t *)src, srclen, (uchar_t *)dst, dstlen));
+	return (bzip2_dec_run((uchar_t *)src, srclen, (uchar_t *)dst, dstlen));
+}
@@ -66,23 +66,69 @@
 #include <crypto_aesctr.h>
 #include <utils.h>
 #include "crypto_aes.h"
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 extern int geturandom_bytes(uchar_t *rbytes, int nbytes);
 extern uint64_t lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc);
+#if defined(__x86_64__)
 extern int vpaes_set_encrypt_key(const unsigned char *userKey, int bits, AES_KEY *key);
 extern void vpaes_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key);
 extern int aesni_set_encrypt_key(const unsigned char *userKey, int bits, AES_KEY *key);
 extern void aesni_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key);
+#endif
 
 setkey_func_ptr enc_setkey;
 encrypt_func_ptr enc_encrypt;
 
+#if defined(__aarch64__)
+/*
+ * AES block encryption with the ARMv8 Cryptography Extensions. The round
+ * keys come from the reference key schedule, which keeps every word as a
+ * big-endian number. They are byte swapped once here so that each round key
+ * can be loaded straight into a vector in the byte order AESE expects.
+ */
+static int
+armv8_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
+{
+	int i, rv;
+
+	rv = AES_set_encrypt_key(userKey, bits, key);
+	if (rv != 0)
+		return (rv);
+	for (i = 0; i < 4 * (key->rounds + 1); i++)
+		key->rd_key[i] = __builtin_bswap32(key->rd_key[i]);
+	return (0);
+}
+
+/*
+ * AESE does AddRoundKey, SubBytes and ShiftRows, AESMC does MixColumns.
+ * The last round has no MixColumns and ends with the final key XOR.
+ */
+static __attribute__((target("+crypto"))) void
+armv8_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+	const uint8_t *rk = (const uint8_t *)key->rd_key;
+	uint8x16_t st;
+	int i;
+
+	st = vld1q_u8(in);
+	for (i = 0; i < key->rounds - 1; i++)
+		st = vaesmcq_u8(vaeseq_u8(st, vld1q_u8(rk + i * 16)));
+	st = vaeseq_u8(st, vld1q_u8(rk + i * 16));
+	st = veorq_u8(st, vld1q_u8(rk + (i + 1) * 16));
+	vst1q_u8(out, st);
+}
+#endif
+
 void
 aes_module_init(processor_cap_t *pc)
 {
 	enc_setkey = AES_set_encrypt_key;
 	enc_encrypt = AES_encrypt;
 
+#if defined(__x86_64__)
 	if (pc->proc_type == PROC_X64_INTEL || pc->proc_type == PROC_X64_AMD) {
 		if (pc->aes_avail) {
 			enc_setkey = aesni_set_encrypt_key;
@@ -93,6 +139,12 @@ aes_module_init(processor_cap_t *pc)
 			enc_encrypt = vpaes_encrypt;
 		}
 	}
+#elif defined(__aarch64__)
+	if (pc->proc_type == PROC_ARM64 && pc->aes_avail) {
+		enc_setkey = armv8_set_encrypt_key;
+		enc_encrypt = armv8_encrypt;
+	}
+#endif
 }
 
 int
@@ -216,6 +268,92 @@ aes_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t le
 	return (0);
 }
 
+/*
+ * AES-GCM keeps a cipher context with the key schedule set up so that the
+ * plain key can be erased after init. Each chunk works on a copy of it. The
+ * 128-bit IV is the 64-bit nonce followed by the chunk id.
+ */
+#define	AES_GCM_IVLEN	16
+#define	AES_GCM_SEG	(1U << 30)
+
+int
+aes_gcm_init(aes_ctx_t *ctx, int enc)
+{
+	EVP_CIPHER_CTX *gctx;
+	const EVP_CIPHER *cipher;
+
+	if (ctx->keylen == 16)
+		cipher = EVP_aes_128_gcm();
+	else if (ctx->keylen == 24)
+		cipher = EVP_aes_192_gcm();
+	else
+		cipher = EVP_aes_256_gcm();
+
+	gctx = EVP_CIPHER_CTX_new();
+	if (gctx == NULL)
+		return (-1);
+	if (EVP_CipherInit_ex(gctx, cipher, NULL, NULL, NULL, enc) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(gctx, EVP_CTRL_GCM_SET_IVLEN, AES_GCM_IVLEN, NULL) != 1 ||
+	    EVP_CipherInit_ex(gctx, NULL, NULL, ctx->pkey, NULL, enc) != 1) {
+		EVP_CIPHER_CTX_free(gctx);
+		log_msg(LOG_ERR, 0, "Failed to init AES-GCM\n");
+		return (-1);
+	}
+	ctx->gcm_ctx = gctx;
+	return (0);
+}
+
+/*
+ * Encrypt or decrypt a buffer and authenticate it along with the given
+ * additional data in a single pass. The tag is written when encrypting and
+ * checked when decrypting. Returns -1 on error or tag mismatch.
+ */
+int
+aes_gcm_crypt(aes_ctx_t *ctx, uchar_t *from, uchar_t *to, uint64_t len, uint64_t id,
+	      uchar_t *aad, int aadlen, uchar_t *tag, int enc)
+{
+	EVP_CIPHER_CTX *gctx;
+	uchar_t IV[AES_GCM_IVLEN];
+	uint64_t done;
+	int outl, rv;
+
+	gctx = EVP_CIPHER_CTX_new();
+	if (gctx == NULL)
+		return (-1);
+	rv = -1;
+	U64_P(IV) = htonll(ctx->nonce);
+	U64_P(IV + 8) = htonll(id);
+	if (EVP_CIPHER_CTX_copy(gctx, (EVP_CIPHER_CTX *)(ctx->gcm_ctx)) != 1 ||
+	    EVP_CipherInit_ex(gctx, NULL, NULL, NULL, IV, enc) != 1)
+		goto gcm_done;
+	if (!enc && EVP_CIPHER_CTX_ctrl(gctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LEN,
+	    tag) != 1)
+		goto gcm_done;
+	if (aadlen > 0 && EVP_CipherUpdate(gctx, NULL, &outl, aad, aadlen) != 1)
+		goto gcm_done;
+
+	/*
+	 * The EVP interface takes int lengths.
+	 */
+	for (done = 0; done < len; done += outl) {
+		int seg = (len - done > AES_GCM_SEG ? AES_GCM_SEG : len - done);
+
+		if (EVP_CipherUpdate(gctx, to + done, &outl, from + done, seg) != 1)
+			goto gcm_done;
+	}
+	if (EVP_CipherFinal_ex(gctx, to + done, &outl) != 1)
+		goto gcm_done;
+	if (enc && EVP_CIPHER_CTX_ctrl(gctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LEN,
+	    tag) != 1)
+		goto gcm_done;
+	rv = 0;
+
+gcm_done:
+	EVP_CIPHER_CTX_free(gctx);
+	memset(IV, 0, sizeof (IV));
+	return (rv);
+}
+
 uchar_t *
 aes_nonce(aes_ctx_t *ctx)
 {
@@ -233,5 +371,7 @@ aes_cleanup(aes_ctx_t *ctx)
 {
 	memset((void *)(&ctx->key), 0, sizeof (ctx->key));
 	ctx->nonce = 0;
+	if (ctx->gcm_ctx != NULL)
+		EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)(ctx->gcm_ctx));
 	free(ctx);
 }
@@ -43,12 +43,16 @@ typedef struct {
 	AES_KEY key;
 	int keylen;
 	uchar_t pkey[MAX_KEYLEN];
+	void *gcm_ctx;
 } aes_ctx_t;
 
 int aes_init(aes_ctx_t *ctx, uchar_t *salt, int saltlen, uchar_t *pwd, int pwd_len,
 	     uint64_t nonce, int enc);
 int aes_encrypt(aes_ctx_t *ctx, uchar_t *plaintext, uchar_t *ciphertext, uint64_t len, uint64_t id);
 int aes_decrypt(aes_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t len, uint64_t id);
+int aes_gcm_init(aes_ctx_t *ctx, int enc);
+int aes_gcm_crypt(aes_ctx_t *ctx, uchar_t *from, uchar_t *to, uint64_t len, uint64_t id,
+		  uchar_t *aad, int aadlen, uchar_t *tag, int enc);
 uchar_t *aes_nonce(aes_ctx_t *ctx);
 void aes_clean_pkey(aes_ctx_t *ctx);
 void aes_cleanup(aes_ctx_t *ctx);
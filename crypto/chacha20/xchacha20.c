@@ -0,0 +1,386 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * XChaCha20 stream cipher. A subkey is derived from the key and the first
+ * 16 nonce bytes using HChaCha20, then ChaCha20 with a 64-bit block counter
+ * is run using the last 8 nonce bytes. This is the same construction as
+ * libsodium's crypto_stream_xchacha20 and the XSalsa20 code in this tree.
+ *
+ * Keystream blocks are independent so several are computed at once, one per
+ * vector lane. The kernel is written with GCC vector extensions and is built
+ * 4 wide, which gives SSE2 code on x86 and NEON code on ARM, and 8 wide with
+ * AVX2 on x86 CPUs that have it. This gives fast encryption on hosts without
+ * AES instructions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <crypto_scrypt.h>
+#include "crypto_xchacha20.h"
+
+extern int geturandom_bytes(uchar_t *rbytes, int nbytes);
+
+#define	CHACHA_BLK	64
+#define	MAX_LANES	8
+
+static const unsigned char sigma[16] = "expand 32-byte k";
+static const unsigned char tau[16] = "expand 16-byte k";
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+typedef void (*chacha_blocks_func_t)(uchar_t *ks, const uint32_t *state);
+
+static inline uint32_t
+ld32(const uchar_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (LE32(v));
+}
+
+#define	ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define	QR(a, b, c, d) do { \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7); \
+} while (0)
+
+#define	DOUBLE_ROUND(x) do { \
+	QR(x[0], x[4], x[8], x[12]); \
+	QR(x[1], x[5], x[9], x[13]); \
+	QR(x[2], x[6], x[10], x[14]); \
+	QR(x[3], x[7], x[11], x[15]); \
+	QR(x[0], x[5], x[10], x[15]); \
+	QR(x[1], x[6], x[11], x[12]); \
+	QR(x[2], x[7], x[8], x[13]); \
+	QR(x[3], x[4], x[9], x[14]); \
+} while (0)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Transpose 4 state words across lanes so that every lane's 16 keystream
+ * bytes become contiguous. For 8 lanes the same 4x4 transpose is done in
+ * each 128-bit half, giving lanes j and j + 4.
+ */
+#define	STORE_ROWS(ks, x, vtype, LANES) do { \
+	vtype t0, t1, t2, t3, r[4]; \
+	int g, l, h; \
+	for (g = 0; g < 4; g++) { \
+		t0 = SHUF(x[g * 4], x[g * 4 + 1], 0, 4, 1, 5); \
+		t1 = SHUF(x[g * 4 + 2], x[g * 4 + 3], 0, 4, 1, 5); \
+		t2 = SHUF(x[g * 4], x[g * 4 + 1], 2, 6, 3, 7); \
+		t3 = SHUF(x[g * 4 + 2], x[g * 4 + 3], 2, 6, 3, 7); \
+		r[0] = SHUF(t0, t1, 0, 1, 4, 5); \
+		r[1] = SHUF(t0, t1, 2, 3, 6, 7); \
+		r[2] = SHUF(t2, t3, 0, 1, 4, 5); \
+		r[3] = SHUF(t2, t3, 2, 3, 6, 7); \
+		for (h = 0; h < LANES / 4; h++) { \
+			for (l = 0; l < 4; l++) \
+				memcpy(ks + (h * 4 + l) * CHACHA_BLK + g * 16, \
+				    (uchar_t *)&r[l] + h * 16, 16); \
+		} \
+	} \
+} while (0)
+#else
+#define	STORE_ROWS(ks, x, vtype, LANES) do { \
+	uint32_t w; \
+	int i, j; \
+	for (j = 0; j < LANES; j++) { \
+		for (i = 0; i < 16; i++) { \
+			w = LE32(x[i][j]); \
+			memcpy(ks + j * CHACHA_BLK + i * 4, &w, 4); \
+		} \
+	} \
+} while (0)
+#endif
+
+/*
+ * Generate LANES consecutive keystream blocks starting at the block counter in
+ * state[12..13]. Lane j computes the block with counter + j.
+ */
+#define	CHACHA_BLOCKS(name, vtype, LANES, attr, ...) \
+static attr void \
+name(uchar_t *ks, const uint32_t *state) \
+{ \
+	vtype x[16], s[16], lane = { __VA_ARGS__ }; \
+	int i; \
+\
+	for (i = 0; i < 16; i++) \
+		s[i] = (vtype){0} + state[i]; \
+	s[12] += lane; \
+	s[13] -= (vtype)(s[12] < lane); \
+	for (i = 0; i < 16; i++) \
+		x[i] = s[i]; \
+	for (i = 0; i < 10; i++) \
+		DOUBLE_ROUND(x); \
+	for (i = 0; i < 16; i++) \
+		x[i] += s[i]; \
+	STORE_ROWS(ks, x, vtype, LANES); \
+}
+
+#define	SHUF(a, b, i0, i1, i2, i3) \
+	__builtin_shuffle(a, b, (v4u32){ i0, i1, i2, i3 })
+CHACHA_BLOCKS(chacha_blocks_4, v4u32, 4, , 0, 1, 2, 3)
+#undef	SHUF
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define	SHUF(a, b, i0, i1, i2, i3) \
+	__builtin_shuffle(a, b, (v8u32){ (i0) + ((i0) & 4), (i1) + ((i1) & 4), \
+	    (i2) + ((i2) & 4), (i3) + ((i3) & 4), (i0) + ((i0) & 4) + 4, \
+	    (i1) + ((i1) & 4) + 4, (i2) + ((i2) & 4) + 4, (i3) + ((i3) & 4) + 4 })
+CHACHA_BLOCKS(chacha_blocks_8, v8u32, 8, __attribute__((target("avx2"))),
+    0, 1, 2, 3, 4, 5, 6, 7)
+#undef	SHUF
+#endif
+
+static void
+hchacha20(uchar_t *out, const uchar_t *in, const uchar_t *k, const uchar_t *c)
+{
+	uint32_t x[16];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		x[i] = ld32(c + i * 4);
+		x[12 + i] = ld32(in + i * 4);
+	}
+	for (i = 0; i < 8; i++)
+		x[4 + i] = ld32(k + i * 4);
+	for (i = 0; i < 10; i++)
+		DOUBLE_ROUND(x);
+	for (i = 0; i < 4; i++) {
+		uint32_t lo = LE32(x[i]), hi = LE32(x[12 + i]);
+
+		memcpy(out + i * 4, &lo, 4);
+		memcpy(out + 16 + i * 4, &hi, 4);
+	}
+}
+
+static int
+crypto_xchacha20(uchar_t *c, const uchar_t *m, uint64_t mlen, const uchar_t *n,
+    const uchar_t *k, int klen)
+{
+	uchar_t subkey[32];
+	uchar_t ks[CHACHA_BLK * MAX_LANES];
+	uint32_t state[16];
+	chacha_blocks_func_t blocks;
+	uint64_t ctr, n1, a, b;
+	int lanes, i;
+
+	hchacha20(subkey, n, k, klen < XCHACHA20_CRYPTO_KEYBYTES ? tau : sigma);
+	for (i = 0; i < 4; i++)
+		state[i] = ld32(sigma + i * 4);
+	for (i = 0; i < 8; i++)
+		state[4 + i] = ld32(subkey + i * 4);
+	state[14] = ld32(n + 16);
+	state[15] = ld32(n + 20);
+
+	blocks = chacha_blocks_4;
+	lanes = 4;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (proc_info.avx_level >= 2) {
+		blocks = chacha_blocks_8;
+		lanes = 8;
+	}
+#endif
+
+	ctr = 0;
+	while (mlen > 0) {
+		state[12] = (uint32_t)ctr;
+		state[13] = (uint32_t)(ctr >> 32);
+		blocks(ks, state);
+		n1 = CHACHA_BLK * lanes;
+		if (n1 > mlen)
+			n1 = mlen;
+		for (i = 0; i + 8 <= n1; i += 8) {
+			memcpy(&a, m + i, 8);
+			memcpy(&b, ks + i, 8);
+			a ^= b;
+			memcpy(c + i, &a, 8);
+		}
+		for (; i < n1; i++)
+			c[i] = m[i] ^ ks[i];
+		m += n1;
+		c += n1;
+		mlen -= n1;
+		ctr += lanes;
+	}
+	memset(subkey, 0, sizeof (subkey));
+	memset(ks, 0, sizeof (ks));
+	memset(state, 0, sizeof (state));
+	return (0);
+}
+
+int
+chacha20_init(chacha20_ctx_t *ctx, uchar_t *salt, int saltlen, uchar_t *pwd, int pwd_len,
+	 uchar_t *nonce, int enc)
+{
+	struct timespec tp;
+	uint64_t tv;
+	uchar_t num[25];
+	uchar_t IV[32];
+	uchar_t *key = ctx->pkey;
+
+#ifndef	_USE_PBK
+	int logN;
+	uint32_t r, p;
+	uint64_t N;
+
+	pickparams(&logN, &r, &p);
+	N = (uint64_t)(1) << logN;
+	if (crypto_scrypt(pwd, pwd_len, salt, saltlen, N, r, p, key, ctx->keylen)) {
+		log_msg(LOG_ERR, 0, "Scrypt failed\n");
+		return (-1);
+	}
+#else
+	if (PKCS5_PBKDF2_HMAC((const char *)pwd, pwd_len, salt, saltlen, PBE_ROUNDS,
+	    EVP_sha256(), ctx->keylen, key) != 1) {
+		log_msg(LOG_ERR, 0, "PBKDF2 key derivation failed\n");
+		return (-1);
+	}
+#endif
+
+	/*
+	 * A 128-bit key is repeated to fill the 256-bit cipher key as is done
+	 * for XSalsa20.
+	 */
+	memcpy(ctx->key, key, ctx->keylen);
+	if (ctx->keylen < XCHACHA20_CRYPTO_KEYBYTES) {
+		uchar_t *k;
+		k = ctx->key + ctx->keylen;
+		memcpy(k, key, XCHACHA20_CRYPTO_KEYBYTES - ctx->keylen);
+	}
+
+	if (enc) {
+		int i;
+		uint64_t *n, *n1;
+
+		// Derive 192-bit nonce
+		if (RAND_status() != 1 || RAND_bytes(IV, XCHACHA20_CRYPTO_NONCEBYTES) != 1) {
+			if (geturandom_bytes(IV, XCHACHA20_CRYPTO_NONCEBYTES) != 0) {
+				if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1) {
+					time((time_t *)&tv);
+				} else {
+					tv = tp.tv_sec * 1000UL + tp.tv_nsec;
+				}
+				sprintf((char *)num, "%" PRIu64, tv);
+				PKCS5_PBKDF2_HMAC((const char *)num, strlen((char *)num), salt,
+						saltlen, PBE_ROUNDS, EVP_sha256(), 32, IV);
+			}
+		}
+		n = (uint64_t *)IV;
+		n1 = (uint64_t *)(ctx->nonce);
+		for (i = 0; i < XCHACHA20_CRYPTO_NONCEBYTES/8; i++) {
+			*n1 = LE64(*n);
+			n++;
+			n1++;
+		}
+
+		// Nullify stack components
+		memset(num, 0, 25);
+		memset(IV, 0, 32);
+		memset(&tp, 0, sizeof (tp));
+		tv = 0;
+	} else {
+		memcpy(ctx->nonce, nonce, XCHACHA20_CRYPTO_NONCEBYTES);
+		memset(nonce, 0, XCHACHA20_CRYPTO_NONCEBYTES);
+	}
+	return (0);
+}
+
+/*
+ * Each chunk uses the base nonce plus the chunk id, carried across the
+ * nonce words, so that no two chunks share a keystream.
+ */
+static int
+chacha20_crypt(chacha20_ctx_t *ctx, uchar_t *from, uchar_t *to, uint64_t len, uint64_t id)
+{
+	uchar_t nonce[XCHACHA20_CRYPTO_NONCEBYTES];
+	int i, rv;
+	uint64_t *n, carry;
+
+	for (i = 0; i < XCHACHA20_CRYPTO_NONCEBYTES; i++) nonce[i] = ctx->nonce[i];
+	carry = id;
+	n = (uint64_t *)nonce;
+	for (i = 0; i < XCHACHA20_CRYPTO_NONCEBYTES/8; i++) {
+		if (UINT64_MAX - *n < carry) {
+			carry = carry - (UINT64_MAX - *n);
+			*n = 0;
+		} else {
+			*n += carry;
+			carry = 0;
+			break;
+		}
+		++n;
+	}
+	if (carry) {
+		n = (uint64_t *)nonce;
+		*n += carry;
+		carry = 0;
+	}
+
+	rv = crypto_xchacha20(to, from, len, nonce, ctx->key, ctx->keylen);
+	memset(nonce, 0, XCHACHA20_CRYPTO_NONCEBYTES);
+	return (rv);
+}
+
+int
+chacha20_encrypt(chacha20_ctx_t *ctx, uchar_t *plaintext, uchar_t *ciphertext, uint64_t len, uint64_t id)
+{
+	return (chacha20_crypt(ctx, plaintext, ciphertext, len, id));
+}
+
+int
+chacha20_decrypt(chacha20_ctx_t *ctx, uchar_t *ciphertext, uchar_t *plaintext, uint64_t len, uint64_t id)
+{
+	return (chacha20_crypt(ctx, ciphertext, plaintext, len, id));
+}
+
+uchar_t *
+chacha20_nonce(chacha20_ctx_t *ctx)
+{
+	return (ctx->nonce);
+}
+
+void
+chacha20_clean_pkey(chacha20_ctx_t *ctx)
+{
+	memset(ctx->pkey, 0, ctx->keylen);
+}
+
+void
+chacha20_cleanup(chacha20_ctx_t *ctx)
+{
+	memset((void *)(&ctx->key), 0, sizeof (ctx->key));
+	memset(ctx->nonce, 0, XCHACHA20_CRYPTO_NONCEBYTES);
+	free(ctx);
+}
@@ -0,0 +1,254 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * CRC32C (Castagnoli polynomial) as used by iSCSI, ext4 and others.
+ *
+ * On x86 with SSE4.2 the crc32 instruction is used. It has a latency of 3
+ * cycles but a throughput of 1 per cycle, so large buffers are processed as
+ * three interleaved streams that are merged at the end of each stride. The
+ * merge shifts a CRC over a stride of zero bytes using precomputed tables.
+ * ARMv8 builds with the CRC extension use the crc32c instructions. All
+ * other cases use a slicing-by-8 table implementation.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define	CRC32C_POLY	0x82F63B78U
+#define	CRC32C_STRIDE	2048
+#define	COPY_SEG	(CRC32C_STRIDE * 3 * 2)
+
+static uint32_t sw_tab[8][256];
+static int crc32c_inited = 0;
+
+#if defined(__x86_64__)
+static uint32_t zero_tab[4][256];
+static int hw_avail = 0;
+#endif
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uchar_t *buf, uint64_t len)
+{
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = sw_tab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, 8);
+		v = LE64(v) ^ crc;
+		crc = sw_tab[7][v & 0xff] ^ sw_tab[6][(v >> 8) & 0xff] ^
+		    sw_tab[5][(v >> 16) & 0xff] ^ sw_tab[4][(v >> 24) & 0xff] ^
+		    sw_tab[3][(v >> 32) & 0xff] ^ sw_tab[2][(v >> 40) & 0xff] ^
+		    sw_tab[1][(v >> 48) & 0xff] ^ sw_tab[0][v >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = sw_tab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return (crc);
+}
+
+#if defined(__x86_64__)
+/*
+ * Advance a CRC over CRC32C_STRIDE zero bytes.
+ */
+static inline uint32_t
+crc32c_shift(uint32_t crc)
+{
+	return (zero_tab[0][crc & 0xff] ^ zero_tab[1][(crc >> 8) & 0xff] ^
+	    zero_tab[2][(crc >> 16) & 0xff] ^ zero_tab[3][crc >> 24]);
+}
+
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_hw(uint32_t crc, const uchar_t *buf, uint64_t len)
+{
+	uint64_t c0, c1, c2, v;
+	int i;
+
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	c0 = crc;
+	while (len >= CRC32C_STRIDE * 3) {
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC32C_STRIDE; i += 8) {
+			c0 = _mm_crc32_u64(c0, U64_P(buf + i));
+			c1 = _mm_crc32_u64(c1, U64_P(buf + CRC32C_STRIDE + i));
+			c2 = _mm_crc32_u64(c2, U64_P(buf + CRC32C_STRIDE * 2 + i));
+		}
+		c0 = crc32c_shift((uint32_t)c0) ^ c1;
+		c0 = crc32c_shift((uint32_t)c0) ^ c2;
+		buf += CRC32C_STRIDE * 3;
+		len -= CRC32C_STRIDE * 3;
+	}
+	while (len >= 8) {
+		memcpy(&v, buf, 8);
+		c0 = _mm_crc32_u64(c0, v);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c0;
+	while (len > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	return (crc);
+}
+
+static __attribute__((target("sse4.2"))) void
+crc32c_hw_init(void)
+{
+	uint32_t img[32];
+	uint64_t c;
+	int i, j, k, b;
+
+	for (i = 0; i < 32; i++) {
+		c = 1U << i;
+		for (j = 0; j < CRC32C_STRIDE; j += 8)
+			c = _mm_crc32_u64(c, 0);
+		img[i] = (uint32_t)c;
+	}
+	for (k = 0; k < 4; k++) {
+		for (b = 0; b < 256; b++) {
+			uint32_t v = 0;
+
+			for (j = 0; j < 8; j++) {
+				if (b & (1 << j))
+					v ^= img[k * 8 + j];
+			}
+			zero_tab[k][b] = v;
+		}
+	}
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t
+crc32c_hw(uint32_t crc, const uchar_t *buf, uint64_t len)
+{
+	uint64_t v;
+
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, buf, 8);
+		crc = __crc32cd(crc, v);
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+	return (crc);
+}
+#endif
+
+void
+crc32c_init(processor_cap_t *pc)
+{
+	uint32_t c;
+	int i, j;
+
+	if (crc32c_inited)
+		return;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+		sw_tab[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = sw_tab[0][i];
+		for (j = 1; j < 8; j++) {
+			c = sw_tab[0][c & 0xff] ^ (c >> 8);
+			sw_tab[j][i] = c;
+		}
+	}
+#if defined(__x86_64__)
+	if (pc->sse_level > 4 || (pc->sse_level == 4 && pc->sse_sub_level >= 2)) {
+		crc32c_hw_init();
+		hw_avail = 1;
+	}
+#endif
+	crc32c_inited = 1;
+}
+
+uint32_t
+crc32c(uint32_t crc, const uchar_t *buf, uint64_t len)
+{
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (hw_avail)
+		crc = crc32c_hw(crc, buf, len);
+	else
+		crc = crc32c_sw(crc, buf, len);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc = crc32c_hw(crc, buf, len);
+#else
+	crc = crc32c_sw(crc, buf, len);
+#endif
+	return (~crc);
+}
+
+/*
+ * Copy len bytes from buf to dst and return the updated CRC. The data is
+ * copied in L1 sized segments each of which is then checksummed while still
+ * in cache.
+ */
+uint32_t
+crc32c_copy(uint32_t crc, uchar_t *dst, const uchar_t *buf, uint64_t len)
+{
+	uint64_t c;
+
+	while (len > 0) {
+		c = len;
+		if (c > COPY_SEG)
+			c = COPY_SEG;
+		memcpy(dst, buf, c);
+		crc = crc32c(crc, buf, c);
+		dst += c;
+		buf += c;
+		len -= c;
+	}
+	return (crc);
+}
@@ -44,10 +44,19 @@
 #include <KeccakNISTInterface.h>
 #include <utils.h>
 #include <crypto_xsalsa20.h>
+#include <crypto_xchacha20.h>
+#include <crypto_scrypt.h>
 
 #include "crypto_utils.h"
 #include "sha2_utils.h"
 #include "sha3_utils.h"
+#include "mb_hash.h"
+#include "crc32c.h"
+#include "xxh3.h"
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #ifdef __HASH_COMPATIBILITY_
 #include "old/sha2_utils_old.h"
@@ -57,8 +66,16 @@
 #define	PROVIDER_OPENSSL	0
 #define	PROVIDER_X64_OPT	1
 
+/*
+ * Non-cryptographic checksums use HMAC-SHA256 when a MAC is needed.
+ */
+#define	NONCRYPTO_CKSUM(c)	((c) == CKSUM_CRC64 || (c) == CKSUM_CRC32C || \
+				(c) == CKSUM_XXH3 || (c) == CKSUM_XXH128)
+
 static void init_sha512(void);
 static void init_blake2(void);
+static void init_crc32c(void);
+static void init_xxh3(void);
 static struct blake2_dispatch	bdsp;
 
 /*
@@ -75,6 +92,12 @@ static struct {
 } cksum_props[] = {
 	{"CRC64",	"Extremely Fast 64-bit CRC from LZMA SDK.",
 			CKSUM_CRC64,		8,	32,	NULL, 0},
+	{"CRC32C",	"Hardware accelerated (SSE4.2, ARMv8) 32-bit Castagnoli CRC.",
+			CKSUM_CRC32C,		4,	32,	init_crc32c, 0},
+	{"XXH3",	"Extremely fast 64-bit XXH3 non-cryptographic hash.",
+			CKSUM_XXH3,		8,	32,	init_xxh3, 0},
+	{"XXH128",	"Extremely fast 128-bit XXH3 non-cryptographic hash.",
+			CKSUM_XXH128,		16,	32,	init_xxh3, 0},
 	{"SKEIN256",	"256-bit SKEIN a NIST SHA3 runners-up (90% faster than Keccak).",
 			CKSUM_SKEIN256,		32,	32,	NULL, 1},
 	{"SKEIN512",	"512-bit SKEIN",
@@ -181,7 +204,9 @@ get_crypto_alg(char *name)
 	if (name[0] == 0 || name[1] == 0 || name[2] == 0) {
 		return (0);
 	}
-	if (strncmp(name, "AES", 3) == 0) {
+	if (strcmp(name, "AES-GCM") == 0) {
+		return (CRYPTO_ALG_AES_GCM);
+	} else if (strncmp(name, "AES", 3) == 0) {
 		return (CRYPTO_ALG_AES);
 	} else {
 		if (name[3] == 0 || name[4] == 0 || name[5] == 0 || name[6] == 0) {
@@ -190,6 +215,11 @@ get_crypto_alg(char *name)
 		if (strncmp(name, "SALSA20", 3) == 0) {
 			return (CRYPTO_ALG_SALSA20);
 		}
+		if (name[7] == 0)
+			return (0);
+		if (strncmp(name, "CHACHA20", 3) == 0) {
+			return (CRYPTO_ALG_CHACHA20);
+		}
 	}
 	return (0);
 }
@@ -218,6 +248,18 @@ compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, in
 		uint64_t *ck = (uint64_t *)cksum_buf;
 		*ck = lzma_crc64(buf, bytes, 0);
 
+	} else if (cksum == CKSUM_CRC32C) {
+		uint32_t *ck = (uint32_t *)cksum_buf;
+		*ck = crc32c(0, buf, bytes);
+
+	} else if (cksum == CKSUM_XXH3) {
+		uint64_t *ck = (uint64_t *)cksum_buf;
+		*ck = xxh3_64(buf, bytes);
+
+	} else if (cksum == CKSUM_XXH128) {
+		uint64_t *ck = (uint64_t *)cksum_buf;
+		xxh3_128(buf, bytes, &ck[0], &ck[1]);
+
 	} else if (cksum == CKSUM_BLAKE256) {
 		if (!mt) {
 			if (bdsp.blake2b(cksum_buf, buf, NULL, 32, bytes, 0) != 0)
@@ -326,6 +368,82 @@ compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, in
 	return (0);
 }
 
+/*
+ * Copy a buffer and compute the digest of the copied data. For the fast
+ * non-cryptographic checksums the copy and the digest are fused so that each
+ * byte makes a single trip through cache. Other checksums are compute bound
+ * so they just copy and then call compute_checksum().
+ */
+int
+compute_checksum_copy(uchar_t *cksum_buf, int cksum, uchar_t *dst, uchar_t *src,
+		      uint64_t bytes, int mt, int verbose)
+{
+	if (cksum == CKSUM_CRC32C) {
+		uint32_t *ck = (uint32_t *)cksum_buf;
+		*ck = crc32c_copy(0, dst, src, bytes);
+
+	} else if (cksum == CKSUM_XXH3) {
+		uint64_t *ck = (uint64_t *)cksum_buf;
+		*ck = xxh3_64_copy(dst, src, bytes);
+
+	} else if (cksum == CKSUM_XXH128) {
+		uint64_t *ck = (uint64_t *)cksum_buf;
+		xxh3_128_copy(dst, src, bytes, &ck[0], &ck[1]);
+
+	} else {
+		memcpy(dst, src, bytes);
+		return (compute_checksum(cksum_buf, cksum, dst, bytes, mt, verbose));
+	}
+	return (0);
+}
+
+/*
+ * Compute digests of n independent small buffers, like dedupe blocks. Where
+ * the CPU allows, groups of buffers are hashed in parallel SIMD lanes,
+ * otherwise they are hashed one by one. Digests are the same either way.
+ */
+int
+compute_checksum_mb(uchar_t *cksum_bufs[], int cksum, uchar_t *bufs[], uint64_t lens[], int n)
+{
+	int i, algo;
+
+	algo = 0;
+	if (cksum == CKSUM_BLAKE256) {
+		algo = MB_BLAKE2B_256;
+	} else if (cksum == CKSUM_BLAKE512) {
+		algo = MB_BLAKE2B_512;
+	} else if (cksum == CKSUM_KECCAK256) {
+		algo = MB_KECCAK256;
+	} else if (cksum == CKSUM_KECCAK512) {
+		algo = MB_KECCAK512;
+	} else if (cksum_provider == PROVIDER_X64_OPT) {
+		/*
+		 * With the optimized provider CKSUM_SHA256 is really SHA512/256.
+		 */
+		if (cksum == CKSUM_SHA256)
+			algo = MB_SHA512T256;
+		else if (cksum == CKSUM_SHA512)
+			algo = MB_SHA512;
+	}
+
+	while (n > 0) {
+		int cnt = (n < MB_HASH_BATCH ? n : MB_HASH_BATCH);
+
+		if (!algo || mb_hash(algo, cksum_bufs, bufs, lens, cnt) != 0) {
+			for (i = 0; i < cnt; i++) {
+				if (compute_checksum(cksum_bufs[i], cksum, bufs[i],
+				    lens[i], 0, 0) != 0)
+					return (-1);
+			}
+		}
+		cksum_bufs += cnt;
+		bufs += cnt;
+		lens += cnt;
+		n -= cnt;
+	}
+	return (0);
+}
+
 static void
 init_sha512(void)
 {
@@ -337,6 +455,7 @@ init_sha512(void)
 	if (proc_info.proc_type == PROC_X64_INTEL || proc_info.proc_type == PROC_X64_AMD) {
 		if (opt_Init_SHA512(&proc_info) == 0) {
 			cksum_provider = PROVIDER_X64_OPT;
+			mb_hash_init(&proc_info);
 		}
 	}
 #endif
@@ -347,6 +466,19 @@ static void
 init_blake2(void)
 {
 	blake2_module_init(&bdsp, &proc_info);
+	mb_hash_init(&proc_info);
+}
+
+static void
+init_crc32c(void)
+{
+	crc32c_init(&proc_info);
+}
+
+static void
+init_xxh3(void)
+{
+	xxh3_init(&proc_info);
 }
 
 void
@@ -359,6 +491,86 @@ list_checksums(FILE *strm, char *pad)
 	}
 }
 
+/*
+ * The implementation the dispatch code picks for a checksum on this
+ * processor. This mirrors the tests in the init functions above.
+ */
+static const char *
+checksum_impl(int cksum)
+{
+	switch (cksum) {
+	    case CKSUM_CRC64:
+		return ("LZMA SDK tables");
+	    case CKSUM_CRC32C:
+#if defined(__x86_64__)
+		if (proc_info.sse_level > 4 ||
+		    (proc_info.sse_level == 4 && proc_info.sse_sub_level >= 2))
+			return ("SSE4.2 crc32, 3 streams");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+		return ("ARMv8 crc32c");
+#endif
+		return ("slicing-by-8 tables");
+	    case CKSUM_XXH3:
+	    case CKSUM_XXH128:
+#if defined(__x86_64__)
+		if (proc_info.avx_level >= 2)
+			return ("AVX2");
+		return ("SSE2");
+#else
+		return ("scalar");
+#endif
+	    case CKSUM_SHA256:
+	    case CKSUM_SHA512:
+		if (cksum_provider != PROVIDER_X64_OPT)
+			return ("OpenSSL");
+		if (mb_hash_avail(MB_SHA512))
+			return ("Intel AVX, AVX2 multi-buffer");
+		if (proc_info.avx_level > 0)
+			return ("Intel AVX");
+		return ("Intel SSE4");
+	    case CKSUM_BLAKE256:
+	    case CKSUM_BLAKE512:
+		if (mb_hash_avail(MB_BLAKE2B_256))
+			return ("AVX, AVX2 multi-buffer");
+		if (proc_info.avx_level >= 1)
+			return ("AVX");
+		if (proc_info.sse_level == 4 && proc_info.sse_sub_level >= 1)
+			return ("SSE4.1");
+		if (proc_info.sse_level == 3 && proc_info.sse_sub_level == 1)
+			return ("SSSE3");
+		return ("SSE2");
+	    case CKSUM_KECCAK256:
+	    case CKSUM_KECCAK512:
+		return ("64-bit optimized C");
+	}
+	return ("portable C");
+}
+
+/*
+ * Describe the n'th selectable checksum for the self benchmark: its name,
+ * whether it is a cryptographic hash and the implementation used on this
+ * processor. Returns -1 past the last checksum.
+ */
+int
+get_checksum_info(int n, const char **name, int *crypto, const char **impl)
+{
+	int i, cksum, cksum_bytes, mac_bytes;
+
+	for (i=0; i<(sizeof (cksum_props)/sizeof (cksum_props[0])); i++) {
+		if (cksum_props[i].compatible)
+			continue;
+		if (n-- > 0)
+			continue;
+		cksum = 0;
+		get_checksum_props(cksum_props[i].name, &cksum, &cksum_bytes, &mac_bytes, 0);
+		*name = cksum_props[i].name;
+		*crypto = !NONCRYPTO_CKSUM(cksum);
+		*impl = checksum_impl(cksum);
+		return (cksum);
+	}
+	return (-1);
+}
+
 /*
  * Check if either the given checksum name or id is valid and
  * return it's properties.
@@ -423,6 +635,7 @@ int
 hmac_init(mac_ctx_t *mctx, int cksum, crypto_ctx_t *cctx)
 {
 	mctx->mac_cksum = cksum;
+	mctx->cctx = cctx;
 
 	if (cksum == CKSUM_BLAKE256) {
 		blake2b_state *ctx = (blake2b_state *)malloc(sizeof (blake2b_state));
@@ -480,7 +693,7 @@ hmac_init(mac_ctx_t *mctx, int cksum, crypto_ctx_t *cctx)
 		memcpy(ctx, mctx->mac_ctx, sizeof (Skein_512_Ctxt_t));
 		mctx->mac_ctx_reinit = ctx;
 
-	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_CRC64) {
+	} else if (cksum == CKSUM_SHA256 || NONCRYPTO_CKSUM(cksum)) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
 			HMAC_CTX *ctx = (HMAC_CTX *)malloc(sizeof (HMAC_CTX));
 			if (!ctx) return (-1);
@@ -586,7 +799,7 @@ hmac_reinit(mac_ctx_t *mctx)
 	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
 		memcpy(mctx->mac_ctx, mctx->mac_ctx_reinit, sizeof (Skein_512_Ctxt_t));
 
-	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_SHA512 || cksum == CKSUM_CRC64) {
+	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_SHA512 || NONCRYPTO_CKSUM(cksum)) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
 			HMAC_CTX_copy((HMAC_CTX *)(mctx->mac_ctx),
 				      (HMAC_CTX *)(mctx->mac_ctx_reinit));
@@ -612,7 +825,7 @@ hmac_update(mac_ctx_t *mctx, uchar_t *data, uint64_t len)
 	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
 		Skein_512_Update((Skein_512_Ctxt_t *)(mctx->mac_ctx), data, len);
 
-	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_CRC64) {
+	} else if (cksum == CKSUM_SHA256 || NONCRYPTO_CKSUM(cksum)) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
 #ifndef __OSSL_OLD__
 			if (HMAC_Update((HMAC_CTX *)(mctx->mac_ctx), data, len) == 0)
@@ -674,7 +887,7 @@ hmac_final(mac_ctx_t *mctx, uchar_t *hash, unsigned int *len)
 		Skein_512_Final((Skein_512_Ctxt_t *)(mctx->mac_ctx), hash);
 		*len = 64;
 
-	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_CRC64) {
+	} else if (cksum == CKSUM_SHA256 || NONCRYPTO_CKSUM(cksum)) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
 			HMAC_Final((HMAC_CTX *)(mctx->mac_ctx), hash, len);
 		} else {
@@ -714,7 +927,7 @@ hmac_cleanup(mac_ctx_t *mctx)
 		memset(mctx->mac_ctx, 0, sizeof (Skein_512_Ctxt_t));
 		memset(mctx->mac_ctx_reinit, 0, sizeof (Skein_512_Ctxt_t));
 
-	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_SHA512 || cksum == CKSUM_CRC64) {
+	} else if (cksum == CKSUM_SHA256 || cksum == CKSUM_SHA512 || NONCRYPTO_CKSUM(cksum)) {
 		if (cksum_provider == PROVIDER_OPENSSL) {
 			HMAC_CTX_cleanup((HMAC_CTX *)(mctx->mac_ctx));
 			HMAC_CTX_cleanup((HMAC_CTX *)(mctx->mac_ctx_reinit));
@@ -734,6 +947,87 @@ hmac_cleanup(mac_ctx_t *mctx)
 	return (0);
 }
 
+/*
+ * Tree MAC update. The data is split into MAC_TREE_BLK sub-blocks and each one
+ * gets its own keyed MAC. The sub-block MACs, in order, and the data length
+ * are then fed into mctx. Sub-blocks are independent so with mt set they are
+ * computed in parallel, like the parallel checksum versions. Used for single
+ * chunk files where one MAC would otherwise cover the whole file on one core.
+ */
+int
+hmac_tree_update(mac_ctx_t *mctx, uchar_t *data, uint64_t len, int mt)
+{
+	uint64_t nblks, i, len_le;
+	mac_ctx_t *tctx;
+	uchar_t *digests;
+	int nt, j, err;
+
+	nblks = (len + MAC_TREE_BLK - 1) / MAC_TREE_BLK;
+	nt = 1;
+#if defined(_OPENMP)
+	if (mt)
+		nt = omp_get_max_threads();
+#endif
+	if (nt > nblks)
+		nt = nblks;
+	if (nt < 1)
+		nt = 1;
+
+	tctx = (mac_ctx_t *)calloc(nt, sizeof (mac_ctx_t));
+	digests = (uchar_t *)calloc(1, nblks * CKSUM_MAX_BYTES + 1);
+	if (!tctx || !digests) {
+		free(tctx);
+		free(digests);
+		return (-1);
+	}
+	err = 0;
+	for (j = 0; j < nt; j++) {
+		if (hmac_init(&tctx[j], mctx->mac_cksum, mctx->cctx) == -1) {
+			nt = j;
+			err = 1;
+			break;
+		}
+	}
+
+	if (!err) {
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nt)
+#endif
+		for (i = 0; i < nblks; i++) {
+			mac_ctx_t *tc;
+			uint64_t blen;
+			unsigned int hlen;
+
+#if defined(_OPENMP)
+			tc = &tctx[omp_get_thread_num()];
+#else
+			tc = &tctx[0];
+#endif
+			blen = len - i * MAC_TREE_BLK;
+			if (blen > MAC_TREE_BLK)
+				blen = MAC_TREE_BLK;
+			hmac_reinit(tc);
+			if (hmac_update(tc, data + i * MAC_TREE_BLK, blen) == -1 ||
+			    hmac_final(tc, digests + i * CKSUM_MAX_BYTES, &hlen) == -1) {
+				err = 1;
+			}
+		}
+	}
+
+	for (j = 0; j < nt; j++)
+		hmac_cleanup(&tctx[j]);
+	free(tctx);
+	if (!err) {
+		len_le = LE64(len);
+		if (nblks > 0 && hmac_update(mctx, digests, nblks * CKSUM_MAX_BYTES) == -1)
+			err = 1;
+		else if (hmac_update(mctx, (uchar_t *)&len_le, sizeof (len_le)) == -1)
+			err = 1;
+	}
+	free(digests);
+	return (err ? -1 : 0);
+}
+
 /*
  * Encryption related functions.
  */
@@ -741,23 +1035,32 @@ int
 init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 	    uchar_t *salt, int saltlen, int keylen, uchar_t *nonce, int enc_dec)
 {
-	if (crypto_alg == CRYPTO_ALG_AES || crypto_alg == CRYPTO_ALG_SALSA20) {
+	if (crypto_alg == CRYPTO_ALG_AES || crypto_alg == CRYPTO_ALG_SALSA20 ||
+	    crypto_alg == CRYPTO_ALG_AES_GCM || crypto_alg == CRYPTO_ALG_CHACHA20) {
 		aes_ctx_t *actx;
 		salsa20_ctx_t *sctx;
+		chacha20_ctx_t *chctx;
 
 		/* Silence compiler warnings */
 		actx = NULL;
 		sctx = NULL;
+		chctx = NULL;
+		scrypt_module_init(&proc_info);
 
-		if (crypto_alg == CRYPTO_ALG_AES) {
+		if (crypto_alg == CRYPTO_ALG_SALSA20) {
+			sctx = (salsa20_ctx_t *)malloc(sizeof (salsa20_ctx_t));
+			sctx->keylen = keylen;
+			cctx->pkey = sctx->pkey;
+		} else if (crypto_alg == CRYPTO_ALG_CHACHA20) {
+			chctx = (chacha20_ctx_t *)malloc(sizeof (chacha20_ctx_t));
+			chctx->keylen = keylen;
+			cctx->pkey = chctx->pkey;
+		} else {
 			actx = (aes_ctx_t *)malloc(sizeof (aes_ctx_t));
 			actx->keylen = keylen;
+			actx->gcm_ctx = NULL;
 			cctx->pkey = actx->pkey;
 			aes_module_init(&proc_info);
-		} else {
-			sctx = (salsa20_ctx_t *)malloc(sizeof (salsa20_ctx_t));
-			sctx->keylen = keylen;
-			cctx->pkey = sctx->pkey;
 		}
 		cctx->keylen = keylen;
 
@@ -799,14 +1102,19 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 			/*
 			 * Zero nonce (arg #6) since it will be generated.
 			 */
-			if (crypto_alg == CRYPTO_ALG_AES) {
-				if (aes_init(actx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
-					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
+			if (crypto_alg == CRYPTO_ALG_SALSA20) {
+				if (salsa20_init(sctx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize SALSA20 context\n");
+					return (-1);
+				}
+			} else if (crypto_alg == CRYPTO_ALG_CHACHA20) {
+				if (chacha20_init(chctx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize CHACHA20 context\n");
 					return (-1);
 				}
 			} else {
-				if (salsa20_init(sctx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
-					log_msg(LOG_ERR, 0, "Failed to initialize SALSA20 context\n");
+				if (aes_init(actx, salt, 32, pwd, pwd_len, 0, enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
 					return (-1);
 				}
 			}
@@ -819,33 +1127,47 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 				log_msg(LOG_ERR, 0, "Salt too long. Max allowed length is %d\n",
 				    MAX_SALTLEN);
 				free(actx);
+				free(sctx);
+				free(chctx);
 				return (-1);
 			}
 			cctx->salt = (uchar_t *)malloc(saltlen);
 			memcpy(cctx->salt, salt, saltlen);
 
-			if (crypto_alg == CRYPTO_ALG_AES) {
-				if (aes_init(actx, cctx->salt, saltlen, pwd, pwd_len, U64_P(nonce),
-				    enc_dec) != 0) {
-					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
+			if (crypto_alg == CRYPTO_ALG_SALSA20) {
+				if (salsa20_init(sctx, salt, 32, pwd, pwd_len, nonce, enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize SALSA20 context\n");
+					return (-1);
+				}
+			} else if (crypto_alg == CRYPTO_ALG_CHACHA20) {
+				if (chacha20_init(chctx, salt, 32, pwd, pwd_len, nonce, enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize CHACHA20 context\n");
 					return (-1);
 				}
 			} else {
-				if (salsa20_init(sctx, salt, 32, pwd, pwd_len, nonce, enc_dec) != 0) {
-					log_msg(LOG_ERR, 0, "Failed to initialize SALSA20 context\n");
+				if (aes_init(actx, cctx->salt, saltlen, pwd, pwd_len, U64_P(nonce),
+				    enc_dec) != 0) {
+					log_msg(LOG_ERR, 0, "Failed to initialize AES context\n");
 					return (-1);
 				}
 			}
 		}
-		if (crypto_alg == CRYPTO_ALG_AES) {
-			cctx->crypto_ctx = actx;
-		} else {
+		if (crypto_alg == CRYPTO_ALG_AES_GCM) {
+			if (aes_gcm_init(actx, enc_dec) != 0)
+				return (-1);
+		}
+		if (crypto_alg == CRYPTO_ALG_SALSA20) {
 			cctx->crypto_ctx = sctx;
+		} else if (crypto_alg == CRYPTO_ALG_CHACHA20) {
+			cctx->crypto_ctx = chctx;
+		} else {
+			cctx->crypto_ctx = actx;
 		}
 		cctx->crypto_alg = crypto_alg;
 		cctx->enc_dec = enc_dec;
 		actx = NULL;
 		sctx = NULL;
+		chctx = NULL;
 	} else {
 		log_msg(LOG_ERR, 0, "Unrecognized algorithm code: %d\n", crypto_alg);
 		return (-1);
@@ -856,7 +1178,7 @@ init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 int
 crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint64_t id)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
+	if (cctx->crypto_alg == CRYPTO_ALG_AES || cctx->crypto_alg == CRYPTO_ALG_AES_GCM) {
 		if (cctx->enc_dec == ENCRYPT_FLAG) {
 			return (aes_encrypt((aes_ctx_t *)(cctx->crypto_ctx), from, to, bytes, id));
 		} else {
@@ -868,6 +1190,12 @@ crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint6
 		} else {
 			return (salsa20_decrypt((salsa20_ctx_t *)(cctx->crypto_ctx), from, to, bytes, id));
 		}
+	} else if (cctx->crypto_alg == CRYPTO_ALG_CHACHA20) {
+		if (cctx->enc_dec == ENCRYPT_FLAG) {
+			return (chacha20_encrypt((chacha20_ctx_t *)(cctx->crypto_ctx), from, to, bytes, id));
+		} else {
+			return (chacha20_decrypt((chacha20_ctx_t *)(cctx->crypto_ctx), from, to, bytes, id));
+		}
 	} else {
 		log_msg(LOG_ERR, 0, "Unrecognized algorithm code: %d\n", cctx->crypto_alg);
 		return (-1);
@@ -875,22 +1203,82 @@ crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint6
 	return (0);
 }
 
+/*
+ * The implementation used for an encryption algorithm on this processor,
+ * as picked by aes_module_init() and the XChaCha20 block function.
+ */
+const char *
+crypto_impl(int crypto_alg)
+{
+	switch (crypto_alg) {
+	    case CRYPTO_ALG_AES:
+		if (proc_info.proc_type == PROC_X64_INTEL || proc_info.proc_type == PROC_X64_AMD) {
+			if (proc_info.aes_avail)
+				return ("AES-NI CTR");
+			if (proc_info.sse_level >= 3 && proc_info.sse_sub_level >= 1)
+				return ("VPAES (SSSE3) CTR");
+		}
+		return ("OpenSSL CTR");
+	    case CRYPTO_ALG_AES_GCM:
+		return ("OpenSSL EVP");
+	    case CRYPTO_ALG_CHACHA20:
+#if defined(__x86_64__) && defined(__GNUC__)
+		if (proc_info.avx_level >= 2)
+			return ("AVX2, 8 blocks");
+#endif
+		return ("vector C, 4 blocks");
+	}
+	return ("portable C");
+}
+
+/*
+ * Whether the algorithm authenticates while encrypting. Such algorithms
+ * produce a tag of AEAD_TAG_LEN bytes that takes the place of the HMAC.
+ */
+int
+crypto_is_aead(crypto_ctx_t *cctx)
+{
+	return (cctx->crypto_alg == CRYPTO_ALG_AES_GCM);
+}
+
+/*
+ * Encrypt and authenticate a buffer, or verify and decrypt it, in one pass.
+ * The additional data is authenticated but not encrypted. Returns -1 on error
+ * or if authentication fails.
+ */
+int
+crypto_aead_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes,
+		uint64_t id, uchar_t *aad, int aadlen, uchar_t *tag)
+{
+	if (cctx->crypto_alg == CRYPTO_ALG_AES_GCM) {
+		return (aes_gcm_crypt((aes_ctx_t *)(cctx->crypto_ctx), from, to, bytes,
+		    id, aad, aadlen, tag, cctx->enc_dec == ENCRYPT_FLAG));
+	}
+	log_msg(LOG_ERR, 0, "Not an authenticated encryption algorithm: %d\n",
+	    cctx->crypto_alg);
+	return (-1);
+}
+
 uchar_t *
 crypto_nonce(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
-		return (aes_nonce((aes_ctx_t *)(cctx->crypto_ctx)));
+	if (cctx->crypto_alg == CRYPTO_ALG_SALSA20) {
+		return (salsa20_nonce((salsa20_ctx_t *)(cctx->crypto_ctx)));
+	} else if (cctx->crypto_alg == CRYPTO_ALG_CHACHA20) {
+		return (chacha20_nonce((chacha20_ctx_t *)(cctx->crypto_ctx)));
 	}
-	return (salsa20_nonce((salsa20_ctx_t *)(cctx->crypto_ctx)));
+	return (aes_nonce((aes_ctx_t *)(cctx->crypto_ctx)));
 }
 
 void
 crypto_clean_pkey(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
-		aes_clean_pkey((aes_ctx_t *)(cctx->crypto_ctx));
-	} else {
+	if (cctx->crypto_alg == CRYPTO_ALG_SALSA20) {
 		salsa20_clean_pkey((salsa20_ctx_t *)(cctx->crypto_ctx));
+	} else if (cctx->crypto_alg == CRYPTO_ALG_CHACHA20) {
+		chacha20_clean_pkey((chacha20_ctx_t *)(cctx->crypto_ctx));
+	} else {
+		aes_clean_pkey((aes_ctx_t *)(cctx->crypto_ctx));
 	}
 	cctx->pkey = NULL;
 }
@@ -898,10 +1286,12 @@ crypto_clean_pkey(crypto_ctx_t *cctx)
 void
 cleanup_crypto(crypto_ctx_t *cctx)
 {
-	if (cctx->crypto_alg == CRYPTO_ALG_AES) {
-		aes_cleanup((aes_ctx_t *)(cctx->crypto_ctx));
-	} else {
+	if (cctx->crypto_alg == CRYPTO_ALG_SALSA20) {
 		salsa20_cleanup((salsa20_ctx_t *)(cctx->crypto_ctx));
+	} else if (cctx->crypto_alg == CRYPTO_ALG_CHACHA20) {
+		chacha20_cleanup((chacha20_ctx_t *)(cctx->crypto_ctx));
+	} else {
+		aes_cleanup((aes_ctx_t *)(cctx->crypto_ctx));
 	}
 	memset(cctx->salt, 0, 32);
 	free(cctx->salt);
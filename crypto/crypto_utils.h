@@ -37,7 +37,7 @@ extern "C" {
 #endif
 
 #define	MAX_PW_LEN	16
-#define	CKSUM_MASK		0x700
+#define	CKSUM_MASK		0x8700
 #define	CKSUM_MAX_BYTES		64
 #define	DEFAULT_CKSUM		"BLAKE256"
 
@@ -56,6 +56,9 @@ extern "C" {
 #define	DECRYPT_FLAG		0
 #define	CRYPTO_ALG_AES		0x10
 #define	CRYPTO_ALG_SALSA20	0x20
+#define	CRYPTO_ALG_AES_GCM	0x30
+#define	CRYPTO_ALG_CHACHA20	0x40
+#define	AEAD_TAG_LEN		16
 #define	MAX_SALTLEN		64
 #define	MAX_NONCE		32
 
@@ -75,13 +78,23 @@ typedef struct {
 	void *mac_ctx;
 	void *mac_ctx_reinit;
 	int mac_cksum;
+	crypto_ctx_t *cctx;
 } mac_ctx_t;
 
+/*
+ * Sub-block size for tree MACs. See hmac_tree_update().
+ */
+#define	MAC_TREE_BLK	(1024 * 1024)
+
 /*
  * Generic message digest functions.
  */
 int compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, int mt, int verbose);
+int compute_checksum_copy(uchar_t *cksum_buf, int cksum, uchar_t *dst, uchar_t *src,
+	uint64_t bytes, int mt, int verbose);
+int compute_checksum_mb(uchar_t *cksum_bufs[], int cksum, uchar_t *bufs[], uint64_t lens[], int n);
 void list_checksums(FILE *strm, char *pad);
+int get_checksum_info(int n, const char **name, int *crypto, const char **impl);
 int get_checksum_props(const char *name, int *cksum, int *cksum_bytes,
 		      int *mac_bytes, int accept_compatible);
 void serialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes);
@@ -93,6 +106,10 @@ void deserialize_checksum(uchar_t *checksum, uchar_t *buf, int cksum_bytes);
 int init_crypto(crypto_ctx_t *cctx, uchar_t *pwd, int pwd_len, int crypto_alg,
 	       uchar_t *salt, int saltlen, int keylen, uchar_t *nonce, int enc_dec);
 int crypto_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes, uint64_t id);
+int crypto_is_aead(crypto_ctx_t *cctx);
+const char *crypto_impl(int crypto_alg);
+int crypto_aead_buf(crypto_ctx_t *cctx, uchar_t *from, uchar_t *to, uint64_t bytes,
+		    uint64_t id, uchar_t *aad, int aadlen, uchar_t *tag);
 uchar_t *crypto_nonce(crypto_ctx_t *cctx);
 void crypto_clean_pkey(crypto_ctx_t *cctx);
 void cleanup_crypto(crypto_ctx_t *cctx);
@@ -108,6 +125,7 @@ int hmac_reinit(mac_ctx_t *mctx);
 int hmac_update(mac_ctx_t *mctx, uchar_t *data, uint64_t len);
 int hmac_final(mac_ctx_t *mctx, uchar_t *hash, unsigned int *len);
 int hmac_cleanup(mac_ctx_t *mctx);
+int hmac_tree_update(mac_ctx_t *mctx, uchar_t *data, uint64_t len, int mt);
 
 #ifdef	__cplusplus
 }
@@ -0,0 +1,629 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Multi-buffer hashing. Small buffers like dedupe blocks are hashed four at a
+ * time, one per 64-bit lane of AVX2 vectors, instead of one after another.
+ * A single SHA-512 or BLAKE2b stream cannot use the vector width since every
+ * round depends on the previous one, but independent buffers can share the
+ * rounds. Buffers of similar length are grouped so that lanes do not idle.
+ * The digests are identical to the single-buffer versions.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#include "mb_hash.h"
+
+#define	SHA512_BLK	128
+#define	BLAKE2B_BLK	128
+#define	KECCAK_MAX_RATE	136
+
+static int mb_avail = 0;
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+	0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+	0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+	0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+	0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+	0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+	0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+	0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+	0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+	0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+	0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+	0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+	0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+	0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+	0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint64_t sha512t256_iv[8] = {
+	0x22312194fc2bf72cULL, 0x9f555fa3c84c64c2ULL, 0x2393b86b6f53b151ULL,
+	0x963877195940eabdULL, 0x96283ee2a88effe3ULL, 0xbe5e1e2553863992ULL,
+	0x2b0199fc2c85b8aaULL, 0x0eb72ddc81c52ca2ULL
+};
+
+static const uint64_t keccak_rc[24] = {
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL,
+	0x8000000080008000ULL, 0x000000000000808bULL, 0x0000000080000001ULL,
+	0x8000000080008081ULL, 0x8000000000008009ULL, 0x000000000000008aULL,
+	0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+	0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL,
+	0x8000000000008003ULL, 0x8000000000008002ULL, 0x8000000000000080ULL,
+	0x000000000000800aULL, 0x800000008000000aULL, 0x8000000080008081ULL,
+	0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+/*
+ * Rotation amounts and destination lanes of the combined rho and pi steps,
+ * following lane 1 around its cycle.
+ */
+static const int keccak_rotc[24] = {
+	1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14,
+	27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44
+};
+
+static const int keccak_piln[24] = {
+	10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4,
+	15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+
+static const uint8_t blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+static inline uint64_t
+load_be64(const uchar_t *p)
+{
+	return (((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+	    ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+	    ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+	    ((uint64_t)p[6] << 8) | (uint64_t)p[7]);
+}
+
+static inline void
+store_be64(uchar_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static inline uint64_t
+load_le64(const uchar_t *p)
+{
+	return (((uint64_t)p[7] << 56) | ((uint64_t)p[6] << 48) |
+	    ((uint64_t)p[5] << 40) | ((uint64_t)p[4] << 32) |
+	    ((uint64_t)p[3] << 24) | ((uint64_t)p[2] << 16) |
+	    ((uint64_t)p[1] << 8) | (uint64_t)p[0]);
+}
+
+static inline void
+store_le64(uchar_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+ * Return block number blk of a SHA-512 message, padded with its length at the
+ * end of the last block. Lanes that are done get a zero block.
+ */
+static const uchar_t *
+sha512_block(uchar_t *pad, const uchar_t *data, uint64_t len, uint64_t blk,
+    uint64_t nblk)
+{
+	uint64_t off = blk * SHA512_BLK;
+
+	if (off + SHA512_BLK <= len)
+		return (data + off);
+	memset(pad, 0, SHA512_BLK);
+	if (blk >= nblk)
+		return (pad);
+	if (off < len)
+		memcpy(pad, data + off, len - off);
+	if (off <= len)
+		pad[len - off] = 0x80;
+	if (blk + 1 == nblk)
+		store_be64(pad + SHA512_BLK - 8, len << 3);
+	return (pad);
+}
+
+/*
+ * Return block number blk of a BLAKE2b message. The last block is zero padded.
+ */
+static const uchar_t *
+blake2b_block(uchar_t *pad, const uchar_t *data, uint64_t len, uint64_t blk,
+    uint64_t nblk)
+{
+	uint64_t off = blk * BLAKE2B_BLK;
+
+	if (off + BLAKE2B_BLK <= len)
+		return (data + off);
+	memset(pad, 0, BLAKE2B_BLK);
+	if (blk < nblk && off < len)
+		memcpy(pad, data + off, len - off);
+	return (pad);
+}
+
+/*
+ * Copy n bytes from offset off of a message.
+ */
+static void
+msg_gather(uchar_t *dst, const mb_msg_t *m, uint64_t off, uint64_t n)
+{
+	uint64_t c, r;
+
+	while (n > 0) {
+		if (off < m->len) {
+			r = off % m->seg;
+			c = m->seg - r;
+			if (c > m->len - off)
+				c = m->len - off;
+			if (c > n)
+				c = n;
+			memcpy(dst, m->data + (off / m->seg) * m->stride + r, c);
+		} else {
+			c = n;
+			memcpy(dst, m->tail + (off - m->len), c);
+		}
+		dst += c;
+		off += c;
+		n -= c;
+	}
+}
+
+/*
+ * Return block number blk of a Keccak message for the given rate. The last
+ * block gets the pad10*1 padding of the Keccak submission, which is what
+ * Keccak_Hash() does. Lanes that are done get a zero block.
+ */
+static const uchar_t *
+keccak_block(uchar_t *pad, const mb_msg_t *m, int rate, uint64_t blk, uint64_t nblk)
+{
+	uint64_t off = blk * rate, n;
+
+	if (blk + 1 < nblk && m->seg == m->stride && off + rate <= m->len)
+		return (m->data + off);
+	memset(pad, 0, rate);
+	if (blk >= nblk)
+		return (pad);
+	n = m->len + m->taillen - off;
+	if (n > (uint64_t)rate)
+		n = rate;
+	msg_gather(pad, m, off, n);
+	if (blk + 1 == nblk) {
+		pad[n] |= 0x01;
+		pad[rate - 1] |= 0x80;
+	}
+	return (pad);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define	MB_ATTR		__attribute__((target("avx2")))
+
+typedef uint64_t mb_vec_t __attribute__((vector_size(32)));
+
+#define	ROTR(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+/*
+ * Hash up to MB_LANES buffers with SHA-512 using the given IV and write dwords
+ * 64-bit words of each digest.
+ */
+static MB_ATTR void
+sha512_lanes(uchar_t *digest[], uchar_t *data[], uint64_t len[], int n,
+    const uint64_t *iv, int dwords)
+{
+	mb_vec_t st[8], w[16], a, b, c, d, e, f, g, h, t1, t2, wv;
+	uint64_t wt[16][MB_LANES] __attribute__((aligned(32)));
+	uchar_t pad[MB_LANES][SHA512_BLK];
+	uint64_t nblk[MB_LANES], maxblk, blk;
+	int i, j, t;
+
+	maxblk = 0;
+	for (j = 0; j < MB_LANES; j++) {
+		nblk[j] = 0;
+		if (j < n)
+			nblk[j] = (len[j] + 17 + SHA512_BLK - 1) / SHA512_BLK;
+		if (nblk[j] > maxblk)
+			maxblk = nblk[j];
+	}
+	for (i = 0; i < 8; i++) {
+		st[i] = (mb_vec_t){0, 0, 0, 0} + iv[i];
+	}
+
+	for (blk = 0; blk < maxblk; blk++) {
+		for (j = 0; j < MB_LANES; j++) {
+			const uchar_t *p;
+
+			p = sha512_block(pad[j], j < n ? data[j] : NULL,
+			    j < n ? len[j] : 0, blk, nblk[j]);
+			for (t = 0; t < 16; t++)
+				wt[t][j] = load_be64(p + t * 8);
+		}
+		for (t = 0; t < 16; t++)
+			memcpy(&w[t], wt[t], sizeof (mb_vec_t));
+
+		a = st[0]; b = st[1]; c = st[2]; d = st[3];
+		e = st[4]; f = st[5]; g = st[6]; h = st[7];
+		for (t = 0; t < 80; t++) {
+			if (t < 16) {
+				wv = w[t];
+			} else {
+				mb_vec_t w2 = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+
+				wv = (ROTR(w2, 19) ^ ROTR(w2, 61) ^ (w2 >> 6)) +
+				    w[(t - 7) & 15] +
+				    (ROTR(w15, 1) ^ ROTR(w15, 8) ^ (w15 >> 7)) +
+				    w[t & 15];
+				w[t & 15] = wv;
+			}
+			t1 = h + (ROTR(e, 14) ^ ROTR(e, 18) ^ ROTR(e, 41)) +
+			    ((e & f) ^ (~e & g)) + sha512_k[t] + wv;
+			t2 = (ROTR(a, 28) ^ ROTR(a, 34) ^ ROTR(a, 39)) +
+			    ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+		st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+
+		for (j = 0; j < n; j++) {
+			if (blk + 1 != nblk[j])
+				continue;
+			for (i = 0; i < dwords; i++)
+				store_be64(digest[j] + i * 8, st[i][j]);
+		}
+	}
+}
+
+#define	B2_G(a, b, c, d, x, y) do { \
+	a = a + b + x; d = ROTR(d ^ a, 32); \
+	c = c + d; b = ROTR(b ^ c, 24); \
+	a = a + b + y; d = ROTR(d ^ a, 16); \
+	c = c + d; b = ROTR(b ^ c, 63); \
+} while (0)
+
+/*
+ * Hash up to MB_LANES buffers with unkeyed BLAKE2b giving outlen byte digests.
+ */
+static MB_ATTR void
+blake2b_lanes(uchar_t *digest[], uchar_t *data[], uint64_t len[], int n, int outlen)
+{
+	mb_vec_t h[8], v[16], m[16], tv, fv;
+	uint64_t mt[16][MB_LANES] __attribute__((aligned(32)));
+	uint64_t tl[MB_LANES] __attribute__((aligned(32)));
+	uint64_t fl[MB_LANES] __attribute__((aligned(32)));
+	uchar_t pad[MB_LANES][BLAKE2B_BLK], last[64];
+	uint64_t nblk[MB_LANES], maxblk, blk;
+	int i, j, r;
+
+	maxblk = 0;
+	for (j = 0; j < MB_LANES; j++) {
+		nblk[j] = 0;
+		if (j < n) {
+			nblk[j] = (len[j] + BLAKE2B_BLK - 1) / BLAKE2B_BLK;
+			if (nblk[j] == 0)
+				nblk[j] = 1;
+		}
+		if (nblk[j] > maxblk)
+			maxblk = nblk[j];
+	}
+	for (i = 0; i < 8; i++)
+		h[i] = (mb_vec_t){0, 0, 0, 0} + sha512_iv[i];
+	h[0] ^= 0x01010000ULL ^ (uint64_t)outlen;
+
+	for (blk = 0; blk < maxblk; blk++) {
+		for (j = 0; j < MB_LANES; j++) {
+			const uchar_t *p;
+			uint64_t end;
+
+			p = blake2b_block(pad[j], j < n ? data[j] : NULL,
+			    j < n ? len[j] : 0, blk, nblk[j]);
+			for (i = 0; i < 16; i++)
+				mt[i][j] = load_le64(p + i * 8);
+			end = (blk + 1) * BLAKE2B_BLK;
+			tl[j] = (j < n && end > len[j]) ? len[j] : end;
+			fl[j] = (blk + 1 == nblk[j]) ? ~0ULL : 0;
+		}
+		for (i = 0; i < 16; i++)
+			memcpy(&m[i], mt[i], sizeof (mb_vec_t));
+		memcpy(&tv, tl, sizeof (mb_vec_t));
+		memcpy(&fv, fl, sizeof (mb_vec_t));
+
+		for (i = 0; i < 8; i++) {
+			v[i] = h[i];
+			v[i + 8] = (mb_vec_t){0, 0, 0, 0} + sha512_iv[i];
+		}
+		v[12] ^= tv;
+		v[14] ^= fv;
+		for (r = 0; r < 12; r++) {
+			const uint8_t *s = blake2b_sigma[r];
+
+			B2_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+			B2_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+			B2_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+			B2_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+			B2_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+			B2_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+			B2_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+			B2_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+		}
+		for (i = 0; i < 8; i++)
+			h[i] ^= v[i] ^ v[i + 8];
+
+		for (j = 0; j < n; j++) {
+			if (blk + 1 != nblk[j])
+				continue;
+			for (i = 0; i < 8; i++)
+				store_le64(last + i * 8, h[i][j]);
+			memcpy(digest[j], last, outlen);
+		}
+	}
+}
+
+#define	ROTL(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+/*
+ * The round loops are fully unrolled so that all state indices are constant
+ * and GCC can keep the words in registers instead of an indexed array.
+ */
+#define	KECCAK_UNROLL	_Pragma("GCC unroll 25")
+
+/*
+ * Hash up to MB_LANES messages with Keccak of the given rate giving outlen
+ * byte digests. The 25 words of the state hold one message per lane, so
+ * the Keccak-f[1600] rounds run on all of them at once.
+ */
+static MB_ATTR void
+keccak_lanes(uchar_t *digest[], mb_msg_t msg[], int n, int rate, int outlen)
+{
+	mb_vec_t st[25], bc[5], t, u;
+	uint64_t mt[KECCAK_MAX_RATE / 8][MB_LANES] __attribute__((aligned(32)));
+	uchar_t pad[MB_LANES][KECCAK_MAX_RATE], last[KECCAK_MAX_RATE];
+	uint64_t nblk[MB_LANES], maxblk, blk;
+	int i, j, r, w;
+
+	w = rate / 8;
+	maxblk = 0;
+	for (j = 0; j < MB_LANES; j++) {
+		nblk[j] = 0;
+		if (j < n)
+			nblk[j] = (msg[j].len + msg[j].taillen) / rate + 1;
+		if (nblk[j] > maxblk)
+			maxblk = nblk[j];
+	}
+	for (i = 0; i < 25; i++)
+		st[i] = (mb_vec_t){0, 0, 0, 0};
+
+	for (blk = 0; blk < maxblk; blk++) {
+		for (j = 0; j < MB_LANES; j++) {
+			const uchar_t *p;
+
+			if (j < n) {
+				p = keccak_block(pad[j], &msg[j], rate, blk, nblk[j]);
+			} else {
+				memset(pad[j], 0, rate);
+				p = pad[j];
+			}
+			for (i = 0; i < w; i++)
+				mt[i][j] = load_le64(p + i * 8);
+		}
+		for (i = 0; i < w; i++) {
+			memcpy(&t, mt[i], sizeof (mb_vec_t));
+			st[i] ^= t;
+		}
+
+		for (r = 0; r < 24; r++) {
+			/* Theta */
+			KECCAK_UNROLL
+			for (i = 0; i < 5; i++)
+				bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^ st[i + 20];
+			KECCAK_UNROLL
+			for (i = 0; i < 5; i++) {
+				t = bc[(i + 4) % 5] ^ ROTL(bc[(i + 1) % 5], 1);
+				st[i] ^= t; st[i + 5] ^= t; st[i + 10] ^= t;
+				st[i + 15] ^= t; st[i + 20] ^= t;
+			}
+
+			/* Rho and Pi */
+			t = st[1];
+			KECCAK_UNROLL
+			for (i = 0; i < 24; i++) {
+				u = st[keccak_piln[i]];
+				st[keccak_piln[i]] = ROTL(t, keccak_rotc[i]);
+				t = u;
+			}
+
+			/* Chi */
+			KECCAK_UNROLL
+			for (j = 0; j < 25; j += 5) {
+				KECCAK_UNROLL
+				for (i = 0; i < 5; i++)
+					bc[i] = st[j + i];
+				KECCAK_UNROLL
+				for (i = 0; i < 5; i++)
+					st[j + i] ^= ~bc[(i + 1) % 5] & bc[(i + 2) % 5];
+			}
+
+			/* Iota */
+			st[0] ^= keccak_rc[r];
+		}
+
+		for (j = 0; j < n; j++) {
+			if (blk + 1 != nblk[j])
+				continue;
+			for (i = 0; i < (outlen + 7) / 8; i++)
+				store_le64(last + i * 8, st[i][j]);
+			memcpy(digest[j], last, outlen);
+		}
+	}
+}
+#endif
+
+void
+mb_hash_init(processor_cap_t *pc)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if ((pc->proc_type == PROC_X64_INTEL || pc->proc_type == PROC_X64_AMD) &&
+	    pc->avx_level >= 2)
+		mb_avail = 1;
+#endif
+}
+
+int
+mb_hash_avail(int algo)
+{
+	return (mb_avail && algo >= MB_SHA512 && algo <= MB_KECCAK512);
+}
+
+/*
+ * Hash up to MB_LANES messages with Keccak, MB_KECCAK256 or MB_KECCAK512.
+ * The messages may be strided, so the leaves of a tree hash can be done
+ * without copying them together first. Returns -1 if this is not available
+ * on this CPU.
+ */
+int
+mb_keccak(int algo, uchar_t *digest[], mb_msg_t msg[], int n)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (!mb_hash_avail(algo) || algo < MB_KECCAK256 || n > MB_LANES)
+		return (-1);
+	if (algo == MB_KECCAK256)
+		keccak_lanes(digest, msg, n, 136, 32);
+	else
+		keccak_lanes(digest, msg, n, 72, 64);
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Hash n buffers with the given algorithm. Buffers are sorted by length so
+ * that each group of lanes finishes at about the same time. Returns -1 if
+ * multi-buffer hashing is not available for the algorithm on this CPU, the
+ * caller must then hash the buffers one by one.
+ */
+int
+mb_hash(int algo, uchar_t *digest[], uchar_t *data[], uint64_t len[], int n)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	uchar_t *gdig[MB_LANES], *gdat[MB_LANES];
+	uint64_t glen[MB_LANES];
+	mb_msg_t gmsg[MB_LANES];
+	int idx[MB_HASH_BATCH];
+	int i, j, k, g;
+
+	if (!mb_hash_avail(algo) || n > MB_HASH_BATCH)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		k = i;
+		while (k > 0 && len[idx[k - 1]] > len[i]) {
+			idx[k] = idx[k - 1];
+			k--;
+		}
+		idx[k] = i;
+	}
+
+	for (i = 0; i < n; i += MB_LANES) {
+		g = (n - i < MB_LANES ? n - i : MB_LANES);
+		for (j = 0; j < g; j++) {
+			k = idx[i + j];
+			gdig[j] = digest[k];
+			gdat[j] = data[k];
+			glen[j] = len[k];
+		}
+		switch (algo) {
+		    case MB_SHA512:
+			sha512_lanes(gdig, gdat, glen, g, sha512_iv, 8);
+			break;
+		    case MB_SHA512T256:
+			sha512_lanes(gdig, gdat, glen, g, sha512t256_iv, 4);
+			break;
+		    case MB_BLAKE2B_256:
+			blake2b_lanes(gdig, gdat, glen, g, 32);
+			break;
+		    case MB_KECCAK256:
+		    case MB_KECCAK512:
+			for (j = 0; j < g; j++) {
+				gmsg[j].data = gdat[j];
+				gmsg[j].len = glen[j];
+				gmsg[j].seg = gmsg[j].stride = (glen[j] > 0 ? glen[j] : 1);
+				gmsg[j].tail = NULL;
+				gmsg[j].taillen = 0;
+			}
+			mb_keccak(algo, gdig, gmsg, g);
+			break;
+		    default:
+			blake2b_lanes(gdig, gdat, glen, g, 64);
+			break;
+		}
+	}
+	return (0);
+#else
+	return (-1);
+#endif
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef _MB_HASH_H_
+#define	_MB_HASH_H_
+
+#include <utils.h>
+
+/*
+ * Maximum number of buffers accepted by one mb_hash() call.
+ */
+#define	MB_HASH_BATCH	32
+
+#define	MB_SHA512	1
+#define	MB_SHA512T256	2
+#define	MB_BLAKE2B_256	3
+#define	MB_BLAKE2B_512	4
+#define	MB_KECCAK256	5
+#define	MB_KECCAK512	6
+
+#define	MB_LANES	4
+
+/*
+ * A message of len bytes taken from data as seg byte pieces that start
+ * stride bytes apart, followed by taillen bytes from tail. A contiguous
+ * buffer has seg equal to stride.
+ */
+typedef struct {
+	uchar_t *data;
+	uint64_t len;
+	uint64_t seg;
+	uint64_t stride;
+	uchar_t *tail;
+	uint64_t taillen;
+} mb_msg_t;
+
+void mb_hash_init(processor_cap_t *pc);
+int mb_hash_avail(int algo);
+int mb_hash(int algo, uchar_t *digest[], uchar_t *data[], uint64_t len[], int n);
+int mb_keccak(int algo, uchar_t *digest[], mb_msg_t msg[], int n);
+
+#endif
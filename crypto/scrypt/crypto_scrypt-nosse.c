@@ -62,18 +62,37 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 #include "sha256.h"
 #include "sysendian.h"
 
 #include "crypto_scrypt.h"
+#include "crypto_scrypt_smix.h"
 
 static void blkcpy(void *, void *, size_t);
 static void blkxor(void *, void *, size_t);
 static void salsa20_8(uint32_t[16]);
 static void blockmix_salsa8(uint32_t *, uint32_t *, uint32_t *, size_t);
 static uint64_t integerify(void *, size_t);
-static void smix(uint8_t *, size_t, uint64_t, uint32_t *, uint32_t *);
+
+typedef void (*smix_func_t)(uint8_t *, size_t, uint64_t, uint32_t *, uint32_t *);
+static smix_func_t smix = smix_ref;
+
+/*
+ * Pick the SMix implementation for this CPU. All of them give identical
+ * results.
+ */
+void
+scrypt_module_init(processor_cap_t *pc)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (pc->sse_level >= 2)
+		smix = smix_sse2;
+#endif
+}
 
 /*
  * Fixup parameters for scrypt. Memory is hardcoded here for
@@ -231,15 +250,15 @@ integerify(void * B, size_t r)
 }
 
 /**
- * smix(B, r, N, V, XY):
+ * smix_ref(B, r, N, V, XY):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length;
  * the temporary storage V must be 128rN bytes in length; the temporary
  * storage XY must be 256r + 64 bytes in length.  The value N must be a
  * power of 2 greater than 1.  The arrays B, V, and XY must be aligned to a
  * multiple of 64 bytes.
  */
-static void
-smix(uint8_t * B, size_t r, uint64_t N, uint32_t * V, uint32_t * XY)
+void
+smix_ref(uint8_t * B, size_t r, uint64_t N, uint32_t * V, uint32_t * XY)
 {
 	uint32_t * X = XY;
 	uint32_t * Y = &XY[32 * r];
@@ -308,6 +327,7 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	uint32_t * V;
 	uint32_t * XY;
 	uint32_t i;
+	size_t nthr;
 
 	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
@@ -324,11 +344,22 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 		errno = EINVAL;
 		goto err0;
 	}
+
+	/*
+	 * The p SMix instances are independent, so they are run in parallel
+	 * with one V and XY area per thread.
+	 */
+	nthr = 1;
+#if defined(_OPENMP)
+	nthr = omp_get_max_threads();
+	if (nthr > p)
+		nthr = p;
+#endif
 	if ((r > SIZE_MAX / 128 / p) ||
 #if SIZE_MAX / 256 <= UINT32_MAX
-	    (r > SIZE_MAX / 256) ||
+	    (r > SIZE_MAX / 256 / nthr) ||
 #endif
-	    (N > SIZE_MAX / 128 / r)) {
+	    (N > SIZE_MAX / 128 / r / nthr)) {
 		errno = ENOMEM;
 		goto err0;
 	}
@@ -338,11 +369,11 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	if ((errno = posix_memalign(&B0, 64, 128 * r * p)) != 0)
 		goto err0;
 	B = (uint8_t *)(B0);
-	if ((errno = posix_memalign(&XY0, 64, 256 * r + 64)) != 0)
+	if ((errno = posix_memalign(&XY0, 64, (256 * r + 64) * nthr)) != 0)
 		goto err1;
 	XY = (uint32_t *)(XY0);
 #ifndef MAP_ANON
-	if ((errno = posix_memalign(&V0, 64, 128 * r * N)) != 0)
+	if ((errno = posix_memalign(&V0, 64, 128 * r * N * nthr)) != 0)
 		goto err2;
 	V = (uint32_t *)(V0);
 #endif
@@ -350,17 +381,17 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	if ((B0 = malloc(128 * r * p + 63)) == NULL)
 		goto err0;
 	B = (uint8_t *)(((uintptr_t)(B0) + 63) & ~ (uintptr_t)(63));
-	if ((XY0 = malloc(256 * r + 64 + 63)) == NULL)
+	if ((XY0 = malloc((256 * r + 64) * nthr + 63)) == NULL)
 		goto err1;
 	XY = (uint32_t *)(((uintptr_t)(XY0) + 63) & ~ (uintptr_t)(63));
 #ifndef MAP_ANON
-	if ((V0 = malloc(128 * r * N + 63)) == NULL)
+	if ((V0 = malloc(128 * r * N * nthr + 63)) == NULL)
 		goto err2;
 	V = (uint32_t *)(((uintptr_t)(V0) + 63) & ~ (uintptr_t)(63));
 #endif
 #endif
 #ifdef MAP_ANON
-	if ((V0 = mmap(NULL, 128 * r * N, PROT_READ | PROT_WRITE,
+	if ((V0 = mmap(NULL, 128 * r * N * nthr, PROT_READ | PROT_WRITE,
 #ifdef MAP_NOCORE
 	    MAP_ANON | MAP_PRIVATE | MAP_NOCORE,
 #else
@@ -375,9 +406,17 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B, p * 128 * r);
 
 	/* 2: for i = 0 to p - 1 do */
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nthr) schedule(static)
+#endif
 	for (i = 0; i < p; i++) {
+		size_t t = 0;
+
+#if defined(_OPENMP)
+		t = omp_get_thread_num();
+#endif
 		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
+		smix(&B[i * 128 * r], r, N, &V[t * 32 * r * N], &XY[t * (64 * r + 16)]);
 	}
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
@@ -385,7 +424,7 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 
 	/* Free memory. */
 #ifdef MAP_ANON
-	if (munmap(V0, 128 * r * N))
+	if (munmap(V0, 128 * r * N * nthr))
 		goto err2;
 #else
 	free(V0);
@@ -56,6 +56,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <utils.h>
 
 #define	PBE_ROUNDS	50000
 
@@ -72,6 +73,7 @@ int crypto_scrypt(const uint8_t *, size_t, const uint8_t *, size_t, uint64_t,
     uint32_t, uint32_t, uint8_t *, size_t);
 
 void pickparams(int * logN, uint32_t * r, uint32_t * p);
+void scrypt_module_init(processor_cap_t *pc);
 
 #define	HAVE_POSIX_MEMALIGN
 
@@ -32,6 +32,7 @@
 #include <omp.h>
 #endif
 #include <utils.h>
+#include <mb_hash.h>
 
 #define	KECCAK_BLOCK_SIZE	1024
 #define	BLKSZ			(2048)
@@ -51,6 +52,39 @@
  * http://gva.noekeon.org/papers/bdpv09tree.html
  */
 
+/*
+ * Hash the 4 leaves in the SIMD lanes of one thread where the CPU allows.
+ * Leaf i is every 4th BLKSZ block starting with block i, and leaf 0 also
+ * gets the partial block at the end. The lanes do about as much as 2.5
+ * scalar threads, so with more threads at hand those are used instead.
+ */
+static int
+keccak_leaves_mb(int algo, uchar_t *cksum[], uchar_t *buf, uint64_t bytes)
+{
+	mb_msg_t msg[4];
+	uint64_t nblk;
+	int i;
+
+	if (!mb_hash_avail(algo))
+		return (-1);
+#if defined(_OPENMP)
+	if (omp_get_max_threads() >= 3)
+		return (-1);
+#endif
+	nblk = bytes / BLKSZ;
+	for (i = 0; i < 4; i++) {
+		msg[i].data = buf + i * BLKSZ;
+		msg[i].len = (nblk > i ? (nblk - i + 3) / 4 : 0) * BLKSZ;
+		msg[i].seg = BLKSZ;
+		msg[i].stride = 4 * BLKSZ;
+		msg[i].tail = NULL;
+		msg[i].taillen = 0;
+	}
+	msg[0].tail = buf + nblk * BLKSZ;
+	msg[0].taillen = bytes - nblk * BLKSZ;
+	return (mb_keccak(algo, cksum, msg, 4));
+}
+
 int
 Keccak256(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 {
@@ -60,7 +94,7 @@ Keccak256(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 int
 Keccak256_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 {
-	uchar_t cksum[6][32];
+	uchar_t cksum[6][32], *leaf[4];
 	hashState ctx[4];
 	int i, rem, rv[4];
 	uint64_t _bytes;
@@ -77,6 +111,9 @@ Keccak256_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 	 * Do first level hashes in parallel.
 	 */
 	for (i = 0; i < 4; ++i) rv[i] = 0;
+	for (i = 0; i < 4; ++i) leaf[i] = cksum[i];
+	if (keccak_leaves_mb(MB_KECCAK256, leaf, buf, bytes) == 0)
+		goto second;
 	_bytes = (bytes / BLKSZ) * BLKSZ;
 	rem = bytes - _bytes;
 #if defined(_OPENMP)
@@ -101,6 +138,7 @@ Keccak256_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 	rv[0] |= Keccak_Final(&ctx[0], cksum[0]);
 
 	for (i = 0; i < 4; ++i) if (rv[i] != 0) return (-1);
+second:
 	rv[0] = 0;
 	rv[1] = 0;
 
@@ -134,7 +172,7 @@ Keccak512(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 int
 Keccak512_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 {
-	uchar_t cksum[6][64];
+	uchar_t cksum[6][64], *leaf[4];
 	hashState ctx[4];
 	int i, rem, rv[4];
 	uint64_t _bytes;
@@ -151,6 +189,9 @@ Keccak512_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 	 * Do first level hashes in parallel.
 	 */
 	for (i = 0; i < 4; ++i) rv[i] = 0;
+	for (i = 0; i < 4; ++i) leaf[i] = cksum[i];
+	if (keccak_leaves_mb(MB_KECCAK512, leaf, buf, bytes) == 0)
+		goto second;
 	_bytes = (bytes / BLKSZ) * BLKSZ;
 	rem = bytes - _bytes;
 #if defined(_OPENMP)
@@ -175,6 +216,7 @@ Keccak512_par(uchar_t *cksum_buf, uchar_t *buf, uint64_t bytes)
 	rv[0] |= Keccak_Final(&ctx[0], cksum[0]);
 
 	for (i = 0; i < 4; ++i) if (rv[i] != 0) return (-1);
+second:
 	rv[0] = 0;
 	rv[1] = 0;
 
@@ -0,0 +1,591 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * XXH3 64-bit and 128-bit hashes with the default secret and a zero seed,
+ * following the xxHash 0.8 specification by Yann Collet. The output is
+ * identical to XXH3_64bits() and XXH3_128bits(). Only the one-shot form is
+ * needed here since chunks and dedupe blocks are always hashed whole.
+ *
+ * Inputs longer than 240 bytes go through the stripe accumulator which has
+ * SSE2 and AVX2 versions on x86, selected at init time.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#include "xxh3.h"
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#define	PRIME32_1	0x9E3779B1U
+#define	PRIME32_2	0x85EBCA77U
+#define	PRIME32_3	0xC2B2AE3DU
+#define	PRIME64_1	0x9E3779B185EBCA87ULL
+#define	PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define	PRIME64_3	0x165667B19E3779F9ULL
+#define	PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define	PRIME64_5	0x27D4EB2F165667C5ULL
+#define	PRIME_MX1	0x165667919E3779F9ULL
+#define	PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define	SECRET_SIZE		192
+#define	SECRET_SIZE_MIN		136
+#define	STRIPE_LEN		64
+#define	SECRET_CONSUME_RATE	8
+#define	ACC_NB			8
+#define	STRIPES_PER_BLOCK	((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define	BLOCK_LEN		(STRIPE_LEN * STRIPES_PER_BLOCK)
+#define	SECRET_LASTACC_START	7
+#define	SECRET_MERGEACCS_START	11
+#define	MIDSIZE_MAX		240
+#define	COPY_SEG		(BLOCK_LEN * 8)
+#define	MIDSIZE_STARTOFFSET	3
+#define	MIDSIZE_LASTOFFSET	17
+
+static const uchar_t kSecret[SECRET_SIZE] __attribute__((aligned(64))) = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+typedef void (*accumulate_func_t)(uint64_t *acc, const uchar_t *in,
+    const uchar_t *secret, uint64_t nstripes);
+typedef void (*scramble_func_t)(uint64_t *acc, const uchar_t *secret);
+
+static void accumulate_scalar(uint64_t *acc, const uchar_t *in,
+    const uchar_t *secret, uint64_t nstripes);
+static void scramble_scalar(uint64_t *acc, const uchar_t *secret);
+
+static accumulate_func_t accumulate = accumulate_scalar;
+static scramble_func_t scramble = scramble_scalar;
+
+static inline uint32_t
+rd32(const uchar_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (LE32(v));
+}
+
+static inline uint64_t
+rd64(const uchar_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+	return (LE64(v));
+}
+
+static inline uint64_t
+rotl64(uint64_t v, int r)
+{
+	return ((v << r) | (v >> (64 - r)));
+}
+
+static inline uint32_t
+swap32(uint32_t v)
+{
+	return (((v << 24) & 0xff000000U) | ((v << 8) & 0x00ff0000U) |
+	    ((v >> 8) & 0x0000ff00U) | ((v >> 24) & 0x000000ffU));
+}
+
+static inline uint64_t
+swap64(uint64_t v)
+{
+	return (((uint64_t)swap32((uint32_t)v) << 32) | swap32((uint32_t)(v >> 32)));
+}
+
+static inline void
+mult64to128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+	__uint128_t p = (__uint128_t)a * b;
+
+	*lo = (uint64_t)p;
+	*hi = (uint64_t)(p >> 64);
+}
+
+static inline uint64_t
+mul128_fold64(uint64_t a, uint64_t b)
+{
+	uint64_t lo, hi;
+
+	mult64to128(a, b, &lo, &hi);
+	return (lo ^ hi);
+}
+
+static inline uint64_t
+xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return (h);
+}
+
+static inline uint64_t
+xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return (h);
+}
+
+static inline uint64_t
+rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return (h ^ (h >> 28));
+}
+
+static inline uint64_t
+mix16B(const uchar_t *in, const uchar_t *secret)
+{
+	return (mul128_fold64(rd64(in) ^ rd64(secret), rd64(in + 8) ^ rd64(secret + 8)));
+}
+
+static inline void
+mix32B(uint64_t *lo, uint64_t *hi, const uchar_t *in1, const uchar_t *in2,
+    const uchar_t *secret)
+{
+	*lo += mix16B(in1, secret);
+	*lo ^= rd64(in2) + rd64(in2 + 8);
+	*hi += mix16B(in2, secret + 16);
+	*hi ^= rd64(in1) + rd64(in1 + 8);
+}
+
+/*
+ * Stripe accumulators. Each stripe of 64 bytes is mixed into 8 64-bit
+ * accumulators using 32x32->64 multiplies, which map directly onto the
+ * pmuludq family of instructions.
+ */
+static void
+accumulate_scalar(uint64_t *acc, const uchar_t *in, const uchar_t *secret,
+    uint64_t nstripes)
+{
+	uint64_t n, i, dv, dk;
+
+	for (n = 0; n < nstripes; n++) {
+		const uchar_t *ip = in + n * STRIPE_LEN;
+		const uchar_t *sp = secret + n * SECRET_CONSUME_RATE;
+
+		for (i = 0; i < ACC_NB; i++) {
+			dv = rd64(ip + i * 8);
+			dk = dv ^ rd64(sp + i * 8);
+			acc[i ^ 1] += dv;
+			acc[i] += (dk & 0xffffffffULL) * (dk >> 32);
+		}
+	}
+}
+
+static void
+scramble_scalar(uint64_t *acc, const uchar_t *secret)
+{
+	int i;
+
+	for (i = 0; i < ACC_NB; i++) {
+		uint64_t a = acc[i];
+
+		a ^= a >> 47;
+		a ^= rd64(secret + i * 8);
+		a *= PRIME32_1;
+		acc[i] = a;
+	}
+}
+
+#if defined(__x86_64__)
+static void
+accumulate_sse2(uint64_t *acc, const uchar_t *in, const uchar_t *secret,
+    uint64_t nstripes)
+{
+	__m128i a[4];
+	uint64_t n;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		a[i] = _mm_loadu_si128((const __m128i *)(acc + i * 2));
+	for (n = 0; n < nstripes; n++) {
+		const uchar_t *ip = in + n * STRIPE_LEN;
+		const uchar_t *sp = secret + n * SECRET_CONSUME_RATE;
+
+		for (i = 0; i < 4; i++) {
+			__m128i dv = _mm_loadu_si128((const __m128i *)(ip + i * 16));
+			__m128i kv = _mm_loadu_si128((const __m128i *)(sp + i * 16));
+			__m128i dk = _mm_xor_si128(dv, kv);
+			__m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+			__m128i swap = _mm_shuffle_epi32(dv, _MM_SHUFFLE(1, 0, 3, 2));
+
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(prod, swap));
+		}
+	}
+	for (i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i *)(acc + i * 2), a[i]);
+}
+
+static void
+scramble_sse2(uint64_t *acc, const uchar_t *secret)
+{
+	__m128i prime = _mm_set1_epi32((int)PRIME32_1);
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(acc + i * 2));
+		__m128i kv = _mm_loadu_si128((const __m128i *)(secret + i * 16));
+		__m128i dk, plo, phi;
+
+		a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+		dk = _mm_xor_si128(a, kv);
+		plo = _mm_mul_epu32(dk, prime);
+		phi = _mm_mul_epu32(_mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+		_mm_storeu_si128((__m128i *)(acc + i * 2),
+		    _mm_add_epi64(plo, _mm_slli_epi64(phi, 32)));
+	}
+}
+
+static __attribute__((target("avx2"))) void
+accumulate_avx2(uint64_t *acc, const uchar_t *in, const uchar_t *secret,
+    uint64_t nstripes)
+{
+	__m256i a[2];
+	uint64_t n;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		a[i] = _mm256_loadu_si256((const __m256i *)(acc + i * 4));
+	for (n = 0; n < nstripes; n++) {
+		const uchar_t *ip = in + n * STRIPE_LEN;
+		const uchar_t *sp = secret + n * SECRET_CONSUME_RATE;
+
+		for (i = 0; i < 2; i++) {
+			__m256i dv = _mm256_loadu_si256((const __m256i *)(ip + i * 32));
+			__m256i kv = _mm256_loadu_si256((const __m256i *)(sp + i * 32));
+			__m256i dk = _mm256_xor_si256(dv, kv);
+			__m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+			__m256i swap = _mm256_shuffle_epi32(dv, _MM_SHUFFLE(1, 0, 3, 2));
+
+			a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(prod, swap));
+		}
+	}
+	for (i = 0; i < 2; i++)
+		_mm256_storeu_si256((__m256i *)(acc + i * 4), a[i]);
+}
+
+static __attribute__((target("avx2"))) void
+scramble_avx2(uint64_t *acc, const uchar_t *secret)
+{
+	__m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(acc + i * 4));
+		__m256i kv = _mm256_loadu_si256((const __m256i *)(secret + i * 32));
+		__m256i dk, plo, phi;
+
+		a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+		dk = _mm256_xor_si256(a, kv);
+		plo = _mm256_mul_epu32(dk, prime);
+		phi = _mm256_mul_epu32(_mm256_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+		_mm256_storeu_si256((__m256i *)(acc + i * 4),
+		    _mm256_add_epi64(plo, _mm256_slli_epi64(phi, 32)));
+	}
+}
+#endif
+
+void
+xxh3_init(processor_cap_t *pc)
+{
+#if defined(__x86_64__)
+	accumulate = accumulate_sse2;
+	scramble = scramble_sse2;
+	if (pc->avx_level >= 2) {
+		accumulate = accumulate_avx2;
+		scramble = scramble_avx2;
+	}
+#endif
+}
+
+static inline uint64_t
+merge_accs(const uint64_t *acc, const uchar_t *secret, uint64_t start)
+{
+	uint64_t r = start;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		r += mul128_fold64(acc[2 * i] ^ rd64(secret + 16 * i),
+		    acc[2 * i + 1] ^ rd64(secret + 16 * i + 8));
+	}
+	return (xxh3_avalanche(r));
+}
+
+/*
+ * When dst is given the input is also copied to it. The copy is done
+ * COPY_SEG bytes ahead of hashing so that the hash reads the data back from
+ * L1 cache rather than making a second trip through memory.
+ */
+static void
+hash_long(uint64_t *acc, uchar_t *dst, const uchar_t *in, uint64_t len)
+{
+	uint64_t nblocks = (len - 1) / BLOCK_LEN;
+	uint64_t n, nstripes, copied, c;
+
+	acc[0] = PRIME32_3; acc[1] = PRIME64_1;
+	acc[2] = PRIME64_2; acc[3] = PRIME64_3;
+	acc[4] = PRIME64_4; acc[5] = PRIME32_2;
+	acc[6] = PRIME64_5; acc[7] = PRIME32_1;
+
+	copied = 0;
+	for (n = 0; n < nblocks; n++) {
+		if (dst && copied < (n + 1) * BLOCK_LEN) {
+			c = len - copied;
+			if (c > COPY_SEG)
+				c = COPY_SEG;
+			memcpy(dst + copied, in + copied, c);
+			copied += c;
+		}
+		accumulate(acc, in + n * BLOCK_LEN, kSecret, STRIPES_PER_BLOCK);
+		scramble(acc, kSecret + SECRET_SIZE - STRIPE_LEN);
+	}
+	if (dst && copied < len)
+		memcpy(dst + copied, in + copied, len - copied);
+	nstripes = ((len - 1) - BLOCK_LEN * nblocks) / STRIPE_LEN;
+	accumulate(acc, in + nblocks * BLOCK_LEN, kSecret, nstripes);
+	accumulate(acc, in + len - STRIPE_LEN,
+	    kSecret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START, 1);
+}
+
+uint64_t
+xxh3_64(const uchar_t *in, uint64_t len)
+{
+	const uchar_t *s = kSecret;
+	uint64_t acc, acc_end;
+	unsigned int i, nrounds;
+
+	if (len <= 16) {
+		if (len > 8) {
+			uint64_t lo = rd64(in) ^ (rd64(s + 24) ^ rd64(s + 32));
+			uint64_t hi = rd64(in + len - 8) ^ (rd64(s + 40) ^ rd64(s + 48));
+
+			return (xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi)));
+		}
+		if (len >= 4) {
+			uint64_t in64 = rd32(in + len - 4) + ((uint64_t)rd32(in) << 32);
+
+			return (rrmxmx(in64 ^ (rd64(s + 8) ^ rd64(s + 16)), len));
+		}
+		if (len) {
+			uint32_t c = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+			    (uint32_t)in[len - 1] | ((uint32_t)len << 8);
+
+			return (xxh64_avalanche((uint64_t)c ^ (rd32(s) ^ rd32(s + 4))));
+		}
+		return (xxh64_avalanche(rd64(s + 56) ^ rd64(s + 64)));
+	}
+
+	if (len <= 128) {
+		acc = len * PRIME64_1;
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += mix16B(in + 48, s + 96);
+					acc += mix16B(in + len - 64, s + 112);
+				}
+				acc += mix16B(in + 32, s + 64);
+				acc += mix16B(in + len - 48, s + 80);
+			}
+			acc += mix16B(in + 16, s + 32);
+			acc += mix16B(in + len - 32, s + 48);
+		}
+		acc += mix16B(in, s);
+		acc += mix16B(in + len - 16, s + 16);
+		return (xxh3_avalanche(acc));
+	}
+
+	if (len <= MIDSIZE_MAX) {
+		acc = len * PRIME64_1;
+		nrounds = (unsigned int)len / 16;
+		for (i = 0; i < 8; i++)
+			acc += mix16B(in + 16 * i, s + 16 * i);
+		acc_end = mix16B(in + len - 16, s + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET);
+		acc = xxh3_avalanche(acc);
+		for (i = 8; i < nrounds; i++)
+			acc_end += mix16B(in + 16 * i, s + 16 * (i - 8) + MIDSIZE_STARTOFFSET);
+		return (xxh3_avalanche(acc + acc_end));
+	}
+
+	{
+		uint64_t accs[ACC_NB];
+
+		hash_long(accs, NULL, in, len);
+		return (merge_accs(accs, s + SECRET_MERGEACCS_START, len * PRIME64_1));
+	}
+}
+
+void
+xxh3_128(const uchar_t *in, uint64_t len, uint64_t *lo, uint64_t *hi)
+{
+	const uchar_t *s = kSecret;
+	uint64_t alo, ahi;
+	unsigned int i;
+
+	if (len <= 16) {
+		if (len > 8) {
+			uint64_t flipl = rd64(s + 32) ^ rd64(s + 40);
+			uint64_t fliph = rd64(s + 48) ^ rd64(s + 56);
+			uint64_t in_lo = rd64(in);
+			uint64_t in_hi = rd64(in + len - 8);
+			uint64_t mlo, mhi, hlo, hhi;
+
+			mult64to128(in_lo ^ in_hi ^ flipl, PRIME64_1, &mlo, &mhi);
+			mlo += (uint64_t)(len - 1) << 54;
+			in_hi ^= fliph;
+			mhi += in_hi + (uint64_t)(uint32_t)in_hi * (PRIME32_2 - 1);
+			mlo ^= swap64(mhi);
+			mult64to128(mlo, PRIME64_2, &hlo, &hhi);
+			hhi += mhi * PRIME64_2;
+			*lo = xxh3_avalanche(hlo);
+			*hi = xxh3_avalanche(hhi);
+			return;
+		}
+		if (len >= 4) {
+			uint64_t in64 = rd32(in) + ((uint64_t)rd32(in + len - 4) << 32);
+			uint64_t keyed = in64 ^ (rd64(s + 16) ^ rd64(s + 24));
+			uint64_t mlo, mhi;
+
+			mult64to128(keyed, PRIME64_1 + (len << 2), &mlo, &mhi);
+			mhi += mlo << 1;
+			mlo ^= mhi >> 3;
+			mlo ^= mlo >> 35;
+			mlo *= PRIME_MX2;
+			mlo ^= mlo >> 28;
+			*lo = mlo;
+			*hi = xxh3_avalanche(mhi);
+			return;
+		}
+		if (len) {
+			uint32_t cl = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+			    (uint32_t)in[len - 1] | ((uint32_t)len << 8);
+			uint32_t ch = swap32(cl);
+
+			ch = (ch << 13) | (ch >> 19);
+			*lo = xxh64_avalanche((uint64_t)cl ^ (rd32(s) ^ rd32(s + 4)));
+			*hi = xxh64_avalanche((uint64_t)ch ^ (rd32(s + 8) ^ rd32(s + 12)));
+			return;
+		}
+		*lo = xxh64_avalanche(rd64(s + 64) ^ rd64(s + 72));
+		*hi = xxh64_avalanche(rd64(s + 80) ^ rd64(s + 88));
+		return;
+	}
+
+	if (len <= MIDSIZE_MAX) {
+		alo = len * PRIME64_1;
+		ahi = 0;
+		if (len <= 128) {
+			if (len > 32) {
+				if (len > 64) {
+					if (len > 96)
+						mix32B(&alo, &ahi, in + 48, in + len - 64, s + 96);
+					mix32B(&alo, &ahi, in + 32, in + len - 48, s + 64);
+				}
+				mix32B(&alo, &ahi, in + 16, in + len - 32, s + 32);
+			}
+			mix32B(&alo, &ahi, in, in + len - 16, s);
+		} else {
+			for (i = 32; i < 160; i += 32)
+				mix32B(&alo, &ahi, in + i - 32, in + i - 16, s + i - 32);
+			alo = xxh3_avalanche(alo);
+			ahi = xxh3_avalanche(ahi);
+			for (i = 160; i <= len; i += 32) {
+				mix32B(&alo, &ahi, in + i - 32, in + i - 16,
+				    s + MIDSIZE_STARTOFFSET + i - 160);
+			}
+			mix32B(&alo, &ahi, in + len - 16, in + len - 32,
+			    s + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET - 16);
+		}
+		*lo = xxh3_avalanche(alo + ahi);
+		*hi = 0 - xxh3_avalanche(alo * PRIME64_1 + ahi * PRIME64_4 + len * PRIME64_2);
+		return;
+	}
+
+	{
+		uint64_t accs[ACC_NB];
+
+		hash_long(accs, NULL, in, len);
+		*lo = merge_accs(accs, s + SECRET_MERGEACCS_START, len * PRIME64_1);
+		*hi = merge_accs(accs, s + SECRET_SIZE - sizeof (accs) - SECRET_MERGEACCS_START,
+		    ~(len * PRIME64_2));
+	}
+}
+
+/*
+ * Copy len bytes from in to dst and return the hash of the data.
+ */
+uint64_t
+xxh3_64_copy(uchar_t *dst, const uchar_t *in, uint64_t len)
+{
+	uint64_t accs[ACC_NB];
+
+	if (len <= MIDSIZE_MAX) {
+		memcpy(dst, in, len);
+		return (xxh3_64(dst, len));
+	}
+	hash_long(accs, dst, in, len);
+	return (merge_accs(accs, kSecret + SECRET_MERGEACCS_START, len * PRIME64_1));
+}
+
+void
+xxh3_128_copy(uchar_t *dst, const uchar_t *in, uint64_t len, uint64_t *lo, uint64_t *hi)
+{
+	uint64_t accs[ACC_NB];
+
+	if (len <= MIDSIZE_MAX) {
+		memcpy(dst, in, len);
+		xxh3_128(dst, len, lo, hi);
+		return;
+	}
+	hash_long(accs, dst, in, len);
+	*lo = merge_accs(accs, kSecret + SECRET_MERGEACCS_START, len * PRIME64_1);
+	*hi = merge_accs(accs, kSecret + SECRET_SIZE - sizeof (accs) - SECRET_MERGEACCS_START,
+	    ~(len * PRIME64_2));
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef _XXH3_H_
+#define	_XXH3_H_
+
+#include <utils.h>
+
+void xxh3_init(processor_cap_t *pc);
+uint64_t xxh3_64(const uchar_t *in, uint64_t len);
+void xxh3_128(const uchar_t *in, uint64_t len, uint64_t *lo, uint64_t *hi);
+uint64_t xxh3_64_copy(uchar_t *dst, const uchar_t *in, uint64_t len);
+void xxh3_128_copy(uchar_t *dst, const uchar_t *in, uint64_t len, uint64_t *lo, uint64_t *hi);
+
+#endif
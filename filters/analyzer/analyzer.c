@@ -22,6 +22,7 @@
  * moinakg@belenix.org, http://moinakg.wordpress.com/
  */
 
+#include <math.h>
 #include "utils.h"
 #include "analyzer.h"
 
@@ -29,46 +30,114 @@
 #define	THIRTY_PCT(x)	((((double)x)/10) * 3)
 #define	TEN_PCT(x)	(((double)x)/10)
 
-void
-analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx)
+#define	ENTROPY_WINDOW	4096
+#define	ENTROPY_WINDOWS	16
+
+/*
+ * Sampled analysis of large buffers. The sample is ANALYZE_WINDOWS windows of
+ * ANALYZE_WINDOW bytes. Below ANALYZE_MIN_CONFIDENCE standard errors from a
+ * threshold the buffer is scanned in full.
+ */
+#define	ANALYZE_SAMPLE_MIN	(32 * 1024 * 1024)
+#define	ANALYZE_WINDOW		(64 * 1024)
+#define	ANALYZE_WINDOWS		64
+#define	ANALYZE_MIN_CONFIDENCE	4.0
+#define	ANALYZE_SLACK		0.002
+
+/*
+ * Order-0 entropy in bits per byte of a byte frequency table.
+ */
+static double
+freq_entropy(uint64_t *freq, uint64_t tot)
 {
-	uchar_t *src1 = (uchar_t *)src;
-	uint64_t i, tot8b, tot_8b, lbytes, spc;
-	uchar_t cur_byte, prev_byte;
-	uint64_t tag1, tag2, tag3;
-	double tagcnt, pct_tag;
+	double ent, p;
+	int i;
 
-	/*
-	 * Count number of 8-bit binary bytes and XML tags in source.
-	 */
-	tot8b = 0;
-	tag1 = 0;
-	tag2 = 0;
-	tag3 = 0;
-	lbytes = 0;
-	spc = 0;
-	prev_byte = cur_byte = 0;
-	memset(actx, 0, sizeof (analyzer_ctx_t));
-	for (i = 0; i < srclen; i++) {
-		cur_byte = src1[i];
-		tot8b += (cur_byte > 127);
-		lbytes += (cur_byte < 32);
-		spc += (cur_byte == ' ');
-		tag1 += (cur_byte == '<');
-		tag2 += (cur_byte == '>');
-		tag3 += ((prev_byte == '<') & (cur_byte == '/'));
-		tag3 += ((prev_byte == '/') & (cur_byte == '>'));
-		if (cur_byte != ' ')
-			prev_byte = cur_byte;
+	if (tot == 0)
+		return (0);
+	ent = 0;
+	for (i = 0; i < 256; i++) {
+		if (freq[i] == 0)
+			continue;
+		p = (double)freq[i] / tot;
+		ent -= p * log2(p);
 	}
+	return (ent);
+}
+
+/*
+ * Count closing tag markers, a '/' preceded by '<' or followed by '>' ignoring
+ * spaces in between. The '/' bytes are located with memchr() which is
+ * vectorized in the C library, so little else than the histogram pass
+ * touches every byte.
+ */
+static uint64_t
+count_close_tags(uchar_t *src, uint64_t srclen)
+{
+	uchar_t *pos, *end, *p;
+	uint64_t tags;
+
+	tags = 0;
+	pos = src;
+	end = src + srclen;
+	while (pos < end && (pos = (uchar_t *)memchr(pos, '/', end - pos)) != NULL) {
+		p = pos;
+		while (p > src && p[-1] == ' ') p--;
+		tags += (p > src && p[-1] == '<');
+		p = pos + 1;
+		while (p < end && *p == ' ') p++;
+		tags += (p < end && *p == '>');
+		pos++;
+	}
+	return (tags);
+}
+
+/*
+ * Add the byte histogram of the buffer to freq. Four partial tables avoid
+ * stalls on runs of the same byte value.
+ */
+static void
+byte_histogram(uchar_t *src, uint64_t srclen, uint64_t *freq)
+{
+	uint64_t f1[256], f2[256], f3[256];
+	uint64_t i;
+
+	memset(f1, 0, sizeof (f1));
+	memset(f2, 0, sizeof (f2));
+	memset(f3, 0, sizeof (f3));
+	for (i = 0; i + 4 <= srclen; i += 4) {
+		freq[src[i]]++;
+		f1[src[i + 1]]++;
+		f2[src[i + 2]]++;
+		f3[src[i + 3]]++;
+	}
+	for (; i < srclen; i++)
+		freq[src[i]]++;
+	for (i = 0; i < 256; i++)
+		freq[i] += f1[i] + f2[i] + f3[i];
+}
+
+static uint64_t
+freq_range(uint64_t *freq, int from, int to)
+{
+	uint64_t tot;
+	int i;
+
+	tot = 0;
+	for (i = from; i < to; i++)
+		tot += freq[i];
+	return (tot);
+}
+
+/*
+ * Classify from the counts of 8-bit and control bytes and the markup test.
+ */
+static void
+classify(analyzer_ctx_t *actx, uint64_t tot8b, uint64_t lbytes, uint64_t srclen, int markup)
+{
+	uint64_t tot_8b;
 
-	/*
-	 * Heuristics for detecting BINARY vs generic TEXT vs XML data at various
-	 * significance levels.
-	 */
 	tot_8b = tot8b + lbytes;
-	tagcnt = tag1 + tag2;
-	pct_tag = tagcnt / (double)srclen;
 	if (tot_8b > THIRTY_PCT(srclen)) {
 		actx->thirty_pct.btype = TYPE_BINARY;
 	} else {
@@ -88,14 +157,142 @@ analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx)
 		actx->ten_pct.btype = TYPE_BINARY;
 	}
 
-	if (tag1 > tag2 - 4 && tag1 < tag2 + 4 && tag3 > (double)tag1 * 0.40 &&
-	    tagcnt > (double)spc * 0.06) {
+	if (markup) {
 		actx->thirty_pct.btype |= TYPE_MARKUP;
 		actx->fifty_pct.btype |= TYPE_MARKUP;
 		actx->ten_pct.btype |= TYPE_MARKUP;
 	}
 }
 
+/*
+ * Distance of a sampled fraction from a classification threshold in standard
+ * errors. A small absolute slack covers the windows not being independent.
+ */
+static double
+thr_distance(double mean, double se, double thr)
+{
+	return (fabs(mean - thr) / (se + ANALYZE_SLACK));
+}
+
+/*
+ * Sampled analysis of a large buffer. ANALYZE_WINDOWS evenly spaced windows
+ * are scanned and the spread of the per-window byte fractions gives the
+ * standard error of the sample. Returns -1 if a class or the markup test
+ * is too close to its threshold to trust the sample.
+ */
+static int
+analyze_sampled(uchar_t *src, uint64_t srclen, analyzer_ctx_t *actx)
+{
+	uint64_t wf[256];
+	uint64_t w, off, step, slen, tag1, tag2, tag3, spc;
+	double x[3], sum[3], sumsq[3], mean[3], se[3], conf, d, tagcnt, bal;
+	int i, markup;
+
+	step = (srclen - ANALYZE_WINDOW) / (ANALYZE_WINDOWS - 1);
+	tag3 = 0;
+	for (i = 0; i < 3; i++)
+		sum[i] = sumsq[i] = 0;
+	for (w = 0; w < ANALYZE_WINDOWS; w++) {
+		off = w * step;
+		memset(wf, 0, sizeof (wf));
+		byte_histogram(src + off, ANALYZE_WINDOW, wf);
+		for (i = 0; i < 256; i++)
+			actx->freq[i] += wf[i];
+		tag3 += count_close_tags(src + off, ANALYZE_WINDOW);
+
+		x[0] = (double)freq_range(wf, 128, 256) / ANALYZE_WINDOW;
+		x[1] = (double)freq_range(wf, 0, 32) / ANALYZE_WINDOW;
+		x[2] = x[0] + x[1];
+		for (i = 0; i < 3; i++) {
+			sum[i] += x[i];
+			sumsq[i] += x[i] * x[i];
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		mean[i] = sum[i] / ANALYZE_WINDOWS;
+		d = sumsq[i] / ANALYZE_WINDOWS - mean[i] * mean[i];
+		se[i] = sqrt((d > 0 ? d : 0) / ANALYZE_WINDOWS);
+	}
+
+	conf = thr_distance(mean[2], se[2], 0.3);
+	if ((d = thr_distance(mean[2], se[2], 0.5)) < conf) conf = d;
+	if ((d = thr_distance(mean[0], se[0], 0.1)) < conf) conf = d;
+	if ((d = thr_distance(mean[1], se[1], 0.875)) < conf) conf = d;
+	actx->confidence = conf;
+	if (conf < ANALYZE_MIN_CONFIDENCE)
+		return (-1);
+
+	/*
+	 * The full scan wants the open and close brackets balanced to within a
+	 * few bytes which a sample can only approximate. Balanced to 0.2% counts
+	 * as markup, off by more than 1% does not and anything else or near the
+	 * other limits asks for a full scan.
+	 */
+	slen = ANALYZE_WINDOW * ANALYZE_WINDOWS;
+	tag1 = actx->freq['<'];
+	tag2 = actx->freq['>'];
+	spc = actx->freq[' '];
+	tagcnt = tag1 + tag2;
+	markup = 0;
+	if (tagcnt > 0 && tag3 > tag1 * 0.30 && tagcnt > spc * 0.045) {
+		bal = fabs((double)tag1 - (double)tag2) / tagcnt;
+		if (bal > 0.002 && bal <= 0.01)
+			return (-1);
+		if (tag3 < tag1 * 0.50 || tagcnt < spc * 0.075)
+			return (-1);
+		markup = (bal <= 0.002);
+	}
+
+	classify(actx, freq_range(actx->freq, 128, 256), freq_range(actx->freq, 0, 32),
+	    slen, markup);
+	actx->entropy = freq_entropy(actx->freq, slen);
+	actx->sampled = 1;
+	return (0);
+}
+
+/*
+ * Build the byte histogram of the buffer in one pass and derive the counts of
+ * 8-bit, control, space and tag bytes as well as the order-0 entropy from it.
+ * Buffers of ANALYZE_SAMPLE_MIN bytes or more are sampled first and only
+ * scanned in full if the sample is ambiguous.
+ */
+void
+analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx)
+{
+	uchar_t *src1 = (uchar_t *)src;
+	uint64_t tot8b, lbytes, spc;
+	uint64_t tag1, tag2, tag3;
+	double tagcnt;
+	int markup;
+
+	memset(actx, 0, sizeof (analyzer_ctx_t));
+	if (srclen >= ANALYZE_SAMPLE_MIN) {
+		if (analyze_sampled(src1, srclen, actx) == 0)
+			return;
+		memset(actx->freq, 0, sizeof (actx->freq));
+	}
+	byte_histogram(src1, srclen, actx->freq);
+
+	tot8b = freq_range(actx->freq, 128, 256);
+	lbytes = freq_range(actx->freq, 0, 32);
+	spc = actx->freq[' '];
+	tag1 = actx->freq['<'];
+	tag2 = actx->freq['>'];
+	tag3 = 0;
+	if (actx->freq['/'] > 0)
+		tag3 = count_close_tags(src1, srclen);
+	actx->entropy = freq_entropy(actx->freq, srclen);
+
+	/*
+	 * Heuristics for detecting BINARY vs generic TEXT vs XML data at various
+	 * significance levels.
+	 */
+	tagcnt = tag1 + tag2;
+	markup = (tag1 > tag2 - 4 && tag1 < tag2 + 4 && tag3 > (double)tag1 * 0.40 &&
+	    tagcnt > (double)spc * 0.06);
+	classify(actx, tot8b, lbytes, srclen, markup);
+}
+
 int
 analyze_buffer_simple(void *src, uint64_t srclen)
 {
@@ -123,3 +320,32 @@ analyze_buffer_simple(void *src, uint64_t srclen)
 	return (btype);
 }
 
+
+/*
+ * Estimate the order-0 entropy of the buffer in bits per byte. Buffers larger
+ * than the sample size are sampled with evenly spaced windows so that the cost
+ * stays constant irrespective of the chunk size.
+ */
+double
+analyze_buffer_entropy(void *src, uint64_t srclen)
+{
+	uchar_t *src1 = (uchar_t *)src;
+	uint64_t freq[256];
+	uint64_t i, w, off, step, tot;
+
+	memset(freq, 0, sizeof (freq));
+	if (srclen <= ENTROPY_WINDOW * ENTROPY_WINDOWS) {
+		for (i = 0; i < srclen; i++)
+			freq[src1[i]]++;
+		tot = srclen;
+	} else {
+		step = (srclen - ENTROPY_WINDOW) / (ENTROPY_WINDOWS - 1);
+		for (w = 0; w < ENTROPY_WINDOWS; w++) {
+			off = w * step;
+			for (i = off; i < off + ENTROPY_WINDOW; i++)
+				freq[src1[i]]++;
+		}
+		tot = ENTROPY_WINDOW * ENTROPY_WINDOWS;
+	}
+	return (freq_entropy(freq, tot));
+}
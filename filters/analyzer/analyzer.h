@@ -29,18 +29,35 @@
 extern "C" {
 #endif
 
+/*
+ * Order-0 entropy in bits per byte at and above which data is treated as
+ * incompressible.
+ */
+#define	INCOMPRESSIBLE_ENTROPY	7.95
+
 struct significance_value {
 	int btype;
 };
 
+/*
+ * freq is the byte histogram of the analyzed buffer and entropy its order-0
+ * entropy in bits per byte. If only a sample of a large buffer was analyzed
+ * sampled is set, freq covers the sample and confidence is how many standard
+ * errors the sampled byte fractions are away from the nearest threshold.
+ */
 typedef struct _analyzer_ctx {
 	struct significance_value ten_pct;
 	struct significance_value thirty_pct;
 	struct significance_value fifty_pct;
+	uint64_t freq[256];
+	double entropy;
+	int sampled;
+	double confidence;
 } analyzer_ctx_t;
 
 void analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx);
 int analyze_buffer_simple(void *src, uint64_t srclen);
+double analyze_buffer_entropy(void *src, uint64_t srclen);
 
 #ifdef  __cplusplus
 }
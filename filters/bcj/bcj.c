@@ -0,0 +1,326 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+
+/*
+ * Branch/call address filter for ARM64 and RISC-V code. Calls and address
+ * computations in these instruction sets carry PC-relative offsets, so calls
+ * to the same function from different places look different. Converting the
+ * offsets to absolute positions within the buffer makes them repeat, like
+ * the E8E9 transform does for x86.
+ *
+ * ARM64: BL offsets and ADRP page offsets (within +/-512MB) are converted.
+ * Instructions are 4-byte aligned but a chunk can start anywhere in a file,
+ * so the alignment is detected and stored.
+ *
+ * RISC-V: JAL with ra as the link register and AUIPC followed by JALR,
+ * ADDI or a load that uses the AUIPC result are converted. A pair has its
+ * full 32-bit target computed and split back into the two immediates. The
+ * scan steps over compressed 16-bit instructions, starting at the detected
+ * 2-byte alignment.
+ *
+ * Only immediate fields change, the bits used to find instructions stay
+ * the same, so decoding finds the same places.
+ *
+ * Encoded format:
+ * Byte 0: Architecture (BCJ_ARM64 or BCJ_RISCV)
+ * Byte 1: Offset of the first instruction
+ * Filtered data of the same length as the original.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#include "bcj.h"
+
+/*
+ * Detection looks at BCJ_WINDOWS windows of BCJ_WINDOW_SZ bytes spread over
+ * the buffer for instruction patterns that are common in code but unlikely
+ * in other data: RET and the frame setup STP on ARM64 and AUIPC pairs on
+ * RISC-V. At least one per BCJ_MARK_RATIO bytes sampled is needed.
+ */
+#define	BCJ_WINDOWS		32
+#define	BCJ_WINDOW_SZ		8192
+#define	BCJ_MARK_RATIO		8192
+#define	BCJ_MIN_MARKS		8
+#define	BCJ_MIN_CONVERSIONS	32
+
+#define	A64_RET			0xd65f03c0
+#define	A64_STP_FP_LR		0xa9807bfd
+#define	A64_STP_MASK		0xffc07fff
+
+#define	RV_RD(w)		(((w) >> 7) & 0x1f)
+#define	RV_RS1(w)		(((w) >> 15) & 0x1f)
+
+/*
+ * Is w2 an instruction that adds its 12-bit I-type immediate to the result
+ * of the AUIPC w1: JALR, ADDI or a load.
+ */
+static int
+rv_auipc_pair(uint32_t w1, uint32_t w2)
+{
+	if (RV_RD(w1) == 0 || RV_RS1(w2) != RV_RD(w1))
+		return (0);
+	return ((w2 & 0x707f) == 0x67 || (w2 & 0x7f) == 0x03 || (w2 & 0x707f) == 0x13);
+}
+
+/*
+ * Returns the architecture detected, setting the offset of the first
+ * instruction, or 0.
+ */
+static int
+bcj_detect(uchar_t *src, uint64_t srclen, int *align)
+{
+	uint64_t marks[4], rv_marks[2], sampled, start, i, end;
+	uint64_t best;
+	int win, nwin, a;
+
+	memset(marks, 0, sizeof (marks));
+	memset(rv_marks, 0, sizeof (rv_marks));
+	sampled = 0;
+	nwin = BCJ_WINDOWS;
+	if (srclen <= (uint64_t)BCJ_WINDOWS * BCJ_WINDOW_SZ)
+		nwin = 1;
+
+	for (win = 0; win < nwin; win++) {
+		if (nwin == 1) {
+			start = 0;
+			end = srclen - 8;
+		} else {
+			start = (srclen - BCJ_WINDOW_SZ - 8) / BCJ_WINDOWS * win;
+			end = start + BCJ_WINDOW_SZ;
+		}
+		sampled += end - start;
+		for (i = start; i < end; i++) {
+			uint32_t w = LE32(U32_P(src + i));
+
+			if (w == A64_RET || (w & A64_STP_MASK) == A64_STP_FP_LR)
+				marks[i & 3]++;
+			if ((w & 0x7f) == 0x17 && rv_auipc_pair(w, LE32(U32_P(src + i + 4))))
+				rv_marks[i & 1]++;
+		}
+	}
+
+	best = 0;
+	*align = 0;
+	for (a = 0; a < 4; a++) {
+		if (marks[a] > best) {
+			best = marks[a];
+			*align = a;
+		}
+	}
+	if (best >= BCJ_MIN_MARKS && best * BCJ_MARK_RATIO >= sampled &&
+	    best > rv_marks[0] + rv_marks[1]) {
+		/*
+		 * Code is aligned, so marks at other offsets are chance hits.
+		 */
+		for (a = 0; a < 4; a++) {
+			if (a != *align && marks[a] * 4 > best)
+				return (0);
+		}
+		return (BCJ_ARM64);
+	}
+	*align = (rv_marks[1] > rv_marks[0]);
+	best = rv_marks[*align];
+	if (best >= BCJ_MIN_MARKS && best * BCJ_MARK_RATIO >= sampled &&
+	    rv_marks[!*align] * 4 <= best)
+		return (BCJ_RISCV);
+	return (0);
+}
+
+/*
+ * Convert ARM64 BL and ADRP immediates, to absolute when encoding and back
+ * when decoding. Returns the number of instructions converted.
+ */
+static uint64_t
+bcj_arm64(uchar_t *buf, uint64_t len, int align, int encode)
+{
+	uint64_t i, conversions;
+	uint32_t w, pc, src, dest;
+
+	conversions = 0;
+	for (i = align; i + 4 <= len; i += 4) {
+		w = LE32(U32_P(buf + i));
+		pc = (uint32_t)i;
+
+		if ((w >> 26) == 0x25) {
+			/*
+			 * BL, 26-bit word offset.
+			 */
+			pc >>= 2;
+			if (!encode)
+				pc = 0U - pc;
+			w = 0x94000000 | ((w + pc) & 0x03ffffff);
+			U32_P(buf + i) = LE32(w);
+			conversions++;
+
+		} else if ((w & 0x9f000000) == 0x90000000) {
+			/*
+			 * ADRP, 21-bit page offset split into immlo and immhi.
+			 * Only offsets within +/-512MB are converted, the top
+			 * bits of the field are then a sign extension and are
+			 * rewritten as one so that decoding sees the same range.
+			 */
+			src = ((w >> 29) & 3) | ((w >> 3) & 0x001ffffc);
+			if ((src + 0x00020000) & 0x001c0000)
+				continue;
+			pc >>= 12;
+			if (!encode)
+				pc = 0U - pc;
+			dest = src + pc;
+			w &= 0x9000001f;
+			w |= (dest & 3) << 29;
+			w |= (dest & 0x0003fffc) << 3;
+			w |= (0U - (dest & 0x00020000)) & 0x00e00000;
+			U32_P(buf + i) = LE32(w);
+			conversions++;
+		}
+	}
+	return (conversions);
+}
+
+/*
+ * Convert RISC-V JAL and AUIPC pair immediates. Returns the number of
+ * instructions converted.
+ */
+static uint64_t
+bcj_riscv(uchar_t *buf, uint64_t len, int align, int encode)
+{
+	uint64_t i, conversions;
+	uint32_t w, w2, pc, imm, val;
+
+	conversions = 0;
+	i = align;
+	while (i + 4 <= len) {
+		if ((buf[i] & 3) != 3) {
+			i += 2;
+			continue;
+		}
+		w = LE32(U32_P(buf + i));
+		pc = (uint32_t)(i - align);
+
+		if ((w & 0xfff) == 0x0ef) {
+			/*
+			 * JAL ra, 21-bit offset stored as imm[20|10:1|11|19:12].
+			 */
+			imm = ((w >> 11) & 0x100000) | ((w >> 20) & 0x7fe) |
+			    ((w >> 9) & 0x800) | (w & 0xff000);
+			if (encode)
+				imm += pc;
+			else
+				imm -= pc;
+			w = (w & 0xfff) | ((imm & 0x100000) << 11) | ((imm & 0x7fe) << 20) |
+			    ((imm & 0x800) << 9) | (imm & 0xff000);
+			U32_P(buf + i) = LE32(w);
+			conversions++;
+			i += 4;
+			continue;
+		}
+
+		if ((w & 0x7f) == 0x17 && i + 8 <= len) {
+			w2 = LE32(U32_P(buf + i + 4));
+			if (rv_auipc_pair(w, w2)) {
+				/*
+				 * The target is the upper immediate plus the sign
+				 * extended lower one. The split of any 32-bit value
+				 * into the two is unique, so this is reversible.
+				 */
+				val = (w & 0xfffff000) + (uint32_t)((int32_t)w2 >> 20);
+				if (encode)
+					val += pc;
+				else
+					val -= pc;
+				w = (w & 0xfff) | ((val + 0x800) & 0xfffff000);
+				w2 = (w2 & 0xfffff) | (val << 20);
+				U32_P(buf + i) = LE32(w);
+				U32_P(buf + i + 4) = LE32(w2);
+				conversions++;
+				i += 8;
+				continue;
+			}
+		}
+		i += 4;
+	}
+	return (conversions);
+}
+
+int
+bcj_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t conversions;
+	int arch, align;
+
+	if (srclen < BCJ_MIN_LEN)
+		return (-1);
+	arch = bcj_detect(src, srclen, &align);
+	if (arch == 0)
+		return (-1);
+
+	dst[0] = arch;
+	dst[1] = align;
+	memcpy(dst + BCJ_HDR, src, srclen);
+	if (arch == BCJ_ARM64)
+		conversions = bcj_arm64(dst + BCJ_HDR, srclen, align, 1);
+	else
+		conversions = bcj_riscv(dst + BCJ_HDR, srclen, align, 1);
+	if (conversions < BCJ_MIN_CONVERSIONS)
+		return (-1);
+
+	*dstlen = srclen + BCJ_HDR;
+	DEBUG_STAT_EN(fprintf(stderr, "BCJ: arch %d, align %d, %" PRIu64 " conversions\n",
+			      arch, align, conversions));
+	return (0);
+}
+
+int
+bcj_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t olen;
+	int arch, align;
+
+	if (srclen < BCJ_HDR) {
+		log_msg(LOG_ERR, 0, "BCJ Decode: Truncated data.\n");
+		return (-1);
+	}
+	arch = src[0];
+	align = src[1];
+	olen = srclen - BCJ_HDR;
+	if ((arch != BCJ_ARM64 && arch != BCJ_RISCV) || align > 3 ||
+	    (arch == BCJ_RISCV && align > 1)) {
+		log_msg(LOG_ERR, 0, "BCJ Decode: Invalid header. Corrupt data.\n");
+		return (-1);
+	}
+	if (*dstlen < olen) {
+		log_msg(LOG_ERR, 0, "BCJ Decode: Destination buffer too small.\n");
+		return (-1);
+	}
+
+	memcpy(dst, src + BCJ_HDR, olen);
+	if (arch == BCJ_ARM64)
+		bcj_arm64(dst, olen, align, 0);
+	else
+		bcj_riscv(dst, olen, align, 0);
+	*dstlen = olen;
+	return (0);
+}
@@ -58,6 +58,10 @@
 #include <transpose.h>
 #include "delta2.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 // Size of original data. 64 bits.
 #define	MAIN_HDR	(sizeof (uint64_t))
 
@@ -100,6 +104,293 @@ static uchar_t strides[NSTRIDES] = {2, 4, 8, 3, 5, 6, 7};
 static int delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
 		int rle_thresh, int last_encode, int *hdr_ovr, int nstrides);
 
+/*
+ * Stride detection works on a bitmap of series breaks. Bit k is set when the
+ * difference between element k and k-1 differs from the previous difference,
+ * ie. a new arithmetic series starts at element k. Elements are stride sized
+ * little-endian integers. Differences are taken in 64-bit arithmetic with the
+ * series starting from zero. The per-stride estimate and the final encoding
+ * then only visit the breaks instead of every element.
+ */
+#define	D2_MAP_WORDS	((DELTA2_CHUNK / STRIDE_MIN) / 64 + 1)
+
+static inline uint64_t
+d2_mask(int st)
+{
+	uint64_t msk;
+
+	msk = st;
+	msk = ((msk << 3) - 1);
+	msk = (1ULL << msk);
+	msk |= (msk - 1);
+	return (msk);
+}
+
+static inline uint64_t
+d2_elem(uchar_t *src, uint64_t k, int st, uint64_t msk)
+{
+	return (LE64(U64_P(src + k * st)) & msk);
+}
+
+static inline uint64_t
+d2_delta(uchar_t *src, uint64_t k, int st, uint64_t msk)
+{
+	return (d2_elem(src, k, st, msk) - (k ? d2_elem(src, k - 1, st, msk) : 0));
+}
+
+static void
+d2_breaks_scalar(uchar_t *src, uint64_t k, uint64_t nelem, int st, uint64_t msk,
+		 uint64_t *map)
+{
+	uint64_t v1, v2, d1, d2, bits;
+	uchar_t *pos;
+
+	v1 = (k > 0 ? d2_elem(src, k - 1, st, msk) : 0);
+	d1 = (k > 1 ? v1 - d2_elem(src, k - 2, st, msk) : v1);
+	pos = src + k * st;
+	bits = 0;
+	for (; k < nelem; k++) {
+		v2 = LE64(U64_P(pos)) & msk;
+		d2 = v2 - v1;
+		bits |= ((uint64_t)(d2 != d1) << (k & 63));
+		if ((k & 63) == 63) {
+			map[k >> 6] |= bits;
+			bits = 0;
+		}
+		d1 = d2;
+		v1 = v2;
+		pos += st;
+	}
+	if (k & 63)
+		map[k >> 6] |= bits;
+}
+
+#if defined(__x86_64__)
+static int d2_avx2 = 0;
+
+void
+delta2_module_init(processor_cap_t *pc)
+{
+	d2_avx2 = (pc->avx_level >= 2);
+}
+
+/*
+ * Break tests for all strides, 4 or 8 elements at a time. 16-bit and 32-bit
+ * elements are widened so that the differences are exact, as in the scalar
+ * 64-bit scalar computation. Groups start at a multiple of the group size so bits
+ * never straddle map words. Returns the next element to test.
+ */
+static __attribute__((target("avx2"))) uint64_t
+d2_breaks_avx2(uchar_t *src, uint64_t nelem, int st, uint64_t *map)
+{
+	__m256i a, b, c;
+	uint64_t k, bits;
+
+	if (st == 2) {
+		for (k = 8; k + 8 <= nelem; k += 8) {
+			a = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(src + k * 2)));
+			b = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(src + k * 2 - 2)));
+			c = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(src + k * 2 - 4)));
+			a = _mm256_cmpeq_epi32(_mm256_sub_epi32(a, b), _mm256_sub_epi32(b, c));
+			bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(a)) & 0xff;
+			map[k >> 6] |= (bits << (k & 63));
+		}
+	} else if (st == 4) {
+		for (k = 4; k + 4 <= nelem; k += 4) {
+			a = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(src + k * 4)));
+			b = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(src + k * 4 - 4)));
+			c = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(src + k * 4 - 8)));
+			a = _mm256_cmpeq_epi64(_mm256_sub_epi64(a, b), _mm256_sub_epi64(b, c));
+			bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(a)) & 0xf;
+			map[k >> 6] |= (bits << (k & 63));
+		}
+	} else if (st == 8) {
+		for (k = 4; k + 4 <= nelem; k += 4) {
+			a = _mm256_loadu_si256((__m256i *)(src + k * 8));
+			b = _mm256_loadu_si256((__m256i *)(src + k * 8 - 8));
+			c = _mm256_loadu_si256((__m256i *)(src + k * 8 - 16));
+			a = _mm256_cmpeq_epi64(_mm256_sub_epi64(a, b), _mm256_sub_epi64(b, c));
+			bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(a)) & 0xf;
+			map[k >> 6] |= (bits << (k & 63));
+		}
+	} else {
+		/*
+		 * Odd strides: each 16-byte load yields two elements, zero
+		 * extended to 64-bit lanes by a byte shuffle. Stop early
+		 * enough that the loads never go past the bytes the scalar
+		 * scan reads.
+		 */
+		__m128i shuf;
+		uchar_t sb[16];
+		int i;
+
+		for (i = 0; i < 8; i++) {
+			sb[i] = (i < st ? i : 0x80);
+			sb[i + 8] = (i < st ? i + st : 0x80);
+		}
+		shuf = _mm_loadu_si128((__m128i *)sb);
+#define	D2_PAIRS(p)	_mm256_set_m128i( \
+		_mm_shuffle_epi8(_mm_loadu_si128((__m128i *)((p) + 2 * st)), shuf), \
+		_mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p)), shuf))
+		for (k = 4; k + 4 + 8 / st <= nelem; k += 4) {
+			a = D2_PAIRS(src + k * st);
+			b = D2_PAIRS(src + k * st - st);
+			c = D2_PAIRS(src + k * st - 2 * st);
+			a = _mm256_cmpeq_epi64(_mm256_sub_epi64(a, b), _mm256_sub_epi64(b, c));
+			bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(a)) & 0xf;
+			map[k >> 6] |= (bits << (k & 63));
+		}
+#undef	D2_PAIRS
+	}
+	return (k);
+}
+
+/*
+ * Write an arithmetic series of lane sized elements. Returns the number of
+ * elements written, the caller finishes any remainder.
+ */
+static __attribute__((target("avx2"))) uint64_t
+d2_series_avx2(uchar_t *dst, uint64_t sval, uint64_t delta, uint64_t n, int st)
+{
+	__m256i v, step;
+	uint64_t k, i, grp;
+	union {
+		uint16_t w[16];
+		uint32_t d[8];
+		uint64_t q[4];
+	} init;
+
+	grp = 32 / st;
+	if (n < grp)
+		return (0);
+	for (i = 0; i < grp; i++) {
+		if (st == 2)
+			init.w[i] = (uint16_t)(sval + i * delta);
+		else if (st == 4)
+			init.d[i] = (uint32_t)(sval + i * delta);
+		else
+			init.q[i] = sval + i * delta;
+	}
+	v = _mm256_loadu_si256((__m256i *)&init);
+	if (st == 2)
+		step = _mm256_set1_epi16((short)(grp * delta));
+	else if (st == 4)
+		step = _mm256_set1_epi32((int)(grp * delta));
+	else
+		step = _mm256_set1_epi64x((long long)(grp * delta));
+
+	for (k = 0; k + grp <= n; k += grp) {
+		_mm256_storeu_si256((__m256i *)dst, v);
+		dst += 32;
+		if (st == 2)
+			v = _mm256_add_epi16(v, step);
+		else if (st == 4)
+			v = _mm256_add_epi32(v, step);
+		else
+			v = _mm256_add_epi64(v, step);
+	}
+	return (k);
+}
+#endif
+
+/*
+ * Build the break bitmap for nelem elements of the given stride. Returns the
+ * number of breaks.
+ */
+static uint64_t
+d2_breaks(uchar_t *src, uint64_t nelem, int st, uint64_t *map)
+{
+	uint64_t k, nbrk, msk;
+	int i, nw;
+
+	nw = (nelem + 63) >> 6;
+	memset(map, 0, nw * sizeof (uint64_t));
+	msk = d2_mask(st);
+	k = 0;
+#if defined(__x86_64__)
+	if (d2_avx2 && nelem >= 16) {
+		d2_breaks_scalar(src, 0, (st == 2 ? 8 : 4), st, msk, map);
+		k = d2_breaks_avx2(src, nelem, st, map);
+	}
+#endif
+	d2_breaks_scalar(src, k, nelem, st, msk, map);
+	nbrk = 0;
+	for (i = 0; i < nw; i++)
+		nbrk += __builtin_popcountll(map[i]);
+	return (nbrk);
+}
+
+/*
+ * Estimate the encoded size for a stride from its break bitmap. Spans are
+ * accounted exactly as a per-element scan would. Also returns the
+ * rescan point if the block ends into another table and the pending literal
+ * byte count.
+ */
+static uint64_t
+d2_estimate(uint64_t *map, uint64_t nelem, uint64_t nbrk, int st, int rle_thresh,
+	    uint64_t *scan, uint64_t *lit)
+{
+	uint64_t gtot2, tot, snum, prev, k, w, end;
+	int i, nw, gt;
+
+	nw = (nelem + 63) >> 6;
+	gtot2 = LIT_HDR;
+	end = nelem * st;
+	prev = 0;
+
+	if ((nelem - nbrk + 1) * st <= rle_thresh) {
+		/*
+		 * No span can exceed the threshold, everything is literal.
+		 * Only the start of the last span is needed.
+		 */
+		for (i = nw - 1; i >= 0; i--) {
+			if (map[i]) {
+				prev = (i << 6) + 63 - __builtin_clzll(map[i]);
+				break;
+			}
+		}
+		gtot2 += prev * st;
+		tot = prev * st;
+	} else {
+		tot = 0;
+		for (i = 0; i < nw; i++) {
+			w = map[i];
+			while (w) {
+				k = (i << 6) + __builtin_ctzll(w);
+				w &= (w - 1);
+				snum = (k - prev) * st;
+				if (snum > rle_thresh) {
+					gt = (tot > 0);
+					gtot2 += (LIT_HDR * gt);
+					tot = 0;
+					gtot2 += DELTA_HDR;
+				} else {
+					gtot2 += snum;
+					tot += snum;
+				}
+				prev = k;
+			}
+		}
+	}
+
+	snum = (nelem - prev) * st;
+	*lit = tot;
+	*scan = 0;
+	if (snum > rle_thresh) {
+		gtot2 += DELTA_HDR;
+		/*
+		 * If this ended into another table reset next scan
+		 * point to beginning of the table.
+		 */
+		*scan = end - snum;
+	} else {
+		gtot2 += snum;
+		if (snum >= (MIN_THRESH>>1))
+			*scan = end - snum;
+	}
+	return (gtot2);
+}
+
 /*
  * Perform Delta2 encoding of the given data buffer in src. Delta Encoding
  * processes data in blocks of 4k. After each call to delta2_encode_real()
@@ -224,76 +515,39 @@ delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen
 		   int rle_thresh, int last_encode, int *hdr_ovr, int nstrides)
 {
 	uint64_t snum, gtot1, gtot2, tot;
-	uint64_t cnt, val, sval;
-	uint64_t vl1, vl2, vld1, vld2;
+	uint64_t cnt, val, sval, vld1, nelem, nbrk, prev, k, w;
+	uint64_t maps[2][D2_MAP_WORDS], *map, *best;
 	uchar_t *pos, *pos2, stride, st1;
-	int st;
+	int st, i, nw;
 
 	assert(srclen == *dstlen);
+	assert(srclen <= DELTA2_CHUNK);
 	gtot1 = ULL_MAX;
 	stride = 0;
 	tot = 0;
+	nelem = 0;
+	map = maps[0];
+	best = maps[1];
 
 	/*
 	 * Estimate which stride length gives the max reduction given rle_thresh.
 	 */
 	for (st = 0; st < nstrides; st++) {
-		int gt;
-
-		snum = 0;
-		gtot2 = LIT_HDR;
-		vl1 = 0;
-		vld1 = 0;
-		tot = 0;
-		pos = src;
 		st1 = strides[st];
-		sval = st1;
-		sval = ((sval << 3) - 1);
-		sval = (1ULL << sval);
-		sval |= (sval - 1);
-		val = 0;
-		for (cnt = 0; cnt < (srclen - sizeof (cnt)); cnt += st1) {
-			vl2 = U64_P(pos);
-			vl2 = LE64(vl2);
-			vl2 &= sval;
-			vld2 = vl2 - vl1;
-			if (vld1 != vld2) {
-				if (snum > rle_thresh) {
-					gt = (tot > 0);
-					gtot2 += (LIT_HDR * gt);
-					tot = 0;
-					gtot2 += DELTA_HDR;
-				} else {
-					gtot2 += snum;
-					tot += snum;
-				}
-				snum = 0;
-			}
-			snum += st1;
-			vld1 = vld2;
-			vl1 = vl2;
-			pos += st1;
-		}
-		if (snum > rle_thresh) {
-			gtot2 += DELTA_HDR;
-			/*
-			 * If this ended into another table reset next scan
-			 * point to beginning of the table.
-			 */
-			val = cnt - snum;
-		} else {
-			gtot2 += snum;
-			/*
-			 * If this ended into another table reset next scan
-			 * point to beginning of the table.
-			 */
-			if (snum >= (MIN_THRESH>>1))
-				val = cnt - snum;
-		}
+		nelem = 0;
+		if (srclen > sizeof (cnt))
+			nelem = (srclen - sizeof (cnt) + st1 - 1) / st1;
+		nbrk = d2_breaks(src, nelem, st1, map);
+		gtot2 = d2_estimate(map, nelem, nbrk, st1, rle_thresh, &val, &tot);
 		if (gtot2 < gtot1) {
+			uint64_t *tmp;
+
 			gtot1 = gtot2;
 			stride = st1;
 			tot = val;
+			tmp = best;
+			best = map;
+			map = tmp;
 		}
 	}
 
@@ -310,31 +564,29 @@ delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen
 	}
 
 	/*
-	 * Now perform encoding using the stride length.
+	 * Now perform encoding using the stride length. Only the break
+	 * points of the chosen stride are visited.
 	 */
-	snum = 0;
-	vl1 = 0;
-	vld1 = 0;
+	nelem = 0;
+	if (srclen > sizeof (cnt))
+		nelem = (srclen - sizeof (cnt) + stride - 1) / stride;
+	nw = (nelem + 63) >> 6;
+	val = d2_mask(stride);
 	gtot1 = 0;
-	pos = src;
 	pos2 = dst;
-
-	vl2 = U64_P(pos);
-	vl2 = LE64(vl2);
-	val = stride;
-	val = ((val << 3) - 1);
-	val = (1ULL << val);
-	val |= (val - 1);
-	vl2 &= val;
-	sval = vl2;
-
-	for (cnt = 0; cnt < (srclen - sizeof (cnt)); cnt += stride) {
-		vl2 = U64_P(pos);
-		vl2 = LE64(vl2);
-		vl2 &= val;
-		vld2 = vl2 - vl1;
-		if (vld1 != vld2) {
+	prev = 0;
+	sval = (nelem > 0 ? d2_elem(src, 0, stride, val) : 0);
+
+	for (i = 0; i < nw; i++) {
+		w = best[i];
+		while (w) {
+			k = (i << 6) + __builtin_ctzll(w);
+			w &= (w - 1);
+			snum = (k - prev) * stride;
+			pos = src + k * stride;
 			if (snum > rle_thresh) {
+				vld1 = d2_delta(src, k - 1, stride, val);
+
 				/*
 				 * We have a series but there is some pending literal data
 				 * to be copied before the series begins. First copy that
@@ -368,14 +620,13 @@ delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen
 			} else {
 				gtot1 += snum;
 			}
-			snum = 0;
-			sval = vl2;
+			sval = d2_elem(src, k, stride, val);
+			prev = k;
 		}
-		snum += stride;
-		vld1 = vld2;
-		vl1 = vl2;
-		pos += stride;
 	}
+	snum = (nelem - prev) * stride;
+	pos = src + nelem * stride;
+	vld1 = (snum > 0 ? d2_delta(src, nelem - 1, stride, val) : 0);
 
 	/*
 	 * Encode final sequence, if any.
@@ -507,7 +758,17 @@ delta2_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
 			 * Recover original bytes from the arithmetic series using
 			 * length, starting value and delta.
 			 */
-			for (cnt = 0; cnt < rcnt/stride; cnt++) {
+			rcnt /= stride;
+#if defined(__x86_64__)
+			if (d2_avx2 && (stride == 2 || stride == 4 || stride == 8)) {
+				cnt = d2_series_avx2(pos1, sval, delta, rcnt, stride);
+				pos1 += cnt * stride;
+				out += cnt * stride;
+				sval += cnt * delta;
+				rcnt -= cnt;
+			}
+#endif
+			for (cnt = 0; cnt < rcnt; cnt++) {
 				val = (sval & vl);
 				U64_P(pos1) = LE64(val);
 				out += stride;
@@ -41,6 +41,7 @@ extern "C" {
 
 int delta2_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen, int rle_thresh, int nstrides);
 int delta2_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen);
+void delta2_module_init(processor_cap_t *pc);
 
 #define	ULL_MAX (18446744073709551615ULL)
 
@@ -69,6 +69,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <new>
 #include "DictFilter.h"
 #include "utils.h"
 #include "allocator.h"
@@ -78,6 +79,16 @@
 #define	WORD_MAX	50
 #define	LIST_LRU_NUM	15
 
+/*
+ * Buffers of at least two shards have their dictionary built in parallel.
+ * The encode pass is split into segments of at least DICT_SEGMENT_MIN bytes.
+ */
+#define	DICT_EVICT_LIMIT	2048
+#define	DICT_SHARD_SIZE		(32 * 1024 * 1024)
+#define	DICT_MAX_SHARDS		128
+#define	DICT_SEGMENT_MIN	(1024 * 1024)
+#define	DICT_MAX_THREADS	16
+
 typedef struct dict_entry {
 	unsigned char *word;
 	unsigned char sz;
@@ -104,6 +115,7 @@ typedef struct list_context_s {
 	uint32_t        listsize;
 	uint32_t        aged_entries;
 	uint32_t        aging_requests;
+	uint32_t        evict_limit;
 } list_context_t;
 
 typedef struct decode_dict_entry_s {
@@ -248,12 +260,29 @@ protected:
 	    dict_entry_t *_de);
 	dict_entry_t *hash_remove(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
 	    dict_entry_t *r_de);
+	dict_entry_t *find_word(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
+	    uint8_t lcfirst);
+	int hash_merge(hash_context_t *hctx, dict_entry_t *de);
 
 	void list_context_init(list_context_t *lctx, uint32_t listsize);
 	void list_context_delete(list_context_t *lctx);
 	dict_entry_t *list_push(list_context_t *lctx, dict_entry_t *de);
 	dict_entry_t *list_pop_lru_min(list_context_t *lctx);
 
+	uint32_t next_boundary(uint8_t *src, uint32_t size, uint32_t from);
+	int scan_words(uint8_t *src, uint32_t start, uint32_t end, hash_context_t *hctx,
+	    list_context_t *lctx, int fasta);
+	int build_dict(uint8_t *src, uint32_t size, uint32_t dictSize, hash_context_t *hctx,
+	    int fasta);
+	uint32_t select_words(hash_context_t *hctx, uint32_t size, dict_entry_t **sorted_dict,
+	    uint32_t *num_entries);
+	int64_t encode_words(uint8_t *src, uint32_t start, uint32_t end, hash_context_t *hctx,
+	    uint8_t *dst, uint32_t dstlen);
+	int64_t encode_words_fasta(uint8_t *src, uint32_t start, uint32_t end,
+	    hash_context_t *hctx, uint8_t *dst, uint32_t dstlen);
+	int64_t encode_segments(uint8_t *src, uint32_t size, hash_context_t *hctx,
+	    uint8_t *dst, uint32_t dstlen, int fasta);
+
 	uint8_t *to_base_enc(uint32_t number, uint8_t *str, int sz);
 	uint32_t from_base_enc(uint8_t *dnum, int sz);
 
@@ -464,6 +493,46 @@ DictFilter::hash_lookup(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
 	return (find_string(hctx->dict[indx], word, wordsize, lcfirst));
 }
 
+/*
+ * Lookup that does not touch the hash context, so that it can be used from
+ * several threads at once.
+ */
+dict_entry_t *
+DictFilter::find_word(hash_context_t *hctx, uint8_t *word, uint32_t wordsize, uint8_t lcfirst)
+{
+	uint32_t indx;
+
+	indx = XXH32(word+1, wordsize-1, lcfirst) % hctx->dictsize;
+	return (find_string(hctx->dict[indx], word, wordsize, lcfirst));
+}
+
+/*
+ * Add an entry from another hash. If the word is already present only its
+ * occurrence count is added and 1 is returned, so the caller can free the
+ * entry. Otherwise the entry itself is linked in.
+ */
+int
+DictFilter::hash_merge(hash_context_t *hctx, dict_entry_t *de)
+{
+	dict_entry_t *de1;
+	uint32_t indx;
+
+	indx = XXH32(de->word+1, de->sz-1, de->lcfirst) % hctx->dictsize;
+	de1 = find_string(hctx->dict[indx], de->word, de->sz, de->lcfirst);
+	if (de1) {
+		de1->occur += de->occur;
+		return (1);
+	}
+
+	de->indx = indx;
+	if (hctx->dict[indx])
+		hctx->collisions++;
+	de->next = hctx->dict[indx];
+	hctx->dict[indx] = de;
+	hctx->dictcount++;
+	return (0);
+}
+
 dict_entry_t *
 DictFilter::hash_add(hash_context_t *hctx, uint8_t *word, uint32_t wordsize, dict_entry_t *_de)
 {
@@ -556,6 +625,7 @@ DictFilter::list_context_init(list_context_t *lctx, uint32_t listsize)
 	lctx->listcount = 0;
 	lctx->listsize = listsize;
 	lctx->aged_entries = 0;
+	lctx->evict_limit = DICT_EVICT_LIMIT;
 }
 
 void
@@ -625,7 +695,7 @@ DictFilter::list_pop_lru_min(list_context_t *lctx)
 		c_de = c_de->list_next;
 	}
 
-	if (min && min->occur * min->sz < 2048) {
+	if (min && min->occur * min->sz < lctx->evict_limit) {
 		min_p->list_next = min->list_next;
 		lctx->aged_entries++;
 		lctx->listcount--;
@@ -640,78 +710,200 @@ DictFilter::list_pop_lru_min(list_context_t *lctx)
 	return (NULL);
 }
 
-int
-DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
+/*
+ * Find the first position after a word separator at or beyond the given
+ * offset. The word scanners start in the same state at such a position as
+ * at the start of the buffer, so work can be split there.
+ */
+uint32_t
+DictFilter::next_boundary(uint8_t *src, uint32_t size, uint32_t from)
 {
-	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
-	hash_context_t hctx;
-	list_context_t lctx;
-	dict_entry_t **sorted_dict;
-	uint8_t num_dict[10], *numd;
-	ssize_t new_size;
-	int rv, sz;
-
-	if (size < 1024)
-		return 0;
-
-	if (size > 20000) {
-		dictSize = size / 10000;
-		dictSize += (dictSize >> 1);
-	} else {
-		dictSize = (size >> 1);
+	while (from < size) {
+		if (SEPARATOR[src[from++]] & 1)
+			return (from);
 	}
-	dictSize++;
+	return (size);
+}
 
-	pos = 0;
-	rv = 0;
-	hash_context_init(&hctx, dictSize);
-	list_context_init(&lctx, dictSize);
-	sorted_dict = new dict_entry_t* [dictSize];
+/*
+ * Scan words in the data between start and end and add them to the
+ * dictionary. Returns 0 if a Fasta buffer contains a flag character.
+ */
+int
+DictFilter::scan_words(uint8_t *src, uint32_t start, uint32_t end, hash_context_t *hctx,
+    list_context_t *lctx, int fasta)
+{
+	uint32_t i, pos, half;
+	int j;
 
-	/*
-	 * Scan words in the data and build the dictionary.
-	 */
-	for (i=0; i<size; i++) {
+	pos = start;
+	half = start + ((end - start) >> 1);
+	j = 0;
+	for (i=start; i<end; i++) {
 		uint8_t c = src[i];
+		int is_sep, genome;
 
-		if (SEPARATOR[c] & 1) {
+		if (fasta && (c == flag || c == flag1 || c == flag2))
+			return (0);
+
+		is_sep = SEPARATOR[c] & 1;
+		if (is_sep || (fasta && j == 4)) {
 			dict_entry_t *de;
 			size_t toklen = i - pos;
 
+			if (!is_sep) {
+				unsigned char *bf = src+pos;
+
+				genome = ((SEPARATOR[bf[0]]&128) & (SEPARATOR[bf[1]]&128) &
+					  (SEPARATOR[bf[2]]&128) & (SEPARATOR[bf[3]]&128));
+				if (!genome) {
+					j = 0;
+					continue;
+				}
+			}
+
+			j = 0;
 			if (toklen < WORD_MIN || toklen > WORD_MAX) {
-				pos = i+1;
+				if (is_sep) {
+					pos = i+1;
+					j--;
+				} else {
+					pos = i;
+				}
+				j++;
 				continue;
 			}
 
-			de = hash_add(&hctx, src+pos, toklen, NULL);
-			if (!de && i > (size>>1)) {
-				de = list_pop_lru_min(&lctx);
+			de = hash_add(hctx, src+pos, toklen, NULL);
+			if (!de && i > half) {
+				de = list_pop_lru_min(lctx);
 				if (de) {
 					dict_entry_t *de1;
-					de1 = hash_remove(&hctx, de->word, de->sz, de);
+					de1 = hash_remove(hctx, de->word, de->sz, de);
 					assert(de1 == de);
-					de1 = hash_add(&hctx, src+pos, toklen, de);
+					de1 = hash_add(hctx, src+pos, toklen, de);
 					assert(de1 != NULL);
-					assert(de1 != hctx.sentinel);
-					list_push(&lctx, de1);
+					assert(de1 != hctx->sentinel);
+					list_push(lctx, de1);
 				}
-			} else if (de != hctx.sentinel) {
-				list_push(&lctx, de);
+			} else if (de != hctx->sentinel) {
+				list_push(lctx, de);
 			}
-			pos = i+1;
+			if (is_sep) {
+				pos = i+1;
+				j--;
+			} else {
+				pos = i;
+			}
+		}
+		j++;
+	}
+	return (1);
+}
+
+/*
+ * Build the word dictionary. Large buffers are scanned as shards of a fixed
+ * size, each into its own hash with the full dictionary size, in parallel.
+ * The shard hashes are then merged into one by adding up the occurrence
+ * counts. The shard layout only depends on the data, so the dictionary and
+ * hence the output does not depend on the number of threads.
+ */
+int
+DictFilter::build_dict(uint8_t *src, uint32_t size, uint32_t dictSize, hash_context_t *hctx,
+    int fasta)
+{
+	hash_context_t *shctx;
+	uint32_t bounds[DICT_MAX_SHARDS + 1];
+	int nshards, i, rv;
+
+	nshards = size / DICT_SHARD_SIZE;
+	if (nshards > DICT_MAX_SHARDS)
+		nshards = DICT_MAX_SHARDS;
+
+	if (nshards < 2) {
+		list_context_t lctx;
+
+		hash_context_init(hctx, dictSize);
+		list_context_init(&lctx, dictSize);
+		rv = scan_words(src, 0, size, hctx, &lctx, fasta);
+		list_context_delete(&lctx);
+		return (rv);
+	}
+
+	bounds[0] = 0;
+	for (i = 1; i < nshards; i++) {
+		bounds[i] = next_boundary(src, size, (uint64_t)size * i / nshards);
+		if (bounds[i] < bounds[i-1])
+			bounds[i] = bounds[i-1];
+	}
+	bounds[nshards] = size;
+
+	shctx = new hash_context_t[nshards];
+	rv = 1;
+#	pragma omp parallel for schedule(dynamic)
+	for (i = 0; i < nshards; i++) {
+		list_context_t lctx;
+
+		/*
+		 * Counts in a shard only reach a fraction of those over the whole
+		 * buffer, so the eviction limit is scaled down likewise.
+		 */
+		hash_context_init(&shctx[i], dictSize);
+		list_context_init(&lctx, dictSize);
+		lctx.evict_limit = (uint64_t)DICT_EVICT_LIMIT * (bounds[i+1] - bounds[i]) / size + 1;
+		if (!scan_words(src, bounds[i], bounds[i+1], &shctx[i], &lctx, fasta))
+			rv = 0;
+		list_context_delete(&lctx);
+	}
+
+	/*
+	 * Merge in shard order. Entries of words seen for the first time are
+	 * moved over, the rest only contribute their counts.
+	 */
+	hash_context_init(hctx, dictSize * 2);
+	for (i = 0; i < nshards; i++) {
+		uint32_t j;
+
+		for (j = 0; j < shctx[i].dictsize && rv; j++) {
+			dict_entry_t *de, *de1;
+
+			de = shctx[i].dict[j];
+			while (de) {
+				de1 = de->next;
+				if (hash_merge(hctx, de))
+					delete de;
+				de = de1;
+			}
+			shctx[i].dict[j] = NULL;
 		}
+		hash_context_delete(&shctx[i]);
 	}
+	delete[] shctx;
+	return (rv);
+}
+
+/*
+ * Flatten the hash, sort it and pick the words that are worth encoding.
+ * Returns the number of sorted entries. The chosen entries have their index
+ * set and the rest get a zero occurrence count.
+ */
+uint32_t
+DictFilter::select_words(hash_context_t *hctx, uint32_t size, dict_entry_t **sorted_dict,
+    uint32_t *num_entries)
+{
+	uint32_t i, pos;
+	ssize_t new_size;
 
 	/*
 	 * Mark below-threshold entries in the dictionary. Also sorted_dict holds a
 	 * flattened view of the hash.
 	 */
 	pos = 0;
-	for (i=0; i<dictSize; i++) {
-		if (hctx.dict[i]) {
+	for (i=0; i<hctx->dictsize; i++) {
+		if (hctx->dict[i]) {
 			dict_entry_t *de;
 
-			de = hctx.dict[i];
+			de = hctx->dict[i];
 			while (de) {
 				ssize_t val;
 
@@ -733,7 +925,7 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 	 * occurrence X word size.
 	 */
 	qsort(sorted_dict, pos, sizeof (dict_entry_t *), cmpoccur);
-	num_entries = 0;
+	*num_entries = 0;
 	new_size = size;
 
 	for (i=0; i<pos; i++) {
@@ -751,13 +943,13 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			prev_size = new_size;
 			val = (size_t)de->occur * (size_t)de->sz;
 			new_size -= val;
-			if (num_entries == 0)
+			if (*num_entries == 0)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 1);
-			else if (num_entries < NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 2);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE * NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 3);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 4);
 			else
 				new_size += ((size_t)de->sz + (size_t)de->occur * 5);
@@ -767,40 +959,28 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				continue;
 			}
 
-			de->indx = num_entries;
-			num_entries++;
+			de->indx = *num_entries;
+			(*num_entries)++;
 		} else {
 			de->occur = 0;
 		}
 	}
+	return (pos);
+}
 
-	sz = sizeof (num_dict);
-	numd = to_base_enc(num_entries, num_dict, sz);
-	dstSize = num_dict+sz-numd-1;
-	copy_bytes(dst, numd, dstSize);
-	dst[dstSize++] = ' ';
-
-	/*
-	 * Copy the dictionary to the output buffer.
-	 */
-	for (i=0; i<pos && dstSize<*dstsize; i++) {
-		dict_entry_t *de;
-
-		de = sorted_dict[i];
-		if (de->occur > 1) {
-			dst[dstSize++] = de->lcfirst;
-			if (dstSize + de->sz + 1 >= *dstsize) {
-				goto bail;
-			}
-
-			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
-			dstSize += (de->sz-1);
-			dst[dstSize++] = ' ';
-		}
-	}
+/*
+ * Encode the words between start and end. Returns the encoded length or -1
+ * if it does not fit into dstlen bytes.
+ */
+int64_t
+DictFilter::encode_words(uint8_t *src, uint32_t start, uint32_t end, hash_context_t *hctx,
+    uint8_t *dst, uint32_t dstlen)
+{
+	uint32_t dstSize = 0, i, pos;
+	int sz;
 
-	pos = 0;
-	for (i=0; i<size && dstSize<*dstsize; i++) {
+	pos = start;
+	for (i=start; i<end && dstSize<dstlen; i++) {
 		uint8_t *tok, c;
 
 		c = src[i];
@@ -813,8 +993,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				    *(src+pos) == flag2 || *(src+pos) == '\\') {
 					dst[dstSize++] = '\\';
 				}
-				if (dstSize + toklen + 1 > *dstsize) {
-					goto bail;
+				if (dstSize + toklen + 1 > dstlen) {
+					return (-1);
 				}
 				copy_bytes(&dst[dstSize], src+pos, toklen+1);
 				dstSize += (toklen+1);
@@ -823,9 +1003,9 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			}
 
 			tok = src+pos;
-			de = hash_lookup(&hctx, tok, toklen, tolower(tok[0]));
+			de = find_word(hctx, tok, toklen, tolower(tok[0]));
 			if (de != NULL && de->occur > 1) {
-				uint16_t val;
+				uint32_t val;
 				unsigned char tok_hdr[10], *dnum;
 
 				/*
@@ -842,8 +1022,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				}
 
 				val = tok_hdr+sz - dnum-1;
-				if (dstSize + val + 1 > *dstsize) {
-					goto bail;
+				if (dstSize + val + 1 > dstlen) {
+					return (-1);
 				}
 				copy_bytes(&dst[dstSize], dnum, val);
 				dstSize += val;
@@ -871,8 +1051,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 						*dnum = flag2;
 
 						val = tok_hdr+sz - dnum-1;
-						if (dstSize + val + 1 > *dstsize) {
-							goto bail;
+						if (dstSize + val + 1 > dstlen) {
+							return (-1);
 						}
 						copy_bytes(&dst[dstSize], dnum, val);
 						dstSize += val;
@@ -885,8 +1065,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 					    *(src+pos) == flag2 || *(src+pos) == '\\') {
 						dst[dstSize++] = '\\';
 					}
-					if (dstSize + toklen + 1 > *dstsize) {
-						goto bail;
+					if (dstSize + toklen + 1 > dstlen) {
+						return (-1);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen+1);
 					dstSize += (toklen+1);
@@ -895,225 +1075,28 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			pos = i+1;
 		}
 	}
-	if (pos < size) {
-		uint32_t sz = size - pos;
+	if (pos < end) {
+		uint32_t sz = end - pos;
 
-		if (dstSize + sz > *dstsize) {
-			goto bail;
+		if (dstSize + sz > dstlen) {
+			return (-1);
 		}
 		copy_bytes(&dst[dstSize], src+pos, sz);
 		dstSize += sz;
 	}
-
-	*dstsize = dstSize;
-	rv = 1;
-
-bail:
-	hash_context_delete(&hctx);
-	list_context_delete(&lctx);
-	delete sorted_dict;
-
-	return rv;
+	return (dstSize);
 }
 
-int
-DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
+int64_t
+DictFilter::encode_words_fasta(uint8_t *src, uint32_t start, uint32_t end, hash_context_t *hctx,
+    uint8_t *dst, uint32_t dstlen)
 {
-	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
-	hash_context_t hctx;
-	list_context_t lctx;
-	dict_entry_t **sorted_dict;
-	uint8_t num_dict[10], *numd;
-	ssize_t new_size;
-	int rv, sz, j;
-
-	if (size < 1024)
-		return 0;
+	uint32_t dstSize = 0, i, pos;
+	int sz, j;
 
-	if (size > 20000) {
-		dictSize = size / 10000;
-		dictSize += (dictSize >> 1);
-	} else {
-		dictSize = (size >> 1);
-	}
-	dictSize++;
-
-	pos = 0;
-	rv = 0;
+	pos = start;
 	j = 0;
-	hash_context_init(&hctx, dictSize);
-	list_context_init(&lctx, dictSize);
-	sorted_dict = new dict_entry_t* [dictSize];
-
-	/*
-	 * Scan words in the data and build the dictionary.
-	 */
-	for (i=0; i<size; i++) {
-		uint8_t c = src[i];
-		int is_sep, genome;
-
-		if (c == flag || c == flag1 || c == flag2)
-			goto bail;
-
-		is_sep = SEPARATOR[c] & 1;
-		if (is_sep || j == 4) {
-			dict_entry_t *de;
-			size_t toklen = i - pos;
-
-			if (j == 4 && !is_sep) {
-				unsigned char *bf = src+pos;
-
-				genome = ((SEPARATOR[bf[0]]&128) & (SEPARATOR[bf[1]]&128) &
-					  (SEPARATOR[bf[2]]&128) & (SEPARATOR[bf[3]]&128));
-				if (!genome) {
-					j = 0;
-					continue;
-				}
-			}
-
-			j = 0;
-			if (toklen < WORD_MIN || toklen > WORD_MAX) {
-				if (is_sep) {
-					pos = i+1;
-					j--;
-				} else {
-					pos = i;
-				}
-				j++;
-				continue;
-			}
-
-			de = hash_add(&hctx, src+pos, toklen, NULL);
-			if (!de && i > (size>>1)) {
-				de = list_pop_lru_min(&lctx);
-				if (de) {
-					dict_entry_t *de1;
-					de1 = hash_remove(&hctx, de->word, de->sz, de);
-					assert(de1 == de);
-					de1 = hash_add(&hctx, src+pos, toklen, de);
-					assert(de1 != NULL);
-					assert(de1 != hctx.sentinel);
-					list_push(&lctx, de1);
-				}
-			} else if (de != hctx.sentinel) {
-				list_push(&lctx, de);
-			}
-			if (is_sep) {
-				pos = i+1;
-				j--;
-			} else {
-				pos = i;
-			}
-		}
-		j++;
-	}
-
-	/*
-	 * Mark below-threshold entries in the dictionary. Also sorted_dict holds a
-	 * flattened view of the hash.
-	 */
-	pos = 0;
-	for (i=0; i<dictSize; i++) {
-		if (hctx.dict[i]) {
-			dict_entry_t *de;
-
-			de = hctx.dict[i];
-			while (de) {
-				ssize_t val;
-
-				val = (size_t)de->occur * (size_t)de->sz;
-				if (val <= 4500) {
-					de->occur = 0;
-					de = de->next;
-					continue;
-				}
-
-				sorted_dict[pos++] = de;
-				de = de->next;
-			}
-		}
-	}
-
-	/*
-	 * Sort the flattened view of the hash in descending order of
-	 * occurrence X word size.
-	 */
-	qsort(sorted_dict, pos, sizeof (dict_entry_t *), cmpoccur);
-	num_entries = 0;
-	new_size = size;
-
-	for (i=0; i<pos; i++) {
-		dict_entry_t *de;
-		ssize_t prev_size;
-
-		de = sorted_dict[i];
-		if (de->occur > 1) {
-			ssize_t val;
-
-			/*
-			 * Mark entries for which the encoded representation will be
-			 * larger than the original.
-			 */
-			prev_size = new_size;
-			val = (size_t)de->occur * (size_t)de->sz;
-			new_size -= val;
-			if (num_entries == 0)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 1);
-			else if (num_entries < NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 2);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 3);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 4);
-			else
-				new_size += ((size_t)de->sz + (size_t)de->occur * 5);
-			if (new_size >= prev_size) {
-				new_size = prev_size;
-				de->occur = 0;
-				continue;
-			}
-
-			de->indx = num_entries;
-			num_entries++;
-		} else {
-			de->occur = 0;
-		}
-	}
-
-	sz = sizeof (num_dict);
-	numd = to_base_enc(num_entries, num_dict, sz);
-	dstSize = num_dict+sz-numd-1;
-	copy_bytes(dst, numd, dstSize);
-	dst[dstSize++] = ' ';
-
-	// Copy the flags
-	dst[dstSize++] = flag;
-	dst[dstSize++] = flag1;
-	dst[dstSize++] = flag2;
-	dst[dstSize++] = ' ';
-
-	/*
-	 * Copy the dictionary to the output buffer.
-	 */
-	for (i=0; i<pos && dstSize<*dstsize; i++) {
-		dict_entry_t *de;
-
-		de = sorted_dict[i];
-		if (de->occur > 1) {
-			dst[dstSize++] = de->lcfirst;
-			if (dstSize + de->sz + 1 >= *dstsize) {
-				goto bail;
-			}
-
-			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
-			dstSize += (de->sz-1);
-			dst[dstSize++] = ' ';
-		}
-	}
-
-	pos = 0;
-	j = 0;
-	for (i=0; i<size && dstSize<*dstsize; i++) {
+	for (i=start; i<end && dstSize<dstlen; i++) {
 		uint8_t *tok, c;
 		int is_sep, genome;
 
@@ -1137,16 +1120,16 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 			j = 0;
 			if (toklen < WORD_MIN || toklen > WORD_MAX) {
 				if (is_sep) {
-					if (dstSize + toklen + 1 > *dstsize) {
-						goto bail;
+					if (dstSize + toklen + 1 > dstlen) {
+						return (-1);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen+1);
 					dstSize += (toklen+1);
 					pos = i+1;
 					j--;
 				} else {
-					if (dstSize + toklen > *dstsize) {
-						goto bail;
+					if (dstSize + toklen > dstlen) {
+						return (-1);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen);
 					dstSize += toklen;
@@ -1157,9 +1140,9 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 			}
 
 			tok = src+pos;
-			de = hash_lookup(&hctx, tok, toklen, tolower(tok[0]));
+			de = find_word(hctx, tok, toklen, tolower(tok[0]));
 			if (de != NULL && de->occur > 1) {
-				uint16_t val;
+				uint32_t val;
 				unsigned char tok_hdr[10], *dnum;
 
 				/*
@@ -1177,8 +1160,8 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 
 				val = tok_hdr+sz - dnum-1;
 
-				if (dstSize + val + 1 > *dstsize) {
-					goto bail;
+				if (dstSize + val + 1 > dstlen) {
+					return (-1);
 				}
 				copy_bytes(&dst[dstSize], dnum, val);
 				dstSize += val;
@@ -1189,14 +1172,14 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 				}
 			} else {
 				if (is_sep) {
-					if (dstSize + toklen + 1 > *dstsize) {
-						goto bail;
+					if (dstSize + toklen + 1 > dstlen) {
+						return (-1);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen+1);
 					dstSize += (toklen+1);
 				} else {
-					if (dstSize + toklen > *dstsize) {
-						goto bail;
+					if (dstSize + toklen > dstlen) {
+						return (-1);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen);
 					dstSize += toklen;
@@ -1211,22 +1194,234 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 		}
 		j++;
 	}
-	if (pos < size) {
-		uint32_t sz = size - pos;
+	if (pos < end) {
+		uint32_t sz = end - pos;
 
-		if (dstSize + sz > *dstsize) {
-			goto bail;
+		if (dstSize + sz > dstlen) {
+			return (-1);
 		}
 		copy_bytes(&dst[dstSize], src+pos, sz);
 		dstSize += sz;
 	}
+	return (dstSize);
+}
+
+/*
+ * Encode the data after the dictionary. Large buffers are split into one
+ * segment per available thread at word boundaries. The first segment is
+ * encoded in place and the others into a scratch buffer limited to their
+ * input size, then moved in order. A segment that did not fit is redone in
+ * place with the space that is actually left, so the result is the same as
+ * a serial encode.
+ */
+int64_t
+DictFilter::encode_segments(uint8_t *src, uint32_t size, hash_context_t *hctx,
+    uint8_t *dst, uint32_t dstlen, int fasta)
+{
+	uint32_t bounds[DICT_MAX_THREADS + 1];
+	int64_t enclen[DICT_MAX_THREADS];
+	int64_t dstSize;
+	uint8_t *scratch;
+	int nseg, i;
+
+	nseg = get_chunk_threads();
+	if (nseg > DICT_MAX_THREADS)
+		nseg = DICT_MAX_THREADS;
+	if (nseg > (int)(size / DICT_SEGMENT_MIN))
+		nseg = size / DICT_SEGMENT_MIN;
+
+	scratch = NULL;
+	if (nseg > 1) {
+		bounds[0] = 0;
+		for (i = 1; i < nseg; i++) {
+			bounds[i] = next_boundary(src, size, (uint64_t)size * i / nseg);
+			if (bounds[i] < bounds[i-1])
+				bounds[i] = bounds[i-1];
+		}
+		bounds[nseg] = size;
+		scratch = new (std::nothrow) uint8_t[size - bounds[1] + 1];
+	}
+	if (!scratch) {
+		if (fasta)
+			return (encode_words_fasta(src, 0, size, hctx, dst, dstlen));
+		return (encode_words(src, 0, size, hctx, dst, dstlen));
+	}
+
+#	pragma omp parallel for num_threads(nseg) schedule(static, 1)
+	for (i = 0; i < nseg; i++) {
+		uint8_t *out;
+		uint32_t outlen;
+
+		if (i == 0) {
+			out = dst;
+			outlen = dstlen;
+		} else {
+			out = scratch + (bounds[i] - bounds[1]);
+			outlen = bounds[i+1] - bounds[i];
+		}
+		if (fasta)
+			enclen[i] = encode_words_fasta(src, bounds[i], bounds[i+1], hctx, out, outlen);
+		else
+			enclen[i] = encode_words(src, bounds[i], bounds[i+1], hctx, out, outlen);
+	}
+
+	dstSize = enclen[0];
+	for (i = 1; i < nseg && dstSize >= 0; i++) {
+		if (enclen[i] >= 0 && dstSize + enclen[i] <= dstlen) {
+			memcpy(dst + dstSize, scratch + (bounds[i] - bounds[1]), enclen[i]);
+		} else if (fasta) {
+			enclen[i] = encode_words_fasta(src, bounds[i], bounds[i+1], hctx,
+			    dst + dstSize, dstlen - dstSize);
+		} else {
+			enclen[i] = encode_words(src, bounds[i], bounds[i+1], hctx,
+			    dst + dstSize, dstlen - dstSize);
+		}
+		if (enclen[i] < 0)
+			dstSize = -1;
+		else
+			dstSize += enclen[i];
+	}
+	delete[] scratch;
+	return (dstSize);
+}
+
+int
+DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
+{
+	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
+	hash_context_t hctx;
+	dict_entry_t **sorted_dict;
+	uint8_t num_dict[10], *numd;
+	int64_t enclen;
+	int rv, sz;
+
+	if (size < 1024)
+		return 0;
+
+	if (size > 20000) {
+		dictSize = size / 10000;
+		dictSize += (dictSize >> 1);
+	} else {
+		dictSize = (size >> 1);
+	}
+	dictSize++;
+
+	rv = 0;
+	build_dict(src, size, dictSize, &hctx, 0);
+	sorted_dict = new dict_entry_t* [hctx.dictcount + 1];
+	pos = select_words(&hctx, size, sorted_dict, &num_entries);
+
+	sz = sizeof (num_dict);
+	numd = to_base_enc(num_entries, num_dict, sz);
+	dstSize = num_dict+sz-numd-1;
+	copy_bytes(dst, numd, dstSize);
+	dst[dstSize++] = ' ';
+
+	/*
+	 * Copy the dictionary to the output buffer.
+	 */
+	for (i=0; i<pos && dstSize<*dstsize; i++) {
+		dict_entry_t *de;
+
+		de = sorted_dict[i];
+		if (de->occur > 1) {
+			dst[dstSize++] = de->lcfirst;
+			if (dstSize + de->sz + 1 >= *dstsize) {
+				goto bail;
+			}
+
+			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
+			dstSize += (de->sz-1);
+			dst[dstSize++] = ' ';
+		}
+	}
+	if (dstSize >= *dstsize)
+		goto bail;
+
+	enclen = encode_segments(src, size, &hctx, dst + dstSize, *dstsize - dstSize, 0);
+	if (enclen < 0)
+		goto bail;
+
+	*dstsize = dstSize + enclen;
+	rv = 1;
+
+bail:
+	hash_context_delete(&hctx);
+	delete sorted_dict;
+
+	return rv;
+}
+
+int
+DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
+{
+	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
+	hash_context_t hctx;
+	dict_entry_t **sorted_dict;
+	uint8_t num_dict[10], *numd;
+	int64_t enclen;
+	int rv, sz;
+
+	if (size < 1024)
+		return 0;
+
+	if (size > 20000) {
+		dictSize = size / 10000;
+		dictSize += (dictSize >> 1);
+	} else {
+		dictSize = (size >> 1);
+	}
+	dictSize++;
+
+	rv = 0;
+	sorted_dict = NULL;
+	if (!build_dict(src, size, dictSize, &hctx, 1))
+		goto bail;
+	sorted_dict = new dict_entry_t* [hctx.dictcount + 1];
+	pos = select_words(&hctx, size, sorted_dict, &num_entries);
+
+	sz = sizeof (num_dict);
+	numd = to_base_enc(num_entries, num_dict, sz);
+	dstSize = num_dict+sz-numd-1;
+	copy_bytes(dst, numd, dstSize);
+	dst[dstSize++] = ' ';
+
+	// Copy the flags
+	dst[dstSize++] = flag;
+	dst[dstSize++] = flag1;
+	dst[dstSize++] = flag2;
+	dst[dstSize++] = ' ';
+
+	/*
+	 * Copy the dictionary to the output buffer.
+	 */
+	for (i=0; i<pos && dstSize<*dstsize; i++) {
+		dict_entry_t *de;
+
+		de = sorted_dict[i];
+		if (de->occur > 1) {
+			dst[dstSize++] = de->lcfirst;
+			if (dstSize + de->sz + 1 >= *dstsize) {
+				goto bail;
+			}
+
+			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
+			dstSize += (de->sz-1);
+			dst[dstSize++] = ' ';
+		}
+	}
+	if (dstSize >= *dstsize)
+		goto bail;
+
+	enclen = encode_segments(src, size, &hctx, dst + dstSize, *dstsize - dstSize, 1);
+	if (enclen < 0)
+		goto bail;
 
-	*dstsize = dstSize;
+	*dstsize = dstSize + enclen;
 	rv = 1;
 
 bail:
 	hash_context_delete(&hctx);
-	list_context_delete(&lctx);
 	delete sorted_dict;
 
 	return rv;
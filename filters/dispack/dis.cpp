@@ -25,6 +25,9 @@
 #include "types.hpp"
 #include "dis.hpp"
 #include <utils.h>
+#ifdef __USE_SSE_INTRIN__
+#include <emmintrin.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -947,7 +950,73 @@ extern "C" {
  *    to the presumed address results in a zero result. This avoids a bunch of
  *    false positives.
  * 2) Store transformed values in big-endian format. This improves compression.
+ *
+ * Candidate opcodes are located 16 positions at a time using SIMD compare and
+ * movemask. A position qualifies if the opcode byte is E8/E9 and the high byte
+ * of the displacement is 0x00 or 0xFF. Only the qualifying positions are then
+ * touched by scalar code. A conversion rewrites the 3 bytes following the
+ * opcode which may change the outcome for the neighbouring positions, so the
+ * mask is discarded and recomputed after every conversion. This keeps output
+ * identical to a plain byte-by-byte scan.
  */
+#ifdef	__USE_SSE_INTRIN__
+static inline uint32_t
+e89_scan_mask(uint8_t *p)
+{
+	__m128i op, hi, m;
+
+	op = _mm_loadu_si128((__m128i *)p);
+	hi = _mm_loadu_si128((__m128i *)(p + 4));
+	op = _mm_cmpeq_epi8(_mm_and_si128(op, _mm_set1_epi8((char)0xfe)),
+	    _mm_set1_epi8((char)0xe8));
+	hi = _mm_or_si128(_mm_cmpeq_epi8(hi, _mm_setzero_si128()),
+	    _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)0xff)));
+	m = _mm_and_si128(op, hi);
+	return (_mm_movemask_epi8(m));
+}
+#endif
+
+#define	E89_CANDIDATE(src, i) ((src[i] & 0xfe) == 0xe8 && \
+	    (src[i+4] == 0 || src[i+4] == 0xff))
+
+static inline int
+e89_forward_at(uint8_t *src, uint32_t i)
+{
+	uint32_t off;
+
+	off = (src[i+1] | (src[i+2] << 8) | (src[i+3] << 16));
+	if (off > 0) {
+		off += i;
+		off &= 0xffffff;
+		if (off > 0) {
+			src[i+1] = (uint8_t)(off >> 16);
+			src[i+2] = (uint8_t)(off >> 8);
+			src[i+3] = (uint8_t)off;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static inline int
+e89_inverse_at(uint8_t *src, uint32_t i)
+{
+	uint32_t val;
+
+	val = (src[i+3] | (src[i+2] << 8) | (src[i+1] << 16));
+	if (val > 0) {
+		val -= i;
+		val &= 0xffffff;
+		if (val > 0) {
+			src[i+1] = (uint8_t)val;
+			src[i+2] = (uint8_t)(val >> 8);
+			src[i+3] = (uint8_t)(val >> 16);
+			return (1);
+		}
+	}
+	return (0);
+}
+
 int
 Forward_E89(uint8_t *src, uint64_t sz)
 {
@@ -961,24 +1030,34 @@ Forward_E89(uint8_t *src, uint64_t sz)
 	size = sz;
 	i = 0;
 	conversions = 0;
-	while (i < size-4) {
-		if ((src[i] & 0xfe) == 0xe8 &&
-		    (src[i+4] == 0 || src[i+4] == 0xff))
-		{
-			uint32_t off;
-
-			off = (src[i+1] | (src[i+2] << 8) | (src[i+3] << 16));
-			if (off > 0) {
-				off += i;
-				off &= 0xffffff;
-				if (off > 0) {
-					src[i+1] = (uint8_t)(off >> 16);
-					src[i+2] = (uint8_t)(off >> 8);
-					src[i+3] = (uint8_t)off;
-					conversions++;
-				}
+#ifdef	__USE_SSE_INTRIN__
+	while (i + 20 <= size) {
+		uint32_t mask, next;
+
+		mask = e89_scan_mask(src + i);
+		next = i + 16;
+
+		/*
+		 * Walk the hits in this window till the first conversion. Bytes
+		 * after a converted opcode have changed, so rescan from there.
+		 */
+		while (mask) {
+			uint32_t pos = i + __builtin_ctz(mask);
+
+			mask &= mask - 1;
+			if (e89_forward_at(src, pos)) {
+				conversions++;
+				next = pos + 1;
+				break;
 			}
 		}
+		i = next;
+	}
+#endif
+	while (i < size-4) {
+		if (E89_CANDIDATE(src, i)) {
+			conversions += e89_forward_at(src, i);
+		}
 		i++;
 	}
 	if (conversions < 5)
@@ -997,24 +1076,36 @@ Inverse_E89(uint8_t *src, uint64_t sz)
 	}
 
 	size = sz;
-	i = size-5;;
-	while (i > 0) {
-		if ((src[i] & 0xfe) == 0xe8 &&
-		    (src[i+4] == 0 || src[i+4] == 0xff))
-		{
-			uint32_t val;
-
-			val = (src[i+3] | (src[i+2] << 8) | (src[i+1] << 16));
-			if (val > 0) {
-				val -= i;
-				val &= 0xffffff;
-				if (val > 0) {
-					src[i+1] = (uint8_t)val;
-					src[i+2] = (uint8_t)(val >> 8);
-					src[i+3] = (uint8_t)(val >> 16);
-				}
+	i = size-5;
+#ifdef	__USE_SSE_INTRIN__
+	/*
+	 * Scan backwards in 16-byte windows ending at i. Inverting an opcode
+	 * at a position only affects the candidacy of the positions before it,
+	 * which are not yet visited, via their displacement high byte. So
+	 * rescan below every hit that was actually changed.
+	 */
+	while (sz >= 25 && i >= 16) {
+		uint32_t mask, base, next;
+
+		base = i - 15;
+		mask = e89_scan_mask(src + base);
+		next = i - 16;
+		while (mask) {
+			uint32_t bit = 31 - __builtin_clz(mask);
+
+			mask &= ~(1U << bit);
+			if (e89_inverse_at(src, base + bit)) {
+				next = base + bit - 1;
+				break;
 			}
 		}
+		i = next;
+	}
+#endif
+	while (i > 0) {
+		if (E89_CANDIDATE(src, i)) {
+			e89_inverse_at(src, i);
+		}
 		i--;
 	}
 	return (0);
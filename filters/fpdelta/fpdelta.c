@@ -0,0 +1,285 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+
+/*
+ * Floating point array filter. Simulation outputs and other scientific data
+ * are mostly arrays of IEEE 754 float or double values. The sign, exponent
+ * and top mantissa bits of neighbouring values are usually the same while
+ * the low mantissa bits are close to noise, so codecs find little to work
+ * with when values are stored one after the other.
+ *
+ * The filter detects the value width (4 or 8 bytes), the offset of the
+ * first value and the record length in values, for arrays of small structs
+ * like xyz coordinates. It splits the values into byte planes with
+ * transpose() and XORs every byte with the byte of the same field in the
+ * previous record, in the same plane. Planes holding the exponent turn into
+ * long runs of zeroes and the noisy mantissa planes no longer break them up.
+ *
+ * Encoded format:
+ * Byte 0: Value width in bytes (4 or 8)
+ * Byte 1: Offset of the first value
+ * Byte 2: Record length in values
+ * Offset bytes of leading data, unmodified.
+ * Width byte planes of n bytes each, n being the number of whole values.
+ * Leftover trailing bytes, unmodified.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+#include <transpose.h>
+#include "fpdelta.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Detection looks at FP_WINDOWS windows of FP_WINDOW_VALS values spread
+ * over the buffer. Almost all sampled values must look like floats with
+ * exponents in a sane range around the bias (or be zero) and XOR with the
+ * previous value must clear a good share of the high-order bytes.
+ */
+#define	FP_WINDOWS		8
+#define	FP_WINDOW_VALS		512
+#define	FP_PLAUSIBLE_PCT	90
+#define	FP_MIN_ZERO_PCT		20
+#define	FP_MAX_DIST		4
+
+static int
+fp_plausible(uint64_t v, int w)
+{
+	int e;
+
+	if (w == 8) {
+		if ((v << 1) == 0)
+			return (1);
+		e = (v >> 52) & 0x7ff;
+		return (e > 1023 - 300 && e < 1023 + 300);
+	}
+	v &= 0xffffffffULL;
+	if ((v & 0x7fffffffULL) == 0)
+		return (1);
+	e = (v >> 23) & 0xff;
+	return (e > 127 - 64 && e < 127 + 64);
+}
+
+/*
+ * Number of high-order zero bytes in a w-byte value.
+ */
+static int
+fp_zero_bytes(uint64_t x, int w)
+{
+	if (x == 0)
+		return (w);
+	return ((__builtin_clzll(x) - (64 - w * 8)) >> 3);
+}
+
+/*
+ * Find the value width, offset and record length that look like a float
+ * array. Returns the width or -1 if the data does not look like one.
+ */
+static int
+fp_detect(uchar_t *src, uint64_t srclen, int *offset, int *distance)
+{
+	uint64_t n, start, i, nv, plaus, zb[FP_MAX_DIST + 1], v, msk;
+	uint64_t best_n, best_d;
+	int w, off, win, best, d;
+
+	best = -1;
+	best_n = 0;
+	best_d = 1;
+	for (w = 8; w >= 4; w -= 4) {
+		msk = (w == 8 ? ~0ULL : 0xffffffffULL);
+		for (off = 0; off < w; off++) {
+			n = (srclen - off) / w;
+			nv = 0;
+			plaus = 0;
+			memset(zb, 0, sizeof (zb));
+			for (win = 0; win < FP_WINDOWS; win++) {
+				start = n / FP_WINDOWS * win + FP_MAX_DIST;
+				for (i = start; i < start + FP_WINDOW_VALS && i + 1 < n; i++) {
+					v = LE64(U64_P(src + off + i * w)) & msk;
+					plaus += fp_plausible(v, w);
+					for (d = 1; d <= FP_MAX_DIST; d++) {
+						zb[d] += fp_zero_bytes(v ^ (LE64(U64_P(src + off +
+						    (i - d) * w)) & msk), w);
+					}
+					nv++;
+				}
+			}
+			if (nv == 0 || plaus * 100 < nv * FP_PLAUSIBLE_PCT)
+				continue;
+
+			/*
+			 * Keep the candidate that clears the largest share of bytes.
+			 */
+			for (d = 1; d <= FP_MAX_DIST; d++) {
+				if (zb[d] * 100 < nv * w * FP_MIN_ZERO_PCT)
+					continue;
+				if (zb[d] * best_d > best_n * nv * w) {
+					best_n = zb[d];
+					best_d = nv * w;
+					best = w;
+					*offset = off;
+					*distance = d;
+				}
+			}
+		}
+	}
+	return (best);
+}
+
+#if defined(__x86_64__)
+/*
+ * AVX2 part of fp_xor_plane(). Returns how far down it got.
+ */
+static __attribute__((target("avx2"))) uint64_t
+fp_xor_plane_avx2(uchar_t *p, uint64_t i, int d)
+{
+	while (i >= 32 + d) {
+		__m256i x, y;
+
+		i -= 32;
+		x = _mm256_loadu_si256((__m256i *)(p + i));
+		y = _mm256_loadu_si256((__m256i *)(p + i - d));
+		_mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(x, y));
+	}
+	return (i);
+}
+
+static int fp_avx2 = 0;
+
+void
+fpdelta_module_init(processor_cap_t *pc)
+{
+	fp_avx2 = (pc->avx_level >= 2);
+}
+#endif
+
+/*
+ * XOR every byte of a plane with the one d bytes before it. Runs backwards
+ * so that it can be done in place.
+ */
+static void
+fp_xor_plane(uchar_t *p, uint64_t n, int d)
+{
+	uint64_t i;
+
+	i = n;
+#if defined(__x86_64__)
+	if (fp_avx2)
+		i = fp_xor_plane_avx2(p, i, d);
+	while (i >= 16 + d) {
+		__m128i x, y;
+
+		i -= 16;
+		x = _mm_loadu_si128((__m128i *)(p + i));
+		y = _mm_loadu_si128((__m128i *)(p + i - d));
+		_mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(x, y));
+	}
+#endif
+	while (i > d) {
+		i--;
+		p[i] ^= p[i - d];
+	}
+}
+
+int
+fpdelta_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t n, rem;
+	uchar_t *planes;
+	int w, off, d, i;
+
+	if (srclen < FPDELTA_MIN_LEN)
+		return (-1);
+	w = fp_detect(src, srclen, &off, &d);
+	if (w == -1)
+		return (-1);
+
+	n = (srclen - off) / w;
+	rem = srclen - off - n * w;
+	dst[0] = w;
+	dst[1] = off;
+	dst[2] = d;
+	memcpy(dst + FPDELTA_HDR, src, off);
+	planes = dst + FPDELTA_HDR + off;
+	transpose(src + off, planes, n * w, w, ROW);
+	for (i = 0; i < w; i++)
+		fp_xor_plane(planes + i * n, n, d);
+	memcpy(planes + n * w, src + off + n * w, rem);
+	*dstlen = srclen + FPDELTA_HDR;
+	DEBUG_STAT_EN(fprintf(stderr, "FPDELTA: width %d, offset %d, record %d\n",
+			      w, off, d));
+	return (0);
+}
+
+int
+fpdelta_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t n, rem, olen, i;
+	uchar_t *planes, *pos;
+	int w, off, d;
+
+	if (srclen < FPDELTA_HDR) {
+		log_msg(LOG_ERR, 0, "FPDELTA Decode: Truncated data.\n");
+		return (-1);
+	}
+	w = src[0];
+	off = src[1];
+	d = src[2];
+	olen = srclen - FPDELTA_HDR;
+	if ((w != 4 && w != 8) || off >= w || d < 1 || d > FP_MAX_DIST || olen < off) {
+		log_msg(LOG_ERR, 0, "FPDELTA Decode: Invalid header. Corrupt data.\n");
+		return (-1);
+	}
+	if (*dstlen < olen) {
+		log_msg(LOG_ERR, 0, "FPDELTA Decode: Destination buffer too small.\n");
+		return (-1);
+	}
+
+	n = (olen - off) / w;
+	rem = olen - off - n * w;
+	planes = src + FPDELTA_HDR + off;
+	memcpy(dst, src + FPDELTA_HDR, off);
+	transpose(planes, dst + off, n * w, w, COL);
+
+	/*
+	 * Undo the XOR on whole values, it is bytewise so the plane order
+	 * does not matter.
+	 */
+	pos = dst + off;
+	if (w == 8) {
+		for (i = d; i < n; i++)
+			U64_P(pos + i * 8) ^= U64_P(pos + (i - d) * 8);
+	} else {
+		for (i = d; i < n; i++)
+			U32_P(pos + i * 4) ^= U32_P(pos + (i - d) * 4);
+	}
+	memcpy(pos + n * w, planes + n * w, rem);
+	*dstlen = olen;
+	return (0);
+}
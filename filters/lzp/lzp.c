@@ -59,9 +59,12 @@ See also the bsc and libbsc web site:
 --*/
 
 /*
- *  TODO: Port the parallel implementation.
+ * Blocks are compressed in parallel with OpenMP when the caller asks for it
+ * and has set more than one thread for itself.
  */
-#undef LZP_OPENMP
+#ifdef _OPENMP
+#define	LZP_OPENMP
+#endif
 
 #ifndef __STDC_FORMAT_MACROS
 #define	__STDC_FORMAT_MACROS	1
@@ -73,12 +76,40 @@ See also the bsc and libbsc web site:
 #include <allocator.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <utils.h>
+#ifdef LZP_OPENMP
+#include <omp.h>
+#endif
 
 #include "lzp.h"
+#ifdef __USE_SSE_INTRIN__
+#include <emmintrin.h>
+#endif
 
 #define LZP_MATCH_FLAG 	0xf2
 
+/*
+ * Newer streams set this bit in the block count byte and store the hash
+ * size in the following byte, since the encoder picks it based on the L2
+ * cache size of the host. Older streams have just the block count and use
+ * the level-based hash size.
+ */
+#define	LZP_HDR_HASHSIZE	0x80
+#define	LZP_HDR_LEN		2
+#define	LZP_MIN_HASHSIZE	10
+#define	LZP_MAX_HASHSIZE	26
+
+/*
+ * The table slot for the context this many bytes ahead is prefetched so that
+ * the lookup does not stall on a cache miss. The context of a position is
+ * simply the four preceding bytes, so it can be computed without running
+ * the encoder forward.
+ */
+#define	LZP_PREFETCH_DIST	16
+#define	LZP_HASH(c)		(((c) >> 15) ^ (c) ^ ((c) >> 3))
+#define	LZP_CONTEXT(p)		ntohl(*(unsigned int *)((p) - 4))
+
 static
 inline int bsc_lzp_num_blocks(int64_t n)
 {
@@ -103,7 +134,7 @@ int bsc_lzp_encode_block(const unsigned char * input, const unsigned char * inpu
         return LZP_NOT_COMPRESSIBLE;
     }
 
-    lookup = (int *)slab_calloc(NULL, (int)(1 << hashSize), sizeof(int));
+    lookup = (int *)slab_tmp_calloc(NULL, (int)(1 << hashSize), sizeof(int));
     if (lookup)
     {
         unsigned int            mask        = (int)(1 << hashSize) - 1;
@@ -119,9 +150,13 @@ int bsc_lzp_encode_block(const unsigned char * input, const unsigned char * inpu
 
         const unsigned char * heuristic      = input;
         const unsigned char * inputMinLenEnd = inputEnd - minLen - 8;
+        int                   prefetchDist   = (minLen + 8 >= LZP_PREFETCH_DIST) ? LZP_PREFETCH_DIST : 4;
         while ((input < inputMinLenEnd) && (output < outputEOB))
         {
-            unsigned int index = ((context >> 15) ^ context ^ (context >> 3)) & mask;
+            unsigned int ahead = LZP_CONTEXT(input + prefetchDist);
+            PREFETCH_WRITE(&lookup[LZP_HASH(ahead) & mask], 3);
+
+            unsigned int index = LZP_HASH(context) & mask;
             int value = lookup[index]; lookup[index] = (int)(input - inputStart);
             if (value > 0)
             {
@@ -133,11 +168,34 @@ int bsc_lzp_encode_block(const unsigned char * input, const unsigned char * inpu
                         goto LZP_MATCH_NOT_FOUND;
                     }
 
+                    /*
+                     * Compare 16 or 8 bytes at a time. The length is still
+                     * rounded down to the first mismatching 4-byte word and
+                     * bounded the same way as the 4-byte loop, so the output
+                     * does not change.
+                     */
                     int len = 4;
+#ifdef __USE_SSE_INTRIN__
+                    for (; input + len + 12 < inputMinLenEnd; len += 16)
+                    {
+                        __m128i a = _mm_loadu_si128((const __m128i *)(input + len));
+                        __m128i b = _mm_loadu_si128((const __m128i *)(reference + len));
+                        unsigned int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+                        if (diff) { len += __builtin_ctz(diff) & ~3; goto LZP_MATCH_END; }
+                    }
+#endif
+#ifndef WORDS_BIGENDIAN
+                    for (; input + len + 4 < inputMinLenEnd; len += 8)
+                    {
+                        uint64_t diff = *(uint64_t *)(input + len) ^ *(uint64_t *)(reference + len);
+                        if (diff) { len += (__builtin_ctzll(diff) >> 3) & ~3; goto LZP_MATCH_END; }
+                    }
+#endif
                     for (; input + len < inputMinLenEnd; len += 4)
                     {
                         if (*(unsigned int *)(input + len) != *(unsigned int *)(reference + len)) break;
                     }
+LZP_MATCH_END:
                     if (len < minLen)
                     {
                         if (heuristic < input + len) heuristic = input + len;
@@ -172,7 +230,7 @@ LZP_MATCH_NOT_FOUND:
 
         while ((input < inputEnd) && (output < outputEOB))
         {
-            unsigned int index = ((context >> 15) ^ context ^ (context >> 3)) & mask;
+            unsigned int index = LZP_HASH(context) & mask;
             int value = lookup[index]; lookup[index] = (int)(input - inputStart);
             if (value > 0)
             {
@@ -202,7 +260,7 @@ int bsc_lzp_decode_block(const unsigned char * input, const unsigned char * inpu
         return LZP_UNEXPECTED_EOB;
     }
 
-    lookup = (int *)slab_calloc(NULL, (int)(1 << hashSize), sizeof(int));
+    lookup = (int *)slab_tmp_calloc(NULL, (int)(1 << hashSize), sizeof(int));
     if (lookup)
     {
         unsigned int            mask        = (int)(1 << hashSize) - 1;
@@ -216,7 +274,7 @@ int bsc_lzp_decode_block(const unsigned char * input, const unsigned char * inpu
 
         while (input < inputEnd)
         {
-            unsigned int index = ((context >> 15) ^ context ^ (context >> 3)) & mask;
+            unsigned int index = LZP_HASH(context) & mask;
             int value = lookup[index]; lookup[index] = (int)(output - outputStart);
             if (*input == LZP_MATCH_FLAG && value > 0)
             {
@@ -268,8 +326,8 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
 {
     if (bsc_lzp_num_blocks(n) == 1)
     {
-        int result = bsc_lzp_encode_block(input, input + n, output + 1, output + n - 1, hashSize, minLen);
-        if (result >= LZP_NO_ERROR) result = (output[0] = 1, result + 1);
+        int result = bsc_lzp_encode_block(input, input + n, output + LZP_HDR_LEN, output + n - LZP_HDR_LEN, hashSize, minLen);
+        if (result >= LZP_NO_ERROR) result = (output[0] = LZP_HDR_HASHSIZE | 1, output[1] = hashSize, result + LZP_HDR_LEN);
 
         return result;
     }
@@ -277,7 +335,7 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
     int nBlocks   = bsc_lzp_num_blocks(n);
     int chunkSize;
     int blockId;
-    int64_t outputPtr = 1 + 8 * nBlocks;
+    int64_t outputPtr = LZP_HDR_LEN + 8 * nBlocks;
     DEBUG_STAT_EN(double strt, en);
 
     DEBUG_STAT_EN(strt = get_wtime_millis());
@@ -286,7 +344,7 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
     else
         chunkSize = n / nBlocks;
 
-    output[0] = nBlocks;
+    output[0] = LZP_HDR_HASHSIZE | nBlocks; output[1] = hashSize;
     for (blockId = 0; blockId < nBlocks; ++blockId)
     {
         int64_t inputStart  = blockId * chunkSize;
@@ -300,8 +358,8 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
             result = inputSize; memcpy(output + outputPtr, input + inputStart, inputSize);
         }
 
-        *(int *)(output + 1 + 8 * blockId + 0) = inputSize;
-        *(int *)(output + 1 + 8 * blockId + 4) = result;
+        *(int *)(output + LZP_HDR_LEN + 8 * blockId + 0) = inputSize;
+        *(int *)(output + LZP_HDR_LEN + 8 * blockId + 4) = result;
 
         outputPtr += result;
     }
@@ -314,92 +372,104 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
 
 #ifdef LZP_OPENMP
 
+/*
+ * Encode the blocks in parallel into a scratch buffer, then lay them out in
+ * order with the same space limits as bsc_lzp_compress_serial() so that the
+ * output does not depend on the thread count.
+ */
 static
-int bsc_lzp_compress_parallel(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen)
+int64_t bsc_lzp_compress_parallel(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen)
 {
-    if (unsigned char * buffer = (unsigned char *)bsc_malloc(n * sizeof(unsigned char)))
-    {
-        int compressionResult[ALPHABET_SIZE];
-
-        int nBlocks   = bsc_lzp_num_blocks(n);
-        int result    = LZP_NO_ERROR;
-        int chunkSize = n / nBlocks;
+    int compressionResult[ALPHABET_SIZE];
+    int nBlocks   = bsc_lzp_num_blocks(n);
+    int numThreads, blockId;
+    int64_t chunkSize, outputPtr;
+    unsigned char *buffer;
 
-        int numThreads = omp_get_max_threads();
-        if (numThreads > nBlocks) numThreads = nBlocks;
+    buffer = (unsigned char *)slab_alloc(NULL, n);
+    if (buffer == NULL)
+        return bsc_lzp_compress_serial(input, output, n, hashSize, minLen);
 
-        output[0] = nBlocks;
-        #pragma omp parallel num_threads(numThreads) if(numThreads > 1)
-        {
-            if (omp_get_num_threads() == 1)
-            {
-                result = bsc_lzp_compress_serial(input, output, n, hashSize, minLen);
-            }
-            else
-            {
-                #pragma omp for schedule(dynamic)
-                for (int blockId = 0; blockId < nBlocks; ++blockId)
-                {
-                    int blockStart   = blockId * chunkSize;
-                    int blockSize    = blockId != nBlocks - 1 ? chunkSize : n - blockStart;
+    if (n > LZP_MAX_BLOCK)
+        chunkSize = LZP_MAX_BLOCK;
+    else
+        chunkSize = n / nBlocks;
 
-                    compressionResult[blockId] = bsc_lzp_encode_block(input + blockStart, input + blockStart + blockSize, buffer + blockStart, buffer + blockStart + blockSize, hashSize, minLen);
-                    if (compressionResult[blockId] < LZP_NO_ERROR) compressionResult[blockId] = blockSize;
+    numThreads = omp_get_max_threads();
+    if (numThreads > nBlocks) numThreads = nBlocks;
 
-                    *(int *)(output + 1 + 8 * blockId + 0) = blockSize;
-                    *(int *)(output + 1 + 8 * blockId + 4) = compressionResult[blockId];
-                }
+    #pragma omp parallel for schedule(dynamic) num_threads(numThreads)
+    for (blockId = 0; blockId < nBlocks; ++blockId)
+    {
+        int64_t inputStart = blockId * chunkSize;
+        int inputSize = blockId != nBlocks - 1 ? chunkSize : n - inputStart;
 
-                #pragma omp single
-                {
-                    result = 1 + 8 * nBlocks;
-                    for (int blockId = 0; blockId < nBlocks; ++blockId)
-                    {
-                        result += compressionResult[blockId];
-                    }
+        compressionResult[blockId] = bsc_lzp_encode_block(input + inputStart, input + inputStart + inputSize,
+            buffer + inputStart, buffer + inputStart + inputSize, hashSize, minLen);
+    }
 
-                    if (result >= n) result = LZP_NOT_COMPRESSIBLE;
-                }
+    output[0] = LZP_HDR_HASHSIZE | nBlocks; output[1] = hashSize;
+    outputPtr = LZP_HDR_LEN + 8 * nBlocks;
+    for (blockId = 0; blockId < nBlocks; ++blockId)
+    {
+        int64_t inputStart  = blockId * chunkSize;
+        int inputSize   = blockId != nBlocks - 1 ? chunkSize : n - inputStart;
+        int outputSize  = inputSize; if (outputSize > n - outputPtr) outputSize = n - outputPtr;
+        int result      = compressionResult[blockId];
 
-                if (result >= LZP_NO_ERROR)
-                {
-                    #pragma omp for schedule(dynamic)
-                    for (int blockId = 0; blockId < nBlocks; ++blockId)
-                    {
-                        int blockStart   = blockId * chunkSize;
-                        int blockSize    = blockId != nBlocks - 1 ? chunkSize : n - blockStart;
-
-                        int outputPtr = 1 + 8 * nBlocks;
-                        for (int p = 0; p < blockId; ++p) outputPtr += compressionResult[p];
-
-                        if (compressionResult[blockId] != blockSize)
-                        {
-                            memcpy(output + outputPtr, buffer + blockStart, compressionResult[blockId]);
-                        }
-                        else
-                        {
-                            memcpy(output + outputPtr, input + blockStart, compressionResult[blockId]);
-                        }
-                    }
-                }
+        /*
+         * Less room left than the block size. Redo it in place like the
+         * serial version does.
+         */
+        if (outputSize < inputSize)
+        {
+            result = bsc_lzp_encode_block(input + inputStart, input + inputStart + inputSize,
+                output + outputPtr, output + outputPtr + outputSize, hashSize, minLen);
+        }
+        else if (result >= LZP_NO_ERROR)
+        {
+            memcpy(output + outputPtr, buffer + inputStart, result);
+        }
+        if (result < LZP_NO_ERROR)
+        {
+            if (outputPtr + inputSize >= n)
+            {
+                slab_release(NULL, buffer);
+                return LZP_NOT_COMPRESSIBLE;
             }
+            result = inputSize; memcpy(output + outputPtr, input + inputStart, inputSize);
         }
 
-        bsc_free(buffer);
+        *(int *)(output + LZP_HDR_LEN + 8 * blockId + 0) = inputSize;
+        *(int *)(output + LZP_HDR_LEN + 8 * blockId + 4) = result;
 
-        return result;
+        outputPtr += result;
     }
-    return LZP_NOT_ENOUGH_MEMORY;
+    slab_release(NULL, buffer);
+    return outputPtr;
 }
 
 #endif
 
 int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features)
 {
+    if (hashSize < LZP_MIN_HASHSIZE || hashSize > LZP_MAX_HASHSIZE)
+    {
+        return LZP_BAD_PARAMETER;
+    }
+
+    /*
+     * The block count shares its byte with the header flag.
+     */
+    if (bsc_lzp_num_blocks(n) >= LZP_HDR_HASHSIZE)
+    {
+        return LZP_NOT_SUPPORTED;
+    }
 
 #ifdef LZP_OPENMP
 
-    if ((bsc_lzp_num_blocks(n) != 1) && (features & LZP_FEATURE_MULTITHREADING))
+    if ((bsc_lzp_num_blocks(n) != 1) && (features & LZP_FEATURE_MULTITHREADING) &&
+        omp_get_max_threads() > 1)
     {
         return bsc_lzp_compress_parallel(input, output, n, hashSize, minLen);
     }
@@ -411,29 +481,36 @@ int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_
 
 int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features)
 {
-    int nBlocks = input[0];
+    int nBlocks = input[0], hdrLen = 1;
+
+    if (nBlocks & LZP_HDR_HASHSIZE)
+    {
+        if (n < LZP_HDR_LEN) return LZP_UNEXPECTED_EOB;
+        nBlocks &= ~LZP_HDR_HASHSIZE; hashSize = input[1]; hdrLen = LZP_HDR_LEN;
+        if (hashSize < LZP_MIN_HASHSIZE || hashSize > LZP_MAX_HASHSIZE) return LZP_DATA_CORRUPT;
+    }
 
     if (nBlocks == 1)
     {
-        return bsc_lzp_decode_block(input + 1, input + n, output, hashSize, minLen);
+        return bsc_lzp_decode_block(input + hdrLen, input + n, output, hashSize, minLen);
     }
 
     int decompressionResult[ALPHABET_SIZE];
 
 #ifdef LZP_OPENMP
 
-    if (features & LZP_FEATURE_MULTITHREADING)
+    if ((features & LZP_FEATURE_MULTITHREADING) && omp_get_max_threads() > 1)
     {
         #pragma omp parallel for schedule(dynamic)
         for (int blockId = 0; blockId < nBlocks; ++blockId)
         {
-            int inputPtr = 0;  for (int p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + 1 + 8 * p + 4);
-            int outputPtr = 0; for (int p = 0; p < blockId; ++p) outputPtr += *(int *)(input + 1 + 8 * p + 0);
+            int64_t inputPtr = 0;  for (int p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + hdrLen + 8 * p + 4);
+            int64_t outputPtr = 0; for (int p = 0; p < blockId; ++p) outputPtr += *(int *)(input + hdrLen + 8 * p + 0);
 
-            inputPtr += 1 + 8 * nBlocks;
+            inputPtr += hdrLen + 8 * nBlocks;
 
-            int inputSize  = *(int *)(input + 1 + 8 * blockId + 4);
-            int outputSize = *(int *)(input + 1 + 8 * blockId + 0);
+            int inputSize  = *(int *)(input + hdrLen + 8 * blockId + 4);
+            int outputSize = *(int *)(input + hdrLen + 8 * blockId + 0);
 
             if (inputSize != outputSize)
             {
@@ -454,13 +531,13 @@ int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int6
 
         for (blockId = 0; blockId < nBlocks; ++blockId)
         {
-            int64_t inputPtr = 0;  for (p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + 1 + 8 * p + 4);
-            int64_t outputPtr = 0; for (p = 0; p < blockId; ++p) outputPtr += *(int *)(input + 1 + 8 * p + 0);
+            int64_t inputPtr = 0;  for (p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + hdrLen + 8 * p + 4);
+            int64_t outputPtr = 0; for (p = 0; p < blockId; ++p) outputPtr += *(int *)(input + hdrLen + 8 * p + 0);
 
-            inputPtr += 1 + 8 * nBlocks;
+            inputPtr += hdrLen + 8 * nBlocks;
 
-            int inputSize  = *(int *)(input + 1 + 8 * blockId + 4);
-            int outputSize = *(int *)(input + 1 + 8 * blockId + 0);
+            int inputSize  = *(int *)(input + hdrLen + 8 * blockId + 4);
+            int outputSize = *(int *)(input + hdrLen + 8 * blockId + 0);
 
             if (inputSize != outputSize)
             {
@@ -489,8 +566,9 @@ int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int6
  * Counter-intuitively we use a larger hash (with better LZP compression) for lower global
  * compression levels. So that LZP preprocessing plays along nicely with the primary
  * compression algorithm being used and actually provides a benefit.
+ * This is also the hash size of streams that do not record it.
  */
-int lzp_hash_size(int level) {
+int lzp_level_hash_size(int level) {
     if (level > 7) {
         return (LZP_DEFAULT_LZPHASHSIZE + 2);
     } else if (level > 5) {
@@ -501,6 +579,27 @@ int lzp_hash_size(int level) {
         return (LZP_DEFAULT_LZPHASHSIZE + 5);
     }
 }
+
+/*
+ * Hash size used for encoding. Every position does a random access into the
+ * table, so it is capped to what fits into the L2 cache as long as that
+ * does not go below the size used at the highest levels.
+ */
+int lzp_hash_size(int level) {
+    int hsize = lzp_level_hash_size(level);
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+    if (l2 > 0) {
+        int l2size = LZP_DEFAULT_LZPHASHSIZE + 2;
+
+        while (l2size < hsize && ((long)sizeof (int) << (l2size + 1)) <= l2)
+            l2size++;
+        hsize = l2size;
+    }
+#endif
+    return (hsize);
+}
 /*-----------------------------------------------------------*/
 /* End                                               lzp.cpp */
 /*-----------------------------------------------------------*/
@@ -74,6 +74,8 @@ See also the bsc and libbsc web site:
 #define	LZP_MAX_BLOCK              (2000000000LL)
 #define	ALPHABET_SIZE              (256)
 
+#define	LZP_FEATURE_MULTITHREADING 1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -103,6 +105,7 @@ extern "C" {
     int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features);
 
     int lzp_hash_size(int level);
+    int lzp_level_hash_size(int level);
 #ifdef __cplusplus
 }
 #endif
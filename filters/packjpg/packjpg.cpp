@@ -268,6 +268,7 @@ packJPG by Matthias Stirner, 12/2013
 #include <string.h>
 #include <math.h>
 #include <ctime>
+#include <pthread.h>
 
 #include "bitops.h"
 #include "aricoder.h"
@@ -283,6 +284,8 @@ packJPG by Matthias Stirner, 12/2013
 #endif
 
 #define INTERN static
+// state is per thread so that several images can be processed at once
+#define TLOCAL static __thread
 
 #define INIT_MODEL_S(a,b,c) new model_s( a, b, c, 255 )
 #define INIT_MODEL_B(a,b)   new model_b( a, b, 255 )
@@ -315,6 +318,7 @@ packJPG by Matthias Stirner, 12/2013
 #define FRD_ERRMSG	"could not read file / file not found: %s"
 #define FWR_ERRMSG	"could not write file / file write-protected: %s"
 #define MSG_SIZE	128
+#define PJG_MT_MINSIZE	( 4 * 1024 * 1024 ) // smallest JPEG coded in parallel
 #define BARLEN		36
 
 
@@ -384,6 +388,14 @@ INTERN bool check_value_range( void );
 INTERN bool calc_zdst_lists( void );
 INTERN bool pack_pjg( void );
 INTERN bool unpack_pjg( void );
+INTERN bool predict_dc_cmp( int cmp, void* arg );
+INTERN bool unpredict_dc_cmp( int cmp, void* arg );
+INTERN bool pjg_encode_cmp( int cmp, void* arg );
+INTERN bool pjg_decode_cmp( int cmp, void* arg );
+INTERN bool pjg_write_part( iostream* part );
+INTERN bool pjg_read_part( unsigned char** data, iostream** part );
+INTERN void* pjg_cmp_thread( void* arg );
+INTERN bool pjg_par_components( bool (*func)( int, void* ), void* arg );
 
 
 /* -----------------------------------------------
@@ -500,7 +512,7 @@ INTERN inline bool file_exists( const char* filename );
 // these are developers functions, they are not needed
 // in any way to compress jpg or decompress pjg
 #if !defined(BUILD_LIB) && defined(DEV_BUILD)
-INTERN int collmode = 0; // write mode for collections: 0 -> std, 1 -> dhf, 2 -> squ, 3 -> unc
+TLOCAL int collmode = 0; // write mode for collections: 0 -> std, 1 -> dhf, 2 -> squ, 3 -> unc
 INTERN bool dump_hdr( void );
 INTERN bool dump_huf( void );
 INTERN bool dump_coll( void );
@@ -517,8 +529,8 @@ INTERN bool dump_pgm( void );
 	global variables: library only variables
 	----------------------------------------------- */
 #if defined(BUILD_LIB)
-INTERN int lib_in_type  = -1;
-INTERN int lib_out_type = -1;
+TLOCAL int lib_in_type  = -1;
+TLOCAL int lib_out_type = -1;
 #endif
 
 
@@ -526,39 +538,39 @@ INTERN int lib_out_type = -1;
 	global variables: data storage
 	----------------------------------------------- */
 
-INTERN unsigned short qtables[4][64];				// quantization tables
-INTERN huffCodes      hcodes[2][4];				// huffman codes
-INTERN huffTree       htrees[2][4];				// huffman decoding trees
-INTERN unsigned char  htset[2][4];					// 1 if huffman table is set
-
-INTERN unsigned char* grbgdata		   =   NULL;	// garbage data
-INTERN unsigned char* hdrdata          =   NULL;   // header data
-INTERN unsigned char* huffdata         =   NULL;   // huffman coded data
-INTERN int            hufs             =    0  ;   // size of huffman data
-INTERN int            hdrs             =    0  ;   // size of header
-INTERN int            grbs             =    0  ;   // size of garbage
-
-INTERN unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
-INTERN unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
-INTERN int            rstc             =    0  ;   // count of restart markers
-INTERN int            scnc             =    0  ;   // count of scans
-INTERN int            rsti             =    0  ;   // restart interval
-INTERN char           padbit           =    -1 ;   // padbit (for huffman coding)
-INTERN unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
-
-INTERN unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
-INTERN unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
-INTERN unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
-INTERN unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
-INTERN unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
-INTERN signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
-
-INTERN unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
-INTERN unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
-
-INTERN int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
-INTERN int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
-INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
+TLOCAL unsigned short qtables[4][64];				// quantization tables
+TLOCAL huffCodes      hcodes[2][4];				// huffman codes
+TLOCAL huffTree       htrees[2][4];				// huffman decoding trees
+TLOCAL unsigned char  htset[2][4];					// 1 if huffman table is set
+
+TLOCAL unsigned char* grbgdata		   =   NULL;	// garbage data
+TLOCAL unsigned char* hdrdata          =   NULL;   // header data
+TLOCAL unsigned char* huffdata         =   NULL;   // huffman coded data
+TLOCAL int            hufs             =    0  ;   // size of huffman data
+TLOCAL int            hdrs             =    0  ;   // size of header
+TLOCAL int            grbs             =    0  ;   // size of garbage
+
+TLOCAL unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
+TLOCAL unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
+TLOCAL int            rstc             =    0  ;   // count of restart markers
+TLOCAL int            scnc             =    0  ;   // count of scans
+TLOCAL int            rsti             =    0  ;   // restart interval
+TLOCAL char           padbit           =    -1 ;   // padbit (for huffman coding)
+TLOCAL unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
+
+TLOCAL unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
+TLOCAL unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
+TLOCAL unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
+TLOCAL unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
+TLOCAL unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
+TLOCAL signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
+
+TLOCAL unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
+TLOCAL unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
+
+TLOCAL int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
+TLOCAL int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
+TLOCAL int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
 
 
 /* -----------------------------------------------
@@ -566,64 +578,64 @@ INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values
 	----------------------------------------------- */
 
 // seperate info for each color component
-INTERN componentInfo cmpnfo[ 4 ];
+TLOCAL componentInfo cmpnfo[ 4 ];
 
-INTERN int cmpc        = 0; // component count
-INTERN int imgwidth    = 0; // width of image
-INTERN int imgheight   = 0; // height of image
+TLOCAL int cmpc        = 0; // component count
+TLOCAL int imgwidth    = 0; // width of image
+TLOCAL int imgheight   = 0; // height of image
 
-INTERN int sfhm        = 0; // max horizontal sample factor
-INTERN int sfvm        = 0; // max verical sample factor
-INTERN int mcuv        = 0; // mcus per line
-INTERN int mcuh        = 0; // mcus per collumn
-INTERN int mcuc        = 0; // count of mcus
+TLOCAL int sfhm        = 0; // max horizontal sample factor
+TLOCAL int sfvm        = 0; // max verical sample factor
+TLOCAL int mcuv        = 0; // mcus per line
+TLOCAL int mcuh        = 0; // mcus per collumn
+TLOCAL int mcuc        = 0; // count of mcus
 
 
 /* -----------------------------------------------
 	global variables: info about current scan
 	----------------------------------------------- */
 
-INTERN int cs_cmpc      =   0  ; // component count in current scan
-INTERN int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
-INTERN int cs_from      =   0  ; // begin - band of current scan ( inclusive )
-INTERN int cs_to        =   0  ; // end - band of current scan ( inclusive )
-INTERN int cs_sah       =   0  ; // successive approximation bit pos high
-INTERN int cs_sal       =   0  ; // successive approximation bit pos low
+TLOCAL int cs_cmpc      =   0  ; // component count in current scan
+TLOCAL int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
+TLOCAL int cs_from      =   0  ; // begin - band of current scan ( inclusive )
+TLOCAL int cs_to        =   0  ; // end - band of current scan ( inclusive )
+TLOCAL int cs_sah       =   0  ; // successive approximation bit pos high
+TLOCAL int cs_sal       =   0  ; // successive approximation bit pos low
 	
 
 /* -----------------------------------------------
 	global variables: info about files
 	----------------------------------------------- */
 	
-INTERN char*  jpgfilename = NULL;	// name of JPEG file
-INTERN char*  pjgfilename = NULL;	// name of PJG file
-INTERN int    jpgfilesize;			// size of JPEG file
-INTERN int    pjgfilesize;			// size of PJG file
-INTERN int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
-INTERN int    filetype;				// type of current file
-INTERN iostream* str_in  = NULL;	// input stream
-INTERN iostream* str_out = NULL;	// output stream
+TLOCAL char*  jpgfilename = NULL;	// name of JPEG file
+TLOCAL char*  pjgfilename = NULL;	// name of PJG file
+TLOCAL int    jpgfilesize;			// size of JPEG file
+TLOCAL int    pjgfilesize;			// size of PJG file
+TLOCAL int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
+TLOCAL int    filetype;				// type of current file
+TLOCAL iostream* str_in  = NULL;	// input stream
+TLOCAL iostream* str_out = NULL;	// output stream
 
 #if !defined(BUILD_LIB)
-INTERN iostream* str_str = NULL;	// storage stream
+TLOCAL iostream* str_str = NULL;	// storage stream
 
-INTERN char** filelist = NULL;		// list of files to process 
-INTERN int    file_cnt = 0;			// count of files in list
-INTERN int    file_no  = 0;			// number of current file
+TLOCAL char** filelist = NULL;		// list of files to process 
+TLOCAL int    file_cnt = 0;			// count of files in list
+TLOCAL int    file_no  = 0;			// number of current file
 
-INTERN char** err_list = NULL;		// list of error messages 
-INTERN int*   err_tp   = NULL;		// list of error types
+TLOCAL char** err_list = NULL;		// list of error messages 
+TLOCAL int*   err_tp   = NULL;		// list of error types
 #endif
 
 #if defined(DEV_INFOS)
-INTERN int    dev_size_hdr      = 0;
-INTERN int    dev_size_cmp[ 4 ] = { 0 };
-INTERN int    dev_size_zsr[ 4 ] = { 0 };
-INTERN int    dev_size_dc[ 4 ]  = { 0 };
-INTERN int    dev_size_ach[ 4 ] = { 0 };
-INTERN int    dev_size_acl[ 4 ] = { 0 };
-INTERN int    dev_size_zdh[ 4 ] = { 0 };
-INTERN int    dev_size_zdl[ 4 ] = { 0 };
+TLOCAL int    dev_size_hdr      = 0;
+TLOCAL int    dev_size_cmp[ 4 ] = { 0 };
+TLOCAL int    dev_size_zsr[ 4 ] = { 0 };
+TLOCAL int    dev_size_dc[ 4 ]  = { 0 };
+TLOCAL int    dev_size_ach[ 4 ] = { 0 };
+TLOCAL int    dev_size_acl[ 4 ] = { 0 };
+TLOCAL int    dev_size_zdh[ 4 ] = { 0 };
+TLOCAL int    dev_size_zdl[ 4 ] = { 0 };
 #endif
 
 
@@ -631,9 +643,9 @@ INTERN int    dev_size_zdl[ 4 ] = { 0 };
 	global variables: messages
 	----------------------------------------------- */
 
-INTERN char errormessage [ MSG_SIZE ];
-INTERN bool (*errorfunction)();
-INTERN int  errorlevel;
+TLOCAL char errormessage [ MSG_SIZE ];
+TLOCAL bool (*errorfunction)();
+TLOCAL int  errorlevel;
 // meaning of errorlevel:
 // -1 -> wrong input
 // 0 -> no error
@@ -646,30 +658,31 @@ INTERN int  errorlevel;
 	----------------------------------------------- */
 
 #if !defined( BUILD_LIB )
-INTERN int  verbosity  = -1;	// level of verbosity
-INTERN bool overwrite  = false;	// overwrite files yes / no
-INTERN bool wait_exit  = true;	// pause after finished yes / no
-INTERN int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
+TLOCAL int  verbosity  = -1;	// level of verbosity
+TLOCAL bool overwrite  = false;	// overwrite files yes / no
+TLOCAL bool wait_exit  = true;	// pause after finished yes / no
+TLOCAL int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
+TLOCAL int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLOCAL bool disc_meta  = false;	// discard meta-info yes / no
 
-INTERN bool developer  = false;	// allow developers functions yes/no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
+TLOCAL bool developer  = false;	// allow developers functions yes/no
+TLOCAL bool auto_set   = true;	// automatic find best settings yes/no
+TLOCAL int  action = A_COMPRESS;// what to do with JPEG/PJG files
 
 INTERN FILE*  msgout   = stdout;// stream for output of messages
-INTERN bool   pipe_on  = false;	// use stdin/stdout instead of filelist
+TLOCAL bool   pipe_on  = false;	// use stdin/stdout instead of filelist
 #else
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
+TLOCAL int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLOCAL bool disc_meta  = false;	// discard meta-info yes / no
+TLOCAL bool auto_set   = true;	// automatic find best settings yes/no
+TLOCAL int  action = A_COMPRESS;// what to do with JPEG/PJG files
 #endif
 
-INTERN unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
-INTERN unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
+TLOCAL unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
+TLOCAL unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
+TLOCAL bool mt_mode = false; // code components in parallel (large images only)
 #if !defined( BUILD_LIB )
-INTERN unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
+TLOCAL unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
 #endif
 
 
@@ -678,6 +691,7 @@ INTERN unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
 	----------------------------------------------- */
 
 INTERN const unsigned char appversion = 25;
+INTERN const unsigned char appversion_mt = 26; // components in separate streams
 INTERN const char*  subversion   = "h";
 INTERN const char*  apptitle     = "packJPG";
 INTERN const char*  appname      = "packjpg";
@@ -2053,6 +2067,9 @@ INTERN bool reset_buffers( void )
 	// reset padbit
 	padbit = -1;
 	
+	// reset parallel coding
+	mt_mode = false;
+	
 	
 	return true;
 }
@@ -2263,6 +2280,8 @@ INTERN bool read_jpeg( void )
 	
 	// get filesize
 	jpgfilesize = str_in->getsize();	
+	// large images get their components coded in parallel
+	mt_mode = ( jpgfilesize >= PJG_MT_MINSIZE );
 	
 	// parse header for image info
 	if ( !jpg_setup_imginfo() ) {
@@ -3103,32 +3122,49 @@ INTERN bool adapt_icos( void )
 	----------------------------------------------- */
 
 INTERN bool predict_dc( void )
+{
+	int cmp;
+	
+	
+	if ( mt_mode )
+		return pjg_par_components( predict_dc_cmp, NULL );
+	
+	for ( cmp = 0; cmp < cmpc; cmp++ )
+		predict_dc_cmp( cmp, NULL );
+	
+	return true;
+}
+
+
+/* -----------------------------------------------
+	filter DC coefficients of one component
+	----------------------------------------------- */
+
+INTERN bool predict_dc_cmp( int cmp, void* arg )
 {
 	signed short* coef;
 	int absmaxp;
 	int absmaxn;
 	int corr_f;
-	int cmp, dpos;	
+	int dpos;	
 	
 	
 	// apply prediction, store prediction error instead of DC
-	for ( cmp = 0; cmp < cmpc; cmp++ ) {
-		absmaxp = MAX_V( cmp, 0 );
-		absmaxn = -absmaxp;
-		corr_f = ( ( 2 * absmaxp ) + 1 );
+	absmaxp = MAX_V( cmp, 0 );
+	absmaxn = -absmaxp;
+	corr_f = ( ( 2 * absmaxp ) + 1 );
+	
+	for ( dpos = cmpnfo[cmp].bc - 1; dpos > 0; dpos-- )	{
+		coef = &(colldata[cmp][0][dpos]);
+		#if defined( USE_PLOCOI )
+		(*coef) -= dc_coll_predictor( cmp, dpos ); // loco-i predictor
+		#else
+		(*coef) -= dc_1ddct_predictor( cmp, dpos ); // 1d dct
+		#endif
 		
-		for ( dpos = cmpnfo[cmp].bc - 1; dpos > 0; dpos-- )	{
-			coef = &(colldata[cmp][0][dpos]);
-			#if defined( USE_PLOCOI )
-			(*coef) -= dc_coll_predictor( cmp, dpos ); // loco-i predictor
-			#else
-			(*coef) -= dc_1ddct_predictor( cmp, dpos ); // 1d dct
-			#endif
-			
-			// fix range
-			if ( (*coef) > absmaxp ) (*coef) -= corr_f;
-			else if ( (*coef) < absmaxn ) (*coef) += corr_f;
-		}
+		// fix range
+		if ( (*coef) > absmaxp ) (*coef) -= corr_f;
+		else if ( (*coef) < absmaxn ) (*coef) += corr_f;
 	}
 	
 	return true;
@@ -3140,32 +3176,50 @@ INTERN bool predict_dc( void )
 	----------------------------------------------- */
 
 INTERN bool unpredict_dc( void )
+{	
+	int cmp;
+	
+	
+	if ( mt_mode )
+		return pjg_par_components( unpredict_dc_cmp, NULL );
+	
+	for ( cmp = 0; cmp < cmpc; cmp++ )
+		unpredict_dc_cmp( cmp, NULL );
+	
+	
+	return true;
+}
+
+
+/* -----------------------------------------------
+	unpredict DC coefficients of one component
+	----------------------------------------------- */
+
+INTERN bool unpredict_dc_cmp( int cmp, void* arg )
 {	
 	signed short* coef;
 	int absmaxp;
 	int absmaxn;
 	int corr_f;
-	int cmp, dpos;
+	int dpos;
 	
 	
 	// remove prediction, store DC instead of prediction error
-	for ( cmp = 0; cmp < cmpc; cmp++ ) {
-		absmaxp = MAX_V( cmp, 0 );
-		absmaxn = -absmaxp;
-		corr_f = ( ( 2 * absmaxp ) + 1 );
+	absmaxp = MAX_V( cmp, 0 );
+	absmaxn = -absmaxp;
+	corr_f = ( ( 2 * absmaxp ) + 1 );
+	
+	for ( dpos = 1; dpos < cmpnfo[cmp].bc; dpos++ ) {
+		coef = &(colldata[cmp][0][dpos]);
+		#if defined( USE_PLOCOI )
+		(*coef) += dc_coll_predictor( cmp, dpos ); // loco-i predictor
+		#else
+		(*coef) += dc_1ddct_predictor( cmp, dpos ); // 1d dct predictor
+		#endif
 		
-		for ( dpos = 1; dpos < cmpnfo[cmp].bc; dpos++ ) {
-			coef = &(colldata[cmp][0][dpos]);
-			#if defined( USE_PLOCOI )
-			(*coef) += dc_coll_predictor( cmp, dpos ); // loco-i predictor
-			#else
-			(*coef) += dc_1ddct_predictor( cmp, dpos ); // 1d dct predictor
-			#endif
-			
-			// fix range
-			if ( (*coef) > absmaxp ) (*coef) -= corr_f;
-			else if ( (*coef) < absmaxn ) (*coef) += corr_f;
-		}
+		// fix range
+		if ( (*coef) > absmaxp ) (*coef) -= corr_f;
+		else if ( (*coef) < absmaxn ) (*coef) += corr_f;
 	}
 	
 	
@@ -3248,7 +3302,10 @@ INTERN bool calc_zdst_lists( void )
 INTERN bool pack_pjg( void )
 {
 	aricoder* encoder;
+	iostream* str_main;
+	iostream* str_cmp[ 4 ] = { NULL };
 	unsigned char hcode;
+	bool ok;
 	int cmp;
 	#if defined(DEV_INFOS)
 	int dev_size = 0;
@@ -3267,12 +3324,14 @@ INTERN bool pack_pjg( void )
 	}
 	
 	// store version number
-	hcode = appversion;
+	if ( cmpc < 2 ) mt_mode = false;
+	hcode = ( mt_mode ) ? appversion_mt : appversion;
 	str_out->write( &hcode, 1, 1 );
 	
 	
-	// init arithmetic compression
-	encoder = new aricoder( str_out, 1 );
+	// init arithmetic compression, components get their own streams in mt mode
+	str_main = ( mt_mode ) ? new iostream( NULL, 1, 0, 1 ) : str_out;
+	encoder = new aricoder( str_main, 1 );
 	
 	// discard meta information from header if option set
 	if ( disc_meta )
@@ -3299,7 +3358,7 @@ INTERN bool pack_pjg( void )
 		if ( !pjg_encode_generic( encoder, rst_err, scnc ) ) return false;
 	
 	// encode actual components data
-	for ( cmp = 0; cmp < cmpc; cmp++ ) {		
+	for ( cmp = 0; cmp < cmpc && !mt_mode; cmp++ ) {		
 		#if !defined(DEV_INFOS)
 		// encode frequency scan ('zero-sort-scan')
 		if ( !pjg_encode_zstscan( encoder, cmp ) ) return false;
@@ -3353,6 +3412,19 @@ INTERN bool pack_pjg( void )
 	// finalize arithmetic compression
 	delete( encoder );
 	
+	// code the components in parallel, then store all streams with their lengths
+	if ( mt_mode ) {
+		for ( cmp = 0; cmp < cmpc; cmp++ )
+			str_cmp[ cmp ] = new iostream( NULL, 1, 0, 1 );
+		ok = pjg_par_components( pjg_encode_cmp, str_cmp ) && pjg_write_part( str_main );
+		for ( cmp = 0; cmp < cmpc; cmp++ ) {
+			if ( ok ) ok = pjg_write_part( str_cmp[ cmp ] );
+			delete( str_cmp[ cmp ] );
+		}
+		delete( str_main );
+		if ( !ok ) return false;
+	}
+	
 	
 	// errormessage if write error
 	if ( str_out->chkerr() ) {
@@ -3376,6 +3448,8 @@ INTERN bool pack_pjg( void )
 INTERN bool unpack_pjg( void )
 {
 	aricoder* decoder;
+	iostream* str_main;
+	unsigned char* main_data = NULL;
 	unsigned char hcode;
 	unsigned char cb;
 	int cmp;
@@ -3392,13 +3466,16 @@ INTERN bool unpack_pjg( void )
 		}
 		else if ( hcode >= 0x14 ) {
 			// compare version number
-			if ( hcode != appversion ) {
+			if ( ( hcode != appversion ) && ( hcode != appversion_mt ) ) {
 				sprintf( errormessage, "incompatible file, use %s v%i.%i",
 					appname, hcode / 10, hcode % 10 );
 				errorlevel = 2;
 				return false;
 			}
-			else break;
+			else {
+				mt_mode = ( hcode == appversion_mt );
+				break;
+			}
 		}
 		else {
 			sprintf( errormessage, "unknown header code, use newer version of %s", appname );
@@ -3408,8 +3485,11 @@ INTERN bool unpack_pjg( void )
 	}
 	
 	
-	// init arithmetic compression
-	decoder = new aricoder( str_in, 0 );
+	// init arithmetic compression, components have their own streams in mt mode
+	str_main = str_in;
+	if ( mt_mode )
+		if ( !pjg_read_part( &main_data, &str_main ) ) return false;
+	decoder = new aricoder( str_main, 0 );
 	
 	// decode JPG header
 	if ( !pjg_decode_generic( decoder, &hdrdata, &hdrs ) ) return false;
@@ -3430,7 +3510,7 @@ INTERN bool unpack_pjg( void )
 	if ( !jpg_setup_imginfo() ) return false;
 	
 	// decode actual components data
-	for ( cmp = 0; cmp < cmpc; cmp++ ) {		
+	for ( cmp = 0; cmp < cmpc && !mt_mode; cmp++ ) {		
 		// decode frequency scan ('zero-sort-scan')
 		if ( !pjg_decode_zstscan( decoder, cmp ) ) return false;		
 		// decode zero-distribution-lists for higher (7x7) ACs
@@ -3455,6 +3535,25 @@ INTERN bool unpack_pjg( void )
 	// finalize arithmetic compression
 	delete( decoder );
 	
+	// decode the components in parallel from their streams
+	if ( mt_mode ) {
+		iostream* str_cmp[ 4 ] = { NULL };
+		unsigned char* cmp_data[ 4 ] = { NULL };
+		bool ok = true;
+		
+		delete( str_main );
+		free( main_data );
+		for ( cmp = 0; cmp < cmpc && ok; cmp++ )
+			ok = pjg_read_part( &cmp_data[ cmp ], &str_cmp[ cmp ] );
+		if ( ok )
+			ok = pjg_par_components( pjg_decode_cmp, str_cmp );
+		for ( cmp = 0; cmp < cmpc; cmp++ ) {
+			if ( str_cmp[ cmp ] != NULL ) delete( str_cmp[ cmp ] );
+			free( cmp_data[ cmp ] );
+		}
+		if ( !ok ) return false;
+	}
+	
 	
 	// get filesize
 	pjgfilesize = str_in->getsize();
@@ -3463,6 +3562,252 @@ INTERN bool unpack_pjg( void )
 	return true;
 }
 
+
+/* -----------------------------------------------
+	encodes one component to its own stream
+	----------------------------------------------- */
+	
+INTERN bool pjg_encode_cmp( int cmp, void* arg )
+{
+	iostream** str_cmp = (iostream**) arg;
+	aricoder* encoder;
+	bool ok;
+	
+	
+	encoder = new aricoder( str_cmp[ cmp ], 1 );
+	ok = pjg_encode_zstscan( encoder, cmp ) &&
+		pjg_encode_zdst_high( encoder, cmp ) &&
+		pjg_encode_ac_high( encoder, cmp ) &&
+		pjg_encode_zdst_low( encoder, cmp ) &&
+		pjg_encode_ac_low( encoder, cmp ) &&
+		pjg_encode_dc( encoder, cmp );
+	delete( encoder );
+	
+	return ok;
+}
+
+
+/* -----------------------------------------------
+	decodes one component from its own stream
+	----------------------------------------------- */
+	
+INTERN bool pjg_decode_cmp( int cmp, void* arg )
+{
+	iostream** str_cmp = (iostream**) arg;
+	aricoder* decoder;
+	bool ok;
+	
+	
+	decoder = new aricoder( str_cmp[ cmp ], 0 );
+	ok = pjg_decode_zstscan( decoder, cmp ) &&
+		pjg_decode_zdst_high( decoder, cmp ) &&
+		pjg_decode_ac_high( decoder, cmp ) &&
+		pjg_decode_zdst_low( decoder, cmp ) &&
+		pjg_decode_ac_low( decoder, cmp ) &&
+		pjg_decode_dc( decoder, cmp );
+	delete( decoder );
+	
+	return ok;
+}
+
+
+/* -----------------------------------------------
+	writes a memory stream to the output,
+	preceded by its length (4 bytes, LE)
+	----------------------------------------------- */
+	
+INTERN bool pjg_write_part( iostream* part )
+{
+	unsigned char lenb[ 4 ];
+	unsigned char* data;
+	int len;
+	
+	
+	len = part->getsize();
+	data = part->getptr();
+	if ( data == NULL ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		return false;
+	}
+	lenb[ 0 ] = len & 0xFF;
+	lenb[ 1 ] = ( len >> 8 ) & 0xFF;
+	lenb[ 2 ] = ( len >> 16 ) & 0xFF;
+	lenb[ 3 ] = ( len >> 24 ) & 0xFF;
+	str_out->write( lenb, 1, 4 );
+	str_out->write( data, 1, len );
+	free( data );
+	
+	return true;
+}
+
+
+/* -----------------------------------------------
+	reads a part written by pjg_write_part() and
+	opens a memory stream on it
+	----------------------------------------------- */
+	
+INTERN bool pjg_read_part( unsigned char** data, iostream** part )
+{
+	unsigned char lenb[ 4 ];
+	int len;
+	
+	
+	if ( str_in->read( lenb, 1, 4 ) != 4 ) {
+		sprintf( errormessage, "unexpected end of data" );
+		errorlevel = 2;
+		return false;
+	}
+	len = lenb[ 0 ] | ( lenb[ 1 ] << 8 ) | ( lenb[ 2 ] << 16 ) | ( lenb[ 3 ] << 24 );
+	if ( ( len <= 0 ) || ( len > str_in->getsize() - str_in->getpos() ) ) {
+		sprintf( errormessage, "bad stream length in pjg file" );
+		errorlevel = 2;
+		return false;
+	}
+	*data = (unsigned char*) malloc( len );
+	if ( *data == NULL ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		return false;
+	}
+	str_in->read( *data, 1, len );
+	*part = new iostream( *data, 1, len, 0 );
+	
+	return true;
+}
+
+
+/* -----------------------------------------------
+	runs a function for each component in parallel
+	----------------------------------------------- */
+
+// the calling thread's image state, shared with the component threads
+struct pjg_shared {
+	int cmpc;
+	componentInfo* cmpnfo;
+	signed short* (*colldata)[ 64 ];
+	unsigned char** zdstdata;
+	unsigned char** eobxhigh;
+	unsigned char** eobyhigh;
+	unsigned char** zdstxlow;
+	unsigned char** zdstylow;
+	unsigned char** freqscan;
+	unsigned char (*zsrtscan)[ 64 ];
+	unsigned char* nois_trs;
+	unsigned char* segm_cnt;
+	int (*adpt_idct_8x8)[ 8 * 8 * 8 * 8 ];
+	int (*adpt_idct_1x8)[ 1 * 1 * 8 * 8 ];
+	int (*adpt_idct_8x1)[ 8 * 8 * 1 * 1 ];
+};
+
+struct pjg_cmp_job {
+	pjg_shared* sh;
+	bool (*func)( int, void* );
+	void* arg;
+	int cmp;
+	bool ok;
+	int errlvl;
+	char msg[ MSG_SIZE ];
+};
+
+INTERN void* pjg_cmp_thread( void* arg )
+{
+	pjg_cmp_job* job = (pjg_cmp_job*) arg;
+	pjg_shared* sh = job->sh;
+	int cmp = job->cmp;
+	int bpos;
+	
+	
+	// state is thread local, so take over what this component needs
+	cmpc = sh->cmpc;
+	memcpy( cmpnfo, sh->cmpnfo, sizeof( cmpnfo ) );
+	for ( bpos = 0; bpos < 64; bpos++ )
+		colldata[ cmp ][ bpos ] = sh->colldata[ cmp ][ bpos ];
+	zdstdata[ cmp ] = sh->zdstdata[ cmp ];
+	eobxhigh[ cmp ] = sh->eobxhigh[ cmp ];
+	eobyhigh[ cmp ] = sh->eobyhigh[ cmp ];
+	zdstxlow[ cmp ] = sh->zdstxlow[ cmp ];
+	zdstylow[ cmp ] = sh->zdstylow[ cmp ];
+	memcpy( zsrtscan[ cmp ], sh->zsrtscan[ cmp ], 64 );
+	freqscan[ cmp ] = ( sh->freqscan[ cmp ] == sh->zsrtscan[ cmp ] ) ?
+		zsrtscan[ cmp ] : sh->freqscan[ cmp ];
+	memcpy( nois_trs, sh->nois_trs, sizeof( nois_trs ) );
+	memcpy( segm_cnt, sh->segm_cnt, sizeof( segm_cnt ) );
+	memcpy( adpt_idct_8x8[ cmp ], sh->adpt_idct_8x8[ cmp ], sizeof( adpt_idct_8x8[ cmp ] ) );
+	memcpy( adpt_idct_1x8[ cmp ], sh->adpt_idct_1x8[ cmp ], sizeof( adpt_idct_1x8[ cmp ] ) );
+	memcpy( adpt_idct_8x1[ cmp ], sh->adpt_idct_8x1[ cmp ], sizeof( adpt_idct_8x1[ cmp ] ) );
+	errorlevel = 0;
+	
+	job->ok = job->func( cmp, job->arg );
+	
+	// hand back the frequency scan, it is set while coding
+	memcpy( sh->zsrtscan[ cmp ], zsrtscan[ cmp ], 64 );
+	sh->freqscan[ cmp ] = ( freqscan[ cmp ] == zsrtscan[ cmp ] ) ?
+		sh->zsrtscan[ cmp ] : freqscan[ cmp ];
+	job->errlvl = errorlevel;
+	memcpy( job->msg, errormessage, MSG_SIZE );
+	
+	return NULL;
+}
+
+INTERN bool pjg_par_components( bool (*func)( int, void* ), void* arg )
+{
+	pjg_shared sh;
+	pjg_cmp_job jobs[ 4 ];
+	pthread_t tids[ 4 ];
+	bool started[ 4 ] = { false };
+	bool ok;
+	int cmp;
+	
+	
+	sh.cmpc = cmpc;
+	sh.cmpnfo = cmpnfo;
+	sh.colldata = colldata;
+	sh.zdstdata = zdstdata;
+	sh.eobxhigh = eobxhigh;
+	sh.eobyhigh = eobyhigh;
+	sh.zdstxlow = zdstxlow;
+	sh.zdstylow = zdstylow;
+	sh.freqscan = freqscan;
+	sh.zsrtscan = zsrtscan;
+	sh.nois_trs = nois_trs;
+	sh.segm_cnt = segm_cnt;
+	sh.adpt_idct_8x8 = adpt_idct_8x8;
+	sh.adpt_idct_1x8 = adpt_idct_1x8;
+	sh.adpt_idct_8x1 = adpt_idct_8x1;
+	
+	// components 1 and up get a thread each, the first one is done here
+	for ( cmp = 1; cmp < cmpc; cmp++ ) {
+		jobs[ cmp ].sh = &sh;
+		jobs[ cmp ].func = func;
+		jobs[ cmp ].arg = arg;
+		jobs[ cmp ].cmp = cmp;
+		jobs[ cmp ].ok = false;
+		started[ cmp ] = ( pthread_create( &tids[ cmp ], NULL, pjg_cmp_thread, &jobs[ cmp ] ) == 0 );
+	}
+	ok = func( 0, arg );
+	
+	for ( cmp = 1; cmp < cmpc; cmp++ ) {
+		if ( started[ cmp ] ) {
+			pthread_join( tids[ cmp ], NULL );
+			if ( !jobs[ cmp ].ok && ok ) {
+				ok = false;
+				errorlevel = jobs[ cmp ].errlvl;
+				memcpy( errormessage, jobs[ cmp ].msg, MSG_SIZE );
+			}
+		}
+		else if ( ok ) {
+			ok = func( cmp, arg );
+		}
+	}
+	if ( !ok && ( errorlevel < 2 ) ) {
+		sprintf( errormessage, "error coding image components" );
+		errorlevel = 2;
+	}
+	
+	return ok;
+}
+
 /* ----------------------- End of main functions -------------------------- */
 
 /* ----------------------- Begin of JPEG specific functions -------------------------- */
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <math.h>
 #include <ctime>
+#include <pthread.h>
 
 #include "bitops.h"
 #include "aricoder.h"
@@ -17,6 +18,18 @@
 #endif
 
 #define INTERN static
+// state is per thread so that several images can be processed at once
+#define TLOCAL static __thread
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	#include <emmintrin.h>
+	#define PPN_SSE2
+#endif
+
+// large RGBA/E images are coded as independent bands of rows
+#define PPN_BAND_PIXELS	( 512 * 1024 )
+#define PPN_BAND_ROWS	64
+#define PPN_BANDS_MAX	8
 
 #define INIT_MODEL_S(a,b,c) new model_s( a, b, c, 255 )
 #define INIT_MODEL_B(a,b)   new model_b( a, b, 255 )
@@ -81,6 +94,22 @@ class cmp_mask {
 };
 
 
+/* -----------------------------------------------
+	band of rows for RGBA/E coding
+	----------------------------------------------- */
+	
+struct ppn_band {
+	int* img;				// pixels, cmpc lines of width ints per row
+	int  rows;				// rows in band
+	int  width;				// image width
+	int  cmpc;				// component count
+	unsigned int mmax[4];	// model maximum per component
+	unsigned char* data;	// coded band
+	int  size;				// size of coded band
+	bool ok;				// coding succeeded
+};
+
+
 /* -----------------------------------------------
 	function declarations: main interface
 	----------------------------------------------- */
@@ -115,6 +144,13 @@ INTERN bool unpack_ppn( void );
 
 INTERN bool ppn_encode_imgdata_rgba( aricoder* enc, iostream* stream );
 INTERN bool ppn_decode_imgdata_rgba( aricoder* dec, iostream* stream );
+INTERN bool ppn_encode_imgdata_bands( iostream* stream, int nbands );
+INTERN bool ppn_decode_imgdata_bands( iostream* in, iostream* out );
+INTERN bool ppn_encode_band_rgba( aricoder* enc, ppn_band* band, iostream* stream );
+INTERN bool ppn_decode_band_rgba( aricoder* dec, ppn_band* band, iostream* stream );
+INTERN inline void ppn_band_init( ppn_band* band, int rows );
+INTERN inline bool ppn_rgba_coded( void );
+INTERN inline int ppn_band_count( void );
 INTERN bool ppn_encode_imgdata_mono( aricoder* enc, iostream* stream );
 INTERN bool ppn_decode_imgdata_mono( aricoder* dec, iostream* stream );
 INTERN bool ppn_encode_imgdata_palette( aricoder* enc, iostream* stream );
@@ -123,6 +159,7 @@ INTERN inline void ppn_encode_pjg( aricoder* enc, pjg_model* mod, int** val, int
 INTERN inline void ppn_decode_pjg( aricoder* dec, pjg_model* mod, int** val, int** err, int ctx3 );
 INTERN inline int get_context_mono( int x, int y, int** val );
 INTERN inline int plocoi( int a, int b, int c );
+INTERN inline void ppn_predict_line( int* err, int* val, int* above, int width );
 INTERN inline int pnm_read_line( iostream* stream, int** line );
 INTERN inline int pnm_write_line( iostream* stream, int** line );
 INTERN inline int hdr_decode_line_rle( iostream* stream, int** line );
@@ -166,8 +203,8 @@ INTERN bool dump_info( void );
 	global variables: library only variables
 	----------------------------------------------- */
 #if defined(BUILD_LIB)
-INTERN int lib_in_type  = -1;
-INTERN int lib_out_type = -1;
+TLOCAL int lib_in_type  = -1;
+TLOCAL int lib_out_type = -1;
 #endif
 
 
@@ -175,39 +212,39 @@ INTERN int lib_out_type = -1;
 	global variables: data storage
 	----------------------------------------------- */
 
-INTERN int imgwidth;	// width of image
-INTERN int imgheight;	// height of image
-INTERN int imgwidthv;	// visible width of image
-INTERN int imgbpp;		// bit per pixel
-INTERN int cmpc;		// component count
-INTERN int endian_l;	// endianness of image data
-INTERN unsigned int pnmax; // maximum pixel value (PPM/PGM only!)
-INTERN cmp_mask* cmask[5]; // masking info for components
-INTERN int bmpsize;		// file size according to header
+TLOCAL int imgwidth;	// width of image
+TLOCAL int imgheight;	// height of image
+TLOCAL int imgwidthv;	// visible width of image
+TLOCAL int imgbpp;		// bit per pixel
+TLOCAL int cmpc;		// component count
+TLOCAL int endian_l;	// endianness of image data
+TLOCAL unsigned int pnmax; // maximum pixel value (PPM/PGM only!)
+TLOCAL cmp_mask* cmask[5]; // masking info for components
+TLOCAL int bmpsize;		// file size according to header
 
 
 /* -----------------------------------------------
 	global variables: info about files
 	----------------------------------------------- */
 	
-INTERN char*  ppnfilename = NULL;	// name of compressed file
-INTERN char*  pnmfilename = NULL;	// name of uncompressed file
-INTERN int    ppnfilesize;			// size of compressed file
-INTERN int    pnmfilesize;			// size of uncompressed file
-INTERN int    filetype;				// type of current file
-INTERN int    subtype;				// sub type of file
-INTERN iostream* str_in  = NULL;	// input stream
-INTERN iostream* str_out = NULL;	// output stream
+TLOCAL char*  ppnfilename = NULL;	// name of compressed file
+TLOCAL char*  pnmfilename = NULL;	// name of uncompressed file
+TLOCAL int    ppnfilesize;			// size of compressed file
+TLOCAL int    pnmfilesize;			// size of uncompressed file
+TLOCAL int    filetype;				// type of current file
+TLOCAL int    subtype;				// sub type of file
+TLOCAL iostream* str_in  = NULL;	// input stream
+TLOCAL iostream* str_out = NULL;	// output stream
 
 #if !defined( BUILD_LIB )
-INTERN iostream* str_str = NULL;	// storage stream
+TLOCAL iostream* str_str = NULL;	// storage stream
 
-INTERN char** filelist = NULL; 		// list of files to process 
-INTERN int    file_cnt = 0;			// count of files in list
-INTERN int    file_no  = 0;			// number of current file
+TLOCAL char** filelist = NULL; 		// list of files to process 
+TLOCAL int    file_cnt = 0;			// count of files in list
+TLOCAL int    file_no  = 0;			// number of current file
 
-INTERN char** err_list = NULL;		// list of error messages 
-INTERN int*   err_tp   = NULL;		// list of error types
+TLOCAL char** err_list = NULL;		// list of error messages 
+TLOCAL int*   err_tp   = NULL;		// list of error types
 #endif
 
 
@@ -215,9 +252,9 @@ INTERN int*   err_tp   = NULL;		// list of error types
 	global variables: messages
 	----------------------------------------------- */
 
-INTERN char errormessage [ 128 ];
-INTERN bool (*errorfunction)();
-INTERN int  errorlevel;
+TLOCAL char errormessage [ 128 ];
+TLOCAL bool (*errorfunction)();
+TLOCAL int  errorlevel;
 // meaning of errorlevel:
 // -1 -> wrong input
 // 0 -> no error
@@ -229,22 +266,22 @@ INTERN int  errorlevel;
 	global variables: settings
 	----------------------------------------------- */
 
-INTERN bool use_rle    = 0;		// use RLE compression for HDR output
+TLOCAL bool use_rle    = 0;		// use RLE compression for HDR output
 #if !defined( BUILD_LIB )
-INTERN int  verbosity  = -1;	// level of verbosity
-INTERN bool overwrite  = false;	// overwrite files yes / no
-INTERN bool wait_exit  = true;	// pause after finished yes / no
-INTERN int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLOCAL int  verbosity  = -1;	// level of verbosity
+TLOCAL bool overwrite  = false;	// overwrite files yes / no
+TLOCAL bool wait_exit  = true;	// pause after finished yes / no
+TLOCAL int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
+TLOCAL int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
 
-INTERN bool developer  = false;	// allow developers functions yes/no
-INTERN int  action     = A_COMPRESS; // what to do with files
+TLOCAL bool developer  = false;	// allow developers functions yes/no
+TLOCAL int  action     = A_COMPRESS; // what to do with files
 
 INTERN FILE*  msgout   = stdout;	// stream for output of messages
-INTERN bool   pipe_on  = false;	// use stdin/stdout instead of filelist
+TLOCAL bool   pipe_on  = false;	// use stdin/stdout instead of filelist
 #else
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN int  action     = A_COMPRESS; // what to do with files
+TLOCAL int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+TLOCAL int  action     = A_COMPRESS; // what to do with files
 #endif
 
 
@@ -253,6 +290,7 @@ INTERN int  action     = A_COMPRESS; // what to do with files
 	----------------------------------------------- */
 
 INTERN const unsigned char appversion = 16;
+INTERN const unsigned char bandversion = 17; // appversion with banded RGBA/E data
 INTERN const char*  subversion   = "c";
 INTERN const char*  apptitle     = "packPNM";
 INTERN const char*  appname      = "packPNM";
@@ -1300,6 +1338,7 @@ INTERN bool pack_ppn( void )
 	char* imghdr = NULL;
 	bool error = false;
 	aricoder* encoder;
+	int nbands;
 	
 	
 	// parse PNM file header
@@ -1312,34 +1351,40 @@ INTERN bool pack_ppn( void )
 	// write PPN file header
 	imghdr[0] = 'S';
 	str_out->write( imghdr, 1, ( subtype != S_BMP ) ? strlen( imghdr ) : INT_LE( imghdr + 0x0A ) );
-	str_out->write( ( void* ) &appversion, 1, 1 );
+	nbands = ppn_band_count();
+	str_out->write( ( void* ) ( ( nbands > 1 ) ? &bandversion : &appversion ), 1, 1 );
+	
+	if ( nbands > 1 ) {
+		// large RGBA/E image, bands are coded in parallel
+		if ( !(ppn_encode_imgdata_bands( str_in, nbands )) ) error = true;
+	} else {
+		// init arithmetic compression
+		encoder = new aricoder( str_out, 1 );
 		
-	// init arithmetic compression
-	encoder = new aricoder( str_out, 1 );
-	
-	// arithmetic encode image data (select method)
-	switch ( imgbpp ) {
-		case  1:
-			if ( !(ppn_encode_imgdata_mono( encoder, str_in )) ) error = true;
-			break;
-		case  4:
-		case  8:
-			if ( subtype == S_BMP ) {
-				if ( !(ppn_encode_imgdata_palette( encoder, str_in )) ) error = true;
-			} else if ( !(ppn_encode_imgdata_rgba( encoder, str_in )) ) error = true;
-			break;
-		case 16:
-		case 24:
-		case 32:
-		case 48:
-			if ( !(ppn_encode_imgdata_rgba( encoder, str_in )) ) error = true;
-			break;
-		default: sprintf( errormessage, "%ibpp is not supported", imgbpp ); error = true; break;
+		// arithmetic encode image data (select method)
+		switch ( imgbpp ) {
+			case  1:
+				if ( !(ppn_encode_imgdata_mono( encoder, str_in )) ) error = true;
+				break;
+			case  4:
+			case  8:
+				if ( subtype == S_BMP ) {
+					if ( !(ppn_encode_imgdata_palette( encoder, str_in )) ) error = true;
+				} else if ( !(ppn_encode_imgdata_rgba( encoder, str_in )) ) error = true;
+				break;
+			case 16:
+			case 24:
+			case 32:
+			case 48:
+				if ( !(ppn_encode_imgdata_rgba( encoder, str_in )) ) error = true;
+				break;
+			default: sprintf( errormessage, "%ibpp is not supported", imgbpp ); error = true; break;
+		}
+		
+		// finalize arithmetic compression
+		delete( encoder );
 	}
 	
-	// finalize arithmetic compression
-	delete( encoder );
-	
 	// error flag set?
 	if ( error ) return false;
 	
@@ -1402,7 +1447,7 @@ INTERN bool unpack_ppn( void )
 		endian_l = E_LITTLE; // bad (mixed endianness!) (!!!)
 		ver = 16; // compatibility hack for v1.4
 	}
-	if ( ver != appversion ) {
+	if ( ( ver != appversion ) && ( ( ver != bandversion ) || !ppn_rgba_coded() ) ) {
 		sprintf( errormessage, "incompatible file, use %s v%i.%i",
 			appname, ver / 10, ver % 10 );
 		errorlevel = 2;
@@ -1413,32 +1458,36 @@ INTERN bool unpack_ppn( void )
 	imghdr[0] = ( subtype == S_BMP ) ? 'B' : ( subtype == S_HDR ) ? '#' : 'P';
 	str_out->write( imghdr, 1, ( subtype != S_BMP ) ? strlen( imghdr ) : INT_LE( imghdr + 0x0A ) );
 	
-	// init arithmetic compression
-	decoder = new aricoder( str_in, 0 );
-	
-	// arithmetic decode image data (select method)
-	switch ( imgbpp ) {
-		case  1:
-			if ( !(ppn_decode_imgdata_mono( decoder, str_out )) ) error = true;
-			break;
-		case  4:
-		case  8:
-			if ( subtype == S_BMP ) {
-				if ( !(ppn_decode_imgdata_palette( decoder, str_out )) ) error = true;
-			} else if ( !(ppn_decode_imgdata_rgba( decoder, str_out )) ) error = true;
-			break;
-		case 16:
-		case 24:
-		case 32:
-		case 48:
-			if ( !(ppn_decode_imgdata_rgba( decoder, str_out )) ) error = true;
-			break;
-		default: error = true;
+	if ( ver == bandversion ) {
+		if ( !(ppn_decode_imgdata_bands( str_in, str_out )) ) error = true;
+	} else {
+		// init arithmetic compression
+		decoder = new aricoder( str_in, 0 );
+		
+		// arithmetic decode image data (select method)
+		switch ( imgbpp ) {
+			case  1:
+				if ( !(ppn_decode_imgdata_mono( decoder, str_out )) ) error = true;
+				break;
+			case  4:
+			case  8:
+				if ( subtype == S_BMP ) {
+					if ( !(ppn_decode_imgdata_palette( decoder, str_out )) ) error = true;
+				} else if ( !(ppn_decode_imgdata_rgba( decoder, str_out )) ) error = true;
+				break;
+			case 16:
+			case 24:
+			case 32:
+			case 48:
+				if ( !(ppn_decode_imgdata_rgba( decoder, str_out )) ) error = true;
+				break;
+			default: error = true;
+		}
+		
+		// finalize arithmetic decompression
+		delete( decoder );
 	}
 	
-	// finalize arithmetic decompression
-	delete( decoder );
-	
 	// error flag set?
 	if ( error ) return false;
 	
@@ -1466,66 +1515,162 @@ INTERN bool unpack_ppn( void )
 /* ----------------------- Begin of side functions -------------------------- */
 
 
+/* -----------------------------------------------
+	sets up a band for the whole image
+	----------------------------------------------- */
+INTERN inline void ppn_band_init( ppn_band* band, int rows )
+{
+	int c;
+	
+	
+	band->img = NULL;
+	band->rows = rows;
+	band->width = imgwidth;
+	band->cmpc = cmpc;
+	for ( c = 0; c < cmpc; c++ )
+		band->mmax[c] = ( pnmax == 0 ) ? cmask[c]->m : pnmax;
+	band->data = NULL;
+	band->size = 0;
+	band->ok = false;
+}
+
+
+/* -----------------------------------------------
+	true if the image goes through the RGBA/E coder
+	----------------------------------------------- */
+INTERN inline bool ppn_rgba_coded( void )
+{
+	switch ( imgbpp ) {
+		case  4:
+		case  8:
+			return ( subtype != S_BMP );
+		case 16:
+		case 24:
+		case 32:
+		case 48:
+			return true;
+		default: return false;
+	}
+}
+
+
+/* -----------------------------------------------
+	number of bands for RGBA/E coding
+	----------------------------------------------- */
+INTERN inline int ppn_band_count( void )
+{
+	int n;
+	
+	
+	// only the RGBA/E coder is split
+	if ( !ppn_rgba_coded() ) return 1;
+	
+	// depends on the image only, so output is the same on every host
+	n = (int) ( ( (long long) imgwidth * imgheight ) / PPN_BAND_PIXELS );
+	if ( n > imgheight / PPN_BAND_ROWS ) n = imgheight / PPN_BAND_ROWS;
+	if ( n > PPN_BANDS_MAX ) n = PPN_BANDS_MAX;
+	
+	return ( n < 1 ) ? 1 : n;
+}
+
+
 /* -----------------------------------------------
 	PPN PJG type RGBA/E encoding
 	----------------------------------------------- */
 INTERN bool ppn_encode_imgdata_rgba( aricoder* enc, iostream* stream )
+{
+	ppn_band band;
+	
+	
+	ppn_band_init( &band, imgheight );
+	
+	return ppn_encode_band_rgba( enc, &band, stream );
+}
+
+
+/* -----------------------------------------------
+	PPN PJG type RGBA/E decoding
+	----------------------------------------------- */
+INTERN bool ppn_decode_imgdata_rgba( aricoder* dec, iostream* stream )
+{
+	ppn_band band;
+	
+	
+	ppn_band_init( &band, imgheight );
+	
+	return ppn_decode_band_rgba( dec, &band, stream );
+}
+
+
+/* -----------------------------------------------
+	RGBA/E encoding of a band of rows, read from
+	stream, or from band->img if stream is NULL
+	----------------------------------------------- */
+INTERN bool ppn_encode_band_rgba( aricoder* enc, ppn_band* band, iostream* stream )
 {
 	pjg_model* mod[4];
 	int* storage; // storage array
 	int* val[4][2] = { { NULL } };
 	int* err[4][2] = { { NULL } };
 	int* dta[4] = { NULL };
+	int width = band->width;
+	int ncmp = band->cmpc;
 	int c, x, y;
 	
 	
 	// init models
-	for ( c = 0; c < cmpc; c++ )
-		mod[c] = new pjg_model(
-			( pnmax == 0 ) ? cmask[c]->m : pnmax,
-			( ( c < 3 ) && ( cmpc >= 3 ) ) ? 3 : 2 );
+	for ( c = 0; c < ncmp; c++ )
+		mod[c] = new pjg_model( band->mmax[c],
+			( ( c < 3 ) && ( ncmp >= 3 ) ) ? 3 : 2 );
 	
 	// allocate storage memory
-	storage = (int*) calloc( ( imgwidth + 2 ) * 4 * cmpc, sizeof( int ) );
+	storage = (int*) calloc( ( width + 2 ) * 4 * ncmp, sizeof( int ) );
 	if ( storage == NULL ) {
 		sprintf( errormessage, MEM_ERRMSG );
 		errorlevel = 2;
+		for ( c = 0; c < ncmp; c++ ) delete( mod[c] );
 		return false;
 	}
 	
 	// arithmetic compression loop
-	for ( y = 0; y < imgheight; y++ ) {
+	for ( y = 0; y < band->rows; y++ ) {
 		// set pointers
-		for ( c = 0; c < cmpc; c++ ) {
-			val[c][0] = storage + 2 + ( ( imgwidth + 2 ) * ( 0 + (4*c) + ( (y+0) % 2 ) ) );
-			val[c][1] = storage + 2 + ( ( imgwidth + 2 ) * ( 0 + (4*c) + ( (y+1) % 2 ) ) );
-			err[c][0] = storage + 2 + ( ( imgwidth + 2 ) * ( 2 + (4*c) + ( (y+0) % 2 ) ) );
-			err[c][1] = storage + 2 + ( ( imgwidth + 2 ) * ( 2 + (4*c) + ( (y+1) % 2 ) ) );
+		for ( c = 0; c < ncmp; c++ ) {
+			val[c][0] = storage + 2 + ( ( width + 2 ) * ( 0 + (4*c) + ( (y+0) % 2 ) ) );
+			val[c][1] = storage + 2 + ( ( width + 2 ) * ( 0 + (4*c) + ( (y+1) % 2 ) ) );
+			err[c][0] = storage + 2 + ( ( width + 2 ) * ( 2 + (4*c) + ( (y+0) % 2 ) ) );
+			err[c][1] = storage + 2 + ( ( width + 2 ) * ( 2 + (4*c) + ( (y+1) % 2 ) ) );
 			dta[c] = val[c][0];
 		}
-		// read line
-		errorlevel = pnm_read_line( stream, dta );
-		if ( errorlevel == 1 ) sprintf( errormessage, ( subtype == S_HDR ) ?
-			"bitwise reconstruction of HDR RLE not guaranteed" : "excess data or bad data found"  );
-		else if ( errorlevel == 2 ) {
-			sprintf( errormessage, "unexpected end of file"  );
-			free( storage );
-			for ( c = 0; c < cmpc; c++ ) delete( mod[c] );
-			return false;
-		}
+		if ( stream != NULL ) {
+			// read line
+			errorlevel = pnm_read_line( stream, dta );
+			if ( errorlevel == 1 ) sprintf( errormessage, ( subtype == S_HDR ) ?
+				"bitwise reconstruction of HDR RLE not guaranteed" : "excess data or bad data found"  );
+			else if ( errorlevel == 2 ) {
+				sprintf( errormessage, "unexpected end of file"  );
+				free( storage );
+				for ( c = 0; c < ncmp; c++ ) delete( mod[c] );
+				return false;
+			}
+		} else for ( c = 0; c < ncmp; c++ )
+			memcpy( dta[c], band->img + ( (size_t) y * ncmp + c ) * width, width * sizeof( int ) );
+		// all values of the line are known, predict them in one go
+		for ( c = 0; c < ncmp; c++ )
+			ppn_predict_line( err[c][0], val[c][0], val[c][1], width );
 		// encode pixel values
-		for ( x = 0; x < imgwidth; x++ ) {
-			if ( cmpc == 1 ) {
+		for ( x = 0; x < width; x++ ) {
+			if ( ncmp == 1 ) {
 				ppn_encode_pjg( enc, mod[0], val[0], err[0], -1 );
 			} else { // cmpc >= 3
-				if ( cmpc > 3 ) ppn_encode_pjg( enc, mod[3], val[3], err[3], -1 );
+				if ( ncmp > 3 ) ppn_encode_pjg( enc, mod[3], val[3], err[3], -1 );
 				ppn_encode_pjg( enc, mod[0], val[0], err[0], BITLENB16N(err[2][0][-1]) );
 				ppn_encode_pjg( enc, mod[2], val[2], err[2], BITLENB16N(err[0][0][0]) );
 				ppn_encode_pjg( enc, mod[1], val[1], err[1],
 					( BITLENB16N(err[0][0][0]) + BITLENB16N(err[2][0][0]) + 1 ) / 2 );
 			}
 			// advance values
-			for ( c = 0; c < cmpc; c++ ) {
+			for ( c = 0; c < ncmp; c++ ) {
 				val[c][0]++; val[c][1]++; err[c][0]++; err[c][1]++;
 			}
 		}
@@ -1533,7 +1678,7 @@ INTERN bool ppn_encode_imgdata_rgba( aricoder* enc, iostream* stream )
 	
 	// free storage / clear models
 	free( storage );
-	for ( c = 0; c < cmpc; c++ ) delete( mod[c] );
+	for ( c = 0; c < ncmp; c++ ) delete( mod[c] );
 	
 	
 	return true;
@@ -1541,65 +1686,309 @@ INTERN bool ppn_encode_imgdata_rgba( aricoder* enc, iostream* stream )
 
 
 /* -----------------------------------------------
-	PPN PJG type RGBA/E decoding
+	RGBA/E decoding of a band of rows, written to
+	stream, or to band->img if stream is NULL
 	----------------------------------------------- */
-INTERN bool ppn_decode_imgdata_rgba( aricoder* dec, iostream* stream )
+INTERN bool ppn_decode_band_rgba( aricoder* dec, ppn_band* band, iostream* stream )
 {
 	pjg_model* mod[4];
 	int* storage; // storage array
 	int* val[4][2] = { { NULL } };
 	int* err[4][2] = { { NULL } };
 	int* dta[4] = { NULL };
+	int width = band->width;
+	int ncmp = band->cmpc;
 	int c, x, y;
 	
 	
 	// init models
-	for ( c = 0; c < cmpc; c++ )
-		mod[c] = new pjg_model(
-			( pnmax == 0 ) ? cmask[c]->m : pnmax,
-			( ( c < 3 ) && ( cmpc >= 3 ) ) ? 3 : 2 );
+	for ( c = 0; c < ncmp; c++ )
+		mod[c] = new pjg_model( band->mmax[c],
+			( ( c < 3 ) && ( ncmp >= 3 ) ) ? 3 : 2 );
 	
 	// allocate storage memory
-	storage = (int*) calloc( ( imgwidth + 2 ) * 4 * cmpc, sizeof( int ) );
+	storage = (int*) calloc( ( width + 2 ) * 4 * ncmp, sizeof( int ) );
 	if ( storage == NULL ) {
 		sprintf( errormessage, MEM_ERRMSG );
 		errorlevel = 2;
+		for ( c = 0; c < ncmp; c++ ) delete( mod[c] );
 		return false;
 	}
 	
 	// arithmetic compression loop
-	for ( y = 0; y < imgheight; y++ ) {
+	for ( y = 0; y < band->rows; y++ ) {
 		// set pointers
-		for ( c = 0; c < cmpc; c++ ) {
-			val[c][0] = storage + 2 + ( ( imgwidth + 2 ) * ( 0 + (4*c) + ( (y+0) % 2 ) ) );
-			val[c][1] = storage + 2 + ( ( imgwidth + 2 ) * ( 0 + (4*c) + ( (y+1) % 2 ) ) );
-			err[c][0] = storage + 2 + ( ( imgwidth + 2 ) * ( 2 + (4*c) + ( (y+0) % 2 ) ) );
-			err[c][1] = storage + 2 + ( ( imgwidth + 2 ) * ( 2 + (4*c) + ( (y+1) % 2 ) ) );
+		for ( c = 0; c < ncmp; c++ ) {
+			val[c][0] = storage + 2 + ( ( width + 2 ) * ( 0 + (4*c) + ( (y+0) % 2 ) ) );
+			val[c][1] = storage + 2 + ( ( width + 2 ) * ( 0 + (4*c) + ( (y+1) % 2 ) ) );
+			err[c][0] = storage + 2 + ( ( width + 2 ) * ( 2 + (4*c) + ( (y+0) % 2 ) ) );
+			err[c][1] = storage + 2 + ( ( width + 2 ) * ( 2 + (4*c) + ( (y+1) % 2 ) ) );
 			dta[c] = val[c][0];
 		}
 		// decode pixel values
-		for ( x = 0; x < imgwidth; x++ ) {
-			if ( cmpc == 1 ) {
+		for ( x = 0; x < width; x++ ) {
+			if ( ncmp == 1 ) {
 				ppn_decode_pjg( dec, mod[0], val[0], err[0], -1 );
 			} else { // cmpc >= 3
-				if ( cmpc > 3 ) ppn_decode_pjg( dec, mod[3], val[3], err[3], -1 );
+				if ( ncmp > 3 ) ppn_decode_pjg( dec, mod[3], val[3], err[3], -1 );
 				ppn_decode_pjg( dec, mod[0], val[0], err[0], BITLENB16N(err[2][0][-1]) );
 				ppn_decode_pjg( dec, mod[2], val[2], err[2], BITLENB16N(err[0][0][0]) );
 				ppn_decode_pjg( dec, mod[1], val[1], err[1],
 					( BITLENB16N(err[0][0][0]) + BITLENB16N(err[2][0][0]) + 1 ) / 2 );
 			}
 			// advance values
-			for ( c = 0; c < cmpc; c++ ) {
+			for ( c = 0; c < ncmp; c++ ) {
 				val[c][0]++; val[c][1]++; err[c][0]++; err[c][1]++;
 			}
 		}
 		// write line
-		pnm_write_line( stream, dta );
+		if ( stream != NULL ) pnm_write_line( stream, dta );
+		else for ( c = 0; c < ncmp; c++ )
+			memcpy( band->img + ( (size_t) y * ncmp + c ) * width, dta[c], width * sizeof( int ) );
 	}	
 	
 	// free storage / clear models
 	free( storage );
-	for ( c = 0; c < cmpc; c++ ) delete( mod[c] );
+	for ( c = 0; c < ncmp; c++ ) delete( mod[c] );
+	
+	
+	return true;
+}
+
+
+/* -----------------------------------------------
+	band worker: encode into memory
+	----------------------------------------------- */
+INTERN void* ppn_encode_band_thread( void* arg )
+{
+	ppn_band* band = (ppn_band*) arg;
+	iostream* str;
+	aricoder* enc;
+	
+	
+	str = new iostream( NULL, 1, 0, 1 );
+	enc = new aricoder( str, 1 );
+	band->ok = ppn_encode_band_rgba( enc, band, NULL );
+	delete( enc );
+	band->size = str->getsize();
+	band->data = str->getptr();
+	if ( band->data == NULL ) band->ok = false;
+	delete( str );
+	
+	return NULL;
+}
+
+
+/* -----------------------------------------------
+	band worker: decode from memory
+	----------------------------------------------- */
+INTERN void* ppn_decode_band_thread( void* arg )
+{
+	ppn_band* band = (ppn_band*) arg;
+	iostream* str;
+	aricoder* dec;
+	
+	
+	str = new iostream( band->data, 1, band->size, 0 );
+	dec = new aricoder( str, 0 );
+	band->ok = ppn_decode_band_rgba( dec, band, NULL );
+	delete( dec );
+	delete( str );
+	
+	return NULL;
+}
+
+
+/* -----------------------------------------------
+	runs the worker on every band, band 0 in
+	the calling thread
+	----------------------------------------------- */
+INTERN void ppn_run_bands( void* (*worker)( void* ), ppn_band* band, int nbands )
+{
+	pthread_t tid[ PPN_BANDS_MAX ];
+	bool started[ PPN_BANDS_MAX ];
+	int b;
+	
+	
+	for ( b = 1; b < nbands; b++ ) {
+		started[b] = ( pthread_create( &tid[b], NULL, worker, &band[b] ) == 0 );
+		if ( !started[b] ) worker( &band[b] );
+	}
+	worker( &band[0] );
+	for ( b = 1; b < nbands; b++ )
+		if ( started[b] ) pthread_join( tid[b], NULL );
+}
+
+
+/* -----------------------------------------------
+	PPN banded RGBA/E encoding: the image is
+	split into bands of rows, each coded with
+	its own models in its own thread
+	----------------------------------------------- */
+INTERN bool ppn_encode_imgdata_bands( iostream* stream, int nbands )
+{
+	ppn_band band[ PPN_BANDS_MAX ];
+	unsigned char hdr[ 4 ];
+	int* img;
+	int* line;
+	int* dta[4] = { NULL };
+	int rpb, lw, b, c, y;
+	bool error = false;
+	
+	
+	// read all lines, with some slack per line for packed formats
+	lw = imgwidth + 16;
+	img = (int*) malloc( (size_t) imgwidth * imgheight * cmpc * sizeof( int ) );
+	line = (int*) calloc( lw * cmpc, sizeof( int ) );
+	if ( ( img == NULL ) || ( line == NULL ) ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		free( img ); free( line );
+		return false;
+	}
+	for ( c = 0; c < cmpc; c++ ) dta[c] = line + ( c * lw );
+	for ( y = 0; y < imgheight; y++ ) {
+		errorlevel = pnm_read_line( stream, dta );
+		if ( errorlevel == 1 ) sprintf( errormessage, ( subtype == S_HDR ) ?
+			"bitwise reconstruction of HDR RLE not guaranteed" : "excess data or bad data found"  );
+		else if ( errorlevel == 2 ) {
+			sprintf( errormessage, "unexpected end of file"  );
+			free( img ); free( line );
+			return false;
+		}
+		for ( c = 0; c < cmpc; c++ )
+			memcpy( img + ( (size_t) y * cmpc + c ) * imgwidth, dta[c], imgwidth * sizeof( int ) );
+	}
+	free( line );
+	
+	// encode bands
+	rpb = ( imgheight + nbands - 1 ) / nbands;
+	for ( b = 0; b < nbands; b++ ) {
+		ppn_band_init( &band[b], ( b < nbands - 1 ) ? rpb : imgheight - ( b * rpb ) );
+		band[b].img = img + ( (size_t) b * rpb * cmpc * imgwidth );
+	}
+	ppn_run_bands( ppn_encode_band_thread, band, nbands );
+	free( img );
+	for ( b = 0; b < nbands; b++ )
+		if ( !band[b].ok ) error = true;
+	
+	// band count, band sizes, then band data
+	if ( !error ) {
+		hdr[0] = (unsigned char) nbands;
+		str_out->write( hdr, 1, 1 );
+		for ( b = 0; b < nbands; b++ ) {
+			hdr[0] = ( band[b].size >>  0 ) & 0xFF;
+			hdr[1] = ( band[b].size >>  8 ) & 0xFF;
+			hdr[2] = ( band[b].size >> 16 ) & 0xFF;
+			hdr[3] = ( band[b].size >> 24 ) & 0xFF;
+			str_out->write( hdr, 1, 4 );
+		}
+		for ( b = 0; b < nbands; b++ )
+			str_out->write( band[b].data, 1, band[b].size );
+	} else {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+	}
+	for ( b = 0; b < nbands; b++ ) free( band[b].data );
+	
+	
+	return !error;
+}
+
+
+/* -----------------------------------------------
+	PPN banded RGBA/E decoding
+	----------------------------------------------- */
+INTERN bool ppn_decode_imgdata_bands( iostream* in, iostream* out )
+{
+	ppn_band band[ PPN_BANDS_MAX ];
+	unsigned char hdr[ 4 ];
+	int* img;
+	int* line;
+	int* dta[4] = { NULL };
+	int nbands, rpb, lw, b, c, y;
+	bool error = false;
+	
+	
+	// read band count and sizes
+	if ( in->read( hdr, 1, 1 ) != 1 ) {
+		sprintf( errormessage, "unexpected end of file" );
+		errorlevel = 2;
+		return false;
+	}
+	nbands = hdr[0];
+	rpb = ( nbands > 0 ) ? ( imgheight + nbands - 1 ) / nbands : 0;
+	if ( ( nbands < 2 ) || ( nbands > PPN_BANDS_MAX ) || ( ( nbands - 1 ) * rpb >= imgheight ) ) {
+		sprintf( errormessage, "bad band count in file" );
+		errorlevel = 2;
+		return false;
+	}
+	for ( b = 0; b < nbands; b++ ) {
+		ppn_band_init( &band[b], ( b < nbands - 1 ) ? rpb : imgheight - ( b * rpb ) );
+		if ( in->read( hdr, 1, 4 ) != 4 ) error = true;
+		band[b].size = INT_LE( hdr );
+		if ( band[b].size <= 0 ) error = true;
+	}
+	if ( error ) {
+		sprintf( errormessage, "unexpected end of file" );
+		errorlevel = 2;
+		return false;
+	}
+	
+	// read band data
+	img = (int*) malloc( (size_t) imgwidth * imgheight * cmpc * sizeof( int ) );
+	for ( b = 0; b < nbands; b++ ) {
+		band[b].img = ( img == NULL ) ? NULL : img + ( (size_t) b * rpb * cmpc * imgwidth );
+		band[b].data = ( unsigned char* ) malloc( band[b].size );
+		if ( band[b].data == NULL ) error = true;
+	}
+	if ( ( img == NULL ) || error ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		for ( b = 0; b < nbands; b++ ) free( band[b].data );
+		free( img );
+		return false;
+	}
+	for ( b = 0; b < nbands; b++ ) {
+		if ( in->read( band[b].data, 1, band[b].size ) != band[b].size ) {
+			sprintf( errormessage, "unexpected end of file" );
+			errorlevel = 2;
+			for ( b = 0; b < nbands; b++ ) free( band[b].data );
+			free( img );
+			return false;
+		}
+	}
+	
+	// decode bands
+	ppn_run_bands( ppn_decode_band_thread, band, nbands );
+	for ( b = 0; b < nbands; b++ ) {
+		if ( !band[b].ok ) error = true;
+		free( band[b].data );
+	}
+	if ( error ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		free( img );
+		return false;
+	}
+	
+	// write lines, with slack as in reading
+	lw = imgwidth + 16;
+	line = (int*) calloc( lw * cmpc, sizeof( int ) );
+	if ( line == NULL ) {
+		sprintf( errormessage, MEM_ERRMSG );
+		errorlevel = 2;
+		free( img );
+		return false;
+	}
+	for ( c = 0; c < cmpc; c++ ) dta[c] = line + ( c * lw );
+	for ( y = 0; y < imgheight; y++ ) {
+		for ( c = 0; c < cmpc; c++ )
+			memcpy( dta[c], img + ( (size_t) y * cmpc + c ) * imgwidth, imgwidth * sizeof( int ) );
+		pnm_write_line( out, dta );
+	}
+	free( line );
+	free( img );
 	
 	
 	return true;
@@ -1819,8 +2208,7 @@ INTERN inline void ppn_encode_pjg( aricoder* enc, pjg_model* mod, int** val, int
 	int clen, absv, sgn;
 	int bt, bp;
 
-	// calculate prediction error
-	**err = **val - plocoi( val[0][-1], val[1][0], val[1][-1] );
+	// prediction error is set by ppn_predict_line()
 	
 	// encode bit length
 	clen = BITLENB16N( **err );
@@ -1961,6 +2349,39 @@ INTERN inline int plocoi( int a, int b, int c )
 }
 
 
+/* -----------------------------------------------
+	loco-i prediction errors for a whole line,
+	the median of left, above and left + above
+	- above-left equals plocoi()
+	----------------------------------------------- */
+INTERN inline void ppn_predict_line( int* err, int* val, int* above, int width )
+{
+	int x = 0;
+	
+	
+	#if defined(PPN_SSE2)
+	for ( ; x + 4 <= width; x += 4 ) {
+		__m128i a = _mm_loadu_si128( (const __m128i*) ( val + x - 1 ) );
+		__m128i b = _mm_loadu_si128( (const __m128i*) ( above + x ) );
+		__m128i c = _mm_loadu_si128( (const __m128i*) ( above + x - 1 ) );
+		__m128i v = _mm_loadu_si128( (const __m128i*) ( val + x ) );
+		__m128i g = _mm_sub_epi32( _mm_add_epi32( a, b ), c );
+		__m128i m = _mm_cmpgt_epi32( a, b );
+		__m128i mn = _mm_or_si128( _mm_and_si128( m, b ), _mm_andnot_si128( m, a ) );
+		__m128i mx = _mm_or_si128( _mm_and_si128( m, a ), _mm_andnot_si128( m, b ) );
+		// clamp a + b - c to [min, max]
+		m = _mm_cmpgt_epi32( mx, g );
+		g = _mm_or_si128( _mm_and_si128( m, g ), _mm_andnot_si128( m, mx ) );
+		m = _mm_cmpgt_epi32( mn, g );
+		g = _mm_or_si128( _mm_and_si128( m, mn ), _mm_andnot_si128( m, g ) );
+		_mm_storeu_si128( (__m128i*) ( err + x ), _mm_sub_epi32( v, g ) );
+	}
+	#endif
+	for ( ; x < width; x++ )
+		err[x] = val[x] - plocoi( val[x-1], above[x], above[x-1] );
+}
+
+
 /* -----------------------------------------------
 	PNM read line
 	----------------------------------------------- */
@@ -2161,8 +2582,8 @@ INTERN inline int pnm_write_line( iostream* stream, int** line )
 	----------------------------------------------- */
 INTERN inline int hdr_decode_line_rle( iostream* stream, int** line )
 {
-	static unsigned int* data = NULL;
-	static int prev_width = 0;	
+	static __thread unsigned int* data = NULL;
+	static __thread int prev_width = 0;	
 	unsigned int* rgb; // RGB + E
 	unsigned char bt = 0;
 	int r, rl;
@@ -2212,8 +2633,8 @@ INTERN inline int hdr_decode_line_rle( iostream* stream, int** line )
 	----------------------------------------------- */
 INTERN inline int hdr_encode_line_rle( iostream* stream, int** line )
 {
-	static unsigned int* data = NULL;
-	static int prev_width = 0;	
+	static __thread unsigned int* data = NULL;
+	static __thread int prev_width = 0;	
 	unsigned int* rgb; // RGB + E
 	unsigned int* dt;
 	unsigned char bt = 0;
@@ -22,33 +22,82 @@
  * moinakg@belenix.org, http://moinakg.wordpress.com/
  */
 
+#include <stdio.h>
 #include "transpose.h"
 
+/*
+ * The scalar path works on tiles of about this many bytes so that the side
+ * accessed with a stride stays in cache.
+ */
+#define	TRANSP_TILE	(32 * 1024)
+
+extern uint64_t transpose_row_avx2(unsigned char *from, unsigned char *to, uint64_t n,
+	uint64_t stride);
+extern uint64_t transpose_col_avx2(unsigned char *from, unsigned char *to, uint64_t n,
+	uint64_t stride);
+
+static uint64_t (*transpose_row_simd)(unsigned char *from, unsigned char *to, uint64_t n,
+	uint64_t stride) = NULL;
+static uint64_t (*transpose_col_simd)(unsigned char *from, unsigned char *to, uint64_t n,
+	uint64_t stride) = NULL;
+
+void
+transpose_module_init(processor_cap_t *pc)
+{
+	if (pc->avx_level >= 2) {
+		transpose_row_simd = transpose_row_avx2;
+		transpose_col_simd = transpose_col_avx2;
+	}
+}
+
 /*
  * Perform a simple matrix transpose of the given buffer in "from".
  * If the buffer contains tables of numbers or structured data a
  * transpose can potentially help improve compression ratio by
  * bringing repeating values in columns into row ordering.
+ *
+ * With ROW the buffer is taken as buflen / stride elements of stride bytes
+ * each and split into stride byte planes. COL does the reverse. Element
+ * sizes 2, 4, 8 and 16 use vector kernels where available.
  */
 void
 transpose(unsigned char *from, unsigned char *to, uint64_t buflen, uint64_t stride, rowcol_t rc)
 {
-	uint64_t rows, cols, i, j, k, l;
-
-	if (rc == ROW) {
-		rows = buflen / stride;
-		cols = stride;
-	} else {
-		cols = buflen / stride;
-		rows = stride;
+	uint64_t n, e, t, tend, tile, b;
+	unsigned char *f, *o;
+
+	n = buflen / stride;
+	e = 0;
+	if (stride == 2 || stride == 4 || stride == 8 || stride == 16) {
+		if (rc == ROW && transpose_row_simd)
+			e = transpose_row_simd(from, to, n, stride);
+		else if (rc == COL && transpose_col_simd)
+			e = transpose_col_simd(from, to, n, stride);
 	}
-	k = 0;
-	for (j = 0; j < rows; j++) {
-		l = 0;
-		for (i = 0; i < cols; i++) {
-			to[j + l] = from[i + k];
-			l += rows;
+
+	tile = TRANSP_TILE / stride;
+	if (tile < 64)
+		tile = 64;
+	for (t = e; t < n; t = tend) {
+		tend = t + tile;
+		if (tend > n)
+			tend = n;
+		for (b = 0; b < stride; b++) {
+			if (rc == ROW) {
+				f = from + t * stride + b;
+				o = to + b * n;
+				for (e = t; e < tend; e++) {
+					o[e] = *f;
+					f += stride;
+				}
+			} else {
+				f = from + b * n;
+				o = to + t * stride + b;
+				for (e = t; e < tend; e++) {
+					*o = f[e];
+					o += stride;
+				}
+			}
 		}
-		k += cols;
 	}
 }
@@ -0,0 +1,139 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+
+/*
+ * AVX2 byte transpose kernels for element sizes of 2, 4, 8 and 16 bytes.
+ * This file is built with AVX2 enabled and only called when the processor
+ * supports it, see transpose_module_init().
+ *
+ * Each 128-bit lane handles a block of 16 elements, viewed as s rows of 16
+ * bytes. One round of unpacklo/unpackhi_epi8 between rows i and i + s/2
+ * rotates the (row, column) byte index bits left by one. Going from
+ * elements to byte planes is a rotation by 4 and the inverse is a rotation
+ * by log2(s), so both directions are just a number of such rounds. The
+ * two lanes process consecutive blocks, giving 32 bytes per plane per pass.
+ */
+#include <immintrin.h>
+#include "transpose.h"
+
+static inline void
+unpack_rounds(__m256i *x, int s, int rounds)
+{
+	__m256i y[16];
+	int i, k, h;
+
+	h = s / 2;
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < h; i++) {
+			y[2 * i] = _mm256_unpacklo_epi8(x[i], x[i + h]);
+			y[2 * i + 1] = _mm256_unpackhi_epi8(x[i], x[i + h]);
+		}
+		for (i = 0; i < s; i++)
+			x[i] = y[i];
+	}
+}
+
+static inline uint64_t
+shuffle_blocks(unsigned char *from, unsigned char *to, uint64_t n, int s)
+{
+	__m256i x[16];
+	uint64_t e;
+	int r;
+
+	for (e = 0; e + 32 <= n; e += 32) {
+		unsigned char *src = from + e * s;
+
+		for (r = 0; r < s; r++) {
+			x[r] = _mm256_castsi128_si256(_mm_loadu_si128((__m128i *)(src + 16 * r)));
+			x[r] = _mm256_inserti128_si256(x[r],
+			    _mm_loadu_si128((__m128i *)(src + 16 * s + 16 * r)), 1);
+		}
+		unpack_rounds(x, s, 4);
+		for (r = 0; r < s; r++)
+			_mm256_storeu_si256((__m256i *)(to + r * n + e), x[r]);
+	}
+	return (e);
+}
+
+static inline uint64_t
+unshuffle_blocks(unsigned char *from, unsigned char *to, uint64_t n, int s, int lg)
+{
+	__m256i x[16];
+	uint64_t e;
+	int r;
+
+	for (e = 0; e + 32 <= n; e += 32) {
+		unsigned char *dst = to + e * s;
+
+		for (r = 0; r < s; r++)
+			x[r] = _mm256_loadu_si256((__m256i *)(from + r * n + e));
+		unpack_rounds(x, s, lg);
+		for (r = 0; r < s; r++) {
+			_mm_storeu_si128((__m128i *)(dst + 16 * r), _mm256_castsi256_si128(x[r]));
+			_mm_storeu_si128((__m128i *)(dst + 16 * s + 16 * r),
+			    _mm256_extracti128_si256(x[r], 1));
+		}
+	}
+	return (e);
+}
+
+/*
+ * Split n elements of the given size into byte planes. Returns the number
+ * of elements done, the caller transposes the rest.
+ */
+uint64_t
+transpose_row_avx2(unsigned char *from, unsigned char *to, uint64_t n, uint64_t stride)
+{
+	switch (stride) {
+	case 2:
+		return (shuffle_blocks(from, to, n, 2));
+	case 4:
+		return (shuffle_blocks(from, to, n, 4));
+	case 8:
+		return (shuffle_blocks(from, to, n, 8));
+	case 16:
+		return (shuffle_blocks(from, to, n, 16));
+	}
+	return (0);
+}
+
+/*
+ * Merge byte planes back into n elements.
+ */
+uint64_t
+transpose_col_avx2(unsigned char *from, unsigned char *to, uint64_t n, uint64_t stride)
+{
+	switch (stride) {
+	case 2:
+		return (unshuffle_blocks(from, to, n, 2, 1));
+	case 4:
+		return (unshuffle_blocks(from, to, n, 4, 2));
+	case 8:
+		return (unshuffle_blocks(from, to, n, 8, 3));
+	case 16:
+		return (unshuffle_blocks(from, to, n, 16, 4));
+	}
+	return (0);
+}
@@ -25,8 +25,10 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
+#include <pthread.h>
 #include <utils.h>
 #include <pcompress.h>
 #include <allocator.h>
@@ -41,8 +43,80 @@ struct libbsc_params {
 	int bscCoder;
 	int features;
 	int oldversion;
+	int gpu;
 };
 
+#ifdef LIBBSC_CUDA_SUPPORT
+/*
+ * GPU offload of the block sorting transform. Libbsc runs one block on the
+ * GPU at a time, so chunk threads queue for the device on the host side.
+ * At most gpu_depth chunks are admitted to the queue, including the one on
+ * the GPU. Other chunk threads sort on the CPU meanwhile instead of waiting.
+ */
+#define	GPU_MAX_DEPTH	64
+
+static int gpu_depth = 0;
+static int gpu_admitted = 0;
+static int gpu_busy = 0;
+static uint64_t gpu_chunks = 0, cpu_chunks = 0, gpu_fallbacks = 0;
+static pthread_mutex_t gpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gpu_cv = PTHREAD_COND_INITIALIZER;
+
+/*
+ * PCOMPRESS_BSC_GPU=<n> sets the queue depth, 0 disables the GPU.
+ */
+static int
+libbsc_gpu_depth(void)
+{
+	char *val;
+	int d;
+
+	if ((val = getenv("PCOMPRESS_BSC_GPU")) == NULL)
+		return (2);
+	d = atoi(val);
+	if (d < 0)
+		d = 0;
+	if (d > GPU_MAX_DEPTH)
+		d = GPU_MAX_DEPTH;
+	return (d);
+}
+
+/*
+ * Enter the GPU queue if it has room. Returns 1 when this thread now owns
+ * the GPU and 0 if the chunk should be sorted on the CPU.
+ */
+static int
+libbsc_gpu_enter(void)
+{
+	pthread_mutex_lock(&gpu_lock);
+	if (gpu_admitted >= gpu_depth) {
+		cpu_chunks++;
+		pthread_mutex_unlock(&gpu_lock);
+		return (0);
+	}
+	gpu_admitted++;
+	while (gpu_busy)
+		pthread_cond_wait(&gpu_cv, &gpu_lock);
+	gpu_busy = 1;
+	pthread_mutex_unlock(&gpu_lock);
+	return (1);
+}
+
+static void
+libbsc_gpu_leave(int failed)
+{
+	pthread_mutex_lock(&gpu_lock);
+	gpu_busy = 0;
+	gpu_admitted--;
+	if (failed)
+		gpu_fallbacks++;
+	else
+		gpu_chunks++;
+	pthread_cond_signal(&gpu_cv);
+	pthread_mutex_unlock(&gpu_lock);
+}
+#endif
+
 static void
 libbsc_err(int err) {
 	switch (err) {
@@ -61,12 +135,31 @@ libbsc_err(int err) {
 	    case LIBBSC_DATA_CORRUPT:
 		log_msg(LOG_ERR, 0, "LIBBSC: Corrupt data.\n");
 		break;
+	    case LIBBSC_GPU_ERROR:
+		log_msg(LOG_ERR, 0, "LIBBSC: GPU error.\n");
+		break;
+	    case LIBBSC_GPU_NOT_SUPPORTED:
+		log_msg(LOG_ERR, 0, "LIBBSC: GPU not supported.\n");
+		break;
+	    case LIBBSC_GPU_NOT_ENOUGH_MEMORY:
+		log_msg(LOG_ERR, 0, "LIBBSC: Out of GPU memory.\n");
+		break;
 	}
 }
 
 void
 libbsc_stats(int show)
 {
+#ifdef LIBBSC_CUDA_SUPPORT
+	if (show && gpu_depth > 0) {
+		log_msg(LOG_INFO, 0, "LIBBSC: Chunks sorted on GPU: %" PRIu64 ", on CPU: %"
+		    PRIu64 ", GPU failures: %" PRIu64 "\n", gpu_chunks, cpu_chunks,
+		    gpu_fallbacks);
+	}
+	gpu_chunks = 0;
+	cpu_chunks = 0;
+	gpu_fallbacks = 0;
+#endif
 }
 
 int
@@ -79,7 +172,8 @@ libbsc_buf_extra(uint64_t buflen)
 /*
  * BSC uses OpenMP where it does not control thread count
  * deterministically. We only use multithread capability in BSC
- * when compressing entire file in a single chunk.
+ * when there are fewer chunks than processors. The OpenMP thread
+ * count of the calling chunk thread is set per chunk.
  */
 void
 libbsc_props(algo_props_t *data, int level, uint64_t chunksize) {
@@ -94,6 +188,8 @@ libbsc_props(algo_props_t *data, int level, uint64_t chunksize) {
 		data->deltac_min_distance = FOURM;
 	else
 		data->deltac_min_distance = EIGHTM;
+	/* The block sorter needs about five bytes per input byte. */
+	data->state_mem = chunksize * 5;
 }
 
 int
@@ -137,6 +233,26 @@ libbsc_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		bscdat->oldversion = 1;
 	}
 	*data = bscdat;
+	bscdat->gpu = 0;
+#ifdef LIBBSC_CUDA_SUPPORT
+	/*
+	 * Only the forward transform runs on the GPU. A failed GPU setup
+	 * leaves the CPU path in place for all threads.
+	 */
+	if (op == COMPRESS) {
+		pthread_mutex_lock(&gpu_lock);
+		if (gpu_depth == 0 && (gpu_depth = libbsc_gpu_depth()) > 0) {
+			rv = bsc_init(bscdat->features | LIBBSC_FEATURE_CUDA);
+			if (rv != LIBBSC_NO_ERROR) {
+				libbsc_err(rv);
+				log_msg(LOG_WARN, 0, "LIBBSC: Using the CPU only.\n");
+				gpu_depth = -1;
+			}
+		}
+		bscdat->gpu = (gpu_depth > 0);
+		pthread_mutex_unlock(&gpu_lock);
+	}
+#endif
 	rv = bsc_init(bscdat->features);
 	if (rv != LIBBSC_NO_ERROR) {
 		libbsc_err(rv);
@@ -171,6 +287,24 @@ libbsc_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 			return (-1);
 	}
 
+#ifdef LIBBSC_CUDA_SUPPORT
+	/*
+	 * The GPU produces the same BWT as the CPU, so the output format is
+	 * unchanged. A chunk the GPU cannot take is redone on the CPU.
+	 */
+	if (bscdat->gpu && libbsc_gpu_enter()) {
+		rv = bsc_compress(src, dst, srclen, bscdat->lzpHashSize, bscdat->lzpMinLen,
+		    LIBBSC_BLOCKSORTER_BWT, bscdat->bscCoder,
+		    bscdat->features | LIBBSC_FEATURE_CUDA);
+		libbsc_gpu_leave(rv < 0);
+		if (rv >= 0) {
+			*dstlen = rv;
+			return (0);
+		}
+		if (rv == LIBBSC_GPU_NOT_SUPPORTED)
+			bscdat->gpu = 0;
+	}
+#endif
 	rv = bsc_compress(src, dst, srclen, bscdat->lzpHashSize, bscdat->lzpMinLen,
 	    LIBBSC_BLOCKSORTER_BWT, bscdat->bscCoder, bscdat->features);
 	if (rv < 0) {
@@ -354,7 +354,8 @@ static inline int LZ4_compressCtx(void** ctx,
                  const char* source,
                  char* dest,
                  int isize,
-                 int maxOutputSize)
+                 int maxOutputSize,
+                 int acceleration)
 {
 #if HEAPMODE
     struct refTables *srt = (struct refTables *) (*ctx);
@@ -400,7 +401,7 @@ static inline int LZ4_compressCtx(void** ctx,
     // Main Loop
     for ( ; ; )
     {
-        int findMatchAttempts = (1U << skipStrength) + 3;
+        int findMatchAttempts = (acceleration << skipStrength) + 3;
         const BYTE* forwardIp = ip;
         const BYTE* ref;
         BYTE* token;
@@ -520,7 +521,8 @@ static inline int LZ4_compress64kCtx(void** ctx,
                  const char* source,
                  char* dest,
                  int isize,
-                 int maxOutputSize)
+                 int maxOutputSize,
+                 int acceleration)
 {
 #if HEAPMODE
     struct refTables *srt = (struct refTables *) (*ctx);
@@ -565,7 +567,7 @@ static inline int LZ4_compress64kCtx(void** ctx,
     // Main Loop
     for ( ; ; )
     {
-        int findMatchAttempts = (1U << skipStrength) + 3;
+        int findMatchAttempts = (acceleration << skipStrength) + 3;
         const BYTE* forwardIp = ip;
         const BYTE* ref;
         BYTE* token;
@@ -673,26 +675,46 @@ _last_literals:
     return (int) (((char*)op)-dest);
 }
 
-int LZ4_compress_limitedOutput(const char* source, 
+static int LZ4_compress_accel(const char* source, 
                                char* dest, 
                                int isize, 
-                               int maxOutputSize)
+                               int maxOutputSize,
+                               int acceleration)
 {
 #if HEAPMODE
     void* ctx = malloc(sizeof(struct refTables));
     int result;
     if (isize < LZ4_64KLIMIT)
-        result = LZ4_compress64kCtx(&ctx, source, dest, isize, maxOutputSize);
-    else result = LZ4_compressCtx(&ctx, source, dest, isize, maxOutputSize);
+        result = LZ4_compress64kCtx(&ctx, source, dest, isize, maxOutputSize, acceleration);
+    else result = LZ4_compressCtx(&ctx, source, dest, isize, maxOutputSize, acceleration);
     free(ctx);
     return result;
 #else
-    if (isize < (int)LZ4_64KLIMIT) return LZ4_compress64kCtx(NULL, source, dest, isize, maxOutputSize);
-    return LZ4_compressCtx(NULL, source, dest, isize, maxOutputSize);
+    if (isize < (int)LZ4_64KLIMIT) return LZ4_compress64kCtx(NULL, source, dest, isize, maxOutputSize, acceleration);
+    return LZ4_compressCtx(NULL, source, dest, isize, maxOutputSize, acceleration);
 #endif
 }
 
 
+int LZ4_compress_limitedOutput(const char* source, 
+                               char* dest, 
+                               int isize, 
+                               int maxOutputSize)
+{
+    return LZ4_compress_accel(source, dest, isize, maxOutputSize, 1);
+}
+
+
+int LZ4_compress_fast(const char* source,
+                 char* dest,
+                 int isize,
+                 int acceleration)
+{
+    if (acceleration < 1) acceleration = 1;
+    return LZ4_compress_accel(source, dest, isize, LZ4_compressBound(isize), acceleration);
+}
+
+
 int LZ4_compress(const char* source,
                  char* dest,
                  int isize)
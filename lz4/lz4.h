@@ -134,6 +134,16 @@ LZ4_compress_limitedOutput() :
 */
 
 
+int LZ4_compress_fast (const char* source, char* dest, int isize, int acceleration);
+
+/*
+LZ4_compress_fast() :
+    Same as LZ4_compress() but skips ahead faster over data where no match is found.
+    An acceleration of 1 gives the same result as LZ4_compress(), larger values trade
+    compression ratio for speed. The output is decoded by the usual functions.
+*/
+
+
 int LZ4_uncompress_unknownOutputSize (const char* source, char* dest, int isize, int maxOutputSize);
 
 /*
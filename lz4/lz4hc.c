@@ -227,6 +227,7 @@ typedef struct
 	HTYPE hashTable[HASHTABLESIZE];
 	U16 chainTable[MAXD];
 	const BYTE* nextToUpdate;
+	int nbAttempts;
 } LZ4HC_Data_Structure;
 
 
@@ -318,6 +319,7 @@ inline static int LZ4HC_Init (LZ4HC_Data_Structure* hc4, const BYTE* base)
 	MEM_INIT(hc4->chainTable, 0xFF, sizeof(hc4->chainTable));
 	hc4->nextToUpdate = base + LZ4_ARCH64;
 	hc4->base = base;
+	hc4->nbAttempts = MAX_NB_ATTEMPTS;
 	return 1;
 }
 
@@ -359,7 +361,7 @@ inline static int LZ4HC_InsertAndFindBestMatch (LZ4HC_Data_Structure* hc4, const
 	HTYPE* const HashTable = hc4->hashTable;
 	const BYTE* ref;
 	INITBASE(base,hc4->base);
-	int nbAttempts=MAX_NB_ATTEMPTS;
+	int nbAttempts=hc4->nbAttempts;
 	int ml=0;
 
 	// HC4 match finder
@@ -412,7 +414,7 @@ inline static int LZ4HC_InsertAndGetWiderMatch (LZ4HC_Data_Structure* hc4, const
 	HTYPE* const HashTable = hc4->hashTable;
 	INITBASE(base,hc4->base);
 	const BYTE*  ref;
-	int nbAttempts = MAX_NB_ATTEMPTS;
+	int nbAttempts = hc4->nbAttempts;
 	int delta = (int)(ip-startLimit);
 
 	// First Match
@@ -719,3 +721,19 @@ int LZ4_compressHC(const char* source,
 }
 
 
+int LZ4_compressHC2(const char* source, 
+				 char* dest,
+				 int isize,
+				 int nbAttempts)
+{
+	LZ4HC_Data_Structure* ctx = LZ4HC_Create((const BYTE*)source);
+	int result;
+
+	if (nbAttempts > 0) ctx->nbAttempts = nbAttempts;
+	result = LZ4_compressHCCtx(ctx, source, dest, isize);
+	LZ4HC_Free (&ctx);
+
+	return result;
+}
+
+
@@ -80,6 +80,16 @@ Decompression functions are provided within regular LZ4 source code (see "lz4.h"
 */
 
 
+int LZ4_compressHC2 (const char* source, char* dest, int isize, int nbAttempts);
+
+/*
+LZ4_compressHC2 :
+	Same as LZ4_compressHC() but follows at most nbAttempts entries of the match
+	chain at each position instead of the default 256. More attempts find longer
+	matches at the cost of compression speed. Decompression speed is not affected.
+*/
+
+
 #if defined (__cplusplus)
 }
 #endif
@@ -25,6 +25,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <limits.h>
@@ -36,8 +37,20 @@
 
 #define	LZ4_MAX_CHUNK	2147450621L
 
+/*
+ * Level 0 and 1 use the fast compressor, level 0 with acceleration. Level 2
+ * runs LZ4HC over the output of the fast compressor. Levels 3 - 9 use LZ4HC
+ * following more and more match chain entries. All but level 2 produce plain
+ * LZ4 blocks so they decode at the same speed.
+ */
+#define	LZ4_ACCEL_DEFAULT	8
+#define	LZ4_HC_STATE		(4 * 32768 + 2 * 65536)
+static const int lz4_hc_attempts[10] = {0, 0, 0, 256, 512, 1024, 2048, 4096, 8192, 16384};
+
 struct lz4_params {
 	int level;
+	int accel;
+	int attempts;
 };
 
 void
@@ -58,8 +71,11 @@ lz4_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->compress_mt_capable = 0;
 	data->decompress_mt_capable = 0;
 	data->buf_extra = lz4_buf_extra(chunksize);
+	data->decomp_direct = 1;
 	data->delta2_span = 100;
 	data->deltac_min_distance = FOURM;
+	if (level >= 2)
+		data->state_mem = LZ4_HC_STATE;
 }
 
 int
@@ -76,12 +92,16 @@ lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	}
 	lzdat = (struct lz4_params *)slab_alloc(NULL, sizeof (struct lz4_params));
 
+	if (*level > 9) *level = 9;
 	lev = *level;
-	if (lev > 3) lev = 3;
 	lzdat->level = lev;
+	lzdat->attempts = lz4_hc_attempts[lev];
+	lzdat->accel = (lev == 0 ? LZ4_ACCEL_DEFAULT : 1);
+	if (lev == 0 && getenv("PCOMPRESS_LZ4_ACCEL") != NULL) {
+		lzdat->accel = atoi(getenv("PCOMPRESS_LZ4_ACCEL"));
+		if (lzdat->accel < 1) lzdat->accel = 1;
+	}
 	*data = lzdat;
-
-	if (*level > 9) *level = 9;
 	return (0);
 }
 
@@ -106,8 +126,8 @@ lz4_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	int _srclen = srclen;
 	uchar_t *dst2;
 
-	if (lzdat->level == 1) {
-		rv = LZ4_compress((const char *)src, (char *)dst, _srclen);
+	if (lzdat->level < 2) {
+		rv = LZ4_compress_fast((const char *)src, (char *)dst, _srclen, lzdat->accel);
 
 	} else if (lzdat->level == 2) {
 		rv = LZ4_compress((const char *)src, (char *)dst, _srclen);
@@ -123,7 +143,7 @@ lz4_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 		}
 		slab_free(NULL, dst2);
 	} else {
-		rv = LZ4_compressHC((const char *)src, (char *)dst, _srclen);
+		rv = LZ4_compressHC2((const char *)src, (char *)dst, _srclen, lzdat->attempts);
 	}
 	if (rv == 0) {
 		return (-1);
@@ -141,13 +161,13 @@ lz4_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	struct lz4_params *lzdat = (struct lz4_params *)data;
 	int _dstlen = *dstlen;
 
-	if (lzdat->level == 1 || lzdat->level == 3) {
+	if (lzdat->level != 2) {
 		rv = LZ4_uncompress((const char *)src, (char *)dst, _dstlen);
 		if (rv != srclen) {
 			return (-1);
 		}
 
-	} else if (lzdat->level == 2) {
+	} else {
 		int sz1;
 
 		sz1 = ntohl(*((int *)src));
@@ -65,6 +65,12 @@
 #else
 # include <string.h>
 #endif
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __USE_SSE_INTRIN__
+#include <emmintrin.h>
+#endif
 
 #if __GNUC__ >= 3 && !DISABLE_EXPECT
 # define fx_expect_false(expr)  __builtin_expect((expr) != 0, 0)
@@ -84,9 +90,38 @@
 #define LZFX_MAX_OFF        (1 << 13)
 #define LZFX_MAX_REF        ((1 << 8) + (1 << 3))
 
+/*
+ * The bucketed hash used by lzfx_compress_hc(). Every bucket is one 64-byte
+ * cache line of LZFX_WAYS input positions stored as offset + 1, so that a
+ * zeroed table is empty. Slots are reused round-robin.
+ */
+#define LZFX_WAYS           16
+#define LZFX_BUCKET_BITS    12
+
 static
 int lzfx_getsize(const void* ibuf, unsigned int ilen, unsigned int *olen);
 
+/*  Extend a match of len bytes up to maxlen, comparing 16 bytes at a time.
+    The caller guarantees that ip + maxlen is within the input. */
+static inline
+unsigned int lzfx_match_len(const u8 *ip, const u8 *ref, unsigned int len,
+                            unsigned int maxlen){
+#ifdef __USE_SSE_INTRIN__
+    while (len + 16 <= maxlen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(ip + len));
+        __m128i b = _mm_loadu_si128((const __m128i *)(ref + len));
+        unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+
+        if (m)
+            return len + __builtin_ctz(m);
+        len += 16;
+    }
+#endif
+    while (len < maxlen && ref[len] == ip[len])
+        len++;
+    return len;
+}
+
 /* Compressed format
 
     There are two kinds of structures in LZF/LZFX: literal runs and back
@@ -182,8 +217,7 @@ int lzfx_compress(const void *const ibuf, const unsigned int ilen,
             op -= !lit;               /* Undo run if length is zero */
 
             /*  Start checking at the fourth byte */
-            while (len < maxlen && ref[len] == ip[len])
-                len++;
+            len = lzfx_match_len(ip, ref, len, maxlen);
 
             len -= 2;  /* We encode the length as #octets - 2 */
 
@@ -258,6 +292,162 @@ int lzfx_compress(const void *const ibuf, const unsigned int ilen,
     return 0;
 }
 
+/*  Like lzfx_compress() but every position looks at all LZFX_WAYS earlier
+    positions in its hash bucket and takes the longest match. The output
+    is in the same format. */
+int lzfx_compress_hc(const void *const ibuf, const unsigned int ilen,
+                              void *obuf, unsigned int *const olen){
+
+    uint32_t *htab;         /* Buckets of input offsets + 1 */
+    u8 *heads;              /* Next slot to replace per bucket */
+    uint32_t *slots;
+    unsigned int hval, b, i;
+
+    const u8 *const base = (const u8 *)ibuf;
+    const u8 *ip = base;
+    const u8 *const in_end = ip + ilen;
+
+    u8 *op = (u8 *)obuf;
+    const u8 *const out_end = (olen == NULL ? NULL : op + *olen);
+
+    int lit;    /* # of bytes in current literal run */
+
+    if(olen == NULL) return LZFX_EARGS;
+    if(ibuf == NULL){
+        if(ilen != 0) return LZFX_EARGS;
+        *olen = 0;
+        return 0;
+    }
+    if(obuf == NULL){
+        if(olen != 0) return LZFX_EARGS;
+        return lzfx_getsize(ibuf, ilen, olen);
+    }
+
+    if (posix_memalign((void **)&htab, 64, LZFX_HTAB_SIZE(LZFX_BUCKET_BITS) *
+        LZFX_WAYS * sizeof (uint32_t)) != 0)
+        return LZFX_ENOMEM;
+    memset(htab, 0, LZFX_HTAB_SIZE(LZFX_BUCKET_BITS) * LZFX_WAYS * sizeof (uint32_t));
+    heads = (u8 *)calloc(LZFX_HTAB_SIZE(LZFX_BUCKET_BITS), 1);
+    if (heads == NULL) {
+        free(htab);
+        return LZFX_ENOMEM;
+    }
+
+    lit = 0; op++;
+
+    hval = LZFX_FRST(ip);
+
+    while(ip + 2 < in_end){
+
+        unsigned int len = 0, off = 0;
+
+        hval = LZFX_NEXT(hval, ip);
+        b = LZFX_IDX(hval, LZFX_BUCKET_BITS);
+        slots = htab + b * LZFX_WAYS;
+
+        if (ip + 4 < in_end) {
+            const unsigned int maxlen = in_end - ip - 2 > LZFX_MAX_REF ?
+                                        LZFX_MAX_REF : in_end - ip - 2;
+
+            for (i = 0; i < LZFX_WAYS; i++) {
+                const u8 *ref;
+                unsigned int l, o;
+
+                if (slots[i] == 0)
+                    continue;
+                ref = base + slots[i] - 1;
+                o = ip - ref - 1;
+                if (o >= LZFX_MAX_OFF || ref[len] != ip[len] ||
+                    ref[0] != ip[0] || ref[1] != ip[1] || ref[2] != ip[2])
+                    continue;
+                l = lzfx_match_len(ip, ref, 3, maxlen);
+                if (l > len || (l == len && o < off)) {
+                    len = l;
+                    off = o;
+                    if (len == maxlen)
+                        break;
+                }
+            }
+        }
+        slots[heads[b]++ & (LZFX_WAYS - 1)] = ip - base + 1;
+
+        if (len >= 3) {
+
+            if(fx_expect_false(op - !lit + 3 + 1 >= out_end)) {
+                free(htab);
+                free(heads);
+                return LZFX_ESIZE;
+            }
+
+            op [- lit - 1] = lit - 1; /* Terminate literal run */
+            op -= !lit;               /* Undo run if length is zero */
+
+            len -= 2;  /* We encode the length as #octets - 2 */
+
+            if (len < 7) {
+              *op++ = (off >> 8) + (len << 5);
+              *op++ = off;
+            } else {
+              *op++ = (off >> 8) + (7 << 5);
+              *op++ = len - 7;
+              *op++ = off;
+            }
+
+            lit = 0; op++;
+
+            ip += len + 1;  /* ip = initial ip + #octets -1 */
+
+            if (fx_expect_false (ip + 3 >= in_end)){
+                ip++;   /* Code following expects exit at bottom of loop */
+                break;
+            }
+
+            hval = LZFX_FRST (ip);
+            hval = LZFX_NEXT (hval, ip);
+            b = LZFX_IDX (hval, LZFX_BUCKET_BITS);
+            htab[b * LZFX_WAYS + (heads[b]++ & (LZFX_WAYS - 1))] = ip - base + 1;
+
+            ip++;   /* ip = initial ip + #octets */
+
+        } else {
+
+              if (fx_expect_false (op >= out_end)) {
+                  free(htab);
+                  free(heads);
+                  return LZFX_ESIZE;
+              }
+
+              lit++; *op++ = *ip++;
+
+              if (fx_expect_false (lit == LZFX_MAX_LIT)) {
+                  op [- lit - 1] = lit - 1; /* stop run */
+                  lit = 0; op++; /* start run */
+              }
+        }
+    }
+
+    free(htab);
+    free(heads);
+    if (op + 3 > out_end)
+        return LZFX_ESIZE;
+
+    while (ip < in_end) {
+
+        lit++; *op++ = *ip++;
+
+        if (fx_expect_false (lit == LZFX_MAX_LIT)){
+            op [- lit - 1] = lit - 1;
+            lit = 0; op++;
+        }
+    }
+
+    op [- lit - 1] = lit - 1;
+    op -= !lit;
+
+    *olen = op - (u8 *)obuf;
+    return 0;
+}
+
 /* Decompressor */
 int lzfx_decompress(const void* ibuf, unsigned int ilen,
                           void* obuf, unsigned int *olen){
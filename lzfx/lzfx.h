@@ -116,6 +116,12 @@ int lzfx_compress(const void* ibuf, unsigned int ilen,
 int lzfx_decompress(const void* ibuf, unsigned int ilen,
                           void* obuf, unsigned int *olen);
 
+/*  Slower buffer-to-buffer compression that searches a bucket of candidate
+    matches per position for better compression. Same output format and
+    return values as lzfx_compress(). */
+int lzfx_compress_hc(const void* ibuf, unsigned int ilen,
+                        void* obuf, unsigned int *olen);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -34,6 +34,7 @@
 
 struct lzfx_params {
 	uint32_t htab_bits;
+	int hc;
 };
 
 void
@@ -60,7 +61,12 @@ lz_fx_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	}
 	lzdat = (struct lzfx_params *)slab_alloc(NULL, sizeof (struct lzfx_params));
 
+	/*
+	 * Levels 1 - 5 grow the hash table. Level 6 and above search a whole
+	 * cache line bucket of candidates per position.
+	 */
 	lev = *level;
+	lzdat->hc = (lev > 5);
 	if (lev > 5) lev = 5;
 	lzdat->htab_bits = 16 + (lev-1);
 	*data = lzdat;
@@ -117,7 +123,10 @@ lz_fx_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	if (level < 7 && PC_TYPE(btype) & TYPE_COMPRESSED)
 		return (-1);
 
-	rv = lzfx_compress(src, _srclen, dst, &_dstlen, lzdat->htab_bits);
+	if (lzdat->hc)
+		rv = lzfx_compress_hc(src, _srclen, dst, &_dstlen);
+	else
+		rv = lzfx_compress(src, _srclen, dst, &_dstlen, lzdat->htab_bits);
 	if (rv != 0) {
 		if (rv != LZFX_ESIZE)
 			lz_fx_err(rv);
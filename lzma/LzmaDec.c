@@ -196,7 +196,14 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
       {
         state -= (state < 4) ? state : 3;
         symbol = 1;
-        do { GET_BIT(prob + symbol, symbol) } while (symbol < 0x100);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
       }
       else
       {
@@ -204,14 +211,20 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         unsigned offs = 0x100;
         state -= (state < 10) ? 3 : 6;
         symbol = 1;
+        /*
+         * offs keeps 0x100 while the decoded bits agree with the match
+         * byte. Taking the match bit as offs & matchByte saves the mask
+         * computation on the 0 path.
+         */
         do
         {
           unsigned bit;
           CLzmaProb *probLit;
-          matchByte <<= 1;
-          bit = (matchByte & offs);
-          probLit = prob + offs + bit + symbol;
-          GET_BIT2(probLit, symbol, offs &= ~bit, offs &= bit)
+          matchByte += matchByte;
+          bit = offs;
+          offs &= matchByte;
+          probLit = prob + (offs + bit + symbol);
+          GET_BIT2(probLit, symbol, offs ^= bit, ;)
         }
         while (symbol < 0x100);
       }
@@ -416,9 +429,34 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
           ptrdiff_t src = (ptrdiff_t)pos - (ptrdiff_t)dicPos;
           const Byte *lim = dest + curLen;
           dicPos += curLen;
-          do
-            *(dest) = (Byte)*(dest + src);
-          while (++dest != lim);
+          /*
+           * Copy 8 bytes at a time when the source is at least 8 bytes
+           * behind, and fill byte runs directly. Never write past lim,
+           * the dictionary may be the caller's output buffer.
+           */
+          if (src <= -8)
+          {
+            while (lim - dest >= 8)
+            {
+              memcpy(dest, dest + src, 8);
+              dest += 8;
+            }
+            while (dest != lim)
+            {
+              *dest = *(dest + src);
+              dest++;
+            }
+          }
+          else if (src == -1)
+          {
+            memset(dest, dest[-1], curLen);
+          }
+          else
+          {
+            do
+              *(dest) = (Byte)*(dest + src);
+            while (++dest != lim);
+          }
         }
         else
         {
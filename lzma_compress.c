@@ -25,6 +25,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <LzmaEnc.h>
 #include <LzmaDec.h>
@@ -35,7 +36,56 @@
 #define	SZ_ERROR_DESTLEN	100
 #define	LZMA_DEFAULT_DICT	(1 << 24)
 
+/*
+ * When a chunk gets spare processors, plain lzma splits it into up to
+ * LZMA_SPLIT_MAX blocks of at least LZMA_SPLIT_MIN bytes that are encoded
+ * and decoded independently in parallel. Such a chunk starts with a marker
+ * byte that can not be a valid LZMA properties byte, followed by the block
+ * count and the compressed and uncompressed length of every block as 64-bit
+ * big-endian values. The blocks follow, each in the usual single block
+ * format below.
+ */
+#define	LZMA_SPLIT_MARK		0xFF
+#define	LZMA_SPLIT_MAX		8
+#define	LZMA_SPLIT_MIN		EIGHTM
+#define	LZMA_SPLIT_HDR(n)	(2 + (n) * 2 * sizeof (uint64_t))
+
+
+/*
+ * Encoder working memory for a level, matching the dictionary sizes picked
+ * in lzma_init(). The BT4 match finder keeps about 11.5 bytes of state per
+ * dictionary byte.
+ */
+static uint64_t
+lzma_state_mem(int level)
+{
+	uint64_t dict;
+
+	if (level < 8)
+		dict = LZMA_DEFAULT_DICT;
+	else if (level == 13)
+		dict = (1 << 27);
+	else if (level == 14)
+		dict = (1 << 28);
+	else
+		dict = (1 << 26);
+	return (dict * 23 / 2);
+}
+
 CLzmaEncProps *p = NULL;
+static int p_refs = 0;
+
+/*
+ * Per-thread state. The encoder handle keeps its match finder hash, price
+ * tables and literal probabilities across chunks, so a new chunk only pays
+ * for re-initialising them. The decoders keep their probability arrays, one
+ * per split block. Buffers are reallocated only when the properties change.
+ */
+struct lzma_ctx {
+	CLzmaEncProps *props;
+	CLzmaEncHandle enc;
+	CLzmaDec dec[LZMA_SPLIT_MAX];
+};
 
 static ISzAlloc g_Alloc = {
 	slab_alloc,
@@ -53,33 +103,44 @@ lzma_mt_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->compress_mt_capable = 1;
 	data->decompress_mt_capable = 0;
 	data->buf_extra = 0;
+	data->decomp_direct = 1;
 	data->c_max_threads = 2;
 	data->delta2_span = 150;
 	if (level < 12)
 		data->deltac_min_distance = (EIGHTM * 16);
 	else
 		data->deltac_min_distance = (EIGHTM * 32);
+	data->state_mem = lzma_state_mem(level);
 }
 
 void
 lzma_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->compress_mt_capable = 0;
 	data->decompress_mt_capable = 0;
+	data->single_chunk_mt_capable = 1;
+	data->c_max_threads = LZMA_SPLIT_MAX;
+	data->d_max_threads = LZMA_SPLIT_MAX;
 	data->buf_extra = 0;
+	data->decomp_direct = 1;
 	data->delta2_span = 150;
 	if (level < 12)
 		data->deltac_min_distance = (EIGHTM * 16);
 	else
 		data->deltac_min_distance = (EIGHTM * 32);
+	data->state_mem = lzma_state_mem(level);
 }
 
 /*
- * The two functions below are not thread-safe, by design.
+ * The two functions below are not thread-safe, by design. The encoder
+ * properties are shared by every user and released by the last one.
  */
 int
 lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	  int file_version, compress_op_t op)
 {
+	struct lzma_ctx *ctx;
+	int i;
+
 	if (!p && op == COMPRESS) {
 		p = (CLzmaEncProps *)slab_alloc(NULL, sizeof (CLzmaEncProps));
 		LzmaEncProps_Init(p);
@@ -132,17 +193,48 @@ lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		slab_cache_add(p->litprob_sz);
 	}
 	if (*level > 9) *level = 9;
-	*data = p;
+
+	ctx = (struct lzma_ctx *)slab_calloc(NULL, 1, sizeof (struct lzma_ctx));
+	if (!ctx)
+		return (1);
+	for (i = 0; i < LZMA_SPLIT_MAX; i++)
+		LzmaDec_Construct(&(ctx->dec[i]));
+	if (p) {
+		p_refs++;
+		ctx->props = p;
+	}
+	*data = ctx;
 	return (0);
 }
 
+/*
+ * Plain lzma keeps the match finder single threaded. Spare processors are
+ * used by splitting the chunk instead.
+ */
+int
+lzma_split_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	  int file_version, compress_op_t op)
+{
+	return (lzma_init(data, level, 1, chunksize, file_version, op));
+}
+
 int
 lzma_deinit(void **data)
 {
-	if (p) {
+	struct lzma_ctx *ctx = (struct lzma_ctx *)(*data);
+	int i;
+
+	if (!ctx)
+		return (0);
+	if (ctx->enc)
+		LzmaEnc_Destroy(ctx->enc, &g_Alloc, &g_Alloc);
+	for (i = 0; i < LZMA_SPLIT_MAX; i++)
+		LzmaDec_FreeProbs(&(ctx->dec[i]), &g_Alloc);
+	if (ctx->props && --p_refs == 0) {
 		slab_release(NULL, p);
 		p = NULL;
 	}
+	slab_free(NULL, ctx);
 	*data = NULL;
 	return (0);
 }
@@ -185,6 +277,33 @@ lzerr(int err, int cmp)
 	}
 }
 
+/*
+ * Same as LzmaDecode() but keeps the probability array in the given decoder.
+ */
+static SRes
+lzma_dec_run(CLzmaDec *d, uchar_t *dst, SizeT *dlen, const uchar_t *src, SizeT *srclen,
+	const uchar_t *props)
+{
+	SizeT inSize = *srclen, outSize = *dlen;
+	ELzmaStatus status;
+	SRes res;
+
+	*srclen = *dlen = 0;
+	res = LzmaDec_AllocateProbs(d, props, LZMA_PROPS_SIZE, &g_Alloc);
+	if (res != SZ_OK)
+		return (res);
+	d->dic = dst;
+	d->dicBufSize = outSize;
+	LzmaDec_Init(d);
+
+	*srclen = inSize;
+	res = LzmaDec_DecodeToDic(d, outSize, src, srclen, LZMA_FINISH_ANY, &status);
+	if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT)
+		res = SZ_ERROR_INPUT_EOF;
+	*dlen = d->dicPos;
+	return (res);
+}
+
 /*
  * LZMA compressed segment format(simplified)
  * ------------------------------------------
@@ -197,6 +316,118 @@ lzerr(int err, int cmp)
  * We do not store the uncompressed chunk size here. It is stored in
  * our chunk header.
  */
+static int
+lzma_compress_split(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
+	CLzmaEncProps *props, int nblk)
+{
+	CLzmaEncProps bprops;
+	uchar_t *bdst[LZMA_SPLIT_MAX];
+	uint64_t blen[LZMA_SPLIT_MAX], bclen[LZMA_SPLIT_MAX], bsz, pos;
+	int i, err;
+
+	bsz = srclen / nblk;
+	for (i = 0; i < nblk; i++) {
+		blen[i] = (i < nblk - 1 ? bsz : srclen - bsz * (nblk - 1));
+		bdst[i] = NULL;
+	}
+	bprops = *props;
+	bprops.numThreads = 1;
+	err = 0;
+
+#	pragma omp parallel for num_threads(nblk) schedule(static, 1)
+	for (i = 0; i < nblk; i++) {
+		SizeT props_len = LZMA_PROPS_SIZE, dlen;
+		SRes res;
+
+		bdst[i] = (uchar_t *)slab_alloc(NULL, blen[i]);
+		if (bdst[i] == NULL) {
+			err = 1;
+			continue;
+		}
+		dlen = blen[i] - LZMA_PROPS_SIZE;
+		res = LzmaEncode(bdst[i] + LZMA_PROPS_SIZE, &dlen, src + bsz * i, blen[i],
+		    &bprops, bdst[i], &props_len, 0, NULL, &g_Alloc, &g_Alloc);
+		if (res != SZ_OK) {
+			lzerr(res, 1);
+			err = 1;
+		}
+		bclen[i] = dlen + LZMA_PROPS_SIZE;
+	}
+
+	pos = LZMA_SPLIT_HDR(nblk);
+	for (i = 0; i < nblk && !err; i++) {
+		if (pos + bclen[i] > *dstlen) {
+			err = 1;
+			break;
+		}
+		memcpy(dst + pos, bdst[i], bclen[i]);
+		U64_P(dst + 2 + i * 16) = htonll(bclen[i]);
+		U64_P(dst + 2 + i * 16 + 8) = htonll(blen[i]);
+		pos += bclen[i];
+	}
+	for (i = 0; i < nblk; i++) {
+		if (bdst[i])
+			slab_free(NULL, bdst[i]);
+	}
+	if (err)
+		return (-1);
+	dst[0] = LZMA_SPLIT_MARK;
+	dst[1] = nblk;
+	*dstlen = pos;
+	return (0);
+}
+
+static int
+lzma_decompress_split(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
+	struct lzma_ctx *ctx)
+{
+	uint64_t coff[LZMA_SPLIT_MAX], doff[LZMA_SPLIT_MAX];
+	uint64_t clen[LZMA_SPLIT_MAX], ulen[LZMA_SPLIT_MAX];
+	uint64_t cpos, dpos;
+	int i, nblk, err;
+
+	nblk = src[1];
+	if (nblk < 2 || nblk > LZMA_SPLIT_MAX || srclen < LZMA_SPLIT_HDR(nblk)) {
+		lzerr(SZ_ERROR_DATA, 0);
+		return (-1);
+	}
+	cpos = LZMA_SPLIT_HDR(nblk);
+	dpos = 0;
+	for (i = 0; i < nblk; i++) {
+		clen[i] = ntohll(U64_P(src + 2 + i * 16));
+		ulen[i] = ntohll(U64_P(src + 2 + i * 16 + 8));
+		if (clen[i] < LZMA_PROPS_SIZE || clen[i] > srclen - cpos ||
+		    ulen[i] > *dstlen - dpos) {
+			lzerr(SZ_ERROR_DATA, 0);
+			return (-1);
+		}
+		coff[i] = cpos;
+		doff[i] = dpos;
+		cpos += clen[i];
+		dpos += ulen[i];
+	}
+	err = 0;
+
+#	pragma omp parallel for schedule(static, 1)
+	for (i = 0; i < nblk; i++) {
+		SizeT _srclen, dlen;
+		SRes res;
+
+		_srclen = clen[i] - LZMA_PROPS_SIZE;
+		dlen = ulen[i];
+		res = lzma_dec_run(&(ctx->dec[i]), dst + doff[i], &dlen,
+		    src + coff[i] + LZMA_PROPS_SIZE, &_srclen, src + coff[i]);
+		if (res != SZ_OK || dlen != ulen[i]) {
+			lzerr(res != SZ_OK ? res : SZ_ERROR_DATA, 0);
+			err = 1;
+		}
+	}
+	if (err)
+		return (-1);
+	*dstlen = dpos;
+	return (0);
+}
+
 int
 lzma_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
@@ -204,8 +435,10 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 	SizeT props_len = LZMA_PROPS_SIZE;
 	SRes res;
 	Byte *_dst;
-	CLzmaEncProps *props = (CLzmaEncProps *)data;
+	struct lzma_ctx *ctx = (struct lzma_ctx *)data;
+	CLzmaEncProps *props = ctx->props;
 	SizeT dlen;
+	int nblk;
 
 	if (*dstlen < LZMA_PROPS_SIZE) {
 		lzerr(SZ_ERROR_DESTLEN, 1);
@@ -216,11 +449,31 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 		return (-1);
 	props->level = level;
 
+	nblk = get_chunk_threads();
+	if (nblk > LZMA_SPLIT_MAX)
+		nblk = LZMA_SPLIT_MAX;
+	if (nblk > srclen / LZMA_SPLIT_MIN)
+		nblk = srclen / LZMA_SPLIT_MIN;
+	if (nblk > 1 && props->numThreads <= 1)
+		return (lzma_compress_split((uchar_t *)src, srclen, (uchar_t *)dst,
+		    dstlen, props, nblk));
+
 	_dst = (Byte *)dst;
 	*dstlen -= LZMA_PROPS_SIZE;
 	dlen = *dstlen;
-	res = LzmaEncode(_dst + LZMA_PROPS_SIZE, &dlen, (const uchar_t *)src, srclen,
-	    props, (uchar_t *)_dst, &props_len, 0, NULL, &g_Alloc, &g_Alloc);
+	if (!ctx->enc) {
+		ctx->enc = LzmaEnc_Create(&g_Alloc);
+		if (!ctx->enc) {
+			lzerr(SZ_ERROR_MEM, 1);
+			return (-1);
+		}
+	}
+	res = LzmaEnc_SetProps(ctx->enc, props);
+	if (res == SZ_OK)
+		res = LzmaEnc_WriteProperties(ctx->enc, _dst, &props_len);
+	if (res == SZ_OK)
+		res = LzmaEnc_MemEncode(ctx->enc, _dst + LZMA_PROPS_SIZE, &dlen,
+		    (const uchar_t *)src, srclen, 0, NULL, &g_Alloc, &g_Alloc);
 	*dstlen = dlen;
 
 	if (res != 0) {
@@ -236,19 +489,32 @@ int
 lzma_decompress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
 {
+	struct lzma_ctx *ctx = (struct lzma_ctx *)data;
 	SizeT _srclen;
 	const uchar_t *_src;
 	SRes res;
-	ELzmaStatus status;
 	SizeT dlen;
 
+	if (srclen < LZMA_PROPS_SIZE) {
+		lzerr(SZ_ERROR_INPUT_EOF, 0);
+		return (-1);
+	}
+	if (!ctx) {
+		/*
+		 * Callers that never expect LZMA data, like adapt mode 1, pass no
+		 * context. Reject such data rather than allocate for it.
+		 */
+		lzerr(SZ_ERROR_DATA, 0);
+		return (-1);
+	}
+	if (*((uchar_t *)src) == LZMA_SPLIT_MARK)
+		return (lzma_decompress_split((uchar_t *)src, srclen, (uchar_t *)dst, dstlen, ctx));
 	_srclen = srclen - LZMA_PROPS_SIZE;
 	_src = (uchar_t *)src + LZMA_PROPS_SIZE;
 	dlen = *dstlen;
 
-	if ((res = LzmaDecode((uchar_t *)dst, &dlen, _src, &_srclen,
-	    (uchar_t *)src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY,
-	    &status, &g_Alloc)) != SZ_OK) {
+	if ((res = lzma_dec_run(&(ctx->dec[0]), (uchar_t *)dst, &dlen, _src, &_srclen,
+	    (uchar_t *)src)) != SZ_OK) {
 		*dstlen = dlen;
 		lzerr(res, 0);
 		return (-1);
@@ -29,11 +29,11 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
 #include <fcntl.h>
 #include <strings.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "pcompress.h"
 #include "filters/delta2/delta2.h"
 #include "utils/utils.h"
@@ -43,56 +43,678 @@
 
 #define	METADATA_CHUNK_SIZE	(3 * 1024 * 1024)
 
-extern int bzip2_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
-               int level, uchar_t chdr, int btype, void *data);
-extern int bzip2_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
-		 int level, uchar_t chdr, int btype, void *data);
-extern void bzip2_props(algo_props_t *data, int level, uint64_t chunksize);
+/*
+ * Metadata chunks are filled by the archiver and compressed by up to this many
+ * worker threads, one chunk each, while the archiver fills the next. They are
+ * written out in order since the chunk number is the CTR mode nonce when
+ * encrypting.
+ */
+#define	METADATA_THREADS	3
 
-enum {
-	SRC_CHANNEL = 0,
-	SINK_CHANNEL
+/*
+ * Codecs for the metadata stream. The codec is recorded in chunk flag bits
+ * that metadata chunks never use for preprocessing. Bzip2 is the default,
+ * LZ4 decodes many times faster which helps listing large archives.
+ */
+#define	META_CODEC_BZIP2	0
+#define	META_CODEC_LZ4		1
+#define	META_CODEC_ZSTD		2
+#define	META_CODEC_MAX		3
+#define	META_FLAG_LZ4		PREPROC_TYPE_LZP
+#define	META_FLAG_ZSTD		PREPROC_TYPE_DISPACK
+#define	META_FLAG_COLUMNAR	PREPROC_TYPE_DICT
+
+/*
+ * Metadata chunk numbers overlap data chunk numbers. With AEAD encryption they
+ * are moved to a separate nonce range since GCM must never reuse a nonce.
+ */
+#define	META_AEAD_ID(id)	((uint64_t)(id) | (1ULL << 63))
+
+#define	META_BLK_FREE		0
+#define	META_BLK_FULL		1
+
+struct meta_blk {
+	uchar_t *frombuf, *tobuf;
+	uint64_t frompos;
+	int id, state;
+	uchar_t checksum[CKSUM_MAX_BYTES];
+	void *codec_dat[META_CODEC_MAX];
+	mac_ctx_t chunk_hmac;
+	pthread_t thr;
+	meta_ctx_t *mctx;
 };
 
 struct _meta_ctx {
-	int meta_pipes[2];
 	pc_ctx_t *pctx;
-	pthread_t meta_thread;
-	uchar_t *frombuf, *tobuf;
-	uint64_t frompos, topos, tosize;
-	uchar_t checksum[CKSUM_MAX_BYTES];
-	void *bzip2_dat;
-	int comp_level, id;
+	struct meta_blk blk[METADATA_THREADS];
+	int nblk, cur, nthr;
+	int next_id, next_write, stop, err;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	uint64_t topos, tosize;
+	int codec, comp_level, id;
+	int columnar;
 	int comp_fd;
-	int running;
 	int delta2_nstrides;
 	int do_compress;
-	mac_ctx_t chunk_hmac;
 	algo_props_t props;
 };
 
+/*
+ * Codec selection from PCOMPRESS_META_CODEC, bzip2 if not set.
+ */
+static int
+meta_codec_select(void)
+{
+	char *cname = getenv("PCOMPRESS_META_CODEC");
+
+	if (cname == NULL || strcasecmp(cname, "bzip2") == 0)
+		return (META_CODEC_BZIP2);
+	if (strcasecmp(cname, "lz4") == 0)
+		return (META_CODEC_LZ4);
+#ifdef ENABLE_PC_ZSTD
+	if (strcasecmp(cname, "zstd") == 0)
+		return (META_CODEC_ZSTD);
+#endif
+	log_msg(LOG_WARN, 0, "Unknown metadata codec %s, using bzip2.", cname);
+	return (META_CODEC_BZIP2);
+}
+
+/*
+ * Set up the codec state of a block on first use. The LZ4 level must not be 2,
+ * which has a different stream layout, as decoding always uses level 1.
+ */
+static void *
+meta_codec_get(meta_ctx_t *mctx, struct meta_blk *blk, int codec)
+{
+	int level, rv;
+
+	if (blk->codec_dat[codec] != NULL)
+		return (blk->codec_dat[codec]);
+	level = mctx->comp_level;
+	rv = 0;
+	switch (codec) {
+	    case META_CODEC_BZIP2:
+		rv = bzip2_init(&blk->codec_dat[codec], &level, 1, METADATA_CHUNK_SIZE,
+		    VERSION, mctx->do_compress ? COMPRESS : DECOMPRESS);
+		if (blk->codec_dat[codec] == NULL)
+			blk->codec_dat[codec] = (void *)1;
+		break;
+	    case META_CODEC_LZ4:
+		level = (mctx->do_compress && mctx->comp_level > 6) ? 9 : 1;
+		rv = lz4_init(&blk->codec_dat[codec], &level, 1, METADATA_CHUNK_SIZE,
+		    VERSION, mctx->do_compress ? COMPRESS : DECOMPRESS);
+		break;
+#ifdef ENABLE_PC_ZSTD
+	    case META_CODEC_ZSTD:
+		rv = zstd_init(&blk->codec_dat[codec], &level, 1, METADATA_CHUNK_SIZE,
+		    VERSION, mctx->do_compress ? COMPRESS : DECOMPRESS);
+		break;
+#endif
+	    default:
+		rv = 1;
+	}
+	if (rv != 0) {
+		blk->codec_dat[codec] = NULL;
+		log_msg(LOG_ERR, 0, "Metadata codec init failed.");
+		return (NULL);
+	}
+	return (blk->codec_dat[codec]);
+}
+
+static void
+meta_codec_release(struct meta_blk *blk)
+{
+	if (blk->codec_dat[META_CODEC_LZ4] != NULL)
+		lz4_deinit(&blk->codec_dat[META_CODEC_LZ4]);
+#ifdef ENABLE_PC_ZSTD
+	if (blk->codec_dat[META_CODEC_ZSTD] != NULL)
+		zstd_deinit(&blk->codec_dat[META_CODEC_ZSTD]);
+#endif
+	blk->codec_dat[META_CODEC_BZIP2] = NULL;
+}
+
+/*
+ * Columnar encoding of metadata chunks. The metadata stream holds the tar
+ * headers written by libarchive: 512 byte ustar header blocks and the data
+ * blocks of pax extended headers. Headers are split into columns of like
+ * fields, so that the codec sees runs of similar values instead of whole
+ * paths and octal fields repeated in every block:
+ *
+ *   kinds   One byte per block: raw, header, or the pax data of the header
+ *           just before.
+ *   types   The typeflag of each header.
+ *   lens    For each string field, the length shared with the same field of
+ *           the previous header and the length of the rest (front coding).
+ *   strs    The rest of each string field.
+ *   dict    Index of the mode and of the uid/gid pair in small tables of
+ *           recent values, or COL_DICT_NEW if the value follows in nums.
+ *   nums    New modes, uids and gids, sizes and device numbers.
+ *   times   Mtime as a delta to the previous header.
+ *   raw     Blocks that do not parse, pax data without its zero padding and
+ *           any tail shorter than a block.
+ *
+ * Numbers are stored as varints, time deltas zigzag coded. A header is only
+ * parsed if it can be rebuilt byte for byte: zero padded strings, numbers in
+ * the octal layout libarchive writes and a matching checksum. The tables are
+ * reset for every chunk, so that each chunk decodes on its own.
+ */
+#define	COL_KINDS	0
+#define	COL_TYPES	1
+#define	COL_LENS	2
+#define	COL_STRS	3
+#define	COL_DICT	4
+#define	COL_NUMS	5
+#define	COL_TIMES	6
+#define	COL_RAW		7
+#define	COL_MAX		8
+
+#define	COL_BLK_RAW	0
+#define	COL_BLK_HDR	1
+#define	COL_BLK_PAXDATA	2
+
+#define	TAR_BLK		512
+#define	COL_DICT_SZ	64
+#define	COL_DICT_NEW	0xff
+
+#define	TAR_NSTRS	5
+#define	TAR_NNUMS	7
+#define	TAR_MODE	0
+#define	TAR_UID		1
+#define	TAR_GID		2
+#define	TAR_SIZE	3
+#define	TAR_MTIME	4
+#define	TAR_DEVMAJOR	5
+#define	TAR_DEVMINOR	6
+#define	TAR_TYPE_OFF	156
+#define	TAR_CKSUM_OFF	148
+#define	TAR_MAGIC_OFF	257
+#define	TAR_PAD_OFF	500
+
+/*
+ * Name, prefix, linkname, uname and gname.
+ */
+static const struct {
+	int off, size;
+} tar_strs[TAR_NSTRS] = {
+	{ 0, 100 }, { 345, 155 }, { 157, 100 }, { 265, 32 }, { 297, 32 }
+};
+
+/*
+ * Octal fields: offset, number of digits and the terminator that follows.
+ */
+static const struct {
+	int off, digits, tlen;
+	const char *term;
+} tar_nums[TAR_NNUMS] = {
+	{ 100, 6, 2, " " }, { 108, 6, 2, " " }, { 116, 6, 2, " " },
+	{ 124, 11, 1, " " }, { 136, 11, 1, " " },
+	{ 329, 6, 2, " " }, { 337, 6, 2, " " }
+};
+
+static const uchar_t tar_magic[8] = { 'u', 's', 't', 'a', 'r', '\0', '0', '0' };
+
+struct tar_hdr {
+	const uchar_t *str[TAR_NSTRS];
+	int slen[TAR_NSTRS];
+	uint64_t num[TAR_NNUMS];
+	uchar_t type;
+};
+
+struct col_dict {
+	uint64_t val[COL_DICT_SZ];
+	int cnt;
+};
+
+struct col_out {
+	uchar_t *buf;
+	uint64_t pos;
+};
+
+struct col_in {
+	const uchar_t *buf;
+	uint64_t pos, len;
+};
+
+static void
+col_put(struct col_out *c, const void *src, uint64_t len)
+{
+	memcpy(c->buf + c->pos, src, len);
+	c->pos += len;
+}
+
+static void
+col_put_varint(struct col_out *c, uint64_t v)
+{
+	while (v >= 0x80) {
+		c->buf[c->pos++] = (uchar_t)(v | 0x80);
+		v >>= 7;
+	}
+	c->buf[c->pos++] = (uchar_t)v;
+}
+
+static int
+col_get(struct col_in *c, void *dst, uint64_t len)
+{
+	if (c->len - c->pos < len)
+		return (-1);
+	memcpy(dst, c->buf + c->pos, len);
+	c->pos += len;
+	return (0);
+}
+
+static int
+col_get_varint(struct col_in *c, uint64_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (c->pos == c->len)
+			return (-1);
+		*v |= (uint64_t)(c->buf[c->pos] & 0x7f) << shift;
+		if ((c->buf[c->pos++] & 0x80) == 0)
+			return (0);
+	}
+	return (-1);
+}
+
+static int
+col_dict_find(struct col_dict *d, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < d->cnt && i < COL_DICT_SZ; i++) {
+		if (d->val[i] == v)
+			return (i);
+	}
+	return (-1);
+}
+
+static void
+col_dict_add(struct col_dict *d, uint64_t v)
+{
+	d->val[d->cnt % COL_DICT_SZ] = v;
+	d->cnt++;
+}
+
+static int
+tar_octal_parse(const uchar_t *p, int digits, int tlen, const char *term, uint64_t *v)
+{
+	int i;
+
+	*v = 0;
+	for (i = 0; i < digits; i++) {
+		if (p[i] < '0' || p[i] > '7')
+			return (-1);
+		*v = (*v << 3) | (p[i] - '0');
+	}
+	return (memcmp(p + digits, term, tlen) == 0 ? 0 : -1);
+}
+
+static void
+tar_octal_format(uchar_t *p, int digits, int tlen, const char *term, uint64_t v)
+{
+	int i;
+
+	for (i = digits - 1; i >= 0; i--) {
+		p[i] = '0' + (v & 7);
+		v >>= 3;
+	}
+	memcpy(p + digits, term, tlen);
+}
+
+static unsigned int
+tar_cksum(const uchar_t *h)
+{
+	unsigned int sum;
+	int i;
+
+	sum = 8 * ' ';
+	for (i = 0; i < TAR_BLK; i++) {
+		if (i < TAR_CKSUM_OFF || i >= TAR_CKSUM_OFF + 8)
+			sum += h[i];
+	}
+	return (sum);
+}
+
+/*
+ * Parse a header block that can be rebuilt exactly. Returns 0 on success.
+ */
+static int
+tar_hdr_parse(const uchar_t *h, struct tar_hdr *th)
+{
+	uint64_t cksum;
+	int i, j;
+
+	if (memcmp(h + TAR_MAGIC_OFF, tar_magic, sizeof (tar_magic)) != 0)
+		return (-1);
+	for (i = TAR_PAD_OFF; i < TAR_BLK; i++) {
+		if (h[i] != 0)
+			return (-1);
+	}
+	for (i = 0; i < TAR_NSTRS; i++) {
+		const uchar_t *s = h + tar_strs[i].off;
+
+		for (j = 0; j < tar_strs[i].size && s[j] != 0; j++);
+		th->str[i] = s;
+		th->slen[i] = j;
+		for (; j < tar_strs[i].size; j++) {
+			if (s[j] != 0)
+				return (-1);
+		}
+	}
+	for (i = 0; i < TAR_NNUMS; i++) {
+		if (tar_octal_parse(h + tar_nums[i].off, tar_nums[i].digits,
+		    tar_nums[i].tlen, tar_nums[i].term, &th->num[i]) != 0)
+			return (-1);
+	}
+	if (tar_octal_parse(h + TAR_CKSUM_OFF, 6, 2, "\0 ", &cksum) != 0 ||
+	    cksum != tar_cksum(h))
+		return (-1);
+	th->type = h[TAR_TYPE_OFF];
+	return (0);
+}
+
+/*
+ * Typeflags whose data blocks are metadata: pax extended and global headers
+ * and GNU long names.
+ */
+static int
+tar_type_has_data(uchar_t type)
+{
+	return (type == 'x' || type == 'g' || type == 'L' || type == 'K');
+}
+
+/*
+ * Encode a metadata chunk into out. Returns the encoded length, or 0 if the
+ * encoding would not be smaller than the input.
+ */
+static uint64_t
+meta_col_encode(const uchar_t *in, uint64_t len, uchar_t *out)
+{
+	struct col_out col[COL_MAX], o;
+	struct col_dict modes, owners;
+	struct tar_hdr th, prev;
+	uint64_t nblk, b, pending, bound[COL_MAX], tot, v;
+	int64_t prev_mtime, d;
+	int i, j, idx;
+	uchar_t kind;
+
+	if (len < TAR_BLK)
+		return (0);
+	nblk = len / TAR_BLK;
+	bound[COL_KINDS] = nblk;
+	bound[COL_TYPES] = nblk;
+	bound[COL_LENS] = nblk * TAR_NSTRS * 4;
+	bound[COL_STRS] = len;
+	bound[COL_DICT] = nblk * 2;
+	bound[COL_NUMS] = nblk * 10 * TAR_NNUMS;
+	bound[COL_TIMES] = nblk * 10;
+	bound[COL_RAW] = len;
+	for (i = 0; i < COL_MAX; i++) {
+		col[i].buf = (uchar_t *)malloc(bound[i]);
+		col[i].pos = 0;
+		if (col[i].buf == NULL) {
+			while (i > 0)
+				free(col[--i].buf);
+			return (0);
+		}
+	}
+
+	memset(&prev, 0, sizeof (prev));
+	memset(&modes, 0, sizeof (modes));
+	memset(&owners, 0, sizeof (owners));
+	prev_mtime = 0;
+	pending = 0;
+	b = 0;
+	while (b + TAR_BLK <= len) {
+		const uchar_t *h = in + b;
+
+		/*
+		 * Data of a pax header, stored without the zero padding.
+		 */
+		if (pending > 0) {
+			uint64_t dlen = (pending + TAR_BLK - 1) / TAR_BLK * TAR_BLK;
+
+			if (b + dlen <= len) {
+				for (v = pending; v < dlen && h[v] == 0; v++);
+				if (v == dlen) {
+					kind = COL_BLK_PAXDATA;
+					col_put(&col[COL_KINDS], &kind, 1);
+					col_put(&col[COL_RAW], h, pending);
+					b += dlen;
+					pending = 0;
+					continue;
+				}
+			}
+			pending = 0;
+		}
+		if (tar_hdr_parse(h, &th) != 0) {
+			kind = COL_BLK_RAW;
+			col_put(&col[COL_KINDS], &kind, 1);
+			col_put(&col[COL_RAW], h, TAR_BLK);
+			b += TAR_BLK;
+			continue;
+		}
+
+		kind = COL_BLK_HDR;
+		col_put(&col[COL_KINDS], &kind, 1);
+		col_put(&col[COL_TYPES], &th.type, 1);
+		for (i = 0; i < TAR_NSTRS; i++) {
+			for (j = 0; j < th.slen[i] && j < prev.slen[i] &&
+			    th.str[i][j] == prev.str[i][j]; j++);
+			col_put_varint(&col[COL_LENS], j);
+			col_put_varint(&col[COL_LENS], th.slen[i] - j);
+			col_put(&col[COL_STRS], th.str[i] + j, th.slen[i] - j);
+		}
+
+		idx = col_dict_find(&modes, th.num[TAR_MODE]);
+		if (idx < 0) {
+			col[COL_DICT].buf[col[COL_DICT].pos++] = COL_DICT_NEW;
+			col_put_varint(&col[COL_NUMS], th.num[TAR_MODE]);
+			col_dict_add(&modes, th.num[TAR_MODE]);
+		} else {
+			col[COL_DICT].buf[col[COL_DICT].pos++] = idx;
+		}
+		v = (th.num[TAR_UID] << 32) | th.num[TAR_GID];
+		idx = col_dict_find(&owners, v);
+		if (idx < 0) {
+			col[COL_DICT].buf[col[COL_DICT].pos++] = COL_DICT_NEW;
+			col_put_varint(&col[COL_NUMS], th.num[TAR_UID]);
+			col_put_varint(&col[COL_NUMS], th.num[TAR_GID]);
+			col_dict_add(&owners, v);
+		} else {
+			col[COL_DICT].buf[col[COL_DICT].pos++] = idx;
+		}
+		col_put_varint(&col[COL_NUMS], th.num[TAR_SIZE]);
+		col_put_varint(&col[COL_NUMS], th.num[TAR_DEVMAJOR]);
+		col_put_varint(&col[COL_NUMS], th.num[TAR_DEVMINOR]);
+		d = (int64_t)th.num[TAR_MTIME] - prev_mtime;
+		col_put_varint(&col[COL_TIMES], ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+		prev_mtime = th.num[TAR_MTIME];
+
+		if (tar_type_has_data(th.type))
+			pending = th.num[TAR_SIZE];
+		prev = th;
+		b += TAR_BLK;
+	}
+	col_put(&col[COL_RAW], in + b, len - b);
+
+	/*
+	 * The original length and the column lengths, then the columns.
+	 */
+	tot = 10 * (COL_MAX + 1);
+	for (i = 0; i < COL_MAX; i++)
+		tot += col[i].pos;
+	o.buf = out;
+	o.pos = 0;
+	if (tot < len) {
+		col_put_varint(&o, len);
+		for (i = 0; i < COL_MAX; i++)
+			col_put_varint(&o, col[i].pos);
+		for (i = 0; i < COL_MAX; i++)
+			col_put(&o, col[i].buf, col[i].pos);
+	}
+	for (i = 0; i < COL_MAX; i++)
+		free(col[i].buf);
+	return (o.pos);
+}
+
+/*
+ * Rebuild a metadata chunk of origlen bytes into out. Returns 0 on success,
+ * -1 if the encoding is damaged.
+ */
 static int
-compress_and_write(meta_ctx_t *mctx)
+meta_col_decode(const uchar_t *in, uint64_t len, uchar_t *out, uint64_t origlen)
+{
+	struct col_in col[COL_MAX], c;
+	struct col_dict modes, owners;
+	struct tar_hdr prev;
+	uint64_t n, b, pending, v, num[TAR_NNUMS], shared, rest;
+	int64_t prev_mtime;
+	uchar_t kind, idx, *h;
+	int i;
+
+	c.buf = in;
+	c.pos = 0;
+	c.len = len;
+	if (col_get_varint(&c, &n) != 0 || n != origlen)
+		return (-1);
+	for (i = 0; i < COL_MAX; i++) {
+		if (col_get_varint(&c, &col[i].len) != 0)
+			return (-1);
+	}
+	for (i = 0; i < COL_MAX; i++) {
+		if (c.len - c.pos < col[i].len)
+			return (-1);
+		col[i].buf = c.buf + c.pos;
+		col[i].pos = 0;
+		c.pos += col[i].len;
+	}
+
+	memset(&prev, 0, sizeof (prev));
+	memset(&modes, 0, sizeof (modes));
+	memset(&owners, 0, sizeof (owners));
+	prev_mtime = 0;
+	pending = 0;
+	b = 0;
+	while (b + TAR_BLK <= n) {
+		h = out + b;
+		if (col_get(&col[COL_KINDS], &kind, 1) != 0)
+			return (-1);
+		if (kind == COL_BLK_PAXDATA) {
+			uint64_t dlen = (pending + TAR_BLK - 1) / TAR_BLK * TAR_BLK;
+
+			if (pending == 0 || b + dlen > n ||
+			    col_get(&col[COL_RAW], h, pending) != 0)
+				return (-1);
+			memset(h + pending, 0, dlen - pending);
+			b += dlen;
+			pending = 0;
+			continue;
+		}
+		pending = 0;
+		if (kind == COL_BLK_RAW) {
+			if (col_get(&col[COL_RAW], h, TAR_BLK) != 0)
+				return (-1);
+			b += TAR_BLK;
+			continue;
+		}
+		if (kind != COL_BLK_HDR)
+			return (-1);
+
+		memset(h, 0, TAR_BLK);
+		if (col_get(&col[COL_TYPES], h + TAR_TYPE_OFF, 1) != 0)
+			return (-1);
+		for (i = 0; i < TAR_NSTRS; i++) {
+			uchar_t *s = h + tar_strs[i].off;
+
+			if (col_get_varint(&col[COL_LENS], &shared) != 0 ||
+			    col_get_varint(&col[COL_LENS], &rest) != 0 ||
+			    shared > prev.slen[i] || shared + rest > tar_strs[i].size)
+				return (-1);
+			if (shared > 0)
+				memcpy(s, prev.str[i], shared);
+			if (col_get(&col[COL_STRS], s + shared, rest) != 0)
+				return (-1);
+			prev.str[i] = s;
+			prev.slen[i] = shared + rest;
+		}
+
+		if (col_get(&col[COL_DICT], &idx, 1) != 0)
+			return (-1);
+		if (idx == COL_DICT_NEW) {
+			if (col_get_varint(&col[COL_NUMS], &num[TAR_MODE]) != 0)
+				return (-1);
+			col_dict_add(&modes, num[TAR_MODE]);
+		} else if (idx < modes.cnt && idx < COL_DICT_SZ) {
+			num[TAR_MODE] = modes.val[idx];
+		} else {
+			return (-1);
+		}
+		if (col_get(&col[COL_DICT], &idx, 1) != 0)
+			return (-1);
+		if (idx == COL_DICT_NEW) {
+			if (col_get_varint(&col[COL_NUMS], &num[TAR_UID]) != 0 ||
+			    col_get_varint(&col[COL_NUMS], &num[TAR_GID]) != 0)
+				return (-1);
+			col_dict_add(&owners, (num[TAR_UID] << 32) | num[TAR_GID]);
+		} else if (idx < owners.cnt && idx < COL_DICT_SZ) {
+			num[TAR_UID] = owners.val[idx] >> 32;
+			num[TAR_GID] = owners.val[idx] & 0xffffffffULL;
+		} else {
+			return (-1);
+		}
+		if (col_get_varint(&col[COL_NUMS], &num[TAR_SIZE]) != 0 ||
+		    col_get_varint(&col[COL_NUMS], &num[TAR_DEVMAJOR]) != 0 ||
+		    col_get_varint(&col[COL_NUMS], &num[TAR_DEVMINOR]) != 0 ||
+		    col_get_varint(&col[COL_TIMES], &v) != 0)
+			return (-1);
+		prev_mtime += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		num[TAR_MTIME] = prev_mtime;
+
+		for (i = 0; i < TAR_NNUMS; i++) {
+			tar_octal_format(h + tar_nums[i].off, tar_nums[i].digits,
+			    tar_nums[i].tlen, tar_nums[i].term, num[i]);
+		}
+		memcpy(h + TAR_MAGIC_OFF, tar_magic, sizeof (tar_magic));
+		tar_octal_format(h + TAR_CKSUM_OFF, 6, 2, "\0 ", tar_cksum(h));
+
+		if (tar_type_has_data(h[TAR_TYPE_OFF]))
+			pending = num[TAR_SIZE];
+		b += TAR_BLK;
+	}
+	if (col_get(&col[COL_RAW], out + b, n - b) != 0)
+		return (-1);
+	for (i = 0; i < COL_MAX; i++) {
+		if (col[i].pos != col[i].len)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Compress a filled metadata block into its output buffer and fill in the
+ * chunk header. Returns the full chunk length or 0 on error.
+ */
+static uint64_t
+compress_blk(meta_ctx_t *mctx, struct meta_blk *blk)
 {
 	pc_ctx_t *pctx = mctx->pctx;
 	uchar_t type;
 	uchar_t *comp_chunk, *tobuf;
+	void *cdat;
 	int rv;
 	uint64_t dstlen;
-	int64_t wbytes;
-
-	/*
-	 * Increment metadata chunk id. Useful when encrypting (CTR Mode).
-	 */
-	mctx->id++;
 
 	/*
 	 * Plain checksum if not encrypting.
 	 * This place will hold HMAC if encrypting.
 	 */
 	if (!pctx->encrypt_type) {
-		compute_checksum(mctx->checksum, pctx->cksum, mctx->frombuf,
-		    mctx->frompos, 0, 1);
+		compute_checksum(blk->checksum, pctx->cksum, blk->frombuf,
+		    blk->frompos, 0, 1);
 	}
 
 	type = 0;
@@ -102,43 +724,66 @@ compress_and_write(meta_ctx_t *mctx)
 	 * always big-endian format. The next value is the real compressed
 	 * chunk size.
 	 */
-	tobuf = mctx->tobuf;
+	tobuf = blk->tobuf;
 	U64_P(tobuf) = htonll(METADATA_INDICATOR);
-	U64_P(tobuf + 16) = LE64(mctx->frompos); // Record original length
+	U64_P(tobuf + 16) = LE64(blk->frompos); // Record original length
 	comp_chunk = tobuf + METADATA_HDR_SZ;
-	dstlen = mctx->frompos;
+
+	if (mctx->columnar) {
+		dstlen = meta_col_encode(blk->frombuf, blk->frompos, comp_chunk);
+		if (dstlen > 0) {
+			memcpy(blk->frombuf, comp_chunk, dstlen);
+			blk->frompos = dstlen;
+			type |= META_FLAG_COLUMNAR;
+		}
+	}
+	dstlen = blk->frompos;
 
 	/*
 	 * Apply Delta2 filter.
 	 */
-	rv = delta2_encode(mctx->frombuf, mctx->frompos, comp_chunk, &dstlen,
+	rv = delta2_encode(blk->frombuf, blk->frompos, comp_chunk, &dstlen,
 	    mctx->props.delta2_span, mctx->delta2_nstrides);
 	if (rv != -1) {
-		memcpy(mctx->frombuf, comp_chunk, dstlen);
-		mctx->frompos = dstlen;
+		memcpy(blk->frombuf, comp_chunk, dstlen);
+		blk->frompos = dstlen;
 		type |= PREPROC_TYPE_DELTA2;
 	} else {
-		dstlen = mctx->frompos;
+		dstlen = blk->frompos;
 	}
 
 	/*
 	 * Ok, now compress.
 	 */
-	rv = bzip2_compress(mctx->frombuf, mctx->frompos, comp_chunk, &dstlen, mctx->comp_level,
-	    0, TYPE_BINARY, mctx->bzip2_dat);
+	cdat = meta_codec_get(mctx, blk, mctx->codec);
+	if (cdat == NULL)
+		return (0);
+	if (mctx->codec == META_CODEC_LZ4) {
+		rv = lz4_compress(blk->frombuf, blk->frompos, comp_chunk, &dstlen,
+		    mctx->comp_level, 0, TYPE_BINARY, cdat);
+		type |= META_FLAG_LZ4;
+#ifdef ENABLE_PC_ZSTD
+	} else if (mctx->codec == META_CODEC_ZSTD) {
+		rv = zstd_compress(blk->frombuf, blk->frompos, comp_chunk, &dstlen,
+		    mctx->comp_level, 0, TYPE_BINARY, cdat);
+		type |= META_FLAG_ZSTD;
+#endif
+	} else {
+		rv = bzip2_compress(blk->frombuf, blk->frompos, comp_chunk, &dstlen,
+		    mctx->comp_level, 0, TYPE_BINARY, cdat);
+	}
 
-	if (rv < 0) {
-		dstlen = mctx->frompos;
-		memcpy(comp_chunk, mctx->frombuf, dstlen);
+	if (rv < 0 || dstlen >= blk->frompos) {
+		dstlen = blk->frompos;
+		memcpy(comp_chunk, blk->frombuf, dstlen);
+		type &= (PREPROC_TYPE_DELTA2 | META_FLAG_COLUMNAR);
 	} else {
 		type |= PREPROC_COMPRESSED;
 	}
 
-	if (pctx->encrypt_type) {
-		rv = crypto_buf(&(pctx->crypto_ctx), comp_chunk, comp_chunk, dstlen, mctx->id);
+	if (pctx->encrypt_type && !crypto_is_aead(&(pctx->crypto_ctx))) {
+		rv = crypto_buf(&(pctx->crypto_ctx), comp_chunk, comp_chunk, dstlen, blk->id);
 		if (rv == -1) {
-			pctx->main_cancel = 1;
-			pctx->t_errored = 1;
 			log_msg(LOG_ERR, 0, "Metadata Encrypion failed");
 			return (0);
 		}
@@ -152,18 +797,32 @@ compress_and_write(meta_ctx_t *mctx)
 	*(tobuf + 24) = type;
 
 	if (!pctx->encrypt_type)
-		serialize_checksum(mctx->checksum, tobuf + 25, pctx->cksum_bytes);
+		serialize_checksum(blk->checksum, tobuf + 25, pctx->cksum_bytes);
 
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && crypto_is_aead(&(pctx->crypto_ctx))) {
+		uchar_t aad[METADATA_HDR_SZ];
+
+		/*
+		 * Encrypt and authenticate with the header in one pass.
+		 */
+		memset(tobuf + 25, 0, pctx->mac_bytes + CRC32_SIZE);
+		memcpy(aad, tobuf, METADATA_HDR_SZ);
+		rv = crypto_aead_buf(&(pctx->crypto_ctx), comp_chunk, comp_chunk, dstlen,
+		    META_AEAD_ID(blk->id), aad, METADATA_HDR_SZ, tobuf + 25);
+		if (rv == -1) {
+			log_msg(LOG_ERR, 0, "Metadata Encrypion failed");
+			return (0);
+		}
+	} else if (pctx->encrypt_type) {
 		uchar_t chash[pctx->mac_bytes];
 		unsigned int hlen;
 		uchar_t *mac_ptr;
 
 		mac_ptr = tobuf + 25;
 		memset(mac_ptr, 0, pctx->mac_bytes + CRC32_SIZE);
-		hmac_reinit(&mctx->chunk_hmac);
-		hmac_update(&mctx->chunk_hmac, tobuf, dstlen + METADATA_HDR_SZ);
-		hmac_final(&mctx->chunk_hmac, chash, &hlen);
+		hmac_reinit(&blk->chunk_hmac);
+		hmac_update(&blk->chunk_hmac, tobuf, dstlen + METADATA_HDR_SZ);
+		hmac_final(&blk->chunk_hmac, chash, &hlen);
 		serialize_checksum(chash, mac_ptr, hlen);
 	} else {
 		uint32_t crc;
@@ -174,141 +833,140 @@ compress_and_write(meta_ctx_t *mctx)
 		crc = lzma_crc32(tobuf, METADATA_HDR_SZ, 0);
 		U32_P(tobuf + 25 + CKSUM_MAX) = LE32(crc);
 	}
-
-	/*
-	 * All done. Now grab lock and write.
-	 */
-	dstlen += METADATA_HDR_SZ; // The 'full' chunk now
-	pthread_mutex_lock(&pctx->write_mutex);
-	wbytes = Write(mctx->comp_fd, mctx->tobuf, dstlen);
-	pthread_mutex_unlock(&pctx->write_mutex);
-	if (wbytes != dstlen) {
-		log_msg(LOG_ERR, 1, "Metadata Write (expected: %" PRIu64 ", written: %" PRId64 ") : ",
-			dstlen, wbytes);
-		pctx->main_cancel = 1;
-		pctx->t_errored = 1;
-		return (0);
-	}
-
-	return (1);
-}
-
-void
-meta_ctx_close_sink_channel(meta_ctx_t *mctx)
-{
-	if (mctx->meta_pipes[SINK_CHANNEL]) {
-		close(mctx->meta_pipes[SINK_CHANNEL]);
-		mctx->meta_pipes[SINK_CHANNEL] = 0;
-	}
-}
-
-void
-meta_ctx_close_src_channel(meta_ctx_t *mctx)
-{
-	if (mctx->meta_pipes[SRC_CHANNEL]) {
-		close(mctx->meta_pipes[SRC_CHANNEL]);
-		mctx->meta_pipes[SRC_CHANNEL] = 0;
-	}
+	return (dstlen + METADATA_HDR_SZ);
 }
 
 /*
- * Accumulate metadata into a memory buffer. Once the buffer gets filled or
- * data stream ends, the buffer is compressed and written out.
+ * Compress the blocks handed over by the archiver. Chunks are written in the
+ * order they were filled, a worker waits for its turn once done.
  */
 static void *
 metadata_compress(void *dat)
 {
-	meta_ctx_t *mctx = (meta_ctx_t *)dat;
-	meta_msg_t *msgp;
-	int ack;
+	struct meta_blk *blk = (struct meta_blk *)dat;
+	meta_ctx_t *mctx = blk->mctx;
+	pc_ctx_t *pctx = mctx->pctx;
+	uint64_t dstlen, t;
+	int64_t wbytes;
 
-	mctx->running = 1;
-	mctx->id = -1;
-	while (Read(mctx->meta_pipes[SINK_CHANNEL], &msgp, sizeof (msgp)) == sizeof (msgp)) {
-		ack = 0;
-		if (mctx->frompos + msgp->len > METADATA_CHUNK_SIZE) {
-			/*
-			 * Accumulating the metadata block will overflow buffer. Compress
-			 * and write the current buffer and then copy the new data into it.
-			 */
-			if (!compress_and_write(mctx)) {
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
-			}
-			mctx->frompos = 0;
-			memcpy(mctx->frombuf, msgp->buf, msgp->len);
-			mctx->frompos = msgp->len;
+	set_chunk_threads(1);
+	pc_trace_thread("meta");
+	pthread_mutex_lock(&mctx->lock);
+	for (;;) {
+		while (blk->state != META_BLK_FULL && !mctx->stop)
+			pthread_cond_wait(&mctx->cv, &mctx->lock);
+		if (blk->state != META_BLK_FULL)
+			break;
+		pthread_mutex_unlock(&mctx->lock);
+		t = pc_trace_start();
+		dstlen = compress_blk(mctx, blk);
+		pc_trace_end("meta_compress", t, blk->frompos);
+		pthread_mutex_lock(&mctx->lock);
+		while (mctx->next_write != blk->id)
+			pthread_cond_wait(&mctx->cv, &mctx->lock);
+		if (dstlen == 0)
+			mctx->err = 1;
 
-		} else if (mctx->frompos + msgp->len == METADATA_CHUNK_SIZE) {
-			/*
-			 * Accumulating the metadata block fills the buffer. Fill it then
-			 * compress and write the buffer.
-			 */
-			memcpy(mctx->frombuf + mctx->frompos, msgp->buf, msgp->len);
-			mctx->frompos += msgp->len;
-			if (!compress_and_write(mctx)) {
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
+		if (!mctx->err) {
+			pthread_mutex_unlock(&mctx->lock);
+			pthread_mutex_lock(&pctx->write_mutex);
+			wbytes = Write(mctx->comp_fd, blk->tobuf, dstlen);
+			if (wbytes > 0)
+				pctx->comp_offset += wbytes;
+			pthread_mutex_unlock(&pctx->write_mutex);
+			if (wbytes != dstlen) {
+				log_msg(LOG_ERR, 1, "Metadata Write (expected: %" PRIu64
+				    ", written: %" PRId64 ") : ", dstlen, wbytes);
 			}
-			mctx->frompos = 0;
-		} else {
-			/*
-			 * Accumulate the metadata block into the buffer for future
-			 * compression.
-			 */
-			memcpy(mctx->frombuf + mctx->frompos, msgp->buf, msgp->len);
-			mctx->frompos += msgp->len;
+			pthread_mutex_lock(&mctx->lock);
+			if (wbytes != dstlen)
+				mctx->err = 1;
 		}
-		ack = 1;
-		Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-	}
-	mctx->running = 0;
-
-	/*
-	 * Flush any accumulated data in the buffer.
-	 */
-	if (mctx->frompos) {
-		if (!compress_and_write(mctx)) {
-			ack = 0;
-			Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-			return (NULL);
+		if (mctx->err) {
+			pctx->main_cancel = 1;
+			pctx->t_errored = 1;
 		}
-		mctx->frompos = 0;
+		mctx->next_write++;
+		blk->frompos = 0;
+		blk->state = META_BLK_FREE;
+		pthread_cond_broadcast(&mctx->cv);
 	}
+	pthread_mutex_unlock(&mctx->lock);
 	return (NULL);
 }
 
+/*
+ * Hand the current block to its worker and move on to the next one, waiting
+ * for that to be written out if needed.
+ */
+static int
+meta_blk_submit(meta_ctx_t *mctx)
+{
+	struct meta_blk *blk;
+
+	pthread_mutex_lock(&mctx->lock);
+	blk = &mctx->blk[mctx->cur];
+	blk->id = mctx->next_id++;
+	blk->state = META_BLK_FULL;
+	pthread_cond_broadcast(&mctx->cv);
+	mctx->cur = (mctx->cur + 1) % mctx->nblk;
+	blk = &mctx->blk[mctx->cur];
+	while (blk->state != META_BLK_FREE && !mctx->err)
+		pthread_cond_wait(&mctx->cv, &mctx->lock);
+	pthread_mutex_unlock(&mctx->lock);
+	return (mctx->err ? -1 : 1);
+}
+
 static int
 decompress_data(meta_ctx_t *mctx)
 {
 	uint64_t origlen, len_cmp, dstlen;
 	uchar_t *cbuf, *cseg, *ubuf, type;
 	pc_ctx_t *pctx = mctx->pctx;
+	struct meta_blk *blk = &mctx->blk[0];
 	uchar_t checksum[CKSUM_MAX_BYTES];
-	int rv;
+	void *cdat;
+	int rv, codec;
 
-	cbuf = mctx->frombuf;
-	ubuf = mctx->tobuf;
+	cbuf = blk->frombuf;
+	ubuf = blk->tobuf;
 	len_cmp = LE64(U64_P(cbuf + 8));
 	origlen = LE64(U64_P(cbuf + 16));
 	type = *(cbuf + 24);
 	cseg = cbuf + METADATA_HDR_SZ;
 	dstlen = origlen;
+	if (origlen > METADATA_CHUNK_SIZE) {
+		log_msg(LOG_ERR, 0, "Metadata chunk %d, invalid length", mctx->id);
+		return (0);
+	}
 
 	/*
 	 * If this was encrypted:
 	 * Verify HMAC first before anything else and then decrypt compressed data.
 	 */
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && crypto_is_aead(&(pctx->crypto_ctx))) {
+		/*
+		 * Verify the tag and decrypt in one pass.
+		 */
+		memcpy(checksum, cbuf + 25, AEAD_TAG_LEN);
+		memset(cbuf + 25, 0, pctx->mac_bytes + CRC32_SIZE);
+		rv = crypto_aead_buf(&(pctx->crypto_ctx), cseg, cseg, len_cmp,
+		    META_AEAD_ID(mctx->id), cbuf, METADATA_HDR_SZ, checksum);
+		if (rv == -1) {
+			log_msg(LOG_ERR, 0, "Metadata chunk %d, authentication failed",
+			    mctx->id);
+			return (0);
+		}
+	} else if (pctx->encrypt_type) {
 		unsigned int len;
 
 		len = pctx->mac_bytes;
 		deserialize_checksum(checksum, cbuf + 25, pctx->mac_bytes);
 		memset(cbuf + 25, 0, pctx->mac_bytes + CRC32_SIZE);
-		hmac_reinit(&mctx->chunk_hmac);
-		hmac_update(&mctx->chunk_hmac, cbuf, len_cmp + METADATA_HDR_SZ);
-		hmac_final(&mctx->chunk_hmac, mctx->checksum, &len);
-		if (memcmp(checksum, mctx->checksum, len) != 0) {
+		hmac_reinit(&blk->chunk_hmac);
+		hmac_update(&blk->chunk_hmac, cbuf, len_cmp + METADATA_HDR_SZ);
+		hmac_final(&blk->chunk_hmac, blk->checksum, &len);
+		if (memcmp(checksum, blk->checksum, len) != 0) {
 			log_msg(LOG_ERR, 0, "Metadata chunk %d, HMAC verification failed",
 			    mctx->id);
 			return (0);
@@ -344,8 +1002,29 @@ decompress_data(meta_ctx_t *mctx)
 	}
 
 	if (type & PREPROC_COMPRESSED) {
-		rv = bzip2_decompress(cseg, len_cmp, ubuf, &dstlen, mctx->comp_level,
-		    0, TYPE_BINARY, mctx->bzip2_dat);
+		if (type & META_FLAG_LZ4)
+			codec = META_CODEC_LZ4;
+		else if (type & META_FLAG_ZSTD)
+			codec = META_CODEC_ZSTD;
+		else
+			codec = META_CODEC_BZIP2;
+		cdat = meta_codec_get(mctx, blk, codec);
+		if (cdat == NULL) {
+			log_msg(LOG_ERR, 0, "Metadata chunk %d, codec not supported.", mctx->id);
+			return (0);
+		}
+		if (codec == META_CODEC_LZ4) {
+			rv = lz4_decompress(cseg, len_cmp, ubuf, &dstlen, 1,
+			    0, TYPE_BINARY, cdat);
+#ifdef ENABLE_PC_ZSTD
+		} else if (codec == META_CODEC_ZSTD) {
+			rv = zstd_decompress(cseg, len_cmp, ubuf, &dstlen, mctx->comp_level,
+			    0, TYPE_BINARY, cdat);
+#endif
+		} else {
+			rv = bzip2_decompress(cseg, len_cmp, ubuf, &dstlen, mctx->comp_level,
+			    0, TYPE_BINARY, cdat);
+		}
 		if (rv == -1) {
 			log_msg(LOG_ERR, 0, "Metadata chunk %d, decompression failed.", mctx->id);
 			return (0);
@@ -365,12 +1044,21 @@ decompress_data(meta_ctx_t *mctx)
                 dstlen = _dstlen;
 	}
 
+	if (type & META_FLAG_COLUMNAR) {
+		if (meta_col_decode(ubuf, dstlen, cseg, origlen) == -1) {
+			log_msg(LOG_ERR, 0, "Metadata chunk %d, columnar decoding failed.", mctx->id);
+			return (0);
+		}
+		memcpy(ubuf, cseg, origlen);
+		dstlen = origlen;
+	}
+
 	/*
 	 * Now verify normal checksum if not using encryption.
 	 */
 	if (!pctx->encrypt_type) {
-		compute_checksum(mctx->checksum, pctx->cksum, ubuf, dstlen, 0, 1);
-		if (memcmp(checksum, mctx->checksum, pctx->cksum_bytes) != 0) {
+		compute_checksum(blk->checksum, pctx->cksum, ubuf, dstlen, 0, 1);
+		if (memcmp(checksum, blk->checksum, pctx->cksum_bytes) != 0) {
 			log_msg(LOG_ERR, 0, "Metadata chunk %d, Checksum verification failed",
 				mctx->id);
 			return (0);
@@ -381,276 +1069,288 @@ decompress_data(meta_ctx_t *mctx)
 	return (1);
 }
 
-static void *
-metadata_decompress(void *dat)
+/*
+ * Scan to the next metadata chunk and decompress it. This runs in the thread
+ * of the archive reader. Returns 1 on success, 2 at the end of the file and 0
+ * on error.
+ */
+static int
+metadata_decompress_next(meta_ctx_t *mctx)
 {
-	meta_ctx_t *mctx = (meta_ctx_t *)dat;
-	pc_ctx_t *pctx;
-	meta_msg_t *msgp;
-	int ack;
+	pc_ctx_t *pctx = mctx->pctx;
+	uchar_t *frombuf = mctx->blk[0].frombuf;
+	int64_t rb;
+	uint64_t len_cmp;
+	off_t rpos;
 
-	pctx = mctx->pctx;
-	mctx->running = 1;
-	mctx->topos = mctx->tosize = 0;
-	mctx->id = -1;
-	while (Read(mctx->meta_pipes[SINK_CHANNEL], &msgp, sizeof (msgp)) == sizeof (msgp)) {
-		int64_t rb;
-		uint64_t len_cmp;
+	mctx->id++;
+
+	/*
+	 * Hop over data chunks using their compressed length. Only the length
+	 * field of each one is read, with a positional read to save a seek.
+	 */
+	rpos = lseek(mctx->comp_fd, 0, SEEK_CUR);
+	if (rpos == -1) {
+		log_msg(LOG_ERR, 1, "Cannot find/seek next metadata block.");
+		return (0);
+	}
+	while ((rb = pread(mctx->comp_fd, &len_cmp, sizeof (len_cmp), rpos)) ==
+	    sizeof (len_cmp)) {
+		len_cmp = ntohll(len_cmp);
+		rpos += sizeof (len_cmp);
+		if (len_cmp == METADATA_INDICATOR)
+			break;
+		if (len_cmp == 0) {
+			/*
+			 * We have reached the end of the file.
+			 */
+			return (2);
+		}
+		rpos += len_cmp + pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+	}
+	if (rb == -1) {
+		log_msg(LOG_ERR, 1, "Failed read from metadata fd: ");
+		return (0);
 
+	} else if (rb < sizeof (len_cmp)) {
 		/*
-		 * Scan to the next metadata chunk and decompress it, if our in-memory data
-		 * is fully consumed or not filled.
+		 * We have reached the end of the file.
 		 */
-		if (mctx->topos == mctx->tosize) {
-			uchar_t *frombuf = mctx->frombuf;
-
-			mctx->id++;
-			while ((rb = Read(mctx->comp_fd, &len_cmp, sizeof (len_cmp))
-			    == sizeof(len_cmp))) {
-				len_cmp = ntohll(len_cmp);
-				if (len_cmp != METADATA_INDICATOR) {
-					uint64_t skiplen;
-
-					if (len_cmp == 0) {
-						/*
-						 * We have reached the end of the file.
-						 */
-						msgp->len = 0;
-						ack = 1;
-						Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-						return (NULL);
-					}
-					skiplen = len_cmp + pctx->cksum_bytes + pctx->mac_bytes
-					    + CHUNK_FLAG_SZ;
-					int64_t cpos = lseek(mctx->comp_fd, skiplen, SEEK_CUR);
-					if (cpos == -1) {
-						log_msg(LOG_ERR, 1, "Cannot find/seek next metadata block.");
-						ack = 0;
-						Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-						return (NULL);
-					}
-				} else {
-					break;
-				}
-			}
-			if (rb == -1) {
-				log_msg(LOG_ERR, 1, "Failed read from metadata fd: ");
-				ack = 0;
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
+		return (2);
+	}
+	if (lseek(mctx->comp_fd, rpos, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot find/seek next metadata block.");
+		return (0);
+	}
+	U64_P(frombuf) = htonll(len_cmp);
+	frombuf += 8;
 
-			} else if (rb == 0) {
-				/*
-				 * We have reached the end of the file.
-				 */
-				msgp->len = 0;
-				ack = 1;
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
-			}
-			U64_P(frombuf) = htonll(len_cmp);
-			frombuf += 8;
+	/*
+	 * We are at the start of a metadata chunk. Read the size.
+	 */
+	if ((rb = Read(mctx->comp_fd, &len_cmp, sizeof (len_cmp))) != sizeof (len_cmp)) {
+		log_msg(LOG_ERR, 1, "Failed to read size from metadata fd: %lld", rb);
+		return (0);
+	}
+	U64_P(frombuf) = len_cmp;
+	frombuf += 8;
+	len_cmp = LE64(len_cmp);
+	if (len_cmp > METADATA_CHUNK_SIZE) {
+		log_msg(LOG_ERR, 0, "Metadata chunk %d, invalid length", mctx->id);
+		return (0);
+	}
 
-			/*
-			 * We are at the start of a metadata chunk. Read the size.
-			 */
-			if ((rb = Read(mctx->comp_fd, &len_cmp, sizeof (len_cmp)))
-			    != sizeof(len_cmp)) {
-				log_msg(LOG_ERR, 1, "Failed to read size from metadata fd: %lld", rb);
-				ack = 0;
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
-			}
-			U64_P(frombuf) = len_cmp;
-			frombuf += 8;
-			len_cmp = LE64(len_cmp);
+	/*
+	 * Now read the rest of the chunk. This is rest of the header plus the
+	 * data segment.
+	 */
+	len_cmp = len_cmp + (METADATA_HDR_SZ - (frombuf - mctx->blk[0].frombuf));
+	rb = Read(mctx->comp_fd, frombuf, len_cmp);
+	if (rb != len_cmp) {
+		log_msg(LOG_ERR, 1, "Failed to read chunk from metadata fd: ");
+		return (0);
+	}
+	mctx->topos = 0;
 
-			/*
-			 * Now read the rest of the chunk. This is rest of the header plus the
-			 * data segment.
-			 */
-			len_cmp = len_cmp + (METADATA_HDR_SZ - (frombuf - mctx->frombuf));
-			rb = Read(mctx->comp_fd, frombuf, len_cmp);
-			if (rb != len_cmp) {
-				log_msg(LOG_ERR, 1, "Failed to read chunk from metadata fd: ");
-				ack = 0;
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
-			}
-			mctx->topos = 0;
-			mctx->frompos = len_cmp + METADATA_HDR_SZ;
+	/*
+	 * Now decompress.
+	 */
+	if (!decompress_data(mctx))
+		return (0);
+	return (1);
+}
 
-			/*
-			 * Now decompress.
-			 */
-			if (!decompress_data(mctx)) {
-				ack = 0;
-				Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-				return (NULL);
-			}
-		}
+static void
+meta_ctx_free(meta_ctx_t *mctx)
+{
+	int i;
 
-		msgp->buf = mctx->tobuf;
-		msgp->len = mctx->tosize;
-		mctx->topos = mctx->tosize;
-		ack = 1;
-		Write(mctx->meta_pipes[SINK_CHANNEL], &ack, sizeof (ack));
-	}
+	for (i = 0; i < mctx->nblk; i++) {
+		struct meta_blk *blk = &mctx->blk[i];
 
-	return (NULL);
+		meta_codec_release(blk);
+		if (mctx->pctx->encrypt_type)
+			hmac_cleanup(&blk->chunk_hmac);
+		if (blk->frombuf)
+			slab_free(NULL, blk->frombuf);
+		if (blk->tobuf)
+			slab_free(NULL, blk->tobuf);
+	}
+	pthread_mutex_destroy(&mctx->lock);
+	pthread_cond_destroy(&mctx->cv);
+	slab_free(NULL, mctx);
 }
 
 /*
- * Create the metadata thread and associated buffers. This writes out compressed
- * metadata chunks into the archive. This is libarchive metadata.
+ * Create the metadata context and associated buffers. When compressing this
+ * starts the workers that write out compressed metadata chunks into the
+ * archive. This is libarchive metadata.
  */
 meta_ctx_t *
 meta_ctx_create(void *pc, int file_version, int comp_fd)
 {
 	pc_ctx_t *pctx = (pc_ctx_t *)pc;
 	meta_ctx_t *mctx;
+	uint64_t bufsz;
+	long nprocs;
+	char *val;
+	int i;
 
-	slab_cache_add(METADATA_CHUNK_SIZE + METADATA_HDR_SZ);
+	bufsz = METADATA_CHUNK_SIZE + METADATA_HDR_SZ + lz4_buf_extra(METADATA_CHUNK_SIZE);
+	slab_cache_add(bufsz);
 	slab_cache_add(sizeof (meta_ctx_t));
 	mctx = (meta_ctx_t *)slab_alloc(NULL, sizeof (meta_ctx_t));
 	if (!mctx) {
 		log_msg(LOG_ERR, 1, "Failed to allocate metadata context.");
 		return (NULL);
 	}
-
-	mctx->running = 0;
-	if (pctx->encrypt_type) {
-		if (hmac_init(&mctx->chunk_hmac, pctx->cksum,
-		    &(pctx->crypto_ctx)) == -1) {
-			(void) free(mctx);
-			log_msg(LOG_ERR, 0, "Cannot initialize metadata hmac.");
-			return (NULL);
-		}
-	}
-
+	memset(mctx, 0, sizeof (meta_ctx_t));
+	mctx->pctx = pctx;
 	mctx->comp_fd = comp_fd;
-	mctx->frompos = 0;
-	mctx->frombuf = slab_alloc(NULL, METADATA_CHUNK_SIZE + METADATA_HDR_SZ);
-	if (!mctx->frombuf) {
-		(void) free(mctx);
-		log_msg(LOG_ERR, 1, "Failed to allocate metadata buffer.");
-		return (NULL);
+	mctx->do_compress = pctx->do_compress;
+	mctx->comp_level = (pctx->level > 9 ? 9 : pctx->level);
+	mctx->id = -1;
+	pthread_mutex_init(&mctx->lock, NULL);
+	pthread_cond_init(&mctx->cv, NULL);
+
+	/*
+	 * Decompression runs in the caller's thread with a single block.
+	 */
+	mctx->nblk = 1;
+	if (mctx->do_compress) {
+		nprocs = get_avail_cpus();
+		mctx->nblk = (nprocs < METADATA_THREADS ? (int)nprocs : METADATA_THREADS);
+		if (mctx->nblk < 2)
+			mctx->nblk = 2;
 	}
+	for (i = 0; i < mctx->nblk; i++) {
+		struct meta_blk *blk = &mctx->blk[i];
 
-	mctx->tobuf = slab_alloc(NULL, METADATA_CHUNK_SIZE + METADATA_HDR_SZ);
-	if (!mctx->tobuf) {
-		(void) free(mctx->frombuf);
-		(void) free(mctx);
-		log_msg(LOG_ERR, 1, "Failed to allocate metadata buffer.");
-		return (NULL);
+		blk->mctx = mctx;
+		blk->frombuf = slab_alloc(NULL, bufsz);
+		blk->tobuf = slab_alloc(NULL, bufsz);
+		if (!blk->frombuf || !blk->tobuf) {
+			log_msg(LOG_ERR, 1, "Failed to allocate metadata buffer.");
+			meta_ctx_free(mctx);
+			return (NULL);
+		}
+		if (pctx->encrypt_type) {
+			if (hmac_init(&blk->chunk_hmac, pctx->cksum,
+			    &(pctx->crypto_ctx)) == -1) {
+				log_msg(LOG_ERR, 0, "Cannot initialize metadata hmac.");
+				mctx->nblk = i;
+				meta_ctx_free(mctx);
+				return (NULL);
+			}
+		}
 	}
 
+#ifdef POSIX_FADV_RANDOM
 	/*
-	 * The archiver passes metadata via this socketpair. Memory buffer pointers
-	 * are passed through the socket for speed rather than the contents.
+	 * When only listing, this fd hops from one metadata chunk to the next.
+	 * Readahead would pull in the data chunks in between.
 	 */
-	mctx->pctx = pctx;
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, mctx->meta_pipes) == -1) {
-		(void) free(mctx->frombuf);
-		(void) free(mctx->tobuf);
-		(void) free(mctx);
-		log_msg(LOG_ERR, 1, "Unable to create a metadata ctx channel.");
-		return (NULL);
-	}
+	if (pctx->list_mode)
+		(void) posix_fadvise(comp_fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
 
 	if (pctx->level > 9)
 		mctx->delta2_nstrides = NSTRIDES_EXTRA;
 	else
 		mctx->delta2_nstrides = NSTRIDES_STANDARD;
-	if (pctx->do_compress) {
-		int rv;
-
-		mctx->comp_level = pctx->level;
-		rv = bzip2_init(&mctx->bzip2_dat, &mctx->comp_level, 1, METADATA_CHUNK_SIZE,
-		    file_version, COMPRESS);
+	if (mctx->do_compress) {
+		mctx->codec = meta_codec_select();
+		val = getenv("PCOMPRESS_META_COLUMNAR");
+		mctx->columnar = (val == NULL || atoi(val) != 0);
 		bzip2_props(&mctx->props, pctx->level, METADATA_CHUNK_SIZE);
-		if (rv != 0 || pthread_create(&(mctx->meta_thread), NULL, metadata_compress,
-		    (void *)mctx) != 0) {
-			(void) close(mctx->meta_pipes[0]);
-			(void) close(mctx->meta_pipes[1]);
-			(void) free(mctx->frombuf);
-			(void) free(mctx->tobuf);
-			(void) free(mctx);
-			if (rv == 0)
-				log_msg(LOG_ERR, 0, "Lzma init failed.");
-			else
-				log_msg(LOG_ERR, 1, "Unable to create metadata thread.");
-			return (NULL);
-		}
-	} else {
-		int rv;
-
-		mctx->comp_level = pctx->level;
-		rv = bzip2_init(&mctx->bzip2_dat, &mctx->comp_level, 1, METADATA_CHUNK_SIZE,
-		    file_version, DECOMPRESS);
-		if (rv != 0 || pthread_create(&(mctx->meta_thread), NULL, metadata_decompress,
-		    (void *)mctx) != 0) {
-			(void) close(mctx->meta_pipes[0]);
-			(void) close(mctx->meta_pipes[1]);
-			(void) free(mctx->frombuf);
-			(void) free(mctx->tobuf);
-			(void) free(mctx);
-			if (rv == 0)
-				log_msg(LOG_ERR, 0, "Lzma init failed.");
-			else
+		for (i = 0; i < mctx->nblk; i++) {
+			if (meta_codec_get(mctx, &mctx->blk[i], mctx->codec) == NULL ||
+			    pthread_create(&(mctx->blk[i].thr), NULL, metadata_compress,
+			    (void *)&mctx->blk[i]) != 0) {
 				log_msg(LOG_ERR, 1, "Unable to create metadata thread.");
-			return (NULL);
+				meta_ctx_done(mctx);
+				return (NULL);
+			}
+			mctx->nthr++;
 		}
 	}
-
-	mctx->do_compress = pctx->do_compress;
 	return (mctx);
 }
 
+/*
+ * Pass a metadata buffer. When compressing the data is copied into the current
+ * block, which is handed to a worker once full. When decompressing the next
+ * decoded block is returned in *buf and *len, a zero length at the end.
+ * Returns 1 on success, -1 on error.
+ */
 int
 meta_ctx_send(meta_ctx_t *mctx, const void **buf, size_t *len)
 {
-	int ack;
-	meta_msg_t msg, *msgp;
-
-	/*
-	 * Write the message buffer to the pipe.
-	 */
-	msg.buf = *buf;
-	msg.len = *len;
-	msgp = &msg;
-	if (Write(mctx->meta_pipes[SRC_CHANNEL], &msgp, sizeof (msgp)) <
-	    sizeof (msgp)) {
-		log_msg(LOG_ERR, 1, "Meta socket write error.");
-		return (0);
-	}
+	struct meta_blk *blk;
+	int rv;
 
-	/*
-	 * Wait for ACK.
-	 */
-	if (Read(mctx->meta_pipes[SRC_CHANNEL], &ack, sizeof (ack)) <
-	    sizeof (ack)) {
-		log_msg(LOG_ERR, 1, "Meta socket read error.");
-		return (0);
+	if (!mctx->do_compress) {
+		if (mctx->topos == mctx->tosize) {
+			rv = metadata_decompress_next(mctx);
+			if (rv == 0)
+				return (-1);
+			if (rv == 2) {
+				*len = 0;
+				return (1);
+			}
+		}
+		*buf = mctx->blk[0].tobuf;
+		*len = mctx->tosize;
+		mctx->topos = mctx->tosize;
+		return (1);
 	}
 
-	if (!ack) {
+	if (mctx->err)
+		return (-1);
+	if (*len > METADATA_CHUNK_SIZE) {
+		log_msg(LOG_ERR, 0, "Metadata block too large.");
 		return (-1);
 	}
-
-	*len = msg.len;
-	*buf = msg.buf;
+	blk = &mctx->blk[mctx->cur];
+	if (blk->frompos + *len > METADATA_CHUNK_SIZE) {
+		/*
+		 * Accumulating the metadata block will overflow buffer. Hand it
+		 * over and copy the new data into the next one.
+		 */
+		if (meta_blk_submit(mctx) == -1)
+			return (-1);
+		blk = &mctx->blk[mctx->cur];
+	}
+	memcpy(blk->frombuf + blk->frompos, *buf, *len);
+	blk->frompos += *len;
+	if (blk->frompos == METADATA_CHUNK_SIZE) {
+		if (meta_blk_submit(mctx) == -1)
+			return (-1);
+	}
 	return (1);
 }
 
+/*
+ * Flush any accumulated metadata, wait for all of it to be written and free
+ * the context.
+ */
 int
 meta_ctx_done(meta_ctx_t *mctx)
 {
-	meta_ctx_close_src_channel(mctx);
-	meta_ctx_close_sink_channel(mctx);
+	int i, err;
+
+	if (mctx->do_compress && mctx->nthr == mctx->nblk &&
+	    mctx->blk[mctx->cur].frompos > 0)
+		(void) meta_blk_submit(mctx);
+	pthread_mutex_lock(&mctx->lock);
+	mctx->stop = 1;
+	pthread_cond_broadcast(&mctx->cv);
+	pthread_mutex_unlock(&mctx->lock);
+	for (i = 0; i < mctx->nthr; i++)
+		pthread_join(mctx->blk[i].thr, NULL);
 	if (!mctx->do_compress)
 		close(mctx->comp_fd);
-	pthread_join(mctx->meta_thread, NULL);
-	return (0);
+	err = mctx->err;
+	meta_ctx_free(mctx);
+	return (err ? -1 : 0);
 }
-
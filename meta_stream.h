@@ -50,16 +50,9 @@ extern "C" {
 
 typedef struct _meta_ctx meta_ctx_t;
 
-typedef struct _meta_msg {
-	const uchar_t *buf;
-	size_t len;
-} meta_msg_t;
-
 meta_ctx_t *meta_ctx_create(void *pc, int file_version, int comp_fd);
 int meta_ctx_send(meta_ctx_t *mctx, const void **buf, size_t *len);
 int meta_ctx_done(meta_ctx_t *mctx);
-void meta_ctx_close_sink_channel(meta_ctx_t *mctx);
-void meta_ctx_close_src_channel(meta_ctx_t *mctx);
 
 #ifdef	__cplusplus
 }
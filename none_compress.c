@@ -50,6 +50,7 @@ none_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->compress_mt_capable = 0;
 	data->decompress_mt_capable = 0;
 	data->buf_extra = 0;
+	data->decomp_direct = 1;
 	data->delta2_span = 50;
 }
 
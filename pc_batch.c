@@ -0,0 +1,426 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Batch interface for many small in-memory objects. Every object is
+ * compressed on its own with the context's algorithm into a compact frame,
+ * without file or chunk headers. A pool of worker threads is kept for the
+ * lifetime of the batch context, each with its own algorithm state that is
+ * set up once and reused for every object the thread handles.
+ *
+ * Usage:
+ *	b = pc_batch_create(argc, argv);	// -c <algo> [-l <level>] [-t <threads>]
+ *	dst[i] = malloc(pc_batch_bound(srclen[i]));
+ *	pc_batch_compress(b, src, srclen, dst, dstlen, n);
+ *	...
+ *	olen[i] = pc_batch_size(dst[i], dstlen[i]);
+ *	pc_batch_decompress(b, dst, dstlen, out, olen, n);
+ *	pc_batch_destroy(b);
+ *
+ * Frame layout:
+ *	1 byte     Chunk header flags: COMPRESSED and the adaptive mode
+ *	           algorithm, as in a regular chunk header.
+ *	1-10 bytes Original length, 7 bits per byte, low bits first.
+ *	...        Compressed data, or the original data if it did not shrink.
+ *
+ * Frames do not say which algorithm made them and carry no checksum. They must
+ * be decompressed with a context created with the same algorithm.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pcompress.h"
+#include "allocator.h"
+#include "utils/utils.h"
+
+#define	BATCH_MIN_STATE		(64 * 1024)
+#define	BATCH_MAX_THREADS	256
+
+struct batch_worker {
+	pthread_t thr;
+	struct pc_batch *b;
+	Hsem_t start_sem;
+	void *cdata, *ddata;
+	uint64_t csize, dsize;
+	int clevel, dlevel;
+	uchar_t *scratch;
+	uint64_t scratch_sz;
+};
+
+struct pc_batch {
+	pc_ctx_t *pctx;
+	char **argv;
+	int nworkers, started;
+	struct batch_worker *w;
+	Hsem_t done_sem;
+
+	/*
+	 * The current job. Workers take objects from it by index.
+	 */
+	int op, quit;
+	const uchar_t **src;
+	const uint64_t *srclen;
+	uchar_t **dst;
+	uint64_t *dstlen;
+	uint32_t n, next;
+	int err;
+};
+
+/*
+ * Make sure a worker's algorithm state can take objects of len bytes. It is
+ * rebuilt for a larger size when a bigger object comes along.
+ */
+static int
+batch_codec(struct batch_worker *w, compress_op_t op, uint64_t len)
+{
+	pc_ctx_t *pctx = w->b->pctx;
+	void **data;
+	uint64_t *size;
+	int *level;
+
+	data = (op == COMPRESS ? &w->cdata : &w->ddata);
+	size = (op == COMPRESS ? &w->csize : &w->dsize);
+	level = (op == COMPRESS ? &w->clevel : &w->dlevel);
+	if (*size >= len)
+		return (0);
+	if (*size > 0 && pctx->_deinit_func)
+		pctx->_deinit_func(data);
+	*data = NULL;
+	*size = BATCH_MIN_STATE;
+	while (*size < len)
+		*size <<= 1;
+	*level = pctx->level;
+	if (pctx->_init_func &&
+	    pctx->_init_func(data, level, 1, *size, VERSION, op) != 0) {
+		*size = 0;
+		return (-1);
+	}
+	return (0);
+}
+
+static uchar_t *
+batch_scratch(struct batch_worker *w, uint64_t len)
+{
+	algo_props_t props;
+
+	init_algo_props(&props);
+	if (w->b->pctx->_props_func)
+		w->b->pctx->_props_func(&props, w->clevel, w->csize);
+	len += zlib_buf_extra(len) + props.buf_extra;
+	if (w->scratch_sz < len) {
+		slab_free(NULL, w->scratch);
+		w->scratch = (uchar_t *)slab_alloc(NULL, len);
+		w->scratch_sz = (w->scratch ? len : 0);
+	}
+	return (w->scratch);
+}
+
+static int
+batch_put_len(uchar_t *p, uint64_t len)
+{
+	int i;
+
+	for (i = 0; len >= 0x80; i++) {
+		p[i] = (uchar_t)(len | 0x80);
+		len >>= 7;
+	}
+	p[i++] = (uchar_t)len;
+	return (i);
+}
+
+static int
+batch_get_len(const uchar_t *p, uint64_t avail, uint64_t *len)
+{
+	int i, shift;
+
+	*len = 0;
+	for (i = 0, shift = 0; i < avail && shift < 64; i++, shift += 7) {
+		*len |= (uint64_t)(p[i] & 0x7f) << shift;
+		if (!(p[i] & 0x80))
+			return (i + 1);
+	}
+	return (-1);
+}
+
+static int
+batch_compress_one(struct batch_worker *w, uint32_t i)
+{
+	struct pc_batch *b = w->b;
+	pc_ctx_t *pctx = b->pctx;
+	const uchar_t *src = b->src[i];
+	uint64_t srclen = b->srclen[i], clen;
+	uchar_t *dst = b->dst[i], *cbuf, chdr;
+	int hl, rv;
+
+	chdr = UNCOMPRESSED;
+	hl = 1 + batch_put_len(dst + 1, srclen);
+	rv = -1;
+	clen = 0;
+	if (srclen > 0 && batch_codec(w, COMPRESS, srclen) == 0 &&
+	    (cbuf = batch_scratch(w, srclen)) != NULL) {
+		clen = w->scratch_sz;
+		rv = pctx->_compress_func((void *)src, srclen, cbuf, &clen, w->clevel, 0,
+		    TYPE_UNKNOWN, w->cdata);
+	}
+	if (rv >= 0 && clen < srclen) {
+		chdr = COMPRESSED;
+		if (pctx->adapt_mode)
+			chdr |= (rv << 4);
+		memcpy(dst + hl, cbuf, clen);
+	} else {
+		clen = srclen;
+		memcpy(dst + hl, src, srclen);
+	}
+	dst[0] = chdr;
+	b->dstlen[i] = hl + clen;
+	return (0);
+}
+
+static int
+batch_decompress_one(struct batch_worker *w, uint32_t i)
+{
+	struct pc_batch *b = w->b;
+	pc_ctx_t *pctx = b->pctx;
+	const uchar_t *src = b->src[i];
+	uint64_t srclen = b->srclen[i], olen, dlen;
+	uchar_t chdr;
+	int hl;
+
+	if (srclen < 2 || (hl = batch_get_len(src + 1, srclen - 1, &olen)) < 0)
+		return (-1);
+	hl++;
+	if (olen > b->dstlen[i])
+		return (-1);
+	chdr = src[0];
+	if (!(chdr & COMPRESSED)) {
+		if (srclen - hl != olen)
+			return (-1);
+		memcpy(b->dst[i], src + hl, olen);
+		b->dstlen[i] = olen;
+		return (0);
+	}
+	if (batch_codec(w, DECOMPRESS, olen) != 0)
+		return (-1);
+	dlen = olen;
+	if (pctx->_decompress_func((void *)(src + hl), srclen - hl, b->dst[i], &dlen,
+	    w->dlevel, chdr, TYPE_UNKNOWN, w->ddata) < 0 || dlen != olen)
+		return (-1);
+	b->dstlen[i] = olen;
+	return (0);
+}
+
+static void *
+batch_thread(void *dat)
+{
+	struct batch_worker *w = (struct batch_worker *)dat;
+	struct pc_batch *b = w->b;
+	uint32_t i;
+
+	for (;;) {
+		Hsem_Wait(&w->start_sem);
+		if (b->quit)
+			break;
+		while ((i = __sync_fetch_and_add(&b->next, 1)) < b->n) {
+			if ((b->op == COMPRESS ? batch_compress_one(w, i) :
+			    batch_decompress_one(w, i)) != 0)
+				b->err = 1;
+		}
+		Hsem_Post(&b->done_sem);
+	}
+	if (w->csize > 0 && b->pctx->_deinit_func)
+		b->pctx->_deinit_func(&w->cdata);
+	if (w->dsize > 0 && b->pctx->_deinit_func)
+		b->pctx->_deinit_func(&w->ddata);
+	return (NULL);
+}
+
+static int
+batch_run(pc_batch_t *b, int op, const uchar_t **src, const uint64_t *srclen,
+    uchar_t **dst, uint64_t *dstlen, uint32_t n)
+{
+	int i, nw;
+
+	if (n == 0)
+		return (0);
+	b->op = op;
+	b->src = src;
+	b->srclen = srclen;
+	b->dst = dst;
+	b->dstlen = dstlen;
+	b->n = n;
+	b->next = 0;
+	b->err = 0;
+
+	/*
+	 * Do not wake up more workers than there are objects.
+	 */
+	nw = (n < b->nworkers ? n : b->nworkers);
+	for (i = 0; i < nw; i++)
+		Hsem_Post(&b->w[i].start_sem);
+	for (i = 0; i < nw; i++)
+		Hsem_Wait(&b->done_sem);
+	return (b->err ? -1 : 0);
+}
+
+/*
+ * Create a batch context from command line style options. Only the
+ * algorithm, level and thread count are used, -c is required. As with
+ * init_pc_context() the argument strings must remain valid for the lifetime
+ * of the context.
+ */
+pc_batch_t DLL_EXPORT *
+pc_batch_create(int argc, char *argv[])
+{
+	pc_batch_t *b;
+	int i;
+
+	if (argc < 1)
+		return (NULL);
+	b = (pc_batch_t *)calloc(1, sizeof (pc_batch_t));
+	if (b == NULL)
+		return (NULL);
+
+	/*
+	 * Insert "-p" right after the program name so no pathnames are needed.
+	 */
+	b->argv = (char **)malloc((argc + 2) * sizeof (char *));
+	if (b->argv == NULL)
+		goto create_err;
+	b->argv[0] = argv[0];
+	b->argv[1] = "-p";
+	for (i = 1; i < argc; i++)
+		b->argv[i + 1] = argv[i];
+	b->argv[argc + 1] = NULL;
+
+	b->pctx = create_pc_context();
+	if (init_pc_context(b->pctx, argc + 1, b->argv) != 0)
+		goto create_err;
+	if (!b->pctx->do_compress || b->pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "Batch needs an algorithm given with -c.");
+		goto create_err;
+	}
+
+	b->nworkers = b->pctx->nthreads;
+	if (b->nworkers <= 0)
+		b->nworkers = get_avail_cpus();
+	if (b->nworkers > BATCH_MAX_THREADS)
+		b->nworkers = BATCH_MAX_THREADS;
+	b->w = (struct batch_worker *)calloc(b->nworkers, sizeof (struct batch_worker));
+	if (b->w == NULL)
+		goto create_err;
+	Hsem_Init(&b->done_sem, 0);
+	for (i = 0; i < b->nworkers; i++) {
+		b->w[i].b = b;
+		Hsem_Init(&b->w[i].start_sem, 0);
+		if (pthread_create(&b->w[i].thr, NULL, batch_thread, &b->w[i]) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			Hsem_Destroy(&b->w[i].start_sem);
+			break;
+		}
+		b->started++;
+	}
+	if (b->started < b->nworkers)
+		goto create_err;
+	return (b);
+
+create_err:
+	pc_batch_destroy(b);
+	return (NULL);
+}
+
+/*
+ * Largest frame pc_batch_compress() can produce for an object of len bytes.
+ */
+uint64_t DLL_EXPORT
+pc_batch_bound(uint64_t len)
+{
+	return (len + PC_BATCH_HDR_MAX);
+}
+
+/*
+ * Original length of the object in a frame, -1 if the frame is invalid.
+ */
+int64_t DLL_EXPORT
+pc_batch_size(const void *frame, uint64_t len)
+{
+	uint64_t olen;
+
+	if (len < 2 || batch_get_len((const uchar_t *)frame + 1, len - 1, &olen) < 0)
+		return (-1);
+	return (olen);
+}
+
+/*
+ * Compress n objects in parallel. dst[i] must have room for
+ * pc_batch_bound(srclen[i]) bytes, the frame length is returned in
+ * dstlen[i]. Returns 0 on success.
+ */
+int DLL_EXPORT
+pc_batch_compress(pc_batch_t *b, const void **src, const uint64_t *srclen,
+    void **dst, uint64_t *dstlen, uint32_t n)
+{
+	return (batch_run(b, COMPRESS, (const uchar_t **)src, srclen, (uchar_t **)dst,
+	    dstlen, n));
+}
+
+/*
+ * Decompress n frames in parallel. On input dstlen[i] is the room in dst[i],
+ * see pc_batch_size(), on return it is the object length. Returns 0 on
+ * success or -1 if any frame could not be decompressed.
+ */
+int DLL_EXPORT
+pc_batch_decompress(pc_batch_t *b, const void **src, const uint64_t *srclen,
+    void **dst, uint64_t *dstlen, uint32_t n)
+{
+	return (batch_run(b, DECOMPRESS, (const uchar_t **)src, srclen, (uchar_t **)dst,
+	    dstlen, n));
+}
+
+void DLL_EXPORT
+pc_batch_destroy(pc_batch_t *b)
+{
+	int i;
+
+	if (b->w) {
+		b->quit = 1;
+		for (i = 0; i < b->started; i++)
+			Hsem_Post(&b->w[i].start_sem);
+		for (i = 0; i < b->started; i++) {
+			pthread_join(b->w[i].thr, NULL);
+			Hsem_Destroy(&b->w[i].start_sem);
+			slab_free(NULL, b->w[i].scratch);
+		}
+		Hsem_Destroy(&b->done_sem);
+		free(b->w);
+	}
+	if (b->pctx)
+		destroy_pc_context(b->pctx);
+	free(b->argv);
+	free(b);
+}
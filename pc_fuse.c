@@ -0,0 +1,742 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Read-only FUSE mount of an archive, from -J:
+ *
+ *	pcompress -d -J backup.pz /mnt/backup
+ *
+ * The archive must have been created with -a and -I. The directory tree is
+ * built from the member index at mount time. Member headers are only read
+ * when a file is looked at and file data is read with the byte range API,
+ * which seeks to the covering chunks through the chunk index and decodes
+ * them in parallel.
+ *
+ * Decoded ranges are kept in a few windows of whole chunks. A read that
+ * continues where the previous read of the same open file ended decodes up
+ * to one chunk per thread ahead, so sequential reads of big files use all
+ * threads and the following reads are served from the window.
+ *
+ * Members stored through a type filter are decoded whole while open. The
+ * mount runs in the foreground until it is unmounted with fusermount -u.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pcompress.h"
+#include "utils/utils.h"
+
+#ifdef ENABLE_PC_FUSE
+
+#define	FUSE_USE_VERSION	31
+#include <fuse.h>
+#include <pc_archive.h>
+
+#define	FUSE_WINDOWS	4
+#define	FUSE_HDR_PEEK	(64 * 1024)
+#define	FUSE_RA_MAX	(64 * 1024 * 1024)
+#define	FUSE_LINK_DEPTH	8
+
+struct fs_node {
+	char *path;
+	const char *name;
+	int64_t parent, child, next;
+	uint64_t off, end, data_off, seq;
+	int member, state, sized, nopen;
+	struct member_stat ms;
+	uchar_t *data;
+};
+
+struct fs_window {
+	uint64_t off, len, stamp;
+	uchar_t *buf;
+};
+
+struct pc_fs {
+	pc_ctx_t *pctx;
+	pthread_mutex_t lock;
+	struct fs_node *nodes;
+	uint64_t nnodes, maxnodes;
+	struct fs_window win[FUSE_WINDOWS];
+	uint64_t stamp, ra_chunks;
+	struct stat arc_st;
+};
+
+struct fs_file {
+	struct fs_node *node;
+	uint64_t next_off;
+};
+
+/*
+ * Drop leading slashes and "./", and trailing slashes from an archive name.
+ */
+static char *
+fs_norm(const char *name, size_t len)
+{
+	char *path;
+
+	for (;;) {
+		if (len > 0 && name[0] == '/') {
+			name++;
+			len--;
+		} else if (len > 1 && name[0] == '.' && name[1] == '/') {
+			name += 2;
+			len -= 2;
+		} else {
+			break;
+		}
+	}
+	while (len > 0 && name[len - 1] == '/')
+		len--;
+	if (len == 1 && name[0] == '.')
+		len = 0;
+	path = (char *)malloc(len + 1);
+	if (path != NULL) {
+		memcpy(path, name, len);
+		path[len] = '\0';
+	}
+	return (path);
+}
+
+static int
+fs_add(struct pc_fs *fs, char *path, uint64_t off, uint64_t end, int member)
+{
+	struct fs_node *n;
+
+	if (path == NULL)
+		return (-1);
+	if (fs->nnodes == fs->maxnodes) {
+		uint64_t nmax = fs->maxnodes ? fs->maxnodes * 2 : 1024;
+
+		n = (struct fs_node *)realloc(fs->nodes, nmax * sizeof (struct fs_node));
+		if (n == NULL) {
+			free(path);
+			return (-1);
+		}
+		fs->nodes = n;
+		fs->maxnodes = nmax;
+	}
+	n = &fs->nodes[fs->nnodes];
+	memset(n, 0, sizeof (*n));
+	n->path = path;
+	n->off = off;
+	n->end = end;
+	n->member = member;
+	n->seq = fs->nnodes++;
+	n->parent = n->child = n->next = -1;
+	return (0);
+}
+
+/*
+ * Sort by path with the last archive member for a path at the end of its
+ * run, that is the one which wins as in extraction.
+ */
+static int
+fs_node_cmp(const void *a, const void *b)
+{
+	const struct fs_node *x = (const struct fs_node *)a;
+	const struct fs_node *y = (const struct fs_node *)b;
+	int rv;
+
+	rv = strcmp(x->path, y->path);
+	if (rv != 0)
+		return (rv);
+	if (x->member != y->member)
+		return (x->member - y->member);
+	return (x->seq < y->seq ? -1 : (x->seq > y->seq));
+}
+
+static struct fs_node *
+fs_lookup(struct pc_fs *fs, const char *path)
+{
+	int64_t lo, hi, mid;
+	int rv;
+
+	lo = 0;
+	hi = fs->nnodes - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		rv = strcmp(path, fs->nodes[mid].path);
+		if (rv == 0)
+			return (&fs->nodes[mid]);
+		if (rv < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return (NULL);
+}
+
+/*
+ * Build the directory tree from the member index. Directories that only
+ * appear as parents of members are added as well.
+ */
+static int
+fs_build(struct pc_fs *fs)
+{
+	pc_ctx_t *pctx = fs->pctx;
+	uint64_t i, j, off, end;
+	uchar_t *pos;
+	char *path, *s;
+
+	if (fs_add(fs, strdup(""), 0, 0, 0) == -1)
+		return (-1);
+	pos = pctx->midx;
+	for (i = 0; i < pctx->midx_count; i++) {
+		uint16_t nlen;
+
+		off = ntohll(U64_P(pos));
+		nlen = ntohs(U16_P(pos + 8));
+		if (i + 1 < pctx->midx_count)
+			end = ntohll(U64_P(pos + 10 + nlen));
+		else
+			end = pctx->midx_end;
+		path = fs_norm((char *)pos + 10, nlen);
+		pos += 10 + nlen;
+		if (path == NULL)
+			return (-1);
+		if (*path == '\0' || end <= off) {
+			free(path);
+			continue;
+		}
+		if (fs_add(fs, path, off, end, 1) == -1)
+			return (-1);
+		path = strdup(path);
+		if (path == NULL)
+			return (-1);
+		while ((s = strrchr(path, '/')) != NULL) {
+			*s = '\0';
+			if (fs_add(fs, strdup(path), 0, 0, 0) == -1) {
+				free(path);
+				return (-1);
+			}
+		}
+		free(path);
+	}
+
+	qsort(fs->nodes, fs->nnodes, sizeof (struct fs_node), fs_node_cmp);
+	for (i = 0, j = 0; i < fs->nnodes; i++) {
+		if (i + 1 < fs->nnodes && strcmp(fs->nodes[i].path, fs->nodes[i + 1].path) == 0) {
+			free(fs->nodes[i].path);
+			continue;
+		}
+		fs->nodes[j++] = fs->nodes[i];
+	}
+	fs->nnodes = j;
+
+	/*
+	 * Link in reverse so that children are listed in sorted order.
+	 */
+	for (i = fs->nnodes - 1; i > 0; i--) {
+		struct fs_node *n, *p;
+
+		n = &fs->nodes[i];
+		s = strrchr(n->path, '/');
+		if (s != NULL) {
+			path = strndup(n->path, s - n->path);
+			if (path == NULL)
+				return (-1);
+			p = fs_lookup(fs, path);
+			free(path);
+			n->name = s + 1;
+		} else {
+			p = &fs->nodes[0];
+			n->name = n->path;
+		}
+		if (p == NULL)
+			return (-1);
+		n->parent = p - fs->nodes;
+		n->next = p->child;
+		p->child = i;
+	}
+	fs->nodes[0].name = "";
+	return (0);
+}
+
+static struct fs_window *
+fs_window_find(struct pc_fs *fs, uint64_t off)
+{
+	int i;
+
+	for (i = 0; i < FUSE_WINDOWS; i++) {
+		struct fs_window *w = &fs->win[i];
+
+		if (w->buf != NULL && off >= w->off && off < w->off + w->len) {
+			w->stamp = ++fs->stamp;
+			return (w);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Decode the chunks covering [off, off + len) into the least recently used
+ * window. Up to ra_chunks chunks are decoded, ending at ra_end.
+ */
+static struct fs_window *
+fs_window_load(struct pc_fs *fs, uint64_t off, uint64_t len, uint64_t ra_end)
+{
+	pc_ctx_t *pctx = fs->pctx;
+	uint64_t lo, hi, mid, c, woff, wend;
+	struct fs_window *w;
+	uchar_t *buf;
+	int64_t got;
+	int i;
+
+	lo = 0;
+	hi = pctx->cidx_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pctx->cidx[mid].uoff + pctx->cidx[mid].ulen <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == pctx->cidx_count)
+		return (NULL);
+	woff = wend = pctx->cidx[lo].uoff;
+	for (c = lo; c < pctx->cidx_count; c++) {
+		if (wend >= off + len && (c - lo >= fs->ra_chunks || wend >= ra_end))
+			break;
+		wend = pctx->cidx[c].uoff + pctx->cidx[c].ulen;
+	}
+
+	w = &fs->win[0];
+	for (i = 1; i < FUSE_WINDOWS; i++) {
+		if (w->buf == NULL)
+			break;
+		if (fs->win[i].buf == NULL || fs->win[i].stamp < w->stamp)
+			w = &fs->win[i];
+	}
+	free(w->buf);
+	w->buf = NULL;
+	buf = (uchar_t *)malloc(wend - woff);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		return (NULL);
+	}
+	got = start_decompress_range(pctx, pctx->filename, woff, wend - woff, buf);
+	if (got != wend - woff) {
+		log_msg(LOG_ERR, 0, "Unable to decompress the archive at offset %" PRIu64 ".",
+		    woff);
+		free(buf);
+		return (NULL);
+	}
+	w->buf = buf;
+	w->off = woff;
+	w->len = got;
+	w->stamp = ++fs->stamp;
+	return (w);
+}
+
+static int
+fs_stream_read(struct pc_fs *fs, uint64_t off, uint64_t len, uchar_t *dst, uint64_t ra_end)
+{
+	struct fs_window *w;
+	uint64_t n;
+
+	while (len > 0) {
+		w = fs_window_find(fs, off);
+		if (w == NULL && (w = fs_window_load(fs, off, len, ra_end)) == NULL)
+			return (-1);
+		n = w->off + w->len - off;
+		if (n > len)
+			n = len;
+		memcpy(dst, w->buf + (off - w->off), n);
+		dst += n;
+		off += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Read the member header of a node. Data is stored padded to the tar
+ * block size at the end of the member range.
+ */
+static int
+fs_node_load(struct pc_fs *fs, struct fs_node *n)
+{
+	uint64_t hlen, mlen, dlen;
+	uchar_t *buf;
+
+	if (!n->member || n->state != 0)
+		return (n->state < 0 ? -EIO : 0);
+	n->state = -1;
+	mlen = n->end - n->off;
+	hlen = mlen < FUSE_HDR_PEEK ? mlen : FUSE_HDR_PEEK;
+	buf = (uchar_t *)malloc(hlen);
+	if (buf == NULL)
+		return (-ENOMEM);
+	if (fs_stream_read(fs, n->off, hlen, buf, 0) == 0 &&
+	    archive_member_stat(buf, hlen, &n->ms) == 0) {
+		dlen = (n->ms.stored + 511) & ~511ULL;
+		if (n->ms.stored >= 0 && dlen <= mlen) {
+			n->data_off = mlen - dlen;
+			n->state = 1;
+		} else {
+			log_msg(LOG_ERR, 0, "Bad member header for %s.", n->path);
+		}
+	}
+	free(buf);
+	return (n->state < 0 ? -EIO : 0);
+}
+
+/*
+ * Follow hardlinks and duplicate file references to the node holding the
+ * data.
+ */
+static struct fs_node *
+fs_node_data(struct pc_fs *fs, struct fs_node *n)
+{
+	const char *src;
+	char *path;
+	int depth;
+
+	for (depth = 0; depth < FUSE_LINK_DEPTH; depth++) {
+		if (fs_node_load(fs, n) != 0)
+			return (NULL);
+		if (n->ms.hardlink)
+			src = n->ms.link;
+		else if (n->ms.dup != NULL)
+			src = n->ms.dup;
+		else
+			return (n);
+		path = fs_norm(src, strlen(src));
+		if (path == NULL)
+			return (NULL);
+		n = fs_lookup(fs, path);
+		free(path);
+		if (n == NULL || !n->member)
+			return (NULL);
+	}
+	return (NULL);
+}
+
+/*
+ * Decode a filtered member whole. The file size is only known after that.
+ */
+static int
+fs_node_decode(struct pc_fs *fs, struct fs_node *n)
+{
+	uint64_t mlen, olen;
+	uchar_t *buf, *out;
+	int64_t got;
+
+	if (n->data != NULL)
+		return (0);
+	mlen = n->end - n->off;
+	buf = (uchar_t *)malloc(mlen);
+	if (buf == NULL)
+		return (-ENOMEM);
+	got = start_decompress_range(fs->pctx, fs->pctx->filename, n->off, mlen, buf);
+	if (got != mlen || archive_member_decode(fs->pctx, buf, mlen, &out, &olen) != 0) {
+		free(buf);
+		return (-EIO);
+	}
+	free(buf);
+	n->data = out;
+	n->ms.st.st_size = olen;
+	n->sized = 1;
+	return (0);
+}
+
+static int
+fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_node *n, *d;
+	int rv;
+
+	n = fs_lookup(fs, path + 1);
+	if (n == NULL)
+		return (-ENOENT);
+	pthread_mutex_lock(&fs->lock);
+	rv = 0;
+	d = NULL;
+	if (!n->member) {
+		memset(st, 0, sizeof (*st));
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		st->st_uid = fs->arc_st.st_uid;
+		st->st_gid = fs->arc_st.st_gid;
+		st->st_atime = fs->arc_st.st_atime;
+		st->st_mtime = fs->arc_st.st_mtime;
+		st->st_ctime = fs->arc_st.st_ctime;
+	} else if ((rv = fs_node_load(fs, n)) == 0) {
+		memcpy(st, &n->ms.st, sizeof (*st));
+		if (S_ISREG(st->st_mode) && (d = fs_node_data(fs, n)) == NULL) {
+			rv = -EIO;
+		} else if (S_ISREG(st->st_mode)) {
+			if (d->ms.filtered && !d->sized && (rv = fs_node_decode(fs, d)) == 0 &&
+			    d->nopen == 0) {
+				free(d->data);
+				d->data = NULL;
+			}
+			st->st_size = d->ms.st.st_size;
+		}
+		st->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+		st->st_blocks = (st->st_size + 511) / 512;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return (rv);
+}
+
+static int
+fs_readlink(const char *path, char *buf, size_t size)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_node *n;
+	int rv;
+
+	n = fs_lookup(fs, path + 1);
+	if (n == NULL)
+		return (-ENOENT);
+	pthread_mutex_lock(&fs->lock);
+	rv = fs_node_load(fs, n);
+	if (rv == 0 && (!n->member || !S_ISLNK(n->ms.st.st_mode) || n->ms.hardlink))
+		rv = -EINVAL;
+	if (rv == 0 && size > 0) {
+		strncpy(buf, n->ms.link, size - 1);
+		buf[size - 1] = '\0';
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return (rv);
+}
+
+static int
+fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+    struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_node *n;
+	int64_t c;
+	int rv;
+
+	n = fs_lookup(fs, path + 1);
+	if (n == NULL)
+		return (-ENOENT);
+	rv = 0;
+	if (n->child < 0 && n->member) {
+		pthread_mutex_lock(&fs->lock);
+		rv = fs_node_load(fs, n);
+		if (rv == 0 && !S_ISDIR(n->ms.st.st_mode))
+			rv = -ENOTDIR;
+		pthread_mutex_unlock(&fs->lock);
+	}
+	if (rv != 0)
+		return (rv);
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for (c = n->child; c >= 0; c = fs->nodes[c].next) {
+		if (filler(buf, fs->nodes[c].name, NULL, 0, 0) != 0)
+			break;
+	}
+	return (0);
+}
+
+static int
+fs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_node *n, *d;
+	struct fs_file *f;
+	int rv;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return (-EROFS);
+	n = fs_lookup(fs, path + 1);
+	if (n == NULL)
+		return (-ENOENT);
+	f = (struct fs_file *)malloc(sizeof (struct fs_file));
+	if (f == NULL)
+		return (-ENOMEM);
+	pthread_mutex_lock(&fs->lock);
+	rv = 0;
+	d = NULL;
+	if (!n->member || (rv = fs_node_load(fs, n)) != 0) {
+		if (rv == 0)
+			rv = -EISDIR;
+	} else if (!S_ISREG(n->ms.st.st_mode)) {
+		rv = S_ISDIR(n->ms.st.st_mode) ? -EISDIR : -EINVAL;
+	} else if ((d = fs_node_data(fs, n)) == NULL) {
+		rv = -EIO;
+	} else if (d->ms.filtered) {
+		rv = fs_node_decode(fs, d);
+	}
+	if (rv == 0)
+		d->nopen++;
+	pthread_mutex_unlock(&fs->lock);
+	if (rv != 0) {
+		free(f);
+		return (rv);
+	}
+	f->node = d;
+	f->next_off = 0;
+	fi->fh = (uint64_t)(uintptr_t)f;
+	fi->keep_cache = 1;
+	return (0);
+}
+
+static int
+fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_file *f = (struct fs_file *)(uintptr_t)fi->fh;
+	struct fs_node *d = f->node;
+	uint64_t fsize, ra_end;
+	int rv;
+
+	fsize = d->ms.st.st_size;
+	if (offset < 0 || (uint64_t)offset >= fsize)
+		return (0);
+	if (size > fsize - offset)
+		size = fsize - offset;
+
+	pthread_mutex_lock(&fs->lock);
+	rv = size;
+	if (d->data != NULL) {
+		memcpy(buf, d->data + offset, size);
+	} else {
+		ra_end = ((uint64_t)offset == f->next_off ? d->end : 0);
+		if (fs_stream_read(fs, d->off + d->data_off + offset, size,
+		    (uchar_t *)buf, ra_end) == -1)
+			rv = -EIO;
+	}
+	f->next_off = offset + size;
+	pthread_mutex_unlock(&fs->lock);
+	return (rv);
+}
+
+static int
+fs_release(const char *path, struct fuse_file_info *fi)
+{
+	struct pc_fs *fs = (struct pc_fs *)fuse_get_context()->private_data;
+	struct fs_file *f = (struct fs_file *)(uintptr_t)fi->fh;
+	struct fs_node *d = f->node;
+
+	pthread_mutex_lock(&fs->lock);
+	if (--d->nopen == 0) {
+		free(d->data);
+		d->data = NULL;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	free(f);
+	return (0);
+}
+
+static const struct fuse_operations fs_ops = {
+	.getattr	= fs_getattr,
+	.readlink	= fs_readlink,
+	.readdir	= fs_readdir,
+	.open		= fs_open,
+	.read		= fs_read,
+	.release	= fs_release,
+};
+
+int
+pc_fuse_mount(pc_ctx_t *pctx)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct pc_fs fs;
+	uint64_t i;
+	int err;
+
+	/*
+	 * An empty byte range only reads the header and the indexes.
+	 */
+	if (start_decompress_range(pctx, pctx->filename, 0, 0, NULL) == -1)
+		return (1);
+	if (pctx->encrypt_type) {
+		log_msg(LOG_ERR, 0, "Mounting encrypted archives is not supported.");
+		return (1);
+	}
+	if (pctx->midx == NULL) {
+		log_msg(LOG_ERR, 0, "Mounting needs an archive with a member index, "
+		    "created with -a and -I.");
+		return (1);
+	}
+
+	memset(&fs, 0, sizeof (fs));
+	fs.pctx = pctx;
+	pthread_mutex_init(&fs.lock, NULL);
+	if (stat(pctx->filename, &fs.arc_st) == -1) {
+		log_msg(LOG_ERR, 1, "%s", pctx->filename);
+		return (1);
+	}
+	err = 1;
+	if (fs_build(&fs) == -1) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		goto mount_done;
+	}
+	fs.ra_chunks = pctx->nthreads > 0 ? pctx->nthreads : 1;
+	if (pctx->chunksize > 0 && fs.ra_chunks * pctx->chunksize > FUSE_RA_MAX)
+		fs.ra_chunks = FUSE_RA_MAX / pctx->chunksize;
+	if (fs.ra_chunks == 0)
+		fs.ra_chunks = 1;
+	log_msg(LOG_VERBOSE, 0, "Mounting %" PRIu64 " members of %s on %s.",
+	    pctx->midx_count, pctx->filename, pctx->to_filename);
+
+	if (fuse_opt_add_arg(&args, "pcompress") == -1 ||
+	    fuse_opt_add_arg(&args, "-f") == -1 ||
+	    fuse_opt_add_arg(&args, "-o") == -1 ||
+	    fuse_opt_add_arg(&args, "ro,default_permissions,fsname=pcompress") == -1 ||
+	    fuse_opt_add_arg(&args, pctx->to_filename) == -1) {
+		log_msg(LOG_ERR, 0, "Out of memory.");
+		goto mount_done;
+	}
+	err = (fuse_main(args.argc, args.argv, &fs_ops, &fs) != 0);
+
+mount_done:
+	fuse_opt_free_args(&args);
+	for (i = 0; i < fs.nnodes; i++) {
+		free(fs.nodes[i].path);
+		free(fs.nodes[i].data);
+		archive_member_free(&fs.nodes[i].ms);
+	}
+	free(fs.nodes);
+	for (i = 0; i < FUSE_WINDOWS; i++)
+		free(fs.win[i].buf);
+	pthread_mutex_destroy(&fs.lock);
+	return (err);
+}
+
+#else
+
+int
+pc_fuse_mount(pc_ctx_t *pctx)
+{
+	log_msg(LOG_ERR, 0, "This pcompress was built without FUSE support, "
+	    "see --enable-fuse in INSTALL.");
+	return (1);
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Server mode. A long running pcompress takes jobs from clients over a Unix
+ * socket so that process startup, allocator setup and, for compression, the
+ * worker threads with their algorithm state are paid for once:
+ *
+ *	pcompress -Z /run/pcompress.sock -c zstd -l 6 -s 8m -D &
+ *	printf 'compress\t/data/file\n' | socat - UNIX-CONNECT:/run/pcompress.sock
+ *
+ * A request is one line of tab separated fields, an operation followed by
+ * absolute paths:
+ *
+ *	compress <file> [<target>]	Compress with the server options
+ *	decompress <file> [<target>]	Decompress as with -d
+ *
+ * The reply to each request is a line "OK" or "ERROR". A connection can
+ * send any number of requests, they are run one after another. Error
+ * messages go to the stderr of the server.
+ *
+ * Compression jobs are files of one compression session, as in batch mode,
+ * and share its workers. Jobs are started in the order they arrive and at
+ * most BATCH_FILES_INFLIGHT run at a time, or one at a time with Global
+ * Deduplication since its index is per process. Since every running file
+ * keeps a bounded number of chunks in the shared work queue, the workers
+ * are shared evenly between running jobs. Decompression jobs get their own
+ * context and threads but take their turn in the same order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pcompress.h"
+#include "utils/utils.h"
+
+#define	SERVER_JOBS	2
+#define	SERVER_LINE	(MAXPATHLEN * 2 + 32)
+
+struct server {
+	pc_ctx_t *pctx;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	uint64_t next_ticket, next_start;
+	int running, max_running, stopping;
+};
+
+struct server_conn {
+	struct server *srv;
+	int fd;
+};
+
+/*
+ * Jobs start strictly in arrival order once a slot is free. None start
+ * once the server is stopping.
+ */
+static int
+job_admit(struct server *srv)
+{
+	uint64_t ticket;
+
+	pthread_mutex_lock(&srv->lock);
+	ticket = srv->next_ticket++;
+	while (!srv->stopping &&
+	    (ticket != srv->next_start || srv->running >= srv->max_running))
+		pthread_cond_wait(&srv->cv, &srv->lock);
+	srv->next_start++;
+	if (srv->stopping) {
+		pthread_cond_broadcast(&srv->cv);
+		pthread_mutex_unlock(&srv->lock);
+		return (-1);
+	}
+	srv->running++;
+	pthread_cond_broadcast(&srv->cv);
+	pthread_mutex_unlock(&srv->lock);
+	return (0);
+}
+
+static void
+job_done(struct server *srv)
+{
+	pthread_mutex_lock(&srv->lock);
+	srv->running--;
+	pthread_cond_broadcast(&srv->cv);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static int
+job_compress(struct server *srv, char *file, char *target)
+{
+	char tname[MAXPATHLEN];
+	struct stat sbuf;
+	pc_ctx_t fctx;
+	int err;
+
+	/*
+	 * An existing file is not overwritten, as on the command line.
+	 */
+	if (target == NULL)
+		snprintf(tname, sizeof (tname), "%s" COMP_EXTN, file);
+	else if (!endswith(target, COMP_EXTN))
+		snprintf(tname, sizeof (tname), "%s" COMP_EXTN, target);
+	else
+		snprintf(tname, sizeof (tname), "%s", target);
+	if (stat(tname, &sbuf) == 0) {
+		log_msg(LOG_ERR, 0, "Compressed file %s exists", tname);
+		return (1);
+	}
+
+	if (pc_session_file_init(&fctx, srv->pctx) != 0)
+		return (1);
+	fctx.to_filename = target;
+	err = start_compress(&fctx, file, fctx.chunksize, fctx.level);
+	pc_session_file_fini(&fctx);
+	return (err);
+}
+
+static int
+job_decompress(struct server *srv, char *file, char *target)
+{
+	char *argv[4];
+	pc_ctx_t *dctx;
+	int argc, err;
+
+	argc = 0;
+	argv[argc++] = srv->pctx->exec_name;
+	argv[argc++] = "-d";
+	argv[argc++] = file;
+	if (target != NULL)
+		argv[argc++] = target;
+
+	dctx = create_pc_context();
+	err = init_pc_context(dctx, argc, argv);
+	if (err == 0)
+		err = start_pcompress(dctx);
+	destroy_pc_context(dctx);
+	return (err != 0);
+}
+
+/*
+ * Split a request line into its fields and run it.
+ */
+static int
+server_request(struct server *srv, char *line)
+{
+	char *op, *file, *target, *sptr;
+	int err;
+
+	op = strtok_r(line, "\t", &sptr);
+	file = strtok_r(NULL, "\t", &sptr);
+	target = strtok_r(NULL, "\t", &sptr);
+	if (op == NULL || file == NULL || strtok_r(NULL, "\t", &sptr) != NULL) {
+		log_msg(LOG_ERR, 0, "Server: malformed request");
+		return (1);
+	}
+	if (*file != '/' || (target != NULL && *target != '/')) {
+		log_msg(LOG_ERR, 0, "Server: paths must be absolute");
+		return (1);
+	}
+	if (strlen(file) + strlen(COMP_EXTN) >= MAXPATHLEN ||
+	    (target != NULL && strlen(target) + strlen(COMP_EXTN) >= MAXPATHLEN)) {
+		log_msg(LOG_ERR, 0, "Server: path too long");
+		return (1);
+	}
+
+	if (strcmp(op, "compress") != 0 && strcmp(op, "decompress") != 0) {
+		log_msg(LOG_ERR, 0, "Server: unknown operation %s", op);
+		return (1);
+	}
+	if (job_admit(srv) != 0)
+		return (1);
+	if (*op == 'c')
+		err = job_compress(srv, file, target);
+	else
+		err = job_decompress(srv, file, target);
+	job_done(srv);
+	log_msg(LOG_VERBOSE, 0, "Server: %s %s: %s", op, file, err ? "failed" : "done");
+	return (err);
+}
+
+static void *
+server_conn_thread(void *dat)
+{
+	struct server_conn *conn = (struct server_conn *)dat;
+	char *line;
+	uint64_t have, len;
+	int64_t rb;
+	char *nl;
+	int err;
+
+	line = (char *)malloc(SERVER_LINE + 1);
+	if (line == NULL) {
+		close(conn->fd);
+		free(conn);
+		return (NULL);
+	}
+	have = 0;
+	for (;;) {
+		line[have] = '\0';
+		nl = strchr(line, '\n');
+		if (nl == NULL) {
+			if (have == SERVER_LINE) {
+				log_msg(LOG_ERR, 0, "Server: request too long");
+				break;
+			}
+			rb = read(conn->fd, line + have, SERVER_LINE - have);
+			if (rb == -1 && errno == EINTR)
+				continue;
+			if (rb <= 0)
+				break;
+			have += rb;
+			continue;
+		}
+		*nl = '\0';
+		len = nl - line + 1;
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		err = server_request(conn->srv, line);
+		if (Write(conn->fd, err ? "ERROR\n" : "OK\n", err ? 6 : 3) < 0)
+			break;
+		memmove(line, line + len, have - len);
+		have -= len;
+	}
+	free(line);
+	close(conn->fd);
+	free(conn);
+	return (NULL);
+}
+
+/*
+ * Listen on pctx->server_path and serve clients until the process is
+ * killed. A stale socket from an earlier server is replaced.
+ */
+int DLL_EXPORT
+pc_server_run(pc_ctx_t *pctx)
+{
+	struct sockaddr_un addr;
+	struct server srv;
+	struct stat sbuf;
+	pthread_attr_t attr;
+	pthread_t thr;
+	int lfd, fd;
+
+	if (strlen(pctx->server_path) >= sizeof (addr.sun_path)) {
+		log_msg(LOG_ERR, 0, "Socket path too long: %s", pctx->server_path);
+		return (1);
+	}
+	if (lstat(pctx->server_path, &sbuf) == 0) {
+		if (!S_ISSOCK(sbuf.st_mode)) {
+			log_msg(LOG_ERR, 0, "%s exists and is not a socket", pctx->server_path);
+			return (1);
+		}
+		unlink(pctx->server_path);
+	}
+	if (pc_session_begin(pctx) != 0)
+		return (1);
+
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, pctx->server_path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_msg(LOG_ERR, 1, "socket ");
+		return (1);
+	}
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof (addr)) == -1 ||
+	    chmod(pctx->server_path, S_IRUSR|S_IWUSR) == -1 || listen(lfd, 64) == -1) {
+		log_msg(LOG_ERR, 1, "%s ", pctx->server_path);
+		close(lfd);
+		return (1);
+	}
+
+	memset(&srv, 0, sizeof (srv));
+	srv.pctx = pctx;
+	srv.max_running = (pctx->enable_rabin_global ? 1 : SERVER_JOBS);
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.cv, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/*
+	 * A client that goes away shows up as a write error instead.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	handle_signals();
+	log_msg(LOG_INFO, 0, "Listening on %s", pctx->server_path);
+
+	for (;;) {
+		struct server_conn *conn;
+
+		fd = accept(lfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+			    errno == ENFILE) {
+				if (errno != EINTR && errno != ECONNABORTED)
+					sleep(1);
+				continue;
+			}
+			log_msg(LOG_ERR, 1, "accept ");
+			break;
+		}
+		conn = (struct server_conn *)malloc(sizeof (struct server_conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->srv = &srv;
+		conn->fd = fd;
+		if (pthread_create(&thr, &attr, server_conn_thread, conn) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			close(fd);
+			free(conn);
+		}
+	}
+
+	/*
+	 * Only reached on a failing listen socket. The session goes away with
+	 * the context so wait for running jobs and start no more.
+	 */
+	close(lfd);
+	unlink(pctx->server_path);
+	pthread_mutex_lock(&srv.lock);
+	srv.stopping = 1;
+	pthread_cond_broadcast(&srv.cv);
+	while (srv.running > 0)
+		pthread_cond_wait(&srv.cv, &srv.lock);
+	pthread_mutex_unlock(&srv.lock);
+	return (1);
+}
@@ -0,0 +1,335 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Incremental in-memory interface to the compressor. A stream runs the normal
+ * pipe mode compression or decompression in a background thread with its
+ * stdin and stdout replaced by socketpairs. The caller pushes input with
+ * pc_stream_write() and pulls output with pc_stream_read(). Since output is
+ * collected by a separate thread the caller can push all input before pulling
+ * anything without deadlocking.
+ *
+ * Usage:
+ *	strm = pc_stream_create(argc, argv);	// Options as for the CLI, no paths
+ *	while (have input)
+ *		pc_stream_write(strm, buf, len);
+ *	pc_stream_finish(strm);
+ *	while ((n = pc_stream_read(strm, obuf, sizeof (obuf))) > 0)
+ *		...
+ *	pc_stream_destroy(strm);
+ *
+ * Output can also be pulled while writing. Before pc_stream_finish() a return
+ * of 0 from pc_stream_read() only means no output is ready yet, afterwards it
+ * means end of stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pcompress.h"
+#include "utils/utils.h"
+
+#define	STREAM_RDBUF	(64 * 1024)
+
+#ifndef MSG_NOSIGNAL
+#define	MSG_NOSIGNAL	0
+#endif
+
+struct pc_stream {
+	pc_ctx_t *pctx;
+	char **argv;
+	int in_fds[2], out_fds[2];
+	int started, finished, err, drain_err;
+	pthread_t comp_thread, drain_thread;
+	pthread_mutex_t mtx;
+	uchar_t *obuf;
+	uint64_t ohead, otail, osize;
+};
+
+static void *
+stream_compress(void *dat)
+{
+	pc_stream_t *strm = (pc_stream_t *)dat;
+
+	strm->err = start_pcompress(strm->pctx);
+
+	/*
+	 * Pipe mode does not close its descriptors. Closing the output side
+	 * here signals end of data to the drain thread, closing the input side
+	 * makes further pushes fail instead of blocking if we bailed early.
+	 */
+	close(strm->out_fds[1]);
+	strm->out_fds[1] = -1;
+	close(strm->in_fds[0]);
+	strm->in_fds[0] = -1;
+	return (NULL);
+}
+
+/*
+ * Collect compressor output into a growing in-memory buffer.
+ */
+static void *
+stream_drain(void *dat)
+{
+	pc_stream_t *strm = (pc_stream_t *)dat;
+	uchar_t rbuf[STREAM_RDBUF];
+	int64_t rb;
+
+	for (;;) {
+		rb = read(strm->out_fds[0], rbuf, STREAM_RDBUF);
+		if (rb < 0 && errno == EINTR)
+			continue;
+		if (rb <= 0)
+			break;
+
+		/* After a buffering failure keep reading so the writer never blocks. */
+		if (strm->drain_err)
+			continue;
+		pthread_mutex_lock(&strm->mtx);
+		if (strm->otail + rb > strm->osize) {
+			uint64_t nsize;
+			uchar_t *nbuf;
+
+			/* Reclaim space already read before growing. */
+			if (strm->ohead > 0) {
+				memmove(strm->obuf, strm->obuf + strm->ohead,
+				    strm->otail - strm->ohead);
+				strm->otail -= strm->ohead;
+				strm->ohead = 0;
+			}
+			nsize = strm->osize;
+			while (strm->otail + rb > nsize)
+				nsize = (nsize == 0 ? STREAM_RDBUF : nsize * 2);
+			if (nsize != strm->osize) {
+				nbuf = (uchar_t *)realloc(strm->obuf, nsize);
+				if (nbuf == NULL) {
+					pthread_mutex_unlock(&strm->mtx);
+					log_msg(LOG_ERR, 0, "Out of memory buffering stream output");
+					strm->pctx->main_cancel = 1;
+					strm->drain_err = 1;
+					continue;
+				}
+				strm->obuf = nbuf;
+				strm->osize = nsize;
+			}
+		}
+		memcpy(strm->obuf + strm->otail, rbuf, rb);
+		strm->otail += rb;
+		pthread_mutex_unlock(&strm->mtx);
+	}
+	return (NULL);
+}
+
+static int
+stream_start(pc_stream_t *strm)
+{
+	if (strm->started)
+		return (strm->started == 1 ? 0 : -1);
+	strm->started = -1;
+	if (pthread_create(&strm->drain_thread, NULL, stream_drain, (void *)strm) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		return (-1);
+	}
+	if (pthread_create(&strm->comp_thread, NULL, stream_compress, (void *)strm) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		close(strm->out_fds[1]);
+		strm->out_fds[1] = -1;
+		pthread_join(strm->drain_thread, NULL);
+		return (-1);
+	}
+	strm->started = 1;
+	return (0);
+}
+
+/*
+ * Create a stream from command line style options. The options are passed to
+ * init_pc_context() with pipe mode implied, so no pathnames must be given.
+ * As with init_pc_context() the argument strings must remain valid for the
+ * lifetime of the stream. Archiving is not supported.
+ */
+pc_stream_t DLL_EXPORT *
+pc_stream_create(int argc, char *argv[])
+{
+	pc_stream_t *strm;
+	int i;
+
+	if (argc < 1)
+		return (NULL);
+	strm = (pc_stream_t *)calloc(1, sizeof (pc_stream_t));
+	if (strm == NULL)
+		return (NULL);
+	strm->in_fds[0] = strm->in_fds[1] = -1;
+	strm->out_fds[0] = strm->out_fds[1] = -1;
+	pthread_mutex_init(&strm->mtx, NULL);
+
+	/*
+	 * Insert "-p" right after the program name.
+	 */
+	strm->argv = (char **)malloc((argc + 2) * sizeof (char *));
+	if (strm->argv == NULL)
+		goto create_err;
+	strm->argv[0] = argv[0];
+	strm->argv[1] = "-p";
+	for (i = 1; i < argc; i++)
+		strm->argv[i + 1] = argv[i];
+	strm->argv[argc + 1] = NULL;
+
+	strm->pctx = create_pc_context();
+	if (init_pc_context(strm->pctx, argc + 1, strm->argv) != 0)
+		goto create_err;
+	if (strm->pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "Archiving is not supported on streams.");
+		goto create_err;
+	}
+	if (!strm->pctx->do_compress && !strm->pctx->do_uncompress) {
+		log_msg(LOG_ERR, 0, "Stream needs either compress or decompress mode.");
+		goto create_err;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, strm->in_fds) == -1 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, strm->out_fds) == -1) {
+		log_msg(LOG_ERR, 1, "Unable to create stream socketpair ");
+		goto create_err;
+	}
+#ifdef __APPLE__
+	{
+		int on = 1;
+		(void) setsockopt(strm->in_fds[1], SOL_SOCKET, SO_NOSIGPIPE, &on,
+		    sizeof (on));
+	}
+#endif
+	strm->pctx->pipe_infd = strm->in_fds[0];
+	strm->pctx->pipe_outfd = strm->out_fds[1];
+	return (strm);
+
+create_err:
+	pc_stream_destroy(strm);
+	return (NULL);
+}
+
+/*
+ * Give access to the context, for example to set a password with
+ * pc_set_userpw() before the first write.
+ */
+pc_ctx_t DLL_EXPORT *
+pc_stream_context(pc_stream_t *strm)
+{
+	return (strm->pctx);
+}
+
+/*
+ * Push input data. Blocks while the compressor is busy. Returns 0 on success
+ * or -1 if the stream is finished or processing failed.
+ */
+int DLL_EXPORT
+pc_stream_write(pc_stream_t *strm, const void *buf, uint64_t len)
+{
+	const uchar_t *cbuf = (const uchar_t *)buf;
+	int64_t wb;
+
+	if (strm->finished || stream_start(strm) == -1)
+		return (-1);
+	while (len > 0) {
+		wb = send(strm->in_fds[1], cbuf, len, MSG_NOSIGNAL);
+		if (wb < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		cbuf += wb;
+		len -= wb;
+	}
+	return (0);
+}
+
+/*
+ * Pull up to len bytes of output. Never blocks. Returns the number of bytes
+ * copied, 0 if nothing is available or -1 if the stream was never started.
+ */
+int64_t DLL_EXPORT
+pc_stream_read(pc_stream_t *strm, void *buf, uint64_t len)
+{
+	uint64_t avail;
+
+	if (strm->started != 1)
+		return (-1);
+	pthread_mutex_lock(&strm->mtx);
+	avail = strm->otail - strm->ohead;
+	if (len > avail)
+		len = avail;
+	memcpy(buf, strm->obuf + strm->ohead, len);
+	strm->ohead += len;
+	if (strm->ohead == strm->otail)
+		strm->ohead = strm->otail = 0;
+	pthread_mutex_unlock(&strm->mtx);
+	return (len);
+}
+
+/*
+ * Signal end of input and wait for processing to complete. All output is
+ * then available via pc_stream_read(). Returns 0 on success.
+ */
+int DLL_EXPORT
+pc_stream_finish(pc_stream_t *strm)
+{
+	if (strm->finished)
+		return (strm->err);
+	if (stream_start(strm) == -1)
+		return (1);
+	strm->finished = 1;
+	close(strm->in_fds[1]);
+	strm->in_fds[1] = -1;
+	pthread_join(strm->comp_thread, NULL);
+	pthread_join(strm->drain_thread, NULL);
+	if (strm->drain_err)
+		strm->err = 1;
+	return (strm->err);
+}
+
+void DLL_EXPORT
+pc_stream_destroy(pc_stream_t *strm)
+{
+	int i;
+
+	if (strm->started == 1)
+		(void) pc_stream_finish(strm);
+	for (i = 0; i < 2; i++) {
+		if (strm->in_fds[i] != -1)
+			close(strm->in_fds[i]);
+		if (strm->out_fds[i] != -1)
+			close(strm->out_fds[i]);
+	}
+	if (strm->pctx)
+		destroy_pc_context(strm->pctx);
+	pthread_mutex_destroy(&strm->mtx);
+	free(strm->obuf);
+	free(strm->argv);
+	free(strm);
+}
@@ -34,7 +34,9 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <strings.h>
 #include <limits.h>
 #include <unistd.h>
@@ -50,11 +52,15 @@
 
 #include <transpose.h>
 #include <delta2/delta2.h>
+#include <fpdelta/fpdelta.h>
+#include <bcj/bcj.h>
 #include <crypto/crypto_utils.h>
 #include <crypto_xsalsa20.h>
+#include <crypto_xchacha20.h>
 #include <ctype.h>
 #include <errno.h>
 #include <pc_archive.h>
+#include <pc_uring.h>
 #include <filters/dispack/dis.hpp>
 #include "filters/dict/DictFilter.h"
 
@@ -64,19 +70,2275 @@
 #define	DEFAULT_CHUNKSIZE	(8 * 1024 * 1024)
 #define	EIGHTY_PCT(x) ((x) - ((x)/5))
 
+/*
+ * Number of chunk slots in addition to the worker threads. The extra slots let
+ * idle threads move ahead of a slow chunk instead of waiting for it.
+ */
+#define	CHUNK_SLOTS_EXTRA(n) ((n) > 1 ? ((n) + 1) / 2 : 0)
+
+/*
+ * Files of a batch that are compressed at the same time. The next file starts
+ * once the previous one is read so its chunks fill in the idle workers while
+ * the last chunks of the previous file are in progress.
+ */
+#define	BATCH_FILES_INFLIGHT	2
+
+/*
+ * Default upper bound on the bytes of consecutive finished chunks the writer
+ * gathers into one writev() or io_uring submission. Can be changed via the
+ * PCOMPRESS_WRITE_BATCH environment variable, 0 writes each chunk separately.
+ */
+#define	WRITE_BATCH_BYTES	(4 * 1024 * 1024)
+#define	WRITE_BATCH_MAX		PC_URING_DEPTH
+
+/*
+ * Default size of the decompressed chunk cache of byte-range reads. Can be
+ * changed via the PCOMPRESS_CHUNK_CACHE environment variable, 0 disables it.
+ */
+#define	CHUNK_CACHE_BYTES	(256 * 1024 * 1024)
+
+/*
+ * Chunks of at least INCOMPRESSIBLE_MIN bytes whose sampled order-0 entropy
+ * reaches INCOMPRESSIBLE_ENTROPY bits per byte are stored as is without trying
+ * the codec. PCOMPRESS_NO_ENTROPY_SKIP turns this off.
+ */
+#define	INCOMPRESSIBLE_MIN	(64 * 1024)
+
+/*
+ * Pipe mode endpoints, stdin and stdout unless redirected by a stream.
+ */
+#define	PIPE_IN_FD(pctx) ((pctx)->pipe_infd != -1 ? (pctx)->pipe_infd : fileno(stdin))
+#define	PIPE_OUT_FD(pctx) ((pctx)->pipe_outfd != -1 ? (pctx)->pipe_outfd : fileno(stdout))
+
+/*
+ * Output descriptor standing for the object storage upload, see out_write().
+ */
+#define	PC_OBJ_FD	(-2)
+
 struct wdata {
 	struct cmp_data **dary;
 	int wfd;
-	int nprocs;
+	int nslots;
 	int64_t chunksize;
+	pc_uring_t *ring;
+	uint64_t batch_bytes;
+	int splice;
+	pc_stats_t *stats;
+	pc_ctx_t *pctx;
+};
+
+/*
+ * Interval at which the spliced writer checks whether the pipe reader has
+ * consumed a chunk it waits for.
+ */
+#define	SPLICE_POLL_US	200
+
+/*
+ * Chunk read-ahead. A reader thread keeps up to READ_AHEAD_BUFS chunk buffers
+ * filled ahead of the dispatch loop in start_compress() so that input I/O
+ * overlaps with chunk dispatch instead of being serialized with it.
+ */
+#define	READ_AHEAD_BUFS	2
+
+/* With a read rate limit plain input is read in slices of this size. */
+#define	READ_PACE_SLICE	(1024 * 1024)
+
+struct rdbuf {
+	uchar_t *buf;
+	int64_t rbytes;
+	int interesting, btype;
+};
+
+struct rdahead {
+	struct rdbuf ent[READ_AHEAD_BUFS];
+	uint32_t head, tail;
+	int fd, threaded, cancel, advise;
+	int arc_queued;
+	uchar_t *carry;
+	int64_t carry_len;
+	uchar_t *map;
+	uint64_t map_len, map_dropped;
+	uint64_t chunksize, maxchunk;
+	struct chunk_plan *plan;
+	uint64_t pos, end;
+	dedupe_context_t *rctx;
+	pc_uring_t *ring;
+	pc_stats_t *stats;
+	Sem_t filled, empty;
+	pthread_t thr;
 	pc_ctx_t *pctx;
 };
 
-pthread_mutex_t opt_parse = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Compressed chunk prefetch for pipe mode decompression. A reader thread parses
+ * the chunk framing and keeps up to PREFETCH_BUFS compressed chunks ready so
+ * that a slow input stream is drained while all slots are busy.
+ */
+#define	PREFETCH_BUFS	4
+
+struct pfbuf {
+	uchar_t *buf;
+	uint64_t len_cmp, len_cmp_be;
+	int64_t rbytes;
+	int status;
+};
+
+struct prefetch {
+	struct pfbuf ent[PREFETCH_BUFS];
+	uint32_t head, tail, chunk_num;
+	int fd, cancel, running;
+	uint64_t chunksize, bufsize, trailer;
+	pc_stats_t *stats;
+	Sem_t filled, empty;
+	pthread_t thr;
+};
+
+pthread_mutex_t opt_parse = PTHREAD_MUTEX_INITIALIZER;
+
+static void * writer_thread(void *dat);
+static uint64_t write_batch_bytes(void);
+static int init_algo(pc_ctx_t *pctx, const char *algo, int bail);
+extern uint32_t lzma_crc32(const uint8_t *buf, uint64_t size, uint32_t crc);
+
+static int
+chunk_queue_init(struct chunk_queue *cq, uint32_t size)
+{
+	cq->ent = (struct cmp_data **)slab_calloc(NULL, size, sizeof (struct cmp_data *));
+	if (!cq->ent)
+		return (-1);
+	cq->head = 0;
+	cq->tail = 0;
+	cq->size = size;
+	pthread_mutex_init(&cq->lock, NULL);
+	Hsem_Init(&cq->avail, 0);
+	return (0);
+}
+
+static void
+chunk_queue_destroy(struct chunk_queue *cq)
+{
+	if (!cq->ent)
+		return;
+	pthread_mutex_destroy(&cq->lock);
+	Hsem_Destroy(&cq->avail);
+	slab_release(NULL, cq->ent);
+	cq->ent = NULL;
+}
+
+/*
+ * The queue is sized to hold every chunk slot plus one exit marker per worker
+ * so adding an entry never has to wait for space.
+ */
+static void
+chunk_queue_put(struct chunk_queue *cq, struct cmp_data *tdat)
+{
+	pthread_mutex_lock(&cq->lock);
+	cq->ent[cq->tail] = tdat;
+	cq->tail = (cq->tail + 1) % cq->size;
+	pthread_mutex_unlock(&cq->lock);
+	Hsem_Post(&cq->avail);
+}
+
+static struct cmp_data *
+chunk_queue_get(struct chunk_queue *cq)
+{
+	struct cmp_data *tdat;
+
+	Hsem_Wait(&cq->avail);
+	pthread_mutex_lock(&cq->lock);
+	tdat = cq->ent[cq->head];
+	cq->head = (cq->head + 1) % cq->size;
+	pthread_mutex_unlock(&cq->lock);
+	return (tdat);
+}
+
+/*
+ * Adaptive modes switch between algorithms whose states are several MB each.
+ * A worker rather takes a chunk expected to need the algorithm it used last,
+ * from among the first CHUNK_AFFINITY_SCAN waiting ones, so its state stays
+ * in cache. The chunk passed over is moved into the taken one's place. A
+ * chunk is not passed over more than CHUNK_AFFINITY_SKIPS times so the
+ * writer does not stall on it. Only chunks given a codec hint are reordered.
+ * Chunks without one, of runs where workers wait on each other in chunk
+ * order, are always taken in queue order.
+ */
+#define	CHUNK_AFFINITY_SCAN	4
+#define	CHUNK_AFFINITY_SKIPS	2
+
+static struct cmp_data *
+chunk_queue_get_codec(struct chunk_queue *cq, int codec)
+{
+	struct cmp_data *tdat, *t;
+	uint32_t i, pos;
+
+	Hsem_Wait(&cq->avail);
+	pthread_mutex_lock(&cq->lock);
+	tdat = cq->ent[cq->head];
+	if (tdat != NULL && codec != ADAPT_COMPRESS_NONE &&
+	    tdat->codec != ADAPT_COMPRESS_NONE && tdat->codec != codec &&
+	    tdat->qskip < CHUNK_AFFINITY_SKIPS) {
+		pos = cq->head;
+		for (i = 1; i < CHUNK_AFFINITY_SCAN; i++) {
+			pos = (pos + 1) % cq->size;
+			if (pos == cq->tail || (t = cq->ent[pos]) == NULL)
+				break;
+			if (t->codec == codec) {
+				cq->ent[pos] = tdat;
+				tdat->qskip++;
+				tdat = t;
+				break;
+			}
+		}
+	}
+	cq->head = (cq->head + 1) % cq->size;
+	pthread_mutex_unlock(&cq->lock);
+	return (tdat);
+}
+
+/*
+ * Number of chunks waiting for a worker.
+ */
+static uint32_t
+chunk_queue_depth(struct chunk_queue *cq)
+{
+	uint32_t depth;
+
+	pthread_mutex_lock(&cq->lock);
+	depth = (cq->tail + cq->size - cq->head) % cq->size;
+	pthread_mutex_unlock(&cq->lock);
+	return (depth);
+}
+
+/* LZP preprocessing splits a chunk into at most this many blocks. */
+#define	LZP_MAX_THREADS		8
+
+/*
+ * Intra-chunk parallelism. When fewer chunks are in flight than there are
+ * processors the spare ones go to the algorithm processing the chunk, up
+ * to chunk_threads_max. This is evaluated for every chunk so that the last
+ * chunks of a file pick up the processors of workers that went idle.
+ */
+static void
+chunk_threads_begin(pc_ctx_t *pctx, struct cmp_thread *wt)
+{
+	int demand, share;
+
+	if (pctx->chunk_threads_max < 2)
+		return;
+	demand = __sync_add_and_fetch(&pctx->busy_workers, 1) +
+	    chunk_queue_depth(wt->queue);
+	share = pctx->thread_budget / demand;
+	if (share > pctx->chunk_threads_max)
+		share = pctx->chunk_threads_max;
+	set_chunk_threads(share);
+}
+
+static void
+chunk_threads_end(pc_ctx_t *pctx)
+{
+	if (pctx->chunk_threads_max < 2)
+		return;
+	__sync_sub_and_fetch(&pctx->busy_workers, 1);
+}
+
+/*
+ * Adaptive chunk sizing for -s auto. The dispatcher folds the codec time of
+ * every finished chunk into a running per-MB cost and picks the size of the
+ * next chunk from that cost and the number of chunks queued for workers.
+ * Short chunks with a backlog waste time on per-chunk overhead so they are
+ * grown; long chunks while workers sit idle hurt parallelism so they are
+ * shrunk. Near the end of a file of known size chunks are trimmed so that
+ * the remaining data is spread across all workers.
+ */
+#define	CHUNK_AUTO_GROW		4
+#define	CHUNK_AUTO_SHRINK	16
+#define	CHUNK_AUTO_LO_MS	50.0
+#define	CHUNK_AUTO_HI_MS	400.0
+
+struct chunk_auto {
+	uint64_t cur, min, max;
+	double ms_per_mb;
+};
+
+static void
+chunk_auto_init(struct chunk_auto *ca, uint64_t max, uint64_t min_chunk)
+{
+	ca->max = max;
+	ca->min = max / CHUNK_AUTO_SHRINK;
+	if (ca->min < min_chunk)
+		ca->min = min_chunk;
+	if (ca->min > max)
+		ca->min = max;
+	ca->cur = max / CHUNK_AUTO_GROW;
+	if (ca->cur < ca->min)
+		ca->cur = ca->min;
+	ca->ms_per_mb = 0;
+}
+
+static void
+chunk_auto_sample(struct chunk_auto *ca, struct cmp_data *tdat)
+{
+	double sample;
+
+	if (tdat->work_ms <= 0 || tdat->uncomp_len == 0)
+		return;
+	sample = tdat->work_ms * (1024.0 * 1024.0) / (double)tdat->uncomp_len;
+	if (ca->ms_per_mb == 0)
+		ca->ms_per_mb = sample;
+	else
+		ca->ms_per_mb = (ca->ms_per_mb * 3 + sample) / 4;
+	tdat->work_ms = 0;
+}
+
+/*
+ * Size of the next chunk to read. remaining is the amount of input left, or
+ * -1 if unknown.
+ */
+static uint64_t
+chunk_auto_next(struct chunk_auto *ca, uint32_t depth, int nworkers, int64_t remaining)
+{
+	uint64_t sz;
+	double est;
+
+	if (ca->ms_per_mb > 0) {
+		est = ca->ms_per_mb * (double)ca->cur / (1024.0 * 1024.0);
+		if (depth >= (uint32_t)nworkers && est < CHUNK_AUTO_LO_MS)
+			ca->cur *= 2;
+		else if (depth == 0 && est > CHUNK_AUTO_HI_MS)
+			ca->cur /= 2;
+		if (ca->cur > ca->max)
+			ca->cur = ca->max;
+		if (ca->cur < ca->min)
+			ca->cur = ca->min;
+	}
+
+	sz = ca->cur;
+	if (remaining > 0 && (uint64_t)remaining < sz * nworkers) {
+		sz = (uint64_t)remaining / nworkers;
+		sz = (sz + 4095) & ~((uint64_t)4095);
+		if (sz < ca->min)
+			sz = ca->min;
+		if (sz > ca->cur)
+			sz = ca->cur;
+	}
+	return (sz);
+}
+
+/*
+ * Decode-speed aware slot window for decompression. Fast decoders like LZ4 or
+ * LZFX finish chunks well before the writer can take them, so with a slot per
+ * thread most slots sit decoded, holding two chunk buffers each, waiting for
+ * the writer. The dispatcher folds the decode time and the write time of every
+ * finished chunk into running averages. Once the first round of slots is done,
+ * and at every later wrap of the slot ring, the window of slots in use is set
+ * to what keeps the writer busy: enough chunks decoding at once for one to be
+ * done in the time of every write, plus the slot being written and the usual
+ * extra slots. Slots that leave the window free their buffers once written and
+ * surplus workers just wait on the queue, so the window grows back when
+ * decoding becomes the bottleneck.
+ */
+#define	SLOT_AUTO_MIN	2
+
+struct slot_auto {
+	uint32_t active, max, nsamples;
+	double dec_ms, wr_ms;
+};
+
+static void
+slot_auto_init(struct slot_auto *sa, uint32_t nslots)
+{
+	sa->active = nslots;
+	sa->max = nslots;
+	sa->nsamples = 0;
+	sa->dec_ms = 0;
+	sa->wr_ms = 0;
+}
+
+static void
+slot_auto_sample(struct slot_auto *sa, struct cmp_data *tdat)
+{
+	if (tdat->work_ms <= 0) {
+		tdat->write_ms = 0;
+		return;
+	}
+	if (sa->nsamples == 0) {
+		sa->dec_ms = tdat->work_ms;
+		sa->wr_ms = tdat->write_ms;
+	} else {
+		sa->dec_ms = (sa->dec_ms * 3 + tdat->work_ms) / 4;
+		sa->wr_ms = (sa->wr_ms * 3 + tdat->write_ms) / 4;
+	}
+	sa->nsamples++;
+	tdat->work_ms = 0;
+	tdat->write_ms = 0;
+}
+
+/*
+ * Number of slots to use for the next round of the slot ring.
+ */
+static uint32_t
+slot_auto_next(struct slot_auto *sa)
+{
+	double need;
+	uint32_t n;
+
+	if (sa->nsamples < sa->max)
+		return (sa->active);
+	n = sa->max;
+	if (sa->wr_ms > 0) {
+		need = sa->dec_ms / sa->wr_ms;
+		if (need < (double)sa->max) {
+			n = (uint32_t)need + 1;
+			n = n + 1 + CHUNK_SLOTS_EXTRA(n);
+		}
+	}
+	if (n < SLOT_AUTO_MIN)
+		n = SLOT_AUTO_MIN;
+	if (n > sa->max)
+		n = sa->max;
+	sa->active = n;
+	return (n);
+}
+
+/*
+ * Start a new round of the slot ring and return the number of slots in it.
+ * Slots outside the window give up their buffers once the writer is done
+ * with them.
+ */
+static uint32_t
+slot_auto_round(struct slot_auto *sa, struct cmp_data **dary)
+{
+	struct cmp_data *tdat;
+	uint32_t i, prev;
+
+	prev = sa->active;
+	if (slot_auto_next(sa) != prev)
+		log_msg(LOG_VERBOSE, 0, "Using %u of %u chunk slots", sa->active, sa->max);
+	for (i = sa->active; i < sa->max; i++) {
+		tdat = dary[i];
+		if ((!tdat->compressed_chunk && !tdat->uncompressed_chunk) ||
+		    Hsem_TryWait(&tdat->write_done_sem) != 0)
+			continue;
+		slot_auto_sample(sa, tdat);
+		if (tdat->compressed_chunk)
+			slab_release(NULL, tdat->compressed_chunk);
+		if (tdat->uncompressed_chunk)
+			slab_release(NULL, tdat->uncompressed_chunk);
+		tdat->compressed_chunk = NULL;
+		tdat->uncompressed_chunk = NULL;
+		Hsem_Post(&tdat->write_done_sem);
+	}
+	return (sa->active);
+}
+
+/*
+ * Chunk planning. A first pass over a regular file samples PLAN_SAMPLE bytes
+ * at the start of every grain and classifies them as text, incompressible or
+ * other data. Runs of grains of the same class are regions of at least
+ * PLAN_MIN_REGION bytes. Region starts are then narrowed down to PLAN_BLOCK
+ * within the grain before them. Chunks never cross a region boundary and are
+ * evened out within a region, and the region's class is passed on as the
+ * chunk's data type.
+ */
+#define	PLAN_SAMPLE		(32 * 1024)
+#define	PLAN_BLOCK		(16 * 1024)
+#define	PLAN_GRAIN		(256 * 1024)
+#define	PLAN_MAX_GRAINS		65536
+#define	PLAN_MIN_REGION		(1024 * 1024)
+
+struct plan_region {
+	uint64_t start;
+	int btype;
+};
+
+struct chunk_plan {
+	struct plan_region *reg;
+	uint32_t nreg, cur;
+	uint64_t size;
+};
+
+static int
+chunk_plan_class(uchar_t *buf, uint64_t len)
+{
+	if (analyze_buffer_entropy(buf, len) >= INCOMPRESSIBLE_ENTROPY)
+		return (TYPE_COMPRESSED);
+	if (analyze_buffer_simple(buf, len) == TYPE_TEXT)
+		return (TYPE_TEXT);
+	return (TYPE_UNKNOWN);
+}
+
+/*
+ * Move a region start back to the first block of the region's class in the
+ * grain before it.
+ */
+static uint64_t
+chunk_plan_refine(int fd, uint64_t start, uint64_t grain, int btype, uchar_t *buf)
+{
+	uint64_t pos;
+	int64_t rv;
+
+	for (pos = start - grain + PLAN_SAMPLE; pos + PLAN_BLOCK <= start; pos += PLAN_BLOCK) {
+		rv = pread(fd, buf, PLAN_BLOCK, pos);
+		if (rv != PLAN_BLOCK)
+			break;
+		if (chunk_plan_class(buf, PLAN_BLOCK) == btype)
+			return (pos);
+	}
+	return (start);
+}
+
+static void
+chunk_plan_free(struct chunk_plan *plan)
+{
+	if (plan == NULL)
+		return;
+	free(plan->reg);
+	free(plan);
+}
+
+static struct chunk_plan *
+chunk_plan_build(int fd, uint64_t size, uint64_t min_region)
+{
+	struct chunk_plan *plan;
+	uint64_t grain, ngr, g, start, len;
+	uchar_t *buf;
+	int *cls, err;
+
+	grain = PLAN_GRAIN;
+	while (size / grain > PLAN_MAX_GRAINS)
+		grain <<= 1;
+	ngr = (size + grain - 1) / grain;
+	if (min_region < PLAN_MIN_REGION)
+		min_region = PLAN_MIN_REGION;
+
+	plan = (struct chunk_plan *)calloc(1, sizeof (struct chunk_plan));
+	cls = (int *)malloc(ngr * sizeof (int));
+	buf = (uchar_t *)malloc(PLAN_BLOCK);
+	if (plan == NULL || cls == NULL || buf == NULL)
+		goto plan_err;
+	plan->reg = (struct plan_region *)malloc(ngr * sizeof (struct plan_region));
+	if (plan->reg == NULL)
+		goto plan_err;
+	plan->size = size;
+
+	err = 0;
+#if defined(_OPENMP)
+#	pragma omp parallel for
+#endif
+	for (g = 0; g < ngr; g++) {
+		uchar_t sbuf[PLAN_SAMPLE];
+		uint64_t n;
+
+		n = size - g * grain;
+		if (n > PLAN_SAMPLE)
+			n = PLAN_SAMPLE;
+		if (pread(fd, sbuf, n, g * grain) != (int64_t)n) {
+			err = 1;
+			continue;
+		}
+		cls[g] = chunk_plan_class(sbuf, n);
+	}
+	if (err) {
+		log_msg(LOG_ERR, 1, "Cannot read input for planning ");
+		goto plan_err;
+	}
+
+	/*
+	 * A single grain that differs from both neighbours is noise.
+	 */
+	for (g = 1; g + 1 < ngr; g++) {
+		if (cls[g - 1] == cls[g + 1])
+			cls[g] = cls[g - 1];
+	}
+
+	/*
+	 * Runs shorter than a region are absorbed by the region before them.
+	 */
+	plan->reg[0].start = 0;
+	plan->reg[0].btype = cls[0];
+	plan->nreg = 1;
+	for (g = 1; g < ngr; ) {
+		start = g;
+		while (g < ngr && cls[g] == cls[start])
+			g++;
+		len = (g < ngr ? g * grain : size) - start * grain;
+		if (cls[start] == plan->reg[plan->nreg - 1].btype || len < min_region)
+			continue;
+		plan->reg[plan->nreg].start = chunk_plan_refine(fd, start * grain, grain,
+		    cls[start], buf);
+		plan->reg[plan->nreg].btype = cls[start];
+		plan->nreg++;
+	}
+	free(cls);
+	free(buf);
+	return (plan);
+
+plan_err:
+	free(cls);
+	free(buf);
+	chunk_plan_free(plan);
+	return (NULL);
+}
+
+/*
+ * Size of the chunk at pos, at most max, and its data type.
+ */
+static uint64_t
+chunk_plan_next(struct chunk_plan *plan, uint64_t pos, uint64_t max, int *btype)
+{
+	uint64_t end, rem, n;
+
+	while (plan->cur + 1 < plan->nreg && plan->reg[plan->cur + 1].start <= pos)
+		plan->cur++;
+	end = (plan->cur + 1 < plan->nreg) ? plan->reg[plan->cur + 1].start : plan->size;
+	*btype = plan->reg[plan->cur].btype;
+	if (pos >= end)
+		return (max);
+	rem = end - pos;
+	if (rem <= max)
+		return (rem);
+	n = (rem + max - 1) / max;
+	return ((rem + n - 1) / n);
+}
+
+/*
+ * Attach a worker thread's per-thread contexts to the chunk slot it picked up.
+ */
+static void
+chunk_attach_worker(struct cmp_thread *wt, struct cmp_data *tdat)
+{
+	tdat->data = wt->data;
+	tdat->level = wt->level;
+	tdat->chunk_hmac = &wt->chunk_hmac;
+	if (tdat->pctx->file_rctx != NULL)
+		tdat->rctx = tdat->pctx->file_rctx[wt->id];
+	else
+		tdat->rctx = wt->rctx;
+	tdat->stats = wt->stats;
+	if (tdat->rctx) {
+		tdat->rctx->index_sem = &tdat->index_sem;
+		tdat->rctx->index_sem_next = tdat->index_sem_next;
+		tdat->rctx->file_offset = tdat->file_offset;
+	}
+}
+
+/*
+ * Linked chunks (-o). Put the last win bytes of old followed by buf into dst,
+ * which may be the same buffer as old.
+ */
+static void
+link_tail(uchar_t *dst, uint64_t *dlen, uchar_t *old, uint64_t olen, uchar_t *buf,
+    uint64_t len, uint64_t win)
+{
+	uint64_t keep;
+
+	if (len >= win) {
+		memcpy(dst, buf + len - win, win);
+		*dlen = win;
+		return;
+	}
+	keep = win - len;
+	if (keep > olen)
+		keep = olen;
+	memmove(dst, old + olen - keep, keep);
+	memcpy(dst + keep, buf, len);
+	*dlen = keep + len;
+}
+
+/*
+ * Give a chunk being queued for compression the data before it as its
+ * prefix and add the chunk to the tail kept in link_buf. The slot's old
+ * prefix buffer is free by now and becomes the next link_buf, so chunks
+ * still compress in parallel.
+ */
+static void
+chunk_link_queue(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	uchar_t *spare, *buf;
+	uint64_t len;
+
+	/* With dedupe the chunk is read into cmp_seg, see start_compress(). */
+	buf = tdat->uncompressed_chunk;
+	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global)
+		buf = tdat->cmp_seg;
+	spare = tdat->prefix;
+	link_tail(spare, &len, pctx->link_buf, pctx->link_len, buf, tdat->rbytes,
+	    pctx->link_win);
+	tdat->prefix = pctx->link_buf;
+	tdat->prefix_len = pctx->link_len;
+	pctx->link_buf = spare;
+	pctx->link_len = len;
+}
+
+/*
+ * Wait until it is this chunk's turn to decompress. Only the decompressed
+ * data of all chunks before it gives its prefix. Returns -1 if cancelled.
+ */
+static int
+chunk_link_wait(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	struct timespec ts;
+	int rv;
+
+	pthread_mutex_lock(&pctx->link_lock);
+	while (pctx->link_next != tdat->id && !pctx->main_cancel) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pctx->link_cv, &pctx->link_lock, &ts);
+	}
+	rv = (pctx->link_next == tdat->id ? 0 : -1);
+	pthread_mutex_unlock(&pctx->link_lock);
+	return (rv);
+}
+
+/*
+ * Add a decompressed chunk to the prefix and hand over to the next chunk.
+ * Called once for every chunk, also failed ones.
+ */
+static void
+chunk_link_pass(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	if (chunk_link_wait(pctx, tdat) == -1)
+		return;
+	if (tdat->len_cmp > 0) {
+		link_tail(pctx->link_buf, &pctx->link_len, pctx->link_buf, pctx->link_len,
+		    tdat->uncompressed_chunk, tdat->len_cmp, pctx->link_win);
+	}
+	pthread_mutex_lock(&pctx->link_lock);
+	pctx->link_next++;
+	pthread_cond_broadcast(&pctx->link_cv);
+	pthread_mutex_unlock(&pctx->link_lock);
+}
+
+/*
+ * Record a chunk in the seekable chunk index. Called by the writer thread with
+ * write_mutex held just before the chunk is written out.
+ */
+static int
+chunk_index_add(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	struct chunk_index_ent *ent;
+
+	if (pctx->cidx_count == pctx->cidx_max) {
+		uint64_t nmax;
+
+		nmax = pctx->cidx_max ? pctx->cidx_max * 2 : 1024;
+		ent = (struct chunk_index_ent *)realloc(pctx->cidx,
+		    nmax * sizeof (struct chunk_index_ent));
+		if (ent == NULL)
+			return (-1);
+		pctx->cidx = ent;
+		pctx->cidx_max = nmax;
+	}
+	ent = &(pctx->cidx[pctx->cidx_count++]);
+	ent->uoff = tdat->file_offset;
+	ent->coff = pctx->comp_offset;
+	ent->clen = tdat->len_cmp;
+	ent->ulen = tdat->uncomp_len;
+	ent->flags = tdat->cmp_seg[COMPRESSED_CHUNKSZ + pctx->cksum_bytes + pctx->mac_bytes];
+	if (pctx->enable_rabin_global && dedupe_restore_group_start(ent->uoff, ent->ulen))
+		ent->flags |= CIDX_GROUP_START;
+	return (0);
+}
+
+
+/*
+ * Write compressed output. PC_OBJ_FD sends it to the object storage upload,
+ * which only ever receives whole chunks and headers from these calls.
+ */
+static int64_t
+out_writev(pc_ctx_t *pctx, int fd, struct iovec *iov, int n)
+{
+	int64_t len;
+	int i;
+
+	if (fd != PC_OBJ_FD)
+		return (Writev(fd, iov, n));
+	len = 0;
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+	if (pc_obj_write(pctx->obj, iov, n) == -1)
+		return (-1);
+	return (len);
+}
+
+static int64_t
+out_write(pc_ctx_t *pctx, int fd, const void *buf, uint64_t len)
+{
+	struct iovec iov;
+
+	if (fd != PC_OBJ_FD)
+		return (Write(fd, buf, len));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return (out_writev(pctx, fd, &iov, 1));
+}
+
+/*
+ * Store chunk index entries [from, to) in their on-disk form at pos.
+ */
+static uchar_t *
+chunk_index_encode(pc_ctx_t *pctx, uint64_t from, uint64_t to, uchar_t *pos)
+{
+	uint64_t i;
+
+	for (i = from; i < to; i++) {
+		struct chunk_index_ent *ent = &(pctx->cidx[i]);
+
+		U64_P(pos) = htonll(ent->uoff);
+		U64_P(pos + 8) = htonll(ent->coff);
+		U64_P(pos + 16) = htonll(ent->clen);
+		U64_P(pos + 24) = htonll(ent->ulen);
+		U32_P(pos + 32) = htonl(ent->flags);
+		U32_P(pos + 36) = 0;
+		pos += CHUNK_INDEX_ENTSZ;
+	}
+	return (pos);
+}
+
+/*
+ * Append the chunk index entries and the fixed size footer that points to them.
+ * This must be called after the zero-length trailer has been written.
+ */
+static int
+chunk_index_write(pc_ctx_t *pctx, int fd, uint64_t usize)
+{
+	uchar_t *buf, *pos;
+	uint64_t len;
+	uint32_t crc;
+	int64_t wbytes;
+
+	len = pctx->cidx_count * CHUNK_INDEX_ENTSZ + CHUNK_INDEX_FOOTERSZ;
+	buf = (uchar_t *)malloc(len);
+	if (buf == NULL) {
+		log_msg(LOG_ERR, 1, "Out of memory ");
+		return (-1);
+	}
+
+	pos = chunk_index_encode(pctx, 0, pctx->cidx_count, buf);
+
+	/*
+	 * Footer: Index offset, entry count, total uncompressed size, entry size,
+	 * CRC32 of entries and preceding footer fields, magic.
+	 */
+	U64_P(pos) = htonll(pctx->comp_offset);
+	U64_P(pos + 8) = htonll(pctx->cidx_count);
+	U64_P(pos + 16) = htonll(usize);
+	U32_P(pos + 24) = htonl(CHUNK_INDEX_ENTSZ);
+	crc = lzma_crc32(buf, pos - buf + 28, 0);
+	U32_P(pos + 28) = htonl(crc);
+	memcpy(pos + 32, CHUNK_INDEX_MAGIC, 8);
+
+	wbytes = out_write(pctx, fd, buf, len);
+	free(buf);
+	if (wbytes != len) {
+		log_msg(LOG_ERR, 1, "Chunk index Write ");
+		return (-1);
+	}
+	pctx->comp_offset += len;
+	return (0);
+}
+
+/*
+ * Append the archive member index collected by the archiver thread and its
+ * footer. This goes between the trailer and the chunk index.
+ */
+static int
+member_index_write(pc_ctx_t *pctx, int fd)
+{
+	uchar_t footer[MEMBER_INDEX_FOOTERSZ];
+	uint32_t crc;
+
+	U64_P(footer) = htonll(pctx->comp_offset);
+	U64_P(footer + 8) = htonll(pctx->midx_count);
+	U64_P(footer + 16) = htonll(pctx->midx_end);
+	crc = lzma_crc32(pctx->midx, pctx->midx_len, 0);
+	crc = lzma_crc32(footer, 24, crc);
+	U32_P(footer + 24) = htonl(crc);
+	U32_P(footer + 28) = 0;
+	memcpy(footer + 32, MEMBER_INDEX_MAGIC, 8);
+
+	if (pctx->midx_len > 0 &&
+	    out_write(pctx, fd, pctx->midx, pctx->midx_len) != pctx->midx_len) {
+		log_msg(LOG_ERR, 1, "Member index Write ");
+		return (-1);
+	}
+	if (out_write(pctx, fd, footer, MEMBER_INDEX_FOOTERSZ) != MEMBER_INDEX_FOOTERSZ) {
+		log_msg(LOG_ERR, 1, "Member index Write ");
+		return (-1);
+	}
+	pctx->comp_offset += pctx->midx_len + MEMBER_INDEX_FOOTERSZ;
+	return (0);
+}
+
+/*
+ * Load the member index that ends just before the chunk index. The chunk
+ * index must have been loaded. The current file position is preserved.
+ */
+static int
+member_index_load(pc_ctx_t *pctx, int fd)
+{
+	uchar_t footer[MEMBER_INDEX_FOOTERSZ], *pos, *end;
+	uint64_t ioff, count, i;
+	off_t cpos;
+	uint32_t crc;
+	int rv;
+
+	cpos = lseek(fd, 0, SEEK_CUR);
+	if (cpos == -1)
+		return (-1);
+	rv = -1;
+	free(pctx->midx);
+	pctx->midx = NULL;
+	pctx->midx_len = 0;
+	pctx->midx_count = 0;
+	if (pctx->cidx_ioff < cpos + MEMBER_INDEX_FOOTERSZ)
+		goto load_done;
+	if (lseek(fd, pctx->cidx_ioff - MEMBER_INDEX_FOOTERSZ, SEEK_SET) == -1 ||
+	    Read(fd, footer, MEMBER_INDEX_FOOTERSZ) < MEMBER_INDEX_FOOTERSZ)
+		goto load_done;
+
+	ioff = ntohll(U64_P(footer));
+	count = ntohll(U64_P(footer + 8));
+	if (memcmp(footer + 32, MEMBER_INDEX_MAGIC, 8) != 0 || ioff < cpos ||
+	    ioff > pctx->cidx_ioff - MEMBER_INDEX_FOOTERSZ)
+		goto load_done;
+
+	pctx->midx_len = pctx->cidx_ioff - MEMBER_INDEX_FOOTERSZ - ioff;
+	pctx->midx = (uchar_t *)malloc(pctx->midx_len + 1);
+	if (pctx->midx == NULL)
+		goto load_done;
+	if (lseek(fd, ioff, SEEK_SET) == -1 ||
+	    Read(fd, pctx->midx, pctx->midx_len) < pctx->midx_len)
+		goto load_done;
+	crc = lzma_crc32(pctx->midx, pctx->midx_len, 0);
+	crc = lzma_crc32(footer, 24, crc);
+	if (crc != ntohl(U32_P(footer + 24)))
+		goto load_done;
+
+	/*
+	 * Check that the entries exactly fill the index.
+	 */
+	pos = pctx->midx;
+	end = pctx->midx + pctx->midx_len;
+	for (i = 0; i < count && end - pos >= 10; i++)
+		pos += 10 + ntohs(U16_P(pos + 8));
+	if (i < count || pos != end)
+		goto load_done;
+	pctx->midx_count = count;
+	pctx->midx_end = ntohll(U64_P(footer + 16));
+	rv = 0;
+
+load_done:
+	if (rv != 0) {
+		free(pctx->midx);
+		pctx->midx = NULL;
+		pctx->midx_len = 0;
+	}
+	if (lseek(fd, cpos, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Seek ");
+		rv = -2;
+	}
+	return (rv);
+}
+
+/*
+ * Locate the chunk index via the footer at the end of a seekable compressed
+ * file, verify and load it. The current file position is preserved.
+ */
+static int
+chunk_index_load(pc_ctx_t *pctx, int fd)
+{
+	uchar_t footer[CHUNK_INDEX_FOOTERSZ], *buf, *pos;
+	uint64_t ioff, count, usize, i, len;
+	off_t cpos, fsize;
+	uint32_t crc;
+	int rv;
+
+	cpos = lseek(fd, 0, SEEK_CUR);
+	if (cpos == -1)
+		return (-1);
+	rv = -1;
+	buf = NULL;
+	fsize = lseek(fd, 0, SEEK_END);
+	if (fsize < cpos + CHUNK_INDEX_FOOTERSZ)
+		goto load_done;
+	if (lseek(fd, fsize - CHUNK_INDEX_FOOTERSZ, SEEK_SET) == -1 ||
+	    Read(fd, footer, CHUNK_INDEX_FOOTERSZ) < CHUNK_INDEX_FOOTERSZ)
+		goto load_done;
+
+	ioff = ntohll(U64_P(footer));
+	count = ntohll(U64_P(footer + 8));
+	usize = ntohll(U64_P(footer + 16));
+	if (memcmp(footer + 32, CHUNK_INDEX_MAGIC, 8) != 0 ||
+	    ntohl(U32_P(footer + 24)) != CHUNK_INDEX_ENTSZ ||
+	    count > (fsize - cpos) / CHUNK_INDEX_ENTSZ ||
+	    ioff < cpos || ioff + count * CHUNK_INDEX_ENTSZ + CHUNK_INDEX_FOOTERSZ != fsize)
+		goto load_done;
+
+	len = count * CHUNK_INDEX_ENTSZ;
+	buf = (uchar_t *)malloc(len + 1);
+	if (buf == NULL)
+		goto load_done;
+	if (lseek(fd, ioff, SEEK_SET) == -1 || Read(fd, buf, len) < len)
+		goto load_done;
+	crc = lzma_crc32(buf, len, 0);
+	crc = lzma_crc32(footer, 28, crc);
+	if (crc != ntohl(U32_P(footer + 28)))
+		goto load_done;
+
+	pctx->cidx = (struct chunk_index_ent *)malloc((count + 1) *
+	    sizeof (struct chunk_index_ent));
+	if (pctx->cidx == NULL)
+		goto load_done;
+	pos = buf;
+	for (i = 0; i < count; i++) {
+		struct chunk_index_ent *ent = &(pctx->cidx[i]);
+
+		ent->uoff = ntohll(U64_P(pos));
+		ent->coff = ntohll(U64_P(pos + 8));
+		ent->clen = ntohll(U64_P(pos + 16));
+		ent->ulen = ntohll(U64_P(pos + 24));
+		ent->flags = ntohl(U32_P(pos + 32));
+		pos += CHUNK_INDEX_ENTSZ;
+	}
+	pctx->cidx_count = count;
+	pctx->cidx_max = count;
+	pctx->cidx_usize = usize;
+	pctx->cidx_ioff = ioff;
+	rv = 0;
+
+load_done:
+	free(buf);
+	if (lseek(fd, cpos, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Seek ");
+		rv = -2;
+	}
+	return (rv);
+}
+
+/*
+ * Read the header of the archive that '-U' appends to and take over its
+ * algorithm, level, chunk size, checksum and dedupe mode. Only unencrypted
+ * archives with a member index and without Global Deduplication qualify.
+ * Added members do not use the per-type dictionaries of the archive.
+ */
+static int
+append_load_header(pc_ctx_t *pctx, const char *arcname)
+{
+	uchar_t hdr[ALGO_SZ + 20];
+	char apath[MAXPATHLEN], *algo;
+	unsigned short version, flags;
+	int fd;
+
+	if (strlen(arcname) + strlen(COMP_EXTN) >= MAXPATHLEN) {
+		log_msg(LOG_ERR, 0, "Path too long: %s", arcname);
+		return (1);
+	}
+	strcpy(apath, arcname);
+	if (!endswith(apath, COMP_EXTN))
+		strcat(apath, COMP_EXTN);
+	if ((fd = open(apath, O_RDONLY, 0)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open: %s", apath);
+		return (1);
+	}
+	if (Read(fd, hdr, sizeof (hdr)) < sizeof (hdr)) {
+		close(fd);
+		log_msg(LOG_ERR, 0, "%s is not a compressed archive.", apath);
+		return (1);
+	}
+	close(fd);
+
+	version = ntohs(U16_P(hdr + ALGO_SZ));
+	flags = ntohs(U16_P(hdr + ALGO_SZ + 2));
+	if (lzma_crc32(hdr, ALGO_SZ + 16, 0) != ntohl(U32_P(hdr + ALGO_SZ + 16)) &&
+	    !(flags & MASK_CRYPTO_ALG)) {
+		log_msg(LOG_ERR, 0, "Header checksum mismatch in %s.", apath);
+		return (1);
+	}
+	if (version != VERSION) {
+		log_msg(LOG_ERR, 0, "Can only append to archives of format version %d.",
+		    VERSION);
+		return (1);
+	}
+	if (flags & MASK_CRYPTO_ALG) {
+		log_msg(LOG_ERR, 0, "Cannot append to an encrypted archive.");
+		return (1);
+	}
+	if (!(flags & FLAG_ARCHIVE) || !(flags & FLAG_CHUNK_INDEX) ||
+	    (flags & FLAG_META_STREAM)) {
+		log_msg(LOG_ERR, 0, "Can only append to archives created with '-a -I'.");
+		return (1);
+	}
+	if ((flags & FLAG_DEDUP) && (flags & FLAG_DEDUP_FIXED)) {
+		log_msg(LOG_ERR, 0, "Cannot append to an archive with Global Deduplication.");
+		return (1);
+	}
+
+	algo = (char *)malloc(ALGO_SZ + 1);
+	if (algo == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (1);
+	}
+	memcpy(algo, hdr, ALGO_SZ);
+	algo[ALGO_SZ] = '\0';
+	pctx->algo = algo;
+	if (init_algo(pctx, pctx->algo, 1) != 0) {
+		log_msg(LOG_ERR, 0, "Invalid algorithm %s in %s", algo, apath);
+		return (1);
+	}
+	pctx->chunksize = ntohll(U64_P(hdr + ALGO_SZ + 4));
+	pctx->level = ntohl(U32_P(hdr + ALGO_SZ + 12)) & ~LEVEL_TYPE_DICT;
+	pctx->cksum = flags & CKSUM_MASK;
+	if (get_checksum_props(NULL, &(pctx->cksum), &(pctx->cksum_bytes),
+	    &(pctx->mac_bytes), 1) == -1) {
+		log_msg(LOG_ERR, 0, "Invalid checksum algorithm code: %d.", pctx->cksum);
+		return (1);
+	}
+	pctx->append_flags = flags;
+	pctx->chunk_index = 1;
+	return (0);
+}
+
+/*
+ * Prepare an existing archive for appending. The chunk and member indexes are
+ * loaded so that new entries extend them and the file is positioned at the
+ * zero-length trailer, which the new chunks overwrite. The old tail is kept
+ * so that a failed append can put it back.
+ */
+static int
+append_open(pc_ctx_t *pctx, int fd)
+{
+	off_t fsize;
+	uchar_t *tail;
+
+	if (lseek(fd, ALGO_SZ + 20, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Seek ");
+		return (-1);
+	}
+	if (chunk_index_load(pctx, fd) != 0 || member_index_load(pctx, fd) != 0) {
+		log_msg(LOG_ERR, 0, "Cannot append: chunk or member index is missing "
+		    "or corrupt.");
+		return (-1);
+	}
+	pctx->midx_max = pctx->midx_len;
+	pctx->arc_stream_pos = pctx->cidx_usize;
+	pctx->append_usize = pctx->cidx_usize;
+	pctx->append_off = pctx->cidx_ioff - MEMBER_INDEX_FOOTERSZ - pctx->midx_len -
+	    sizeof (uint64_t);
+
+	fsize = lseek(fd, 0, SEEK_END);
+	if (fsize == -1 || pctx->append_off < ALGO_SZ + 20) {
+		log_msg(LOG_ERR, 0, "Cannot append: archive trailer not found.");
+		return (-1);
+	}
+	pctx->append_tail_len = fsize - pctx->append_off;
+	tail = (uchar_t *)malloc(pctx->append_tail_len);
+	if (tail == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (-1);
+	}
+	if (lseek(fd, pctx->append_off, SEEK_SET) == -1 ||
+	    Read(fd, tail, pctx->append_tail_len) < pctx->append_tail_len ||
+	    U64_P(tail) != 0 || lseek(fd, pctx->append_off, SEEK_SET) == -1) {
+		free(tail);
+		log_msg(LOG_ERR, 0, "Cannot append: archive trailer not found.");
+		return (-1);
+	}
+	pctx->append_tail = tail;
+	return (0);
+}
+
+/*
+ * Put back the trailer and indexes of an archive after a failed append.
+ */
+static void
+append_restore(pc_ctx_t *pctx, int fd)
+{
+	if (lseek(fd, pctx->append_off, SEEK_SET) == -1 ||
+	    Write(fd, pctx->append_tail, pctx->append_tail_len) != pctx->append_tail_len ||
+	    ftruncate(fd, pctx->append_off + pctx->append_tail_len) == -1)
+		log_msg(LOG_ERR, 1, "Cannot restore archive after failed append ");
+}
+
+/*
+ * Write the next checkpoint record. Records alternate between two slots so
+ * that a torn write leaves the previous one intact.
+ */
+static int
+ckpt_write_rec(pc_ctx_t *pctx, uint64_t nent, uint64_t coff, uint64_t uoff)
+{
+	uchar_t rec[CKPT_RECSZ];
+
+	memset(rec, 0, CKPT_RECSZ);
+	memcpy(rec, CKPT_MAGIC, 8);
+	U64_P(rec + 8) = htonll(pctx->ckpt_seq);
+	U64_P(rec + 16) = htonll(nent);
+	U64_P(rec + 24) = htonll(coff);
+	U64_P(rec + 32) = htonll(uoff);
+	U64_P(rec + 40) = htonll(pctx->ckpt_isize);
+	U64_P(rec + 48) = htonll(pctx->ckpt_mtime);
+	U32_P(rec + 56) = htonl(lzma_crc32(rec, 56, 0));
+	if (pwrite(pctx->ckpt_fd, rec, CKPT_RECSZ, (pctx->ckpt_seq & 1) * CKPT_RECSZ) !=
+	    CKPT_RECSZ)
+		return (-1);
+	pctx->ckpt_seq++;
+	return (0);
+}
+
+/*
+ * Record the chunks written since the last checkpoint, at most once per
+ * checkpoint interval unless forced. The output is synced first, then the
+ * new chunk index entries are added to the checkpoint file and synced and
+ * last the record pointing past them is written. Called by the writer thread
+ * after chunks have been written. A failure only stops further checkpoints,
+ * the last good one stays usable.
+ */
+static void
+ckpt_update(pc_ctx_t *pctx, int fd, int force)
+{
+	uchar_t *buf;
+	uint64_t n, len, uoff;
+	double now;
+
+	if (pctx->ckpt_fd == -1)
+		return;
+	now = get_wtime_millis();
+	if (!force && now - pctx->ckpt_last < pctx->ckpt_ms)
+		return;
+	pctx->ckpt_last = now;
+
+	n = pctx->cidx_count;
+	uoff = pctx->ckpt_uoff;
+	if (n > 0)
+		uoff = pctx->cidx[n - 1].uoff + pctx->cidx[n - 1].ulen;
+	len = (n - pctx->ckpt_nent) * CHUNK_INDEX_ENTSZ;
+	buf = (uchar_t *)malloc(len + 1);
+	if (buf != NULL)
+		chunk_index_encode(pctx, pctx->ckpt_nent, n, buf);
+	if (buf == NULL || fdatasync(fd) == -1 ||
+	    pwrite(pctx->ckpt_fd, buf, len, 2 * CKPT_RECSZ + pctx->ckpt_nent *
+	    CHUNK_INDEX_ENTSZ) != (int64_t)len || fdatasync(pctx->ckpt_fd) == -1 ||
+	    ckpt_write_rec(pctx, n, pctx->comp_offset, uoff) == -1 ||
+	    fdatasync(pctx->ckpt_fd) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot write checkpoint, no further checkpoints ");
+		close(pctx->ckpt_fd);
+		pctx->ckpt_fd = -1;
+	}
+	free(buf);
+	pctx->ckpt_nent = n;
+}
+
+/*
+ * Pick the newer of the two checkpoint records and load the chunk index
+ * entries it covers. The entries must follow each other in the input and the
+ * output, starting at the beginning of the input.
+ */
+static int
+ckpt_load(pc_ctx_t *pctx)
+{
+	uchar_t rec[2][CKPT_RECSZ], *r, *buf, *pos;
+	uint64_t nent, coff, uoff, i, len;
+	int s;
+
+	if (pread(pctx->ckpt_fd, rec, sizeof (rec), 0) != sizeof (rec))
+		memset(rec, 0, sizeof (rec));
+	r = NULL;
+	for (s = 0; s < 2; s++) {
+		if (memcmp(rec[s], CKPT_MAGIC, 8) != 0 ||
+		    ntohl(U32_P(rec[s] + 56)) != lzma_crc32(rec[s], 56, 0))
+			continue;
+		if (r == NULL || ntohll(U64_P(rec[s] + 8)) > ntohll(U64_P(r + 8)))
+			r = rec[s];
+	}
+	if (r == NULL) {
+		log_msg(LOG_ERR, 0, "Cannot resume: no valid checkpoint.");
+		return (-1);
+	}
+	if (ntohll(U64_P(r + 40)) != pctx->ckpt_isize ||
+	    ntohll(U64_P(r + 48)) != pctx->ckpt_mtime) {
+		log_msg(LOG_ERR, 0, "Cannot resume: the input file changed since the "
+		    "checkpoint.");
+		return (-1);
+	}
+	nent = ntohll(U64_P(r + 16));
+	coff = ntohll(U64_P(r + 24));
+	uoff = ntohll(U64_P(r + 32));
+	if (uoff > pctx->ckpt_isize || nent > uoff) {
+		log_msg(LOG_ERR, 0, "Cannot resume: corrupt checkpoint.");
+		return (-1);
+	}
+
+	len = nent * CHUNK_INDEX_ENTSZ;
+	buf = (uchar_t *)malloc(len + 1);
+	free(pctx->cidx);
+	pctx->cidx = (struct chunk_index_ent *)malloc((nent + 1) *
+	    sizeof (struct chunk_index_ent));
+	if (buf == NULL || pctx->cidx == NULL) {
+		free(buf);
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (-1);
+	}
+	if (pread(pctx->ckpt_fd, buf, len, 2 * CKPT_RECSZ) != (int64_t)len) {
+		free(buf);
+		log_msg(LOG_ERR, 0, "Cannot resume: checkpoint is truncated.");
+		return (-1);
+	}
+	pos = buf;
+	for (i = 0; i < nent; i++) {
+		struct chunk_index_ent *ent = &(pctx->cidx[i]);
+
+		ent->uoff = ntohll(U64_P(pos));
+		ent->coff = ntohll(U64_P(pos + 8));
+		ent->clen = ntohll(U64_P(pos + 16));
+		ent->ulen = ntohll(U64_P(pos + 24));
+		ent->flags = ntohl(U32_P(pos + 32));
+		pos += CHUNK_INDEX_ENTSZ;
+		if (ent->uoff != (i ? ent[-1].uoff + ent[-1].ulen : 0) ||
+		    (i && ent->coff != ent[-1].coff + ent[-1].clen))
+			break;
+	}
+	free(buf);
+	if (i < nent || (nent > 0 && (pctx->cidx[nent - 1].uoff +
+	    pctx->cidx[nent - 1].ulen != uoff || pctx->cidx[nent - 1].coff +
+	    pctx->cidx[nent - 1].clen != coff))) {
+		log_msg(LOG_ERR, 0, "Cannot resume: corrupt checkpoint.");
+		return (-1);
+	}
+	pctx->cidx_count = nent;
+	pctx->cidx_max = nent + 1;
+	pctx->ckpt_nent = nent;
+	pctx->ckpt_seq = ntohll(U64_P(r + 8)) + 1;
+	pctx->ckpt_coff = coff;
+	pctx->ckpt_uoff = uoff;
+	return (0);
+}
+
+/*
+ * Open the output of a compression with checkpoints, <target>.part, and
+ * its checkpoint file. When resuming the checkpoint is loaded and the
+ * output is kept, otherwise both start out empty. Returns the output fd.
+ */
+static int
+ckpt_open(pc_ctx_t *pctx, const char *to_filename, char *partname, struct stat *sb)
+{
+	char cname[MAXPATHLEN];
+	struct stat pst;
+	int fd, oflags;
+
+	if (strlen(to_filename) + strlen(CKPT_PART_EXTN) >= MAXPATHLEN) {
+		log_msg(LOG_ERR, 0, "Path too long: %s", to_filename);
+		return (-1);
+	}
+	snprintf(partname, MAXPATHLEN, "%s" CKPT_PART_EXTN, to_filename);
+	snprintf(cname, sizeof (cname), "%s" CKPT_EXTN, to_filename);
+	pctx->ckpt_isize = sb->st_size;
+	pctx->ckpt_mtime = sb->st_mtime;
+	pctx->ckpt_seq = 0;
+	pctx->ckpt_nent = 0;
+	pctx->ckpt_coff = 0;
+	pctx->ckpt_uoff = 0;
+	pctx->ckpt_last = get_wtime_millis();
+
+	oflags = (pctx->resume ? O_RDWR : O_CREAT|O_RDWR|O_TRUNC);
+	if ((pctx->ckpt_fd = open(cname, oflags, S_IRUSR|S_IWUSR)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open checkpoint %s ", cname);
+		return (-1);
+	}
+	if (pctx->resume && ckpt_load(pctx) == -1)
+		goto open_err;
+	if ((fd = open(partname, oflags, S_IRUSR|S_IWUSR)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open %s ", partname);
+		goto open_err;
+	}
+	if (pctx->resume) {
+		if (fstat(fd, &pst) == -1 || pst.st_size < pctx->ckpt_coff) {
+			log_msg(LOG_ERR, 0, "Cannot resume: %s is shorter than the "
+			    "checkpoint.", partname);
+			close(fd);
+			goto open_err;
+		}
+		log_msg(LOG_INFO, 0, "Resuming after chunk %" PRIu64 " at input offset %"
+		    PRIu64, pctx->ckpt_nent, pctx->ckpt_uoff);
+	}
+	return (fd);
+
+open_err:
+	close(pctx->ckpt_fd);
+	pctx->ckpt_fd = -1;
+	return (-1);
+}
+
+/*
+ * Close the checkpoint file, removing it once the compression is complete.
+ */
+static void
+ckpt_close(pc_ctx_t *pctx, const char *to_filename, int done)
+{
+	char cname[MAXPATHLEN];
+
+	if (!done && pctx->ckpt_fd == -1)
+		return;
+	snprintf(cname, sizeof (cname), "%s" CKPT_EXTN, to_filename);
+	if (done)
+		unlink(cname);
+	else if (pctx->ckpt_fd != -1)
+		log_msg(LOG_INFO, 0, "Checkpoint kept in %s, run again with -r to resume.",
+		    cname);
+	if (pctx->ckpt_fd != -1)
+		close(pctx->ckpt_fd);
+	pctx->ckpt_fd = -1;
+}
+
+/*
+ * Write a part of the file header or, when resuming, check that it matches
+ * the header of the interrupted run.
+ */
+static int64_t
+hdr_write(pc_ctx_t *pctx, int fd, const uchar_t *buf, uint64_t len)
+{
+	uchar_t old[ALGO_SZ + 64];
+
+	if (!pctx->resume)
+		return (out_write(pctx, fd, buf, len));
+	if (len > sizeof (old) || pread(fd, old, len, pctx->comp_offset) != (int64_t)len ||
+	    memcmp(old, buf, len) != 0) {
+		log_msg(LOG_ERR, 0, "Cannot resume: algorithm, level, chunk size, "
+		    "checksum or dedupe options differ from the interrupted run.");
+		return (-1);
+	}
+	return (len);
+}
+
+/*
+ * Clip the requested byte range to the uncompressed size and find the span of
+ * chunks [range_chunk, range_end) in the index that covers it.
+ */
+static void
+chunk_index_range(pc_ctx_t *pctx)
+{
+	uint64_t lo, hi, mid, end;
+
+	if (pctx->range_offset >= pctx->cidx_usize)
+		pctx->range_len = 0;
+	else if (pctx->range_len > pctx->cidx_usize - pctx->range_offset)
+		pctx->range_len = pctx->cidx_usize - pctx->range_offset;
+	if (pctx->range_len == 0) {
+		pctx->range_chunk = 0;
+		pctx->range_end = 0;
+		return;
+	}
+
+	/* First chunk ending beyond range start. */
+	lo = 0;
+	hi = pctx->cidx_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pctx->cidx[mid].uoff + pctx->cidx[mid].ulen <= pctx->range_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	pctx->range_chunk = lo;
+
+	/* First chunk starting at or beyond range end. */
+	end = pctx->range_offset + pctx->range_len;
+	hi = pctx->cidx_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pctx->cidx[mid].uoff < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	pctx->range_end = lo;
+}
+
+/*
+ * Copy the part of a decompressed chunk that overlaps the requested byte
+ * range into the caller's buffer. Called by the writer thread.
+ */
+static int64_t
+chunk_range_copy(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	uint64_t start, end;
+
+	start = tdat->file_offset;
+	end = start + tdat->len_cmp;
+	if (start < pctx->range_offset)
+		start = pctx->range_offset;
+	if (end > pctx->range_offset + pctx->range_len)
+		end = pctx->range_offset + pctx->range_len;
+	if (start < end) {
+		memcpy(pctx->range_buf + (start - pctx->range_offset),
+		    tdat->cmp_seg + (start - tdat->file_offset), end - start);
+	}
+	return (tdat->len_cmp);
+}
+
+/*
+ * Map a regular input file so that chunks can be compressed straight from the
+ * page cache. The mapping is private and writable so that any in-place scratch
+ * use of the input buffer by a filter only touches a copy of the page.
+ */
+static uchar_t *
+input_map(int fd, uint64_t len)
+{
+	void *map;
+
+	if (len == 0 || len > (uint64_t)SIZE_MAX)
+		return (NULL);
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return (NULL);
+#ifdef MADV_SEQUENTIAL
+	(void) madvise(map, len, MADV_SEQUENTIAL);
+#endif
+	return ((uchar_t *)map);
+}
+
+/*
+ * Continue the output and input of a resumed compression after the last
+ * checkpointed chunk. With Global Dedupe the blocks of the chunks already
+ * compressed are put back into the index first.
+ */
+static int
+ckpt_resume(pc_ctx_t *pctx, int compfd, int uncompfd, uint64_t isize,
+    dedupe_context_t *rctx)
+{
+	uchar_t *map;
+	uint64_t i;
+
+	if (rctx != NULL && pctx->ckpt_nent > 0) {
+		if ((map = input_map(uncompfd, isize)) == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot map input ");
+			return (-1);
+		}
+		for (i = 0; i < pctx->ckpt_nent; i++) {
+			if (dedupe_index_reseed(rctx, map + pctx->cidx[i].uoff,
+			    pctx->cidx[i].uoff, pctx->cidx[i].ulen) == -1)
+				break;
+		}
+		munmap(map, isize);
+		if (i < pctx->ckpt_nent) {
+			log_msg(LOG_ERR, 0, "Cannot rebuild the Global Dedupe index.");
+			return (-1);
+		}
+	}
+	pctx->comp_offset = pctx->ckpt_coff;
+	if (ftruncate(compfd, pctx->ckpt_coff) == -1 ||
+	    lseek(compfd, pctx->ckpt_coff, SEEK_SET) == -1 ||
+	    lseek(uncompfd, pctx->ckpt_uoff, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot seek to the checkpoint ");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * End a chunk of mapped input at the last content boundary in it, as
+ * Read_Adjusted() does for input that is read. Only the tail of the chunk
+ * is scanned. The last chunk of the file is left as is.
+ */
+static int64_t
+input_map_split(dedupe_context_t *rctx, uchar_t *imap, uint64_t offset, int64_t len,
+    uint64_t size)
+{
+	uint64_t sz, pos;
+
+	if (rctx == NULL || (uint64_t)len <= rctx->rabin_poly_max_block_size ||
+	    offset + len >= size)
+		return (len);
+	sz = len;
+	pos = 0;
+	dedupe_compress(rctx, imap + offset, &sz, 0, &pos, 0);
+	return (pos > 0 ? (int64_t)pos : len);
+}
+
+/*
+ * Release the mapped pages of input that has been fully written out, from
+ * *dropped up to the page containing upto.
+ */
+static void
+input_map_drop(uchar_t *map, uint64_t *dropped, uint64_t upto)
+{
+#ifdef MADV_DONTNEED
+	uint64_t pgsz = (uint64_t)sysconf(_SC_PAGESIZE);
+
+	upto -= upto % pgsz;
+	if (upto > *dropped) {
+		(void) madvise(map + *dropped, upto - *dropped, MADV_DONTNEED);
+		*dropped = upto;
+	}
+#endif
+}
+
+static void
+rdahead_advise(struct rdahead *ra)
+{
+#ifdef POSIX_FADV_WILLNEED
+	if (ra->advise) {
+		off_t cpos = lseek(ra->fd, 0, SEEK_CUR);
+
+		if (cpos != -1)
+			(void) posix_fadvise(ra->fd, cpos, ra->chunksize * READ_AHEAD_BUFS,
+			    POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+
+/*
+ * Like Read() but the reader thread gives up when the read-ahead is stopped,
+ * even if no more data ever arrives on an input pipe. Otherwise stopping it
+ * after an error would wait for the input forever.
+ */
+static int64_t
+rdahead_fill(struct rdahead *ra, uchar_t *buf, uint64_t count)
+{
+	struct pollfd pfd;
+	int64_t rcount;
+	uint64_t rem;
+
+	if (!ra->threaded)
+		return (Read(ra->fd, buf, count));
+	rem = count;
+	pfd.fd = ra->fd;
+	pfd.events = POLLIN;
+	while (rem) {
+		if (ra->cancel)
+			return (-1);
+		if (poll(&pfd, 1, 100) == 0)
+			continue;
+		rcount = read(ra->fd, buf, rem);
+		if (rcount < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (rcount);
+		}
+		if (rcount == 0)
+			break;
+		rem -= rcount;
+		buf += rcount;
+	}
+	return (count - rem);
+}
+
+/*
+ * Read a chunk in slices paced by the read rate limit so that the input is
+ * not pulled in with bursts of a whole chunk.
+ */
+static int64_t
+rdahead_read_paced(struct rdahead *ra, uchar_t *buf, uint64_t count)
+{
+	uint64_t done, n;
+	int64_t rv;
+
+	done = 0;
+	while (done < count) {
+		n = count - done;
+		if (n > READ_PACE_SLICE)
+			n = READ_PACE_SLICE;
+		pc_throttle_read(ra->pctx->throttle, n);
+		rv = rdahead_fill(ra, buf + done, n);
+		if (rv < 0)
+			return (rv);
+		done += rv;
+		if ((uint64_t)rv < n)
+			break;
+	}
+	return (done);
+}
 
-static void * writer_thread(void *dat);
-static int init_algo(pc_ctx_t *pctx, const char *algo, int bail);
-extern uint32_t lzma_crc32(const uint8_t *buf, uint64_t size, uint32_t crc);
+/*
+ * Read the next chunk of input into the given buffer. With Rabin splitting the
+ * data beyond the last Rabin boundary is carried over to the next chunk, unless
+ * the input is mapped.
+ */
+static void
+rdahead_read(struct rdahead *ra, struct rdbuf *rb)
+{
+	pc_ctx_t *pctx = ra->pctx;
+	int64_t rabin_count;
+	uint64_t st_t, count, want;
+	int btype;
+
+	st_t = pc_stats_start(ra->stats);
+	pctx->interesting = 0;
+	want = ra->chunksize;
+	btype = pctx->btype;
+	if (ra->plan)
+		want = chunk_plan_next(ra->plan, ra->pos, want, &btype);
+	if (ra->end > 0 && want > ra->end - ra->pos)
+		want = ra->end - ra->pos;
+	if (ra->map != NULL) {
+		/*
+		 * Chunks are windows of the mapped input that end at the last
+		 * boundary. The next one starts right there so nothing is carried
+		 * over, and each byte is copied once into the buffer.
+		 */
+		count = ra->map_len - ra->pos;
+		if (count > want)
+			count = want;
+		count = input_map_split(ra->rctx, ra->map, ra->pos, count,
+		    ra->end > 0 ? ra->end : ra->map_len);
+		memcpy(rb->buf, ra->map + ra->pos, count);
+		input_map_drop(ra->map, &ra->map_dropped, ra->pos + count);
+		rb->rbytes = count;
+		if (count > 0)
+			pc_throttle_read(pctx->throttle, count);
+	} else if (pctx->enable_rabin_split) {
+		rabin_count = ra->carry_len;
+		if (rabin_count)
+			memcpy(rb->buf, ra->carry, rabin_count);
+
+		/*
+		 * With adaptive chunk sizing the carried over data may exceed the
+		 * current chunk size. Always read some new data after it.
+		 */
+		count = want;
+		if (count <= (uint64_t)rabin_count) {
+			count += rabin_count;
+			if (count > ra->maxchunk)
+				count = ra->maxchunk;
+			if (ra->end > 0 && count > ra->end - ra->pos)
+				count = ra->end - ra->pos;
+		}
+		if (pctx->archive_mode) {
+			rb->rbytes = Read_Adjusted(ra->fd, rb->buf, count, &rabin_count,
+			    ra->rctx, pctx);
+		} else {
+			rb->rbytes = rdahead_fill(ra, rb->buf + rabin_count, count - rabin_count);
+			rb->rbytes = Split_Adjusted(rb->buf, rb->rbytes, count - rabin_count,
+			    &rabin_count, ra->rctx);
+		}
+		if (rb->rbytes > 0)
+			pc_throttle_read(pctx->throttle, rb->rbytes);
+		ra->carry_len = 0;
+		if (rabin_count && rb->rbytes > 0) {
+			ra->carry_len = rb->rbytes - rabin_count;
+			memcpy(ra->carry, rb->buf + rabin_count, ra->carry_len);
+			rb->rbytes = rabin_count;
+		}
+	} else {
+		if (pctx->archive_mode) {
+			rb->rbytes = archiver_read(pctx, rb->buf, ra->chunksize);
+			if (rb->rbytes > 0)
+				pc_throttle_read(pctx->throttle, rb->rbytes);
+		} else if (pctx->read_rate) {
+			rb->rbytes = rdahead_read_paced(ra, rb->buf, want);
+		} else {
+			rb->rbytes = rdahead_fill(ra, rb->buf, want);
+		}
+	}
+	rb->interesting = pctx->interesting;
+	rb->btype = btype;
+	if (rb->rbytes > 0) {
+		ra->pos += rb->rbytes;
+		pc_stats_end(ra->stats, PC_STAGE_READ, st_t, rb->rbytes);
+		rdahead_advise(ra);
+	}
+}
+
+/*
+ * Read all the free buffers in one io_uring batch. Only used for plain input
+ * without Rabin splitting where chunk boundaries do not depend on the data.
+ */
+static int
+rdahead_read_batch(struct rdahead *ra, int n)
+{
+	uchar_t *bufs[READ_AHEAD_BUFS];
+	uint64_t lens[READ_AHEAD_BUFS];
+	int64_t done[READ_AHEAD_BUFS];
+	struct rdbuf *rb;
+	uint64_t st_t, total;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		bufs[i] = ra->ent[(ra->tail + i) % READ_AHEAD_BUFS].buf;
+		lens[i] = ra->chunksize;
+	}
+	st_t = pc_stats_start(ra->stats);
+	if (pc_uring_rw(ra->ring, 0, ra->fd, bufs, lens, done, n) == -1) {
+		for (i = 0; i < n; i++)
+			done[i] = -1;
+	}
+	total = 0;
+	for (i = 0; i < n; i++) {
+		if (done[i] > 0)
+			total += done[i];
+	}
+	pc_stats_end(ra->stats, PC_STAGE_READ, st_t, total);
+	for (i = 0; i < n; i++) {
+		rb = &ra->ent[ra->tail];
+		rb->rbytes = done[i];
+		rb->interesting = 0;
+		rb->btype = ra->pctx->btype;
+		ra->tail = (ra->tail + 1) % READ_AHEAD_BUFS;
+		Sem_Post(&ra->filled);
+		if (rb->rbytes <= 0)
+			return (-1);
+	}
+	rdahead_advise(ra);
+	return (0);
+}
+
+/*
+ * Archive mode without Rabin splitting. Every free buffer is queued with the
+ * archiver which writes straight into it and moves on to the next queued one
+ * without waiting for this thread. The oldest queued buffer is then collected.
+ */
+static int
+rdahead_arc_read(struct rdahead *ra)
+{
+	pc_ctx_t *pctx = ra->pctx;
+	struct rdbuf *rb;
+	uint64_t st_t;
+
+	do {
+		if (ra->cancel)
+			return (-1);
+		rb = &ra->ent[(ra->tail + ra->arc_queued) % READ_AHEAD_BUFS];
+		archiver_submit(pctx, rb->buf, ra->chunksize);
+		ra->arc_queued++;
+	} while (ra->arc_queued < READ_AHEAD_BUFS && ra->arc_queued < ARC_SLOTS &&
+	    Sem_TryWait(&ra->empty) == 0);
+
+	st_t = pc_stats_start(ra->stats);
+	rb = &ra->ent[ra->tail];
+	rb->rbytes = archiver_wait(pctx, &rb->btype, &rb->interesting);
+	ra->arc_queued--;
+	if (rb->rbytes > 0) {
+		pc_throttle_read(pctx->throttle, rb->rbytes);
+		pc_stats_end(ra->stats, PC_STAGE_READ, st_t, rb->rbytes);
+	}
+	ra->tail = (ra->tail + 1) % READ_AHEAD_BUFS;
+	Sem_Post(&ra->filled);
+	return (rb->rbytes <= 0 ? -1 : 0);
+}
+
+static void *
+rdahead_thread(void *dat)
+{
+	struct rdahead *ra = (struct rdahead *)dat;
+	struct rdbuf *rb;
+	int n;
+
+	if (ra->pctx->cpu_share)
+		pc_throttle_background();
+	for (;;) {
+		Sem_Wait(&ra->empty);
+		if (ra->cancel)
+			break;
+		if (ra->ring) {
+			n = 1;
+			while (n < READ_AHEAD_BUFS && Sem_TryWait(&ra->empty) == 0)
+				n++;
+			if (ra->cancel)
+				break;
+			if (rdahead_read_batch(ra, n) == -1)
+				break;
+			continue;
+		}
+		if (ra->pctx->archive_mode && !ra->pctx->enable_rabin_split) {
+			if (rdahead_arc_read(ra) == -1)
+				break;
+			continue;
+		}
+		rb = &ra->ent[ra->tail];
+		rdahead_read(ra, rb);
+		ra->tail = (ra->tail + 1) % READ_AHEAD_BUFS;
+		Sem_Post(&ra->filled);
+		if (rb->rbytes <= 0)
+			break;
+	}
+	return (NULL);
+}
+
+/*
+ * Set up input buffering. If threaded is zero no reader thread or extra buffers
+ * are used and rdahead_next() reads synchronously. Otherwise rdahead_run() must
+ * be called to start reading. With a chunk plan the chunk sizes follow it.
+ */
+static struct rdahead *
+rdahead_start(pc_ctx_t *pctx, int fd, uint64_t chunksize, uint64_t bufsize,
+    dedupe_context_t *rctx, struct chunk_plan *plan, int threaded)
+{
+	struct rdahead *ra;
+	int i;
+
+	ra = (struct rdahead *)calloc(1, sizeof (struct rdahead));
+	if (ra == NULL)
+		return (NULL);
+	ra->pctx = pctx;
+	ra->fd = fd;
+	ra->chunksize = chunksize;
+	ra->maxchunk = chunksize;
+	ra->rctx = rctx;
+	ra->plan = plan;
+	ra->advise = (!pctx->pipe_mode && !pctx->archive_mode);
+	if (pctx->resume)
+		ra->pos = pctx->ckpt_uoff;
+	if (pctx->shard_mode) {
+		ra->pos = pctx->shard_off;
+		ra->end = pctx->shard_off + pctx->shard_len;
+	}
+
+	/*
+	 * Content split chunks of a regular file are cut from a mapping of it,
+	 * where the bytes after the boundary need not be carried over. A read
+	 * rate limit needs the reads to pace.
+	 */
+	if (pctx->enable_rabin_split && ra->advise && !pctx->read_rate) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		    lseek(fd, 0, SEEK_CUR) == (off_t)ra->pos) {
+			ra->map = input_map(fd, st.st_size);
+			ra->map_len = st.st_size;
+		}
+		if (ra->map != NULL)
+			ra->advise = 0;
+	}
+	if (pctx->enable_rabin_split && ra->map == NULL) {
+		ra->carry = (uchar_t *)slab_alloc(NULL, chunksize);
+		if (ra->carry == NULL) {
+			free(ra);
+			return (NULL);
+		}
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (ra->advise)
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	if (!threaded)
+		return (ra);
+
+	for (i = 0; i < READ_AHEAD_BUFS; i++) {
+		ra->ent[i].buf = (uchar_t *)slab_alloc(NULL, bufsize);
+		if (ra->ent[i].buf == NULL)
+			goto start_err;
+	}
+	Sem_Init(&ra->filled, 0, 0);
+	Sem_Init(&ra->empty, 0, READ_AHEAD_BUFS);
+	ra->threaded = 1;
+
+	/*
+	 * An io_uring read of a pipe cannot be given up on, see rdahead_fill().
+	 */
+	if (!pctx->enable_rabin_split && !pctx->archive_mode && !pctx->read_rate &&
+	    !pctx->pipe_mode && plan == NULL && ra->end == 0)
+		ra->ring = pc_uring_create(READ_AHEAD_BUFS);
+	return (ra);
+
+start_err:
+	for (i = 0; i < READ_AHEAD_BUFS; i++) {
+		if (ra->ent[i].buf)
+			slab_release(NULL, ra->ent[i].buf);
+	}
+	if (ra->carry)
+		slab_release(NULL, ra->carry);
+	if (ra->map)
+		munmap(ra->map, ra->map_len);
+	free(ra);
+	return (NULL);
+}
+
+static int
+rdahead_run(struct rdahead *ra)
+{
+	if (!ra->threaded)
+		return (0);
+	if (pthread_create(&ra->thr, NULL, rdahead_thread, (void *)ra) != 0) {
+		ra->threaded = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Register every chunk sized buffer that can reach the io_uring reader or
+ * writer. Buffers move between the slots and the read-ahead ring so the same
+ * set goes to both.
+ */
+static void
+uring_register_bufs(pc_uring_t *wring, struct rdahead *ra, struct cmp_data **dary,
+    uint32_t nslots, uchar_t *cread_buf, uint64_t buflen)
+{
+	uchar_t **bufs;
+	uint32_t i;
+	int n;
+
+	bufs = (uchar_t **)malloc((nslots * 2 + READ_AHEAD_BUFS + 1) * sizeof (uchar_t *));
+	if (bufs == NULL)
+		return;
+	n = 0;
+	for (i = 0; i < nslots; i++) {
+		if (dary[i]->cmp_seg != (uchar_t *)1)
+			bufs[n++] = dary[i]->cmp_seg;
+		if (dary[i]->uncompressed_chunk != (uchar_t *)1)
+			bufs[n++] = dary[i]->uncompressed_chunk;
+	}
+	if (cread_buf)
+		bufs[n++] = cread_buf;
+	if (ra && ra->threaded) {
+		for (i = 0; i < READ_AHEAD_BUFS; i++)
+			bufs[n++] = ra->ent[i].buf;
+	}
+	if (wring)
+		(void) pc_uring_register(wring, bufs, n, buflen);
+	if (ra && ra->ring)
+		(void) pc_uring_register(ra->ring, bufs, n, buflen);
+	free(bufs);
+}
+
+/*
+ * Exchange the caller's free buffer for the next filled one. Returns the number
+ * of bytes in the new buffer, 0 at EOF or -1 on error.
+ */
+static int64_t
+rdahead_next(struct rdahead *ra, uchar_t **buf, int *interesting, int *btype)
+{
+	struct rdbuf *rb, srb;
+	uchar_t *tmp;
+	int64_t rbytes;
+
+	if (!ra->threaded) {
+		srb.buf = *buf;
+		rb = &srb;
+		rdahead_read(ra, rb);
+	} else {
+		Sem_Wait(&ra->filled);
+		rb = &ra->ent[ra->head];
+		tmp = rb->buf;
+		rb->buf = *buf;
+		*buf = tmp;
+		ra->head = (ra->head + 1) % READ_AHEAD_BUFS;
+	}
+	*interesting = rb->interesting;
+	*btype = rb->btype;
+	rbytes = rb->rbytes;
+	if (ra->threaded)
+		Sem_Post(&ra->empty);
+	return (rbytes);
+}
+
+static void
+rdahead_stop(struct rdahead *ra)
+{
+	int i;
+
+	if (ra->threaded) {
+		if (ra->threaded == 1) {
+			ra->cancel = 1;
+			Sem_Post(&ra->empty);
+			pthread_join(ra->thr, NULL);
+		}
+		pc_uring_destroy(ra->ring);
+		Sem_Destroy(&ra->filled);
+		Sem_Destroy(&ra->empty);
+		for (i = 0; i < READ_AHEAD_BUFS; i++)
+			slab_release(NULL, ra->ent[i].buf);
+	}
+	if (ra->carry)
+		slab_release(NULL, ra->carry);
+	if (ra->map)
+		munmap(ra->map, ra->map_len);
+	free(ra);
+}
+
+/*
+ * Like Read() but gives up when the prefetch is cancelled, even if no more
+ * data ever arrives on the input.
+ */
+static int64_t
+prefetch_fill(struct prefetch *pf, uchar_t *buf, uint64_t count)
+{
+	struct pollfd pfd;
+	int64_t rcount;
+	uint64_t rem;
+
+	rem = count;
+	pfd.fd = pf->fd;
+	pfd.events = POLLIN;
+	while (rem) {
+		if (pf->cancel)
+			return (-1);
+		if (poll(&pfd, 1, 100) == 0)
+			continue;
+		rcount = read(pf->fd, buf, rem);
+		if (rcount < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return (rcount);
+		}
+		if (rcount == 0)
+			break;
+		rem -= rcount;
+		buf += rcount;
+	}
+	return (count - rem);
+}
+
+/*
+ * Read the next chunk header and body. Status is 1 at the end of the stream
+ * and -1 on error.
+ */
+static void
+prefetch_read(struct prefetch *pf, struct pfbuf *pb)
+{
+	uint64_t st_t;
+	int64_t rb;
+
+	pb->status = -1;
+	rb = prefetch_fill(pf, (uchar_t *)&pb->len_cmp, sizeof (pb->len_cmp));
+	if (pf->cancel)
+		return;
+	if (rb != sizeof (pb->len_cmp)) {
+		if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
+		else
+			log_msg(LOG_ERR, 0, "Incomplete chunk %d header,"
+			    "file corrupt", pf->chunk_num);
+		return;
+	}
+	pb->len_cmp_be = pb->len_cmp; // Needed for HMAC
+	pb->len_cmp = htonll(pb->len_cmp);
+
+	if (pb->len_cmp == 0) {
+		pb->status = 1;
+		return;
+	}
+	if (pb->len_cmp == METADATA_INDICATOR) {
+		log_msg(LOG_ERR, 0, "Invalid chunk %d length: %" PRIu64 "\n",
+		    pf->chunk_num, pb->len_cmp);
+		return;
+	}
+	if (pb->len_cmp > pf->chunksize + 256) {
+		log_msg(LOG_ERR, 0, "Compressed length too big for chunk: %d",
+		    pf->chunk_num);
+		return;
+	}
+
+	rb = pb->len_cmp + pf->trailer;
+	st_t = pc_stats_start(pf->stats);
+	pb->rbytes = prefetch_fill(pf, pb->buf, rb);
+	if (pf->cancel)
+		return;
+	if (pb->rbytes < rb) {
+		if (pb->rbytes < 0) {
+			log_msg(LOG_ERR, 1, "Read: ");
+		} else {
+			log_msg(LOG_ERR, 0, "Incomplete chunk %d, file corrupt.",
+			    pf->chunk_num);
+		}
+		return;
+	}
+	pc_stats_end(pf->stats, PC_STAGE_READ, st_t, pb->rbytes);
+	pf->chunk_num++;
+	pb->status = 0;
+}
+
+static void *
+prefetch_thread(void *dat)
+{
+	struct prefetch *pf = (struct prefetch *)dat;
+	struct pfbuf *pb;
+
+	for (;;) {
+		Sem_Wait(&pf->empty);
+		if (pf->cancel)
+			break;
+		pb = &pf->ent[pf->tail];
+		prefetch_read(pf, pb);
+		pf->tail = (pf->tail + 1) % PREFETCH_BUFS;
+		Sem_Post(&pf->filled);
+		if (pb->status != 0)
+			break;
+	}
+	return (NULL);
+}
+
+static void
+prefetch_stop(struct prefetch *pf)
+{
+	int i;
+
+	if (pf->running) {
+		pf->cancel = 1;
+		Sem_Post(&pf->empty);
+		pthread_join(pf->thr, NULL);
+	}
+	Sem_Destroy(&pf->filled);
+	Sem_Destroy(&pf->empty);
+	for (i = 0; i < PREFETCH_BUFS; i++) {
+		if (pf->ent[i].buf)
+			slab_release(NULL, pf->ent[i].buf);
+	}
+	free(pf);
+}
+
+/*
+ * Start reading compressed chunks from the current position of fd.
+ */
+static struct prefetch *
+prefetch_start(pc_ctx_t *pctx, int fd, uint64_t chunksize, uint64_t bufsize,
+    pc_stats_t *stats)
+{
+	struct prefetch *pf;
+	int i;
+
+	pf = (struct prefetch *)calloc(1, sizeof (struct prefetch));
+	if (pf == NULL)
+		return (NULL);
+	pf->fd = fd;
+	pf->chunksize = chunksize;
+	pf->bufsize = bufsize;
+	pf->trailer = pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+	pf->stats = stats;
+	Sem_Init(&pf->filled, 0, 0);
+	Sem_Init(&pf->empty, 0, PREFETCH_BUFS);
+	for (i = 0; i < PREFETCH_BUFS; i++) {
+		pf->ent[i].buf = (uchar_t *)slab_alloc(NULL, bufsize);
+		if (pf->ent[i].buf == NULL) {
+			prefetch_stop(pf);
+			return (NULL);
+		}
+	}
+	if (pthread_create(&pf->thr, NULL, prefetch_thread, (void *)pf) != 0) {
+		prefetch_stop(pf);
+		return (NULL);
+	}
+	pf->running = 1;
+	return (pf);
+}
+
+/*
+ * Hand the next prefetched chunk to a slot by exchanging compressed buffers.
+ * Returns the chunk status, see prefetch_read().
+ */
+static int
+prefetch_next(struct prefetch *pf, struct cmp_data *tdat)
+{
+	struct pfbuf *pb;
+	uchar_t *tmp;
+
+	Sem_Wait(&pf->filled);
+	pb = &pf->ent[pf->head];
+	if (pb->status != 0)
+		return (pb->status);
+	tdat->len_cmp = pb->len_cmp;
+	tdat->len_cmp_be = pb->len_cmp_be;
+	tdat->rbytes = pb->rbytes;
+	tmp = tdat->compressed_chunk;
+	tdat->compressed_chunk = pb->buf;
+	pb->buf = tmp;
+	pf->head = (pf->head + 1) % PREFETCH_BUFS;
+	Sem_Post(&pf->empty);
+	return (0);
+}
 
 void DLL_EXPORT
 usage(pc_ctx_t *pctx)
@@ -94,7 +2356,7 @@ usage(pc_ctx_t *pctx)
 "    ---------\n"
 "       %s -a [-v] [-l <compress level>] [-s <chunk size>] [-c <algorithm>]\n"
 "                    [<file1> <directory1> <file2> ...] [-t <number>] [-S <chunk checksum>]\n"
-"                    <archive filename or '-'>\n\n"
+"                    [-b <size>] <archive filename or '-'>\n\n"
 "       Archives a given set of files and/or directories into a compressed PAX archive which\n"
 "       is then compressed.\n\n"
 "       -a       Enables the archive mode.\n"
@@ -103,23 +2365,36 @@ usage(pc_ctx_t *pctx)
 "       -s <chunk size>\n"
 "                Specifies the maximum chunk size to split the data for parallelism. Values\n"
 "                can be in bytes or with suffix(k - KB, m - MB, g - GB). Default: 8m\n"
-"                Larger chunks can produce better compression at the cost of memory.\n\n"
+"                Larger chunks can produce better compression at the cost of memory.\n"
+"                'auto' adapts the chunk size at runtime to the measured compression\n"
+"                speed, using up to 4 times the default.\n\n"
 "       -c <algorithm>\n"
 "                The compression algorithm. Default algorithm when archiving is adapt2.\n"
 "       -v       Enables verbose mode.\n\n"
 "       -t <number>\n"
 "                Sets the number of compression threads. Default: core count.\n"
+"       -b <size>\n"
+"                Limit memory use to about <size> bytes (suffix k, m, g allowed). Thread count\n"
+"                and then chunk size are reduced until the estimated footprint fits.\n"
 "       -T       Disable separate metadata stream.\n"
+"       -N       Order members by a content sketch so similar files are stored together.\n"
+"       -W       Store repeated identical files as references to their first copy.\n"
+"       -y       Train zstd dictionaries per data type from small files and store them\n"
+"                in the archive. zstd only.\n"
+"       -U       Append the files to an existing archive created with -a and -I. Settings\n"
+"                are taken from the archive.\n"
 "       -S <chunk checksum>\n"
-"                The chunk verification checksum. Default: BLAKE256. Others are: CRC64, SHA256,\n"
-"                SHA512, KECCAK256, KECCAK512, BLAKE256, BLAKE512.\n"
+"                The chunk verification checksum. Default: BLAKE256. Others are: CRC64, CRC32C,\n"
+"                XXH3, XXH128, SHA256, SHA512, KECCAK256, KECCAK512, BLAKE256, BLAKE512.\n"
 "       <archive filename>\n"
 "                Pathname of the resulting archive. A '.pz' extension is automatically added\n"
-"                if not already present. This can be '-' to output to stdout.\n\n"
+"                if not already present. This can be '-' to output to stdout.\n\n",
+	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name);
+	fprintf(stderr,
 "    Single File Compression\n"
 "    -----------------------\n"
-"       %s -c <algorithm> [-l <compress level>] [-s <chunk size>] [-p] [<file>]\n"
-"                 [-t <number>] [-S <chunk checksum>] [<target file or '-'>]\n\n"
+"       %s -c <algorithm> [-l <compress level>] [-s <chunk size>] [-p] [-I] [-A] [<file> ...]\n"
+"                 [-t <number>] [-b <size>] [-S <chunk checksum>] [<target file or '-'>]\n\n"
 "       Takes a single file as input and produces a compressed file. Archiving is not performed.\n"
 "       This can also work in streaming mode.\n\n"
 "       -c <algorithm>\n"
@@ -127,38 +2402,91 @@ usage(pc_ctx_t *pctx)
 "       -l <compress level>\n"
 "       -s <chunk size>\n"
 "       -t <number>\n"
+"       -b <size>\n"
 "       -S <chunk checksum>\n"
 "                See above.\n"
 "                Note: In singe file compression mode with adapt2 or adapt algorithm, larger\n"
 "                      chunks may not necessarily produce better compression.\n"
-"       -p       Make Pcompress work in streaming mode. Input is stdin, output is stdout.\n\n"
+"       -p       Make Pcompress work in streaming mode. Input is stdin, output is stdout.\n"
+"       -I       Append a seekable chunk index to the compressed file for random access.\n"
+"       -o <window>\n"
+"                Link the chunks: compress each one after the last <window> bytes\n"
+"                before it for a ratio close to one large chunk. zstd only.\n"
+"       -r       Resume an interrupted compression from its checkpoint. See\n"
+"                PCOMPRESS_CHECKPOINT in README.md.\n"
+"       -g <offset>[,<length>]\n"
+"                Compress only this part of the file as one shard. Shards of a file\n"
+"                made with the same options concatenate in order to one archive.\n"
+"       -A       Batch mode. Compress every following file argument to its own <file>.pz\n"
+"                using one shared pool of worker threads.\n"
+"       -Z <socket>\n"
+"                Server mode. Run compression and decompression jobs sent to the Unix\n"
+"                socket <socket>, using the given compression options and one shared\n"
+"                pool of worker threads.\n"
+"       -R <rate>\n"
+"                Limit input reads to <rate> bytes per second. Suffixes k, m and g\n"
+"                are accepted as for the chunk size.\n"
+"       -Y <cpu share>\n"
+"                Background mode. Run the worker threads at idle CPU and I/O priority\n"
+"                and keep CPU use near <cpu share> percent of all processors by\n"
+"                varying the number of running workers. Use 100 for just the priority.\n"
+"       -O <MB/s>\n"
+"                Pick algorithm, level, chunk size and preprocessing for the best\n"
+"                compression that still decompresses at <MB/s> or faster. A sample of\n"
+"                the input file is used to calibrate. Not used with -c or -l.\n"
+"       -Q <algo>[:<level>][,<algo>[:<level>]...]\n"
+"                Dry run. Estimate compressed size, speed and time for each listed\n"
+"                algorithm from a sample of the input chunks. Dedupe options apply.\n"
+"                Nothing is written.\n"
+"       -H [<file>]\n"
+"                Benchmark all checksums, ciphers and codec fast paths on this processor\n"
+"                and recommend -S and -e. A sample of <file> is used for the codecs too.\n\n"
 "       <target file>\n"
-"                Pathname of the compressed file to be created or '-' for stdout.\n\n"
+"                Pathname of the compressed file to be created or '-' for stdout.\n"
+"                tcp://host:port or tls://host:port sends it over the network,\n"
+"                tcp://:port or tls://:port waits for the receiver to connect.\n"
+"                s3://bucket/key uploads it to object storage.\n\n",
+	    pctx->exec_name);
+	fprintf(stderr,
 "    Decompression, Listing and Archive extraction\n"
 "    ---------------------------------------------\n"
-"       %s <-d|-i>  [-m] [-K] <compressed file or '-'> [<target file or directory>]\n\n"
+"       %s <-d|-i|-V>  [-m] [-K] <compressed file or '-'> [<target file or directory>]\n\n"
 "       -d        Extract archive to target dir or current dir.\n"
-"       -i        Only list contents of the archive, do not extract.\n\n"
+"       -i        Only list contents of the archive, do not extract.\n"
+"       -V        Verify all chunks in parallel without writing any output. Failed\n"
+"                 chunks are listed at the end. Use -VV on encrypted files to only\n"
+"                 check the HMACs.\n\n"
 "       -m        Enable restoring *all* permissions, ACLs, Extended Attributes etc.\n"
 "                 Equivalent to the '-p' option in tar.\n"
 "       -K        Do not overwrite newer files.\n"
+"       -X <member>\n"
+"                 Extract only <member>, and everything below it for a directory. Can be\n"
+"                 repeated. Needs an archive created with -a and -I.\n"
+"       -J        Mount the archive read-only on the directory given as the target\n"
+"                 with FUSE instead of extracting. Needs an archive created with -a\n"
+"                 and -I. Runs until unmounted with 'fusermount -u'.\n"
 "       -m and -K are only meaningful if the compressed file is an archive. For single file\n"
 "       compressed mode these options are ignored.\n\n"
 "       <compressed file>\n"
 "                 Specifies the compressed file or archive. This can be '-' to indicate reading\n"
-"                 from stdin while write goes to <target file>\n\n"
+"                 from stdin while write goes to <target file>. A tcp:// or tls://\n"
+"                 address as for the compression target receives it from the network,\n"
+"                 an s3://bucket/key name reads it from object storage.\n\n"
 "       <target file or directory>\n"
 "                 If single file compression was used then this is the output file.\n"
 "                 Default output name if omitted: <input filename>.out\n\n"
 "                 If Archiving was done then this should be the name of a directory into which\n"
 "                 extracted files are restored. Default if omitted: Current directory.\n\n",
-	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name, pctx->exec_name, pctx->exec_name);
+	    pctx->exec_name);
 	fprintf(stderr,
 "    Encryption\n"
 "    ----------\n"
 "       -e <ALGO> Encrypt chunks with the given encrption algorithm. The ALGO parameter\n"
-"                 can be one of AES or SALSA20. Both are used in CTR stream encryption\n"
-"                 mode. The password can be prompted from the user or read from a file.\n"
+"                 can be one of AES, SALSA20, CHACHA20 or AES-GCM. AES is used in CTR\n"
+"                 mode and SALSA20 and CHACHA20 are stream ciphers, all with a separate\n"
+"                 HMAC. CHACHA20 is fastest on CPUs without AES-NI. AES-GCM encrypts and\n"
+"                 authenticates chunks in one pass. The password can be prompted from the\n"
+"                 user or read from a file.\n"
 "                 Unique keys are generated every time pcompress is run even when giving\n"
 "                 the same password. Default key length is 256-bits (see -k below).\n"
 "       -w <pathname>\n"
@@ -189,6 +2517,10 @@ show_compression_stats(pc_ctx_t *pctx)
 		log_msg(LOG_INFO, 0, "Avg compressed chunk   : %s(%.2f%%)\n",
 		    bytes_to_size(pctx->avg_chunk),
 		    (double)pctx->avg_chunk/(double)pctx->chunksize*100);
+		if (pctx->do_compress)
+			pc_filter_print(pctx->filters);
+		if (pctx->perf)
+			pc_perf_print(&pctx->perf_total);
 	}
 }
 
@@ -205,14 +2537,15 @@ show_compression_stats(pc_ctx_t *pctx)
 static int
 preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t srclen,
     void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props, int interesting)
+    algo_props_t *props, int interesting, pc_stats_t *stats)
 {
 	uchar_t *dest = (uchar_t *)dst, type = 0;
 	int result;
-	uint64_t _dstlen, fromlen;
+	uint64_t _dstlen, fromlen, st_t, f_t;
 	uchar_t *from, *to;
-	int stype, analyzed;
+	int stype, analyzed, slot;
 	analyzer_ctx_t actx;
+	pc_filter_ctx_t *fc;
 	DEBUG_STAT_EN(double strt, en);
 
 	_dstlen = *dstlen;
@@ -222,24 +2555,57 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	result = 0;
 	stype = PC_SUBTYPE(btype);
 	analyzed = 0;
+	fc = pctx->filters;
 
 	if (btype == TYPE_UNKNOWN || stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF ||
 	    PC_TYPE(btype) & TYPE_TEXT || interesting) {
+		st_t = pc_stats_start(stats);
 		analyze_buffer(src, srclen, &actx);
+		pc_stats_end(stats, PC_STAGE_ANALYZE, st_t, srclen);
 		analyzed = 1;
 		if (pctx->adapt_mode)
 			adapt_set_analyzer_ctx(data, &actx);
 	}
 
+	/*
+	 * Filter costs are accounted per data type. The analyzer's view is
+	 * used if the chunk does not have a known subtype.
+	 */
+	if (stype == TYPE_UNKNOWN && analyzed)
+		slot = pc_filter_slot(actx.ten_pct.btype);
+	else
+		slot = pc_filter_slot(btype);
+
 	/*
 	 * Dispack is used for 32-bit EXE files via a libarchive filter routine.
 	 * For 64-bit exes or AR archives we apply an E8E9 CALL/JMP transform filter.
+	 * ARM64 and RISC-V code is detected by content, ELF headers are not seen
+	 * in most chunks, and gets the BCJ filter instead.
 	 */
+	st_t = pc_stats_start(stats);
 	if (pctx->exe_preprocess) {
 		int processed = 0;
 
-		if (stype == TYPE_EXE32 ||  stype == TYPE_EXE32_PE ||
-		    stype == TYPE_EXE64 || stype == TYPE_ARCHIVE_AR) {
+		if (pc_filter_use(fc, PC_FILTER_BCJ, slot)) {
+			f_t = pc_filter_start(fc);
+			_dstlen = fromlen + BCJ_HDR;
+			result = bcj_encode((uchar_t *)from, fromlen, to, &_dstlen);
+			pc_filter_end(fc, PC_FILTER_BCJ, slot, f_t, fromlen, _dstlen,
+			    result != -1);
+			if (result != -1) {
+				uchar_t *tmp;
+				tmp = from;
+				from = to;
+				to = tmp;
+				fromlen = _dstlen;
+				type |= PREPROC_TYPE_BCJ;
+				processed = 1;
+			}
+		}
+
+		if (!processed && (stype == TYPE_EXE32 ||  stype == TYPE_EXE32_PE ||
+		    stype == TYPE_EXE64 || stype == TYPE_ARCHIVE_AR) &&
+		    pc_filter_use(fc, PC_FILTER_DISPACK, slot)) {
 			/*
 			 * If file-level Dispack did not happen for 32-bit EXEs it was
 			 * most likely that the file was large. So, as a workaround,
@@ -247,8 +2613,11 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 			 * get any worthwhile reduction we do E8E9 as the final
 			 * fallback.
 			 */
+			f_t = pc_filter_start(fc);
 			_dstlen = fromlen;
 			result = dispack_encode((uchar_t *)from, fromlen, to, &_dstlen);
+			pc_filter_end(fc, PC_FILTER_DISPACK, slot, f_t, fromlen, _dstlen,
+			    result != -1);
 			if (result != -1) {
 				uchar_t *tmp;
 				tmp = from;
@@ -260,10 +2629,15 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 			}
 		}
 
-		if (!processed) {
+		if (!processed && pc_filter_use(fc, PC_FILTER_E8E9, slot)) {
+			f_t = pc_filter_start(fc);
 			_dstlen = fromlen;
 			memcpy(to, from, fromlen);
-			if (Forward_E89(to, fromlen) == 0) {
+			pc_stats_copy(stats, fromlen);
+			result = Forward_E89(to, fromlen);
+			pc_filter_end(fc, PC_FILTER_E8E9, slot, f_t, fromlen, _dstlen,
+			    result == 0);
+			if (result == 0) {
 				uchar_t *tmp;
 				tmp = from;
 				from = to;
@@ -278,7 +2652,7 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	 * Enabling LZP also enables the DICT filter since we are dealing with text
 	 * in any case.
 	 */
-	if (pctx->lzp_preprocess) {
+	if (pctx->lzp_preprocess && pc_filter_use(fc, PC_FILTER_DICT, slot)) {
 		int b_type;
 
 		b_type = btype;
@@ -289,8 +2663,11 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 		}
 
 		if (PC_TYPE(b_type) & TYPE_TEXT) {
+			f_t = pc_filter_start(fc);
 			_dstlen = fromlen;
 			result = dict_encode(from, fromlen, to, &_dstlen, (stype == TYPE_DNA_SEQ));
+			pc_filter_end(fc, PC_FILTER_DICT, slot, f_t, fromlen, _dstlen,
+			    result != -1);
 			if (result != -1) {
 				uchar_t *tmp;
 				tmp = from;
@@ -303,7 +2680,8 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	}
 
 #ifndef _MPLV2_LICENSE_
-	if (pctx->lzp_preprocess && stype != TYPE_BMP && stype != TYPE_TIFF) {
+	if (pctx->lzp_preprocess && stype != TYPE_BMP && stype != TYPE_TIFF &&
+	    pc_filter_use(fc, PC_FILTER_LZP, slot)) {
 		int hashsize, b_type;
 		int64_t result;
 
@@ -312,9 +2690,13 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 			b_type = actx.thirty_pct.btype;
 
 		if (!(PC_TYPE(b_type) & TYPE_BINARY)) {
+			f_t = pc_filter_start(fc);
 			hashsize = lzp_hash_size(level);
 			result = lzp_compress((const uchar_t *)from, to, fromlen,
-					      hashsize, LZP_DEFAULT_LZPMINLEN, 0);
+			    hashsize, LZP_DEFAULT_LZPMINLEN,
+			    get_chunk_threads() > 1 ? LZP_FEATURE_MULTITHREADING : 0);
+			pc_filter_end(fc, PC_FILTER_LZP, slot, f_t, fromlen, result,
+			    result >= 0 && result < srclen);
 			if (result >= 0 && result < srclen) {
 				uchar_t *tmp;
 				tmp = from;
@@ -336,11 +2718,36 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 		if (analyzed)
 			b_type = actx.ten_pct.btype;
 
-		if (!(PC_TYPE(b_type) & TYPE_TEXT)) {
+		/*
+		 * Float arrays get the byte plane XOR filter, Delta2 does not
+		 * find series in them.
+		 */
+		if (!(PC_TYPE(b_type) & TYPE_TEXT) &&
+		    pc_filter_use(fc, PC_FILTER_FPDELTA, slot)) {
+			f_t = pc_filter_start(fc);
+			_dstlen = fromlen + FPDELTA_HDR;
+			result = fpdelta_encode((uchar_t *)from, fromlen, to, &_dstlen);
+			pc_filter_end(fc, PC_FILTER_FPDELTA, slot, f_t, fromlen, _dstlen,
+			    result != -1);
+			if (result != -1) {
+				uchar_t *tmp;
+				tmp = from;
+				from = to;
+				to = tmp;
+				fromlen = _dstlen;
+				type |= PREPROC_TYPE_FPDELTA;
+			}
+		}
+
+		if (!(PC_TYPE(b_type) & TYPE_TEXT) && !(type & PREPROC_TYPE_FPDELTA) &&
+		    pc_filter_use(fc, PC_FILTER_DELTA2, slot)) {
+			f_t = pc_filter_start(fc);
 			_dstlen = fromlen;
 			result = delta2_encode((uchar_t *)from, fromlen, to,
 					       &_dstlen, props->delta2_span,
 					       pctx->delta2_nstrides);
+			pc_filter_end(fc, PC_FILTER_DELTA2, slot, f_t, fromlen, _dstlen,
+			    result != -1);
 			if (result != -1) {
 				uchar_t *tmp;
 				tmp = from;
@@ -360,15 +2767,19 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	 */
 	if (from == dst) {
 		memcpy(src, dst, fromlen);
+		pc_stats_copy(stats, fromlen);
 	}
+	pc_stats_end(stats, PC_STAGE_PREPROC, st_t, srclen);
 	srclen = fromlen;
 
 	*dest = type;
 	U64_P(dest + 1) = htonll(srclen);
 	_dstlen = srclen;
 	DEBUG_STAT_EN(strt = get_wtime_millis());
+	st_t = pc_stats_start(stats);
 	result = cmp_func(src, srclen, dest+9, &_dstlen, level, chdr,
 	    btype, data);
+	pc_stats_end(stats, PC_STAGE_CODEC, st_t, srclen);
 	DEBUG_STAT_EN(en = get_wtime_millis());
 
 	if (result > -1 && _dstlen < srclen) {
@@ -387,6 +2798,7 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 		 */
 		if (type > 0) {
 			memcpy(dest+1, src, srclen);
+			pc_stats_copy(stats, srclen);
 			*dstlen = srclen + 1;
 			result = 0;
 		} else {
@@ -403,57 +2815,80 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 static int
 preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64_t srclen,
     void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props)
+    algo_props_t *props, pc_stats_t *stats)
 {
-	uchar_t *sorc = (uchar_t *)src, type;
+	uchar_t *sorc = (uchar_t *)src, *from, *to, *tmp, type;
 	int result;
-	uint64_t _dstlen = *dstlen, _dstlen1 = *dstlen;
+	uint64_t _dstlen, _dstlen1 = *dstlen;
+	uint64_t st_t;
 	DEBUG_STAT_EN(double strt, en);
 
 	type = *sorc;
 	++sorc;
 	--srclen;
+
+	/*
+	 * As in preproc_compress() every decoding stage goes from one of the
+	 * two buffers to the other and the pointers are swapped after it. The
+	 * result is copied only if it ends up in src.
+	 */
 	if (type & PREPROC_COMPRESSED) {
 		*dstlen = ntohll(U64_P(sorc));
 		sorc += 8;
 		srclen -= 8;
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		st_t = pc_stats_start(stats);
 		result = dec_func(sorc, srclen, dst, dstlen, level, chdr, btype, data);
+		pc_stats_end(stats, PC_STAGE_CODEC, st_t, *dstlen);
 		DEBUG_STAT_EN(en = get_wtime_millis());
 
 		if (result < 0) return (result);
 		DEBUG_STAT_EN(fprintf(stderr, "Chunk decompression speed %.3f MB/s\n",
 		    get_mb_s(srclen, strt, en)));
-		memcpy(src, dst, *dstlen);
+		from = (uchar_t *)dst;
+		to = (uchar_t *)src;
 		srclen = *dstlen;
 	} else {
-		src = sorc;
+		from = sorc;
+		to = (uchar_t *)dst;
 	}
 
+	st_t = pc_stats_start(stats);
 	if (type & PREPROC_TYPE_DELTA2) {
-		result = delta2_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen);
+		_dstlen = _dstlen1;
+		result = delta2_decode(from, srclen, to, &_dstlen);
 		if (result != -1) {
-			memcpy(src, dst, _dstlen);
+			tmp = from; from = to; to = tmp;
 			srclen = _dstlen;
-			*dstlen = _dstlen;
-			_dstlen = _dstlen1;
 		} else {
 			log_msg(LOG_ERR, 0, "Delta2 decoding failed.");
 			return (result);
 		}
 	}
 
+	if (type & PREPROC_TYPE_FPDELTA) {
+		_dstlen = _dstlen1;
+		result = fpdelta_decode(from, srclen, to, &_dstlen);
+		if (result != -1) {
+			tmp = from; from = to; to = tmp;
+			srclen = _dstlen;
+		} else {
+			log_msg(LOG_ERR, 0, "FPDELTA decoding failed.");
+			return (result);
+		}
+	}
+
 	if (type & PREPROC_TYPE_LZP) {
 #ifndef _MPLV2_LICENSE_
 		int hashsize;
 		int64_t result;
-		hashsize = lzp_hash_size(level);
-		result = lzp_decompress((const uchar_t *)src, (uchar_t *)dst, srclen,
-					hashsize, LZP_DEFAULT_LZPMINLEN, 0);
+		hashsize = lzp_level_hash_size(level);
+		result = lzp_decompress((const uchar_t *)from, to, srclen,
+		    hashsize, LZP_DEFAULT_LZPMINLEN,
+		    get_chunk_threads() > 1 ? LZP_FEATURE_MULTITHREADING : 0);
 		if (result > 0) {
-			memcpy(src, dst, result);
+			tmp = from; from = to; to = tmp;
 			srclen = result;
-			*dstlen = result;
 		} else {
 			log_msg(LOG_ERR, 0, "LZP decompression failed.");
 			return ((int)result);
@@ -466,12 +2901,11 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	}
 
 	if (type & PREPROC_TYPE_DICT) {
-		result = dict_decode(src, srclen, dst, &_dstlen);
+		_dstlen = _dstlen1;
+		result = dict_decode(from, srclen, to, &_dstlen);
 		if (result != -1) {
-			memcpy(src, dst, _dstlen);
+			tmp = from; from = to; to = tmp;
 			srclen = _dstlen;
-			*dstlen = _dstlen;
-			_dstlen = _dstlen1;
 		} else {
 			log_msg(LOG_ERR, 0, "DICT decoding failed.");
 			return (result);
@@ -479,20 +2913,30 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	}
 
 	if (type & PREPROC_TYPE_E8E9) {
-		_dstlen1 = srclen;
-		memcpy(dst, src, srclen);
-		result = Inverse_E89(dst, srclen);
+		/* Size preserving, so done in place. */
+		result = Inverse_E89(from, srclen);
+		if (result == -1) {
+			log_msg(LOG_ERR, 0, "E8E9 decoding failed.");
+			return (result);
+		}
+
+	} else if (type & PREPROC_TYPE_BCJ) {
+		_dstlen = _dstlen1;
+		result = bcj_decode(from, srclen, to, &_dstlen);
 		if (result != -1) {
-			*dstlen = _dstlen1;
+			tmp = from; from = to; to = tmp;
+			srclen = _dstlen;
 		} else {
-			log_msg(LOG_ERR, 0, "E8E9 decoding failed.");
+			log_msg(LOG_ERR, 0, "BCJ decoding failed.");
 			return (result);
 		}
 
 	} else if (type & PREPROC_TYPE_DISPACK) { // Backward compatibility
-		result = dispack_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen1);
+		_dstlen = _dstlen1;
+		result = dispack_decode(from, srclen, to, &_dstlen);
 		if (result != -1) {
-			*dstlen = _dstlen1;
+			tmp = from; from = to; to = tmp;
+			srclen = _dstlen;
 		} else {
 			log_msg(LOG_ERR, 0, "Dispack decoding failed.");
 			return (result);
@@ -500,44 +2944,143 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	}
 
 	if (!(type & (PREPROC_COMPRESSED|PREPROC_TYPE_DELTA2|PREPROC_TYPE_LZP|
-		      PREPROC_TYPE_DISPACK|PREPROC_TYPE_DICT|PREPROC_TYPE_E8E9))
+		      PREPROC_TYPE_DISPACK|PREPROC_TYPE_DICT|PREPROC_TYPE_E8E9|
+		      PREPROC_TYPE_FPDELTA|PREPROC_TYPE_BCJ))
 	    && type > 0) {
 		log_msg(LOG_ERR, 0, "Invalid preprocessing flags: %d", type);
 		return (-1);
 	}
+	if (from != dst) {
+		memcpy(dst, from, srclen);
+		pc_stats_copy(stats, srclen);
+	}
+	*dstlen = srclen;
+	pc_stats_end(stats, PC_STAGE_PREPROC, st_t, *dstlen);
 	return (0);
 }
 
+/*
+ * Record a chunk that failed verification. Verify mode keeps going so that
+ * all damaged chunks are reported in one pass.
+ */
+static void
+verify_chunk_failed(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	uint32_t *nf;
+
+	pthread_mutex_lock(&pctx->verify_mutex);
+	if (pctx->verify_nfailed == pctx->verify_cap) {
+		nf = (uint32_t *)realloc(pctx->verify_failed,
+		    (pctx->verify_cap + 64) * sizeof (uint32_t));
+		if (nf != NULL) {
+			pctx->verify_failed = nf;
+			pctx->verify_cap += 64;
+		}
+	}
+	if (pctx->verify_nfailed < pctx->verify_cap)
+		pctx->verify_failed[pctx->verify_nfailed] = tdat->id;
+	pctx->verify_nfailed++;
+	pthread_mutex_unlock(&pctx->verify_mutex);
+	tdat->len_cmp = 0;
+}
+
+static int
+cmp_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : (x > y));
+}
+
+/*
+ * Summary printed at the end of a verify run.
+ */
+static void
+verify_report(pc_ctx_t *pctx)
+{
+	uint32_t i, n;
+
+	n = pctx->verify_nfailed;
+	if (n > pctx->verify_cap)
+		n = pctx->verify_cap;
+	if (n > 0) {
+		qsort(pctx->verify_failed, n, sizeof (uint32_t), cmp_uint32);
+		fprintf(stderr, "Failed chunks:");
+		for (i = 0; i < n; i++)
+			fprintf(stderr, " %u", pctx->verify_failed[i]);
+		fprintf(stderr, "\n");
+	}
+	log_msg(LOG_INFO, 0, "Verified %u chunks%s, %u failed.", pctx->chunk_num,
+	    pctx->verify_mode == VERIFY_HMAC ? " (HMAC only)" : "", pctx->verify_nfailed);
+}
+
 /*
  * This routine is called in multiple threads. Calls the decompression handler
  * as encoded in the file header. For adaptive mode the handler adapt_decompress()
  * in turns looks at the chunk header and calls the actual decompression
  * routine.
  */
+/*
+ * Pick the buffer a chunk is decompressed into. With a mapped output a plain
+ * chunk goes straight to its place in the file, if it is stored or the codec
+ * never writes past the decompressed size. Otherwise the slot's own buffer is
+ * used, allocated when first needed.
+ */
+static uchar_t *
+decompress_target(pc_ctx_t *pctx, struct cmp_data *tdat, uchar_t HDR, uint64_t len)
+{
+	if (pctx->out_map != NULL &&
+	    !(HDR & (CHUNK_FLAG_DEDUP | CHUNK_FLAG_PREPROC | CHUNK_FLAG_RUNS)) &&
+	    (!(HDR & COMPRESSED) || tdat->props->decomp_direct) &&
+	    len == tdat->uncomp_len && tdat->file_offset <= pctx->out_map_len &&
+	    len <= pctx->out_map_len - tdat->file_offset)
+		return (pctx->out_map + tdat->file_offset);
+
+	if (tdat->uncompressed_chunk == NULL) {
+		tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL, pctx->out_bufsz);
+		tdat->cmp_seg = tdat->uncompressed_chunk;
+	}
+	return (tdat->uncompressed_chunk);
+}
+
 static void *
 perform_decompress(void *dat)
 {
-	struct cmp_data *tdat = (struct cmp_data *)dat;
+	struct cmp_thread *wt = (struct cmp_thread *)dat;
+	struct cmp_data *tdat;
 	uint64_t _chunksize;
 	uint64_t dedupe_index_sz, dedupe_data_sz, dedupe_index_sz_cmp, dedupe_data_sz_cmp;
-	int rv = 0;
+	int rv = 0, cksum_done, direct;
 	unsigned int blknum;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	uchar_t HDR;
-	uchar_t *cseg;
+	uchar_t *cseg, *ubuf;
+	uint64_t st_t;
+	double work_st;
 	pc_ctx_t *pctx;
+	char tname[32];
 
-	pctx = tdat->pctx;
+	pctx = wt->pctx;
+	pc_numa_bind(wt->numa_node);
+	set_chunk_threads(pctx->chunk_threads_max);
+	snprintf(tname, sizeof (tname), "worker-%d", wt->id);
+	pc_trace_thread(tname);
 redo:
-	Sem_Wait(&tdat->start_sem);
-	if (pctx->main_cancel)
+	tdat = chunk_queue_get(wt->queue);
+	if (tdat == NULL)
 		return (NULL);
+	slab_tmp_reset();
+	cksum_done = 0;
 
-	if (unlikely(tdat->cancel)) {
+	if (pctx->main_cancel) {
 		tdat->len_cmp = 0;
-		Sem_Post(&tdat->cmp_done_sem);
-		return (0);
+		Hsem_Post(&tdat->cmp_done_sem);
+		return (NULL);
 	}
+	chunk_attach_worker(wt, tdat);
+	work_st = 0;
+	if (pctx->slot_auto)
+		work_st = get_wtime_millis();
 
 	/*
 	 * If the last read returned a 0 quit.
@@ -566,51 +3109,116 @@ redo:
 	 */
 	if (pctx->encrypt_type) {
 		unsigned int len;
+		int aead, authok;
 		DEBUG_STAT_EN(double strt, en);
 
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		st_t = pc_stats_start(tdat->stats);
+		aead = crypto_is_aead(&(pctx->crypto_ctx));
 		len = pctx->mac_bytes;
-		deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
-		    pctx->mac_bytes);
+		if (aead) {
+			memcpy(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
+			    AEAD_TAG_LEN);
+		} else {
+			deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
+			    pctx->mac_bytes);
+		}
 		memset(tdat->compressed_chunk + pctx->cksum_bytes, 0, pctx->mac_bytes);
-		hmac_reinit(&tdat->chunk_hmac);
-		hmac_update(&tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
-		hmac_update(&tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
-		if (HDR & CHSIZE_MASK) {
-			uchar_t *rseg;
-			rseg = tdat->compressed_chunk + tdat->rbytes;
-			hmac_update(&tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
+		if (aead) {
+			uchar_t aad[COMPRESSED_CHUNKSZ + CKSUM_MAX_BYTES * 2 + CHUNK_FLAG_SZ +
+			    ORIGINAL_CHUNKSZ];
+			int aadlen;
+
+			/*
+			 * Verify the tag and decrypt in one pass. The header and the
+			 * trailing size are authenticated the same way as the HMAC.
+			 */
+			aadlen = cseg - tdat->compressed_chunk;
+			memcpy(aad, &tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
+			memcpy(aad + sizeof (tdat->len_cmp_be), tdat->compressed_chunk, aadlen);
+			aadlen += sizeof (tdat->len_cmp_be);
+			if (HDR & CHSIZE_MASK) {
+				memcpy(aad + aadlen, tdat->compressed_chunk + tdat->rbytes,
+				    ORIGINAL_CHUNKSZ);
+				aadlen += ORIGINAL_CHUNKSZ;
+			}
+			authok = (crypto_aead_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp,
+			    tdat->id, aad, aadlen, checksum) == 0);
+			pc_stats_end(tdat->stats, PC_STAGE_CRYPTO, st_t, tdat->len_cmp);
+		} else {
+			hmac_reinit(tdat->chunk_hmac);
+			hmac_update(tdat->chunk_hmac, (uchar_t *)&tdat->len_cmp_be,
+			    sizeof (tdat->len_cmp_be));
+			if (pctx->mac_tree) {
+				uint64_t hsz, tsz;
+
+				/*
+				 * The chunk header goes into the MAC directly, the rest
+				 * including the trailing original size is tree hashed.
+				 */
+				hsz = pctx->cksum_bytes + pctx->mac_bytes + CHUNK_FLAG_SZ;
+				tsz = tdat->rbytes - hsz;
+				if (HDR & CHSIZE_MASK)
+					tsz += ORIGINAL_CHUNKSZ;
+				hmac_update(tdat->chunk_hmac, tdat->compressed_chunk, hsz);
+				hmac_tree_update(tdat->chunk_hmac, tdat->compressed_chunk + hsz,
+				    tsz, tdat->cksum_mt);
+			} else {
+				hmac_update(tdat->chunk_hmac, tdat->compressed_chunk, tdat->rbytes);
+				if (HDR & CHSIZE_MASK) {
+					uchar_t *rseg;
+					rseg = tdat->compressed_chunk + tdat->rbytes;
+					hmac_update(tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
+				}
+			}
+			hmac_final(tdat->chunk_hmac, tdat->checksum, &len);
+			pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, tdat->rbytes);
+			authok = (memcmp(checksum, tdat->checksum, len) == 0);
 		}
-		hmac_final(&tdat->chunk_hmac, tdat->checksum, &len);
-		if (memcmp(checksum, tdat->checksum, len) != 0) {
+		if (!authok) {
 			/*
 			 * HMAC verification failure is fatal.
 			 */
 			log_msg(LOG_ERR, 0, "Chunk %d, HMAC verification failed", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+				goto cont;
+			}
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
+			Hsem_Post(&tdat->cmp_done_sem);
 			return (NULL);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Verification speed %.3f MB/s",
 			      get_mb_s(tdat->rbytes + sizeof (tdat->len_cmp_be), strt, en)));
+		if (pctx->verify_mode == VERIFY_HMAC)
+			goto cont;
 
 		/*
 		 * Encryption algorithm should not change the size and
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
-		rv = crypto_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp, tdat->id);
+		rv = 0;
+		if (!aead) {
+			st_t = pc_stats_start(tdat->stats);
+			rv = crypto_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp, tdat->id);
+			pc_stats_end(tdat->stats, PC_STAGE_CRYPTO, st_t, tdat->len_cmp);
+		}
 		if (rv == -1) {
 			/*
 			 * Decryption failure is fatal.
 			 */
 			log_msg(LOG_ERR, 0, "Chunk %d, Decryption failed", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+				goto cont;
+			}
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->cmp_done_sem);
+			Hsem_Post(&tdat->cmp_done_sem);
 			return (NULL);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
@@ -638,10 +3246,14 @@ redo:
 			 * Header CRC32 verification failure is fatal.
 			 */
 			log_msg(LOG_ERR, 0, "Chunk %d, Header CRC verification failed", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+				goto cont;
+			}
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
+			Hsem_Post(&tdat->cmp_done_sem);
 			return (NULL);
 		}
 
@@ -652,9 +3264,27 @@ redo:
 		deserialize_checksum(tdat->checksum, tdat->compressed_chunk, pctx->cksum_bytes);
 	}
 
+	if (pctx->link_win) {
+		if (chunk_link_wait(pctx, tdat) == -1) {
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			goto cont;
+		}
+		pctx->_prefix_func(tdat->data, pctx->link_buf, pctx->link_len);
+	}
+	ubuf = decompress_target(pctx, tdat, HDR, _chunksize);
+	if (ubuf == NULL) {
+		log_msg(LOG_ERR, 0, "ERROR: Chunk %d, out of memory.", tdat->id);
+		tdat->len_cmp = 0;
+		pctx->t_errored = 1;
+		pctx->main_cancel = 1;
+		goto cont;
+	}
+	direct = (ubuf != tdat->uncompressed_chunk);
+
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) &&
 	    (HDR & CHUNK_FLAG_DEDUP)) {
-		uchar_t *cmpbuf, *ubuf;
+		uchar_t *cmpbuf;
 
 		/* Extract various sizes from dedupe header. */
 		parse_dedupe_hdr(cseg, &blknum, &dedupe_index_sz, &dedupe_data_sz,
@@ -673,70 +3303,104 @@ redo:
 			if (HDR & CHUNK_FLAG_PREPROC) {
 				rv = preproc_decompress(pctx, tdat->decompress, cmpbuf,
 				    dedupe_data_sz_cmp,	ubuf, &_chunksize, tdat->level,
-				    HDR, pctx->btype, tdat->data, tdat->props);
+				    HDR, pctx->btype, tdat->data, tdat->props, tdat->stats);
 			} else {
 				DEBUG_STAT_EN(double strt, en);
 
 				DEBUG_STAT_EN(strt = get_wtime_millis());
+				st_t = pc_stats_start(tdat->stats);
 				rv = tdat->decompress(cmpbuf, dedupe_data_sz_cmp, ubuf, &_chunksize,
 				    tdat->level, HDR, pctx->btype, tdat->data);
+				pc_stats_end(tdat->stats, PC_STAGE_CODEC, st_t, _chunksize);
 				DEBUG_STAT_EN(en = get_wtime_millis());
 				DEBUG_STAT_EN(fprintf(stderr, "Chunk %d decompression speed %.3f MB/s\n",
 						      tdat->id, get_mb_s(_chunksize, strt, en)));
 			}
 			if (rv == -1) {
-				tdat->len_cmp = 0;
 				log_msg(LOG_ERR, 0, "ERROR: Chunk %d, decompression failed.", tdat->id);
+				if (pctx->verify_mode) {
+					verify_chunk_failed(pctx, tdat);
+					goto cont;
+				}
+				tdat->len_cmp = 0;
 				pctx->t_errored = 1;
 				goto cont;
 			}
 		} else {
 			memcpy(ubuf, cmpbuf, _chunksize);
+			pc_stats_copy(tdat->stats, _chunksize);
 		}
 
 		rv = 0;
 		cmpbuf = cseg + RABIN_HDR_SIZE;
 		ubuf = tdat->uncompressed_chunk + RABIN_HDR_SIZE;
 
-		if (dedupe_index_sz >= 90 && dedupe_index_sz > dedupe_index_sz_cmp) {
-			/* Index should be at least 90 bytes to have been compressed. */
-			rv = lzma_decompress(cmpbuf, dedupe_index_sz_cmp, ubuf,
-			    &dedupe_index_sz, tdat->rctx->level, 0, TYPE_BINARY, tdat->rctx->lzma_data);
+		if (dedupe_hdr_index_coded(cseg)) {
+			/* Index stored with the index coder, not transposed. */
+			st_t = pc_stats_start(tdat->stats);
+			rv = dedupe_index_decode(cmpbuf, dedupe_index_sz_cmp, ubuf,
+			    dedupe_index_sz);
+			pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, 0);
 		} else {
+			if (dedupe_index_sz >= 90 && dedupe_index_sz > dedupe_index_sz_cmp) {
+				/* Index should be at least 90 bytes to have been compressed. */
+				st_t = pc_stats_start(tdat->stats);
+				rv = lzma_decompress(cmpbuf, dedupe_index_sz_cmp, ubuf,
+				    &dedupe_index_sz, tdat->rctx->level, 0, TYPE_BINARY,
+				    tdat->rctx->lzma_data);
+				pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, 0);
+			} else {
+				memcpy(ubuf, cmpbuf, dedupe_index_sz);
+			}
+
+			/*
+			 * Recover from transposed index.
+			 */
+			transpose(ubuf, cmpbuf, dedupe_index_sz, sizeof (uint32_t), COL);
 			memcpy(ubuf, cmpbuf, dedupe_index_sz);
 		}
 
-		/*
-		 * Recover from transposed index.
-		 */
-		transpose(ubuf, cmpbuf, dedupe_index_sz, sizeof (uint32_t), COL);
-		memcpy(ubuf, cmpbuf, dedupe_index_sz);
-
 	} else {
 		if (HDR & COMPRESSED) {
 			if (HDR & CHUNK_FLAG_PREPROC) {
 				rv = preproc_decompress(pctx, tdat->decompress, cseg, tdat->len_cmp,
-				    tdat->uncompressed_chunk, &_chunksize, tdat->level, HDR, pctx->btype,
-				    tdat->data, tdat->props);
+				    ubuf, &_chunksize, tdat->level, HDR, pctx->btype,
+				    tdat->data, tdat->props, tdat->stats);
 			} else {
 				DEBUG_STAT_EN(double strt, en);
 
 				DEBUG_STAT_EN(strt = get_wtime_millis());
-				rv = tdat->decompress(cseg, tdat->len_cmp, tdat->uncompressed_chunk,
+				st_t = pc_stats_start(tdat->stats);
+				rv = tdat->decompress(cseg, tdat->len_cmp, ubuf,
 				    &_chunksize, tdat->level, HDR, pctx->btype, tdat->data);
+				pc_stats_end(tdat->stats, PC_STAGE_CODEC, st_t, _chunksize);
 				DEBUG_STAT_EN(en = get_wtime_millis());
 				DEBUG_STAT_EN(fprintf(stderr, "Chunk decompression speed %.3f MB/s\n",
 						get_mb_s(_chunksize, strt, en)));
 			}
+		} else if (!pctx->encrypt_type && !(HDR & CHUNK_FLAG_RUNS)) {
+			/*
+			 * Stored chunk. Verify the checksum while copying it out.
+			 */
+			st_t = pc_stats_start(tdat->stats);
+			compute_checksum_copy(checksum, pctx->cksum, ubuf,
+			    cseg, _chunksize, tdat->cksum_mt, 1);
+			pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, _chunksize);
+			cksum_done = 1;
 		} else {
-			memcpy(tdat->uncompressed_chunk, cseg, _chunksize);
+			memcpy(ubuf, cseg, _chunksize);
+			pc_stats_copy(tdat->stats, _chunksize);
 		}
 	}
 	tdat->len_cmp = _chunksize;
 
 	if (rv == -1) {
-		tdat->len_cmp = 0;
 		log_msg(LOG_ERR, 0, "ERROR: Chunk %d, decompression failed.", tdat->id);
+		if (pctx->verify_mode) {
+			verify_chunk_failed(pctx, tdat);
+			goto cont;
+		}
+		tdat->len_cmp = 0;
 		pctx->t_errored = 1;
 		goto cont;
 	}
@@ -745,12 +3409,18 @@ redo:
 		dedupe_context_t *rctx;
 		uchar_t *tmp;
 
+		st_t = pc_stats_start(tdat->stats);
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->compressed_chunk;
 		dedupe_decompress(rctx, tdat->uncompressed_chunk, &(tdat->len_cmp));
+		pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, tdat->len_cmp);
 		if (!rctx->valid) {
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, dedup recovery failed.", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+				goto cont;
+			}
 			rv = -1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
@@ -761,16 +3431,51 @@ redo:
 		tdat->uncompressed_chunk = tdat->compressed_chunk;
 		tdat->compressed_chunk = tmp;
 		tdat->cmp_seg = tdat->uncompressed_chunk;
-	} else {
+	}
+
+	/* Put back constant byte runs cut out during compression. */
+	if (HDR & CHUNK_FLAG_RUNS) {
+		uint64_t olen;
+
+		if (pc_runs_restore(tdat->uncompressed_chunk, tdat->len_cmp,
+		    tdat->chunksize, &olen) == -1) {
+			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, corrupt run records.", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+				goto cont;
+			}
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			goto cont;
+		}
+		tdat->len_cmp = olen;
+		_chunksize = olen;
+	}
+
+	if (!pctx->encrypt_type && !cksum_done && pctx->verify_deferred) {
 		/*
-		 * This chunk was not deduplicated, however we still need to down the
-		 * semaphore in order to maintain proper thread coordination. We do this after
-		 * decompression to achieve better concurrency. Decompression does not need
-		 * to wait for the previous thread's dedupe recovery to complete.
+		 * Let the writer have the chunk now and verify it meanwhile. The
+		 * writer only holds back releasing the slot, and on a mismatch
+		 * it stops with an error.
 		 */
-		if (pctx->enable_rabin_global) {
-			Sem_Wait(tdat->rctx->index_sem);
+		tdat->verify_pending = 1;
+		if (pctx->link_win)
+			chunk_link_pass(pctx, tdat);
+		Hsem_Post(&tdat->cmp_done_sem);
+		st_t = pc_stats_start(tdat->stats);
+		compute_checksum(checksum, pctx->cksum, tdat->uncompressed_chunk,
+		    _chunksize, tdat->cksum_mt, 1);
+		pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, _chunksize);
+		tdat->verify_ok = (memcmp(checksum, tdat->checksum, pctx->cksum_bytes) == 0);
+		if (!tdat->verify_ok) {
+			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, checksums do not match.", tdat->id);
+			pctx->t_errored = 1;
+			pctx->main_cancel = 1;
 		}
+		Hsem_Post(&tdat->verify_sem);
+		if (!pctx->t_errored)
+			goto redo;
+		return (NULL);
 	}
 
 	if (!pctx->encrypt_type) {
@@ -779,23 +3484,151 @@ redo:
 		 * If it does not match we set length of chunk to 0 to indicate
 		 * exit to the writer thread.
 		 */
-		compute_checksum(checksum, pctx->cksum, tdat->uncompressed_chunk,
-		    _chunksize, tdat->cksum_mt, 1);
+		if (!cksum_done) {
+			st_t = pc_stats_start(tdat->stats);
+			compute_checksum(checksum, pctx->cksum,
+			    direct ? ubuf : tdat->uncompressed_chunk, _chunksize, tdat->cksum_mt, 1);
+			pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, _chunksize);
+		}
 		if (memcmp(checksum, tdat->checksum, pctx->cksum_bytes) != 0) {
-			tdat->len_cmp = 0;
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, checksums do not match.", tdat->id);
+			if (pctx->verify_mode) {
+				verify_chunk_failed(pctx, tdat);
+			} else {
+				tdat->len_cmp = 0;
+				pctx->t_errored = 1;
+				pctx->main_cancel = 1;
+			}
+		}
+	}
+
+	/*
+	 * With a chunk index the chunk can go straight to its final place in the
+	 * output file.
+	 */
+	if (pctx->pwrite_fd != -1 && tdat->len_cmp > 0) {
+		if (tdat->len_cmp != tdat->uncomp_len) {
+			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, size does not match chunk index.",
+			    tdat->id);
+			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
 			pctx->main_cancel = 1;
+		} else if (!direct) {
+			st_t = pc_stats_start(tdat->stats);
+			if (Pwrite(pctx->pwrite_fd, tdat->uncompressed_chunk, tdat->len_cmp,
+			    tdat->file_offset) != tdat->len_cmp) {
+				log_msg(LOG_ERR, 1, "ERROR: Chunk %d, write failed: ", tdat->id);
+				tdat->len_cmp = 0;
+				pctx->t_errored = 1;
+				pctx->main_cancel = 1;
+			}
+			pc_stats_end(tdat->stats, PC_STAGE_WRITE, st_t, tdat->len_cmp);
 		}
 	}
 
 cont:
-	Sem_Post(&tdat->cmp_done_sem);
+	if (pctx->link_win)
+		chunk_link_pass(pctx, tdat);
+
+	/*
+	 * Verify mode has no writer. The slot goes straight back to the reader.
+	 */
+	if (wt->free_queue != NULL) {
+		chunk_queue_put(wt->free_queue, tdat);
+		goto redo;
+	}
+	if (pctx->slot_auto)
+		tdat->work_ms = get_wtime_millis() - work_st;
+	Hsem_Post(&tdat->cmp_done_sem);
 	if (!pctx->t_errored)
 		goto redo;
 	return (NULL);
 }
 
+/*
+ * Approximate peak memory of a run with the given thread count and chunk
+ * size: two buffers per chunk slot, the read-ahead or pipe prefetch buffers
+ * and the per-thread codec state.
+ */
+static uint64_t
+mem_footprint(pc_ctx_t *pctx, uint64_t chunksize, uint32_t nthreads, int level,
+    compress_op_t op)
+{
+	algo_props_t props;
+	uint64_t bufsz, nbufs;
+	uint32_t extra;
+
+	init_algo_props(&props);
+	if (pctx->_props_func)
+		pctx->_props_func(&props, level, chunksize);
+	extra = zlib_buf_extra(chunksize);
+	if (props.buf_extra > extra)
+		extra = props.buf_extra;
+	bufsz = chunksize + CHUNK_HDR_SZ + extra;
+	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
+		extra = dedupe_buf_extra(chunksize, 0, pctx->algo, pctx->enable_delta_encode);
+		if (chunksize + extra > bufsz)
+			bufsz = chunksize + extra;
+	}
+	nbufs = (nthreads + CHUNK_SLOTS_EXTRA(nthreads)) * 2;
+	if (op == COMPRESS && nthreads > 1)
+		nbufs += READ_AHEAD_BUFS;
+	else if (op == DECOMPRESS && pctx->pipe_mode)
+		nbufs += PREFETCH_BUFS;
+
+	/* Linked chunks keep a prefix per chunk slot. */
+	if (op == COMPRESS && pctx->link_wlog)
+		bufsz += (1ULL << pctx->link_wlog) / 2;
+	return (bufsz * nbufs + props.state_mem * nthreads);
+}
+
+/*
+ * Fit the thread count, and when compressing the chunk size, into the memory
+ * budget given with -b. Threads are dropped first so that the requested chunk
+ * size and with it the compression ratio is kept where possible. With global
+ * dedupe half of the budget is reserved for the index.
+ */
+static int
+plan_mem_budget(pc_ctx_t *pctx, uint64_t *chunksize, int level, compress_op_t op)
+{
+	uint64_t budget, need, cs;
+	uint32_t n;
+
+	pctx->mem_index_cap = 0;
+	if (pctx->mem_budget == 0 || pctx->nthreads < 1)
+		return (0);
+
+	budget = pctx->mem_budget;
+	if (op == COMPRESS && pctx->enable_rabin_global)
+		budget >>= 1;
+	n = pctx->nthreads;
+	cs = *chunksize;
+	while (n > 1 && mem_footprint(pctx, cs, n, level, op) > budget)
+		n--;
+	if (op == COMPRESS) {
+		while (cs / 2 >= pctx->min_chunk && mem_footprint(pctx, cs, n, level, op) > budget)
+			cs /= 2;
+	}
+	need = mem_footprint(pctx, cs, n, level, op);
+	if (need > budget) {
+		log_msg(LOG_ERR, 0, "Memory budget of %" PRIu64 "MB is too small, "
+		    "at least %" PRIu64 "MB is needed.", budget >> 20, (need >> 20) + 1);
+		return (-1);
+	}
+
+	if (n < pctx->nthreads)
+		log_msg(LOG_INFO, 0, "Memory budget: Reducing threads to %u", n);
+	if (cs < *chunksize)
+		log_msg(LOG_INFO, 0, "Memory budget: Reducing chunk size to %s",
+		    bytes_to_size(cs));
+	log_msg(LOG_INFO, 0, "Planned memory footprint: %" PRIu64 "MB of %" PRIu64 "MB",
+	    (need >> 20) + 1, pctx->mem_budget >> 20);
+	pctx->nthreads = n;
+	*chunksize = cs;
+	pctx->mem_index_cap = pctx->mem_budget - need;
+	return (0);
+}
+
 /*
  * File decompression routine.
  *
@@ -837,22 +3670,50 @@ int DLL_EXPORT
 start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 {
 	char algorithm[ALGO_SZ];
-	struct stat sbuf;
+	struct stat sbuf, osbuf;
 	struct wdata w;
 	int compfd = -1, compfd2 = -1, p, dedupe_flag;
-	int uncompfd = -1, err, np, bail;
-	int thread = 0, level;
-	uint32_t nprocs = 1, i;
+	int uncompfd = -1, mfd, err, np, bail;
+	int thread = 0, level, hdr_level, dedupe_window, type_dicts;
+	uint32_t nprocs = 1, nslots = 0, nactive = 0, i;
 	unsigned short version, flags;
 	int64_t chunksize, compressed_chunksize;
 	struct cmp_data **dary, *tdat;
+	struct cmp_thread *wthr;
+	struct chunk_queue cq, fq;
+	struct slot_auto sa;
 	pthread_t writer_thr;
 	algo_props_t props;
+	pc_stats_t *stats;
+	const char *stats_json;
+	uint64_t stats_t0;
+	int tracing;
+	int numa, verify_serial;
+	struct prefetch *pf;
 
 	err = 0;
 	flags = 0;
 	thread = 0;
+	type_dicts = 0;
 	dary = NULL;
+	pf = NULL;
+	verify_serial = 0;
+	wthr = NULL;
+	cq.ent = NULL;
+	fq.ent = NULL;
+	if (pctx->verify_mode) {
+		pthread_mutex_init(&pctx->verify_mutex, NULL);
+		pctx->verify_nfailed = 0;
+	}
+	w.ring = NULL;
+	w.splice = 0;
+	w.stats = NULL;
+	stats = NULL;
+	stats_t0 = 0;
+	pctx->pwrite_fd = -1;
+	pctx->out_map = NULL;
+	pctx->verify_deferred = 0;
+	pctx->slot_auto = 0;
 	init_algo_props(&props);
 
 	/*
@@ -861,7 +3722,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	if (!pctx->pipe_mode) {
 		if (filename == NULL) {
 			pctx->pipe_mode = 1;
-			compfd = fileno(stdin);
+			compfd = PIPE_IN_FD(pctx);
 			if (compfd == -1) {
 				log_msg(LOG_ERR, 1, "fileno ");
 				UNCOMP_BAIL;
@@ -881,7 +3742,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				return (1);
 		}
 	} else {
-		compfd = fileno(stdin);
+		compfd = PIPE_IN_FD(pctx);
 		if (compfd == -1) {
 			log_msg(LOG_ERR, 1, "fileno ");
 			UNCOMP_BAIL;
@@ -916,6 +3777,43 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	flags = ntohs(flags);
 	chunksize = ntohll(chunksize);
 	level = ntohl(level);
+	hdr_level = level;
+
+	/*
+	 * The dedupe window in chunks is kept in the upper half of the level.
+	 */
+	dedupe_window = 0;
+	if (flags & FLAG_DEDUPE_WINDOW) {
+		dedupe_window = level >> 16;
+		level &= 0xffff;
+	}
+	type_dicts = (level & LEVEL_TYPE_DICT);
+	level &= ~LEVEL_TYPE_DICT;
+
+	/*
+	 * Linked chunks are decompressed after the data before them, in order.
+	 */
+	pctx->link_win = 0;
+	if ((level >> LINK_WLOG_SHIFT) & LINK_WLOG_MASK) {
+		int wlog = (level >> LINK_WLOG_SHIFT) & LINK_WLOG_MASK;
+
+		level &= 0xff;
+		if (wlog < LINK_MIN_WLOG || wlog > LINK_MAX_WLOG ||
+		    pctx->_prefix_func == NULL) {
+			log_msg(LOG_ERR, 0, "Invalid linked chunk window in header.");
+			err = 1;
+			goto uncomp_done;
+		}
+		pctx->link_win = 1ULL << wlog;
+		pctx->link_buf = (uchar_t *)slab_alloc(NULL, pctx->link_win);
+		if (pctx->link_buf == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			err = 1;
+			goto uncomp_done;
+		}
+		pctx->link_len = 0;
+		pctx->link_next = 0;
+	}
 
 	/*
 	 * Check for ridiculous values (malicious tampering or otherwise).
@@ -944,8 +3842,20 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 
 	/*
 	 * First check for archive mode. In that case the to_filename must be a directory.
+	 * Byte-range decompression returns raw bytes of the archive stream instead.
+	 * Verify mode checks the archive stream without extracting it.
 	 */
-	if (flags & FLAG_ARCHIVE) {
+	if (pctx->verify_mode) {
+		if ((flags & FLAG_ARCHIVE) && (flags & FLAG_META_STREAM) && version > 9)
+			pctx->meta_stream = 1;
+		if (pctx->pipe_mode && pctx->meta_stream) {
+			log_msg(LOG_ERR, 0,
+			    "Cannot verify archive with metadata stream in pipe mode.");
+			err = 1;
+			goto uncomp_done;
+		}
+
+	} else if ((flags & FLAG_ARCHIVE) && !pctx->range_mode) {
 		if (flags & FLAG_META_STREAM && version > 9)
 			pctx->meta_stream = 1;
 
@@ -1056,8 +3966,8 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 
 	if (pctx->_props_func) {
 		pctx->_props_func(&props, level, chunksize);
-		if (chunksize + props.buf_extra > compressed_chunksize) {
-			compressed_chunksize += (chunksize + props.buf_extra - 
+		if (chunksize + CHUNK_HDR_SZ + props.buf_extra > compressed_chunksize) {
+			compressed_chunksize += (chunksize + CHUNK_HDR_SZ + props.buf_extra -
 			    compressed_chunksize);
 		}
 	}
@@ -1069,9 +3979,10 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 
 		if (flags & FLAG_DEDUP_FIXED) {
 			if (version > 7) {
-				if (pctx->pipe_mode) {
-					log_msg(LOG_ERR, 0, "Global Deduplication is not "
-					    "supported with pipe mode.");
+				if (pctx->pipe_mode && (dedupe_window < 1 ||
+				    dedupe_window > DEDUPE_WINDOW_MAX)) {
+					log_msg(LOG_ERR, 0, "Global Deduplication is only "
+					    "supported with pipe mode if a dedupe window was used.");
 					err = 1;
 					goto uncomp_done;
 				}
@@ -1087,6 +3998,19 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		pctx->enable_fixed_scan = 1;
 		dedupe_flag = RABIN_DEDUPE_FIXED;
 	}
+	if (flags & FLAG_GLOBAL_BASE) {
+		if (!pctx->enable_rabin_global) {
+			log_msg(LOG_ERR, 0, "Invalid file deduplication flags.");
+			err = 1;
+			goto uncomp_done;
+		}
+		if (getenv("PCOMPRESS_GLOBAL_BASE") == NULL) {
+			log_msg(LOG_ERR, 0, "File references blocks of a base file. Set "
+			    "PCOMPRESS_GLOBAL_BASE to the restored base file.");
+			err = 1;
+			goto uncomp_done;
+		}
+	}
 
 	if (flags & FLAG_SINGLE_CHUNK) {
 		props.is_single_chunk = 1;
@@ -1139,13 +4063,17 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		pw_len = -1;
 		compressed_chunksize += pctx->mac_bytes;
 		pctx->encrypt_type = flags & MASK_CRYPTO_ALG;
+		pctx->mac_tree = ((flags & FLAG_MAC_TREE) != 0);
 		if (version < 7)
 			pctx->keylen = OLD_KEYLEN;
 
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (pctx->encrypt_type == CRYPTO_ALG_AES ||
+		    pctx->encrypt_type == CRYPTO_ALG_AES_GCM) {
 			noncelen = 8;
 		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
 			noncelen = XSALSA20_CRYPTO_NONCEBYTES;
+		} else if (pctx->encrypt_type == CRYPTO_ALG_CHACHA20) {
+			noncelen = XCHACHA20_CRYPTO_NONCEBYTES;
 		} else {
 			log_msg(LOG_ERR, 0, "Invalid Encryption algorithm code: %d. File corrupt ?",
 				pctx->encrypt_type);
@@ -1174,10 +4102,12 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			UNCOMP_BAIL;
 		}
 
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (pctx->encrypt_type == CRYPTO_ALG_AES ||
+		    pctx->encrypt_type == CRYPTO_ALG_AES_GCM) {
 			U64_P(nonce) = ntohll(U64_P(n1));
 
-		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20) {
+		} else if (pctx->encrypt_type == CRYPTO_ALG_SALSA20 ||
+		    pctx->encrypt_type == CRYPTO_ALG_CHACHA20) {
 			deserialize_checksum(nonce, n1, noncelen);
 		}
 
@@ -1300,7 +4230,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		hmac_update(&hdr_mac, (uchar_t *)&d1, sizeof (flags));
 		d3 = htonll(chunksize);
 		hmac_update(&hdr_mac, (uchar_t *)&d3, sizeof (chunksize));
-		d2 = htonl(level);
+		d2 = htonl(hdr_level);
 		hmac_update(&hdr_mac, (uchar_t *)&d2, sizeof (level));
 		if (version > 6) {
 			d2 = htonl(saltlen);
@@ -1343,7 +4273,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		crc2 = lzma_crc32((uchar_t *)&d1, sizeof (version), crc2);
 		ch = htonll(chunksize);
 		crc2 = lzma_crc32((uchar_t *)&ch, sizeof (ch), crc2);
-		d2 = htonl(level);
+		d2 = htonl(hdr_level);
 		crc2 = lzma_crc32((uchar_t *)&d2, sizeof (level), crc2);
 		if (crc1 != crc2) {
 			log_msg(LOG_ERR, 0, "Header verification failed! File tampered "
@@ -1352,7 +4282,156 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 	}
 
-	if (flags & FLAG_ARCHIVE) {
+	/*
+	 * Per-type zstd dictionaries follow the header.
+	 */
+	if (type_dicts) {
+#ifdef ENABLE_PC_ZSTD
+		uchar_t *tdbuf;
+		uint32_t tdlen, tdcrc;
+
+		if (strncmp(pctx->algo, "zstd", 4) != 0 ||
+		    Read(compfd, &tdlen, sizeof (tdlen)) < sizeof (tdlen) ||
+		    (tdlen = ntohl(tdlen)) > TYPE_DICT_MAX_SZ) {
+			log_msg(LOG_ERR, 0, "Invalid type dictionaries in header.");
+			UNCOMP_BAIL;
+		}
+		tdbuf = (uchar_t *)malloc(tdlen + sizeof (tdcrc));
+		if (tdbuf == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			UNCOMP_BAIL;
+		}
+		if (Read(compfd, tdbuf, tdlen + sizeof (tdcrc)) < tdlen + sizeof (tdcrc)) {
+			free(tdbuf);
+			log_msg(LOG_ERR, 1, "Read: ");
+			UNCOMP_BAIL;
+		}
+		tdcrc = ntohl(U32_P(tdbuf + tdlen));
+		if (tdcrc != lzma_crc32(tdbuf, tdlen, 0) ||
+		    zstd_tdict_decode(tdbuf, tdlen) != 0) {
+			free(tdbuf);
+			log_msg(LOG_ERR, 0, "Type dictionaries in header are corrupt.");
+			UNCOMP_BAIL;
+		}
+		free(tdbuf);
+#else
+		log_msg(LOG_ERR, 0, "Type dictionaries need zstd support.");
+		UNCOMP_BAIL;
+#endif
+	}
+
+	/*
+	 * Load the seekable chunk index if present. It is not needed for a full
+	 * sequential decompression so a damaged index is not fatal.
+	 */
+	if ((flags & FLAG_CHUNK_INDEX) && !pctx->pipe_mode) {
+		int rv = chunk_index_load(pctx, compfd);
+
+		if (rv == -2) {
+			UNCOMP_BAIL;
+		} else if (rv == -1) {
+			log_msg(LOG_WARN, 0, "Chunk index is missing or corrupt, ignoring.");
+		} else {
+			log_msg(LOG_VERBOSE, 0, "Chunk index: %" PRIu64 " chunks, %" PRIu64
+			    " bytes uncompressed.", pctx->cidx_count, pctx->cidx_usize);
+
+			/*
+			 * The member index is only needed for selective extraction
+			 * and mounting.
+			 */
+			if ((flags & FLAG_ARCHIVE) && (pctx->xmembers_count > 0 ||
+			    pctx->fuse_mount) && pctx->midx == NULL) {
+				rv = member_index_load(pctx, compfd);
+				if (rv == -2) {
+					UNCOMP_BAIL;
+				}
+			}
+		}
+	}
+
+	if (pctx->range_mode) {
+		if (pctx->cidx == NULL) {
+			log_msg(LOG_ERR, 0, "Byte-range decompression needs a chunk index (-I).");
+			UNCOMP_BAIL;
+		}
+		chunk_index_range(pctx);
+		uncompfd = -1;
+		if (pctx->chunk_cache != NULL) {
+			struct stat csb;
+
+			if (fstat(compfd, &csb) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot stat %s", filename);
+				UNCOMP_BAIL;
+			}
+			pctx->cache_fid = ((uint64_t)csb.st_dev << 32) ^ (uint64_t)csb.st_ino ^
+			    ((uint64_t)csb.st_mtime * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)csb.st_size;
+		}
+
+		/*
+		 * Global dedupe references are resolved from a temporary file that
+		 * the chunks from the start of the restore group on are written to
+		 * at their offsets in the stream.
+		 */
+		if (pctx->enable_rabin_global && pctx->range_len > 0) {
+			const char *tmpdir = getenv("TMPDIR");
+
+			while (pctx->range_chunk > 0 &&
+			    !(pctx->cidx[pctx->range_chunk].flags & CIDX_GROUP_START))
+				pctx->range_chunk--;
+			if (!(pctx->cidx[pctx->range_chunk].flags & CIDX_GROUP_START)) {
+				log_msg(LOG_ERR, 0, "Byte-range decompression with Global "
+				    "Deduplication needs restore groups.");
+				UNCOMP_BAIL;
+			}
+			if (tmpdir == NULL || *tmpdir == '\0')
+				tmpdir = "/tmp";
+			snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
+			    "%s" PATHSEP_STR ".pcrangeXXXXXX", tmpdir);
+			if ((pctx->archive_temp_fd = mkstemp(pctx->archive_temp_file)) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot create temporary file in %s", tmpdir);
+				UNCOMP_BAIL;
+			}
+			add_fname(pctx->archive_temp_file);
+			if (lseek(pctx->archive_temp_fd, pctx->cidx[pctx->range_chunk].uoff,
+			    SEEK_SET) == -1) {
+				log_msg(LOG_ERR, 1, "Seek ");
+				UNCOMP_BAIL;
+			}
+		}
+
+	} else if (pctx->verify_mode) {
+		if (pctx->verify_mode == VERIFY_HMAC && !pctx->encrypt_type) {
+			log_msg(LOG_INFO, 0, "Not encrypted, doing a full verify.");
+			pctx->verify_mode = VERIFY_FULL;
+		}
+
+		/*
+		 * Global dedupe recovery reads back earlier output so chunks are
+		 * decompressed in order into a temporary file, as in a normal run.
+		 * The first failure then stops the run.
+		 */
+		uncompfd = -1;
+		if (pctx->verify_mode == VERIFY_FULL && pctx->enable_rabin_global) {
+			const char *tmpdir = getenv("TMPDIR");
+
+			if (tmpdir == NULL || *tmpdir == '\0')
+				tmpdir = "/tmp";
+			snprintf(pctx->archive_members_file, sizeof (pctx->archive_members_file),
+			    "%s" PATHSEP_STR ".pcverifyXXXXXX", tmpdir);
+			if ((uncompfd = mkstemp(pctx->archive_members_file)) == -1) {
+				log_msg(LOG_ERR, 1, "Cannot create temporary file in %s", tmpdir);
+				UNCOMP_BAIL;
+			}
+			to_filename = pctx->archive_members_file;
+			add_fname(to_filename);
+			log_msg(LOG_VERBOSE, 0, "Global Deduplication: verifying through %s",
+			    to_filename);
+			pthread_mutex_destroy(&pctx->verify_mutex);
+			pctx->verify_mode = 0;
+			verify_serial = 1;
+		}
+
+	} else if (flags & FLAG_ARCHIVE) {
 		if (pctx->enable_rabin_global) {
 			char cwd[MAXPATHLEN];
 
@@ -1419,8 +4498,45 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				log_msg(LOG_ERR, 1, "Cannot open: %s", to_filename);
 				UNCOMP_BAIL;
 			}
+
+			/*
+			 * The chunk index gives the final offset of every chunk so the
+			 * decompression threads can write them in parallel into a
+			 * preallocated file. Global dedupe reads back earlier output
+			 * and needs the ordered writer.
+			 */
+			if (pctx->cidx != NULL && !pctx->enable_rabin_global &&
+			    fstat(uncompfd, &osbuf) == 0 && S_ISREG(osbuf.st_mode)) {
+#ifndef __APPLE__
+				if (posix_fallocate(uncompfd, 0, pctx->cidx_usize) != 0)
+#endif
+					(void) ftruncate(uncompfd, pctx->cidx_usize);
+				pctx->pwrite_fd = uncompfd;
+				log_msg(LOG_VERBOSE, 0, "Writing chunks in parallel");
+
+				/*
+				 * Plain chunks can then be decompressed right into a
+				 * mapping of the output. Slots allocate their own
+				 * buffer only for chunks that cannot.
+				 */
+				mfd = open(to_filename, O_RDWR);
+				if (mfd != -1 && pctx->cidx_usize > 0 &&
+				    pctx->cidx_usize <= (uint64_t)SIZE_MAX) {
+					void *map;
+
+					map = mmap(NULL, pctx->cidx_usize, PROT_READ | PROT_WRITE,
+					    MAP_SHARED, mfd, 0);
+					if (map != MAP_FAILED) {
+						pctx->out_map = (uchar_t *)map;
+						pctx->out_map_len = pctx->cidx_usize;
+						pctx->out_bufsz = compressed_chunksize;
+					}
+				}
+				if (mfd != -1)
+					close(mfd);
+			}
 		} else {
-			uncompfd = fileno(stdout);
+			uncompfd = PIPE_OUT_FD(pctx);
 			if (uncompfd == -1) {
 				log_msg(LOG_ERR, 1, "fileno ");
 				UNCOMP_BAIL;
@@ -1433,7 +4549,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	 *          Doing so will BREAK Separate Metadata stream processing.
 	 */
 
-	nprocs = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+	nprocs = (uint32_t)get_avail_cpus();
 	if (pctx->archive_mode) {
 		nprocs = nprocs > 1 ? nprocs-1:nprocs;
 	}
@@ -1443,9 +4559,19 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	else
 		pctx->nthreads = nprocs;
 
+	if (!(pctx->list_mode && pctx->meta_stream)) {
+		uint64_t cs = chunksize;
+
+		if (plan_mem_budget(pctx, &cs, level, DECOMPRESS) == -1) {
+			UNCOMP_BAIL;
+		}
+		nprocs = pctx->nthreads;
+	}
+
 	set_threadcounts(&props, &(pctx->nthreads), nprocs, DECOMPRESS_THREADS);
 	if (props.is_single_chunk)
 		pctx->nthreads = 1;
+	pctx->chunk_threads_max = props.nthreads;
 	/*
 	 * If we are trying to list the archive contents, and the archive has a
 	 * metadata stream, then we do not do any data decompression. Only
@@ -1466,8 +4592,54 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	slab_cache_add(chunksize);
 	slab_cache_add(sizeof (struct cmp_data));
 
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
-	for (i = 0; i < nprocs; i++) {
+	nslots = nprocs + CHUNK_SLOTS_EXTRA(nprocs);
+	dary = (struct cmp_data **)slab_calloc(NULL, nslots, sizeof (struct cmp_data *));
+	wthr = (struct cmp_thread *)slab_calloc(NULL, nprocs, sizeof (struct cmp_thread));
+	if (!dary || !wthr || chunk_queue_init(&cq, nslots + nprocs) == -1) {
+		log_msg(LOG_ERR, 0, "1: Out of memory");
+		UNCOMP_BAIL;
+	}
+
+	/*
+	 * In verify mode nothing is written so chunks need not complete in order.
+	 * Workers hand finished slots back through a free queue.
+	 */
+	if (pctx->verify_mode && chunk_queue_init(&fq, nslots + 1) == -1) {
+		log_msg(LOG_ERR, 0, "1: Out of memory");
+		UNCOMP_BAIL;
+	}
+
+	/*
+	 * The window of slots in use follows decode and write speed when chunks
+	 * go through the writer in order, see slot_auto_next().
+	 */
+	nactive = nslots;
+	slot_auto_init(&sa, nslots);
+	if (!pctx->verify_mode && !pctx->range_mode && !(pctx->list_mode && pctx->meta_stream) &&
+	    nslots > SLOT_AUTO_MIN && getenv("PCOMPRESS_NO_SLOT_AUTO") == NULL)
+		pctx->slot_auto = 1;
+
+	/*
+	 * Per-stage timings, one set per thread as in start_compress(). The
+	 * chunk reads happen in this thread.
+	 */
+	stats_json = getenv("PCOMPRESS_STATS_JSON");
+	pc_trace_thread("reader");
+	tracing = pc_trace_init();
+	pctx->perf = pc_perf_init();
+	if ((stats_json != NULL && *stats_json != '\0') || tracing || pctx->perf) {
+		stats = pc_stats_create(nprocs + 2);
+		if (stats == NULL) {
+			log_msg(LOG_ERR, 0, "1: Out of memory");
+			UNCOMP_BAIL;
+		}
+		w.stats = &stats[1];
+		stats_t0 = pc_stats_start(stats);
+	}
+	numa = pc_numa_init();
+	if (numa)
+		log_msg(LOG_VERBOSE, 0, "Placing threads on %d NUMA nodes", numa);
+	for (i = 0; i < nslots; i++) {
 		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
 		if (!dary[i]) {
 			log_msg(LOG_ERR, 0, "1: Out of memory");
@@ -1480,8 +4652,12 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		tdat->chunksize = chunksize;
 		tdat->compress = pctx->_compress_func;
 		tdat->decompress = pctx->_decompress_func;
-		tdat->cancel = 0;
 		tdat->decompressing = 1;
+		tdat->passthrough = 0;
+		tdat->cache_ent = NULL;
+		tdat->work_ms = 0;
+		tdat->write_ms = 0;
+		tdat->ring_wrap = 0;
 		if (props.is_single_chunk) {
 			tdat->cksum_mt = 1;
 			if (version == 6) {
@@ -1492,14 +4668,45 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 		tdat->level = level;
 		tdat->data = NULL;
+		tdat->rctx = NULL;
+		tdat->chunk_hmac = NULL;
+		tdat->index_sem_next = NULL;
+		tdat->file_offset = 0;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
-		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
-		Sem_Init(&(tdat->write_done_sem), 0, 1);
-		Sem_Init(&(tdat->index_sem), 0, 0);
+		tdat->verify_pending = 0;
+		Hsem_Init(&(tdat->cmp_done_sem), 0);
+		Hsem_Init(&(tdat->write_done_sem), 1);
+		Hsem_Init(&(tdat->index_sem), 0);
+		Hsem_Init(&(tdat->verify_sem), 0);
+		if (pctx->verify_mode)
+			chunk_queue_put(&fq, tdat);
+	}
+
+	/*
+	 * When doing global dedupe, dedupe recovery of a chunk only waits for the
+	 * output it references to be written, see dedupe_durable_advance(). So no
+	 * index semaphore ring is set up here. A pipe cannot be mapped, so the
+	 * dedupe window of output is kept in memory.
+	 */
+	if (pctx->enable_rabin_global && pctx->pipe_mode && !pctx->verify_mode)
+		dedupe_restore_window((uint64_t)dedupe_window * chunksize);
+
+	for (i = 0; i < nprocs; i++) {
+		struct cmp_thread *wt = &wthr[i];
+
+		wt->pctx = pctx;
+		wt->id = i;
+		wt->level = level;
+		wt->data = NULL;
+		wt->rctx = NULL;
+		wt->stats = (stats ? &stats[2 + i] : NULL);
+		wt->numa_node = (numa ? pc_numa_node(i) : -1);
+		wt->queue = &cq;
+		wt->free_queue = (pctx->verify_mode ? &fq : NULL);
+		pc_numa_prefer(wt->numa_node);
 
 		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads, chunksize,
+			if (pctx->_init_func(&(wt->data), &(wt->level), props.nthreads, chunksize,
 			    version, DECOMPRESS) != 0) {
 				UNCOMP_BAIL;
 			}
@@ -1509,22 +4716,22 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		 * The last parameter is freeram. It is not needed during decompression.
 		 */
 		if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
-			tdat->rctx = create_dedupe_context(chunksize, compressed_chunksize,
+			wt->rctx = create_dedupe_context(chunksize, compressed_chunksize,
 			    pctx->rab_blk_size, pctx->algo, &props, pctx->enable_delta_encode,
 			    dedupe_flag, version, DECOMPRESS, 0, NULL, pctx->pipe_mode, nprocs, 0);
-			if (tdat->rctx == NULL) {
+			if (wt->rctx == NULL) {
 				UNCOMP_BAIL;
 			}
-			if (pctx->enable_rabin_global) {
-				if (pctx->archive_mode) {
-					if ((tdat->rctx->out_fd = open(pctx->archive_temp_file,
+			if (pctx->enable_rabin_global && !pctx->verify_mode && !pctx->pipe_mode) {
+				if (pctx->archive_temp_fd != -1) {
+					if ((wt->rctx->out_fd = open(pctx->archive_temp_file,
 					    O_RDONLY, 0)) == -1) {
 						log_msg(LOG_ERR, 1, "Unable to get new read handle"
 						    " to output file");
 						UNCOMP_BAIL;
 					}
 				} else {
-					if ((tdat->rctx->out_fd = open(to_filename, O_RDONLY, 0))
+					if ((wt->rctx->out_fd = open(to_filename, O_RDONLY, 0))
 					    == -1) {
 						log_msg(LOG_ERR, 1, "Unable to get new read handle"
 						    " to output file");
@@ -1532,51 +4739,59 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 					}
 				}
 			}
-			tdat->rctx->index_sem = &(tdat->index_sem);
-		} else {
-			tdat->rctx = NULL;
 		}
 
 		if (pctx->encrypt_type) {
-			if (hmac_init(&tdat->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			if (hmac_init(&wt->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
 				log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
 				UNCOMP_BAIL;
 			}
 		}
-		if (pthread_create(&(tdat->thr), NULL, perform_decompress,
-		    (void *)tdat) != 0) {
+		if (pthread_create(&(wt->thr), NULL, perform_decompress,
+		    (void *)wt) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			UNCOMP_BAIL;
 		}
 	}
+	pc_numa_prefer(-1);
 	thread = 1;
 
-	if (pctx->enable_rabin_global) {
-		for (i = 0; i < nprocs; i++) {
-			tdat = dary[i];
-			tdat->rctx->index_sem_next = &(dary[(i + 1) % nprocs]->index_sem);
-		}
-	}
-	// When doing global dedupe first thread does not wait to start dedupe recovery.
-	if (nprocs > 0)
-		Sem_Post(&(dary[0]->index_sem));
+	/*
+	 * Nothing before the restore group is referenced.
+	 */
+	if (pctx->range_mode && pctx->archive_temp_fd != -1)
+		dedupe_durable_advance(NULL, pctx->cidx[pctx->range_chunk].uoff);
 
 	if (pctx->encrypt_type) {
 		/* Erase encryption key bytes stored as a plain array. No longer reqd. */
 		crypto_clean_pkey(&(pctx->crypto_ctx));
 	}
 
-	if (!(pctx->list_mode && pctx->meta_stream)) {
+	if (!(pctx->list_mode && pctx->meta_stream) && !pctx->verify_mode) {
 		w.dary = dary;
 		w.wfd = uncompfd;
-		w.nprocs = nprocs;
+		w.nslots = nslots;
 		w.chunksize = chunksize;
+		w.batch_bytes = write_batch_bytes();
 		w.pctx = pctx;
+		if (pctx->pipe_mode && !pctx->range_mode && !pctx->archive_mode &&
+		    pctx->pwrite_fd == -1 && pctx->archive_temp_fd == -1 && getenv("PCOMPRESS_NO_SPLICE") == NULL &&
+		    fstat(uncompfd, &osbuf) == 0 && S_ISFIFO(osbuf.st_mode)) {
+			w.splice = 1;
+			log_msg(LOG_VERBOSE, 0, "Using vmsplice for pipe output");
+		} else if (!pctx->range_mode && !pctx->archive_mode && pctx->pwrite_fd == -1) {
+			w.ring = pc_uring_create(PC_URING_DEPTH);
+			if (w.ring) {
+				log_msg(LOG_VERBOSE, 0, "Using io_uring for chunk I/O");
+			}
+		}
 		if (pthread_create(&writer_thr, NULL, writer_thread, (void *)(&w)) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			UNCOMP_BAIL;
 		}
 		thread = 2;
+		pctx->verify_deferred = (pctx->pwrite_fd == -1 &&
+		    getenv("PCOMPRESS_VERIFY_INLINE") == NULL);
 	}
 
 	/*
@@ -1586,23 +4801,114 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	 * Chunk sequencing is ensured.
 	 */
 	pctx->chunk_num = 0;
+	if (pctx->range_mode)
+		pctx->chunk_num = pctx->range_chunk;
 	np = 0;
 	bail = 0;
-	if (nprocs == 0)
+	if (nslots == 0)
 		bail = 1;
+
+	/*
+	 * When reading from a pipe, parse and read chunks ahead in a separate
+	 * thread so that the input keeps draining while all slots are busy.
+	 */
+	if (!bail && pctx->pipe_mode && !pctx->meta_stream && !pctx->range_mode) {
+		pf = prefetch_start(pctx, compfd, chunksize, compressed_chunksize,
+		    stats ? &stats[0] : NULL);
+		if (pf == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot start input prefetch ");
+			UNCOMP_BAIL;
+		}
+	}
 	while (!bail) {
 		int64_t rb;
+		uint64_t st_t;
 
 		if (pctx->main_cancel) break;
-		for (p = 0; p < nprocs; p++) {
+		if (pctx->slot_auto)
+			nactive = slot_auto_round(&sa, dary);
+		for (p = 0; p < nactive; p++) {
 			np = p;
-			tdat = dary[p];
-			Sem_Wait(&tdat->write_done_sem);
+			if (pctx->verify_mode) {
+				tdat = chunk_queue_get(&fq);
+			} else {
+				tdat = dary[p];
+				Hsem_Wait(&tdat->write_done_sem);
+				if (pctx->slot_auto)
+					slot_auto_sample(&sa, tdat);
+				tdat->ring_wrap = (p == nactive - 1);
+			}
 			if (pctx->main_cancel) break;
 			tdat->id = pctx->chunk_num;
-			if (tdat->rctx) tdat->rctx->id = tdat->id;
+
+			/*
+			 * In byte-range mode seek straight to the next covering chunk.
+			 */
+			if (pctx->range_mode) {
+				if (pctx->chunk_num >= pctx->range_end) {
+					bail = 1;
+					break;
+				}
+				tdat->file_offset = pctx->cidx[pctx->chunk_num].uoff;
+
+				/*
+				 * A cached chunk goes straight to the writer. The slot
+				 * data is restored when the writer is done with it.
+				 */
+				if (pctx->chunk_cache != NULL && (tdat->cache_ent =
+				    pc_cache_get(pctx->chunk_cache, pctx->cache_fid,
+				    pctx->chunk_num, &tdat->cmp_seg, &tdat->len_cmp)) != NULL) {
+					tdat->decompressing = 1;
+					tdat->passthrough = 0;
+					tdat->verify_pending = 0;
+					Hsem_Post(&tdat->cmp_done_sem);
+					++(pctx->chunk_num);
+					continue;
+				}
+				if (lseek(compfd, pctx->cidx[pctx->chunk_num].coff, SEEK_SET) == -1) {
+					log_msg(LOG_ERR, 1, "Seek ");
+					UNCOMP_BAIL;
+				}
+			} else if (pctx->pwrite_fd != -1) {
+				if (pctx->chunk_num < pctx->cidx_count) {
+					tdat->file_offset = pctx->cidx[pctx->chunk_num].uoff;
+					tdat->uncomp_len = pctx->cidx[pctx->chunk_num].ulen;
+				} else {
+					/* More chunks than the index has. Fails the size check. */
+					tdat->uncomp_len = 0;
+				}
+			}
 
 redo:
+			if (pf != NULL) {
+				if (!tdat->compressed_chunk) {
+					tdat->compressed_chunk = (uchar_t *)slab_alloc(NULL,
+					    compressed_chunksize);
+					if (pctx->out_map == NULL)
+						tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
+						    compressed_chunksize);
+					if (!tdat->compressed_chunk || (!tdat->uncompressed_chunk &&
+					    pctx->out_map == NULL)) {
+						log_msg(LOG_ERR, 0, "2: Out of memory");
+						UNCOMP_BAIL;
+					}
+					tdat->cmp_seg = tdat->uncompressed_chunk;
+				}
+				rb = prefetch_next(pf, tdat);
+				if (rb == 1) {
+					bail = 1;
+					break;
+				} else if (rb == -1) {
+					UNCOMP_BAIL;
+				}
+				if (tdat->len_cmp > pctx->largest_chunk)
+					pctx->largest_chunk = tdat->len_cmp;
+				if (tdat->len_cmp < pctx->smallest_chunk)
+					pctx->smallest_chunk = tdat->len_cmp;
+				pctx->avg_chunk += tdat->len_cmp;
+				goto queue_chunk;
+			}
+
 			/*
 			 * First read length of compressed chunk.
 			 */
@@ -1668,9 +4974,11 @@ redo:
 			if (!tdat->compressed_chunk && tdat->len_cmp != METADATA_INDICATOR) {
 				tdat->compressed_chunk = (uchar_t *)slab_alloc(NULL,
 				    compressed_chunksize);
-				tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
-				    compressed_chunksize);
-				if (!tdat->compressed_chunk || !tdat->uncompressed_chunk) {
+				if (pctx->out_map == NULL)
+					tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
+					    compressed_chunksize);
+				if (!tdat->compressed_chunk || (!tdat->uncompressed_chunk &&
+				    pctx->out_map == NULL)) {
 					log_msg(LOG_ERR, 0, "2: Out of memory");
 					UNCOMP_BAIL;
 				}
@@ -1691,7 +4999,10 @@ redo:
 				 */
 				rb = tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes +
 				    CHUNK_FLAG_SZ;
+				st_t = pc_stats_start(stats);
 				tdat->rbytes = Read(compfd, tdat->compressed_chunk, rb);
+				if (tdat->rbytes > 0)
+					pc_stats_end(stats, PC_STAGE_READ, st_t, tdat->rbytes);
 			} else {
 				off_t cpos = lseek(compfd, 0, SEEK_CUR);
 
@@ -1719,69 +5030,136 @@ redo:
 			if (tdat->len_cmp == METADATA_INDICATOR) {
 				goto redo;
 			}
-			Sem_Post(&tdat->start_sem);
+queue_chunk:
+			chunk_queue_put(&cq, tdat);
 			++(pctx->chunk_num);
 		}
 	}
 
-	if (!pctx->main_cancel) {
-		for (p = 0; p < nprocs; p++) {
+	if (!pctx->main_cancel && pctx->verify_mode) {
+		/* One slot is still held by this thread. */
+		for (p = 1; p < nslots; p++)
+			(void) chunk_queue_get(&fq);
+
+	} else if (!pctx->main_cancel) {
+		for (p = 0; p < nslots; p++) {
 			if (p == np) continue;
 			tdat = dary[p];
-			Sem_Wait(&tdat->write_done_sem);
+			Hsem_Wait(&tdat->write_done_sem);
 // VS begin
 			if (pctx->main_cancel) break;
 // VS end
 		}
 	}
 uncomp_done:
+	pc_numa_prefer(-1);
+	if (pf != NULL)
+		prefetch_stop(pf);
 	if (pctx->t_errored) err = pctx->t_errored;
 	if (thread) {
-		for (i = 0; i < nprocs; i++) {
+		for (i = 0; i < nprocs; i++)
+			chunk_queue_put(&cq, NULL);
+
+		/*
+		 * Release any worker still waiting for global dedupe output.
+		 */
+		if (pctx->enable_rabin_global)
+			dedupe_durable_abort();
+		for (i = 0; i < nprocs; i++)
+			pthread_join(wthr[i].thr, NULL);
+		for (i = 0; i < nslots; i++) {
 			tdat = dary[i];
-			tdat->cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->start_sem);
-			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
+			Hsem_Post(&tdat->cmp_done_sem);
 		}
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
+	pc_uring_destroy(w.ring);
+	pctx->pwrite_fd = -1;
+	pctx->slot_auto = 0;
+	if (pctx->out_map != NULL) {
+		munmap(pctx->out_map, pctx->out_map_len);
+		pctx->out_map = NULL;
+	}
+	if (pctx->verify_mode) {
+		if (thread)
+			verify_report(pctx);
+		if (pctx->verify_nfailed > 0)
+			err = 1;
+		chunk_queue_destroy(&fq);
+		pthread_mutex_destroy(&pctx->verify_mutex);
+	} else if (verify_serial) {
+		pctx->verify_mode = VERIFY_FULL;
+		if (thread && !err)
+			verify_report(pctx);
+	}
 
 	/*
 	 * Ownership and mode of target should be same as original.
 	 */
-	if (filename != NULL && uncompfd != -1) {
+	if (filename != NULL && uncompfd != -1 && !verify_serial) {
 		fchmod(uncompfd, sbuf.st_mode);
 		if (fchown(uncompfd, sbuf.st_uid, sbuf.st_gid) == -1)
 			log_msg(LOG_ERR, 1, "Chown ");
 	}
-	if (dary != NULL) {
+	if (stats != NULL) {
+		pc_trace_write();
+		if (!err && !pctx->list_mode && stats_json != NULL && *stats_json != '\0')
+			pc_stats_write_json(stats_json, pctx->verify_mode ? "verify" : "decompress",
+			    filename, stats,
+			    nprocs + 2, pc_stats_start(stats) - stats_t0, NULL);
+		if (pctx->perf)
+			pc_stats_merge(&pctx->perf_total, stats, nprocs + 2);
+		pc_stats_destroy(stats);
+	}
+	if (wthr != NULL) {
 		for (i = 0; i < nprocs; i++) {
+			if (pctx->_deinit_func)
+				pctx->_deinit_func(&(wthr[i].data));
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
+				destroy_dedupe_context(wthr[i].rctx);
+			}
+		}
+		slab_release(NULL, wthr);
+	}
+	if (dary != NULL) {
+		for (i = 0; i < nslots; i++) {
 			if (!dary[i]) continue;
+			if (dary[i]->cache_ent != NULL)
+				pc_cache_release(pctx->chunk_cache, dary[i]->cache_ent);
 			if (dary[i]->uncompressed_chunk)
 				slab_release(NULL, dary[i]->uncompressed_chunk);
 			if (dary[i]->compressed_chunk)
 				slab_release(NULL, dary[i]->compressed_chunk);
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
-			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
-				destroy_dedupe_context(dary[i]->rctx);
-			}
-			Sem_Destroy(&(dary[i]->start_sem));
-			Sem_Destroy(&(dary[i]->cmp_done_sem));
-			Sem_Destroy(&(dary[i]->write_done_sem));
-			Sem_Destroy(&(dary[i]->index_sem));
+			Hsem_Destroy(&(dary[i]->cmp_done_sem));
+			Hsem_Destroy(&(dary[i]->write_done_sem));
+			Hsem_Destroy(&(dary[i]->index_sem));
+			Hsem_Destroy(&(dary[i]->verify_sem));
 
 			slab_release(NULL, dary[i]);
 		}
 		slab_release(NULL, dary);
 	}
+	if (pctx->link_buf != NULL) {
+		slab_release(NULL, pctx->link_buf);
+		pctx->link_buf = NULL;
+	}
+	chunk_queue_destroy(&cq);
 	if (!pctx->pipe_mode) {
 		if (filename && compfd != -1) close(compfd);
 		if (uncompfd != -1) close(uncompfd);
 	}
+	if (verify_serial) {
+		unlink(to_filename);
+		rm_fname(to_filename);
+	}
+	if (pctx->range_mode && pctx->archive_temp_fd != -1) {
+		close(pctx->archive_temp_fd);
+		unlink(pctx->archive_temp_file);
+		rm_fname(pctx->archive_temp_file);
+		pctx->archive_temp_fd = -1;
+	}
 	if (pctx->archive_mode) {
 		pthread_join(pctx->archive_thread, NULL);
 		if (pctx->meta_stream) {
@@ -1803,28 +5181,97 @@ uncomp_done:
 	return (err);
 }
 
+/*
+ * Cut long constant byte runs out of the chunk in place before dedupe and
+ * compression. Not done with Global Dedupe, whose block references are
+ * offsets into the original data.
+ */
+static int
+chunk_runs_eliminate(pc_ctx_t *pctx, struct cmp_data *tdat, uchar_t *buf)
+{
+	int64_t nb;
+	uint64_t st_t;
+
+	if (!pctx->run_scan || pctx->enable_rabin_global)
+		return (0);
+	st_t = pc_stats_start(tdat->stats);
+	nb = pc_runs_eliminate(buf, tdat->rbytes);
+	pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, tdat->rbytes);
+	if (nb < 0)
+		return (0);
+	pc_progress_saved(pctx->progress, tdat->rbytes - nb);
+	tdat->rbytes = nb;
+	return (1);
+}
+
+/*
+ * Check whether the codec can be skipped for a chunk. That is the case with
+ * the 'none' algorithm and for data whose sampled order-0 entropy is close
+ * to 8 bits per byte, like JPEG, MP4 or already compressed files.
+ */
+static int
+chunk_incompressible(pc_ctx_t *pctx, struct cmp_data *tdat, uchar_t *buf, uint64_t len)
+{
+	uint64_t st_t;
+	double ent;
+
+	if (tdat->compress == none_compress && !pctx->preprocess_mode)
+		return (1);
+	if (pctx->no_entropy_skip || len < INCOMPRESSIBLE_MIN)
+		return (0);
+	st_t = pc_stats_start(tdat->stats);
+	ent = analyze_buffer_entropy(buf, len);
+	pc_stats_end(tdat->stats, PC_STAGE_ANALYZE, st_t, len);
+	return (ent >= INCOMPRESSIBLE_ENTROPY);
+}
+
 static void *
 perform_compress(void *dat) {
-	struct cmp_data *tdat = (struct cmp_data *)dat;
+	struct cmp_thread *wt = (struct cmp_thread *)dat;
+	struct cmp_data *tdat;
 	typeof (tdat->chunksize) _chunksize, len_cmp, dedupe_index_sz, index_size_cmp;
-	int type, rv;
-	uchar_t *compressed_chunk;
+	int type, rv, runs;
+	uchar_t *compressed_chunk, *crypt_src;
 	int64_t rbytes;
+	uint64_t st_t, prog_st;
+	double work_st;
 	pc_ctx_t *pctx;
-
-	pctx = tdat->pctx;
+	char tname[32];
+
+	pc_numa_bind(wt->numa_node);
+	set_chunk_threads(1);
+	snprintf(tname, sizeof (tname), "worker-%d", wt->id);
+	pc_trace_thread(tname);
+	if (wt->pctx->cpu_share)
+		pc_throttle_background();
 redo:
-	Sem_Wait(&tdat->start_sem);
-	if (unlikely(tdat->cancel)) {
-		tdat->len_cmp = 0;
-		Sem_Post(&tdat->cmp_done_sem);
+	tdat = chunk_queue_get_codec(wt->queue, wt->codec);
+	if (tdat == NULL)
 		return (0);
-	}
+	wt->codec = tdat->codec;
+	slab_tmp_reset();
+
+	/*
+	 * Session workers can take chunks of several files in a batch so the
+	 * context comes with the chunk.
+	 */
+	pctx = tdat->pctx;
+	chunk_attach_worker(wt, tdat);
+	if (pctx->_prefix_func != NULL)
+		pctx->_prefix_func(tdat->data, tdat->prefix, tdat->prefix_len);
+	pc_throttle_enter(pctx->throttle);
+	prog_st = pc_progress_start(pctx->progress);
+	chunk_threads_begin(pctx, wt);
+	work_st = 0;
+	if (pctx->chunk_auto)
+		work_st = get_wtime_millis();
 
 	compressed_chunk = tdat->compressed_chunk + CHUNK_FLAG_SZ;
+	crypt_src = compressed_chunk;
 	rbytes = tdat->rbytes;
 	dedupe_index_sz = 0;
 	type = COMPRESSED;
+	tdat->passthrough = 0;
 
 	/* Perform Dedup if enabled. */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
@@ -1837,27 +5284,53 @@ redo:
 		 * into uncompressed_chunk so that compress transforms uncompressed_chunk
 		 * back into cmp_seg. Avoids an extra memcpy().
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type) {
+			st_t = pc_stats_start(tdat->stats);
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->cmp_seg, tdat->rbytes,
 					 tdat->cksum_mt, 1);
+			pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, tdat->rbytes);
+		}
+		if ((runs = chunk_runs_eliminate(pctx, tdat, tdat->cmp_seg)) != 0)
+			rb = rbytes = tdat->rbytes;
 
+		st_t = pc_stats_start(tdat->stats);
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->uncompressed_chunk;
+		rctx->stats = (tdat->stats ? &tdat->stats->dd : NULL);
 		dedupe_index_sz = dedupe_compress(tdat->rctx, tdat->cmp_seg, &rb, 0,
 						  NULL, tdat->cksum_mt);
+		pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, tdat->rbytes);
 		tdat->rbytes = rb;
 		if (!rctx->valid) {
-			memcpy(tdat->uncompressed_chunk, tdat->cmp_seg, rbytes);
+			uchar_t *tmp;
+
+			/*
+			 * Nothing deduped. Both buffers are of the same size so they
+			 * trade places instead of copying the data over.
+			 */
+			tmp = tdat->uncompressed_chunk;
+			tdat->uncompressed_chunk = tdat->cmp_seg;
+			tdat->cmp_seg = tmp;
+			tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
+			    pctx->cksum_bytes + pctx->mac_bytes;
+			compressed_chunk = tdat->compressed_chunk + CHUNK_FLAG_SZ;
+			crypt_src = compressed_chunk;
 			tdat->rbytes = rbytes;
+		} else if (rb < (uint64_t)rbytes) {
+			pc_progress_saved(pctx->progress, rbytes - rb);
 		}
 	} else {
 		/*
 		 * Compute checksum of original uncompressed chunk.
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type) {
+			st_t = pc_stats_start(tdat->stats);
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->uncompressed_chunk,
 					 tdat->rbytes, tdat->cksum_mt, 1);
+			pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, tdat->rbytes);
+		}
+		runs = chunk_runs_eliminate(pctx, tdat, tdat->uncompressed_chunk);
 	}
 
 	/*
@@ -1866,11 +5339,31 @@ redo:
 	 * reducing compression effectiveness of the data chunk. So we separate them.
 	 */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && tdat->rctx->valid) {
-		uint64_t o_chunksize;
+		uint64_t o_chunksize, index_flag;
 		_chunksize = tdat->rbytes - dedupe_index_sz - RABIN_HDR_SIZE;
 		index_size_cmp = dedupe_index_sz;
+		index_flag = 0;
 		rv = 0;
 
+		/*
+		 * The index is normally stored with the index coder, which is
+		 * much cheaper to decode than LZMA. LZMA on the transposed
+		 * index is only used if the coder does not shrink it.
+		 */
+		if (dedupe_index_sz >= 90) {
+			st_t = pc_stats_start(tdat->stats);
+			index_size_cmp = dedupe_index_sz - 1;
+			rv = dedupe_index_encode(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
+			    dedupe_index_sz, compressed_chunk + RABIN_HDR_SIZE, &index_size_cmp);
+			pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, 0);
+			if (rv == 0) {
+				index_flag = RABIN_INDEX_CODED;
+				goto coded_index;
+			}
+			index_size_cmp = dedupe_index_sz;
+			rv = 0;
+		}
+
 		/*
 		 * Do a matrix transpose of the index table with the hope of improving
 		 * compression ratio subsequently.
@@ -1883,10 +5376,12 @@ redo:
 
 		if (dedupe_index_sz >= 90) {
 			/* Compress index if it is at least 90 bytes. */
+			st_t = pc_stats_start(tdat->stats);
 			rv = lzma_compress(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
 			    dedupe_index_sz, compressed_chunk + RABIN_HDR_SIZE,
 			    &index_size_cmp, tdat->rctx->level, 255, TYPE_BINARY,
 			    tdat->rctx->lzma_data);
+			pc_stats_end(tdat->stats, PC_STAGE_DEDUPE, st_t, 0);
 
 			/* 
 			 * If index compression fails or does not produce a smaller result
@@ -1903,26 +5398,31 @@ plain_index:
 			    tdat->uncompressed_chunk + RABIN_HDR_SIZE, dedupe_index_sz);
 		}
 
+coded_index:
 		index_size_cmp += RABIN_HDR_SIZE;
 		dedupe_index_sz += RABIN_HDR_SIZE;
 		memcpy(compressed_chunk, tdat->uncompressed_chunk, RABIN_HDR_SIZE);
 		o_chunksize = _chunksize;
 
 		/* Compress data chunk. */
-		if (_chunksize == 0) {
+		if (_chunksize == 0 || chunk_incompressible(pctx, tdat,
+		    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize)) {
 			rv = -1;
 		} else if (pctx->preprocess_mode) {
 			rv = preproc_compress(pctx, tdat->compress,
 			    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize,
 			    compressed_chunk + index_size_cmp, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			    tdat->btype, tdat->data, tdat->props, tdat->interesting,
+			    tdat->stats);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
 			DEBUG_STAT_EN(strt = get_wtime_millis());
+			st_t = pc_stats_start(tdat->stats);
 			rv = tdat->compress(tdat->uncompressed_chunk + dedupe_index_sz,
 			    _chunksize, compressed_chunk + index_size_cmp, &_chunksize,
 			    tdat->level, 0, tdat->btype, tdat->data);
+			pc_stats_end(tdat->stats, PC_STAGE_CODEC, st_t, o_chunksize);
 			DEBUG_STAT_EN(en = get_wtime_millis());
 			DEBUG_STAT_EN(fprintf(stderr, "Chunk compression speed %.3f MB/s\n",
 					      get_mb_s(_chunksize, strt, en)));
@@ -1934,23 +5434,30 @@ plain_index:
 			type = UNCOMPRESSED;
 			memcpy(compressed_chunk + index_size_cmp,
 			    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize);
+			pc_stats_copy(tdat->stats, _chunksize);
 		}
 		/* Now update rabin header with the compressed sizes. */
-		update_dedupe_hdr(compressed_chunk, index_size_cmp - RABIN_HDR_SIZE, _chunksize);
+		update_dedupe_hdr(compressed_chunk, (index_size_cmp - RABIN_HDR_SIZE) | index_flag,
+		    _chunksize);
 		_chunksize += index_size_cmp;
 	} else {
 		_chunksize = tdat->rbytes;
-		if (pctx->preprocess_mode) {
+		if (chunk_incompressible(pctx, tdat, tdat->uncompressed_chunk, tdat->rbytes)) {
+			rv = -1;
+		} else if (pctx->preprocess_mode) {
 			rv = preproc_compress(pctx, tdat->compress, tdat->uncompressed_chunk,
 			    tdat->rbytes, compressed_chunk, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			    tdat->btype, tdat->data, tdat->props, tdat->interesting,
+			    tdat->stats);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
 			DEBUG_STAT_EN(strt = get_wtime_millis());
+			st_t = pc_stats_start(tdat->stats);
 			rv = tdat->compress(tdat->uncompressed_chunk, tdat->rbytes,
 			    compressed_chunk, &_chunksize, tdat->level, 0, tdat->btype,
 			    tdat->data);
+			pc_stats_end(tdat->stats, PC_STAGE_CODEC, st_t, tdat->rbytes);
 			DEBUG_STAT_EN(en = get_wtime_millis());
 			DEBUG_STAT_EN(fprintf(stderr, "Chunk compression speed %.3f MB/s\n",
 					      get_mb_s(_chunksize, strt, en)));
@@ -1968,20 +5475,32 @@ plain_index:
 	 * later on compression does not happen. So we have to retain information
 	 * that E8E9 hapened, to recover the data correctly. In this corner case
 	 * the chunk size is increased by 1 byte for the preproc header.
+	 *
+	 * Unless it has to be encrypted an uncompressed chunk is not copied.
+	 * The writer sends the data from uncompressed_chunk between the header
+	 * and the trailer in cmp_seg.
 	 */
 	tdat->len_cmp = _chunksize;
 	if ((_chunksize >= tdat->rbytes && !pctx->preprocess_mode) || rv < 0) {
-		if (!(pctx->enable_rabin_scan || pctx->enable_fixed_scan) || !tdat->rctx->valid)
-			memcpy(compressed_chunk, tdat->uncompressed_chunk, tdat->rbytes);
+		if (!(pctx->enable_rabin_scan || pctx->enable_fixed_scan) || !tdat->rctx->valid) {
+			if (pctx->encrypt_type && crypto_is_aead(&(pctx->crypto_ctx)))
+				crypt_src = tdat->uncompressed_chunk;
+			else if (pctx->encrypt_type) {
+				memcpy(compressed_chunk, tdat->uncompressed_chunk, tdat->rbytes);
+				pc_stats_copy(tdat->stats, tdat->rbytes);
+			} else
+				tdat->passthrough = 1;
+		}
 		type = UNCOMPRESSED;
 		tdat->len_cmp = tdat->rbytes;
 		if (rv < 0) rv = COMPRESS_NONE;
 	}
 
 	/*
-	 * Now perform encryption on the compressed data, if requested.
+	 * Now perform encryption on the compressed data, if requested. AEAD
+	 * encryption is done along with authentication once the header is done.
 	 */
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && !crypto_is_aead(&(pctx->crypto_ctx))) {
 		int ret;
 		DEBUG_STAT_EN(double strt, en);
 
@@ -1990,8 +5509,10 @@ plain_index:
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		st_t = pc_stats_start(tdat->stats);
 		ret = crypto_buf(&(pctx->crypto_ctx), compressed_chunk, compressed_chunk,
 			tdat->len_cmp, tdat->id);
+		pc_stats_end(tdat->stats, PC_STAGE_CRYPTO, st_t, tdat->len_cmp);
 		if (ret == -1) {
 			/*
 			 * Encryption failure is fatal.
@@ -1999,7 +5520,7 @@ plain_index:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
+			Hsem_Post(&tdat->cmp_done_sem);
 			return (0);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
@@ -2013,6 +5534,9 @@ plain_index:
 	if (pctx->preprocess_mode) {
 		type |= CHUNK_FLAG_PREPROC;
 	}
+	if (runs) {
+		type |= CHUNK_FLAG_RUNS;
+	}
 
 	/*
 	 * Insert compressed chunk length and checksum into chunk header.
@@ -2050,9 +5574,44 @@ plain_index:
 	*(tdat->compressed_chunk) = type;
 
 	/*
-	 * If encrypting, compute HMAC for full chunk including header.
+	 * With AEAD encryption the chunk data is encrypted and authenticated
+	 * along with the header and trailing size in one pass. The tag takes
+	 * the place of the HMAC.
 	 */
-	if (pctx->encrypt_type) {
+	if (pctx->encrypt_type && crypto_is_aead(&(pctx->crypto_ctx))) {
+		uchar_t aad[COMPRESSED_CHUNKSZ + CKSUM_MAX_BYTES * 2 + CHUNK_FLAG_SZ +
+		    ORIGINAL_CHUNKSZ];
+		uchar_t *mac_ptr;
+		uint64_t dlen;
+		int aadlen, ret;
+
+		st_t = pc_stats_start(tdat->stats);
+		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
+		memset(mac_ptr, 0, pctx->mac_bytes);
+		memcpy(aad, tdat->cmp_seg, rbytes);
+		aadlen = rbytes;
+		dlen = tdat->len_cmp - rbytes;
+		if (type & CHSIZE_MASK) {
+			dlen -= ORIGINAL_CHUNKSZ;
+			memcpy(aad + aadlen, tdat->cmp_seg + tdat->len_cmp - ORIGINAL_CHUNKSZ,
+			    ORIGINAL_CHUNKSZ);
+			aadlen += ORIGINAL_CHUNKSZ;
+		}
+		ret = crypto_aead_buf(&(pctx->crypto_ctx), crypt_src, compressed_chunk, dlen,
+		    tdat->id, aad, aadlen, mac_ptr);
+		pc_stats_end(tdat->stats, PC_STAGE_CRYPTO, st_t, dlen);
+		if (ret == -1) {
+			/*
+			 * Encryption failure is fatal.
+			 */
+			pctx->main_cancel = 1;
+			tdat->len_cmp = 0;
+			pctx->t_errored = 1;
+			Hsem_Post(&tdat->cmp_done_sem);
+			return (0);
+		}
+
+	} else if (pctx->encrypt_type) {
 		uchar_t *mac_ptr;
 		unsigned int hlen;
 		uchar_t chash[pctx->mac_bytes];
@@ -2060,12 +5619,24 @@ plain_index:
 
 		/* Clean out mac_bytes to 0 for stable HMAC. */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		st_t = pc_stats_start(tdat->stats);
 		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
 		memset(mac_ptr, 0, pctx->mac_bytes);
-		hmac_reinit(&tdat->chunk_hmac);
-		hmac_update(&tdat->chunk_hmac, tdat->cmp_seg, tdat->len_cmp);
-		hmac_final(&tdat->chunk_hmac, chash, &hlen);
+		hmac_reinit(tdat->chunk_hmac);
+		if (pctx->mac_tree) {
+			uint64_t hsz;
+
+			hsz = COMPRESSED_CHUNKSZ + pctx->cksum_bytes + pctx->mac_bytes +
+			    CHUNK_FLAG_SZ;
+			hmac_update(tdat->chunk_hmac, tdat->cmp_seg, hsz);
+			hmac_tree_update(tdat->chunk_hmac, tdat->cmp_seg + hsz,
+			    tdat->len_cmp - hsz, tdat->cksum_mt);
+		} else {
+			hmac_update(tdat->chunk_hmac, tdat->cmp_seg, tdat->len_cmp);
+		}
+		hmac_final(tdat->chunk_hmac, chash, &hlen);
 		serialize_checksum(chash, mac_ptr, hlen);
+		pc_stats_end(tdat->stats, PC_STAGE_CKSUM, st_t, tdat->len_cmp);
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Computation speed %.3f MB/s\n",
 			      get_mb_s(tdat->len_cmp, strt, en)));
@@ -2086,26 +5657,363 @@ plain_index:
 		U32_P(mac_ptr) = htonl(crc);
 	}
 
-	Sem_Post(&tdat->cmp_done_sem);
+	if (pctx->chunk_auto)
+		tdat->work_ms = get_wtime_millis() - work_st;
+	chunk_threads_end(pctx);
+	pc_progress_busy(pctx->progress, wt->id, prog_st);
+	pc_throttle_leave(pctx->throttle);
+	Hsem_Post(&tdat->cmp_done_sem);
+	if (pctx->chunk_done_wait)
+		Sem_Post(&pctx->chunk_done_sem);
 	goto redo;
 }
 
+/*
+ * Describe the bytes of a finished chunk. A passthrough chunk has its data in
+ * uncompressed_chunk, between the header and the optional trailer in cmp_seg.
+ */
+static int
+chunk_iov(struct cmp_data *tdat, struct iovec *iov)
+{
+	uint64_t hdr;
+
+	if (!tdat->passthrough) {
+		iov[0].iov_base = tdat->cmp_seg;
+		iov[0].iov_len = tdat->len_cmp;
+		return (1);
+	}
+	hdr = tdat->compressed_chunk + CHUNK_FLAG_SZ - tdat->cmp_seg;
+	iov[0].iov_base = tdat->cmp_seg;
+	iov[0].iov_len = hdr;
+	iov[1].iov_base = tdat->uncompressed_chunk;
+	iov[1].iov_len = tdat->rbytes;
+	if (tdat->len_cmp == hdr + tdat->rbytes)
+		return (2);
+	iov[2].iov_base = tdat->cmp_seg + hdr + tdat->rbytes;
+	iov[2].iov_len = tdat->len_cmp - hdr - tdat->rbytes;
+	return (3);
+}
+
+static int64_t
+chunk_write(pc_ctx_t *pctx, int fd, struct cmp_data *tdat)
+{
+	struct iovec iov[3];
+	int n;
+
+	n = chunk_iov(tdat, iov);
+	if (n == 1)
+		return (out_write(pctx, fd, tdat->cmp_seg, tdat->len_cmp));
+	return (out_writev(pctx, fd, iov, n));
+}
+
+/*
+ * Wait for the deferred checksum verification of a decompressed chunk that
+ * has already been written out. Returns -1 if the chunk is corrupt.
+ */
+static int
+chunk_verify_wait(struct cmp_data *tdat)
+{
+	if (!tdat->verify_pending)
+		return (0);
+	Hsem_Wait(&tdat->verify_sem);
+	tdat->verify_pending = 0;
+	return (tdat->verify_ok ? 0 : -1);
+}
+
+/*
+ * Slot the writer goes to after slot p. Decompression can change the number of
+ * slots in the ring at a wrap, see slot_auto_round(), so the dispatcher marks
+ * the last slot of every round. This has to be read before the slot is handed
+ * back to the dispatcher.
+ */
+static inline int
+slot_next(struct wdata *w, int p)
+{
+	if (w->dary[p]->ring_wrap)
+		return (0);
+	return ((p + 1) % w->nslots);
+}
+
+/*
+ * Writer variant that gathers chunks already done in the following slots, up to
+ * the batch byte budget, and writes them with one writev() or io_uring
+ * submission.
+ */
 static void *
-writer_thread(void *dat) {
+writer_batched(struct wdata *w)
+{
+	struct cmp_data *batch[WRITE_BATCH_MAX], *tdat;
+	struct iovec iov[WRITE_BATCH_MAX * 3];
+	uchar_t *bufs[WRITE_BATCH_MAX * 3];
+	uint64_t lens[WRITE_BATCH_MAX * 3], total;
+	int64_t done[WRITE_BATCH_MAX * 3];
+	int i, n, p, q, maxn, err, niov;
+	uint64_t st_t;
+	double wr_st;
+	pc_ctx_t *pctx;
+
+	pctx = w->pctx;
+	maxn = w->nslots;
+	if (maxn > WRITE_BATCH_MAX)
+		maxn = WRITE_BATCH_MAX;
+	p = 0;
+	for (;;) {
+		tdat = w->dary[p];
+		Hsem_Wait(&tdat->cmp_done_sem);
+		if (tdat->len_cmp == 0) {
+			batch[0] = tdat;
+			n = 1;
+			goto do_cancel;
+		}
+		n = 0;
+		niov = 0;
+		total = 0;
+		q = p;
+		do {
+			batch[n] = tdat;
+			niov += chunk_iov(tdat, &iov[niov]);
+			total += tdat->len_cmp;
+			n++;
+			q = slot_next(w, q);
+			if (n == maxn || total >= w->batch_bytes)
+				break;
+			tdat = w->dary[q];
+			if (Hsem_TryWait(&tdat->cmp_done_sem) != 0)
+				break;
+			if (tdat->len_cmp == 0) {
+				/* Leave the end marker for the next round. */
+				Hsem_Post(&tdat->cmp_done_sem);
+				break;
+			}
+		} while (1);
+
+		err = 0;
+		pthread_mutex_lock(&pctx->write_mutex);
+		for (i = 0; i < n; i++) {
+			tdat = batch[i];
+			if (pctx->do_compress) {
+				if (tdat->len_cmp > pctx->largest_chunk)
+					pctx->largest_chunk = tdat->len_cmp;
+				if (tdat->len_cmp < pctx->smallest_chunk)
+					pctx->smallest_chunk = tdat->len_cmp;
+				pctx->avg_chunk += tdat->len_cmp;
+			}
+			if ((pctx->chunk_index || pctx->ckpt_fd != -1) && pctx->do_compress) {
+				if (chunk_index_add(pctx, tdat) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot grow chunk index ");
+					pctx->t_errored = 1;
+					err = 1;
+					break;
+				}
+			}
+			pctx->comp_offset += tdat->len_cmp;
+		}
+		st_t = pc_stats_start(w->stats);
+		wr_st = (pctx->slot_auto ? get_wtime_millis() : 0);
+		if (!err && w->ring) {
+			for (i = 0; i < niov; i++) {
+				bufs[i] = (uchar_t *)iov[i].iov_base;
+				lens[i] = iov[i].iov_len;
+			}
+			if (pc_uring_rw(w->ring, 1, w->wfd, bufs, lens, done, niov) == -1) {
+				log_msg(LOG_ERR, 1, "Chunk Write ");
+				err = 1;
+			}
+		} else if (!err) {
+			if (out_writev(pctx, w->wfd, iov, niov) != (int64_t)total) {
+				log_msg(LOG_ERR, 1, "Chunk Write (expected: %" PRIu64 ") : ", total);
+				err = 1;
+			}
+		}
+		if (!err)
+			pc_stats_end(w->stats, PC_STAGE_WRITE, st_t, total);
+		pthread_mutex_unlock(&pctx->write_mutex);
+		if (pctx->slot_auto && total > 0) {
+			/* Split the batch time by chunk size. */
+			wr_st = get_wtime_millis() - wr_st;
+			for (i = 0; i < n; i++)
+				batch[i]->write_ms = wr_st * batch[i]->len_cmp / total;
+		}
+		for (i = 0; i < n; i++) {
+			if (chunk_verify_wait(batch[i]) == -1)
+				err = 1;
+		}
+		if (err)
+			goto do_cancel;
+		for (i = 0; i < n; i++) {
+			tdat = batch[i];
+			pc_progress_update(pctx->progress, tdat->uncomp_len, tdat->len_cmp);
+			if (tdat->decompressing && pctx->enable_rabin_global)
+				dedupe_durable_advance(tdat->cmp_seg, tdat->len_cmp);
+			Hsem_Post(&tdat->write_done_sem);
+		}
+		ckpt_update(pctx, w->wfd, 0);
+		p = q;
+	}
+
+do_cancel:
+	pctx->main_cancel = 1;
+	for (i = 0; i < n; i++) {
+		tdat = batch[i];
+		if (tdat->decompressing && pctx->enable_rabin_global)
+			dedupe_durable_abort();
+		else if (tdat->index_sem_next && pctx->enable_rabin_global) {
+			dedupe_index_abort();
+			Hsem_Post(tdat->index_sem_next);
+		}
+		Hsem_Post(&tdat->write_done_sem);
+	}
+	return (0);
+}
+
+/*
+ * Hand back the slots of spliced chunks whose bytes the pipe reader has
+ * consumed, oldest first, until at most keep of them are left. Waits for the
+ * reader if needed. If the reader has gone away nothing will read the slots
+ * any more and all of them are handed back.
+ */
+static void
+splice_release(struct wdata *w, uint64_t *end, int *rel, int *npend, uint64_t total,
+    int keep)
+{
+	int64_t unread;
 	int p;
+
+	while (*npend > 0) {
+		unread = pipe_unread(w->wfd);
+		while (*npend > 0 && (unread == -1 || ((uint64_t)unread <= total &&
+		    end[*rel] <= total - unread))) {
+			p = *rel;
+			*rel = slot_next(w, p);
+			end[p] = 0;
+			Hsem_Post(&(w->dary[p]->write_done_sem));
+			(*npend)--;
+		}
+		if (*npend <= keep)
+			break;
+		usleep(SPLICE_POLL_US);
+	}
+}
+
+/*
+ * Writer variant for decompression into a pipe. Instead of copying every
+ * chunk into the pipe with write(), its pages are mapped into the pipe with
+ * vmsplice(). The pipe reads the slot buffer only when the reader gets to it,
+ * so a slot is handed back for reuse once the reader has consumed all of its
+ * bytes and not when the call returns. Since vmsplice() only returns when the
+ * pipe has room for the last pages, that is usually right away. end holds the
+ * pipe offset at which each slot's bytes end, or 0 if the slot is not pending.
+ */
+static void *
+writer_spliced(struct wdata *w, uint64_t *end)
+{
+	struct cmp_data *tdat;
+	struct iovec iov[3];
+	uint64_t total, st_t;
+	double wr_st;
+	int p, rel, npend, niov;
+	int64_t wbytes;
+	pc_ctx_t *pctx;
+
+	pctx = w->pctx;
+	total = 0;
+	rel = 0;
+	npend = 0;
+	for (p = 0; ; ) {
+		while (end[p] != 0)
+			splice_release(w, end, &rel, &npend, total, npend - 1);
+		tdat = w->dary[p];
+		Hsem_Wait(&tdat->cmp_done_sem);
+		if (tdat->len_cmp == 0)
+			goto do_cancel;
+
+		niov = chunk_iov(tdat, iov);
+		pthread_mutex_lock(&pctx->write_mutex);
+		st_t = pc_stats_start(w->stats);
+		wr_st = (pctx->slot_auto ? get_wtime_millis() : 0);
+		wbytes = Vmsplice(w->wfd, iov, niov);
+		if (pctx->slot_auto)
+			tdat->write_ms = get_wtime_millis() - wr_st;
+		pc_stats_end(w->stats, PC_STAGE_WRITE, st_t, tdat->len_cmp);
+		if (wbytes > 0)
+			pctx->comp_offset += wbytes;
+		pthread_mutex_unlock(&pctx->write_mutex);
+		if (unlikely(wbytes != tdat->len_cmp)) {
+			log_msg(LOG_ERR, 1, "Chunk Write (expected: %" PRIu64
+			    ", written: %" PRId64 ") : ", tdat->len_cmp, wbytes);
+			goto do_cancel;
+		}
+		pc_progress_update(pctx->progress, tdat->uncomp_len, wbytes);
+		if (chunk_verify_wait(tdat) == -1)
+			goto do_cancel;
+		if (tdat->decompressing && pctx->enable_rabin_global)
+			dedupe_durable_advance(tdat->cmp_seg, tdat->len_cmp);
+		total += wbytes;
+		end[p] = total;
+		npend++;
+		p = slot_next(w, p);
+		splice_release(w, end, &rel, &npend, total, w->nslots);
+	}
+
+do_cancel:
+	pctx->main_cancel = 1;
+	if (tdat->decompressing && pctx->enable_rabin_global)
+		dedupe_durable_abort();
+	/*
+	 * The slot buffers are freed after this, so let the reader finish all of
+	 * the pipe including a partly spliced chunk.
+	 */
+	while (pipe_unread(w->wfd) > 0)
+		usleep(SPLICE_POLL_US);
+	splice_release(w, end, &rel, &npend, total, 0);
+	Hsem_Post(&tdat->write_done_sem);
+	free(end);
+	return (0);
+}
+
+static uint64_t
+write_batch_bytes(void)
+{
+	char *val;
+
+	if ((val = getenv("PCOMPRESS_WRITE_BATCH")) != NULL)
+		return (strtoull(val, NULL, 0));
+	return (WRITE_BATCH_BYTES);
+}
+
+static void *
+writer_thread(void *dat) {
+	int p, next;
 	struct wdata *w = (struct wdata *)dat;
 	struct cmp_data *tdat;
 	int64_t wbytes;
+	uint64_t st_t;
+	double wr_st;
 	pc_ctx_t *pctx;
 
 	pctx = w->pctx;
-repeat:
-	for (p = 0; p < w->nprocs; p++) {
+	pc_trace_thread("writer");
+	if (pctx->cpu_share)
+		pc_throttle_background();
+	if (w->splice) {
+		uint64_t *end;
+
+		end = (uint64_t *)calloc(w->nslots, sizeof (uint64_t));
+		if (end != NULL)
+			return (writer_spliced(w, end));
+		log_msg(LOG_WARN, 0, "Out of memory, not using vmsplice");
+	}
+	if ((w->ring || w->batch_bytes > 0) && pctx->archive_temp_fd == -1 &&
+	    !pctx->range_mode && pctx->pwrite_fd == -1 &&
+	    !(pctx->archive_mode && !pctx->do_compress))
+		return (writer_batched(w));
+	for (p = 0; ; p = next) {
 		tdat = w->dary[p];
-		Sem_Wait(&tdat->cmp_done_sem);
+		Hsem_Wait(&tdat->cmp_done_sem);
 		if (tdat->len_cmp == 0) {
 			goto do_cancel;
 		}
+		wr_st = (pctx->slot_auto ? get_wtime_millis() : 0);
 
 		if (pctx->do_compress) {
 			if (tdat->len_cmp > pctx->largest_chunk)
@@ -2116,33 +6024,179 @@ repeat:
 		}
 
 		if (pctx->archive_mode && tdat->decompressing) {
+			st_t = pc_stats_start(w->stats);
 			wbytes = archiver_write(pctx, tdat->cmp_seg, tdat->len_cmp);
+			pc_stats_end(w->stats, PC_STAGE_WRITE, st_t, tdat->len_cmp);
+		} else if (pctx->range_mode && tdat->decompressing) {
+			st_t = pc_stats_start(w->stats);
+			wbytes = chunk_range_copy(pctx, tdat);
+			pc_stats_end(w->stats, PC_STAGE_WRITE, st_t, tdat->len_cmp);
+		} else if (pctx->pwrite_fd != -1 && tdat->decompressing) {
+			/* Already written by the decompression thread. */
+			wbytes = tdat->len_cmp;
 		} else {
 			pthread_mutex_lock(&pctx->write_mutex);
-			wbytes = Write(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+			if ((pctx->chunk_index || pctx->ckpt_fd != -1) && pctx->do_compress) {
+				if (chunk_index_add(pctx, tdat) == -1) {
+					pthread_mutex_unlock(&pctx->write_mutex);
+					log_msg(LOG_ERR, 1, "Cannot grow chunk index ");
+					pctx->t_errored = 1;
+					goto do_cancel;
+				}
+			}
+			st_t = pc_stats_start(w->stats);
+			wbytes = chunk_write(pctx, w->wfd, tdat);
+			pc_stats_end(w->stats, PC_STAGE_WRITE, st_t, tdat->len_cmp);
+			if (wbytes > 0)
+				pctx->comp_offset += wbytes;
 			pthread_mutex_unlock(&pctx->write_mutex);
+			if (wbytes == tdat->len_cmp)
+				pc_progress_update(pctx->progress, tdat->uncomp_len, wbytes);
+		}
+		if (pctx->slot_auto)
+			tdat->write_ms = get_wtime_millis() - wr_st;
+		if (chunk_verify_wait(tdat) == -1)
+			goto do_cancel;
+		if (pctx->range_mode && tdat->decompressing && pctx->chunk_cache != NULL &&
+		    tdat->cache_ent == NULL && wbytes == tdat->len_cmp) {
+			pc_cache_put(pctx->chunk_cache, pctx->cache_fid, tdat->id,
+			    tdat->cmp_seg, tdat->len_cmp);
 		}
+		if (wbytes == tdat->len_cmp)
+			ckpt_update(pctx, w->wfd, 0);
 		if (pctx->archive_temp_fd != -1 && wbytes == tdat->len_cmp) {
-			wbytes = Write(pctx->archive_temp_fd, tdat->cmp_seg, tdat->len_cmp);
+			wbytes = chunk_write(pctx, pctx->archive_temp_fd, tdat);
 		}
 		if (unlikely(wbytes != tdat->len_cmp)) {
 			log_msg(LOG_ERR, 1, "Chunk Write (expected: %" PRIu64
 			    ", written: %" PRId64 ") : ", tdat->len_cmp, wbytes);
 do_cancel:
 			pctx->main_cancel = 1;
-			tdat->cancel = 1;
-			Sem_Post(&tdat->start_sem);
-			if (tdat->rctx && pctx->enable_rabin_global)
-				Sem_Post(tdat->rctx->index_sem_next);
-			Sem_Post(&tdat->write_done_sem);
+			if (tdat->decompressing && pctx->enable_rabin_global)
+				dedupe_durable_abort();
+			else if (tdat->index_sem_next && pctx->enable_rabin_global) {
+				dedupe_index_abort();
+				Hsem_Post(tdat->index_sem_next);
+			}
+			Hsem_Post(&tdat->write_done_sem);
 			return (0);
 		}
-		if (tdat->decompressing && tdat->rctx && pctx->enable_rabin_global) {
-			Sem_Post(tdat->rctx->index_sem_next);
+		if (tdat->decompressing && pctx->enable_rabin_global) {
+			dedupe_durable_advance(tdat->cmp_seg, tdat->len_cmp);
 		}
-		Sem_Post(&tdat->write_done_sem);
+		if (pctx->range_mode && tdat->cache_ent != NULL) {
+			pc_cache_release(pctx->chunk_cache, tdat->cache_ent);
+			tdat->cache_ent = NULL;
+			tdat->cmp_seg = tdat->uncompressed_chunk;
+		}
+		next = slot_next(w, p);
+		Hsem_Post(&tdat->write_done_sem);
+	}
+}
+
+/*
+ * Stop the persistent workers of a compression session and release their
+ * algorithm and dedupe state. The session itself stays usable and starts new
+ * workers for the next file.
+ */
+static void
+session_stop_workers(pc_ctx_t *pctx)
+{
+	struct pc_session *sess = pctx->session;
+	uint32_t i;
+
+	if (sess == NULL || sess->wthr == NULL)
+		return;
+	for (i = 0; i < sess->nworkers; i++)
+		chunk_queue_put(&sess->queue, NULL);
+	for (i = 0; i < sess->nworkers; i++) {
+		struct cmp_thread *wt = &sess->wthr[i];
+
+		pthread_join(wt->thr, NULL);
+		destroy_dedupe_context(wt->rctx);
+		if (pctx->_deinit_func)
+			pctx->_deinit_func(&(wt->data));
+	}
+	slab_release(NULL, sess->wthr);
+	sess->wthr = NULL;
+	sess->nworkers = 0;
+	chunk_queue_destroy(&sess->queue);
+}
+
+/*
+ * Start nworkers compression threads for a session. The algorithm state is
+ * set up for the session chunk size so that it also covers every smaller
+ * chunk size used by later files.
+ */
+static int
+session_start_workers(pc_ctx_t *pctx, uint32_t nworkers, int level, int cnthreads)
+{
+	struct pc_session *sess = pctx->session;
+	uint32_t i;
+	int numa;
+
+	numa = pc_numa_init();
+	sess->wthr = (struct cmp_thread *)slab_calloc(NULL, nworkers,
+	    sizeof (struct cmp_thread));
+	if (!sess->wthr || chunk_queue_init(&sess->queue, (nworkers +
+	    CHUNK_SLOTS_EXTRA(nworkers)) * BATCH_FILES_INFLIGHT + nworkers) == -1) {
+		log_msg(LOG_ERR, 0, "3: Out of memory");
+		if (sess->wthr)
+			slab_release(NULL, sess->wthr);
+		sess->wthr = NULL;
+		return (-1);
+	}
+	sess->nworkers = 0;
+	sess->level = level;
+	sess->cnthreads = cnthreads;
+
+	for (i = 0; i < nworkers; i++) {
+		struct cmp_thread *wt = &sess->wthr[i];
+
+		wt->pctx = pctx;
+		wt->id = i;
+		wt->level = level;
+		wt->data = NULL;
+		wt->rctx = NULL;
+		wt->stats = NULL;
+		wt->codec = ADAPT_COMPRESS_NONE;
+		wt->numa_node = (numa ? pc_numa_node(i) : -1);
+		wt->queue = &sess->queue;
+		pc_numa_prefer(wt->numa_node);
+
+		if (pctx->_init_func) {
+			if (pctx->_init_func(&(wt->data), &(wt->level), cnthreads,
+			    sess->chunksize, VERSION, COMPRESS) != 0) {
+				pc_numa_prefer(-1);
+				session_stop_workers(pctx);
+				return (-1);
+			}
+		}
+		if (pthread_create(&(wt->thr), NULL, perform_compress,
+		    (void *)wt) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			if (pctx->_deinit_func)
+				pctx->_deinit_func(&(wt->data));
+			pc_numa_prefer(-1);
+			session_stop_workers(pctx);
+			return (-1);
+		}
+		sess->nworkers++;
+	}
+	pc_numa_prefer(-1);
+	return (0);
+}
+
+/*
+ * Let the next file of a batch start once this one has been read.
+ */
+static void
+batch_input_done(pc_ctx_t *pctx)
+{
+	if (pctx->batch_read_sem != NULL) {
+		Sem_Post(pctx->batch_read_sem);
+		pctx->batch_read_sem = NULL;
 	}
-	goto repeat;
 }
 
 /*
@@ -2159,14 +6213,30 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	char tmpfile1[MAXPATHLEN], tmpdir[MAXPATHLEN];
 	char to_filename[MAXPATHLEN];
 	uint64_t compressed_chunksize, n_chunksize, file_offset;
-	int64_t rbytes, rabin_count;
+	int64_t rbytes;
+	int interesting, btype;
+	struct rdahead *ra;
+	uchar_t *imap;
+	uint64_t imap_dropped;
 	unsigned short version, flags;
 	struct stat sbuf;
 	int compfd = -1, uncompfd = -1, err;
-	int thread, bail, single_chunk;
-	uint32_t i, nprocs, np, p, dedupe_flag;
+	int thread, bail, single_chunk, auto_chunks, shard_last;
+	struct chunk_auto ca;
+	struct chunk_plan *plan;
+	uint64_t split_size, next_size;
+	uint32_t i, nprocs, maxprocs, nslots, np, p, dedupe_flag;
 	struct cmp_data **dary = NULL, *tdat;
+	struct cmp_thread *wthr = NULL;
+	struct chunk_queue cq, *cqp;
+	struct pc_session *sess;
+	uint32_t nworkers;
 	pthread_t writer_thr;
+	pc_stats_t *stats;
+	const char *stats_json;
+	uint64_t stats_t0;
+	int tracing;
+	int numa;
 	uchar_t *cread_buf, *pos;
 	dedupe_context_t *rctx;
 	algo_props_t props;
@@ -2176,11 +6246,30 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	props.cksum = pctx->cksum;
 	props.buf_extra = 0;
 	cread_buf = NULL;
+	ra = NULL;
+	plan = NULL;
+	imap = NULL;
+	imap_dropped = 0;
+	file_offset = 0;
+	w.ring = NULL;
+	w.splice = 0;
 	pctx->btype = TYPE_UNKNOWN;
 	flags = 0;
 	sbuf.st_size = 0;
 	err = 0;
 	thread = 0;
+	nslots = 0;
+	cq.ent = NULL;
+	cqp = &cq;
+	sess = NULL;
+	nworkers = 0;
+	stats = NULL;
+	stats_t0 = 0;
+	w.stats = NULL;
+	pctx->file_rctx = NULL;
+	pctx->progress = NULL;
+	pctx->chunk_done_wait = 0;
+	pctx->chunk_num = 0;
 	dedupe_flag = RABIN_DEDUPE_SEGMENTED; // Silence the compiler
 	compressed_chunksize = 0;
 
@@ -2250,13 +6339,14 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 	single_chunk = 0;
+	shard_last = 1;
 	rctx = NULL;
 
 	/*
 	 * Get number of lCPUs. When archiving with advanced filters, we use one less
 	 * lCPU to reduce threads due to increased memory requirements.
 	 */
-	nprocs = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+	nprocs = (uint32_t)get_avail_cpus();
 	if (pctx->archive_mode && (pctx->enable_packjpg || pctx->enable_wavpack)) {
 		nprocs = nprocs > 1 ? nprocs-1:nprocs;
 	}
@@ -2266,6 +6356,19 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	else
 		pctx->nthreads = nprocs;
 
+	if (plan_mem_budget(pctx, &chunksize, level, COMPRESS) == -1)
+		return (1);
+	nprocs = pctx->nthreads;
+	maxprocs = nprocs;
+
+	/*
+	 * With -s auto chunksize is the upper bound used for buffers and the
+	 * file header. Global Dedupe segments depend on a fixed chunk size.
+	 */
+	auto_chunks = (pctx->chunk_auto && !pctx->enable_rabin_global);
+	chunk_auto_init(&ca, chunksize, pctx->min_chunk);
+	split_size = auto_chunks ? ca.cur : chunksize;
+
 	/* A host of sanity checks. */
 	if (!pctx->pipe_mode) {
 		char *tmp;
@@ -2304,8 +6407,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		 * This is not valid for archive mode since we cannot accurately estimate
 		 * final archive size.
 		 */
-		if (sbuf.st_size <= chunksize && !(pctx->archive_mode)) {
+		if (sbuf.st_size <= split_size && !(pctx->archive_mode)) {
 			chunksize = sbuf.st_size;
+			auto_chunks = 0;
 			pctx->enable_rabin_split = 0; // Do not split for whole files.
 			pctx->nthreads = 1;
 			single_chunk = 1;
@@ -2332,13 +6436,51 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				flags &= ~flg;
 			}
 		} else {
-			if (pctx->nthreads == 0 || pctx->nthreads > sbuf.st_size / chunksize) {
-				pctx->nthreads = (int)(sbuf.st_size / chunksize);
-				if (sbuf.st_size % chunksize)
+			if (pctx->nthreads == 0 || pctx->nthreads > sbuf.st_size / split_size) {
+				pctx->nthreads = (int)(sbuf.st_size / split_size);
+				if (sbuf.st_size % split_size)
 					pctx->nthreads++;
 			}
 		}
 
+		/*
+		 * A shard is cut with the chunk size of the whole file, which all
+		 * shards share with the header of the first one. Its input then
+		 * ends at the end of the shard.
+		 */
+		if (pctx->shard_mode) {
+			if (single_chunk || pctx->shard_off >= (uint64_t)sbuf.st_size) {
+				log_msg(LOG_ERR, 0, "Shard is past the end of %s or the "
+				    "file is too small to shard.", filename);
+				close(uncompfd);
+				return (1);
+			}
+			if (pctx->shard_len == 0 ||
+			    pctx->shard_len > sbuf.st_size - pctx->shard_off)
+				pctx->shard_len = sbuf.st_size - pctx->shard_off;
+			shard_last = (pctx->shard_off + pctx->shard_len == sbuf.st_size);
+			sbuf.st_size = pctx->shard_off + pctx->shard_len;
+		}
+
+		/*
+		 * Checkpoints are only kept for a plain file compressed into a file.
+		 * A single chunk has nothing to resume.
+		 */
+		if (pctx->ckpt_ms > 0 && (single_chunk || pctx->archive_mode ||
+		    pctx->append_mode || pctx->pipe_out || pctx->encrypt_type ||
+		    pctx->session != NULL || pctx->shard_mode)) {
+			if (pctx->resume) {
+				log_msg(LOG_ERR, 0, "Cannot resume: checkpoints are only "
+				    "kept for a file of more than one chunk compressed to a "
+				    "file, without '-a', '-U' or '-e'.");
+				COMP_BAIL;
+			}
+			if (!single_chunk)
+				log_msg(LOG_WARN, 0, "Checkpoints not supported with these "
+				    "options, PCOMPRESS_CHECKPOINT ignored.");
+			pctx->ckpt_ms = 0;
+		}
+
 		/*
 		 * Create a temporary file to hold compressed data which is renamed at
 		 * the end. The target file name is same as original file with the '.pz'
@@ -2366,13 +6508,13 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		}
 
 		if (pctx->pipe_out) {
-			compfd = fileno(stdout);
+			compfd = pctx->obj ? PC_OBJ_FD : PIPE_OUT_FD(pctx);
 			if (compfd == -1) {
 				log_msg(LOG_ERR, 1, "fileno ");
 				COMP_BAIL;
 			}
 		} else {
-			if (pctx->to_filename == NULL) {
+			if (pctx->to_filename == NULL && pctx->ckpt_ms == 0) {
 				strcat(tmpfile1, "/.pcompXXXXXX");
 				snprintf(to_filename, sizeof (to_filename), "%s" COMP_EXTN, filename);
 				if ((compfd = mkstemp(tmpfile1)) == -1) {
@@ -2381,17 +6523,44 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				}
 				add_fname(tmpfile1);
 			} else {
-				if (!endswith(pctx->to_filename, COMP_EXTN))
+				if (pctx->to_filename == NULL)
+					snprintf(to_filename, sizeof (to_filename),
+					    "%s" COMP_EXTN, filename);
+				else if (!endswith(pctx->to_filename, COMP_EXTN))
 					snprintf(to_filename, sizeof (to_filename),
 					    "%s" COMP_EXTN, pctx->to_filename);
 				else
 					snprintf(to_filename, sizeof (to_filename),
 					    "%s", pctx->to_filename);
-				if ((compfd = open(to_filename, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR)) == -1) {
-					log_msg(LOG_ERR, 1, "open ");
-					COMP_BAIL;
+				if (pctx->ckpt_ms > 0) {
+					/*
+					 * Output goes to <target>.part which is kept
+					 * on errors for a resume and renamed at the end.
+					 */
+					compfd = ckpt_open(pctx, to_filename, tmpfile1, &sbuf);
+					if (compfd == -1) {
+						COMP_BAIL;
+					}
+				} else if (pctx->append_mode) {
+					/*
+					 * Not registered for removal on a signal, the
+					 * archive existed before.
+					 */
+					if ((compfd = open(to_filename, O_RDWR, 0)) == -1) {
+						log_msg(LOG_ERR, 1, "open ");
+						COMP_BAIL;
+					}
+					if (append_open(pctx, compfd) != 0) {
+						COMP_BAIL;
+					}
+				} else {
+					if ((compfd = open(to_filename, O_CREAT|O_RDWR,
+					    S_IRUSR|S_IWUSR)) == -1) {
+						log_msg(LOG_ERR, 1, "open ");
+						COMP_BAIL;
+					}
+					add_fname(to_filename);
 				}
-				add_fname(to_filename);
 			}
 		}
 	} else {
@@ -2400,12 +6569,12 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		/*
 		 * Use stdin/stdout for pipe mode.
 		 */
-		compfd = fileno(stdout);
+		compfd = pctx->obj ? PC_OBJ_FD : PIPE_OUT_FD(pctx);
 		if (compfd == -1) {
 			log_msg(LOG_ERR, 1, "fileno ");
 			COMP_BAIL;
 		}
-		uncompfd = fileno(stdin);
+		uncompfd = PIPE_IN_FD(pctx);
 		if (uncompfd == -1) {
 			log_msg(LOG_ERR, 1, "fileno ");
 			COMP_BAIL;
@@ -2419,15 +6588,40 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		free(tmp);
 	}
 
+	/*
+	 * Fixed blocks default to the block size of the filesystem holding the
+	 * input, so that they line up with the blocks of VM images and the like
+	 * which are allocated at the same granularity.
+	 */
+	if (pctx->rab_blk_auto && !pctx->pipe_mode && !pctx->archive_mode) {
+		int b;
+
+		for (b = 0; b <= 5; b++) {
+			if (RAB_BLK_AVG_SZ(b) == sbuf.st_blksize) {
+				pctx->rab_blk_size = b;
+				break;
+			}
+		}
+	}
+
 	if (pctx->enable_rabin_global) {
 		my_sysinfo msys_info;
 
 		get_sys_limits(&msys_info);
+		if (pctx->mem_index_cap && msys_info.freeram > pctx->mem_index_cap)
+			msys_info.freeram = pctx->mem_index_cap;
 		global_dedupe_bufadjust(pctx->rab_blk_size, &chunksize, 0, pctx->algo,
 		    pctx->cksum, CKSUM_BLAKE256, sbuf.st_size, msys_info.freeram,
 		    pctx->nthreads, pctx->pipe_mode);
 	}
 
+	/*
+	 * Every chunk is a whole number of fixed blocks so that the blocks of
+	 * later chunks stay aligned to the file offsets of the input.
+	 */
+	if (pctx->enable_fixed_scan && !single_chunk)
+		chunksize -= chunksize % RAB_BLK_AVG_SZ(pctx->rab_blk_size);
+
 	/*
 	 * Compressed buffer size must include zlib/dedup scratch space and
 	 * chunk header space.
@@ -2446,8 +6640,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	compressed_chunksize += chunksize + CHUNK_HDR_SZ + zlib_buf_extra(chunksize);
 	if (pctx->_props_func) {
 		pctx->_props_func(&props, level, chunksize);
-		if (chunksize + props.buf_extra > compressed_chunksize) {
-			compressed_chunksize += (chunksize + props.buf_extra - 
+		if (chunksize + CHUNK_HDR_SZ + props.buf_extra > compressed_chunksize) {
+			compressed_chunksize += (chunksize + CHUNK_HDR_SZ + props.buf_extra -
 			    compressed_chunksize);
 		}
 	}
@@ -2472,27 +6666,189 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		}
 	}
 
+	/*
+	 * Plan the chunks of a regular file with a first pass over it. Global
+	 * Dedupe segments depend on a fixed chunk size.
+	 */
+	if (pctx->chunk_plan && !pctx->pipe_mode && !pctx->archive_mode && !single_chunk &&
+	    !pctx->enable_rabin_global) {
+		plan = chunk_plan_build(uncompfd, sbuf.st_size, pctx->min_chunk);
+		if (plan != NULL)
+			log_msg(LOG_VERBOSE, 0, "Planned %u regions", plan->nreg);
+	}
+
+	/*
+	 * Plain chunks of a regular file are compressed directly from a mapping
+	 * of the file instead of being copied into per-slot buffers. Dedupe
+	 * consumes its input buffer as scratch space and preprocessing filters
+	 * may write past the chunk boundary, so those always read. A read rate
+	 * limit needs the reads to pace.
+	 */
+	if (!pctx->pipe_mode && !pctx->archive_mode && !single_chunk &&
+	    !pctx->read_rate && !pctx->enable_rabin_scan && !pctx->enable_fixed_scan &&
+	    !pctx->enable_rabin_global && !pctx->preprocess_mode) {
+		imap = input_map(uncompfd, sbuf.st_size);
+		if (imap != NULL)
+			log_msg(LOG_VERBOSE, 0, "Compressing from mapped input");
+	}
+
 	slab_cache_add(chunksize);
 	slab_cache_add(compressed_chunksize);
 	slab_cache_add(sizeof (struct cmp_data));
 
-	if (pctx->encrypt_type)
+	if (pctx->encrypt_type) {
 		flags |= pctx->encrypt_type;
 
+		/*
+		 * A single chunk holds the whole file so use a tree MAC that can
+		 * be computed in parallel.
+		 */
+		if (single_chunk && pctx->encrypt_type != CRYPTO_ALG_AES_GCM) {
+			flags |= FLAG_MAC_TREE;
+			pctx->mac_tree = 1;
+		}
+	}
+
 	set_threadcounts(&props, &(pctx->nthreads), nprocs, COMPRESS_THREADS);
 	if (pctx->nthreads * props.nthreads > 1)
 		log_msg(LOG_INFO, 0, "Scaling to %d threads", pctx->nthreads * props.nthreads);
 	else
 		log_msg(LOG_INFO, 0, "Scaling to 1 thread");
+
+	/*
+	 * Algorithms that can split a chunk over several threads are set up for
+	 * the most they may get. How many they use is decided per chunk.
+	 */
+	pctx->thread_budget = nprocs;
+	pctx->chunk_threads_max = 1;
+	pctx->busy_workers = 0;
+	if (props.single_chunk_mt_capable) {
+		pctx->chunk_threads_max = props.c_max_threads;
+		if (pctx->chunk_threads_max > (int)nprocs)
+			pctx->chunk_threads_max = nprocs;
+		if (props.nthreads < pctx->chunk_threads_max)
+			props.nthreads = pctx->chunk_threads_max;
+	}
+	if (pctx->lzp_preprocess && pctx->chunk_threads_max < LZP_MAX_THREADS) {
+		pctx->chunk_threads_max = LZP_MAX_THREADS;
+		if (pctx->chunk_threads_max > (int)nprocs)
+			pctx->chunk_threads_max = nprocs;
+	}
+	if ((pctx->enable_rabin_scan || pctx->enable_rabin_global) && !pctx->enable_fixed_scan &&
+	    pctx->chunk_threads_max < RABIN_SCAN_MAX_THREADS) {
+		pctx->chunk_threads_max = RABIN_SCAN_MAX_THREADS;
+		if (pctx->chunk_threads_max > (int)nprocs)
+			pctx->chunk_threads_max = nprocs;
+	}
 	nprocs = pctx->nthreads;
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
+
+	/*
+	 * Use a few more chunk slots than threads so that idle threads can pick up
+	 * further chunks while a slow one is still in progress. There is no point in
+	 * having more slots than chunks in the input.
+	 */
+	nslots = nprocs + CHUNK_SLOTS_EXTRA(nprocs);
+	if (sbuf.st_size > 0) {
+		uint64_t nchunks = sbuf.st_size / chunksize + 1;
+
+		if (nslots > nchunks)
+			nslots = nchunks;
+		if (nslots < nprocs)
+			nslots = nprocs;
+	}
+	/*
+	 * A single chunk has nothing to be linked to.
+	 */
+	pctx->link_win = 0;
+	if (pctx->link_wlog && !single_chunk)
+		pctx->link_win = 1ULL << pctx->link_wlog;
+	dary = (struct cmp_data **)slab_calloc(NULL, nslots, sizeof (struct cmp_data *));
 	cread_buf = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
-	if (!cread_buf) {
+	if (!dary || !cread_buf) {
 		log_msg(LOG_ERR, 0, "3: Out of memory");
 		COMP_BAIL;
 	}
 
-	for (i = 0; i < nprocs; i++) {
+	/*
+	 * Within a session the worker threads of the previous file are reused
+	 * when they fit this one. Encryption, archiving and global dedupe keep
+	 * per-file state in the workers so those always get fresh threads. So
+	 * does a file that does not fit workers still busy with another file
+	 * of a batch.
+	 */
+	sess = pctx->session;
+	if (sess != NULL && (pctx->encrypt_type || pctx->archive_mode ||
+	    pctx->enable_rabin_global || chunksize > sess->chunksize))
+		sess = NULL;
+	if (sess != NULL) {
+		pthread_mutex_lock(&sess->lock);
+		if (sess->wthr != NULL && (sess->level != level ||
+		    sess->cnthreads != props.nthreads || sess->nworkers < nprocs)) {
+			if (sess->users == 0) {
+				session_stop_workers(pctx);
+			} else {
+				pthread_mutex_unlock(&sess->lock);
+				sess = NULL;
+			}
+		}
+	}
+	if (sess != NULL) {
+		/*
+		 * A batch starts all workers with the first file even if that
+		 * one is too small to use them, the next files will.
+		 */
+		if (sess->wthr == NULL && session_start_workers(pctx,
+		    pctx->batch_shared ? maxprocs : nprocs, level, props.nthreads) == -1) {
+			pthread_mutex_unlock(&sess->lock);
+			sess = NULL;
+			COMP_BAIL;
+		}
+		sess->users++;
+		pthread_mutex_unlock(&sess->lock);
+		wthr = sess->wthr;
+		nworkers = sess->nworkers;
+		cqp = &sess->queue;
+		pctx->chunk_done_wait = 1;
+		Sem_Init(&pctx->chunk_done_sem, 0, 0);
+	} else {
+		wthr = (struct cmp_thread *)slab_calloc(NULL, nprocs,
+		    sizeof (struct cmp_thread));
+		if (!wthr || chunk_queue_init(&cq, nslots + nprocs) == -1) {
+			log_msg(LOG_ERR, 0, "3: Out of memory");
+			COMP_BAIL;
+		}
+		nworkers = nprocs;
+	}
+	pc_throttle_workers(pctx->throttle, nworkers);
+
+	/*
+	 * Per-stage timings are collected in one set per thread: the reader,
+	 * the writer and then each worker. Session workers are idle here so
+	 * their pointers can be switched safely, except in a batch where they
+	 * may still work on the previous file. Their timings are left out then.
+	 */
+	stats_json = getenv("PCOMPRESS_STATS_JSON");
+	pc_trace_thread("reader");
+	tracing = pc_trace_init();
+	pctx->perf = pc_perf_init();
+	if ((stats_json != NULL && *stats_json != '\0') || tracing || pctx->perf) {
+		stats = pc_stats_create(nworkers + 2);
+		if (stats == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			COMP_BAIL;
+		}
+		w.stats = &stats[1];
+		stats_t0 = pc_stats_start(stats);
+	}
+	for (i = 0; i < nworkers && !(sess != NULL && pctx->batch_shared); i++)
+		wthr[i].stats = (stats ? &stats[2 + i] : NULL);
+	pctx->progress = pc_progress_create("compress", filename,
+	    pctx->pipe_mode ? 0 : sbuf.st_size, nworkers);
+	numa = pc_numa_init();
+	if (numa)
+		log_msg(LOG_VERBOSE, 0, "Placing threads on %d NUMA nodes", numa);
+
+	for (i = 0; i < nslots; i++) {
 		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
 		if (!dary[i]) {
 			log_msg(LOG_ERR, 0, "4: Out of memory");
@@ -2501,6 +6857,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		tdat = dary[i];
 		tdat->pctx = pctx;
 		tdat->cmp_seg = NULL;
+		tdat->ring_wrap = 0;
 		tdat->chunksize = chunksize;
 		tdat->compress = pctx->_compress_func;
 		tdat->decompress = pctx->_decompress_func;
@@ -2513,7 +6870,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
 				compressed_chunksize);
 		} else {
-			if (single_chunk)
+			if (single_chunk || imap != NULL)
 				tdat->uncompressed_chunk = (uchar_t *)1;
 			else
 				tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
@@ -2526,8 +6883,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			log_msg(LOG_ERR, 0, "5: Out of memory");
 			COMP_BAIL;
 		}
-		tdat->cancel = 0;
 		tdat->decompressing = 0;
+		tdat->passthrough = 0;
 		if (single_chunk)
 			tdat->cksum_mt = 1;
 		else
@@ -2535,31 +6892,69 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		tdat->level = level;
 		tdat->data = NULL;
 		tdat->rctx = NULL;
+		tdat->chunk_hmac = NULL;
+		tdat->index_sem_next = NULL;
+		tdat->file_offset = 0;
+		tdat->work_ms = 0;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
-		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
-		Sem_Init(&(tdat->write_done_sem), 0, 1);
-		Sem_Init(&(tdat->index_sem), 0, 0);
+		tdat->verify_pending = 0;
+		tdat->prefix = NULL;
+		tdat->prefix_len = 0;
+		tdat->codec = ADAPT_COMPRESS_NONE;
+		tdat->qskip = 0;
+		Hsem_Init(&(tdat->cmp_done_sem), 0);
+		Hsem_Init(&(tdat->write_done_sem), 1);
+		Hsem_Init(&(tdat->index_sem), 0);
+		if (pctx->link_win) {
+			tdat->prefix = (uchar_t *)slab_alloc(NULL, pctx->link_win);
+			if (tdat->prefix == NULL) {
+				log_msg(LOG_ERR, 0, "5: Out of memory");
+				COMP_BAIL;
+			}
+		}
+	}
+	if (pctx->link_win) {
+		pctx->link_buf = (uchar_t *)slab_alloc(NULL, pctx->link_win);
+		if (pctx->link_buf == NULL) {
+			log_msg(LOG_ERR, 0, "5: Out of memory");
+			COMP_BAIL;
+		}
+		pctx->link_len = 0;
+	}
+
+	for (i = 0; i < nprocs && sess == NULL; i++) {
+		struct cmp_thread *wt = &wthr[i];
+
+		wt->pctx = pctx;
+		wt->id = i;
+		wt->level = level;
+		wt->data = NULL;
+		wt->rctx = NULL;
+		wt->codec = ADAPT_COMPRESS_NONE;
+		wt->numa_node = (numa ? pc_numa_node(i) : -1);
+		wt->queue = &cq;
+		pc_numa_prefer(wt->numa_node);
 
 		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads,
+			if (pctx->_init_func(&(wt->data), &(wt->level), props.nthreads,
 			    chunksize, VERSION, COMPRESS) != 0) {
 				COMP_BAIL;
 			}
 		}
 
 		if (pctx->encrypt_type) {
-			if (hmac_init(&tdat->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
+			if (hmac_init(&wt->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
 				log_msg(LOG_ERR, 0, "Cannot initialize chunk hmac.");
 				COMP_BAIL;
 			}
 		}
-		if (pthread_create(&(tdat->thr), NULL, perform_compress,
-		    (void *)tdat) != 0) {
+		if (pthread_create(&(wt->thr), NULL, perform_compress,
+		    (void *)wt) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			COMP_BAIL;
 		}
 	}
+	pc_numa_prefer(-1);
 
 	/*
 	 * Now create the metadata handler context. This is relevant in archive mode where
@@ -2580,6 +6975,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 * When archiving, filter scratch buffer is taken into account.
 	 */
 	get_sys_limits(&msys_info);
+	if (pctx->mem_index_cap && msys_info.freeram > pctx->mem_index_cap)
+		msys_info.freeram = pctx->mem_index_cap;
 
 	if (pctx->enable_packjpg || pctx->enable_wavpack) {
 		if (FILTER_SCRATCH_SIZE_MAX >= msys_info.freeram ||
@@ -2592,34 +6989,73 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	}
 
 	if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) {
-		for (i = 0; i < nprocs; i++) {
-			tdat = dary[i];
-			tdat->rctx = create_dedupe_context(chunksize, compressed_chunksize,
+		/*
+		 * Session workers may be shared with other files so the dedupe
+		 * contexts of this file are kept in the file context.
+		 */
+		if (sess != NULL) {
+			pctx->file_rctx = (dedupe_context_t **)slab_calloc(NULL, nworkers,
+			    sizeof (dedupe_context_t *));
+			if (pctx->file_rctx == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory");
+				COMP_BAIL;
+			}
+		}
+		for (i = 0; i < nworkers; i++) {
+			struct cmp_thread *wt = &wthr[i];
+			dedupe_context_t *wrctx;
+
+			pc_numa_prefer(wt->numa_node);
+			wrctx = create_dedupe_context(chunksize, compressed_chunksize,
 			    pctx->rab_blk_size, pctx->algo, &props, pctx->enable_delta_encode,
 			    dedupe_flag, VERSION, COMPRESS, sbuf.st_size, tmpdir,
 			    pctx->pipe_mode, nprocs, msys_info.freeram);
-			if (tdat->rctx == NULL) {
+			if (wrctx == NULL) {
 				COMP_BAIL;
 			}
 
-			tdat->rctx->show_chunks = pctx->show_chunks;
-			tdat->rctx->index_sem = &(tdat->index_sem);
-			tdat->rctx->id = i;
+			wrctx->show_chunks = pctx->show_chunks;
+			wrctx->id = i;
+			if (sess != NULL)
+				pctx->file_rctx[i] = wrctx;
+			else
+				wt->rctx = wrctx;
+		}
+		pc_numa_prefer(-1);
+
+		/*
+		 * Long range matches are checked against the input file.
+		 */
+		if (pctx->enable_rabin_global) {
+			dedupe_long_match_source((pctx->pipe_mode || pctx->archive_mode) ?
+			    -1 : uncompfd, pctx->append_usize);
 		}
 	}
+
+	/*
+	 * Segmented global dedupe index access is serialized in chunk sequence via
+	 * a ring of index semaphores across the chunk slots. The simple index is
+	 * used concurrently and does not need it.
+	 */
 	if (pctx->enable_rabin_global) {
-		for (i = 0; i < nprocs; i++) {
+		for (i = 0; i < nslots; i++) {
 			tdat = dary[i];
-			tdat->rctx->index_sem_next = &(dary[(i + 1) % nprocs]->index_sem);
+			tdat->index_sem_next = &(dary[(i + 1) % nslots]->index_sem);
 		}
-		// When doing global dedupe first thread does not wait to access the index.
-		Sem_Post(&(dary[0]->index_sem));
+		// When doing global dedupe first chunk does not wait to access the index.
+		Hsem_Post(&(dary[0]->index_sem));
 	}
 
 	w.dary = dary;
 	w.wfd = compfd;
-	w.nprocs = nprocs;
+	w.nslots = nslots;
 	w.pctx = pctx;
+	w.batch_bytes = write_batch_bytes();
+	w.ring = NULL;
+	if (compfd != PC_OBJ_FD)
+		w.ring = pc_uring_create(PC_URING_DEPTH);
+	if (w.ring)
+		log_msg(LOG_VERBOSE, 0, "Using io_uring for chunk I/O");
 	if (pthread_create(&writer_thr, NULL, writer_thread, (void *)(&w)) != 0) {
 		log_msg(LOG_ERR, 1, "Error in thread creation: ");
 		COMP_BAIL;
@@ -2643,6 +7079,36 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 * then write out the full hdr in one shot.
 	 */
 	flags |= pctx->cksum;
+	if (pctx->chunk_index)
+		flags |= FLAG_CHUNK_INDEX;
+	if (pctx->enable_rabin_global && dedupe_index_has_base())
+		flags |= FLAG_GLOBAL_BASE;
+	if (pctx->enable_rabin_global && dedupe_index_window() > 0) {
+		flags |= FLAG_DEDUPE_WINDOW;
+		level |= dedupe_index_window() << 16;
+	}
+	if (pctx->link_win)
+		level |= pctx->link_wlog << LINK_WLOG_SHIFT;
+	if (pctx->archive_type_dicts)
+		level |= LEVEL_TYPE_DICT;
+
+	/*
+	 * When appending the existing header stays and new chunks start at the
+	 * old trailer.
+	 */
+	if (pctx->append_mode) {
+		pctx->comp_offset = pctx->append_off;
+		goto hdr_done;
+	}
+
+	/*
+	 * A shard further into the input continues the chunks of the one
+	 * before it.
+	 */
+	if (pctx->shard_mode && pctx->shard_off > 0) {
+		pctx->comp_offset = 0;
+		goto hdr_done;
+	}
 	memset(cread_buf, 0, ALGO_SZ);
 	strncpy((char *)cread_buf, pctx->algo, ALGO_SZ);
 	version = htons(VERSION);
@@ -2668,7 +7134,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		pos += sizeof (int);
 		serialize_checksum(pctx->crypto_ctx.salt, pos, pctx->crypto_ctx.saltlen);
 		pos += pctx->crypto_ctx.saltlen;
-		if (pctx->encrypt_type == CRYPTO_ALG_AES) {
+		if (pctx->encrypt_type == CRYPTO_ALG_AES ||
+		    pctx->encrypt_type == CRYPTO_ALG_AES_GCM) {
 			U64_P(pos) = htonll(U64_P(crypto_nonce(&(pctx->crypto_ctx))));
 			pos += 8;
 
@@ -2676,14 +7143,21 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			serialize_checksum(crypto_nonce(&(pctx->crypto_ctx)), pos,
 			    XSALSA20_CRYPTO_NONCEBYTES);
 			pos += XSALSA20_CRYPTO_NONCEBYTES;
+
+		} else if (pctx->encrypt_type == CRYPTO_ALG_CHACHA20) {
+			serialize_checksum(crypto_nonce(&(pctx->crypto_ctx)), pos,
+			    XCHACHA20_CRYPTO_NONCEBYTES);
+			pos += XCHACHA20_CRYPTO_NONCEBYTES;
 		}
 		*((int *)pos) = htonl(pctx->keylen);
 		pos += sizeof (int);
 	}
-	if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
+	pctx->comp_offset = 0;
+	if (hdr_write(pctx, compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
 		log_msg(LOG_ERR, 1, "Write ");
 		COMP_BAIL;
 	}
+	pctx->comp_offset = pos - cread_buf;
 
 	/*
 	 * If encryption is enabled, compute header HMAC and write it.
@@ -2707,22 +7181,66 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		pos = cread_buf;
 		serialize_checksum(hdr_hash, pos, hlen);
 		pos += hlen;
-		if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
+		if (out_write(pctx, compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
+		pctx->comp_offset += pos - cread_buf;
 	} else {
 		/*
 		 * Compute header CRC32 and store that. Only archive version 5 and above.
 		 */
 		uint32_t crc = lzma_crc32(cread_buf, pos - cread_buf, 0);
 		U32_P(cread_buf) = htonl(crc);
-		if (Write(compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
+		if (hdr_write(pctx, compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
+			log_msg(LOG_ERR, 1, "Write ");
+			COMP_BAIL;
+		}
+		pctx->comp_offset += sizeof (uint32_t);
+	}
+
+#ifdef ENABLE_PC_ZSTD
+	/*
+	 * Per-type dictionaries follow the header.
+	 */
+	if (pctx->archive_type_dicts) {
+		uchar_t *tdbuf;
+		int64_t tdlen;
+
+		tdlen = zstd_tdict_encode(&tdbuf);
+		if (tdlen == -1) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			COMP_BAIL;
+		}
+		U32_P(cread_buf) = htonl(tdlen);
+		U32_P(cread_buf + 4) = htonl(lzma_crc32(tdbuf, tdlen, 0));
+		if (out_write(pctx, compfd, cread_buf, 4) != 4 ||
+		    out_write(pctx, compfd, tdbuf, tdlen) != tdlen ||
+		    out_write(pctx, compfd, cread_buf + 4, 4) != 4) {
+			free(tdbuf);
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
+		free(tdbuf);
+		pctx->comp_offset += tdlen + 8;
+	}
+#endif
+
+	/*
+	 * A resumed run continues after the last checkpointed chunk, with its
+	 * blocks put back into the Global Dedupe index first. A new run records
+	 * the header in its first checkpoint.
+	 */
+	if (pctx->resume) {
+		if (ckpt_resume(pctx, compfd, uncompfd, sbuf.st_size,
+		    pctx->enable_rabin_global ? wthr[0].rctx : NULL) == -1) {
+			COMP_BAIL;
+		}
+	} else {
+		ckpt_update(pctx, compfd, 1);
 	}
 
+hdr_done:
 	/*
 	 * Now read from the uncompressed file in 'chunksize' sized chunks, independently
 	 * compress each chunk and write it out. Chunk sequencing is ensured.
@@ -2733,40 +7251,87 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	pctx->largest_chunk = 0;
 	pctx->smallest_chunk = chunksize;
 	pctx->avg_chunk = 0;
-	rabin_count = 0;
 
 	/*
 	 * Read the first chunk into a spare buffer (a simple double-buffering).
+	 * Appended data continues the uncompressed stream of the archive.
 	 */
-	file_offset = 0;
-	pctx->interesting = 0;
+	file_offset = pctx->append_usize;
+	if (pctx->resume)
+		file_offset = pctx->ckpt_uoff;
+	if (pctx->shard_mode) {
+		file_offset = pctx->shard_off;
+		if (lseek(uncompfd, file_offset, SEEK_SET) == -1) {
+			log_msg(LOG_ERR, 1, "Seek ");
+			COMP_BAIL;
+		}
+	}
 	if (pctx->enable_rabin_split) {
 		rctx = create_dedupe_context(chunksize, 0, pctx->rab_blk_size, pctx->algo, &props,
 		    pctx->enable_delta_encode, pctx->enable_fixed_scan, VERSION, COMPRESS, 0, NULL,
 		    pctx->pipe_mode, nprocs, msys_info.freeram);
-		if (pctx->archive_mode)
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, pctx);
-		else
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, NULL);
+	}
+
+	/*
+	 * Subsequent chunks are read ahead by a separate thread while the current
+	 * ones are dispatched. A single chunk is just read directly. Mapped input
+	 * needs no reads at all.
+	 */
+	if (imap != NULL) {
+		if (w.ring)
+			uring_register_bufs(w.ring, NULL, dary, nslots, cread_buf,
+			    compressed_chunksize);
+		interesting = pctx->interesting;
+		btype = pctx->btype;
+		rbytes = auto_chunks ? ca.cur : chunksize;
+		if (rbytes > sbuf.st_size - file_offset)
+			rbytes = sbuf.st_size - file_offset;
+		if (plan != NULL)
+			rbytes = chunk_plan_next(plan, file_offset, rbytes, &btype);
+		rbytes = input_map_split(rctx, imap, file_offset, rbytes, sbuf.st_size);
 	} else {
-		if (pctx->archive_mode)
-			rbytes = archiver_read(pctx, cread_buf, chunksize);
-		else
-			rbytes = Read(uncompfd, cread_buf, chunksize);
+		ra = rdahead_start(pctx, uncompfd, chunksize, compressed_chunksize, rctx,
+		    plan, !single_chunk);
+		if (ra == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot start input read-ahead ");
+			COMP_BAIL;
+		}
+		ra->stats = (stats ? &stats[0] : NULL);
+		if (auto_chunks)
+			ra->chunksize = ca.cur;
+		if (w.ring || ra->ring)
+			uring_register_bufs(w.ring, ra, dary, nslots, cread_buf,
+			    compressed_chunksize);
+		if (rdahead_run(ra) == -1) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			COMP_BAIL;
+		}
+		rbytes = rdahead_next(ra, &cread_buf, &interesting, &btype);
 	}
 
 	while (!bail) {
 		uchar_t *tmp;
 
 		if (pctx->main_cancel) break;
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			np = p;
 			tdat = dary[p];
 			if (pctx->main_cancel) break;
 			/* Wait for previous chunk compression to complete. */
-			Sem_Wait(&tdat->write_done_sem);
+			Hsem_Wait(&tdat->write_done_sem);
 			if (pctx->main_cancel) break;
 
+			/*
+			 * Chunks are written in order so all input up to the end of
+			 * this slot's previous chunk is done with.
+			 */
+			if (imap != NULL && tdat->uncompressed_chunk != (uchar_t *)1) {
+				input_map_drop(imap, &imap_dropped,
+				    tdat->file_offset + tdat->uncomp_len);
+			}
+			if (auto_chunks)
+				chunk_auto_sample(&ca, tdat);
+
 			if (rbytes == 0) { /* EOF */
 				bail = 1;
 				break;
@@ -2783,33 +7348,37 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			 */
 			tdat->id = pctx->chunk_num;
 			tdat->rbytes = rbytes;
-			tdat->interesting = pctx->interesting;
-			tdat->btype = pctx->btype; // Have to copy btype for this buffer as pctx->btype will change
+			tdat->interesting = interesting;
+			tdat->btype = btype; // Have to copy btype for this buffer as pctx->btype will change
 			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global)) {
 				tmp = tdat->cmp_seg;
 				tdat->cmp_seg = cread_buf;
 				cread_buf = tmp;
 				tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
 				    pctx->cksum_bytes + pctx->mac_bytes;
-				if (tdat->rctx) tdat->rctx->file_offset = file_offset;
-
-				/*
-				 * If there is data after the last rabin boundary in the chunk, then
-				 * rabin_count will be non-zero. We carry over the data to the beginning
-				 * of the next chunk.
-				 */
-				if (rabin_count) {
-					memcpy(cread_buf,
-					    tdat->cmp_seg + rabin_count, rbytes - rabin_count);
-					tdat->rbytes = rabin_count;
-					rabin_count = rbytes - rabin_count;
-				}
+			} else if (imap != NULL) {
+				tdat->uncompressed_chunk = imap + file_offset;
 			} else {
 				tmp = tdat->uncompressed_chunk;
 				tdat->uncompressed_chunk = cread_buf;
 				cread_buf = tmp;
 			}
+			tdat->file_offset = file_offset;
+			tdat->uncomp_len = tdat->rbytes;
 			file_offset += tdat->rbytes;
+			/*
+			 * Workers wait in chunk order on the Global Dedupe index
+			 * ring and on the link window, so those chunks are not
+			 * hinted and stay in order.
+			 */
+			if (pctx->adapt_mode && rbytes > 0 &&
+			    !pctx->enable_rabin_global && !pctx->link_win) {
+				tdat->codec = adapt_codec_hint(pctx->adapt_mode, btype,
+				    (pctx->enable_rabin_scan || pctx->enable_fixed_scan ||
+				    pctx->enable_rabin_global) ? tdat->cmp_seg :
+				    tdat->uncompressed_chunk, rbytes);
+				tdat->qskip = 0;
+			}
 
 			if (rbytes < chunksize) {
 				if (rbytes < 0) {
@@ -2819,8 +7388,10 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				}
 			}
 
-			/* Signal the compression thread to start */
-			Sem_Post(&tdat->start_sem);
+			/* Queue the chunk for the next idle compression thread */
+			if (pctx->link_win)
+				chunk_link_queue(pctx, tdat);
+			chunk_queue_put(cqp, tdat);
 			++(pctx->chunk_num);
 
 			if (single_chunk) {
@@ -2828,39 +7399,63 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				continue;
 			}
 
+			next_size = chunksize;
+			if (auto_chunks) {
+				next_size = chunk_auto_next(&ca, chunk_queue_depth(cqp), nprocs,
+				    (pctx->pipe_mode || pctx->archive_mode) ? -1 :
+				    (int64_t)(sbuf.st_size - file_offset));
+				if (pctx->enable_fixed_scan)
+					next_size -= next_size % RAB_BLK_AVG_SZ(pctx->rab_blk_size);
+				if (ra != NULL)
+					ra->chunksize = next_size;
+			}
+
+			if (imap != NULL) {
+				rbytes = sbuf.st_size - file_offset;
+				if (rbytes > next_size)
+					rbytes = next_size;
+				if (plan != NULL && rbytes > 0)
+					rbytes = chunk_plan_next(plan, file_offset, rbytes, &btype);
+				rbytes = input_map_split(rctx, imap, file_offset, rbytes,
+				    sbuf.st_size);
+				continue;
+			}
+
 			/*
-			 * Read the next buffer we want to process while previous
-			 * buffer is in progress.
+			 * Pick up the next buffer from the read-ahead thread, handing it
+			 * the one just swapped out of this chunk slot for refilling.
 			 */
-			pctx->interesting = 0;
-			if (pctx->enable_rabin_split) {
-				if (pctx->archive_mode)
-					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, pctx);
-				else
-					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, NULL);
-			} else {
-				if (pctx->archive_mode)
-					rbytes = archiver_read(pctx, cread_buf, chunksize);
-				else
-					rbytes = Read(uncompfd, cread_buf, chunksize);
-			}
+			rbytes = rdahead_next(ra, &cread_buf, &interesting, &btype);
 		}
 	}
+	batch_input_done(pctx);
 
 	if (!pctx->main_cancel) {
 		/* Wait for all remaining chunks to finish. */
-		for (p = 0; p < nprocs; p++) {
+		for (p = 0; p < nslots; p++) {
 			if (p == np) continue;
 			tdat = dary[p];
-			Sem_Wait(&tdat->write_done_sem);
+			Hsem_Wait(&tdat->write_done_sem);
 		}
 	} else {
 		err = 1;
 	}
 
 comp_done:
+	pc_numa_prefer(-1);
+	batch_input_done(pctx);
+
+	/*
+	 * Stop the read-ahead thread before its input goes away. On error it may
+	 * still be waiting for data from the archiver so close that side first.
+	 */
+	if (ra != NULL) {
+		if (err && pctx->archive_mode && !pctx->arc_closed)
+			archiver_close(pctx);
+		rdahead_stop(ra);
+	}
+	chunk_plan_free(plan);
+
 	/*
 	 * First close the input fd of uncompressed data. If archiving this will cause
 	 * the archive thread to exit and cleanup.
@@ -2875,22 +7470,70 @@ comp_done:
 
 	if (pctx->t_errored) err = pctx->t_errored;
 	if (thread) {
-		for (i = 0; i < nprocs; i++) {
+		if (sess != NULL) {
+			/*
+			 * Session workers are idle once every chunk is written. After
+			 * an error some may still be busy so drop them along with
+			 * their state instead, unless another file of a batch is
+			 * using them.
+			 */
+			pthread_mutex_lock(&sess->lock);
+			if (err && sess->users == 1) {
+				session_stop_workers(pctx);
+				wthr = NULL;
+			}
+			pthread_mutex_unlock(&sess->lock);
+		} else {
+			for (i = 0; i < nprocs; i++)
+				chunk_queue_put(&cq, NULL);
+		}
+
+		/*
+		 * Release any worker still waiting for its global dedupe turn.
+		 */
+		if (pctx->enable_rabin_global) {
+			dedupe_index_abort();
+			for (i = 0; i < nslots; i++)
+				Hsem_Post(&(dary[i]->index_sem));
+		}
+		for (i = 0; i < nprocs && sess == NULL; i++) {
+			pthread_join(wthr[i].thr, NULL);
+			if (pctx->encrypt_type)
+				hmac_cleanup(&wthr[i].chunk_hmac);
+		}
+		for (i = 0; i < nslots; i++) {
 			tdat = dary[i];
-			tdat->cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->start_sem);
-			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
-			if (pctx->encrypt_type)
-				hmac_cleanup(&tdat->chunk_hmac);
+			Hsem_Post(&tdat->cmp_done_sem);
 		}
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
 
+	/*
+	 * Chunks of this file may still be finishing on shared session workers
+	 * after an error. Wait until they let go of them.
+	 */
+	if (sess != NULL) {
+		for (i = 0; i < pctx->chunk_num; i++)
+			Sem_Wait(&pctx->chunk_done_sem);
+		Sem_Destroy(&pctx->chunk_done_sem);
+		pctx->chunk_done_wait = 0;
+		pthread_mutex_lock(&sess->lock);
+		sess->users--;
+		pthread_mutex_unlock(&sess->lock);
+	}
+	pc_uring_destroy(w.ring);
+
 	if (err) {
-		if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
+		if (pctx->append_mode) {
+			if (pctx->append_tail != NULL)
+				append_restore(pctx, compfd);
+		} else if (pctx->ckpt_ms > 0) {
+			if (compfd != -1)
+				close(compfd);
+			ckpt_close(pctx, to_filename, 0);
+		} else if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
 			unlink(tmpfile1);
 			rm_fname(tmpfile1);
 		}
@@ -2900,13 +7543,42 @@ comp_done:
 			log_msg(LOG_ERR, 0, "Error compressing");
 	} else {
 		/*
-		* Write a trailer of zero chunk length.
-		*/
-		compressed_chunksize = 0;
-		if (Write(compfd, &compressed_chunksize,
-		    sizeof (compressed_chunksize)) < 0) {
-			log_msg(LOG_ERR, 1, "Write ");
-			err = 1;
+		* Write a trailer of zero chunk length. Only the last shard of
+		* the input ends the archive.
+		*/
+		compressed_chunksize = 0;
+		if (shard_last && out_write(pctx, compfd, &compressed_chunksize,
+		    sizeof (compressed_chunksize)) < 0) {
+			log_msg(LOG_ERR, 1, "Write ");
+			err = 1;
+		}
+		if (shard_last)
+			pctx->comp_offset += sizeof (compressed_chunksize);
+
+		/*
+		 * The chunk index goes after the trailer so that older versions
+		 * stop reading before it.
+		 */
+		if (!err && pctx->chunk_index && pctx->archive_mode) {
+			if (member_index_write(pctx, compfd) == -1)
+				err = 1;
+		}
+		if (!err && pctx->chunk_index) {
+			if (chunk_index_write(pctx, compfd, file_offset) == -1)
+				err = 1;
+		}
+
+		/*
+		 * An append may be shorter than the old tail when no members
+		 * were added.
+		 */
+		if (pctx->append_mode) {
+			if (!err && ftruncate(compfd, pctx->comp_offset) == -1) {
+				log_msg(LOG_ERR, 1, "ftruncate ");
+				err = 1;
+			}
+			if (err)
+				append_restore(pctx, compfd);
 		}
 
 		/*
@@ -2917,12 +7589,20 @@ comp_done:
 			/*
 			 * Ownership and mode of target should be same as original.
 			 */
-			fchmod(compfd, sbuf.st_mode);
-			if (fchown(compfd, sbuf.st_uid, sbuf.st_gid) == -1)
-				log_msg(LOG_ERR, 1, "chown ");
+			if (!pctx->append_mode) {
+				fchmod(compfd, sbuf.st_mode);
+				if (fchown(compfd, sbuf.st_uid, sbuf.st_gid) == -1)
+					log_msg(LOG_ERR, 1, "chown ");
+			}
 			close(compfd);
 
-			if (pctx->to_filename == NULL) {
+			if (pctx->ckpt_ms > 0) {
+				if (!err && rename(tmpfile1, to_filename) == -1) {
+					log_msg(LOG_ERR, 1, "Cannot rename %s ", tmpfile1);
+					err = 1;
+				}
+				ckpt_close(pctx, to_filename, !err);
+			} else if (pctx->to_filename == NULL) {
 				if (rename(tmpfile1, to_filename) == -1) {
 					log_msg(LOG_ERR, 1, "Cannot rename temporary file ");
 					unlink(tmpfile1);
@@ -2932,33 +7612,77 @@ comp_done:
 				rm_fname(to_filename);
 			}
 		}
+
+		/*
+		 * The data just compressed becomes the base for the next run.
+		 */
+		if (!err && pctx->enable_rabin_global)
+			dedupe_index_save(file_offset);
+	}
+	if (pctx->progress != NULL) {
+		if (!err)
+			pc_progress_finish(pctx->progress);
+		pc_progress_destroy(pctx->progress);
+		pctx->progress = NULL;
+	}
+	if (stats != NULL) {
+		pc_trace_write();
+		if (!err && stats_json != NULL && *stats_json != '\0')
+			pc_stats_write_json(stats_json, "compress", filename, stats,
+			    nworkers + 2, pc_stats_start(stats) - stats_t0, pctx->filters);
+		if (pctx->perf)
+			pc_stats_merge(&pctx->perf_total, stats, nworkers + 2);
+		pc_stats_destroy(stats);
+	}
+	if (wthr != NULL) {
+		for (i = 0; i < nworkers; i++) {
+			if (sess == NULL || !pctx->batch_shared)
+				wthr[i].stats = NULL;
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && sess == NULL) {
+				destroy_dedupe_context(wthr[i].rctx);
+				wthr[i].rctx = NULL;
+			}
+			if (pctx->_deinit_func && sess == NULL)
+				pctx->_deinit_func(&(wthr[i].data));
+		}
+		if (sess == NULL)
+			slab_release(NULL, wthr);
+	}
+	if (pctx->file_rctx != NULL) {
+		for (i = 0; i < nworkers; i++)
+			destroy_dedupe_context(pctx->file_rctx[i]);
+		slab_release(NULL, pctx->file_rctx);
+		pctx->file_rctx = NULL;
 	}
 	if (dary != NULL) {
-		for (i = 0; i < nprocs; i++) {
+		for (i = 0; i < nslots; i++) {
 			if (!dary[i]) continue;
-			if (dary[i]->uncompressed_chunk != (uchar_t *)1)
+			if (dary[i]->uncompressed_chunk != (uchar_t *)1 && imap == NULL)
 				slab_release(NULL, dary[i]->uncompressed_chunk);
 			if (dary[i]->cmp_seg != (uchar_t *)1)
 				slab_release(NULL, dary[i]->cmp_seg);
-			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
-				destroy_dedupe_context(dary[i]->rctx);
-			}
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
-			Sem_Destroy(&(dary[i]->start_sem));
-			Sem_Destroy(&(dary[i]->cmp_done_sem));
-			Sem_Destroy(&(dary[i]->write_done_sem));
-			Sem_Destroy(&(dary[i]->index_sem));
+			if (dary[i]->prefix != NULL)
+				slab_release(NULL, dary[i]->prefix);
+			Hsem_Destroy(&(dary[i]->cmp_done_sem));
+			Hsem_Destroy(&(dary[i]->write_done_sem));
+			Hsem_Destroy(&(dary[i]->index_sem));
 
 			slab_release(NULL, dary[i]);
 		}
 		slab_release(NULL, dary);
 	}
+	if (pctx->link_buf != NULL) {
+		slab_release(NULL, pctx->link_buf);
+		pctx->link_buf = NULL;
+	}
+	if (imap != NULL)
+		munmap(imap, sbuf.st_size);
+	chunk_queue_destroy(&cq);
 	if (pctx->enable_rabin_split) destroy_dedupe_context(rctx);
 	if (cread_buf != (uchar_t *)1)
 		slab_release(NULL, cread_buf);
 	if (!pctx->pipe_mode) {
-		if (compfd != -1) close(compfd);
+		if (compfd >= 0) close(compfd);
 	}
 
 	if (pctx->archive_mode) {
@@ -2973,6 +7697,8 @@ comp_done:
 		}
 		Sem_Destroy(&(pctx->read_sem));
 		Sem_Destroy(&(pctx->write_sem));
+		pthread_mutex_destroy(&(pctx->arc_lock));
+		pthread_cond_destroy(&(pctx->arc_cv));
 	}
 	if (!pctx->hide_cmp_stats) show_compression_stats(pctx);
 	pctx->_stats_func(!pctx->hide_cmp_stats);
@@ -2992,6 +7718,7 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 	/* Copy given string into known length buffer to avoid memcmp() overruns. */
 	strncpy(algorithm, algo, 8);
 	pctx->_props_func = NULL;
+	pctx->_prefix_func = NULL;
 	if (memcmp(algorithm, "zlib", 4) == 0) {
 		pctx->_compress_func = zlib_compress;
 		pctx->_decompress_func = zlib_decompress;
@@ -3013,104 +7740,1005 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 	} else if (memcmp(algorithm, "lzma", 4) == 0) {
 		pctx->_compress_func = lzma_compress;
 		pctx->_decompress_func = lzma_decompress;
-		pctx->_init_func = lzma_init;
+		pctx->_init_func = lzma_split_init;
 		pctx->_deinit_func = lzma_deinit;
 		pctx->_stats_func = lzma_stats;
 		pctx->_props_func = lzma_props;
 		rv = 0;
 
-	} else if (memcmp(algorithm, "bzip2", 5) == 0) {
-		pctx->_compress_func = bzip2_compress;
-		pctx->_decompress_func = bzip2_decompress;
-		pctx->_init_func = bzip2_init;
-		pctx->_deinit_func = NULL;
-		pctx->_stats_func = bzip2_stats;
-		pctx->_props_func = bzip2_props;
-		rv = 0;
+	} else if (memcmp(algorithm, "bzip2", 5) == 0) {
+		pctx->_compress_func = bzip2_compress;
+		pctx->_decompress_func = bzip2_decompress;
+		pctx->_init_func = bzip2_init;
+		pctx->_deinit_func = NULL;
+		pctx->_stats_func = bzip2_stats;
+		pctx->_props_func = bzip2_props;
+		rv = 0;
+
+	} else if (memcmp(algorithm, "ppmd", 4) == 0) {
+		pctx->_compress_func = ppmd_compress;
+		pctx->_decompress_func = ppmd_decompress;
+		pctx->_init_func = ppmd_init;
+		pctx->_deinit_func = ppmd_deinit;
+		pctx->_stats_func = ppmd_stats;
+		pctx->_props_func = ppmd_props;
+		rv = 0;
+
+	} else if (memcmp(algorithm, "lzfx", 4) == 0) {
+		pctx->_compress_func = lz_fx_compress;
+		pctx->_decompress_func = lz_fx_decompress;
+		pctx->_init_func = lz_fx_init;
+		pctx->_deinit_func = lz_fx_deinit;
+		pctx->_stats_func = lz_fx_stats;
+		pctx->_props_func = lz_fx_props;
+		rv = 0;
+
+	} else if (memcmp(algorithm, "lz4", 3) == 0) {
+		pctx->_compress_func = lz4_compress;
+		pctx->_decompress_func = lz4_decompress;
+		pctx->_init_func = lz4_init;
+		pctx->_deinit_func = lz4_deinit;
+		pctx->_stats_func = lz4_stats;
+		pctx->_props_func = lz4_props;
+		rv = 0;
+
+	} else if (memcmp(algorithm, "none", 4) == 0) {
+		pctx->_compress_func = none_compress;
+		pctx->_decompress_func = none_decompress;
+		pctx->_init_func = none_init;
+		pctx->_deinit_func = none_deinit;
+		pctx->_stats_func = none_stats;
+		pctx->_props_func = none_props;
+		rv = 0;
+
+	/* adapt2 and adapt ordering of the checks matter here. */
+	} else if (memcmp(algorithm, "adapt2", 6) == 0) {
+		pctx->_compress_func = adapt_compress;
+		pctx->_decompress_func = adapt_decompress;
+		pctx->_init_func = adapt2_init;
+		pctx->_deinit_func = adapt_deinit;
+		pctx->_stats_func = adapt_stats;
+		pctx->_props_func = adapt_props;
+		pctx->adapt_mode = 2;
+		pctx->enable_analyzer = 1;
+		rv = 0;
+
+	} else if (memcmp(algorithm, "adapt", 5) == 0) {
+		pctx->_compress_func = adapt_compress;
+		pctx->_decompress_func = adapt_decompress;
+		pctx->_init_func = adapt_init;
+		pctx->_deinit_func = adapt_deinit;
+		pctx->_stats_func = adapt_stats;
+		pctx->_props_func = adapt_props;
+		pctx->adapt_mode = 1;
+		pctx->enable_analyzer = 1;
+		rv = 0;
+#ifdef ENABLE_PC_LIBBSC
+	} else if (memcmp(algorithm, "libbsc", 6) == 0) {
+		pctx->_compress_func = libbsc_compress;
+		pctx->_decompress_func = libbsc_decompress;
+		pctx->_init_func = libbsc_init;
+		pctx->_deinit_func = libbsc_deinit;
+		pctx->_stats_func = libbsc_stats;
+		pctx->_props_func = libbsc_props;
+		rv = 0;
+#endif
+#ifdef ENABLE_PC_ZSTD
+	} else if (memcmp(algorithm, "zstd", 4) == 0) {
+		pctx->_compress_func = zstd_compress;
+		pctx->_decompress_func = zstd_decompress;
+		pctx->_init_func = zstd_init;
+		pctx->_deinit_func = zstd_deinit;
+		pctx->_stats_func = zstd_stats;
+		pctx->_props_func = zstd_props;
+		pctx->_prefix_func = zstd_set_prefix;
+		rv = 0;
+#endif
+	}
+
+	return (rv);
+}
+
+/*
+ * Decode speed presets for -O, best compression first. speed is a nominal
+ * per-thread decompression rate in MB/s used when no calibration sample
+ * is available. The last entry is the fallback if none is fast enough.
+ */
+struct decode_preset {
+	const char *algo;
+	int level;
+	uint64_t chunksize;
+	int lzp, delta2, dedupe;
+	int speed;
+};
+
+static struct decode_preset decode_presets[] = {
+	{"lzma",   9, 64 * 1024 * 1024, 1, 1, 1,   45},
+#ifdef ENABLE_PC_LIBBSC
+	{"libbsc", 6, 64 * 1024 * 1024, 1, 1, 1,   35},
+#endif
+	{"lzma",   6, 32 * 1024 * 1024, 0, 1, 1,   50},
+#ifdef ENABLE_PC_ZSTD
+	{"zstd",  14, 32 * 1024 * 1024, 0, 0, 1,  600},
+#endif
+	{"zlib",   9, 16 * 1024 * 1024, 0, 0, 1,  250},
+	{"lz4",    6, 16 * 1024 * 1024, 0, 0, 1, 1500},
+	{"lz4",    1,  8 * 1024 * 1024, 0, 0, 0, 2500}
+};
+#define	NUM_DECODE_PRESETS	(sizeof (decode_presets) / sizeof (struct decode_preset))
+#define	CALIBRATE_SAMPLE	(4 * 1024 * 1024)
+
+/*
+ * Read up to CALIBRATE_SAMPLE bytes from the middle of the given file.
+ */
+static uchar_t *
+calibrate_sample(const char *filename, uint64_t *len)
+{
+	struct stat sbuf;
+	uchar_t *buf;
+	uint64_t sz;
+	int fd;
+
+	if (stat(filename, &sbuf) == -1 || !S_ISREG(sbuf.st_mode) || sbuf.st_size < MIN_CHUNK)
+		return (NULL);
+	sz = sbuf.st_size;
+	if (sz > CALIBRATE_SAMPLE)
+		sz = CALIBRATE_SAMPLE;
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return (NULL);
+	buf = (uchar_t *)malloc(sz);
+	if (buf != NULL && pread(fd, buf, sz, (sbuf.st_size - sz) / 2) != (ssize_t)sz) {
+		free(buf);
+		buf = NULL;
+	}
+	close(fd);
+	*len = sz;
+	return (buf);
+}
+
+/*
+ * Compress and decompress the sample with one preset's codec. Returns the
+ * decompression speed in MB/s per thread and the compression ratio, or -1
+ * if the codec could not be set up. Preprocessing and dedupe are not part
+ * of the measurement.
+ */
+static double
+calibrate_preset(struct decode_preset *dp, uchar_t *sample, uint64_t len, double *ratio)
+{
+	pc_ctx_t tctx;
+	algo_props_t props;
+	uchar_t *cbuf, *ubuf;
+	uint64_t clen, ulen, cbufsz;
+	void *data;
+	double strt, en, spd;
+	int level, rv, i;
+
+	memset(&tctx, 0, sizeof (tctx));
+	if (init_algo(&tctx, dp->algo, 0) != 0)
+		return (-1);
+	init_algo_props(&props);
+	if (tctx._props_func)
+		tctx._props_func(&props, dp->level, len);
+	cbufsz = len + zlib_buf_extra(len) + props.buf_extra;
+	cbuf = (uchar_t *)malloc(cbufsz);
+	ubuf = (uchar_t *)malloc(len + props.buf_extra);
+	if (cbuf == NULL || ubuf == NULL) {
+		free(cbuf);
+		free(ubuf);
+		return (-1);
+	}
+
+	spd = -1;
+	data = NULL;
+	level = dp->level;
+	if (tctx._init_func && tctx._init_func(&data, &level, 1, len, VERSION, COMPRESS) != 0)
+		goto out;
+	clen = cbufsz;
+	rv = tctx._compress_func(sample, len, cbuf, &clen, level, 0, TYPE_UNKNOWN, data);
+	if (tctx._deinit_func)
+		tctx._deinit_func(&data);
+	data = NULL;
+
+	/*
+	 * An incompressible sample is stored as is and decodes at copy speed.
+	 */
+	if (rv < 0 || clen >= len) {
+		*ratio = 1.0;
+		spd = 1e6;
+		goto out;
+	}
+	*ratio = (double)len / clen;
+
+	level = dp->level;
+	if (tctx._init_func && tctx._init_func(&data, &level, 1, len, VERSION, DECOMPRESS) != 0)
+		goto out;
+	strt = get_wtime_millis();
+	for (i = 0; i < 3; i++) {
+		ulen = len;
+		rv = tctx._decompress_func(cbuf, clen, ubuf, &ulen, level, 0,
+		    TYPE_UNKNOWN, data);
+		if (rv < 0 || ulen != len)
+			break;
+	}
+	en = get_wtime_millis();
+	if (i == 3)
+		spd = get_mb_s(len * 3, strt, en);
+	if (tctx._deinit_func)
+		tctx._deinit_func(&data);
+out:
+	free(cbuf);
+	free(ubuf);
+	return (spd);
+}
+
+/*
+ * Pick the preset with the best compression whose decompression meets the
+ * -O target with all threads busy. If a regular input file is available a
+ * sample of it is run through each candidate codec, otherwise the nominal
+ * speeds are used.
+ */
+static struct decode_preset *
+select_decode_preset(pc_ctx_t *pctx, const char *filename)
+{
+	struct decode_preset *dp, *best;
+	uchar_t *sample;
+	uint64_t len;
+	double spd, ratio, best_ratio;
+	int nthreads, i;
+
+	nthreads = pctx->nthreads;
+	if (nthreads == 0)
+		nthreads = get_avail_cpus();
+	if (nthreads < 1)
+		nthreads = 1;
+
+	sample = NULL;
+	if (filename != NULL && !pctx->pipe_mode)
+		sample = calibrate_sample(filename, &len);
+
+	best = &decode_presets[NUM_DECODE_PRESETS - 1];
+	best_ratio = 0;
+	for (i = 0; i < NUM_DECODE_PRESETS; i++) {
+		dp = &decode_presets[i];
+		if (sample == NULL) {
+			if ((double)dp->speed * nthreads >= pctx->decode_target) {
+				best = dp;
+				break;
+			}
+			continue;
+		}
+		ratio = 1.0;
+		spd = calibrate_preset(dp, sample, len, &ratio);
+		if (spd < 0)
+			continue;
+		log_msg(LOG_VERBOSE, 0, "Preset %s level %d: ratio %.3f, decode %.1f MB/s",
+		    dp->algo, dp->level, ratio, spd * nthreads);
+		if (spd * nthreads >= pctx->decode_target && ratio > best_ratio) {
+			best = dp;
+			best_ratio = ratio;
+		}
+	}
+	free(sample);
+	return (best);
+}
+
+/*
+ * Dry run from -Q. Up to ESTIMATE_SAMPLES chunks spread evenly over the
+ * input are deduped and compressed with each listed codec as in a real run,
+ * limited to ESTIMATE_MEM of sample buffers. The results are scaled to the
+ * whole file. Global Dedupe is estimated as segmented dedupe within each
+ * sample, so it is low on data that repeats over long distances.
+ */
+#define	ESTIMATE_SAMPLES	16
+#define	ESTIMATE_MEM		(256 * 1024 * 1024)
+#define	ESTIMATE_MAX_ALGOS	16
+
+struct est_algo {
+	char name[16];
+	int level;
+};
+
+static int
+estimate_parse(pc_ctx_t *pctx, struct est_algo *ea)
+{
+	pc_ctx_t tctx;
+	char *p, *e;
+	size_t n;
+	int nalgo;
+
+	nalgo = 0;
+	p = pctx->estimate;
+	while (*p != '\0') {
+		n = strcspn(p, ":,");
+		if (n == 0 || n >= sizeof (ea->name) || nalgo == ESTIMATE_MAX_ALGOS) {
+			log_msg(LOG_ERR, 0, "Invalid algorithm list %s", pctx->estimate);
+			return (-1);
+		}
+		memcpy(ea[nalgo].name, p, n);
+		ea[nalgo].name[n] = '\0';
+		memset(&tctx, 0, sizeof (tctx));
+		if (init_algo(&tctx, ea[nalgo].name, 0) != 0) {
+			log_msg(LOG_ERR, 0, "Invalid algorithm %s", ea[nalgo].name);
+			return (-1);
+		}
+		p += n;
+		ea[nalgo].level = pctx->estimate_level;
+		if (*p == ':') {
+			ea[nalgo].level = strtol(p + 1, &e, 10);
+			if (e == p + 1 || ea[nalgo].level < 0 || ea[nalgo].level > MAX_LEVEL) {
+				log_msg(LOG_ERR, 0, "Compression level should be in range 0 - 14");
+				return (-1);
+			}
+			p = e;
+		}
+		if (ea[nalgo].level == -1)
+			ea[nalgo].level = (memcmp(ea[nalgo].name, "lz4", 3) == 0 ? 1 : 6);
+		if (*p == ',')
+			p++;
+		else if (*p != '\0') {
+			log_msg(LOG_ERR, 0, "Invalid algorithm list %s", pctx->estimate);
+			return (-1);
+		}
+		nalgo++;
+	}
+	return (nalgo);
+}
+
+/*
+ * Dedupe one sample the way compress_thread() does. On return *data and
+ * *dlen describe what goes to the codec and *hlen is the size of the dedupe
+ * header with the compressed index, 0 if dedupe found nothing.
+ */
+static void
+estimate_dedupe(dedupe_context_t *rctx, uchar_t *sbuf, uchar_t *dbuf, uint64_t len,
+    uchar_t **data, uint64_t *dlen, uint64_t *hlen)
+{
+	uchar_t *idx;
+	uint64_t rb, index_sz, index_cmp;
+	uint32_t isz;
+
+	*data = sbuf;
+	*dlen = len;
+	*hlen = 0;
+	rb = len;
+	rctx->cbuf = dbuf;
+	isz = dedupe_compress(rctx, sbuf, &rb, 0, NULL, 0);
+	if (!rctx->valid)
+		return;
+
+	index_sz = isz;
+	index_cmp = index_sz;
+	idx = (uchar_t *)malloc(index_sz + zlib_buf_extra(index_sz));
+	if (idx != NULL && index_sz >= 90) {
+		index_cmp = index_sz - 1;
+		if (dedupe_index_encode(dbuf + RABIN_HDR_SIZE, index_sz, idx, &index_cmp) == 0)
+			goto done;
+		transpose(dbuf + RABIN_HDR_SIZE, idx, index_sz, sizeof (uint32_t), ROW);
+		memcpy(dbuf + RABIN_HDR_SIZE, idx, index_sz);
+		index_cmp = index_sz + zlib_buf_extra(index_sz);
+		if (lzma_compress(dbuf + RABIN_HDR_SIZE, index_sz, idx, &index_cmp,
+		    rctx->level, 255, TYPE_BINARY, rctx->lzma_data) != 0 ||
+		    index_cmp >= index_sz)
+			index_cmp = index_sz;
+	}
+done:
+	free(idx);
+	*data = dbuf + RABIN_HDR_SIZE + index_sz;
+	*dlen = rb - RABIN_HDR_SIZE - index_sz;
+	*hlen = RABIN_HDR_SIZE + index_cmp;
+}
+
+static int
+estimate_compress(pc_ctx_t *pctx, const char *filename)
+{
+	struct est_algo ea[ESTIMATE_MAX_ALGOS];
+	dedupe_context_t **rctx;
+	algo_props_t props;
+	struct stat sbuf;
+	uchar_t **sbufs, **dbufs, **data;
+	uint64_t *slen, *dlen, *hlen, *clen;
+	double *ctm, *dtm, ddtime;
+	uint64_t size, chunksize, nchunks, bufsz, tot, dtot, htot, ctot, i;
+	int nalgo, nsamp, nthreads, dedupe, fd, err, a, k;
+
+	if ((nalgo = estimate_parse(pctx, ea)) <= 0)
+		return (1);
+	if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &sbuf) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open: %s", filename);
+		if (fd != -1)
+			close(fd);
+		return (1);
+	}
+	size = sbuf.st_size;
+	if (!S_ISREG(sbuf.st_mode) || size == 0) {
+		log_msg(LOG_ERR, 0, "%s: Not a regular file or empty", filename);
+		close(fd);
+		return (1);
+	}
+
+	nthreads = pctx->nthreads;
+	if (nthreads == 0)
+		nthreads = get_avail_cpus();
+	if (nthreads < 1)
+		nthreads = 1;
+	dedupe = (pctx->enable_rabin_scan || pctx->enable_fixed_scan);
+	chunksize = pctx->chunksize;
+	if (chunksize > size)
+		chunksize = size;
+	nchunks = (size + chunksize - 1) / chunksize;
+	if (nchunks < (uint64_t)nthreads)
+		nthreads = nchunks;
+	bufsz = chunksize + CHUNK_HDR_SZ + zlib_buf_extra(chunksize);
+	if (dedupe)
+		bufsz += dedupe_buf_extra(chunksize, 0, pctx->algo, pctx->enable_delta_encode);
+	nsamp = ESTIMATE_MEM / (2 * bufsz);
+	if (nsamp > ESTIMATE_SAMPLES)
+		nsamp = ESTIMATE_SAMPLES;
+	if (nsamp < 1)
+		nsamp = 1;
+	if ((uint64_t)nsamp > nchunks)
+		nsamp = nchunks;
+
+	err = 1;
+	rctx = (dedupe_context_t **)calloc(nsamp, sizeof (dedupe_context_t *));
+	sbufs = (uchar_t **)calloc(nsamp, sizeof (uchar_t *));
+	dbufs = (uchar_t **)calloc(nsamp, sizeof (uchar_t *));
+	data = (uchar_t **)calloc(nsamp, sizeof (uchar_t *));
+	slen = (uint64_t *)calloc(nsamp, sizeof (uint64_t));
+	dlen = (uint64_t *)calloc(nsamp, sizeof (uint64_t));
+	hlen = (uint64_t *)calloc(nsamp, sizeof (uint64_t));
+	clen = (uint64_t *)calloc(nsamp, sizeof (uint64_t));
+	ctm = (double *)calloc(nsamp, sizeof (double));
+	dtm = (double *)calloc(nsamp, sizeof (double));
+	if (rctx == NULL || sbufs == NULL || dbufs == NULL || data == NULL || slen == NULL ||
+	    dlen == NULL || hlen == NULL || clen == NULL || ctm == NULL || dtm == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		goto est_out;
+	}
+
+	tot = 0;
+	for (k = 0; k < nsamp; k++) {
+		uint64_t off = (nchunks * k / nsamp) * chunksize;
+
+		slen[k] = size - off;
+		if (slen[k] > chunksize)
+			slen[k] = chunksize;
+		sbufs[k] = (uchar_t *)malloc(bufsz);
+		if (sbufs[k] == NULL || (dedupe && (dbufs[k] = (uchar_t *)malloc(bufsz)) == NULL)) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			goto est_out;
+		}
+		if (pread(fd, sbufs[k], slen[k], off) != (int64_t)slen[k]) {
+			log_msg(LOG_ERR, 1, "Cannot read: %s ", filename);
+			goto est_out;
+		}
+		data[k] = sbufs[k];
+		dlen[k] = slen[k];
+		tot += slen[k];
+	}
+
+	printf("%s: %" PRIu64 " bytes in %" PRIu64 " chunks of %" PRIu64 ", %d sampled, "
+	    "%d threads\n", filename, size, nchunks, chunksize, nsamp, nthreads);
+
+	/*
+	 * Contexts are set up one at a time, the dedupe itself runs in
+	 * parallel.
+	 */
+	ddtime = 0;
+	if (dedupe) {
+		init_algo_props(&props);
+		if (pctx->_props_func)
+			pctx->_props_func(&props, pctx->level, chunksize);
+		for (k = 0; k < nsamp; k++) {
+			rctx[k] = create_dedupe_context(chunksize, bufsz, pctx->rab_blk_size,
+			    pctx->algo, &props, pctx->enable_delta_encode,
+			    pctx->enable_fixed_scan ? RABIN_DEDUPE_FIXED : RABIN_DEDUPE_SEGMENTED,
+			    VERSION, COMPRESS, size, NULL, 0, 1, get_total_ram() / 2);
+			if (rctx[k] == NULL)
+				goto est_out;
+		}
+#if defined(_OPENMP)
+#	pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+		for (k = 0; k < nsamp; k++) {
+			double st = get_wtime_millis();
+
+			estimate_dedupe(rctx[k], sbufs[k], dbufs[k], slen[k], &data[k],
+			    &dlen[k], &hlen[k]);
+			ctm[k] = get_wtime_millis() - st;
+		}
+		dtot = 0;
+		htot = 0;
+		for (k = 0; k < nsamp; k++) {
+			ddtime += ctm[k];
+			dtot += dlen[k];
+			htot += hlen[k];
+		}
+		printf("Dedupe (%s): %.1f%% removed, index %" PRIu64 " bytes, %.1f MB/s\n",
+		    pctx->enable_fixed_scan ? "fixed" : "content defined",
+		    100.0 - (double)dtot * 100 / tot, htot, get_mb_s(tot, 0, ddtime));
+	}
+
+	printf("%-8s %5s %8s %16s %12s %12s %10s\n", "Algo", "Level", "Ratio", "Est. size",
+	    "Comp MB/s", "Decomp MB/s", "Est. time");
+	for (a = 0; a < nalgo; a++) {
+		pc_ctx_t tctx;
+		double cms, dms, ratio;
+
+		memset(&tctx, 0, sizeof (tctx));
+		init_algo(&tctx, ea[a].name, 0);
+		init_algo_props(&props);
+		if (tctx._props_func)
+			tctx._props_func(&props, ea[a].level, chunksize);
+
+#if defined(_OPENMP)
+#	pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+		for (k = 0; k < nsamp; k++) {
+			uchar_t *cbuf, *ubuf;
+			uint64_t cl, ul, cbsz;
+			void *cdat;
+			double st;
+			int level, rv;
+
+			clen[k] = dlen[k];
+			ctm[k] = 0;
+			dtm[k] = 0;
+			cbsz = dlen[k] + zlib_buf_extra(dlen[k]) + props.buf_extra;
+			cbuf = (uchar_t *)malloc(cbsz);
+			ubuf = (uchar_t *)malloc(dlen[k] + props.buf_extra);
+			cdat = NULL;
+			level = ea[a].level;
+			if (cbuf == NULL || ubuf == NULL || (tctx._init_func &&
+			    tctx._init_func(&cdat, &level, 1, dlen[k], VERSION, COMPRESS) != 0)) {
+				clen[k] = 0;
+				goto smp_done;
+			}
+			cl = cbsz;
+			st = get_wtime_millis();
+			rv = tctx._compress_func(data[k], dlen[k], cbuf, &cl, level, 0,
+			    TYPE_UNKNOWN, cdat);
+			ctm[k] = get_wtime_millis() - st;
+			if (tctx._deinit_func)
+				tctx._deinit_func(&cdat);
+			cdat = NULL;
+
+			/*
+			 * As in a real run a chunk that does not shrink is stored
+			 * and costs nothing to decode.
+			 */
+			if (rv < 0 || cl >= dlen[k])
+				goto smp_done;
+			clen[k] = cl;
+			level = ea[a].level;
+			if (tctx._init_func &&
+			    tctx._init_func(&cdat, &level, 1, dlen[k], VERSION, DECOMPRESS) != 0) {
+				clen[k] = 0;
+				goto smp_done;
+			}
+			ul = dlen[k];
+			st = get_wtime_millis();
+			rv = tctx._decompress_func(cbuf, cl, ubuf, &ul, level, 0, TYPE_UNKNOWN, cdat);
+			dtm[k] = get_wtime_millis() - st;
+			if (rv < 0 || ul != dlen[k] || memcmp(ubuf, data[k], ul) != 0)
+				clen[k] = 0;
+			if (tctx._deinit_func)
+				tctx._deinit_func(&cdat);
+smp_done:
+			free(cbuf);
+			free(ubuf);
+		}
+
+		ctot = 0;
+		cms = ddtime;
+		dms = 0;
+		for (k = 0; k < nsamp; k++) {
+			if (clen[k] == 0)
+				break;
+			ctot += hlen[k] + clen[k] + CHUNK_HDR_SZ;
+			cms += ctm[k];
+			dms += dtm[k];
+		}
+		if (k < nsamp) {
+			printf("%-8s %5d   failed\n", ea[a].name, ea[a].level);
+			continue;
+		}
+		ratio = (double)tot / ctot;
+		if (cms < 0.001)
+			cms = 0.001;
+		if (dms < 0.001)
+			dms = 0.001;
+		i = (uint64_t)((double)size / ratio);
+		printf("%-8s %5d %8.3f %16" PRIu64 " %12.1f %12.1f %9.1fs\n", ea[a].name,
+		    ea[a].level, ratio, i, get_mb_s(tot, 0, cms) * nthreads,
+		    get_mb_s(tot, 0, dms) * nthreads,
+		    cms / 1000 * ((double)size / tot) / nthreads);
+	}
+	err = 0;
+
+est_out:
+	close(fd);
+	for (k = 0; k < nsamp; k++) {
+		if (rctx != NULL && rctx[k] != NULL)
+			destroy_dedupe_context(rctx[k]);
+		if (sbufs != NULL)
+			free(sbufs[k]);
+		if (dbufs != NULL)
+			free(dbufs[k]);
+	}
+	free(rctx);
+	free(sbufs);
+	free(dbufs);
+	free(data);
+	free(slen);
+	free(dlen);
+	free(hlen);
+	free(clen);
+	free(ctm);
+	free(dtm);
+	return (err);
+}
+
+/*
+ * Built-in self benchmark from -H. Every checksum, cipher and codec fast
+ * path is timed on in-memory data so that -S, -e and -c can be chosen for
+ * the host. Checksums and ciphers do not depend on the data and use random
+ * bytes. Codecs use synthetic text, random bytes and, if a file is given,
+ * a sample from its start. Worker threads each process whole chunks so the
+ * single thread rates are the per core rates of a real run.
+ */
+#define	BENCH_BUF_SZ	(8UL * 1024 * 1024)
+#define	BENCH_MIN_MS	300
+#define	BENCH_WORDS	512
+
+static const char *bench_algos[] = {
+	"lz4", "lzfx", "zlib", "zstd", "bzip2", "lzma", "ppmd", "libbsc", NULL
+};
+
+static const char *bench_ciphers[] = {
+	"AES", "AES-GCM", "SALSA20", "CHACHA20", NULL
+};
+
+static uint64_t
+bench_rand(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (*s);
+}
+
+/*
+ * Words drawn from a small vocabulary with a skewed distribution, which
+ * compresses roughly like plain text.
+ */
+static void
+bench_gen_text(uchar_t *buf, uint64_t len)
+{
+	char words[BENCH_WORDS][12];
+	uint64_t s, i, r;
+	int w, j, l;
+
+	s = 0x9E3779B97F4A7C15ULL;
+	for (w = 0; w < BENCH_WORDS; w++) {
+		l = 2 + bench_rand(&s) % 8;
+		for (j = 0; j < l; j++)
+			words[w][j] = 'a' + bench_rand(&s) % 26;
+		words[w][l] = '\0';
+	}
+	i = 0;
+	while (i < len) {
+		r = bench_rand(&s);
+		w = (int)((r % BENCH_WORDS) * ((r >> 32) % BENCH_WORDS) / BENCH_WORDS);
+		for (j = 0; words[w][j] != '\0' && i < len; j++)
+			buf[i++] = words[w][j];
+		if (i < len)
+			buf[i++] = ((r >> 20) & 15) == 0 ? '\n' : ' ';
+	}
+}
+
+static void
+bench_gen_random(uchar_t *buf, uint64_t len)
+{
+	uint64_t s, i, v;
+
+	s = 0xD1B54A32D192ED03ULL;
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = bench_rand(&s);
+		memcpy(buf + i, &v, 8);
+	}
+	for (; i < len; i++)
+		buf[i] = bench_rand(&s) & 0xff;
+}
+
+static double
+bench_checksum(int cksum, uchar_t *buf, uint64_t len, int mt)
+{
+	uchar_t digest[CKSUM_MAX_BYTES];
+	double st, en;
+	uint64_t tot;
+
+	tot = 0;
+	st = get_wtime_millis();
+	do {
+		compute_checksum(digest, cksum, buf, len, mt, 0);
+		tot += len;
+		en = get_wtime_millis();
+	} while (en - st < BENCH_MIN_MS);
+	return (get_mb_s(tot, st, en));
+}
+
+/*
+ * Key setup runs scrypt and is not part of the timing.
+ */
+static double
+bench_cipher(int alg, int keylen, uchar_t *src, uchar_t *dst, uint64_t len)
+{
+	crypto_ctx_t cctx;
+	uchar_t pwd[] = "pcbench0", tag[AEAD_TAG_LEN];
+	double st, en;
+	uint64_t tot, id;
+	int rv;
+
+	memset(&cctx, 0, sizeof (cctx));
+	if (init_crypto(&cctx, pwd, sizeof (pwd) - 1, alg, NULL, 0, keylen, NULL,
+	    ENCRYPT_FLAG) == -1)
+		return (0);
+	tot = 0;
+	id = 0;
+	st = get_wtime_millis();
+	en = st;
+	do {
+		if (crypto_is_aead(&cctx))
+			rv = crypto_aead_buf(&cctx, src, dst, len, id, NULL, 0, tag);
+		else
+			rv = crypto_buf(&cctx, src, dst, len, id);
+		if (rv == -1)
+			break;
+		tot += len;
+		id++;
+		en = get_wtime_millis();
+	} while (en - st < BENCH_MIN_MS);
+	crypto_clean_pkey(&cctx);
+	cleanup_crypto(&cctx);
+	if (rv == -1)
+		return (0);
+	return (get_mb_s(tot, st, en));
+}
 
-	} else if (memcmp(algorithm, "ppmd", 4) == 0) {
-		pctx->_compress_func = ppmd_compress;
-		pctx->_decompress_func = ppmd_decompress;
-		pctx->_init_func = ppmd_init;
-		pctx->_deinit_func = ppmd_deinit;
-		pctx->_stats_func = ppmd_stats;
-		pctx->_props_func = ppmd_props;
-		rv = 0;
+/*
+ * Compress and decompress one buffer at level 1 until BENCH_MIN_MS have
+ * passed each way. Returns -1 if the codec fails or does not round trip.
+ */
+static int
+bench_codec(pc_ctx_t *tctx, uchar_t *data, uint64_t len, uchar_t *cbuf, uint64_t cbsz,
+    uchar_t *ubuf, double *cmbs, double *dmbs, double *ratio)
+{
+	void *cdat;
+	uint64_t cl, ul, tot;
+	double st, en;
+	int level, rv;
+
+	cdat = NULL;
+	level = 1;
+	if (tctx->_init_func && tctx->_init_func(&cdat, &level, 1, len, VERSION,
+	    COMPRESS) != 0)
+		return (-1);
+	tot = 0;
+	st = get_wtime_millis();
+	do {
+		cl = cbsz;
+		rv = tctx->_compress_func(data, len, cbuf, &cl, level, 0, TYPE_UNKNOWN, cdat);
+		tot += len;
+		en = get_wtime_millis();
+	} while (rv >= 0 && en - st < BENCH_MIN_MS);
+	if (tctx->_deinit_func)
+		tctx->_deinit_func(&cdat);
+	*cmbs = get_mb_s(tot, st, en);
 
-	} else if (memcmp(algorithm, "lzfx", 4) == 0) {
-		pctx->_compress_func = lz_fx_compress;
-		pctx->_decompress_func = lz_fx_decompress;
-		pctx->_init_func = lz_fx_init;
-		pctx->_deinit_func = lz_fx_deinit;
-		pctx->_stats_func = lz_fx_stats;
-		pctx->_props_func = lz_fx_props;
-		rv = 0;
+	/*
+	 * Data that does not shrink is stored as is in a real run.
+	 */
+	if (rv < 0 || cl >= len) {
+		*dmbs = 0;
+		*ratio = 1.0;
+		return (0);
+	}
+	*ratio = (double)len / cl;
+	cdat = NULL;
+	level = 1;
+	if (tctx->_init_func && tctx->_init_func(&cdat, &level, 1, len, VERSION,
+	    DECOMPRESS) != 0)
+		return (-1);
+	tot = 0;
+	st = get_wtime_millis();
+	do {
+		ul = len;
+		rv = tctx->_decompress_func(cbuf, cl, ubuf, &ul, level, 0, TYPE_UNKNOWN, cdat);
+		tot += len;
+		en = get_wtime_millis();
+	} while (rv >= 0 && en - st < BENCH_MIN_MS);
+	if (tctx->_deinit_func)
+		tctx->_deinit_func(&cdat);
+	*dmbs = get_mb_s(tot, st, en);
+	if (rv < 0 || ul != len || memcmp(ubuf, data, len) != 0)
+		return (-1);
+	return (0);
+}
 
-	} else if (memcmp(algorithm, "lz4", 3) == 0) {
-		pctx->_compress_func = lz4_compress;
-		pctx->_decompress_func = lz4_decompress;
-		pctx->_init_func = lz4_init;
-		pctx->_deinit_func = lz4_deinit;
-		pctx->_stats_func = lz4_stats;
-		pctx->_props_func = lz4_props;
-		rv = 0;
+static int
+self_bench(pc_ctx_t *pctx)
+{
+	uchar_t *bufs[3], *cbuf, *ubuf;
+	uint64_t lens[3], cbsz;
+	const char *dnames[3] = {"text", "random", "sample"};
+	const char *name, *impl, *best_ck, *best_cck, *best_ci;
+	double st_mbs, mt_mbs, best_ck_mbs, best_cck_mbs, best_ci_mbs, mbs, eff;
+	int ncpu, n, cksum, crypto, alg, ndata, d, err;
+
+	err = 1;
+	ncpu = get_avail_cpus();
+	if (ncpu < 1)
+		ncpu = 1;
+	cbsz = BENCH_BUF_SZ + zlib_buf_extra(BENCH_BUF_SZ) + BENCH_BUF_SZ / 2;
+	bufs[0] = (uchar_t *)malloc(BENCH_BUF_SZ);
+	bufs[1] = (uchar_t *)malloc(BENCH_BUF_SZ);
+	bufs[2] = NULL;
+	cbuf = (uchar_t *)malloc(cbsz);
+	ubuf = (uchar_t *)malloc(cbsz);
+	if (bufs[0] == NULL || bufs[1] == NULL || cbuf == NULL || ubuf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		goto bench_out;
+	}
+	bench_gen_text(bufs[0], BENCH_BUF_SZ);
+	bench_gen_random(bufs[1], BENCH_BUF_SZ);
+	lens[0] = BENCH_BUF_SZ;
+	lens[1] = BENCH_BUF_SZ;
+	ndata = 2;
+	if (pctx->bench_file != NULL) {
+		int fd;
+		int64_t rd;
+
+		if ((fd = open(pctx->bench_file, O_RDONLY)) == -1) {
+			log_msg(LOG_ERR, 1, "Cannot open: %s", pctx->bench_file);
+			goto bench_out;
+		}
+		bufs[2] = (uchar_t *)malloc(BENCH_BUF_SZ);
+		rd = -1;
+		if (bufs[2] != NULL)
+			rd = Read(fd, bufs[2], BENCH_BUF_SZ);
+		close(fd);
+		if (rd <= 0) {
+			log_msg(LOG_ERR, 1, "Cannot read: %s ", pctx->bench_file);
+			goto bench_out;
+		}
+		lens[2] = rd;
+		ndata = 3;
+	}
 
-	} else if (memcmp(algorithm, "none", 4) == 0) {
-		pctx->_compress_func = none_compress;
-		pctx->_decompress_func = none_decompress;
-		pctx->_init_func = none_init;
-		pctx->_deinit_func = none_deinit;
-		pctx->_stats_func = none_stats;
-		pctx->_props_func = none_props;
-		rv = 0;
+	printf("Processor: %s, SSE %d.%d, AVX %d%s, %d cores used\n",
+	    proc_info.proc_type == PROC_X64_INTEL ? "Intel x86-64" :
+	    proc_info.proc_type == PROC_X64_AMD ? "AMD x86-64" :
+	    proc_info.proc_type == PROC_BIGENDIAN_GENERIC ? "Big endian" : "Little endian",
+	    proc_info.sse_level, proc_info.sse_sub_level, proc_info.avx_level,
+	    proc_info.aes_avail ? ", AES-NI" : "", ncpu);
 
-	/* adapt2 and adapt ordering of the checks matter here. */
-	} else if (memcmp(algorithm, "adapt2", 6) == 0) {
-		pctx->_compress_func = adapt_compress;
-		pctx->_decompress_func = adapt_decompress;
-		pctx->_init_func = adapt2_init;
-		pctx->_deinit_func = adapt_deinit;
-		pctx->_stats_func = adapt_stats;
-		pctx->_props_func = adapt_props;
-		pctx->adapt_mode = 2;
-		pctx->enable_analyzer = 1;
-		rv = 0;
+	/*
+	 * The multi-threaded checksums are used when a file fits in a
+	 * single chunk, otherwise each thread hashes its own chunks.
+	 */
+	printf("\n%-10s %-30s %10s %10s %10s\n", "Checksum", "Implementation",
+	    "MB/s/core", "MT MB/s", "MT/core");
+	best_ck = best_cck = NULL;
+	best_ck_mbs = best_cck_mbs = 0;
+	for (n = 0; (cksum = get_checksum_info(n, &name, &crypto, &impl)) != -1; n++) {
+		st_mbs = bench_checksum(cksum, bufs[1], lens[1], 0);
+		mt_mbs = bench_checksum(cksum, bufs[1], lens[1], 1);
+		printf("%-10s %-30s %10.1f %10.1f %10.1f\n", name, impl, st_mbs, mt_mbs,
+		    mt_mbs / ncpu);
+		if (st_mbs > best_ck_mbs) {
+			best_ck = name;
+			best_ck_mbs = st_mbs;
+		}
+		if (crypto && st_mbs > best_cck_mbs) {
+			best_cck = name;
+			best_cck_mbs = st_mbs;
+		}
+	}
 
-	} else if (memcmp(algorithm, "adapt", 5) == 0) {
-		pctx->_compress_func = adapt_compress;
-		pctx->_decompress_func = adapt_decompress;
-		pctx->_init_func = adapt_init;
-		pctx->_deinit_func = adapt_deinit;
-		pctx->_stats_func = adapt_stats;
-		pctx->_props_func = adapt_props;
-		pctx->adapt_mode = 1;
-		pctx->enable_analyzer = 1;
-		rv = 0;
-#ifdef ENABLE_PC_LIBBSC
-	} else if (memcmp(algorithm, "libbsc", 6) == 0) {
-		pctx->_compress_func = libbsc_compress;
-		pctx->_decompress_func = libbsc_decompress;
-		pctx->_init_func = libbsc_init;
-		pctx->_deinit_func = libbsc_deinit;
-		pctx->_stats_func = libbsc_stats;
-		pctx->_props_func = libbsc_props;
-		rv = 0;
-#endif
+	/*
+	 * Other than AES-GCM every cipher needs a separate HMAC pass over the
+	 * data, which is taken to run at the rate of the fastest cryptographic
+	 * checksum above.
+	 */
+	printf("\n%-10s %-30s %10s %10s\n", "Cipher", "Implementation", "MB/s/core",
+	    "With MAC");
+	best_ci = NULL;
+	best_ci_mbs = 0;
+	for (n = 0; bench_ciphers[n] != NULL; n++) {
+		alg = get_crypto_alg((char *)bench_ciphers[n]);
+		mbs = bench_cipher(alg, pctx->keylen, bufs[1], cbuf, lens[1]);
+		if (mbs == 0) {
+			printf("%-10s %-30s %10s\n", bench_ciphers[n], crypto_impl(alg), "failed");
+			continue;
+		}
+		eff = mbs;
+		if (alg != CRYPTO_ALG_AES_GCM && best_cck_mbs > 0)
+			eff = 1.0 / (1.0 / mbs + 1.0 / best_cck_mbs);
+		printf("%-10s %-30s %10.1f %10.1f\n", bench_ciphers[n], crypto_impl(alg),
+		    mbs, eff);
+		if (eff > best_ci_mbs) {
+			best_ci = bench_ciphers[n];
+			best_ci_mbs = eff;
+		}
 	}
 
-	return (rv);
+	printf("\n%-8s %-7s %8s %10s %12s\n", "Codec", "Data", "Ratio", "Comp/core",
+	    "Decomp/core");
+	for (n = 0; bench_algos[n] != NULL; n++) {
+		pc_ctx_t tctx;
+		double cmbs, dmbs, ratio;
+
+		memset(&tctx, 0, sizeof (tctx));
+		if (init_algo(&tctx, bench_algos[n], 0) != 0)
+			continue;
+		for (d = 0; d < ndata; d++) {
+			if (bench_codec(&tctx, bufs[d], lens[d], cbuf, cbsz, ubuf, &cmbs,
+			    &dmbs, &ratio) != 0) {
+				printf("%-8s %-7s   failed\n", bench_algos[n], dnames[d]);
+				continue;
+			}
+			if (dmbs == 0) {
+				printf("%-8s %-7s %8.3f %10.1f %12s\n", bench_algos[n],
+				    dnames[d], ratio, cmbs, "stored");
+				continue;
+			}
+			printf("%-8s %-7s %8.3f %10.1f %12.1f\n", bench_algos[n], dnames[d],
+			    ratio, cmbs, dmbs);
+		}
+	}
+
+	printf("\nRecommended:\n");
+	if (best_cck != NULL)
+		printf("  -S %-10s fastest cryptographic checksum (default %s)\n",
+		    best_cck, DEFAULT_CKSUM);
+	if (best_ck != NULL && best_ck != best_cck)
+		printf("  -S %-10s fastest checksum, detects corruption only\n", best_ck);
+	if (best_ci != NULL)
+		printf("  -e %-10s fastest cipher including the MAC\n", best_ci);
+	printf("  Codec speeds are at level 1, use -Q on real data to pick -c and -l.\n");
+	err = 0;
+
+bench_out:
+	free(bufs[0]);
+	free(bufs[1]);
+	free(bufs[2]);
+	free(cbuf);
+	free(ubuf);
+	return (err);
 }
 
 /*
  * Pcompress context handling functions.
+ *
+ * The allocator and the processor dependent routines are process wide. They
+ * are set up by the first context and the allocator is torn down with the
+ * last one, so that several contexts can be live at once as in server mode.
  */
+static pthread_mutex_t ctx_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ctx_count = 0;
+
 pc_ctx_t DLL_EXPORT * 
 create_pc_context(void)
 {
 	pc_ctx_t *ctx = (pc_ctx_t *)malloc(sizeof (pc_ctx_t));
 
-	slab_init();
-	init_pcompress();
+	pthread_mutex_lock(&ctx_count_lock);
+	if (ctx_count++ == 0) {
+		slab_init();
+		init_pcompress();
+	}
+	pthread_mutex_unlock(&ctx_count_lock);
 	init_archive_mod();
 
 	memset(ctx, 0, sizeof (pc_ctx_t));
@@ -3120,10 +8748,28 @@ create_pc_context(void)
 	ctx->enable_rabin_split = 1;
 	ctx->rab_blk_size = -1;
 	ctx->archive_temp_fd = -1;
+	ctx->pwrite_fd = -1;
+	ctx->pipe_infd = -1;
+	ctx->pipe_outfd = -1;
+	ctx->ckpt_fd = -1;
+	if (getenv("PCOMPRESS_CHECKPOINT") != NULL && atoi(getenv("PCOMPRESS_CHECKPOINT")) > 0)
+		ctx->ckpt_ms = atoi(getenv("PCOMPRESS_CHECKPOINT")) * 1000ULL;
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->btype = TYPE_UNKNOWN;
 	ctx->delta2_nstrides = NSTRIDES_STANDARD;
+	ctx->run_scan = (getenv("PCOMPRESS_RUNS") != NULL && atoi(getenv("PCOMPRESS_RUNS")) > 0);
+	ctx->no_entropy_skip = (getenv("PCOMPRESS_NO_ENTROPY_SKIP") != NULL);
+	ctx->chunk_plan = (getenv("PCOMPRESS_PLAN") != NULL && atoi(getenv("PCOMPRESS_PLAN")) > 0);
+	ctx->chunk_cache_size = CHUNK_CACHE_BYTES;
+	if (getenv("PCOMPRESS_CHUNK_CACHE") != NULL) {
+		int64_t csz;
+
+		if (parse_numeric(&csz, getenv("PCOMPRESS_CHUNK_CACHE")) != 2 && csz >= 0)
+			ctx->chunk_cache_size = csz;
+	}
 	pthread_mutex_init(&ctx->write_mutex, NULL);
+	pthread_mutex_init(&ctx->link_lock, NULL);
+	pthread_cond_init(&ctx->link_cv, NULL);
 
 	return (ctx);
 }
@@ -3131,12 +8777,32 @@ create_pc_context(void)
 void DLL_EXPORT
 destroy_pc_context(pc_ctx_t *pctx)
 {
+	pc_session_end(pctx);
 	if (pctx->do_compress)
 		free((void *)(pctx->filename));
 	if (pctx->pwd_file)
 		free(pctx->pwd_file);
+	free(pctx->cidx);
+	free(pctx->midx);
+	free(pctx->append_tail);
+	free(pctx->xmembers);
+	free(pctx->verify_failed);
+	while (pctx->batch_nfiles > 0)
+		free(pctx->batch_files[--pctx->batch_nfiles]);
+	free(pctx->batch_files);
+	pc_throttle_destroy(pctx->throttle);
+	if (pctx->chunk_cache != NULL) {
+		log_msg(LOG_VERBOSE, 0, "Chunk cache: %" PRIu64 " hits, %" PRIu64 " misses, %"
+		    PRIu64 " evicted.", pctx->chunk_cache->hits, pctx->chunk_cache->misses,
+		    pctx->chunk_cache->evicted);
+		pc_cache_destroy(pctx->chunk_cache);
+	}
+	pc_filter_destroy(pctx->filters);
 	free((void *)(pctx->exec_name));
-	slab_cleanup(pctx->hide_mem_stats);
+	pthread_mutex_lock(&ctx_count_lock);
+	if (--ctx_count == 0)
+		slab_cleanup(pctx->hide_mem_stats);
+	pthread_mutex_unlock(&ctx_count_lock);
 	free(pctx);
 }
 
@@ -3178,13 +8844,20 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	ff.enable_packjpg = 0;
 	ff.enable_wavpack = 0;
 	ff.exe_preprocess = 0;
+	ff.enable_deflate = 0;
 
 	pthread_mutex_lock(&opt_parse);
-	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avmKjxiTn")) != -1) {
+	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avmKjxiTnNWIX:b:VAR:Y:O:UQ:Z:Hro:g:yJ")) != -1) {
 		int ovr;
 		int64_t chunksize;
 
 		switch (opt) {
+		    case 'V':
+			if (pctx->verify_mode < VERIFY_HMAC)
+				pctx->verify_mode++;
+			pctx->do_uncompress = 1;
+			break;
+
 		    case 'i':
 			pctx->list_mode = 1; // List mode also sets decompress flag
 		    case 'd':
@@ -3201,6 +8874,12 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			break;
 
 		    case 's':
+			if (strcmp(optarg, "auto") == 0) {
+				pctx->chunk_auto = 1;
+				pctx->chunksize = 0;
+				break;
+			}
+			pctx->chunk_auto = 0;
 			ovr = parse_numeric(&chunksize, optarg);
 			if (ovr == 1) {
 				log_msg(LOG_ERR, 0, "Chunk size too large %s", optarg);
@@ -3284,7 +8963,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->encrypt_type = get_crypto_alg(optarg);
 			if (pctx->encrypt_type == 0) {
 				log_msg(LOG_ERR, 0, "Invalid encryption algorithm. "
-				    "Should be AES or SALSA20.", optarg);
+				    "Should be AES, SALSA20, CHACHA20 or AES-GCM.", optarg);
 				return (1);
 			}
 			break;
@@ -3332,6 +9011,53 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->do_compress = 1;
 			break;
 
+		    case 'A':
+			pctx->batch_mode = 1;
+			break;
+
+		    case 'Z':
+			pctx->server_path = optarg;
+			break;
+
+		    case 'J':
+			pctx->fuse_mount = 1;
+			break;
+
+		    case 'R':
+			ovr = parse_numeric(&chunksize, optarg);
+			if (ovr == 2 || chunksize <= 0) {
+				log_msg(LOG_ERR, 0, "Invalid read rate %s", optarg);
+				return (1);
+			}
+			pctx->read_rate = chunksize;
+			break;
+
+		    case 'Y':
+			pctx->cpu_share = atoi(optarg);
+			if (pctx->cpu_share < 1 || pctx->cpu_share > 100) {
+				log_msg(LOG_ERR, 0, "CPU share should be in range 1 - 100");
+				return (1);
+			}
+			break;
+
+		    case 'O':
+			pctx->do_compress = 1;
+			pctx->decode_target = atoi(optarg);
+			if (pctx->decode_target < 1) {
+				log_msg(LOG_ERR, 0, "Invalid decompression speed %s", optarg);
+				return (1);
+			}
+			break;
+
+		    case 'Q':
+			pctx->do_compress = 1;
+			pctx->estimate = optarg;
+			break;
+
+		    case 'H':
+			pctx->self_bench = 1;
+			break;
+
 		    case 'v':
 			set_log_level(LOG_VERBOSE);
 			break;
@@ -3348,6 +9074,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->advanced_opts = 1;
 			ff.enable_packjpg = 1;
 			ff.enable_wavpack = 1;
+			ff.enable_deflate = 1;
 			break;
 
 		    case 'x':
@@ -3360,32 +9087,332 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->meta_stream = -1;
 			break;
 
-		   case 'n':
-			pctx->enable_archive_sort = -1;
-			break;
+		   case 'n':
+			pctx->enable_archive_sort = -1;
+			break;
+
+		    case 'N':
+			pctx->archive_sim_sort = 1;
+			break;
+
+		    case 'y':
+			pctx->archive_type_dicts = 1;
+			break;
+
+		    case 'W':
+			pctx->archive_dup_members = 1;
+			break;
+
+		    case 'I':
+			pctx->chunk_index = 1;
+			break;
+
+		    case 'U':
+			pctx->append_mode = 1;
+			break;
+
+		    case 'r':
+			pctx->resume = 1;
+			break;
+
+		    case 'g': {
+			char *soff, *slen;
+			int64_t off, len;
+
+			soff = strdup(optarg);
+			if (soff == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory");
+				return (1);
+			}
+			len = 0;
+			ovr = 0;
+			if ((slen = strchr(soff, ',')) != NULL) {
+				*slen++ = '\0';
+				ovr = parse_numeric(&len, slen);
+			}
+			if (ovr != 0 || parse_numeric(&off, soff) != 0 || off < 0 || len < 0 ||
+			    (slen != NULL && len == 0)) {
+				log_msg(LOG_ERR, 0, "Invalid shard %s", optarg);
+				free(soff);
+				return (1);
+			}
+			free(soff);
+			pctx->shard_mode = 1;
+			pctx->shard_off = off;
+			pctx->shard_len = len;
+			break;
+		    }
+
+		    case 'o':
+			ovr = parse_numeric(&chunksize, optarg);
+			if (ovr != 0 || chunksize <= 0) {
+				log_msg(LOG_ERR, 0, "Invalid linked chunk window %s", optarg);
+				return (1);
+			}
+			pctx->link_wlog = LINK_MIN_WLOG;
+			while (pctx->link_wlog < LINK_MAX_WLOG &&
+			    (1ULL << pctx->link_wlog) < (uint64_t)chunksize)
+				pctx->link_wlog++;
+			break;
+
+		    case 'X': {
+			char **xm;
+
+			xm = (char **)realloc(pctx->xmembers,
+			    (pctx->xmembers_count + 1) * sizeof (char *));
+			if (xm == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory");
+				return (1);
+			}
+			xm[pctx->xmembers_count++] = optarg;
+			pctx->xmembers = xm;
+			break;
+		    }
+
+		    case 'b':
+			ovr = parse_numeric(&chunksize, optarg);
+			if (ovr == 2 || chunksize <= 0) {
+				log_msg(LOG_ERR, 0, "Invalid memory budget %s", optarg);
+				return (1);
+			}
+			pctx->mem_budget = chunksize;
+			break;
+
+		    case '?':
+		    default:
+			return (2);
+			break;
+		}
+	}
+	my_optind = optind;
+	optind = 0;
+	pthread_mutex_unlock(&opt_parse);
+
+	/*
+	 * The self benchmark takes an optional sample file. Only -k and -v
+	 * apply to it.
+	 */
+	if (pctx->self_bench) {
+		if (pctx->do_compress || pctx->do_uncompress || argc > my_optind + 1) {
+			log_msg(LOG_ERR, 0, "'-H' takes at most one file name and no "
+			    "compression options.");
+			return (1);
+		}
+		if (argc > my_optind)
+			pctx->bench_file = argv[my_optind];
+		pctx->inited = 1;
+		return (0);
+	}
+
+	if ((pctx->do_compress && pctx->do_uncompress) || (!pctx->do_compress && !pctx->do_uncompress)) {
+		return (2);
+	}
+
+	if (pctx->archive_mode && pctx->do_uncompress) {
+		log_msg(LOG_ERR, 0, "'-a' flag is only for archive creation.");
+		return (1);
+	}
+
+	if (pctx->verify_mode && pctx->list_mode) {
+		log_msg(LOG_ERR, 0, "'-V' and '-i' cannot be used together.");
+		return (1);
+	}
+
+	if (pctx->chunk_index && !pctx->do_compress) {
+		log_msg(LOG_ERR, 0, "'-I' flag is only for compression.");
+		return (1);
+	}
+
+	if (pctx->xmembers_count > 0 && (!pctx->do_uncompress || pctx->list_mode ||
+	    pctx->verify_mode || pctx->pipe_mode)) {
+		log_msg(LOG_ERR, 0, "'-X' flag is only for extracting from an archive file.");
+		return (1);
+	}
+
+	if (pctx->fuse_mount && (!pctx->do_uncompress || pctx->list_mode ||
+	    pctx->verify_mode || pctx->pipe_mode || pctx->xmembers_count > 0)) {
+		log_msg(LOG_ERR, 0, "'-J' is only for mounting an archive file, it cannot "
+		    "be used with '-i', '-V', '-p' or '-X'.");
+		return (1);
+	}
+
+	if (pctx->archive_mode && pctx->pipe_mode) {
+		log_msg(LOG_ERR, 0, "Full pipeline mode is meaningless with archiver.");
+		return (1);
+	}
+
+	if (pctx->batch_mode && (!pctx->do_compress || pctx->archive_mode ||
+	    pctx->pipe_mode)) {
+		log_msg(LOG_ERR, 0, "'-A' is only for compressing individual files.");
+		return (1);
+	}
+
+	if (pctx->batch_mode && pctx->encrypt_type) {
+		log_msg(LOG_ERR, 0, "Encryption is not supported in batch mode.");
+		return (1);
+	}
+
+	/*
+	 * The server compresses with the options it was started with and takes
+	 * the file names from its clients.
+	 */
+	if (pctx->server_path != NULL && (!pctx->do_compress || pctx->archive_mode ||
+	    pctx->pipe_mode || pctx->batch_mode || pctx->encrypt_type ||
+	    pctx->estimate != NULL || pctx->decode_target || argc > my_optind)) {
+		log_msg(LOG_ERR, 0, "'-Z' needs '-c' and takes no file names. It cannot "
+		    "be used with '-a', '-p', '-A', '-e', '-Q' or '-O'.");
+		return (1);
+	}
+
+	if ((pctx->read_rate || pctx->cpu_share) && !pctx->do_compress) {
+		log_msg(LOG_ERR, 0, "'-R' and '-Y' are only for compression.");
+		return (1);
+	}
+	if (pctx->read_rate || pctx->cpu_share) {
+		pctx->throttle = pc_throttle_create(pctx->read_rate,
+		    pctx->cpu_share < 100 ? pctx->cpu_share : 0);
+		if (pctx->throttle == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			return (1);
+		}
+	}
+	if (pctx->do_compress) {
+		pctx->filters = pc_filter_create();
+		if (pctx->filters == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			return (1);
+		}
+	}
+
+	/*
+	 * Appending keeps the settings of the existing archive.
+	 */
+	if (pctx->append_mode) {
+		if (!pctx->archive_mode || argc - my_optind < 2) {
+			log_msg(LOG_ERR, 0, "'-U' needs '-a', the paths to add and the "
+			    "archive name.");
+			return (1);
+		}
+		if (pctx->algo != NULL || pctx->level != -1 || pctx->chunksize != 0 ||
+		    pctx->chunk_auto || pctx->cksum != 0 || pctx->encrypt_type ||
+		    pctx->enable_rabin_scan || pctx->enable_fixed_scan ||
+		    pctx->enable_rabin_global || pctx->decode_target) {
+			log_msg(LOG_ERR, 0, "'-U' takes the algorithm, level, chunk size, "
+			    "checksum and dedupe settings from the archive.");
+			return (1);
+		}
+		if (append_load_header(pctx, argv[argc - 1]) != 0)
+			return (1);
+	}
 
-		    case '?':
-		    default:
-			return (2);
-			break;
+	/*
+	 * Linked chunks are decompressed in order from the start, each after the
+	 * data of the ones before it. Only zstd takes a prefix.
+	 */
+	if (pctx->link_wlog) {
+		if (!pctx->do_compress || pctx->chunk_index || pctx->enable_rabin_global) {
+			log_msg(LOG_ERR, 0, "'-o' is for compression and cannot be used "
+			    "with '-I', '-U' or '-G'.");
+			return (1);
+		}
+		if (pctx->algo == NULL || strncmp(pctx->algo, "zstd", 4) != 0) {
+			log_msg(LOG_ERR, 0, "'-o' needs the zstd algorithm.");
+			return (1);
 		}
 	}
-	my_optind = optind;
-	optind = 0;
-	pthread_mutex_unlock(&opt_parse);
 
-	if ((pctx->do_compress && pctx->do_uncompress) || (!pctx->do_compress && !pctx->do_uncompress)) {
-		return (2);
+	/*
+	 * Shards of one file, compressed with the same options, are put together
+	 * by concatenating them in order. Their chunks may not depend on each
+	 * other or on where they end up in the archive.
+	 */
+	if (pctx->shard_mode) {
+		if (!pctx->do_compress || pctx->pipe_mode || pctx->archive_mode ||
+		    pctx->append_mode || pctx->resume || pctx->batch_mode ||
+		    pctx->estimate != NULL) {
+			log_msg(LOG_ERR, 0, "'-g' compresses part of a file and cannot "
+			    "be used with '-d', '-p', '-a', '-U', '-r', '-A' or '-Q'.");
+			return (1);
+		}
+		if (pctx->encrypt_type || pctx->enable_rabin_global || pctx->chunk_index ||
+		    pctx->link_wlog || pctx->mem_budget) {
+			log_msg(LOG_ERR, 0, "'-g' cannot be used with '-e', '-G', '-I', "
+			    "'-o' or '-b'.");
+			return (1);
+		}
 	}
 
-	if (pctx->archive_mode && pctx->do_uncompress) {
-		log_msg(LOG_ERR, 0, "'-a' flag is only for archive creation.");
-		return (1);
+	/*
+	 * Resuming keeps taking checkpoints, every CKPT_DEFAULT_SECS unless
+	 * PCOMPRESS_CHECKPOINT says otherwise.
+	 */
+	if (pctx->resume) {
+		if (!pctx->do_compress || pctx->pipe_mode || pctx->batch_mode) {
+			log_msg(LOG_ERR, 0, "'-r' resumes compressing a file to a file and "
+			    "cannot be used with '-d', '-p' or '-A'.");
+			return (1);
+		}
+		if (pctx->ckpt_ms == 0)
+			pctx->ckpt_ms = CKPT_DEFAULT_SECS * 1000;
 	}
 
-	if (pctx->archive_mode && pctx->pipe_mode) {
-		log_msg(LOG_ERR, 0, "Full pipeline mode is meaningless with archiver.");
-		return (1);
+	/*
+	 * A dry run takes the defaults of the first listed algorithm unless -c
+	 * is given, so that chunk size and dedupe are set up as in a real run.
+	 * Nothing is written, so an existing compressed file does not matter.
+	 */
+	if (pctx->estimate != NULL) {
+		if (pctx->archive_mode || pctx->pipe_mode || pctx->batch_mode ||
+		    pctx->append_mode || pctx->decode_target || pctx->encrypt_type ||
+		    argc - my_optind != 1) {
+			log_msg(LOG_ERR, 0, "'-Q' takes one input file and cannot be used "
+			    "with '-a', '-p', '-A', '-U', '-O' or '-e'.");
+			return (1);
+		}
+		pctx->estimate_level = pctx->level;
+		if (pctx->algo == NULL) {
+			pctx->algo = strndup(pctx->estimate, strcspn(pctx->estimate, ":,"));
+			if (pctx->algo == NULL || init_algo(pctx, pctx->algo, 1) != 0) {
+				log_msg(LOG_ERR, 0, "Invalid algorithm list %s", pctx->estimate);
+				return (1);
+			}
+		}
+	}
+
+	/*
+	 * With a decode speed target the preset decides algorithm, level,
+	 * preprocessing and, unless given, the chunk size.
+	 */
+	if (pctx->decode_target) {
+		struct decode_preset *dp;
+
+		if (pctx->algo != NULL || pctx->level != -1 || pctx->advanced_opts) {
+			log_msg(LOG_ERR, 0, "'-O' cannot be used with '-c', '-l' or "
+			    "preprocessing and dedupe options.");
+			return (1);
+		}
+		dp = select_decode_preset(pctx, my_optind < argc ? argv[my_optind] : NULL);
+		pctx->algo = (char *)dp->algo;
+		init_algo(pctx, pctx->algo, 1);
+		pctx->level = dp->level;
+		if (pctx->chunksize == 0 && !pctx->chunk_auto) {
+			pctx->chunksize = dp->chunksize;
+			if (pctx->chunksize > EIGHTY_PCT(get_total_ram()))
+				pctx->chunksize = EIGHTY_PCT(get_total_ram());
+		}
+		pctx->advanced_opts = 1;
+#ifndef _MPLV2_LICENSE_
+		pctx->lzp_preprocess = dp->lzp;
+#endif
+		pctx->enable_delta2_encode = dp->delta2;
+		if (dp->dedupe) {
+			pctx->enable_rabin_scan = 1;
+			pctx->enable_rabin_split = 1;
+		}
+		log_msg(LOG_INFO, 0, "Decode target %d MB/s: %s level %d%s%s%s",
+		    pctx->decode_target, dp->algo, dp->level,
+		    dp->lzp ? ", LZP" : "", dp->delta2 ? ", Delta2" : "",
+		    dp->dedupe ? ", Dedupe" : "");
 	}
 
 	/*
@@ -3404,18 +9431,59 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		}
 	}
 
+	if (pctx->archive_dup_members && !pctx->archive_mode) {
+		log_msg(LOG_ERR, 0, "'-W' flag is only for archive creation.");
+		return (1);
+	}
+
+	if (pctx->archive_sim_sort) {
+		if (!pctx->archive_mode) {
+			log_msg(LOG_ERR, 0, "'-N' flag is only for archive creation.");
+			return (1);
+		}
+		if (pctx->enable_archive_sort == -1) {
+			log_msg(LOG_ERR, 0, "'-N' and '-n' cannot be used together.");
+			return (1);
+		}
+	}
+
+	/*
+	 * Per-type dictionaries are stored in clear in the header and take the
+	 * place of any other zstd dictionary or prefix.
+	 */
+	if (pctx->archive_type_dicts) {
+#ifndef ENABLE_PC_ZSTD
+		log_msg(LOG_ERR, 0, "'-y' needs pcompress built with zstd.");
+		return (1);
+#endif
+		if (!pctx->archive_mode || !pctx->do_compress || pctx->append_mode ||
+		    pctx->algo == NULL || strncmp(pctx->algo, "zstd", 4) != 0) {
+			log_msg(LOG_ERR, 0, "'-y' is only for archive creation with zstd.");
+			return (1);
+		}
+		if (pctx->encrypt_type || pctx->link_wlog ||
+		    getenv("PCOMPRESS_ZSTD_DICT") != NULL) {
+			log_msg(LOG_ERR, 0, "'-y' cannot be used with '-e', '-o' or "
+			    "PCOMPRESS_ZSTD_DICT.");
+			return (1);
+		}
+	}
+
 	/*
 	 * Sorting of members when archiving is enabled for compression levels >6 (>2 for lz4),
-	 * unless it is explicitly disabled via '-n'.
+	 * unless it is explicitly disabled via '-n'. Similarity ordering via '-N' always
+	 * needs sorting.
 	 */
 	if (pctx->enable_archive_sort != -1 && pctx->do_compress) {
-		if ((memcmp(pctx->algo, "lz4", 3) == 0 && pctx->level > 1) || pctx->level > 4)
+		if ((memcmp(pctx->algo, "lz4", 3) == 0 && pctx->level > 1) || pctx->level > 4 ||
+		    pctx->archive_sim_sort)
 			pctx->enable_archive_sort = 1;
 	} else {
 		pctx->enable_archive_sort = 0;
 	}
 
 	if (pctx->rab_blk_size == -1) {
+		pctx->rab_blk_auto = (pctx->enable_fixed_scan && !pctx->enable_rabin_global);
 		if (!pctx->enable_rabin_global)
 			pctx->rab_blk_size = 0;
 		else
@@ -3432,6 +9500,15 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	 * Remaining mandatory arguments are the filenames.
 	 */
 	num_rem = argc - my_optind;
+	if (pctx->pipe_mode && num_rem == 1 && pctx->do_compress &&
+	    (pc_net_url(argv[my_optind]) || pc_obj_url(argv[my_optind]))) {
+		if (pc_net_url(argv[my_optind]))
+			pctx->net_url = argv[my_optind];
+		else
+			pctx->obj_url = argv[my_optind];
+		my_optind++;
+		num_rem--;
+	}
 	if (pctx->pipe_mode && num_rem > 0 ) {
 		log_msg(LOG_ERR, 0, "Filename(s) unexpected for pipe mode");
 		return (1);
@@ -3441,7 +9518,15 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		log_msg(LOG_ERR, 0, "Deduplication is only used during compression.");
 		return (1);
 	}
-	if (!pctx->enable_rabin_scan)
+
+	/*
+	 * Chunks end at a content boundary even without dedupe, so that a
+	 * repeated string is not cut at the same arbitrary byte offset in every
+	 * chunk. Archives end chunks at member boundaries instead and -F keeps
+	 * fixed sizes. PCOMPRESS_FIXED_CHUNKS turns this off.
+	 */
+	if (!pctx->enable_rabin_scan && (!pctx->do_compress || pctx->archive_mode ||
+	    pctx->enable_fixed_scan || getenv("PCOMPRESS_FIXED_CHUNKS") != NULL))
 		pctx->enable_rabin_split = 0;
 
 	if (pctx->enable_fixed_scan && (pctx->enable_rabin_scan ||
@@ -3474,6 +9559,17 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	/*
+	 * Archives are restored as files, not as the data stream that a persistent
+	 * index refers to.
+	 */
+	if (pctx->enable_rabin_global && pctx->archive_mode && pctx->do_compress &&
+	    (getenv("PCOMPRESS_GLOBAL_INDEX") != NULL ||
+	    getenv("PCOMPRESS_GLOBAL_INDEX_SHARED") != NULL)) {
+		log_msg(LOG_ERR, 0, "A persistent Global Dedupe index cannot be used when archiving.");
+		return (1);
+	}
+
 	/*
 	 * EXE, PackJPG and WavPack are only valid when archiving files.
 	 */
@@ -3484,10 +9580,44 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
-	if (num_rem == 0 && !pctx->pipe_mode) {
+	if (num_rem == 0 && !pctx->pipe_mode && pctx->server_path == NULL) {
 		log_msg(LOG_ERR, 0, "Expected at least one filename.");
 		return (1);
 
+	} else if (pctx->batch_mode) {
+		char apath[MAXPATHLEN];
+		char *tmp;
+
+		/*
+		 * In batch mode all remaining names are files to be compressed
+		 * each into its own file.pz.
+		 */
+		pctx->batch_files = (char **)calloc(num_rem, sizeof (char *));
+		if (pctx->batch_files == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			return (1);
+		}
+		for (; my_optind < argc; my_optind++) {
+			if ((tmp = realpath(argv[my_optind], NULL)) == NULL) {
+				log_msg(LOG_ERR, 1, "%s", argv[my_optind]);
+				return (1);
+			}
+			pctx->batch_files[pctx->batch_nfiles++] = tmp;
+			if (strlen(tmp) + strlen(COMP_EXTN) >= MAXPATHLEN) {
+				log_msg(LOG_ERR, 0, "Path too long: %s", tmp);
+				return (1);
+			}
+			strcpy(apath, tmp);
+			strcat(apath, COMP_EXTN);
+
+			/* Check if compressed file exists */
+			if ((tmp = realpath(apath, NULL)) != NULL) {
+				log_msg(LOG_ERR, 0, "Compressed file %s exists", tmp);
+				free(tmp);
+				return (1);
+			}
+		}
+
 	} else if (num_rem == 1 || num_rem == 2 || (num_rem > 0 && pctx->archive_mode)) {
 		if (pctx->do_compress) {
 			char apath[MAXPATHLEN];
@@ -3547,19 +9677,31 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 					pctx->to_filename = "-";
 					pctx->pipe_out = 1;
 					pctx->to_filename = NULL;
+				} else if (pc_net_url(argv[my_optind])) {
+					pctx->net_url = argv[my_optind];
+					pctx->pipe_out = 1;
+					pctx->to_filename = NULL;
+				} else if (pc_obj_url(argv[my_optind])) {
+					pctx->obj_url = argv[my_optind];
+					pctx->pipe_out = 1;
+					pctx->to_filename = NULL;
 				} else {
 					strcpy(apath, argv[my_optind]);
 					if (!endswith(apath, COMP_EXTN))
 						strcat(apath, COMP_EXTN);
 					pctx->to_filename = realpath(apath, NULL);
 
-					/* Check if compressed file exists */
-					if (pctx->to_filename != NULL) {
+					/*
+					 * Check if compressed file exists. When appending
+					 * it has to.
+					 */
+					if (pctx->to_filename != NULL && !pctx->append_mode) {
 						log_msg(LOG_ERR, 0, "Compressed file %s exists",
 						    pctx->to_filename);
 						free((void *)(pctx->to_filename));
 						return (1);
 					}
+					free((void *)(pctx->to_filename));
 					pctx->to_filename = argv[my_optind];
 				}
 			} else {
@@ -3568,7 +9710,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				pctx->to_filename = realpath(apath, NULL);
 
 				/* Check if compressed file exists */
-				if (pctx->to_filename != NULL) {
+				if (pctx->to_filename != NULL && pctx->estimate == NULL) {
 					log_msg(LOG_ERR, 0, "Compressed file %s exists",
 					    pctx->to_filename);
 					free((void *)(pctx->to_filename));
@@ -3581,6 +9723,16 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			 */
 			if (*(argv[my_optind]) == '-') {
 				pctx->filename = NULL;
+			} else if (pc_net_url(argv[my_optind])) {
+				pctx->net_url = argv[my_optind];
+				pctx->filename = NULL;
+			} else if (pc_obj_url(argv[my_optind])) {
+				if (pctx->xmembers_count > 0 || pctx->fuse_mount) {
+					log_msg(LOG_ERR, 0, "'-X' and '-J' need a seekable archive file.");
+					return (1);
+				}
+				pctx->obj_url = argv[my_optind];
+				pctx->filename = NULL;
 			} else {
 				if ((pctx->filename = realpath(argv[my_optind], NULL)) == NULL) {
 					log_msg(LOG_ERR, 1, "%s", argv[my_optind]);
@@ -3588,11 +9740,21 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				}
 			}
 			if (num_rem == 2) {
+				if (pctx->verify_mode) {
+					log_msg(LOG_ERR, 0, "Verify mode does not take a target "
+					    "file.");
+					return (1);
+				}
 				my_optind++;
 				pctx->to_filename = argv[my_optind];
 			} else {
 				pctx->to_filename = NULL;
 			}
+			if (pctx->fuse_mount && (pctx->filename == NULL ||
+			    pctx->to_filename == NULL)) {
+				log_msg(LOG_ERR, 0, "'-J' needs an archive file and a mount point.");
+				return (1);
+			}
 		} else {
 			return (1);
 		}
@@ -3606,8 +9768,9 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		get_checksum_props(DEFAULT_CKSUM, &(pctx->cksum), &(pctx->cksum_bytes),
 				   &(pctx->mac_bytes), 0);
 
-	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && pctx->cksum == CKSUM_CRC64) {
-		log_msg(LOG_ERR, 0, "CRC64 checksum is not suitable for Deduplication.");
+	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && (pctx->cksum == CKSUM_CRC64 ||
+	    pctx->cksum == CKSUM_CRC32C || pctx->cksum == CKSUM_XXH3)) {
+		log_msg(LOG_ERR, 0, "CRC and 64-bit checksums are not suitable for Deduplication.");
 		return (1);
 	}
 
@@ -3639,16 +9802,35 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				pctx->chunksize = DEFAULT_CHUNKSIZE + (pctx->level - 8) *
 				    DEFAULT_CHUNKSIZE/4;
 			}
+
+			/*
+			 * Adaptive sizing starts at the default and may grow up to
+			 * CHUNK_AUTO_GROW times it.
+			 */
+			if (pctx->chunk_auto && pctx->enable_rabin_global) {
+				log_msg(LOG_WARN, 0, "Adaptive chunk size is not used with "
+				    "Global Deduplication.");
+				pctx->chunk_auto = 0;
+			}
+			if (pctx->chunk_auto) {
+				pctx->chunksize *= CHUNK_AUTO_GROW;
+				if (pctx->chunksize > EIGHTY_PCT(get_total_ram()))
+					pctx->chunksize = EIGHTY_PCT(get_total_ram());
+			}
 		}
 
+		/*
+		 * The member index needs every member to be one contiguous range of
+		 * the archive stream, so there is no metadata stream with '-I'.
+		 */
 		if (pctx->archive_mode) {
-			if (pctx->meta_stream != -1)
+			if (pctx->meta_stream != -1 && !pctx->chunk_index)
 				pctx->meta_stream = 1;
 			else
 				pctx->meta_stream = 0;
 		}
 
-		if (pctx->pipe_mode)
+		if (pctx->pipe_mode || pctx->obj_url != NULL)
 			pctx->meta_stream = 0;
 
 		/*
@@ -3663,14 +9845,12 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				if (pctx->level > 10) {
 					ff.enable_packjpg = 1;
 					ff.enable_wavpack = 1;
+					ff.enable_deflate = 1;
 				}
 				if (pctx->level > 8) {
 					pctx->exe_preprocess = 1;
 					ff.exe_preprocess = 1;
 				}
-				init_filters(&ff);
-				pctx->enable_packjpg = ff.enable_packjpg;
-				pctx->enable_wavpack = ff.enable_wavpack;
 			}
 
 			/*
@@ -3679,7 +9859,14 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			if (pctx->level > 4) pctx->enable_delta2_encode = 1;
 			if (pctx->level > 9) pctx->lzp_preprocess = 1;
 			if (pctx->level > 3) {
-				if (pctx->chunksize >= RAB_MIN_CHUNK_SIZE_GLOBAL)
+				/*
+				 * The global dedupe index is per process so it would
+				 * make a batch compress one file at a time. Linked
+				 * chunks cannot be restored from global references.
+				 */
+				if (pctx->chunksize >= RAB_MIN_CHUNK_SIZE_GLOBAL &&
+				    !pctx->batch_mode && pctx->server_path == NULL &&
+				    pctx->link_wlog == 0)
 					pctx->enable_rabin_global = 1;
 				if (pctx->chunksize >= RAB_MIN_CHUNK_SIZE) {
 					pctx->enable_rabin_scan = 1;
@@ -3689,6 +9876,22 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			}
 			if (pctx->level > 9) pctx->delta2_nstrides = NSTRIDES_EXTRA;
 		}
+
+		/*
+		 * Appended chunks are decoded with the dedupe mode in the header
+		 * of the archive, which is not rewritten.
+		 */
+		if (pctx->append_mode) {
+			pctx->enable_rabin_global = 0;
+			pctx->enable_rabin_scan = ((pctx->append_flags & FLAG_DEDUP) != 0);
+			pctx->enable_rabin_split = pctx->enable_rabin_scan;
+			pctx->enable_fixed_scan = ((pctx->append_flags & FLAG_DEDUP_FIXED) != 0);
+		}
+		if (pctx->archive_mode) {
+			init_filters(&ff);
+			pctx->enable_packjpg = ff.enable_packjpg;
+			pctx->enable_wavpack = ff.enable_wavpack;
+		}
 		if (pctx->lzp_preprocess || pctx->enable_delta2_encode || pctx->exe_preprocess) {
 			pctx->preprocess_mode = 1;
 			pctx->enable_analyzer = 1;
@@ -3701,6 +9904,7 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		ff.enable_packjpg = 1;
 		ff.enable_wavpack = 1;
 		ff.exe_preprocess = 1;
+		ff.enable_deflate = 1;
 		pctx->enable_packjpg = 1;
 		pctx->enable_wavpack = 1;
 		pctx->exe_preprocess = 1;
@@ -3721,13 +9925,317 @@ start_pcompress(pc_ctx_t *pctx)
 
 	handle_signals();
 	err = 0;
-	if (pctx->do_compress)
+	if (pctx->net_url != NULL) {
+		pctx->net = pc_net_open(pctx->net_url, pctx->do_compress ?
+		    PC_NET_SEND : PC_NET_RECV);
+		if (pctx->net == NULL)
+			return (1);
+		if (pctx->do_compress)
+			pctx->pipe_outfd = pc_net_fd(pctx->net);
+		else
+			pctx->pipe_infd = pc_net_fd(pctx->net);
+	}
+	if (pctx->obj_url != NULL) {
+		if (pctx->do_compress) {
+			pctx->obj = pc_obj_create(pctx->obj_url);
+		} else {
+			pctx->obj = pc_obj_open(pctx->obj_url);
+			if (pctx->obj != NULL)
+				pctx->pipe_infd = pc_obj_fd(pctx->obj);
+		}
+		if (pctx->obj == NULL)
+			return (1);
+	}
+	if (pctx->self_bench)
+		err = self_bench(pctx);
+	else if (pctx->server_path != NULL)
+		err = pc_server_run(pctx);
+	else if (pctx->batch_mode)
+		err = pc_compress_batch(pctx, pctx->batch_files, pctx->batch_nfiles);
+	else if (pctx->estimate != NULL)
+		err = estimate_compress(pctx, pctx->filename);
+	else if (pctx->do_compress)
 		err = start_compress(pctx, pctx->filename, pctx->chunksize, pctx->level);
+	else if (pctx->do_uncompress && pctx->fuse_mount)
+		err = pc_fuse_mount(pctx);
+	else if (pctx->do_uncompress && pctx->xmembers_count > 0)
+		err = extract_members(pctx, pctx->filename, pctx->to_filename);
 	else if (pctx->do_uncompress)
 		err = start_decompress(pctx, pctx->filename, pctx->to_filename);
+	if (pctx->net != NULL) {
+		if (pc_net_close(pctx->net, err) != 0)
+			err = 1;
+		pctx->net = NULL;
+	}
+	if (pctx->obj != NULL) {
+		if (pctx->do_compress) {
+			if (pc_obj_finish(pctx->obj, err) != 0)
+				err = 1;
+		} else {
+			pc_obj_close(pctx->obj);
+		}
+		pctx->obj = NULL;
+	}
+	return (err);
+}
+
+/*
+ * Begin a compression session on an initialized compression context. Files
+ * compressed with pc_compress_file() until pc_session_end() reuse the worker
+ * threads and algorithm state of the previous file instead of setting them up
+ * again, which helps when compressing many small files.
+ */
+int DLL_EXPORT
+pc_session_begin(pc_ctx_t *pctx)
+{
+	struct pc_session *sess;
+
+	if (!pctx->inited || !pctx->do_compress || pctx->archive_mode)
+		return (1);
+	if (pctx->session != NULL)
+		return (0);
+
+	sess = (struct pc_session *)slab_calloc(NULL, 1, sizeof (struct pc_session));
+	if (sess == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (1);
+	}
+	sess->chunksize = pctx->chunksize;
+	sess->nthreads = pctx->nthreads;
+	sess->enable_rabin_scan = pctx->enable_rabin_scan;
+	sess->enable_rabin_global = pctx->enable_rabin_global;
+	sess->enable_rabin_split = pctx->enable_rabin_split;
+	pthread_mutex_init(&sess->lock, NULL);
+	pctx->session = sess;
+	return (0);
+}
+
+/*
+ * Compress filename into to_filename, or filename.pz when to_filename is NULL,
+ * using the options the context was initialized with. A session is begun if
+ * there is none yet. Every file starts from the same options since
+ * start_compress() adjusts some of them to suit the file at hand.
+ */
+int DLL_EXPORT
+pc_compress_file(pc_ctx_t *pctx, const char *filename, const char *to_filename)
+{
+	struct pc_session *sess;
+	char *saved_to;
+	int err;
+
+	if (filename == NULL || pc_session_begin(pctx) != 0)
+		return (1);
+
+	sess = pctx->session;
+	pctx->nthreads = sess->nthreads;
+	pctx->enable_rabin_scan = sess->enable_rabin_scan;
+	pctx->enable_rabin_global = sess->enable_rabin_global;
+	pctx->enable_rabin_split = sess->enable_rabin_split;
+	pctx->cidx_count = 0;
+	pctx->cidx_usize = 0;
+	pctx->main_cancel = 0;
+	pctx->t_errored = 0;
+
+	saved_to = pctx->to_filename;
+	pctx->to_filename = (char *)to_filename;
+	handle_signals();
+	err = start_compress(pctx, filename, pctx->chunksize, pctx->level);
+	pctx->to_filename = saved_to;
+	return (err);
+}
+
+/*
+ * End the compression session, stopping its worker threads.
+ */
+void DLL_EXPORT
+pc_session_end(pc_ctx_t *pctx)
+{
+	if (pctx->session == NULL)
+		return;
+	session_stop_workers(pctx);
+	pthread_mutex_destroy(&pctx->session->lock);
+	slab_release(NULL, pctx->session);
+	pctx->session = NULL;
+}
+
+/*
+ * One file of a batch, compressed on a copy of the batch context.
+ */
+struct batch_file {
+	pc_ctx_t ctx;
+	const char *filename;
+	pthread_t thr;
+	int started, err;
+};
+
+static void *
+batch_compress_file(void *dat)
+{
+	struct batch_file *bf = (struct batch_file *)dat;
+
+	bf->err = start_compress(&bf->ctx, bf->filename, bf->ctx.chunksize,
+	    bf->ctx.level);
+	batch_input_done(&bf->ctx);
+	return (NULL);
+}
+
+static int
+batch_file_finish(struct batch_file *bf)
+{
+	if (!bf->started)
+		return (1);
+	pthread_join(bf->thr, NULL);
+	pc_session_file_fini(&bf->ctx);
+	return (bf->err);
+}
+
+/*
+ * Set up fctx as a copy of the session context pctx to compress one more
+ * file on the session workers, alongside other such files. At most
+ * BATCH_FILES_INFLIGHT of them may be in progress at a time since the work
+ * queue of the session is sized for that. Release with
+ * pc_session_file_fini().
+ */
+int DLL_EXPORT
+pc_session_file_init(pc_ctx_t *fctx, pc_ctx_t *pctx)
+{
+	struct pc_session *sess;
+
+	if (pc_session_begin(pctx) != 0)
+		return (1);
+	sess = pctx->session;
+	memcpy(fctx, pctx, sizeof (pc_ctx_t));
+	fctx->nthreads = sess->nthreads;
+	fctx->enable_rabin_scan = sess->enable_rabin_scan;
+	fctx->enable_rabin_global = sess->enable_rabin_global;
+	fctx->enable_rabin_split = sess->enable_rabin_split;
+	fctx->to_filename = NULL;
+	fctx->cidx = NULL;
+	fctx->cidx_count = 0;
+	fctx->cidx_max = 0;
+	fctx->cidx_usize = 0;
+	fctx->verify_failed = NULL;
+	fctx->main_cancel = 0;
+	fctx->t_errored = 0;
+	fctx->batch_shared = 1;
+	fctx->batch_read_sem = NULL;
+	pthread_mutex_init(&fctx->write_mutex, NULL);
+	return (0);
+}
+
+void DLL_EXPORT
+pc_session_file_fini(pc_ctx_t *fctx)
+{
+	free(fctx->cidx);
+	fctx->cidx = NULL;
+	pthread_mutex_destroy(&fctx->write_mutex);
+}
+
+/*
+ * Compress every file in files into its own filename.pz. The files share the
+ * session worker threads and overlap: the next file starts as soon as the
+ * previous one is read in full so that its chunks keep the workers busy while
+ * the last chunks of the previous file are compressed and written. Global
+ * dedupe keeps its index in the process so those files are done one after
+ * another. Returns non-zero if any file failed.
+ */
+int DLL_EXPORT
+pc_compress_batch(pc_ctx_t *pctx, char **files, int nfiles)
+{
+	struct batch_file *bf;
+	Sem_t read_sem;
+	int i, j, err;
+
+	if (pctx->encrypt_type || pc_session_begin(pctx) != 0)
+		return (1);
+
+	err = 0;
+	if (pctx->enable_rabin_global) {
+		for (i = 0; i < nfiles; i++) {
+			if (pc_compress_file(pctx, files[i], NULL) != 0)
+				err = 1;
+		}
+		return (err);
+	}
+
+	bf = (struct batch_file *)slab_calloc(NULL, nfiles, sizeof (struct batch_file));
+	if (bf == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (1);
+	}
+	Sem_Init(&read_sem, 0, 0);
+	handle_signals();
+
+	for (i = 0, j = 0; i < nfiles; i++) {
+		pc_ctx_t *fctx = &bf[i].ctx;
+
+		/*
+		 * Wait for the previous file to be read and keep at most
+		 * BATCH_FILES_INFLIGHT files in progress.
+		 */
+		if (i > 0)
+			Sem_Wait(&read_sem);
+		for (; j <= i - BATCH_FILES_INFLIGHT; j++) {
+			if (batch_file_finish(&bf[j]) != 0)
+				err = 1;
+		}
+		(void) pc_session_file_init(fctx, pctx);
+		fctx->batch_read_sem = &read_sem;
+		bf[i].filename = files[i];
+
+		if (pthread_create(&bf[i].thr, NULL, batch_compress_file,
+		    (void *)&bf[i]) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			pc_session_file_fini(fctx);
+			err = 1;
+			break;
+		}
+		bf[i].started = 1;
+	}
+	for (; j < nfiles; j++) {
+		if (bf[j].started && batch_file_finish(&bf[j]) != 0)
+			err = 1;
+	}
+	Sem_Destroy(&read_sem);
+	slab_release(NULL, bf);
 	return (err);
 }
 
+/*
+ * Decompress only bytes [offset, offset + len) of the uncompressed stream into
+ * buf. The chunk index is used to seek straight to the covering chunks which
+ * are then decompressed in parallel. The range is clipped at the end of data.
+ * Returns the number of bytes placed in buf or -1 on error.
+ */
+int64_t DLL_EXPORT
+start_decompress_range(pc_ctx_t *pctx, const char *filename, uint64_t offset,
+    uint64_t len, uchar_t *buf)
+{
+	int err;
+
+	if (!pctx->inited || filename == NULL)
+		return (-1);
+
+	free(pctx->cidx);
+	pctx->cidx = NULL;
+	pctx->cidx_count = 0;
+	pctx->cidx_max = 0;
+	pctx->main_cancel = 0;
+	pctx->t_errored = 0;
+
+	if (pctx->chunk_cache == NULL && pctx->chunk_cache_size > 0)
+		pctx->chunk_cache = pc_cache_create(pctx->chunk_cache_size);
+	pctx->range_mode = 1;
+	pctx->range_buf = buf;
+	pctx->range_offset = offset;
+	pctx->range_len = len;
+	err = start_decompress(pctx, filename, NULL);
+	pctx->range_mode = 0;
+	if (err)
+		return (-1);
+	return (pctx->range_len);
+}
+
 /*
  * Setter functions for various parameters in the context.
  */
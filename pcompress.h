@@ -38,6 +38,13 @@ extern "C" {
 #include <crypto_utils.h>
 #include <filters/analyzer/analyzer.h>
 #include <meta_stream.h>
+#include <pc_stats.h>
+#include <pc_numa.h>
+#include <pc_throttle.h>
+#include <pc_net.h>
+#include <pc_obj.h>
+#include <pc_runs.h>
+#include <pc_cache.h>
 
 #define	CHUNK_FLAG_SZ	1
 #define	ALGO_SZ		8
@@ -46,10 +53,14 @@ extern "C" {
 #define	FLAG_DEDUP	1
 #define	FLAG_DEDUP_FIXED	2
 #define	FLAG_SINGLE_CHUNK	4
+#define	FLAG_MAC_TREE	8
 #define FLAG_META_STREAM	4096
 #define	FLAG_ARCHIVE	2048
+#define	FLAG_CHUNK_INDEX	8192
+#define	FLAG_GLOBAL_BASE	16384
+#define	FLAG_DEDUPE_WINDOW	128
 #define	UTILITY_VERSION	"3.1"
-#define	MASK_CRYPTO_ALG	0x30
+#define	MASK_CRYPTO_ALG	0x70
 #define	MAX_LEVEL	14
 
 #ifndef _MPLV2_LICENSE_
@@ -65,6 +76,7 @@ extern "C" {
 #define	LZMA_A_NUM	32
 #define	CHUNK_FLAG_DEDUP	2
 #define	CHUNK_FLAG_PREPROC	4
+#define	CHUNK_FLAG_RUNS	8
 #define	COMP_EXTN	".pz"
 
 #define	PREPROC_TYPE_LZP	1
@@ -72,6 +84,8 @@ extern "C" {
 #define	PREPROC_TYPE_DISPACK	4
 #define	PREPROC_TYPE_DICT	8
 #define	PREPROC_TYPE_E8E9	16
+#define	PREPROC_TYPE_FPDELTA	32
+#define	PREPROC_TYPE_BCJ	64
 #define	PREPROC_COMPRESSED	128
 
 /*
@@ -81,6 +95,78 @@ extern "C" {
 #define	ORIGINAL_CHUNKSZ	(sizeof (uint64_t))
 #define	CHUNK_HDR_SZ		(COMPRESSED_CHUNKSZ + pctx->cksum_bytes + ORIGINAL_CHUNKSZ + CHUNK_FLAG_SZ)
 
+/*
+ * Seekable chunk index optionally appended after the zero-length trailer.
+ * See compressed_file_format.txt for the on-disk layout.
+ */
+#define	CHUNK_INDEX_MAGIC	"PCZCHIDX"
+#define	CHUNK_INDEX_ENTSZ	40
+#define	CHUNK_INDEX_FOOTERSZ	40
+
+/*
+ * Archive member index written before the chunk index in archive mode.
+ */
+#define	MEMBER_INDEX_MAGIC	"PCZMBIDX"
+#define	MEMBER_INDEX_FOOTERSZ	40
+
+/*
+ * Log2 of the linked chunk window (-o) is stored in bits 8 - 12 of the
+ * level in the file header.
+ */
+#define	LINK_WLOG_SHIFT		8
+#define	LINK_WLOG_MASK		0x1f
+#define	LINK_MIN_WLOG		16
+#define	LINK_MAX_WLOG		30
+
+/*
+ * Bit 13 of the level in the file header marks per-type zstd dictionaries
+ * (-y), stored after the header checksum as their length, the dictionaries
+ * and a CRC32 of them. The length is capped at TYPE_DICT_MAX_SZ.
+ */
+#define	LEVEL_TYPE_DICT		(1 << 13)
+#define	TYPE_DICT_MAX_SZ	(1024 * 1024)
+
+/*
+ * Checkpoint file of a compression that can be resumed with -r. Two record
+ * slots are followed by the chunk index entries of the durable chunks.
+ */
+#define	CKPT_MAGIC		"PCZCKPT1"
+#define	CKPT_RECSZ		64
+#define	CKPT_EXTN		".ckpt"
+#define	CKPT_PART_EXTN		".part"
+#define	CKPT_DEFAULT_SECS	60
+
+/*
+ * Verify modes (-V, -VV). VERIFY_HMAC only checks the HMAC of encrypted
+ * chunks without decrypting or decompressing them.
+ */
+#define	VERIFY_FULL	1
+#define	VERIFY_HMAC	2
+
+/*
+ * Chunk index flag above the chunk header flags byte. Global dedupe references
+ * of this and the following chunks do not reach before this chunk.
+ */
+#define	CIDX_GROUP_START	0x100
+
+struct chunk_index_ent {
+	uint64_t uoff, coff, clen, ulen;
+	uint32_t flags;
+};
+
+/*
+ * Chunk buffers queued with the archiver which writes archive data straight
+ * into them. More than one can be queued so that the archiver moves on to the
+ * next buffer without waiting for the reader.
+ */
+#define	ARC_SLOTS	2
+
+struct arc_slot {
+	uchar_t *buf;
+	uint64_t size, pos;
+	int btype, interesting, state;
+};
+
 /*
  * lower 3 bits in higher nibble indicate chunk compression algorithm
  * in adaptive modes.
@@ -142,6 +228,8 @@ extern int adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize
 		       int file_version, compress_op_t op);
 extern int lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		     int file_version, compress_op_t op);
+extern int lzma_split_init(void **data, int *level, int nthreads, uint64_t chunksize,
+			   int file_version, compress_op_t op);
 extern int ppmd_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		     int file_version, compress_op_t op);
 extern int bzip2_init(void **data, int *level, int nthreads, uint64_t chunksize,
@@ -155,6 +243,7 @@ extern int lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 extern int none_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		     int file_version, compress_op_t op);
 extern void adapt_set_analyzer_ctx(void *data, analyzer_ctx_t *actx);
+extern int adapt_codec_hint(int adapt_mode, int btype, uchar_t *buf, uint64_t len);
 
 extern void lzma_props(algo_props_t *data, int level, uint64_t chunksize);
 extern void lzma_mt_props(algo_props_t *data, int level, uint64_t chunksize);
@@ -195,6 +284,24 @@ extern int libbsc_deinit(void **data);
 extern void libbsc_stats(int show);
 #endif
 
+#ifdef ENABLE_PC_ZSTD
+extern int zstd_compress(void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data);
+extern int zstd_decompress(void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data);
+extern int zstd_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	int file_version, compress_op_t op);
+extern void zstd_props(algo_props_t *data, int level, uint64_t chunksize);
+extern int zstd_deinit(void **data);
+extern void zstd_stats(int show);
+extern void zstd_set_prefix(void *data, uchar_t *prefix, uint64_t len);
+extern int zstd_tdict_want(int btype);
+extern void zstd_tdict_sample(int btype, uchar_t *buf, uint64_t len);
+extern int zstd_tdict_train(void);
+extern int64_t zstd_tdict_encode(uchar_t **buf);
+extern int zstd_tdict_decode(uchar_t *buf, uint64_t len);
+#endif
+
 typedef struct pc_ctx {
 	compress_func_ptr _compress_func;
 	compress_func_ptr _decompress_func;
@@ -202,6 +309,7 @@ typedef struct pc_ctx {
 	deinit_func_ptr _deinit_func;
 	stats_func_ptr _stats_func;
 	props_func_ptr _props_func;
+	prefix_func_ptr _prefix_func;
 
 	int inited;
 	int main_cancel;
@@ -220,16 +328,242 @@ typedef struct pc_ctx {
 	int enable_fixed_scan;
 	int enable_analyzer;
 	int preprocess_mode;
+	int run_scan;
+	int no_entropy_skip;
 	int lzp_preprocess;
 	int exe_preprocess;
 	int encrypt_type;
+	int mac_tree;
 	int archive_mode;
 	int enable_archive_sort;
+	int archive_sim_sort;
+	int archive_dup_members;
+	int archive_type_dicts;
 	long pagesize;
 	int force_archive_perms;
 	int no_overwrite_newer;
 	int advanced_opts;
 	int meta_stream;
+	int chunk_index;
+
+	/*
+	 * Memory budget from -b, 0 if unlimited. mem_index_cap is what the plan
+	 * leaves over for the global dedupe index.
+	 */
+	uint64_t mem_budget, mem_index_cap;
+
+	/*
+	 * Adaptive chunk sizing from -s auto. chunksize is then the largest
+	 * chunk the run may use and the actual size is tuned at runtime.
+	 */
+	int chunk_auto;
+
+	/*
+	 * Decompression sizes its window of chunk slots from measured decode
+	 * and write times, see slot_auto_next().
+	 */
+	int slot_auto;
+
+	/*
+	 * Two-pass compression via PCOMPRESS_PLAN. The input is sampled first
+	 * and chunks are cut at content type changes.
+	 */
+	int chunk_plan;
+
+	/*
+	 * Intra-chunk threads. thread_budget is the processor count of the run
+	 * and chunk_threads_max the most threads one chunk may use. busy_workers
+	 * counts the chunk threads currently working on a chunk.
+	 */
+	int thread_budget, chunk_threads_max;
+	int busy_workers;
+
+	/*
+	 * Background mode. read_rate from -R caps input bytes per second and
+	 * cpu_share from -Y the percentage of all processors used, with the
+	 * worker threads at idle priority. throttle is shared by all files of
+	 * a batch.
+	 */
+	uint64_t read_rate;
+	int cpu_share;
+	pc_throttle_t *throttle;
+
+	/*
+	 * Minimum decompression speed in MB/s from -O. The codec, level, chunk
+	 * size and preprocessing are then picked from the decode speed presets.
+	 */
+	int decode_target;
+
+	/*
+	 * Dry run from -Q. Comma separated algo[:level] list whose ratio and
+	 * speed on the input are estimated from a sample of its chunks.
+	 */
+	char *estimate;
+	int estimate_level;
+
+	/* Self benchmark from -H with an optional sample file. */
+	int self_bench;
+	char *bench_file;
+
+	/* Live progress reports of the current compression run, if enabled. */
+	pc_progress_t *progress;
+
+	/*
+	 * Preprocessing filter costs per data type, shared by all files of a
+	 * batch. Filters that do not pay off are skipped.
+	 */
+	pc_filter_ctx_t *filters;
+
+	/* Hardware counter totals of the last run, with PCOMPRESS_PERF. */
+	int perf;
+	pc_stats_t perf_total;
+
+	/*
+	 * Seekable chunk index. comp_offset tracks the compressed stream
+	 * position and is only updated while holding write_mutex.
+	 */
+	struct chunk_index_ent *cidx;
+	uint64_t cidx_count, cidx_max, cidx_usize;
+	uint64_t cidx_ioff;
+	uint64_t comp_offset;
+
+	/*
+	 * Archive member index. Entries are kept in their on-disk form: offset
+	 * in the archive stream, name length and name. arc_stream_pos counts
+	 * the archive stream bytes written so far. xmembers are the names
+	 * given with -X for selective extraction.
+	 */
+	uchar_t *midx;
+	uint64_t midx_len, midx_max, midx_count, midx_end;
+	uint64_t arc_stream_pos;
+	char **xmembers;
+	int xmembers_count;
+
+	/*
+	 * Appending to an existing archive (-U). New chunks overwrite the old
+	 * trailer at append_off and continue the stream from append_usize.
+	 */
+	int append_mode, append_flags;
+	uint64_t append_off, append_usize;
+	uchar_t *append_tail;
+	uint64_t append_tail_len;
+
+	/*
+	 * Linked chunks (-o). Each chunk is compressed after the last link_win
+	 * bytes of data before it. When decompressing the chunks pass link_buf
+	 * on in chunk order, link_next is the chunk whose turn it is.
+	 */
+	int link_wlog;
+	uint64_t link_win, link_len, link_next;
+	uchar_t *link_buf;
+	pthread_mutex_t link_lock;
+	pthread_cond_t link_cv;
+
+	/*
+	 * Checkpoints of a compression into <target>.part, for resuming it
+	 * with -r. ckpt_ms is the interval, 0 when off. ckpt_nent chunk index
+	 * entries are in the checkpoint file. A resumed run continues at
+	 * ckpt_coff in the output and ckpt_uoff in the input.
+	 */
+	int resume, ckpt_fd;
+	uint64_t ckpt_ms, ckpt_seq, ckpt_nent;
+	uint64_t ckpt_coff, ckpt_uoff, ckpt_isize, ckpt_mtime;
+	double ckpt_last;
+
+	/*
+	 * Byte-range decompression state, see start_decompress_range().
+	 */
+	int range_mode;
+	uchar_t *range_buf;
+	uint64_t range_offset, range_len;
+	uint64_t range_chunk, range_end;
+
+	/*
+	 * Decompressed chunks kept across byte-range calls, chunk_cache_size
+	 * bytes at most, see pc_cache.h. cache_fid identifies the compressed
+	 * file of the current call.
+	 */
+	pc_cache_t *chunk_cache;
+	uint64_t chunk_cache_size, cache_fid;
+
+	/*
+	 * Sharded compression (-g). Only shard_len bytes of the input from
+	 * shard_off on are compressed, 0 meaning up to the end. Only the shard
+	 * at the start of the input has the file header and only the one at
+	 * the end the trailer, so the shards in order concatenate to one archive.
+	 */
+	int shard_mode;
+	uint64_t shard_off, shard_len;
+
+	/*
+	 * Output fd written at chunk offsets by the decompression threads, or -1
+	 * when decompressed chunks go through the writer thread.
+	 */
+	int pwrite_fd;
+
+	/*
+	 * Shared mapping of the pwrite_fd output that chunks are decompressed
+	 * into directly, and the size of a slot's own decompression buffer,
+	 * which is then only allocated for chunks that need it.
+	 */
+	uchar_t *out_map;
+	uint64_t out_map_len, out_bufsz;
+
+	/*
+	 * Descriptors used in pipe mode instead of stdin and stdout when not -1.
+	 * Set by the streaming API, see pc_stream.c.
+	 */
+	int pipe_infd, pipe_outfd;
+
+	/*
+	 * Network stream from a tcp:// or tls:// target or source name. The
+	 * pump's local pipe end is used as pipe_outfd or pipe_infd.
+	 */
+	const char *net_url;
+	pc_net_t *net;
+
+	/*
+	 * Object storage target or source from an s3:// name. Compressed data
+	 * goes to the multipart upload instead of a descriptor.
+	 */
+	const char *obj_url;
+	pc_obj_t *obj;
+
+	/*
+	 * Persistent compression workers kept across pc_compress_file() calls,
+	 * see pc_session_begin().
+	 */
+	struct pc_session *session;
+
+	/*
+	 * Batch mode from -A, see pc_compress_batch(). The files of a batch are
+	 * compressed on copies of the context, marked batch_shared, that share
+	 * the session workers. batch_read_sem is posted once a file has been
+	 * read in full so that the next file can start meanwhile.
+	 */
+	int batch_mode, batch_nfiles, batch_shared;
+	char **batch_files;
+	Sem_t *batch_read_sem;
+
+	/*
+	 * Server mode from -Z, see pc_server.c.
+	 */
+	const char *server_path;
+
+	/*
+	 * Read-only FUSE mount of an archive on to_filename from -J, see
+	 * pc_fuse.c.
+	 */
+	int fuse_mount;
+
+	/*
+	 * Per-file state kept outside of shared session workers. file_rctx
+	 * holds one dedupe context per worker and chunk_done_sem is posted for
+	 * every chunk a session worker is done with.
+	 */
+	dedupe_context_t **file_rctx;
+	Sem_t chunk_done_sem;
+	int chunk_done_wait;
 
 	/*
 	 * Archiving related context data.
@@ -251,12 +585,32 @@ typedef struct pc_ctx {
 	uchar_t *arc_buf;
 	uint64_t arc_buf_size, arc_buf_pos;
 	int arc_closed, arc_writing;
+	struct arc_slot arc_slot[ARC_SLOTS];
+	uint32_t arc_head, arc_tail, arc_cur;
+	pthread_mutex_t arc_lock;
+	pthread_cond_t arc_cv;
 	int btype, ctype;
 	int interesting;
 	int min_chunk;
 	int enable_packjpg;
 	int enable_wavpack;
 	int list_mode;
+
+	/*
+	 * Chunks that failed in verify mode. They are recorded here and the
+	 * remaining chunks are still checked.
+	 */
+	int verify_mode;
+	uint32_t *verify_failed;
+	uint32_t verify_nfailed, verify_cap;
+	pthread_mutex_t verify_mutex;
+
+	/*
+	 * Decompressed chunks are handed to the writer before their checksum
+	 * is verified. The writer waits for the result before it releases
+	 * the slot, see chunk_verify_wait().
+	 */
+	int verify_deferred;
 	FILE *err_paths_fd;
 	uint32_t errored_count;
 
@@ -270,7 +624,7 @@ typedef struct pc_ctx {
 	int do_uncompress;
 	int cksum_bytes, mac_bytes;
 	int cksum, t_errored;
-	int rab_blk_size, keylen;
+	int rab_blk_size, rab_blk_auto, keylen;
 	crypto_ctx_t crypto_ctx;
 	unsigned char *user_pw;
 	int user_pw_len;
@@ -279,7 +633,9 @@ typedef struct pc_ctx {
 } pc_ctx_t;
 
 /*
- * Per-thread data structure for compression and decompression threads.
+ * Per-chunk data structure for compression and decompression. There are a
+ * few more of these slots than worker threads so that chunks can be processed
+ * out of order while the writer thread emits them in sequence.
  */
 struct cmp_data {
 	uchar_t *cmp_seg;
@@ -289,24 +645,90 @@ struct cmp_data {
 	int64_t rbytes;
 	uint64_t chunksize;
 	uint64_t len_cmp, len_cmp_be;
+	uint64_t file_offset, uncomp_len;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	int level, cksum_mt, out_fd;
 	unsigned int id;
 	compress_func_ptr compress;
 	compress_func_ptr decompress;
-	int cancel;
 	int interesting;
-	Sem_t start_sem;
-	Sem_t cmp_done_sem;
-	Sem_t write_done_sem;
-	Sem_t index_sem;
+	Hsem_t cmp_done_sem;
+	Hsem_t write_done_sem;
+	Hsem_t index_sem;
+	Hsem_t *index_sem_next;
+	Hsem_t verify_sem;
+	int verify_pending, verify_ok;
 	void *data;
-	pthread_t thr;
-	mac_ctx_t chunk_hmac;
+	mac_ctx_t *chunk_hmac;
 	algo_props_t *props;
 	int decompressing;
 	int btype;
+	int codec, qskip;
+	int passthrough;
+	uchar_t *prefix;
+	uint64_t prefix_len;
+	pc_stats_t *stats;
+	double work_ms, write_ms;
+	int ring_wrap;
 	pc_ctx_t *pctx;
+	pc_cache_ent_t *cache_ent;
+};
+
+/*
+ * Bounded FIFO of chunk slots ready to be processed. Any idle worker thread
+ * picks up the next entry. A NULL entry asks a worker to exit.
+ */
+struct chunk_queue {
+	struct cmp_data **ent;
+	uint32_t head, tail, size;
+	pthread_mutex_t lock;
+	Hsem_t avail;
+};
+
+/*
+ * Per-thread state of a compression or decompression worker. The algorithm
+ * context, dedupe context and HMAC context are attached to whichever chunk
+ * slot the worker is currently processing.
+ */
+struct cmp_thread {
+	pthread_t thr;
+	int id, level;
+	int numa_node;
+	int codec;
+	void *data;
+	dedupe_context_t *rctx;
+	mac_ctx_t chunk_hmac;
+	struct chunk_queue *queue;
+	struct chunk_queue *free_queue;
+	pc_stats_t *stats;
+	pc_ctx_t *pctx;
+};
+
+/*
+ * A compression session keeps the worker threads and their algorithm state
+ * alive between files compressed with the same context. The workers are
+ * reused as long as the level, per-chunk thread count and chunk size limit
+ * they were set up for still fit the next file, otherwise they are rebuilt.
+ */
+struct pc_session {
+	struct cmp_thread *wthr;
+	uint32_t nworkers;
+	struct chunk_queue queue;
+	int level, cnthreads;
+	uint64_t chunksize;
+
+	/*
+	 * Files currently compressed on the workers. They can only be rebuilt
+	 * when there is none.
+	 */
+	pthread_mutex_t lock;
+	int users;
+
+	/*
+	 * Per-file option values that start_compress() may adjust.
+	 */
+	int nthreads;
+	int enable_rabin_scan, enable_rabin_global, enable_rabin_split;
 };
 
 void usage(pc_ctx_t *pctx);
@@ -319,6 +741,52 @@ void pc_set_userpw(pc_ctx_t *pctx, unsigned char *pwdata, int pwlen);
 int start_pcompress(pc_ctx_t *pctx);
 int start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int level);
 int start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename);
+int64_t start_decompress_range(pc_ctx_t *pctx, const char *filename, uint64_t offset,
+    uint64_t len, uchar_t *buf);
+int pc_session_begin(pc_ctx_t *pctx);
+int pc_compress_file(pc_ctx_t *pctx, const char *filename, const char *to_filename);
+void pc_session_end(pc_ctx_t *pctx);
+int pc_compress_batch(pc_ctx_t *pctx, char **files, int nfiles);
+int pc_session_file_init(pc_ctx_t *fctx, pc_ctx_t *pctx);
+void pc_session_file_fini(pc_ctx_t *fctx);
+
+/*
+ * Compression server on a Unix socket, see pc_server.c.
+ */
+int pc_server_run(pc_ctx_t *pctx);
+
+/*
+ * Read-only FUSE mount of an archive, see pc_fuse.c.
+ */
+int pc_fuse_mount(pc_ctx_t *pctx);
+
+/*
+ * Incremental in-memory compression and decompression, see pc_stream.c.
+ */
+typedef struct pc_stream pc_stream_t;
+
+pc_stream_t *pc_stream_create(int argc, char *argv[]);
+pc_ctx_t *pc_stream_context(pc_stream_t *strm);
+int pc_stream_write(pc_stream_t *strm, const void *buf, uint64_t len);
+int64_t pc_stream_read(pc_stream_t *strm, void *buf, uint64_t len);
+int pc_stream_finish(pc_stream_t *strm);
+void pc_stream_destroy(pc_stream_t *strm);
+
+/*
+ * Parallel compression of many small in-memory objects, see pc_batch.c.
+ */
+#define	PC_BATCH_HDR_MAX	11
+
+typedef struct pc_batch pc_batch_t;
+
+pc_batch_t *pc_batch_create(int argc, char *argv[]);
+uint64_t pc_batch_bound(uint64_t len);
+int64_t pc_batch_size(const void *frame, uint64_t len);
+int pc_batch_compress(pc_batch_t *b, const void **src, const uint64_t *srclen,
+    void **dst, uint64_t *dstlen, uint32_t n);
+int pc_batch_decompress(pc_batch_t *b, const void **src, const uint64_t *srclen,
+    void **dst, uint64_t *dstlen, uint32_t n);
+void pc_batch_destroy(pc_batch_t *b);
 
 #ifdef	__cplusplus
 }
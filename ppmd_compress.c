@@ -62,11 +62,31 @@ static ISzAlloc g_Alloc = {
 	NULL
 };
 
+/*
+ * Ppmd8_Alloc() pads the model buffer to a 4-byte aligned offset, so the
+ * slab cache has to be set up for the padded size to actually be hit.
+ */
+static uint64_t
+ppmd_slab_sz(int order)
+{
+	unsigned int size = ppmd8_mem_sz[order];
+	return (size + (4 - (size & 3)));
+}
+
+/*
+ * Allocate the model memory. Once allocated it is kept across calls until
+ * ppmd_free()/ppmd_deinit(), since Ppmd8_Alloc() only reallocates when the
+ * size changes. The model is fully restarted by Ppmd8_Init() on every chunk
+ * so nothing needs to be cleared here.
+ */
+
 int
 ppmd_alloc(void *data)
 {
 	CPpmd8 *_ppmd = (CPpmd8 *)data;
 
+	if (_ppmd->Base != 0 && _ppmd->Size == ppmd8_mem_sz[_ppmd->Order])
+		return (0);
 	if (!Ppmd8_Alloc(_ppmd, ppmd8_mem_sz[_ppmd->Order], &g_Alloc)) {
 		log_msg(LOG_ERR, 0, "PPMD: Out of memory.\n");
 		return (-1);
@@ -90,7 +110,7 @@ ppmd_state_init(void **data, int *level, int alloc)
 	pthread_mutex_lock(&mem_init_lock);
 	if (!mem_inited) {
 		slab_cache_add(sizeof (CPpmd8));
-		slab_cache_add(ppmd8_mem_sz[*level]);
+		slab_cache_add(ppmd_slab_sz(*level > 14 ? 14:*level));
 	}
 	pthread_mutex_unlock(&mem_init_lock);
 	_ppmd = (CPpmd8 *)slab_alloc(NULL, sizeof (CPpmd8));
@@ -120,6 +140,9 @@ void
 ppmd_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->delta2_span = 100;
 	data->deltac_min_distance = FOURM;
+	if (level < 0) level = 0;
+	if (level > 14) level = 14;
+	data->state_mem = ppmd8_mem_sz[level];
 }
 
 int
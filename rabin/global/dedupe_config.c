@@ -111,6 +111,15 @@ get_cksum_type(char *cksum_name)
 	if (strcmp(cksum_name, "CRC64") == 0) {
 		return (CKSUM_CRC64);
 
+	} else if (strcmp(cksum_name, "CRC32C") == 0) {
+		return (CKSUM_CRC32C);
+
+	} else if (strcmp(cksum_name, "XXH3") == 0) {
+		return (CKSUM_XXH3);
+
+	} else if (strcmp(cksum_name, "XXH128") == 0) {
+		return (CKSUM_XXH128);
+
 	} else if (strcmp(cksum_name, "SHA256") == 0) {
 		return (CKSUM_SHA256);
 
@@ -144,6 +153,15 @@ get_cksum_str(cksum_t ck)
 	if (ck == CKSUM_CRC64) {
 		return ("CRC64");
 
+	} else if (ck == CKSUM_CRC32C) {
+		return ("CRC32C");
+
+	} else if (ck == CKSUM_XXH3) {
+		return ("XXH3");
+
+	} else if (ck == CKSUM_XXH128) {
+		return ("XXH128");
+
 	} else if (ck == CKSUM_SHA256) {
 		return ("SHA256");
 
@@ -174,9 +192,15 @@ get_cksum_str(cksum_t ck)
 static int
 get_cksum_sz(cksum_t ck)
 {
-	if (ck == CKSUM_CRC64) {
+	if (ck == CKSUM_CRC32C) {
+		return (4);
+
+	} else if (ck == CKSUM_CRC64 || ck == CKSUM_XXH3) {
 		return (8);
 
+	} else if (ck == CKSUM_XXH128) {
+		return (16);
+
 	} else if (ck == CKSUM_SHA256 || ck == CKSUM_BLAKE256 || ck == CKSUM_KECCAK256 ||
 	    ck == CKSUM_SKEIN256) {
 		return (32);
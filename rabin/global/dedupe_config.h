@@ -50,13 +50,27 @@ typedef enum {
 	MODE_ARCHIVE
 } dedupe_mode_t;
 
-struct seg_map_fd {
-	int fd;
+/*
+ * Number of segment metadata mappings each thread keeps around. Segments
+ * matched by consecutive chunks tend to repeat so a small LRU avoids most of
+ * the mmap/munmap churn.
+ */
+#define	SEGCACHE_MAPS	16
+
+struct seg_map {
 	void *mapping;
 	uint64_t cache_offset;
+	uint64_t lru;
 	uint32_t len;
 };
 
+struct seg_map_fd {
+	int fd;
+	uint64_t clock;
+	struct seg_map maps[SEGCACHE_MAPS];
+	struct global_blockentry *blocks; // Decoded block entries of the last mapped segment
+};
+
 typedef struct {
 	char rootdir[PATH_MAX+1];
 	uint32_t chunk_sz; // Numeric ID: 1 - 4k ... 5 - 64k
@@ -84,10 +98,12 @@ typedef struct {
 	int nthreads; // Number of threads processing data segments in parallel
 	int seg_fd_w; 
 	uint64_t segcache_pos;
+	uchar_t *segcache_buf; // Encoding buffer for one segment's metadata
 	uint32_t pagesize;
 	struct seg_map_fd *seg_fd_r; // One read-only fd per thread for mapping in portions of the
 		       // segment metadata cache.
 	int valid;
+	uint64_t window_sz; // Windowed index: bytes of preceding data that can be referenced
 	void *db_index;
 } archive_config_t;
 
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
@@ -36,24 +37,149 @@
 
 #include "utils/utils.h"
 #include "allocator.h"
-#include "utils/xxhash.h"
 #include "index.h"
 
+#ifdef __USE_SSE_INTRIN__
+#include <emmintrin.h>
+#endif
+
 /*
- * Hashtable structures for in-memory index.
+ * Hashtable structures for in-memory index. A slot is a cache line sized bucket
+ * holding fingerprints of the keys next to references to their entries, so a
+ * lookup normally touches the bucket and the one matching entry. Full buckets
+ * are chained to overflow buckets. Entries and overflow buckets are carved out
+ * of large arenas and referenced by 32-bit ids, 0 being none. They are never
+ * freed individually and do not move, so entry pointers stay valid.
+ *
+ * Every entry has a 2-bit hit counter in its bucket for the GCLOCK eviction in
+ * bucket_add(), and the home bucket of a chain holds the clock hand.
  */
+#define	BUCKET_ENTS	7
+#define	BUCKET_FILL	4
+#define	HITS_MAX	3
+
+typedef struct {
+	uint32_t fp[BUCKET_ENTS];
+	uint32_t ref[BUCKET_ENTS];
+	uint32_t next;
+	uint8_t count, hand;
+	uint16_t hits;
+} bucket_t;
+
+#define	BUCKET_HITS(b, i)	(((b)->hits >> ((i) * 2)) & HITS_MAX)
+#define	BUCKET_SET_HITS(b, i, h)	((b)->hits = ((b)->hits & ~(HITS_MAX << ((i) * 2))) | \
+	((h) << ((i) * 2)))
+
 typedef struct {
-	hash_entry_t **tab;
+	void *mem;
+	bucket_t *tab;
 } htab_t;
 
+#define	ARENA_SHIFT	16
+#define	ARENA_CHUNKS	65535
+#define	ARENA_MAXID	((uint32_t)ARENA_CHUNKS << ARENA_SHIFT)
+
+typedef struct {
+	uchar_t **chunk;
+	uint32_t next;
+	int objsz;
+	pthread_mutex_t lock;
+} arena_t;
+
+/*
+ * Number of lock stripes over the hash slots for concurrent index access.
+ */
+#define	INDEX_LOCKS	1024
+
 typedef struct {
 	htab_t *list;
+	arena_t entries, buckets;
 	uint64_t memlimit;
 	uint64_t memused;
 	int hash_entry_size, intervals, hash_slots;
+
+	/*
+	 * Fingerprints of recently evicted keys, used to estimate how many
+	 * matches evictions lose.
+	 */
+	uint32_t *ghost;
+	uint32_t ghost_mask;
 	char *index_file;
+	pthread_mutex_t locks[INDEX_LOCKS];
+
+	/*
+	 * Insert progress for concurrent access. All data below file offset
+	 * mark is inserted, pending holds (start, end) ranges above it that are
+	 * inserted already.
+	 */
+	pthread_mutex_t mark_lock;
+	pthread_cond_t mark_cv;
+	uint64_t mark;
+	uint64_t *pending;
+	int npending, maxpending, abort;
+
+	/*
+	 * Read-only mapping of a persistent base index, see db_base_save_s().
+	 */
+	uchar_t *base, *base_filter;
+	uint64_t base_len, base_mask, base_fmask;
+	int base_ent;
 } index_t;
 
+#define	SEGCACHE_HDR_SZ	12
+#define	SEGCACHE_MAXLEN(cfg)	(SEGCACHE_HDR_SZ + (cfg)->segment_sz * \
+		(2 * 10 + (cfg)->chunk_cksum_sz))
+
+/*
+ * Persistent base index file layout, little-endian:
+ *	0	8	BASE_MAGIC
+ *	8	4	chunk checksum type
+ *	12	4	block size setting
+ *	16	4	chunk checksum size
+ *	20	4	number of filter blocks, a power of 2 or 0
+ *	24	8	size of base data
+ *	32	8	number of slots, a power of 2
+ *	40	??	slots of (checksum, 64-bit offset, 32-bit length)
+ *	??	??	filter blocks
+ * It is an open addressing hashtable with linear probing keyed on the first 8
+ * bytes of the block checksum. Empty slots have 0 length.
+ *
+ * Most blocks of changed data are not in the base, and without help each such
+ * lookup faults in a random page of the table. So a blocked Bloom filter is
+ * kept after the table: a block is a cache line picked by checksum bytes 8-15
+ * in which checksum bytes 16-23 (a remix of bytes 0-7 for 128-bit checksums)
+ * select BASE_FILTER_K bits. At 4 bits per slot and at most half the slots in
+ * use, it holds at least 8 bits per key for a false positive rate of a few
+ * percent and is small enough to stay in memory.
+ */
+#define	BASE_MAGIC	"PCBIDX01"
+#define	BASE_HDR_SZ	40
+#define	BASE_FILTER_BLK	64
+#define	BASE_FILTER_K	6
+#define	BASE_FILTER_BLOCKS(slots)	((slots) / (BASE_FILTER_BLK * 2))
+
+static inline int
+base_filter_test(uchar_t *blk, uchar_t *cksum, int cksum_sz, int set)
+{
+	uint64_t h;
+	uint32_t bit;
+	int i;
+
+	if (cksum_sz >= 24)
+		h = LE64(U64_P(cksum + 16));
+	else
+		h = LE64(U64_P(cksum)) * 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < BASE_FILTER_K; i++) {
+		bit = h & (BASE_FILTER_BLK * 8 - 1);
+		h >>= 9;
+		if (set)
+			blk[bit >> 3] |= (1 << (bit & 7));
+		else if (!(blk[bit >> 3] & (1 << (bit & 7))))
+			return (0);
+	}
+	return (1);
+}
+
 archive_config_t *
 init_global_db(char *configfile)
 {
@@ -84,35 +210,106 @@ init_on_disk_index(archive_config_t *cfg)
 	return (0);
 }
 
-void
-static cleanup_indx(index_t *indx)
+static int
+arena_init(arena_t *a, int objsz)
+{
+	a->chunk = (uchar_t **)calloc(ARENA_CHUNKS, sizeof (uchar_t *));
+	a->next = 1;
+	a->objsz = objsz;
+	pthread_mutex_init(&a->lock, NULL);
+	return (a->chunk ? 0 : -1);
+}
+
+static void
+arena_destroy(arena_t *a)
+{
+	int i;
+
+	if (a->chunk == NULL)
+		return;
+	for (i = 0; i < ARENA_CHUNKS; i++)
+		free(a->chunk[i]);
+	free(a->chunk);
+	a->chunk = NULL;
+	pthread_mutex_destroy(&a->lock);
+}
+
+/*
+ * Hand out the id of a new zeroed object. Chunks of 64K objects are allocated
+ * as they are first needed. Returns 0 on failure.
+ */
+static uint32_t
+arena_alloc(arena_t *a)
+{
+	uint32_t id, c;
+	uchar_t *m;
+
+	/*
+	 * Concurrent callers overshoot the limit by at most one id each, so the
+	 * id counter never wraps.
+	 */
+	if (__atomic_load_n(&a->next, __ATOMIC_RELAXED) >= ARENA_MAXID)
+		return (0);
+	id = __atomic_fetch_add(&a->next, 1, __ATOMIC_RELAXED);
+	c = id >> ARENA_SHIFT;
+	if (c >= ARENA_CHUNKS)
+		return (0);
+	if (__atomic_load_n(&a->chunk[c], __ATOMIC_ACQUIRE) == NULL) {
+		pthread_mutex_lock(&a->lock);
+		if (a->chunk[c] == NULL) {
+			if (posix_memalign((void **)&m, 64, (size_t)a->objsz << ARENA_SHIFT) != 0) {
+				pthread_mutex_unlock(&a->lock);
+				return (0);
+			}
+			memset(m, 0, (size_t)a->objsz << ARENA_SHIFT);
+			__atomic_store_n(&a->chunk[c], m, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+	return (id);
+}
+
+static inline void *
+arena_ptr(arena_t *a, uint32_t id)
 {
-	int i, j;
+	return (a->chunk[id >> ARENA_SHIFT] + (size_t)(id & ((1 << ARENA_SHIFT) - 1)) * a->objsz);
+}
+
+#define	ENTRY(indx, id)		((hash_entry_t *)arena_ptr(&(indx)->entries, id))
+#define	BUCKET(indx, id)	((bucket_t *)arena_ptr(&(indx)->buckets, id))
+
+/*
+ * Entries are kept 8-byte aligned.
+ */
+#define	HASH_ENTRY_SIZE(ck_sz)	((sizeof (hash_entry_t) + (ck_sz) - 1 + 7) & ~7)
+
+static void
+cleanup_indx(index_t *indx)
+{
+	int i;
 
 	if (indx) {
+		for (i = 0; i < INDEX_LOCKS; i++)
+			pthread_mutex_destroy(&indx->locks[i]);
+		pthread_mutex_destroy(&indx->mark_lock);
+		pthread_cond_destroy(&indx->mark_cv);
+		free(indx->pending);
+		if (indx->base)
+			munmap(indx->base, indx->base_len);
 		if (indx->list) {
-			for (i = 0; i < indx->intervals; i++) {
-				if (indx->list[i].tab) {
-					for (j=0; j<indx->hash_slots; j++) {
-						hash_entry_t *he, *nxt;
-						he = indx->list[i].tab[j];
-						while (he) {
-							nxt = he->next;
-							free(he);
-							he = nxt;
-						}
-					}
-					free(indx->list[i].tab);
-				}
-			}
+			for (i = 0; i < indx->intervals; i++)
+				free(indx->list[i].mem);
 			free(indx->list);
 		}
+		arena_destroy(&indx->entries);
+		arena_destroy(&indx->buckets);
+		free(indx->ghost);
 		free(indx);
 	}
 }
 
-#define	MEM_PER_UNIT(ent_sz) ( (ent_sz + sizeof (hash_entry_t *) + \
-		(sizeof (hash_entry_t *)) / 2) + sizeof (hash_entry_t **) )
+#define	MEM_PER_UNIT(ent_sz) ((ent_sz) + sizeof (bucket_t) / BUCKET_FILL + \
+		sizeof (bucket_t) / (BUCKET_FILL * 8))
 #define	MEM_REQD(hslots, ent_sz) (hslots * MEM_PER_UNIT(ent_sz))
 #define	SLOTS_FOR_MEM(memlimit, ent_sz) (memlimit / MEM_PER_UNIT(ent_sz) - 5)
 
@@ -170,7 +367,7 @@ set_cfg:
 	}
 
 	// Compute total hashtable entries first
-	*hash_entry_size = sizeof (hash_entry_t) + cfg->chunk_cksum_sz - 1;
+	*hash_entry_size = HASH_ENTRY_SIZE(cfg->chunk_cksum_sz);
 	if (*pct_interval == 0) {
 		cfg->sub_intervals = 1;
 		*hash_slots = file_sz / cfg->chunk_sz_bytes + 1;
@@ -180,7 +377,7 @@ set_cfg:
 		*hash_slots = SLOTS_FOR_MEM(memlimit, *hash_entry_size);
 		*pct_interval = 0;
 	} else {
-		*hash_entry_size = sizeof (hash_entry_t) + cfg->similarity_cksum_sz - 1;
+		*hash_entry_size = HASH_ENTRY_SIZE(cfg->similarity_cksum_sz);
 		cfg->intervals = 100 / *pct_interval;
 		cfg->sub_intervals = cfg->intervals;
 
@@ -251,6 +448,10 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 		free(cfg);
 		return (NULL);
 	}
+	for (i = 0; i < INDEX_LOCKS; i++)
+		pthread_mutex_init(&indx->locks[i], NULL);
+	pthread_mutex_init(&indx->mark_lock, NULL);
+	pthread_cond_init(&indx->mark_cv, NULL);
 
 	cfg->nthreads = nthreads;
 	if (cfg->dedupe_mode == MODE_SIMILARITY)
@@ -261,17 +462,44 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	indx->list = (htab_t *)calloc(intervals, sizeof (htab_t));
 	indx->hash_entry_size = hash_entry_size;
 	indx->intervals = intervals;
-	indx->hash_slots = hash_slots / intervals;
+	indx->hash_slots = hash_slots / intervals / BUCKET_FILL + 1;
+	if (indx->list == NULL || arena_init(&indx->entries, hash_entry_size) == -1 ||
+	    arena_init(&indx->buckets, sizeof (bucket_t)) == -1) {
+		cleanup_indx(indx);
+		free(cfg);
+		return (NULL);
+	}
 
 	for (i = 0; i < intervals; i++) {
-		indx->list[i].tab = (hash_entry_t **)calloc(indx->hash_slots, sizeof (hash_entry_t *));
-		if (!(indx->list[i].tab)) {
+		uint64_t tsz = (uint64_t)indx->hash_slots * sizeof (bucket_t);
+
+		/*
+		 * Align buckets to cache lines.
+		 */
+		indx->list[i].mem = calloc(1, tsz + 64);
+		if (!(indx->list[i].mem)) {
 			cleanup_indx(indx);
 			free(cfg);
 			return (NULL);
 		}
-		indx->memused += ((indx->hash_slots) * (sizeof (hash_entry_t *)));
+		indx->list[i].tab = (bucket_t *)(((uintptr_t)indx->list[i].mem + 63) & ~(uintptr_t)63);
+		indx->memused += tsz;
+	}
+
+	/*
+	 * One ghost per 8 expected entries at most, up to 4MB.
+	 */
+	indx->ghost_mask = 1023;
+	while (indx->ghost_mask < (1 << 20) - 1 &&
+	    (uint64_t)(indx->ghost_mask + 1) * 8 < hash_slots)
+		indx->ghost_mask = (indx->ghost_mask << 1) | 1;
+	indx->ghost = (uint32_t *)calloc(indx->ghost_mask + 1, sizeof (uint32_t));
+	if (indx->ghost == NULL) {
+		cleanup_indx(indx);
+		free(cfg);
+		return (NULL);
 	}
+	indx->memused += (uint64_t)(indx->ghost_mask + 1) * sizeof (uint32_t);
 
 	/*
 	 * If Segmented Deduplication is required intervals will be set and a temporary
@@ -284,24 +512,33 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 		strcpy(cfg->rootdir, tmppath);
 		strcat(cfg->rootdir, "/.segXXXXXX");
 		cfg->seg_fd_w = mkstemp(cfg->rootdir);
-		cfg->seg_fd_r = (struct seg_map_fd *)malloc(sizeof (struct seg_map_fd) * nthreads);
-		if (cfg->seg_fd_w == -1 || cfg->seg_fd_r == NULL) {
+		cfg->seg_fd_r = (struct seg_map_fd *)calloc(nthreads, sizeof (struct seg_map_fd));
+		cfg->segcache_buf = (uchar_t *)malloc(SEGCACHE_MAXLEN(cfg));
+		if (cfg->seg_fd_w == -1 || cfg->seg_fd_r == NULL || cfg->segcache_buf == NULL) {
 			cleanup_indx(indx);
 			if (cfg->seg_fd_r)
 				free(cfg->seg_fd_r);
+			if (cfg->segcache_buf)
+				free(cfg->segcache_buf);
 			free(cfg);
 			return (NULL);
 		}
 
 		errored = 0;
 		for (i = 0; i < nthreads; i++) {
+			cfg->seg_fd_r[i].fd = -1;
+			cfg->seg_fd_r[i].blocks = (global_blockentry_t *)malloc(cfg->segment_sz *
+			    sizeof (global_blockentry_t));
+			if (cfg->seg_fd_r[i].blocks == NULL) {
+				errored = 1;
+				break;
+			}
 			cfg->seg_fd_r[i].fd = open(cfg->rootdir, O_RDONLY);
 			if (cfg->seg_fd_r[i].fd == -1) {
 				log_msg(LOG_ERR, 1, " ");
 				errored = 1;
 				break;
 			}
-			cfg->seg_fd_r[i].mapping = NULL;
 		}
 
 		/*
@@ -312,8 +549,15 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 
 		if (errored) {
 			cleanup_indx(indx);
-			if (cfg->seg_fd_r)
-				free(cfg->seg_fd_r);
+			for (i = 0; i < nthreads; i++) {
+				if (cfg->seg_fd_r[i].fd != -1)
+					close(cfg->seg_fd_r[i].fd);
+				if (cfg->seg_fd_r[i].blocks)
+					free(cfg->seg_fd_r[i].blocks);
+			}
+			free(cfg->seg_fd_r);
+			free(cfg->segcache_buf);
+			close(cfg->seg_fd_w);
 			free(cfg);
 			return (NULL);
 		}
@@ -323,6 +567,35 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 	return (cfg);
 }
 
+/*
+ * Setup a simple index that only needs to cover the last window_sz bytes of data.
+ * The hashtable is sized for the blocks in the window and the memory limit is
+ * capped to the same number of entries, so once it fills up the oldest entry in
+ * a slot is recycled for every new block. Entries are never looked up beyond
+ * the window by the caller, so recycling does not lose any usable match.
+ */
+archive_config_t *
+init_window_db_s(uint32_t chunksize, uint64_t user_chunk_sz, const char *algo, cksum_t ck,
+		 uint64_t window_sz, size_t memlimit, int nthreads)
+{
+	archive_config_t *cfg;
+	index_t *indx;
+	uint64_t wlimit;
+
+	cfg = init_global_db_s(NULL, NULL, chunksize, user_chunk_sz, 0, algo, ck, GLOBAL_SIM_CKSUM,
+			       window_sz, memlimit, nthreads);
+	if (cfg == NULL)
+		return (NULL);
+
+	indx = (index_t *)(cfg->db_index);
+	wlimit = indx->memused + (uint64_t)indx->hash_slots * BUCKET_FILL * indx->hash_entry_size +
+	    (uint64_t)indx->hash_slots * sizeof (bucket_t) / 4;
+	if (wlimit < indx->memlimit)
+		indx->memlimit = wlimit;
+	cfg->window_sz = window_sz;
+	return (cfg);
+}
+
 /*
  * Functions to handle segment metadata cache for segmented similarity based deduplication.
  * These functions are not thread-safe by design. The caller must ensure thread safety.
@@ -332,29 +605,76 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
  * Add new segment block list array into the metadata cache. Once added the entry is
  * not removed till the program exits.
  */
-#define SEGCACHE_HDR_SZ	12
+/*
+ * Segment metadata is kept in the segcache file in a compact form. A 12 byte
+ * header with the number of blocks and the file offset of the segment's chunk is
+ * followed by one record per block:
+ *
+ *	varint length | varint zigzag(offset - end of previous block) | checksum
+ *
+ * Blocks of a segment are adjacent so the offset gap is almost always 0 and a
+ * record is only a few bytes more than the checksum, about a third of the size
+ * of a global_blockentry_t. Checksums are kept whole since a match is taken as
+ * identity without comparing the data. SEGCACHE_MAXLEN is the size of a full
+ * segment with the largest records.
+ */
+static inline uchar_t *
+put_varint64(uchar_t *op, uint64_t val)
+{
+	while (val >= 0x80) {
+		*op++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*op++ = val;
+	return (op);
+}
+
+static inline uchar_t *
+get_varint64(uchar_t *ip, uchar_t *iend, uint64_t *val)
+{
+	uint64_t v;
+	int shift;
+
+	v = 0;
+	shift = 0;
+	while (ip < iend && shift < 64) {
+		v |= (uint64_t)(*ip & 0x7f) << shift;
+		if (!(*ip++ & 0x80)) {
+			*val = v;
+			return (ip);
+		}
+		shift += 7;
+	}
+	return (NULL);
+}
+
 int
-db_segcache_write(archive_config_t *cfg, int tid, uchar_t *buf, uint32_t len, uint32_t blknum,
+db_segcache_write(archive_config_t *cfg, int tid, global_blockentry_t *blocks, uint32_t blknum,
 		  uint64_t file_offset)
 {
-	int64_t w;
-	uchar_t hdr[SEGCACHE_HDR_SZ];
-
-	U32_P(hdr) = blknum;
-	U64_P(hdr + 4) = file_offset;
+	int64_t w, gap;
+	uint64_t end;
+	uchar_t *op;
+	uint32_t i;
 
-	w = Write(cfg->seg_fd_w, hdr, sizeof (hdr));
-	if (w < sizeof (hdr)) {
-		/*
-		 * On error restore file pointer to previous position so that
-		 * all subsequent offsets will be properly computed.
-		 */
-		lseek(cfg->seg_fd_w, cfg->segcache_pos, SEEK_SET);
+	if (blknum > cfg->segment_sz)
 		return (-1);
+	op = cfg->segcache_buf;
+	U32_P(op) = blknum;
+	U64_P(op + 4) = file_offset;
+	op += SEGCACHE_HDR_SZ;
+	end = 0;
+	for (i = 0; i < blknum; i++) {
+		gap = blocks[i].offset - end;
+		op = put_varint64(op, blocks[i].length);
+		op = put_varint64(op, (uint64_t)((gap << 1) ^ (gap >> 63)));
+		memcpy(op, blocks[i].cksum, cfg->chunk_cksum_sz);
+		op += cfg->chunk_cksum_sz;
+		end = blocks[i].offset + blocks[i].length;
 	}
-	cfg->segcache_pos += w;
-	w = Write(cfg->seg_fd_w, buf, len);
-	if (w < len) {
+
+	w = Write(cfg->seg_fd_w, cfg->segcache_buf, op - cfg->segcache_buf);
+	if (w < op - cfg->segcache_buf) {
 		/*
 		 * On error restore file pointer to previous position so that
 		 * all subsequent offsets will be properly computed.
@@ -377,83 +697,156 @@ db_segcache_pos(archive_config_t *cfg, int tid)
 }
 
 /*
- * Mmap the requested segment metadata array.
+ * Look for an existing mapping of the segment at offset in the thread's LRU.
  */
-int
-db_segcache_map(archive_config_t *cfg, int tid, uint32_t *blknum, uint64_t *offset, uchar_t **blocks)
+static struct seg_map *
+segcache_find(archive_config_t *cfg, int tid, uint64_t offset)
 {
-	uchar_t *mapbuf, *hdr;
-	int fd, dummy;
-	uint32_t len, adj;
-	uint64_t pos;
+	struct seg_map_fd *sf = &cfg->seg_fd_r[tid];
+	int i;
 
-	/*
-	 * If same mapping is re-attempted just return the pointer into the
-	 * existing mapping.
-	 */
-	adj = *offset % cfg->pagesize;
-	if (*offset == cfg->seg_fd_r[tid].cache_offset && cfg->seg_fd_r[tid].mapping) {
-		hdr = (uchar_t *)(cfg->seg_fd_r[tid].mapping) + adj;
-		*blknum = U32_P(hdr);
-		*offset = U64_P(hdr + 4);
-		*blocks = hdr + SEGCACHE_HDR_SZ;
-		return (0);
+	for (i = 0; i < SEGCACHE_MAPS; i++) {
+		if (sf->maps[i].mapping && sf->maps[i].cache_offset == offset)
+			return (&sf->maps[i]);
 	}
+	return (NULL);
+}
 
-	/*
-	 * Ensure previous mapping is removed.
-	 */
-	db_segcache_unmap(cfg, tid);
-	fd = cfg->seg_fd_r[tid].fd;
-	if (lseek(fd, *offset, SEEK_SET) != *offset) {
-		log_msg(LOG_ERR, 1, " ");
-		return (-1);
-	}
+/*
+ * Length of the segment metadata mapping at offset. We assume max # of rabin
+ * block entries of the largest size (unless remaining file length is less). The
+ * header contains actual number of block entries so mmap-ing extra has no
+ * consequence other than address space usage.
+ */
+static uint32_t
+segcache_maplen(archive_config_t *cfg, uint64_t offset)
+{
+	uint32_t len;
+	uint64_t pos;
 
-	/*
-	 * Mmap hdr and blocks. We assume max # of rabin block entries and mmap (unless remaining
-	 * file length is less). The header contains actual number of block entries so mmap-ing
-	 * extra has no consequence other than address space usage.
-	 */
-	len = cfg->segment_sz * sizeof (global_blockentry_t) + SEGCACHE_HDR_SZ;
+	len = SEGCACHE_MAXLEN(cfg);
 	pos = cfg->segcache_pos;
-	if (pos - *offset < len)
-		len = pos - *offset;
+	if (pos - offset < len)
+		len = pos - offset;
+	return (len);
+}
 
-	mapbuf = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, fd, *offset - adj);
-	if (mapbuf == MAP_FAILED) {
-		log_msg(LOG_ERR, 1, " ");
-		return (-1);
+/*
+ * Mmap the requested segment metadata array. Segments are immutable once their
+ * offset has been published in the index, so recently used mappings are kept
+ * and reused.
+ */
+int
+db_segcache_map(archive_config_t *cfg, int tid, uint32_t *blknum, uint64_t *offset, uchar_t **blocks)
+{
+	struct seg_map_fd *sf = &cfg->seg_fd_r[tid];
+	struct seg_map *sm;
+	global_blockentry_t *be;
+	uchar_t *mapbuf, *hdr, *ip, *iend;
+	uint64_t val, end;
+	uint32_t len, adj, n;
+	int i;
+
+	adj = *offset % cfg->pagesize;
+	sf->clock++;
+	sm = segcache_find(cfg, tid, *offset);
+	if (sm == NULL) {
+		/*
+		 * Evict the least recently used mapping. Unused slots have lru 0.
+		 */
+		sm = &sf->maps[0];
+		for (i = 1; i < SEGCACHE_MAPS; i++) {
+			if (sf->maps[i].lru < sm->lru)
+				sm = &sf->maps[i];
+		}
+		if (sm->mapping) {
+			munmap(sm->mapping, sm->len);
+			sm->mapping = NULL;
+		}
+
+		len = segcache_maplen(cfg, *offset);
+		mapbuf = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, sf->fd, *offset - adj);
+		if (mapbuf == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, " ");
+			return (-1);
+		}
+		sm->mapping = mapbuf;
+		sm->cache_offset = *offset;
+		sm->len = len + adj;
 	}
+	sm->lru = sf->clock;
 
-	cfg->seg_fd_r[tid].cache_offset = *offset;
-	hdr = mapbuf + adj;
-	*blknum = U32_P(hdr);
+	hdr = (uchar_t *)(sm->mapping) + adj;
+	iend = (uchar_t *)(sm->mapping) + sm->len;
+	n = U32_P(hdr);
+	if (n > cfg->segment_sz)
+		goto corrupt;
+	ip = hdr + SEGCACHE_HDR_SZ;
+	end = 0;
+	for (i = 0; i < n; i++) {
+		be = &sf->blocks[i];
+		if ((ip = get_varint64(ip, iend, &val)) == NULL)
+			goto corrupt;
+		be->length = val;
+		if ((ip = get_varint64(ip, iend, &val)) == NULL ||
+		    iend - ip < cfg->chunk_cksum_sz)
+			goto corrupt;
+		be->offset = end + (int64_t)((val >> 1) ^ -(val & 1));
+		memcpy(be->cksum, ip, cfg->chunk_cksum_sz);
+		ip += cfg->chunk_cksum_sz;
+		end = be->offset + be->length;
+	}
+	*blknum = n;
 	*offset = U64_P(hdr + 4);
-	*blocks = hdr + SEGCACHE_HDR_SZ;
-	dummy = *(hdr + SEGCACHE_HDR_SZ);
-
-	cfg->seg_fd_r[tid].mapping = mapbuf;
-	cfg->seg_fd_r[tid].len = len + adj;
+	*blocks = (uchar_t *)sf->blocks;
 
 	return (0);
+corrupt:
+	log_msg(LOG_ERR, 0, "Corrupt segment metadata at %" PRIu64 "\n", sm->cache_offset);
+	return (-1);
 }
 
 /*
- * Remove the metadata mapping.
+ * Start reading in the segment metadata at offset in the background so that it
+ * is resident by the time db_segcache_map() is called for it.
+ */
+void
+db_segcache_prefetch(archive_config_t *cfg, int tid, uint64_t offset)
+{
+#ifdef POSIX_FADV_WILLNEED
+	uint32_t adj;
+
+	if (segcache_find(cfg, tid, offset) != NULL)
+		return;
+	adj = offset % cfg->pagesize;
+	(void) posix_fadvise(cfg->seg_fd_r[tid].fd, offset - adj,
+	    segcache_maplen(cfg, offset) + adj, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Remove all the cached metadata mappings of a thread.
  */
 int
 db_segcache_unmap(archive_config_t *cfg, int tid)
 {
-	if (cfg->seg_fd_r[tid].mapping) {
-		munmap(cfg->seg_fd_r[tid].mapping, cfg->seg_fd_r[tid].len);
-		cfg->seg_fd_r[tid].mapping = NULL;
+	struct seg_map_fd *sf = &cfg->seg_fd_r[tid];
+	int i;
+
+	for (i = 0; i < SEGCACHE_MAPS; i++) {
+		if (sf->maps[i].mapping) {
+			munmap(sf->maps[i].mapping, sf->maps[i].len);
+			sf->maps[i].mapping = NULL;
+			sf->maps[i].lru = 0;
+		}
 	}
 	return (0);
 }
 
 /*
- * Compare hashes. Hash size must be multiple of 8 bytes.
+ * Compare hashes. Hash size must be multiple of 8 bytes. The supported key
+ * widths get their own unrolled compare so that wide keys cost about as much
+ * as 8-byte ones: one or two 16-byte vector compares for 16 and 32 bytes.
  */
 static inline int
 mycmp(uchar_t *a, uchar_t *b, int sz)
@@ -463,6 +856,31 @@ mycmp(uchar_t *a, uchar_t *b, int sz)
 	uchar_t *v2 = b;
 	int len;
 
+	switch (sz) {
+	case 8:
+		return (U64_P(a) != U64_P(b));
+#ifdef __USE_SSE_INTRIN__
+	case 16:
+		return (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)a),
+		    _mm_loadu_si128((__m128i *)b))) != 0xffff);
+	case 32:
+		return (_mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)a), _mm_loadu_si128((__m128i *)b)),
+		    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(a + 16)),
+		    _mm_loadu_si128((__m128i *)(b + 16))))) != 0xffff);
+	case 64:
+		if (mycmp(a, b, 32))
+			return (1);
+		return (mycmp(a + 32, b + 32, 32));
+#else
+	case 16:
+		return ((U64_P(a) ^ U64_P(b)) | (U64_P(a + 8) ^ U64_P(b + 8))) != 0;
+	case 32:
+		return ((U64_P(a) ^ U64_P(b)) | (U64_P(a + 8) ^ U64_P(b + 8)) |
+		    (U64_P(a + 16) ^ U64_P(b + 16)) | (U64_P(a + 24) ^ U64_P(b + 24))) != 0;
+#endif
+	}
+
 	len = 0;
 	do {
 		val1 = *((size_t *)v1);
@@ -478,83 +896,397 @@ mycmp(uchar_t *a, uchar_t *b, int sz)
 	return (0);
 }
 
+static inline uint32_t
+db_slot(archive_config_t *cfg, index_t *indx, uchar_t *sim_cksum)
+{
+	uint32_t htab_entry;
+
+	/*
+	 * Keys are either cryptographic block hashes or, for similarity based
+	 * dedupe, 64-bit portions of them. Since those are already a product of
+	 * strong hashing there is no need to re-hash the keys here, whatever
+	 * their width.
+	 */
+	htab_entry = U32_P(sim_cksum) ^ U32_P(sim_cksum + 4);
+	return (htab_entry % indx->hash_slots);
+}
+
+/*
+ * The fingerprint is taken from the end of the key, away from the bytes that
+ * the slot is derived from.
+ */
+#define	KEY_FP(key, ksz)	U32_P((key) + (ksz) - sizeof (uint32_t))
+
+/*
+ * Number of keys whose buckets are prefetched together in a batch lookup.
+ */
+#define	DB_BATCH	16
+
+/*
+ * Find a key in the bucket chain of a slot. Item sizes are compared too if
+ * match_size is set. A hit counts towards keeping the entry if touch is set.
+ */
+static inline hash_entry_t *
+bucket_find(index_t *indx, bucket_t *b, uchar_t *key, int ksz, int match_size,
+	    uint32_t item_size, int touch)
+{
+	hash_entry_t *ent;
+	uint32_t fp, i, h;
+
+	fp = KEY_FP(key, ksz);
+	for (;;) {
+		for (i = 0; i < b->count; i++) {
+			if (b->fp[i] != fp)
+				continue;
+			ent = ENTRY(indx, b->ref[i]);
+			if (mycmp(key, ent->cksum, ksz) == 0 &&
+			    (!match_size || ent->item_size == item_size)) {
+				if (touch && (h = BUCKET_HITS(b, i)) < HITS_MAX)
+					BUCKET_SET_HITS(b, i, h + 1);
+				return (ent);
+			}
+		}
+		if (b->next == 0)
+			return (NULL);
+		b = BUCKET(indx, b->next);
+	}
+}
+
+static inline uint32_t *
+ghost_cell(index_t *indx, uint32_t slot, uint32_t fp)
+{
+	return (&indx->ghost[(fp ^ (slot * 0x9E3779B1U)) & indx->ghost_mask]);
+}
+
+/*
+ * Add a key to the bucket chain of a slot and return its entry for the caller
+ * to fill in. Returns NULL if out of memory.
+ *
+ * Once the index is close to its memory limit an entry of the chain is
+ * recycled instead, chosen by GCLOCK: the hand sweeps the chain and takes the
+ * first entry without hits left, taking one hit off every entry it passes. So
+ * blocks that keep matching stay while blocks seen once go first. The evicted
+ * fingerprint is remembered, and a key missing from the index that matches it
+ * is counted as a lost match in st.
+ */
+static hash_entry_t *
+bucket_add(index_t *indx, bucket_t *home, uint32_t slot, uchar_t *key, int ksz,
+	   uint32_t item_size, index_stat_t *st)
+{
+	hash_entry_t *ent;
+	bucket_t *b, *nb;
+	uint32_t id, bid, fp, *g, i, n, h;
+
+	fp = KEY_FP(key, ksz);
+	g = ghost_cell(indx, slot, fp);
+	if (__atomic_load_n(g, __ATOMIC_RELAXED) == (fp | 1)) {
+		__atomic_store_n(g, 0, __ATOMIC_RELAXED);
+		if (st) {
+			st->lost++;
+			st->lost_bytes += item_size;
+		}
+	}
+
+	if (__atomic_load_n(&indx->memused, __ATOMIC_RELAXED) + indx->hash_entry_size >=
+	    indx->memlimit && home->count > 0) {
+		/*
+		 * Move the hand to its position in the chain.
+		 */
+		b = home;
+		n = home->hand;
+		i = n;
+		while (i >= b->count && b->next) {
+			i -= b->count;
+			b = BUCKET(indx, b->next);
+		}
+		if (i >= b->count) {
+			b = home;
+			i = 0;
+			n = 0;
+		}
+		while ((h = BUCKET_HITS(b, i)) > 0) {
+			BUCKET_SET_HITS(b, i, h - 1);
+			n++;
+			if (++i == b->count) {
+				i = 0;
+				if (b->next) {
+					b = BUCKET(indx, b->next);
+				} else {
+					b = home;
+					n = 0;
+				}
+			}
+		}
+		home->hand = (uint8_t)(n + 1);
+		__atomic_store_n(ghost_cell(indx, slot, b->fp[i]), b->fp[i] | 1, __ATOMIC_RELAXED);
+		if (st)
+			st->evict++;
+		b->fp[i] = fp;
+		ent = ENTRY(indx, b->ref[i]);
+		memcpy(ent->cksum, key, ksz);
+		return (ent);
+	}
+
+	b = home;
+	while (b->next)
+		b = BUCKET(indx, b->next);
+	if (b->count == BUCKET_ENTS) {
+		if ((bid = arena_alloc(&indx->buckets)) == 0)
+			return (NULL);
+		nb = BUCKET(indx, bid);
+		b->next = bid;
+		b = nb;
+		__atomic_fetch_add(&indx->memused, sizeof (bucket_t), __ATOMIC_RELAXED);
+	}
+	if ((id = arena_alloc(&indx->entries)) == 0)
+		return (NULL);
+	__atomic_fetch_add(&indx->memused, indx->hash_entry_size, __ATOMIC_RELAXED);
+	ent = ENTRY(indx, id);
+	memcpy(ent->cksum, key, ksz);
+	b->fp[b->count] = fp;
+	b->ref[b->count] = id;
+	b->count++;
+	return (ent);
+}
+
+/*
+ * Concurrent access to the simple Global Dedupe index. Threads insert the blocks
+ * of their chunks in any order and an entry keeps the lowest file offset that its
+ * block was inserted at. Once all data before a chunk is inserted, which
+ * db_insert_wait_s() waits for, a lookup gives the first occurrence of a block
+ * in the file no matter how the inserts interleaved. So the output is the same
+ * as with serial index access. Slots are protected by striped locks.
+ *
+ * When the index is full entries are recycled as with db_lookup_insert_s() and
+ * matches then depend on thread timing.
+ */
+void
+db_insert_mt_s(archive_config_t *cfg, uchar_t *cksum, uint64_t item_offset,
+	       uint32_t item_size, index_stat_t *st)
+{
+	uint32_t htab_entry;
+	index_t *indx = (index_t *)(cfg->db_index);
+	hash_entry_t *ent;
+	pthread_mutex_t *lock;
+
+	htab_entry = db_slot(cfg, indx, cksum);
+	lock = &indx->locks[htab_entry % INDEX_LOCKS];
+
+	pthread_mutex_lock(lock);
+	ent = bucket_find(indx, &indx->list[0].tab[htab_entry], cksum, cfg->chunk_cksum_sz,
+	    1, item_size, 1);
+	if (ent) {
+		if (item_offset < ent->item_offset)
+			ent->item_offset = item_offset;
+	} else if ((ent = bucket_add(indx, &indx->list[0].tab[htab_entry], htab_entry, cksum,
+	    cfg->chunk_cksum_sz, item_size, st)) != NULL) {
+		ent->item_offset = item_offset;
+		ent->item_size = item_size;
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * Find the first occurrence of a block. Returns 1 and sets *item_offset if it
+ * is in the index.
+ */
+int
+db_lookup_mt_s(archive_config_t *cfg, uchar_t *cksum, uint32_t item_size,
+	       uint64_t *item_offset)
+{
+	uint32_t htab_entry;
+	index_t *indx = (index_t *)(cfg->db_index);
+	hash_entry_t *ent;
+	pthread_mutex_t *lock;
+	int found;
+
+	htab_entry = db_slot(cfg, indx, cksum);
+	lock = &indx->locks[htab_entry % INDEX_LOCKS];
+	found = 0;
+	pthread_mutex_lock(lock);
+	ent = bucket_find(indx, &indx->list[0].tab[htab_entry], cksum, cfg->chunk_cksum_sz,
+	    1, item_size, 0);
+	if (ent) {
+		*item_offset = ent->item_offset;
+		found = 1;
+	}
+	pthread_mutex_unlock(lock);
+	return (found);
+}
+
+/*
+ * Record that all blocks in the file range [start, end) are inserted.
+ */
+void
+db_insert_done_s(archive_config_t *cfg, uint64_t start, uint64_t end)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	int i;
+
+	pthread_mutex_lock(&indx->mark_lock);
+	if (start != indx->mark) {
+		if (indx->npending == indx->maxpending) {
+			uint64_t *p;
+			int n;
+
+			n = indx->maxpending ? indx->maxpending * 2 : 16;
+			p = (uint64_t *)realloc(indx->pending, n * 2 * sizeof (uint64_t));
+			if (p == NULL) {
+				indx->abort = 1;
+				pthread_cond_broadcast(&indx->mark_cv);
+				pthread_mutex_unlock(&indx->mark_lock);
+				return;
+			}
+			indx->pending = p;
+			indx->maxpending = n;
+		}
+		indx->pending[indx->npending * 2] = start;
+		indx->pending[indx->npending * 2 + 1] = end;
+		indx->npending++;
+		pthread_mutex_unlock(&indx->mark_lock);
+		return;
+	}
+
+	indx->mark = end;
+	i = 0;
+	while (i < indx->npending) {
+		if (indx->pending[i * 2] == indx->mark) {
+			indx->mark = indx->pending[i * 2 + 1];
+			indx->npending--;
+			indx->pending[i * 2] = indx->pending[indx->npending * 2];
+			indx->pending[i * 2 + 1] = indx->pending[indx->npending * 2 + 1];
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+	pthread_cond_broadcast(&indx->mark_cv);
+	pthread_mutex_unlock(&indx->mark_lock);
+}
+
+/*
+ * Wait till all blocks before file offset upto are inserted. Returns -1 if
+ * the operation is aborted.
+ */
+int
+db_insert_wait_s(archive_config_t *cfg, uint64_t upto)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	int rv;
+
+	pthread_mutex_lock(&indx->mark_lock);
+	while (indx->mark < upto && !indx->abort)
+		pthread_cond_wait(&indx->mark_cv, &indx->mark_lock);
+	rv = (indx->mark < upto ? -1 : 0);
+	pthread_mutex_unlock(&indx->mark_lock);
+	return (rv);
+}
+
+/*
+ * Wake up all threads waiting in db_insert_wait_s() with an error.
+ */
+void
+db_insert_abort_s(archive_config_t *cfg)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+
+	pthread_mutex_lock(&indx->mark_lock);
+	indx->abort = 1;
+	pthread_cond_broadcast(&indx->mark_cv);
+	pthread_mutex_unlock(&indx->mark_lock);
+}
+
 /*
  * Lookup and insert item if indicated. Not thread-safe by design. Caller needs to
  * ensure thread-safety.
  */
 hash_entry_t *
 db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
-		   uint64_t item_offset, uint32_t item_size, int do_insert)
+		   uint64_t item_offset, uint32_t item_size, int do_insert, index_stat_t *st)
 {
 	uint32_t htab_entry;
 	index_t *indx = (index_t *)(cfg->db_index);
-	hash_entry_t **htab, *ent, **pent;
+	hash_entry_t *ent;
+	bucket_t *home;
 
 	assert((cfg->similarity_cksum_sz & (sizeof (size_t) - 1)) == 0);
 
+	htab_entry = db_slot(cfg, indx, sim_cksum);
+	home = &indx->list[interval].tab[htab_entry];
+
 	/*
-	 * If doing similarity based dedupe, keys will be 64-bit and are portions of
-	 * cryptographic hashes. Since those are already a product of strong hashing
-	 * there is no need to re-hash the keys here.
+	 * With the simple index block sizes have to match as well. Segmented
+	 * Dedupe does approximate matching of similarity keys only.
 	 */
-	if (cfg->similarity_cksum_sz == 8) {
-		htab_entry = U32_P(sim_cksum);
-	} else {
-		htab_entry = XXH32(sim_cksum, cfg->similarity_cksum_sz, 0);
-	}
-	htab_entry ^= (htab_entry / cfg->similarity_cksum_sz);
-	htab_entry = htab_entry % indx->hash_slots;
-	htab = indx->list[interval].tab;
-
-	pent = &(htab[htab_entry]);
-	ent = htab[htab_entry];
-	if (cfg->pct_interval == 0) { // Global dedupe with simple index.
+	if (cfg->pct_interval == 0)
 		assert(cfg->similarity_cksum_sz == cfg->chunk_cksum_sz);
-		while (ent) {
-			if (mycmp(sim_cksum, ent->cksum, cfg->similarity_cksum_sz) == 0 &&
-			    ent->item_size == item_size) {
-				return (ent);
-			}
-			pent = &(ent->next);
-			ent = ent->next;
+	ent = bucket_find(indx, home, sim_cksum, cfg->similarity_cksum_sz,
+	    cfg->pct_interval == 0, item_size, 1);
+	if (ent)
+		return (ent);
+
+	if (do_insert) {
+		ent = bucket_add(indx, home, htab_entry, sim_cksum, cfg->similarity_cksum_sz,
+		    item_size, st);
+		if (ent) {
+			ent->item_offset = item_offset;
+			ent->item_size = item_size;
 		}
-	// The following two cases are for Segmented Dedupe approximate matching
-	} else if (cfg->similarity_cksum_sz == 8) {// Fast path for 64-bit keys
-		while (ent) {
-			if (U64_P(sim_cksum) == U64_P(ent->cksum)) {
-				return (ent);
-			}
-			pent = &(ent->next);
-			ent = ent->next;
+	}
+	return (NULL);
+}
+
+/*
+ * Look up and insert a batch of similarity keys of one segment. The home buckets
+ * of a group of keys are prefetched before any of them is resolved, so that the
+ * cache misses overlap instead of being taken one after another. Results are the
+ * same as calling db_lookup_insert_s() for each key in turn: the offset of a
+ * matching entry or UINT64_MAX is stored for each key at a stride of the key size.
+ * Returns the number of keys found.
+ */
+int
+db_lookup_insert_batch_s(archive_config_t *cfg, uchar_t *sim_cksums, int nkeys,
+		   uint64_t item_offset, uchar_t *offsets, index_stat_t *st)
+{
+	uint32_t slots[DB_BATCH];
+	index_t *indx = (index_t *)(cfg->db_index);
+	hash_entry_t *ent;
+	uchar_t *key;
+	int i, j, n, found;
+
+	assert(cfg->pct_interval > 0);
+	found = 0;
+	for (i = 0; i < nkeys; i += DB_BATCH) {
+		n = nkeys - i;
+		if (n > DB_BATCH)
+			n = DB_BATCH;
+		key = sim_cksums;
+		for (j = 0; j < n; j++) {
+			slots[j] = db_slot(cfg, indx, key);
+			PREFETCH_WRITE(&indx->list[0].tab[slots[j]], 3);
+			key += cfg->similarity_cksum_sz;
 		}
-	} else {
-		while (ent) {
-			if (mycmp(sim_cksum, ent->cksum, cfg->similarity_cksum_sz) == 0) {
-				return (ent);
+
+		for (j = 0; j < n; j++) {
+			ent = bucket_find(indx, &indx->list[0].tab[slots[j]], sim_cksums,
+			    cfg->similarity_cksum_sz, 0, 0, 1);
+			if (ent) {
+				U64_P(offsets) = ent->item_offset;
+				found++;
+			} else {
+				U64_P(offsets) = UINT64_MAX;
+				ent = bucket_add(indx, &indx->list[0].tab[slots[j]], slots[j],
+				    sim_cksums, cfg->similarity_cksum_sz, 0, st);
+				if (ent) {
+					ent->item_offset = item_offset;
+					ent->item_size = 0;
+				}
 			}
-			pent = &(ent->next);
-			ent = ent->next;
+			sim_cksums += cfg->similarity_cksum_sz;
+			offsets += cfg->similarity_cksum_sz;
 		}
 	}
-	if (do_insert) {
-		if (indx->memused + indx->hash_entry_size >= indx->memlimit && htab[htab_entry] != NULL) {
-			/*
-			 * If the index is close to full capacity, steal the oldest hash bucket
-			 * in this slot to hold the new data.
-			 */
-			ent = htab[htab_entry];
-			htab[htab_entry] = htab[htab_entry]->next;
-		} else {
-			ent = (hash_entry_t *)malloc(indx->hash_entry_size);
-			indx->memused += indx->hash_entry_size;
-		}
-		ent->item_offset = item_offset;
-		ent->item_size = item_size;
-		ent->next = 0;
-		memcpy(ent->cksum, sim_cksum, cfg->similarity_cksum_sz);
-		*pent = ent;
-	}
-	return (NULL);
+	return (found);
 }
 
 void
@@ -566,10 +1298,273 @@ destroy_global_db_s(archive_config_t *cfg)
 	cleanup_indx(indx);
 	if (cfg->pct_interval > 0) {
 		for (i = 0; i < cfg->nthreads; i++) {
+			db_segcache_unmap(cfg, i);
 			close(cfg->seg_fd_r[i].fd);
+			free(cfg->seg_fd_r[i].blocks);
 		}
 		free(cfg->seg_fd_r);
+		free(cfg->segcache_buf);
 		close(cfg->seg_fd_w);
 	}
 }
 
+/*
+ * Map the persistent index of a base file so that blocks of the base can be
+ * looked up with db_base_lookup_s(). Returns 0 if there is no index file yet
+ * and -1 if the index cannot be used with the current settings.
+ */
+int
+db_base_open_s(archive_config_t *cfg, char *path)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	struct stat sbuf;
+	uchar_t *m;
+	uint64_t slots;
+	uint32_t fblocks;
+	int fd, ent;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return (0);
+		log_msg(LOG_ERR, 1, "Cannot open index %s ", path);
+		return (-1);
+	}
+	if (fstat(fd, &sbuf) == -1 || sbuf.st_size < BASE_HDR_SZ) {
+		log_msg(LOG_ERR, 0, "Invalid index %s\n", path);
+		close(fd);
+		return (-1);
+	}
+	m = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		log_msg(LOG_ERR, 1, "Cannot map index %s ", path);
+		return (-1);
+	}
+
+	ent = cfg->chunk_cksum_sz + sizeof (uint64_t) + sizeof (uint32_t);
+	slots = LE64(U64_P(m + 32));
+	fblocks = LE32(U32_P(m + 20));
+	if (memcmp(m, BASE_MAGIC, 8) != 0 || slots == 0 || !ISP2(slots) ||
+	    (sbuf.st_size - BASE_HDR_SZ) / ent < slots || (fblocks != 0 && !ISP2(fblocks)) ||
+	    sbuf.st_size - BASE_HDR_SZ - slots * ent < (uint64_t)fblocks * BASE_FILTER_BLK) {
+		log_msg(LOG_ERR, 0, "Invalid index %s\n", path);
+		munmap(m, sbuf.st_size);
+		return (-1);
+	}
+	if (LE32(U32_P(m + 8)) != cfg->chunk_cksum_type || LE32(U32_P(m + 12)) != cfg->chunk_sz ||
+	    LE32(U32_P(m + 16)) != cfg->chunk_cksum_sz) {
+		log_msg(LOG_WARN, 0, "Index %s was created with a different block size or "
+		    "chunk hash.\n", path);
+		munmap(m, sbuf.st_size);
+		return (-1);
+	}
+	indx->base = m;
+	indx->base_len = sbuf.st_size;
+	indx->base_mask = slots - 1;
+	indx->base_ent = ent;
+	indx->base_filter = NULL;
+	if (fblocks > 0) {
+		indx->base_filter = m + BASE_HDR_SZ + slots * ent;
+		indx->base_fmask = fblocks - 1;
+	}
+	return (0);
+}
+
+int
+db_base_mapped_s(archive_config_t *cfg)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+
+	return (indx->base != NULL);
+}
+
+/*
+ * Find a block in the base index. Returns 1 and sets *item_offset to its offset
+ * in the base data if found. Lock free as the mapping is read-only.
+ */
+int
+db_base_lookup_s(archive_config_t *cfg, uchar_t *cksum, uint32_t item_size,
+		 uint64_t *item_offset)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	uchar_t *slot;
+	uint64_t i, n;
+	uint32_t len;
+
+	if (indx->base == NULL)
+		return (0);
+	if (indx->base_filter && !base_filter_test(indx->base_filter + BASE_FILTER_BLK *
+	    (LE64(U64_P(cksum + 8)) & indx->base_fmask), cksum, cfg->chunk_cksum_sz, 0))
+		return (0);
+	i = LE64(U64_P(cksum)) & indx->base_mask;
+	for (n = 0; n <= indx->base_mask; n++) {
+		slot = indx->base + BASE_HDR_SZ + i * indx->base_ent;
+		len = LE32(U32_P(slot + cfg->chunk_cksum_sz + sizeof (uint64_t)));
+		if (len == 0)
+			return (0);
+		if (len == item_size && memcmp(slot, cksum, cfg->chunk_cksum_sz) == 0) {
+			*item_offset = LE64(U64_P(slot + cfg->chunk_cksum_sz));
+			return (1);
+		}
+		i = (i + 1) & indx->base_mask;
+	}
+	return (0);
+}
+
+/*
+ * Set up an empty base index in memory with room for nblocks blocks, to be
+ * filled in by db_base_insert_s(). This lets a reference file be used as the
+ * base without a persistent index from an earlier run. Returns the number of
+ * slots, 0 on failure.
+ */
+uint64_t
+db_base_create_s(archive_config_t *cfg, uint64_t nblocks)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	uint64_t slots, len;
+	uchar_t *m;
+	int ent;
+
+	slots = 1024;
+	while (slots < nblocks * 2)
+		slots <<= 1;
+	ent = cfg->chunk_cksum_sz + sizeof (uint64_t) + sizeof (uint32_t);
+	len = BASE_HDR_SZ + slots * ent;
+	m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		log_msg(LOG_ERR, 1, "Cannot allocate base index ");
+		return (0);
+	}
+	memcpy(m, BASE_MAGIC, 8);
+	U64_P(m + 32) = LE64(slots);
+	indx->base = m;
+	indx->base_len = len;
+	indx->base_mask = slots - 1;
+	indx->base_ent = ent;
+	indx->base_filter = NULL;
+	return (slots);
+}
+
+/*
+ * Add a block to an index set up by db_base_create_s(). The first block with
+ * a given hash is kept. Not thread safe.
+ */
+void
+db_base_insert_s(archive_config_t *cfg, uchar_t *cksum, uint64_t item_offset,
+		 uint32_t item_size)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	uchar_t *slot;
+	uint64_t i, n;
+	uint32_t len;
+
+	i = LE64(U64_P(cksum)) & indx->base_mask;
+	for (n = 0; n <= indx->base_mask; n++) {
+		slot = indx->base + BASE_HDR_SZ + i * indx->base_ent;
+		len = LE32(U32_P(slot + cfg->chunk_cksum_sz + sizeof (uint64_t)));
+		if (len == 0) {
+			memcpy(slot, cksum, cfg->chunk_cksum_sz);
+			U64_P(slot + cfg->chunk_cksum_sz) = LE64(item_offset);
+			U32_P(slot + cfg->chunk_cksum_sz + sizeof (uint64_t)) = LE32(item_size);
+			return;
+		}
+		if (len == item_size && memcmp(slot, cksum, cfg->chunk_cksum_sz) == 0)
+			return;
+		i = (i + 1) & indx->base_mask;
+	}
+}
+
+/*
+ * Write the blocks in the simple index out as the persistent index of the data
+ * just processed, which becomes the base for the next run. The file is built
+ * under a temporary name and renamed over the old index only once complete.
+ */
+int
+db_base_save_s(archive_config_t *cfg, char *path, uint64_t base_size)
+{
+	index_t *indx = (index_t *)(cfg->db_index);
+	char tmp[PATH_MAX];
+	hash_entry_t *he;
+	uchar_t *m, *slot;
+	uchar_t *filter;
+	uint64_t n, slots, len, i;
+	uint32_t id, nid, fblocks;
+	int fd, ent;
+
+	if (cfg->pct_interval != 0 || cfg->window_sz != 0)
+		return (-1);
+
+	/*
+	 * Every entry handed out is in use as entries are only ever recycled.
+	 */
+	nid = indx->entries.next;
+	if (nid > ARENA_MAXID)
+		nid = ARENA_MAXID;
+	n = nid - 1;
+	slots = 1024;
+	while (slots < n * 2)
+		slots <<= 1;
+	ent = cfg->chunk_cksum_sz + sizeof (uint64_t) + sizeof (uint32_t);
+	fblocks = BASE_FILTER_BLOCKS(slots);
+	len = BASE_HDR_SZ + slots * ent + (uint64_t)fblocks * BASE_FILTER_BLK;
+
+	if (snprintf(tmp, sizeof (tmp), "%s.XXXXXX", path) >= sizeof (tmp)) {
+		log_msg(LOG_ERR, 0, "Index path too long: %s\n", path);
+		return (-1);
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot create index %s ", tmp);
+		return (-1);
+	}
+	if (ftruncate(fd, len) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot size index %s ", tmp);
+		goto err;
+	}
+	m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		log_msg(LOG_ERR, 1, "Cannot map index %s ", tmp);
+		goto err;
+	}
+
+	memcpy(m, BASE_MAGIC, 8);
+	U32_P(m + 8) = LE32(cfg->chunk_cksum_type);
+	U32_P(m + 12) = LE32(cfg->chunk_sz);
+	U32_P(m + 16) = LE32(cfg->chunk_cksum_sz);
+	U32_P(m + 20) = LE32(fblocks);
+	U64_P(m + 24) = LE64(base_size);
+	U64_P(m + 32) = LE64(slots);
+	filter = m + BASE_HDR_SZ + slots * ent;
+	for (id = 1; id < nid; id++) {
+		if (indx->entries.chunk[id >> ARENA_SHIFT] == NULL)
+			continue;
+		he = ENTRY(indx, id);
+		if (he->item_size == 0)
+			continue;
+		i = LE64(U64_P(he->cksum)) & (slots - 1);
+		slot = m + BASE_HDR_SZ + i * ent;
+		while (U32_P(slot + cfg->chunk_cksum_sz + sizeof (uint64_t)) != 0) {
+			i = (i + 1) & (slots - 1);
+			slot = m + BASE_HDR_SZ + i * ent;
+		}
+		memcpy(slot, he->cksum, cfg->chunk_cksum_sz);
+		U64_P(slot + cfg->chunk_cksum_sz) = LE64(he->item_offset);
+		U32_P(slot + cfg->chunk_cksum_sz + sizeof (uint64_t)) = LE32(he->item_size);
+		base_filter_test(filter + BASE_FILTER_BLK * (LE64(U64_P(he->cksum + 8)) &
+		    (fblocks - 1)), he->cksum, cfg->chunk_cksum_sz, 1);
+	}
+	if (munmap(m, len) == -1 || fsync(fd) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot write index %s ", tmp);
+		goto err;
+	}
+	close(fd);
+	if (rename(tmp, path) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot rename index %s ", tmp);
+		unlink(tmp);
+		return (-1);
+	}
+	return (0);
+err:
+	close(fd);
+	unlink(tmp);
+	return (-1);
+}
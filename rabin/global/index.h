@@ -32,15 +32,23 @@ extern "C" {
 #endif
 
 /*
- * Publically visible In-memory hashtable entry.
+ * Publically visible In-memory hashtable entry. Entries live in the index
+ * arenas and stay valid till the index is destroyed.
  */
 typedef struct _hash_entry {
 	uint64_t item_offset;
 	uint32_t item_size;
-	struct _hash_entry *next;
 	uchar_t cksum[1];
 } hash_entry_t;
 
+/*
+ * Index eviction counters of a caller. Lost matches are keys looked up again
+ * after their entry was evicted, an estimate of the dedupe that evictions cost.
+ */
+typedef struct {
+	uint64_t evict, lost, lost_bytes;
+} index_stat_t;
+
 
 archive_config_t *init_global_db(char *configfile);
 int setup_db_config_s(archive_config_t *cfg, uint32_t chunksize, uint64_t *user_chunk_sz,
@@ -51,14 +59,36 @@ archive_config_t *init_global_db_s(char *path, char *tmppath, uint32_t chunksize
 			uint64_t user_chunk_sz, int pct_interval, const char *algo,
 			cksum_t ck, cksum_t ck_sim, size_t file_sz, size_t memlimit,
 			int nthreads);
+archive_config_t *init_window_db_s(uint32_t chunksize, uint64_t user_chunk_sz,
+			const char *algo, cksum_t ck, uint64_t window_sz, size_t memlimit,
+			int nthreads);
 hash_entry_t *db_lookup_insert_s(archive_config_t *cfg, uchar_t *sim_cksum, int interval,
-		   uint64_t item_offset, uint32_t item_size, int do_insert);
+		   uint64_t item_offset, uint32_t item_size, int do_insert, index_stat_t *st);
+int db_lookup_insert_batch_s(archive_config_t *cfg, uchar_t *sim_cksums, int nkeys,
+		   uint64_t item_offset, uchar_t *offsets, index_stat_t *st);
+void db_insert_mt_s(archive_config_t *cfg, uchar_t *cksum, uint64_t item_offset,
+		uint32_t item_size, index_stat_t *st);
+int db_lookup_mt_s(archive_config_t *cfg, uchar_t *cksum, uint32_t item_size,
+		uint64_t *item_offset);
+void db_insert_done_s(archive_config_t *cfg, uint64_t start, uint64_t end);
+int db_insert_wait_s(archive_config_t *cfg, uint64_t upto);
+void db_insert_abort_s(archive_config_t *cfg);
 void destroy_global_db_s(archive_config_t *cfg);
+int db_base_open_s(archive_config_t *cfg, char *path);
+int db_base_mapped_s(archive_config_t *cfg);
+int db_base_lookup_s(archive_config_t *cfg, uchar_t *cksum, uint32_t item_size,
+		uint64_t *item_offset);
+int db_base_save_s(archive_config_t *cfg, char *path, uint64_t base_size);
+uint64_t db_base_create_s(archive_config_t *cfg, uint64_t nblocks);
+void db_base_insert_s(archive_config_t *cfg, uchar_t *cksum, uint64_t item_offset,
+		uint32_t item_size);
 
-int db_segcache_write(archive_config_t *cfg, int tid, uchar_t *buf, uint32_t len, uint32_t blknum, uint64_t file_offset);
+int db_segcache_write(archive_config_t *cfg, int tid, global_blockentry_t *blocks, uint32_t blknum,
+		      uint64_t file_offset);
 uint64_t db_segcache_pos(archive_config_t *cfg, int tid);
 int db_segcache_map(archive_config_t *cfg, int tid, uint32_t *blknum, uint64_t *offset, uchar_t **blocks);
 int db_segcache_unmap(archive_config_t *cfg, int tid);
+void db_segcache_prefetch(archive_config_t *cfg, int tid, uint64_t offset);
 
 #ifdef	__cplusplus
 }
@@ -69,34 +69,50 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <allocator.h>
 #include <utils.h>
 #include <pthread.h>
-#include <heap.h>
 #include <xxhash.h>
-
-#define	QSORT_LT(a, b)	((*a)<(*b))
-#define	QSORT_TYPE uint64_t
-#include <qsort.h>
+#include <mb_hash.h>
 
 #include "rabin_dedup.h"
-#if defined(__USE_SSE_INTRIN__) && defined(__SSE4_1__) && RAB_POLYNOMIAL_WIN_SIZE == 16
-#	include <smmintrin.h>
-#	define	SSE_MODE		1
+#include <lz4.h>
+#if defined(__USE_SSE_INTRIN__)
+#	include <emmintrin.h>
 #endif
 
-#if defined(__USE_SSE_INTRIN__) && !defined(__SSE4_1__)
-#	include <emmintrin.h>
+#if defined(__x86_64__)
+#	include <smmintrin.h>
+#elif defined(__aarch64__)
+#	include <arm_neon.h>
 #endif
 
 #if defined(_OPENMP)
 #include <omp.h>
 #endif
 
-#define	DELTA_EXTRA2_PCT(x) ((x) >> 1)
-#define	DELTA_EXTRA_PCT(x) (((x) >> 1) + ((x) >> 3))
-#define	DELTA_NORMAL_PCT(x) (((x) >> 1) + ((x) >> 2) + ((x) >> 3))
+/*
+ * Multipliers and addends of the linear transforms used for the similarity
+ * sketch features. Multipliers are odd so that each transform is a bijection.
+ */
+#define	SKETCH_FEATURES	4
+static const uint32_t sketch_mul[SKETCH_FEATURES] = {
+	0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU
+};
+static const uint32_t sketch_add[SKETCH_FEATURES] = {
+	0x165667b1U, 0xd3a2646cU, 0xfd7046c5U, 0xb55a4f09U
+};
+
+/*
+ * Features of the sketch that groups unique blocks when reordering. Fewer
+ * features than delta encoding uses, since blocks only need to be alike
+ * enough to help the compressor.
+ */
+#define	REORDER_FEATURES 2
 
 extern int lzma_init(void **data, int *level, int nthreads, int64_t chunksize,
 		     int file_version, compress_op_t op);
@@ -110,19 +126,108 @@ extern int bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsi
 extern bsize_t get_bsdiff_sz(u_char *pbuf);
 extern int bspatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf,
 	bsize_t *_newsize);
+extern bsize_t hdelta(uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf, bsize_t newsize,
+	uchar_t *diff, bsize_t maxsize);
+extern int hpatch(uchar_t *pbuf, uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf,
+	bsize_t *newsize);
+extern int is_hdelta(uchar_t *pbuf);
+extern bsize_t get_hdelta_sz(uchar_t *pbuf);
 
 static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 uint64_t ir[256], out[256];
-static int inited = 0;
+static uint64_t gear[256];
+static int inited = 0, gear_inited = 0;
 archive_config_t *arc = NULL;
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Global dedupe recovery state shared by the decompression contexts of a file.
+ * References to earlier output are read through read-only mappings of 64MB
+ * extents of the output file that are set up on first use and kept till the
+ * contexts go away. A reference can be resolved as soon as the writer has
+ * written out the data it points to, tracked by durable_off.
+ */
+#define	MAP_EXTENT_SHIFT	26
+#define	MAP_EXTENT		(1ULL << MAP_EXTENT_SHIFT)
+#define	MAP_L2_SZ		1024
+#define	MAP_L1_SZ		1024
+
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t restore_cv = PTHREAD_COND_INITIALIZER;
+static uchar_t **map_l1[MAP_L1_SZ];
+static uint64_t durable_off;
+static int durable_abort, restore_inited = 0;
+
+/*
+ * When the output is not seekable, references of a file compressed with a
+ * dedupe window are resolved from a ring buffer holding the last window
+ * bytes of output instead, see dedupe_restore_window().
+ */
+static uchar_t *out_ring = NULL;
+static uint64_t out_ring_sz = 0;
+
+/*
+ * Size in chunks of the dedupe window of the index used for compression.
+ */
+static int index_window = 0;
+
+/*
+ * Persistent index written at the end of compression and the mapping of the
+ * base file that references into a previous run's data are resolved from.
+ */
+static char *base_index = NULL;
+static uchar_t *base_map = NULL;
+static uint64_t base_len = 0;
+
+/*
+ * Long range matching along with Global Dedupe, see dedupe_long_match(). The
+ * table holds the stream offset of the latest anchor for each hash slot in the
+ * low LDM_OFF_BITS and a check tag from the hash above them. The top bit marks
+ * offsets into the base file. It is shared by all threads without locks. A
+ * lost update only loses a match since every match is checked against the
+ * input file, read via ldm_fd.
+ */
+#define	LDM_ANCHOR_BITS	8
+#define	LDM_ANCHOR_MASK	GEAR_MASK(LDM_ANCHOR_BITS)
+#define	LDM_MIN_MATCH	512
+#define	LDM_TAB_MIN_BITS	16
+#define	LDM_TAB_MAX_BITS	23
+#define	LDM_OFF_BITS	40
+#define	LDM_OFF_MASK	((1ULL << LDM_OFF_BITS) - 1)
+#define	LDM_TAG_BITS	23
+#define	LDM_TAG_MASK	((1ULL << LDM_TAG_BITS) - 1)
+#define	LDM_BASE	(1ULL << 63)
+#define	LDM_CMP_MIN	1024
+#define	LDM_CMP_BUF	(64 * 1024)
+
+static uint64_t *ldm_tab = NULL;
+static int ldm_bits = 0;
+static int ldm_fd = -1;
+static uint64_t ldm_base = 0;
+
+/*
+ * Restore groups. With PCOMPRESS_RESTORE_GROUP a chunk only references data
+ * of its own group, which starts with the chunk holding a multiple of
+ * restore_group_sz bytes. Such a chunk may only reference itself. Any group
+ * can then be restored without the data before it.
+ */
+static uint64_t restore_group_sz = 0;
+
+/*
+ * A base file given for compression is indexed in pieces of this size once
+ * the first context is set up.
+ */
+#define	BASE_PIECE	(64ULL * 1024 * 1024)
+static int base_build = 0;
+
+static int dedupe_base_build(dedupe_context_t *ctx);
+
+#define	DEDUPE_MIN_BLKSZ(x)	((1 << ((x) + RAB_BLK_MIN_BITS)) - 1024)
 
 static uint32_t
 dedupe_min_blksz(int rab_blk_sz)
 {
-	uint32_t min_blk;
-
-	min_blk = (1 << (rab_blk_sz + RAB_BLK_MIN_BITS)) - 1024;
-	return (min_blk);
+	return (DEDUPE_MIN_BLKSZ(rab_blk_sz));
 }
 
 uint32_t
@@ -134,6 +239,737 @@ dedupe_buf_extra(uint64_t chunksize, int rab_blk_sz, const char *algo, int delta
 	return ((chunksize / dedupe_min_blksz(rab_blk_sz)) * sizeof (uint32_t));
 }
 
+/*
+ * Fill the Gear table with pseudo-random 64-bit values. A fixed seed keeps
+ * block boundaries identical across runs and hosts.
+ */
+static void
+gear_init(void)
+{
+	uint64_t x, z;
+	int j;
+
+	x = 0x5ca1ab1e0ddba11ULL;
+	for (j = 0; j < 256; j++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[j] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * Build a Gear judgement mask with the given number of bits at the top of the
+ * fingerprint. Top bits depend on the last 64 bytes of input.
+ */
+#define	GEAR_MASK(bits)	(((1ULL << (bits)) - 1) << (64 - (bits)))
+
+static uint64_t
+gear_mask(int bits)
+{
+	if (bits < 1)
+		bits = 1;
+	return (GEAR_MASK(bits));
+}
+
+/*
+ * Return the length of the next Gear block of buf. This is FastCDC with
+ * normalized chunking: the first min block size bytes are skipped, a harder
+ * mask is used up to the average block size and an easier one after that.
+ * The hash is warmed up over the last 64 bytes before the minimum size so
+ * that boundaries only depend on content.
+ */
+static inline __attribute__((always_inline)) uint32_t
+gear_scan(uchar_t *buf, uint64_t len, const uint32_t min, const uint32_t avg,
+	  const uint32_t maxsz, const uint64_t mask_s, const uint64_t mask_l)
+{
+	uint64_t i, normal, max, fp;
+
+	if (len <= min)
+		return (len);
+	max = maxsz;
+	if (max > len)
+		max = len;
+	normal = avg;
+	if (normal > max)
+		normal = max;
+
+	fp = 0;
+	for (i = min - RAB_WINDOW_SLIDE_OFFSET; i < min; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+	}
+	for (; i < normal; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & mask_s))
+			return (i + 1);
+	}
+	for (; i < max; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & mask_l))
+			return (i + 1);
+	}
+	return (max);
+}
+
+/*
+ * Return the length of the next Rabin block of buf. The rolling checksum only
+ * depends on the last RAB_POLYNOMIAL_WIN_SIZE bytes, so starting every block
+ * with a fresh window RAB_WINDOW_SLIDE_OFFSET bytes before the minimum size
+ * finds the same boundaries as sliding it over the whole chunk. The last window
+ * of the buffer is not scanned and len is returned if no boundary is found.
+ *
+ * The byte pushed out of the window is simply the one RAB_POLYNOMIAL_WIN_SIZE
+ * bytes back, or a zero byte while the window fills up. Only the low bits of
+ * the checksum are tested and reducing modulo POLY_MASK + 1 does not change
+ * those, so the checksum is kept modulo 2^64 instead. It is then a linear
+ * recurrence that can be advanced 4 bytes at a time from the checksum 4 bytes
+ * back, which takes the per byte multiply off the critical path.
+ */
+#define	RAB_C1	((uint64_t)RAB_POLYNOMIAL_CONST)
+#define	RAB_C2	(RAB_C1 * RAB_C1)
+#define	RAB_C3	(RAB_C2 * RAB_C1)
+#define	RAB_C4	(RAB_C3 * RAB_C1)
+
+static inline __attribute__((always_inline)) uint32_t
+rabin_scan(uchar_t *buf, uint64_t len, const uint32_t min, const uint32_t max,
+	   const uint64_t mask, const uint64_t patt)
+{
+	uint64_t i, start, fill, end, stop, warm, roll;
+	uint64_t d0, d1, d2, d3, e2, e3, e4, r1, r2, r3;
+	uchar_t *p;
+
+	start = min - RAB_WINDOW_SLIDE_OFFSET;
+	end = len - RAB_POLYNOMIAL_WIN_SIZE;
+	stop = (end < max ? end : max);
+	warm = (min - 1 < stop ? min - 1 : stop);
+	fill = (start + RAB_POLYNOMIAL_WIN_SIZE < warm ? start + RAB_POLYNOMIAL_WIN_SIZE : warm);
+
+	/*
+	 * No boundary can come before the minimum size, so the window is only
+	 * warmed up until then.
+	 */
+	roll = 0;
+	for (i = start; i < fill; i++)
+		roll = roll * RAB_C1 + buf[i] - out[0];
+	for (; i < warm; i++)
+		roll = roll * RAB_C1 + buf[i] - out[buf[i - RAB_POLYNOMIAL_WIN_SIZE]];
+
+	for (; i + 4 <= stop; i += 4) {
+		p = buf + i - RAB_POLYNOMIAL_WIN_SIZE;
+		d0 = buf[i] - out[p[0]];
+		d1 = buf[i + 1] - out[p[1]];
+		d2 = buf[i + 2] - out[p[2]];
+		d3 = buf[i + 3] - out[p[3]];
+		e2 = d0 * RAB_C1 + d1;
+		e3 = e2 * RAB_C1 + d2;
+		e4 = e3 * RAB_C1 + d3;
+		r1 = roll * RAB_C1 + d0;
+		r2 = roll * RAB_C2 + e2;
+		r3 = roll * RAB_C3 + e3;
+
+		// If we hit our special value end the block
+		if (((r1 ^ ir[p[0]]) & mask) == patt)
+			return (i + 1);
+		if (((r2 ^ ir[p[1]]) & mask) == patt)
+			return (i + 2);
+		if (((r3 ^ ir[p[2]]) & mask) == patt)
+			return (i + 3);
+		roll = roll * RAB_C4 + e4;
+		if (((roll ^ ir[p[3]]) & mask) == patt)
+			return (i + 4);
+	}
+	for (; i < stop; i++) {
+		p = buf + i - RAB_POLYNOMIAL_WIN_SIZE;
+		roll = roll * RAB_C1 + buf[i] - out[p[0]];
+		if (((roll ^ ir[p[0]]) & mask) == patt)
+			return (i + 1);
+	}
+
+	// Reached the max block size end the block
+	if (stop == max)
+		return (max);
+	return (len);
+}
+
+/*
+ * Generic scan kernels that read the block size parameters from the context.
+ */
+static uint32_t
+gear_next_block(dedupe_context_t *ctx, uchar_t *buf, uint64_t len)
+{
+	return (gear_scan(buf, len, ctx->rabin_poly_min_block_size,
+	    ctx->rabin_poly_avg_block_size, ctx->rabin_poly_max_block_size,
+	    ctx->gear_mask_s, ctx->gear_mask_l));
+}
+
+static uint32_t
+rabin_next_block(dedupe_context_t *ctx, uchar_t *buf, uint64_t len)
+{
+	return (rabin_scan(buf, len, ctx->rabin_poly_min_block_size,
+	    ctx->rabin_poly_max_block_size, ctx->rabin_avg_block_mask,
+	    ctx->rabin_break_patt));
+}
+
+/*
+ * Scan kernels specialised for each block size setting and maximum block size,
+ * where the bounds and masks are compile time constants. The chunker is run
+ * per byte, so this lets the compiler keep them in registers or immediates
+ * and unroll the loops. The kernel is selected when the context is created.
+ */
+#define	RABIN_SCAN_KERNEL(bs, maxk) \
+static uint32_t \
+rabin_next_block_##bs##_##maxk(dedupe_context_t *ctx, uchar_t *buf, uint64_t len) \
+{ \
+	return (rabin_scan(buf, len, DEDUPE_MIN_BLKSZ(bs), (maxk) * 1024, \
+	    RAB_BLK_MASK, 0)); \
+}
+
+#define	GEAR_SCAN_KERNEL(bs, maxk) \
+static uint32_t \
+gear_next_block_##bs##_##maxk(dedupe_context_t *ctx, uchar_t *buf, uint64_t len) \
+{ \
+	return (gear_scan(buf, len, DEDUPE_MIN_BLKSZ(bs), RAB_BLK_AVG_SZ(bs), \
+	    (maxk) * 1024, GEAR_MASK(RAB_BLK_MIN_BITS - 1 + GEAR_NC_LEVEL), \
+	    GEAR_MASK(RAB_BLK_MIN_BITS - 1 - GEAR_NC_LEVEL))); \
+}
+
+#define	DEDUPE_SCAN_KERNELS(bs, maxk) \
+	RABIN_SCAN_KERNEL(bs, maxk) \
+	GEAR_SCAN_KERNEL(bs, maxk)
+
+DEDUPE_SCAN_KERNELS(0, 128)
+DEDUPE_SCAN_KERNELS(1, 128)
+DEDUPE_SCAN_KERNELS(2, 128)
+DEDUPE_SCAN_KERNELS(3, 128)
+DEDUPE_SCAN_KERNELS(4, 128)
+DEDUPE_SCAN_KERNELS(5, 128)
+DEDUPE_SCAN_KERNELS(0, 64)
+DEDUPE_SCAN_KERNELS(1, 64)
+DEDUPE_SCAN_KERNELS(2, 64)
+
+static const dedupe_scan_fn rabin_kernels[2][6] = {
+	{ rabin_next_block_0_128, rabin_next_block_1_128, rabin_next_block_2_128,
+	  rabin_next_block_3_128, rabin_next_block_4_128, rabin_next_block_5_128 },
+	{ rabin_next_block_0_64, rabin_next_block_1_64, rabin_next_block_2_64,
+	  NULL, NULL, NULL }
+};
+
+static const dedupe_scan_fn gear_kernels[2][6] = {
+	{ gear_next_block_0_128, gear_next_block_1_128, gear_next_block_2_128,
+	  gear_next_block_3_128, gear_next_block_4_128, gear_next_block_5_128 },
+	{ gear_next_block_0_64, gear_next_block_1_64, gear_next_block_2_64,
+	  NULL, NULL, NULL }
+};
+
+/*
+ * Pick the scan kernel matching the block size parameters of the context, or
+ * the generic one if there is no specialised kernel for them.
+ */
+static dedupe_scan_fn
+dedupe_scan_select(dedupe_context_t *ctx, int rab_blk_sz)
+{
+	dedupe_scan_fn fn;
+	int m;
+
+	fn = NULL;
+	if (ctx->rabin_poly_max_block_size == RAB_POLYNOMIAL_MAX_BLOCK_SIZE)
+		m = 0;
+	else if (ctx->rabin_poly_max_block_size == RAB_POLY_MAX_BLOCK_SIZE_GLOBAL)
+		m = 1;
+	else
+		m = -1;
+	if (m >= 0 && ctx->rabin_poly_min_block_size == DEDUPE_MIN_BLKSZ(rab_blk_sz) &&
+	    ctx->rabin_poly_avg_block_size == RAB_BLK_AVG_SZ(rab_blk_sz) &&
+	    ctx->rabin_avg_block_mask == RAB_BLK_MASK && ctx->rabin_break_patt == 0) {
+		if (ctx->chunker == RABIN_CHUNKER_GEAR)
+			fn = gear_kernels[m][rab_blk_sz];
+		else
+			fn = rabin_kernels[m][rab_blk_sz];
+	}
+	if (fn == NULL) {
+		if (ctx->chunker == RABIN_CHUNKER_GEAR)
+			fn = gear_next_block;
+		else
+			fn = rabin_next_block;
+	}
+	return (fn);
+}
+
+static inline uint32_t
+dedupe_next_block(dedupe_context_t *ctx, uchar_t *buf, uint64_t len)
+{
+	return (ctx->next_block(ctx, buf, len));
+}
+
+/*
+ * Chunk one segment [start, end) of a buffer as if a block started at start.
+ * Block end offsets are stored in cuts. Scanning stops at the first block that
+ * ends at or beyond end, or when the remaining data forms the trailing block in
+ * which case 1 is returned.
+ */
+static int
+dedupe_scan_segment(dedupe_context_t *ctx, uchar_t *buf, uint64_t size, uint64_t start,
+		    uint64_t end, uint64_t *cuts, uint32_t *ncuts)
+{
+	uint64_t pos;
+	uint32_t n, length;
+
+	pos = start;
+	n = 0;
+	for (;;) {
+		if (size - pos <= ctx->rabin_poly_min_block_size) break;
+		length = dedupe_next_block(ctx, buf + pos, size - pos);
+		if (pos + length >= size) break;
+		pos += length;
+		cuts[n++] = pos;
+		if (pos >= end) {
+			*ncuts = n;
+			return (0);
+		}
+	}
+	*ncuts = n;
+	return (1);
+}
+
+/*
+ * Called by the writer when decompressed data has been written to the output
+ * file. Wakes up recovery of chunks that reference it. The data is kept in
+ * the output ring if there is one. Only the writer adds to the ring, and a
+ * chunk only references the window before its own start, so the part being
+ * overwritten is never needed by a chunk still being recovered.
+ */
+void
+dedupe_durable_advance(uchar_t *buf, uint64_t len)
+{
+	if (out_ring && buf) {
+		uint64_t pos, n, l;
+
+		l = len;
+		if (l > out_ring_sz) {
+			buf += l - out_ring_sz;
+			l = out_ring_sz;
+		}
+		pos = (durable_off + len - l) % out_ring_sz;
+		while (l > 0) {
+			n = out_ring_sz - pos;
+			if (n > l)
+				n = l;
+			memcpy(out_ring + pos, buf, n);
+			buf += n;
+			l -= n;
+			pos = 0;
+		}
+	}
+	pthread_mutex_lock(&restore_lock);
+	__atomic_store_n(&durable_off, durable_off + len, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&restore_cv);
+	pthread_mutex_unlock(&restore_lock);
+}
+
+/*
+ * Fail any chunk recovery waiting for output that will not be written.
+ */
+void
+dedupe_durable_abort(void)
+{
+	pthread_mutex_lock(&restore_lock);
+	durable_abort = 1;
+	pthread_cond_broadcast(&restore_cv);
+	pthread_mutex_unlock(&restore_lock);
+}
+
+static int
+dedupe_wait_durable(uint64_t end)
+{
+	int rv;
+
+	if (__atomic_load_n(&durable_off, __ATOMIC_ACQUIRE) >= end)
+		return (0);
+	pthread_mutex_lock(&restore_lock);
+	while (durable_off < end && !durable_abort)
+		pthread_cond_wait(&restore_cv, &restore_lock);
+	rv = (durable_off >= end ? 0 : -1);
+	pthread_mutex_unlock(&restore_lock);
+	return (rv);
+}
+
+/*
+ * Get the mapping of one extent of the output file. Mapped extents are looked
+ * up without locking and only set up under the lock. An extent may reach past
+ * the end of the file, but only data that has been written is ever read.
+ */
+static uchar_t *
+dedupe_map_extent(dedupe_context_t *ctx, uint64_t ext)
+{
+	uchar_t **l2, *m;
+
+	if (ext >= MAP_L1_SZ * MAP_L2_SZ)
+		return (NULL);
+	m = NULL;
+	l2 = __atomic_load_n(&map_l1[ext / MAP_L2_SZ], __ATOMIC_ACQUIRE);
+	if (l2)
+		m = __atomic_load_n(&l2[ext % MAP_L2_SZ], __ATOMIC_ACQUIRE);
+	if (m == NULL) {
+		pthread_mutex_lock(&restore_lock);
+		if ((l2 = map_l1[ext / MAP_L2_SZ]) == NULL) {
+			l2 = (uchar_t **)calloc(MAP_L2_SZ, sizeof (uchar_t *));
+			__atomic_store_n(&map_l1[ext / MAP_L2_SZ], l2, __ATOMIC_RELEASE);
+		}
+		if (l2 && (m = l2[ext % MAP_L2_SZ]) == NULL) {
+			m = mmap(NULL, MAP_EXTENT, PROT_READ, MAP_SHARED, ctx->out_fd,
+			    ext << MAP_EXTENT_SHIFT);
+			if (m == MAP_FAILED)
+				m = NULL;
+			else
+				__atomic_store_n(&l2[ext % MAP_L2_SZ], m, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&restore_lock);
+	}
+	return (m);
+}
+
+/*
+ * Copy len bytes at offset pos of the output file via the extent mappings.
+ */
+static int
+dedupe_map_copy(dedupe_context_t *ctx, uchar_t *dst, uint64_t pos, uint64_t len)
+{
+	uchar_t *m;
+	uint64_t eoff, n;
+
+	while (len > 0) {
+		eoff = pos & (MAP_EXTENT - 1);
+		if ((m = dedupe_map_extent(ctx, pos >> MAP_EXTENT_SHIFT)) == NULL)
+			return (-1);
+		n = MAP_EXTENT - eoff;
+		if (n > len)
+			n = len;
+		memcpy(dst, m + eoff, n);
+		dst += n;
+		pos += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Read planning for the references of one chunk to earlier output. Taken in
+ * index order the references are scattered reads that fault in the output a
+ * page at a time. Instead they are gathered up front, sorted by offset, runs
+ * closer than PLAN_GAP merged, and readahead started on the extent mappings
+ * for all of them at once so that the copies find the data in memory. Since
+ * chunks are recovered in parallel ahead of the writer, this overlaps the
+ * reads of upcoming chunks with the writing of earlier ones. Only output
+ * that has already been written is planned.
+ */
+#define	PLAN_GAP	(128 * 1024)
+#define	PLAN_MIN_REFS	4
+
+struct plan_ref {
+	uint64_t pos, len;
+};
+
+static int
+plan_ref_cmp(const void *a, const void *b)
+{
+	const struct plan_ref *x = (const struct plan_ref *)a;
+	const struct plan_ref *y = (const struct plan_ref *)b;
+
+	return (x->pos < y->pos ? -1 : (x->pos > y->pos));
+}
+
+static void
+dedupe_map_advise(dedupe_context_t *ctx, uint64_t pos, uint64_t len)
+{
+	uint64_t eoff, n, pg;
+	uchar_t *m;
+
+	pg = sysconf(_SC_PAGESIZE);
+	while (len > 0) {
+		eoff = pos & (MAP_EXTENT - 1);
+		n = MAP_EXTENT - eoff;
+		if (n > len)
+			n = len;
+		if ((m = dedupe_map_extent(ctx, pos >> MAP_EXTENT_SHIFT)) == NULL)
+			return;
+		(void) madvise(m + (eoff & ~(pg - 1)), n + (eoff & (pg - 1)), MADV_WILLNEED);
+		pos += n;
+		len -= n;
+	}
+}
+
+static void
+dedupe_plan_reads(dedupe_context_t *ctx, uchar_t *idx, uint32_t blknum, uint64_t offset)
+{
+	struct plan_ref *refs;
+	uint64_t pos, durable, end;
+	uint32_t blk, len, nrefs, i, j;
+
+	durable = __atomic_load_n(&durable_off, __ATOMIC_ACQUIRE);
+	refs = NULL;
+	nrefs = 0;
+	for (blk = 0; blk < blknum;) {
+		len = LE32(U32_P(idx));
+		idx += RABIN_ENTRY_SIZE;
+		blk++;
+		if (!(len & RABIN_INDEX_FLAG))
+			continue;
+		len &= RABIN_INDEX_VALUE;
+		pos = LE64(U64_P(idx));
+		idx += (RABIN_ENTRY_SIZE * 2);
+		blk += 2;
+		if ((pos & GLOBAL_BASE_REF) || pos >= offset || pos + len > durable)
+			continue;
+		if (refs == NULL) {
+			refs = (struct plan_ref *)malloc((blknum / 3 + 1) * sizeof (struct plan_ref));
+			if (refs == NULL)
+				return;
+		}
+		refs[nrefs].pos = pos;
+		refs[nrefs].len = len;
+		nrefs++;
+	}
+	if (nrefs < PLAN_MIN_REFS) {
+		free(refs);
+		return;
+	}
+
+	qsort(refs, nrefs, sizeof (struct plan_ref), plan_ref_cmp);
+	for (i = 0; i < nrefs; i = j) {
+		pos = refs[i].pos;
+		end = pos + refs[i].len;
+		for (j = i + 1; j < nrefs && refs[j].pos <= end + PLAN_GAP; j++) {
+			if (refs[j].pos + refs[j].len > end)
+				end = refs[j].pos + refs[j].len;
+		}
+		dedupe_map_advise(ctx, pos, end - pos);
+	}
+	free(refs);
+}
+
+/*
+ * Copy len bytes at offset pos of the output from the output ring. The chunk
+ * at offset off may only reference the window before it.
+ */
+static int
+dedupe_ring_copy(uchar_t *dst, uint64_t pos, uint64_t len, uint64_t off)
+{
+	uint64_t rpos, n;
+
+	if (pos + out_ring_sz < off || len > out_ring_sz)
+		return (-1);
+	rpos = pos % out_ring_sz;
+	while (len > 0) {
+		n = out_ring_sz - rpos;
+		if (n > len)
+			n = len;
+		memcpy(dst, out_ring + rpos, n);
+		dst += n;
+		len -= n;
+		rpos = 0;
+	}
+	return (0);
+}
+
+/*
+ * Resolve references from an in-memory window of size bytes of the output
+ * instead of the output file. Called before the decompression contexts are
+ * created.
+ */
+void
+dedupe_restore_window(uint64_t size)
+{
+	out_ring_sz = size;
+}
+
+/*
+ * Size in chunks of the dedupe window, if the index has one.
+ */
+int
+dedupe_index_window(void)
+{
+	return (index_window);
+}
+
+/*
+ * Map the base file given by PCOMPRESS_GLOBAL_BASE, if any.
+ */
+static int
+dedupe_base_map(void)
+{
+	struct stat sbuf;
+	char *path;
+	int fd;
+
+	if ((path = getenv("PCOMPRESS_GLOBAL_BASE")) == NULL)
+		return (0);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open base file %s ", path);
+		return (-1);
+	}
+	if (fstat(fd, &sbuf) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot stat base file %s ", path);
+		close(fd);
+		return (-1);
+	}
+	base_len = sbuf.st_size;
+	if (base_len > 0) {
+		base_map = mmap(NULL, base_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (base_map == MAP_FAILED) {
+			log_msg(LOG_ERR, 1, "Cannot map base file %s ", path);
+			base_map = NULL;
+			close(fd);
+			return (-1);
+		}
+	}
+	close(fd);
+	return (0);
+}
+
+static void
+dedupe_restore_cleanup(void)
+{
+	int i, j;
+
+	for (i = 0; i < MAP_L1_SZ; i++) {
+		if (map_l1[i] == NULL)
+			continue;
+		for (j = 0; j < MAP_L2_SZ; j++) {
+			if (map_l1[i][j])
+				munmap(map_l1[i][j], MAP_EXTENT);
+		}
+		free(map_l1[i]);
+		map_l1[i] = NULL;
+	}
+	if (base_map)
+		munmap(base_map, base_len);
+	base_map = NULL;
+	base_len = 0;
+	if (out_ring)
+		slab_free(NULL, out_ring);
+	out_ring = NULL;
+	out_ring_sz = 0;
+}
+
+/*
+ * Delta encode a similar block with the selected engine. Returns the patch
+ * length or 0 if the block is not worth delta encoding.
+ */
+static bsize_t
+dedupe_delta(dedupe_context_t *ctx, uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf,
+	     bsize_t newsize, uchar_t *diff, uchar_t *scratch, bsize_t scratchsize)
+{
+	bsize_t hsz, bsz;
+
+	if (ctx->delta_engine == DELTA_ENGINE_BSDIFF)
+		return (bsdiff(oldbuf, oldsize, newbuf, newsize, diff, scratch, scratchsize));
+
+	hsz = hdelta(oldbuf, oldsize, newbuf, newsize, diff, newsize);
+	if (ctx->delta_engine == DELTA_ENGINE_FAST || (hsz > 0 && hsz <= newsize / 4))
+		return (hsz);
+
+	/*
+	 * Both patches go to the same place so the hash delta has to be redone
+	 * if bsdiff does worse.
+	 */
+	bsz = bsdiff(oldbuf, oldsize, newbuf, newsize, diff, scratch, scratchsize);
+	if (hsz > 0 && (bsz == 0 || bsz > hsz))
+		bsz = hdelta(oldbuf, oldsize, newbuf, newsize, diff, newsize);
+	return (bsz);
+}
+
+static bsize_t
+dedupe_delta_sz(uchar_t *pbuf)
+{
+	if (is_hdelta(pbuf))
+		return (get_hdelta_sz(pbuf));
+	return (get_bsdiff_sz(pbuf));
+}
+
+static int
+dedupe_patch(uchar_t *pbuf, uchar_t *oldbuf, bsize_t oldsize, uchar_t *newbuf, bsize_t *newsize)
+{
+	if (is_hdelta(pbuf))
+		return (hpatch(pbuf, oldbuf, oldsize, newbuf, newsize));
+	return (bspatch(pbuf, oldbuf, oldsize, newbuf, newsize));
+}
+
+/*
+ * Number of preceding chunks visible to a windowed Global Dedupe index, 0 if the
+ * full index is used and -1 if PCOMPRESS_DEDUPE_WINDOW is invalid. In pipe mode
+ * a window of DEDUPE_PIPE_WINDOW bytes is used by default, so that neither
+ * compression nor decompression need temporary files. A window of 0 selects
+ * the full index.
+ */
+static int
+dedupe_window_chunks(int pipe_mode, uint64_t chunksize)
+{
+	char *val, *end;
+	long n;
+
+	if ((val = getenv("PCOMPRESS_DEDUPE_WINDOW")) == NULL) {
+		if (!pipe_mode)
+			return (0);
+		n = (chunksize > 0 ? DEDUPE_PIPE_WINDOW / chunksize : 1);
+		if (n < 1) n = 1;
+		if (n > DEDUPE_WINDOW_MAX) n = DEDUPE_WINDOW_MAX;
+		return ((int)n);
+	}
+	n = strtol(val, &end, 10);
+	if (*val == '\0' || *end != '\0' || n < 0 || n > DEDUPE_WINDOW_MAX) {
+		log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_DEDUPE_WINDOW. Must be 0 - %d chunks.\n",
+		    DEDUPE_WINDOW_MAX);
+		return (-1);
+	}
+	return ((int)n);
+}
+
+/*
+ * Number of chunks in a restore group, 0 if not used and -1 if
+ * PCOMPRESS_RESTORE_GROUP is invalid.
+ */
+static int
+dedupe_group_chunks(void)
+{
+	char *val, *end;
+	long n;
+
+	if ((val = getenv("PCOMPRESS_RESTORE_GROUP")) == NULL)
+		return (0);
+	n = strtol(val, &end, 10);
+	if (*val == '\0' || *end != '\0' || n < 1 || n > 1024) {
+		log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_RESTORE_GROUP. Must be 1 - 1024 chunks.\n");
+		return (-1);
+	}
+	return ((int)n);
+}
+
+/*
+ * Return 1 if the chunk of len bytes at offset starts a restore group.
+ */
+int
+dedupe_restore_group_start(uint64_t offset, uint64_t len)
+{
+	if (restore_group_sz == 0)
+		return (0);
+	return (offset % restore_group_sz == 0 ||
+	    offset / restore_group_sz != (offset + len - 1) / restore_group_sz);
+}
+
+/*
+ * Lowest stream offset the chunk of len bytes at offset may reference.
+ */
+static uint64_t
+dedupe_group_floor(uint64_t offset, uint64_t len)
+{
+	if (restore_group_sz == 0)
+		return (0);
+	if (dedupe_restore_group_start(offset, len))
+		return (offset);
+	return (offset - offset % restore_group_sz);
+}
+
 /*
  * Helper function to let caller size the the user specific compression chunk/segment
  * to align with deduplication requirements.
@@ -149,6 +985,13 @@ global_dedupe_bufadjust(uint32_t rab_blk_sz, uint64_t *user_chunk_sz, int pct_in
 	uint32_t hash_slots;
 
 	rv = 0;
+
+	/*
+	 * A windowed index is always simple and small, so the chunk size is left
+	 * as it is.
+	 */
+	if (dedupe_window_chunks(pipe_mode, *user_chunk_sz) != 0 || dedupe_group_chunks() != 0)
+		return (rv);
 	pct_i = pct_interval;
 	if (pipe_mode && pct_i == 0)
 		pct_i = DEFAULT_PCT_INTERVAL;
@@ -168,10 +1011,50 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
     int pipe_mode, int nthreads, size_t freeram) {
 	dedupe_context_t *ctx;
 	uint32_t i;
+	int chunker, window, group, delta_engine, shared;
+	char *cenv;
 
 	if (rab_blk_sz < 0 || rab_blk_sz > 5)
 		rab_blk_sz = RAB_BLK_DEFAULT;
 
+	chunker = RABIN_CHUNKER_RABIN;
+	if ((cenv = getenv("PCOMPRESS_CHUNKER")) != NULL) {
+		if (strcmp(cenv, "GEAR") == 0) {
+			chunker = RABIN_CHUNKER_GEAR;
+		} else if (strcmp(cenv, "RABIN") != 0) {
+			log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_CHUNKER. Must be RABIN or GEAR.\n");
+			return (NULL);
+		}
+	}
+
+	delta_engine = DELTA_ENGINE_BSDIFF;
+	if ((cenv = getenv("PCOMPRESS_DELTA")) != NULL) {
+		if (strcmp(cenv, "FAST") == 0) {
+			delta_engine = DELTA_ENGINE_FAST;
+		} else if (strcmp(cenv, "AUTO") == 0) {
+			delta_engine = DELTA_ENGINE_AUTO;
+		} else if (strcmp(cenv, "BSDIFF") != 0) {
+			log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_DELTA. Must be BSDIFF, FAST or AUTO.\n");
+			return (NULL);
+		}
+	}
+
+	window = 0;
+	group = 0;
+	if (dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == COMPRESS) {
+		if ((window = dedupe_window_chunks(pipe_mode, chunksize)) < 0)
+			return (NULL);
+		if ((group = dedupe_group_chunks()) < 0)
+			return (NULL);
+
+		/*
+		 * Nothing before the group is referenced so the windowed index
+		 * need not be larger than a group.
+		 */
+		if (group > 0 && (window == 0 || window > group))
+			window = group;
+	}
+
 	if (dedupe_flag == RABIN_DEDUPE_FIXED || dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL) {
 		delta_flag = 0;
 		if (dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)
@@ -206,47 +1089,149 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 			}
 			ir[j] = val;
 		}
+		inited = 1;
+	}
+	if (!gear_inited && chunker == RABIN_CHUNKER_GEAR) {
+		gear_init();
+		gear_inited = 1;
+	}
 
-		/*
-		 * If Global Deduplication is enabled initialize the in-memory index.
-		 * It is essentially a hashtable that is used for crypto-hash based
-		 * chunk matching.
-		 */
-		if (dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == COMPRESS && rab_blk_sz >= 0) {
-			int pct_interval, chunk_cksum, cksum_bytes, mac_bytes;
-			char *ck;
-
-			pct_interval = 0;
-			if (pipe_mode)
-				pct_interval = DEFAULT_PCT_INTERVAL;
-
-			chunk_cksum = 0;
-			if ((ck = getenv("PCOMPRESS_CHUNK_HASH_GLOBAL")) != NULL) {
-				if (get_checksum_props(ck, &chunk_cksum, &cksum_bytes, &mac_bytes, 1) != 0 ||
-				    strcmp(ck, "CRC64") == 0) {
-					log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_CHUNK_HASH_GLOBAL.\n");
-					chunk_cksum = DEFAULT_CHUNK_CKSUM;
-					pthread_mutex_unlock(&init_lock);
-					return (NULL);
-				}
-			}
-			if (chunk_cksum == 0) {
+	/*
+	 * If Global Deduplication is enabled initialize the in-memory index.
+	 * It is essentially a hashtable that is used for crypto-hash based
+	 * chunk matching. The index is shared by all contexts of one file and
+	 * released with them, so a later file sets up a fresh one.
+	 */
+	if (arc == NULL && dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == COMPRESS &&
+	    rab_blk_sz >= 0) {
+		int pct_interval, chunk_cksum, cksum_bytes, mac_bytes;
+		char *ck;
+
+		pct_interval = 0;
+		if (pipe_mode)
+			pct_interval = DEFAULT_PCT_INTERVAL;
+
+		chunk_cksum = 0;
+		if ((ck = getenv("PCOMPRESS_CHUNK_HASH_GLOBAL")) != NULL) {
+			if (get_checksum_props(ck, &chunk_cksum, &cksum_bytes, &mac_bytes, 1) != 0 ||
+			    cksum_bytes < 16) {
+				log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_CHUNK_HASH_GLOBAL.\n");
 				chunk_cksum = DEFAULT_CHUNK_CKSUM;
-				if (get_checksum_props(NULL, &chunk_cksum, &cksum_bytes, &mac_bytes, 0) != 0) {
-					log_msg(LOG_ERR, 0, "Invalid default chunk checksum: %d\n", DEFAULT_CHUNK_CKSUM);
-					pthread_mutex_unlock(&init_lock);
-					return (NULL);
-				}
+				pthread_mutex_unlock(&init_lock);
+				return (NULL);
+			}
+		}
+		if (chunk_cksum == 0) {
+			chunk_cksum = DEFAULT_CHUNK_CKSUM;
+			if (get_checksum_props(NULL, &chunk_cksum, &cksum_bytes, &mac_bytes, 0) != 0) {
+				log_msg(LOG_ERR, 0, "Invalid default chunk checksum: %d\n", DEFAULT_CHUNK_CKSUM);
+				pthread_mutex_unlock(&init_lock);
+				return (NULL);
 			}
+		}
+		/*
+		 * With a dedupe window the index only covers the last few chunks. It
+		 * stays small, needs no segment cache and threads can use it in any
+		 * order, see dedupe_compress().
+		 */
+		if (window > 0) {
+			arc = init_window_db_s(rab_blk_sz, chunksize, algo, chunk_cksum,
+					      (uint64_t)window * chunksize, freeram, nthreads);
+		} else {
 			arc = init_global_db_s(NULL, tmppath, rab_blk_sz, chunksize, pct_interval,
 					      algo, chunk_cksum, GLOBAL_SIM_CKSUM, file_size,
 					      freeram, nthreads);
-			if (arc == NULL) {
+		}
+		if (arc == NULL) {
+			pthread_mutex_unlock(&init_lock);
+			return (NULL);
+		}
+		index_window = window;
+		restore_group_sz = (uint64_t)group * chunksize;
+
+		/*
+		 * Blocks of the previous run are looked up in its persistent index
+		 * and this run's blocks replace it once compression is done. Only
+		 * the simple index holds all block hashes. A shared index is only
+		 * looked up, so that many hosts can reference one common base.
+		 */
+		base_index = NULL;
+		shared = 0;
+		if ((cenv = getenv("PCOMPRESS_GLOBAL_INDEX")) == NULL) {
+			cenv = getenv("PCOMPRESS_GLOBAL_INDEX_SHARED");
+			shared = 1;
+		}
+		if (cenv != NULL) {
+			if (window > 0 || arc->pct_interval != 0) {
+				log_msg(LOG_WARN, 0, "PCOMPRESS_GLOBAL_INDEX%s needs the simple "
+				    "Global Dedupe index. Ignored.\n", shared ? "_SHARED":"");
+			} else if (db_base_open_s(arc, cenv) == -1) {
+				log_msg(LOG_WARN, 0, "Not using base index %s\n", cenv);
+			} else if (shared && !db_base_mapped_s(arc)) {
+				log_msg(LOG_WARN, 0, "Shared base index %s not found\n", cenv);
+			}
+			if (!shared)
+				base_index = cenv;
+		}
+
+		/*
+		 * Without a persistent index a base file given for compression is
+		 * indexed directly.
+		 */
+		base_build = 0;
+		if (cenv == NULL && getenv("PCOMPRESS_GLOBAL_BASE") != NULL) {
+			if (window > 0 || arc->pct_interval != 0) {
+				log_msg(LOG_WARN, 0, "PCOMPRESS_GLOBAL_BASE needs the simple "
+				    "Global Dedupe index. Ignored.\n");
+			} else {
+				base_build = 1;
+			}
+		}
+
+		/*
+		 * The long range match table has a slot per expected anchor of the
+		 * input, within limits. The input file is set later on, see
+		 * dedupe_long_match_source().
+		 */
+		ldm_fd = -1;
+		if ((cenv = getenv("PCOMPRESS_LONG_MATCH")) != NULL && atoi(cenv) > 0) {
+			if (pipe_mode) {
+				log_msg(LOG_WARN, 0, "PCOMPRESS_LONG_MATCH needs a regular "
+				    "input file. Ignored.\n");
+			} else {
+				ldm_bits = LDM_TAB_MIN_BITS;
+				while (ldm_bits < LDM_TAB_MAX_BITS &&
+				    (1ULL << ldm_bits) < (file_size >> LDM_ANCHOR_BITS))
+					ldm_bits++;
+				ldm_tab = (uint64_t *)slab_calloc(NULL, 1ULL << ldm_bits,
+				    sizeof (uint64_t));
+				if (ldm_tab == NULL)
+					log_msg(LOG_WARN, 0, "Out of memory. Long range "
+					    "matching disabled.\n");
+				if (!gear_inited) {
+					gear_init();
+					gear_inited = 1;
+				}
+			}
+		}
+	}
+	if (dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == DECOMPRESS && !restore_inited) {
+		durable_off = 0;
+		durable_abort = 0;
+		if (dedupe_base_map() == -1) {
+			pthread_mutex_unlock(&init_lock);
+			return (NULL);
+		}
+		if (out_ring_sz > 0) {
+			out_ring = (uchar_t *)slab_alloc(NULL, out_ring_sz);
+			if (out_ring == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory for the dedupe window.\n");
+				out_ring_sz = 0;
 				pthread_mutex_unlock(&init_lock);
 				return (NULL);
 			}
 		}
-		inited = 1;
+		restore_inited = 1;
 	}
 	pthread_mutex_unlock(&init_lock);
 
@@ -280,27 +1265,54 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	ctx = (dedupe_context_t *)slab_alloc(NULL, sizeof (dedupe_context_t));
 	ctx->rabin_poly_max_block_size = RAB_POLYNOMIAL_MAX_BLOCK_SIZE;
 	ctx->arc = arc;
+	ctx->group_floor = 0;
 
-	ctx->current_window_data = NULL;
 	ctx->dedupe_flag = dedupe_flag;
 	ctx->rabin_break_patt = 0;
 	ctx->rabin_poly_avg_block_size = RAB_BLK_AVG_SZ(rab_blk_sz);
+
+	/*
+	 * Fixed blocks that are all zero are not hashed. They get the hash of a
+	 * zero block computed here.
+	 */
+	ctx->zero_blocks = 0;
+	if (dedupe_flag == RABIN_DEDUPE_FIXED && op == COMPRESS) {
+		uchar_t *zb = calloc(1, ctx->rabin_poly_avg_block_size);
+
+		if (zb != NULL) {
+			ctx->zero_hash = XXH32(zb, ctx->rabin_poly_avg_block_size, 0);
+			ctx->zero_blocks = 1;
+			free(zb);
+		}
+	}
 	ctx->rabin_avg_block_mask = RAB_BLK_MASK;
+	ctx->chunker = chunker;
+	ctx->gear_mask_s = gear_mask(RAB_BLK_MIN_BITS - 1 + GEAR_NC_LEVEL);
+	ctx->gear_mask_l = gear_mask(RAB_BLK_MIN_BITS - 1 - GEAR_NC_LEVEL);
 	ctx->rabin_poly_min_block_size = dedupe_min_blksz(rab_blk_sz);
 	ctx->delta_flag = 0;
 	ctx->deltac_min_distance = props->deltac_min_distance;
+	ctx->delta_engine = delta_engine;
+	ctx->reorder = (op == COMPRESS && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL &&
+	    (cenv = getenv("PCOMPRESS_DEDUPE_REORDER")) != NULL && atoi(cenv) > 0);
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->similarity_cksums = NULL;
+	ctx->sketch_len = NULL;
+	ctx->scan_cuts = NULL;
 	ctx->show_chunks = 0;
+	ctx->stats = NULL;
 	if (arc) {
 		arc->pagesize = ctx->pagesize;
 		if (rab_blk_sz < 3)
 			ctx->rabin_poly_max_block_size = RAB_POLY_MAX_BLOCK_SIZE_GLOBAL;
 	}
+	ctx->next_block = dedupe_scan_select(ctx, rab_blk_sz);
 
 	/*
 	 * Scale down similarity percentage based on avg block size unless user specified
 	 * argument '-EE' in which case fixed 40% match is used for Delta compression.
+	 * The required similarity is set by the number of min-hash features that make
+	 * up a sketch.
 	 */
 	if (delta_flag == DELTA_NORMAL) {
 		if (ctx->rabin_poly_avg_block_size < (1 << 14)) {
@@ -313,160 +1325,1034 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	} else if (delta_flag == DELTA_EXTRA) {
 		ctx->delta_flag = 2;
 	}
+	ctx->sketch_features = SKETCH_FEATURES + 1 - ctx->delta_flag;
+
+	if (dedupe_flag != RABIN_DEDUPE_FIXED)
+		ctx->blknum = chunksize / ctx->rabin_poly_min_block_size;
+	else
+		ctx->blknum = chunksize / ctx->rabin_poly_avg_block_size;
+
+	if (chunksize % ctx->rabin_poly_min_block_size)
+		++(ctx->blknum);
+
+	if (ctx->blknum > RABIN_MAX_BLOCKS) {
+		log_msg(LOG_ERR, 0, "Chunk size too large for dedup.\n");
+		destroy_dedupe_context(ctx);
+		return (NULL);
+	}
+	memset(&ctx->blocks, 0, sizeof (ctx->blocks));
+	if (real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL) {
+		ctx->blocks.offset = (uint64_t *)slab_alloc(NULL, ctx->blknum * sizeof (uint64_t));
+		ctx->blocks.length = (uint32_t *)slab_alloc(NULL, ctx->blknum * sizeof (uint32_t));
+		ctx->blocks.hash = (uint32_t *)slab_alloc(NULL, ctx->blknum * sizeof (uint32_t));
+		/*
+		 * Without delta compression or reordering the similarity hash is
+		 * the block hash, so no separate array is kept.
+		 */
+		if (ctx->delta_flag || ctx->reorder) {
+			ctx->blocks.similarity_hash = (uint32_t *)slab_alloc(NULL,
+			    ctx->blknum * sizeof (uint32_t));
+		} else {
+			ctx->blocks.similarity_hash = ctx->blocks.hash;
+		}
+		ctx->blocks.index = (uint32_t *)slab_alloc(NULL, ctx->blknum * sizeof (uint32_t));
+		ctx->blocks.other = (uint32_t *)slab_alloc(NULL, ctx->blknum * sizeof (uint32_t));
+		ctx->blocks.similar = (uchar_t *)slab_alloc(NULL, ctx->blknum);
+	}
+	if(ctx == NULL ||
+	    ((ctx->blocks.offset == NULL || ctx->blocks.length == NULL ||
+	    ctx->blocks.hash == NULL || ctx->blocks.similarity_hash == NULL ||
+	    ctx->blocks.index == NULL || ctx->blocks.other == NULL ||
+	    ctx->blocks.similar == NULL) &&
+	    real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)) {
+		log_msg(LOG_ERR, 0,
+		    "Could not allocate rabin polynomial context, out of memory\n");
+		destroy_dedupe_context(ctx);
+		return (NULL);
+	}
+
+	if (arc && dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL) {
+		uint32_t nsegs = ctx->blknum / arc->segment_sz + 1;
+
+		ctx->similarity_cksums = (uchar_t *)slab_calloc(NULL,
+					(uint64_t)arc->sub_intervals * nsegs,
+					arc->similarity_cksum_sz);
+		ctx->sketch_len = (uint32_t *)slab_calloc(NULL, nsegs, sizeof (uint32_t));
+		if (!ctx->similarity_cksums || !ctx->sketch_len) {
+			log_msg(LOG_ERR, 0,
+			    "Could not allocate dedupe context, out of memory\n");
+			destroy_dedupe_context(ctx);
+			return (NULL);
+		}
+	}
+
+	ctx->lzma_data = NULL;
+	ctx->level = 14;
+	if (real_chunksize > 0) {
+		lzma_init(&(ctx->lzma_data), &(ctx->level), 1, chunksize, file_version, op);
+
+		// The lzma_data member holds per-thread encoder and decoder state
+		if (!(ctx->lzma_data)) {
+			log_msg(LOG_ERR, 0,
+			    "Could not initialize LZMA data for dedupe index, out of memory\n");
+			destroy_dedupe_context(ctx);
+			return (NULL);
+		}
+	}
+
+	ctx->real_chunksize = real_chunksize;
+	reset_dedupe_context(ctx);
+
+	pthread_mutex_lock(&init_lock);
+	if (base_build) {
+		base_build = 0;
+		if (dedupe_base_build(ctx) == -1) {
+			pthread_mutex_unlock(&init_lock);
+			destroy_dedupe_context(ctx);
+			return (NULL);
+		}
+	}
+	pthread_mutex_unlock(&init_lock);
+	return (ctx);
+}
+
+void
+reset_dedupe_context(dedupe_context_t *ctx)
+{
+	ctx->valid = 0;
+}
+
+void
+destroy_dedupe_context(dedupe_context_t *ctx)
+{
+	if (ctx) {
+		pthread_mutex_lock(&init_lock);
+		if (arc) {
+			destroy_global_db_s(arc);
+		}
+		arc = NULL;
+		index_window = 0;
+		restore_group_sz = 0;
+		if (ldm_tab)
+			slab_free(NULL, ldm_tab);
+		ldm_tab = NULL;
+		ldm_fd = -1;
+		if (base_map && !restore_inited) {
+			munmap(base_map, base_len);
+			base_map = NULL;
+			base_len = 0;
+		}
+		if (restore_inited) {
+			dedupe_restore_cleanup();
+			restore_inited = 0;
+		}
+		pthread_mutex_unlock(&init_lock);
+
+		if (ctx->blocks.offset) slab_free(NULL, ctx->blocks.offset);
+		if (ctx->blocks.length) slab_free(NULL, ctx->blocks.length);
+		if (ctx->blocks.hash) slab_free(NULL, ctx->blocks.hash);
+		if (ctx->blocks.similarity_hash &&
+		    ctx->blocks.similarity_hash != ctx->blocks.hash)
+			slab_free(NULL, ctx->blocks.similarity_hash);
+		if (ctx->blocks.index) slab_free(NULL, ctx->blocks.index);
+		if (ctx->blocks.other) slab_free(NULL, ctx->blocks.other);
+		if (ctx->blocks.similar) slab_free(NULL, ctx->blocks.similar);
+		if (ctx->similarity_cksums) slab_free(NULL, ctx->similarity_cksums);
+		if (ctx->sketch_len) slab_free(NULL, ctx->sketch_len);
+		if (ctx->scan_cuts) slab_free(NULL, ctx->scan_cuts);
+		if (ctx->lzma_data) lzma_deinit(&(ctx->lzma_data));
+		slab_free(NULL, ctx);
+	}
+}
+
+/*
+ * Simple insertion sort of integers. Used for sorting a small number of items to
+ * avoid overheads of qsort() with callback function.
+ */
+static void
+isort_uint64(uint64_t *ary, uint32_t nitems)
+{
+	uint32_t i, j, k;
+	uint64_t tmp;
+
+	for (i = 1 ; i < nitems; i++) {
+		for (j = 0 ; j < i ; j++) {
+			if (ary[j] > ary[i]) {
+				tmp = ary[j] ;
+				ary[j] = ary[i] ;
+
+				for (k = i ; k > j ; k--)
+					ary[k] = ary[k - 1] ;
+
+				ary[k + 1] = tmp ;
+			}
+		}
+	}
+}
+
+/*
+ * K min values sketch of a segment: the k smallest distinct non-zero 64-bit
+ * words of the block hashes, in ascending order. They are kept in a small
+ * sorted array. Once it is full nearly every word fails the comparison
+ * with the largest kept value, so this is close to a single pass over the
+ * hashes, where sorting all of them took O(n log n).
+ */
+static uint32_t
+segment_sketch(global_blockentry_t *blocks, uint32_t nblks, int cksum_sz,
+    uint64_t *sketch, uint32_t k)
+{
+	uint32_t n, j, p;
+	uint64_t v;
+	int w;
+
+	n = 0;
+	for (j = 0; j < nblks; j++) {
+		for (w = 0; w + 8 <= cksum_sz; w += 8) {
+			v = U64_P(blocks[j].cksum + w);
+			if (v == 0 || (n == k && v >= sketch[k - 1]))
+				continue;
+			p = n;
+			while (p > 0 && sketch[p - 1] > v)
+				p--;
+			if (p > 0 && sketch[p - 1] == v)
+				continue;
+			if (n < k)
+				n++;
+			memmove(sketch + p + 1, sketch + p, (n - 1 - p) * sizeof (uint64_t));
+			sketch[p] = v;
+		}
+	}
+	return (n);
+}
+
+static inline int
+ckcmp(uchar_t *a, uchar_t *b, int sz)
+{
+	size_t *v1 = (size_t *)a;
+	size_t *v2 = (size_t *)b;
+	int len;
+
+	len = 0;
+	do {
+		if (*v1 != *v2) {
+			return (1);
+		}
+		++v1;
+		++v2;
+		len += sizeof (size_t);
+	} while (len < sz);
+
+	return (0);
+}
+
+/*
+ * Record a variable length block found by the chunker.
+ */
+static void
+dedupe_add_block(dedupe_context_t *ctx, uint32_t blknum, uint64_t last_offset, uint32_t length)
+{
+	if (!(ctx->arc)) {
+		ctx->blocks.offset[blknum] = last_offset;
+		ctx->blocks.index[blknum] = blknum;
+		ctx->blocks.length[blknum] = length;
+	} else {
+		ctx->g_blocks[blknum].length = length;
+		ctx->g_blocks[blknum].offset = last_offset;
+	}
+	if (ctx->show_chunks) {
+		fprintf(stderr, "Block offset: %" PRIu64 ", length: %u\n", last_offset, length);
+	}
+}
+
+/*
+ * Check for a block of zero bytes, the unallocated space of disk and VM
+ * images. Words are ORed together 64 bytes at a time and tested once per
+ * step, so the loop runs at memory speed.
+ */
+static int
+dedupe_zero_block(uchar_t *buf, uint32_t len)
+{
+	uint32_t i, n;
+
+	n = len & ~63U;
+#if defined(__x86_64__)
+	for (i = 0; i < n; i += 64) {
+		__m128i acc;
+
+		acc = _mm_or_si128(_mm_loadu_si128((__m128i *)(buf + i)),
+		    _mm_loadu_si128((__m128i *)(buf + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((__m128i *)(buf + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((__m128i *)(buf + i + 48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+			return (0);
+	}
+#else
+	for (i = 0; i < n; i += 64) {
+		uint64_t *w = (uint64_t *)(buf + i);
+
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return (0);
+	}
+#endif
+	for (; i < len; i++) {
+		if (buf[i])
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Compute the similarity sketch of a block for Delta Compression. The block is
+ * viewed as a sequence of 32-bit words and every feature is the minimum of one
+ * linear transform (a * w + b) over all words. This is min-hashing with one
+ * independent hash per feature. The first nfeat features are folded into a
+ * single super-feature, so two blocks get the same sketch only if all of those
+ * minimums match. Fewer features make the test more lenient.
+ */
+static int sketch_sse4 = 0;
+static int sketch_neon = 0;
+
+void
+dedupe_module_init(processor_cap_t *pc)
+{
+	sketch_sse4 = (pc->sse_level >= 4);
+	sketch_neon = pc->neon_avail;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * With SSE4.1 four words are transformed at a time for each feature and the
+ * lanes are reduced at the end. The result is the same as the scalar loop.
+ * Returns the number of words done.
+ */
+static __attribute__((target("sse4.1"))) uint32_t
+dedupe_sketch_sse4(uchar_t *buf, uint32_t n, uint32_t *feat)
+{
+	__m128i m0, m1, m2, m3, x;
+	__m128i a0, a1, a2, a3, b0, b1, b2, b3;
+	uint32_t lanes[4];
+	uint32_t i, w;
+
+	m0 = m1 = m2 = m3 = _mm_set1_epi32(-1);
+	a0 = _mm_set1_epi32(sketch_mul[0]); b0 = _mm_set1_epi32(sketch_add[0]);
+	a1 = _mm_set1_epi32(sketch_mul[1]); b1 = _mm_set1_epi32(sketch_add[1]);
+	a2 = _mm_set1_epi32(sketch_mul[2]); b2 = _mm_set1_epi32(sketch_add[2]);
+	a3 = _mm_set1_epi32(sketch_mul[3]); b3 = _mm_set1_epi32(sketch_add[3]);
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = _mm_loadu_si128((__m128i *)(buf + i * sizeof (uint32_t)));
+		m0 = _mm_min_epu32(m0, _mm_add_epi32(_mm_mullo_epi32(x, a0), b0));
+		m1 = _mm_min_epu32(m1, _mm_add_epi32(_mm_mullo_epi32(x, a1), b1));
+		m2 = _mm_min_epu32(m2, _mm_add_epi32(_mm_mullo_epi32(x, a2), b2));
+		m3 = _mm_min_epu32(m3, _mm_add_epi32(_mm_mullo_epi32(x, a3), b3));
+	}
+#define	SKETCH_LANE_MIN(m, f) \
+	_mm_storeu_si128((__m128i *)lanes, m); \
+	for (w = 0; w < 4; w++) \
+		if (lanes[w] < feat[f]) feat[f] = lanes[w];
+	SKETCH_LANE_MIN(m0, 0);
+	SKETCH_LANE_MIN(m1, 1);
+	SKETCH_LANE_MIN(m2, 2);
+	SKETCH_LANE_MIN(m3, 3);
+#undef	SKETCH_LANE_MIN
+	return (i);
+}
+#elif defined(__aarch64__)
+/*
+ * The same on ARM64 with NEON, which has an unsigned minimum across lanes.
+ */
+static uint32_t
+dedupe_sketch_neon(uchar_t *buf, uint32_t n, uint32_t *feat)
+{
+	uint32x4_t m0, m1, m2, m3, x;
+	uint32x4_t a0, a1, a2, a3, b0, b1, b2, b3;
+	uint32_t i, v;
+
+	m0 = m1 = m2 = m3 = vdupq_n_u32(UINT32_MAX);
+	a0 = vdupq_n_u32(sketch_mul[0]); b0 = vdupq_n_u32(sketch_add[0]);
+	a1 = vdupq_n_u32(sketch_mul[1]); b1 = vdupq_n_u32(sketch_add[1]);
+	a2 = vdupq_n_u32(sketch_mul[2]); b2 = vdupq_n_u32(sketch_add[2]);
+	a3 = vdupq_n_u32(sketch_mul[3]); b3 = vdupq_n_u32(sketch_add[3]);
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = vreinterpretq_u32_u8(vld1q_u8(buf + i * sizeof (uint32_t)));
+		m0 = vminq_u32(m0, vmlaq_u32(b0, x, a0));
+		m1 = vminq_u32(m1, vmlaq_u32(b1, x, a1));
+		m2 = vminq_u32(m2, vmlaq_u32(b2, x, a2));
+		m3 = vminq_u32(m3, vmlaq_u32(b3, x, a3));
+	}
+#define	SKETCH_LANE_MIN(m, f) \
+	v = vminvq_u32(m); \
+	if (v < feat[f]) feat[f] = v;
+	SKETCH_LANE_MIN(m0, 0);
+	SKETCH_LANE_MIN(m1, 1);
+	SKETCH_LANE_MIN(m2, 2);
+	SKETCH_LANE_MIN(m3, 3);
+#undef	SKETCH_LANE_MIN
+	return (i);
+}
+#endif
+
+static uint32_t
+dedupe_sketch(uchar_t *buf, uint32_t len, int nfeat)
+{
+	uint32_t feat[SKETCH_FEATURES];
+	uint32_t i, n, w;
+	int f;
+
+	n = len / sizeof (uint32_t);
+	for (f = 0; f < SKETCH_FEATURES; f++)
+		feat[f] = UINT32_MAX;
+	i = 0;
+#if defined(__x86_64__)
+	if (sketch_sse4 && n >= 4)
+		i = dedupe_sketch_sse4(buf, n, feat);
+#elif defined(__aarch64__)
+	if (sketch_neon && n >= 4)
+		i = dedupe_sketch_neon(buf, n, feat);
+#endif
+	for (; i < n; i++) {
+		w = U32_P(buf + i * sizeof (uint32_t));
+		for (f = 0; f < SKETCH_FEATURES; f++) {
+			uint32_t v = w * sketch_mul[f] + sketch_add[f];
+			if (v < feat[f]) feat[f] = v;
+		}
+	}
+	return (XXH32((const uchar_t *)feat, nfeat * sizeof (uint32_t), 0));
+}
+
+/*
+ * Pass on Global Dedupe index access for a chunk that has no blocks to add.
+ * Segmented dedupe hands the index over in chunk sequence via the index
+ * semaphores, the simple index only needs to know the chunk was done.
+ */
+static void
+dedupe_index_skip(dedupe_context_t *ctx, uint64_t size)
+{
+	if (ctx->arc == NULL || ctx->arc->window_sz)
+		return;
+	if (ctx->arc->dedupe_mode == MODE_SIMPLE) {
+		db_insert_done_s(ctx->arc, ctx->file_offset, ctx->file_offset + size);
+	} else {
+		uint64_t t = pc_trace_start();
+
+		Hsem_Wait(ctx->index_sem);
+		pc_trace_end("index_wait", t, 0);
+		Hsem_Post(ctx->index_sem_next);
+	}
+}
+
+/*
+ * Called on errors to release compression threads waiting for index inserts
+ * of earlier chunks.
+ */
+void
+dedupe_index_abort(void)
+{
+	pthread_mutex_lock(&init_lock);
+	if (arc && arc->dedupe_mode == MODE_SIMPLE)
+		db_insert_abort_s(arc);
+	pthread_mutex_unlock(&init_lock);
+}
 
-	if (dedupe_flag != RABIN_DEDUPE_FIXED)
-		ctx->blknum = chunksize / ctx->rabin_poly_min_block_size;
-	else
-		ctx->blknum = chunksize / ctx->rabin_poly_avg_block_size;
+/*
+ * Whether blocks may be referenced from the base file of a persistent index.
+ */
+int
+dedupe_index_has_base(void)
+{
+	int rv;
 
-	if (chunksize % ctx->rabin_poly_min_block_size)
-		++(ctx->blknum);
+	pthread_mutex_lock(&init_lock);
+	rv = (arc && db_base_mapped_s(arc));
+	pthread_mutex_unlock(&init_lock);
+	return (rv);
+}
 
-	if (ctx->blknum > RABIN_MAX_BLOCKS) {
-		log_msg(LOG_ERR, 0, "Chunk size too large for dedup.\n");
-		destroy_dedupe_context(ctx);
-		return (NULL);
+/*
+ * Whether the Global Dedupe index can be rebuilt from the input alone when
+ * resuming an interrupted compression. Only the simple index is, segmented
+ * and windowed indexes depend on the order chunks were processed in.
+ */
+int
+dedupe_index_resumable(void)
+{
+	int rv;
+
+	pthread_mutex_lock(&init_lock);
+	rv = (arc == NULL || (arc->dedupe_mode == MODE_SIMPLE && arc->window_sz == 0));
+	pthread_mutex_unlock(&init_lock);
+	return (rv);
+}
+
+/*
+ * Insert the blocks of a chunk compressed by an interrupted run into the
+ * simple index, so that resumed chunks find the same matches. The chunk is
+ * cut into blocks from its start as the compression threads do. Chunks must
+ * be given in order from the start of the input.
+ */
+int
+dedupe_index_reseed(dedupe_context_t *ctx, uchar_t *buf, uint64_t offset, uint64_t len)
+{
+	uint64_t off, i, *offs;
+	uint32_t blen, n, cap, *lens;
+	index_stat_t ist;
+	uchar_t *cks;
+	int cksz;
+
+	if (arc == NULL || arc->dedupe_mode != MODE_SIMPLE || arc->window_sz)
+		return (-1);
+	cksz = arc->chunk_cksum_sz;
+	cap = len / ctx->rabin_poly_min_block_size + 2;
+	offs = (uint64_t *)slab_alloc(NULL, cap * sizeof (uint64_t));
+	lens = (uint32_t *)slab_alloc(NULL, cap * sizeof (uint32_t));
+	cks = (uchar_t *)slab_alloc(NULL, (uint64_t)cap * cksz);
+	if (offs == NULL || lens == NULL || cks == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory rebuilding the dedupe index.\n");
+		if (offs) slab_free(NULL, offs);
+		if (lens) slab_free(NULL, lens);
+		if (cks) slab_free(NULL, cks);
+		return (-1);
 	}
-#ifndef SSE_MODE
-	ctx->current_window_data = (uchar_t *)slab_alloc(NULL, RAB_POLYNOMIAL_WIN_SIZE);
-#else
-	ctx->current_window_data = (uchar_t *)1;
-#endif
-	ctx->blocks = NULL;
-	if (real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL) {
-		ctx->blocks = (rabin_blockentry_t **)slab_calloc(NULL,
-			ctx->blknum, sizeof (rabin_blockentry_t *));
+
+	off = 0;
+	n = 0;
+	while (off < len && n < cap) {
+		blen = len - off;
+		if (blen > ctx->rabin_poly_min_block_size) {
+			blen = dedupe_next_block(ctx, buf + off, len - off);
+			if (off + blen > len)
+				blen = len - off;
+		}
+		offs[n] = off;
+		lens[n] = blen;
+		n++;
+		off += blen;
 	}
-	if(ctx == NULL || ctx->current_window_data == NULL ||
-	    (ctx->blocks == NULL && real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)) {
-		log_msg(LOG_ERR, 0,
-		    "Could not allocate rabin polynomial context, out of memory\n");
-		destroy_dedupe_context(ctx);
-		return (NULL);
+	for (i = 0; i < n; i += MB_HASH_BATCH) {
+		uchar_t *ckp[MB_HASH_BATCH], *bufs[MB_HASH_BATCH];
+		uint64_t l[MB_HASH_BATCH];
+		int j, cnt;
+
+		cnt = (n - i < MB_HASH_BATCH ? n - i : MB_HASH_BATCH);
+		for (j = 0; j < cnt; j++) {
+			ckp[j] = cks + (i + j) * cksz;
+			bufs[j] = buf + offs[i + j];
+			l[j] = lens[i + j];
+		}
+		compute_checksum_mb(ckp, arc->chunk_cksum_type, bufs, l, cnt);
 	}
+	memset(&ist, 0, sizeof (ist));
+	for (i = 0; i < n; i++)
+		db_insert_mt_s(arc, cks + i * cksz, offset + offs[i], lens[i], &ist);
+	db_insert_done_s(arc, offset, offset + len);
+
+	slab_free(NULL, offs);
+	slab_free(NULL, lens);
+	slab_free(NULL, cks);
+	return (0);
+}
 
-	if (arc && dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL) {
-		ctx->similarity_cksums = (uchar_t *)slab_calloc(NULL,
-					arc->sub_intervals,
-					arc->similarity_cksum_sz);
-		if (!ctx->similarity_cksums) {
-			log_msg(LOG_ERR, 0,
-			    "Could not allocate dedupe context, out of memory\n");
-			destroy_dedupe_context(ctx);
-			return (NULL);
+/*
+ * Replace the persistent index with one for the data just compressed. If that
+ * fails the old index is removed, as the next run would otherwise reference
+ * data that the user does not expect to be the base.
+ */
+void
+dedupe_index_save(uint64_t size)
+{
+	pthread_mutex_lock(&init_lock);
+	if (arc && base_index) {
+		if (db_base_save_s(arc, base_index, size) == -1) {
+			log_msg(LOG_ERR, 0, "Could not update index %s, removing it.\n",
+			    base_index);
+			unlink(base_index);
 		}
 	}
+	pthread_mutex_unlock(&init_lock);
+}
 
-	ctx->lzma_data = NULL;
-	ctx->level = 14;
-	if (real_chunksize > 0) {
-		lzma_init(&(ctx->lzma_data), &(ctx->level), 1, chunksize, file_version, op);
+/*
+ * Set the input file that long range matches are read from and the stream
+ * offset of its first byte. Without one long range matching is turned off.
+ */
+void
+dedupe_long_match_source(int fd, uint64_t base)
+{
+	pthread_mutex_lock(&init_lock);
+	if (ldm_tab && fd == -1) {
+		log_msg(LOG_WARN, 0, "PCOMPRESS_LONG_MATCH needs a regular input file. "
+		    "Ignored.\n");
+		slab_free(NULL, ldm_tab);
+		ldm_tab = NULL;
+	}
+	ldm_fd = fd;
+	ldm_base = base;
+	pthread_mutex_unlock(&init_lock);
+}
 
-		// The lzma_data member is not needed during decompression
-		if (!(ctx->lzma_data) && op == COMPRESS) {
-			log_msg(LOG_ERR, 0,
-			    "Could not initialize LZMA data for dedupe index, out of memory\n");
-			destroy_dedupe_context(ctx);
-			return (NULL);
-		}
+/*
+ * Monotonic nanosecond clock for the dedupe telemetry, 0 when not timed.
+ */
+static inline uint64_t
+dedupe_clock(int timed)
+{
+	struct timespec ts;
+
+	if (!timed || clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return (0);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Length of the common prefix of a and b, up to n bytes.
+ */
+static uint64_t
+ldm_common(const uchar_t *a, const uchar_t *b, uint64_t n)
+{
+	uint64_t i, x;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = U64_P(a + i) ^ U64_P(b + i);
+		if (x)
+			return (i + (__builtin_ctzll(LE64(x)) >> 3));
 	}
+	while (i < n && a[i] == b[i])
+		i++;
+	return (i);
+}
 
-	slab_cache_add(sizeof (rabin_blockentry_t));
-	ctx->real_chunksize = real_chunksize;
-	reset_dedupe_context(ctx);
-	return (ctx);
+/*
+ * Table slot and check tag of an anchor hash.
+ */
+static inline uint64_t
+ldm_slot(uint64_t h, uint64_t *tag)
+{
+	uint64_t kx;
+
+	kx = (h << LDM_ANCHOR_BITS) * 0x9e3779b97f4a7c15ULL;
+	*tag = (kx >> (64 - ldm_bits - LDM_TAG_BITS)) & LDM_TAG_MASK;
+	return (kx >> (64 - ldm_bits));
 }
 
-void
-reset_dedupe_context(dedupe_context_t *ctx)
+/*
+ * Return len bytes of input at stream offset pos, from the chunk buffer if
+ * they are in it, else read from the input file into scratch. The range never
+ * spans the start of the chunk. With isbase pos is an offset into the base.
+ */
+static uchar_t *
+ldm_source(dedupe_context_t *ctx, uchar_t *buf, uchar_t *scratch, uint64_t pos,
+    uint64_t len, int isbase)
 {
-#ifndef	SSE_MODE
-	memset(ctx->current_window_data, 0, RAB_POLYNOMIAL_WIN_SIZE);
-#endif
-	ctx->valid = 0;
+	if (isbase)
+		return (base_map + pos);
+	if (pos >= ctx->file_offset)
+		return (buf + (pos - ctx->file_offset));
+	if (pos < ldm_base || pread(ldm_fd, scratch, len, pos - ldm_base) != (ssize_t)len)
+		return (NULL);
+	return (scratch);
 }
 
-void
-destroy_dedupe_context(dedupe_context_t *ctx)
+/*
+ * Long range matching. Block hashes only find repeats that start and end on
+ * block boundaries. The data that Global Dedupe left as literal runs is
+ * searched for repeats at any alignment within all the input seen so far and
+ * the base file, if one is given.
+ * Positions where the Gear hash of the last 64 bytes has its top
+ * LDM_ANCHOR_BITS clear are anchors. Their stream offsets are kept in a
+ * sparse table keyed by that hash. An anchor found in the table is checked
+ * against the data there and the match is extended both ways. Matches of
+ * LDM_MIN_MATCH bytes or more replace the literal data with ordinary Global
+ * Dedupe references, so decompression resolves them like any other.
+ *
+ * References must point backwards and must not span the start of the chunk,
+ * as decompression copies data before it from the output file and data after
+ * it from the chunk being restored.
+ *
+ * The nent entries of the index at idx are rewritten in place and the new
+ * number of entries is returned.
+ */
+static uint32_t
+dedupe_long_match(dedupe_context_t *ctx, uchar_t *buf, uchar_t *idx, uint32_t nent,
+    uint64_t *matchlen, struct pc_dedupe_stat *ds)
 {
-	if (ctx) {
-		uint32_t i;
-#ifndef SSE_MODE
-		if (ctx->current_window_data) slab_free(NULL, ctx->current_window_data);
-#endif
+	uchar_t *out, *o, *ip, *scratch, *sp, *tp;
+	uint64_t pos, end, lit, i, hs, h, cur, cand, ent, tag, slot;
+	uint64_t bmax, fmax, back, fwd, n, m, outsz, fo, tstart, lb;
+	uint32_t e, k, nout, nmatch;
+	int isbase;
+
+	fo = ctx->file_offset;
+	lb = (ldm_base > ctx->group_floor ? ldm_base : ctx->group_floor);
+	pos = 0;
+	ip = idx;
+	for (k = 0; k < nent; k++) {
+		e = LE32(U32_P(ip));
+		ip += RABIN_ENTRY_SIZE;
+		if (e & RABIN_INDEX_FLAG) {
+			ip += RABIN_ENTRY_SIZE * 2;
+			k += 2;
+		}
+		pos += (e & RABIN_INDEX_VALUE);
+	}
+	outsz = (nent + (pos / LDM_MIN_MATCH + 1) * 4) * RABIN_ENTRY_SIZE;
+	out = (uchar_t *)slab_tmp_alloc(NULL, outsz);
+	scratch = (uchar_t *)slab_tmp_alloc(NULL, LDM_CMP_BUF);
+	if (out == NULL || scratch == NULL) {
+		if (out) slab_free(NULL, out);
+		if (scratch) slab_free(NULL, scratch);
+		return (nent);
+	}
 
-		pthread_mutex_lock(&init_lock);
-		if (arc) {
-			destroy_global_db_s(arc);
+	o = out;
+	ip = idx;
+	pos = 0;
+	nout = 0;
+	nmatch = 0;
+	for (k = 0; k < nent; k++) {
+		e = LE32(U32_P(ip));
+		if (e & RABIN_INDEX_FLAG) {
+			memcpy(o, ip, RABIN_ENTRY_SIZE * 3);
+			o += RABIN_ENTRY_SIZE * 3;
+			ip += RABIN_ENTRY_SIZE * 3;
+			k += 2;
+			nout += 3;
+			pos += (e & RABIN_INDEX_VALUE);
+			continue;
 		}
-		arc = NULL;
-		pthread_mutex_unlock(&init_lock);
+		ip += RABIN_ENTRY_SIZE;
+		end = pos + e;
+		lit = pos;
+		h = 0;
+		hs = pos;
+		for (i = pos; i < end; i++) {
+			h = (h << 1) + gear[buf[i]];
+			if ((h & LDM_ANCHOR_MASK) || i + 1 - hs < 64)
+				continue;
+
+			/*
+			 * Look up and replace the table entry for the anchor.
+			 */
+			cur = fo + i + 1;
+			slot = ldm_slot(h, &tag);
+			ent = __atomic_load_n(&ldm_tab[slot], __ATOMIC_RELAXED);
+			if (cur <= LDM_OFF_MASK)
+				__atomic_store_n(&ldm_tab[slot], (tag << LDM_OFF_BITS) | cur,
+				    __ATOMIC_RELAXED);
+			if (ent == 0 || ((ent >> LDM_OFF_BITS) & LDM_TAG_MASK) != tag)
+				continue;
+			cand = ent & LDM_OFF_MASK;
+			isbase = ((ent & LDM_BASE) != 0);
+			if (isbase ? (base_map == NULL || cand > base_len) :
+			    (cand >= cur || cand < lb))
+				continue;
+
+			/*
+			 * The target stays within the literal run. The source lies
+			 * in the base, wholly before the chunk or wholly inside it
+			 * before the target. Data is compared in growing pieces so
+			 * that short repeats do not cost much reading.
+			 */
+			bmax = cur - (fo + lit);
+			fmax = fo + end - cur;
+			if (isbase) {
+				if (bmax > cand)
+					bmax = cand;
+				if (fmax > base_len - cand)
+					fmax = base_len - cand;
+			} else if (cand <= fo) {
+				if (bmax > cand - lb)
+					bmax = cand - lb;
+				if (fmax > fo - cand)
+					fmax = fo - cand;
+			} else {
+				if (bmax > cand - fo)
+					bmax = cand - fo;
+				if (bmax > cur - cand)
+					bmax = cur - cand;
+			}
+
+			tp = buf + (cur - fo);
+			back = 0;
+			n = LDM_CMP_MIN;
+			while (back < bmax) {
+				if (n > bmax - back)
+					n = bmax - back;
+				sp = ldm_source(ctx, buf, scratch, cand - back - n, n, isbase);
+				if (sp == NULL)
+					break;
+				m = 0;
+				while (m < n && sp[n - 1 - m] == tp[-1 - (int64_t)(back + m)])
+					m++;
+				back += m;
+				if (m < n)
+					break;
+				if (n < LDM_CMP_BUF)
+					n <<= 1;
+			}
+			if (!isbase && cand > fo && fmax > cur - back - cand)
+				fmax = cur - back - cand;
+			if (fmax > RABIN_INDEX_VALUE - back)
+				fmax = RABIN_INDEX_VALUE - back;
+			fwd = 0;
+			n = LDM_CMP_MIN;
+			while (fwd < fmax) {
+				if (n > fmax - fwd)
+					n = fmax - fwd;
+				if ((sp = ldm_source(ctx, buf, scratch, cand + fwd, n, isbase)) == NULL)
+					break;
+				m = ldm_common(sp, tp + fwd, n);
+				fwd += m;
+				if (m < n)
+					break;
+				if (n < LDM_CMP_BUF)
+					n <<= 1;
+			}
+			if (back + fwd < LDM_MIN_MATCH)
+				continue;
 
-		if (ctx->blocks) {
-			for (i=0; i<ctx->blknum && ctx->blocks[i] != NULL; i++) {
-				slab_free(NULL, ctx->blocks[i]);
+			/*
+			 * Emit the pending literal run and the reference.
+			 */
+			tstart = cur - back - fo;
+			if (tstart > lit) {
+				U32_P(o) = LE32((uint32_t)(tstart - lit));
+				o += RABIN_ENTRY_SIZE;
+				nout++;
 			}
-			slab_free(NULL, ctx->blocks);
+			U32_P(o) = LE32(((uint32_t)(back + fwd) | RABIN_INDEX_FLAG) &
+			    CLEAR_SIMILARITY_FLAG);
+			o += RABIN_ENTRY_SIZE;
+			U64_P(o) = LE64(isbase ? (cand - back) | GLOBAL_BASE_REF : cand - back);
+			o += RABIN_ENTRY_SIZE * 2;
+			nout += 3;
+			nmatch++;
+			*matchlen += back + fwd;
+			ds->long_match++;
+			ds->long_bytes += back + fwd;
+
+			lit = tstart + back + fwd;
+			i = lit - 1;
+			h = 0;
+			hs = lit;
 		}
-		if (ctx->similarity_cksums) slab_free(NULL, ctx->similarity_cksums);
-		if (ctx->lzma_data) lzma_deinit(&(ctx->lzma_data));
-		slab_free(NULL, ctx);
+		if (end > lit) {
+			U32_P(o) = LE32((uint32_t)(end - lit));
+			o += RABIN_ENTRY_SIZE;
+			nout++;
+		}
+		pos = end;
 	}
+	if (nmatch > 0)
+		memcpy(idx, out, (uint64_t)nout * RABIN_ENTRY_SIZE);
+	else
+		nout = nent;
+	slab_free(NULL, scratch);
+	slab_free(NULL, out);
+	return (nout);
 }
 
 /*
- * Simple insertion sort of integers. Used for sorting a small number of items to
- * avoid overheads of qsort() with callback function.
+ * Add the long range match anchors of base file range [start, end) to the
+ * match table.
  */
 static void
-isort_uint64(uint64_t *ary, uint32_t nitems)
+ldm_base_anchors(uint64_t start, uint64_t end)
 {
-	uint32_t i, j, k;
-	uint64_t tmp;
+	uint64_t i, h, slot, tag;
+
+	h = 0;
+	for (i = (start > 64 ? start - 64 : 0); i < end && i < LDM_OFF_MASK; i++) {
+		h = (h << 1) + gear[base_map[i]];
+		if (i < start || i < 63 || (h & LDM_ANCHOR_MASK))
+			continue;
+		slot = ldm_slot(h, &tag);
+		__atomic_store_n(&ldm_tab[slot], LDM_BASE | (tag << LDM_OFF_BITS) | (i + 1),
+		    __ATOMIC_RELAXED);
+	}
+}
 
-	for (i = 1 ; i < nitems; i++) {
-		for (j = 0 ; j < i ; j++) {
-			if (ary[j] > ary[i]) {
-				tmp = ary[j] ;
-				ary[j] = ary[i] ;
+/*
+ * Index the base file given by PCOMPRESS_GLOBAL_BASE to compress directly
+ * against it, as if it had been compressed before with a persistent index.
+ * The base is cut into blocks like the input, one piece at a time, and the
+ * block hashes go into an in-memory base index. Matching blocks of the input
+ * then become references into the base. With long range matching the anchors
+ * of the base are added to the match table as well.
+ */
+static int
+dedupe_base_build(dedupe_context_t *ctx)
+{
+	uint64_t npieces, slots, added, p, start, end, off, i, *offs;
+	uint32_t len, n, cap, *lens;
+	uchar_t *cks;
+	int cksz;
+
+	if (dedupe_base_map() == -1)
+		return (-1);
+	if (base_map == NULL)
+		return (0);
+	npieces = (base_len + BASE_PIECE - 1) / BASE_PIECE;
+	slots = db_base_create_s(arc, base_len / ctx->rabin_poly_avg_block_size + npieces);
+	if (slots == 0)
+		return (-1);
+
+	cksz = arc->chunk_cksum_sz;
+	cap = BASE_PIECE / ctx->rabin_poly_min_block_size + 2;
+	offs = (uint64_t *)slab_alloc(NULL, cap * sizeof (uint64_t));
+	lens = (uint32_t *)slab_alloc(NULL, cap * sizeof (uint32_t));
+	cks = (uchar_t *)slab_alloc(NULL, (uint64_t)cap * cksz);
+	if (offs == NULL || lens == NULL || cks == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory indexing the base file.\n");
+		if (offs) slab_free(NULL, offs);
+		if (lens) slab_free(NULL, lens);
+		if (cks) slab_free(NULL, cks);
+		return (-1);
+	}
 
-				for (k = i ; k > j ; k--)
-					ary[k] = ary[k - 1] ;
+	/*
+	 * The index is never filled beyond three quarters. Blocks past that
+	 * point of an unusually dense base are left out.
+	 */
+	added = 0;
+	for (p = 0; p < npieces && added < slots / 4 * 3; p++) {
+		start = p * BASE_PIECE;
+		end = (base_len - start < BASE_PIECE) ? base_len : start + BASE_PIECE;
+		off = start;
+		n = 0;
+		while (off < end) {
+			len = end - off;
+			if (len > ctx->rabin_poly_min_block_size) {
+				len = dedupe_next_block(ctx, base_map + off, end - off);
+				if (off + len > end)
+					len = end - off;
+			}
+			offs[n] = off;
+			lens[n] = len;
+			n++;
+			off += len;
+		}
 
-				ary[k + 1] = tmp ;
+#if defined(_OPENMP)
+#	pragma omp parallel for
+#endif
+		for (i = 0; i < n; i += MB_HASH_BATCH) {
+			uchar_t *ckp[MB_HASH_BATCH], *bufs[MB_HASH_BATCH];
+			uint64_t l[MB_HASH_BATCH];
+			int j, cnt;
+
+			cnt = (n - i < MB_HASH_BATCH ? n - i : MB_HASH_BATCH);
+			for (j = 0; j < cnt; j++) {
+				ckp[j] = cks + (i + j) * cksz;
+				bufs[j] = base_map + offs[i + j];
+				l[j] = lens[i + j];
 			}
+			compute_checksum_mb(ckp, arc->chunk_cksum_type, bufs, l, cnt);
 		}
+		for (i = 0; i < n && added < slots / 4 * 3; i++, added++)
+			db_base_insert_s(arc, cks + i * cksz, offs[i], lens[i]);
 	}
+	slab_free(NULL, offs);
+	slab_free(NULL, lens);
+	slab_free(NULL, cks);
+
+	if (ldm_tab) {
+#if defined(_OPENMP)
+#	pragma omp parallel for
+#endif
+		for (p = 0; p < npieces; p++) {
+			start = p * BASE_PIECE;
+			ldm_base_anchors(start, (base_len - start < BASE_PIECE) ?
+			    base_len : start + BASE_PIECE);
+		}
+	}
+	return (0);
 }
 
 /*
- * Sort an array of 64-bit unsigned integers. The QSORT macro provides an
- * inline quicksort routine that does not use a callback function.
+ * Link the unique blocks of a chunk that have the same similarity sketch into
+ * clusters, for storing their data next to each other. Blocks of a cluster
+ * are chained in block order via other[] (next block + 1, 0 at the end) and
+ * have hash[] set to 1, other blocks have hash[] 0. The hashtable slots hold
+ * the last block of each cluster + 1.
  */
 static void
-do_qsort(uint64_t *arr, uint32_t len)
+dedupe_cluster(dedupe_context_t *ctx, uchar_t *buf1, uint32_t blknum, uint32_t *htab,
+    uint64_t hmask, int mt)
 {
-	QSORT(arr, len);
-}
+	rabin_blocks_t *bt = &ctx->blocks;
+	uint32_t i, ck, be;
+	uint64_t j;
 
-static inline int
-ckcmp(uchar_t *a, uchar_t *b, int sz)
-{
-	size_t *v1 = (size_t *)a;
-	size_t *v2 = (size_t *)b;
-	int len;
+	if (!ctx->delta_flag) {
+#if defined(_OPENMP)
+#	pragma omp parallel for if (mt)
+#endif
+		for (i=0; i<blknum; i++) {
+			if (bt->similar[i] == 0 || bt->similar[i] == SIMILAR_REF)
+				bt->similarity_hash[i] = dedupe_sketch(buf1+bt->offset[i],
+				    bt->length[i], REORDER_FEATURES);
+		}
+	}
 
-	len = 0;
-	do {
-		if (*v1 != *v2) {
-			return (1);
+	memset(htab, 0, (hmask + 1) * sizeof (uint32_t));
+	for (i=0; i<blknum; i++) {
+		bt->hash[i] = 0;
+		if (bt->similar[i] != 0 && bt->similar[i] != SIMILAR_REF)
+			continue;
+		if (i == blknum - 1 && bt->length[i] <= ctx->rabin_poly_min_block_size)
+			continue;
+		bt->other[i] = 0;
+		ck = bt->similarity_hash[i];
+		j = ck & hmask;
+		while (htab[j] != 0) {
+			be = htab[j] - 1;
+			if (bt->similarity_hash[be] == ck) {
+				bt->other[be] = i + 1;
+				bt->hash[be] = 1;
+				bt->hash[i] = 1;
+				break;
+			}
+			j = (j + 1) & hmask;
 		}
-		++v1;
-		++v2;
-		len += sizeof (size_t);
-	} while (len < sz);
+		htab[j] = i + 1;
+	}
+}
 
-	return (0);
+/*
+ * Fill ord with the order in which the data of the dedupe index entries is
+ * stored: entries with data in chunk order, except that the entries of a
+ * cluster all follow its first one. Exact duplicates, which have no data,
+ * come last. Returns the number of entries with data.
+ */
+static uint32_t
+dedupe_cluster_order(rabin_blocks_t *bt, uint32_t *dedupe_index, uint32_t nent,
+    uint32_t *ord)
+{
+	uint32_t i, be, m, n;
+
+	m = 0;
+	for (i=0; i<nent; i++) {
+		be = dedupe_index[i];
+		if (bt->similar[be] == SIMILAR_EXACT || bt->hash[be] == 2)
+			continue;
+		if (bt->hash[be] == 0) {
+			ord[m++] = i;
+			continue;
+		}
+		while (1) {
+			ord[m++] = bt->index[be];
+			bt->hash[be] = 2;
+			if (bt->other[be] == 0)
+				break;
+			be = bt->other[be] - 1;
+		}
+	}
+	n = m;
+	for (i=0; i<nent; i++) {
+		if (bt->similar[dedupe_index[i]] == SIMILAR_EXACT)
+			ord[n++] = i;
+	}
+	return (m);
 }
 
 /**
@@ -475,18 +2361,19 @@ ckcmp(uchar_t *a, uchar_t *b, int sz)
  * A 16-byte window is used for the rolling checksum and dedup blocks can vary in size
  * from 4K-128K.
  */
-uint32_t
-dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t offset,
-		uint64_t *rabin_pos, int mt)
+static uint32_t
+dedupe_compress_blocks(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t offset,
+		uint64_t *rabin_pos, int mt, struct pc_dedupe_stat *ds, int timed)
 {
 	uint64_t i, last_offset, j, ary_sz;
-	uint32_t blknum, window_pos;
+	uint32_t blknum;
 	uchar_t *buf1 = (uchar_t *)buf;
 	uint32_t length;
-	uint64_t cur_roll_checksum, cur_pos_checksum;
-	uint32_t *ctx_heap;
-	rabin_blockentry_t **htab;
-	MinHeap heap;
+	uint32_t *htab;
+	uint64_t *ftab;
+	int nseg, done;
+	uint64_t t, pv[PC_PERF_MAX];
+	index_stat_t ist;
 	DEBUG_STAT_EN(uint32_t max_count);
 	DEBUG_STAT_EN(max_count = 0);
 	DEBUG_STAT_EN(double strt, en_1, en);
@@ -494,21 +2381,19 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	length = offset;
 	last_offset = 0;
 	blknum = 0;
-	window_pos = 0;
 	ctx->valid = 0;
-	cur_roll_checksum = 0;
 	if (*size < ctx->rabin_poly_avg_block_size) {
 		/*
-		 * Must ensure that we are signaling the index semaphores before skipping
-		 * in order to maintain proper sequencing and avoid deadlocks.
+		 * Must ensure that we are signaling the index before skipping in order
+		 * to maintain proper sequencing and avoid deadlocks.
 		 */
-		if (ctx->arc) {
-			Sem_Wait(ctx->index_sem);
-			Sem_Post(ctx->index_sem_next);
-		}
+		dedupe_index_skip(ctx, *size);
 		return (0);
 	}
 	DEBUG_STAT_EN(strt = get_wtime_millis());
+	t = dedupe_clock(timed);
+	if (timed)
+		pc_perf_read(pv);
 
 	if (ctx->dedupe_flag == RABIN_DEDUPE_FIXED) {
 		blknum = *size / ctx->rabin_poly_avg_block_size;
@@ -524,14 +2409,10 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 			if (i == blknum-1) {
 				length = j;
 			}
-			if (ctx->blocks[i] == 0) {
-				ctx->blocks[i] = (rabin_blockentry_t *)slab_alloc(NULL,
-				    sizeof (rabin_blockentry_t));
-			}
-			ctx->blocks[i]->offset = last_offset;
-			ctx->blocks[i]->index = i; // Need to store for sorting
-			ctx->blocks[i]->length = length;
-			ctx->blocks[i]->similar = 0;
+			ctx->blocks.offset[i] = last_offset;
+			ctx->blocks.index[i] = i;
+			ctx->blocks.length[i] = length;
+			ctx->blocks.similar[i] = 0;
 			last_offset += length;
 		}
 		goto process_blocks;
@@ -547,66 +2428,22 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 			ary_sz = (sizeof (global_blockentry_t) * (*size / ctx->rabin_poly_min_block_size + 1));
 			ctx->g_blocks = (global_blockentry_t *)(ctx->cbuf + ctx->real_chunksize - ary_sz);
 		}
-
-		/*
-		 * Initialize arrays for sketch computation. We re-use memory allocated
-		 * for the compressed chunk temporarily.
-		 */
-		ary_sz += ctx->rabin_poly_max_block_size;
-		ctx_heap = (uint32_t *)(ctx->cbuf + ctx->real_chunksize - ary_sz);
 	}
-#ifndef SSE_MODE
-	memset(ctx->current_window_data, 0, RAB_POLYNOMIAL_WIN_SIZE);
-#else
-	__m128i cur_sse_byte = _mm_setzero_si128();
-	__m128i window = _mm_setzero_si128();
-#endif
-	j = *size - RAB_POLYNOMIAL_WIN_SIZE;
-
-	/* 
-	 * If rabin_pos is non-zero then we are being asked to scan for the last rabin boundary
-	 * in the chunk. We start scanning at chunk end - max rabin block size. We avoid doing
-	 * a full chunk scan.
-	 * 
-	 * !!!NOTE!!!: Code duplication below for performance.
+
+	/*
+	 * If rabin_pos is non-zero then we are being asked to scan for the last block
+	 * boundary in the chunk. We chunk the final max block size bytes of the buffer
+	 * and avoid doing a full chunk scan.
 	 */
 	if (rabin_pos) {
 		offset = *size - ctx->rabin_poly_max_block_size;
-		length = 0;
-		for (i=offset; i<j; i++) {
-			int cur_byte = buf1[i];
-#ifdef	SSE_MODE
-			uint32_t pushed_out = _mm_extract_epi32(window, 3);
-			pushed_out >>= 24;
-			asm ("movd %[cur_byte], %[cur_sse_byte]"
-			     : [cur_sse_byte] "=x" (cur_sse_byte)
-			     : [cur_byte] "r" (cur_byte)
-			);
-			window = _mm_slli_si128(window, 1);
-			window = _mm_or_si128(window, cur_sse_byte);
-#else
-			uint32_t pushed_out = ctx->current_window_data[window_pos];
-			ctx->current_window_data[window_pos] = cur_byte;
-#endif
-
-			cur_roll_checksum = (cur_roll_checksum * RAB_POLYNOMIAL_CONST) & POLY_MASK;
-			cur_roll_checksum += cur_byte;
-			cur_roll_checksum -= out[pushed_out];
-
-#ifndef	SSE_MODE
-			window_pos = (window_pos + 1) & (RAB_POLYNOMIAL_WIN_SIZE-1);
-#endif
-			++length;
-			if (length < ctx->rabin_poly_min_block_size) continue;
-
-			// If we hit our special value update block offset
-			cur_pos_checksum = cur_roll_checksum ^ ir[pushed_out];
-			if ((cur_pos_checksum & ctx->rabin_avg_block_mask) == ctx->rabin_break_patt) {
-				last_offset = i;
-				length = 0;
-			}
+		last_offset = 0;
+		while (*size - offset > ctx->rabin_poly_min_block_size) {
+			length = dedupe_next_block(ctx, buf1 + offset, *size - offset);
+			if (offset + length >= *size) break;
+			offset += length;
+			last_offset = offset;
 		}
-
 		if (last_offset < *size) {
 			*rabin_pos = last_offset;
 		}
@@ -614,163 +2451,141 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	}
 
 	/*
-	 * Start our sliding window at a fixed number of bytes before the min window size.
-	 * It is pointless to slide the window over the whole length of the chunk.
+	 * Large chunks are split into segments that are chunked concurrently by the
+	 * spare threads given to this chunk. Each segment is chunked as if a block
+	 * started at its beginning. Since boundaries only depend on content, the
+	 * real block sequence coming in from the previous segment joins that of the
+	 * segment at the first boundary both have in common. Up to that point blocks
+	 * are found serially here, after it the segment's blocks are taken as is.
+	 * The result is the same as a serial scan.
 	 */
-	offset = ctx->rabin_poly_min_block_size - RAB_WINDOW_SLIDE_OFFSET;
-	length = offset;
-	for (i=offset; i<j; i++) {
-		uint64_t pc[4];
-		uint32_t cur_byte = buf1[i];
-
-#ifdef	SSE_MODE
-		/*
-		 * A 16-byte XMM register is used as a sliding window if our window size is 16 bytes
-		 * and at least SSE 4.1 is enabled. Avoids memory access for the sliding window.
-		 */
-		uint32_t pushed_out = _mm_extract_epi32(window, 3);
-		pushed_out >>= 24;
-
-		/*
-		 * No intrinsic available for this.
-		 */
-		asm ("movd %[cur_byte], %[cur_sse_byte]"
-		     : [cur_sse_byte] "=x" (cur_sse_byte)
-		     : [cur_byte] "r" (cur_byte)
-		);
-		window = _mm_slli_si128(window, 1);
-		window = _mm_or_si128(window, cur_sse_byte);
-#else
-		uint32_t pushed_out = ctx->current_window_data[window_pos];
-		ctx->current_window_data[window_pos] = cur_byte;
-#endif
-
-		cur_roll_checksum = (cur_roll_checksum * RAB_POLYNOMIAL_CONST) & POLY_MASK;
-		cur_roll_checksum += cur_byte;
-		cur_roll_checksum -= out[pushed_out];
+	nseg = get_chunk_threads();
+	if (nseg > RABIN_SCAN_MAX_THREADS)
+		nseg = RABIN_SCAN_MAX_THREADS;
+	if (nseg > *size / RABIN_SCAN_SEGMENT_MIN)
+		nseg = *size / RABIN_SCAN_SEGMENT_MIN;
+	if (nseg > 1 && ctx->scan_cuts == NULL) {
+		ctx->scan_cuts = (uint64_t *)slab_alloc(NULL,
+		    (ctx->blknum + RABIN_SCAN_MAX_THREADS) * sizeof (uint64_t));
+		if (ctx->scan_cuts == NULL)
+			nseg = 1;
+	}
 
-#ifndef	SSE_MODE
-		/*
-		 * Window pos has to rotate from 0 .. RAB_POLYNOMIAL_WIN_SIZE-1
-		 * We avoid a branch here by masking. This requires RAB_POLYNOMIAL_WIN_SIZE
-		 * to be power of 2
-		 */
-		window_pos = (window_pos + 1) & (RAB_POLYNOMIAL_WIN_SIZE-1);
+	done = 0;
+	if (nseg > 1) {
+		uint64_t seg_sz, seg_start[RABIN_SCAN_MAX_THREADS], seg_end[RABIN_SCAN_MAX_THREADS];
+		uint32_t seg_base[RABIN_SCAN_MAX_THREADS], seg_n[RABIN_SCAN_MAX_THREADS];
+		int seg_last[RABIN_SCAN_MAX_THREADS];
+		int k;
+
+		seg_sz = *size / nseg;
+		for (k = 0; k < nseg; k++) {
+			seg_start[k] = seg_sz * k;
+			seg_end[k] = (k == nseg - 1) ? *size : seg_start[k] + seg_sz;
+			seg_base[k] = seg_start[k] / ctx->rabin_poly_min_block_size + k;
+		}
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nseg) schedule(static, 1)
 #endif
-		++length;
-		if (length < ctx->rabin_poly_min_block_size) continue;
-
-		// If we hit our special value or reached the max block size update block offset
-		cur_pos_checksum = cur_roll_checksum ^ ir[pushed_out];
-		if ((cur_pos_checksum & ctx->rabin_avg_block_mask) == ctx->rabin_break_patt ||
-		    length >= ctx->rabin_poly_max_block_size) {
-
-			if (!(ctx->arc)) {
-				if (ctx->blocks[blknum] == 0)
-					ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
-					    sizeof (rabin_blockentry_t));
-				ctx->blocks[blknum]->offset = last_offset;
-				ctx->blocks[blknum]->index = blknum; // Need to store for sorting
-				ctx->blocks[blknum]->length = length;
-			} else {
-				ctx->g_blocks[blknum].length = length;
-				ctx->g_blocks[blknum].offset = last_offset;
-			}
-			DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
-			if (ctx->show_chunks) {
-				fprintf(stderr, "Block offset: %" PRIu64 ", length: %u\n", last_offset, length);
-			}
+		for (k = 0; k < nseg; k++) {
+			seg_last[k] = dedupe_scan_segment(ctx, buf1, *size, seg_start[k],
+			    seg_end[k], ctx->scan_cuts + seg_base[k], &seg_n[k]);
+		}
 
-			/*
-			 * Reset the heap structure and find the K min values if Delta Compression
-			 * is enabled. We use a min heap mechanism taken from the heap based priority
-			 * queue implementation in Python.
-			 * Here K = similarity extent = 87% or 62% or 50%.
-			 * 
-			 * Once block contents are arranged in a min heap we compute the K min values
-			 * sketch by hashing over the heap till K%. We interpret the raw bytes as a
-			 * sequence of 64-bit integers.
-			 * This is variant of minhashing which is used widely, for example in various
-			 * search engines to detect similar documents.
-			 */
-			if (ctx->delta_flag) {
-				length /= 8;
-				pc[1] = DELTA_NORMAL_PCT(length);
-				pc[2] = DELTA_EXTRA_PCT(length);
-				pc[3] = DELTA_EXTRA2_PCT(length);
-
-				heap_nsmallest(&heap, (int64_t *)(buf1+last_offset),
-					       (int64_t *)ctx_heap, pc[ctx->delta_flag], length);
-				ctx->blocks[blknum]->similarity_hash =
-					XXH32((const uchar_t *)ctx_heap, heap_size(&heap)*8, 0);
+		for (k = 0; k < nseg && !done; k++) {
+			uint64_t *cuts = ctx->scan_cuts + seg_base[k];
+			uint32_t idx = 0;
+			int joined;
+
+			joined = (last_offset == seg_start[k]);
+			while (!joined && last_offset < seg_end[k]) {
+				while (idx < seg_n[k] && cuts[idx] < last_offset)
+					idx++;
+				if (idx < seg_n[k] && cuts[idx] == last_offset) {
+					idx++;
+					joined = 1;
+					break;
+				}
+				if (*size - last_offset <= ctx->rabin_poly_min_block_size) {
+					done = 1;
+					break;
+				}
+				length = dedupe_next_block(ctx, buf1 + last_offset, *size - last_offset);
+				if (last_offset + length >= *size) {
+					done = 1;
+					break;
+				}
+				DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
+				dedupe_add_block(ctx, blknum, last_offset, length);
+				++blknum;
+				last_offset += length;
+			}
+			if (joined) {
+				for (; idx < seg_n[k]; idx++) {
+					length = cuts[idx] - last_offset;
+					DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
+					dedupe_add_block(ctx, blknum, last_offset, length);
+					++blknum;
+					last_offset = cuts[idx];
+				}
+				if (seg_last[k])
+					done = 1;
 			}
-			++blknum;
-			last_offset = i+1;
-			length = 0;
-			if (*size - last_offset <= ctx->rabin_poly_min_block_size) break;
-			length = ctx->rabin_poly_min_block_size - RAB_WINDOW_SLIDE_OFFSET;
-			i = i + length;
 		}
 	}
 
+	/*
+	 * Serial scan, or whatever is left after the segments.
+	 */
+	while (!done && *size - last_offset > ctx->rabin_poly_min_block_size) {
+		length = dedupe_next_block(ctx, buf1 + last_offset, *size - last_offset);
+		if (last_offset + length >= *size) break;
+		DEBUG_STAT_EN(if (length >= ctx->rabin_poly_max_block_size) ++max_count);
+		dedupe_add_block(ctx, blknum, last_offset, length);
+		++blknum;
+		last_offset += length;
+	}
+
 	// Insert the last left-over trailing bytes, if any, into a block.
 	if (last_offset < *size) {
 		length = *size - last_offset;
-		if (!(ctx->arc)) {
-			if (ctx->blocks[blknum] == 0)
-				ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
-					sizeof (rabin_blockentry_t));
-			ctx->blocks[blknum]->offset = last_offset;
-			ctx->blocks[blknum]->index = blknum;
-			ctx->blocks[blknum]->length = length;
-		} else {
-			ctx->g_blocks[blknum].length = length;
-			ctx->g_blocks[blknum].offset = last_offset;
-		}
-		if (ctx->show_chunks) {
-			fprintf(stderr, "Block offset: %" PRIu64 ", length: %u\n", last_offset, length);
-		}
-
-		if (ctx->delta_flag) {
-			uint64_t cur_sketch;
-			uint64_t pc[4];
-
-			if (length > ctx->rabin_poly_min_block_size) {
-				length /= 8;
-				pc[1] = DELTA_NORMAL_PCT(length);
-				pc[2] = DELTA_EXTRA_PCT(length);
-				pc[3] = DELTA_EXTRA2_PCT(length);
+		dedupe_add_block(ctx, blknum, last_offset, length);
+		++blknum;
+		last_offset = *size;
+	}
 
-				heap_nsmallest(&heap, (int64_t *)(buf1+last_offset),
-					       (int64_t *)ctx_heap, pc[ctx->delta_flag], length);
+process_blocks:
+	ds->scan_ns += dedupe_clock(timed) - t;
+	if (timed)
+		pc_perf_add(ds->scan_pmu, pv);
+	ds->blocks += blknum;
+	if (timed) {
+		for (i=0; i<blknum; i++) {
+			int b = 0;
 
-				cur_sketch =
-				    XXH32((const uchar_t *)ctx_heap,  heap_size(&heap)*8, 0);
-			} else {
-				cur_sketch =
-				    XXH32((const uchar_t *)(buf1+last_offset), length, 0);
+			length = (ctx->arc ? ctx->g_blocks[i].length : ctx->blocks.length[i]);
+			while (length > 0 && b < PC_DEDUPE_BUCKETS - 1) {
+				length >>= 1;
+				b++;
 			}
-			ctx->blocks[blknum]->similarity_hash = cur_sketch;
+			ds->blk_hist[b]++;
 		}
-		++blknum;
-		last_offset = *size;
 	}
 
-process_blocks:
 	// If we found at least a few chunks, perform dedup.
 	DEBUG_STAT_EN(en_1 = get_wtime_millis());
 	DEBUG_STAT_EN(fprintf(stderr, "Original size: %" PRId64 ", blknum: %u\n", *size, blknum));
 	DEBUG_STAT_EN(fprintf(stderr, "Number of maxlen blocks: %u\n", max_count));
-	if (blknum <=2 && ctx->arc) {
-		Sem_Wait(ctx->index_sem);
-		Sem_Post(ctx->index_sem_next);
-	}
+	if (blknum <=2)
+		dedupe_index_skip(ctx, *size);
 	if (blknum > 2) {
 		uint64_t pos, matchlen, pos1 = 0;
 		int valid = 1;
 		uint32_t *dedupe_index;
 		uint64_t dedupe_index_sz = 0;
-		rabin_blockentry_t *be;
+		rabin_blocks_t *bt = &ctx->blocks;
+		uint32_t be, hmask, x, nperm, *ord, zblk;
+		int reorder;
 		DEBUG_STAT_EN(uint32_t delta_calls, delta_fails, merge_count, hash_collisions);
 		DEBUG_STAT_EN(double w1 = 0);
 		DEBUG_STAT_EN(double w2 = 0);
@@ -784,17 +2599,34 @@ process_blocks:
 		if (ctx->arc) {
 			uchar_t *g_dedupe_idx, *tgt, *src;
 
+			ctx->group_floor = dedupe_group_floor(ctx->file_offset, *size);
+
 			/*
 			 * First compute all the rabin chunk/block cryptographic hashes.
 			 */
+			t = dedupe_clock(timed);
 #if defined(_OPENMP)
 #	pragma omp parallel for
 #endif
-			for (i=0; i<blknum; i++) {
-				compute_checksum(ctx->g_blocks[i].cksum,
-					ctx->arc->chunk_cksum_type, buf1+ctx->g_blocks[i].offset,
-					ctx->g_blocks[i].length, 0, 0);
+			for (i=0; i<blknum; i+=MB_HASH_BATCH) {
+				uchar_t *cks[MB_HASH_BATCH], *bufs[MB_HASH_BATCH];
+				uint64_t lens[MB_HASH_BATCH];
+				int j, cnt;
+
+				/*
+				 * Blocks are hashed in batches so that several of them
+				 * can go through the SIMD lanes together.
+				 */
+				cnt = (blknum - i < MB_HASH_BATCH ? blknum - i : MB_HASH_BATCH);
+				for (j=0; j<cnt; j++) {
+					cks[j] = ctx->g_blocks[i+j].cksum;
+					bufs[j] = buf1+ctx->g_blocks[i+j].offset;
+					lens[j] = ctx->g_blocks[i+j].length;
+				}
+				compute_checksum_mb(cks, ctx->arc->chunk_cksum_type,
+					bufs, lens, cnt);
 			}
+			ds->hash_ns += dedupe_clock(timed) - t;
 
 			/*
 			 * Index table within this segment.
@@ -817,23 +2649,72 @@ process_blocks:
 				 *======================================================================
 				 */
 				/*
-				 * Now lookup blocks in index. First wait for our semaphore to be
-				 * signaled. If the previous thread in sequence is using the index
-				 * it will finish and then signal our semaphore. So we can have
-				 * predictable serialization of index access in a sequence of
-				 * threads without locking.
+				 * Threads first insert all blocks of their chunk into the index
+				 * concurrently, then wait for all data before the chunk to be
+				 * inserted and look the blocks up. An entry always holds the
+				 * first occurrence of a block in the file seen so far, so a
+				 * block is a duplicate if its entry lies before it. This finds
+				 * the same matches as serialized index access in chunk sequence.
+				 */
+				/*
+				 * A windowed index is only a lock away. Threads use it in whatever
+				 * order they get there, so a match can come from a later chunk
+				 * than this one. Only matches that lie before the current block,
+				 * within the window and within the restore group are used, which keeps all references
+				 * backward as decompression requires. Other matches are taken
+				 * over by the current block.
 				 */
 				length = 0;
+				memset(&ist, 0, sizeof (ist));
+				t = dedupe_clock(timed);
+				if (timed)
+					pc_perf_read(pv);
 				DEBUG_STAT_EN(w1 = get_wtime_millis());
-				Sem_Wait(ctx->index_sem);
+				if (ctx->arc->window_sz) {
+					pthread_mutex_lock(&window_lock);
+				} else {
+					for (i=0; i<blknum; i++) {
+						db_insert_mt_s(ctx->arc, ctx->g_blocks[i].cksum,
+						    ctx->file_offset + ctx->g_blocks[i].offset,
+						    ctx->g_blocks[i].length, &ist);
+					}
+					db_insert_done_s(ctx->arc, ctx->file_offset,
+					    ctx->file_offset + *size);
+					if (db_insert_wait_s(ctx->arc, ctx->file_offset) == -1) {
+						ctx->valid = 0;
+						return (0);
+					}
+				}
 				DEBUG_STAT_EN(w2 = get_wtime_millis());
 				for (i=0; i<blknum; i++) {
 					hash_entry_t *he;
-
-					he = db_lookup_insert_s(ctx->arc, ctx->g_blocks[i].cksum, 0,
-						ctx->file_offset + ctx->g_blocks[i].offset,
-						ctx->g_blocks[i].length, 1);
-					if (!he) {
+					uint64_t cur, moff;
+					int found;
+
+					cur = ctx->file_offset + ctx->g_blocks[i].offset;
+					found = 0;
+					if (ctx->arc->window_sz) {
+						he = db_lookup_insert_s(ctx->arc, ctx->g_blocks[i].cksum, 0,
+							cur, ctx->g_blocks[i].length, 1, &ist);
+						if (he && (he->item_offset >= cur ||
+						    he->item_offset < ctx->group_floor ||
+						    cur - he->item_offset > ctx->arc->window_sz)) {
+							he->item_offset = cur;
+							he = NULL;
+						}
+						if (he) {
+							found = 1;
+							moff = he->item_offset;
+						}
+					} else if (db_lookup_mt_s(ctx->arc, ctx->g_blocks[i].cksum,
+					    ctx->g_blocks[i].length, &moff) && moff < cur) {
+						found = 1;
+					} else if (db_base_lookup_s(ctx->arc, ctx->g_blocks[i].cksum,
+					    ctx->g_blocks[i].length, &moff)) {
+						moff |= GLOBAL_BASE_REF;
+						found = 1;
+					}
+					if (!found) {
 						/*
 						 * Block match in index not found.
 						 * Block was added to index. Merge this block.
@@ -862,20 +2743,27 @@ process_blocks:
 						/*
 						 * Add a reference entry to the dedupe array.
 						 */
-						U32_P(g_dedupe_idx) = LE32((he->item_size | RABIN_INDEX_FLAG) &
-							CLEAR_SIMILARITY_FLAG);
+						U32_P(g_dedupe_idx) = LE32((ctx->g_blocks[i].length |
+							RABIN_INDEX_FLAG) & CLEAR_SIMILARITY_FLAG);
 						g_dedupe_idx += RABIN_ENTRY_SIZE;
-						U64_P(g_dedupe_idx) = LE64(he->item_offset);
+						U64_P(g_dedupe_idx) = LE64(moff);
 						g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
-						matchlen += he->item_size;
+						matchlen += ctx->g_blocks[i].length;
 						dedupe_index_sz += 3;
+						ds->global++;
+						ds->global_bytes += ctx->g_blocks[i].length;
 					}
 				}
-
-				/*
-				 * Signal the next thread in sequence to access the index.
-				 */
-				Sem_Post(ctx->index_sem_next);
+				if (ctx->arc->window_sz)
+					pthread_mutex_unlock(&window_lock);
+				ds->index_ns += dedupe_clock(timed) - t;
+				if (timed)
+					pc_perf_add(ds->index_pmu, pv);
+				ds->lookups += blknum;
+				ds->hits += ds->global;
+				ds->evict += ist.evict;
+				ds->evict_lost += ist.lost;
+				ds->evict_lost_bytes += ist.lost_bytes;
 
 				/*
 				 * Write final pending block length value (if any).
@@ -897,7 +2785,7 @@ process_blocks:
 			} else {
 				uchar_t *seg_heap, *sim_ck, *sim_offsets;
 				archive_config_t *cfg;
-				uint32_t len, blks, o_blks, k;
+				uint32_t blks, o_blks, k, nsegs;
 				global_blockentry_t *seg_blocks;
 				uint64_t seg_offset, offset;
 				global_blockentry_t **htab, *be;
@@ -918,96 +2806,63 @@ process_blocks:
 				src = sim_offsets;
 				ary_sz = cfg->segment_sz * sizeof (global_blockentry_t **);
 				htab = (global_blockentry_t **)(src - ary_sz);
+
+				/*
+				 * Sketch all the segments of the chunk at once, concurrently,
+				 * before waiting for the shared index.
+				 */
+				nsegs = (blknum + cfg->segment_sz - 1) / cfg->segment_sz;
+				t = dedupe_clock(timed);
+#if defined(_OPENMP)
+#	pragma omp parallel for if (mt && nsegs > 1)
+#endif
+				for (k = 0; k < nsegs; k++) {
+					uint32_t first, n;
+
+					first = k * cfg->segment_sz;
+					n = cfg->segment_sz;
+					if (n > blknum - first) n = blknum - first;
+					ctx->sketch_len[k] = segment_sketch(&(ctx->g_blocks[first]), n,
+					    cfg->chunk_cksum_sz, (uint64_t *)(ctx->similarity_cksums) +
+					    (uint64_t)k * cfg->sub_intervals, cfg->sub_intervals);
+				}
+				ds->match_ns += dedupe_clock(timed) - t;
+
 				for (i=0; i<blknum;) {
 					uint64_t crc, off1;
-					uint64_t a, b;
-					length = 0;
 
 					/*
 					 * Compute length of current segment.
 					 */
 					blks = cfg->segment_sz;
 					if (blks > blknum-i) blks = blknum-i;
-					length = 0;
-					tgt = seg_heap;
-#ifdef	__USE_SSE_INTRIN__
-					if ((cfg->chunk_cksum_sz & 15) == 0) {
-						for (j=0; j<blks; j++) {
-							__m128i s;
-							uchar_t *sc;
-							k = cfg->chunk_cksum_sz;
-							sc = ctx->g_blocks[j+i].cksum;
-
-							/*
-							 * Use SSE2 to copy 16 bytes at a time avoiding a call
-							 * to memcpy() since hash sizes are typically multiple
-							 * of 16 bytes: 256-bit or 512-bit.
-							 */
-							while (k > 0) {
-								s = _mm_loadu_si128((__m128i *)sc);
-								_mm_storeu_si128((__m128i *)tgt, s);
-								tgt += 16;
-								sc += 16;
-								k -= 16;
-							}
-							length += cfg->chunk_cksum_sz;
-						}
-					} else {
-#else
-					{
-#endif
-						for (j=0; j<blks; j++) {
-							memcpy(tgt, ctx->g_blocks[j+i].cksum, cfg->chunk_cksum_sz);
-							length += cfg->chunk_cksum_sz;
-							tgt += cfg->chunk_cksum_sz;
-						}
-					}
 					U32_P(src) = blks;
 					src += sizeof (blks);
-					blks = j+i;
-
-					/*
-					 * Assume the concatenated chunk hash buffer as an array of 64-bit
-					 * integers and sort them in ascending order.
-					 */
-					do_qsort((uint64_t *)seg_heap, length/8);
-
-					/*
-					 * Compute the K min values sketch where K == 20 in this case.
-					 */
-					sim_ck = ctx->similarity_cksums;
-					tgt = seg_heap;
-					sub_i = 0;
-
-					U64_P(sim_ck) = 0;
-					a = 0;
-					for (j = 0; j < length && sub_i < cfg->sub_intervals;) {
-						b = U64_P(tgt);
-						tgt += sizeof (uint64_t);
-						j += sizeof (uint64_t);
-						if (b != a) {
-							U64_P(sim_ck) = b;
-							sim_ck += sizeof (uint64_t);
-							a = b;
-							sub_i++;
-						}
-					}
+					sim_ck = ctx->similarity_cksums + (uint64_t)(i / cfg->segment_sz) *
+					    cfg->sub_intervals * sizeof (uint64_t);
+					sub_i = ctx->sketch_len[i / cfg->segment_sz];
+					blks += i;
 
 					/*
 					 * Begin shared index access and write segment metadata to cache
 					 * first.
 					 */
+					t = dedupe_clock(timed);
+					if (timed)
+						pc_perf_read(pv);
 					if (i == 0) {
+						uint64_t tw = pc_trace_start();
+
 						DEBUG_STAT_EN(w1 = get_wtime_millis());
-						Sem_Wait(ctx->index_sem);
+						Hsem_Wait(ctx->index_sem);
 						DEBUG_STAT_EN(w2 = get_wtime_millis());
+						pc_trace_end("index_wait", tw, 0);
 					}
 
 					seg_offset = db_segcache_pos(cfg, ctx->id);
-					len = (blks-i) * sizeof (global_blockentry_t);
-					if (db_segcache_write(cfg, ctx->id, (uchar_t *)&(ctx->g_blocks[i]),
-					    len, blks-i, ctx->file_offset) == -1) {
-						Sem_Post(ctx->index_sem_next);
+					if (db_segcache_write(cfg, ctx->id, &(ctx->g_blocks[i]),
+					    blks-i, ctx->file_offset) == -1) {
+						Hsem_Post(ctx->index_sem_next);
 						ctx->valid = 0;
 						return (0);
 					}
@@ -1017,23 +2872,18 @@ process_blocks:
 					 * The matching segment offsets in the segcache are stored in a list. Entries
 					 * that were not found are stored with offset of UINT64_MAX.
 					 */
-					sim_ck = ctx->similarity_cksums;
 					tgt = src + 1; // One byte for number of entries
 					crc = 0;
 					off1 = UINT64_MAX;
 					k = 0;
+					memset(&ist, 0, sizeof (ist));
 
-					for (j=0; j < sub_i; j++) {
-						hash_entry_t *he = NULL;
-						he = db_lookup_insert_s(cfg, sim_ck, 0, seg_offset, 0, 1);
-						if (he) {
-							U64_P(tgt) = he->item_offset;
-						} else {
-							U64_P(tgt) = UINT64_MAX;
-						}
-						sim_ck += cfg->similarity_cksum_sz;
-						tgt += cfg->similarity_cksum_sz;
-					}
+					ds->hits += db_lookup_insert_batch_s(cfg, sim_ck, sub_i, seg_offset,
+					    tgt, &ist);
+					ds->lookups += sub_i;
+					ds->evict += ist.evict;
+					ds->evict_lost += ist.lost;
+					ds->evict_lost_bytes += ist.lost_bytes;
 
 					/*
 					 * At this point we have a list of segment offsets from the segcache
@@ -1059,12 +2909,33 @@ process_blocks:
 					*src = k; // Number of entries
 					src = tgt;
 					i = blks;
+					ds->index_ns += dedupe_clock(timed) - t;
+					if (timed)
+						pc_perf_add(ds->index_pmu, pv);
 				}
 
 				/*
 				 * Signal the next thread in sequence to access the index.
 				 */
-				Sem_Post(ctx->index_sem_next);
+				Hsem_Post(ctx->index_sem_next);
+				t = dedupe_clock(timed);
+
+				/*
+				 * Get the kernel reading in all the matching segment metadata
+				 * up front so that the I/O overlaps the in-segment dedupe below.
+				 */
+				src = sim_offsets;
+				for (i=0; i<blknum;) {
+					blks = U32_P(src) + i;
+					src += sizeof (blks);
+					sub_i = *src;
+					src++;
+					for (j=0; j < sub_i; j++) {
+						db_segcache_prefetch(cfg, ctx->id, U64_P(src));
+						src += cfg->similarity_cksum_sz;
+					}
+					i = blks;
+				}
 
 				/*
 				 * Now go through all the matching segments for all the current segments
@@ -1223,8 +3094,11 @@ next_ent:
 						g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
 						matchlen += (ctx->g_blocks[i].length & RABIN_INDEX_VALUE);
 						dedupe_index_sz += 3;
+						ds->global++;
+						ds->global_bytes += (ctx->g_blocks[i].length & RABIN_INDEX_VALUE);
 					}
 				}
+				ds->match_ns += dedupe_clock(timed) - t;
 
 				/*
 				 * Write final pending block length value (if any).
@@ -1244,6 +3118,18 @@ next_ent:
 				g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
 			}
 
+			/*
+			 * Look for long repeats at any alignment in the literal runs.
+			 */
+			if (ldm_tab != NULL && ldm_fd != -1) {
+				t = dedupe_clock(timed);
+				blknum = dedupe_long_match(ctx, buf1, g_dedupe_idx, blknum - 2,
+				    &matchlen, ds) + 2;
+				dedupe_index_sz = blknum * RABIN_ENTRY_SIZE;
+				tgt = ctx->cbuf + RABIN_HDR_SIZE + dedupe_index_sz;
+				ds->match_ns += dedupe_clock(timed) - t;
+			}
+
 			/*
 			 * Deduplication reduction should at least be greater than block list metadata.
 			 */
@@ -1289,125 +3175,195 @@ next_ent:
 		 * Compute hash signature for each block. We do this in a separate loop to 
 		 * have a fast linear scan through the buffer.
 		 */
-		if (ctx->delta_flag) {
+		t = dedupe_clock(timed);
 #if defined(_OPENMP)
 #	pragma omp parallel for if (mt)
 #endif
-			for (i=0; i<blknum; i++) {
-				ctx->blocks[i]->hash = XXH32(buf1+ctx->blocks[i]->offset,
-								ctx->blocks[i]->length, 0);
+		for (i=0; i<blknum; i+=MB_HASH_BATCH) {
+			const void *bp[MB_HASH_BATCH];
+			int j, cnt;
+
+			/*
+			 * Hash in batches so that several blocks go through the
+			 * SIMD lanes together.
+			 */
+			cnt = (blknum - i < MB_HASH_BATCH ? blknum - i : MB_HASH_BATCH);
+			if (ctx->zero_blocks) {
+				uint32_t bl[MB_HASH_BATCH], bh[MB_HASH_BATCH], bi[MB_HASH_BATCH];
+				int n = 0;
+
+				/*
+				 * Zero fixed blocks are flagged and left out of the
+				 * batch.
+				 */
+				for (j=0; j<cnt; j++) {
+					if (bt->length[i+j] == ctx->rabin_poly_avg_block_size &&
+					    dedupe_zero_block(buf1+bt->offset[i+j], bt->length[i+j])) {
+						bt->similar[i+j] = SIMILAR_ZERO;
+						bt->hash[i+j] = ctx->zero_hash;
+						continue;
+					}
+					bp[n] = buf1+bt->offset[i+j];
+					bl[n] = bt->length[i+j];
+					bi[n] = i+j;
+					n++;
+				}
+				XXH32_bulk(bp, bl, bh, n, 0);
+				for (j=0; j<n; j++)
+					bt->hash[bi[j]] = bh[j];
+				continue;
 			}
-		} else {
+			for (j=0; j<cnt; j++)
+				bp[j] = buf1+bt->offset[i+j];
+			XXH32_bulk(bp, &(bt->length[i]), &(bt->hash[i]), cnt, 0);
+		}
+		if (ctx->delta_flag) {
+			/*
+			 * Also compute the similarity sketch of each block. A trailing block
+			 * that is not longer than the minimum block size is just hashed.
+			 */
 #if defined(_OPENMP)
 #	pragma omp parallel for if (mt)
 #endif
 			for (i=0; i<blknum; i++) {
-				ctx->blocks[i]->hash = XXH32(buf1+ctx->blocks[i]->offset,
-								ctx->blocks[i]->length, 0);
-				ctx->blocks[i]->similarity_hash = ctx->blocks[i]->hash;
+				if (i == blknum - 1 && bt->length[i] <= ctx->rabin_poly_min_block_size)
+					bt->similarity_hash[i] = bt->hash[i];
+				else
+					bt->similarity_hash[i] = dedupe_sketch(buf1+bt->offset[i],
+					    bt->length[i], ctx->sketch_features);
 			}
+		} else if (bt->similarity_hash != bt->hash) {
+			memcpy(bt->similarity_hash, bt->hash, blknum * sizeof (uint32_t));
 		}
 
-		ary_sz = (blknum << 1) * sizeof (rabin_blockentry_t *);
-		htab = (rabin_blockentry_t **)(ctx->cbuf + ctx->real_chunksize - ary_sz);
-		memset(htab, 0, ary_sz);
+		ds->hash_ns += dedupe_clock(timed) - t;
+		t = dedupe_clock(timed);
 
 		/*
-		 * Perform hash-matching of blocks and use a bucket-chained hashtable to match
-		 * for duplicates and similar blocks. Unique blocks are inserted and duplicates
-		 * and similar ones are marked in the block array.
+		 * Size the table to a power of 2 with at least twice as many slots as
+		 * blocks so that probe sequences stay short.
+		 */
+		hmask = 1;
+		while (hmask < (blknum << 1))
+			hmask <<= 1;
+		ary_sz = hmask * sizeof (uint64_t);
+		hmask--;
+		ftab = (uint64_t *)(ctx->cbuf + ctx->real_chunksize - ary_sz);
+		htab = (uint32_t *)ftab;
+		memset(ftab, 0, ary_sz);
+
+		/*
+		 * Perform hash-matching of blocks using an open-addressing hashtable with
+		 * linear probing to match for duplicates and similar blocks. Slots hold
+		 * block number + 1 in the low 32 bits, 0 being an empty slot, and the
+		 * length biased similarity hash of the block in the high 32 bits. Unique
+		 * blocks are inserted and duplicates and similar ones are marked in the
+		 * block table.
+		 *
+		 * Blocks that can match each other have the same similarity hash and
+		 * length, so they share the home slot and are probed in insertion order.
+		 * The fingerprint in the slot lets a probe step over other blocks without
+		 * touching the block table. Matches are still confirmed from the block
+		 * table and by memcmp() of the data.
 		 *
 		 * Hashtable memory is not allocated. We just use available space in the
 		 * target buffer.
 		 */
 		matchlen = 0;
+		zblk = blknum;
 		for (i=0; i<blknum; i++) {
 			uint64_t ck;
+			uint32_t sim;
+
+			/*
+			 * Zero blocks after the first one are duplicates of it and
+			 * need no lookup.
+			 */
+			if (ctx->zero_blocks && bt->similar[i] == SIMILAR_ZERO) {
+				if (zblk < blknum) {
+					bt->similar[i] = SIMILAR_EXACT;
+					bt->other[i] = zblk;
+					bt->similar[zblk] = SIMILAR_REF;
+					matchlen += bt->length[i];
+					ds->exact++;
+					ds->exact_bytes += bt->length[i];
+					continue;
+				}
+				zblk = i;
+			}
 
 			/*
 			 * Bias hash with length for fewer collisions. If Delta Compression is
 			 * not enabled then value of similarity_hash == hash.
 			 */
-			ck = ctx->blocks[i]->similarity_hash;
-			ck ^= (ck / ctx->blocks[i]->length);
-			j = ck % (blknum << 1);
-
-			if (htab[j] == 0) {
-				/*
-				 * Hash bucket empty. So add block into table.
-				 */
-				htab[j] = ctx->blocks[i];
-				ctx->blocks[i]->other = 0;
-				ctx->blocks[i]->next = 0;
-				ctx->blocks[i]->similar = 0;
-			} else {
-				be = htab[j];
-				length = 0;
+			ck = bt->similarity_hash[i];
+			ck = (uint32_t)(ck ^ (ck / bt->length[i]));
+			j = ck & hmask;
+			bt->similar[i] = 0;
+			sim = 0;
+			length = 0;
 
-				/*
-				 * Look for exact duplicates. Same cksum, length and memcmp()
-				 */
-				while (1) {
-					if (be->hash == ctx->blocks[i]->hash &&
-					    be->length == ctx->blocks[i]->length &&
-					    memcmp(buf1 + be->offset, buf1 + ctx->blocks[i]->offset,
-					    be->length) == 0) {
-						ctx->blocks[i]->similar = SIMILAR_EXACT;
-						ctx->blocks[i]->other = be;
-						be->similar = SIMILAR_REF;
-						matchlen += be->length;
-						length = 1;
-						break;
-					}
-					if (be->next)
-						be = be->next;
-					else
-						break;
+			/*
+			 * Look for exact duplicates. Same cksum, length and memcmp().
+			 * Remember the first similar block on the way.
+			 */
+			while (ftab[j] != 0) {
+				if ((ftab[j] >> 32) != ck) {
+					j = (j + 1) & hmask;
+					DEBUG_STAT_EN(++hash_collisions);
+					continue;
 				}
-
-				if (ctx->delta_flag && !length) {
-					/*
-					 * Look for similar blocks.
-					 */
-					be = htab[j];
-					while (1) {
-						if (be->similarity_hash == ctx->blocks[i]->similarity_hash &&
-						    be->length == ctx->blocks[i]->length) {
-							uint64_t off_diff;
-							if (be->offset > ctx->blocks[i]->offset)
-								off_diff = be->offset - ctx->blocks[i]->offset;
-							else
-								off_diff = ctx->blocks[i]->offset - be->offset;
-
-							if (off_diff > ctx->deltac_min_distance) {
-								ctx->blocks[i]->similar = SIMILAR_PARTIAL;
-								ctx->blocks[i]->other = be;
-								be->similar = SIMILAR_REF;
-								matchlen += (be->length>>1);
-								length = 1;
-								break;
-							}
-						}
-						if (be->next)
-							be = be->next;
-						else
-							break;
-					}
+				be = (uint32_t)ftab[j] - 1;
+				if (bt->hash[be] == bt->hash[i] &&
+				    bt->length[be] == bt->length[i] &&
+				    memcmp(buf1 + bt->offset[be], buf1 + bt->offset[i],
+				    bt->length[be]) == 0) {
+					bt->similar[i] = SIMILAR_EXACT;
+					bt->other[i] = be;
+					bt->similar[be] = SIMILAR_REF;
+					matchlen += bt->length[be];
+					length = 1;
+					ds->exact++;
+					ds->exact_bytes += bt->length[be];
+					break;
 				}
-				/*
-				 * No duplicate in table for this block. So add it to
-				 * the bucket chain.
-				 */
-				if (!length) {
-					ctx->blocks[i]->other = 0;
-					ctx->blocks[i]->next = 0;
-					ctx->blocks[i]->similar = 0;
-					be->next = ctx->blocks[i];
-					DEBUG_STAT_EN(++hash_collisions);
+				if (ctx->delta_flag && !sim &&
+				    bt->similarity_hash[be] == bt->similarity_hash[i] &&
+				    bt->length[be] == bt->length[i]) {
+					uint64_t off_diff;
+					if (bt->offset[be] > bt->offset[i])
+						off_diff = bt->offset[be] - bt->offset[i];
+					else
+						off_diff = bt->offset[i] - bt->offset[be];
+
+					if (off_diff > ctx->deltac_min_distance)
+						sim = be + 1;
 				}
+				j = (j + 1) & hmask;
+				DEBUG_STAT_EN(++hash_collisions);
+			}
+
+			if (!length && sim) {
+				be = sim - 1;
+				bt->similar[i] = SIMILAR_PARTIAL;
+				bt->other[i] = be;
+				bt->similar[be] = SIMILAR_REF;
+				matchlen += (bt->length[be]>>1);
+				length = 1;
+				ds->similar++;
 			}
+
+			/*
+			 * No duplicate in table for this block. So add it in the empty
+			 * slot that ended the probe.
+			 */
+			if (!length)
+				ftab[j] = (ck << 32) | (i + 1);
 		}
-		DEBUG_STAT_EN(fprintf(stderr, "Total Hashtable bucket collisions: %u\n", hash_collisions));
+		DEBUG_STAT_EN(fprintf(stderr, "Total Hashtable probe collisions: %u\n", hash_collisions));
+		ds->match_ns += dedupe_clock(timed) - t;
+		ds->lookups += blknum;
+		ds->hits += ds->exact + ds->similar;
 
 		dedupe_index_sz = (uint64_t)blknum * RABIN_ENTRY_SIZE;
 		if (matchlen < dedupe_index_sz) {
@@ -1419,28 +3375,43 @@ next_ent:
 			return (0);
 		}
 
+		/*
+		 * Group similar unique blocks if asked to. The order of the data is
+		 * stored after the index, so only do this when the dedupe savings
+		 * cover that as well.
+		 */
+		reorder = (ctx->reorder && matchlen >= (dedupe_index_sz << 1) + RABIN_ENTRY_SIZE);
+		if (reorder) {
+			t = dedupe_clock(timed);
+			dedupe_cluster(ctx, buf1, blknum, htab, hmask, mt);
+			ds->match_ns += dedupe_clock(timed) - t;
+		}
+
 		dedupe_index = (uint32_t *)(ctx->cbuf + RABIN_HDR_SIZE);
 		pos = 0;
 		DEBUG_STAT_EN(merge_count = 0);
 
 		/*
 		 * Merge runs of unique blocks into a single block entry to reduce
-		 * dedupe index size.
+		 * dedupe index size. Blocks of a cluster keep entries of their own.
 		 */
 		for (i=0; i<blknum;) {
 			dedupe_index[pos] = i;
-			ctx->blocks[i]->index = pos;
+			bt->index[i] = pos;
 			++pos;
 			length = 0;
 			j = i;
-			if (ctx->blocks[i]->similar == 0) {
-				while (i< blknum && ctx->blocks[i]->similar == 0 &&
+			if (bt->similar[i] == 0) {
+				while (i< blknum && bt->similar[i] == 0 &&
 				   length < RABIN_MAX_BLOCK_SIZE) {
-					length += ctx->blocks[i]->length;
+					length += bt->length[i];
 					++i;
 					DEBUG_STAT_EN(++merge_count);
+					if (reorder && (bt->hash[j] != 0 ||
+					    (i < blknum && bt->hash[i] != 0)))
+						break;
 				}
-				ctx->blocks[j]->length = length;
+				bt->length[j] = length;
 			} else {
 				++i;
 			}
@@ -1452,44 +3423,69 @@ next_ent:
 		 */
 		blknum = pos;
 		dedupe_index_sz = (uint64_t)blknum * RABIN_ENTRY_SIZE;
+		ord = NULL;
+		nperm = 0;
+		if (reorder) {
+			/*
+			 * The data order goes after the index, followed by its length.
+			 * The similarity hashes are no longer needed, so they hold
+			 * the order of all entries while the data is copied.
+			 */
+			ord = bt->similarity_hash;
+			nperm = dedupe_cluster_order(bt, dedupe_index, blknum, ord);
+			for (x=0; x<nperm; x++)
+				dedupe_index[blknum + x] = htonl(ord[x]);
+			dedupe_index[blknum + nperm] = htonl(nperm);
+			dedupe_index_sz += (uint64_t)(nperm + 1) * RABIN_ENTRY_SIZE;
+		}
 		pos1 = dedupe_index_sz + RABIN_HDR_SIZE;
 		matchlen = ctx->real_chunksize - *size;
-		for (i=0; i<blknum; i++) {
-			be = ctx->blocks[dedupe_index[i]];
-			if (be->similar == 0 || be->similar == SIMILAR_REF) {
+		for (x=0; x<blknum; x++) {
+			i = (ord ? ord[x] : x);
+			be = dedupe_index[i];
+			if (bt->similar[be] == 0 || bt->similar[be] == SIMILAR_REF) {
 				/* Just copy. */
-				dedupe_index[i] = htonl(be->length);
-				memcpy(ctx->cbuf + pos1, buf1 + be->offset, be->length);
-				pos1 += be->length;
+				dedupe_index[i] = htonl(bt->length[be]);
+				memcpy(ctx->cbuf + pos1, buf1 + bt->offset[be], bt->length[be]);
+				pos1 += bt->length[be];
 			} else {
-				if (be->similar == SIMILAR_EXACT) {
-					dedupe_index[i] = htonl((be->other->index | RABIN_INDEX_FLAG) &
+				uint32_t other = bt->other[be];
+
+				if (bt->similar[be] == SIMILAR_EXACT) {
+					dedupe_index[i] = htonl((bt->index[other] | RABIN_INDEX_FLAG) &
 					    CLEAR_SIMILARITY_FLAG);
 				} else {
 					uchar_t *oldbuf, *newbuf;
 					int32_t bsz;
 					/*
-					 * Perform bsdiff.
+					 * Perform delta encoding.
 					 */
-					oldbuf = buf1 + be->other->offset;
-					newbuf = buf1 + be->offset;
+					oldbuf = buf1 + bt->offset[other];
+					newbuf = buf1 + bt->offset[be];
 					DEBUG_STAT_EN(++delta_calls);
 
-					bsz = bsdiff(oldbuf, be->other->length, newbuf, be->length,
-					    ctx->cbuf + pos1, buf1 + *size, matchlen);
+					t = dedupe_clock(timed);
+					bsz = dedupe_delta(ctx, oldbuf, bt->length[other], newbuf,
+					    bt->length[be], ctx->cbuf + pos1, buf1 + *size, matchlen);
+					ds->delta_ns += dedupe_clock(timed) - t;
 					if (bsz == 0) {
+						ds->delta_fail++;
 						DEBUG_STAT_EN(++delta_fails);
-						memcpy(ctx->cbuf + pos1, newbuf, be->length);
-						dedupe_index[i] = htonl(be->length);
-						pos1 += be->length;
+						memcpy(ctx->cbuf + pos1, newbuf, bt->length[be]);
+						dedupe_index[i] = htonl(bt->length[be]);
+						pos1 += bt->length[be];
 					} else {
-						dedupe_index[i] = htonl(be->other->index |
+						dedupe_index[i] = htonl(bt->index[other] |
 						    RABIN_INDEX_FLAG | SET_SIMILARITY_FLAG);
 						pos1 += bsz;
+						ds->delta++;
+						ds->delta_bytes += bt->length[be] - bsz;
 					}
 				}
 			}
 		}
+		if (reorder)
+			blknum = (blknum + nperm + 1) | RABIN_REORDER_FLAG;
 
 dedupe_done:
 		if (valid) {
@@ -1520,6 +3516,40 @@ dedupe_done:
 	return (0);
 }
 
+/*
+ * Dedupe a chunk and account the outcome. Counters of the chunk go to
+ * ctx->stats if set and are shown with the chunk display.
+ */
+uint32_t
+dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t offset,
+		uint64_t *rabin_pos, int mt)
+{
+	struct pc_dedupe_stat ds;
+	uint64_t insz;
+	uint32_t rv;
+	int timed;
+
+	memset(&ds, 0, sizeof (ds));
+	timed = (ctx->stats != NULL || ctx->show_chunks);
+	insz = *size;
+	rv = dedupe_compress_blocks(ctx, buf, size, offset, rabin_pos, mt, &ds, timed);
+	if (rabin_pos || !timed)
+		return (rv);
+
+	ds.chunks = 1;
+	ds.bytes_in = insz;
+	ds.bytes_out = insz;
+	if (ctx->valid) {
+		ds.deduped = 1;
+		ds.bytes_out = *size;
+	}
+	if (ctx->stats != NULL)
+		pc_dedupe_stat_add(ctx->stats, &ds);
+	if (ctx->show_chunks)
+		pc_dedupe_stat_print(&ds);
+	return (rv);
+}
+
 void
 update_dedupe_hdr(uchar_t *buf, uint64_t dedupe_index_sz_cmp, uint64_t dedupe_data_sz_cmp)
 {
@@ -1543,20 +3573,192 @@ parse_dedupe_hdr(uchar_t *buf, uint32_t *blknum, uint64_t *dedupe_index_sz,
 
 	entries = (uint64_t *)buf;
 	*dedupe_data_sz = ntohll(entries[0]);
-	*dedupe_index_sz = (uint64_t)(*blknum & CLEAR_GLOBAL_FLAG) * RABIN_ENTRY_SIZE;
-	*dedupe_index_sz_cmp =  ntohll(entries[1]);
+	if (*blknum & GLOBAL_FLAG)
+		*dedupe_index_sz = (uint64_t)(*blknum & CLEAR_GLOBAL_FLAG) * RABIN_ENTRY_SIZE;
+	else
+		*dedupe_index_sz = (uint64_t)(*blknum & RABIN_INDEX_VALUE) * RABIN_ENTRY_SIZE;
+	*dedupe_index_sz_cmp =  ntohll(entries[1]) & RABIN_INDEX_CODED_VALUE;
 	*deduped_size = ntohll(entries[2]);
 	*dedupe_data_sz_cmp = ntohll(entries[3]);
 }
 
+int
+dedupe_hdr_index_coded(uchar_t *buf)
+{
+	uint64_t *entries;
+
+	entries = (uint64_t *)(buf + sizeof (uint32_t));
+	return ((ntohll(entries[1]) & RABIN_INDEX_CODED) != 0);
+}
+
+/*
+ * Index coder. The index is an array of big endian 32-bit words: block
+ * lengths, and back references with the top bit set. The top two bits of
+ * every word are packed four to a byte. The low 30 bits are coded as the
+ * zigzag delta to the previous word of the same kind, length or reference,
+ * in little endian base 128. Equal lengths from fixed size chunking and
+ * runs of consecutive references then take one byte per word. This works
+ * for any word array, so the global dedupe offsets and the reorder table
+ * need no special handling.
+ *
+ * The first byte gives the method. With DEDUPE_IDX_LZ4 the varint stream
+ * is followed by LZ4 and its length is stored before the LZ4 data.
+ */
+#define	DEDUPE_IDX_VARINT	0
+#define	DEDUPE_IDX_LZ4		1
+#define	DEDUPE_IDX_LZ4_MIN	256
+#define	DEDUPE_IDX_LZ4_MAX	(0x7E000000ULL)
+
+static uint64_t
+dedupe_index_varint(uchar_t *src, uint64_t nwords, uchar_t *dst, uint64_t dstlen)
+{
+	uint32_t prev[2], w, v, d;
+	uint64_t i, pos, fbytes;
+	int32_t s;
+	int cls;
+
+	fbytes = (nwords + 3) / 4;
+	if (fbytes > dstlen)
+		return (0);
+	memset(dst, 0, fbytes);
+	pos = fbytes;
+	prev[0] = prev[1] = 0;
+	for (i = 0; i < nwords; i++) {
+		w = ntohl(U32_P(src + i * RABIN_ENTRY_SIZE));
+		dst[i >> 2] |= (w >> 30) << ((i & 3) * 2);
+		cls = w >> 31;
+		v = w & 0x3fffffffUL;
+		d = v - prev[cls];
+		prev[cls] = v;
+
+		/* Zigzag of the delta taken as a signed 30-bit value. */
+		s = (int32_t)(d << 2) >> 2;
+		d = ((uint32_t)s << 1) ^ (uint32_t)(s >> 31);
+		while (d >= 0x80) {
+			if (pos >= dstlen)
+				return (0);
+			dst[pos++] = (d & 0x7f) | 0x80;
+			d >>= 7;
+		}
+		if (pos >= dstlen)
+			return (0);
+		dst[pos++] = d;
+	}
+	return (pos);
+}
+
+int
+dedupe_index_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t vlen, nwords;
+	uchar_t *vbuf;
+	int clen;
+
+	nwords = srclen / RABIN_ENTRY_SIZE;
+	if (*dstlen < 2)
+		return (-1);
+	vlen = dedupe_index_varint(src, nwords, dst + 1, *dstlen - 1);
+	if (vlen == 0)
+		return (-1);
+	dst[0] = DEDUPE_IDX_VARINT;
+	*dstlen = vlen + 1;
+
+	/*
+	 * Repeated patterns left in the varint stream are taken out by LZ4,
+	 * which keeps decoding fast. It is only kept if it helps.
+	 */
+	if (vlen < DEDUPE_IDX_LZ4_MIN || vlen > DEDUPE_IDX_LZ4_MAX)
+		return (0);
+	vbuf = (uchar_t *)malloc(vlen);
+	if (vbuf == NULL)
+		return (0);
+	memcpy(vbuf, dst + 1, vlen);
+	clen = LZ4_compress_limitedOutput((const char *)vbuf, (char *)(dst + 5), vlen,
+	    vlen - 5);
+	if (clen > 0 && clen + 5 < vlen) {
+		dst[0] = DEDUPE_IDX_LZ4;
+		U32_P(dst + 1) = LE32((uint32_t)vlen);
+		*dstlen = clen + 5;
+	} else {
+		memcpy(dst + 1, vbuf, vlen);
+	}
+	free(vbuf);
+	return (0);
+}
+
+int
+dedupe_index_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t dstlen)
+{
+	uint32_t prev[2], w, v, d;
+	uint64_t i, pos, vlen, nwords, fbytes;
+	uchar_t *vbuf;
+	int cls, shift, rv;
+
+	if (srclen < 1)
+		return (-1);
+	vbuf = NULL;
+	if (src[0] == DEDUPE_IDX_LZ4) {
+		if (srclen < 5)
+			return (-1);
+		vlen = LE32(U32_P(src + 1));
+		if (vlen == 0 || vlen > DEDUPE_IDX_LZ4_MAX)
+			return (-1);
+		vbuf = (uchar_t *)malloc(vlen);
+		if (vbuf == NULL)
+			return (-1);
+		if (LZ4_uncompress_unknownOutputSize((const char *)(src + 5), (char *)vbuf,
+		    srclen - 5, vlen) != (int)vlen) {
+			free(vbuf);
+			return (-1);
+		}
+		src = vbuf;
+	} else if (src[0] == DEDUPE_IDX_VARINT) {
+		src++;
+		vlen = srclen - 1;
+	} else {
+		return (-1);
+	}
+
+	rv = -1;
+	nwords = dstlen / RABIN_ENTRY_SIZE;
+	fbytes = (nwords + 3) / 4;
+	if (fbytes > vlen)
+		goto out;
+	pos = fbytes;
+	prev[0] = prev[1] = 0;
+	for (i = 0; i < nwords; i++) {
+		d = 0;
+		shift = 0;
+		do {
+			if (pos >= vlen || shift > 28)
+				goto out;
+			d |= (uint32_t)(src[pos] & 0x7f) << shift;
+			shift += 7;
+		} while (src[pos++] & 0x80);
+
+		w = (uint32_t)((src[i >> 2] >> ((i & 3) * 2)) & 3) << 30;
+		cls = w >> 31;
+		d = (d >> 1) ^ (0U - (d & 1));
+		v = (prev[cls] + d) & 0x3fffffffUL;
+		prev[cls] = v;
+		U32_P(dst + i * RABIN_ENTRY_SIZE) = htonl(w | v);
+	}
+	if (pos == vlen)
+		rv = 0;
+out:
+	free(vbuf);
+	return (rv);
+}
+
 void
 dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 {
-	uint32_t blknum, blk, oblk, len;
+	uint32_t blknum, blk, oblk, len, x, nperm, *perm;
 	uint32_t *dedupe_index;
 	uint64_t data_sz, sz, indx_cmp, data_sz_cmp, deduped_sz;
 	uint64_t dedupe_index_sz, pos1;
 	uchar_t *pos2;
+	rabin_blocks_t *bt;
 
 	parse_dedupe_hdr(buf, &blknum, &dedupe_index_sz, &data_sz, &indx_cmp, &data_sz_cmp, &deduped_sz);
 	dedupe_index = (uint32_t *)(buf + RABIN_HDR_SIZE);
@@ -1570,7 +3772,7 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	 */
 	if (blknum & GLOBAL_FLAG) {
 		uchar_t *g_dedupe_idx, *src1, *src2;
-		uint64_t adj, offset;
+		uint64_t offset;
 		uint32_t flag;
 
 		blknum &= CLEAR_GLOBAL_FLAG;
@@ -1579,8 +3781,9 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 		g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
 		blknum -= 2;
 		src1 = buf + RABIN_HDR_SIZE + dedupe_index_sz;
+		if (!out_ring)
+			dedupe_plan_reads(ctx, g_dedupe_idx, blknum, offset);
 
-		Sem_Wait(ctx->index_sem);
 		for (blk=0; blk<blknum;) {
 			len = LE32(U32_P(g_dedupe_idx));
 			g_dedupe_idx += RABIN_ENTRY_SIZE;
@@ -1609,26 +3812,44 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 				 * If required data offset is greater than the current segment's starting
 				 * offset then the referenced chunk is already in the current segment in
 				 * RAM. Just mem-copy it.
-				 * Otherwise it will be in the current output file. We mmap() the relevant
-				 * region and copy it. The way deduplication is done it is guaranteed that
-				 * all duplicate references will be backward references so this approach works.
+				 * Otherwise it will be in the current output file. We wait till the writer
+				 * has written it out and copy it from the shared extent mappings. The way
+				 * deduplication is done it is guaranteed that all duplicate references will
+				 * be backward references so this approach works. Chunks only wait for the
+				 * data they reference, not for the previous chunk.
 				 * 
-				 * However this approach precludes pipe-mode streamed decompression since
-				 * it requires random access to the output file.
+				 * In pipe mode the output cannot be mapped. Files compressed with a
+				 * dedupe window only reference the window before the chunk, which is
+				 * kept in the output ring.
 				 */
-				if (pos1 >= offset) {
+				if (pos1 & GLOBAL_BASE_REF) {
+					pos1 &= ~GLOBAL_BASE_REF;
+					if (pos1 > base_len || len > base_len - pos1) {
+						log_msg(LOG_ERR, 0, "Reference beyond end of base file.\n");
+						ctx->valid = 0;
+						break;
+					}
+					memcpy(pos2, base_map + pos1, len);
+				} else if (pos1 >= offset) {
 					src2 = ctx->cbuf + (pos1 - offset);
 					memcpy(pos2, src2, len);
 				} else {
-					adj = pos1 % ctx->pagesize;
-					src2 = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, ctx->out_fd, pos1 - adj);
-					if (src2 == NULL) {
+					if (dedupe_wait_durable(pos1 + len) == -1) {
+						ctx->valid = 0;
+						break;
+					}
+					if (out_ring) {
+						if (dedupe_ring_copy(pos2, pos1, len, offset) == -1) {
+							log_msg(LOG_ERR, 0, "Reference beyond the "
+							    "dedupe window.\n");
+							ctx->valid = 0;
+							break;
+						}
+					} else if (dedupe_map_copy(ctx, pos2, pos1, len) == -1) {
 						log_msg(LOG_ERR, 1, "MMAP failed ");
 						ctx->valid = 0;
 						break;
 					}
-					memcpy(pos2, src2 + adj, len);
-					munmap(src2, len + adj);
 				}
 				pos2 += len;
 				sz += len;
@@ -1643,53 +3864,95 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	 * First pass re-create the rabin block array from the index metadata.
 	 * Second pass copy over blocks to the target buffer to re-create the original segment.
 	 */
-	slab_cache_add(sizeof (rabin_blockentry_t));
+	bt = &ctx->blocks;
+	perm = NULL;
+	nperm = 0;
+	if (blknum & RABIN_REORDER_FLAG) {
+		/*
+		 * The data of the entries is stored in the order that follows the
+		 * index. Find the data offsets in that order first.
+		 */
+		blknum &= RABIN_INDEX_VALUE;
+		nperm = (blknum > 0 ? ntohl(dedupe_index[blknum - 1]) : UINT32_MAX);
+		if (nperm >= blknum) {
+			log_msg(LOG_ERR, 0, "Invalid dedupe data order.\n");
+			ctx->valid = 0;
+			return;
+		}
+		blknum -= nperm + 1;
+		perm = dedupe_index + blknum;
+		for (x = 0; x < nperm; x++) {
+			blk = ntohl(perm[x]);
+			len = (blk < blknum ? ntohl(dedupe_index[blk]) : RABIN_INDEX_FLAG);
+			if ((len & RABIN_INDEX_FLAG) && !(len & GET_SIMILARITY_FLAG)) {
+				log_msg(LOG_ERR, 0, "Invalid dedupe data order.\n");
+				ctx->valid = 0;
+				return;
+			}
+			bt->offset[blk] = pos1;
+			if (len & RABIN_INDEX_FLAG)
+				pos1 += dedupe_delta_sz(buf + pos1);
+			else
+				pos1 += len;
+		}
+	}
 	for (blk = 0; blk < blknum; blk++) {
-		if (ctx->blocks[blk] == 0)
-			ctx->blocks[blk] = (rabin_blockentry_t *)slab_alloc(NULL, sizeof (rabin_blockentry_t));
 		len = ntohl(dedupe_index[blk]);
-		ctx->blocks[blk]->hash = 0;
+		bt->hash[blk] = 0;
 		if (len == 0) {
-			ctx->blocks[blk]->hash = 1;
+			bt->hash[blk] = 1;
 
 		} else if (!(len & RABIN_INDEX_FLAG)) {
-			ctx->blocks[blk]->length = len;
-			ctx->blocks[blk]->offset = pos1;
-			pos1 += len;
+			bt->length[blk] = len;
+			if (!perm) {
+				bt->offset[blk] = pos1;
+				pos1 += len;
+			} else {
+				--nperm;
+			}
 		} else {
 			bsize_t blen;
 
-			ctx->blocks[blk]->length = 0;
+			bt->length[blk] = 0;
 			if (len & GET_SIMILARITY_FLAG) {
-				ctx->blocks[blk]->offset = pos1;
-				ctx->blocks[blk]->index = (len & RABIN_INDEX_VALUE) | SET_SIMILARITY_FLAG;
-				blen = get_bsdiff_sz(buf + pos1);
-				pos1 += blen;
+				bt->index[blk] = (len & RABIN_INDEX_VALUE) | SET_SIMILARITY_FLAG;
+				if (!perm) {
+					bt->offset[blk] = pos1;
+					blen = dedupe_delta_sz(buf + pos1);
+					pos1 += blen;
+				} else {
+					--nperm;
+				}
 			} else {
-				ctx->blocks[blk]->index = len & RABIN_INDEX_VALUE;
+				bt->index[blk] = len & RABIN_INDEX_VALUE;
 			}
 		}
 	}
+	if (nperm != 0) {
+		log_msg(LOG_ERR, 0, "Invalid dedupe data order.\n");
+		ctx->valid = 0;
+		return;
+	}
 
 	for (blk = 0; blk < blknum; blk++) {
 		int rv;
 		bsize_t newsz;
 
-		if (ctx->blocks[blk]->hash == 1) continue;
-		if (ctx->blocks[blk]->length > 0) {
-			len = ctx->blocks[blk]->length;
-			pos1 = ctx->blocks[blk]->offset;
+		if (bt->hash[blk] == 1) continue;
+		if (bt->length[blk] > 0) {
+			len = bt->length[blk];
+			pos1 = bt->offset[blk];
 		} else {
-			oblk = ctx->blocks[blk]->index;
+			oblk = bt->index[blk];
 
 			if (oblk & GET_SIMILARITY_FLAG) {
 				oblk = oblk & CLEAR_SIMILARITY_FLAG;
-				len = ctx->blocks[oblk]->length;
-				pos1 = ctx->blocks[oblk]->offset;
+				len = bt->length[oblk];
+				pos1 = bt->offset[oblk];
 				newsz = data_sz - sz;
-				rv = bspatch(buf + ctx->blocks[blk]->offset, buf + pos1, len, pos2, &newsz);
+				rv = dedupe_patch(buf + bt->offset[blk], buf + pos1, len, pos2, &newsz);
 				if (rv == 0) {
-					log_msg(LOG_ERR, 0, "Failed to bspatch block.\n");
+					log_msg(LOG_ERR, 0, "Failed to patch delta block.\n");
 					ctx->valid = 0;
 					break;
 				}
@@ -1702,8 +3965,8 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 				}
 				continue;
 			} else {
-				len = ctx->blocks[oblk]->length;
-				pos1 = ctx->blocks[oblk]->offset;
+				len = bt->length[oblk];
+				pos1 = bt->offset[oblk];
 			}
 		}
 		memcpy(pos2, buf + pos1, len);
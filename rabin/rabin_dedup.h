@@ -66,6 +66,7 @@
 #include <utils.h>
 #include <index.h>
 #include <crypto_utils.h>
+#include <pc_stats.h>
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -93,6 +94,11 @@
 #define	RAB_MIN_CHUNK_SIZE (1048576L)
 #define	RAB_MIN_CHUNK_SIZE_GLOBAL (2097152L)
 
+// Largest Global Dedupe window in chunks, and the default window in bytes
+// in pipe mode.
+#define	DEDUPE_WINDOW_MAX	1024
+#define	DEDUPE_PIPE_WINDOW	(256ULL * 1024 * 1024)
+
 // An entry in the Rabin block array in the chunk.
 // It is either a length value <= RABIN_MAX_BLOCK_SIZE or an index value with
 // which this block is a duplicate/similar. The entries are variable sized.
@@ -125,11 +131,35 @@
 #define	CLEAR_SIMILARITY_FLAG (0xBFFFFFFFUL)
 #define	GLOBAL_FLAG RABIN_INDEX_FLAG
 #define	CLEAR_GLOBAL_FLAG (0x7fffffffUL)
+// Global Dedupe reference offsets with the MSB set point into the base file.
+#define	GLOBAL_BASE_REF (0x8000000000000000ULL)
+// Block count flag of a segmented dedupe chunk whose data is stored reordered.
+// The index is followed by the order of the entries with data and its length.
+#define	RABIN_REORDER_FLAG (0x40000000UL)
+// Compressed index size flag of a chunk whose index is stored with the
+// index coder below instead of LZMA.
+#define	RABIN_INDEX_CODED (0x8000000000000000ULL)
+#define	RABIN_INDEX_CODED_VALUE (0x7fffffffffffffffULL)
 
 #define	RABIN_DEDUPE_SEGMENTED	0
 #define	RABIN_DEDUPE_FIXED	1
 #define	RABIN_DEDUPE_FILE_GLOBAL	2
 
+/*
+ * Content defined chunking engines for variable block dedupe. The Gear engine
+ * is a FastCDC style chunker selected via PCOMPRESS_CHUNKER. Block lengths
+ * are recorded in the dedupe index so decompression does not depend on it.
+ */
+#define	RABIN_CHUNKER_RABIN	0
+#define	RABIN_CHUNKER_GEAR	1
+
+// Extra mask bits below and fewer mask bits above the normal block size.
+#define	GEAR_NC_LEVEL	2
+
+// Chunks of at least twice this size are chunked by up to this many threads.
+#define	RABIN_SCAN_SEGMENT_MIN	(1048576L)
+#define	RABIN_SCAN_MAX_THREADS	16
+
 // Mask to extract value from a rabin index entry
 #define	RABIN_INDEX_VALUE (0x3FFFFFFFUL)
 
@@ -139,6 +169,7 @@
 #define	SIMILAR_EXACT 1
 #define	SIMILAR_PARTIAL 2
 #define	SIMILAR_REF 3
+#define	SIMILAR_ZERO 4	/* Zero fixed block, only until hash matching */
 
 /*
  * TYpes of delta operations.
@@ -148,26 +179,46 @@
 #define	DELTA_NORMAL	1
 #define	DELTA_EXTRA	2
 
+/*
+ * Delta encoders for similar blocks, selected via PCOMPRESS_DELTA. The AUTO
+ * mode tries the hash based encoder first and falls back to bsdiff when that
+ * does not reduce a block well.
+ */
+#define	DELTA_ENGINE_BSDIFF	0
+#define	DELTA_ENGINE_FAST	1
+#define	DELTA_ENGINE_AUTO	2
+
 /*
  * Irreducible polynomial for Rabin modulus. This value is from the
  * Low Bandwidth Filesystem.
  */
 #define	FP_POLY  0xbfe6b8a5bf378d83ULL
 
-typedef struct rab_blockentry {
-	uint64_t offset;
-	uint32_t similarity_hash;
-	uint32_t hash;
-	uint32_t index;
-	uint32_t length;
-	unsigned char similar;
-	struct rab_blockentry *other;
-	struct rab_blockentry *next;
-} rabin_blockentry_t;
-
+/*
+ * Table of the blocks found in a chunk, kept as parallel arrays indexed by
+ * block number. other is the block number a duplicate or similar block refers
+ * to.
+ */
 typedef struct {
-	unsigned char *current_window_data;
-	rabin_blockentry_t **blocks;
+	uint64_t *offset;
+	uint32_t *length;
+	uint32_t *hash;
+	uint32_t *similarity_hash;
+	uint32_t *index;
+	uint32_t *other;
+	uchar_t *similar;
+} rabin_blocks_t;
+
+struct dedupe_context;
+
+/*
+ * Returns the length of the next content defined block at the start of buf.
+ */
+typedef uint32_t (*dedupe_scan_fn)(struct dedupe_context *ctx, unsigned char *buf,
+	uint64_t len);
+
+typedef struct dedupe_context {
+	rabin_blocks_t blocks;
 	global_blockentry_t *g_blocks;
 	uint32_t blknum;
 	unsigned char *cbuf;
@@ -176,19 +227,32 @@ typedef struct {
 	uint32_t rabin_poly_avg_block_size;
 	uint32_t rabin_avg_block_mask;
 	uint32_t rabin_break_patt;
+	int chunker;
+	dedupe_scan_fn next_block; // Scan kernel picked for the block size setting
+	uint64_t gear_mask_s;
+	uint64_t gear_mask_l;
 	uint64_t real_chunksize;
 	short valid;
 	void *lzma_data;
 	int level, delta_flag, dedupe_flag, deltac_min_distance;
+	int sketch_features; // Min-hash features folded into a similarity sketch
+	int delta_engine;
+	int reorder; // Group similar unique blocks together in the data
+	int zero_blocks; // Zero fixed blocks are detected, see zero_hash
+	uint32_t zero_hash;
 	uint64_t file_offset; // For global dedupe
+	uint64_t group_floor; // Lowest offset the chunk may reference, see restore groups
 	archive_config_t *arc;
-	Sem_t *index_sem;
-	Sem_t *index_sem_next;
-	uchar_t *similarity_cksums;
+	Hsem_t *index_sem;
+	Hsem_t *index_sem_next;
+	uchar_t *similarity_cksums; // Sketches of all segments of a chunk
+	uint32_t *sketch_len; // Number of sketch values of each segment
+	uint64_t *scan_cuts; // Block ends found by parallel segment scans
 	uint32_t pagesize;
 	int out_fd;
 	int id;
 	int show_chunks; // Debug display of chunks (offset, length)
+	struct pc_dedupe_stat *stats; // Dedupe telemetry of this thread, if collected
 } dedupe_context_t;
 
 extern dedupe_context_t *create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, 
@@ -204,7 +268,23 @@ extern void parse_dedupe_hdr(uchar_t *buf, unsigned int *blknum, uint64_t *dedup
 	uint64_t *dedupe_data_sz_cmp, uint64_t *deduped_size);
 extern void update_dedupe_hdr(uchar_t *buf, uint64_t dedupe_index_sz_cmp,
 	uint64_t dedupe_data_sz_cmp);
+extern int dedupe_hdr_index_coded(uchar_t *buf);
+extern int dedupe_index_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen);
+extern int dedupe_index_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t dstlen);
 extern void reset_dedupe_context(dedupe_context_t *ctx);
+extern void dedupe_module_init(processor_cap_t *pc);
+extern void dedupe_durable_advance(uchar_t *buf, uint64_t len);
+extern void dedupe_restore_window(uint64_t size);
+extern int dedupe_index_window(void);
+extern void dedupe_durable_abort(void);
+extern void dedupe_index_abort(void);
+extern int dedupe_index_has_base(void);
+extern int dedupe_index_resumable(void);
+extern int dedupe_index_reseed(dedupe_context_t *ctx, uchar_t *buf, uint64_t offset,
+	uint64_t len);
+extern void dedupe_index_save(uint64_t size);
+extern void dedupe_long_match_source(int fd, uint64_t base);
+extern int dedupe_restore_group_start(uint64_t offset, uint64_t len);
 extern uint32_t dedupe_buf_extra(uint64_t chunksize, int rab_blk_sz, const char *algo,
 	int delta_flag);
 extern int global_dedupe_bufadjust(uint32_t rab_blk_sz, uint64_t *user_chunk_sz, int pct_interval,
@@ -0,0 +1,301 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Microbenchmark of the slab allocator against malloc. Each thread runs
+ * the allocation pattern of one part of pcompress over and over:
+ *
+ *   chunk   The per-chunk compression and output buffers, a few MB each.
+ *   dedupe  A dedupe context with its per-block arrays, set up and torn
+ *           down for every chunk.
+ *   small   Many short lived small objects with a bounded live set, like
+ *           index entries and list nodes.
+ *
+ * Every buffer is touched once per page so that page faults of fresh
+ * memory are counted, as they are in a real run. Allocation rates are
+ * printed per pattern, allocator and thread count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <utils.h>
+#include <allocator.h>
+
+#define	MIN_MS		500
+#define	SMALL_LIVE	4096
+#define	DEDUPE_ARRAYS	8
+#define	MAX_THREADS	256
+
+typedef void *(*alloc_func_t)(size_t size);
+typedef void (*free_func_t)(void *ptr);
+
+static void *
+slab_a(size_t size)
+{
+	return (slab_alloc(NULL, size));
+}
+
+static void
+slab_f(void *ptr)
+{
+	slab_free(NULL, ptr);
+}
+
+static void *
+malloc_a(size_t size)
+{
+	return (malloc(size));
+}
+
+static void
+malloc_f(void *ptr)
+{
+	free(ptr);
+}
+
+static struct {
+	const char *name;
+	alloc_func_t alloc;
+	free_func_t free;
+} allocators[] = {
+	{"slab",	slab_a,		slab_f},
+	{"malloc",	malloc_a,	malloc_f}
+};
+
+struct bench_arg {
+	int pattern;
+	int alloc;
+	uint64_t chunksize;
+	uint64_t seed;
+	double end;
+	uint64_t ops;
+	uint64_t bytes;
+	int err;
+};
+
+static inline void
+touch(void *buf, uint64_t len)
+{
+	uchar_t *p = (uchar_t *)buf;
+	uint64_t i;
+
+	for (i = 0; i < len; i += 4096)
+		p[i] = (uchar_t)i;
+	p[len - 1] = 0;
+}
+
+static uint64_t
+rng(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (*s);
+}
+
+/*
+ * Compressed and uncompressed chunk buffers with their header room.
+ */
+static int
+run_chunk(struct bench_arg *ba, alloc_func_t af, free_func_t ff)
+{
+	void *a, *b;
+	uint64_t sz = ba->chunksize + 256;
+
+	if ((a = af(sz)) == NULL || (b = af(sz)) == NULL)
+		return (-1);
+	touch(a, sz);
+	touch(b, sz);
+	ff(b);
+	ff(a);
+	ba->ops += 2;
+	ba->bytes += sz * 2;
+	return (0);
+}
+
+/*
+ * A dedupe context for 4KB average blocks: the context itself, the block
+ * offset, length, hash, similarity, index and other arrays and the
+ * similarity flags.
+ */
+static int
+run_dedupe(struct bench_arg *ba, alloc_func_t af, free_func_t ff)
+{
+	static const int esz[DEDUPE_ARRAYS] = {1024, 8, 4, 4, 4, 4, 4, 1};
+	void *p[DEDUPE_ARRAYS];
+	uint64_t blknum, sz;
+	int i;
+
+	blknum = ba->chunksize / 4096 * 2;
+	for (i = 0; i < DEDUPE_ARRAYS; i++) {
+		sz = (i == 0 ? esz[0] : blknum * esz[i]);
+		if ((p[i] = af(sz)) == NULL)
+			return (-1);
+		touch(p[i], sz);
+		ba->bytes += sz;
+	}
+	for (i = DEDUPE_ARRAYS - 1; i >= 0; i--)
+		ff(p[i]);
+	ba->ops += DEDUPE_ARRAYS;
+	return (0);
+}
+
+static int
+run_small(struct bench_arg *ba, alloc_func_t af, free_func_t ff, void **live)
+{
+	uint64_t r, sz;
+	int i, k;
+
+	for (k = 0; k < 1024; k++) {
+		r = rng(&ba->seed);
+		i = r % SMALL_LIVE;
+		if (live[i] != NULL)
+			ff(live[i]);
+		sz = 16 + (r >> 16) % 2032;
+		if ((live[i] = af(sz)) == NULL)
+			return (-1);
+		*(uchar_t *)live[i] = 0;
+		ba->ops++;
+		ba->bytes += sz;
+	}
+	return (0);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_arg *ba = (struct bench_arg *)arg;
+	alloc_func_t af = allocators[ba->alloc].alloc;
+	free_func_t ff = allocators[ba->alloc].free;
+	void **live;
+	int i;
+
+	live = NULL;
+	if (ba->pattern == 2 && (live = (void **)calloc(SMALL_LIVE, sizeof (void *))) == NULL) {
+		ba->err = 1;
+		return (NULL);
+	}
+	do {
+		if (ba->pattern == 0)
+			ba->err = run_chunk(ba, af, ff);
+		else if (ba->pattern == 1)
+			ba->err = run_dedupe(ba, af, ff);
+		else
+			ba->err = run_small(ba, af, ff, live);
+	} while (ba->err == 0 && get_wtime_millis() < ba->end);
+	if (live != NULL) {
+		for (i = 0; i < SMALL_LIVE; i++) {
+			if (live[i] != NULL)
+				ff(live[i]);
+		}
+		free(live);
+	}
+	return (NULL);
+}
+
+static const char *pnames[] = {"chunk", "dedupe", "small"};
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s <MB>] [-t <threads>]\n"
+	    "  -s <MB>       Chunk size the buffers are sized for (default 8)\n"
+	    "  -t <threads>  Highest thread count, 1, 2, 4 ... up to it are run\n"
+	    "                (default core count)\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_arg ba[MAX_THREADS];
+	pthread_t tid[MAX_THREADS];
+	uint64_t chunksize, ops, bytes;
+	double st, en;
+	int opt, maxt, nt, p, a, t, err;
+
+	chunksize = 8;
+	maxt = get_avail_cpus();
+	while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+		switch (opt) {
+		    case 's': chunksize = strtoull(optarg, NULL, 0); break;
+		    case 't': maxt = atoi(optarg); break;
+		    default: usage(argv[0]); return (1);
+		}
+	}
+	if (optind != argc || chunksize == 0 || chunksize > 1024 || maxt < 1 ||
+	    maxt > MAX_THREADS) {
+		usage(argv[0]);
+		return (1);
+	}
+	chunksize *= (1024 * 1024);
+
+	slab_init();
+	printf("%-7s %-7s %7s %12s %12s %12s\n", "Pattern", "Alloc", "Threads", "Mops/s",
+	    "Alloc MB/s", "Mops/s/thr");
+	err = 0;
+	for (p = 0; p < 3; p++) {
+		for (nt = 1; ; nt *= 2) {
+			if (nt > maxt)
+				nt = maxt;
+			for (a = 0; a < 2; a++) {
+				st = get_wtime_millis();
+				for (t = 0; t < nt; t++) {
+					memset(&ba[t], 0, sizeof (ba[t]));
+					ba[t].pattern = p;
+					ba[t].alloc = a;
+					ba[t].chunksize = chunksize;
+					ba[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+					ba[t].end = st + MIN_MS;
+					if (pthread_create(&tid[t], NULL, bench_thread, &ba[t]) != 0) {
+						perror("pthread_create");
+						return (1);
+					}
+				}
+				ops = 0;
+				bytes = 0;
+				for (t = 0; t < nt; t++) {
+					pthread_join(tid[t], NULL);
+					ops += ba[t].ops;
+					bytes += ba[t].bytes;
+					err |= ba[t].err;
+				}
+				en = get_wtime_millis();
+				printf("%-7s %-7s %7d %12.3f %12.1f %12.3f\n", pnames[p],
+				    allocators[a].name, nt, ops / (en - st) / 1000,
+				    get_mb_s(bytes, st, en), ops / (en - st) / 1000 / nt);
+			}
+			if (nt == maxt)
+				break;
+		}
+	}
+	slab_cleanup(1);
+	if (err)
+		fprintf(stderr, "Out of memory during the run\n");
+	return (err);
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Generator of synthetic versioned datasets for dedupe benchmarks.
+ *
+ * A base image is built from blocks. Each block is an exact copy of an
+ * earlier block, a similar copy with a few bytes changed, or new data.
+ * Then a number of versions are derived, each from the one before, by
+ * inserting, deleting and overwriting short byte runs at random offsets.
+ * Inserts and deletes shift all following data, which is what content
+ * defined chunking has to cope with. All versions are written one after
+ * the other to the output, like a stream of backups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	uint64_t x = rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	rng_state = x;
+	return (x);
+}
+
+static uint32_t
+rng_range(uint32_t n)
+{
+	return ((uint32_t)(rng() % n));
+}
+
+/*
+ * New data. With entropy below 8 the bytes are drawn from a smaller
+ * alphabet so that the codec has something to work on as well.
+ */
+static void
+fill_new(unsigned char *buf, uint32_t len, int entropy)
+{
+	uint32_t i, mask;
+	uint64_t r;
+
+	mask = (1U << entropy) - 1;
+	r = 0;
+	for (i = 0; i < len; i++) {
+		if ((i & 7) == 0)
+			r = rng();
+		buf[i] = (unsigned char)(r & mask) + (entropy < 8 ? 'A' : 0);
+		r >>= 8;
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] <outfile>\n"
+	    "  -s <MB>     Size of the base image (default 64)\n"
+	    "  -b <bytes>  Block size of the base image (default 4096)\n"
+	    "  -d <pct>    Blocks that duplicate an earlier block (default 30)\n"
+	    "  -S <pct>    Blocks similar to an earlier block (default 10)\n"
+	    "  -e <pct>    Bytes changed in a similar block (default 5)\n"
+	    "  -v <n>      Versions derived from the base image (default 3)\n"
+	    "  -m <n>      Mutations per MB in each version (default 8)\n"
+	    "  -E <bits>   Entropy of new data, 1-8 bits per byte (default 6)\n"
+	    "  -r <seed>   Random seed (default 1)\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t size, len, i, nblk, b, src, pos, nmut, m;
+	uint32_t blksz, dup, sim, edit, nver, mut, k, cnt;
+	unsigned char *img, *nimg, run[64];
+	int entropy, opt, v;
+	FILE *fh;
+
+	size = 64;
+	blksz = 4096;
+	dup = 30;
+	sim = 10;
+	edit = 5;
+	nver = 3;
+	mut = 8;
+	entropy = 6;
+	while ((opt = getopt(argc, argv, "s:b:d:S:e:v:m:E:r:")) != -1) {
+		switch (opt) {
+		    case 's': size = strtoull(optarg, NULL, 0); break;
+		    case 'b': blksz = atoi(optarg); break;
+		    case 'd': dup = atoi(optarg); break;
+		    case 'S': sim = atoi(optarg); break;
+		    case 'e': edit = atoi(optarg); break;
+		    case 'v': nver = atoi(optarg); break;
+		    case 'm': mut = atoi(optarg); break;
+		    case 'E': entropy = atoi(optarg); break;
+		    case 'r': rng_state ^= strtoull(optarg, NULL, 0) * 0xff51afd7ed558ccdULL; break;
+		    default: usage(argv[0]); return (1);
+		}
+	}
+	if (optind != argc - 1 || size == 0 || blksz < 64 || dup + sim > 100 ||
+	    entropy < 1 || entropy > 8) {
+		usage(argv[0]);
+		return (1);
+	}
+	size *= (1024 * 1024);
+	nblk = size / blksz;
+	size = nblk * blksz;
+
+	/*
+	 * Room for the versions to grow by inserts.
+	 */
+	img = malloc(size + size / 2);
+	nimg = malloc(size + size / 2);
+	if (img == NULL || nimg == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (1);
+	}
+	fh = fopen(argv[optind], "w");
+	if (fh == NULL) {
+		perror(argv[optind]);
+		return (1);
+	}
+
+	for (b = 0; b < nblk; b++) {
+		unsigned char *blk = img + b * blksz;
+
+		k = rng_range(100);
+		if (b > 0 && k < dup) {
+			src = rng_range(b);
+			memcpy(blk, img + src * blksz, blksz);
+		} else if (b > 0 && k < dup + sim) {
+			src = rng_range(b);
+			memcpy(blk, img + src * blksz, blksz);
+			cnt = (uint32_t)((uint64_t)blksz * edit / 100);
+			for (i = 0; i < cnt; i++)
+				blk[rng_range(blksz)] = (unsigned char)rng();
+		} else {
+			fill_new(blk, blksz, entropy);
+		}
+	}
+	len = size;
+	if (fwrite(img, 1, len, fh) != len)
+		goto err;
+
+	for (v = 0; v < (int)nver; v++) {
+		unsigned char *tmp;
+
+		nmut = (len >> 20) * mut;
+		pos = 0;
+		m = 0;
+		for (i = 0; i < nmut; i++) {
+			uint64_t at = pos + rng_range((uint32_t)((len - pos) / (nmut - i) + 1));
+			uint32_t n = 1 + rng_range(sizeof (run));
+
+			if (at > len)
+				at = len;
+			memcpy(nimg + m, img + pos, at - pos);
+			m += at - pos;
+			pos = at;
+			switch (rng_range(3)) {
+			    case 0:
+				/* Insert */
+				if (m + n > size + size / 2)
+					break;
+				fill_new(run, n, entropy);
+				memcpy(nimg + m, run, n);
+				m += n;
+				break;
+			    case 1:
+				/* Delete */
+				pos += (pos + n <= len ? n : len - pos);
+				break;
+			    default:
+				/* Overwrite */
+				if (pos + n > len)
+					n = (uint32_t)(len - pos);
+				fill_new(nimg + m, n, entropy);
+				m += n;
+				pos += n;
+				break;
+			}
+		}
+		if (m + len - pos > size + size / 2)
+			break;
+		memcpy(nimg + m, img + pos, len - pos);
+		m += len - pos;
+		tmp = img;
+		img = nimg;
+		nimg = tmp;
+		len = m;
+		if (fwrite(img, 1, len, fh) != len)
+			goto err;
+	}
+	fclose(fh);
+	free(img);
+	free(nimg);
+	return (0);
+err:
+	perror(argv[optind]);
+	fclose(fh);
+	return (1);
+}
@@ -0,0 +1,488 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ */
+
+/*
+ * Microbenchmark of the preprocessing filters in isolation. Each filter is
+ * run on fixed, generated corpora that suit it, plus an optional file, and
+ * the encode and decode rates and the size change are printed. Decoded
+ * data is compared with the input so a broken filter shows up as failed.
+ * The corpora are the same on every run so results can be compared across
+ * builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utils.h>
+#include <allocator.h>
+#include <lzp.h>
+#include <transpose.h>
+#include <delta2/delta2.h>
+#include <analyzer.h>
+#include <filters/dispack/dis.hpp>
+#include "filters/dict/DictFilter.h"
+
+#define	MIN_MS		300
+#define	NCORPUS		5
+
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+	uint64_t x = rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	rng_state = x;
+	return (x);
+}
+
+static const char *words[] = {
+	"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was",
+	"with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from",
+	"at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+	"one", "all", "we", "can", "her", "has", "there", "been", "if", "more",
+	"when", "will", "would", "who", "so", "no", "compression", "data", "file",
+	"system", "between", "information", "number", "people", "because", "through",
+	"government", "following", "something", "different", "important", "example"
+};
+
+/*
+ * English words with a skewed distribution, capitals and punctuation.
+ * Some runs of earlier text are repeated, as boilerplate and quotes are
+ * in real documents, for LZP to find.
+ */
+static void
+gen_text(uchar_t *buf, uint64_t len)
+{
+	uint64_t i, r;
+	const char *w;
+	int n, cap;
+
+	n = sizeof (words) / sizeof (words[0]);
+	i = 0;
+	cap = 1;
+	while (i < len) {
+		r = rng();
+		if (i > 4096 && ((r >> 48) & 255) == 0) {
+			uint64_t from = (r >> 8) % (i - 1024), k;
+
+			for (k = 0; k < 512 + (r & 511) && i < len; k++)
+				buf[i++] = buf[from + k];
+			continue;
+		}
+		w = words[(r % n) * ((r >> 16) % n) / n];
+		if (cap && i < len)
+			buf[i++] = toupper(*w++);
+		while (*w != '\0' && i < len)
+			buf[i++] = *w++;
+		cap = 0;
+		if (i < len) {
+			if (((r >> 32) & 15) == 0) {
+				buf[i++] = '.';
+				cap = 1;
+			} else if (((r >> 36) & 15) == 0) {
+				buf[i++] = ',';
+			}
+		}
+		if (i < len)
+			buf[i++] = ((r >> 40) & 63) == 0 ? '\n' : ' ';
+	}
+}
+
+/*
+ * Column segments of a numeric table: 32-bit ids and 64-bit offsets or
+ * timestamps that grow by a fixed step, which is what Delta2 encodes, and
+ * columns of small measured values that it leaves alone.
+ */
+static void
+gen_table(uchar_t *buf, uint64_t len)
+{
+	uint64_t i, j, seg, v, step;
+	uint32_t r;
+
+	for (i = 0; i < len; i += seg) {
+		seg = 4096;
+		if (seg > len - i)
+			seg = len - i;
+		r = (uint32_t)rng();
+		v = rng() >> 24;
+		step = 1 + (r >> 8) % 4096;
+		switch (r % 4) {
+		    case 0:
+			for (j = 0; j + 4 <= seg; j += 4, v += step)
+				U32_P(buf + i + j) = LE32((uint32_t)v);
+			break;
+		    case 1:
+		    case 2:
+			for (j = 0; j + 8 <= seg; j += 8, v += step)
+				U64_P(buf + i + j) = LE64(v);
+			break;
+		    default:
+			for (j = 0; j + 4 <= seg; j += 4)
+				U32_P(buf + i + j) = LE32(5000 + (uint32_t)(rng() % 64));
+			break;
+		}
+		for (j = seg & ~(uint64_t)3; j < seg; j++)
+			buf[i + j] = 0;
+	}
+}
+
+/*
+ * 32-bit x86 code made of common function prologues, calls, loads and
+ * stores and epilogues, with call targets drawn from a set of functions.
+ */
+static void
+gen_x86(uchar_t *buf, uint64_t len)
+{
+	static const uchar_t prologue[] = {0x55, 0x89, 0xe5, 0x83, 0xec, 0x18};
+	static const uchar_t epilogue[] = {0x89, 0xec, 0x5d, 0xc3};
+	uint32_t funcs[256];
+	uint64_t i, r;
+	int32_t rel;
+	int k, n;
+
+	for (k = 0; k < 256; k++)
+		funcs[k] = (uint32_t)(rng() % len) & ~15U;
+	i = 0;
+	while (i + 64 < len) {
+		memcpy(buf + i, prologue, sizeof (prologue));
+		i += sizeof (prologue);
+		n = 2 + rng() % 8;
+		for (k = 0; k < n; k++) {
+			r = rng();
+			switch (r % 4) {
+			    case 0:
+				/* call rel32 */
+				rel = (int32_t)(funcs[(r >> 8) & 255] - (i + 5));
+				buf[i] = 0xe8;
+				U32_P(buf + i + 1) = LE32((uint32_t)rel);
+				i += 5;
+				break;
+			    case 1:
+				/* mov eax, [ebp + disp8] */
+				buf[i] = 0x8b;
+				buf[i + 1] = 0x45;
+				buf[i + 2] = 0x08 + ((r >> 8) & 3) * 4;
+				i += 3;
+				break;
+			    case 2:
+				/* mov [ebp - disp8], eax */
+				buf[i] = 0x89;
+				buf[i + 1] = 0x45;
+				buf[i + 2] = 0xfc - ((r >> 8) & 3) * 4;
+				i += 3;
+				break;
+			    case 3:
+				/* push imm32, a global address */
+				buf[i] = 0x68;
+				U32_P(buf + i + 1) = LE32(0x08048000U + ((r >> 8) & 0xfff0));
+				i += 5;
+				break;
+			}
+		}
+		memcpy(buf + i, epilogue, sizeof (epilogue));
+		i += sizeof (epilogue);
+		while (i & 15)
+			buf[i++] = 0x90;
+	}
+	for (; i < len; i++)
+		buf[i] = 0x90;
+}
+
+static void
+gen_random(uchar_t *buf, uint64_t len)
+{
+	uint64_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (uchar_t)rng();
+}
+
+/*
+ * Uniform wrappers around each filter. The encoders return -1 if the
+ * filter declined the data.
+ */
+#ifndef _MPLV2_LICENSE_
+static int
+lzp_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	int64_t rv;
+
+	rv = lzp_compress(src, dst, len, lzp_hash_size(6), LZP_DEFAULT_LZPMINLEN, 0);
+	if (rv < 0 || (uint64_t)rv >= len)
+		return (-1);
+	*dlen = rv;
+	return (0);
+}
+
+static int
+lzp_dec(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	int64_t rv;
+
+	rv = lzp_decompress(src, dst, len, lzp_hash_size(6), LZP_DEFAULT_LZPMINLEN, 0);
+	if (rv < 0)
+		return (-1);
+	*dlen = rv;
+	return (0);
+}
+#endif
+
+static int
+delta2_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	*dlen = len;
+	return (delta2_encode(src, len, dst, dlen, 100, NSTRIDES_STANDARD));
+}
+
+static int
+delta2_dec(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	return (delta2_decode(src, len, dst, dlen));
+}
+
+static int
+dispack_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	*dlen = len;
+	return (dispack_encode(src, len, dst, dlen));
+}
+
+static int
+dispack_dec(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	return (dispack_decode(src, len, dst, dlen));
+}
+
+static int
+dict_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	*dlen = len;
+	return (dict_encode(src, len, dst, dlen, 0) < 0 ? -1 : 0);
+}
+
+static int
+dict_dec(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	return (dict_decode(src, len, dst, dlen) < 0 ? -1 : 0);
+}
+
+/*
+ * 32-bit columns as for the dedupe index. A tail shorter than a column is
+ * copied.
+ */
+static int
+transpose_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	uint64_t n = len & ~(uint64_t)3;
+
+	transpose(src, dst, n, sizeof (uint32_t), COL);
+	memcpy(dst + n, src + n, len - n);
+	*dlen = len;
+	return (0);
+}
+
+static int
+transpose_dec(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	uint64_t n = len & ~(uint64_t)3;
+
+	transpose(src, dst, n, sizeof (uint32_t), ROW);
+	memcpy(dst + n, src + n, len - n);
+	*dlen = len;
+	return (0);
+}
+
+static int
+analyze_enc(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen)
+{
+	analyzer_ctx_t actx;
+
+	analyze_buffer(src, len, &actx);
+	*dlen = len;
+	return (0);
+}
+
+typedef int (*filter_func_t)(uchar_t *src, uint64_t len, uchar_t *dst, uint64_t *dlen);
+
+/*
+ * The corpora each filter is run on, as a bit mask of corpus numbers.
+ */
+#define	C_TEXT		1
+#define	C_TABLE		2
+#define	C_X86		4
+#define	C_RANDOM	8
+#define	C_FILE		16
+
+static struct {
+	const char *name;
+	filter_func_t enc, dec;
+	int corpora;
+} filters[] = {
+	{"analyzer",	analyze_enc,	NULL,		C_TEXT | C_TABLE | C_X86 | C_RANDOM | C_FILE},
+	{"transpose",	transpose_enc,	transpose_dec,	C_TABLE | C_RANDOM | C_FILE},
+	{"delta2",	delta2_enc,	delta2_dec,	C_TABLE | C_RANDOM | C_FILE},
+	{"dispack",	dispack_enc,	dispack_dec,	C_X86 | C_FILE},
+	{"dict",	dict_enc,	dict_dec,	C_TEXT | C_FILE},
+#ifndef _MPLV2_LICENSE_
+	{"lzp",		lzp_enc,	lzp_dec,	C_TEXT | C_TABLE | C_FILE},
+#endif
+};
+
+static const char *cnames[NCORPUS] = {"text", "table", "x86", "random", "file"};
+
+static double
+run_timed(filter_func_t fn, uchar_t *src, uint64_t len, uchar_t *dst, uint64_t dsz,
+    uint64_t *olen, int *rv)
+{
+	double st, en;
+	uint64_t tot;
+
+	tot = 0;
+	st = get_wtime_millis();
+	do {
+		*olen = dsz;
+		*rv = fn(src, len, dst, olen);
+		tot += len;
+		en = get_wtime_millis();
+	} while (*rv >= 0 && en - st < MIN_MS);
+	return (get_mb_s(tot, st, en));
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s <MB>] [-r <seed>] [<file>]\n"
+	    "  -s <MB>     Size of each generated corpus (default 8)\n"
+	    "  -r <seed>   Random seed of the corpora (default 1)\n"
+	    "  <file>      Also run every filter on up to that much of this file\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uchar_t *corpus[NCORPUS], *ebuf, *dbuf;
+	uint64_t clen[NCORPUS], size, dsz, elen, dlen;
+	double emb, dmb;
+	int opt, c, f, rv, nf;
+
+	size = 8;
+	rng_state = 1;
+	while ((opt = getopt(argc, argv, "s:r:")) != -1) {
+		switch (opt) {
+		    case 's': size = strtoull(optarg, NULL, 0); break;
+		    case 'r': rng_state = strtoull(optarg, NULL, 0); break;
+		    default: usage(argv[0]); return (1);
+		}
+	}
+	if (optind < argc - 1 || size == 0 || size > 1024) {
+		usage(argv[0]);
+		return (1);
+	}
+	rng_state = rng_state * 0x9e3779b97f4a7c15ULL + 0xff51afd7ed558ccdULL;
+	size *= (1024 * 1024);
+
+	slab_init();
+	init_pcompress();
+	dsz = size * 2 + 65536;
+	ebuf = (uchar_t *)malloc(dsz);
+	dbuf = (uchar_t *)malloc(dsz);
+	memset(corpus, 0, sizeof (corpus));
+	for (c = 0; c < NCORPUS - 1; c++) {
+		corpus[c] = (uchar_t *)malloc(size);
+		clen[c] = size;
+	}
+	if (ebuf == NULL || dbuf == NULL || corpus[0] == NULL || corpus[1] == NULL ||
+	    corpus[2] == NULL || corpus[3] == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (1);
+	}
+	gen_text(corpus[0], size);
+	gen_table(corpus[1], size);
+	gen_x86(corpus[2], size);
+	gen_random(corpus[3], size);
+	clen[4] = 0;
+	if (optind == argc - 1) {
+		int fd;
+		int64_t rd;
+
+		corpus[4] = (uchar_t *)malloc(size);
+		if ((fd = open(argv[optind], O_RDONLY)) == -1 || corpus[4] == NULL) {
+			perror(argv[optind]);
+			return (1);
+		}
+		rd = Read(fd, corpus[4], size);
+		close(fd);
+		if (rd <= 0) {
+			perror(argv[optind]);
+			return (1);
+		}
+		clen[4] = rd;
+	}
+
+	printf("%-10s %-7s %10s %10s %9s %10s %10s\n", "Filter", "Corpus", "Size", "Output",
+	    "Reduced", "Enc MB/s", "Dec MB/s");
+	nf = sizeof (filters) / sizeof (filters[0]);
+	for (f = 0; f < nf; f++) {
+		for (c = 0; c < NCORPUS; c++) {
+			if (!(filters[f].corpora & (1 << c)) || clen[c] == 0)
+				continue;
+			emb = run_timed(filters[f].enc, corpus[c], clen[c], ebuf, dsz, &elen, &rv);
+			if (rv < 0) {
+				printf("%-10s %-7s %10" PRIu64 " %10s\n", filters[f].name, cnames[c],
+				    clen[c], "declined");
+				continue;
+			}
+			if (filters[f].dec == NULL) {
+				printf("%-10s %-7s %10" PRIu64 " %10s %9s %10.1f\n", filters[f].name,
+				    cnames[c], clen[c], "-", "-", emb);
+				continue;
+			}
+			dmb = run_timed(filters[f].dec, ebuf, elen, dbuf, dsz, &dlen, &rv);
+			if (rv < 0 || dlen != clen[c] || memcmp(dbuf, corpus[c], dlen) != 0) {
+				printf("%-10s %-7s %10" PRIu64 " %10s\n", filters[f].name, cnames[c],
+				    clen[c], "failed");
+				continue;
+			}
+			printf("%-10s %-7s %10" PRIu64 " %10" PRIu64 " %8.1f%% %10.1f %10.1f\n",
+			    filters[f].name, cnames[c], clen[c], elen,
+			    100.0 - (double)elen * 100 / clen[c], emb, dmb);
+		}
+	}
+
+	for (c = 0; c < NCORPUS; c++)
+		free(corpus[c]);
+	free(ebuf);
+	free(dbuf);
+	slab_cleanup(1);
+	return (0);
+}
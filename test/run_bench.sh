@@ -0,0 +1,135 @@
+#!/bin/sh
+
+#
+# Codec benchmark. Measures compression and decompression speed and ratio
+# for each algorithm and level over corpora of different data types, with a
+# single thread and with the full thread pool.
+#
+# Environment:
+#   BENCH_ALGOS    Algorithms to run (default: all supported by the build)
+#   BENCH_LEVELS   Compression levels (default: 1 6 9)
+#   BENCH_THREADS  Thread counts, 0 is the full pool (default: 1 0)
+#   BENCH_RUNS     Runs per case, the fastest is reported (default: 1)
+#   BENCH_FORMAT   csv or json (default: csv)
+#   BENCH_OUT      Output file (default: bench.csv or bench.json)
+#
+
+PDIR=`pwd`
+PC=${PDIR}/../pcompress
+BDIR=${PDIR}/datafiles/bench
+
+[ "x$BENCH_ALGOS" = "x" ] && BENCH_ALGOS="lzfx lz4 zlib zstd bzip2 lzma lzmaMt libbsc ppmd adapt adapt2"
+[ "x$BENCH_LEVELS" = "x" ] && BENCH_LEVELS="1 6 9"
+[ "x$BENCH_THREADS" = "x" ] && BENCH_THREADS="1 0"
+[ "x$BENCH_RUNS" = "x" ] && BENCH_RUNS=1
+[ "x$BENCH_FORMAT" = "x" ] && BENCH_FORMAT=csv
+[ "x$BENCH_OUT" = "x" ] && BENCH_OUT=${PDIR}/bench.${BENCH_FORMAT}
+
+NCPU=`getconf _NPROCESSORS_ONLN 2>/dev/null`
+[ "x$NCPU" = "x" ] && NCPU=1
+
+#
+# Corpora for the main data types. Each is about 5MB.
+#
+mkdir -p ${BDIR}
+[ ! -f ${BDIR}/text.dat ] && (tar cpf - /usr/include 2>/dev/null | dd of=${BDIR}/text.dat bs=1024 count=5120 2>/dev/null)
+[ ! -f ${BDIR}/markup.dat ] && (i=0; while [ $i -lt 8 ]; do cat res/xml/*.xml; i=$((i + 1)); done) > ${BDIR}/markup.dat
+[ ! -f ${BDIR}/binary.dat ] && (tar cpf - /usr/bin 2>/dev/null | dd of=${BDIR}/binary.dat bs=1024 count=5120 2>/dev/null)
+[ ! -f ${BDIR}/share.dat ] && (tar cpf - /usr/share 2>/dev/null | dd of=${BDIR}/share.dat bs=1024 count=5120 2>/dev/null)
+[ ! -f ${BDIR}/jpeg.dat ] && (i=0; while [ $i -lt 32 ]; do cat res/jpg/*.jpg; i=$((i + 1)); done) > ${BDIR}/jpeg.dat
+CORPORA="text markup binary share jpeg"
+
+#
+# Wall clock in nanoseconds. Falls back to whole seconds where date has no %N.
+#
+now_ns() {
+	t=`date +%s%N`
+	case "$t" in
+		*N) echo $((`date +%s` * 1000000000)) ;;
+		*) echo $t ;;
+	esac
+}
+
+mbs() {
+	awk -v b=$1 -v ns=$2 'BEGIN { if (ns <= 0) ns = 1; printf "%.2f", b / 1048576 / (ns / 1000000000) }'
+}
+
+fsize() {
+	wc -c < $1 | tr -d ' '
+}
+
+rm -f ${BENCH_OUT}
+if [ "$BENCH_FORMAT" = "json" ]
+then
+	echo "{\"host\": \"`uname -n`\", \"cpus\": ${NCPU}, \"results\": [" > ${BENCH_OUT}
+else
+	echo "algo,level,threads,corpus,size,csize,ratio,comp_mbs,decomp_mbs" > ${BENCH_OUT}
+fi
+
+sep=""
+for algo in ${BENCH_ALGOS}
+do
+	${PC} 2>&1 | grep $algo > /dev/null
+	[ $? -ne 0 ] && continue
+
+	for level in ${BENCH_LEVELS}
+	do
+		for thr in ${BENCH_THREADS}
+		do
+			nthr=$thr
+			[ $thr -eq 0 ] && nthr=$NCPU
+			for corp in ${CORPORA}
+			do
+				tf=${BDIR}/${corp}.dat
+				size=`fsize ${tf}`
+				cbest=0
+				dbest=0
+				run=0
+				while [ $run -lt $BENCH_RUNS ]
+				do
+					rm -f ${tf}.pz ${tf}.1
+					t0=`now_ns`
+					${PC} -c ${algo} -l ${level} -s 1m -t ${nthr} ${tf} > /dev/null 2>&1
+					rv=$?
+					t1=`now_ns`
+					if [ $rv -ne 0 ]
+					then
+						echo "FATAL: Compression failed: ${algo} ${level} ${corp}" >&2
+						break
+					fi
+					${PC} -d -t ${nthr} ${tf}.pz ${tf}.1 > /dev/null 2>&1
+					rv=$?
+					t2=`now_ns`
+					if [ $rv -ne 0 ]
+					then
+						echo "FATAL: Decompression failed: ${algo} ${level} ${corp}" >&2
+						break
+					fi
+					ct=$((t1 - t0))
+					dt=$((t2 - t1))
+					[ $cbest -eq 0 -o $ct -lt $cbest ] && cbest=$ct
+					[ $dbest -eq 0 -o $dt -lt $dbest ] && dbest=$dt
+					run=$((run + 1))
+				done
+				[ $run -lt $BENCH_RUNS ] && continue
+
+				csize=`fsize ${tf}.pz`
+				rm -f ${tf}.pz ${tf}.1
+				ratio=`awk -v a=$size -v b=$csize 'BEGIN { printf "%.3f", a / b }'`
+				cmbs=`mbs $size $cbest`
+				dmbs=`mbs $size $dbest`
+				echo "${algo} -l ${level} -t ${nthr} ${corp}: ratio ${ratio}, ${cmbs} MB/s compress, ${dmbs} MB/s decompress"
+				if [ "$BENCH_FORMAT" = "json" ]
+				then
+					echo "${sep}  {\"algo\": \"${algo}\", \"level\": ${level}, \"threads\": ${nthr}, \"corpus\": \"${corp}\", \"size\": ${size}, \"csize\": ${csize}, \"ratio\": ${ratio}, \"comp_mbs\": ${cmbs}, \"decomp_mbs\": ${dmbs}}" >> ${BENCH_OUT}
+					sep=","
+				else
+					echo "${algo},${level},${nthr},${corp},${size},${csize},${ratio},${cmbs},${dmbs}" >> ${BENCH_OUT}
+				fi
+			done
+		done
+	done
+done
+
+[ "$BENCH_FORMAT" = "json" ] && echo "]}" >> ${BENCH_OUT}
+echo "Results written to ${BENCH_OUT}"
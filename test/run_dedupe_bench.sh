@@ -0,0 +1,116 @@
+#!/bin/sh
+
+#
+# Dedupe benchmark. Generates synthetic versioned datasets with dedupe_gen
+# and measures each dedupe mode at several block sizes: compression speed,
+# time in the chunk scan, index lookup rate, dedupe ratio and peak memory.
+# A fast codec is used so that the dedupe stages dominate.
+#
+# Environment:
+#   DBENCH_SIZE    Base image size in MB (default 64)
+#   DBENCH_MODES   Dedupe modes, words joined by '+' (default: D D+E D+EE F G G+F)
+#   DBENCH_BLKS    Values for -B (default: 0 1 3 5)
+#   DBENCH_OUT     Output CSV (default: dedupe_bench.csv)
+#
+
+PDIR=`pwd`
+PC=${PDIR}/../pcompress
+BDIR=${PDIR}/datafiles/dbench
+CC=${CC:-cc}
+
+[ "x$DBENCH_SIZE" = "x" ] && DBENCH_SIZE=64
+[ "x$DBENCH_MODES" = "x" ] && DBENCH_MODES="D D+E D+EE F G G+F"
+[ "x$DBENCH_BLKS" = "x" ] && DBENCH_BLKS="0 1 3 5"
+[ "x$DBENCH_OUT" = "x" ] && DBENCH_OUT=${PDIR}/dedupe_bench.csv
+
+mkdir -p ${BDIR}
+${CC} -O2 -o ${BDIR}/dedupe_gen dedupe_gen.c
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Cannot build dedupe_gen"
+	exit 1
+fi
+
+#
+# Datasets:
+#   dup      Many exact duplicate blocks, no versions.
+#   similar  Many near duplicate blocks, for delta encoding.
+#   versions A base image with few duplicates and shifted later versions.
+#
+gen() {
+	[ -f ${BDIR}/$1.dat ] || ${BDIR}/dedupe_gen -s ${DBENCH_SIZE} $2 ${BDIR}/$1.dat
+}
+gen dup "-d 60 -S 0 -v 0"
+gen similar "-d 10 -S 50 -e 3 -v 0"
+gen versions "-d 5 -S 5 -v 3 -m 16"
+DATASETS="dup similar versions"
+
+#
+# Peak RSS is measured with GNU time where it is available.
+#
+TIMECMD=""
+/usr/bin/time -f %M true > /dev/null 2>&1 && TIMECMD="/usr/bin/time -o ${BDIR}/rss -f %M"
+
+now_ns() {
+	t=`date +%s%N`
+	case "$t" in
+		*N) echo $((`date +%s` * 1000000000)) ;;
+		*) echo $t ;;
+	esac
+}
+
+jval() {
+	grep -o "\"$1\": [0-9][0-9.]*" ${BDIR}/stats.json | head -1 | awk '{ print $2 }'
+}
+
+echo "dataset,mode,blk,size,csize,ratio,comp_mbs,scan_mbs,lookups,lookups_s,hits,rss_kb" > ${DBENCH_OUT}
+for ds in ${DATASETS}
+do
+	tf=${BDIR}/${ds}.dat
+	size=`wc -c < ${tf} | tr -d ' '`
+	for mode in ${DBENCH_MODES}
+	do
+		flags=`echo ${mode} | sed 's/^/-/; s/+/ -/g'`
+		for blk in ${DBENCH_BLKS}
+		do
+			rm -f ${tf}.pz ${tf}.1 ${BDIR}/stats.json ${BDIR}/rss
+			t0=`now_ns`
+			PCOMPRESS_STATS_JSON=${BDIR}/stats.json ${TIMECMD} \
+			    ${PC} -c lz4 -l 1 -s 16m ${flags} -B ${blk} ${tf} > /dev/null 2>&1
+			rv=$?
+			t1=`now_ns`
+			if [ $rv -ne 0 ]
+			then
+				echo "FATAL: Compression failed: ${ds} ${flags} -B ${blk}"
+				continue
+			fi
+			${PC} -d ${tf}.pz ${tf}.1 > /dev/null 2>&1
+			cmp -s ${tf} ${tf}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression was not correct: ${ds} ${flags} -B ${blk}"
+				continue
+			fi
+
+			csize=`wc -c < ${tf}.pz | tr -d ' '`
+			rm -f ${tf}.pz ${tf}.1
+			scan=`jval scan`
+			lookups=`jval lookups`
+			hits=`jval hits`
+			index=`jval index`
+			rss=""
+			[ -f ${BDIR}/rss ] && rss=`tail -1 ${BDIR}/rss`
+			line=`awk -v s=$size -v c=$csize -v ns=$((t1 - t0)) -v sc=${scan:-0} \
+			    -v lk=${lookups:-0} -v ix=${index:-0} 'BEGIN {
+				if (ns <= 0) ns = 1;
+				printf "%.3f,%.2f,", s / c, s / 1048576 / (ns / 1e9);
+				if (sc > 0) printf "%.2f,", s / 1048576 / (sc / 1e6); else printf ",";
+				printf "%d,", lk;
+				if (ix > 0) printf "%.0f", lk / (ix / 1e6);
+			}'`
+			echo "${ds} ${flags} -B ${blk}: ${line}"
+			echo "${ds},${mode},${blk},${size},${csize},${line},${hits},${rss}" >> ${DBENCH_OUT}
+		done
+	done
+done
+echo "Results written to ${DBENCH_OUT}"
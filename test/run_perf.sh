@@ -0,0 +1,152 @@
+#!/bin/sh
+
+#
+# Performance regression check. Runs a fixed set of compression, dedupe,
+# archive and crypto cases on the test datafiles and compares throughput and
+# peak memory against a stored baseline for this host class. This is run
+# from run_test.sh in the datafiles directory with "make test TESTSUITE=perf".
+#
+# Environment:
+#   PERF_UPDATE    Set to 1 to write the results as the new baseline
+#   PERF_TOL       Allowed throughput drop in percent (default 10)
+#   PERF_MEM_TOL   Allowed peak memory growth in percent (default 15)
+#   PERF_RUNS      Runs per case, the best is used (default 3)
+#   PERF_BASEDIR   Directory of baseline files (default test/perf)
+#
+
+PC=../../pcompress
+[ "x$PERF_TOL" = "x" ] && PERF_TOL=10
+[ "x$PERF_MEM_TOL" = "x" ] && PERF_MEM_TOL=15
+[ "x$PERF_RUNS" = "x" ] && PERF_RUNS=3
+[ "x$PERF_BASEDIR" = "x" ] && PERF_BASEDIR=../perf
+
+#
+# The host class is the architecture, processor model and processor count.
+# Baselines are only comparable within a class.
+#
+ncpu=`getconf _NPROCESSORS_ONLN 2>/dev/null`
+model=`grep -m 1 "model name" /proc/cpuinfo 2>/dev/null | sed 's/.*: //'`
+[ "x$model" = "x" ] && model=`sysctl -n machdep.cpu.brand_string 2>/dev/null`
+hclass=`echo "\`uname -s\`-\`uname -m\`-${model}-${ncpu}" | tr -c 'A-Za-z0-9.\n-' '_'`
+base=${PERF_BASEDIR}/${hclass}.base
+res=perf.results
+
+TIMECMD=""
+/usr/bin/time -f %M true > /dev/null 2>&1 && TIMECMD="/usr/bin/time -o perf.rss -f %M"
+
+now_ns() {
+	t=`date +%s%N`
+	case "$t" in
+		*N) echo $((`date +%s` * 1000000000)) ;;
+		*) echo $t ;;
+	esac
+}
+
+dsize() {
+	du -sk $1 | awk '{ print $1 * 1024 }'
+}
+
+#
+# run_case <name> <input> <output> <compress args> <decompress args>
+# Records best compression and decompression MB/s and the peak RSS of
+# compression.
+#
+run_case() {
+	name=$1; in=$2; out=$3; cargs=$4; dargs=$5
+	size=`dsize ${in}`
+	cbest=0; dbest=0; rss=0
+	run=0
+	while [ $run -lt $PERF_RUNS ]
+	do
+		rm -rf ${out} ${out}.pz perf.rss
+		[ -f perf.pw ] && echo "perf-test-password" > perf.pw
+		t0=`now_ns`
+		eval ${TIMECMD} ${PC} ${cargs} > /dev/null 2>&1
+		rv=$?
+		t1=`now_ns`
+		[ -f perf.pw ] && echo "perf-test-password" > perf.pw
+		eval ${PC} ${dargs} > /dev/null 2>&1
+		rv2=$?
+		t2=`now_ns`
+		if [ $rv -ne 0 -o $rv2 -ne 0 ]
+		then
+			echo "FATAL: Perf case ${name} failed"
+			failures=$((failures + 1))
+			rm -rf ${out} ${out}.pz
+			return
+		fi
+		ct=$((t1 - t0)); dt=$((t2 - t1))
+		[ $cbest -eq 0 -o $ct -lt $cbest ] && cbest=$ct
+		[ $dbest -eq 0 -o $dt -lt $dbest ] && dbest=$dt
+		if [ -f perf.rss ]
+		then
+			r=`tail -1 perf.rss`
+			[ $r -gt $rss ] && rss=$r
+		fi
+		run=$((run + 1))
+	done
+	rm -rf ${out} ${out}.pz perf.rss
+	awk -v n=$name -v s=$size -v c=$cbest -v d=$dbest -v r=$rss 'BEGIN {
+		printf "%s %.2f %.2f %d\n", n, s / 1048576 / (c / 1e9), s / 1048576 / (d / 1e9), r
+	}' >> ${res}
+}
+
+failures=0
+rm -f ${res}
+src=`head -4 files.lst | tail -1`
+dup=`tail -1 files.lst`
+echo "perf-test-password" > perf.pw
+
+echo "#################################################"
+echo "# Performance check for host class ${hclass}"
+echo "#################################################"
+for algo in lz4 zstd lzma libbsc
+do
+	${PC} 2>&1 | grep $algo > /dev/null
+	[ $? -ne 0 ] && continue
+	run_case codec_${algo} ${src} ${src}.1 "-c ${algo} -l 6 -s 8m ${src}" "-d ${src}.pz ${src}.1"
+done
+run_case dedupe_D ${dup} ${dup}.1 "-c lz4 -l 1 -s 16m -D ${dup}" "-d ${dup}.pz ${dup}.1"
+run_case dedupe_G ${dup} ${dup}.1 "-c lz4 -l 1 -s 16m -G ${dup}" "-d ${dup}.pz ${dup}.1"
+run_case archive /usr/include perf_arc "-a -c lz4 -l 1 /usr/include perf_arc" "-d perf_arc.pz perf_arc"
+run_case crypto_aes ${src} ${src}.1 "-c lz4 -l 1 -s 8m -e AES -w perf.pw ${src}" \
+    "-d -w perf.pw ${src}.pz ${src}.1"
+run_case crypto_chacha20 ${src} ${src}.1 "-c lz4 -l 1 -s 8m -e CHACHA20 -w perf.pw ${src}" \
+    "-d -w perf.pw ${src}.pz ${src}.1"
+rm -f perf.pw
+cat ${res}
+
+if [ "x$PERF_UPDATE" = "x1" ]
+then
+	mkdir -p ${PERF_BASEDIR}
+	cp ${res} ${base}
+	echo "Baseline written to ${base}"
+elif [ ! -f ${base} ]
+then
+	echo "No baseline for this host class. Run with PERF_UPDATE=1 to create ${base}"
+else
+	#
+	# Compare each case with the baseline. Cases missing from either side
+	# are skipped since the set of algorithms depends on the build.
+	#
+	regs=`awk -v tol=$PERF_TOL -v mtol=$PERF_MEM_TOL '
+		NR == FNR { bc[$1] = $2; bd[$1] = $3; br[$1] = $4; next }
+		($1 in bc) {
+			if ($2 < bc[$1] * (100 - tol) / 100)
+				printf "FATAL: %s compression %.2f MB/s, baseline %.2f\n", $1, $2, bc[$1];
+			if ($3 < bd[$1] * (100 - tol) / 100)
+				printf "FATAL: %s decompression %.2f MB/s, baseline %.2f\n", $1, $3, bd[$1];
+			if (br[$1] > 0 && $4 > br[$1] * (100 + mtol) / 100)
+				printf "FATAL: %s peak memory %d KB, baseline %d KB\n", $1, $4, br[$1];
+		}' ${base} ${res}`
+	if [ "x$regs" != "x" ]
+	then
+		echo "$regs"
+		failures=$((failures + `echo "$regs" | wc -l`))
+	else
+		echo "No regressions against ${base}"
+	fi
+fi
+echo "#################################################"
+echo ""
+[ $failures -eq 0 ]
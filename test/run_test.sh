@@ -44,7 +44,13 @@ fi
 
 
 failures=0
-if [ "x$tst" = "x" ]
+if [ "x$tst" = "xperf" ]
+then
+	cd datafiles
+	sh ../run_perf.sh
+	[ $? -ne 0 ] && failures=$((failures + 1))
+	cd $PDIR
+elif [ "x$tst" = "x" ]
 then
 	for tf in *
 	do
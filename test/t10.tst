@@ -0,0 +1,58 @@
+#
+# Selective extraction of archive members
+#
+echo "#################################################"
+echo "# Selective extraction of archive members"
+echo "#################################################"
+
+rm -rf xtst xtst.pz xout
+mkdir xtst
+for tf in `cat files.lst`
+do
+	cp ${tf} xtst/
+done
+
+for algo in lz4 zlib lzma
+do
+	for feat in "-s1m" "-s1m -D" "-s4m -G"
+	do
+		cmd="../../pcompress -a -I -c ${algo} -l3 ${feat} xtst xtst"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Archiving failed."
+			rm -f xtst.pz
+			continue
+		fi
+
+		for mem in share.dat combined.dat
+		do
+			rm -rf xout
+			cmd="../../pcompress -d -X xtst/${mem} xtst.pz xout"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Selective extraction failed."
+				continue
+			fi
+			cmp xtst/${mem} xout/xtst/${mem}
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Extracted member was not correct"
+			fi
+			cnt=`find xout -type f | wc -l`
+			if [ $cnt -ne 1 ]
+			then
+				echo "FATAL: Selective extraction wrote $cnt files instead of 1"
+			fi
+		done
+		rm -f xtst.pz
+	done
+done
+rm -rf xtst xtst.pz xout
+
+echo "#################################################"
+echo ""
+
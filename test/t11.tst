@@ -0,0 +1,83 @@
+#
+# FUSE mount of an archive
+#
+echo "#################################################"
+echo "# FUSE mount of an archive"
+echo "#################################################"
+
+if [ ! -c /dev/fuse ] || ! which fusermount > /dev/null 2>&1
+then
+	echo "FUSE is not available, skipping"
+else
+	rm -rf xtst xtst.pz xmnt
+	mkdir xtst xmnt
+	for tf in `cat files.lst`
+	do
+		cp ${tf} xtst/
+	done
+
+	for algo in lz4 lzma
+	do
+		cmd="../../pcompress -a -I -c ${algo} -l3 -s1m xtst xtst"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Archiving failed."
+			rm -f xtst.pz
+			continue
+		fi
+
+		cmd="../../pcompress -d -J xtst.pz xmnt"
+		echo "Running $cmd"
+		eval $cmd > xmnt.log 2>&1 &
+		pid=$!
+		i=0
+		while [ $i -lt 30 ]
+		do
+			[ -f xmnt/xtst/share.dat ] && break
+			kill -0 $pid 2> /dev/null || break
+			sleep 1
+			i=$((i + 1))
+		done
+
+		if grep "without FUSE support" xmnt.log > /dev/null
+		then
+			echo "pcompress is built without FUSE support, skipping"
+			wait $pid
+			rm -f xtst.pz xmnt.log
+			break
+		fi
+		if [ ! -f xmnt/xtst/share.dat ]
+		then
+			cat xmnt.log
+			echo "FATAL: Mounting the archive failed."
+			fusermount -u xmnt > /dev/null 2>&1
+			kill $pid > /dev/null 2>&1
+			wait $pid
+			rm -f xtst.pz xmnt.log
+			continue
+		fi
+
+		for tf in `ls xtst`
+		do
+			cmp xtst/${tf} xmnt/xtst/${tf}
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Member ${tf} read through the mount was not correct"
+			fi
+		done
+		fusermount -u xmnt
+		wait $pid
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Mount exited with an error."
+		fi
+		rm -f xtst.pz xmnt.log
+	done
+	rm -rf xtst xtst.pz xmnt xmnt.log
+fi
+
+echo "#################################################"
+echo ""
+
@@ -0,0 +1,83 @@
+#
+# Resume an interrupted compression from its checkpoint
+#
+echo "#################################################"
+echo "# Resume an interrupted compression"
+echo "#################################################"
+
+#
+# Select a large file from the list
+#
+tstf=
+tsz=0
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	if [ $sz -gt $tsz ]
+	then
+		tsz=$sz
+		tstf="$tf"
+	fi
+done
+
+#
+# Reads are rate limited so that the run is still going when it is killed,
+# a few checkpoints after it started.
+#
+rate=$((tsz / 8))
+export PCOMPRESS_CHECKPOINT=1
+for algo in lz4 zlib lzma
+do
+	for feat in "-s1m" "-s1m -D" "-s2m -G"
+	do
+		rm -f ${tstf}.pz ${tstf}.pz.part ${tstf}.pz.ckpt ${tstf}.1
+		cmd="../../pcompress -c ${algo} -l3 ${feat} -R ${rate} ${tstf}"
+		echo "Running $cmd, killed after 4 seconds"
+		eval $cmd &
+		pid=$!
+		sleep 4
+		kill -9 $pid
+		wait $pid
+		if [ ! -f ${tstf}.pz.ckpt -o ! -f ${tstf}.pz.part ]
+		then
+			echo "FATAL: No checkpoint was left by the interrupted run"
+			rm -f ${tstf}.pz ${tstf}.pz.part ${tstf}.pz.ckpt
+			continue
+		fi
+
+		cmd="../../pcompress -r -c ${algo} -l3 ${feat} ${tstf}"
+		echo "Running $cmd"
+		eval $cmd 2>&1 | tee resume.log
+		if ! grep "Resuming after chunk" resume.log > /dev/null
+		then
+			echo "FATAL: Compression was not resumed."
+		fi
+		if [ ! -f ${tstf}.pz -o -f ${tstf}.pz.ckpt ]
+		then
+			echo "FATAL: Resumed compression failed."
+			rm -f ${tstf}.pz ${tstf}.pz.part ${tstf}.pz.ckpt resume.log
+			continue
+		fi
+
+		cmd="../../pcompress -d ${tstf}.pz ${tstf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression of a resumed file failed."
+			rm -f ${tstf}.pz ${tstf}.1 resume.log
+			continue
+		fi
+		cmp ${tstf} ${tstf}.1
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression of a resumed file was not correct"
+		fi
+		rm -f ${tstf}.pz ${tstf}.1 resume.log
+	done
+done
+unset PCOMPRESS_CHECKPOINT
+
+echo "#################################################"
+echo ""
+
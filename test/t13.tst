@@ -0,0 +1,70 @@
+#
+# Verify mode
+#
+echo "#################################################"
+echo "# Verify mode"
+echo "#################################################"
+
+for algo in lz4 zlib adapt
+do
+	for tf in `cat files.lst`
+	do
+		for feat in "-s1m" "-s1m -D" "-s2m -G" "-s1m -e AES"
+		do
+			rm -f ${tf}.pz ${tf}.1
+			echo "sillypassword" > /tmp/pwf
+			cmd="../../pcompress -c ${algo} -l3 ${feat} -w /tmp/pwf ${tf}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Compression failed."
+				rm -f ${tf}.pz
+				continue
+			fi
+
+			vflags="-V"
+			echo "$feat" | grep "\-e" > /dev/null && vflags="-V -VV"
+			for vf in $vflags
+			do
+				echo "sillypassword" > /tmp/pwf
+				cmd="../../pcompress -d ${vf} -w /tmp/pwf ${tf}.pz"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Verify failed on a good file."
+				fi
+				if [ -f ${tf}.1 ]
+				then
+					echo "FATAL: Verify wrote an output file."
+				fi
+			done
+
+			#
+			# Damage a chunk in the middle of the file. Verify must
+			# fail.
+			#
+			sz=`ls -l ${tf}.pz | awk '{ print $5 }'`
+			dd if=/dev/urandom of=${tf}.pz bs=1 count=32 seek=$((sz / 2)) \
+			    conv=notrunc > /dev/null 2>&1
+			for vf in $vflags
+			do
+				echo "sillypassword" > /tmp/pwf
+				cmd="../../pcompress -d ${vf} -w /tmp/pwf ${tf}.pz"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -eq 0 ]
+				then
+					echo "FATAL: Verify did not fail on a damaged file."
+				fi
+			done
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+done
+rm -f /tmp/pwf
+
+echo "#################################################"
+echo ""
+
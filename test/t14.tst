@@ -0,0 +1,52 @@
+#
+# Batch mode
+#
+echo "#################################################"
+echo "# Batch mode compress and decompress"
+echo "#################################################"
+
+for algo in lz4 zlib adapt2
+do
+	for feat in "-s1m" "-s1m -D" "-s2m -G"
+	do
+		for tf in `cat files.lst`
+		do
+			rm -f ${tf}.pz ${tf}.1
+		done
+		cmd="../../pcompress -A -c ${algo} -l3 ${feat} `cat files.lst`"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Batch compression failed."
+		fi
+
+		for tf in `cat files.lst`
+		do
+			if [ ! -f ${tf}.pz ]
+			then
+				echo "FATAL: Batch compression did not write ${tf}.pz"
+				continue
+			fi
+			cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression failed."
+				rm -f ${tf}.pz ${tf}.1
+				continue
+			fi
+			cmp ${tf} ${tf}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression was not correct"
+			fi
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+done
+
+echo "#################################################"
+echo ""
+
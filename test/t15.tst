@@ -0,0 +1,107 @@
+#
+# zstd backend and dictionaries
+#
+echo "#################################################"
+echo "# zstd compress and decompress"
+echo "#################################################"
+
+rm -f zstd.chk zstd.chk.pz
+echo "zstd" > zstd.chk
+if ../../pcompress -c zstd -l1 zstd.chk 2>&1 | grep "Invalid algorithm" > /dev/null
+then
+	echo "pcompress is built without zstd support, skipping"
+else
+	for tf in `cat files.lst`
+	do
+		for feat in "-l1 -s1m" "-l6 -s1m -D" "-l14 -s16m" "-l9 -s2m -G"
+		do
+			rm -f ${tf}.pz ${tf}.1
+			cmd="../../pcompress -c zstd ${feat} ${tf}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Compression failed."
+				rm -f ${tf}.pz
+				continue
+			fi
+			cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression failed."
+				rm -f ${tf}.pz ${tf}.1
+				continue
+			fi
+			cmp ${tf} ${tf}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression was not correct"
+			fi
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+
+	#
+	# Train a dictionary on the largest file, then use it on both
+	# sides. Decompression without it must fail.
+	#
+	tstf=
+	tsz=0
+	for tf in `cat files.lst`
+	do
+		sz=`ls -l ${tf} | awk '{ print $5 }'`
+		if [ $sz -gt $tsz ]
+		then
+			tsz=$sz
+			tstf="$tf"
+		fi
+	done
+	rm -f ${tstf}.pz ${tstf}.1 /tmp/zdict
+	cmd="PCOMPRESS_ZSTD_TRAIN=/tmp/zdict ../../pcompress -c zstd -l6 -s256k ${tstf}"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 -o ! -f /tmp/zdict ]
+	then
+		echo "FATAL: Dictionary training failed."
+	else
+		rm -f ${tstf}.pz
+		cmd="PCOMPRESS_ZSTD_DICT=/tmp/zdict ../../pcompress -c zstd -l6 -s256k ${tstf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression with a dictionary failed."
+		else
+			cmd="PCOMPRESS_ZSTD_DICT=/tmp/zdict ../../pcompress -d ${tstf}.pz ${tstf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression with a dictionary failed."
+			else
+				cmp ${tstf} ${tstf}.1
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Decompression with a dictionary was not correct"
+				fi
+			fi
+
+			rm -f ${tstf}.1
+			cmd="../../pcompress -d ${tstf}.pz ${tstf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -eq 0 ]
+			then
+				echo "FATAL: Decompression without the dictionary did not fail."
+			fi
+		fi
+	fi
+	rm -f ${tstf}.pz ${tstf}.1 /tmp/zdict
+fi
+rm -f zstd.chk zstd.chk.pz
+
+echo "#################################################"
+echo ""
+
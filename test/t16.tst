@@ -0,0 +1,100 @@
+#
+# Appending to an archive
+#
+echo "#################################################"
+echo "# Append to an archive"
+echo "#################################################"
+
+rm -rf xtst xtst2 xtst.pz xout
+for algo in lz4 zlib lzma
+do
+	for feat in "-s1m" "-s1m -D" "-s2m -F"
+	do
+		rm -rf xtst xtst2 xtst.pz xout
+		mkdir xtst xtst2
+		n=0
+		for tf in `cat files.lst`
+		do
+			if [ $((n % 2)) -eq 0 ]
+			then
+				cp ${tf} xtst/
+			else
+				cp ${tf} xtst2/
+			fi
+			n=$((n + 1))
+		done
+
+		cmd="../../pcompress -a -I -c ${algo} -l3 ${feat} xtst xtst"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Archiving failed."
+			continue
+		fi
+
+		cmd="../../pcompress -a -U xtst2 xtst"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Appending a directory failed."
+			continue
+		fi
+
+		#
+		# A member added again replaces the older copy.
+		#
+		mem=`ls xtst | head -1`
+		cat xtst2/* >> xtst/${mem}
+		cmd="../../pcompress -a -U xtst/${mem} xtst"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Appending a changed file failed."
+			continue
+		fi
+
+		cmd="../../pcompress -d xtst.pz xout"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracting an appended archive failed."
+			continue
+		fi
+		for d in xtst xtst2
+		do
+			for f in `ls ${d}`
+			do
+				cmp ${d}/${f} xout/${d}/${f}
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Member ${d}/${f} was not correct"
+				fi
+			done
+		done
+
+		f=`ls xtst2 | head -1`
+		rm -rf xout
+		cmd="../../pcompress -d -X xtst2/${f} xtst.pz xout"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Selective extraction of an appended member failed."
+			continue
+		fi
+		cmp xtst2/${f} xout/xtst2/${f}
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Extracted appended member was not correct"
+		fi
+	done
+done
+rm -rf xtst xtst2 xtst.pz xout
+
+echo "#################################################"
+echo ""
+
@@ -0,0 +1,60 @@
+#
+# Damaged encrypted files
+#
+echo "#################################################"
+echo "# Damaged and truncated encrypted files"
+echo "#################################################"
+
+for cipher in AES-GCM CHACHA20
+do
+	for tf in `cat files.lst`
+	do
+		for feat in "-s1m" "-s1m -D" "-s100m"
+		do
+			for dmg in middle tail
+			do
+				rm -f ${tf}.pz ${tf}.1
+				echo "sillypassword" > /tmp/pwf
+				cmd="../../pcompress -c lz4 -l3 ${feat} -e ${cipher} -w /tmp/pwf ${tf}"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Compression errored."
+					rm -f ${tf}.pz
+					continue
+				fi
+
+				#
+				# Overwrite some bytes in the middle, or cut off the end
+				# of the file. Decompression must fail either way.
+				#
+				sz=`ls -l ${tf}.pz | awk '{ print $5 }'`
+				if [ "$dmg" = "middle" ]
+				then
+					dd if=/dev/urandom of=${tf}.pz bs=1 count=32 \
+					    seek=$((sz / 2)) conv=notrunc > /dev/null 2>&1
+				else
+					dd if=${tf}.pz of=${tf}.pz.t bs=1024 \
+					    count=$((sz / 1024 - 1)) > /dev/null 2>&1
+					mv ${tf}.pz.t ${tf}.pz
+				fi
+
+				echo "sillypassword" > /tmp/pwf
+				cmd="../../pcompress -d -w /tmp/pwf ${tf}.pz ${tf}.1"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -eq 0 ]
+				then
+					echo "FATAL: Decompression of a ${dmg} damaged file did not fail."
+				fi
+				rm -f ${tf}.pz ${tf}.1
+			done
+		done
+	done
+done
+rm -f /tmp/pwf
+
+echo "#################################################"
+echo ""
+
@@ -0,0 +1,89 @@
+#
+# Patch-from mode: compress against a reference file
+#
+echo "#################################################"
+echo "# Compress against a reference file"
+echo "#################################################"
+
+#
+# The largest file is the reference. The target is the reference with
+# another file inserted in the middle.
+#
+ref=
+tsz=0
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	if [ $sz -gt $tsz ]
+	then
+		tsz=$sz
+		ref="$tf"
+	fi
+done
+ins=`head -1 files.lst`
+tgt=`pwd`/patch.dat
+half=$((tsz / 2048))
+dd if=${ref} of=${tgt} bs=1024 count=${half} > /dev/null 2>&1
+cat ${ins} >> ${tgt}
+dd if=${ref} bs=1024 skip=${half} >> ${tgt} 2> /dev/null
+
+for algo in lz4 zlib lzma
+do
+	for feat in "-s1m" "-s4m -B4" "-s2m -B2"
+	do
+		rm -f ${tgt}.pz ${tgt}.1
+		cmd="../../pcompress -G -c ${algo} -l3 ${feat} ${tgt}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression without a reference failed."
+			continue
+		fi
+		fsz=`ls -l ${tgt}.pz | awk '{ print $5 }'`
+		rm -f ${tgt}.pz
+
+		cmd="PCOMPRESS_GLOBAL_BASE=${ref} ../../pcompress -G -c ${algo} -l3 ${feat} ${tgt}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression against a reference failed."
+			continue
+		fi
+		psz=`ls -l ${tgt}.pz | awk '{ print $5 }'`
+		if [ $psz -ge $fsz ]
+		then
+			echo "FATAL: Compressing against a reference gave $psz bytes, $fsz without"
+		fi
+
+		cmd="PCOMPRESS_GLOBAL_BASE=${ref} ../../pcompress -d ${tgt}.pz ${tgt}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression against a reference failed."
+		else
+			cmp ${tgt} ${tgt}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression against a reference was not correct"
+			fi
+		fi
+
+		rm -f ${tgt}.1
+		cmd="../../pcompress -d ${tgt}.pz ${tgt}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -eq 0 ]
+		then
+			echo "FATAL: Decompression without the reference did not fail."
+		fi
+		rm -f ${tgt}.pz ${tgt}.1
+	done
+done
+rm -f ${tgt} ${tgt}.pz ${tgt}.1
+
+echo "#################################################"
+echo ""
+
@@ -0,0 +1,65 @@
+#
+# Sharded compression
+#
+echo "#################################################"
+echo "# Sharded compression of one file"
+echo "#################################################"
+
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	s1=$((sz / 3))
+	s2=$((sz * 2 / 3 + 12345))
+	for algo in lz4 zlib lzma adapt
+	do
+		for feat in "-s1m" "-s1m -D" "-s2m -F"
+		do
+			rm -f ${tf}.pz ${tf}.1 ${tf}.s0.pz ${tf}.s1.pz ${tf}.s2.pz
+			fail=0
+			for n in 0 1 2
+			do
+				case $n in
+				0) shard="0,${s1}" ;;
+				1) shard="${s1},$((s2 - s1))" ;;
+				2) shard="${s2}" ;;
+				esac
+				cmd="../../pcompress -c ${algo} -l3 ${feat} -g ${shard} ${tf} ${tf}.s${n}"
+				echo "Running $cmd"
+				eval $cmd
+				if [ $? -ne 0 ]
+				then
+					echo "FATAL: Compressing shard ${shard} failed."
+					fail=1
+					break
+				fi
+			done
+			if [ $fail -ne 0 ]
+			then
+				rm -f ${tf}.s0.pz ${tf}.s1.pz ${tf}.s2.pz
+				continue
+			fi
+
+			cat ${tf}.s0.pz ${tf}.s1.pz ${tf}.s2.pz > ${tf}.pz
+			rm -f ${tf}.s0.pz ${tf}.s1.pz ${tf}.s2.pz
+			cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompressing concatenated shards failed."
+				rm -f ${tf}.pz ${tf}.1
+				continue
+			fi
+			cmp ${tf} ${tf}.1
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompressed shards were not correct"
+			fi
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+done
+
+echo "#################################################"
+echo ""
+
@@ -11,7 +11,7 @@ do
 	do
 		rm -f ${tf}.*
 		for feat in "-D" "-D -B3 -L" "-D -B4 -E" "-D -B0 -EE" "-D -B5 -EE -L" "-D -B2" "-P" "-D -P" "-D -L -P" \
-				"-G -D" "-G -F" "-G -L -P" "-G -B2"
+				"-G -D" "-G -F" "-G -L -P" "-G -B2" "-G -D -S XXH128" "-D -B3 -S XXH128"
 		do
 			for seg in 2m 11m
 			do
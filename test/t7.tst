@@ -12,7 +12,7 @@ for algo in lzfx adapt2
 do
 	for tf in `cat files.lst`
 	do
-		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e AES" "-e SALSA20 -S CRC64" "-e SALSA20 -L" "-e AES -E"
+		for feat in "-e SALSA20" "-e AES -L" "-D -e SALSA20" "-D -EE -L -e AES" "-e SALSA20 -S CRC64" "-e SALSA20 -L" "-e AES -E" "-e AES-GCM" "-D -e AES-GCM -S SHA512" "-e CHACHA20" "-D -e CHACHA20 -L"
 		do
 			for seg in 2m 5m
 			do
@@ -49,6 +49,10 @@
  */
 
 #include <string.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 #include "utils.h"
 #include "cpuid.h"
 
@@ -62,6 +66,7 @@
 #define	AVX2_FLAG		(1U << 5)
 #define	XOP_FLAG		0x800
 #define	AES_FLAG		0x2000000
+#define	OSXSAVE_FLAG	0x8000000
 
 static void
 exec_cpuid(uint32_t *regs)
@@ -99,6 +104,15 @@ exec_cpuid(uint32_t *regs)
 #endif
 }
 
+static uint64_t
+exec_xgetbv(void)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (((uint64_t)hi << 32) | lo);
+}
+
 static void
 cpu_exec_cpuid(uint32_t eax, uint32_t* regs)
 {
@@ -175,12 +189,17 @@ cpuid_basic_identify(processor_cap_t *pc)
 				pc->sse_level = 2;
 			}
 		}
+		/*
+		 * AVX is only usable if the OS saves the YMM state, so
+		 * also check XCR0 for the XMM and YMM bits.
+		 */
 		pc->avx_level = 0;
-		if (raw.basic_cpuid[1][2] & AVX_FLAG) {
+		if ((raw.basic_cpuid[1][2] & (AVX_FLAG | OSXSAVE_FLAG)) ==
+		    (AVX_FLAG | OSXSAVE_FLAG) && (exec_xgetbv() & 6) == 6) {
 			pc->avx_level = 1;
-		}
-		if (raw.basic_cpuid[7][1] & AVX2_FLAG) {
-			pc->avx_level = 2;
+			if (raw.basic_cpuid[7][1] & AVX2_FLAG) {
+				pc->avx_level = 2;
+			}
 		}
 
 		if (raw.basic_cpuid[1][2] & AES_FLAG) {
@@ -193,4 +212,41 @@ cpuid_basic_identify(processor_cap_t *pc)
 	}
 }
 
+#elif defined(__aarch64__)
+
+/*
+ * Advanced SIMD is part of ARMv8-A. The AES and SHA2 instructions are an
+ * optional extension and are read from the kernel's hardware capabilities.
+ */
+void
+cpuid_basic_identify(processor_cap_t *pc)
+{
+	memset(pc, 0, sizeof (processor_cap_t));
+	pc->proc_type = PROC_ARM64;
+	pc->neon_avail = 1;
+#ifdef	__linux__
+	{
+		unsigned long hwcap = getauxval(AT_HWCAP);
+
+		pc->neon_avail = ((hwcap & HWCAP_ASIMD) != 0);
+		pc->aes_avail = ((hwcap & HWCAP_AES) != 0);
+		pc->sha2_avail = ((hwcap & HWCAP_SHA2) != 0);
+	}
+#endif
+}
+
+#else
+
+void
+cpuid_basic_identify(processor_cap_t *pc)
+{
+	uint32_t one = 1;
+
+	memset(pc, 0, sizeof (processor_cap_t));
+	if (*(uchar_t *)&one == 1)
+		pc->proc_type = PROC_LITENDIAN_GENERIC;
+	else
+		pc->proc_type = PROC_BIGENDIAN_GENERIC;
+}
+
 #endif
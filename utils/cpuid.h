@@ -50,30 +50,40 @@
 #ifndef __CPUID_H__
 #define __CPUID_H__
 
-#ifdef	__x86_64__
-#define VENDOR_STR_MAX          16
-#define BRAND_STR_MAX           64
-#define CPU_FLAGS_MAX           128
-#define MAX_CPUID_LEVEL         32
-#define MAX_EXT_CPUID_LEVEL     32
-#define MAX_INTELFN4_LEVEL      4
-
 typedef enum {
 	PROC_BIGENDIAN_GENERIC = 1,
 	PROC_LITENDIAN_GENERIC,
 	PROC_X64_INTEL,
-	PROC_X64_AMD
+	PROC_X64_AMD,
+	PROC_ARM64
 } proc_type_t;
 
+/*
+ * The sse, avx and xop fields are only set on x86_64, neon and sha2 only on
+ * ARM64. aes_avail is AES-NI on the former and the ARMv8 AES instructions on
+ * the latter.
+ */
 typedef struct {
 	int sse_level;
 	int sse_sub_level;
 	int avx_level;
 	int xop_avail;
 	int aes_avail;
+	int neon_avail;
+	int sha2_avail;
 	proc_type_t proc_type;
 } processor_cap_t;
 
+void cpuid_basic_identify(processor_cap_t *pc);
+
+#ifdef	__x86_64__
+#define VENDOR_STR_MAX          16
+#define BRAND_STR_MAX           64
+#define CPU_FLAGS_MAX           128
+#define MAX_CPUID_LEVEL         32
+#define MAX_EXT_CPUID_LEVEL     32
+#define MAX_INTELFN4_LEVEL      4
+
 /**
  * This contains only the most basic CPU data, required to do identification
  * and feature recognition. Every processor should be identifiable using this
@@ -94,7 +104,6 @@ struct cpu_raw_data_t {
 };
 
 void cpuid_get_raw_data(struct cpu_raw_data_t* data);
-void cpuid_basic_identify(processor_cap_t *pc);
 
 #endif /* __x86_64__ */
 
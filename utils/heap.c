@@ -23,8 +23,10 @@
  */
 
 /*
- * Functions for a rudimentary fast min-heap implementation.
- * Adapted from "Algorithms with C", Kyle Loudon, O'Reilly.
+ * Bounded 4-ary max-heap used to select the n smallest values of an array.
+ * The four children of a node are adjacent so a sift-down step reads one
+ * or two cache lines, and the largest child is picked with conditional
+ * moves instead of compare branches that mispredict on random data.
  */
 
 #include <limits.h>
@@ -35,41 +37,80 @@
 #include <inttypes.h>
 #include "heap.h"
 
-#define	heap_parent(npos) ((__TYPE)(((npos) - 1) / 2))
-#define	heap_left(npos) (((npos) * 2) + 1)
-#define	heap_right(npos) (((npos) * 2) + 2)
+#define	HEAP_ARITY	4
+#define	heap_parent(npos) (((npos) - 1) / HEAP_ARITY)
+#define	heap_child(npos) (((npos) * HEAP_ARITY) + 1)
 
 static void
-heap_insert(MinHeap *heap, __TYPE data)
+heap_siftup(__TYPE *tree, __TYPE ipos)
 {
-	__TYPE temp;
-	__TYPE ipos, ppos;
+	__TYPE ppos, v;
 
-	heap->tree[heap_size(heap)] = data;
-	ipos = heap_size(heap);
-	ppos = heap_parent(ipos);
-
-	while (ipos > 0 && heap->tree[ppos] > heap->tree[ipos]) {
-		temp = heap->tree[ppos];
-		heap->tree[ppos] = heap->tree[ipos];
-		heap->tree[ipos] = temp;
-		ipos = ppos;
+	v = tree[ipos];
+	while (ipos > 0) {
 		ppos = heap_parent(ipos);
+		if (tree[ppos] >= v)
+			break;
+		tree[ipos] = tree[ppos];
+		ipos = ppos;
 	}
-	if (heap->size < heap->totsize)
-		heap->size++;
+	tree[ipos] = v;
 }
 
+/*
+ * Replace the root with v and restore the heap order.
+ */
+static void
+heap_replace_top(__TYPE *tree, __TYPE size, __TYPE v)
+{
+	__TYPE ipos, c, m, k;
+
+	ipos = 0;
+	for (;;) {
+		c = heap_child(ipos);
+		if (c + HEAP_ARITY <= size) {
+			m = c;
+			m = (tree[c + 1] > tree[m] ? c + 1 : m);
+			k = (tree[c + 3] > tree[c + 2] ? c + 3 : c + 2);
+			m = (tree[k] > tree[m] ? k : m);
+		} else if (c < size) {
+			m = c;
+			for (k = c + 1; k < size; k++)
+				m = (tree[k] > tree[m] ? k : m);
+		} else {
+			break;
+		}
+		if (tree[m] <= v)
+			break;
+		tree[ipos] = tree[m];
+		ipos = m;
+	}
+	tree[ipos] = v;
+}
+
+/*
+ * Collect the heapsize smallest values of data into heapbuf. The values are
+ * in heap order with the largest of them at heapbuf[0]. heap->size is the
+ * number of values collected.
+ */
 void
 heap_nsmallest(MinHeap *heap, __TYPE *data, __TYPE *heapbuf, __TYPE heapsize, __TYPE datasize)
 {
-	__TYPE i;
+	__TYPE i, n;
 
-	heap->size = 1;
 	heap->totsize = heapsize;
 	heap->tree = heapbuf;
-	heap->tree[0] = data[0];
+	n = (datasize < heapsize ? datasize : heapsize);
+	for (i = 0; i < n; i++) {
+		heapbuf[i] = data[i];
+		heap_siftup(heapbuf, i);
+	}
+	heap->size = n;
+	if (n == 0)
+		return;
 
-	for (i = 1; i < datasize; i++)
-		heap_insert(heap, data[i]);
+	for (; i < datasize; i++) {
+		if (data[i] < heapbuf[0])
+			heap_replace_top(heapbuf, n, data[i]);
+	}
 }
@@ -0,0 +1,247 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Decompressed chunk cache. A chained hash table finds entries and a doubly
+ * linked list keeps them in order of use, most recent first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <utils.h>
+#include "pc_cache.h"
+
+#define	CACHE_MIN_HSIZE	256
+
+struct pc_cache_ent {
+	uint64_t fid, chunk, len;
+	unsigned char *data;
+	int pins;
+	struct pc_cache_ent *hnext, *prev, *next;
+};
+
+static inline uint64_t
+cache_hash(pc_cache_t *cc, uint64_t fid, uint64_t chunk)
+{
+	uint64_t h = (fid ^ (chunk * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+
+	return ((h >> 32) & (cc->hsize - 1));
+}
+
+static void
+lru_unlink(pc_cache_t *cc, pc_cache_ent_t *ent)
+{
+	if (ent->prev != NULL)
+		ent->prev->next = ent->next;
+	else
+		cc->lru_head = ent->next;
+	if (ent->next != NULL)
+		ent->next->prev = ent->prev;
+	else
+		cc->lru_tail = ent->prev;
+	ent->prev = ent->next = NULL;
+}
+
+static void
+lru_push(pc_cache_t *cc, pc_cache_ent_t *ent)
+{
+	ent->prev = NULL;
+	ent->next = cc->lru_head;
+	if (cc->lru_head != NULL)
+		cc->lru_head->prev = ent;
+	cc->lru_head = ent;
+	if (cc->lru_tail == NULL)
+		cc->lru_tail = ent;
+}
+
+static void
+cache_remove(pc_cache_t *cc, pc_cache_ent_t *ent)
+{
+	pc_cache_ent_t **pp;
+
+	pp = &cc->htab[cache_hash(cc, ent->fid, ent->chunk)];
+	while (*pp != ent)
+		pp = &(*pp)->hnext;
+	*pp = ent->hnext;
+	lru_unlink(cc, ent);
+	cc->bytes -= ent->len;
+	cc->nents--;
+	free(ent->data);
+	free(ent);
+}
+
+pc_cache_t *
+pc_cache_create(uint64_t max_bytes)
+{
+	pc_cache_t *cc;
+
+	cc = (pc_cache_t *)calloc(1, sizeof (pc_cache_t));
+	if (cc == NULL)
+		return (NULL);
+	cc->hsize = CACHE_MIN_HSIZE;
+	cc->htab = (pc_cache_ent_t **)calloc(cc->hsize, sizeof (pc_cache_ent_t *));
+	if (cc->htab == NULL) {
+		free(cc);
+		return (NULL);
+	}
+	cc->max_bytes = max_bytes;
+	pthread_mutex_init(&cc->lock, NULL);
+	return (cc);
+}
+
+void
+pc_cache_destroy(pc_cache_t *cc)
+{
+	if (cc == NULL)
+		return;
+	while (cc->lru_head != NULL)
+		cache_remove(cc, cc->lru_head);
+	free(cc->htab);
+	pthread_mutex_destroy(&cc->lock);
+	free(cc);
+}
+
+/*
+ * Look up a chunk. On a hit the entry is pinned and its data returned.
+ */
+pc_cache_ent_t *
+pc_cache_get(pc_cache_t *cc, uint64_t fid, uint64_t chunk, unsigned char **data,
+    uint64_t *len)
+{
+	pc_cache_ent_t *ent;
+
+	pthread_mutex_lock(&cc->lock);
+	for (ent = cc->htab[cache_hash(cc, fid, chunk)]; ent != NULL; ent = ent->hnext) {
+		if (ent->fid == fid && ent->chunk == chunk)
+			break;
+	}
+	if (ent != NULL) {
+		ent->pins++;
+		lru_unlink(cc, ent);
+		lru_push(cc, ent);
+		*data = ent->data;
+		*len = ent->len;
+		cc->hits++;
+	} else {
+		cc->misses++;
+	}
+	pthread_mutex_unlock(&cc->lock);
+	return (ent);
+}
+
+void
+pc_cache_release(pc_cache_t *cc, pc_cache_ent_t *ent)
+{
+	pthread_mutex_lock(&cc->lock);
+	ent->pins--;
+	pthread_mutex_unlock(&cc->lock);
+}
+
+/*
+ * Grow the hash table to keep chains short. Failure only costs lookup time.
+ */
+static void
+cache_grow(pc_cache_t *cc)
+{
+	pc_cache_ent_t **ntab, **otab, *ent, *next;
+	uint64_t i, osize, h;
+
+	ntab = (pc_cache_ent_t **)calloc(cc->hsize * 2, sizeof (pc_cache_ent_t *));
+	if (ntab == NULL)
+		return;
+	otab = cc->htab;
+	osize = cc->hsize;
+	cc->htab = ntab;
+	cc->hsize *= 2;
+	for (i = 0; i < osize; i++) {
+		for (ent = otab[i]; ent != NULL; ent = next) {
+			next = ent->hnext;
+			h = cache_hash(cc, ent->fid, ent->chunk);
+			ent->hnext = ntab[h];
+			ntab[h] = ent;
+		}
+	}
+	free(otab);
+}
+
+/*
+ * Add a copy of a decompressed chunk, evicting the least recently used
+ * unpinned chunks to make room.
+ */
+void
+pc_cache_put(pc_cache_t *cc, uint64_t fid, uint64_t chunk, const unsigned char *data,
+    uint64_t len)
+{
+	pc_cache_ent_t *ent, *victim, *prev;
+	uint64_t h;
+
+	if (len == 0 || len > cc->max_bytes / 4)
+		return;
+	pthread_mutex_lock(&cc->lock);
+	h = cache_hash(cc, fid, chunk);
+	for (ent = cc->htab[h]; ent != NULL; ent = ent->hnext) {
+		if (ent->fid == fid && ent->chunk == chunk) {
+			pthread_mutex_unlock(&cc->lock);
+			return;
+		}
+	}
+	for (victim = cc->lru_tail; victim != NULL && cc->bytes + len > cc->max_bytes;
+	    victim = prev) {
+		prev = victim->prev;
+		if (victim->pins == 0) {
+			cache_remove(cc, victim);
+			cc->evicted++;
+		}
+	}
+	if (cc->bytes + len > cc->max_bytes)
+		goto put_done;
+
+	ent = (pc_cache_ent_t *)calloc(1, sizeof (pc_cache_ent_t));
+	if (ent == NULL)
+		goto put_done;
+	ent->data = (unsigned char *)malloc(len);
+	if (ent->data == NULL) {
+		free(ent);
+		goto put_done;
+	}
+	memcpy(ent->data, data, len);
+	ent->fid = fid;
+	ent->chunk = chunk;
+	ent->len = len;
+	if (cc->nents >= cc->hsize * 2) {
+		cache_grow(cc);
+		h = cache_hash(cc, fid, chunk);
+	}
+	ent->hnext = cc->htab[h];
+	cc->htab[h] = ent;
+	lru_push(cc, ent);
+	cc->bytes += len;
+	cc->nents++;
+
+put_done:
+	pthread_mutex_unlock(&cc->lock);
+}
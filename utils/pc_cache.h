@@ -0,0 +1,67 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_CACHE_H
+#define	_PC_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded cache of decompressed chunks for the random-access readers: byte
+ * range decompression, selective extraction and the FUSE mount. Chunks are
+ * keyed by the compressed file and their chunk number. The least recently
+ * used chunks are evicted to keep the total size within max_bytes, chunks
+ * bigger than a quarter of that are not kept. An entry returned by
+ * pc_cache_get() is pinned and not evicted until pc_cache_release().
+ */
+typedef struct pc_cache_ent pc_cache_ent_t;
+
+typedef struct pc_cache {
+	pthread_mutex_t lock;
+	pc_cache_ent_t **htab;
+	pc_cache_ent_t *lru_head, *lru_tail;
+	uint64_t hsize, nents;
+	uint64_t max_bytes, bytes;
+	uint64_t hits, misses, evicted;
+} pc_cache_t;
+
+pc_cache_t *pc_cache_create(uint64_t max_bytes);
+void pc_cache_destroy(pc_cache_t *cc);
+pc_cache_ent_t *pc_cache_get(pc_cache_t *cc, uint64_t fid, uint64_t chunk,
+    unsigned char **data, uint64_t *len);
+void pc_cache_release(pc_cache_t *cc, pc_cache_ent_t *ent);
+void pc_cache_put(pc_cache_t *cc, uint64_t fid, uint64_t chunk,
+    const unsigned char *data, uint64_t len);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
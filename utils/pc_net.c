@@ -0,0 +1,741 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * TCP and TLS transport for compressed streams. Two pump threads connect
+ * the local pipe with the socket: the fill thread reads its source into a
+ * FIFO and the drain thread writes the FIFO out to its destination. The
+ * FIFO is a memory ring of PCOMPRESS_NET_BUFFER bytes followed by up to
+ * PCOMPRESS_NET_SPILL bytes in an unlinked temporary file. Once both are
+ * full the fill thread stops reading, which blocks the writer at the other
+ * end of the pipe. Only one thread ever uses the TLS session: the drain
+ * thread when sending and the fill thread when receiving.
+ */
+
+#ifndef __APPLE__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <utils.h>
+#include "pc_net.h"
+
+#define	NET_BUF_DEFAULT	(64 * 1024 * 1024)
+#define	NET_BUF_MIN	(1024 * 1024)
+#define	NET_IO_SZ	(256 * 1024)
+#define	NET_HOST_MAX	256
+
+#ifndef MSG_NOSIGNAL
+#define	MSG_NOSIGNAL	0
+#endif
+
+struct net_end {
+	int fd, sock;
+	SSL *ssl;
+};
+
+struct pc_net {
+	int dir, local_fd;
+	struct net_end src, dst;
+	pc_conn_t conn;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_t fill_thr, drain_thr;
+	uchar_t *ring;
+	uint64_t cap, head, len, peak;
+	int spill_fd;
+	uint64_t spill_max, spill_r, spill_w, spilled;
+	int eof, err, stop;
+};
+
+int
+pc_net_url(const char *name)
+{
+	return (strncmp(name, "tcp://", 6) == 0 || strncmp(name, "tls://", 6) == 0);
+}
+
+static void
+net_tls_error(const char *what)
+{
+	char buf[256];
+
+	ERR_error_string_n(ERR_get_error(), buf, sizeof (buf));
+	log_msg(LOG_ERR, 0, "%s: %s", what, buf);
+}
+
+/*
+ * Read up to n bytes. Returns the count, 0 at the end of the stream or -1.
+ */
+static int64_t
+end_read(struct net_end *e, uchar_t *buf, uint64_t n)
+{
+	int64_t rv;
+
+	if (e->ssl != NULL) {
+		rv = SSL_read(e->ssl, buf, n);
+		if (rv > 0)
+			return (rv);
+		if (SSL_get_error(e->ssl, rv) == SSL_ERROR_ZERO_RETURN)
+			return (0);
+		net_tls_error("TLS read");
+		return (-1);
+	}
+	do {
+		rv = read(e->fd, buf, n);
+	} while (rv == -1 && errno == EINTR);
+	return (rv);
+}
+
+static int
+end_write(struct net_end *e, const uchar_t *buf, uint64_t n)
+{
+	int64_t rv;
+
+	while (n > 0) {
+		if (e->ssl != NULL) {
+			rv = SSL_write(e->ssl, buf, n);
+			if (rv <= 0) {
+				net_tls_error("TLS write");
+				return (-1);
+			}
+		} else {
+			if (e->sock)
+				rv = send(e->fd, buf, n, MSG_NOSIGNAL);
+			else
+				rv = write(e->fd, buf, n);
+			if (rv == -1 && errno == EINTR)
+				continue;
+			if (rv <= 0)
+				return (-1);
+		}
+		buf += rv;
+		n -= rv;
+	}
+	return (0);
+}
+
+/*
+ * Move spilled data back into the ring as room frees up. Called with the
+ * lock held.
+ */
+static void
+net_refill(pc_net_t *net)
+{
+	uint64_t tail, m;
+
+	while (net->spill_r < net->spill_w && net->len < net->cap) {
+		tail = (net->head + net->len) % net->cap;
+		m = net->spill_w - net->spill_r;
+		if (m > net->cap - net->len)
+			m = net->cap - net->len;
+		if (m > net->cap - tail)
+			m = net->cap - tail;
+		if (pread(net->spill_fd, net->ring + tail, m, net->spill_r) != (int64_t)m) {
+			log_msg(LOG_ERR, 1, "Cannot read network spill file ");
+			net->err = 1;
+			return;
+		}
+		net->spill_r += m;
+		net->len += m;
+	}
+	if (net->spill_r == net->spill_w && net->spill_w > 0) {
+		net->spill_r = net->spill_w = 0;
+		(void) ftruncate(net->spill_fd, 0);
+	}
+}
+
+/*
+ * Append to the FIFO, waiting for room. New data goes to the ring unless
+ * older data is still in the spill file. Called with the lock held.
+ */
+static int
+net_put(pc_net_t *net, const uchar_t *buf, uint64_t n)
+{
+	uint64_t tail, m;
+
+	while (n > 0) {
+		if (net->stop || net->err)
+			return (-1);
+		if (net->spill_r == net->spill_w && net->len < net->cap) {
+			tail = (net->head + net->len) % net->cap;
+			m = n;
+			if (m > net->cap - net->len)
+				m = net->cap - net->len;
+			if (m > net->cap - tail)
+				m = net->cap - tail;
+			memcpy(net->ring + tail, buf, m);
+			net->len += m;
+			if (net->len > net->peak)
+				net->peak = net->len;
+			buf += m;
+			n -= m;
+			pthread_cond_broadcast(&net->cv);
+			continue;
+		}
+		if (net->spill_w - net->spill_r + n <= net->spill_max) {
+			if (net->spill_fd == -1) {
+				char path[MAXPATHLEN], *tmp;
+
+				tmp = get_temp_dir();
+				snprintf(path, sizeof (path), "%s/.pcnetXXXXXX", tmp);
+				free(tmp);
+				if ((net->spill_fd = mkstemp(path)) != -1)
+					unlink(path);
+			}
+			if (net->spill_fd == -1 ||
+			    pwrite(net->spill_fd, buf, n, net->spill_w) != (int64_t)n) {
+				log_msg(LOG_WARN, 1, "Network spill file failed, buffering "
+				    "in memory only ");
+				net->spill_max = 0;
+				continue;
+			}
+			net->spill_w += n;
+			net->spilled += n;
+			pthread_cond_broadcast(&net->cv);
+			break;
+		}
+		pthread_cond_wait(&net->cv, &net->lock);
+	}
+	return (0);
+}
+
+static void *
+net_fill(void *dat)
+{
+	pc_net_t *net = (pc_net_t *)dat;
+	uchar_t *buf;
+	int64_t n;
+
+	buf = (uchar_t *)malloc(NET_IO_SZ);
+	for (;;) {
+		n = (buf == NULL ? -1 : end_read(&net->src, buf, NET_IO_SZ));
+		pthread_mutex_lock(&net->lock);
+		if (n <= 0) {
+			if (n < 0 && !net->stop) {
+				if (buf != NULL)
+					log_msg(LOG_ERR, 1, "Network read ");
+				net->err = 1;
+			}
+			net->eof = 1;
+			pthread_cond_broadcast(&net->cv);
+			pthread_mutex_unlock(&net->lock);
+			break;
+		}
+		if (net_put(net, buf, n) == -1) {
+			pthread_mutex_unlock(&net->lock);
+			break;
+		}
+		pthread_mutex_unlock(&net->lock);
+	}
+	free(buf);
+	return (NULL);
+}
+
+static void *
+net_drain(void *dat)
+{
+	pc_net_t *net = (pc_net_t *)dat;
+	uchar_t *p;
+	uint64_t m;
+
+	for (;;) {
+		pthread_mutex_lock(&net->lock);
+		for (;;) {
+			net_refill(net);
+			if (net->stop || net->err || net->len > 0 ||
+			    (net->eof && net->spill_r == net->spill_w))
+				break;
+			pthread_cond_wait(&net->cv, &net->lock);
+		}
+		if (net->stop || net->err || net->len == 0) {
+			pthread_mutex_unlock(&net->lock);
+			break;
+		}
+		p = net->ring + net->head;
+		m = net->len;
+		if (m > net->cap - net->head)
+			m = net->cap - net->head;
+		if (m > NET_IO_SZ)
+			m = NET_IO_SZ;
+		pthread_mutex_unlock(&net->lock);
+
+		if (end_write(&net->dst, p, m) == -1) {
+			pthread_mutex_lock(&net->lock);
+			if (!net->stop) {
+				log_msg(LOG_ERR, 1, "Network write ");
+				net->err = 1;
+			}
+			pthread_cond_broadcast(&net->cv);
+			pthread_mutex_unlock(&net->lock);
+			break;
+		}
+		pthread_mutex_lock(&net->lock);
+		net->head = (net->head + m) % net->cap;
+		net->len -= m;
+		pthread_cond_broadcast(&net->cv);
+		pthread_mutex_unlock(&net->lock);
+	}
+
+	/*
+	 * The end of the stream is passed on: close_notify and a half close
+	 * to the peer, or EOF on the pipe to the decompressor. The sender then
+	 * waits for the peer to close. Closing with unread data, such as TLS
+	 * session tickets, would reset the connection and could lose the tail
+	 * of the stream.
+	 */
+	if (net->dir == PC_NET_SEND) {
+		if (net->conn.ssl != NULL && !net->err && !net->stop)
+			(void) SSL_shutdown((SSL *)net->conn.ssl);
+		(void) shutdown(net->conn.sock, SHUT_WR);
+		if (!net->err && !net->stop) {
+			char buf[512];
+
+			while (recv(net->conn.sock, buf, sizeof (buf), 0) > 0 || errno == EINTR);
+		}
+	} else {
+		close(net->dst.fd);
+		net->dst.fd = -1;
+	}
+	return (NULL);
+}
+
+/*
+ * Split [host]:port or host:port. An empty host means listen.
+ */
+static int
+net_parse(const char *url, char *host, char *port)
+{
+	const char *p, *e;
+
+	p = url + 6;
+	if (*p == '[') {
+		e = strchr(p, ']');
+		if (e == NULL || e[1] != ':')
+			return (-1);
+		p++;
+	} else {
+		e = strrchr(p, ':');
+		if (e == NULL)
+			return (-1);
+	}
+	if (e - p >= NET_HOST_MAX || strlen(strchr(e, ':') + 1) >= 32 ||
+	    *(strchr(e, ':') + 1) == '\0')
+		return (-1);
+	memcpy(host, p, e - p);
+	host[e - p] = '\0';
+	strcpy(port, strchr(e, ':') + 1);
+	return (0);
+}
+
+static int
+net_connect(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd, rv;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+		log_msg(LOG_ERR, 0, "%s: %s", host, gai_strerror(rv));
+		return (-1);
+	}
+	fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		log_msg(LOG_ERR, 1, "Cannot connect to %s port %s ", host, port);
+	return (fd);
+}
+
+/*
+ * Wait for a single connection on port, IPv6 and IPv4 where possible.
+ */
+static int
+net_accept(const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int lfd, fd, rv, on;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+		hints.ai_family = AF_UNSPEC;
+		if ((rv = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+			log_msg(LOG_ERR, 0, "Port %s: %s", port, gai_strerror(rv));
+			return (-1);
+		}
+	}
+	lfd = -1;
+	on = 1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		lfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (lfd == -1)
+			continue;
+		(void) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+		if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(lfd, 1) == 0)
+			break;
+		close(lfd);
+		lfd = -1;
+	}
+	freeaddrinfo(res);
+	if (lfd == -1) {
+		log_msg(LOG_ERR, 1, "Cannot listen on port %s ", port);
+		return (-1);
+	}
+	log_msg(LOG_INFO, 0, "Waiting for a connection on port %s", port);
+	do {
+		fd = accept(lfd, NULL, NULL);
+	} while (fd == -1 && errno == EINTR);
+	if (fd == -1)
+		log_msg(LOG_ERR, 1, "accept ");
+	close(lfd);
+	return (fd);
+}
+
+/*
+ * TLS 1.2 or later. The connecting side verifies the peer against
+ * PCOMPRESS_NET_CA or the system store and checks the host name. The
+ * listening side needs PCOMPRESS_NET_CERT and asks for a client
+ * certificate only when PCOMPRESS_NET_CA is set.
+ */
+static int
+net_tls_start(pc_conn_t *c, const char *host, int server)
+{
+	const char *cert, *key, *ca;
+	unsigned char addr[16];
+	SSL_CTX *sctx;
+	SSL *ssl;
+	int rv;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	SSL_library_init();
+	SSL_load_error_strings();
+#endif
+	cert = getenv("PCOMPRESS_NET_CERT");
+	key = getenv("PCOMPRESS_NET_KEY");
+	ca = getenv("PCOMPRESS_NET_CA");
+	if (server && cert == NULL) {
+		log_msg(LOG_ERR, 0, "A TLS listener needs PCOMPRESS_NET_CERT.");
+		return (-1);
+	}
+	sctx = SSL_CTX_new(server ? SSLv23_server_method() : SSLv23_client_method());
+	c->sctx = sctx;
+	if (sctx == NULL) {
+		net_tls_error("TLS setup");
+		return (-1);
+	}
+	SSL_CTX_set_options(sctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+	    SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+	if (cert != NULL) {
+		if (SSL_CTX_use_certificate_chain_file(sctx, cert) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(sctx, key ? key : cert,
+		    SSL_FILETYPE_PEM) != 1) {
+			net_tls_error(cert);
+			return (-1);
+		}
+	}
+	if (ca != NULL) {
+		if (SSL_CTX_load_verify_locations(sctx, ca, NULL) != 1) {
+			net_tls_error(ca);
+			return (-1);
+		}
+	} else if (!server) {
+		(void) SSL_CTX_set_default_verify_paths(sctx);
+	}
+	if (!server || ca != NULL)
+		SSL_CTX_set_verify(sctx, SSL_VERIFY_PEER |
+		    (server ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), NULL);
+
+	ssl = SSL_new(sctx);
+	c->ssl = ssl;
+	if (ssl == NULL || SSL_set_fd(ssl, c->sock) != 1) {
+		net_tls_error("TLS setup");
+		return (-1);
+	}
+	if (!server) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		if (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1) {
+			rv = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+		} else {
+			(void) SSL_set_tlsext_host_name(ssl, host);
+			rv = X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), host, 0);
+		}
+		if (rv != 1) {
+			net_tls_error("TLS setup");
+			return (-1);
+		}
+#else
+		(void) addr;
+		log_msg(LOG_WARN, 0, "OpenSSL is too old to check the host name of %s", host);
+#endif
+	}
+	rv = (server ? SSL_accept(ssl) : SSL_connect(ssl));
+	if (rv != 1) {
+		net_tls_error("TLS handshake");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Client connections for other transports, see pc_obj.c. Only one thread
+ * may use a connection at a time.
+ */
+int
+pc_conn_open(pc_conn_t *c, const char *host, const char *port, int tls)
+{
+	c->sctx = c->ssl = NULL;
+	if ((c->sock = net_connect(host, port)) == -1)
+		return (-1);
+	if (tls && net_tls_start(c, host, 0) == -1) {
+		pc_conn_close(c);
+		return (-1);
+	}
+	return (0);
+}
+
+int64_t
+pc_conn_read(pc_conn_t *c, void *buf, uint64_t n)
+{
+	struct net_end e;
+
+	e.fd = c->sock;
+	e.sock = 1;
+	e.ssl = (SSL *)c->ssl;
+	return (end_read(&e, (uchar_t *)buf, n));
+}
+
+int
+pc_conn_write(pc_conn_t *c, const void *buf, uint64_t n)
+{
+	struct net_end e;
+
+	e.fd = c->sock;
+	e.sock = 1;
+	e.ssl = (SSL *)c->ssl;
+	return (end_write(&e, (const uchar_t *)buf, n));
+}
+
+void
+pc_conn_close(pc_conn_t *c)
+{
+	if (c->ssl != NULL)
+		SSL_free((SSL *)c->ssl);
+	if (c->sctx != NULL)
+		SSL_CTX_free((SSL_CTX *)c->sctx);
+	if (c->sock != -1)
+		close(c->sock);
+	c->ssl = c->sctx = NULL;
+	c->sock = -1;
+}
+
+static void
+net_free(pc_net_t *net)
+{
+	pc_conn_close(&net->conn);
+	if (net->src.fd != -1 && !net->src.sock)
+		close(net->src.fd);
+	if (net->dst.fd != -1 && !net->dst.sock)
+		close(net->dst.fd);
+	if (net->local_fd != -1)
+		close(net->local_fd);
+	if (net->spill_fd != -1)
+		close(net->spill_fd);
+	free(net->ring);
+	pthread_mutex_destroy(&net->lock);
+	pthread_cond_destroy(&net->cv);
+	free(net);
+}
+
+/*
+ * Connect or accept and start the pumps. With PC_NET_SEND the caller
+ * writes to pc_net_fd(), with PC_NET_RECV it reads from it.
+ */
+pc_net_t *
+pc_net_open(const char *url, int dir)
+{
+	char host[NET_HOST_MAX], port[32];
+	int64_t val;
+	pc_net_t *net;
+	int fds[2];
+	char *e;
+
+	if (net_parse(url, host, port) == -1) {
+		log_msg(LOG_ERR, 0, "Invalid network address %s", url);
+		return (NULL);
+	}
+	net = (pc_net_t *)calloc(1, sizeof (pc_net_t));
+	if (net == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (NULL);
+	}
+	net->dir = dir;
+	net->conn.sock = net->local_fd = net->spill_fd = -1;
+	net->src.fd = net->dst.fd = -1;
+	pthread_mutex_init(&net->lock, NULL);
+	pthread_cond_init(&net->cv, NULL);
+
+	net->cap = NET_BUF_DEFAULT;
+	if ((e = getenv("PCOMPRESS_NET_BUFFER")) != NULL) {
+		if (parse_numeric(&val, e) == 2 || val < NET_BUF_MIN) {
+			log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_NET_BUFFER %s", e);
+			goto open_err;
+		}
+		net->cap = val;
+	}
+	if ((e = getenv("PCOMPRESS_NET_SPILL")) != NULL) {
+		if (parse_numeric(&val, e) == 2 || val < 0) {
+			log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_NET_SPILL %s", e);
+			goto open_err;
+		}
+		net->spill_max = val;
+	}
+	net->ring = (uchar_t *)malloc(net->cap);
+	if (net->ring == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		goto open_err;
+	}
+
+	/*
+	 * A peer that goes away shows up as a write error instead.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(fds) == -1) {
+		log_msg(LOG_ERR, 1, "pipe ");
+		goto open_err;
+	}
+#ifdef F_SETPIPE_SZ
+	(void) fcntl(fds[0], F_SETPIPE_SZ, NET_IO_SZ * 4);
+#endif
+	net->conn.sock = (host[0] == '\0' ? net_accept(port) : net_connect(host, port));
+	if (dir == PC_NET_SEND) {
+		net->local_fd = fds[1];
+		net->src.fd = fds[0];
+		net->dst.fd = net->conn.sock;
+		net->dst.sock = 1;
+	} else {
+		net->local_fd = fds[0];
+		net->dst.fd = fds[1];
+		net->src.fd = net->conn.sock;
+		net->src.sock = 1;
+	}
+	if (net->conn.sock == -1)
+		goto open_err;
+	if (strncmp(url, "tls://", 6) == 0) {
+		if (net_tls_start(&net->conn, host, host[0] == '\0') == -1)
+			goto open_err;
+		if (dir == PC_NET_SEND)
+			net->dst.ssl = (SSL *)net->conn.ssl;
+		else
+			net->src.ssl = (SSL *)net->conn.ssl;
+	}
+
+	if (pthread_create(&net->fill_thr, NULL, net_fill, net) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		goto open_err;
+	}
+	if (pthread_create(&net->drain_thr, NULL, net_drain, net) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		pthread_mutex_lock(&net->lock);
+		net->stop = 1;
+		pthread_mutex_unlock(&net->lock);
+		(void) shutdown(net->conn.sock, SHUT_RDWR);
+		close(net->local_fd);
+		net->local_fd = -1;
+		pthread_join(net->fill_thr, NULL);
+		goto open_err;
+	}
+	return (net);
+
+open_err:
+	net_free(net);
+	return (NULL);
+}
+
+int
+pc_net_fd(pc_net_t *net)
+{
+	return (net->local_fd);
+}
+
+/*
+ * Finish the stream. When sending, everything written so far is sent
+ * unless abort is set. When receiving the connection is dropped since the
+ * decompressor has read all it needs. Returns -1 if sending failed.
+ */
+int
+pc_net_close(pc_net_t *net, int abort)
+{
+	int rv;
+
+	pthread_mutex_lock(&net->lock);
+	if (abort || net->dir == PC_NET_RECV)
+		net->stop = 1;
+	pthread_cond_broadcast(&net->cv);
+	pthread_mutex_unlock(&net->lock);
+
+	close(net->local_fd);
+	net->local_fd = -1;
+	if (abort || net->dir == PC_NET_RECV)
+		(void) shutdown(net->conn.sock, SHUT_RDWR);
+	pthread_join(net->fill_thr, NULL);
+	pthread_join(net->drain_thr, NULL);
+
+	rv = 0;
+	if (net->dir == PC_NET_SEND && (net->err || net->len > 0 ||
+	    net->spill_r != net->spill_w) && !abort)
+		rv = -1;
+	log_msg(LOG_VERBOSE, 0, "Network buffer peak %" PRIu64 " bytes, %" PRIu64
+	    " bytes spilled", net->peak, net->spilled);
+	net_free(net);
+	return (rv);
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+
+#ifndef	_PC_NET_H
+#define	_PC_NET_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Network streams for the compressed data. A name of the form
+ * tcp://host:port or tls://host:port connects to host, tcp://:port and
+ * tls://:port wait for one connection on port. The caller reads or writes
+ * a local pipe while a pump copies between it and the connection through
+ * a memory buffer that can overflow to a spill file.
+ */
+#define	PC_NET_SEND	1
+#define	PC_NET_RECV	2
+
+typedef struct pc_net pc_net_t;
+
+int pc_net_url(const char *name);
+pc_net_t *pc_net_open(const char *url, int dir);
+int pc_net_fd(pc_net_t *net);
+int pc_net_close(pc_net_t *net, int abort);
+
+/*
+ * A client connection, plain or TLS. The TLS state is kept opaque so
+ * that users of this header do not need the OpenSSL headers.
+ */
+typedef struct pc_conn {
+	int sock;
+	void *sctx, *ssl;
+} pc_conn_t;
+
+int pc_conn_open(pc_conn_t *c, const char *host, const char *port, int tls);
+int64_t pc_conn_read(pc_conn_t *c, void *buf, uint64_t n);
+int pc_conn_write(pc_conn_t *c, const void *buf, uint64_t n);
+void pc_conn_close(pc_conn_t *c);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * NUMA topology is read from sysfs and applied with raw system calls so
+ * there is no libnuma dependency. Worker placement is only a hint: any
+ * failure leaves the thread where the scheduler put it.
+ */
+
+#ifndef __APPLE__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pc_numa.h"
+
+#ifndef __APPLE__
+
+#include <sched.h>
+#include <sys/syscall.h>
+
+#define	PC_NUMA_MAX_NODES	64
+#define	PC_MPOL_DEFAULT		0
+#define	PC_MPOL_PREFERRED	1
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_nodes = 0;
+static int node_ids[PC_NUMA_MAX_NODES];
+static cpu_set_t node_cpus[PC_NUMA_MAX_NODES];
+
+/*
+ * Parse a sysfs cpulist like "0-3,8-11" into a cpu set.
+ */
+static int
+parse_cpulist(const char *str, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+	int n = 0;
+
+	CPU_ZERO(set);
+	while (*str != '\0' && *str != '\n') {
+		lo = strtol(str, &end, 10);
+		if (end == str)
+			return (-1);
+		hi = lo;
+		if (*end == '-') {
+			str = end + 1;
+			hi = strtol(str, &end, 10);
+			if (end == str)
+				return (-1);
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+			CPU_SET(lo, set);
+			n++;
+		}
+		str = end;
+		if (*str == ',')
+			str++;
+	}
+	return (n);
+}
+
+static void
+numa_probe(void)
+{
+	char path[64], buf[1024];
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < PC_NUMA_MAX_NODES; i++) {
+		snprintf(path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", i);
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fgets(buf, sizeof (buf), fp) != NULL &&
+		    parse_cpulist(buf, &node_cpus[numa_nodes]) > 0) {
+			node_ids[numa_nodes] = i;
+			numa_nodes++;
+		}
+		fclose(fp);
+	}
+}
+
+/*
+ * Returns the number of usable NUMA nodes if placement is enabled and there
+ * is more than one node, 0 otherwise.
+ */
+int
+pc_numa_init(void)
+{
+	char *val;
+
+	val = getenv("PCOMPRESS_NUMA");
+	if (val == NULL || atoi(val) == 0)
+		return (0);
+	pthread_once(&numa_once, numa_probe);
+	return (numa_nodes > 1 ? numa_nodes : 0);
+}
+
+/*
+ * Node for the given worker id. Workers are spread round-robin.
+ */
+int
+pc_numa_node(int id)
+{
+	if (numa_nodes < 2)
+		return (-1);
+	return (id % numa_nodes);
+}
+
+/*
+ * Set the memory policy of the calling thread to prefer the given node, or
+ * back to the default policy if node is -1.
+ */
+int
+pc_numa_prefer(int node)
+{
+	unsigned long mask[PC_NUMA_MAX_NODES / (8 * sizeof (unsigned long))];
+
+	if (numa_nodes < 2)
+		return (0);
+	if (node < 0)
+		return (syscall(SYS_set_mempolicy, PC_MPOL_DEFAULT, NULL, 0));
+
+	memset(mask, 0, sizeof (mask));
+	mask[node_ids[node] / (8 * sizeof (unsigned long))] |=
+	    1UL << (node_ids[node] % (8 * sizeof (unsigned long)));
+	return (syscall(SYS_set_mempolicy, PC_MPOL_PREFERRED, mask,
+	    PC_NUMA_MAX_NODES + 1));
+}
+
+/*
+ * Pin the calling thread to the CPUs of a node and prefer its memory.
+ */
+int
+pc_numa_bind(int node)
+{
+	if (numa_nodes < 2 || node < 0)
+		return (0);
+	if (pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t),
+	    &node_cpus[node]) != 0)
+		return (-1);
+	return (pc_numa_prefer(node));
+}
+
+#else
+
+int
+pc_numa_init(void)
+{
+	return (0);
+}
+
+int
+pc_numa_node(int id)
+{
+	return (-1);
+}
+
+int
+pc_numa_bind(int node)
+{
+	return (0);
+}
+
+int
+pc_numa_prefer(int node)
+{
+	return (0);
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_NUMA_H
+#define	_PC_NUMA_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Optional NUMA placement of worker threads, enabled by setting PCOMPRESS_NUMA.
+ * Workers are spread round-robin over the nodes, pinned to the CPUs of their
+ * node and prefer memory from it. Without NUMA support or with a single node
+ * pc_numa_init() returns 0 and the other calls do nothing.
+ */
+int pc_numa_init(void);
+int pc_numa_node(int id);
+int pc_numa_bind(int node);
+int pc_numa_prefer(int node);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
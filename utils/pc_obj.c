@@ -0,0 +1,1019 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Minimal S3 client for multipart uploads and ranged downloads: HTTP/1.1
+ * with one request per connection and AWS Signature Version 4. Settings
+ * come from the environment:
+ *
+ *   AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY  Credentials, required
+ *   AWS_SESSION_TOKEN          Temporary credentials, optional
+ *   PCOMPRESS_S3_REGION        Region, else AWS_REGION or us-east-1
+ *   PCOMPRESS_S3_ENDPOINT      http[s]://host[:port] of the service, default
+ *                              https://s3.<region>.amazonaws.com
+ *   PCOMPRESS_S3_VHOST         1 for bucket.host instead of host/bucket
+ *   PCOMPRESS_S3_PART          Part and range size, default 16m, min 5m
+ *   PCOMPRESS_S3_CONCURRENCY   Parallel part requests, default 4
+ *
+ * Uploads are cut at chunk boundaries: every write from the writer holds
+ * whole chunks, and a part is handed to the upload threads once it has
+ * reached the part size. Part sizes grow by the base size every 1000
+ * parts so that 10000 parts cover close to 900 times the base size.
+ */
+
+#ifndef __APPLE__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <openssl/sha.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <utils.h>
+#include "pc_net.h"
+#include "pc_obj.h"
+
+#define	OBJ_PART_DEFAULT	(16 * 1024 * 1024)
+#define	OBJ_PART_MIN		(5 * 1024 * 1024)
+#define	OBJ_PART_GROW		1000
+#define	OBJ_MAX_PARTS		10000
+#define	OBJ_THREADS_DEFAULT	4
+#define	OBJ_THREADS_MAX		64
+#define	OBJ_RETRIES		4
+#define	OBJ_HDR_MAX		(16 * 1024)
+#define	OBJ_BODY_MAX		(1024 * 1024)
+#define	OBJ_PATH_MAX		2048
+
+#define	SLOT_FREE	0
+#define	SLOT_FILLING	1
+#define	SLOT_QUEUED	2
+#define	SLOT_BUSY	3
+#define	SLOT_READY	4
+
+struct s3_target {
+	char host[256], port[8];
+	char path[OBJ_PATH_MAX];
+	char region[64];
+	int tls;
+	const char *akey, *skey, *token;
+};
+
+struct s3_resp {
+	int status;
+	char etag[128];
+	uint64_t clen;
+	char *body;
+	uint64_t blen;
+};
+
+struct obj_slot {
+	uchar_t *buf;
+	uint64_t len, cap, off;
+	uint32_t num;
+	int state;
+};
+
+struct pc_obj {
+	struct s3_target s3;
+	int reading;
+	char upload_id[512];
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_t thr[OBJ_THREADS_MAX + 1];
+	int nthr, started;
+	struct obj_slot *slots;
+	int nslots;
+	uint64_t part_size;
+	int err, done;
+
+	/* Upload state. */
+	struct obj_slot *cur;
+	uint32_t next_num;
+	char (*etags)[128];
+	uint64_t total;
+
+	/* Download state. */
+	uint64_t size, next_fetch, next_write, nranges;
+	int fds[2];
+};
+
+int
+pc_obj_url(const char *name)
+{
+	return (strncmp(name, "s3://", 5) == 0);
+}
+
+static void
+hex_str(const uchar_t *d, int n, char *out)
+{
+	static const char hx[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < n; i++) {
+		out[i * 2] = hx[d[i] >> 4];
+		out[i * 2 + 1] = hx[d[i] & 15];
+	}
+	out[n * 2] = '\0';
+}
+
+static void
+sha256_hex(const void *d, uint64_t n, char *out)
+{
+	uchar_t md[SHA256_DIGEST_LENGTH];
+
+	SHA256((const uchar_t *)d, n, md);
+	hex_str(md, SHA256_DIGEST_LENGTH, out);
+}
+
+static void
+hmac256(const uchar_t *key, int klen, const char *msg, uchar_t *out)
+{
+	unsigned int olen = SHA256_DIGEST_LENGTH;
+
+	HMAC(EVP_sha256(), key, klen, (const uchar_t *)msg, strlen(msg), out, &olen);
+}
+
+/*
+ * RFC 3986 encoding as SigV4 wants it. Slashes are kept in paths.
+ */
+static int
+uri_encode(const char *s, char *out, int outlen, int keep_slash)
+{
+	static const char hx[] = "0123456789ABCDEF";
+	int o;
+
+	for (o = 0; *s != '\0'; s++) {
+		uchar_t c = *s;
+
+		if (o + 4 > outlen)
+			return (-1);
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+		    c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keep_slash)) {
+			out[o++] = c;
+		} else {
+			out[o++] = '%';
+			out[o++] = hx[c >> 4];
+			out[o++] = hx[c & 15];
+		}
+	}
+	out[o] = '\0';
+	return (0);
+}
+
+static int
+s3_target_init(struct s3_target *s3, const char *url)
+{
+	char bucket[256], enc[OBJ_PATH_MAX], *ep, *p;
+	const char *key, *e;
+	int vhost;
+
+	memset(s3, 0, sizeof (*s3));
+	s3->akey = getenv("AWS_ACCESS_KEY_ID");
+	s3->skey = getenv("AWS_SECRET_ACCESS_KEY");
+	s3->token = getenv("AWS_SESSION_TOKEN");
+	if (s3->akey == NULL || s3->skey == NULL) {
+		log_msg(LOG_ERR, 0, "AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are needed for %s",
+		    url);
+		return (-1);
+	}
+	if ((e = getenv("PCOMPRESS_S3_REGION")) == NULL && (e = getenv("AWS_REGION")) == NULL)
+		e = "us-east-1";
+	if (strlen(e) >= sizeof (s3->region))
+		return (-1);
+	strcpy(s3->region, e);
+
+	key = strchr(url + 5, '/');
+	if (key == NULL || key == url + 5 || key[1] == '\0' ||
+	    key - (url + 5) >= (int)sizeof (bucket)) {
+		log_msg(LOG_ERR, 0, "Invalid object name %s, expected s3://bucket/key", url);
+		return (-1);
+	}
+	memcpy(bucket, url + 5, key - (url + 5));
+	bucket[key - (url + 5)] = '\0';
+	if (uri_encode(key + 1, enc, sizeof (enc), 1) == -1) {
+		log_msg(LOG_ERR, 0, "Object name too long: %s", url);
+		return (-1);
+	}
+
+	/*
+	 * Endpoint host and port. The default is the regional AWS endpoint.
+	 */
+	s3->tls = 1;
+	strcpy(s3->port, "443");
+	if ((e = getenv("PCOMPRESS_S3_ENDPOINT")) != NULL) {
+		if (strncmp(e, "http://", 7) == 0) {
+			s3->tls = 0;
+			strcpy(s3->port, "80");
+			e += 7;
+		} else if (strncmp(e, "https://", 8) == 0) {
+			e += 8;
+		}
+		if (strlen(e) >= sizeof (s3->host)) {
+			log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_S3_ENDPOINT");
+			return (-1);
+		}
+		strcpy(s3->host, e);
+		if ((p = strchr(s3->host, '/')) != NULL)
+			*p = '\0';
+		if ((ep = strrchr(s3->host, ':')) != NULL && strchr(s3->host, ']') < ep) {
+			*ep++ = '\0';
+			if (strlen(ep) == 0 || strlen(ep) >= sizeof (s3->port)) {
+				log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_S3_ENDPOINT");
+				return (-1);
+			}
+			strcpy(s3->port, ep);
+		}
+	} else {
+		snprintf(s3->host, sizeof (s3->host), "s3.%s.amazonaws.com", s3->region);
+	}
+
+	vhost = ((e = getenv("PCOMPRESS_S3_VHOST")) != NULL && atoi(e) == 1);
+	if (vhost) {
+		char h[256];
+
+		if (snprintf(h, sizeof (h), "%s.%s", bucket, s3->host) >= (int)sizeof (h))
+			return (-1);
+		strcpy(s3->host, h);
+		snprintf(s3->path, sizeof (s3->path), "/%s", enc);
+	} else if (snprintf(s3->path, sizeof (s3->path), "/%s/%s", bucket, enc) >=
+	    (int)sizeof (s3->path)) {
+		log_msg(LOG_ERR, 0, "Object name too long: %s", url);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Read a whole response. The header is parsed for the status, the length
+ * and the ETag. A ranged GET body goes to dst, anything else to a
+ * buffer of at most OBJ_BODY_MAX bytes. Chunked bodies are only used for
+ * small XML replies and are decoded in place. HEAD replies have no body.
+ */
+static int
+s3_response(pc_conn_t *c, int head, uchar_t *dst, uint64_t dstlen, struct s3_resp *r)
+{
+	char *hdr, *eoh, *line, *p;
+	uint64_t have, n, blen, want;
+	int64_t rb;
+	int chunked;
+
+	hdr = (char *)malloc(OBJ_HDR_MAX + 1);
+	if (hdr == NULL)
+		return (-1);
+	have = 0;
+	eoh = NULL;
+	while (eoh == NULL) {
+		if (have == OBJ_HDR_MAX ||
+		    (rb = pc_conn_read(c, hdr + have, OBJ_HDR_MAX - have)) <= 0) {
+			free(hdr);
+			return (-1);
+		}
+		have += rb;
+		hdr[have] = '\0';
+		eoh = strstr(hdr, "\r\n\r\n");
+	}
+	*eoh = '\0';
+	eoh += 4;
+	if (sscanf(hdr, "HTTP/%*s %d", &r->status) != 1) {
+		free(hdr);
+		return (-1);
+	}
+	r->clen = UINT64_MAX;
+	chunked = 0;
+	for (line = strstr(hdr, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			r->clen = strtoull(line + 15, NULL, 10);
+		} else if (strncasecmp(line, "ETag:", 5) == 0) {
+			p = line + 5;
+			while (*p == ' ')
+				p++;
+			n = strcspn(p, "\r");
+			if (n >= sizeof (r->etag))
+				n = sizeof (r->etag) - 1;
+			memcpy(r->etag, p, n);
+			r->etag[n] = '\0';
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 &&
+		    strstr(line, "chunked") != NULL) {
+			chunked = 1;
+		}
+	}
+
+	have -= (eoh - hdr);
+	if (dst != NULL && (r->status == 200 || r->status == 206)) {
+		if (r->clen == UINT64_MAX || r->clen > dstlen || have > r->clen) {
+			free(hdr);
+			return (-1);
+		}
+		memcpy(dst, eoh, have);
+		while (have < r->clen) {
+			if ((rb = pc_conn_read(c, dst + have, r->clen - have)) <= 0) {
+				free(hdr);
+				return (-1);
+			}
+			have += rb;
+		}
+		r->blen = have;
+		free(hdr);
+		return (0);
+	}
+
+	want = (r->clen != UINT64_MAX && !chunked ? r->clen : OBJ_BODY_MAX);
+	if (want > OBJ_BODY_MAX)
+		want = OBJ_BODY_MAX;
+	if (head || r->status == 204 || r->status == 304)
+		want = have = 0;
+	r->body = (char *)malloc(want + have + 1);
+	if (r->body == NULL) {
+		free(hdr);
+		return (-1);
+	}
+	memcpy(r->body, eoh, have);
+	blen = have;
+	free(hdr);
+	while (blen < want) {
+		if (chunked && blen >= 5 && memcmp(r->body + blen - 5, "0\r\n\r\n", 5) == 0)
+			break;
+		if ((rb = pc_conn_read(c, r->body + blen, want - blen)) <= 0)
+			break;
+		blen += rb;
+	}
+	r->body[blen] = '\0';
+
+	if (chunked) {
+		char *src = r->body, *end = r->body + blen;
+		uint64_t o = 0, cl;
+
+		while (src < end) {
+			cl = strtoull(src, &p, 16);
+			if (p == src || cl == 0 || (p = strstr(p, "\r\n")) == NULL)
+				break;
+			p += 2;
+			if (p + cl > end)
+				cl = end - p;
+			memmove(r->body + o, p, cl);
+			o += cl;
+			src = p + cl + 2;
+		}
+		blen = o;
+		r->body[blen] = '\0';
+	}
+	r->blen = blen;
+	return (0);
+}
+
+/*
+ * One signed request on a new connection.
+ */
+static int
+s3_request_once(struct s3_target *s3, const char *method, const char *query,
+    const uchar_t *body, uint64_t blen, const char *range, uchar_t *dst,
+    uint64_t dstlen, struct s3_resp *r)
+{
+	char amzdate[32], date[16], phash[65], crhash[65], sig[65], scope[128];
+	char hosthdr[300], *creq, *req, *sts;
+	uchar_t k1[32], k2[32], key[64];
+	struct tm tm;
+	pc_conn_t c;
+	time_t now;
+	int rv, n;
+
+	memset(r, 0, sizeof (*r));
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(amzdate, sizeof (amzdate), "%Y%m%dT%H%M%SZ", &tm);
+	strftime(date, sizeof (date), "%Y%m%d", &tm);
+	sha256_hex(body != NULL ? body : (const uchar_t *)"", blen, phash);
+	if ((s3->tls && strcmp(s3->port, "443") == 0) ||
+	    (!s3->tls && strcmp(s3->port, "80") == 0))
+		snprintf(hosthdr, sizeof (hosthdr), "%s", s3->host);
+	else
+		snprintf(hosthdr, sizeof (hosthdr), "%s:%s", s3->host, s3->port);
+	snprintf(scope, sizeof (scope), "%s/%s/s3/aws4_request", date, s3->region);
+
+	n = OBJ_PATH_MAX * 2 + 4096;
+	creq = (char *)malloc(n);
+	sts = (char *)malloc(n);
+	req = (char *)malloc(n);
+	if (creq == NULL || sts == NULL || req == NULL) {
+		free(creq);
+		free(sts);
+		free(req);
+		return (-1);
+	}
+	snprintf(creq, n, "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n%s%s%s\n"
+	    "host;x-amz-content-sha256;x-amz-date%s\n%s", method, s3->path, query, hosthdr,
+	    phash, amzdate, s3->token ? "x-amz-security-token:" : "",
+	    s3->token ? s3->token : "", s3->token ? "\n" : "",
+	    s3->token ? ";x-amz-security-token" : "", phash);
+	sha256_hex(creq, strlen(creq), crhash);
+	snprintf(sts, n, "AWS4-HMAC-SHA256\n%s\n%s\n%s", amzdate, scope, crhash);
+
+	snprintf((char *)key, sizeof (key), "AWS4%s", s3->skey);
+	hmac256(key, strlen((char *)key), date, k1);
+	hmac256(k1, 32, s3->region, k2);
+	hmac256(k2, 32, "s3", k1);
+	hmac256(k1, 32, "aws4_request", k2);
+	hmac256(k2, 32, sts, k1);
+	hex_str(k1, 32, sig);
+
+	snprintf(req, n, "%s %s%s%s HTTP/1.1\r\nHost: %s\r\nx-amz-date: %s\r\n"
+	    "x-amz-content-sha256: %s\r\n%s%s%sAuthorization: AWS4-HMAC-SHA256 "
+	    "Credential=%s/%s, SignedHeaders=host;x-amz-content-sha256;x-amz-date%s, "
+	    "Signature=%s\r\nContent-Length: %" PRIu64 "\r\n%s%s%sConnection: close\r\n\r\n",
+	    method, s3->path, query[0] ? "?" : "", query, hosthdr, amzdate, phash,
+	    s3->token ? "x-amz-security-token: " : "", s3->token ? s3->token : "",
+	    s3->token ? "\r\n" : "", s3->akey, scope,
+	    s3->token ? ";x-amz-security-token" : "", sig, blen,
+	    range ? "Range: bytes=" : "", range ? range : "", range ? "\r\n" : "");
+
+	rv = -1;
+	if (pc_conn_open(&c, s3->host, s3->port, s3->tls) == 0) {
+		if (pc_conn_write(&c, req, strlen(req)) == 0 &&
+		    (blen == 0 || pc_conn_write(&c, body, blen) == 0) &&
+		    s3_response(&c, strcmp(method, "HEAD") == 0, dst, dstlen, r) == 0)
+			rv = 0;
+		pc_conn_close(&c);
+	}
+	free(creq);
+	free(sts);
+	free(req);
+	return (rv);
+}
+
+/*
+ * Retry network errors, throttling and server errors with backoff. Other
+ * statuses are returned to the caller.
+ */
+static int
+s3_request(struct s3_target *s3, const char *method, const char *query,
+    const uchar_t *body, uint64_t blen, const char *range, uchar_t *dst,
+    uint64_t dstlen, struct s3_resp *r)
+{
+	int i;
+
+	for (i = 0; i < OBJ_RETRIES; i++) {
+		if (i > 0) {
+			free(r->body);
+			r->body = NULL;
+			sleep(1 << (i - 1));
+		}
+		if (s3_request_once(s3, method, query, body, blen, range, dst, dstlen, r) == 0 &&
+		    r->status < 500 && r->status != 429)
+			return (0);
+	}
+	if (r->status != 0)
+		log_msg(LOG_ERR, 0, "%s %s: HTTP status %d", method, s3->path, r->status);
+	else
+		log_msg(LOG_ERR, 0, "%s %s: request failed", method, s3->path);
+	return (-1);
+}
+
+static int
+s3_ok(struct s3_target *s3, const char *method, struct s3_resp *r)
+{
+	if (r->status >= 200 && r->status < 300 &&
+	    (r->body == NULL || strstr(r->body, "<Error>") == NULL))
+		return (1);
+	log_msg(LOG_ERR, 0, "%s %s: HTTP status %d %s", method, s3->path, r->status,
+	    r->body ? r->body : "");
+	return (0);
+}
+
+static void
+obj_settings(pc_obj_t *obj)
+{
+	int64_t val;
+	char *e;
+
+	obj->part_size = OBJ_PART_DEFAULT;
+	if ((e = getenv("PCOMPRESS_S3_PART")) != NULL) {
+		if (parse_numeric(&val, e) != 0 || val < OBJ_PART_MIN)
+			log_msg(LOG_WARN, 0, "Ignoring PCOMPRESS_S3_PART %s, the minimum is 5m", e);
+		else
+			obj->part_size = val;
+	}
+	obj->nthr = OBJ_THREADS_DEFAULT;
+	if ((e = getenv("PCOMPRESS_S3_CONCURRENCY")) != NULL) {
+		obj->nthr = atoi(e);
+		if (obj->nthr < 1)
+			obj->nthr = 1;
+		if (obj->nthr > OBJ_THREADS_MAX)
+			obj->nthr = OBJ_THREADS_MAX;
+	}
+	obj->nslots = obj->nthr + 2;
+}
+
+static pc_obj_t *
+obj_alloc(const char *url, int reading)
+{
+	pc_obj_t *obj;
+	int i;
+
+	obj = (pc_obj_t *)calloc(1, sizeof (pc_obj_t));
+	if (obj == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (NULL);
+	}
+	obj->reading = reading;
+	obj->fds[0] = obj->fds[1] = -1;
+	pthread_mutex_init(&obj->lock, NULL);
+	pthread_cond_init(&obj->cv, NULL);
+	if (s3_target_init(&obj->s3, url) == -1) {
+		free(obj);
+		return (NULL);
+	}
+	obj_settings(obj);
+	obj->slots = (struct obj_slot *)calloc(obj->nslots, sizeof (struct obj_slot));
+	if (obj->slots == NULL) {
+		free(obj);
+		log_msg(LOG_ERR, 0, "Out of memory");
+		return (NULL);
+	}
+	for (i = 0; i < obj->nslots; i++) {
+		obj->slots[i].cap = obj->part_size;
+		obj->slots[i].buf = (uchar_t *)malloc(obj->part_size);
+		if (obj->slots[i].buf == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			obj->err = 1;
+		}
+	}
+
+	/*
+	 * A peer that goes away shows up as a write error instead.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	return (obj);
+}
+
+static void
+obj_free(pc_obj_t *obj)
+{
+	int i;
+
+	for (i = 0; i < obj->nslots; i++)
+		free(obj->slots[i].buf);
+	free(obj->slots);
+	free(obj->etags);
+	if (obj->fds[0] != -1)
+		close(obj->fds[0]);
+	if (obj->fds[1] != -1)
+		close(obj->fds[1]);
+	pthread_mutex_destroy(&obj->lock);
+	pthread_cond_destroy(&obj->cv);
+	free(obj);
+}
+
+static uint64_t
+obj_part_target(pc_obj_t *obj, uint32_t num)
+{
+	return (obj->part_size * (1 + (num - 1) / OBJ_PART_GROW));
+}
+
+static void *
+obj_upload_thread(void *dat)
+{
+	pc_obj_t *obj = (pc_obj_t *)dat;
+	struct obj_slot *s;
+	struct s3_resp r;
+	char query[700];
+	int i, ok;
+
+	for (;;) {
+		pthread_mutex_lock(&obj->lock);
+		for (;;) {
+			s = NULL;
+			for (i = 0; i < obj->nslots; i++) {
+				if (obj->slots[i].state == SLOT_QUEUED &&
+				    (s == NULL || obj->slots[i].num < s->num))
+					s = &obj->slots[i];
+			}
+			if (s != NULL || obj->done)
+				break;
+			pthread_cond_wait(&obj->cv, &obj->lock);
+		}
+		if (s == NULL) {
+			pthread_mutex_unlock(&obj->lock);
+			break;
+		}
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&obj->lock);
+
+		snprintf(query, sizeof (query), "partNumber=%u&uploadId=%s", s->num, obj->upload_id);
+		ok = (s3_request(&obj->s3, "PUT", query, s->buf, s->len, NULL, NULL, 0, &r) == 0 &&
+		    s3_ok(&obj->s3, "PUT", &r) && r.etag[0] != '\0');
+		free(r.body);
+
+		pthread_mutex_lock(&obj->lock);
+		if (ok)
+			strcpy(obj->etags[s->num - 1], r.etag);
+		else
+			obj->err = 1;
+		s->state = SLOT_FREE;
+		s->len = 0;
+		pthread_cond_broadcast(&obj->cv);
+		pthread_mutex_unlock(&obj->lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Start a multipart upload and its upload threads.
+ */
+pc_obj_t *
+pc_obj_create(const char *url)
+{
+	struct s3_resp r;
+	pc_obj_t *obj;
+	char *s, *e;
+
+	if ((obj = obj_alloc(url, 0)) == NULL)
+		return (NULL);
+	obj->etags = calloc(OBJ_MAX_PARTS, sizeof (*obj->etags));
+	if (obj->err || obj->etags == NULL) {
+		log_msg(LOG_ERR, 0, "Out of memory");
+		obj_free(obj);
+		return (NULL);
+	}
+	if (s3_request(&obj->s3, "POST", "uploads=", NULL, 0, NULL, NULL, 0, &r) == -1 ||
+	    !s3_ok(&obj->s3, "POST", &r) || r.body == NULL ||
+	    (s = strstr(r.body, "<UploadId>")) == NULL ||
+	    (e = strstr(s, "</UploadId>")) == NULL) {
+		log_msg(LOG_ERR, 0, "Cannot start the upload of %s", url);
+		free(r.body);
+		obj_free(obj);
+		return (NULL);
+	}
+	s += 10;
+	*e = '\0';
+	if (uri_encode(s, obj->upload_id, sizeof (obj->upload_id), 0) == -1) {
+		free(r.body);
+		obj_free(obj);
+		return (NULL);
+	}
+	free(r.body);
+
+	for (obj->started = 0; obj->started < obj->nthr; obj->started++) {
+		if (pthread_create(&obj->thr[obj->started], NULL, obj_upload_thread, obj) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			(void) pc_obj_finish(obj, 1);
+			return (NULL);
+		}
+	}
+	return (obj);
+}
+
+/*
+ * Hand the part being filled to the upload threads. Called with the lock
+ * held.
+ */
+static void
+obj_submit(pc_obj_t *obj)
+{
+	obj->cur->state = SLOT_QUEUED;
+	obj->cur = NULL;
+	pthread_cond_broadcast(&obj->cv);
+}
+
+/*
+ * Append whole chunks to the current part. Blocks while all part buffers
+ * are in flight.
+ */
+int
+pc_obj_write(pc_obj_t *obj, const struct iovec *iov, int n)
+{
+	struct obj_slot *s;
+	uint64_t len;
+	uchar_t *nb;
+	int i;
+
+	len = 0;
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+	pthread_mutex_lock(&obj->lock);
+	while (obj->cur == NULL && !obj->err) {
+		for (i = 0; i < obj->nslots; i++) {
+			if (obj->slots[i].state == SLOT_FREE) {
+				if (obj->next_num == OBJ_MAX_PARTS) {
+					log_msg(LOG_ERR, 0, "Too many upload parts, raise "
+					    "PCOMPRESS_S3_PART");
+					obj->err = 1;
+					break;
+				}
+				obj->cur = &obj->slots[i];
+				obj->cur->state = SLOT_FILLING;
+				obj->cur->num = ++obj->next_num;
+				obj->cur->len = 0;
+				break;
+			}
+		}
+		if (obj->cur == NULL && !obj->err)
+			pthread_cond_wait(&obj->cv, &obj->lock);
+	}
+	if (obj->err) {
+		pthread_mutex_unlock(&obj->lock);
+		return (-1);
+	}
+	s = obj->cur;
+	pthread_mutex_unlock(&obj->lock);
+
+	if (s->len + len > s->cap) {
+		nb = (uchar_t *)realloc(s->buf, s->len + len);
+		if (nb == NULL) {
+			log_msg(LOG_ERR, 0, "Out of memory");
+			return (-1);
+		}
+		s->buf = nb;
+		s->cap = s->len + len;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(s->buf + s->len, iov[i].iov_base, iov[i].iov_len);
+		s->len += iov[i].iov_len;
+	}
+	obj->total += len;
+	if (s->len >= obj_part_target(obj, s->num)) {
+		pthread_mutex_lock(&obj->lock);
+		obj_submit(obj);
+		pthread_mutex_unlock(&obj->lock);
+	}
+	return (0);
+}
+
+/*
+ * Upload the last part and complete the upload, or abort it so that no
+ * parts are left behind.
+ */
+int
+pc_obj_finish(pc_obj_t *obj, int abort)
+{
+	struct s3_resp r;
+	char query[600], *xml, *p;
+	uint32_t i;
+	int rv;
+
+	pthread_mutex_lock(&obj->lock);
+	if (obj->cur != NULL) {
+		if (abort || obj->cur->len == 0) {
+			obj->cur->state = SLOT_FREE;
+			obj->cur = NULL;
+			obj->next_num--;
+		} else {
+			obj_submit(obj);
+		}
+	}
+	obj->done = 1;
+	pthread_cond_broadcast(&obj->cv);
+	pthread_mutex_unlock(&obj->lock);
+	for (i = 0; i < (uint32_t)obj->started; i++)
+		pthread_join(obj->thr[i], NULL);
+
+	snprintf(query, sizeof (query), "uploadId=%s", obj->upload_id);
+	rv = -1;
+	if (!abort && !obj->err && obj->next_num > 0) {
+		xml = (char *)malloc(obj->next_num * 200 + 100);
+		if (xml != NULL) {
+			p = xml + sprintf(xml, "<CompleteMultipartUpload>");
+			for (i = 0; i < obj->next_num; i++)
+				p += sprintf(p, "<Part><PartNumber>%u</PartNumber><ETag>%s</ETag></Part>",
+				    i + 1, obj->etags[i]);
+			strcpy(p, "</CompleteMultipartUpload>");
+			if (s3_request(&obj->s3, "POST", query, (uchar_t *)xml, strlen(xml),
+			    NULL, NULL, 0, &r) == 0 && s3_ok(&obj->s3, "POST", &r))
+				rv = 0;
+			free(r.body);
+			free(xml);
+		}
+		if (rv == 0)
+			log_msg(LOG_VERBOSE, 0, "Uploaded %" PRIu64 " bytes in %u parts",
+			    obj->total, obj->next_num);
+	}
+	if (rv != 0) {
+		if (s3_request(&obj->s3, "DELETE", query, NULL, 0, NULL, NULL, 0, &r) == 0)
+			(void) s3_ok(&obj->s3, "DELETE", &r);
+		free(r.body);
+	}
+	obj_free(obj);
+	return (abort ? 0 : rv);
+}
+
+static void *
+obj_fetch_thread(void *dat)
+{
+	pc_obj_t *obj = (pc_obj_t *)dat;
+	struct obj_slot *s;
+	struct s3_resp r;
+	char range[64];
+	uint64_t k, len;
+	int i, ok;
+
+	for (;;) {
+		pthread_mutex_lock(&obj->lock);
+		for (;;) {
+			s = NULL;
+			if (obj->err || obj->done || obj->next_fetch == obj->nranges)
+				break;
+			if (obj->next_fetch < obj->next_write + obj->nslots) {
+				for (i = 0; i < obj->nslots; i++) {
+					if (obj->slots[i].state == SLOT_FREE) {
+						s = &obj->slots[i];
+						break;
+					}
+				}
+			}
+			if (s != NULL)
+				break;
+			pthread_cond_wait(&obj->cv, &obj->lock);
+		}
+		if (s == NULL) {
+			pthread_mutex_unlock(&obj->lock);
+			break;
+		}
+		k = obj->next_fetch++;
+		s->state = SLOT_BUSY;
+		s->off = k;
+		pthread_mutex_unlock(&obj->lock);
+
+		len = obj->size - k * obj->part_size;
+		if (len > obj->part_size)
+			len = obj->part_size;
+		snprintf(range, sizeof (range), "%" PRIu64 "-%" PRIu64, k * obj->part_size,
+		    k * obj->part_size + len - 1);
+		ok = (s3_request(&obj->s3, "GET", "", NULL, 0, range, s->buf, s->cap, &r) == 0 &&
+		    s3_ok(&obj->s3, "GET", &r) && r.blen == len);
+		free(r.body);
+
+		pthread_mutex_lock(&obj->lock);
+		if (ok) {
+			s->len = len;
+			s->state = SLOT_READY;
+		} else {
+			obj->err = 1;
+		}
+		pthread_cond_broadcast(&obj->cv);
+		pthread_mutex_unlock(&obj->lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Pass fetched ranges on to the decompressor in order.
+ */
+static void *
+obj_feed_thread(void *dat)
+{
+	pc_obj_t *obj = (pc_obj_t *)dat;
+	struct obj_slot *s;
+	uint64_t o;
+	int64_t wb;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&obj->lock);
+		for (;;) {
+			s = NULL;
+			if (obj->err || obj->done || obj->next_write == obj->nranges)
+				break;
+			for (i = 0; i < obj->nslots; i++) {
+				if (obj->slots[i].state == SLOT_READY &&
+				    obj->slots[i].off == obj->next_write) {
+					s = &obj->slots[i];
+					break;
+				}
+			}
+			if (s != NULL)
+				break;
+			pthread_cond_wait(&obj->cv, &obj->lock);
+		}
+		pthread_mutex_unlock(&obj->lock);
+		if (s == NULL)
+			break;
+
+		for (o = 0; o < s->len; o += wb) {
+			wb = write(obj->fds[1], s->buf + o, s->len - o);
+			if (wb == -1 && errno == EINTR) {
+				wb = 0;
+				continue;
+			}
+			if (wb <= 0)
+				break;
+		}
+		pthread_mutex_lock(&obj->lock);
+		if (o < s->len)
+			obj->err = 1;
+		s->state = SLOT_FREE;
+		obj->next_write++;
+		pthread_cond_broadcast(&obj->cv);
+		pthread_mutex_unlock(&obj->lock);
+	}
+
+	/*
+	 * EOF for the decompressor, which reports a truncated stream if a
+	 * range could not be fetched.
+	 */
+	close(obj->fds[1]);
+	obj->fds[1] = -1;
+	return (NULL);
+}
+
+/*
+ * Open an object for reading. The decompressor reads pc_obj_fd().
+ */
+pc_obj_t *
+pc_obj_open(const char *url)
+{
+	struct s3_resp r;
+	pc_obj_t *obj;
+
+	if ((obj = obj_alloc(url, 1)) == NULL)
+		return (NULL);
+	if (obj->err) {
+		obj_free(obj);
+		return (NULL);
+	}
+	if (s3_request(&obj->s3, "HEAD", "", NULL, 0, NULL, NULL, 0, &r) == -1 ||
+	    r.status != 200 || r.clen == UINT64_MAX || r.clen == 0) {
+		if (r.status != 0)
+			log_msg(LOG_ERR, 0, "Cannot read %s: HTTP status %d", url, r.status);
+		free(r.body);
+		obj_free(obj);
+		return (NULL);
+	}
+	free(r.body);
+	obj->size = r.clen;
+	obj->nranges = (obj->size + obj->part_size - 1) / obj->part_size;
+	if (pipe(obj->fds) == -1) {
+		log_msg(LOG_ERR, 1, "pipe ");
+		obj_free(obj);
+		return (NULL);
+	}
+
+	if (pthread_create(&obj->thr[0], NULL, obj_feed_thread, obj) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		obj_free(obj);
+		return (NULL);
+	}
+	for (obj->started = 1; obj->started <= obj->nthr; obj->started++) {
+		if (pthread_create(&obj->thr[obj->started], NULL, obj_fetch_thread, obj) != 0) {
+			log_msg(LOG_ERR, 1, "Error in thread creation: ");
+			pc_obj_close(obj);
+			return (NULL);
+		}
+	}
+	return (obj);
+}
+
+int
+pc_obj_fd(pc_obj_t *obj)
+{
+	return (obj->fds[0]);
+}
+
+void
+pc_obj_close(pc_obj_t *obj)
+{
+	int i;
+
+	pthread_mutex_lock(&obj->lock);
+	obj->done = 1;
+	pthread_cond_broadcast(&obj->cv);
+	pthread_mutex_unlock(&obj->lock);
+
+	/*
+	 * Unblocks the feed thread if it is writing to the pipe.
+	 */
+	close(obj->fds[0]);
+	obj->fds[0] = -1;
+	for (i = 0; i < obj->started; i++)
+		pthread_join(obj->thr[i], NULL);
+	obj_free(obj);
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+
+#ifndef	_PC_OBJ_H
+#define	_PC_OBJ_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * S3 compatible object storage for the compressed stream, named as
+ * s3://bucket/key. Output is collected into multipart upload parts that
+ * are uploaded concurrently. Input is fetched with parallel ranged GETs
+ * and handed to the decompressor in order through a local pipe.
+ */
+typedef struct pc_obj pc_obj_t;
+
+int pc_obj_url(const char *name);
+pc_obj_t *pc_obj_create(const char *url);
+int pc_obj_write(pc_obj_t *obj, const struct iovec *iov, int n);
+int pc_obj_finish(pc_obj_t *obj, int abort);
+pc_obj_t *pc_obj_open(const char *url);
+int pc_obj_fd(pc_obj_t *obj);
+void pc_obj_close(pc_obj_t *obj);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Constant byte run elimination. Any run of at least PC_RUN_MIN bytes covers
+ * 16 bytes starting at a multiple of PC_RUN_MIN / 2, so only those probe
+ * points are tested on ordinary data. A probe that hits is extended both ways
+ * 16 bytes at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils.h>
+#include "pc_runs.h"
+
+#ifdef __USE_SSE_INTRIN__
+#include <emmintrin.h>
+#endif
+
+#define	RUN_PROBE	(PC_RUN_MIN / 2)
+#define	RUN_RECSZ	(2 * sizeof (uint64_t))
+#define	RUN_TRAILER	(sizeof (uint64_t) + sizeof (uint32_t))
+
+/*
+ * Check whether the 16 bytes at p are all c.
+ */
+static inline int
+run_const16(const uchar_t *p, uchar_t c)
+{
+#ifdef __USE_SSE_INTRIN__
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))) == 0xffff);
+#else
+	uint64_t cv = 0x0101010101010101ULL * c;
+	return (U64_P(p) == cv && U64_P(p + 8) == cv);
+#endif
+}
+
+int64_t
+pc_runs_eliminate(uchar_t *buf, uint64_t len)
+{
+	uint64_t *runs, w, r, p, s, e, nruns, maxruns, i;
+	uchar_t c, *rec;
+
+	if (len < PC_RUN_MIN)
+		return (-1);
+	maxruns = len / PC_RUN_MIN;
+	runs = NULL;
+	nruns = 0;
+	w = 0;
+	r = 0;
+	for (p = 0; p + 16 <= len; p += RUN_PROBE) {
+		if (p < r)
+			continue;
+		c = buf[p];
+		if (!run_const16(buf + p, c))
+			continue;
+
+		/*
+		 * Bytes before r have already been overwritten by compaction.
+		 */
+		s = p;
+		while (s >= r + 16 && run_const16(buf + s - 16, c))
+			s -= 16;
+		while (s > r && buf[s - 1] == c)
+			s--;
+		e = p + 16;
+		while (e + 16 <= len && run_const16(buf + e, c))
+			e += 16;
+		while (e < len && buf[e] == c)
+			e++;
+		if (e - s < PC_RUN_MIN)
+			continue;
+
+		if (runs == NULL) {
+			runs = (uint64_t *)malloc(maxruns * 2 * sizeof (uint64_t));
+			if (runs == NULL)
+				return (-1);
+		}
+		memmove(buf + w, buf + r, s - r);
+		w += s - r;
+		runs[nruns * 2] = s;
+		runs[nruns * 2 + 1] = ((e - s) << 8) | c;
+		nruns++;
+		r = e;
+	}
+	if (nruns == 0)
+		return (-1);
+
+	memmove(buf + w, buf + r, len - r);
+	w += len - r;
+	rec = buf + w;
+	for (i = 0; i < nruns; i++) {
+		U64_P(rec) = htonll(runs[i * 2]);
+		U64_P(rec + 8) = htonll(runs[i * 2 + 1]);
+		rec += RUN_RECSZ;
+	}
+	U64_P(rec) = htonll(len);
+	U32_P(rec + 8) = htonl(nruns);
+	free(runs);
+	return (w + nruns * RUN_RECSZ + RUN_TRAILER);
+}
+
+/*
+ * Expand the runs again working backward from the end, so that the literal
+ * bytes are only ever moved up. Returns -1 on inconsistent run records.
+ */
+int
+pc_runs_restore(uchar_t *buf, uint64_t len, uint64_t bufsz, uint64_t *olen)
+{
+	uint64_t *runs, nruns, lit, src, dst, off, rl, seg, i;
+
+	if (len < RUN_TRAILER)
+		return (-1);
+	nruns = ntohl(U32_P(buf + len - sizeof (uint32_t)));
+	dst = ntohll(U64_P(buf + len - RUN_TRAILER));
+	if (nruns == 0 || nruns > (len - RUN_TRAILER) / RUN_RECSZ || dst > bufsz)
+		return (-1);
+	lit = len - RUN_TRAILER - nruns * RUN_RECSZ;
+	runs = (uint64_t *)malloc(nruns * RUN_RECSZ);
+	if (runs == NULL)
+		return (-1);
+	for (i = 0; i < nruns * 2; i++)
+		runs[i] = ntohll(U64_P(buf + lit + i * sizeof (uint64_t)));
+
+	*olen = dst;
+	src = lit;
+	i = nruns;
+	while (i-- > 0) {
+		off = runs[i * 2];
+		rl = runs[i * 2 + 1] >> 8;
+		if (rl > dst || off > dst - rl)
+			goto corrupt;
+		seg = dst - (off + rl);
+		if (seg > src)
+			goto corrupt;
+		memmove(buf + off + rl, buf + src - seg, seg);
+		src -= seg;
+		memset(buf + off, runs[i * 2 + 1] & 0xff, rl);
+		dst = off;
+	}
+	if (src != dst)
+		goto corrupt;
+	free(runs);
+	return (0);
+corrupt:
+	free(runs);
+	return (-1);
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_RUNS_H
+#define	_PC_RUNS_H
+
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Long runs of one byte value, like the zeroes in sparse disk images, are cut
+ * out of a chunk before dedupe and compression and described by run records
+ * appended to the remaining data:
+ *
+ *	literal bytes | (offset, length << 8 | byte) * nruns | original length | nruns
+ *
+ * with 64-bit big-endian record fields and a 32-bit run count. Both directions
+ * work in place.
+ */
+#define	PC_RUN_MIN	4096
+
+int64_t pc_runs_eliminate(unsigned char *buf, uint64_t len);
+int pc_runs_restore(unsigned char *buf, uint64_t len, uint64_t bufsz, uint64_t *olen);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
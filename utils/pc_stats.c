@@ -0,0 +1,1261 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Per-stage chunk latency and throughput accounting. Every thread records
+ * into its own pc_stats_t, the sets are only combined when the report is
+ * written at the end of an operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "pc_stats.h"
+
+static const char *stage_names[PC_STAGE_MAX] = {
+	"read", "analyze", "preproc", "dedupe", "codec", "checksum", "crypto", "write"
+};
+
+pc_stats_t *
+pc_stats_create(int nsets)
+{
+	pc_stats_t *stats;
+	int i, j;
+
+	stats = (pc_stats_t *)calloc(nsets, sizeof (pc_stats_t));
+	if (stats == NULL)
+		return (NULL);
+	for (i = 0; i < nsets; i++) {
+		for (j = 0; j < PC_STAGE_MAX; j++)
+			stats[i].st[j].min_ns = UINT64_MAX;
+	}
+	return (stats);
+}
+
+void
+pc_stats_destroy(pc_stats_t *stats)
+{
+	free(stats);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return (0);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Hardware counters. Every thread opens one counter group on its first
+ * sample and reads all members with a single read(). Stages can nest, so
+ * the counts at each start are kept on a small per-thread stack, keyed by
+ * the start timestamp that pc_stats_end() gets back. Entries of stages that
+ * never end are dropped once the stack wraps.
+ */
+#define	PERF_DEPTH	8
+
+static const char *perf_names[PC_PERF_MAX] = {
+	"cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+struct perf_thr {
+	int state;			// 0 not opened, 1 counting, -1 failed
+	int leader, n;
+	int fd[PC_PERF_MAX];
+	int idx[PC_PERF_MAX];		// Position in a group read, -1 if absent
+	int top;
+	struct {
+		uint64_t ts;
+		uint64_t v[PC_PERF_MAX];
+	} st[PERF_DEPTH];
+};
+
+static int perf_on = 0, perf_mask = 0;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t perf_key;
+static __thread struct perf_thr *perf_self = NULL;
+
+static void
+perf_thr_free(void *arg)
+{
+	struct perf_thr *pt = (struct perf_thr *)arg;
+	int i;
+
+	for (i = 0; i < PC_PERF_MAX; i++) {
+		if (pt->fd[i] != -1)
+			close(pt->fd[i]);
+	}
+	free(pt);
+}
+
+static void
+perf_key_init(void)
+{
+	(void) pthread_key_create(&perf_key, perf_thr_free);
+}
+
+#ifdef __linux__
+static const uint64_t perf_config[PC_PERF_MAX] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int
+perf_open(uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof (attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof (attr);
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return ((int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+#endif
+
+/*
+ * Counter group of the calling thread, opened on first use. Counters the
+ * PMU does not have are left out, the group fails only without any.
+ */
+static struct perf_thr *
+perf_thread(void)
+{
+	struct perf_thr *pt;
+	int i;
+
+	pt = perf_self;
+	if (pt != NULL)
+		return (pt->state > 0 ? pt : NULL);
+	pt = (struct perf_thr *)calloc(1, sizeof (struct perf_thr));
+	if (pt == NULL)
+		return (NULL);
+	pt->state = -1;
+	pt->leader = -1;
+	for (i = 0; i < PC_PERF_MAX; i++) {
+		pt->fd[i] = -1;
+		pt->idx[i] = -1;
+	}
+#ifdef __linux__
+	for (i = 0; i < PC_PERF_MAX; i++) {
+		pt->fd[i] = perf_open(perf_config[i], pt->leader);
+		if (pt->fd[i] == -1)
+			continue;
+		if (pt->leader == -1)
+			pt->leader = pt->fd[i];
+		pt->idx[i] = pt->n++;
+		__sync_fetch_and_or(&perf_mask, 1 << i);
+	}
+	if (pt->leader != -1)
+		pt->state = 1;
+#endif
+	perf_self = pt;
+	(void) pthread_once(&perf_once, perf_key_init);
+	(void) pthread_setspecific(perf_key, pt);
+	return (pt->state > 0 ? pt : NULL);
+}
+
+/*
+ * Read the counters of the thread, scaled up if the kernel had to multiplex
+ * the group with other users of the PMU.
+ */
+static int
+perf_read_thr(struct perf_thr *pt, uint64_t *v)
+{
+	uint64_t buf[3 + PC_PERF_MAX];
+	int i;
+
+	if (read(pt->leader, buf, sizeof (buf)) < (ssize_t)((3 + pt->n) * sizeof (uint64_t)))
+		return (0);
+	for (i = 0; i < PC_PERF_MAX; i++) {
+		v[i] = 0;
+		if (pt->idx[i] == -1)
+			continue;
+		v[i] = buf[3 + pt->idx[i]];
+		if (buf[2] > 0 && buf[2] < buf[1])
+			v[i] = (uint64_t)((double)v[i] * buf[1] / buf[2]);
+	}
+	return (1);
+}
+
+/*
+ * Turn counting on if PCOMPRESS_PERF is set to a non-zero value and the
+ * counters can be opened. Returns 1 if counting is on.
+ */
+int
+pc_perf_init(void)
+{
+	char *val;
+
+	val = getenv("PCOMPRESS_PERF");
+	perf_on = (val != NULL && atoi(val) != 0);
+	if (!perf_on)
+		return (0);
+#ifndef __linux__
+	log_msg(LOG_WARN, 0, "PCOMPRESS_PERF: Hardware counters need Linux");
+	perf_on = 0;
+#else
+	if (perf_thread() == NULL) {
+		log_msg(LOG_WARN, 0, "PCOMPRESS_PERF: Cannot open hardware counters, "
+		    "check /proc/sys/kernel/perf_event_paranoid");
+		perf_on = 0;
+	}
+#endif
+	return (perf_on);
+}
+
+/*
+ * Current counts of the calling thread, 0 if counting is off.
+ */
+int
+pc_perf_read(uint64_t *v)
+{
+	struct perf_thr *pt;
+
+	if (!perf_on || (pt = perf_thread()) == NULL)
+		return (0);
+	return (perf_read_thr(pt, v));
+}
+
+/*
+ * Add the counts since start, taken with pc_perf_read(), to acc.
+ */
+void
+pc_perf_add(uint64_t *acc, const uint64_t *start)
+{
+	uint64_t v[PC_PERF_MAX];
+	int i;
+
+	if (!pc_perf_read(v))
+		return;
+	for (i = 0; i < PC_PERF_MAX; i++)
+		acc[i] += v[i] - start[i];
+}
+
+static void
+perf_push(uint64_t ts)
+{
+	struct perf_thr *pt;
+	int top;
+
+	if ((pt = perf_thread()) == NULL)
+		return;
+	top = pt->top % PERF_DEPTH;
+	if (!perf_read_thr(pt, pt->st[top].v))
+		return;
+	pt->st[top].ts = ts;
+	pt->top++;
+}
+
+static void
+perf_pop(uint64_t ts, uint64_t *acc)
+{
+	struct perf_thr *pt;
+	uint64_t v[PC_PERF_MAX];
+	int i, n;
+
+	pt = perf_self;
+	if (pt == NULL || pt->state <= 0)
+		return;
+	for (n = 0; n < PERF_DEPTH && pt->top > 0; n++) {
+		pt->top--;
+		if (pt->st[pt->top % PERF_DEPTH].ts != ts)
+			continue;
+		if (!perf_read_thr(pt, v))
+			return;
+		for (i = 0; i < PC_PERF_MAX; i++)
+			acc[i] += v[i] - pt->st[pt->top % PERF_DEPTH].v[i];
+		return;
+	}
+}
+
+/*
+ * Return a start timestamp for a stage, or 0 if collection is disabled.
+ */
+uint64_t
+pc_stats_start(pc_stats_t *stats)
+{
+	uint64_t ts;
+
+	if (stats == NULL)
+		return (0);
+	ts = now_ns();
+	if (perf_on)
+		perf_push(ts);
+	return (ts);
+}
+
+void
+pc_stats_end(pc_stats_t *stats, pc_stage_t stage, uint64_t start, uint64_t bytes)
+{
+	struct pc_stage_stat *st;
+	uint64_t ns, us;
+	int b;
+
+	if (stats == NULL)
+		return;
+	ns = now_ns() - start;
+	st = &stats->st[stage];
+	if (perf_on)
+		perf_pop(start, st->pmu);
+	st->count++;
+	st->bytes += bytes;
+	st->total_ns += ns;
+	if (ns < st->min_ns)
+		st->min_ns = ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+
+	us = ns / 1000;
+	b = 0;
+	while (us > 0 && b < PC_STATS_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	st->hist[b]++;
+	pc_trace_end(stage_names[stage], start, bytes);
+}
+
+/*
+ * Count a copy of chunk data from one buffer to another.
+ */
+void
+pc_stats_copy(pc_stats_t *stats, uint64_t bytes)
+{
+	if (stats == NULL)
+		return;
+	stats->copies++;
+	stats->copy_bytes += bytes;
+}
+
+static void
+merge_stage(struct pc_stage_stat *dst, const struct pc_stage_stat *src)
+{
+	int b;
+
+	dst->count += src->count;
+	dst->bytes += src->bytes;
+	dst->total_ns += src->total_ns;
+	if (src->min_ns < dst->min_ns)
+		dst->min_ns = src->min_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (b = 0; b < PC_STATS_BUCKETS; b++)
+		dst->hist[b] += src->hist[b];
+	for (b = 0; b < PC_PERF_MAX; b++)
+		dst->pmu[b] += src->pmu[b];
+}
+
+void
+pc_dedupe_stat_add(struct pc_dedupe_stat *dst, const struct pc_dedupe_stat *src)
+{
+	int b;
+
+	dst->chunks += src->chunks;
+	dst->deduped += src->deduped;
+	dst->bytes_in += src->bytes_in;
+	dst->bytes_out += src->bytes_out;
+	dst->blocks += src->blocks;
+	for (b = 0; b < PC_DEDUPE_BUCKETS; b++)
+		dst->blk_hist[b] += src->blk_hist[b];
+	dst->exact += src->exact;
+	dst->exact_bytes += src->exact_bytes;
+	dst->similar += src->similar;
+	dst->delta += src->delta;
+	dst->delta_fail += src->delta_fail;
+	dst->delta_bytes += src->delta_bytes;
+	dst->global += src->global;
+	dst->global_bytes += src->global_bytes;
+	dst->long_match += src->long_match;
+	dst->long_bytes += src->long_bytes;
+	dst->lookups += src->lookups;
+	dst->hits += src->hits;
+	dst->evict += src->evict;
+	dst->evict_lost += src->evict_lost;
+	dst->evict_lost_bytes += src->evict_lost_bytes;
+	dst->scan_ns += src->scan_ns;
+	dst->hash_ns += src->hash_ns;
+	dst->match_ns += src->match_ns;
+	dst->delta_ns += src->delta_ns;
+	dst->index_ns += src->index_ns;
+	for (b = 0; b < PC_PERF_MAX; b++) {
+		dst->scan_pmu[b] += src->scan_pmu[b];
+		dst->index_pmu[b] += src->index_pmu[b];
+	}
+}
+
+/*
+ * Combine the per-thread sets into dst.
+ */
+void
+pc_stats_merge(pc_stats_t *dst, const pc_stats_t *stats, int nsets)
+{
+	int i, j;
+
+	memset(dst, 0, sizeof (*dst));
+	for (j = 0; j < PC_STAGE_MAX; j++)
+		dst->st[j].min_ns = UINT64_MAX;
+	for (i = 0; i < nsets; i++) {
+		for (j = 0; j < PC_STAGE_MAX; j++)
+			merge_stage(&dst->st[j], &stats[i].st[j]);
+		pc_dedupe_stat_add(&dst->dd, &stats[i].dd);
+		dst->copies += stats[i].copies;
+		dst->copy_bytes += stats[i].copy_bytes;
+	}
+}
+
+/*
+ * Counter lines for the compression statistics: totals, instructions per
+ * cycle, cycles per byte and misses per thousand instructions of every
+ * stage and of the dedupe block scan and index access.
+ */
+static void
+perf_line(const char *name, const uint64_t *pmu, uint64_t bytes)
+{
+	char buf[256];
+	int i, n;
+
+	if (pmu[PC_PERF_CYCLES] == 0 && pmu[PC_PERF_INSTR] == 0)
+		return;
+	n = 0;
+	for (i = 0; i < PC_PERF_MAX && n < (int)sizeof (buf); i++) {
+		if (perf_mask & (1 << i))
+			n += snprintf(buf + n, sizeof (buf) - n, " %s %" PRIu64 ",",
+			    perf_names[i], pmu[i]);
+	}
+	if (pmu[PC_PERF_CYCLES] > 0 && (perf_mask & (1 << PC_PERF_INSTR)) &&
+	    n < (int)sizeof (buf))
+		n += snprintf(buf + n, sizeof (buf) - n, " IPC %.2f,",
+		    (double)pmu[PC_PERF_INSTR] / pmu[PC_PERF_CYCLES]);
+	if (bytes > 0 && n < (int)sizeof (buf))
+		n += snprintf(buf + n, sizeof (buf) - n, " cycles/byte %.2f,",
+		    (double)pmu[PC_PERF_CYCLES] / bytes);
+	if (pmu[PC_PERF_INSTR] > 0 && (perf_mask & (1 << PC_PERF_LLC_MISS)) &&
+	    n < (int)sizeof (buf))
+		n += snprintf(buf + n, sizeof (buf) - n, " LLC MPKI %.3f,",
+		    (double)pmu[PC_PERF_LLC_MISS] * 1000 / pmu[PC_PERF_INSTR]);
+	if (pmu[PC_PERF_INSTR] > 0 && (perf_mask & (1 << PC_PERF_BR_MISS)) &&
+	    n < (int)sizeof (buf))
+		n += snprintf(buf + n, sizeof (buf) - n, " branch MPKI %.3f,",
+		    (double)pmu[PC_PERF_BR_MISS] * 1000 / pmu[PC_PERF_INSTR]);
+	if (n > 0 && n < (int)sizeof (buf))
+		buf[n - 1] = '\0';
+	log_msg(LOG_INFO, 0, "%-14s :%s", name, buf);
+}
+
+void
+pc_perf_print(const pc_stats_t *total)
+{
+	int j;
+
+	if (!perf_on || perf_mask == 0)
+		return;
+	log_msg(LOG_INFO, 0, "Hardware counters (user mode):");
+	for (j = 0; j < PC_STAGE_MAX; j++) {
+		if (total->st[j].count > 0)
+			perf_line(stage_names[j], total->st[j].pmu, total->st[j].bytes);
+	}
+	perf_line("dedupe scan", total->dd.scan_pmu, total->dd.bytes_in);
+	perf_line("dedupe index", total->dd.index_pmu, 0);
+}
+
+/*
+ * One line summary of a chunk for the -CC chunk display.
+ */
+void
+pc_dedupe_stat_print(const struct pc_dedupe_stat *dd)
+{
+	fprintf(stderr, "Dedupe: %" PRIu64 " -> %" PRIu64 " bytes, blocks: %" PRIu64
+	    ", exact: %" PRIu64 " (%" PRIu64 " bytes), delta: %" PRIu64 "/%" PRIu64
+	    " (%" PRIu64 " bytes), global: %" PRIu64 " (%" PRIu64 " bytes), hits: %"
+	    PRIu64 "/%" PRIu64 ", us scan/hash/match/delta/index: %" PRIu64 "/%" PRIu64
+	    "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n", dd->bytes_in, dd->bytes_out,
+	    dd->blocks, dd->exact, dd->exact_bytes, dd->delta, dd->similar,
+	    dd->delta_bytes, dd->global, dd->global_bytes, dd->hits, dd->lookups,
+	    dd->scan_ns / 1000, dd->hash_ns / 1000, dd->match_ns / 1000,
+	    dd->delta_ns / 1000, dd->index_ns / 1000);
+}
+
+static void
+json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Counter totals with the usual ratios, emitted only while counting.
+ */
+static void
+json_perf(FILE *fp, const uint64_t *pmu, uint64_t bytes)
+{
+	int i;
+
+	fprintf(fp, "{");
+	for (i = 0; i < PC_PERF_MAX; i++) {
+		if (perf_mask & (1 << i))
+			fprintf(fp, "\"%s\": %" PRIu64 ", ", perf_names[i], pmu[i]);
+	}
+	fprintf(fp, "\"ipc\": %.3f, \"cycles_per_byte\": %.3f, \"llc_mpki\": %.3f"
+	    ", \"branch_mpki\": %.3f}",
+	    pmu[PC_PERF_CYCLES] ? (double)pmu[PC_PERF_INSTR] / pmu[PC_PERF_CYCLES] : 0.0,
+	    bytes ? (double)pmu[PC_PERF_CYCLES] / bytes : 0.0,
+	    pmu[PC_PERF_INSTR] ? (double)pmu[PC_PERF_LLC_MISS] * 1000 / pmu[PC_PERF_INSTR] : 0.0,
+	    pmu[PC_PERF_INSTR] ? (double)pmu[PC_PERF_BR_MISS] * 1000 / pmu[PC_PERF_INSTR] : 0.0);
+}
+
+static void
+json_stage(FILE *fp, const struct pc_stage_stat *st, int hist)
+{
+	double mbs;
+	int b, first;
+
+	mbs = 0;
+	if (st->total_ns > 0)
+		mbs = ((double)st->bytes / st->total_ns) * 1000000000.0 / (1024 * 1024);
+	fprintf(fp, "{\"count\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"total_us\": %" PRIu64
+	    ", \"min_us\": %" PRIu64 ", \"max_us\": %" PRIu64 ", \"avg_us\": %" PRIu64
+	    ", \"mb_s\": %.3f", st->count, st->bytes, st->total_ns / 1000,
+	    st->min_ns / 1000, st->max_ns / 1000, st->total_ns / st->count / 1000, mbs);
+	if (perf_on) {
+		fprintf(fp, ", \"perf\": ");
+		json_perf(fp, st->pmu, st->bytes);
+	}
+	if (hist) {
+		fprintf(fp, ", \"hist_us\": [");
+		first = 1;
+		for (b = 0; b < PC_STATS_BUCKETS; b++) {
+			if (st->hist[b] == 0)
+				continue;
+			fprintf(fp, "%s{\"lt\": %" PRIu64 ", \"count\": %" PRIu64 "}",
+			    first ? "" : ", ", (uint64_t)1 << b, st->hist[b]);
+			first = 0;
+		}
+		fprintf(fp, "]");
+	}
+	fprintf(fp, "}");
+}
+
+static void
+json_stages(FILE *fp, const pc_stats_t *stats, int hist, const char *indent)
+{
+	int j, first;
+
+	fprintf(fp, "{");
+	first = 1;
+	for (j = 0; j < PC_STAGE_MAX; j++) {
+		if (stats->st[j].count == 0)
+			continue;
+		fprintf(fp, "%s\n%s\"%s\": ", first ? "" : ",", indent, stage_names[j]);
+		json_stage(fp, &stats->st[j], hist);
+		first = 0;
+	}
+	fprintf(fp, "}");
+}
+
+static void
+json_dedupe(FILE *fp, const struct pc_dedupe_stat *dd)
+{
+	int b, first;
+
+	fprintf(fp, "{\n    \"chunks\": %" PRIu64 ", \"deduped\": %" PRIu64
+	    ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 ",\n    \"blocks\": %"
+	    PRIu64 ", \"block_hist\": [", dd->chunks, dd->deduped, dd->bytes_in,
+	    dd->bytes_out, dd->blocks);
+	first = 1;
+	for (b = 0; b < PC_DEDUPE_BUCKETS; b++) {
+		if (dd->blk_hist[b] == 0)
+			continue;
+		fprintf(fp, "%s{\"lt\": %" PRIu64 ", \"count\": %" PRIu64 "}",
+		    first ? "" : ", ", (uint64_t)1 << b, dd->blk_hist[b]);
+		first = 0;
+	}
+	fprintf(fp, "],\n    \"exact\": {\"count\": %" PRIu64 ", \"bytes_saved\": %" PRIu64
+	    "},\n    \"delta\": {\"similar\": %" PRIu64 ", \"count\": %" PRIu64
+	    ", \"failed\": %" PRIu64 ", \"bytes_saved\": %" PRIu64 "},\n    \"global\": "
+	    "{\"count\": %" PRIu64 ", \"bytes_saved\": %" PRIu64 "},\n    \"long\": "
+	    "{\"count\": %" PRIu64 ", \"bytes_saved\": %" PRIu64 "},\n",
+	    dd->exact, dd->exact_bytes, dd->similar, dd->delta, dd->delta_fail,
+	    dd->delta_bytes, dd->global, dd->global_bytes, dd->long_match, dd->long_bytes);
+	fprintf(fp, "    \"index\": {\"lookups\": %" PRIu64 ", \"hits\": %" PRIu64
+	    ", \"hit_rate\": %.4f, \"evictions\": %" PRIu64 ", \"lost\": %" PRIu64
+	    ", \"lost_bytes\": %" PRIu64 "},\n", dd->lookups, dd->hits,
+	    dd->lookups ? (double)dd->hits / dd->lookups : 0.0, dd->evict, dd->evict_lost,
+	    dd->evict_lost_bytes);
+	fprintf(fp, "    \"time_us\": {\"scan\": %" PRIu64 ", \"hash\": %" PRIu64
+	    ", \"match\": %" PRIu64 ", \"delta\": %" PRIu64 ", \"index\": %" PRIu64
+	    "}", dd->scan_ns / 1000, dd->hash_ns / 1000, dd->match_ns / 1000,
+	    dd->delta_ns / 1000, dd->index_ns / 1000);
+	if (perf_on) {
+		fprintf(fp, ",\n    \"perf\": {\"scan\": ");
+		json_perf(fp, dd->scan_pmu, dd->bytes_in);
+		fprintf(fp, ",\n      \"index\": ");
+		json_perf(fp, dd->index_pmu, 0);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "}");
+}
+
+static const char *filter_names[PC_FILTER_MAX] = {
+	"bcj", "dispack", "e8e9", "dict", "lzp", "fpdelta", "delta2"
+};
+
+/*
+ * Filters that only rewrite data in place. Their worth is only seen after
+ * the codec, so they are judged by how often they apply.
+ */
+static const int filter_transform[PC_FILTER_MAX] = {
+	1, 0, 1, 0, 0, 1, 0
+};
+
+/*
+ * Slots 0 - 7 are the basic PC_TYPE classes, the rest the subtypes.
+ */
+static const char *slot_names[] = {
+	"unknown", "text", "binary", "text+binary", "compressed", "text+compressed",
+	"binary+compressed", "mixed",
+	"exe32", "jpeg", "markup", "gz", "lzw", "bz2", "zip", "arj", "arc", "ar",
+	"lzma", "lzo", "avi", "mp4", "flac", "rar", "lz", "ppmd", "zpaq", "packjpg",
+	"dna", "mjpeg", "audio", "exe64", "bmp", "tiff", "pdf", "tar", "dicom",
+	"pnm", "packpnm", "wav", "english", "media_bsc", "exe32_pe"
+};
+
+#define	SLOT_NAMES	(sizeof (slot_names) / sizeof (slot_names[0]))
+
+pc_filter_ctx_t *
+pc_filter_create(void)
+{
+	pc_filter_ctx_t *fc;
+	char *val;
+
+	fc = (pc_filter_ctx_t *)calloc(1, sizeof (pc_filter_ctx_t));
+	if (fc == NULL)
+		return (NULL);
+	fc->adapt = 1;
+	val = getenv("PCOMPRESS_FILTER_ADAPT");
+	if (val != NULL && *val != '\0')
+		fc->adapt = atoi(val);
+	return (fc);
+}
+
+void
+pc_filter_destroy(pc_filter_ctx_t *fc)
+{
+	free(fc);
+}
+
+int
+pc_filter_slot(int btype)
+{
+	int stype, slot;
+
+	stype = PC_SUBTYPE(btype);
+	if (stype == 0)
+		return (PC_TYPE(btype) & 7);
+	slot = (stype >> 3) + 7;
+	if (slot >= PC_FILTER_SLOTS)
+		slot = PC_TYPE(btype) & 7;
+	return (slot);
+}
+
+/*
+ * Return 1 if filter f should be tried on a chunk of the given slot.
+ */
+int
+pc_filter_use(pc_filter_ctx_t *fc, pc_filter_t f, int slot)
+{
+	struct pc_filter_stat *fs;
+
+	if (fc == NULL || !fc->adapt)
+		return (1);
+	fs = &fc->fs[f][slot];
+	if (!fs->disabled)
+		return (1);
+	if (__sync_add_and_fetch(&fs->skipped, 1) % PC_FILTER_PROBE == 0)
+		return (1);
+	return (0);
+}
+
+uint64_t
+pc_filter_start(pc_filter_ctx_t *fc)
+{
+	if (fc == NULL)
+		return (0);
+	return (now_ns());
+}
+
+static int
+filter_pays(pc_filter_t f, uint64_t runs, uint64_t applied, uint64_t in, uint64_t out,
+    uint64_t ns)
+{
+	if (filter_transform[f])
+		return (applied * PC_FILTER_MIN_HIT >= runs);
+	if (out >= in)
+		return (0);
+	return ((in - out) * 1000 >= in + ns);
+}
+
+/*
+ * Record one run of filter f. Output size is ignored if the filter did not
+ * apply. The thread that completes a window judges it and clears it.
+ */
+void
+pc_filter_end(pc_filter_ctx_t *fc, pc_filter_t f, int slot, uint64_t start,
+    uint64_t in, uint64_t out, int applied)
+{
+	struct pc_filter_stat *fs;
+	uint64_t ns, runs, app, w_in, w_out, w_ns;
+
+	if (fc == NULL)
+		return;
+	ns = now_ns() - start;
+	if (!applied)
+		out = in;
+	fs = &fc->fs[f][slot];
+	__sync_fetch_and_add(&fs->runs, 1);
+	__sync_fetch_and_add(&fs->bytes_in, in);
+	__sync_fetch_and_add(&fs->bytes_out, out);
+	__sync_fetch_and_add(&fs->ns, ns);
+	__sync_fetch_and_add(&fs->w_in, in);
+	__sync_fetch_and_add(&fs->w_out, out);
+	__sync_fetch_and_add(&fs->w_ns, ns);
+	if (applied) {
+		__sync_fetch_and_add(&fs->applied, 1);
+		__sync_fetch_and_add(&fs->w_applied, 1);
+	}
+	if (__sync_add_and_fetch(&fs->w_runs, 1) != PC_FILTER_WINDOW)
+		return;
+
+	runs = __sync_fetch_and_and(&fs->w_runs, 0);
+	app = __sync_fetch_and_and(&fs->w_applied, 0);
+	w_in = __sync_fetch_and_and(&fs->w_in, 0);
+	w_out = __sync_fetch_and_and(&fs->w_out, 0);
+	w_ns = __sync_fetch_and_and(&fs->w_ns, 0);
+	if (!fc->adapt)
+		return;
+	if (filter_pays(f, runs, app, w_in, w_out, w_ns)) {
+		fs->disabled = 0;
+	} else if (!fs->disabled) {
+		fs->disabled = 1;
+		__sync_fetch_and_add(&fs->disables, 1);
+	}
+}
+
+/*
+ * Filter cost lines for the compression statistics.
+ */
+void
+pc_filter_print(pc_filter_ctx_t *fc)
+{
+	struct pc_filter_stat *fs;
+	int f, slot;
+	double mbs;
+
+	if (fc == NULL)
+		return;
+	for (f = 0; f < PC_FILTER_MAX; f++) {
+		for (slot = 0; slot < SLOT_NAMES; slot++) {
+			fs = &fc->fs[f][slot];
+			if (fs->runs == 0)
+				continue;
+			mbs = 0;
+			if (fs->ns > 0)
+				mbs = ((double)fs->bytes_in / fs->ns) * 1000000000.0 / (1024 * 1024);
+			log_msg(LOG_INFO, 0, "Filter %-7s %-11s : %" PRIu64 "/%" PRIu64
+			    " applied, %.2f%% size, %.1f MB/s, %" PRIu64 " skipped%s",
+			    filter_names[f], slot_names[slot], fs->applied, fs->runs,
+			    (double)fs->bytes_out / fs->bytes_in * 100, mbs, fs->skipped,
+			    fs->disabled ? ", disabled" : "");
+		}
+	}
+}
+
+static void
+json_filters(FILE *fp, pc_filter_ctx_t *fc)
+{
+	struct pc_filter_stat *fs;
+	int f, slot, first;
+
+	fprintf(fp, ",\n  \"filters\": [");
+	first = 1;
+	for (f = 0; f < PC_FILTER_MAX; f++) {
+		for (slot = 0; slot < SLOT_NAMES; slot++) {
+			fs = &fc->fs[f][slot];
+			if (fs->runs == 0)
+				continue;
+			fprintf(fp, "%s\n    {\"filter\": \"%s\", \"type\": \"%s\", \"runs\": %"
+			    PRIu64 ", \"applied\": %" PRIu64 ", \"bytes_in\": %" PRIu64
+			    ", \"bytes_out\": %" PRIu64 ", \"time_us\": %" PRIu64 ", \"skipped\": %"
+			    PRIu64 ", \"disables\": %" PRIu64 ", \"disabled\": %s}",
+			    first ? "" : ",", filter_names[f], slot_names[slot], fs->runs,
+			    fs->applied, fs->bytes_in, fs->bytes_out, fs->ns / 1000, fs->skipped,
+			    fs->disables, fs->disabled ? "true" : "false");
+			first = 0;
+		}
+	}
+	fprintf(fp, "\n  ]");
+}
+
+/*
+ * Write the collected timings as JSON to path, or stderr if path is "-".
+ * Set 0 is the reader, set 1 the writer and the rest are worker threads.
+ * The "stages" object is the combination of all sets and includes latency
+ * histograms, "threads" lists the per-thread totals. The filter costs are
+ * added as "filters" if fc is given.
+ */
+int
+pc_stats_write_json(const char *path, const char *op, const char *filename,
+    pc_stats_t *stats, int nsets, uint64_t wall_ns, pc_filter_ctx_t *fc)
+{
+	pc_stats_t total;
+	FILE *fp;
+	int i;
+
+	if (strcmp(path, "-") == 0) {
+		fp = stderr;
+	} else {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			log_msg(LOG_ERR, 1, "Cannot open stats file %s", path);
+			return (-1);
+		}
+	}
+
+	pc_stats_merge(&total, stats, nsets);
+
+	fprintf(fp, "{\n  \"operation\": ");
+	json_string(fp, op);
+	fprintf(fp, ",\n  \"file\": ");
+	json_string(fp, filename ? filename : "-");
+	fprintf(fp, ",\n  \"wall_us\": %" PRIu64 ",\n  \"workers\": %d,\n  \"stages\": ",
+	    wall_ns / 1000, nsets - 2);
+	json_stages(fp, &total, 1, "    ");
+	fprintf(fp, ",\n  \"chunk_copies\": %" PRIu64 ",\n  \"copy_bytes\": %" PRIu64,
+	    total.copies, total.copy_bytes);
+	if (total.dd.chunks > 0) {
+		fprintf(fp, ",\n  \"dedupe\": ");
+		json_dedupe(fp, &total.dd);
+	}
+	if (fc != NULL)
+		json_filters(fp, fc);
+	fprintf(fp, ",\n  \"threads\": [");
+	for (i = 0; i < nsets; i++) {
+		fprintf(fp, "%s\n    {\"thread\": ", i ? "," : "");
+		if (i == 0)
+			json_string(fp, "reader");
+		else if (i == 1)
+			json_string(fp, "writer");
+		else
+			fprintf(fp, "\"worker-%d\"", i - 2);
+		fprintf(fp, ", \"stages\": ");
+		json_stages(fp, &stats[i], 0, "      ");
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	if (fp != stderr) {
+		if (fclose(fp) != 0) {
+			log_msg(LOG_ERR, 1, "Cannot write stats file %s", path);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+pc_progress_t *
+pc_progress_create(const char *op, const char *filename, uint64_t total, int nworkers)
+{
+	pc_progress_t *prog;
+	char *val;
+	double secs;
+
+	val = getenv("PCOMPRESS_PROGRESS");
+	if (val == NULL || *val == '\0')
+		return (NULL);
+	secs = strtod(val, NULL);
+	if (secs <= 0)
+		return (NULL);
+	prog = (pc_progress_t *)calloc(1, sizeof (pc_progress_t));
+	if (prog == NULL)
+		return (NULL);
+	prog->busy_ns = (uint64_t *)calloc(nworkers * 2, sizeof (uint64_t));
+	if (prog->busy_ns == NULL) {
+		free(prog);
+		return (NULL);
+	}
+	prog->last_busy = prog->busy_ns + nworkers;
+	prog->nworkers = nworkers;
+	prog->fd = 2;
+	val = getenv("PCOMPRESS_PROGRESS_FD");
+	if (val != NULL && *val != '\0')
+		prog->fd = atoi(val);
+	prog->op = op;
+	prog->filename = filename;
+	prog->total = total;
+	prog->interval_ns = (uint64_t)(secs * 1000000000.0);
+	prog->t0 = now_ns();
+	prog->last_ns = prog->t0;
+	return (prog);
+}
+
+void
+pc_progress_destroy(pc_progress_t *prog)
+{
+	if (prog == NULL)
+		return;
+	free(prog->busy_ns);
+	free(prog);
+}
+
+uint64_t
+pc_progress_start(pc_progress_t *prog)
+{
+	if (prog == NULL)
+		return (0);
+	return (now_ns());
+}
+
+void
+pc_progress_busy(pc_progress_t *prog, int worker, uint64_t start)
+{
+	if (prog == NULL || worker < 0 || worker >= prog->nworkers)
+		return;
+	__sync_fetch_and_add(&prog->busy_ns[worker], now_ns() - start);
+}
+
+void
+pc_progress_saved(pc_progress_t *prog, uint64_t bytes)
+{
+	if (prog == NULL)
+		return;
+	__sync_fetch_and_add(&prog->saved, bytes);
+}
+
+/*
+ * Copy s into buf as a JSON string body, truncating if needed.
+ */
+static void
+json_escape(char *buf, size_t len, const char *s)
+{
+	size_t n = 0;
+
+	for (; s && *s && n + 7 < len; s++) {
+		if (*s == '"' || *s == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = *s;
+		} else if ((unsigned char)*s < 0x20) {
+			n += snprintf(buf + n, len - n, "\\u%04x", (unsigned char)*s);
+		} else {
+			buf[n++] = *s;
+		}
+	}
+	buf[n] = '\0';
+}
+
+/*
+ * Format one report line and write it with a single write() so that lines
+ * of concurrent runs sharing the fd do not interleave.
+ */
+static void
+progress_report(pc_progress_t *prog, uint64_t now, int done)
+{
+	char line[4096 + 1024], name[2048];
+	uint64_t elapsed, busy;
+	double mbs, avg;
+	int i, n;
+
+	elapsed = now - prog->t0;
+	mbs = 0;
+	if (now > prog->last_ns)
+		mbs = ((double)(prog->in - prog->last_in) / (now - prog->last_ns)) *
+		    1000000000.0 / (1024 * 1024);
+	avg = 0;
+	if (elapsed > 0)
+		avg = ((double)prog->in / elapsed) * 1000000000.0 / (1024 * 1024);
+	json_escape(name, sizeof (name), prog->filename ? prog->filename : "-");
+	n = snprintf(line, sizeof (line), "{\"operation\": \"%s\", \"file\": \"%s\", "
+	    "\"elapsed_us\": %" PRIu64 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %"
+	    PRIu64 ", \"mb_s\": %.3f, \"avg_mb_s\": %.3f, \"dedupe_saved\": %" PRIu64,
+	    prog->op, name, elapsed / 1000, prog->in, prog->out, mbs, avg, prog->saved);
+	if (prog->total > 0 && n < (int)sizeof (line)) {
+		n += snprintf(line + n, sizeof (line) - n, ", \"total_in\": %" PRIu64,
+		    prog->total);
+		if (avg > 0 && prog->total >= prog->in && n < (int)sizeof (line)) {
+			n += snprintf(line + n, sizeof (line) - n, ", \"eta_s\": %.1f",
+			    (double)(prog->total - prog->in) / (avg * 1024 * 1024));
+		}
+	}
+	if (n < (int)sizeof (line))
+		n += snprintf(line + n, sizeof (line) - n, ", \"busy\": [");
+	for (i = 0; i < prog->nworkers && n < (int)sizeof (line); i++) {
+		busy = prog->busy_ns[i];
+		n += snprintf(line + n, sizeof (line) - n, "%s%.2f", i ? ", " : "",
+		    now > prog->last_ns ?
+		    (double)(busy - prog->last_busy[i]) / (now - prog->last_ns) : 0.0);
+		prog->last_busy[i] = busy;
+	}
+	if (n < (int)sizeof (line))
+		n += snprintf(line + n, sizeof (line) - n, "], \"done\": %s}\n",
+		    done ? "true" : "false");
+	if (n > (int)sizeof (line) - 1)
+		n = sizeof (line) - 1;
+	(void) write(prog->fd, line, n);
+	prog->last_ns = now;
+	prog->last_in = prog->in;
+}
+
+/*
+ * Account a written chunk: in is the input bytes it covers and out the bytes
+ * written for it.
+ */
+void
+pc_progress_update(pc_progress_t *prog, uint64_t in, uint64_t out)
+{
+	uint64_t now;
+
+	if (prog == NULL)
+		return;
+	prog->in += in;
+	prog->out += out;
+	now = now_ns();
+	if (now - prog->last_ns >= prog->interval_ns)
+		progress_report(prog, now, 0);
+}
+
+/*
+ * Emit the final report. Call this once all workers are done with the run.
+ */
+void
+pc_progress_finish(pc_progress_t *prog)
+{
+	if (prog == NULL)
+		return;
+	progress_report(prog, now_ns(), 1);
+}
+
+/*
+ * Timeline trace. Each thread appends spans to its own buffer, found through
+ * a thread local pointer, so recording needs no locking. Buffers are linked
+ * into a global list under a mutex when a thread records its first span.
+ * A generation number tells a thread that its buffer belongs to an earlier
+ * trace that has been written and freed.
+ */
+struct pc_trace_ev {
+	const char *name;
+	uint64_t ts, dur, bytes;
+};
+
+struct pc_trace_buf {
+	struct pc_trace_buf *next;
+	char name[32];
+	int tid;
+	uint32_t n, cap;
+	struct pc_trace_ev *ev;
+};
+
+#define	PC_TRACE_MAX_EV	(4U * 1024 * 1024)
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pc_trace_buf *trace_head = NULL;
+static const char *trace_path = NULL;
+static uint64_t trace_t0 = 0;
+static int trace_on = 0, trace_ntid = 0;
+static unsigned int trace_gen = 0;
+static __thread struct pc_trace_buf *trace_self = NULL;
+static __thread unsigned int trace_self_gen = 0;
+static __thread char trace_self_name[32];
+
+/*
+ * Start a trace if PCOMPRESS_TRACE names an output file. Returns 1 if
+ * tracing is on.
+ */
+int
+pc_trace_init(void)
+{
+	char *val;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_on) {
+		val = getenv("PCOMPRESS_TRACE");
+		if (val != NULL && *val != '\0') {
+			trace_path = val;
+			trace_t0 = now_ns();
+			trace_gen++;
+			trace_on = 1;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	return (trace_on);
+}
+
+/*
+ * Name the calling thread in the trace. Threads that record spans without
+ * a name show up as "thread-<n>".
+ */
+void
+pc_trace_thread(const char *name)
+{
+	snprintf(trace_self_name, sizeof (trace_self_name), "%s", name);
+	if (trace_self != NULL && trace_self_gen == trace_gen)
+		snprintf(trace_self->name, sizeof (trace_self->name), "%s", name);
+}
+
+uint64_t
+pc_trace_start(void)
+{
+	if (!trace_on)
+		return (0);
+	return (now_ns());
+}
+
+void
+pc_trace_end(const char *name, uint64_t start, uint64_t bytes)
+{
+	struct pc_trace_buf *tb;
+	struct pc_trace_ev *ev;
+	uint64_t t;
+
+	if (!trace_on || start == 0)
+		return;
+	t = now_ns();
+	tb = trace_self;
+	if (tb == NULL || trace_self_gen != trace_gen) {
+		tb = (struct pc_trace_buf *)calloc(1, sizeof (struct pc_trace_buf));
+		if (tb == NULL)
+			return;
+		pthread_mutex_lock(&trace_mutex);
+		if (!trace_on) {
+			pthread_mutex_unlock(&trace_mutex);
+			free(tb);
+			return;
+		}
+		tb->tid = ++trace_ntid;
+		if (trace_self_name[0] != '\0')
+			snprintf(tb->name, sizeof (tb->name), "%s", trace_self_name);
+		else
+			snprintf(tb->name, sizeof (tb->name), "thread-%d", tb->tid);
+		tb->next = trace_head;
+		trace_head = tb;
+		trace_self = tb;
+		trace_self_gen = trace_gen;
+		pthread_mutex_unlock(&trace_mutex);
+	}
+	if (tb->n == tb->cap) {
+		uint32_t cap = (tb->cap ? tb->cap * 2 : 1024);
+
+		if (cap > PC_TRACE_MAX_EV)
+			return;
+		ev = (struct pc_trace_ev *)realloc(tb->ev, cap * sizeof (struct pc_trace_ev));
+		if (ev == NULL)
+			return;
+		tb->ev = ev;
+		tb->cap = cap;
+	}
+	ev = &tb->ev[tb->n++];
+	ev->name = name;
+	ev->ts = start;
+	ev->dur = t - start;
+	ev->bytes = bytes;
+}
+
+/*
+ * Write the trace in Chrome trace event format, which chrome://tracing and
+ * Perfetto load directly, and stop tracing. This must be called once the
+ * traced threads have stopped recording.
+ */
+void
+pc_trace_write(void)
+{
+	struct pc_trace_buf *tb, *nxt;
+	uint32_t i;
+	FILE *fp;
+	int first;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_on) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	trace_on = 0;
+	tb = trace_head;
+	trace_head = NULL;
+	trace_ntid = 0;
+	pthread_mutex_unlock(&trace_mutex);
+
+	fp = fopen(trace_path, "w");
+	if (fp == NULL)
+		log_msg(LOG_ERR, 1, "Cannot open trace file %s", trace_path);
+	if (fp != NULL) {
+		fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+		first = 1;
+		for (nxt = tb; nxt != NULL; nxt = nxt->next) {
+			fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+			    "\"tid\": %d, \"args\": {\"name\": ", first ? "" : ",", nxt->tid);
+			json_string(fp, nxt->name);
+			fprintf(fp, "}}");
+			first = 0;
+			for (i = 0; i < nxt->n; i++) {
+				struct pc_trace_ev *ev = &nxt->ev[i];
+
+				fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+				    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+				    "{\"bytes\": %" PRIu64 "}}", ev->name, nxt->tid,
+				    (double)(ev->ts - trace_t0) / 1000, (double)ev->dur / 1000,
+				    ev->bytes);
+			}
+		}
+		fprintf(fp, "\n]}\n");
+		if (fclose(fp) != 0)
+			log_msg(LOG_ERR, 1, "Cannot write trace file %s", trace_path);
+	}
+	while (tb != NULL) {
+		nxt = tb->next;
+		free(tb->ev);
+		free(tb);
+		tb = nxt;
+	}
+}
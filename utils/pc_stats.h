@@ -0,0 +1,223 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_STATS_H
+#define	_PC_STATS_H
+
+#include <stdint.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Processing stages that are timed per chunk.
+ */
+typedef enum {
+	PC_STAGE_READ = 0,
+	PC_STAGE_ANALYZE,
+	PC_STAGE_PREPROC,
+	PC_STAGE_DEDUPE,
+	PC_STAGE_CODEC,
+	PC_STAGE_CKSUM,
+	PC_STAGE_CRYPTO,
+	PC_STAGE_WRITE,
+	PC_STAGE_MAX
+} pc_stage_t;
+
+/*
+ * Latency histogram buckets. Bucket n counts operations that took less than
+ * 2^n microseconds, the last one also collects everything above.
+ */
+#define	PC_STATS_BUCKETS	32
+
+/*
+ * Hardware counters sampled around every stage when PCOMPRESS_PERF is set.
+ * They count user mode events of the calling thread only.
+ */
+typedef enum {
+	PC_PERF_CYCLES = 0,
+	PC_PERF_INSTR,
+	PC_PERF_LLC_MISS,
+	PC_PERF_BR_MISS,
+	PC_PERF_MAX
+} pc_perf_t;
+
+struct pc_stage_stat {
+	uint64_t count, bytes;
+	uint64_t total_ns, min_ns, max_ns;
+	uint64_t hist[PC_STATS_BUCKETS];
+	uint64_t pmu[PC_PERF_MAX];
+};
+
+/*
+ * Dedupe effectiveness and cost as counted by dedupe_compress(). Bucket n of
+ * the block size histogram counts blocks of less than 2^n bytes. Exact and
+ * delta savings are within a chunk, global ones are references to earlier
+ * data through the Global Dedupe index. Lookups and hits are probes of the
+ * chunk hashtable or of the global index.
+ */
+#define	PC_DEDUPE_BUCKETS	20
+
+struct pc_dedupe_stat {
+	uint64_t chunks, deduped, bytes_in, bytes_out;
+	uint64_t blocks, blk_hist[PC_DEDUPE_BUCKETS];
+	uint64_t exact, exact_bytes;
+	uint64_t similar, delta, delta_fail, delta_bytes;
+	uint64_t global, global_bytes;
+	uint64_t long_match, long_bytes;
+	uint64_t lookups, hits;
+	uint64_t evict, evict_lost, evict_lost_bytes;
+	uint64_t scan_ns, hash_ns, match_ns, delta_ns, index_ns;
+	uint64_t scan_pmu[PC_PERF_MAX], index_pmu[PC_PERF_MAX];
+};
+
+/*
+ * Stage timings of one thread. Each thread only updates its own instance so
+ * no locking is needed. A NULL pointer disables collection.
+ */
+typedef struct pc_stats {
+	struct pc_stage_stat st[PC_STAGE_MAX];
+	struct pc_dedupe_stat dd;
+	uint64_t copies, copy_bytes; // Whole chunk memcpy()s between buffers
+} pc_stats_t;
+
+/*
+ * Cost accounting of the preprocessing filters in preproc_compress(). Every
+ * filter run is recorded per data type slot with its time and input and
+ * output sizes. The counters are shared by all workers and updated with
+ * atomic adds.
+ *
+ * Unless PCOMPRESS_FILTER_ADAPT is 0, each PC_FILTER_WINDOW runs of a
+ * filter on a data type are checked for payoff. A filter that changes the
+ * size must save at least 1 per mille of its input plus 1 per mille for
+ * every ns per byte it spends. Size preserving transforms must apply to at
+ * least 1 in PC_FILTER_MIN_HIT chunks. A filter that does not pay off is
+ * skipped for that data type, except for one probe run in PC_FILTER_PROBE
+ * chunks that can enable it again.
+ */
+typedef enum {
+	PC_FILTER_BCJ = 0,
+	PC_FILTER_DISPACK,
+	PC_FILTER_E8E9,
+	PC_FILTER_DICT,
+	PC_FILTER_LZP,
+	PC_FILTER_FPDELTA,
+	PC_FILTER_DELTA2,
+	PC_FILTER_MAX
+} pc_filter_t;
+
+#define	PC_FILTER_SLOTS		48
+#define	PC_FILTER_WINDOW	8
+#define	PC_FILTER_PROBE		16
+#define	PC_FILTER_MIN_HIT	4
+
+struct pc_filter_stat {
+	uint64_t runs, applied, bytes_in, bytes_out, ns;
+	uint64_t w_runs, w_applied, w_in, w_out, w_ns;
+	uint64_t skipped, disables;
+	int disabled;
+};
+
+typedef struct pc_filter_ctx {
+	int adapt;
+	struct pc_filter_stat fs[PC_FILTER_MAX][PC_FILTER_SLOTS];
+} pc_filter_ctx_t;
+
+pc_stats_t *pc_stats_create(int nsets);
+void pc_stats_destroy(pc_stats_t *stats);
+uint64_t pc_stats_start(pc_stats_t *stats);
+void pc_stats_end(pc_stats_t *stats, pc_stage_t stage, uint64_t start, uint64_t bytes);
+void pc_stats_copy(pc_stats_t *stats, uint64_t bytes);
+void pc_stats_merge(pc_stats_t *dst, const pc_stats_t *stats, int nsets);
+int pc_stats_write_json(const char *path, const char *op, const char *filename,
+    pc_stats_t *stats, int nsets, uint64_t wall_ns, pc_filter_ctx_t *fc);
+void pc_dedupe_stat_add(struct pc_dedupe_stat *dst, const struct pc_dedupe_stat *src);
+void pc_dedupe_stat_print(const struct pc_dedupe_stat *dd);
+pc_filter_ctx_t *pc_filter_create(void);
+void pc_filter_destroy(pc_filter_ctx_t *fc);
+int pc_filter_slot(int btype);
+int pc_filter_use(pc_filter_ctx_t *fc, pc_filter_t f, int slot);
+uint64_t pc_filter_start(pc_filter_ctx_t *fc);
+void pc_filter_end(pc_filter_ctx_t *fc, pc_filter_t f, int slot, uint64_t start,
+    uint64_t in, uint64_t out, int applied);
+void pc_filter_print(pc_filter_ctx_t *fc);
+
+/*
+ * Hardware performance counters through perf_event_open(2), Linux only.
+ * pc_perf_init() checks PCOMPRESS_PERF and opens the counters of the
+ * calling thread, other threads open theirs on first use. While it is on,
+ * pc_stats_start() and pc_stats_end() add the counts of every stage to the
+ * stage totals. Code that times sub-stages on its own uses pc_perf_read()
+ * at the start and pc_perf_add() at the end, both do nothing when off.
+ */
+int pc_perf_init(void);
+int pc_perf_read(uint64_t *v);
+void pc_perf_add(uint64_t *acc, const uint64_t *start);
+void pc_perf_print(const pc_stats_t *total);
+
+/*
+ * Timeline tracing, enabled by setting PCOMPRESS_TRACE to an output file.
+ * Spans of every thread are written in Chrome trace event format. All stage
+ * timings recorded with pc_stats_end() become spans as well, other code can
+ * add spans with pc_trace_start() and pc_trace_end(). The span name must be
+ * a string constant.
+ */
+int pc_trace_init(void);
+void pc_trace_thread(const char *name);
+uint64_t pc_trace_start(void);
+void pc_trace_end(const char *name, uint64_t start, uint64_t bytes);
+void pc_trace_write(void);
+
+/*
+ * Live progress reports, enabled by setting PCOMPRESS_PROGRESS to the report
+ * interval in seconds. The writer calls pc_progress_update() for every chunk
+ * written and a JSON line goes to PCOMPRESS_PROGRESS_FD, default stderr, at
+ * most once per interval. Workers add their busy time and dedupe savings
+ * with atomic updates. A NULL pointer disables reporting.
+ */
+typedef struct pc_progress {
+	int fd, nworkers;
+	const char *op, *filename;
+	uint64_t interval_ns, t0, last_ns;
+	uint64_t total, in, out, saved, last_in;
+	uint64_t *busy_ns, *last_busy;
+} pc_progress_t;
+
+pc_progress_t *pc_progress_create(const char *op, const char *filename, uint64_t total,
+    int nworkers);
+void pc_progress_destroy(pc_progress_t *prog);
+uint64_t pc_progress_start(pc_progress_t *prog);
+void pc_progress_busy(pc_progress_t *prog, int worker, uint64_t start);
+void pc_progress_saved(pc_progress_t *prog, uint64_t bytes);
+void pc_progress_update(pc_progress_t *prog, uint64_t in, uint64_t out);
+void pc_progress_finish(pc_progress_t *prog);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Token bucket read pacing and an adaptive worker gate for background runs.
+ * All waits are bounded so a worker held back by the gate never stalls a
+ * run for longer than one sampling window at a time.
+ */
+
+#ifndef __APPLE__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <utils.h>
+#include "pc_throttle.h"
+
+#define	NSEC			1000000000ULL
+#define	THROTTLE_WINDOW_NS	(250 * 1000000ULL)
+#define	THROTTLE_MIN_BURST	(64 * 1024)
+
+#define	PC_IOPRIO_WHO_PROCESS	1
+#define	PC_IOPRIO_CLASS_IDLE	3
+#define	PC_IOPRIO_CLASS_SHIFT	13
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return (0);
+	return ((uint64_t)ts.tv_sec * NSEC + ts.tv_nsec);
+}
+
+/*
+ * User and system time of the whole process in microseconds.
+ */
+static uint64_t
+cpu_us(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return (0);
+	return ((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC;
+	ts.tv_nsec = ns % NSEC;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+pc_throttle_t *
+pc_throttle_create(uint64_t read_rate, int cpu_share)
+{
+	pc_throttle_t *thr;
+	long n;
+
+	thr = (pc_throttle_t *)calloc(1, sizeof (pc_throttle_t));
+	if (thr == NULL)
+		return (NULL);
+	pthread_mutex_init(&thr->lock, NULL);
+	pthread_cond_init(&thr->cv, NULL);
+	thr->read_rate = read_rate;
+	thr->burst = (double)read_rate / 10;
+	if (thr->burst < THROTTLE_MIN_BURST)
+		thr->burst = THROTTLE_MIN_BURST;
+	thr->tokens = thr->burst;
+	thr->fill_ns = now_ns();
+	thr->cpu_share = cpu_share;
+	n = get_avail_cpus();
+	thr->ncpu = (n > 0 ? n : 1);
+	thr->allowed = 1;
+	return (thr);
+}
+
+void
+pc_throttle_destroy(pc_throttle_t *thr)
+{
+	if (thr == NULL)
+		return;
+	pthread_cond_destroy(&thr->cv);
+	pthread_mutex_destroy(&thr->lock);
+	free(thr);
+}
+
+/*
+ * Tell the gate how many workers may take chunks. The first call starts
+ * with as many workers as the CPU share covers, later adjustments are made
+ * from the measured CPU use.
+ */
+void
+pc_throttle_workers(pc_throttle_t *thr, int nworkers)
+{
+	int start;
+
+	if (thr == NULL)
+		return;
+	pthread_mutex_lock(&thr->lock);
+	if (thr->nworkers == 0) {
+		start = (thr->cpu_share * thr->ncpu + 99) / 100;
+		thr->allowed = (start < nworkers ? start : nworkers);
+		if (thr->allowed < 1 || thr->cpu_share == 0)
+			thr->allowed = nworkers;
+	}
+	if (nworkers > thr->nworkers)
+		thr->nworkers = nworkers;
+	pthread_mutex_unlock(&thr->lock);
+}
+
+/*
+ * Take tokens for bytes about to be read, sleeping off any deficit. The
+ * bucket can go negative so a read larger than the burst size is paid for
+ * before the next one instead of being refused.
+ */
+void
+pc_throttle_read(pc_throttle_t *thr, uint64_t bytes)
+{
+	uint64_t now, wait;
+
+	if (thr == NULL || thr->read_rate == 0)
+		return;
+	pthread_mutex_lock(&thr->lock);
+	now = now_ns();
+	thr->tokens += (double)(now - thr->fill_ns) * thr->read_rate / NSEC;
+	if (thr->tokens > thr->burst)
+		thr->tokens = thr->burst;
+	thr->fill_ns = now;
+	thr->tokens -= (double)bytes;
+	wait = 0;
+	if (thr->tokens < 0)
+		wait = (uint64_t)(-thr->tokens * NSEC / thr->read_rate);
+	pthread_mutex_unlock(&thr->lock);
+	if (wait)
+		sleep_ns(wait);
+}
+
+/*
+ * Compare the CPU time used in the last window with the share and move the
+ * number of running workers by one. When one worker alone is over the
+ * share, pause long enough for the average to come down to it.
+ */
+static void
+throttle_sample(pc_throttle_t *thr, uint64_t now)
+{
+	uint64_t cpu, used, elapsed, budget, idle;
+
+	if (thr->win_ns == 0) {
+		thr->win_ns = now;
+		thr->win_cpu_us = cpu_us();
+		return;
+	}
+	elapsed = now - thr->win_ns;
+	if (elapsed < THROTTLE_WINDOW_NS)
+		return;
+	cpu = cpu_us();
+	used = (cpu - thr->win_cpu_us) * 1000;
+	budget = elapsed / 100 * thr->ncpu * thr->cpu_share;
+	if (used > budget) {
+		if (thr->allowed > 1) {
+			thr->allowed--;
+		} else {
+			idle = used / thr->cpu_share * 100 / thr->ncpu;
+			if (idle > elapsed)
+				thr->pause_until = now + (idle - elapsed);
+		}
+	} else if (used < budget / 10 * 9 && thr->allowed < thr->nworkers) {
+		thr->allowed++;
+		pthread_cond_broadcast(&thr->cv);
+	}
+	thr->win_ns = now;
+	thr->win_cpu_us = cpu;
+}
+
+void
+pc_throttle_enter(pc_throttle_t *thr)
+{
+	struct timeval tv;
+	struct timespec ts;
+	uint64_t now, wait;
+
+	if (thr == NULL || thr->cpu_share == 0)
+		return;
+	pthread_mutex_lock(&thr->lock);
+	for (;;) {
+		now = now_ns();
+		throttle_sample(thr, now);
+		if (thr->active < thr->allowed && now >= thr->pause_until)
+			break;
+		wait = THROTTLE_WINDOW_NS;
+		if (now < thr->pause_until && thr->pause_until - now < wait)
+			wait = thr->pause_until - now;
+		gettimeofday(&tv, NULL);
+		wait += (uint64_t)tv.tv_usec * 1000;
+		ts.tv_sec = tv.tv_sec + wait / NSEC;
+		ts.tv_nsec = wait % NSEC;
+		(void) pthread_cond_timedwait(&thr->cv, &thr->lock, &ts);
+	}
+	thr->active++;
+	pthread_mutex_unlock(&thr->lock);
+}
+
+void
+pc_throttle_leave(pc_throttle_t *thr)
+{
+	if (thr == NULL || thr->cpu_share == 0)
+		return;
+	pthread_mutex_lock(&thr->lock);
+	thr->active--;
+	pthread_cond_signal(&thr->cv);
+	pthread_mutex_unlock(&thr->lock);
+}
+
+/*
+ * Move the calling thread to the idle I/O class and the idle scheduling
+ * policy where available, otherwise to the lowest priority of its policy.
+ * Failures are ignored, the run just goes on at normal priority.
+ */
+void
+pc_throttle_background(void)
+{
+	struct sched_param sp;
+	int policy;
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	(void) syscall(SYS_ioprio_set, PC_IOPRIO_WHO_PROCESS, 0,
+	    PC_IOPRIO_CLASS_IDLE << PC_IOPRIO_CLASS_SHIFT);
+#endif
+	memset(&sp, 0, sizeof (sp));
+#ifdef SCHED_IDLE
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp) == 0)
+		return;
+#endif
+	if (pthread_getschedparam(pthread_self(), &policy, &sp) != 0)
+		return;
+	sp.sched_priority = sched_get_priority_min(policy);
+	(void) pthread_setschedparam(pthread_self(), policy, &sp);
+}
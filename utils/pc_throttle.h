@@ -0,0 +1,67 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_THROTTLE_H
+#define	_PC_THROTTLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Throttling for background runs. Input reads are paced by a token bucket
+ * refilled at read_rate bytes per second. Workers pass a gate that keeps
+ * process CPU use near cpu_share percent of all processors: the number of
+ * workers allowed to run at the same time is adapted to the CPU use seen in
+ * every sampling window, and with a single worker left the gate pauses
+ * between chunks. A zero rate or share disables that part.
+ */
+typedef struct pc_throttle {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	uint64_t read_rate;
+	double tokens, burst;
+	uint64_t fill_ns;
+	int cpu_share, ncpu;
+	int nworkers, allowed, active;
+	uint64_t win_ns, win_cpu_us, pause_until;
+} pc_throttle_t;
+
+pc_throttle_t *pc_throttle_create(uint64_t read_rate, int cpu_share);
+void pc_throttle_destroy(pc_throttle_t *thr);
+void pc_throttle_workers(pc_throttle_t *thr, int nworkers);
+void pc_throttle_read(pc_throttle_t *thr, uint64_t bytes);
+void pc_throttle_enter(pc_throttle_t *thr);
+void pc_throttle_leave(pc_throttle_t *thr);
+void pc_throttle_background(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * A small io_uring wrapper used to batch chunk reads and writes. It talks to
+ * the kernel via raw system calls so there is no liburing dependency. All
+ * operations in a batch are linked and use the current file position, so
+ * they behave exactly like the equivalent sequence of Read() or Write()
+ * calls and work on pipes as well as files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "pc_uring.h"
+
+#ifdef ENABLE_PC_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define	PC_URING_MAXIO	(1UL << 30)
+
+struct pc_uring {
+	int fd;
+	unsigned int depth;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	uchar_t **rbufs;
+	int nrbufs;
+	uint64_t rbuflen;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags)
+{
+	return ((int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+	    NULL, 0));
+}
+
+static int
+sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return ((int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+pc_uring_t *
+pc_uring_create(unsigned int depth)
+{
+	struct io_uring_params p;
+	pc_uring_t *ring;
+
+	ring = (pc_uring_t *)calloc(1, sizeof (pc_uring_t));
+	if (ring == NULL)
+		return (NULL);
+
+	memset(&p, 0, sizeof (p));
+	ring->fd = sys_io_uring_setup(depth, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return (NULL);
+	}
+
+	/*
+	 * We need reads and writes at the current file position (-1 offset).
+	 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		goto create_err;
+
+	ring->depth = p.sq_entries;
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto create_err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_sz);
+			goto create_err;
+		}
+	}
+	ring->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_sz,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_sz);
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+		goto create_err;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+	return (ring);
+
+create_err:
+	close(ring->fd);
+	free(ring);
+	return (NULL);
+}
+
+void
+pc_uring_destroy(pc_uring_t *ring)
+{
+	if (ring == NULL)
+		return;
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	free(ring->rbufs);
+	free(ring);
+}
+
+/*
+ * Register a set of equal sized buffers with the kernel so that I/O to and from
+ * them avoids per-operation page pinning. This is best-effort: If it fails (for
+ * example due to RLIMIT_MEMLOCK) unregistered operations are used.
+ */
+int
+pc_uring_register(pc_uring_t *ring, uchar_t **bufs, int nbufs, uint64_t buflen)
+{
+	struct iovec *iov;
+	int i, rv;
+
+	iov = (struct iovec *)malloc(nbufs * sizeof (struct iovec));
+	ring->rbufs = (uchar_t **)malloc(nbufs * sizeof (uchar_t *));
+	if (iov == NULL || ring->rbufs == NULL) {
+		free(iov);
+		free(ring->rbufs);
+		ring->rbufs = NULL;
+		return (-1);
+	}
+	for (i = 0; i < nbufs; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = buflen;
+		ring->rbufs[i] = bufs[i];
+	}
+	rv = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nbufs);
+	free(iov);
+	if (rv < 0) {
+		free(ring->rbufs);
+		ring->rbufs = NULL;
+		return (-1);
+	}
+	ring->nrbufs = nbufs;
+	ring->rbuflen = buflen;
+	return (0);
+}
+
+/*
+ * Find the registered buffer containing the given range, if any.
+ */
+static int
+uring_buf_index(pc_uring_t *ring, uchar_t *buf, uint64_t len)
+{
+	int i;
+
+	for (i = 0; i < ring->nrbufs; i++) {
+		if (buf >= ring->rbufs[i] && buf + len <= ring->rbufs[i] + ring->rbuflen)
+			return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Submit up to ring->depth linked operations and wait for all of them.
+ */
+static int
+uring_submit_batch(pc_uring_t *ring, int write, int fd, uchar_t **bufs, uint64_t *lens,
+    int64_t *res, int n)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, idx;
+	int i, bi, rv, reaped, submitted;
+
+	tail = *ring->sq_tail;
+	for (i = 0; i < n; i++) {
+		idx = tail & *ring->sq_mask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof (*sqe));
+		bi = uring_buf_index(ring, bufs[i], lens[i]);
+		if (bi >= 0) {
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = bi;
+		} else {
+			sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		}
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)bufs[i];
+		/* Larger transfers are completed synchronously after a short one. */
+		sqe->len = lens[i] > PC_URING_MAXIO ? PC_URING_MAXIO : lens[i];
+		sqe->off = (uint64_t)-1;
+		sqe->user_data = i;
+		if (i < n - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		ring->sq_array[idx] = idx;
+		tail++;
+		res[i] = -ECANCELED;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = 0;
+	reaped = 0;
+	while (reaped < n) {
+		rv = sys_io_uring_enter(ring->fd, n - submitted, n - reaped,
+		    IORING_ENTER_GETEVENTS);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		submitted += rv;
+		if (submitted > n)
+			submitted = n;
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data < (uint64_t)n)
+				res[cqe->user_data] = cqe->res;
+			head++;
+			reaped++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+/*
+ * Perform n reads or writes in sequence at the current position of fd. Each
+ * operation transfers lens[i] bytes and the actual count goes into done[i].
+ * As with Read(), a read is short only at EOF after which the remaining reads
+ * get 0. Operations cut short by the kernel are completed synchronously.
+ */
+int
+pc_uring_rw(pc_uring_t *ring, int write, int fd, uchar_t **bufs, uint64_t *lens,
+    int64_t *done, int n)
+{
+	int64_t res[PC_URING_DEPTH], rv;
+	int i, b, nb, eof;
+
+	eof = 0;
+	for (b = 0; b < n; b += nb) {
+		nb = n - b;
+		if (nb > (int)ring->depth)
+			nb = ring->depth;
+		if (nb > PC_URING_DEPTH)
+			nb = PC_URING_DEPTH;
+		if (eof) {
+			for (i = 0; i < nb; i++)
+				done[b + i] = 0;
+			continue;
+		}
+		if (uring_submit_batch(ring, write, fd, bufs + b, lens + b, res, nb) == -1)
+			return (-1);
+
+		for (i = 0; i < nb; i++) {
+			uchar_t *buf = bufs[b + i];
+			uint64_t len = lens[b + i];
+
+			if (eof) {
+				done[b + i] = 0;
+				continue;
+			}
+			rv = res[i];
+			if (rv == -ECANCELED || rv == -EINTR || rv == -EAGAIN) {
+				rv = 0;
+			} else if (rv < 0) {
+				errno = -rv;
+				return (-1);
+			} else if (rv == 0 && !write) {
+				eof = 1;
+				done[b + i] = 0;
+				continue;
+			}
+			if (rv < len) {
+				int64_t rem;
+
+				if (write)
+					rem = Write(fd, buf + rv, len - rv);
+				else
+					rem = Read(fd, buf + rv, len - rv);
+				if (rem < 0)
+					return (-1);
+				if (!write && rem < len - rv)
+					eof = 1;
+				rv += rem;
+				if (write && rv < len)
+					return (-1);
+			}
+			done[b + i] = rv;
+		}
+	}
+	return (0);
+}
+
+#else
+
+pc_uring_t *
+pc_uring_create(unsigned int depth)
+{
+	return (NULL);
+}
+
+void
+pc_uring_destroy(pc_uring_t *ring)
+{
+}
+
+int
+pc_uring_register(pc_uring_t *ring, uchar_t **bufs, int nbufs, uint64_t buflen)
+{
+	return (-1);
+}
+
+int
+pc_uring_rw(pc_uring_t *ring, int write, int fd, uchar_t **bufs, uint64_t *lens,
+    int64_t *done, int n)
+{
+	errno = ENOTSUP;
+	return (-1);
+}
+
+#endif
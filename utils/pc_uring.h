@@ -0,0 +1,58 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_PC_URING_H
+#define	_PC_URING_H
+
+#include <stdint.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Maximum number of chunk reads or writes batched into one submission.
+ */
+#define	PC_URING_DEPTH	32
+
+typedef struct pc_uring pc_uring_t;
+
+/*
+ * Optional Linux io_uring based batched I/O. If built without
+ * ENABLE_PC_IO_URING, or if the kernel does not support it, pc_uring_create()
+ * returns NULL and callers fall back to plain Read() and Write().
+ */
+pc_uring_t *pc_uring_create(unsigned int depth);
+void pc_uring_destroy(pc_uring_t *ring);
+int pc_uring_register(pc_uring_t *ring, uchar_t **bufs, int nbufs, uint64_t buflen);
+int pc_uring_rw(pc_uring_t *ring, int write, int fd, uchar_t **bufs, uint64_t *lens,
+    int64_t *done, int n);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,9 @@
  *
  */
 
+#if !defined(__APPLE__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE	1
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
@@ -36,6 +39,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #ifndef __APPLE__
 #include <link.h>
 #endif
@@ -43,8 +48,14 @@
 #include <rabin_dedup.h>
 #include <cpuid.h>
 #include <xxhash.h>
+#include <transpose.h>
+#include <delta2/delta2.h>
+#include <fpdelta/fpdelta.h>
 #include "archive/pc_archive.h"
 #include "archive/pc_arc_filter.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef __APPLE__
 #include <sys/sysctl.h>
@@ -55,6 +66,11 @@
 static mach_timebase_info_data_t sTimebaseInfo;
 #else
 #include <sys/sysinfo.h>
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 
 #define _IN_UTILS_
@@ -73,10 +89,73 @@ struct RiffHdr {
     char formType [4];
 };
 
+/*
+ * The PCOMPRESS_ISA environment variable can lower the detected instruction
+ * set to check or benchmark the fallback kernels. It never raises it.
+ */
+static void
+isa_override(processor_cap_t *pc)
+{
+	char *isa;
+	int sse, sub, avx;
+
+	isa = getenv("PCOMPRESS_ISA");
+	if (isa == NULL)
+		return;
+	if (pc->proc_type == PROC_ARM64) {
+		if (strcmp(isa, "generic") == 0) {
+			pc->neon_avail = 0;
+		} else if (strcmp(isa, "neon") != 0) {
+			log_msg(LOG_WARN, 0, "Ignoring unknown PCOMPRESS_ISA value %s", isa);
+			return;
+		}
+		pc->aes_avail = 0;
+		pc->sha2_avail = 0;
+		return;
+	}
+	if (strcmp(isa, "generic") == 0 || strcmp(isa, "sse2") == 0) {
+		sse = 2; sub = 0; avx = 0;
+	} else if (strcmp(isa, "sse4.1") == 0) {
+		sse = 4; sub = 1; avx = 0;
+	} else if (strcmp(isa, "sse4.2") == 0) {
+		sse = 4; sub = 2; avx = 0;
+	} else if (strcmp(isa, "avx") == 0) {
+		sse = 4; sub = 2; avx = 1;
+	} else if (strcmp(isa, "avx2") == 0) {
+		sse = 4; sub = 2; avx = 2;
+	} else {
+		log_msg(LOG_WARN, 0, "Ignoring unknown PCOMPRESS_ISA value %s", isa);
+		return;
+	}
+	if (pc->sse_level > sse || (pc->sse_level == sse && pc->sse_sub_level > sub)) {
+		pc->sse_level = sse;
+		pc->sse_sub_level = sub;
+	}
+	if (pc->avx_level > avx)
+		pc->avx_level = avx;
+	if (avx == 0)
+		pc->xop_avail = 0;
+	if (sse < 4)
+		pc->aes_avail = 0;
+}
+
 void
 init_pcompress() {
 	cpuid_basic_identify(&proc_info);
+	isa_override(&proc_info);
 	XXH32_module_init();
+	transpose_module_init(&proc_info);
+	dedupe_module_init(&proc_info);
+	delta2_module_init(&proc_info);
+	fpdelta_module_init(&proc_info);
+#ifdef _OPENMP
+	/*
+	 * The OpenMP runtime sizes its team from the affinity mask only, so
+	 * also honour a cgroup CPU quota unless the user set a thread count.
+	 */
+	if (getenv("OMP_NUM_THREADS") == NULL && get_avail_cpus() < omp_get_max_threads())
+		omp_set_num_threads(get_avail_cpus());
+#endif
 #ifdef __APPLE__
 	(void) mach_timebase_info(&sTimebaseInfo);
 #endif
@@ -236,7 +315,6 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
 {
         uchar_t *buf2;
         int64_t rcount;
-        dedupe_context_t *rctx = (dedupe_context_t *)ctx;
 
         if (!ctx) {
 		if (pctx)
@@ -253,6 +331,22 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
 		rcount = archiver_read(pctx, buf2, count);
 	else
 		rcount = Read(fd, buf2, count);
+	return (Split_Adjusted(buf, rcount, count, rabin_count, ctx));
+}
+
+/*
+ * Second half of Read_Adjusted() for callers that read the data themselves:
+ * count bytes were requested after the carried over data at the start of buf
+ * and rcount of them were read.
+ */
+int64_t
+Split_Adjusted(uchar_t *buf, int64_t rcount, uint64_t count, int64_t *rabin_count,
+    void *ctx)
+{
+        dedupe_context_t *rctx = (dedupe_context_t *)ctx;
+
+        if (!ctx)
+                return (rcount);
         if (rcount > 0) {
                 rcount += *rabin_count;
 		if (rcount == count + *rabin_count) {
@@ -294,6 +388,116 @@ Write(int fd, const void *buf, uint64_t count)
 	return (count - rem);
 }
 
+/*
+ * Positional version of Write(). Does not change the file offset.
+ */
+int64_t
+Pwrite(int fd, const void *buf, uint64_t count, uint64_t offset)
+{
+	int64_t wcount, rem;
+	uchar_t *cbuf;
+
+	rem = count;
+	cbuf = (uchar_t *)buf;
+	do {
+		wcount = pwrite(fd, cbuf, rem, offset);
+		if (wcount < 0) return (wcount);
+		rem = rem - wcount;
+		cbuf += wcount;
+		offset += wcount;
+	} while (rem);
+	return (count - rem);
+}
+
+/*
+ * Gathered version of Write(). Short writes are continued from where they
+ * stopped. The iovec array is modified in the process. If nothing more can
+ * be written the short count is returned.
+ */
+int64_t
+Writev(int fd, struct iovec *iov, int iovcnt)
+{
+	int64_t wcount, total;
+	uint64_t len;
+
+	total = 0;
+	while (iovcnt > 0) {
+		wcount = writev(fd, iov, iovcnt);
+		if (wcount < 0) return (wcount);
+		if (wcount == 0) break;
+		total += wcount;
+		while (iovcnt > 0 && (uint64_t)wcount >= iov->iov_len) {
+			wcount -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			len = wcount;
+			iov->iov_base = (uchar_t *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return (total);
+}
+
+/*
+ * Version of Writev() for pipes that maps the pages into the pipe with
+ * vmsplice() instead of copying them. The pipe refers to the memory until
+ * its reader gets to it, so the memory must not change before pipe_unread()
+ * shows that the bytes are consumed. Fails with ENOSYS where there is no
+ * vmsplice().
+ */
+int64_t
+Vmsplice(int fd, struct iovec *iov, int iovcnt)
+{
+#ifdef __linux__
+	int64_t wcount, total;
+	uint64_t len;
+
+	total = 0;
+	while (iovcnt > 0) {
+		wcount = vmsplice(fd, iov, iovcnt, 0);
+		if (wcount < 0) return (wcount);
+		if (wcount == 0) break;
+		total += wcount;
+		while (iovcnt > 0 && (uint64_t)wcount >= iov->iov_len) {
+			wcount -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			len = wcount;
+			iov->iov_base = (uchar_t *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return (total);
+#else
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+/*
+ * Number of bytes written into a pipe that its reader has not consumed yet.
+ * Returns -1 if the reader has gone away or the count is not available.
+ */
+int64_t
+pipe_unread(int fd)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = fd;
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+		return (-1);
+	if (ioctl(fd, FIONREAD, &n) == -1)
+		return (-1);
+	return (n);
+}
+
 void
 init_algo_props(algo_props_t *props)
 {
@@ -306,6 +510,8 @@ init_algo_props(algo_props_t *props)
 	props->c_max_threads = 1;
 	props->d_max_threads = 1;
 	props->delta2_span = 0;
+	props->state_mem = 0;
+	props->decomp_direct = 0;
 }
 
 /*
@@ -357,18 +563,236 @@ set_threadcounts(algo_props_t *props, int *nthreads, int nprocs, algo_threads_ty
 			props->nthreads = props->d_max_threads;
 		if (props->nthreads > nprocs)
 			props->nthreads = nprocs;
+
+	} else if (props->single_chunk_mt_capable && *nthreads > 0 && *nthreads < nprocs) {
+		/*
+		 * Fewer chunks than processors. Spread the spare processors over
+		 * the chunks.
+		 */
+		props->nthreads = nprocs / *nthreads;
+		if (typ == COMPRESS_THREADS) {
+			if (props->nthreads > props->c_max_threads)
+				props->nthreads = props->c_max_threads;
+		} else {
+			if (props->nthreads > props->d_max_threads)
+				props->nthreads = props->d_max_threads;
+		}
 	}
 }
 
+/*
+ * Number of threads the calling thread lets an algorithm use for one chunk.
+ * This is the OpenMP thread count of the calling thread, which is private
+ * to it, so every chunk thread can set its own.
+ */
+void
+set_chunk_threads(int n)
+{
+#ifdef _OPENMP
+	omp_set_num_threads(n < 1 ? 1 : n);
+#endif
+}
+
+int
+get_chunk_threads(void)
+{
+#ifdef _OPENMP
+	return (omp_get_max_threads());
+#else
+	return (1);
+#endif
+}
+
+#ifndef __APPLE__
+/*
+ * Container limits. Inside a cgroup with a CPU quota or a memory limit the
+ * host wide core count and RAM size lead to too many threads and to buffers
+ * and indexes that run into the OOM killer. Both cgroup v2 and v1 layouts are
+ * checked, first under the cgroup path of this process from /proc/self/cgroup
+ * and then at the mount root, which is what a cgroup namespace shows.
+ */
+static pthread_once_t cg_once = PTHREAD_ONCE_INIT;
+static int cg_cpus = 0;
+static uint64_t cg_mem_limit = 0;
+static char cg_mem_dir[MAXPATHLEN];
+
+static int
+cg_read(const char *dir, const char *file, char *buf, int len)
+{
+	char path[MAXPATHLEN];
+	int fd, rv;
+
+	snprintf(path, sizeof (path), "%s/%s", dir, file);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	rv = read(fd, buf, len - 1);
+	close(fd);
+	if (rv <= 0)
+		return (-1);
+	buf[rv] = '\0';
+	return (0);
+}
+
+/*
+ * Find the directory holding the given control file. For cgroup v2 ctrl is
+ * NULL, otherwise it is the v1 controller name.
+ */
+static int
+cg_find(const char *ctrl, const char *file, char *dir, int dlen)
+{
+	char line[512], buf[64], *cpath, *ctrls;
+	const char *mnt;
+	FILE *fh;
+
+	mnt = (ctrl == NULL ? "/sys/fs/cgroup" : NULL);
+	if (ctrl != NULL) {
+		if (strcmp(ctrl, "cpu") == 0)
+			mnt = "/sys/fs/cgroup/cpu";
+		else
+			mnt = "/sys/fs/cgroup/memory";
+	}
+	fh = fopen("/proc/self/cgroup", "r");
+	if (fh != NULL) {
+		while (fgets(line, sizeof (line), fh) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			ctrls = strchr(line, ':');
+			if (ctrls == NULL)
+				continue;
+			ctrls++;
+			cpath = strchr(ctrls, ':');
+			if (cpath == NULL)
+				continue;
+			*cpath++ = '\0';
+			if (ctrl == NULL) {
+				if (*ctrls != '\0')
+					continue;
+			} else {
+				char *c, *sv;
+				int found = 0;
+
+				for (c = strtok_r(ctrls, ",", &sv); c != NULL;
+				    c = strtok_r(NULL, ",", &sv)) {
+					if (strcmp(c, ctrl) == 0)
+						found = 1;
+				}
+				if (!found)
+					continue;
+			}
+			snprintf(dir, dlen, "%s%s", mnt, cpath);
+			if (cg_read(dir, file, buf, sizeof (buf)) == 0) {
+				fclose(fh);
+				return (0);
+			}
+		}
+		fclose(fh);
+	}
+	snprintf(dir, dlen, "%s", mnt);
+	if (cg_read(dir, file, buf, sizeof (buf)) == 0)
+		return (0);
+	return (-1);
+}
+
+static void
+cg_init(void)
+{
+	char dir[MAXPATHLEN], buf[64];
+	int64_t quota, period;
+	uint64_t lim;
+	cpu_set_t cs;
+	int n;
+
+	/*
+	 * CPUs allowed by the affinity mask, then lowered by any CFS quota.
+	 */
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (sched_getaffinity(0, sizeof (cs), &cs) == 0 && CPU_COUNT(&cs) > 0 &&
+	    CPU_COUNT(&cs) < n)
+		n = CPU_COUNT(&cs);
+	quota = -1;
+	period = 0;
+	if (cg_find(NULL, "cpu.max", dir, sizeof (dir)) == 0 &&
+	    cg_read(dir, "cpu.max", buf, sizeof (buf)) == 0) {
+		if (strncmp(buf, "max", 3) != 0)
+			sscanf(buf, "%" PRId64 " %" PRId64, &quota, &period);
+	} else if (cg_find("cpu", "cpu.cfs_quota_us", dir, sizeof (dir)) == 0 &&
+	    cg_read(dir, "cpu.cfs_quota_us", buf, sizeof (buf)) == 0) {
+		quota = strtoll(buf, NULL, 10);
+		if (cg_read(dir, "cpu.cfs_period_us", buf, sizeof (buf)) == 0)
+			period = strtoll(buf, NULL, 10);
+	}
+	if (quota > 0 && period > 0) {
+		int64_t q = (quota + period - 1) / period;
+
+		if (q < n)
+			n = (int)q;
+	}
+	cg_cpus = (n > 0 ? n : 1);
+
+	/*
+	 * Memory limit. cgroup v1 reports a huge page aligned value when
+	 * there is no limit, which the comparison with host RAM filters out.
+	 */
+	lim = 0;
+	if (cg_find(NULL, "memory.max", cg_mem_dir, sizeof (cg_mem_dir)) == 0) {
+		if (cg_read(cg_mem_dir, "memory.max", buf, sizeof (buf)) == 0 &&
+		    strncmp(buf, "max", 3) != 0)
+			lim = strtoull(buf, NULL, 10);
+	} else if (cg_find("memory", "memory.limit_in_bytes", cg_mem_dir,
+	    sizeof (cg_mem_dir)) == 0) {
+		if (cg_read(cg_mem_dir, "memory.limit_in_bytes", buf, sizeof (buf)) == 0)
+			lim = strtoull(buf, NULL, 10);
+	}
+	if (lim > 0 && lim < (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE))
+		cg_mem_limit = lim;
+}
+
+/*
+ * Memory charged to the cgroup right now, or 0 if unknown.
+ */
+static uint64_t
+cg_mem_usage(void)
+{
+	char buf[64];
+
+	if (cg_read(cg_mem_dir, "memory.current", buf, sizeof (buf)) == 0 ||
+	    cg_read(cg_mem_dir, "memory.usage_in_bytes", buf, sizeof (buf)) == 0)
+		return (strtoull(buf, NULL, 10));
+	return (0);
+}
+#endif
+
+/*
+ * Number of CPUs this process can actually use. This accounts for the
+ * affinity mask and any cgroup CPU quota, so it is what thread counts
+ * should be based on.
+ */
+int
+get_avail_cpus()
+{
+#ifndef __APPLE__
+	pthread_once(&cg_once, cg_init);
+	return (cg_cpus);
+#else
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0 ? n : 1);
+#endif
+}
+
 uint64_t
 get_total_ram()
 {
 #ifndef __APPLE__
-	uint64_t phys_pages, page_size;
+	uint64_t phys_pages, page_size, ram;
 
 	page_size = sysconf(_SC_PAGESIZE);
 	phys_pages = sysconf(_SC_PHYS_PAGES);
-	return (phys_pages * page_size);
+	ram = phys_pages * page_size;
+	pthread_once(&cg_once, cg_init);
+	if (cg_mem_limit > 0 && cg_mem_limit < ram)
+		ram = cg_mem_limit;
+	return (ram);
 #else
 	int mib[2];
 	int64_t size;
@@ -461,6 +885,25 @@ get_sys_limits(my_sysinfo *msys_info)
 	msys_info->freeswap = sys_info.freeswap * sys_info.mem_unit;
 	msys_info->mem_unit = sys_info.mem_unit;
 	msys_info->sharedram = sys_info.sharedram * sys_info.mem_unit;
+
+	/*
+	 * Inside a memory limited cgroup only the headroom below the limit
+	 * is really free, whatever the host has.
+	 */
+	pthread_once(&cg_once, cg_init);
+	if (cg_mem_limit > 0) {
+		uint64_t used = cg_mem_usage();
+		uint64_t avail = (used < cg_mem_limit ? cg_mem_limit - used : 0);
+
+		if ((uint64_t)msys_info->totalram > cg_mem_limit)
+			msys_info->totalram = cg_mem_limit;
+		if ((uint64_t)msys_info->freeram > avail)
+			msys_info->freeram = avail;
+		if (msys_info->sharedram > msys_info->totalram)
+			msys_info->sharedram = 0;
+		msys_info->totalswap = 0;
+		msys_info->freeswap = 0;
+	}
 #endif
 
 	/*
@@ -763,6 +1206,12 @@ Sem_Wait(Sem_t *sem)
 	return (sem_wait(sem->sem1));
 }
 
+int
+Sem_TryWait(Sem_t *sem)
+{
+	return (sem_trywait(sem->sem1));
+}
+
 #else
 
 int
@@ -788,5 +1237,128 @@ Sem_Wait(Sem_t *sem)
 {
 	return (sem_wait(&sem->sem));
 }
+
+int
+Sem_TryWait(Sem_t *sem)
+{
+	return (sem_trywait(&sem->sem));
+}
+#endif
+
+/*
+ * Handoff semaphores. The count is taken with a compare and swap. A waiter
+ * that finds it zero spins for a while, then registers in waiters and sleeps
+ * in a futex for as long as the count is zero. Hsem_Post bumps the count and
+ * wakes one sleeper if there is any. Both sides use sequentially consistent
+ * atomics, so either the poster sees the waiter or the futex call of the
+ * waiter sees the new count and returns at once. Spinning only helps if the
+ * poster runs on another processor, so it is off with a single one. The spin
+ * count can be set with PCOMPRESS_HANDOFF_SPIN, 0 sleeps right away.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#	define	CPU_RELAX()	__asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#	define	CPU_RELAX()	__asm__ __volatile__("yield")
+#else
+#	define	CPU_RELAX()
+#endif
+
+int
+Hsem_Init(Hsem_t *hs, int value)
+{
+	char *sp;
+
+	hs->count = value;
+	hs->waiters = 0;
+	if ((sp = getenv("PCOMPRESS_HANDOFF_SPIN")) != NULL)
+		hs->spin = atoi(sp);
+	else
+		hs->spin = (get_avail_cpus() > 1 ? HSEM_SPIN_DEFAULT : 0);
+#ifdef __linux__
+	return (0);
+#else
+	return (Sem_Init(&hs->sem, 0, value));
+#endif
+}
+
+int
+Hsem_Destroy(Hsem_t *hs)
+{
+#ifdef __linux__
+	return (0);
+#else
+	return (Sem_Destroy(&hs->sem));
+#endif
+}
+
+#ifdef __linux__
+int
+Hsem_TryWait(Hsem_t *hs)
+{
+	int32_t c;
+
+	c = __atomic_load_n(&hs->count, __ATOMIC_RELAXED);
+	while (c > 0) {
+		if (__atomic_compare_exchange_n(&hs->count, &c, c - 1, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return (0);
+	}
+	errno = EAGAIN;
+	return (-1);
+}
+
+int
+Hsem_Post(Hsem_t *hs)
+{
+	__atomic_fetch_add(&hs->count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hs->waiters, __ATOMIC_SEQ_CST) > 0)
+		syscall(SYS_futex, &hs->count, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	return (0);
+}
+
+int
+Hsem_Wait(Hsem_t *hs)
+{
+	int i;
+
+	for (i = 0; i < hs->spin; i++) {
+		if (Hsem_TryWait(hs) == 0)
+			return (0);
+		CPU_RELAX();
+	}
+	for (;;) {
+		if (Hsem_TryWait(hs) == 0)
+			return (0);
+		__atomic_fetch_add(&hs->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&hs->count, __ATOMIC_SEQ_CST) == 0)
+			syscall(SYS_futex, &hs->count, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+		__atomic_fetch_sub(&hs->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+#else
+int
+Hsem_TryWait(Hsem_t *hs)
+{
+	return (Sem_TryWait(&hs->sem));
+}
+
+int
+Hsem_Post(Hsem_t *hs)
+{
+	return (Sem_Post(&hs->sem));
+}
+
+int
+Hsem_Wait(Hsem_t *hs)
+{
+	int i;
+
+	for (i = 0; i < hs->spin; i++) {
+		if (Sem_TryWait(&hs->sem) == 0)
+			return (0);
+		CPU_RELAX();
+	}
+	return (Sem_Wait(&hs->sem));
+}
 #endif
 
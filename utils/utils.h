@@ -29,6 +29,7 @@
 #include <arpa/nameser_compat.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifndef __STDC_FORMAT_MACROS
 #define	__STDC_FORMAT_MACROS	1
@@ -218,6 +219,13 @@ typedef enum {
  */
 	CKSUM_SKEIN256 = 0x800,
 	CKSUM_SKEIN512 = 0x900,
+/*
+ * Non-cryptographic fast checksums. The 3-bit checksum field in the header
+ * flags is full so these set the top flag bit as well.
+ */
+	CKSUM_CRC32C = 0x8100,
+	CKSUM_XXH3 = 0x8200,
+	CKSUM_XXH128 = 0x8300,
 	CKSUM_INVALID = 0
 } cksum_t;
 
@@ -243,6 +251,8 @@ typedef struct {
 	int delta2_span;
 	int deltac_min_distance;
 	cksum_t cksum;
+	uint64_t state_mem;	/* Approximate working memory of one instance. */
+	int decomp_direct;	/* Never writes past the decompressed size. */
 } algo_props_t;
 
 typedef enum {
@@ -344,10 +354,19 @@ extern char *bytes_to_size(uint64_t bytes);
 extern int64_t Read(int fd, void *buf, uint64_t count);
 extern int64_t Read_Adjusted(int fd, uchar_t *buf, uint64_t count,
 	int64_t *rabin_count, void *ctx, void *pctx);
+extern int64_t Split_Adjusted(uchar_t *buf, int64_t rcount, uint64_t count,
+	int64_t *rabin_count, void *ctx);
 extern int64_t Write(int fd, const void *buf, uint64_t count);
+extern int64_t Writev(int fd, struct iovec *iov, int iovcnt);
+extern int64_t Vmsplice(int fd, struct iovec *iov, int iovcnt);
+extern int64_t pipe_unread(int fd);
+extern int64_t Pwrite(int fd, const void *buf, uint64_t count, uint64_t offset);
 extern void set_threadcounts(algo_props_t *props, int *nthreads, int nprocs,
 	algo_threads_type_t typ);
+extern void set_chunk_threads(int n);
+extern int get_chunk_threads(void);
 extern uint64_t get_total_ram();
+extern int get_avail_cpus();
 extern double get_wtime_millis(void);
 extern double get_mb_s(uint64_t bytes, double strt, double en);
 extern void get_sys_limits(my_sysinfo *msys_info);
@@ -378,6 +397,9 @@ typedef int (*deinit_func_ptr)(void **data);
 typedef void (*stats_func_ptr)(int show);
 typedef void (*props_func_ptr)(algo_props_t *data, int level, uint64_t chunksize);
 
+/* Pointer type for setting the data a chunk is compressed after, see -o. */
+typedef void (*prefix_func_ptr)(void *data, uchar_t *prefix, uint64_t len);
+
 /*
  * Logging definitions.
  */
@@ -435,6 +457,31 @@ int Sem_Init(Sem_t *sem, int pshared, int value);
 int Sem_Destroy(Sem_t *sem);
 int Sem_Post(Sem_t *sem);
 int Sem_Wait(Sem_t *sem);
+int Sem_TryWait(Sem_t *sem);
+
+/*
+ * Handoff semaphore, used to pass chunk slots between the reader, the
+ * workers and the writer. A waiter spins for a while before it sleeps, and
+ * Hsem_Post only makes a system call if a waiter sleeps. There is no spinning
+ * with a single processor. On Linux it sleeps in a futex on the count,
+ * elsewhere it falls back to Sem_t.
+ */
+#define	HSEM_SPIN_DEFAULT	256
+
+typedef struct _handoff_sem {
+	int32_t count;
+	int32_t waiters;
+	int spin;
+#ifndef __linux__
+	Sem_t sem;
+#endif
+} Hsem_t;
+
+int Hsem_Init(Hsem_t *hs, int value);
+int Hsem_Destroy(Hsem_t *hs);
+int Hsem_Post(Hsem_t *hs);
+int Hsem_Wait(Hsem_t *hs);
+int Hsem_TryWait(Hsem_t *hs);
 
 
 /*
@@ -41,6 +41,8 @@ typedef int			INT;
 #define IMAGE_FILE_MACHINE_AMD64 0x8664
 #define IMAGE_NT_OPTIONAL_HDR32_MAGIC 0x10b
 #define IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20b
+#define IMAGE_SCN_CNT_CODE 0x00000020
+#define IMAGE_SCN_MEM_EXECUTE 0x20000000
 
 typedef struct _IMAGE_DOS_HEADER
 {
@@ -152,6 +152,15 @@ To free memory context, use XXH32_result().
 
 void XXH32_module_init();
 
+void XXH32_bulk(const void* input[], const unsigned int len[], unsigned int hash[], int n, unsigned int seed);
+
+/*
+XXH32_bulk() :
+	Calculate the 32-bits hash of n independent buffers. hash[i] is the same as
+	XXH32(input[i], len[i], seed). With AVX2 up to 8 buffers are hashed in parallel,
+	which is much faster for many small buffers like dedupe blocks.
+*/
+
 #if defined (__cplusplus)
 }
 #endif
@@ -26,8 +26,21 @@
 #include <inttypes.h>
 #include <xxhash.h>
 #include <pthread.h>
+#include <string.h>
 #include <utils.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#define	PRIME32_1	2654435761U
+#define	PRIME32_2	2246822519U
+#define	PRIME32_3	3266489917U
+#define	PRIME32_4	668265263U
+#define	PRIME32_5	374761393U
+#define	ROTL32(x, r)	(((x) << (r)) | ((x) >> (32 - (r))))
+#define	BULK_LANES	8
+
 extern void*        XXH32_init_SSE4   (unsigned int seed);
 extern int          XXH32_feed_SSE4   (void* state, const void* input, int len);
 extern unsigned int XXH32_result_SSE4 (void* state);
@@ -45,6 +58,7 @@ void * (*xxh32_init)(unsigned int seed) = NULL;
 int (*xxh32_feed)(void* state, const void* input, int len) = NULL;
 unsigned int (*xxh32_result)(void* state) = NULL;
 unsigned int (*xxh32_getIntermediateResult)(void* state) = NULL;
+static int bulk_avx2 = 0;
 
 void
 XXH32_module_init() {
@@ -61,6 +75,9 @@ XXH32_module_init() {
 		xxh32_result = XXH32_result_SSE2;
 		xxh32_getIntermediateResult = XXH32_getIntermediateResult_SSE2;
 	}
+#if defined(__x86_64__) && defined(__GNUC__)
+	bulk_avx2 = (proc_info.avx_level >= 2);
+#endif
 }
 
 unsigned int
@@ -93,3 +110,168 @@ XXH32_getIntermediateResult(void* state)
 	return xxh32_getIntermediateResult(state);
 }
 
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * The eight 32-bit accumulators of XXH32 (v1-v4 and vx1-vx4) exactly fill
+ * one YMM register, and a 32-byte stripe loads straight into it. A single
+ * buffer is bound by the latency of the multiply chain, so up to eight
+ * buffers are advanced together to keep the multipliers busy. When a lane
+ * runs out of stripes it is finished and refilled with the next buffer.
+ */
+static inline __attribute__((target("avx2"))) __m256i
+bulk_round(__m256i acc, const unsigned char *p, __m256i p1, __m256i p2)
+{
+	__m256i m = _mm256_loadu_si256((const __m256i *)p);
+
+	acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(m, p2));
+	acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13), _mm256_srli_epi32(acc, 19));
+	return (_mm256_mullo_epi32(acc, p1));
+}
+
+/*
+ * Combine the accumulators and hash the tail the same way as XXH32().
+ */
+static unsigned int
+bulk_finish(unsigned int vx[8], const unsigned char *p, const unsigned char *bEnd,
+    unsigned int consumed)
+{
+	unsigned int v1, v2, v3, v4, h32, w;
+
+	v1 = vx[0] + vx[4] * PRIME32_2; v1 = ROTL32(v1, 13); v1 *= PRIME32_1;
+	v2 = vx[1] + vx[5] * PRIME32_2; v2 = ROTL32(v2, 13); v2 *= PRIME32_1;
+	v3 = vx[2] + vx[6] * PRIME32_2; v3 = ROTL32(v3, 13); v3 *= PRIME32_1;
+	v4 = vx[3] + vx[7] * PRIME32_2; v4 = ROTL32(v4, 13); v4 *= PRIME32_1;
+	h32 = ROTL32(v1, 1) + ROTL32(v2, 7) + ROTL32(v3, 12) + ROTL32(v4, 18);
+	h32 += consumed;
+
+	while (p + 4 <= bEnd) {
+		memcpy(&w, p, 4);
+		h32 += w * PRIME32_3;
+		h32 = ROTL32(h32, 17) * PRIME32_4;
+		p += 4;
+	}
+	while (p < bEnd) {
+		h32 += (*p) * PRIME32_5;
+		h32 = ROTL32(h32, 11) * PRIME32_1;
+		p++;
+	}
+	h32 ^= h32 >> 15;
+	h32 *= PRIME32_2;
+	h32 ^= h32 >> 13;
+	h32 *= PRIME32_3;
+	h32 ^= h32 >> 16;
+	return (h32);
+}
+
+static __attribute__((target("avx2"))) void
+XXH32_bulk_avx2(const void* input[], const unsigned int len[], unsigned int hash[],
+    int n, unsigned int seed)
+{
+	__m256i acc[BULK_LANES], init, p1, p2;
+	const unsigned char *ptr[BULK_LANES];
+	unsigned int left[BULK_LANES], vx[8];
+	int idx[BULK_LANES];
+	int next, m, k;
+	unsigned int r, s;
+
+	init = _mm256_setr_epi32(seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed,
+	    seed - PRIME32_1, seed + PRIME32_1 + PRIME32_2, seed + PRIME32_2, seed,
+	    seed - PRIME32_1);
+	p1 = _mm256_set1_epi32(PRIME32_1);
+	p2 = _mm256_set1_epi32(PRIME32_2);
+	next = 0;
+	m = 0;
+
+	for (;;) {
+		/*
+		 * Fill free lanes. Buffers shorter than one stripe do not
+		 * touch the accumulators and are hashed directly.
+		 */
+		while (m < BULK_LANES && next < n) {
+			if (len[next] < 32) {
+				hash[next] = XXH32(input[next], len[next], seed);
+			} else {
+				idx[m] = next;
+				ptr[m] = (const unsigned char *)input[next];
+				left[m] = len[next] / 32;
+				acc[m] = init;
+				m++;
+			}
+			next++;
+		}
+		if (m == 0)
+			break;
+
+		r = left[0];
+		for (k = 1; k < m; k++) {
+			if (left[k] < r)
+				r = left[k];
+		}
+		if (m == BULK_LANES) {
+			for (s = 0; s < r; s++) {
+				unsigned int o = s * 32;
+
+				acc[0] = bulk_round(acc[0], ptr[0] + o, p1, p2);
+				acc[1] = bulk_round(acc[1], ptr[1] + o, p1, p2);
+				acc[2] = bulk_round(acc[2], ptr[2] + o, p1, p2);
+				acc[3] = bulk_round(acc[3], ptr[3] + o, p1, p2);
+				acc[4] = bulk_round(acc[4], ptr[4] + o, p1, p2);
+				acc[5] = bulk_round(acc[5], ptr[5] + o, p1, p2);
+				acc[6] = bulk_round(acc[6], ptr[6] + o, p1, p2);
+				acc[7] = bulk_round(acc[7], ptr[7] + o, p1, p2);
+			}
+		} else {
+			for (s = 0; s < r; s++) {
+				for (k = 0; k < m; k++)
+					acc[k] = bulk_round(acc[k], ptr[k] + s * 32, p1, p2);
+			}
+		}
+
+		/*
+		 * Advance all lanes and retire the ones that are done by moving
+		 * the last active lane into their slot.
+		 */
+		for (k = 0; k < m; k++) {
+			ptr[k] += r * 32;
+			left[k] -= r;
+		}
+		k = 0;
+		while (k < m) {
+			if (left[k] > 0) {
+				k++;
+				continue;
+			}
+			s = len[idx[k]];
+			_mm256_storeu_si256((__m256i *)vx, acc[k]);
+			hash[idx[k]] = bulk_finish(vx, ptr[k],
+			    (const unsigned char *)input[idx[k]] + s, s & ~31U);
+			m--;
+			idx[k] = idx[m];
+			ptr[k] = ptr[m];
+			left[k] = left[m];
+			acc[k] = acc[m];
+		}
+	}
+}
+#endif
+
+/*
+ * Hash n independent buffers, like the blocks of a chunk. The results are the
+ * same as calling XXH32() on each buffer.
+ */
+void
+XXH32_bulk(const void* input[], const unsigned int len[], unsigned int hash[], int n,
+    unsigned int seed)
+{
+	int i;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (bulk_avx2) {
+		XXH32_bulk_avx2(input, len, hash, n, seed);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		hash[i] = XXH32(input[i], len[i], seed);
+}
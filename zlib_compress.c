@@ -30,12 +30,33 @@
 #include <utils.h>
 #include <pcompress.h>
 #include <allocator.h>
+#ifdef ENABLE_PC_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 /*
  * Max buffer size allowed for a single zlib compress/decompress call.
  */
 #define	SINGLE_CALL_MAX (2147483648UL)
 
+/*
+ * Since pcompress always has the whole chunk in memory, when built with
+ * libdeflate the zlib algorithm uses its whole-buffer deflate engine instead
+ * of zlib's streaming one. Both produce and accept the same raw deflate data
+ * (zlib format for archive versions before 5), so archives are compatible
+ * either way. The z_stream is still set up for buffers beyond
+ * SINGLE_CALL_MAX which go through zlib.
+ */
+struct zlib_ctx {
+	z_stream zs;
+	compress_op_t op;
+#ifdef ENABLE_PC_LIBDEFLATE
+	struct libdeflate_compressor *ldc;
+	struct libdeflate_decompressor *ldd;
+	int wrapped;
+#endif
+};
+
 static void zerr(int ret, int cmp);
 
 static void *
@@ -59,10 +80,17 @@ int
 zlib_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	  int file_version, compress_op_t op)
 {
+	struct zlib_ctx *ctx;
 	z_stream *zs;
 	int ret;
 
-	zs = (z_stream *)slab_alloc(NULL, sizeof (z_stream));
+	ctx = (struct zlib_ctx *)slab_calloc(NULL, 1, sizeof (struct zlib_ctx));
+	if (!ctx) {
+		zerr(Z_MEM_ERROR, 0);
+		return (-1);
+	}
+	ctx->op = op;
+	zs = &(ctx->zs);
 	zs->zalloc = slab_alloc_ui;
 	zs->zfree = slab_free;
 	zs->opaque = NULL;
@@ -79,10 +107,23 @@ zlib_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	}
 	if (ret != Z_OK) {
 		zerr(ret, 0);
+		slab_free(NULL, ctx);
+		return (-1);
+	}
+#ifdef ENABLE_PC_LIBDEFLATE
+	if (op == COMPRESS)
+		ctx->ldc = libdeflate_alloc_compressor(*level);
+	else
+		ctx->ldd = libdeflate_alloc_decompressor();
+	if (!ctx->ldc && !ctx->ldd) {
+		zerr(Z_MEM_ERROR, 0);
+		zlib_deinit((void **)&ctx);
 		return (-1);
 	}
+	ctx->wrapped = (file_version < 5);
+#endif
 
-	*data = zs;
+	*data = ctx;
 	return (0);
 }
 
@@ -95,15 +136,26 @@ void
 zlib_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->delta2_span = 100;
 	data->deltac_min_distance = EIGHTM;
+	data->state_mem = (256 * 1024);
 }
 
 int
 zlib_deinit(void **data)
 {
 	if (*data) {
-		z_stream *zs = (z_stream *)(*data);
-		deflateEnd(zs);
-		slab_free(NULL, *data);
+		struct zlib_ctx *ctx = (struct zlib_ctx *)(*data);
+		if (ctx->op == COMPRESS)
+			deflateEnd(&(ctx->zs));
+		else
+			inflateEnd(&(ctx->zs));
+#ifdef ENABLE_PC_LIBDEFLATE
+		if (ctx->ldc)
+			libdeflate_free_compressor(ctx->ldc);
+		if (ctx->ldd)
+			libdeflate_free_decompressor(ctx->ldd);
+#endif
+		slab_free(NULL, ctx);
+		*data = NULL;
 	}
 	return (0);
 }
@@ -150,7 +202,8 @@ zlib_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	uint64_t _dstlen = *dstlen;
 	uchar_t *dst1 = (uchar_t *)dst;
 	uchar_t *src1 = (uchar_t *)src;
-	z_stream *zs = (z_stream *)data;
+	struct zlib_ctx *ctx = (struct zlib_ctx *)data;
+	z_stream *zs = &(ctx->zs);
 
 	/*
 	 * If the data is known to be compressed then certain types less compressed data
@@ -165,6 +218,17 @@ zlib_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 			return (-1);
 		}
 	}
+#ifdef ENABLE_PC_LIBDEFLATE
+	if (srclen <= SINGLE_CALL_MAX) {
+		size_t clen;
+
+		clen = libdeflate_deflate_compress(ctx->ldc, src, srclen, dst, *dstlen);
+		if (clen == 0)
+			return (-1);
+		*dstlen = clen;
+		return (0);
+	}
+#endif
 	ending = 0;
 	while (_srclen > 0) {
 		if (_srclen > SINGLE_CALL_MAX) {
@@ -226,8 +290,29 @@ zlib_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	uint64_t _dstlen = *dstlen;
 	uchar_t *dst1 = (uchar_t *)dst;
 	uchar_t *src1 = (uchar_t *)src;
-	z_stream *zs = (z_stream *)data;
+	struct zlib_ctx *ctx = (struct zlib_ctx *)data;
+	z_stream *zs = &(ctx->zs);
 
+#ifdef ENABLE_PC_LIBDEFLATE
+	if (srclen <= SINGLE_CALL_MAX && *dstlen <= SINGLE_CALL_MAX) {
+		enum libdeflate_result res;
+		size_t in_nbytes, out_nbytes;
+
+		if (ctx->wrapped) {
+			res = libdeflate_zlib_decompress_ex(ctx->ldd, src, srclen, dst,
+			    *dstlen, &in_nbytes, &out_nbytes);
+		} else {
+			res = libdeflate_deflate_decompress_ex(ctx->ldd, src, srclen, dst,
+			    *dstlen, &in_nbytes, &out_nbytes);
+		}
+		if (res != LIBDEFLATE_SUCCESS || in_nbytes != srclen) {
+			zerr(res == LIBDEFLATE_INSUFFICIENT_SPACE ? Z_BUF_ERROR : Z_DATA_ERROR, 0);
+			return (-1);
+		}
+		*dstlen = out_nbytes;
+		return (0);
+	}
+#endif
 	while (_srclen > 0) {
 		if (_srclen > SINGLE_CALL_MAX) {
 			slen = SINGLE_CALL_MAX;
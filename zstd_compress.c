@@ -0,0 +1,658 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2014 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <utils.h>
+#include <pcompress.h>
+#include <allocator.h>
+#include <zstd.h>
+#include <zdict.h>
+
+/*
+ * Pcompress levels 0 - 14 spread over the zstd levels. Long distance matching
+ * with a window covering the whole chunk is enabled from ZSTD_LDM_LEVEL onwards
+ * for chunks bigger than 8MB.
+ */
+static const int zstd_levels[15] = {1, 1, 2, 3, 4, 6, 8, 11, 14, 17, 19, 19, 20, 21, 22};
+#define	ZSTD_LDM_LEVEL		8
+#define	ZSTD_LDM_MIN_WLOG	23
+#define	ZSTD_MAX_WLOG		30
+
+/*
+ * Dictionary training samples. Every chunk contributes a few samples spread
+ * over its length until the sample pool is full.
+ */
+#define	ZSTD_SAMPLE_SZ		4096
+#define	ZSTD_SAMPLES_PER_CHUNK	16
+#define	ZSTD_SAMPLE_POOL	(4 * FOURM)
+#define	ZSTD_DICT_SZ		(112 * 1024)
+
+/*
+ * Per-type dictionaries of archive mode (-y). Small members are sampled per
+ * data type while the file list is built and a dictionary is trained for each
+ * type with enough samples. They are stored in the file header and a chunk is
+ * compressed with the dictionary of its type, decompression finds it by the
+ * dictionary ID in the zstd frame.
+ */
+#define	ZSTD_TDICT_MAX		8
+#define	ZSTD_TDICT_POOL		(1024 * 1024)
+#define	ZSTD_TDICT_SZ		(64 * 1024)
+#define	ZSTD_TDICT_MIN_SAMPLES	32
+
+struct zstd_tdict {
+	int btype;
+	uchar_t *pool;
+	size_t *sizes;
+	size_t len;
+	unsigned int n, id;
+	uchar_t *dict;
+	size_t dict_sz;
+	ZSTD_CDict *cd;
+	ZSTD_DDict *dd;
+};
+
+struct zstd_params {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	int train, wlog;
+	uchar_t *prefix;
+	uint64_t prefix_len;
+};
+
+/*
+ * State shared by all threads: the dictionary named by PCOMPRESS_ZSTD_DICT and
+ * the training sample pool for PCOMPRESS_ZSTD_TRAIN.
+ */
+static pthread_mutex_t zstd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int zstd_users = 0;
+static uchar_t *zstd_dict = NULL;
+static size_t zstd_dict_sz = 0;
+static uchar_t *sample_pool = NULL;
+static size_t *sample_sizes = NULL;
+static size_t sample_len = 0;
+static unsigned int nsamples = 0;
+static struct zstd_tdict tdicts[ZSTD_TDICT_MAX];
+static int ntdicts = 0, tdicts_ready = 0;
+
+void
+zstd_stats(int show)
+{
+}
+
+int
+zstd_buf_extra(uint64_t buflen)
+{
+	return (ZSTD_compressBound(buflen) - buflen);
+}
+
+void
+zstd_props(algo_props_t *data, int level, uint64_t chunksize) {
+	data->compress_mt_capable = 0;
+	data->decompress_mt_capable = 0;
+	data->buf_extra = zstd_buf_extra(chunksize);
+	data->delta2_span = 100;
+	data->deltac_min_distance = FOURM;
+}
+
+static int
+zstd_load_dict(const char *path)
+{
+	struct stat sbuf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_msg(LOG_ERR, 1, "ZSTD: Cannot open dictionary %s: ", path);
+		return (-1);
+	}
+	if (fstat(fd, &sbuf) == -1 || sbuf.st_size == 0) {
+		log_msg(LOG_ERR, 0, "ZSTD: Invalid dictionary %s\n", path);
+		close(fd);
+		return (-1);
+	}
+	zstd_dict = (uchar_t *)malloc(sbuf.st_size);
+	if (zstd_dict == NULL) {
+		log_msg(LOG_ERR, 0, "ZSTD: Out of memory.\n");
+		close(fd);
+		return (-1);
+	}
+	if (Read(fd, zstd_dict, sbuf.st_size) < sbuf.st_size) {
+		log_msg(LOG_ERR, 1, "ZSTD: Reading dictionary %s: ", path);
+		free(zstd_dict);
+		zstd_dict = NULL;
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	zstd_dict_sz = sbuf.st_size;
+	return (0);
+}
+
+/*
+ * Train a dictionary from the sample pool and write it out.
+ */
+static void
+zstd_train(const char *path)
+{
+	uchar_t *dict;
+	size_t dsz;
+	int fd;
+
+	dict = (uchar_t *)malloc(ZSTD_DICT_SZ);
+	if (dict == NULL)
+		return;
+	dsz = ZDICT_trainFromBuffer(dict, ZSTD_DICT_SZ, sample_pool, sample_sizes, nsamples);
+	if (ZDICT_isError(dsz)) {
+		log_msg(LOG_WARN, 0, "ZSTD: Dictionary training failed: %s\n",
+		    ZDICT_getErrorName(dsz));
+		free(dict);
+		return;
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1) {
+		log_msg(LOG_ERR, 1, "ZSTD: Cannot create dictionary %s: ", path);
+		free(dict);
+		return;
+	}
+	if (Write(fd, dict, dsz) < dsz)
+		log_msg(LOG_ERR, 1, "ZSTD: Writing dictionary %s: ", path);
+	else
+		log_msg(LOG_INFO, 0, "ZSTD: Wrote %" PRIu64 " byte dictionary from %u samples to %s\n",
+		    (uint64_t)dsz, nsamples, path);
+	close(fd);
+	free(dict);
+}
+
+/*
+ * Copy a few evenly spaced pieces of a chunk to the sample pool.
+ */
+static void
+zstd_sample(uchar_t *src, uint64_t srclen)
+{
+	uint64_t step, off;
+	size_t len;
+	int i;
+
+	pthread_mutex_lock(&zstd_lock);
+	if (sample_pool == NULL) {
+		sample_pool = (uchar_t *)malloc(ZSTD_SAMPLE_POOL);
+		sample_sizes = (size_t *)malloc(ZSTD_SAMPLE_POOL / ZSTD_SAMPLE_SZ *
+		    sizeof (size_t));
+		if (sample_pool == NULL || sample_sizes == NULL) {
+			free(sample_pool);
+			free(sample_sizes);
+			sample_pool = NULL;
+			sample_sizes = NULL;
+			pthread_mutex_unlock(&zstd_lock);
+			return;
+		}
+	}
+	step = srclen / ZSTD_SAMPLES_PER_CHUNK;
+	if (step < ZSTD_SAMPLE_SZ)
+		step = ZSTD_SAMPLE_SZ;
+	for (off = 0, i = 0; off < srclen && i < ZSTD_SAMPLES_PER_CHUNK; off += step, i++) {
+		len = srclen - off;
+		if (len > ZSTD_SAMPLE_SZ)
+			len = ZSTD_SAMPLE_SZ;
+		if (sample_len + len > ZSTD_SAMPLE_POOL)
+			break;
+		memcpy(sample_pool + sample_len, src + off, len);
+		sample_sizes[nsamples++] = len;
+		sample_len += len;
+	}
+	pthread_mutex_unlock(&zstd_lock);
+}
+
+static void
+zstd_tdict_free(void)
+{
+	int i;
+
+	for (i = 0; i < ntdicts; i++) {
+		free(tdicts[i].pool);
+		free(tdicts[i].sizes);
+		free(tdicts[i].dict);
+		if (tdicts[i].cd)
+			ZSTD_freeCDict(tdicts[i].cd);
+		if (tdicts[i].dd)
+			ZSTD_freeDDict(tdicts[i].dd);
+	}
+	memset(tdicts, 0, sizeof (tdicts));
+	ntdicts = 0;
+	tdicts_ready = 0;
+}
+
+static struct zstd_tdict *
+zstd_tdict_find(int btype)
+{
+	int i;
+
+	for (i = 0; i < ntdicts; i++) {
+		if (tdicts[i].btype == btype)
+			return (&tdicts[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Whether more samples of the given data type are taken, of any type if
+ * btype is -1.
+ */
+int
+zstd_tdict_want(int btype)
+{
+	struct zstd_tdict *td;
+	int i, want;
+
+	pthread_mutex_lock(&zstd_lock);
+	if (btype == -1) {
+		want = (ntdicts < ZSTD_TDICT_MAX);
+		for (i = 0; i < ntdicts && !want; i++)
+			want = (tdicts[i].len < ZSTD_TDICT_POOL);
+	} else {
+		td = zstd_tdict_find(btype);
+		want = (td != NULL ? td->len < ZSTD_TDICT_POOL : ntdicts < ZSTD_TDICT_MAX);
+	}
+	pthread_mutex_unlock(&zstd_lock);
+	return (want);
+}
+
+/*
+ * Add a small member of the given data type to the training samples.
+ */
+void
+zstd_tdict_sample(int btype, uchar_t *buf, uint64_t len)
+{
+	struct zstd_tdict *td;
+
+	pthread_mutex_lock(&zstd_lock);
+	td = zstd_tdict_find(btype);
+	if (td == NULL && ntdicts < ZSTD_TDICT_MAX) {
+		td = &tdicts[ntdicts];
+		td->pool = (uchar_t *)malloc(ZSTD_TDICT_POOL);
+		td->sizes = (size_t *)malloc(ZSTD_TDICT_POOL / 8 * sizeof (size_t));
+		if (td->pool == NULL || td->sizes == NULL) {
+			free(td->pool);
+			free(td->sizes);
+			memset(td, 0, sizeof (*td));
+			td = NULL;
+		} else {
+			td->btype = btype;
+			ntdicts++;
+		}
+	}
+	if (td != NULL && len >= 8 && td->len + len <= ZSTD_TDICT_POOL) {
+		memcpy(td->pool + td->len, buf, len);
+		td->sizes[td->n++] = len;
+		td->len += len;
+	}
+	pthread_mutex_unlock(&zstd_lock);
+}
+
+/*
+ * Train the dictionaries from the samples, dropping the types with too few
+ * samples or with a dictionary ID that is already taken. Returns the number
+ * of dictionaries.
+ */
+int
+zstd_tdict_train(void)
+{
+	struct zstd_tdict *td;
+	size_t cap, dsz;
+	int i, j, n;
+
+	pthread_mutex_lock(&zstd_lock);
+	n = 0;
+	for (i = 0; i < ntdicts; i++) {
+		td = &tdicts[i];
+		if (td->n >= ZSTD_TDICT_MIN_SAMPLES) {
+			cap = td->len / 8;
+			if (cap > ZSTD_TDICT_SZ)
+				cap = ZSTD_TDICT_SZ;
+			td->dict = (uchar_t *)malloc(cap);
+			if (td->dict != NULL) {
+				dsz = ZDICT_trainFromBuffer(td->dict, cap, td->pool,
+				    td->sizes, td->n);
+				if (!ZDICT_isError(dsz)) {
+					td->dict_sz = dsz;
+					td->id = ZDICT_getDictID(td->dict, dsz);
+				}
+			}
+		}
+		for (j = 0; j < n && td->id != 0; j++) {
+			if (tdicts[j].id == td->id)
+				td->id = 0;
+		}
+		free(td->pool);
+		free(td->sizes);
+		td->pool = NULL;
+		td->sizes = NULL;
+		if (td->id == 0) {
+			free(td->dict);
+			td->dict = NULL;
+			continue;
+		}
+		if (n != i) {
+			tdicts[n] = *td;
+			memset(td, 0, sizeof (*td));
+		}
+		log_msg(LOG_VERBOSE, 0, "ZSTD: %" PRIu64 " byte dictionary for type %d "
+		    "from %u members", (uint64_t)tdicts[n].dict_sz, tdicts[n].btype,
+		    tdicts[n].n);
+		n++;
+	}
+	ntdicts = n;
+	tdicts_ready = (n > 0);
+	pthread_mutex_unlock(&zstd_lock);
+	return (n);
+}
+
+/*
+ * Serialize the trained dictionaries: the count, then per dictionary its data
+ * type, length and data. 32-bit values are big-endian.
+ */
+int64_t
+zstd_tdict_encode(uchar_t **buf)
+{
+	uchar_t *pos;
+	uint64_t len;
+	int i;
+
+	len = 4;
+	for (i = 0; i < ntdicts; i++)
+		len += 8 + tdicts[i].dict_sz;
+	if ((*buf = (uchar_t *)malloc(len)) == NULL)
+		return (-1);
+	pos = *buf;
+	U32_P(pos) = htonl(ntdicts);
+	pos += 4;
+	for (i = 0; i < ntdicts; i++) {
+		U32_P(pos) = htonl(tdicts[i].btype);
+		U32_P(pos + 4) = htonl(tdicts[i].dict_sz);
+		memcpy(pos + 8, tdicts[i].dict, tdicts[i].dict_sz);
+		pos += 8 + tdicts[i].dict_sz;
+	}
+	return (len);
+}
+
+/*
+ * Load the dictionaries stored by zstd_tdict_encode().
+ */
+int
+zstd_tdict_decode(uchar_t *buf, uint64_t len)
+{
+	struct zstd_tdict *td;
+	uint64_t dsz;
+	uint32_t n, i;
+
+	pthread_mutex_lock(&zstd_lock);
+	zstd_tdict_free();
+	if (len < 4 || (n = ntohl(U32_P(buf))) > ZSTD_TDICT_MAX)
+		goto bad;
+	buf += 4;
+	len -= 4;
+	for (i = 0; i < n; i++) {
+		if (len < 8)
+			goto bad;
+		td = &tdicts[ntdicts];
+		td->btype = ntohl(U32_P(buf));
+		dsz = ntohl(U32_P(buf + 4));
+		if (dsz == 0 || dsz > ZSTD_TDICT_SZ || dsz > len - 8)
+			goto bad;
+		if ((td->dict = (uchar_t *)malloc(dsz)) == NULL)
+			goto bad;
+		ntdicts++;
+		memcpy(td->dict, buf + 8, dsz);
+		td->dict_sz = dsz;
+		td->id = ZDICT_getDictID(td->dict, dsz);
+		buf += 8 + dsz;
+		len -= 8 + dsz;
+	}
+	if (len != 0)
+		goto bad;
+	tdicts_ready = (ntdicts > 0);
+	pthread_mutex_unlock(&zstd_lock);
+	return (0);
+bad:
+	zstd_tdict_free();
+	pthread_mutex_unlock(&zstd_lock);
+	log_msg(LOG_ERR, 0, "ZSTD: Invalid type dictionaries in header.\n");
+	return (-1);
+}
+
+int
+zstd_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	  int file_version, compress_op_t op)
+{
+	struct zstd_params *zp;
+	int lev, wlog, i;
+	char *dpath;
+	size_t rv;
+
+	if (*level > 14) *level = 14;
+	if (*level < 0) *level = 0;
+	lev = zstd_levels[*level];
+
+	zp = (struct zstd_params *)slab_calloc(NULL, 1, sizeof (struct zstd_params));
+	if (zp == NULL) {
+		log_msg(LOG_ERR, 0, "ZSTD: Out of memory.\n");
+		return (1);
+	}
+
+	pthread_mutex_lock(&zstd_lock);
+	dpath = getenv("PCOMPRESS_ZSTD_DICT");
+	if (dpath != NULL && zstd_dict == NULL && zstd_load_dict(dpath) != 0) {
+		pthread_mutex_unlock(&zstd_lock);
+		slab_free(NULL, zp);
+		return (1);
+	}
+	zstd_users++;
+
+	/*
+	 * The digested dictionaries are shared by all threads.
+	 */
+	for (i = 0; i < ntdicts && tdicts_ready; i++) {
+		if (op == COMPRESS && tdicts[i].cd == NULL)
+			tdicts[i].cd = ZSTD_createCDict(tdicts[i].dict, tdicts[i].dict_sz, lev);
+		else if (op != COMPRESS && tdicts[i].dd == NULL)
+			tdicts[i].dd = ZSTD_createDDict(tdicts[i].dict, tdicts[i].dict_sz);
+		if (tdicts[i].cd == NULL && tdicts[i].dd == NULL) {
+			pthread_mutex_unlock(&zstd_lock);
+			log_msg(LOG_ERR, 0, "ZSTD: Out of memory.\n");
+			*data = zp;
+			goto err;
+		}
+	}
+	pthread_mutex_unlock(&zstd_lock);
+	*data = zp;
+
+	if (op == COMPRESS) {
+		zp->cctx = ZSTD_createCCtx();
+		if (zp->cctx == NULL)
+			goto err;
+		ZSTD_CCtx_setParameter(zp->cctx, ZSTD_c_compressionLevel, lev);
+		ZSTD_CCtx_setParameter(zp->cctx, ZSTD_c_checksumFlag, 0);
+		if (*level >= ZSTD_LDM_LEVEL) {
+			wlog = 10;
+			while (wlog < ZSTD_MAX_WLOG && (1ULL << wlog) < chunksize)
+				wlog++;
+			if (wlog > ZSTD_LDM_MIN_WLOG) {
+				ZSTD_CCtx_setParameter(zp->cctx,
+				    ZSTD_c_enableLongDistanceMatching, 1);
+				ZSTD_CCtx_setParameter(zp->cctx, ZSTD_c_windowLog, wlog);
+				zp->wlog = wlog;
+			}
+		}
+		if (zstd_dict != NULL) {
+			rv = ZSTD_CCtx_loadDictionary(zp->cctx, zstd_dict, zstd_dict_sz);
+			if (ZSTD_isError(rv)) {
+				log_msg(LOG_ERR, 0, "ZSTD: Bad dictionary: %s\n",
+				    ZSTD_getErrorName(rv));
+				goto err;
+			}
+		}
+		zp->train = (getenv("PCOMPRESS_ZSTD_TRAIN") != NULL);
+	} else {
+		zp->dctx = ZSTD_createDCtx();
+		if (zp->dctx == NULL)
+			goto err;
+		ZSTD_DCtx_setParameter(zp->dctx, ZSTD_d_windowLogMax, ZSTD_MAX_WLOG);
+		if (zstd_dict != NULL) {
+			rv = ZSTD_DCtx_loadDictionary(zp->dctx, zstd_dict, zstd_dict_sz);
+			if (ZSTD_isError(rv)) {
+				log_msg(LOG_ERR, 0, "ZSTD: Bad dictionary: %s\n",
+				    ZSTD_getErrorName(rv));
+				goto err;
+			}
+		}
+	}
+	return (0);
+err:
+	zstd_deinit(data);
+	return (1);
+}
+
+int
+zstd_deinit(void **data)
+{
+	struct zstd_params *zp = (struct zstd_params *)(*data);
+	char *tpath;
+
+	if (zp == NULL)
+		return (0);
+	if (zp->cctx)
+		ZSTD_freeCCtx(zp->cctx);
+	if (zp->dctx)
+		ZSTD_freeDCtx(zp->dctx);
+	slab_free(NULL, zp);
+	*data = NULL;
+
+	/*
+	 * The last thread to finish trains the dictionary from the samples.
+	 */
+	pthread_mutex_lock(&zstd_lock);
+	if (--zstd_users == 0) {
+		if (nsamples > 0 && (tpath = getenv("PCOMPRESS_ZSTD_TRAIN")) != NULL)
+			zstd_train(tpath);
+		free(sample_pool);
+		free(sample_sizes);
+		free(zstd_dict);
+		sample_pool = NULL;
+		sample_sizes = NULL;
+		zstd_dict = NULL;
+		sample_len = 0;
+		nsamples = 0;
+		zstd_tdict_free();
+	}
+	pthread_mutex_unlock(&zstd_lock);
+	return (0);
+}
+
+/*
+ * Set the data that precedes the next chunks with linked chunks (-o). It is
+ * referenced as a zstd prefix so matches can reach back into it, the window
+ * is grown to cover it. A loaded dictionary takes precedence.
+ */
+void
+zstd_set_prefix(void *data, uchar_t *prefix, uint64_t len)
+{
+	struct zstd_params *zp = (struct zstd_params *)data;
+
+	zp->prefix = prefix;
+	zp->prefix_len = (zstd_dict == NULL ? len : 0);
+}
+
+int
+zstd_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+	      int level, uchar_t chdr, int btype, void *data)
+{
+	struct zstd_params *zp = (struct zstd_params *)data;
+	struct zstd_tdict *td;
+	int wlog;
+	size_t rv;
+
+	if (zp->train && sample_len < ZSTD_SAMPLE_POOL)
+		zstd_sample((uchar_t *)src, srclen);
+	if (tdicts_ready && zstd_dict == NULL && zp->prefix_len == 0) {
+		td = zstd_tdict_find(btype);
+		ZSTD_CCtx_refCDict(zp->cctx, td != NULL ? td->cd : NULL);
+	}
+	if (zp->prefix_len > 0) {
+		wlog = 10;
+		while (wlog < ZSTD_MAX_WLOG && (1ULL << wlog) < zp->prefix_len + srclen)
+			wlog++;
+		if (zp->wlog < wlog) {
+			ZSTD_CCtx_setParameter(zp->cctx, ZSTD_c_windowLog, wlog);
+			zp->wlog = wlog;
+		}
+		ZSTD_CCtx_refPrefix(zp->cctx, zp->prefix, zp->prefix_len);
+	}
+	rv = ZSTD_compress2(zp->cctx, dst, *dstlen, src, srclen);
+	if (ZSTD_isError(rv))
+		return (-1);
+	*dstlen = rv;
+	return (0);
+}
+
+int
+zstd_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+		int level, uchar_t chdr, int btype, void *data)
+{
+	struct zstd_params *zp = (struct zstd_params *)data;
+	unsigned int dict_id;
+	ZSTD_DDict *dd;
+	size_t rv;
+	int i;
+
+	dd = NULL;
+	dict_id = ZSTD_getDictID_fromFrame(src, srclen);
+	for (i = 0; i < ntdicts && tdicts_ready && dict_id != 0; i++) {
+		if (tdicts[i].id == dict_id)
+			dd = tdicts[i].dd;
+	}
+	if (zp->prefix_len > 0)
+		ZSTD_DCtx_refPrefix(zp->dctx, zp->prefix, zp->prefix_len);
+	if (dd != NULL)
+		rv = ZSTD_decompress_usingDDict(zp->dctx, dst, *dstlen, src, srclen, dd);
+	else
+		rv = ZSTD_decompressDCtx(zp->dctx, dst, *dstlen, src, srclen);
+	if (ZSTD_isError(rv)) {
+		if (dict_id != 0 && dd == NULL && zstd_dict == NULL)
+			log_msg(LOG_ERR, 0, "ZSTD: Data needs dictionary %u, set "
+			    "PCOMPRESS_ZSTD_DICT.\n", dict_id);
+		else
+			log_msg(LOG_ERR, 0, "ZSTD: %s\n", ZSTD_getErrorName(rv));
+		return (-1);
+	}
+	if (rv != *dstlen)
+		return (-1);
+	return (0);
+}